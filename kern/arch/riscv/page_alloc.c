@@ -48,6 +48,13 @@ void page_alloc_init(struct multiboot_info *mbi)
 		                     pg_link);
 	}
 	nr_free_pages = first_invalid_page - first_free_page;
+	nr_free_pages_node[0] = nr_free_pages;
 
 	colored_page_free_list = lists;
 }
+
+/* No NUMA on riscv yet */
+int arch_mem_node_init(void)
+{
+	return 1;
+}
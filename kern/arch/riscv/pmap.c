@@ -127,6 +127,27 @@ void arch_pgdir_clear(pgdir_t *pd)
 	*pd = 0;
 }
 
+/* No ASIDs yet, so this flushes the TLB */
+void arch_pgdir_load(struct proc *p)
+{
+	lcr3(p ? p->env_cr3 : boot_cr3);
+}
+
+/* No batching yet, just one walk per call */
+size_t
+pgdir_walk_range(pgdir_t *pgdir, const void *va, size_t nr, pte_t **ptes)
+{
+	ptes[0] = pgdir_walk(pgdir, va, 1);
+	return ptes[0] ? 1 : 0;
+}
+
+/* No user jumbos on riscv yet */
+pte_t*
+pgdir_walk_jumbo(pgdir_t *pgdir, const void *va, int create)
+{
+	return 0;
+}
+
 /* Returns the page shift of the largest jumbo supported */
 int arch_max_jumbo_page_shift(void)
 {
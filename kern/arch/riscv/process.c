@@ -61,7 +61,7 @@ void proc_secure_ctx(struct user_context *ctx)
 void __abandon_core(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	lcr3(boot_cr3);
+	proc_load_pgdir(0);
 	proc_decref(pcpui->cur_proc);
 	pcpui->cur_proc = 0;
 }
@@ -38,6 +38,7 @@
 /* All arches must define this, which is the lower limit of their static
  * mappings, and where the dynamic mappings will start. */
 #define KERN_DYN_TOP    KERNBASE
+#define KERN_DYN_BOT    ULIM
 
 /* **************************************** */
 /* Page table constants, macros, etc */
@@ -98,6 +99,7 @@
 #define PTE_SR   0x200 // Supervisor Write permission
 #define PTE_PERM (PTE_SR | PTE_SW | PTE_SX | PTE_UR | PTE_UW | PTE_UX)
 #define PTE_PPN_SHIFT 13
+#define PTE_COW  0x400 // Copy-on-write (software bit below the PPN)
 #warning "Review RISCV PTE_modes, like NOCACHE/WRITECOMB"
 #define PTE_NOCACHE	0 // PTE bits to turn off caching, if possible
 #define PTE_WRITECOMB	0 // PTE bits to turn on write-combining, if possible
@@ -1,4 +1,5 @@
 #include <arch/time.h>
+#include <time.h>
 #include <ros/common.h>
 #include <trap.h>
 #include <arch/arch.h>
@@ -39,6 +40,16 @@ set_core_timer(uint32_t usec, bool periodic)
 	}
 }
 
+void
+set_core_timer_deadline(uint64_t deadline)
+{
+	uint64_t now = read_tsc();
+	uint64_t rel_usec;
+
+	rel_usec = deadline <= now ? 1 : MAX(tsc2usec(deadline - now), 1);
+	set_core_timer(MIN(rel_usec, UINT32_MAX), FALSE);
+}
+
 void
 udelay(uint64_t usec)
 {
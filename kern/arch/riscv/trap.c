@@ -375,6 +375,29 @@ int route_irqs(int cpu_vec, int coreid)
 	return -1;
 }
 
+int route_irqs_spread(int cpu_vec, int idx)
+{
+	return route_irqs(cpu_vec, irq_spread_core(idx));
+}
+
+int irq_spread_core(int idx)
+{
+	return 0;
+}
+
+void irq_rebalance(void)
+{
+}
+
+void irq_core_allocated(uint32_t coreid)
+{
+}
+
+int get_irq_vector(isr_t handler, void *irq_arg)
+{
+	return -1;
+}
+
 void __arch_reflect_trap_hwtf(struct hw_trapframe *hw_tf, unsigned int trap_nr,
                               unsigned int err, unsigned long aux)
 {
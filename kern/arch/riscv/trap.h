@@ -51,4 +51,19 @@ static inline void arch_finalize_ctx(struct user_context *ctx)
 {
 }
 
+/* We don't track whether the FPU is in use, so we always save and restore. */
+static inline bool fp_state_is_init(void)
+{
+	return FALSE;
+}
+
+static inline void save_fp_state_init(ancillary_state_t *silly)
+{
+}
+
+static inline bool fp_state_saved_is_init(ancillary_state_t *silly)
+{
+	return FALSE;
+}
+
 #endif
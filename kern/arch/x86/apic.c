@@ -13,6 +13,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <bitmask.h>
+#include <smp.h>
 #include <arch/topology.h>
 #include <ros/procinfo.h>
 
@@ -120,6 +121,7 @@ void __lapic_set_timer(uint32_t ticks, uint8_t vec, bool periodic, uint8_t div)
 	 * IRQs from any source to get them delivered.  periodic does the trick. */
 	periodic = TRUE;
 #endif
+	per_cpu_info[core_id()].lapic_tsc_deadline = FALSE;
 	// clears bottom bit and then set divider
 	apicrput(MSR_LAPIC_DIVIDE_CONFIG_REG,
 	         (apicrget(MSR_LAPIC_DIVIDE_CONFIG_REG) & ~0xf) | (div & 0xf));
@@ -148,6 +150,38 @@ void lapic_set_timer(uint32_t usec, bool periodic)
 	                  LAPIC_TIMER_DIVISOR_BITS);
 }
 
+/* Sets the LAPIC timer to go off when the TSC hits deadline, in TSC-deadline
+ * mode.  Deadlines in the past go off right away.  Only call this if the core
+ * has CPU_FEAT_X86_TSC_DEADLINE.  Ref SDM, 3A, 10.5.4.1.
+ *
+ * Unlike the countdown, there's nothing to convert, and once we're in
+ * TSC-deadline mode, each rearm is a single MSR write. */
+void lapic_set_tsc_deadline(uint64_t deadline)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+
+	if (!pcpui->lapic_tsc_deadline) {
+		apicrput(MSR_LAPIC_LVT_TIMER, IdtLAPIC_TIMER | LAPIC_LVT_TSC_DEADLINE);
+		/* The LVT write must land before the deadline write, or the deadline
+		 * could be dropped. */
+		mb();
+		pcpui->lapic_tsc_deadline = TRUE;
+	}
+	/* 0 would disarm it */
+	write_msr(MSR_IA32_TSC_DEADLINE, MAX(deadline, 1));
+}
+
+/* Turns off the LAPIC timer, whichever mode it is in. */
+void lapic_disarm_timer(void)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+
+	if (pcpui->lapic_tsc_deadline)
+		write_msr(MSR_IA32_TSC_DEADLINE, 0);
+	else
+		lapic_disable_timer();
+}
+
 uint32_t lapic_get_default_id(void)
 {
 	uint32_t ebx;
@@ -25,6 +25,7 @@
  * addresses. */
 #define LAPIC_PBASE					0xfee00000	/* default *physical* address */
 #define LAPIC_LVT_MASK					0x00010000
+#define LAPIC_LVT_TSC_DEADLINE			(2 << 17)	/* timer mode */
 
 /* Quick note on the divisor.  The LAPIC timer ticks once per divisor-bus ticks
  * (system bus or APIC bus, depending on the model).  Ex: A divisor of 128 means
@@ -60,6 +61,8 @@ void lapic_unmask_irq(struct irq_handler *unused, int apic_vector);
 bool ipi_is_pending(uint8_t vector);
 void __lapic_set_timer(uint32_t ticks, uint8_t vec, bool periodic, uint8_t div);
 void lapic_set_timer(uint32_t usec, bool periodic);
+void lapic_set_tsc_deadline(uint64_t deadline);
+void lapic_disarm_timer(void);
 uint32_t lapic_get_default_id(void);
 int apiconline(void);
 void handle_lapic_error(struct hw_trapframe *hw_tf, void *data);
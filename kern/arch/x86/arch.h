@@ -43,6 +43,7 @@ int vendor_id(char *);
 void invlpg(void *addr);
 void tlbflush(void);
 void tlb_flush_global(void);
+void x86_pcid_init(void);
 /* idle.c */
 void cpu_halt(void);
 
@@ -378,6 +378,20 @@ static inline unsigned long __fls(unsigned long word)
 	return word;
 }
 
+/*
+ * __arch_popcnt: count the set bits in word
+ * @word: The word to count
+ *
+ * Only use this if we have CPU_FEAT_X86_POPCNT.
+ */
+static inline unsigned long __arch_popcnt(unsigned long word)
+{
+	asm("popcnt %1,%0"
+	    : "=r" (word)
+	    : "rm" (word));
+	return word;
+}
+
 #undef ADDR
 
 /**
@@ -148,6 +148,17 @@ void print_cpuinfo(void)
 		panic("Can't write FS Base from userspace, and no FASTCALL support!");
 		#endif
 	}
+	/* Enhanced rep movsb/stosb, and fast short rep movsb */
+	if (ebx & (1 << 9))
+		cpu_set_feat(CPU_FEAT_X86_ERMS);
+	if (edx & (1 << 4))
+		cpu_set_feat(CPU_FEAT_X86_FSRM);
+	if (ebx & (1 << 29)) {
+		printk("SHA extensions supported\n");
+		cpu_set_feat(CPU_FEAT_X86_SHA);
+	}
+	if (ebx & (1 << 18))
+		cpu_set_feat(CPU_FEAT_X86_RDSEED);
 	cpuid(0x80000001, 0x0, &eax, &ebx, &ecx, &edx);
 	if (edx & (1 << 27)) {
 		printk("RDTSCP supported\n");
@@ -175,18 +186,37 @@ void print_cpuinfo(void)
 	#define CPUID_FXSR_SUPPORT          (1 << 24)
 	#define CPUID_XSAVE_SUPPORT         (1 << 26)
 	#define CPUID_XSAVEOPT_SUPPORT      (1 << 0)
+	#define CPUID_XGETBV_XINUSE         (1 << 2)
 	#define CPUID_MONITOR_MWAIT         (1 << 3)
 	#define CPUID_MWAIT_PWR_MGMT        (1 << 0)
+	#define CPUID_TSC_DEADLINE          (1 << 24)
+	#define CPUID_PCID                  (1 << 17)
+	#define CPUID_POPCNT                (1 << 23)
+	#define CPUID_RDRAND                (1 << 30)
 
 	cpuid(0x01, 0x00, 0, 0, &ecx, &edx);
 	if (CPUID_FXSR_SUPPORT & edx)
 		cpu_set_feat(CPU_FEAT_X86_FXSR);
 	if (CPUID_XSAVE_SUPPORT & ecx)
 		cpu_set_feat(CPU_FEAT_X86_XSAVE);
+	if (CPUID_TSC_DEADLINE & ecx) {
+		printk("LAPIC TSC-deadline timer supported\n");
+		cpu_set_feat(CPU_FEAT_X86_TSC_DEADLINE);
+	}
+	if (CPUID_PCID & ecx) {
+		printk("PCIDs supported\n");
+		cpu_set_feat(CPU_FEAT_X86_PCID);
+	}
+	if (CPUID_POPCNT & ecx)
+		cpu_set_feat(CPU_FEAT_X86_POPCNT);
+	if (CPUID_RDRAND & ecx)
+		cpu_set_feat(CPU_FEAT_X86_RDRAND);
 
 	cpuid(0x0d, 0x01, &eax, 0, 0, 0);
 	if (CPUID_XSAVEOPT_SUPPORT & eax)
 		cpu_set_feat(CPU_FEAT_X86_XSAVEOPT);
+	if ((CPUID_XGETBV_XINUSE & eax) && cpu_has_feat(CPU_FEAT_X86_XSAVE))
+		cpu_set_feat(CPU_FEAT_X86_XINUSE);
 
 	cpuid(0x01, 0x00, 0, 0, &ecx, 0);
 	if (CPUID_MONITOR_MWAIT & ecx) {
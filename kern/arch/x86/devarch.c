@@ -68,6 +68,7 @@ enum {
 	Qperf,
 	Qcstate,
 	Qpstate,
+	Qirq,
 
 	Qmax,
 };
@@ -89,6 +90,19 @@ static struct dirtab archdir[Qmax] = {
 	{"perf", {Qperf, 0}, 0, 0666},
 	{"c-state", {Qcstate, 0}, 0, 0666},
 	{"p-state", {Qpstate, 0}, 0, 0666},
+	{"irq", {Qirq, 0}, 0, 0666},
+};
+
+enum {
+	CMirq_route,
+	CMirq_unpin,
+	CMirq_rebalance,
+};
+
+static struct cmdtab irq_cmds[] = {
+	{CMirq_route, "route", 3},
+	{CMirq_unpin, "unpin", 2},
+	{CMirq_rebalance, "rebalance", 1},
 };
 /* White list entries needs to be ordered by start address, and never overlap.
  */
@@ -423,11 +437,15 @@ static long arch_perf_write(struct perf_context *pc, const void *udata,
 
 			pef = perfmon_get_event_status(pc->ps, (int) ped);
 
-			pc->resp_size = sizeof(uint32_t) + num_cores * sizeof(uint64_t);
+			pc->resp_size = sizeof(uint32_t) + 3 * num_cores * sizeof(uint64_t);
 			pc->resp = kmalloc(pc->resp_size, MEM_WAIT);
 			rptr = put_le_u32(pc->resp, num_cores);
 			for (int i = 0; i < num_cores; i++)
 				rptr = put_le_u64(rptr, pef->cores_values[i]);
+			for (int i = 0; i < num_cores; i++)
+				rptr = put_le_u64(rptr, pef->cores_time_enabled[i]);
+			for (int i = 0; i < num_cores; i++)
+				rptr = put_le_u64(rptr, pef->cores_time_running[i]);
 
 			perfmon_free_event_status(pef);
 			break;
@@ -496,6 +514,57 @@ static void archclose(struct chan *c)
 	}
 }
 
+/* One line per routable vector: the vector, its core, its type, its tbdf, and
+ * whether it's pinned there or spread over the cores. */
+static long irq_read(void *ubuf, long n, int64_t offset)
+{
+	size_t len = NUM_IRQS * 40;
+	char *buf = kmalloc(len, MEM_WAIT);
+
+	len = irq_affinity_print(buf, len);
+	n = readmem(offset, ubuf, n, buf, len);
+	kfree(buf);
+	return n;
+}
+
+/* route VEC CORE pins VEC to CORE.  unpin VEC spreads it again, and rebalance
+ * moves the spread vectors off of any cores MCPs got. */
+static long irq_write(void *ubuf, long n)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb;
+	struct cmdtab *ct;
+	long vec, coreid;
+
+	cb = parsecmd(ubuf, n);
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	ct = lookupcmd(cb, irq_cmds, ARRAY_SIZE(irq_cmds));
+	switch (ct->index) {
+	case CMirq_route:
+		vec = strtol(cb->f[1], 0, 0);
+		coreid = strtol(cb->f[2], 0, 0);
+		if ((coreid < 0) || (coreid >= num_cores))
+			error(EINVAL, "No core %d", coreid);
+		if (route_irqs(vec, coreid))
+			error(EINVAL, "Can't route vector %d", vec);
+		break;
+	case CMirq_unpin:
+		vec = strtol(cb->f[1], 0, 0);
+		if (unpin_irqs(vec))
+			error(EINVAL, "Can't route vector %d", vec);
+		break;
+	case CMirq_rebalance:
+		irq_rebalance();
+		break;
+	}
+	poperror();
+	kfree(cb);
+	return n;
+}
+
 static long archread(struct chan *c, void *a, long n, int64_t offset)
 {
 	char *buf, *p;
@@ -597,6 +666,8 @@ static long archread(struct chan *c, void *a, long n, int64_t offset)
 		case Qpstate:
 			return readnum_hex(offset, a, n, get_pstate(), NUMSIZE32);
 		}
+		case Qirq:
+			return irq_read(a, n, offset);
 		default:
 			error(EINVAL, ERROR_FIXME);
 	}
@@ -736,6 +807,8 @@ static long archwrite(struct chan *c, void *a, long n, int64_t offset)
 			return cstate_write(a, n, 0);
 		case Qpstate:
 			return pstate_write(a, n, 0);
+		case Qirq:
+			return irq_write(a, n);
 		default:
 			error(EINVAL, ERROR_FIXME);
 	}
@@ -3,19 +3,52 @@
 #include <arch/mmu.h>
 #include <cpu_feat.h>
 #include <arch/uaccess.h>
+#include <smp.h>
+#include <alarm.h>
+#include <time.h>
+
+/* Deep C-states take a while to get out of, so we only use them if we don't
+ * have an alarm coming up sooner than this. */
+#define X86_DEEP_IDLE_MIN_USEC	200
 
 static unsigned int x86_cstate;
 
+/* Picks between C1 and the deepest C-state we're allowed, based on when the
+ * next alarm is due.  The tchain could change under us; it's just a guess. */
+static unsigned int idle_cstate(struct per_cpu_info *pcpui)
+{
+	unsigned int cstate = ACCESS_ONCE(x86_cstate);
+	uint64_t next = ACCESS_ONCE(pcpui->tchain.earliest_time);
+
+	if (cstate == X86_MWAIT_C1 || next == ALARM_POISON_TIME)
+		return cstate;
+	if (next < read_tsc() + usec2tsc(X86_DEEP_IDLE_MIN_USEC))
+		return X86_MWAIT_C1;
+	return cstate;
+}
+
 /* This atomically enables interrupts and halts.
  *
- * Note that sti does not take effect until after the *next* instruction */
+ * Note that sti does not take effect until after the *next* instruction
+ *
+ * With mwait, we watch our routine KMSG stack, so senders don't need to IPI us
+ * for routine messages; see trap.c.  We might return without halting, if a
+ * message came in before the monitor was armed. */
 void cpu_halt(void)
 {
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+
 	if (cpu_has_feat(CPU_FEAT_X86_MWAIT)) {
-		/* TODO: since we're monitoring anyway, x86 could use monitor/mwait for
-		 * KMSGs, instead of relying on IPIs.  (Maybe only for ROUTINE). */
-		asm volatile("monitor" : : "a"(KERNBASE), "c"(0), "d"(0));
-		asm volatile("sti; mwait" : : "c"(0x0), "a"(x86_cstate) : "memory");
+		pcpui->kmsg_mwait = TRUE;
+		mb();	/* flag write before the monitor and the check */
+		asm volatile("monitor" : : "a"(&pcpui->routine_amsgs_in), "c"(0),
+		             "d"(0));
+		if (!ACCESS_ONCE(pcpui->routine_amsgs_in))
+			asm volatile("sti; mwait" : : "c"(0x0), "a"(idle_cstate(pcpui))
+			             : "memory");
+		else
+			enable_irq();
+		pcpui->kmsg_mwait = FALSE;
 	} else {
 		asm volatile("sti; hlt" : : : "memory");
 	}
@@ -0,0 +1,69 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Kernel FPU sections.  The kernel is built without SSE, and we don't save the
+ * user's FP state when we enter the kernel, so whatever is in the FPU belongs
+ * to someone else: usually the vcore we're running on behalf of.  Code that
+ * wants the XMM registers (e.g. the SHA extensions) saves that state in its
+ * core's kfpu, and puts it back when it's done.  IRQs are off in between, so
+ * no one else on this core can start a section, and we can't block.
+ *
+ * If the FPU was in its initial configuration, we don't save it, and just
+ * reinitialize it at the end. */
+
+#include <arch/arch.h>
+#include <trap.h>
+#include <kmalloc.h>
+#include <smp.h>
+
+struct kfpu {
+	struct ancillary_state		anc;
+	bool						active;
+	bool						saved;
+	int8_t						irq_state;
+};
+
+static struct kfpu *kfpus[MAX_NUM_CORES];
+
+bool kfpu_begin(void)
+{
+	struct kfpu *kf;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	kf = kfpus[core_id()];
+	if (!kf) {
+		/* xsave wants 64 byte alignment */
+		kf = kmalloc_align(sizeof(struct kfpu), MEM_ATOMIC, 64);
+		if (!kf) {
+			enable_irqsave(&irq_state);
+			return FALSE;
+		}
+		kf->active = FALSE;
+		kfpus[core_id()] = kf;
+	}
+	if (kf->active) {
+		enable_irqsave(&irq_state);
+		return FALSE;
+	}
+	kf->active = TRUE;
+	kf->irq_state = irq_state;
+	kf->saved = !fp_state_is_init();
+	if (kf->saved)
+		save_fp_state(&kf->anc);
+	return TRUE;
+}
+
+void kfpu_end(void)
+{
+	struct kfpu *kf = kfpus[core_id()];
+	int8_t irq_state = kf->irq_state;
+
+	assert(kf->active);
+	if (kf->saved)
+		restore_fp_state(&kf->anc);
+	else
+		init_fp_state();
+	kf->active = FALSE;
+	enable_irqsave(&irq_state);
+}
@@ -301,7 +301,7 @@ static int __pci_msix_init(struct pci_device *p)
 	if (!p->msix_pba_vaddr) {
 		pcidev_write16(p, c + 2, f & ~Msixenable);
 		printk("MSI-X: unable to vmap the PBA!\n");
-		vunmap_vmem(p->msix_tbl_paddr,
+		vunmap_vmem(p->msix_tbl_vaddr,
 	                p->msix_nr_vec * sizeof(struct msix_entry));
 		return -1;
 	}
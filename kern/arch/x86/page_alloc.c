@@ -10,6 +10,8 @@
 #include <pmap.h>
 #include <kmalloc.h>
 #include <multiboot.h>
+#include <acpi.h>
+#include <arch/topology.h>
 
 spinlock_t colored_page_free_list_lock = SPINLOCK_INITIALIZER_IRQSAVE;
 
@@ -24,14 +26,15 @@ static void page_alloc_bootstrap() {
 		BSD_LIST_INIT(&colored_page_free_list[i]);
 }
 
-/* Can do whatever here.  For now, our page allocator just works with colors,
- * not NUMA zones or anything. */
+/* Can do whatever here.  At this point, we don't know about NUMA nodes yet, so
+ * everything goes on node 0's lists.  page_numa_init() sorts them out later. */
 static void track_free_page(struct page *page)
 {
 	BSD_LIST_INSERT_HEAD(&colored_page_free_list[get_page_color(page2ppn(page),
 	                                                            llc_cache)],
 	                 page, pg_link);
 	nr_free_pages++;
+	nr_free_pages_node[0]++;
 	/* Page was previous marked as busy, need to set it free explicitly */
 	page_setref(page, 0);
 }
@@ -242,3 +245,27 @@ void page_alloc_init(struct multiboot_info *mbi)
 	printk("Number of free pages: %lu\n", nr_free_pages);
 	printk("Page alloc init successful\n");
 }
+
+/* Tells the page allocator which node each core and each SRAT memory range is
+ * on.  Returns the number of nodes. */
+int arch_mem_node_init(void)
+{
+	struct Srat *st;
+	int node;
+
+	if (!srat || (cpu_topology_info.num_numa <= 1))
+		return 1;
+	for (int i = 0; i < num_cores; i++)
+		page_numa_set_core_node(i, cpu_topology_info.core_list[i].numa_id);
+	for (int i = 0; i < srat->nchildren; i++) {
+		st = srat->children[i]->tbl;
+		if (!st || (st->type != SRmem))
+			continue;
+		node = numa_domain_to_id(st->mem.dom);
+		/* Memory-only domains have no cores to be local to */
+		if (node < 0)
+			node = 0;
+		page_numa_add_range(st->mem.addr, st->mem.addr + st->mem.len, node);
+	}
+	return cpu_topology_info.num_numa;
+}
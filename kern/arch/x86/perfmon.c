@@ -28,7 +28,20 @@
  *
  * You can have multiple sessions, but if you try to install the same counter in
  * multiple, concurrent sessions, the hardware might complain (it definitely
- * will if it is a fixed event). */
+ * will if it is a fixed event).
+ *
+ * Unfixed events are multiplexed.  Each core has up to MAX_MUX_COUNTERS of them
+ * in vcounters[], and for unfixed events, the alloc's counters[] are indexes
+ * into that.  If a core has more than will fit on its hardware counters, a
+ * per-core alarm rotates them every PERFMON_MUX_USEC: everyone comes off the
+ * hardware, saving their raw counts, and the next batch goes on with their
+ * counts restored.  The status reports how long each event was open and how
+ * long it was actually counting, so the user can scale the counts, like Linux's
+ * time_enabled and time_running.  Fixed events have their own counters, and
+ * are always running.
+ *
+ * Uncore events (see uncore.c) only go to one core per socket, and for those,
+ * the alloc's counters[] are the counter within the uncore box. */
 
 #include <sys/types.h>
 #include <arch/ros/msr-index.h>
@@ -47,15 +60,37 @@
 #include <err.h>
 #include <string.h>
 #include <profiler.h>
+#include <alarm.h>
+#include <time.h>
 #include <arch/perfmon.h>
+#include <arch/uncore.h>
 
 #define FIXCNTR_NBITS 4
 #define FIXCNTR_MASK (((uint64_t) 1 << FIXCNTR_NBITS) - 1)
 
+#define PERFMON_MUX_USEC 4000
+
+/* An unfixed event on a core.  ev.event is 0 if the slot is free. */
+struct perfmon_vcounter {
+	struct perfmon_event ev;
+	int hw_idx;					/* -1 when off the hardware */
+	uint64_t value;				/* raw count, saved while off the hardware */
+	uint64_t enabled_ts;		/* nsec when opened */
+	uint64_t running;			/* nsec on the hardware, up to running_ts */
+	uint64_t running_ts;		/* nsec when it last went on the hardware */
+};
+
+/* counters[] mirrors what is on the hardware, for the interrupt handler. */
 struct perfmon_cpu_context {
 	spinlock_t lock;
 	struct perfmon_event counters[MAX_VAR_COUNTERS];
 	struct perfmon_event fixed_counters[MAX_FIX_COUNTERS];
+	uint64_t fixed_enabled_ts[MAX_FIX_COUNTERS];
+	struct perfmon_vcounter vcounters[MAX_MUX_COUNTERS];
+	unsigned int nr_vcounters;
+	unsigned int mux_next;		/* first vcounter to try at the next fill */
+	struct alarm_waiter mux_waiter;
+	bool mux_armed;
 };
 
 struct perfmon_status_env {
@@ -76,12 +111,16 @@ struct sample_snapshot {
 };
 static DEFINE_PERCPU(struct sample_snapshot, sample_snapshots);
 
+static void perfmon_mux_handler(struct alarm_waiter *waiter,
+                                struct hw_trapframe *hw_tf);
+
 static void perfmon_counters_env_init(void)
 {
 	for (int i = 0; i < num_cores; i++) {
 		struct perfmon_cpu_context *cctx = _PERCPU_VARPTR(counters_env, i);
 
 		spinlock_init_irqsave(&cctx->lock);
+		init_awaiter_irq(&cctx->mux_waiter, perfmon_mux_handler);
 	}
 }
 
@@ -223,19 +262,133 @@ static void perfmon_convert_error(int err_code, int core_id)
 	case ENOENT:
 		set_error(err_code, "Perf counter not set on core %d", core_id);
 		break;
+	case ENODEV:
+		set_error(err_code, "No such uncore box on core %d's socket",
+		          core_id);
+		break;
+	case EINVAL:
+		set_error(err_code, "Bad uncore event for its box on core %d",
+		          core_id);
+		break;
 	default:
 		set_error(err_code, "Unknown perf counter error on core %d", core_id);
 		break;
 	};
 }
 
+/* Helper: the raw counter value that has an unfixed event start counting from
+ * zero, or from -trigger_count if it interrupts. */
+static uint64_t perfmon_unfixed_initial_value(const struct perfmon_event *pev)
+{
+	if (!PMEV_GET_INTEN(pev->event))
+		return 0;
+	return -(int64_t)pev->trigger_count &
+	       ((1ULL << cpu_caps.bits_x_counter) - 1);
+}
+
+static uint64_t perfmon_read_unfixed_counter(int ccno);
+
+/* Puts vc on hardware counter idx, picking up where its count left off.  Hold
+ * the cctx lock. */
+static void __perfmon_vc_install(struct perfmon_cpu_context *cctx,
+                                 struct perfmon_vcounter *vc, int idx,
+                                 uint64_t now)
+{
+	/* kernel bug if the MSRs don't agree with our bookkeeping */
+	assert(perfmon_event_available(idx));
+	cctx->counters[idx] = vc->ev;
+	write_msr(MSR_IA32_PERFCTR0 + idx, vc->value);
+	write_msr(MSR_CORE_PERF_GLOBAL_OVF_CTRL, 1ULL << idx);
+	perfmon_enable_event(idx, vc->ev.event);
+	vc->hw_idx = idx;
+	vc->running_ts = now;
+}
+
+/* Takes vc off the hardware, saving its count.  Hold the cctx lock. */
+static void __perfmon_vc_remove(struct perfmon_cpu_context *cctx,
+                                struct perfmon_vcounter *vc, uint64_t now)
+{
+	int idx = vc->hw_idx;
+
+	vc->value = perfmon_read_unfixed_counter(idx);
+	perfmon_disable_event(idx);
+	write_msr(MSR_IA32_PERFCTR0 + idx, 0);
+	perfmon_init_event(&cctx->counters[idx]);
+	vc->running += now - vc->running_ts;
+	vc->hw_idx = -1;
+}
+
+/* Puts waiting vcounters on any free hardware counters, round robin from
+ * mux_next.  The next fill starts with whoever didn't fit.  Hold the cctx
+ * lock. */
+static void __perfmon_mux_fill(struct perfmon_cpu_context *cctx, uint64_t now)
+{
+	struct perfmon_vcounter *vc;
+	unsigned int slot;
+	int idx = 0;
+
+	for (int i = 0; i < MAX_MUX_COUNTERS; i++) {
+		slot = (cctx->mux_next + i) % MAX_MUX_COUNTERS;
+		vc = &cctx->vcounters[slot];
+		if (!vc->ev.event || (vc->hw_idx >= 0))
+			continue;
+		while ((idx < (int) cpu_caps.counters_x_proc) &&
+		       cctx->counters[idx].event)
+			idx++;
+		if (idx == (int) cpu_caps.counters_x_proc) {
+			cctx->mux_next = slot;
+			return;
+		}
+		__perfmon_vc_install(cctx, vc, idx, now);
+	}
+}
+
+static bool __perfmon_mux_needed(struct perfmon_cpu_context *cctx)
+{
+	return cctx->nr_vcounters > cpu_caps.counters_x_proc;
+}
+
+/* Rotates this core's vcounters, for as long as there are too many of them to
+ * all fit on the hardware. */
+static void perfmon_mux_handler(struct alarm_waiter *waiter,
+                                struct hw_trapframe *hw_tf)
+{
+	struct perfmon_cpu_context *cctx = container_of(waiter,
+	                                                struct perfmon_cpu_context,
+	                                                mux_waiter);
+	uint64_t now = nsec();
+	struct perfmon_vcounter *vc;
+
+	spin_lock_irqsave(&cctx->lock);
+	if (__perfmon_mux_needed(cctx)) {
+		for (int i = 0; i < MAX_MUX_COUNTERS; i++) {
+			vc = &cctx->vcounters[i];
+			if (vc->ev.event && (vc->hw_idx >= 0))
+				__perfmon_vc_remove(cctx, vc, now);
+		}
+		__perfmon_mux_fill(cctx, now);
+		set_awaiter_rel(waiter, PERFMON_MUX_USEC);
+		set_alarm(&per_cpu_info[core_id()].tchain, waiter);
+	} else {
+		cctx->mux_armed = FALSE;
+	}
+	spin_unlock_irqsave(&cctx->lock);
+}
+
 static void perfmon_do_cores_alloc(void *opaque)
 {
 	struct perfmon_alloc *pa = (struct perfmon_alloc *) opaque;
 	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
 	int i;
 	struct perfmon_event *pev;
+	struct perfmon_vcounter *vc;
+	uint64_t now = nsec();
+	bool arm_mux = FALSE;
 
+	if (perfmon_is_uncore_event(&pa->ev)) {
+		pa->cores_counters[core_id()] = (counter_t) uncore_alloc(&pa->ev);
+		return;
+	}
 	spin_lock_irqsave(&cctx->lock);
 	if (perfmon_is_fixed_event(&pa->ev)) {
 		uint64_t fxctrl_value = read_msr(MSR_CORE_PERF_FIXED_CTR_CTRL);
@@ -248,6 +401,7 @@ static void perfmon_do_cores_alloc(void *opaque)
 		} else {
 			/* Keep a copy of pa->ev for later.  pa is read-only and shared. */
 			cctx->fixed_counters[i] = pa->ev;
+			cctx->fixed_enabled_ts[i] = now;
 			pev = &cctx->fixed_counters[i];
 			if (PMEV_GET_INTEN(pev->event))
 				perfmon_set_fixed_trigger(i, pev->trigger_count);
@@ -257,27 +411,34 @@ static void perfmon_do_cores_alloc(void *opaque)
 			perfmon_enable_fix_event(i, pev->event, fxctrl_value);
 		}
 	} else {
-		for (i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
-			if (cctx->counters[i].event == 0) {
-				/* kernel bug if the MSRs don't agree with our bookkeeping */
-				assert(perfmon_event_available(i));
+		for (i = 0; i < MAX_MUX_COUNTERS; i++) {
+			if (cctx->vcounters[i].ev.event == 0)
 				break;
-			}
 		}
-		if (i < (int) cpu_caps.counters_x_proc) {
-			cctx->counters[i] = pa->ev;
-			pev = &cctx->counters[i];
-			if (PMEV_GET_INTEN(pev->event))
-				perfmon_set_unfixed_trigger(i, pev->trigger_count);
-			else
-				write_msr(MSR_IA32_PERFCTR0 + i, 0);
-			write_msr(MSR_CORE_PERF_GLOBAL_OVF_CTRL, 1ULL << i);
-			perfmon_enable_event(i, pev->event);
+		if (i < MAX_MUX_COUNTERS) {
+			vc = &cctx->vcounters[i];
+			vc->ev = pa->ev;
+			vc->hw_idx = -1;
+			vc->value = perfmon_unfixed_initial_value(&vc->ev);
+			vc->enabled_ts = now;
+			vc->running = 0;
+			cctx->nr_vcounters++;
+			/* If there's a free counter, it goes on right away.  Otherwise
+			 * it waits for the next rotation. */
+			__perfmon_mux_fill(cctx, now);
+			if (__perfmon_mux_needed(cctx) && !cctx->mux_armed) {
+				cctx->mux_armed = TRUE;
+				arm_mux = TRUE;
+			}
 		} else {
 			i = -ENOSPC;
 		}
 	}
 	spin_unlock_irqsave(&cctx->lock);
+	if (arm_mux) {
+		set_awaiter_rel(&cctx->mux_waiter, PERFMON_MUX_USEC);
+		set_alarm(&per_cpu_info[core_id()].tchain, &cctx->mux_waiter);
+	}
 
 	pa->cores_counters[core_id()] = (counter_t) i;
 }
@@ -289,6 +450,10 @@ static void perfmon_do_cores_free(void *opaque)
 	int err = 0, coreno = core_id();
 	counter_t ccno = pa->cores_counters[coreno];
 
+	if (perfmon_is_uncore_event(&pa->ev)) {
+		pa->cores_counters[coreno] = (counter_t) uncore_free(&pa->ev, ccno);
+		return;
+	}
 	spin_lock_irqsave(&cctx->lock);
 	if (perfmon_is_fixed_event(&pa->ev)) {
 		uint64_t fxctrl_value = read_msr(MSR_CORE_PERF_FIXED_CTR_CTRL);
@@ -302,10 +467,15 @@ static void perfmon_do_cores_free(void *opaque)
 			write_msr(MSR_CORE_PERF_FIXED_CTR0 + ccno, 0);
 		}
 	} else {
-		if (ccno < (int) cpu_caps.counters_x_proc) {
-			perfmon_init_event(&cctx->counters[ccno]);
-			perfmon_disable_event((int) ccno);
-			write_msr(MSR_IA32_PERFCTR0 + ccno, 0);
+		if ((ccno < MAX_MUX_COUNTERS) && cctx->vcounters[ccno].ev.event) {
+			struct perfmon_vcounter *vc = &cctx->vcounters[ccno];
+
+			if (vc->hw_idx >= 0)
+				__perfmon_vc_remove(cctx, vc, nsec());
+			perfmon_init_event(&vc->ev);
+			cctx->nr_vcounters--;
+			/* The mux alarm stops on its own once everyone fits. */
+			__perfmon_mux_fill(cctx, nsec());
 		} else {
 			err = -ENOENT;
 		}
@@ -343,14 +513,34 @@ static void perfmon_do_cores_status(void *opaque)
 {
 	struct perfmon_status_env *env = (struct perfmon_status_env *) opaque;
 	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
+	struct perfmon_status *pef = env->pef;
 	int coreno = core_id();
 	counter_t ccno = env->pa->cores_counters[coreno];
+	struct perfmon_vcounter *vc;
+	uint64_t now = nsec();
 
+	if (perfmon_is_uncore_event(&env->pa->ev)) {
+		pef->cores_values[coreno] =
+			uncore_read(&env->pa->ev, ccno, &pef->cores_time_enabled[coreno]);
+		pef->cores_time_running[coreno] = pef->cores_time_enabled[coreno];
+		return;
+	}
 	spin_lock_irqsave(&cctx->lock);
-	if (perfmon_is_fixed_event(&env->pa->ev))
-		env->pef->cores_values[coreno] = perfmon_read_fixed_counter(ccno);
-	else
-		env->pef->cores_values[coreno] = perfmon_read_unfixed_counter(ccno);
+	if (perfmon_is_fixed_event(&env->pa->ev)) {
+		pef->cores_values[coreno] = perfmon_read_fixed_counter(ccno);
+		pef->cores_time_enabled[coreno] = now - cctx->fixed_enabled_ts[ccno];
+		pef->cores_time_running[coreno] = pef->cores_time_enabled[coreno];
+	} else {
+		vc = &cctx->vcounters[ccno];
+		pef->cores_time_enabled[coreno] = now - vc->enabled_ts;
+		pef->cores_time_running[coreno] = vc->running;
+		if (vc->hw_idx >= 0) {
+			pef->cores_values[coreno] = perfmon_read_unfixed_counter(vc->hw_idx);
+			pef->cores_time_running[coreno] += now - vc->running_ts;
+		} else {
+			pef->cores_values[coreno] = vc->value;
+		}
+	}
 	spin_unlock_irqsave(&cctx->lock);
 }
 
@@ -402,9 +592,11 @@ static struct perfmon_alloc *perfmon_create_alloc(const struct perfmon_event *pe
 static struct perfmon_status *perfmon_status_alloc(void)
 {
 	struct perfmon_status *pef = kzmalloc(sizeof(struct perfmon_status) +
-	                                          num_cores * sizeof(uint64_t),
+	                                          3 * num_cores * sizeof(uint64_t),
 	                                      MEM_WAIT);
 
+	pef->cores_time_enabled = pef->cores_values + num_cores;
+	pef->cores_time_running = pef->cores_time_enabled + num_cores;
 	return pef;
 }
 
@@ -423,6 +615,7 @@ bool perfmon_supported(void)
 void perfmon_global_init(void)
 {
 	perfmon_read_cpu_caps(&cpu_caps);
+	uncore_init();
 }
 
 void perfmon_pcpu_init(void)
@@ -577,12 +770,35 @@ static int perfmon_install_session_alloc(struct perfmon_session *ps,
 	error(ENFILE, "Too many perf allocs in the session");
 }
 
+/* Uncore counters are per socket, so we program them from the lowest core in
+ * cset on each socket. */
+static void perfmon_uncore_core_set(const struct core_set *cset,
+                                    struct core_set *ucset)
+{
+	struct core_info *cores = cpu_topology_info.core_list;
+	int j;
+
+	core_set_init(ucset);
+	for (int i = 0; i < num_cores; i++) {
+		if (!core_set_getcpu(cset, i))
+			continue;
+		for (j = 0; j < i; j++) {
+			if (core_set_getcpu(cset, j) &&
+			    (cores[j].socket_id == cores[i].socket_id))
+				break;
+		}
+		if (j == i)
+			core_set_setcpu(ucset, i);
+	}
+}
+
 int perfmon_open_event(const struct core_set *cset, struct perfmon_session *ps,
                        const struct perfmon_event *pev)
 {
 	ERRSTACK(1);
 	int i;
 	struct perfmon_alloc *pa = perfmon_create_alloc(pev);
+	struct core_set ucset;
 
 	if (waserror()) {
 		perfmon_destroy_alloc(pa);
@@ -592,6 +808,10 @@ int perfmon_open_event(const struct core_set *cset, struct perfmon_session *ps,
 	 * it.  Our tracking of whether or not a counter is in use depends on it
 	 * being enabled, or at least that some bit is set. */
 	PMEV_SET_EN(pa->ev.event, 1);
+	if (perfmon_is_uncore_event(&pa->ev)) {
+		perfmon_uncore_core_set(cset, &ucset);
+		cset = &ucset;
+	}
 	smp_do_in_cores(cset, perfmon_do_cores_alloc, pa);
 
 	for (i = 0; i < num_cores; i++) {
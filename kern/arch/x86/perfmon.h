@@ -17,6 +17,8 @@
 #define MAX_VAR_COUNTERS 32
 #define MAX_FIX_COUNTERS 16
 #define MAX_PERFMON_COUNTERS (MAX_VAR_COUNTERS + MAX_FIX_COUNTERS)
+/* Unfixed events per core, multiplexed onto the hardware's counters */
+#define MAX_MUX_COUNTERS MAX_PERFMON_COUNTERS
 #define INVALID_COUNTER INT32_MIN
 
 struct hw_trapframe;
@@ -42,8 +44,13 @@ struct perfmon_session {
 	struct perfmon_alloc *allocs[MAX_PERFMON_COUNTERS];
 };
 
+/* Times are in nsec.  An event ran for cores_time_running of the
+ * cores_time_enabled it was open on each core; they differ when events are
+ * multiplexed. */
 struct perfmon_status {
 	struct perfmon_event ev;
+	uint64_t *cores_time_enabled;
+	uint64_t *cores_time_running;
 	uint64_t cores_values[0];
 };
 
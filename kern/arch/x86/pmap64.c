@@ -11,7 +11,8 @@
  * - mapping segments doesn't support having a PTE already present
  * - mtrrs break big machines
  * - jumbo pages are only supported at the VM layer, not PM (a jumbo is 2^9
- * little pages, for example)
+ * little pages, for example).  User jumbos are PML2 only, and each of their
+ * little pages has its own refcnt, so we can split them whenever we want.
  * - usermemwalk and freeing might need some help (in higher layers of the
  * kernel). */
 
@@ -31,6 +32,7 @@
 #include <kmalloc.h>
 #include <page_alloc.h>
 #include <umem.h>
+#include <percpu.h>
 
 extern char boot_pml4[], gdt64[], gdt64desc[];
 pgdir_t boot_pgdir;
@@ -89,6 +91,29 @@ static kpte_t *kpte2pml(kpte_t kpte)
 	return (kpte_t*)KADDR(PTE_ADDR(kpte));
 }
 
+/* Splits a user jumbo PTE into a page table of small PTEs that map the same
+ * memory with the same settings.  The translations don't change, so there's no
+ * need for a TLB shootdown.  Hold the proc's pte_lock. */
+static int demote_jumbo(kpte_t *kpte, int pml_shift)
+{
+	epte_t *epte = kpte_to_epte(kpte);
+	physaddr_t pa = kpte_get_paddr(kpte);
+	int settings = kpte_get_settings(kpte) & ~PTE_PS;
+	kpte_t *new_pml;
+
+	/* We only hand out PML2 jumbos to userspace */
+	assert(pml_shift == PML2_SHIFT);
+	new_pml = get_cont_pages(1, 0);
+	if (!new_pml)
+		return -ENOMEM;
+	for (int i = 0; i < NPTENTRIES; i++)
+		pte_write(&new_pml[i], pa + i * PGSIZE, settings);
+	/* Same intermediate perms as __pml_walk() */
+	*kpte = PADDR(new_pml) | PTE_P | PTE_U | PTE_W;
+	*epte = (PADDR(new_pml) + PGSIZE) | EPTE_R | EPTE_X | EPTE_W;
+	return 0;
+}
+
 static kpte_t *__pml_walk(kpte_t *pml, uintptr_t va, int flags, int pml_shift)
 {
 	kpte_t *kpte;
@@ -97,8 +122,15 @@ static kpte_t *__pml_walk(kpte_t *pml, uintptr_t va, int flags, int pml_shift)
 
 	kpte = &pml[PMLx(va, pml_shift)];
 	epte = kpte_to_epte(kpte);
-	if (walk_is_complete(kpte, pml_shift, flags))
-		return kpte;
+	if (walk_is_complete(kpte, pml_shift, flags)) {
+		/* If we're creating a smaller PTE inside a user jumbo, the jumbo needs
+		 * to be split first.  We leave the kernel's jumbos alone. */
+		if ((pml_shift == (flags & PG_WALK_SHIFT_MASK)) ||
+		    !(flags & PG_WALK_CREATE) || (va >= ULIM))
+			return kpte;
+		if (demote_jumbo(kpte, pml_shift))
+			return NULL;
+	}
 	if (!kpte_is_present(kpte)) {
 		if (!(flags & PG_WALK_CREATE))
 			return NULL;
@@ -394,6 +426,38 @@ pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create)
 	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
 }
 
+/* Like pgdir_walk, but stops at the level of the smallest jumbo (PTSIZE).  The
+ * PTE could be unmapped (in which case you can put a jumbo there), a jumbo, or
+ * an intermediate PTE for a page table of small pages. */
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int create)
+{
+	int flags = PML2_SHIFT;
+	if (create == 1)
+		flags |= PG_WALK_CREATE;
+	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
+}
+
+/* Like pgdir_walk() with create, but for a run of up to nr pages starting at
+ * va.  Fills in ptes from va to the end of its page table, so someone mapping
+ * lots of pages walks once per table instead of once per page.  Returns the
+ * number of PTEs filled in, or 0 if the walk failed. */
+size_t pgdir_walk_range(pgdir_t pgdir, const void *va, size_t nr, pte_t *ptes)
+{
+	kpte_t *kpte;
+	size_t nr_ptes;
+
+	kpte = pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va,
+	                PML1_SHIFT | PG_WALK_CREATE);
+	if (!kpte)
+		return 0;
+	/* With create, the walk split any user jumbo, so kpte is in a PML1 and
+	 * its neighbors (and their EPTEs) map the following pages. */
+	nr_ptes = MIN(nr, NPTENTRIES - PMLx((uintptr_t)va, PML1_SHIFT));
+	for (size_t i = 0; i < nr_ptes; i++)
+		ptes[i] = kpte + i;
+	return nr_ptes;
+}
+
 static int pml_perm_walk(kpte_t *pml, const void *va, int pml_shift)
 {
 	kpte_t *kpte;
@@ -444,6 +508,79 @@ static void check_syms_va(void)
 	check_sym_va(BRK_END,        0x0000400000000000);
 }
 
+/* Returns TRUE if the MTRRs give all of [pa, pa + len) the same memory type.
+ * len is a power of two and pa is aligned to it.  A jumbo page that spans more
+ * than one type is undefined behavior (SDM 11.11.9), and the boot page tables
+ * map the low memory with jumbos, right over the VGA and BIOS holes. */
+static bool mtrr_range_is_uniform(physaddr_t pa, size_t len)
+{
+	uint64_t def_type = read_msr(IA32_MTRR_DEF_TYPE);
+	int nr_var = read_msr(MSR_MTRRcap) & 0xff;
+	uint64_t base, mask;
+
+	if (len == PGSIZE || !(def_type & (1 << 11)))
+		return TRUE;
+	/* Fixed ranges cover the first MB in chunks of 4K and up */
+	if ((def_type & (1 << 10)) && pa < 0x100000)
+		return FALSE;
+	for (int i = 0; i < nr_var; i++) {
+		mask = read_msr(IA32_MTRR_PHYSMASK0 + 2 * i);
+		if (!(mask & (1 << 11)))
+			continue;
+		base = read_msr(IA32_MTRR_PHYSBASE0 + 2 * i);
+		mask &= ~(PGSIZE - 1) & ((1ULL << 52) - 1);
+		/* The MTRR's range is smaller than ours and falls within it */
+		if ((mask & (len - 1)) &&
+		    ((pa ^ base) & mask & ~(len - 1)) == 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Splits a kernel jumbo into a PML of the next size down, with the same
+ * settings.  The boot PMLs aren't paired with EPT pages, and the kernel's half
+ * of the address space never shows up in an EPT, so we just do the KPT. */
+static void split_kern_jumbo(kpte_t *kpte, int pml_shift)
+{
+	physaddr_t pa = kpte_get_paddr(kpte);
+	int settings = kpte_get_settings(kpte);
+	size_t sub_sz = 1UL << (pml_shift - BITS_PER_PML);
+	kpte_t *new_pml;
+
+	if (pml_shift - BITS_PER_PML == PML1_SHIFT)
+		settings &= ~PTE_PS;
+	new_pml = get_cont_pages(0, MEM_WAIT);
+	for (int i = 0; i < NPTENTRIES; i++)
+		kpte_write(&new_pml[i], pa + i * sub_sz, settings);
+	*kpte = PADDR(new_pml) | PTE_P | PTE_W;
+}
+
+/* Breaks up any kernel jumbo on [va, va + len), which maps va - base, that
+ * straddles MTRR types, down to the largest page size that doesn't.  In
+ * practice this is just the first GB, and within it, the first 2MB.  Everything
+ * else stays in 1GB pages, or 2MB pages on machines without them. */
+static void fixup_kern_jumbos(kpte_t *pml, uintptr_t va, size_t len,
+                              uintptr_t base, int pml_shift)
+{
+	size_t pg_sz = 1UL << pml_shift;
+	uintptr_t end = va + len;
+	kpte_t *kpte;
+
+	for (; va < end; va += pg_sz) {
+		kpte = &pml[PMLx(va, pml_shift)];
+		if (!kpte_is_present(kpte))
+			continue;
+		/* Then everything under it is too, jumbo or not */
+		if (mtrr_range_is_uniform(va - base, pg_sz))
+			continue;
+		if (kpte_is_jumbo(kpte))
+			split_kern_jumbo(kpte, pml_shift);
+		if (pml_shift > PML2_SHIFT)
+			fixup_kern_jumbos(kpte2pml(*kpte), va, pg_sz, base,
+			                  pml_shift - BITS_PER_PML);
+	}
+}
+
 /* Initializes anything related to virtual memory.  Paging is already on, but we
  * have a slimmed down page table. */
 void vm_init(void)
@@ -476,6 +613,14 @@ void vm_init(void)
 	boot_kpt[PML4(UVPT)] = PADDR(boot_kpt) | PTE_U | PTE_P;
 	/* set up core0s now (mostly for debugging) */
 	setup_default_mtrrs(0);
+	/* The MTRRs are set: keep the direct map's and the kernel's jumbos from
+	 * spanning memory types.  We only need to look at the first PML3's worth of
+	 * each; the low memory is all that's interesting. */
+	fixup_kern_jumbos(kpte2pml(boot_kpt[PML4(KERNBASE)]), KERNBASE,
+	                  PML3_REACH, KERNBASE, PML3_SHIFT);
+	fixup_kern_jumbos(kpte2pml(boot_kpt[PML4(KERN_LOAD_ADDR)]), KERN_LOAD_ADDR,
+	                  PML3_PTE_REACH, KERN_LOAD_ADDR, PML3_SHIFT);
+	tlb_flush_global();
 	/* Our current gdt_pd (gdt64desc) is pointing to a physical address for the
 	 * GDT.  We need to switch over to pointing to one with a virtual address,
 	 * so we can later unmap the low memory */
@@ -496,7 +641,7 @@ void x86_cleanup_bootmem(void)
 
 /* Walks len bytes from start, executing 'callback' on every PTE, passing it a
  * specific VA and whatever arg is passed in.  Note, this cannot handle jumbo
- * pages.
+ * pages, so it splits any jumbos it runs into.  Hold the pte_lock.
  *
  * This is just a clumsy wrapper around the more powerful pml_for_each, which
  * can handle jumbo and intermediate pages. */
@@ -507,22 +652,43 @@ int env_user_mem_walk(struct proc *p, void *start, size_t len,
 		struct proc *p;
 		mem_walk_callback_t cb;
 		void *cb_arg;
+		uintptr_t start;
+		uintptr_t end;
 	};
 	int trampoline_cb(kpte_t *kpte, uintptr_t kva, int shift, bool visited_subs,
 	                  void *data)
 	{
 		struct tramp_package *tp = (struct tramp_package*)data;
+		uintptr_t va, end;
+		kpte_t *pml;
+		int ret;
+
 		assert(tp->cb);
-		/* memwalk CBs don't know how to handle intermediates or jumbos */
-		if (shift != PML1_SHIFT)
+		if (shift == PML1_SHIFT)
+			return tp->cb(tp->p, kpte, (void*)kva, tp->cb_arg);
+		/* memwalk CBs don't know how to handle intermediates or jumbos.  We
+		 * skip the intermediates, and split the jumbos and run the CB on the
+		 * small PTEs that are in range. */
+		if (!kpte_is_jumbo(kpte))
 			return 0;
-		return tp->cb(tp->p, kpte, (void*)kva, tp->cb_arg);
+		if ((ret = demote_jumbo(kpte, shift)))
+			return ret;
+		pml = kpte2pml(*kpte);
+		end = MIN(kva + (1UL << shift), tp->end);
+		for (va = MAX(kva, tp->start); va < end; va += PGSIZE) {
+			ret = tp->cb(tp->p, &pml[PML1(va)], (void*)va, tp->cb_arg);
+			if (ret)
+				return ret;
+		}
+		return 0;
 	}
 
 	struct tramp_package local_tp;
 	local_tp.p = p;
 	local_tp.cb = callback;
 	local_tp.cb_arg = arg;
+	local_tp.start = ROUNDDOWN((uintptr_t)start, PGSIZE);
+	local_tp.end = (uintptr_t)start + len;
 	return pml_for_each(pgdir_get_kpt(p->env_pgdir), (uintptr_t)start, len,
 	                   trampoline_cb, &local_tp);
 }
@@ -673,6 +839,86 @@ int arch_max_jumbo_page_shift(void)
 	return edx & (1 << 26) ? PML3_SHIFT : PML2_SHIFT;
 }
 
+/* PCIDs.  With CR4_PCIDE, the TLB tags entries with the PCID in the low bits of
+ * CR3, and a CR3 load with CR3_NOFLUSH keeps the new PCID's entries.  Each core
+ * caches a few address spaces in PCID slots, keyed by the proc's tlb_gen.
+ * proc_tlbshootdown() gives the proc a new tlb_gen, so a core that wasn't
+ * running it flushes on its next load, without needing an IPI.
+ *
+ * PCID 0 is for CR3 loads we don't control, like VM exits, and we flush it on
+ * every load.  The kernel's boot_cr3 gets its own PCID.  Kernel mappings that
+ * change are global, and those changes flush every PCID. */
+#define X86_PCID_KERN			1
+#define X86_PCID_SLOT0			2
+#define X86_NR_PCID_SLOTS		16
+#define CR3_NOFLUSH				(1UL << 63)
+
+struct pcid_cache {
+	bool						enabled;
+	unsigned int				next_victim;
+	unsigned long				gens[X86_NR_PCID_SLOTS];
+};
+
+static DEFINE_PERCPU(struct pcid_cache, pcid_cache);
+
+/* Called on each core, in boot_cr3 (PCID 0), during __arch_pcpu_init(). */
+void x86_pcid_init(void)
+{
+	struct pcid_cache *pc = PERCPU_VARPTR(pcid_cache);
+
+#ifdef CONFIG_NOPCID
+	return;
+#endif
+	if (!cpu_has_feat(CPU_FEAT_X86_PCID))
+		return;
+	lcr4(rcr4() | CR4_PCIDE);
+	memset(pc->gens, 0, sizeof(pc->gens));
+	pc->next_victim = 0;
+	pc->enabled = TRUE;
+	/* The first load of the kernel PCID flushes whatever was tagged there */
+	lcr3(boot_cr3 | X86_PCID_KERN);
+}
+
+/* Loads p's page tables, or boot_cr3 if p is 0.  Keeps p's TLB entries from the
+ * last time it ran here, unless it had a shootdown since then. */
+void arch_pgdir_load(struct proc *p)
+{
+	struct pcid_cache *pc;
+	unsigned long gen;
+	int8_t irq_state = 0;
+	int slot;
+
+	disable_irqsave(&irq_state);
+	pc = PERCPU_VARPTR(pcid_cache);
+	if (!pc->enabled) {
+		lcr3(p ? p->env_cr3 : boot_cr3);
+		goto out;
+	}
+	if (!p) {
+		lcr3(boot_cr3 | X86_PCID_KERN | CR3_NOFLUSH);
+		goto out;
+	}
+	/* VM exits use PCID 0 (see vmx.c), so it must only ever hold this VMM */
+	if (p->vmm.vmmcp) {
+		lcr3(p->env_cr3);
+		goto out;
+	}
+	/* Our caller already published us in pgdir_proc */
+	gen = ACCESS_ONCE(p->tlb_gen);
+	for (slot = 0; slot < X86_NR_PCID_SLOTS; slot++) {
+		if (pc->gens[slot] == gen) {
+			lcr3(p->env_cr3 | (X86_PCID_SLOT0 + slot) | CR3_NOFLUSH);
+			goto out;
+		}
+	}
+	slot = pc->next_victim;
+	pc->next_victim = (slot + 1) % X86_NR_PCID_SLOTS;
+	pc->gens[slot] = gen;
+	lcr3(p->env_cr3 | (X86_PCID_SLOT0 + slot));
+out:
+	enable_irqsave(&irq_state);
+}
+
 /* Debugging */
 static int print_pte(kpte_t *kpte, uintptr_t kva, int shift, bool visited_subs,
                      void *data)
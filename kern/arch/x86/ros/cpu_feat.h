@@ -17,4 +17,14 @@
 #define CPU_FEAT_X86_XSAVEOPT			(__CPU_FEAT_ARCH_START + 4)
 #define CPU_FEAT_X86_FSGSBASE			(__CPU_FEAT_ARCH_START + 5)
 #define CPU_FEAT_X86_MWAIT				(__CPU_FEAT_ARCH_START + 6)
+#define CPU_FEAT_X86_TSC_DEADLINE		(__CPU_FEAT_ARCH_START + 7)
+#define CPU_FEAT_X86_PCID				(__CPU_FEAT_ARCH_START + 8)
+#define CPU_FEAT_X86_RDTSCP				(__CPU_FEAT_ARCH_START + 9)
+#define CPU_FEAT_X86_POPCNT				(__CPU_FEAT_ARCH_START + 10)
+#define CPU_FEAT_X86_ERMS				(__CPU_FEAT_ARCH_START + 11)
+#define CPU_FEAT_X86_FSRM				(__CPU_FEAT_ARCH_START + 12)
+#define CPU_FEAT_X86_XINUSE				(__CPU_FEAT_ARCH_START + 13)
+#define CPU_FEAT_X86_SHA				(__CPU_FEAT_ARCH_START + 14)
+#define CPU_FEAT_X86_RDRAND				(__CPU_FEAT_ARCH_START + 15)
+#define CPU_FEAT_X86_RDSEED				(__CPU_FEAT_ARCH_START + 16)
 #define __NR_CPU_FEAT					(__CPU_FEAT_ARCH_START + 64)
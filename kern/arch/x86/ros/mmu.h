@@ -41,6 +41,7 @@
 #define CR4_VMXE	0x00002000	// VMX enable
 #define CR4_SMXE	0x00004000	// SMX enable
 #define CR4_FSGSBASE	0x00010000	// RD/WR FS/GS Base enabled
+#define CR4_PCIDE	0x00020000	// Process-context identifiers enabled
 #define CR4_OSXSAVE	0x00040000	// XSAVE and processor extended states-enabled
 
 // Eflags register
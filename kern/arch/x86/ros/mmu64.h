@@ -167,6 +167,8 @@ typedef struct x86_pgdir {
 /* All arches must define this, which is the lower limit of their static
  * mappings, and where the dynamic mappings will start. */
 #define KERN_DYN_TOP	IOAPIC_BASE
+/* The dynamic mappings grow down to the kernel's static linking limit */
+#define KERN_DYN_BOT	0xffffffff80000000
 
 /* Virtual page table.  Every PML4 has a PTE at the slot (PML4(VPT))
  * corresponding to VPT that points to that PML4's base.  In essence, the 512
@@ -284,6 +286,7 @@ typedef struct x86_pgdir {
 #define PTE_PS			0x080	/* Page Size */
 #define __PTE_PAT		0x080	/* Page attribute table */
 #define PTE_G			0x100	/* Global Page */
+#define PTE_COW			0x200	/* Copy-on-write (OS bit, user PTEs only) */
 #define __PTE_JPAT		0x800	/* Jumbo PAT */
 #define PTE_NOCACHE		(__PTE_PWT | __PTE_PCD)
 #define PTE_WRITECOMB	(__PTE_PCD)
@@ -37,6 +37,9 @@
  *   U32 NUM_VALUES; (always num_cores)
  *   U64 VALUES[NUM_VALUES]; (one value per core - zero if the counter was not
  *                            active in that core)
+ *   U64 TIME_ENABLED[NUM_VALUES]; (nsec the counter was open on each core)
+ *   U64 TIME_RUNNING[NUM_VALUES]; (nsec it was counting on each core - less
+ *                                  than TIME_ENABLED if it was multiplexed)
  *
  * PERFMON_CMD_COUNTER_CLOSE request
  *   U8 CMD; (= PERFMON_CMD_COUNTER_CLOSE)
@@ -53,6 +56,12 @@
  *   U32 COUNTERS_X_PROC;
  *   U32 BITS_X_FIX_COUNTER;
  *   U32 FIX_COUNTERS_X_PROC;
+ *
+ * Uncore events have PERFMON_UNCORE_EVENT set in EVENT_FLAGS, along with the
+ * box type and index (PMFL_UNC_BOX and PMFL_UNC_BOX_IDX).  They are counted
+ * once per socket, on the lowest core in the CPUMASK from each socket, and
+ * their values come back in that core's slot.  They can't interrupt, so
+ * EVENT_TRIGGER_COUNT instead carries the box's filter, if any (CBo only).
  */
 
 #define PERFMON_CMD_COUNTER_OPEN 1
@@ -61,6 +70,19 @@
 #define PERFMON_CMD_CPU_CAPS 4
 
 #define PERFMON_FIXED_EVENT (1 << 0)
+#define PERFMON_UNCORE_EVENT (1 << 1)
+
+#define PERFMON_UNC_BOX_CBO 1
+#define PERFMON_UNC_BOX_IMC 2
+#define PERFMON_UNC_BOX_QPI 3
+
+#define PMFL_UNC_BOX MKBITFIELD(8, 8)
+#define PMFL_UNC_BOX_IDX MKBITFIELD(16, 8)
+
+#define PMFL_GET_UNC_BOX(v) BF_GETFIELD(v, PMFL_UNC_BOX)
+#define PMFL_SET_UNC_BOX(v, x) BF_SETFIELD(v, x, PMFL_UNC_BOX)
+#define PMFL_GET_UNC_BOX_IDX(v) BF_GETFIELD(v, PMFL_UNC_BOX_IDX)
+#define PMFL_SET_UNC_BOX_IDX(v, x) BF_SETFIELD(v, x, PMFL_UNC_BOX_IDX)
 
 #define PMEV_EVENT MKBITFIELD(0, 8)
 #define PMEV_MASK MKBITFIELD(8, 8)
@@ -113,3 +135,8 @@ static inline bool perfmon_is_fixed_event(const struct perfmon_event *pev)
 {
 	return (pev->flags & PERFMON_FIXED_EVENT) != 0;
 }
+
+static inline bool perfmon_is_uncore_event(const struct perfmon_event *pev)
+{
+	return (pev->flags & PERFMON_UNCORE_EVENT) != 0;
+}
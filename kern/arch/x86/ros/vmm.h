@@ -16,6 +16,57 @@ struct vmm_gpcore_init {
 	void					*apic_addr;
 };
 
+/* Setup for the in-kernel virtio-net backend, SYS_vmm_vhost_net.  Addresses
+ * are guest physical, which are also the VMM's virtual addresses.  vrings[0] is
+ * the receiveq and vrings[1] the transmitq. */
+struct vmm_vhost_vring {
+	uint64_t				desc;
+	uint64_t				avail;
+	uint64_t				used;
+	uint32_t				num;
+};
+
+struct event_queue;
+
+struct vmm_vhost_net_init {
+	uint64_t				mmio_addr;	/* base of the device's registers */
+	uint32_t				*isr;		/* the device's InterruptStatus */
+	int						data_fd;	/* #ether data, in batch mode */
+	unsigned int			gpcoreid;	/* who gets the IRQs */
+	unsigned int			vector;
+	struct event_queue		*ev_q;		/* IRQs for unloaded gpcs */
+	struct vmm_vhost_vring	vrings[2];
+};
+
+/* VM exit accounting, shared by the kernel's #kprof/kpvmexit and the VMM's
+ * per-guest-thread stats.  Exits count against their basic exit reason, and
+ * the cycles it took to handle each go in a log2 histogram: bucket i has the
+ * exits that took fewer than 2^(VMM_EXIT_HIST_SHIFT + i + 1) cycles, and the
+ * last bucket has everything else. */
+#define VMM_EXIT_NR_REASONS			(EXIT_REASON_XRSTORS + 1)
+#define VMM_EXIT_HIST_SHIFT			8
+#define VMM_EXIT_HIST_NR_BUCKETS	16
+
+struct vmm_exit_stat {
+	uint64_t				count;
+	uint64_t				cycles;
+	uint64_t				hist[VMM_EXIT_HIST_NR_BUCKETS];
+};
+
+static inline void vmm_exit_stat_add(struct vmm_exit_stat *st, uint64_t cycles)
+{
+	uint64_t c = cycles >> VMM_EXIT_HIST_SHIFT;
+	unsigned int bucket = 0;
+
+	while ((c > 1) && (bucket < VMM_EXIT_HIST_NR_BUCKETS - 1)) {
+		c >>= 1;
+		bucket++;
+	}
+	st->count++;
+	st->cycles += cycles;
+	st->hist[bucket]++;
+}
+
 /* Intel VM Trap Injection Fields */
 #define VM_TRAP_VALID               (1 << 31)
 #define VM_TRAP_ERROR_CODE          (1 << 11)
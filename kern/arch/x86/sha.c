@@ -0,0 +1,48 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * SHA-1 and SHA-256 with the SHA extensions, for kern/lib/crypto.  These
+ * return how many blocks they hashed, and the generic code does the rest.
+ *
+ * A kfpu section costs about as much as hashing a block the slow way, so we
+ * don't bother for a single block.  We also drop out of the section every
+ * X86_SHA_CHUNK_BLOCKS, so IRQs aren't off for too long. */
+
+#include <arch/arch.h>
+#include <cpu_feat.h>
+#include <trap.h>
+#include <crypto/2sha.h>
+
+#define X86_SHA_MIN_BLOCKS		2
+#define X86_SHA_CHUNK_BLOCKS	64
+
+void x86_sha1_ni_blocks(uint32_t state[5], const uint8_t *data, size_t nr);
+void x86_sha256_ni_blocks(uint32_t state[8], const uint8_t *data, size_t nr);
+
+static size_t x86_sha_blocks(void (*func)(uint32_t *, const uint8_t *, size_t),
+                             uint32_t *state, const uint8_t *data, size_t nr)
+{
+	size_t done = 0, amt;
+
+	if (!cpu_has_feat(CPU_FEAT_X86_SHA) || (nr < X86_SHA_MIN_BLOCKS))
+		return 0;
+	while (done < nr) {
+		if (!kfpu_begin())
+			break;
+		amt = MIN(nr - done, X86_SHA_CHUNK_BLOCKS);
+		func(state, data + done * 64, amt);
+		kfpu_end();
+		done += amt;
+	}
+	return done;
+}
+
+size_t x86_sha1_blocks(uint32_t state[5], const uint8_t *data, size_t nr)
+{
+	return x86_sha_blocks(x86_sha1_ni_blocks, state, data, nr);
+}
+
+size_t x86_sha256_blocks(uint32_t state[8], const uint8_t *data, size_t nr)
+{
+	return x86_sha_blocks(x86_sha256_ni_blocks, state, data, nr);
+}
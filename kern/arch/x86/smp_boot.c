@@ -30,7 +30,10 @@
 
 extern handler_wrapper_t handler_wrappers[NUM_HANDLER_WRAPPERS];
 int x86_num_cores_booted = 1;
-uintptr_t smp_stack_top;
+/* Each AP takes a ticket in smp_entry, which picks its boot stack */
+uintptr_t *smp_stack_tops;
+unsigned int smp_nr_stacks;
+unsigned int smp_stack_ticket;
 barrier_t generic_barrier;
 
 #define DECLARE_HANDLER_CHECKLISTS(vector)                          \
@@ -74,6 +77,9 @@ static void setup_rdtscp(int coreid)
 		asm volatile ("rdtscp" : "=c"(rdtscp_ecx) : : "eax", "edx");
 		if (!coreid && (read_msr(MSR_TSC_AUX) != rdtscp_ecx))
 			printk("\nBroken rdtscp detected, don't trust it for pcoreid!\n\n");
+		/* Userspace gets its pcoreid from rdtscp if it works */
+		else if (!coreid)
+			cpu_set_feat(CPU_FEAT_X86_RDTSCP);
 	}
 }
 
@@ -123,10 +129,33 @@ static void __spin_bootlock_raw(void)
 	              "jne 1b;" : : "m"(*bootlock) : "eax", "cc", "memory");
 }
 
+/* APs run smp_main() on these until they have their real kernel stacks */
+static void smp_alloc_boot_stacks(void)
+{
+	page_t *page;
+
+	smp_nr_stacks = num_cores - 1;
+	smp_stack_tops = kzmalloc(sizeof(uintptr_t) * MAX(smp_nr_stacks, 1),
+	                          MEM_WAIT);
+	for (int i = 0; i < smp_nr_stacks; i++) {
+		if (kpage_alloc(&page))
+			panic("No memory for SMP boot stacks!");
+		smp_stack_tops[i] = (uintptr_t)page2kva(page) + PGSIZE;
+	}
+}
+
+static void smp_free_boot_stacks(void)
+{
+	for (int i = 0; i < smp_nr_stacks; i++)
+		page_decref(kva2page((void*)smp_stack_tops[i] - PGSIZE));
+	kfree(smp_stack_tops);
+	smp_stack_tops = 0;
+}
+
 void smp_boot(void)
 {
 	struct per_cpu_info *pcpui0 = &per_cpu_info[0];
-	page_t *smp_stack;
+	uint64_t start, sipi, aps_up, deadline;
 
 	// NEED TO GRAB A LOWMEM FREE PAGE FOR AP BOOTUP CODE
 	// page1 (2nd page) is reserved, hardcoded in pmap.c
@@ -137,10 +166,9 @@ void smp_boot(void)
 	/* Make sure the trampoline page is mapped.  64 bit already has the tramp pg
 	 * mapped (1 GB of lowmem), so this is a nop. */
 
-	// Allocate a stack for the cores starting up.  One for all, must share
-	if (kpage_alloc(&smp_stack))
-		panic("No memory for SMP boot stack!");
-	smp_stack_top = (uintptr_t)(page2kva(smp_stack) + PGSIZE);
+	/* One stack per AP, so they can all run smp_main() at once */
+	smp_alloc_boot_stacks();
+	start = read_tsc();
 
 	/* During SMP boot, core_id_early() returns 0, so all of the cores, which
 	 * grab locks concurrently, share the same pcpui and thus the same
@@ -157,7 +185,14 @@ void smp_boot(void)
 	udelay(200);
 	send_startup_ipi(0x01);
 	*/
-	udelay(500000);
+	sipi = read_tsc();
+	/* The APs we know about usually show up in well under a millisecond.  We
+	 * give stragglers (or cores ACPI didn't tell us about) as long as we used
+	 * to wait unconditionally. */
+	deadline = sipi + usec2tsc(500000);
+	while ((ACCESS_ONCE(x86_num_cores_booted) < num_cores) &&
+	       (read_tsc() < deadline))
+		cpu_relax();
 
 	// Each core will also increment smp_semaphore, and decrement when it is done,
 	// all in smp_entry.  It's purpose is to keep Core0 from competing for the
@@ -165,9 +200,11 @@ void smp_boot(void)
 	// LAPIC timer goes off, all available cores will be initialized.
 	while (*get_smp_semaphore())
 		cpu_relax();
+	aps_up = read_tsc();
 
 	// From here on, no other cores are coming up.  Grab the lock to ensure it.
-	// Another core could be in it's prelock phase and be trying to grab the lock
+	// The APs only hold it long enough to get through the door, but another
+	// core could be in it's prelock phase and be trying to grab the lock
 	// forever....
 	// The lock exists on the trampoline, so it can be grabbed right away in
 	// real mode.  If core0 wins the race and blocks other CPUs from coming up
@@ -193,8 +230,8 @@ void smp_boot(void)
 		     num_cores, x86_num_cores_booted, x86_num_cores_booted);
 		num_cores = x86_num_cores_booted;
 	}
-	// Dealloc the temp shared stack
-	page_decref(smp_stack);
+	/* Everyone who got a boot stack is done with it */
+	smp_free_boot_stacks();
 
 	// Set up the generic remote function call facility
 	init_smp_call_function();
@@ -204,12 +241,14 @@ void smp_boot(void)
 	/* This will break the cores out of their hlt in smp_entry.S */
 	send_broadcast_ipi(I_POKE_CORE);
 	smp_final_core_init();	/* need to init ourselves as well */
+	printk("SMP boot: %llu usec INIT/SIPI, %llu usec APs, %llu usec per-core\n",
+	       tsc2usec(sipi - start), tsc2usec(aps_up - sipi),
+	       tsc2usec(read_tsc() - aps_up));
 }
 
 /* This is called from smp_entry by each core to finish the core bootstrapping.
- * There is a spinlock around this entire function in smp_entry, for a few
- * reasons, the most important being that all cores use the same stack when
- * entering here.
+ * The APs run this in parallel, each on its own boot stack from
+ * smp_stack_tops.
  *
  * Do not use per_cpu_info in here.  Do whatever you need in smp_percpu_init().
  */
@@ -302,6 +341,7 @@ void __arch_pcpu_init(uint32_t coreid)
 
 	if (cpu_has_feat(CPU_FEAT_X86_FSGSBASE))
 		lcr4(rcr4() | CR4_FSGSBASE);
+	x86_pcid_init();
 
 	/*
 	 * Enable SSE instructions.
@@ -0,0 +1,208 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * x86 memcpy and memset, picked by size:
+ *
+ * - Small ones (< X86_STR_SMALL) are a couple of overlapping loads and stores
+ *   from each end, so there are no loops or byte-at-a-time tails.
+ * - Mid-sized ones use rep movs/stos.  With ERMS ("enhanced rep movsb"), the
+ *   CPU does byte-granular rep movsb as fast as movsq, so we use that, and
+ *   with FSRM it's fast even for short strings.  Otherwise it's movsq, and we
+ *   mop up the tail.
+ * - Big copies (>= X86_STR_NT) use non-temporal stores, since the destination
+ *   won't fit in the cache anyway, and it'd evict everything else on its way.
+ *
+ * We can't use the vector registers in the kernel, since we don't save the
+ * user's FP state on entry.  movnti only needs GPRs.
+ *
+ * The CPU features don't get set until we've been running for a while, so
+ * we start out with the movsq versions, which work everywhere. */
+
+#include <arch/arch.h>
+#include <arch/x86.h>
+#include <cpu_feat.h>
+#include <string.h>
+
+#define X86_STR_SMALL			64
+#define X86_STR_FSRM_SMALL		16
+#define X86_STR_NT				(256 * 1024)
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) u64_ua;
+typedef uint32_t __attribute__((may_alias, aligned(1))) u32_ua;
+typedef uint16_t __attribute__((may_alias, aligned(1))) u16_ua;
+
+/* n < X86_STR_SMALL.  The loads all happen before the stores, so this works
+ * for any overlap, though memcpy() callers shouldn't care. */
+static void memcpy_small(char *d, const char *s, size_t n)
+{
+	uint64_t a, b, c, e, f, g, h, i;
+
+	if (n >= 32) {
+		a = *(u64_ua*)s;
+		b = *(u64_ua*)(s + 8);
+		c = *(u64_ua*)(s + 16);
+		e = *(u64_ua*)(s + 24);
+		f = *(u64_ua*)(s + n - 32);
+		g = *(u64_ua*)(s + n - 24);
+		h = *(u64_ua*)(s + n - 16);
+		i = *(u64_ua*)(s + n - 8);
+		*(u64_ua*)d = a;
+		*(u64_ua*)(d + 8) = b;
+		*(u64_ua*)(d + 16) = c;
+		*(u64_ua*)(d + 24) = e;
+		*(u64_ua*)(d + n - 32) = f;
+		*(u64_ua*)(d + n - 24) = g;
+		*(u64_ua*)(d + n - 16) = h;
+		*(u64_ua*)(d + n - 8) = i;
+	} else if (n >= 16) {
+		a = *(u64_ua*)s;
+		b = *(u64_ua*)(s + 8);
+		h = *(u64_ua*)(s + n - 16);
+		i = *(u64_ua*)(s + n - 8);
+		*(u64_ua*)d = a;
+		*(u64_ua*)(d + 8) = b;
+		*(u64_ua*)(d + n - 16) = h;
+		*(u64_ua*)(d + n - 8) = i;
+	} else if (n >= 8) {
+		a = *(u64_ua*)s;
+		i = *(u64_ua*)(s + n - 8);
+		*(u64_ua*)d = a;
+		*(u64_ua*)(d + n - 8) = i;
+	} else if (n >= 4) {
+		a = *(u32_ua*)s;
+		i = *(u32_ua*)(s + n - 4);
+		*(u32_ua*)d = a;
+		*(u32_ua*)(d + n - 4) = i;
+	} else if (n >= 2) {
+		a = *(u16_ua*)s;
+		i = *(u16_ua*)(s + n - 2);
+		*(u16_ua*)d = a;
+		*(u16_ua*)(d + n - 2) = i;
+	} else if (n) {
+		*d = *s;
+	}
+}
+
+static void rep_movsb(void *d, const void *s, size_t n)
+{
+	asm volatile("rep movsb"
+	             : "+D" (d), "+S" (s), "+c" (n)
+	             : : "memory");
+}
+
+static void rep_movsq(void *d, const void *s, size_t n)
+{
+	size_t nr_q = n / 8;
+
+	asm volatile("rep movsq"
+	             : "+D" (d), "+S" (s), "+c" (nr_q)
+	             : : "memory");
+	/* d and s were advanced past the words */
+	memcpy_small(d, s, n % 8);
+}
+
+static inline void movnti(void *d, uint64_t val)
+{
+	asm volatile("movnti %1, %0" : "=m" (*(u64_ua*)d) : "r" (val));
+}
+
+/* Streams whole cache lines around the cache, with the ragged ends done the
+ * usual way. */
+static void memcpy_nt(char *d, const char *s, size_t n)
+{
+	size_t head = -(uintptr_t)d & (ARCH_CL_SIZE - 1);
+	uint64_t a, b, c, e;
+
+	rep_movsq(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	for (; n >= ARCH_CL_SIZE; n -= ARCH_CL_SIZE) {
+		for (int j = 0; j < ARCH_CL_SIZE; j += 32) {
+			a = *(u64_ua*)(s + j);
+			b = *(u64_ua*)(s + j + 8);
+			c = *(u64_ua*)(s + j + 16);
+			e = *(u64_ua*)(s + j + 24);
+			movnti(d + j, a);
+			movnti(d + j + 8, b);
+			movnti(d + j + 16, c);
+			movnti(d + j + 24, e);
+		}
+		d += ARCH_CL_SIZE;
+		s += ARCH_CL_SIZE;
+	}
+	/* NT stores are weakly ordered; the caller expects normal ones */
+	asm volatile("sfence" : : : "memory");
+	rep_movsq(d, s, n);
+}
+
+void *__arch_memcpy(void *dst, const void *src, size_t n)
+{
+	if (n < X86_STR_SMALL) {
+		if (n >= X86_STR_FSRM_SMALL && cpu_has_feat(CPU_FEAT_X86_FSRM))
+			rep_movsb(dst, src, n);
+		else
+			memcpy_small(dst, src, n);
+	} else if (n >= X86_STR_NT) {
+		memcpy_nt(dst, src, n);
+	} else if (cpu_has_feat(CPU_FEAT_X86_ERMS)) {
+		rep_movsb(dst, src, n);
+	} else {
+		rep_movsq(dst, src, n);
+	}
+	return dst;
+}
+
+static void memset_small(char *d, uint64_t c8, size_t n)
+{
+	if (n >= 32) {
+		*(u64_ua*)d = c8;
+		*(u64_ua*)(d + 8) = c8;
+		*(u64_ua*)(d + 16) = c8;
+		*(u64_ua*)(d + 24) = c8;
+		*(u64_ua*)(d + n - 32) = c8;
+		*(u64_ua*)(d + n - 24) = c8;
+		*(u64_ua*)(d + n - 16) = c8;
+		*(u64_ua*)(d + n - 8) = c8;
+	} else if (n >= 16) {
+		*(u64_ua*)d = c8;
+		*(u64_ua*)(d + 8) = c8;
+		*(u64_ua*)(d + n - 16) = c8;
+		*(u64_ua*)(d + n - 8) = c8;
+	} else if (n >= 8) {
+		*(u64_ua*)d = c8;
+		*(u64_ua*)(d + n - 8) = c8;
+	} else if (n >= 4) {
+		*(u32_ua*)d = c8;
+		*(u32_ua*)(d + n - 4) = c8;
+	} else if (n >= 2) {
+		*(u16_ua*)d = c8;
+		*(u16_ua*)(d + n - 2) = c8;
+	} else if (n) {
+		*d = c8;
+	}
+}
+
+void *__arch_memset(void *dst, int c, size_t n)
+{
+	uint64_t c8 = (uint8_t)c * 0x0101010101010101ULL;
+	void *d = dst;
+	size_t nr_q;
+
+	if (n < X86_STR_SMALL) {
+		memset_small(dst, c8, n);
+	} else if (cpu_has_feat(CPU_FEAT_X86_ERMS)) {
+		asm volatile("rep stosb"
+		             : "+D" (d), "+c" (n)
+		             : "a" (c)
+		             : "memory");
+	} else {
+		nr_q = n / 8;
+		asm volatile("rep stosq"
+		             : "+D" (d), "+c" (nr_q)
+		             : "a" (c8)
+		             : "memory");
+		memset_small(d, c8, n % 8);
+	}
+	return dst;
+}
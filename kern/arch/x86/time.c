@@ -9,6 +9,7 @@
 #include <arch/pic.h>
 #include <arch/apic.h>
 #include <time.h>
+#include <cpu_feat.h>
 #include <trap.h>
 #include <assert.h>
 #include <stdio.h>
@@ -142,5 +143,28 @@ void set_core_timer(uint32_t usec, bool periodic)
 	if (usec)
 		lapic_set_timer(usec, periodic);
 	else
-		lapic_disable_timer();
+		lapic_disarm_timer();
+}
+
+static bool use_tsc_deadline(void)
+{
+#ifdef CONFIG_LOUSY_LAPIC_TIMER
+	/* The lousy timer needs to be periodic */
+	return FALSE;
+#endif
+	return cpu_has_feat(CPU_FEAT_X86_TSC_DEADLINE);
+}
+
+void set_core_timer_deadline(uint64_t deadline)
+{
+	uint64_t now, rel_usec;
+
+	if (use_tsc_deadline()) {
+		lapic_set_tsc_deadline(deadline);
+		return;
+	}
+	/* For times in the past, we just need to make sure it goes off. */
+	now = read_tsc();
+	rel_usec = deadline <= now ? 1 : MAX(tsc2usec(deadline - now), 1);
+	set_core_timer(MIN(rel_usec, UINT32_MAX), FALSE);
 }
@@ -12,6 +12,7 @@
 #include <arch/arch.h>
 #include <arch/apic.h>
 #include <arch/topology.h>
+#include <ros/procinfo.h>
 
 struct topology_info cpu_topology_info;
 int *os_coreid_lookup;
@@ -93,6 +94,17 @@ static int find_numa_domain(int apic_id)
 	return -1;
 }
 
+/* Returns the (squashed) numa_id of the cores in the given SRAT proximity
+ * domain, or -1 if no cores are in it. */
+int numa_domain_to_id(int dom)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (find_numa_domain(core_list[i].apic_id) == dom)
+			return core_list[i].numa_id;
+	}
+	return -1;
+}
+
 /* Figure out the maximum number of cores we actually have and set it in our
  * cpu_topology_info struct. */
 static void set_num_cores(void)
@@ -327,6 +339,18 @@ static void build_flat_topology(void)
 	set_remaining_topology_info();
 }
 
+/* Tells userspace where each core is. */
+static void export_topology(void)
+{
+	__proc_global_info.nr_sockets = num_sockets;
+	__proc_global_info.nr_numa = num_numa;
+	for (int i = 0; i < num_cores; i++) {
+		__proc_global_info.core_socket[i] = core_list[i].socket_id;
+		__proc_global_info.core_numa[i] = core_list[i].numa_id;
+		__proc_global_info.core_cpu[i] = core_list[i].cpu_id;
+	}
+}
+
 void topology_init(void)
 {
 	uint32_t eax, ebx, ecx, edx;
@@ -355,6 +379,7 @@ void topology_init(void)
 		build_topology(core_bits, cpu_bits);
 	else
 		build_flat_topology();
+	export_topology();
 }
 
 void print_cpu_topology()
@@ -38,6 +38,7 @@ extern int *os_coreid_lookup;
 
 void topology_init();
 void print_cpu_topology();
+int numa_domain_to_id(int dom);
 
 static inline int get_hw_coreid(uint32_t coreid)
 {
@@ -20,6 +20,7 @@
 #include <ex_table.h>
 #include <arch/mptables.h>
 #include <ros/procinfo.h>
+#include <corerequest.h>
 
 enum {
 	NMI_NORMAL_OPN = 0,
@@ -37,6 +38,9 @@ pseudodesc_t idt_pd;
  * given IRQ.  Modification requires holding the lock (TODO: RCU) */
 struct irq_handler *irq_handlers[NUM_IRQS];
 spinlock_t irq_handler_wlock = SPINLOCK_INITIALIZER_IRQSAVE;
+/* How many routable vectors are on each core, under irq_handler_wlock */
+static unsigned int irqs_on_core[MAX_NUM_CORES];
+static int irq_next_spread_idx;
 
 static bool try_handle_exception_fixup(struct hw_trapframe *hw_tf)
 {
@@ -594,6 +598,7 @@ static void trap_dispatch(struct hw_trapframe *hw_tf)
 			handled = try_handle_exception_fixup(hw_tf);
 			break;
 		case T_SYSCALL:
+			__set_cpu_state(&per_cpu_info[core_id()], CPU_STATE_SYSCALL);
 			enable_irq();
 			// check for userspace, for now
 			assert(hw_tf->tf_cs != GD_KT);
@@ -696,7 +701,7 @@ static void irq_dispatch(struct hw_trapframe *hw_tf)
 	struct irq_handler *irq_h;
 
 	if (!in_irq_ctx(pcpui))
-		__set_cpu_state(pcpui, CPU_STATE_IRQ);
+		__cpu_state_irq_enter(pcpui);
 	inc_irq_depth(pcpui);
 	//if (core_id())
 	if (hw_tf->tf_trapno != IdtLAPIC_TIMER)	/* timer irq */
@@ -736,7 +741,7 @@ static void irq_dispatch(struct hw_trapframe *hw_tf)
 out_no_eoi:
 	dec_irq_depth(pcpui);
 	if (!in_irq_ctx(pcpui))
-		__set_cpu_state(pcpui, CPU_STATE_KERNEL);
+		__cpu_state_irq_exit(pcpui);
 }
 
 /* Note IRQs are disabled unless explicitly turned on.
@@ -785,12 +790,24 @@ int register_irq(int irq, isr_t handler, void *irq_arg, uint32_t tbdf)
 	irq_h->isr = handler;
 	irq_h->data = irq_arg;
 	irq_h->apic_vector = vector;
+	/* bus_irq_setup() sends the routable ones to core 0 */
+	irq_h->os_coreid = irq_h->route_irq ? 0 : -1;
+	irq_h->spread_idx = -1;
 	/* RCU write lock */
 	spin_lock_irqsave(&irq_handler_wlock);
 	irq_h->next = irq_handlers[vector];
 	wmb();	/* make sure irq_h is done before publishing to readers */
 	irq_handlers[vector] = irq_h;
+	if (irq_h->route_irq)
+		irqs_on_core[0]++;
 	spin_unlock_irqsave(&irq_handler_wlock);
+	/* MSI and MSI-X vectors are all for PCI devices that want their own
+	 * vector, so we spread them over the cores instead of piling them all on
+	 * core 0.  Legacy IOAPIC IRQs (the console, etc) stay on core 0.
+	 * Multiqueue drivers reroute their queues with their own indexes. */
+	if (irq_h->route_irq && strcmp(irq_h->type, "ioapic"))
+		route_irqs_spread(vector, __sync_fetch_and_add(&irq_next_spread_idx,
+		                                               1));
 	/* Most IRQs other than the BusIPI should need their irq unmasked.
 	 * Might need to pass the irq_h, in case unmask needs more info.
 	 * The lapic IRQs need to be unmasked on a per-core basis */
@@ -820,16 +837,21 @@ static int route_irq_h(struct irq_handler *irq_h, int os_coreid)
 		return -1;
 	}
 	irq_h->route_irq(irq_h, irq_h->apic_vector, hw_coreid);
+	if (irq_h->os_coreid >= 0)
+		irqs_on_core[irq_h->os_coreid]--;
+	irqs_on_core[os_coreid]++;
+	irq_h->os_coreid = os_coreid;
 	return 0;
 }
 
-/* Routes all irqs for a given apic_vector to os_coreid.  Returns 0 if all of
- * them succeeded.  -1 if there were none or if any of them failed.  We don't
- * share IRQs often (if ever anymore), so this shouldn't be an issue. */
-int route_irqs(int apic_vec, int os_coreid)
+/* Routes every irq_h on apic_vec to os_coreid, and sets their affinity.  A
+ * spread_idx of -1 leaves theirs alone.  Hold irq_handler_wlock. */
+static int __route_irqs(int apic_vec, int os_coreid, int spread_idx,
+                        bool pinned)
 {
 	struct irq_handler *irq_h;
 	int ret = -1;
+
 	if (!vector_is_irq(apic_vec)) {
 		printk("[kernel] vector %d is not an IRQ vector!\n", apic_vec);
 		return -1;
@@ -838,11 +860,177 @@ int route_irqs(int apic_vec, int os_coreid)
 	while (irq_h) {
 		assert(irq_h->apic_vector == apic_vec);
 		ret = route_irq_h(irq_h, os_coreid);
+		if (!ret) {
+			if (spread_idx >= 0)
+				irq_h->spread_idx = spread_idx;
+			irq_h->pinned = pinned;
+		}
 		irq_h = irq_h->next;
 	}
 	return ret;
 }
 
+/* Routes all irqs for a given apic_vector to os_coreid.  Returns 0 if all of
+ * them succeeded.  -1 if there were none or if any of them failed.  We don't
+ * share IRQs often (if ever anymore), so this shouldn't be an issue.
+ *
+ * The vector is pinned: it stays on os_coreid, even if an MCP gets that core,
+ * until someone calls unpin_irqs(). */
+int route_irqs(int apic_vec, int os_coreid)
+{
+	int ret;
+
+	spin_lock_irqsave(&irq_handler_wlock);
+	ret = __route_irqs(apic_vec, os_coreid, -1, TRUE);
+	spin_unlock_irqsave(&irq_handler_wlock);
+	return ret;
+}
+
+static bool core_is_mcps(int coreid)
+{
+	extern struct sched_pcore *all_pcores;
+
+	return all_pcores && get_alloc_proc(coreid);
+}
+
+/* The core for the idx'th vector of a set, like a NIC's queues: each gets its
+ * own core, round-robin, out of the cores that aren't core 0 and that no MCP
+ * has right now.  Core 0 takes the rest of the IRQs, and MCPs shouldn't get
+ * interrupted by the kernel's IRQs.  If there aren't any such cores, it's core
+ * 0. */
+int irq_spread_core(int idx)
+{
+	int nr = 0;
+
+	for (int i = 1; i < num_cores; i++)
+		nr += !core_is_mcps(i);
+	if (!nr)
+		return 0;
+	idx %= nr;
+	for (int i = 1; i < num_cores; i++) {
+		if (!core_is_mcps(i) && !idx--)
+			return i;
+	}
+	return 0;
+}
+
+static int __route_irqs_spread(int apic_vec, int idx)
+{
+	return __route_irqs(apic_vec, irq_spread_core(idx), idx, FALSE);
+}
+
+/* Routes apic_vec to the idx'th core of irq_spread_core(), and keeps it there
+ * until the spread changes: when an MCP gets its core, irq_rebalance() moves
+ * it.  An explicit route_irqs() overrides this. */
+int route_irqs_spread(int apic_vec, int idx)
+{
+	int ret;
+
+	spin_lock_irqsave(&irq_handler_wlock);
+	ret = __route_irqs_spread(apic_vec, idx);
+	spin_unlock_irqsave(&irq_handler_wlock);
+	return ret;
+}
+
+/* Undoes a route_irqs(): apic_vec goes back to being spread, in its old spot
+ * if it had one. */
+int unpin_irqs(int apic_vec)
+{
+	struct irq_handler *irq_h;
+	int idx, ret;
+
+	if (!vector_is_irq(apic_vec))
+		return -1;
+	spin_lock_irqsave(&irq_handler_wlock);
+	irq_h = irq_handlers[apic_vec];
+	if (!irq_h) {
+		spin_unlock_irqsave(&irq_handler_wlock);
+		return -1;
+	}
+	idx = irq_h->spread_idx;
+	if (idx < 0)
+		idx = __sync_fetch_and_add(&irq_next_spread_idx, 1);
+	ret = __route_irqs_spread(apic_vec, idx);
+	spin_unlock_irqsave(&irq_handler_wlock);
+	return ret;
+}
+
+/* Moves the spread vectors to where irq_spread_core() says they go now.  The
+ * pinned ones stay put. */
+void irq_rebalance(void)
+{
+	struct irq_handler *irq_h;
+
+	spin_lock_irqsave(&irq_handler_wlock);
+	for (int i = 0; i < NUM_IRQS; i++) {
+		irq_h = irq_handlers[i];
+		if (!irq_h || !irq_h->route_irq || irq_h->pinned ||
+		    (irq_h->spread_idx < 0))
+			continue;
+		if (irq_h->os_coreid != irq_spread_core(irq_h->spread_idx))
+			__route_irqs_spread(i, irq_h->spread_idx);
+	}
+	spin_unlock_irqsave(&irq_handler_wlock);
+}
+
+static void __irq_rebalance_kmsg(uint32_t srcid, long a0, long a1, long a2)
+{
+	irq_rebalance();
+}
+
+/* The ksched gave coreid to an MCP.  We're holding its lock, so if there are
+ * any IRQs on coreid, we move them later. */
+void irq_core_allocated(uint32_t coreid)
+{
+	if (!ACCESS_ONCE(irqs_on_core[coreid]))
+		return;
+	send_kernel_message(core_id(), __irq_rebalance_kmsg, 0, 0, 0,
+	                    KMSG_ROUTINE);
+}
+
+/* Prints a line for each routable vector into buf, returning the length. */
+size_t irq_affinity_print(char *buf, size_t len)
+{
+	struct irq_handler *irq_h;
+	size_t off = 0;
+
+	spin_lock_irqsave(&irq_handler_wlock);
+	for (int i = 0; i < NUM_IRQS; i++) {
+		irq_h = irq_handlers[i];
+		if (!irq_h || !irq_h->route_irq)
+			continue;
+		off += snprintf(buf + off, len - off, "%3d %3d %-6s %08x %s\n", i,
+		                irq_h->os_coreid, irq_h->type, irq_h->tbdf,
+		                irq_h->pinned ? "pinned" :
+		                irq_h->spread_idx >= 0 ? "spread" : "boot");
+		if (off >= len)
+			break;
+	}
+	spin_unlock_irqsave(&irq_handler_wlock);
+	return MIN(off, len);
+}
+
+/* Returns the vector register_irq() gave handler and irq_arg, or -1.  Drivers
+ * that register one IRQ per queue use this to route each vector with
+ * route_irqs(). */
+int get_irq_vector(isr_t handler, void *irq_arg)
+{
+	struct irq_handler *irq_h;
+	int ret = -1;
+
+	spin_lock_irqsave(&irq_handler_wlock);
+	for (int i = 0; i < NUM_IRQS && ret < 0; i++) {
+		for (irq_h = irq_handlers[i]; irq_h; irq_h = irq_h->next) {
+			if ((irq_h->isr == handler) && (irq_h->data == irq_arg)) {
+				ret = irq_h->apic_vector;
+				break;
+			}
+		}
+	}
+	spin_unlock_irqsave(&irq_handler_wlock);
+	return ret;
+}
+
 /* It's a moderate pain in the ass to put these in bit-specific files (header
  * hell with the set_current_ helpers) */
 void sysenter_callwrapper(struct syscall *sysc, unsigned long count,
@@ -850,7 +1038,7 @@ void sysenter_callwrapper(struct syscall *sysc, unsigned long count,
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	set_current_ctx_sw(pcpui, sw_tf);
-	__set_cpu_state(pcpui, CPU_STATE_KERNEL);
+	__set_cpu_state(pcpui, CPU_STATE_SYSCALL);
 	/* Once we've set_current_ctx, we can enable interrupts.  This used to be
 	 * mandatory (we had immediate KMSGs that would muck with cur_ctx).  Now it
 	 * should only help for sanity/debugging. */
@@ -1034,7 +1222,9 @@ static bool handle_vmexit_xsetbv(struct vm_trapframe *tf)
 	return TRUE;
 }
 
-static void vmexit_dispatch(struct vm_trapframe *tf)
+/* Returns TRUE if we handled the exit in the kernel, FALSE if we reflected it
+ * (or killed the process trying). */
+static bool vmexit_dispatch(struct vm_trapframe *tf)
 {
 	bool handled = FALSE;
 
@@ -1059,7 +1249,7 @@ static void vmexit_dispatch(struct vm_trapframe *tf)
 		handled = handle_vmexit_cpuid(tf);
 		break;
 	case EXIT_REASON_EPT_VIOLATION:
-		handled = handle_vmexit_ept_fault(tf);
+		handled = vhost_net_notify(tf) || handle_vmexit_ept_fault(tf);
 		break;
 	case EXIT_REASON_EXCEPTION_NMI:
 		handled = handle_vmexit_nmi(tf);
@@ -1088,11 +1278,15 @@ static void vmexit_dispatch(struct vm_trapframe *tf)
 			proc_destroy(current);
 		}
 	}
+	return handled;
 }
 
 void handle_vmexit(struct vm_trapframe *tf)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	uint64_t start = read_tsc();
+	unsigned int reason;
+	bool handled;
 
 	tf->tf_rip = vmcs_read(GUEST_RIP);
 	tf->tf_rflags = vmcs_read(GUEST_RFLAGS);
@@ -1111,7 +1305,10 @@ void handle_vmexit(struct vm_trapframe *tf)
 
 	set_current_ctx_vm(pcpui, tf);
 	tf = &pcpui->cur_ctx->tf.vm_tf;
-	vmexit_dispatch(tf);
+	/* Reflecting the exit can change cur_ctx, so grab the reason first. */
+	reason = tf->tf_exit_reason;
+	handled = vmexit_dispatch(tf);
+	vmexit_account(reason, read_tsc() - start, !handled);
 	/* We're either restarting a partial VM ctx (vmcs was launched, loaded on
 	 * the core, etc) or a SW vc ctx for the reflected trap.  Or the proc is
 	 * dying and we'll handle a __death KMSG shortly. */
@@ -143,6 +143,11 @@ struct irq_handler {
 	int tbdf;
 	int dev_irq;
 
+	/* Affinity, under irq_handler_wlock.  See route_irqs_spread(). */
+	int os_coreid;				/* where it's routed, or -1 */
+	int spread_idx;				/* which of a spread set, or -1 */
+	bool pinned;				/* someone asked for os_coreid */
+
 	void *dev_private;
 	char *type;
 	#define IRQ_NAME_LEN 26
@@ -154,6 +159,8 @@ extern gatedesc_t idt[];
 extern pseudodesc_t idt_pd;
 extern taskstate_t ts;
 int bus_irq_setup(struct irq_handler *irq_h);	/* ioapic.c */
+size_t irq_affinity_print(char *buf, size_t len);
+int unpin_irqs(int apic_vec);
 extern const char *x86_trapname(int trapno);
 extern void sysenter_handler(void);
 
@@ -208,6 +215,44 @@ static inline void save_fp_state(struct ancillary_state *silly)
 	}
 }
 
+/* Whether the FPU is in its initial configuration, i.e. x86_default_fpu.  This
+ * is XINUSE (XGETBV with ECX = 1), which has a bit for each state component
+ * that isn't in its init state.  XINUSE doesn't cover the MXCSR, so we check
+ * that too.  Without XINUSE, we have to assume it's in use. */
+static inline bool fp_state_is_init(void)
+{
+	uint32_t eax, edx, mxcsr;
+
+	if (!cpu_has_feat(CPU_FEAT_X86_XINUSE))
+		return FALSE;
+	asm volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(1));
+	if (((uint64_t)edx << 32 | eax) & __proc_global_info.x86_default_xcr0)
+		return FALSE;
+	asm volatile("stmxcsr %0" : "=m"(mxcsr));
+	return mxcsr == x86_default_fpu.fp_head_64d.mxcsr;
+}
+
+/* Saves the initial configuration, without reading the FPU.  Only use this if
+ * fp_state_is_init().  XRSTOR initializes every component that isn't in
+ * xstate_bv, and only takes the MXCSR from the legacy region, so we don't need
+ * to write out the rest of it.  (fsw is for restore_fp_state()'s AMD check.) */
+static inline void save_fp_state_init(struct ancillary_state *silly)
+{
+	silly->fp_head_64d.fcw = x86_default_fpu.fp_head_64d.fcw;
+	silly->fp_head_64d.fsw = 0;
+	silly->fp_head_64d.mxcsr = x86_default_fpu.fp_head_64d.mxcsr;
+	silly->xstate_bv = 0;
+}
+
+/* Whether restoring silly would put the FPU in its initial configuration. */
+static inline bool fp_state_saved_is_init(struct ancillary_state *silly)
+{
+	if (!cpu_has_feat(CPU_FEAT_X86_XINUSE))
+		return FALSE;
+	return !(silly->xstate_bv & __proc_global_info.x86_default_xcr0) &&
+	       (silly->fp_head_64d.mxcsr == x86_default_fpu.fp_head_64d.mxcsr);
+}
+
 static inline void init_fp_state(void);
 static inline void restore_fp_state(struct ancillary_state *silly)
 {
@@ -289,6 +334,12 @@ static inline void init_fp_state(void)
 	restore_fp_state(&x86_default_fpu);
 }
 
+/* Lets the kernel use the FPU and XMM registers until kfpu_end(), with IRQs
+ * off.  Don't block in between.  If this returns FALSE, don't use the FPU and
+ * don't call kfpu_end(). */
+bool kfpu_begin(void);
+void kfpu_end(void);
+
 static inline void __attribute__((always_inline))
 set_stack_pointer(uintptr_t sp)
 {
@@ -0,0 +1,315 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Uncore PMU boxes on SNB-EP and IVB-EP: the CBos (one per LLC slice, in
+ * MSRs), the memory controller channels (IMC) and the QPI links (both in PCI
+ * config space).  Each box has four 48 bit counters.  We don't reset counters
+ * on open; we note where they started and report the difference, so that
+ * events from different sessions can share a box.  A CBo has one filter for
+ * all of its counters; events that want different filters can't share.
+ *
+ * We find the PCI boxes by device ID.  There's one of each ID per socket, and
+ * we assume they come in socket order on the PCI buses, which is how the BIOS
+ * numbers them on the machines we've seen.  Linux gets this from the UBox's
+ * node ID registers; we can do that if it ever matters. */
+
+#include <arch/uncore.h>
+#include <arch/x86.h>
+#include <arch/msr.h>
+#include <arch/pci.h>
+#include <arch/topology.h>
+#include <ros/errno.h>
+#include <cpu_feat.h>
+#include <assert.h>
+#include <kmalloc.h>
+#include <atomic.h>
+#include <time.h>
+
+#define UNC_NR_COUNTERS 4
+#define UNC_CTR_MASK ((1ULL << 48) - 1)
+#define UNC_MAX_CBOS 15
+#define UNC_MAX_IMCS 8
+#define UNC_MAX_QPIS 3
+
+#define UNC_BOX_CTL_RST_CTRL (1 << 0)
+#define UNC_BOX_CTL_RST_CTRS (1 << 1)
+
+/* The event select bits we pass through: event, umask, edge, enable, invert
+ * and threshold.  QPI also has an extended event bit. */
+#define UNC_CTL_MASK 0xffc4ffffULL
+#define UNC_QPI_CTL_MASK (UNC_CTL_MASK | (1 << 21))
+
+/* CBo MSRs, relative to the box's base */
+#define UNC_CBO_MSR_BASE 0xd00
+#define UNC_CBO_MSR_STRIDE 0x20
+#define UNC_CBO_BOX_CTL 0x04
+#define UNC_CBO_CTL0 0x10
+#define UNC_CBO_FILTER 0x14
+#define UNC_CBO_CTR0 0x16
+#define UNC_CBO_FILTER1 0x1a	/* IVB-EP only: the upper 32 filter bits */
+
+/* PCI boxes' config space */
+#define UNC_PCI_BOX_CTL 0xf4
+#define UNC_PCI_CTL0 0xd8
+#define UNC_PCI_CTR0 0xa0
+
+struct uncore_box {
+	bool present;
+	uint8_t type;
+	uint32_t msr_base;
+	struct pci_device *pcidev;
+	uint8_t in_use;				/* bitmask of counters */
+	uint8_t filtered;			/* counters using the filter */
+	uint64_t filter;
+	uint64_t start[UNC_NR_COUNTERS];
+	uint64_t start_ts[UNC_NR_COUNTERS];
+};
+
+struct uncore_socket {
+	spinlock_t lock;
+	struct uncore_box cbo[UNC_MAX_CBOS];
+	struct uncore_box imc[UNC_MAX_IMCS];
+	struct uncore_box qpi[UNC_MAX_QPIS];
+};
+
+struct uncore_model {
+	uint32_t model;
+	unsigned int max_cbos;
+	bool cbo_filter1;
+	uint16_t imc_dids[UNC_MAX_IMCS];
+	uint16_t qpi_dids[UNC_MAX_QPIS];
+};
+
+static const struct uncore_model uncore_models[] = {
+	{	/* SNB-EP */
+		.model = 45,
+		.max_cbos = 8,
+		.imc_dids = {0x3cb0, 0x3cb1, 0x3cb4, 0x3cb5},
+		.qpi_dids = {0x3c41, 0x3c42},
+	},
+	{	/* IVB-EP */
+		.model = 62,
+		.max_cbos = 15,
+		.cbo_filter1 = TRUE,
+		.imc_dids = {0x0eb4, 0x0eb5, 0x0eb0, 0x0eb1,
+		             0x0ef4, 0x0ef5, 0x0ef0, 0x0ef1},
+		.qpi_dids = {0x0e32, 0x0e33, 0x0e3a},
+	},
+};
+
+static const struct uncore_model *uncore_model;
+static struct uncore_socket *uncore_sockets;
+
+static int uncore_socket_id(void)
+{
+	return cpu_topology_info.core_list[core_id()].socket_id;
+}
+
+static struct uncore_box *uncore_socket_box(struct uncore_socket *us,
+                                            unsigned int type, unsigned int idx)
+{
+	switch (type) {
+	case PERFMON_UNC_BOX_CBO:
+		return idx < UNC_MAX_CBOS ? &us->cbo[idx] : 0;
+	case PERFMON_UNC_BOX_IMC:
+		return idx < UNC_MAX_IMCS ? &us->imc[idx] : 0;
+	case PERFMON_UNC_BOX_QPI:
+		return idx < UNC_MAX_QPIS ? &us->qpi[idx] : 0;
+	}
+	return 0;
+}
+
+/* Gives the nth device with did, in PCI bus order, to socket n's box. */
+static void uncore_find_pci_boxes(uint16_t did, uint8_t type, unsigned int idx)
+{
+	struct pci_device *pcidev;
+	struct uncore_box *box;
+	int socket = 0;
+
+	if (!did)
+		return;
+	STAILQ_FOREACH(pcidev, &pci_devices, all_dev) {
+		if (socket >= cpu_topology_info.num_sockets)
+			break;
+		if ((pci_get_vendor(pcidev) != 0x8086) ||
+		    (pci_get_device(pcidev) != did))
+			continue;
+		box = uncore_socket_box(&uncore_sockets[socket], type, idx);
+		box->present = TRUE;
+		box->type = type;
+		box->pcidev = pcidev;
+		socket++;
+	}
+}
+
+void uncore_init(void)
+{
+	uint32_t eax, family, model;
+	unsigned int nr_cbos;
+	struct uncore_socket *us;
+
+	if (!cpu_has_feat(CPU_FEAT_X86_VENDOR_INTEL))
+		return;
+	cpuid(1, 0, &eax, 0, 0, 0);
+	family = ((eax & 0x0FF00000) >> 20) + ((eax & 0x00000F00) >> 8);
+	model = ((eax & 0x000F0000) >> 16) + ((eax & 0x000000F0) >> 4);
+	if (family != 6)
+		return;
+	for (int i = 0; i < ARRAY_SIZE(uncore_models); i++) {
+		if (uncore_models[i].model == model)
+			uncore_model = &uncore_models[i];
+	}
+	if (!uncore_model)
+		return;
+	uncore_sockets = kzmalloc(cpu_topology_info.num_sockets *
+	                          sizeof(struct uncore_socket), MEM_WAIT);
+	/* One CBo per physical core */
+	nr_cbos = MIN(cpu_topology_info.cpus_per_socket, uncore_model->max_cbos);
+	for (int i = 0; i < cpu_topology_info.num_sockets; i++) {
+		us = &uncore_sockets[i];
+		spinlock_init_irqsave(&us->lock);
+		for (int j = 0; j < nr_cbos; j++) {
+			us->cbo[j].present = TRUE;
+			us->cbo[j].type = PERFMON_UNC_BOX_CBO;
+			us->cbo[j].msr_base = UNC_CBO_MSR_BASE + j * UNC_CBO_MSR_STRIDE;
+		}
+	}
+	for (int j = 0; j < UNC_MAX_IMCS; j++)
+		uncore_find_pci_boxes(uncore_model->imc_dids[j], PERFMON_UNC_BOX_IMC,
+		                      j);
+	for (int j = 0; j < UNC_MAX_QPIS; j++)
+		uncore_find_pci_boxes(uncore_model->qpi_dids[j], PERFMON_UNC_BOX_QPI,
+		                      j);
+}
+
+/* Returns this socket's box for pev, or 0 if there isn't one. */
+static struct uncore_box *uncore_lookup_box(const struct perfmon_event *pev)
+{
+	struct uncore_box *box;
+
+	if (!uncore_model)
+		return 0;
+	box = uncore_socket_box(&uncore_sockets[uncore_socket_id()],
+	                        PMFL_GET_UNC_BOX(pev->flags),
+	                        PMFL_GET_UNC_BOX_IDX(pev->flags));
+	return box && box->present ? box : 0;
+}
+
+static void uncore_write_box_ctl(struct uncore_box *box, uint32_t val)
+{
+	if (box->type == PERFMON_UNC_BOX_CBO)
+		write_msr(box->msr_base + UNC_CBO_BOX_CTL, val);
+	else
+		pcidev_write32(box->pcidev, UNC_PCI_BOX_CTL, val);
+}
+
+static void uncore_write_ctl(struct uncore_box *box, int ctr, uint32_t val)
+{
+	if (box->type == PERFMON_UNC_BOX_CBO)
+		write_msr(box->msr_base + UNC_CBO_CTL0 + ctr, val);
+	else
+		pcidev_write32(box->pcidev, UNC_PCI_CTL0 + ctr * 4, val);
+}
+
+static void uncore_write_filter(struct uncore_box *box, uint64_t filter)
+{
+	write_msr(box->msr_base + UNC_CBO_FILTER, (uint32_t)filter);
+	if (uncore_model->cbo_filter1)
+		write_msr(box->msr_base + UNC_CBO_FILTER1, filter >> 32);
+}
+
+static uint64_t uncore_read_ctr(struct uncore_box *box, int ctr)
+{
+	uint32_t off = UNC_PCI_CTR0 + ctr * 8;
+	uint32_t lo, hi;
+
+	if (box->type == PERFMON_UNC_BOX_CBO)
+		return read_msr(box->msr_base + UNC_CBO_CTR0 + ctr) & UNC_CTR_MASK;
+	/* Config space reads are 32 bits; retry if the low half wrapped. */
+	do {
+		hi = pcidev_read32(box->pcidev, off + 4);
+		lo = pcidev_read32(box->pcidev, off);
+	} while (hi != pcidev_read32(box->pcidev, off + 4));
+	return (((uint64_t)hi << 32) | lo) & UNC_CTR_MASK;
+}
+
+/* Returns the counter index, or a negative error. */
+int uncore_alloc(const struct perfmon_event *pev)
+{
+	struct uncore_box *box = uncore_lookup_box(pev);
+	struct uncore_socket *us;
+	uint64_t filter = pev->trigger_count;
+	uint64_t ctl_mask;
+	int ctr;
+
+	if (!box)
+		return -ENODEV;
+	if (PMEV_GET_INTEN(pev->event) ||
+	    (filter && (box->type != PERFMON_UNC_BOX_CBO)))
+		return -EINVAL;
+	ctl_mask = box->type == PERFMON_UNC_BOX_QPI ? UNC_QPI_CTL_MASK
+	                                            : UNC_CTL_MASK;
+	us = &uncore_sockets[uncore_socket_id()];
+	spin_lock_irqsave(&us->lock);
+	if (filter && box->filtered && (box->filter != filter)) {
+		ctr = -EBUSY;
+		goto out;
+	}
+	for (ctr = 0; ctr < UNC_NR_COUNTERS; ctr++) {
+		if (!(box->in_use & (1 << ctr)))
+			break;
+	}
+	if (ctr == UNC_NR_COUNTERS) {
+		ctr = -ENOSPC;
+		goto out;
+	}
+	/* The first user of a box resets it, which also unfreezes it. */
+	if (!box->in_use)
+		uncore_write_box_ctl(box, UNC_BOX_CTL_RST_CTRL | UNC_BOX_CTL_RST_CTRS);
+	if (filter) {
+		if (!box->filtered) {
+			box->filter = filter;
+			uncore_write_filter(box, filter);
+		}
+		box->filtered |= 1 << ctr;
+	}
+	box->in_use |= 1 << ctr;
+	uncore_write_ctl(box, ctr, pev->event & ctl_mask);
+	box->start[ctr] = uncore_read_ctr(box, ctr);
+	box->start_ts[ctr] = nsec();
+out:
+	spin_unlock_irqsave(&us->lock);
+	return ctr;
+}
+
+int uncore_free(const struct perfmon_event *pev, int ctr)
+{
+	struct uncore_box *box = uncore_lookup_box(pev);
+	struct uncore_socket *us;
+
+	if (!box || (ctr < 0) || (ctr >= UNC_NR_COUNTERS) ||
+	    !(box->in_use & (1 << ctr)))
+		return -ENOENT;
+	us = &uncore_sockets[uncore_socket_id()];
+	spin_lock_irqsave(&us->lock);
+	uncore_write_ctl(box, ctr, 0);
+	box->in_use &= ~(1 << ctr);
+	if (box->filtered & (1 << ctr)) {
+		box->filtered &= ~(1 << ctr);
+		if (!box->filtered)
+			uncore_write_filter(box, 0);
+	}
+	spin_unlock_irqsave(&us->lock);
+	return 0;
+}
+
+uint64_t uncore_read(const struct perfmon_event *pev, int ctr,
+                     uint64_t *enabled_ns)
+{
+	struct uncore_box *box = uncore_lookup_box(pev);
+
+	/* perfmon only asks about counters it got from uncore_alloc() */
+	assert(box);
+	*enabled_ns = nsec() - box->start_ts[ctr];
+	return (uncore_read_ctr(box, ctr) - box->start[ctr]) & UNC_CTR_MASK;
+}
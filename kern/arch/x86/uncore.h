@@ -0,0 +1,17 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Uncore PMU boxes on SNB-EP and IVB-EP.  perfmon.c calls these on a core in
+ * the socket whose box the event names.  Counters are identified by their index
+ * within the box. */
+
+#pragma once
+
+#include <sys/types.h>
+#include <arch/ros/perfmon.h>
+
+void uncore_init(void);
+int uncore_alloc(const struct perfmon_event *pev);
+int uncore_free(const struct perfmon_event *pev, int ctr);
+uint64_t uncore_read(const struct perfmon_event *pev, int ctr,
+                     uint64_t *enabled_ns);
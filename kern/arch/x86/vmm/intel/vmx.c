@@ -737,7 +737,8 @@ static void vmx_setup_constant_host_state(void)
 
 	vmcs_writel(HOST_CR0, rcr0() & ~X86_CR0_TS);	/* 22.2.3 */
 	vmcs_writel(HOST_CR4, rcr4());	/* 22.2.3, 22.2.5 */
-	vmcs_writel(HOST_CR3, rcr3());	/* 22.2.3 */
+	/* Without the PCID; see __vmx_setup_pcpu() */
+	vmcs_writel(HOST_CR3, PTE_ADDR(rcr3()));	/* 22.2.3 */
 
 	vmcs_write16(HOST_CS_SELECTOR, GD_KT);	/* 22.2.4 */
 	vmcs_write16(HOST_DS_SELECTOR, GD_KD);	/* 22.2.4 */
@@ -782,6 +783,11 @@ static void __vmx_setup_pcpu(struct guest_pcore *gpc)
 	/* TODO: this is MSR_KERNEL_GS_BASE, the 0'th autoload.  This array API is a
 	 * little dangerous. */
 	gpc->msr_autoload.host[0].value = (uintptr_t)pcpui;
+	/* VM exits load HOST_CR3, which has PCID 0.  arch_pgdir_load() always
+	 * flushes PCID 0 for VMMs, but we might have loaded our page tables with
+	 * a PCID before we became one. */
+	if (PGOFF(rcr3()))
+		lcr3(PTE_ADDR(rcr3()));
 	/* TODO: we might need to also set HOST_IA32_PERF_GLOBAL_CTRL.  Need to
 	 * think about how perf will work with VMs */
 }
@@ -857,7 +863,7 @@ static void vmx_setup_initial_guest_state(struct proc *p,
 				X86_CR0_MP | X86_CR0_ET | X86_CR0_NE);
 	vmcs_writel(CR0_READ_SHADOW, protected_mode | X86_CR0_WP |
 				X86_CR0_MP | X86_CR0_ET | X86_CR0_NE);
-	vmcs_writel(GUEST_CR3, rcr3());
+	vmcs_writel(GUEST_CR3, PTE_ADDR(rcr3()));
 	vmcs_writel(GUEST_CR4, cr4);
 	/* The only bits that matter in this shadow are those that are
 	 * set in CR4_GUEST_HOST_MASK.  TODO: do we need to separate
@@ -1324,7 +1330,10 @@ int intel_vmm_init(void) {
 		kfree(msr_bitmap);
 		return -ENOMEM;
 	}
-	/* FIXME: do we need APIC virtualization (flexpriority?) */
+	/* We run guests with APICv in x2APIC mode: the virtual-APIC page backs the
+	 * x2APIC MSRs, EOIs and vectors are virtualized, and posted IRQs arrive on
+	 * I_POKE_CORE.  That excludes VIRTUALIZE_APIC_ACCESSES (flexpriority),
+	 * which is only for the xAPIC MMIO page. */
 
 	memset(msr_bitmap, 0xff, PAGE_SIZE);
 
@@ -0,0 +1,486 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * In-kernel virtio-net backend.
+ *
+ * Normally, every guest packet goes vmexit -> user VMM -> virtio_net.c ->
+ * syscall into #ether.  With vhost_net, the user VMM only sets things up: it
+ * tells us where the guest's receiveq and transmitq are, hands us its #ether
+ * data fd, and says where the IRQs go (SYS_vmm_vhost_net).  From then on, a
+ * guest write to the device's QueueNotify register is handled entirely in
+ * vmexit_dispatch, and a ktask moves packets between the vrings and the
+ * conversation.  Guest physical addresses are our user virtual addresses, so
+ * the ktask switches to the VMM's address space and uses the usual user copies.
+ *
+ * The vmexit handler can't block, so it just wakes the ktask and skips the
+ * guest's store.  The conversation's input queue wakes the ktask too, through
+ * its qio wake callback.  The ktask holds a ref on the proc; proc_destroy()
+ * tells it to stop, and the memory goes away with the rest of the vmm struct.
+ *
+ * We do one queue pair, without indirect descriptors, offloads, or mergeable
+ * receive buffers, which is all the user VMM offers the guest when it is using
+ * us.  The conversation must be in batch mode (see netif.c), since that is how
+ * the transmit side hands #ether many frames at once. */
+
+#include <assert.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <rendez.h>
+#include <event.h>
+#include <umem.h>
+#include <smp.h>
+#include <process.h>
+#include <ns.h>
+#include <ip.h>
+#include <bitmask.h>
+#include "vmm.h"
+
+#define VHOST_NET_RX			0
+#define VHOST_NET_TX			1
+
+#define VHOST_NET_HDR_SZ		12		/* struct virtio_net_hdr_v1 */
+#define VHOST_NET_MAX_FRAME		1514
+#define VHOST_NET_BATCH_SZ		(64 * 1024)
+#define VHOST_NET_MAX_VRING		32768
+
+/* From the virtio-mmio register layout, virtio-v1.0-cs04 s4.2.2 */
+#define VHOST_MMIO_QUEUE_NOTIFY	0x050
+#define VHOST_MMIO_INT_VRING	0x1
+
+/* The split vring, virtio-v1.0-cs04 s2.4.  The rings are just sets of offsets
+ * from the addresses the driver gave us. */
+struct vring_desc {
+	uint64_t					addr;
+	uint32_t					len;
+	uint16_t					flags;
+	uint16_t					next;
+};
+
+#define VRING_DESC_F_NEXT		1
+#define VRING_DESC_F_WRITE		2
+
+#define VRING_AVAIL_IDX(vr)		((vr)->avail + 2)
+#define VRING_AVAIL_ENT(vr, i)	((vr)->avail + 4 + 2 * ((i) % (vr)->num))
+#define VRING_USED_IDX(vr)		((vr)->used + 2)
+#define VRING_USED_ENT(vr, i)	((vr)->used + 4 + 8 * ((i) % (vr)->num))
+
+struct vhost_vq {
+	struct vmm_vhost_vring		vr;
+	uint16_t					last_avail;
+	uint16_t					used_idx;
+};
+
+struct vhost_net {
+	struct proc					*proc;
+	uintptr_t					notify_gpa;
+	struct chan					*chan;
+	struct queue				*inq;
+	uint32_t					*isr;		/* KVA of the user's register */
+	uint8_t						*pir;		/* KVA of the posted IRQ desc */
+	struct guest_pcore			*gpc;
+	unsigned int				vector;
+	struct event_queue			*ev_q;
+	struct vhost_vq				vqs[2];
+	struct rendez				rv;
+	bool						kicked;
+	bool						dying;
+	struct block				*rx_pending;
+	uint8_t						*tx_batch;
+};
+
+static void vhost_net_wake(struct vhost_net *vn)
+{
+	ACCESS_ONCE(vn->kicked) = TRUE;
+	rendez_wakeup(&vn->rv);
+}
+
+static int vhost_net_has_work(void *arg)
+{
+	struct vhost_net *vn = arg;
+
+	return ACCESS_ONCE(vn->kicked) || ACCESS_ONCE(vn->dying);
+}
+
+static void vhost_net_rx_wake(struct queue *q, void *data, int filter)
+{
+	vhost_net_wake(data);
+}
+
+static uint16_t vhost_read16(uintptr_t uva)
+{
+	uint16_t val;
+
+	if (copy_from_user(&val, (void*)uva, sizeof(val)))
+		error(EFAULT, "vhost_net: bad vring address %p", uva);
+	return val;
+}
+
+static void vhost_write(uintptr_t uva, void *val, size_t len)
+{
+	if (copy_to_user((void*)uva, val, len))
+		error(EFAULT, "vhost_net: bad vring address %p", uva);
+}
+
+/* Gets the head of the next chain the driver made available, if any. */
+static bool vhost_vq_next(struct vhost_vq *vq, uint16_t *head)
+{
+	if (vq->last_avail == vhost_read16(VRING_AVAIL_IDX(&vq->vr)))
+		return FALSE;
+	rmb();	/* read the idx before the entry it covers */
+	*head = vhost_read16(VRING_AVAIL_ENT(&vq->vr, vq->last_avail));
+	vq->last_avail++;
+	return TRUE;
+}
+
+static void vhost_vq_put_used(struct vhost_vq *vq, uint16_t head, uint32_t len)
+{
+	uint32_t ent[2] = {head, len};
+
+	vhost_write(VRING_USED_ENT(&vq->vr, vq->used_idx), ent, sizeof(ent));
+	vq->used_idx++;
+}
+
+/* The driver sees every entry from vhost_vq_put_used() once we bump idx. */
+static void vhost_vq_flush_used(struct vhost_vq *vq)
+{
+	wmb();
+	vhost_write(VRING_USED_IDX(&vq->vr), &vq->used_idx, sizeof(uint16_t));
+}
+
+/* Copies up to len bytes between buf and the guest buffers of head's chain,
+ * starting skip bytes into the chain.  Receive buffers must be device-writable
+ * and transmit buffers must not be. */
+static size_t vhost_vq_copy(struct vhost_vq *vq, uint16_t head, size_t skip,
+                            void *buf, size_t len, bool to_guest)
+{
+	struct vring_desc *descs = (struct vring_desc*)vq->vr.desc;
+	struct vring_desc d;
+	uint16_t i = head;
+	size_t done = 0, amt;
+	int ret;
+
+	/* A chain has at most num descriptors, which also stops loops */
+	for (int n = 0; n < vq->vr.num && done < len; n++) {
+		if (i >= vq->vr.num)
+			error(EINVAL, "vhost_net: desc %d out of range", i);
+		if (copy_from_user(&d, &descs[i], sizeof(d)))
+			error(EFAULT, "vhost_net: bad desc table %p", descs);
+		if (!!(d.flags & VRING_DESC_F_WRITE) != to_guest)
+			error(EINVAL, "vhost_net: desc %d has the wrong direction", i);
+		if (skip >= d.len) {
+			skip -= d.len;
+		} else {
+			amt = MIN(d.len - skip, len - done);
+			if (to_guest)
+				ret = copy_to_user((void*)d.addr + skip, buf + done, amt);
+			else
+				ret = copy_from_user(buf + done, (void*)d.addr + skip, amt);
+			if (ret)
+				error(EFAULT, "vhost_net: bad buffer %p", d.addr);
+			done += amt;
+			skip = 0;
+		}
+		if (!(d.flags & VRING_DESC_F_NEXT))
+			break;
+		i = d.next;
+	}
+	return done;
+}
+
+/* Errors from #ether just cost us the batch; the guest already gave it up. */
+static void vhost_net_xmit(struct vhost_net *vn, size_t len)
+{
+	ERRSTACK(1);
+
+	if (waserror()) {
+		poperror();
+		return;
+	}
+	devtab[vn->chan->type].write(vn->chan, vn->tx_batch, len, 0);
+	poperror();
+}
+
+/* Sends everything on the transmitq, a batch at a time.  Returns TRUE if we
+ * used any of the guest's buffers. */
+static bool vhost_net_tx(struct vhost_net *vn)
+{
+	struct vhost_vq *vq = &vn->vqs[VHOST_NET_TX];
+	uint8_t *batch = vn->tx_batch;
+	size_t off = 0, len;
+	uint16_t head;
+	bool used = FALSE;
+
+	while (vhost_vq_next(vq, &head)) {
+		/* The virtio header isn't part of the frame */
+		len = vhost_vq_copy(vq, head, VHOST_NET_HDR_SZ,
+		                    batch + off + NETIF_BATCHHDR, VHOST_NET_MAX_FRAME,
+		                    FALSE);
+		hnputs(batch + off, len);
+		off += NETIF_BATCHHDR + len;
+		vhost_vq_put_used(vq, head, 0);
+		used = TRUE;
+		if (VHOST_NET_BATCH_SZ - off < NETIF_BATCHHDR + VHOST_NET_MAX_FRAME) {
+			vhost_vq_flush_used(vq);
+			vhost_net_xmit(vn, off);
+			off = 0;
+		}
+	}
+	if (off) {
+		vhost_vq_flush_used(vq);
+		vhost_net_xmit(vn, off);
+	}
+	return used;
+}
+
+/* Fills receive buffers until we run out of frames or buffers.  A frame that
+ * doesn't get a buffer waits for the driver to kick the receiveq. */
+static bool vhost_net_rx(struct vhost_net *vn)
+{
+	struct vhost_vq *vq = &vn->vqs[VHOST_NET_RX];
+	/* A virtio_net_hdr_v1 with nothing but num_buffers = 1 */
+	uint16_t hdr[VHOST_NET_HDR_SZ / 2] = {[5] = 1};
+	struct block *bp;
+	uint16_t head;
+	size_t len;
+	bool used = FALSE;
+
+	for (;;) {
+		bp = vn->rx_pending;
+		vn->rx_pending = NULL;
+		if (!bp)
+			bp = qget(vn->inq);
+		if (!bp)
+			break;
+		if (!vhost_vq_next(vq, &head)) {
+			vn->rx_pending = bp;
+			break;
+		}
+		bp = linearizeblock(bp);
+		len = vhost_vq_copy(vq, head, 0, hdr, sizeof(hdr), TRUE);
+		len += vhost_vq_copy(vq, head, sizeof(hdr), bp->rp, BLEN(bp), TRUE);
+		freeb(bp);
+		vhost_vq_put_used(vq, head, len);
+		used = TRUE;
+	}
+	if (used)
+		vhost_vq_flush_used(vq);
+	return used;
+}
+
+/* Like the user VMM's vmm_interrupt_guest(), but we can't sync with a halted
+ * guest pcore.  If the gpc isn't loaded, we let the VMM do the wakeup. */
+static void vhost_net_irq(struct vhost_net *vn)
+{
+	struct event_msg msg = {0};
+	int cpu;
+
+	/* The bit is in the low byte, and x86 is little endian */
+	atomic_orb((uint8_t*)vn->isr, VHOST_MMIO_INT_VRING);
+	SET_BITMASK_BIT_ATOMIC(vn->pir, vn->vector);
+	/* The atomics order these with reading gpc->cpu */
+	if (!GET_BITMASK_BIT(vn->pir, VMX_POSTED_OUTSTANDING_NOTIF))
+		SET_BITMASK_BIT_ATOMIC(vn->pir, VMX_POSTED_OUTSTANDING_NOTIF);
+	cpu = ACCESS_ONCE(vn->gpc->cpu);
+	if (cpu != -1) {
+		send_ipi(cpu, I_POKE_CORE);
+		return;
+	}
+	msg.ev_type = EV_USER_IPI;
+	msg.ev_arg2 = vn->vector;
+	send_event(vn->proc, vn->ev_q, &msg, 0);
+}
+
+static void vhost_net_ktask(void *arg)
+{
+	ERRSTACK(1);
+	struct vhost_net *vn = arg;
+	struct proc *p = vn->proc;
+	uintptr_t prev = switch_to(p);
+	bool used;
+
+	if (waserror()) {
+		/* The guest messed up its rings.  Its kicks are now noops, and the
+		 * vmexit handler can still use vn until p goes away. */
+		printk("[kernel] vhost_net for %d stopped: %s\n", p->pid,
+		       current_errstr());
+		goto out;
+	}
+	for (;;) {
+		rendez_sleep(&vn->rv, vhost_net_has_work, vn);
+		if (ACCESS_ONCE(vn->dying))
+			break;
+		ACCESS_ONCE(vn->kicked) = FALSE;
+		mb();	/* clear kicked before looking at the rings */
+		used = vhost_net_tx(vn);
+		used |= vhost_net_rx(vn);
+		if (used)
+			vhost_net_irq(vn);
+	}
+	poperror();
+out:
+	qio_set_wake_cb(vn->inq, 0, 0);
+	cclose(vn->chan);
+	vn->chan = NULL;
+	if (vn->rx_pending)
+		freeb(vn->rx_pending);
+	vn->rx_pending = NULL;
+	switch_back(p, prev);
+	/* This might be the last ref; vn goes away with p->vmm. */
+	proc_decref(p);
+}
+
+/* Returns the length of the guest's store at tf_rip, or 0 if we can't tell.
+ * Linux's writel() is a mov from a register, maybe with REX, so that's all we
+ * handle.  Anything else goes to the user VMM, which knows a few more. */
+static int vhost_store_len(struct proc *p, struct vm_trapframe *tf)
+{
+	uint8_t insn[15] = {0};
+	uintptr_t gpa, kva;
+	size_t n;
+	int i = 0;
+	int mod, rm;
+
+	gpa = gva2gpa(p, tf->tf_cr3, tf->tf_rip);
+	kva = uva2kva(p, (void*)gpa, 1, PROT_READ);
+	if (!kva)
+		return 0;
+	/* We don't bother with stores that cross a page */
+	n = MIN(sizeof(insn), PGSIZE - PGOFF(gpa));
+	memcpy(insn, (void*)kva, n);
+	if ((insn[i] & 0xf0) == 0x40)
+		i++;
+	if (insn[i++] != 0x89)
+		return 0;
+	mod = insn[i] >> 6;
+	rm = insn[i++] & 7;
+	if (mod == 3)
+		return 0;
+	if (rm == 4 && mod == 0 && (insn[i] & 7) == 5)
+		i += 4;
+	if (rm == 4)
+		i++;
+	else if (mod == 0 && rm == 5)
+		i += 4;
+	if (mod == 1)
+		i += 1;
+	else if (mod == 2)
+		i += 4;
+	return i <= n ? i : 0;
+}
+
+/* Called from vmexit_dispatch for EPT faults.  Can't block.  A kick for either
+ * queue gets the ktask to look at both, so we don't care what was written. */
+bool vhost_net_notify(struct vm_trapframe *tf)
+{
+	struct vhost_net *vn = ACCESS_ONCE(current->vmm.vhost_net);
+	int len;
+
+	if (!vn || tf->tf_guest_pa != vn->notify_gpa)
+		return FALSE;
+	if (!(tf->tf_exit_qual & VMX_EPT_FAULT_WRITE))
+		return FALSE;
+	vhost_net_wake(vn);
+	/* If we can't skip the store, the VMM will, and its own notify is a
+	 * noop. */
+	len = vhost_store_len(current, tf);
+	if (!len)
+		return FALSE;
+	tf->tf_rip += len;
+	return TRUE;
+}
+
+static void vhost_net_check_vring(struct vmm_vhost_vring *vr)
+{
+	if (!vr->num || vr->num > VHOST_NET_MAX_VRING || (vr->num & (vr->num - 1)))
+		error(EINVAL, "vhost_net: bad vring size %d", vr->num);
+	if (!is_user_rwaddr((void*)vr->desc,
+	                    vr->num * sizeof(struct vring_desc)) ||
+	    !is_user_rwaddr((void*)vr->avail, 4 + 2 * vr->num) ||
+	    !is_user_rwaddr((void*)vr->used, 4 + 8 * vr->num))
+		error(EFAULT, "vhost_net: bad vring addresses");
+}
+
+/* Hands a guest's network device to the kernel.  Throws on error. */
+void vhost_net_setup(struct proc *p, struct vmm_vhost_net_init *u_init)
+{
+	ERRSTACK(1);
+	struct vmm *vmm = &p->vmm;
+	struct vmm_vhost_net_init init;
+	struct vhost_net *vn;
+
+	if (copy_from_user(&init, u_init, sizeof(init)))
+		error(EFAULT, "Bad vhost_net init %p", u_init);
+	for (int i = 0; i < ARRAY_SIZE(init.vrings); i++)
+		vhost_net_check_vring(&init.vrings[i]);
+	if (init.vector >= VMX_POSTED_OUTSTANDING_NOTIF)
+		error(EINVAL, "vhost_net: bad vector %d", init.vector);
+	vn = kzmalloc(sizeof(struct vhost_net), MEM_WAIT);
+	vn->tx_batch = kmalloc(VHOST_NET_BATCH_SZ, MEM_WAIT);
+	if (waserror()) {
+		if (vn->chan)
+			cclose(vn->chan);
+		kfree(vn->tx_batch);
+		kfree(vn);
+		nexterror();
+	}
+	vn->chan = fdtochan(&p->open_files, init.data_fd, O_RDWR, TRUE, TRUE);
+	vn->inq = ether_chan_inq(vn->chan);
+	if (!vn->inq)
+		error(EINVAL, "vhost_net: fd %d isn't #ether data", init.data_fd);
+	/* Like the VMCS's pages, these stay put for the life of the VMM */
+	vn->isr = (uint32_t*)uva2kva(p, init.isr, sizeof(uint32_t), PROT_WRITE);
+	if (!vn->isr || !ALIGNED(init.isr, sizeof(uint32_t)))
+		error(EFAULT, "vhost_net: bad isr %p", init.isr);
+	for (int i = 0; i < ARRAY_SIZE(vn->vqs); i++)
+		vn->vqs[i].vr = init.vrings[i];
+	vn->notify_gpa = init.mmio_addr + VHOST_MMIO_QUEUE_NOTIFY;
+	vn->vector = init.vector;
+	vn->ev_q = init.ev_q;
+	rendez_init(&vn->rv);
+	/* The driver might have given us buffers already */
+	vn->kicked = TRUE;
+
+	qlock(&vmm->qlock);
+	vn->gpc = vmm->vmmcp ? lookup_guest_pcore(p, init.gpcoreid) : NULL;
+	if (vn->gpc)
+		vn->pir = (uint8_t*)uva2kva(p, vn->gpc->posted_irq_desc, PGSIZE,
+		                            PROT_WRITE);
+	if (!vn->pir || vmm->vhost_net) {
+		qunlock(&vmm->qlock);
+		error(EINVAL, "vhost_net: no gpc %d, or already set up",
+		      init.gpcoreid);
+	}
+	vn->proc = p;
+	proc_incref(p, 1);
+	/* The qunlock makes sure the vmexit handler sees all of vn */
+	vmm->vhost_net = vn;
+	qunlock(&vmm->qlock);
+	poperror();
+
+	qio_set_wake_cb(vn->inq, vhost_net_rx_wake, vn);
+	ktask("vhost_net", vhost_net_ktask, vn);
+}
+
+/* Called from proc_destroy.  The ktask cleans up and drops its ref. */
+void vhost_net_destroy(struct proc *p)
+{
+	struct vhost_net *vn = p->vmm.vhost_net;
+
+	if (!vn)
+		return;
+	ACCESS_ONCE(vn->dying) = TRUE;
+	rendez_wakeup(&vn->rv);
+}
+
+/* Only call this when no one else can use vn, i.e. from __vmm_struct_cleanup.
+ * The ktask is long gone, since it held a ref on p. */
+void __vhost_net_free(struct proc *p)
+{
+	struct vhost_net *vn = p->vmm.vhost_net;
+
+	if (!vn)
+		return;
+	kfree(vn->tx_batch);
+	kfree(vn);
+	p->vmm.vhost_net = NULL;
+}
@@ -22,6 +22,8 @@
 
 #include <arch/x86.h>
 #include <ros/procinfo.h>
+#include <percpu.h>
+#include <stdio.h>
 
 
 /* TODO: have better cpuid info storage and checks */
@@ -123,10 +125,18 @@ void __vmm_struct_cleanup(struct proc *p)
 			destroy_guest_pcore(vmm->guest_pcores[i]);
 	}
 	kfree(vmm->guest_pcores);
+	__vhost_net_free(p);
 	ept_flush(p->env_pgdir.eptp);
 	vmm->vmmcp = FALSE;
 }
 
+/* Called from proc_destroy, once p's files are closed.  Stops anything in the
+ * kernel that works on behalf of the guest and holds a ref on p. */
+void vmm_proc_destroy(struct proc *p)
+{
+	vhost_net_destroy(p);
+}
+
 int vmm_poke_guest(struct proc *p, int guest_pcoreid)
 {
 	struct guest_pcore *gpc;
@@ -152,6 +162,75 @@ int vmm_poke_guest(struct proc *p, int guest_pcoreid)
 	return 0;
 }
 
+/* Each core counts the exits it handles, so the counters need no atomics.
+ * Readers and resetters race with the cores, which is fine for stats. */
+struct vmexit_stats {
+	struct vmm_exit_stat		reason[VMM_EXIT_NR_REASONS];
+	uint64_t					reflected[VMM_EXIT_NR_REASONS];
+};
+
+static DEFINE_PERCPU(struct vmexit_stats, vmexit_stats);
+
+#define VMEXIT_LINE_SZ			(48 + 11 * VMM_EXIT_HIST_NR_BUCKETS)
+
+/* Charges an exit to its reason.  cycles is the time spent in the kernel; if
+ * we reflected the exit, the VMM's own stats have the rest. */
+void vmexit_account(unsigned int reason, uint64_t cycles, bool reflected)
+{
+	struct vmexit_stats *vs = PERCPU_VARPTR(vmexit_stats);
+
+	if (reason >= VMM_EXIT_NR_REASONS)
+		return;
+	vmm_exit_stat_add(&vs->reason[reason], cycles);
+	if (reflected)
+		vs->reflected[reason]++;
+}
+
+void vmexit_stats_reset(void)
+{
+	for (int i = 0; i < num_cores; i++)
+		memset(_PERCPU_VARPTR(vmexit_stats, i), 0,
+		       sizeof(struct vmexit_stats));
+}
+
+/* Returns a kmalloc'd report of every core's exits, merged, with one line per
+ * reason that has happened. */
+char *vmexit_stats_report(size_t *len)
+{
+	struct vmexit_stats *vs;
+	struct vmm_exit_stat st;
+	uint64_t reflected;
+	size_t bufsz = VMEXIT_LINE_SZ * (VMM_EXIT_NR_REASONS + 2);
+	size_t off = 0;
+	char *buf = kmalloc(bufsz, MEM_WAIT);
+
+	off += snprintf(buf + off, bufsz - off, "%-20s %10s %10s %8s  %s%d\n",
+	                "Reason", "Count", "Reflected", "AvgCyc",
+	                "Histogram, log2 cycles from ", VMM_EXIT_HIST_SHIFT + 1);
+	for (int i = 0; i < VMM_EXIT_NR_REASONS; i++) {
+		memset(&st, 0, sizeof(st));
+		reflected = 0;
+		for (int j = 0; j < num_cores; j++) {
+			vs = _PERCPU_VARPTR(vmexit_stats, j);
+			st.count += vs->reason[i].count;
+			st.cycles += vs->reason[i].cycles;
+			for (int k = 0; k < VMM_EXIT_HIST_NR_BUCKETS; k++)
+				st.hist[k] += vs->reason[i].hist[k];
+			reflected += vs->reflected[i];
+		}
+		if (!st.count)
+			continue;
+		off += snprintf(buf + off, bufsz - off, "%-20s %10llu %10llu %8llu ",
+		                VMX_EXIT_REASON_NAMES[i] ?: "?", st.count, reflected,
+		                st.cycles / st.count);
+		for (int k = 0; k < VMM_EXIT_HIST_NR_BUCKETS; k++)
+			off += snprintf(buf + off, bufsz - off, " %llu", st.hist[k]);
+		off += snprintf(buf + off, bufsz - off, "\n");
+	}
+	*len = off;
+	return buf;
+}
+
 struct guest_pcore *lookup_guest_pcore(struct proc *p, int guest_pcoreid)
 {
 	/* nr_guest_pcores is written once at setup and never changed */
@@ -55,6 +55,7 @@ struct vmm {
 		struct guest_pcore **guest_pcores;
 	};
 	unsigned long vmexits[VMM_VMEXIT_NR_TYPES];
+	struct vhost_net *vhost_net;
 };
 
 void vmm_init(void);
@@ -64,6 +65,16 @@ int vmm_struct_init(struct proc *p, unsigned int nr_guest_pcores,
                     struct vmm_gpcore_init *gpcis, int flags);
 void __vmm_struct_cleanup(struct proc *p);
 int vmm_poke_guest(struct proc *p, int guest_pcoreid);
+void vmm_proc_destroy(struct proc *p);
+
+void vmexit_account(unsigned int reason, uint64_t cycles, bool reflected);
+void vmexit_stats_reset(void);
+char *vmexit_stats_report(size_t *len);
+
+void vhost_net_setup(struct proc *p, struct vmm_vhost_net_init *u_init);
+bool vhost_net_notify(struct vm_trapframe *tf);
+void vhost_net_destroy(struct proc *p);
+void __vhost_net_free(struct proc *p);
 
 int intel_vmx_start(int id);
 int intel_vmx_setup(int nvmcs);
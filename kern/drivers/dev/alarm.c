@@ -14,12 +14,17 @@
  * To use, first open #alarm/clone, and that gives you an alarm directory aN,
  * where N is ID of the alarm.  The FD you get from clone points to 'ctl.'
  *
- * 'ctl' takes no commands.  You can read it to get the ID.  That's it.
+ * You can read 'ctl' to get the ID.  Writing "signal VCOREID SIGNO" to it makes
+ * the alarm post SIGNO straight to that vcore each time it fires, in addition
+ * to firing taps.  The signal skips the event mboxes; see ros/event.h.  SIGNO
+ * 0 turns that off.
  *
  * 'timer' takes the hex string value (in absolute tsc time) to fire the alarm.
- * Writing 0 disables the alarm.  You can read 'timer' to get the next time it
- * will fire, in TSC time.  0 means it is disabled.  To find out about the timer
- * firing, put an FD tap on 'timer' for FDTAP_FILT_WRITTEN.
+ * The alarm may fire up to PROC_ALARM_SLACK_USEC late, so that nearby alarms
+ * can share an interrupt.  Writing 0 disables the alarm.  You can read 'timer'
+ * to get the next time it will fire, in TSC time.  0 means it is disabled.  To
+ * find out about the timer firing, put an FD tap on 'timer' for
+ * FDTAP_FILT_WRITTEN.
  *
  * 'period' takes the hex string value (in TSC ticks) for the period of the
  * alarm.  If non-zero, the alarm will rearm when it fires.  You can read the
@@ -67,6 +72,7 @@
 #include <alarm.h>
 #include <umem.h>
 #include <devalarm.h>
+#include <event.h>
 
 struct dev alarmdevtab;
 
@@ -84,6 +90,9 @@ static char *devname(void)
 #define Qperiod					6
 #define Qcount					7
 
+/* How late a process's alarm may fire, so it can share an interrupt */
+#define PROC_ALARM_SLACK_USEC	50
+
 /* This paddr/kaddr is a bit dangerous.  it'll work so long as we don't need all
  * 64 bits for a physical address (48 is the current norm on x86_64). */
 #define ADDR_SHIFT 5
@@ -110,8 +119,10 @@ static void alarm_fire_taps(struct proc_alarm *a, int filter)
 {
 	struct fd_tap *tap_i;
 
+	event_defer_notifs();
 	SLIST_FOREACH(tap_i, &a->fd_taps, link)
 		fire_tap(tap_i, filter);
+	event_flush_notifs();
 }
 
 static void proc_alarm_handler(struct alarm_waiter *a_waiter)
@@ -120,6 +131,8 @@ static void proc_alarm_handler(struct alarm_waiter *a_waiter)
 
 	cv_lock(&a->cv);
 	a->count++;
+	if (a->sig_nr)
+		send_vcore_signal(a->proc, a->sig_vcoreid, a->sig_nr);
 	if (!a->period) {
 		a_waiter->wake_up_time = 0;
 	} else {
@@ -299,6 +312,7 @@ static struct chan *alarmopen(struct chan *c, int omode)
 			cv_init(&a->cv);
 			qlock_init(&a->qlock);
 			init_awaiter(&a->a_waiter, proc_alarm_handler);
+			set_awaiter_slack(&a->a_waiter, PROC_ALARM_SLACK_USEC);
 			spin_lock(&p->alarmset.lock);
 			a->id = p->alarmset.id_counter++;
 			proc_incref(p, 1);
@@ -466,6 +480,34 @@ static void set_proc_alarm(struct proc_alarm *a, uint64_t hexval)
 	qunlock(&a->qlock);
 }
 
+/* Handles a write to ctl.  Throws on error. */
+static void alarm_ctl(struct proc_alarm *a, void *ubuf, long n)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb = parsecmd(ubuf, n);
+	unsigned long vcoreid, sig_nr;
+
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	if ((cb->nf != 3) || strcmp(cb->f[0], "signal"))
+		error(EINVAL, "usage: signal VCOREID SIGNO");
+	vcoreid = strtoul(cb->f[1], 0, 0);
+	sig_nr = strtoul(cb->f[2], 0, 0);
+	if (vcoreid >= a->proc->procinfo->max_vcores)
+		error(EINVAL, "bad vcoreid %lu", vcoreid);
+	if (sig_nr >= sizeof(long) * 8)
+		error(EINVAL, "bad signal %lu", sig_nr);
+	/* racing with the handler, like the period */
+	cv_lock(&a->cv);
+	a->sig_vcoreid = vcoreid;
+	a->sig_nr = sig_nr;
+	cv_unlock(&a->cv);
+	kfree(cb);
+	poperror();
+}
+
 /* Note that in read and write we have an open chan, which means we have an
  * active kref on the p_alarm.  Also note that we make no assumptions about
  * current here - we find the proc (and the tchain) via the ref stored in the
@@ -477,9 +519,11 @@ static long alarmwrite(struct chan *c, void *ubuf, long n, int64_t unused)
 	switch (TYPE(c->qid)) {
 		case Qtopdir:
 		case Qalarmdir:
-		case Qctl:
 		case Qcount:
 			error(EPERM, ERROR_FIXME);
+		case Qctl:
+			alarm_ctl(QID2A(c->qid), ubuf, n);
+			break;
 		case Qtimer:
 			set_proc_alarm(QID2A(c->qid), strtoul_from_ubuf(ubuf, n, 16));
 			break;
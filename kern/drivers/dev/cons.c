@@ -20,6 +20,7 @@
 #include <sys/queue.h>
 #include <event.h>
 #include <ros/procinfo.h>
+#include <klog.h>
 
 #if 0
 void (*consdebug) (void) = NULL;
@@ -38,22 +39,6 @@ struct queue *cons_q;			/* Akaros cons input: keyboard, serial, etc */
 spinlock_t cons_q_lock = SPINLOCK_INITIALIZER;
 struct fdtap_slist cons_q_fd_taps = SLIST_HEAD_INITIALIZER(cons_q_fd_taps);
 
-static uint8_t logbuffer[1 << 20];
-static int index = 0;
-static struct queue *logqueue = NULL;
-static int reading_kmesg = 0;
-
-typedef unsigned char uint8_t;
-
-void logbuf(int c)
-{
-	if (reading_kmesg)
-		return;
-	if (index > 1 << 20)
-		return;
-	logbuffer[index++] = c;
-}
-
 /*
  *  return true if current user is eve
  */
@@ -757,6 +742,10 @@ static struct chan *consopen(struct chan *c, int omode)
 				qreopen(kprintoq);
 			c->iounit = qiomaxatomic;
 			break;
+
+		case Qklog:
+			c->aux = klog_snapshot();
+			break;
 	}
 	return c;
 }
@@ -779,6 +768,11 @@ static void consclose(struct chan *c)
 				qhangup(kprintoq, NULL);
 			}
 			break;
+
+		case Qklog:
+			kfree(c->aux);
+			c->aux = NULL;
+			break;
 	}
 }
 
@@ -792,6 +786,7 @@ static long consread(struct chan *c, void *buf, long n, int64_t off)
 	char *b, *bp, ch;
 	char tmp[256];				/* must be >= 18*NUMSIZE (Qswap) */
 	int i, k, id, send;
+	struct sized_alloc *sza;
 	int64_t offset = off;
 #if 0
 	extern char configfile[];
@@ -1011,21 +1006,8 @@ static long consread(struct chan *c, void *buf, long n, int64_t off)
 			return n;
 
 		case Qklog:
-			//return qread(klogq, buf, n);
-			/* the queue gives us some elasticity for log reading. */
-			if (!logqueue)
-				logqueue = qopen(1 << 20, 0, 0, 0);
-			if (logqueue) {
-				int ret;
-				/* atomic sets/gets are not that important in this case. */
-				reading_kmesg = 1;
-				qwrite(logqueue, logbuffer, index);
-				index = 0;
-				ret = qread(logqueue, buf, n);
-				reading_kmesg = 0;
-				return ret;
-			}
-			break;
+			sza = c->aux;
+			return readmem(offset, buf, n, sza->buf, sza->size);
 
 		case Qzero:
 			memset(buf, 0, n);
@@ -1262,8 +1244,10 @@ static void __consq_fire_taps(uint32_t srcid, long a0, long a1, long a2)
 	int filter = a0;
 
 	spin_lock(&cons_q_lock);
+	event_defer_notifs();
 	SLIST_FOREACH(tap_i, &cons_q_fd_taps, link)
 		fire_tap(tap_i, filter);
+	event_flush_notifs();
 	spin_unlock(&cons_q_lock);
 
 }
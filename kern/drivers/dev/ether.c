@@ -49,6 +49,20 @@ static char *devname(void)
 
 enum {
 	Type8021Q = 0x8100,			/* value of type field for 802.1[pQ] tags */
+	TypeIPv4 = 0x0800,
+	TypeIPv6 = 0x86dd,
+	TcpFIN = 0x01,				/* TCP flags, for GSO and GRO */
+	TcpPSH = 0x08,
+	TcpACK = 0x10,
+};
+
+/* The usual default RSS key, from Microsoft's RSS spec */
+static const uint8_t rss_default_key[EtherRSSKeyLen] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
 };
 
 static struct ether *etherxx[MaxEther];	/* real controllers */
@@ -223,7 +237,7 @@ out:
 	return r;
 }
 
-static struct block *etherbread(struct chan *chan, long n, uint32_t offset)
+static struct block *etherbread(struct chan *chan, long n, int64_t offset)
 {
 	ERRSTACK(1);
 	struct block *b;
@@ -302,39 +316,21 @@ static inline int eaddrcmp(uint8_t *x, uint8_t *y)
 	return (a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]);
 }
 
-struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
+static struct block *__etheriq(struct ether *ether, struct block *bp,
+                               int fromwire)
 {
 	struct etherpkt *pkt;
 	uint16_t type;
-	int multi, tome, fromme, vlanid, i;
+	int multi, tome, fromme;
 	struct netfile **ep, *f, **fp, *fx;
+	struct net_capring *ncr;
+	struct bpf_prog *prog;
 	struct block *xbp;
-	struct ether *vlan;
-
-	ether->inpackets++;
+	uint32_t len, snap;
 
 	pkt = (struct etherpkt *)bp->rp;
-	/* TODO: we might need to assert more for higher layers, or otherwise deal
-	 * with extra data. */
-	assert(BHLEN(bp) >= offsetof(struct etherpkt, data));
+	len = BLEN(bp);
 	type = (pkt->type[0] << 8) | pkt->type[1];
-	if (type == Type8021Q && ether->nvlan) {
-		vlanid = nhgets(bp->rp + 2 * Eaddrlen + 2) & 0xFFF;
-		if (vlanid) {
-			for (i = 0; i < ARRAY_SIZE(ether->vlans); i++) {
-				vlan = ether->vlans[i];
-				if (vlan != NULL && vlan->vlanid == vlanid) {
-					/* might have a problem with extra data here */
-					assert(BHLEN(bp) >= 4 + 2 * Eaddrlen);
-					memmove(bp->rp + 4, bp->rp, 2 * Eaddrlen);
-					bp->rp += 4;
-					return etheriq(vlan, bp, fromwire);
-				}
-			}
-			/* allow normal type handling to accept or discard it */
-		}
-	}
-
 	fx = 0;
 	ep = &ether->f[Ntypes];
 
@@ -367,15 +363,25 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 				/* Don't want to hear bridged packets */
 				if (f->bridge && !fromwire && !fromme)
 					continue;
+				/* The filter runs before we copy anything */
+				rcu_read_lock();
+				prog = rcu_dereference(f->filter);
+				snap = prog ? bpf_run(prog, bp) : len;
+				ncr = snap ? rcu_dereference(f->capring) : NULL;
+				if (ncr)
+					capring_put(ncr, bp, snap);
+				rcu_read_unlock();
+				if (!snap || ncr)
+					continue;
 				if (f->headersonly) {
 					etherrtrace(f, pkt, BHLEN(bp));
 					continue;
 				}
-				if (fromwire && fx == 0) {
+				if (fromwire && fx == 0 && snap == len) {
 					fx = f;
 					continue;
 				}
-				xbp = copyblock(bp, MEM_ATOMIC);
+				xbp = copyblock_n(bp, snap, MEM_ATOMIC);
 				if (xbp == 0) {
 					ether->soverflows++;
 					continue;
@@ -398,9 +404,492 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	return bp;
 }
 
-static int etheroq(struct ether *ether, struct block *bp)
+/* GRO: etheriq() holds in-order TCP/IPv4 segments of a flow, from one receive
+ * batch, and hands them up as one big segment when the driver calls
+ * etheriq_flush(), or sooner if the flow hits something it can't merge.  Each
+ * slot of ether->gro holds one flow's segment.  Later segments hang off it as
+ * extra data, without a copy: block_alloc() blocks are one kmalloc, so an ebd
+ * can own the whole block.
+ *
+ * We only merge plain ACK (and PSH) data with matching ACKs and options, and
+ * check each segment's checksums on the way in, since TCP can't check them for
+ * the merged segment.  PSH, or anything else for the flow, like a FIN, flushes
+ * it first, so TCP sees everything in order. */
+
+struct gro_seg {
+	uint8_t						*ip;
+	uint8_t						*tcp;
+	int							ip_len;
+	int							tcp_hlen;
+	int							payload;
+	uint32_t					seq;
+};
+
+/* bp is TCP over IPv4, with no options, and its headers in the main body. */
+static void gro_hdr(struct block *bp, struct gro_seg *s)
+{
+	s->ip = bp->rp + ETHERHDRSIZE;
+	s->tcp = s->ip + 20;
+	s->ip_len = nhgets(s->ip + 2);
+	s->tcp_hlen = (s->tcp[12] >> 4) << 2;
+	s->payload = s->ip_len - 20 - s->tcp_hlen;
+	s->seq = nhgetl(s->tcp + 4);
+}
+
+static bool gro_tcp_csum_ok(struct gro_seg *s)
+{
+	uint8_t phdr[12];
+	uint32_t sum;
+
+	memcpy(phdr, s->ip + 12, 8);
+	phdr[8] = 0;
+	phdr[9] = 6;
+	hnputs(phdr + 10, s->ip_len - 20);
+	sum = ptclbsum(phdr, sizeof(phdr)) + ptclbsum(s->tcp, s->ip_len - 20);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum == 0xffff;
+}
+
+/* Returns TRUE and fills in s if bp is a segment GRO can take. */
+static bool gro_parse(struct ether *ether, struct block *bp, struct gro_seg *s)
+{
+	struct etherpkt *pkt = (struct etherpkt *)bp->rp;
+	uint8_t *ip = bp->rp + ETHERHDRSIZE;
+
+	if (bp->next || bp->extra_len || (BHLEN(bp) < ETHERHDRSIZE + 40) ||
+	    ether->prom || eaddrcmp(pkt->d, ether->ea))
+		return FALSE;
+	/* IPv4 without options, TCP, and not a fragment */
+	if ((ip[0] != 0x45) || (ip[9] != 6) || (nhgets(ip + 6) & 0x3fff))
+		return FALSE;
+	gro_hdr(bp, s);
+	if ((s->tcp_hlen < 20) || (s->payload <= 0) ||
+	    (ETHERHDRSIZE + s->ip_len > BHLEN(bp)) ||
+	    ((s->tcp[13] & ~TcpPSH) != TcpACK))
+		return FALSE;
+	if (!(bp->flag & Bipck) && ipcsum(ip))
+		return FALSE;
+	if (!(bp->flag & Btcpck) && !gro_tcp_csum_ok(s))
+		return FALSE;
+	return TRUE;
+}
+
+/* Can s go on the end of h? */
+static bool gro_can_merge(struct gro_seg *h, struct gro_seg *s)
+{
+	return !memcmp(h->ip + 12, s->ip + 12, 8) &&
+	       !memcmp(h->tcp, s->tcp, 4) &&
+	       (h->tcp_hlen == s->tcp_hlen) &&
+	       !memcmp(h->tcp + 8, s->tcp + 8, 4) &&
+	       !memcmp(h->tcp + 20, s->tcp + 20, h->tcp_hlen - 20) &&
+	       (s->seq == h->seq + h->payload) &&
+	       (h->ip_len + s->payload <= 0xffff);
+}
+
+/* Makes bp the first segment of a held flow.  Its checksums were checked, and
+ * the IP length will change, so we keep later layers from checking them. */
+static void gro_hold(struct block *bp, struct gro_seg *s)
+{
+	bp->wp = bp->rp + ETHERHDRSIZE + s->ip_len;
+	bp->flag |= Bipck | Btcpck;
+}
+
+/* Appends s's payload to head, which takes the block.  Returns FALSE if it
+ * can't. */
+static bool gro_merge(struct block *head, struct gro_seg *h, struct block *bp,
+                      struct gro_seg *s)
+{
+	uintptr_t off = s->tcp + s->tcp_hlen - (uint8_t*)bp;
+
+	if (bp->free || bp->extra_data)
+		return FALSE;
+	if (block_append_extra(head, (uintptr_t)bp, off, s->payload, MEM_ATOMIC))
+		return FALSE;
+	hnputs(h->ip + 2, h->ip_len + s->payload);
+	memcpy(h->tcp + 14, s->tcp + 14, 2);	/* latest window */
+	h->tcp[13] |= s->tcp[13] & TcpPSH;
+	head->flag &= ~Bpktck;
+	return TRUE;
+}
+
+static void gro_send(struct ether *ether, struct block *head)
+{
+	uint8_t *ip = head->rp + ETHERHDRSIZE;
+
+	ip[10] = ip[11] = 0;
+	hnputs(ip + 10, ipcsum(ip));
+	__etheriq(ether, head, 1);
+}
+
+/* Returns bp if it should go up now, behind anything we flushed, or 0 if GRO
+ * took it. */
+static struct block *ether_gro(struct ether *ether, struct block *bp)
+{
+	struct etherpkt *pkt = (struct etherpkt *)bp->rp;
+	uint8_t *ip = bp->rp + ETHERHDRSIZE;
+	struct block *head, *flush = NULL;
+	struct gro_seg h, s;
+	uint8_t *tcp;
+	int idx;
+
+	if ((BHLEN(bp) < ETHERHDRSIZE + 20) || (nhgets(pkt->type) != TypeIPv4) ||
+	    ((ip[0] >> 4) != 4) || (ip[9] != 6))
+		return bp;
+	tcp = ip + ((ip[0] & 0xf) << 2);
+	if (BHLEN(bp) < tcp + 4 - bp->rp)
+		return bp;
+	idx = (nhgetl(ip + 12) ^ nhgetl(ip + 16) ^ nhgetl(tcp)) % EtherGROFlows;
+
+	spin_lock_irqsave(&ether->gro_lock);
+	head = ether->gro[idx];
+	if (!gro_parse(ether, bp, &s)) {
+		/* Might be from the held flow, so it goes up behind it */
+		flush = head;
+		ether->gro[idx] = NULL;
+		goto out;
+	}
+	if (head) {
+		gro_hdr(head, &h);
+		if (gro_can_merge(&h, &s) && gro_merge(head, &h, bp, &s)) {
+			bp = NULL;
+			if (s.tcp[13] & TcpPSH) {
+				flush = head;
+				ether->gro[idx] = NULL;
+			}
+			goto out;
+		}
+	}
+	/* Start a new flow in the slot */
+	flush = head;
+	ether->gro[idx] = NULL;
+	if (!(s.tcp[13] & TcpPSH)) {
+		gro_hold(bp, &s);
+		ether->gro[idx] = bp;
+		bp = NULL;
+	}
+out:
+	spin_unlock_irqsave(&ether->gro_lock);
+	if (flush)
+		gro_send(ether, flush);
+	return bp;
+}
+
+static void ether_gro_flush(struct ether *ether)
+{
+	struct block *held[EtherGROFlows];
+
+	ether->gro_on = TRUE;
+	spin_lock_irqsave(&ether->gro_lock);
+	memcpy(held, ether->gro, sizeof(held));
+	memset(ether->gro, 0, sizeof(ether->gro));
+	spin_unlock_irqsave(&ether->gro_lock);
+	for (int i = 0; i < EtherGROFlows; i++) {
+		if (held[i])
+			gro_send(ether, held[i]);
+	}
+}
+
+/* Drivers call this at the end of each receive batch, to send up whatever GRO
+ * is holding.  The first call turns on GRO for ether and its vlans. */
+void etheriq_flush(struct ether *ether)
+{
+	struct ether *vlan;
+
+	ether_gro_flush(ether);
+	for (int i = 0; i < ARRAY_SIZE(ether->vlans); i++) {
+		vlan = ACCESS_ONCE(ether->vlans[i]);
+		if (vlan)
+			ether_gro_flush(vlan);
+	}
+}
+
+/* Returns the next packet for chan, an open ether data file, or 0.  If none is
+ * waiting, this polls the NIC for up to budget packets first.  For busy polling
+ * from the IP stack, which can't wait for the interrupt. */
+struct block *ether_busy_poll(struct chan *chan, int budget)
+{
+	struct ether *ether;
+	struct netfile *f;
+	struct block *b = NULL;
+
+	if (strcmp(devtab[chan->type].name, "ether") ||
+	    (chan->qid.type & QTDIR) || NETTYPE(chan->qid.path) != Ndataqid)
+		return NULL;
+	ether = chan->aux;
+	if (!ether->poll || !canrlock(&ether->rwlock))
+		return NULL;
+	f = ether->f[NETID(chan->qid.path)];
+	if (f) {
+		b = qget(f->in);
+		if (!b && ether->poll(ether, budget))
+			b = qget(f->in);
+	}
+	runlock(&ether->rwlock);
+	return b;
+}
+
+/* Returns the input queue of chan, an open ether data file, or 0.  For kernel
+ * consumers, like the VMM's vhost_net, that take frames straight off the queue
+ * instead of reading the chan. */
+struct queue *ether_chan_inq(struct chan *chan)
+{
+	struct ether *ether;
+	struct netfile *f;
+
+	if (strcmp(devtab[chan->type].name, "ether") ||
+	    (chan->qid.type & QTDIR) || NETTYPE(chan->qid.path) != Ndataqid)
+		return NULL;
+	ether = chan->aux;
+	f = ether->f[NETID(chan->qid.path)];
+	return f ? f->in : NULL;
+}
+
+struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
+{
+	struct etherpkt *pkt;
+	uint16_t type;
+	int vlanid, i;
+	struct ether *vlan;
+
+	ether->inpackets++;
+
+	pkt = (struct etherpkt *)bp->rp;
+	/* TODO: we might need to assert more for higher layers, or otherwise deal
+	 * with extra data. */
+	assert(BHLEN(bp) >= offsetof(struct etherpkt, data));
+	type = (pkt->type[0] << 8) | pkt->type[1];
+	if (type == Type8021Q && ether->nvlan) {
+		vlanid = nhgets(bp->rp + 2 * Eaddrlen + 2) & 0xFFF;
+		if (vlanid) {
+			for (i = 0; i < ARRAY_SIZE(ether->vlans); i++) {
+				vlan = ether->vlans[i];
+				if (vlan != NULL && vlan->vlanid == vlanid) {
+					/* might have a problem with extra data here */
+					assert(BHLEN(bp) >= 4 + 2 * Eaddrlen);
+					memmove(bp->rp + 4, bp->rp, 2 * Eaddrlen);
+					bp->rp += 4;
+					return etheriq(vlan, bp, fromwire);
+				}
+			}
+			/* allow normal type handling to accept or discard it */
+		}
+	}
+
+	if (fromwire && ether->gro_on) {
+		bp = ether_gro(ether, bp);
+		if (!bp)
+			return 0;
+	}
+	return __etheriq(ether, bp, fromwire);
+}
+
+/* Toeplitz hash of len bytes of in, as NICs do it for RSS.  key has at least
+ * len + 4 bytes. */
+static uint32_t toeplitz_hash(const uint8_t *key, const uint8_t *in,
+                              size_t len)
+{
+	uint32_t hash = 0;
+	uint32_t window = (key[0] << 24) | (key[1] << 16) | (key[2] << 8) | key[3];
+
+	for (size_t i = 0; i < len; i++) {
+		for (int bit = 7; bit >= 0; bit--) {
+			if (in[i] & (1 << bit))
+				hash ^= window;
+			window = (window << 1) | ((key[i + 4] >> bit) & 1);
+		}
+	}
+	return hash;
+}
+
+/* Returns the RSS hash of bp's flow: its IP addresses, and for TCP and UDP,
+ * its ports, the same way the NIC would hash it with our key.  Fragments only
+ * hash their addresses, so every piece of a datagram hashes alike.  Non-IP
+ * packets get 0. */
+uint32_t ether_rss_hash(struct ether *ether, struct block *bp)
+{
+	uint8_t in[36];			/* IPv6 addresses and ports */
+	uint8_t *p = bp->rp;
+	size_t hdr_len = BHLEN(bp), len;
+	uint16_t type;
+	int proto;
+	bool ports = TRUE;
+
+	if (hdr_len < ETHERHDRSIZE)
+		return 0;
+	type = nhgets(p + 2 * Eaddrlen);
+	p += ETHERHDRSIZE;
+	hdr_len -= ETHERHDRSIZE;
+	if (type == Type8021Q) {
+		if (hdr_len < 4)
+			return 0;
+		type = nhgets(p + 2);
+		p += 4;
+		hdr_len -= 4;
+	}
+	switch (type) {
+	case TypeIPv4:
+		if ((hdr_len < 20) || (hdr_len < (p[0] & 0xf) << 2))
+			return 0;
+		proto = p[9];
+		memcpy(in, p + 12, 8);
+		len = 8;
+		/* more fragments, or a fragment offset */
+		if (nhgets(p + 6) & 0x3fff)
+			ports = FALSE;
+		hdr_len -= (p[0] & 0xf) << 2;
+		p += (p[0] & 0xf) << 2;
+		break;
+	case TypeIPv6:
+		if (hdr_len < 40)
+			return 0;
+		proto = p[6];
+		memcpy(in, p + 8, 32);
+		len = 32;
+		p += 40;
+		hdr_len -= 40;
+		break;
+	default:
+		return 0;
+	}
+	if (ports && ((proto == 6) || (proto == 17)) && (hdr_len >= 4)) {
+		memcpy(in + len, p, 4);
+		len += 4;
+	}
+	return toeplitz_hash(ether->rss_key, in, len);
+}
+
+/* The core that should run queue qidx's input: one queue per core, skipping
+ * core 0, which takes the rest of the interrupts, and the cores MCPs have.
+ * Multiqueue drivers use this when steering their per-queue vectors. */
+int ether_queue_core(struct ether *ether, int qidx)
+{
+	return irq_spread_core(qidx);
+}
+
+/* Routes the interrupt for queue qidx, on apic_vec, to its core.  It'll move
+ * if an MCP gets that core. */
+int ether_steer_queue(struct ether *ether, int qidx, int apic_vec)
+{
+	return route_irqs_spread(apic_vec, qidx);
+}
+
+enum {
+	ItrClassLowest,
+	ItrClassLow,
+	ItrClassBulk,
+};
+
+static const unsigned int itr_class_rates[] = {
+	[ItrClassLowest] = EtherItrLowest,
+	[ItrClassLow] = EtherItrLow,
+	[ItrClassBulk] = EtherItrBulk,
+};
+
+void ether_itr_init(struct ether_itr *itr)
+{
+	itr->class = ItrClassLow;
+	itr->rate = EtherItrLow;
+	itr->pkts = 0;
+	itr->bytes = 0;
+}
+
+/* Picks the next class from the load of the last interrupt.  The thresholds
+ * are from Intel's drivers: they move one class at a time, and only leave low
+ * latency for small packets when there are a lot of them. */
+static int itr_next_class(int class, unsigned int pkts, unsigned int bytes)
+{
+	unsigned int avg;
+
+	if (!pkts)
+		return class;
+	avg = bytes / pkts;
+	switch (class) {
+	case ItrClassLowest:
+		if (avg > 8000)
+			return ItrClassBulk;
+		if (pkts < 5 && bytes > 512)
+			return ItrClassLow;
+		break;
+	case ItrClassLow:
+		if (bytes > 10000) {
+			if (avg > 8000 || pkts < 10 || avg > 1200)
+				return ItrClassBulk;
+			if (pkts > 35)
+				return ItrClassLowest;
+		} else if (avg > 2000) {
+			return ItrClassBulk;
+		} else if (pkts <= 2 && bytes < 512) {
+			return ItrClassLowest;
+		}
+		break;
+	case ItrClassBulk:
+		if (bytes > 25000) {
+			if (pkts > 35)
+				return ItrClassLow;
+		} else if (bytes < 6000) {
+			return ItrClassLow;
+		}
+		break;
+	}
+	return class;
+}
+
+/* Call after each interrupt, with itr's pkts and bytes counted up.  Returns
+ * TRUE if itr->rate changed and the driver should reprogram its throttle.
+ * Rates going up jump straight to the target, so latency recovers quickly, but
+ * rates going down are smoothed, so a single burst doesn't slow us down. */
+bool ether_itr_update(struct ether_itr *itr)
+{
+	unsigned int old = itr->rate, target;
+
+	itr->class = itr_next_class(itr->class, itr->pkts, itr->bytes);
+	itr->pkts = 0;
+	itr->bytes = 0;
+	target = itr_class_rates[itr->class];
+	if (target > old)
+		itr->rate = target;
+	else if (target < old)
+		itr->rate = (10ULL * target * old) / (9ULL * target + old);
+	return itr->rate != old;
+}
+
+/* Outbound packets use the queue their flow would come in on. */
+static int ether_tx_queue(struct ether *ether, struct block *bp)
+{
+	if (ether->nr_queues <= 1)
+		return 0;
+	return ether->rss_tbl[ether_rss_hash(ether, bp) % EtherRSSTblLen] %
+	       ether->nr_queues;
+}
+
+/* Sets up the outbound queues and the default RSS config, spreading the
+ * indirection table evenly over the queues.  Drivers can set their own key in
+ * reset. */
+static void ether_queues_init(struct ether *ether, int qsize)
+{
+	static const uint8_t zero_key[EtherRSSKeyLen];
+
+	ether->nr_queues = MAX(1, MIN(ether->nr_queues, MaxEtherQueues));
+	if (ether->oq)
+		ether->oqs[0] = ether->oq;
+	for (int i = 0; i < ether->nr_queues; i++) {
+		if (!ether->oqs[i])
+			ether->oqs[i] = qopen(qsize, Qmsg, 0, 0);
+		if (!ether->oqs[i])
+			panic("etherreset %s", ether->name);
+	}
+	ether->oq = ether->oqs[0];
+	if (!memcmp(ether->rss_key, zero_key, EtherRSSKeyLen))
+		memcpy(ether->rss_key, rss_default_key, EtherRSSKeyLen);
+	for (int i = 0; i < EtherRSSTblLen; i++)
+		ether->rss_tbl[i] = i % ether->nr_queues;
+	if (ether->rss_update)
+		ether->rss_update(ether);
+}
+
+static int __etheroq(struct ether *ether, struct block *bp)
 {
-	int len, loopback;
+	int len, loopback, qidx;
 	struct etherpkt *pkt;
 	int8_t irq_state = 0;
 
@@ -443,13 +932,187 @@ static int etheroq(struct ether *ether, struct block *bp)
 	if ((ether->feat & NETF_PADMIN) == 0 && BLEN(bp) < ether->minmtu)
 		bp = adjustblock(bp, ether->minmtu);
 
-	qbwrite(ether->oq, bp);
-	if (ether->transmit != NULL)
+	qidx = ether_tx_queue(ether, bp);
+	qbwrite(ether->oqs[qidx], bp);
+	if (ether->transmit_q != NULL)
+		ether->transmit_q(ether, qidx);
+	else if (ether->transmit != NULL)
 		ether->transmit(ether);
 
 	return len;
 }
 
+/* Software GSO, for devices without TSO.  Cuts a TCP/IPv4 super-segment from
+ * tcpoutput() into MSS-sized frames, each with a copy of the headers and its
+ * own IP length, ID and checksum, and TCP sequence number.  Only the last frame
+ * keeps FIN and PSH.  If the device can do TCP checksums, each frame's is left
+ * partial, like any other frame's.  Otherwise we sum the payload while we copy
+ * it.  Returns a list of frames linked by ->next, or 0 if bp wasn't something
+ * we can cut.  Eats bp. */
+static struct block *ether_gso(struct block *bp, unsigned int feat)
+{
+	struct block *segs = NULL, **tail = &segs, *seg;
+	uint8_t *ip, *tcp, phdr[12];
+	int ip_hlen, tcp_hlen, hdr_len, payload, mss, chunk;
+	uint32_t seq, sum = 0;
+	uint16_t id;
+
+	bp = linearizeblock(bp);
+	mss = bp->mss;
+	ip = bp->rp + ETHERHDRSIZE;
+	if ((BLEN(bp) < ETHERHDRSIZE + 40) || !mss ||
+	    (nhgets(bp->rp + 2 * Eaddrlen) != TypeIPv4) ||
+	    ((ip[0] >> 4) != 4) || (ip[9] != 6))
+		goto out;
+	ip_hlen = (ip[0] & 0xf) << 2;
+	if (BLEN(bp) < ETHERHDRSIZE + ip_hlen + 20)
+		goto out;
+	tcp = ip + ip_hlen;
+	tcp_hlen = (tcp[12] >> 4) << 2;
+	hdr_len = ETHERHDRSIZE + ip_hlen + tcp_hlen;
+	if ((tcp_hlen < 20) || (BLEN(bp) < hdr_len))
+		goto out;
+	id = nhgets(ip + 4);
+	seq = nhgetl(tcp + 4);
+	for (int off = hdr_len; off < BLEN(bp); off += chunk) {
+		chunk = MIN(mss, BLEN(bp) - off);
+		payload = tcp_hlen + chunk;
+		seg = block_alloc(hdr_len + chunk, MEM_WAIT);
+		memcpy(seg->wp, bp->rp, hdr_len);
+		if (feat & NETF_TCPCK)
+			memcpy(seg->wp + hdr_len, bp->rp + off, chunk);
+		else
+			sum = ptclbsum_copy(seg->wp + hdr_len, bp->rp + off, chunk);
+		seg->wp += hdr_len + chunk;
+		ip = seg->rp + ETHERHDRSIZE;
+		tcp = ip + ip_hlen;
+		hnputs(ip + 2, ip_hlen + payload);
+		hnputs(ip + 4, id++);
+		ip[10] = ip[11] = 0;
+		hnputs(ip + 10, ipcsum(ip));
+		hnputl(tcp + 4, seq);
+		seq += chunk;
+		if (off + chunk < BLEN(bp))
+			tcp[13] &= ~(TcpFIN | TcpPSH);
+		memcpy(phdr, ip + 12, 8);
+		phdr[8] = 0;
+		phdr[9] = 6;
+		hnputs(phdr + 10, payload);
+		if (feat & NETF_TCPCK) {
+			/* Pseudo-header sum, to be finished like tcpoutput()'s */
+			hnputs(tcp + 16, ptclbsum(phdr, sizeof(phdr)));
+			seg->checksum_start = ETHERHDRSIZE + ip_hlen;
+			seg->checksum_offset = 16;
+			seg->flag |= Btcpck;
+		} else {
+			tcp[16] = tcp[17] = 0;
+			sum += ptclbsum(phdr, sizeof(phdr)) + ptclbsum(tcp, tcp_hlen);
+			sum = (sum & 0xffff) + (sum >> 16);
+			sum = (sum & 0xffff) + (sum >> 16);
+			hnputs(tcp + 16, ~sum);
+		}
+		*tail = seg;
+		tail = &seg->next;
+	}
+out:
+	freeb(bp);
+	return segs;
+}
+
+static int etheroq(struct ether *ether, struct block *bp)
+{
+	struct block *seg;
+	int len;
+
+	if (!(bp->flag & Btso) || (ether->feat & NETF_TSO))
+		return __etheroq(ether, bp);
+	len = BLEN(bp);
+	bp = ether_gso(bp, ether->feat);
+	if (!bp)
+		ether->oerrs++;
+	while (bp) {
+		seg = bp;
+		bp = bp->next;
+		seg->next = NULL;
+		__etheroq(ether, seg);
+	}
+	return len;
+}
+
+/* Sets bp's offloads from the header the writer gave us.  Returns FALSE for
+ * anything we can't do: TSO needs a TCP/IPv4 frame for GSO, unless the device
+ * does TSO itself. */
+static bool ether_vnethdr_apply(struct ether *ether, struct block *bp,
+                                struct netif_vnethdr *vh)
+{
+	if (vh->flags & NETIF_VNET_F_NEEDS_CSUM) {
+		if (vh->csum_start + vh->csum_offset + 2 > BLEN(bp))
+			return FALSE;
+		bp->checksum_start = vh->csum_start;
+		bp->checksum_offset = vh->csum_offset;
+		/* UDP's checksum is 6 bytes in, TCP's is 16 */
+		bp->flag |= vh->csum_offset == 6 ? Budpck : Btcpck;
+	}
+	switch (vh->gso_type) {
+	case NETIF_VNET_GSO_NONE:
+		return BLEN(bp) <= ether->maxmtu + ETHERHDRSIZE;
+	case NETIF_VNET_GSO_TCPV4:
+		break;
+	case NETIF_VNET_GSO_TCPV6:
+		if (!(ether->feat & NETF_TSO))
+			return FALSE;
+		break;
+	default:
+		return FALSE;
+	}
+	if (!vh->gso_size)
+		return FALSE;
+	bp->flag |= Btso;
+	bp->mss = vh->gso_size;
+	return TRUE;
+}
+
+/* A batch-mode write: any number of records, each a 2 byte big-endian length
+ * and then a frame, maybe after a netif_vnethdr.  A record that runs off the
+ * end of the write is dropped. */
+static long etherwrite_batch(struct ether *ether, struct netfile *f,
+                             uint8_t *buf, long n)
+{
+	struct netif_vnethdr vh;
+	int hlen = f->vnethdr ? sizeof(vh) : 0;
+	struct block *bp;
+	long off = 0;
+	int len;
+
+	while (n - off >= NETIF_BATCHHDR) {
+		len = nhgets(buf + off);
+		off += NETIF_BATCHHDR;
+		if (len > n - off)
+			break;
+		if ((!hlen && len > ether->maxmtu + ETHERHDRSIZE) ||
+		    len < hlen + ETHERHDRSIZE) {
+			ether->oerrs++;
+			off += len;
+			continue;
+		}
+		memcpy(&vh, buf + off, hlen);
+		off += hlen;
+		len -= hlen;
+		bp = block_alloc(len, MEM_WAIT);
+		memmove(bp->wp, buf + off, len);
+		memmove(bp->wp + Eaddrlen, ether->ea, Eaddrlen);
+		bp->wp += len;
+		off += len;
+		if (hlen && !ether_vnethdr_apply(ether, bp, &vh)) {
+			ether->oerrs++;
+			freeb(bp);
+			continue;
+		}
+		etheroq(ether, bp);
+	}
+	return n;
+}
+
 static long etherwrite(struct chan *chan, void *buf, long n, int64_t unused)
 {
 	ERRSTACK(2);
@@ -479,8 +1142,8 @@ static long etherwrite(struct chan *chan, void *buf, long n, int64_t unused)
 				onoff = 1;
 			else
 				onoff = atoi(cb->f[1]);
-			if (ether->oq != NULL)
-				qdropoverflow(ether->oq, onoff);
+			for (int i = 0; i < ether->nr_queues; i++)
+				qdropoverflow(ether->oqs[i], onoff);
 			kfree(cb);
 			goto out;
 		}
@@ -492,6 +1155,11 @@ static long etherwrite(struct chan *chan, void *buf, long n, int64_t unused)
 		error(EINVAL, ERROR_FIXME);
 	}
 
+	if (ether->f[NETID(chan->qid.path)]->batch) {
+		l = etherwrite_batch(ether, ether->f[NETID(chan->qid.path)], buf,
+		                     n);
+		goto out;
+	}
 	if (n > ether->maxmtu + ETHERHDRSIZE)
 		error(E2BIG, ERROR_FIXME);
 	bp = block_alloc(n, MEM_WAIT);
@@ -511,7 +1179,7 @@ out:
 	return l;
 }
 
-static long etherbwrite(struct chan *chan, struct block *bp, uint32_t unused)
+static long etherbwrite(struct chan *chan, struct block *bp, int64_t unused)
 {
 	ERRSTACK(1);
 	struct ether *ether;
@@ -529,6 +1197,17 @@ static long etherbwrite(struct chan *chan, struct block *bp, uint32_t unused)
 		return n;
 	}
 	ether = chan->aux;
+	if (ether->f[NETID(chan->qid.path)]->batch) {
+		bp = linearizeblock(bp);
+		if (waserror()) {
+			freeb(bp);
+			nexterror();
+		}
+		n = etherwrite(chan, bp->rp, BLEN(bp), 0);
+		poperror();
+		freeb(bp);
+		return n;
+	}
 	rlock(&ether->rwlock);
 	if (waserror()) {
 		runlock(&ether->rwlock);
@@ -614,6 +1293,7 @@ static struct ether *vlanalloc(struct ether *ether, int id)
 			error(ENOMEM, ERROR_FIXME);
 		rwinit(&vlan->rwlock);
 		qlock_init(&vlan->vlq);
+		spinlock_init_irqsave(&vlan->gro_lock);
 		netifinit(vlan, name, Ntypes, ether->limit);
 		ether->vlans[fid] = vlan;	/* id is still zero, can't be matched */
 		ether->nvlan++;
@@ -637,6 +1317,7 @@ static struct ether *vlanalloc(struct ether *ether, int id)
 	memmove(vlan->addr, ether->addr, sizeof(vlan->addr));
 	memmove(vlan->bcast, ether->bcast, sizeof(ether->bcast));
 	vlan->oq = NULL;
+	vlan->feat = NETF_GSO;
 	vlan->ctlr = ether;
 	vlan->vlanid = id;
 	poperror();
@@ -694,6 +1375,7 @@ static void etherreset(void)
 		memset(ether, 0, sizeof(struct ether));
 		rwinit(&ether->rwlock);
 		qlock_init(&ether->vlq);
+		spinlock_init_irqsave(&ether->gro_lock);
 		ether->ctlrno = ctlrno;
 		ether->mbps = 10;
 		ether->minmtu = ETHERMINTU;
@@ -766,10 +1448,8 @@ static void etherreset(void)
 				qsize = 8 * 1024 * 1024;
 			}
 			netifinit(ether, name, Ntypes, qsize);
-			if (ether->oq == 0)
-				ether->oq = qopen(qsize, Qmsg, 0, 0);
-			if (ether->oq == 0)
-				panic("etherreset %s", name);
+			ether_queues_init(ether, qsize);
+			ether->feat |= NETF_GSO;
 			ether->alen = Eaddrlen;
 			memmove(ether->addr, ether->ea, Eaddrlen);
 			memset(ether->bcast, 0xFF, Eaddrlen);
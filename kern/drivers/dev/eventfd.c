@@ -6,7 +6,15 @@
  *
  * Unlike the Linux interface, which takes host-endian u64s, we read and write
  * strings.  It's a little slower, but it maintains the distributed-system
- * nature of Plan 9 devices. */
+ * nature of Plan 9 devices.
+ *
+ * Reads and writes are a CAS on the counter.  The rendezes and taps are only
+ * poked if someone is sleeping on the other side or a tap is registered, so
+ * an eventfd that's used as a wakeup when no one is waiting doesn't touch
+ * any locks.  Sleepers bump nr_*_sleepers before their rendez checks the
+ * counter, and wakers check nr_*_sleepers after their CAS.  The atomics are
+ * full barriers, so either the waker sees the sleeper or the sleeper sees the
+ * new count. */
 
 #include <ns.h>
 #include <kmalloc.h>
@@ -18,6 +26,7 @@
 #include <error.h>
 #include <sys/queue.h>
 #include <fdtap.h>
+#include <event.h>
 #include <syscall.h>
 
 struct dev efd_devtab;
@@ -52,6 +61,8 @@ struct eventfd {
 	spinlock_t					tap_lock;
 	struct rendez				rv_readers;
 	struct rendez				rv_writers;
+	atomic_t					nr_rd_sleepers;
+	atomic_t					nr_wr_sleepers;
 	struct kref					refcnt;
 };
 
@@ -143,8 +154,10 @@ static void efd_fire_taps(struct eventfd *efd, int filter)
 	 * from writers or anything like that.
 	 * TODO: (RCU) Locking to protect the list and the tap's existence. */
 	spin_lock(&efd->tap_lock);
+	event_defer_notifs();
 	SLIST_FOREACH(tap_i, &efd->fd_taps, link)
 		fire_tap(tap_i, filter);
+	event_flush_notifs();
 	spin_unlock(&efd->tap_lock);
 }
 
@@ -154,6 +167,22 @@ static int has_counts(void *arg)
 	return atomic_read(&efd->counter) != 0;
 }
 
+/* Sleeps on rv until cond, letting the other side know it needs to wake us. */
+static void efd_sleep(struct rendez *rv, atomic_t *nr_sleepers,
+                      int (*cond)(void*), struct eventfd *efd)
+{
+	ERRSTACK(1);
+
+	atomic_inc(nr_sleepers);
+	if (waserror()) {
+		atomic_dec(nr_sleepers);
+		nexterror();
+	}
+	rendez_sleep(rv, cond, efd);
+	poperror();
+	atomic_dec(nr_sleepers);
+}
+
 /* The heart of reading an eventfd */
 static unsigned long efd_read_efd(struct eventfd *efd, struct chan *c)
 {
@@ -163,7 +192,8 @@ static unsigned long efd_read_efd(struct eventfd *efd, struct chan *c)
 		if (!old_count) {
 			if (c->flag & O_NONBLOCK)
 				error(EAGAIN, "Would block on #%s read", devname());
-			rendez_sleep(&efd->rv_readers, has_counts, efd);
+			efd_sleep(&efd->rv_readers, &efd->nr_rd_sleepers, has_counts,
+			          efd);
 		} else {
 			if (efd->flags & EFD_SEMAPHORE) {
 				new_count = old_count - 1;
@@ -177,7 +207,8 @@ static unsigned long efd_read_efd(struct eventfd *efd, struct chan *c)
 		}
 	}
 success:
-	rendez_wakeup(&efd->rv_writers);
+	if (atomic_read(&efd->nr_wr_sleepers))
+		rendez_wakeup(&efd->rv_writers);
 	efd_fire_taps(efd, FDTAP_FILT_WRITABLE);
 	return ret;
 }
@@ -219,14 +250,16 @@ static void efd_write_efd(struct eventfd *efd, unsigned long add_to,
 		if (new_count > EFD_MAX_VAL) {
 			if (c->flag & O_NONBLOCK)
 				error(EAGAIN, "Would block on #%s write", devname());
-			rendez_sleep(&efd->rv_writers, has_room, efd);
+			efd_sleep(&efd->rv_writers, &efd->nr_wr_sleepers, has_room,
+			          efd);
 		} else {
 			if (atomic_cas(&efd->counter, old_count, new_count))
 				goto success;
 		}
 	}
 success:
-	rendez_wakeup(&efd->rv_readers);
+	if (atomic_read(&efd->nr_rd_sleepers))
+		rendez_wakeup(&efd->rv_readers);
 	efd_fire_taps(efd, FDTAP_FILT_READABLE);
 }
 
@@ -26,10 +26,16 @@
 #include <umem.h>
 #include <profiler.h>
 #include <kprof.h>
+#include <memprof.h>
+#include <lockprof.h>
 #include <ros/procinfo.h>
+#include <ros/mpstat.h>
+#include <syscall.h>
+#include <kpz.h>
 
 #define KTRACE_BUFFER_SIZE (128 * 1024)
 #define TRACE_PRINTK_BUFFER_SIZE (8 * 1024)
+#define KPZ_BATCH_SZ (4 * 1024 * 1024)
 
 enum {
 	Kprofdirqid = 0,
@@ -39,6 +45,12 @@ enum {
 	Kprintxqid,
 	Kmpstatqid,
 	Kmpstatrawqid,
+	Kpmemqid,
+	Kplockqid,
+	Kpvmexitqid,
+	Kpsyslatqid,
+	Kprofdatazqid,
+	Kptracezqid,
 };
 
 struct trace_printk_buffer {
@@ -62,6 +74,26 @@ struct dirtab kproftab[] = {
 	{"kprintx",		{Kprintxqid},		0,	0600},
 	{"mpstat",		{Kmpstatqid},		0,	0600},
 	{"mpstat-raw",	{Kmpstatrawqid},	0,	0600},
+	{"kpmem",		{Kpmemqid},			0,	0600},
+	{"kplock",		{Kplockqid},		0,	0600},
+	{"kpvmexit",	{Kpvmexitqid},		0,	0600},
+	{"kpsyslat",	{Kpsyslatqid},		0,	0600},
+	{"kpdata.z",	{Kprofdatazqid},	0,	0600},
+	{"kptrace.z",	{Kptracezqid},		0,	0600},
+};
+
+/* A reader's snapshot of the memprof or lockprof report, so that it doesn't
+ * change between reads at different offsets. */
+struct kpmem_snap {
+	char *buf;
+	size_t len;
+};
+
+/* A kpdata.z reader's frames, which it might only have read part of. */
+struct kpz_stream {
+	qlock_t lock;
+	struct sized_alloc *sza;
+	size_t off;
 };
 
 static struct kprof kprof;
@@ -80,10 +112,9 @@ static size_t mpstat_len(void)
 
 static size_t mpstatraw_len(void)
 {
-	size_t header_row = 27 + NR_CPU_STATES * 7 + 1;
-	size_t cpu_row = 7 + NR_CPU_STATES * 17;
-
-	return header_row + cpu_row * num_cores + 1;
+	return sizeof(struct mpstat_raw_hdr) + NR_CPU_STATES * MPSTAT_NAME_LEN +
+	       num_cores * (sizeof(struct mpstat_raw_core) +
+	                    NR_CPU_STATES * sizeof(uint64_t));
 }
 
 static char *devname(void)
@@ -197,10 +228,66 @@ static long kprof_profdata_read(void *dest, long size, int64_t off)
 	return profiler_read(dest, size);
 }
 
+/* Compresses whatever the profiler has, up to KPZ_BATCH_SZ at a time.  Like
+ * kpdata, this blocks until there's something to read, and returns 0 once the
+ * profiler has stopped and been drained. */
+static long kprof_profdataz_read(struct chan *c, void *va, long n)
+{
+	ERRSTACK(1);
+	struct kpz_stream *ks = c->aux;
+	char *raw = NULL;
+	long raw_len = 0;
+
+	qlock(&ks->lock);
+	if (waserror()) {
+		kfree(raw);
+		qunlock(&ks->lock);
+		nexterror();
+	}
+	if (!ks->sza || ks->off == ks->sza->size) {
+		kfree(ks->sza);
+		ks->sza = NULL;
+		ks->off = 0;
+		raw = kmalloc(KPZ_BATCH_SZ, MEM_WAIT);
+		do {
+			raw_len += profiler_read(raw + raw_len, KPZ_BATCH_SZ - raw_len);
+		} while (raw_len && raw_len < KPZ_BATCH_SZ && kprof_profdata_size());
+		if (raw_len) {
+			ks->sza = kpz_compress(raw, raw_len);
+			if (!ks->sza)
+				error(ENOMEM, "Unable to compress the profiler data");
+		}
+		kfree(raw);
+		raw = NULL;
+	}
+	n = ks->sza ? readmem(ks->off, va, n, ks->sza->buf, ks->sza->size) : 0;
+	ks->off += n;
+	poperror();
+	qunlock(&ks->lock);
+	return n;
+}
+
+/* kptrace.z is a snapshot, taken when it's opened. */
+static struct sized_alloc *kprof_tracedataz_snap(void)
+{
+	size_t len = kprof_tracedata_size();
+	char *raw = kmalloc(MAX(len, 1), MEM_WAIT);
+	struct sized_alloc *sza;
+
+	len = kprof_tracedata_read(raw, len, 0);
+	sza = kpz_compress(raw, len);
+	kfree(raw);
+	if (!sza)
+		error(ENOMEM, "Unable to compress the trace data");
+	return sza;
+}
+
 static int kprof_stat(struct chan *c, uint8_t *db, int n)
 {
 	kproftab[Kprofdataqid].length = kprof_profdata_size();
 	kproftab[Kptraceqid].length = kprof_tracedata_size();
+	/* Just so that perf can tell if there's anything to read */
+	kproftab[Kprofdatazqid].length = kprof_profdata_size();
 
 	return devstat(c, db, n, kproftab, ARRAY_SIZE(kproftab), devgen);
 }
@@ -226,6 +313,50 @@ static struct chan *kprof_open(struct chan *c, int omode)
 		profiler_setup();
 		qunlock(&kprof.lock);
 		break;
+	case Kpmemqid:
+		if (openmode(omode) != O_WRITE) {
+			struct kpmem_snap *snap = kzmalloc(sizeof(*snap), MEM_WAIT);
+
+			snap->buf = memprof_report(&snap->len);
+			c->aux = snap;
+		}
+		break;
+	case Kplockqid:
+		if (openmode(omode) != O_WRITE) {
+			struct kpmem_snap *snap = kzmalloc(sizeof(*snap), MEM_WAIT);
+
+			snap->buf = lockprof_report(&snap->len);
+			c->aux = snap;
+		}
+		break;
+	case Kpvmexitqid:
+		if (openmode(omode) != O_WRITE) {
+			struct kpmem_snap *snap = kzmalloc(sizeof(*snap), MEM_WAIT);
+
+			snap->buf = vmexit_stats_report(&snap->len);
+			c->aux = snap;
+		}
+		break;
+	case Kpsyslatqid:
+		if (openmode(omode) != O_WRITE)
+			c->aux = sysc_lat_report(NULL);
+		break;
+	case Kprofdatazqid:
+	case Kptracezqid:
+		#ifndef CONFIG_ZLIB_DEFLATE
+		error(ENOSYS, "Kernel built without CONFIG_ZLIB_DEFLATE");
+		#endif
+		if (openmode(omode) != O_READ)
+			error(EPERM, "Compressed files are read-only");
+		if (c->qid.path == Kptracezqid) {
+			c->aux = kprof_tracedataz_snap();
+		} else {
+			struct kpz_stream *ks = kzmalloc(sizeof(*ks), MEM_WAIT);
+
+			qlock_init(&ks->lock);
+			c->aux = ks;
+		}
+		break;
 	}
 	c->mode = openmode(omode);
 	c->flag |= COPEN;
@@ -244,6 +375,28 @@ static void kprof_close(struct chan *c)
 			kprof.opened = FALSE;
 			qunlock(&kprof.lock);
 			break;
+		case Kpmemqid:
+		case Kplockqid:
+		case Kpvmexitqid:
+			if (c->aux) {
+				struct kpmem_snap *snap = c->aux;
+
+				kfree(snap->buf);
+				kfree(snap);
+			}
+			break;
+		case Kpsyslatqid:
+		case Kptracezqid:
+			kfree(c->aux);
+			break;
+		case Kprofdatazqid:
+			if (c->aux) {
+				struct kpz_stream *ks = c->aux;
+
+				kfree(ks->sza);
+				kfree(ks);
+			}
+			break;
 		}
 	}
 }
@@ -289,34 +442,60 @@ static long mpstat_read(void *va, long n, int64_t off)
 static long mpstatraw_read(void *va, long n, int64_t off)
 {
 	size_t bufsz = mpstatraw_len();
-	char *buf = kmalloc(bufsz, MEM_WAIT);
-	int len = 0;
+	void *buf = kzmalloc(bufsz, MEM_WAIT);
+	struct mpstat_raw_hdr *hdr = buf;
+	struct mpstat_raw_core *core;
+	char *names = buf + sizeof(struct mpstat_raw_hdr);
 	struct per_cpu_info *pcpui;
 
-	/* could spit it all out in binary, though then it'd be harder to process
-	 * the data across a mnt (if we export #K).  probably not a big deal. */
-
-	/* header line: version, num_cores, tsc freq, state names */
-	len += snprintf(buf + len, bufsz - len, "v%03d %5d %16llu", 1, num_cores,
-	                __proc_global_info.tsc_freq);
+	if (kprof.mpstat_ipi)
+		send_broadcast_ipi(I_POKE_CORE);
+	hdr->magic = MPSTAT_RAW_MAGIC;
+	hdr->version = MPSTAT_RAW_VERSION;
+	hdr->hdr_size = sizeof(struct mpstat_raw_hdr);
+	hdr->nr_cores = num_cores;
+	hdr->nr_states = NR_CPU_STATES;
+	hdr->tsc_freq = __proc_global_info.tsc_freq;
+	hdr->tsc = read_tsc();
 	for (int j = 0; j < NR_CPU_STATES; j++)
-		len += snprintf(buf + len, bufsz - len, " %6s", cpu_state_names[j]);
-	len += snprintf(buf + len, bufsz - len, "\n");
-
+		strlcpy(names + j * MPSTAT_NAME_LEN, cpu_state_names[j],
+		        MPSTAT_NAME_LEN);
+	core = (void*)names + NR_CPU_STATES * MPSTAT_NAME_LEN;
 	for (int i = 0; i < num_cores; i++) {
 		pcpui = &per_cpu_info[i];
-		len += snprintf(buf + len, bufsz - len, "%5d: ", i);
-		for (int j = 0; j < NR_CPU_STATES; j++) {
-			len += snprintf(buf + len, bufsz - len, "%16llx%s",
-			                pcpui->state_ticks[j],
-			                j != NR_CPU_STATES - 1 ? " " : "\n");
-		}
+		core->coreid = i;
+		core->cur_state = ACCESS_ONCE(pcpui->cpu_state);
+		for (int j = 0; j < NR_CPU_STATES; j++)
+			core->ticks[j] = ACCESS_ONCE(pcpui->state_ticks[j]);
+		core = (void*)core + sizeof(struct mpstat_raw_core) +
+		       NR_CPU_STATES * sizeof(uint64_t);
 	}
-	n = readstr(off, va, n, buf);
+	n = readmem(off, va, n, buf, bufsz);
 	kfree(buf);
 	return n;
 }
 
+/* kpmem's records are the profiler's PROFTYPE_KERN_TRACE64s, one per site, so
+ * the usual perf tools can symbolize them.  kplock's and kpvmexit's reports are
+ * text. */
+static long kpmem_read(struct chan *c, void *va, long n, int64_t off)
+{
+	struct kpmem_snap *snap = c->aux;
+
+	if (!snap)
+		error(EBADF, "Opened write-only");
+	return readmem(off, va, n, snap->buf, snap->len);
+}
+
+static long kprof_sza_read(struct chan *c, void *va, long n, int64_t off)
+{
+	struct sized_alloc *sza = c->aux;
+
+	if (!sza)
+		error(EBADF, "Opened write-only");
+	return readmem(off, va, n, sza->buf, sza->size);
+}
+
 static long kprof_read(struct chan *c, void *va, long n, int64_t off)
 {
 	uint64_t w, *bp;
@@ -342,6 +521,18 @@ static long kprof_read(struct chan *c, void *va, long n, int64_t off)
 	case Kmpstatrawqid:
 		n = mpstatraw_read(va, n, offset);
 		break;
+	case Kpmemqid:
+	case Kplockqid:
+	case Kpvmexitqid:
+		n = kpmem_read(c, va, n, offset);
+		break;
+	case Kpsyslatqid:
+	case Kptracezqid:
+		n = kprof_sza_read(c, va, n, offset);
+		break;
+	case Kprofdatazqid:
+		n = kprof_profdataz_read(c, va, n);
+		break;
 	default:
 		n = 0;
 		break;
@@ -420,6 +611,39 @@ static long kprof_write(struct chan *c, void *a, long n, int64_t unused)
 			error(EFAIL, "Bad mpstat option (reset|ipi|on|off)");
 		}
 		break;
+	case Kpmemqid:
+		if (cb->nf < 1)
+			error(EFAIL, "Bad kpmem option (start [rate]|stop)");
+		if (!strcmp(cb->f[0], "start")) {
+			memprof_start(cb->nf > 1 ? strtoul(cb->f[1], 0, 0) : 0);
+		} else if (!strcmp(cb->f[0], "stop")) {
+			memprof_stop();
+		} else {
+			error(EFAIL, "Bad kpmem option (start [rate]|stop)");
+		}
+		break;
+	case Kplockqid:
+		if (cb->nf < 1)
+			error(EFAIL, "Bad kplock option (start|stop)");
+		if (!strcmp(cb->f[0], "start")) {
+			if (lockprof_start())
+				error(ENOSYS, "Kernel built without CONFIG_LOCK_PROFILE");
+		} else if (!strcmp(cb->f[0], "stop")) {
+			lockprof_stop();
+		} else {
+			error(EFAIL, "Bad kplock option (start|stop)");
+		}
+		break;
+	case Kpvmexitqid:
+		if (cb->nf < 1 || strcmp(cb->f[0], "reset"))
+			error(EFAIL, "Bad kpvmexit option (reset)");
+		vmexit_stats_reset();
+		break;
+	case Kpsyslatqid:
+		if (cb->nf < 1 || strcmp(cb->f[0], "reset"))
+			error(EFAIL, "Bad kpsyslat option (reset)");
+		sysc_lat_reset();
+		break;
 	default:
 		error(EBADFD, ERROR_FIXME);
 	}
@@ -59,8 +59,10 @@ static char *devname(void)
  * connection.
  */
 
-#define MAXRPC (IOHDRSZ+8192)
+#define MAXRPC (IOHDRSZ + 1024 * 1024)
 #define MAXTAG MAX_U16_POOL_SZ
+/* Read/write rpcs a single mntrdwr() keeps in flight */
+#define MNT_MAX_INFLIGHT 8
 
 static __inline int isxdigit(int c)
 {
@@ -119,6 +121,9 @@ struct mntrpc *mntralloc(struct chan *, uint32_t);
 long mntrdwr(int unused_int, struct chan *, void *, long, int64_t);
 int mntrpcread(struct mnt *, struct mntrpc *);
 void mountio(struct mnt *, struct mntrpc *);
+static void __mountio(struct mnt *, struct mntrpc *, bool);
+static void mntsend(struct mnt *, struct mntrpc *);
+static void mntreplycheck(struct mnt *, struct mntrpc *);
 void mountmux(struct mnt *, struct mntrpc *);
 void mountrpc(struct mnt *, struct mntrpc *);
 int rpcattn(void *);
@@ -242,7 +247,7 @@ long mntversion(struct chan *c, char *version, int msize, int returnlen)
 	}
 	if (f.msize > msize)
 		error(EFAIL, "server tries to increase msize in fversion");
-	if (f.msize < 256 || f.msize > 1024 * 1024)
+	if (f.msize < 256 || f.msize > MAXRPC)
 		error(EFAIL, "nonsense value of msize in fversion");
 	if (strncmp(f.version, v, strlen(f.version)) != 0)
 		error(EFAIL, "bad 9P version returned from server");
@@ -458,6 +463,8 @@ static struct walkqid *mntwalk(struct chan *c, struct chan *nc, char **name,
 		 * Therefore set type to -1 for now.  inferno was setting this to 0,
 		 * assuming it was devroot.  lining up with chanrelease and newchan */
 		nc->type = -1;
+		/* devclone() leaves the flags alone, but the cache is per mount */
+		nc->flag |= c->flag & CCACHE;
 		alloc = 1;
 	}
 	wq->clone = nc;
@@ -513,10 +520,18 @@ static int mntstat(struct chan *c, uint8_t * dp, int n)
 	ERRSTACK(1);
 	struct mnt *m;
 	struct mntrpc *r;
+	int nc;
 
 	if (n < BIT16SZ)
 		error(EINVAL, ERROR_FIXME);
 	m = mntchk(c);
+	if (c->flag & CCACHE) {
+		nc = cstat(c, dp, n);
+		if (nc) {
+			mntdirfix(dp, c);
+			return nc;
+		}
+	}
 	r = mntralloc(c, m->msize);
 	if (waserror()) {
 		mntfree(r);
@@ -534,6 +549,8 @@ static int mntstat(struct chan *c, uint8_t * dp, int n)
 		n = r->reply.nstat;
 		memmove(dp, r->reply.stat, n);
 		validstat(dp, n, 0);
+		if (c->flag & CCACHE)
+			cstatupdate(c, dp, n);
 		mntdirfix(dp, c);
 	}
 	poperror();
@@ -678,6 +695,8 @@ static int mntwstat(struct chan *c, uint8_t * dp, int n)
 	mountrpc(m, r);
 	poperror();
 	mntfree(r);
+	if (c->flag & CCACHE)
+		cstatinval(c);
 	return n;
 }
 
@@ -743,69 +762,136 @@ static long mntwrite(struct chan *c, void *buf, long n, int64_t off)
 	return mntrdwr(Twrite, c, buf, n, off);
 }
 
-long mntrdwr(int type, struct chan *c, void *buf, long n, int64_t off)
+/*
+ * Cleans up after a failed batch: flushes the rpcs that are still outstanding,
+ * so the server is done with their tags before we reuse them, and frees them
+ * all.
+ */
+static void mntdrain(struct mnt *m, struct mntrpc **rpcs, int nrpc)
 {
 	ERRSTACK(1);
-	struct mnt *m;
-	struct mntrpc *r;			/* TO DO: volatile struct { Mntrpc *r; } r; */
-	char *uba;
+	struct mntrpc *r;
+
+	for (int i = 0; i < nrpc; i++) {
+		r = rpcs[i];
+		if (!r)
+			continue;
+		if (!r->done) {
+			if (!waserror())
+				__mountio(m, mntflushalloc(r, m->msize), FALSE);
+			poperror();
+		}
+		mntfree(r);
+	}
+}
+
+/*
+ * Sends up to nrpc reads or writes for consecutive chunks of uba before
+ * waiting on any of them, so a big I/O costs one round trip instead of one per
+ * chunk.  The replies can come back in any order; mountmux() pairs them up by
+ * tag, and we put the data back together in offset order here.  Returns the
+ * amount transferred.  *shortp is set if a chunk came up short, in which case
+ * whatever the later chunks did doesn't count.
+ */
+static long mntrdwr_batch(int type, struct chan *c, struct mnt *m,
+                          struct mntrpc **rpcs, int nrpc, uint8_t *uba,
+                          long n, int64_t off, bool *shortp)
+{
+	ERRSTACK(1);
+	struct mntrpc *r;
+	uint32_t nr, nreq;
 	int cache;
-	uint32_t cnt, nr, nreq;
+	long cnt = 0;
 
-	m = mntchk(c);
-	uba = buf;
-	cnt = 0;
 	cache = c->flag & CCACHE;
 	if (c->qid.type & QTDIR)
 		cache = 0;
-	for (;;) {
-		r = mntralloc(c, m->msize);
-		if (waserror()) {
-			mntfree(r);
-			nexterror();
-		}
+	*shortp = FALSE;
+	memset(rpcs, 0, nrpc * sizeof(struct mntrpc *));
+	if (waserror()) {
+		mntdrain(m, rpcs, nrpc);
+		nexterror();
+	}
+	for (int i = 0; i < nrpc && n > 0; i++) {
+		/* A Tread's data comes back in blocks, not in the rpc buffer */
+		r = mntralloc(c, type == Tread ? IOHDRSZ : m->msize);
+		rpcs[i] = r;
 		r->request.type = type;
 		r->request.fid = c->fid;
 		r->request.offset = off;
-		r->request.data = uba;
-		nr = n;
-		if (nr > m->msize - IOHDRSZ)
-			nr = m->msize - IOHDRSZ;
+		r->request.data = (char *)uba;
+		nr = MIN(n, m->msize - IOHDRSZ);
 		r->request.count = nr;
-		mountrpc(m, r);
+		mntsend(m, r);
+		off += nr;
+		uba += nr;
+		n -= nr;
+	}
+	for (int i = 0; i < nrpc && rpcs[i]; i++) {
+		r = rpcs[i];
+		__mountio(m, r, TRUE);
+		mntreplycheck(m, r);
+		if (*shortp)
+			continue;
 		nreq = r->request.count;
-		nr = r->reply.count;
-		if (nr > nreq)
-			nr = nreq;
-
+		nr = MIN(r->reply.count, nreq);
 		if (type == Tread)
-			r->b = bl2mem((uint8_t *) uba, r->b, nr);
+			r->b = bl2mem((uint8_t *)r->request.data, r->b, nr);
 		else if (cache)
-			cwrite(c, (uint8_t *) uba, nr, off);
+			cwrite(c, (uint8_t *)r->request.data, nr, r->request.offset);
+		cnt += nr;
+		if (nr != nreq)
+			*shortp = TRUE;
+	}
+	poperror();
+	for (int i = 0; i < nrpc && rpcs[i]; i++)
+		mntfree(rpcs[i]);
+	return cnt;
+}
 
-		poperror();
-		mntfree(r);
+/*
+ * Every rpc carries its own tag, offset and buffer, and only reads the chan's
+ * fid, so any number of these can run on one chan at once (see struct dev).
+ */
+long mntrdwr(int type, struct chan *c, void *buf, long n, int64_t off)
+{
+	struct mnt *m;
+	struct mntrpc *rpcs[MNT_MAX_INFLIGHT];
+	uint8_t *uba;
+	int depth;
+	long cnt, nr;
+	bool short_io;
+
+	m = mntchk(c);
+	uba = buf;
+	cnt = 0;
+	/* Directory reads and appends depend on where the last rpc left off */
+	depth = c->qid.type & (QTDIR | QTAPPEND) ? 1 : MNT_MAX_INFLIGHT;
+	for (;;) {
+		nr = mntrdwr_batch(type, c, m, rpcs, depth, uba, n, off, &short_io);
 		off += nr;
 		uba += nr;
 		cnt += nr;
 		n -= nr;
-		if (nr != nreq || n == 0 /*|| current->killed */ )
+		if (short_io || n == 0 /*|| current->killed */ )
 			break;
 	}
 	return cnt;
 }
 
 void mountrpc(struct mnt *m, struct mntrpc *r)
+{
+	mountio(m, r);
+	mntreplycheck(m, r);
+}
+
+/* Throws if r's reply is an error or doesn't match the request. */
+static void mntreplycheck(struct mnt *m, struct mntrpc *r)
 {
 	char *sn, *cn;
 	int t;
 	char *e;
 
-	r->reply.tag = 0;
-	r->reply.type = Tmax;	/* can't ever be a valid message type */
-
-	mountio(m, r);
-
 	t = r->reply.type;
 	switch (t) {
 		case Rerror:
@@ -843,10 +929,49 @@ void mountrpc(struct mnt *m, struct mntrpc *r)
 	}
 }
 
+/*
+ * Queues r and transmits its request, without waiting for the reply.  The
+ * reply is picked up by whoever is reading for m; __mountio() waits for it.
+ */
+static void mntsend(struct mnt *m, struct mntrpc *r)
+{
+	int n;
+
+	r->reply.tag = 0;
+	r->reply.type = Tmax;	/* can't ever be a valid message type */
+
+	spin_lock(&m->lock);
+	r->m = m;
+	r->list = m->queue;
+	m->queue = r;
+	spin_unlock(&m->lock);
+
+	/* Transmit a file system rpc */
+	if (m->msize == 0)
+		panic("msize");
+	n = convS2M(&r->request, r->rpc, r->rpclen);
+	if (n <= 0)
+		panic("bad message type in mountio");
+	if (devtab[m->c->type].write(m->c, r->rpc, n, 0) != n) {
+		mntqrm(m, r);
+		error(EIO, ERROR_FIXME);
+	}
+/*	r->stime = fastticks(NULL); */
+	r->reqlen = n;
+}
+
 void mountio(struct mnt *m, struct mntrpc *r)
+{
+	__mountio(m, r, FALSE);
+}
+
+/*
+ * Runs r to completion: sends it unless it was already sent, then waits for
+ * its reply, taking a turn as m's reader if no one else is.
+ */
+static void __mountio(struct mnt *m, struct mntrpc *r, bool sent)
 {
 	ERRSTACK(1);
-	int n;
 
 	while (waserror()) {
 		if (m->rip == current)
@@ -861,39 +986,26 @@ void mountio(struct mnt *m, struct mntrpc *r)
 			nexterror();
 		}
 		r = mntflushalloc(r, m->msize);
+		sent = FALSE;
 		/* need one for every waserror call (so this plus one outside) */
 		poperror();
 	}
 
-	spin_lock(&m->lock);
-	r->m = m;
-	r->list = m->queue;
-	m->queue = r;
-	spin_unlock(&m->lock);
-
-	/* Transmit a file system rpc */
-	if (m->msize == 0)
-		panic("msize");
-	n = convS2M(&r->request, r->rpc, m->msize);
-	if (n < 0)
-		panic("bad message type in mountio");
-	if (devtab[m->c->type].write(m->c, r->rpc, n, 0) != n)
-		error(EIO, ERROR_FIXME);
-/*	r->stime = fastticks(NULL); */
-	r->reqlen = n;
+	if (!sent)
+		mntsend(m, r);
 
 	/* Gate readers onto the mount point one at a time */
 	for (;;) {
-		spin_lock(&m->lock);
-		if (m->rip == 0)
-			break;
-		spin_unlock(&m->lock);
-		rendez_sleep(&r->r, rpcattn, r);
 		if (r->done) {
 			poperror();
 			mntflushfree(m, r);
 			return;
 		}
+		spin_lock(&m->lock);
+		if (m->rip == 0)
+			break;
+		spin_unlock(&m->lock);
+		rendez_sleep(&r->r, rpcattn, r);
 	}
 	m->rip = current;
 	spin_unlock(&m->lock);
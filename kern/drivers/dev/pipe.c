@@ -39,6 +39,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <event.h>
 
 struct dev pipedevtab;
 
@@ -365,7 +366,7 @@ static long piperead(struct chan *c, void *va, long n, int64_t ignored)
 	return -1;	/* not reached */
 }
 
-static struct block *pipebread(struct chan *c, long n, uint32_t offset)
+static struct block *pipebread(struct chan *c, long n, int64_t offset)
 {
 	Pipe *p;
 
@@ -419,7 +420,7 @@ static long pipewrite(struct chan *c, void *va, long n, int64_t ignored)
 	return n;
 }
 
-static long pipebwrite(struct chan *c, struct block *bp, uint32_t junk)
+static long pipebwrite(struct chan *c, struct block *bp, int64_t junk)
 {
 	long n;
 	Pipe *p;
@@ -495,11 +496,28 @@ static void pipe_wake_cb(struct queue *q, void *data, int filter)
 	struct fd_tap *tap_i;
 
 	spin_lock(&p->tap_lock);
+	event_defer_notifs();
 	SLIST_FOREACH(tap_i, &p->data_taps[which], link)
 		fire_tap(tap_i, filter);
+	event_flush_notifs();
 	spin_unlock(&p->tap_lock);
 }
 
+/* Returns the tap events that are already true for this end of the pipe, so
+ * a new or re-armed tap hears about them. */
+static int pipe_ready(Pipe *p, int which)
+{
+	int filter = 0;
+
+	if (qreadable(p->q[which]))
+		filter |= FDTAP_FILT_READABLE;
+	if (qwritable(p->q[which ^ 1]))
+		filter |= FDTAP_FILT_WRITABLE;
+	if (qisclosed(p->q[which]))
+		filter |= FDTAP_FILT_HANGUP;
+	return filter;
+}
+
 static int pipetapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 {
 	int ret;
@@ -531,6 +549,12 @@ static int pipetapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 			if (SLIST_EMPTY(&p->data_taps[which]))
 				qio_set_wake_cb(p->q[which], pipe_wake_cb, (void *)kludge);
 			SLIST_INSERT_HEAD(&p->data_taps[which], tap, link);
+			fire_tap(tap, pipe_ready(p, which));
+			ret = 0;
+			break;
+		case (FDTAP_CMD_MOD):
+			/* the filter was already changed; just re-arm */
+			fire_tap(tap, pipe_ready(p, which));
 			ret = 0;
 			break;
 		case (FDTAP_CMD_REM):
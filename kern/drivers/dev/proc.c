@@ -66,6 +66,8 @@ enum {
 	Qprofile,
 	Qsyscall,
 	Qcore,
+	Qsyslat,
+	Qstats,
 };
 
 enum {
@@ -92,6 +94,8 @@ enum {
 	CMstraceme,
 	CMstraceall,
 	CMstraceoff,
+	CMshares,
+	CMreserve,
 };
 
 enum {
@@ -129,6 +133,8 @@ struct dirtab procdir[] = {
 	{"profile", {Qprofile}, 0, 0400},
 	{"syscall", {Qsyscall}, 0, 0400},
 	{"core", {Qcore}, 0, 0444},
+	{"syslat", {Qsyslat}, 0, 0444},
+	{"stats", {Qstats}, 0, 0444},
 };
 
 static
@@ -158,6 +164,8 @@ struct cmdtab proccmd[] = {
 	{CMstraceme, "straceme", 0},
 	{CMstraceall, "straceall", 0},
 	{CMstraceoff, "straceoff", 0},
+	{CMshares, "shares", 2},
+	{CMreserve, "reserve", 3},
 };
 
 /*
@@ -615,6 +623,10 @@ static struct chan *procopen(struct chan *c, int omode)
 		case Qvmstatus:
 		case Qctl:
 			break;
+		case Qstats:
+			if (omode != O_READ)
+				error(EPERM, ERROR_FIXME);
+			break;
 
 		case Qstrace:
 			if (!p->strace)
@@ -628,6 +640,11 @@ static struct chan *procopen(struct chan *c, int omode)
 		case Qmaps:
 			c->aux = build_maps(p);
 			break;
+		case Qsyslat:
+			if (omode != O_READ)
+				error(EPERM, ERROR_FIXME);
+			c->aux = sysc_lat_report(p);
+			break;
 		case Qnotepg:
 			error(ENOSYS, ERROR_FIXME);
 #if 0
@@ -831,6 +848,8 @@ static void procclose(struct chan *c)
 		kfree(c->aux);
 	if (QID(c->qid) == Qmaps && c->aux != 0)
 		kfree(c->aux);
+	if (QID(c->qid) == Qsyslat && c->aux != 0)
+		kfree(c->aux);
 	if (QID(c->qid) == Qstrace && c->aux != 0) {
 		struct strace *s = c->aux;
 
@@ -906,6 +925,14 @@ static int eventsavailable(void *)
 }
 #endif
 
+static int strace_has_records(void *arg)
+{
+	struct strace *strace = arg;
+
+	return systrace_pending(strace) || qlen(strace->q) ||
+	       qisclosed(strace->q);
+}
+
 static long procread(struct chan *c, void *va, long n, int64_t off)
 {
 	ERRSTACK(1);
@@ -935,6 +962,18 @@ static long procread(struct chan *c, void *va, long n, int64_t off)
 	switch (QID(c->qid)) {
 		case Qstrace:
 			s = c->aux;
+			systrace_drain(s);
+			if (!qlen(s->q) && !qisclosed(s->q)) {
+				atomic_inc(&s->nr_readers_waiting);
+				if (waserror()) {
+					atomic_dec(&s->nr_readers_waiting);
+					nexterror();
+				}
+				rendez_sleep(&s->rv, strace_has_records, s);
+				poperror();
+				atomic_dec(&s->nr_readers_waiting);
+				systrace_drain(s);
+			}
 			n = qread(s->q, va, n);
 			return n;
 	}
@@ -965,12 +1004,26 @@ static long procread(struct chan *c, void *va, long n, int64_t off)
 					s = seprintf(s, e, " %d trace users %d traced procs",
 					             kref_refcnt(&p->strace->users),
 					             kref_refcnt(&p->strace->procs));
+				if (atomic_read(&p->fp_saves) || atomic_read(&p->fp_restores))
+					s = seprintf(s, e, " fp saves %ld (%ld skipped)"
+					             " restores %ld (%ld skipped)",
+					             atomic_read(&p->fp_saves),
+					             atomic_read(&p->fp_saves_skipped),
+					             atomic_read(&p->fp_restores),
+					             atomic_read(&p->fp_restores_skipped));
 				proc_decref(p);
 				i = readstr(off, va, n, buf);
 				kfree(buf);
 				return i;
 			}
 
+		case Qstats:
+			/* Fresh on every read, so monitors can keep it open and pread */
+			sza = proc_stats_report(p);
+			proc_decref(p);
+			i = readmem(off, va, n, sza->buf, sza->size);
+			kfree(sza);
+			return i;
 		case Qvmstatus:
 			{
 				size_t buflen = 50 * 65 + 2;
@@ -1033,6 +1086,7 @@ static long procread(struct chan *c, void *va, long n, int64_t off)
 			proc_decref(p);
 			return i;
 		case Qmaps:
+		case Qsyslat:
 			sza = c->aux;
 			i = readmem(off, va, n, sza->buf, sza->size);
 			proc_decref(p);
@@ -1153,6 +1207,7 @@ static long procwrite(struct chan *c, void *va, long n, int64_t off)
 			 * the case if all of the procs closed and decref'd.  if the q is
 			 * closed, qwrite() will throw an error. */
 			n = qwrite(((struct strace*)c->aux)->q, va, n);
+			rendez_wakeup(&((struct strace*)c->aux)->rv);
 			break;
 		default:
 			error(EFAIL, "unknown qid %#llux in procwrite\n", c->qid.path);
@@ -1303,11 +1358,14 @@ static void strace_shutdown(struct kref *a)
 	size_t msg_len = NUMSIZE64 * 2 + sizeof(base_msg);
 	char *msg = kmalloc(msg_len, 0);
 
+	/* Whatever is left in the rings goes out before the hangup */
+	systrace_drain(strace);
 	if (msg)
 		snprintf(msg, msg_len, base_msg, strace->appx_nr_sysc,
 		         atomic_read(&strace->nr_drops));
 	qhangup(strace->q, msg);
 	kfree(msg);
+	rendez_wakeup(&strace->rv);
 }
 
 static void strace_release(struct kref *a)
@@ -1315,6 +1373,7 @@ static void strace_release(struct kref *a)
 	struct strace *strace = container_of(a, struct strace, users);
 
 	qfree(strace->q);
+	kfree(strace->rings);
 	kfree(strace);
 }
 
@@ -1344,6 +1403,11 @@ static void procctlreq(struct proc *p, char *va, int n)
 		if (!p->strace) {
 			strace = kzmalloc(sizeof(*p->strace), MEM_WAIT);
 			strace->q = qopen(65536, Qdropoverflow|Qcoalesce, NULL, NULL);
+			strace->rings = kzmalloc(num_cores * sizeof(struct systrace_ring),
+			                         MEM_WAIT);
+			spinlock_init(&strace->drain_lock);
+			rendez_init(&strace->rv);
+			atomic_init(&strace->nr_readers_waiting, 0);
 			/* both of these refs are put when the proc is freed.  procs is for
 			 * every process that has this p->strace.  users is procs + every
 			 * user (e.g. from open()).
@@ -1358,6 +1422,7 @@ static void procctlreq(struct proc *p, char *va, int n)
 			if (!atomic_cas_ptr((void**)&p->strace, 0, strace)) {
 				/* someone else won the race and installed strace. */
 				qfree(strace->q);
+				kfree(strace->rings);
 				kfree(strace);
 				error(EAGAIN, "Concurrent strace init, try again");
 			}
@@ -1410,6 +1475,17 @@ static void procctlreq(struct proc *p, char *va, int n)
 		p->strace_on = FALSE;
 		p->strace_inherit = FALSE;
 		break;
+	case CMshares:
+		if (sched_set_shares(p, strtoul(cb->f[1], 0, 0)))
+			error(EINVAL, "shares must be between 1 and %d",
+			      SCHED_MAX_SHARES);
+		break;
+	case CMreserve:
+		if (sched_reserve_cores(p, strtoul(cb->f[1], 0, 0),
+		                        strtoul(cb->f[2], 0, 0)))
+			error(get_errno(), "can't reserve %s cores with a %s usec lead",
+			      cb->f[1], cb->f[2]);
+		break;
 	}
 	poperror();
 	kfree(cb);
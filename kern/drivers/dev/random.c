@@ -20,7 +20,10 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <percpu.h>
+#include <cpu_feat.h>
 #include <random/fortuna.h>
+#include <random/chacha20.h>
 
 static qlock_t rl;
 
@@ -66,31 +69,157 @@ uint32_t random_read(void *xp, uint32_t n)
 	return n;
 }
 
+/* urandom is a ChaCha20 generator per core, so readers on different cores never
+ * touch the same state.  Each one is keyed from the central pool, mixed with
+ * RDSEED or RDRAND if we have them, and rekeyed from there every
+ * URANDOM_RESEED_BYTES or URANDOM_RESEED_SEC.
+ *
+ * Between reseeds, every refill of the buffer takes the next key from the
+ * start of its own output and clears it ("fast key erasure"), and bytes are
+ * cleared as they're handed out, so the state never holds anything we already
+ * gave someone.  The state is only touched with IRQs off, on its own core.
+ * The bytes go out through a bounce buffer on the stack, since xp could be a
+ * user address that faults. */
+#define URANDOM_BUF_SZ			(8 * CHACHA20_BLOCK_SZ)
+#define URANDOM_CHUNK_SZ		256
+#define URANDOM_RESEED_BYTES	(1 << 20)
+#define URANDOM_RESEED_SEC		60
+
+struct urandom_core {
+	uint32_t					key[CHACHA20_KEY_SZ / 4];
+	uint64_t					counter;
+	uint8_t						buf[URANDOM_BUF_SZ];
+	size_t						avail;		/* unused bytes at the end of buf */
+	size_t						since_seed;
+	uint64_t					reseed_tsc;
+	bool						seeded;
+};
+
+static DEFINE_PERCPU(struct urandom_core, urandom_cores);
+
+/* Anything used before percpu_init() got copied to every core.  No two cores
+ * should ever have the same key, so they all start over. */
+DEFINE_PERCPU_INIT(urandom_percpu_init);
+
+static void urandom_percpu_init(void)
+{
+	for (int i = 0; i < num_cores; i++)
+		memset(_PERCPU_VARPTR(urandom_cores, i), 0,
+		       sizeof(struct urandom_core));
+}
+
+static bool urandom_hw_seed(uint64_t *val)
+{
+#ifdef CONFIG_X86
+	bool ok;
+
+	/* RDSEED can run dry, and it's fine to fall back to RDRAND's DRBG */
+	for (int i = 0; i < 10; i++) {
+		if (!cpu_has_feat(CPU_FEAT_X86_RDSEED))
+			break;
+		asm volatile("rdseed %0; setc %1" : "=r"(*val), "=qm"(ok));
+		if (ok)
+			return TRUE;
+	}
+	for (int i = 0; i < 10; i++) {
+		if (!cpu_has_feat(CPU_FEAT_X86_RDRAND))
+			break;
+		asm volatile("rdrand %0; setc %1" : "=r"(*val), "=qm"(ok));
+		if (ok)
+			return TRUE;
+	}
+#endif
+	return FALSE;
+}
+
+static bool urandom_needs_seed(struct urandom_core *uc)
+{
+	return (uc->since_seed >= URANDOM_RESEED_BYTES) ||
+	       (read_tsc() >= uc->reseed_tsc);
+}
+
+/* Mixes a new seed into whichever core we're on by the time we have one.  This
+ * can block on rl, but only once in a while. */
+static void urandom_reseed(void)
+{
+	uint64_t seed[CHACHA20_KEY_SZ / 8], hw;
+	struct urandom_core *uc;
+	int8_t irq_state = 0;
+
+	random_read(seed, sizeof(seed));
+	for (int i = 0; i < ARRAY_SIZE(seed); i++) {
+		if (urandom_hw_seed(&hw))
+			seed[i] ^= hw;
+	}
+	disable_irqsave(&irq_state);
+	uc = PERCPU_VARPTR(urandom_cores);
+	for (int i = 0; i < ARRAY_SIZE(uc->key); i++)
+		uc->key[i] ^= ((uint32_t*)seed)[i];
+	memset(uc->buf, 0, sizeof(uc->buf));
+	uc->avail = 0;
+	uc->since_seed = 0;
+	uc->reseed_tsc = read_tsc() +
+	                 __proc_global_info.tsc_freq * URANDOM_RESEED_SEC;
+	uc->seeded = TRUE;
+	enable_irqsave(&irq_state);
+	memset(seed, 0, sizeof(seed));
+}
+
+static void urandom_refill(struct urandom_core *uc)
+{
+	for (int i = 0; i < URANDOM_BUF_SZ; i += CHACHA20_BLOCK_SZ)
+		chacha20_block(uc->key, uc->counter++, 0, uc->buf + i);
+	memcpy(uc->key, uc->buf, CHACHA20_KEY_SZ);
+	memset(uc->buf, 0, CHACHA20_KEY_SZ);
+	uc->avail = URANDOM_BUF_SZ - CHACHA20_KEY_SZ;
+}
+
+/* Returns how many bytes of uc's buffer went to dst. */
+static size_t urandom_take(struct urandom_core *uc, uint8_t *dst, size_t amt)
+{
+	uint8_t *src;
+
+	if (!uc->avail)
+		urandom_refill(uc);
+	amt = MIN(amt, uc->avail);
+	src = uc->buf + URANDOM_BUF_SZ - uc->avail;
+	memcpy(dst, src, amt);
+	memset(src, 0, amt);
+	uc->avail -= amt;
+	uc->since_seed += amt;
+	return amt;
+}
+
 /**
  * Fast random generator
  **/
 uint32_t urandom_read(void *xp, uint32_t n)
 {
-	uint64_t seed[16];
-	uint8_t *e, *p;
-	uint32_t x = 0;
-	uint64_t s0;
-	uint64_t s1;
+	uint8_t chunk[URANDOM_CHUNK_SZ];
+	struct urandom_core *uc;
+	int8_t irq_state = 0;
+	bool reseeded = FALSE;
+	uint8_t *p = xp;
+	size_t left = n, amt;
 
-	if (n <= sizeof(seed))
-		return random_read(xp, n);
-	// The initial seed is from a good random pool.
-	random_read(seed, sizeof(seed));
-	p = xp;
-	for (e = p + n; p < e;) {
-		s0 = seed[x];
-		s1 = seed[x = (x + 1) & 15];
-		s1 ^= s1 << 31;
-		s1 ^= s1 >> 11;
-		s0 ^= s0 >> 30;
-		*p++ = (seed[x] = s0 ^ s1) * 1181783497276652981LL;
+	while (left) {
+		disable_irqsave(&irq_state);
+		uc = PERCPU_VARPTR(urandom_cores);
+		/* A stale core is fine for a while, but not an unseeded one.  We
+		 * could have moved to a new core since we reseeded. */
+		if (!uc->seeded || (!reseeded && urandom_needs_seed(uc))) {
+			enable_irqsave(&irq_state);
+			urandom_reseed();
+			reseeded = TRUE;
+			continue;
+		}
+		amt = urandom_take(uc, chunk, MIN(left, sizeof(chunk)));
+		enable_irqsave(&irq_state);
+		memcpy(p, chunk, amt);
+		p += amt;
+		left -= amt;
 	}
-
+	memset(chunk, 0, sizeof(chunk));
 	return n;
 }
 
@@ -176,7 +305,7 @@ static long randomwrite(struct chan *c, void *va, long n, int64_t ignored)
 	return -1;
 }
 
-static long randombwrite(struct chan *c, struct block *bp, uint32_t junk)
+static long randombwrite(struct chan *c, struct block *bp, int64_t junk)
 {
 	error(EPERM, "No use for writing random just yet");
 	return -1;
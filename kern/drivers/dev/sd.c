@@ -333,6 +333,7 @@ static struct sdunit *sdgetunit(struct sdev *sdev, int subno)
 		unit->subno = subno;
 		unit->dev = sdev;
 		qlock_init(&unit->ctl);
+		rwinit(&unit->wrlock);
 
 		if (sdev->enabled == 0 && sdev->ifc->enable)
 			sdev->ifc->enable(sdev);
@@ -770,6 +771,7 @@ static int32_t sdbio(struct chan *c, int write, char *a, int32_t len,
 	struct sdev *sdev;
 	int64_t bno;
 	int32_t l, max, nb, offset;
+	bool rmw;
 
 	sdev = sdgetdev(DEV(c->qid));
 	if (sdev == NULL) {
@@ -837,21 +839,34 @@ static int32_t sdbio(struct chan *c, int write, char *a, int32_t len,
 		poperror();
 	}
 
+	offset = off % unit->secsize;
+	if (offset + len > nb * unit->secsize)
+		len = nb * unit->secsize - offset;
+	/* Requests run in parallel on non-removable units, and b is ours alone.
+	 * A partial-sector write reads its sectors, patches them, and writes them
+	 * back, which would undo any other write to them in between.  So those
+	 * exclude all other writes; whole-sector writes only exclude them. */
+	rmw = write && (offset || (len % unit->secsize));
 	b = kzmalloc(nb * unit->secsize, MEM_WAIT);
 	if (b == NULL)
 		error(ENOMEM, "%s: could not allocate %d bytes", nb * unit->secsize);
+	if (rmw)
+		wlock(&unit->wrlock);
+	else if (write)
+		rlock(&unit->wrlock);
 	if (waserror()) {
+		if (rmw)
+			wunlock(&unit->wrlock);
+		else if (write)
+			runlock(&unit->wrlock);
 		kfree(b);
 		if (!(unit->inquiry[1] & SDinq1removable))
 			kref_put(&sdev->r); /* gadverdamme! */
 		nexterror();
 	}
 
-	offset = off % unit->secsize;
-	if (offset + len > nb * unit->secsize)
-		len = nb * unit->secsize - offset;
 	if (write) {
-		if (offset || (len % unit->secsize)) {
+		if (rmw) {
 			l = unit->dev->ifc->bio(unit, 0, 0, b, nb, bno);
 			if (l < 0)
 				error(EIO, "IO Error");
@@ -880,6 +895,10 @@ static int32_t sdbio(struct chan *c, int write, char *a, int32_t len,
 			len = l - offset;
 		memmove(a, b + offset, len);
 	}
+	if (rmw)
+		wunlock(&unit->wrlock);
+	else if (write)
+		runlock(&unit->wrlock);
 	kfree(b);
 	poperror();
 
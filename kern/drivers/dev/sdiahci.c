@@ -123,7 +123,7 @@ static char *descmode[] = {
 };
 
 static char *flagname[] = {
-    "llba", "smart", "power", "nop", "atapi", "atapi16",
+    "llba", "smart", "power", "nop", "atapi", "atapi16", "ncq",
 };
 
 struct drive {
@@ -389,6 +389,29 @@ static void aesleep(struct aportm *pm, struct Asleep *a, int ms)
 	poperror();
 }
 
+static int ncqidle(void *v)
+{
+	struct aportm *pm;
+
+	pm = v;
+	return pm->issued == 0;
+}
+
+/*
+ * wait for queued commands to finish before issuing an unqueued one; the
+ * drive won't take both at once.  pm->ql is held, so no more get queued.
+ */
+static void ncqdrain(struct aportm *pm)
+{
+	ERRSTACK(2);
+	if (pm->issued == 0)
+		return;
+	if (waserror())
+		return;
+	rendez_sleep_timeout(&pm->Rendez, ncqidle, pm, (3 * 1000) * 1000);
+	poperror();
+}
+
 static int ahciwait(struct aportc *c, int ms)
 {
 	struct Asleep as;
@@ -396,6 +419,7 @@ static int ahciwait(struct aportc *c, int ms)
 	uint32_t cmd, tfd;
 
 	port = c->p;
+	ncqdrain(c->pm);
 	cmd = ahci_port_read32(port, PORT_CMD);
 	printd("ahci: %s: CMD=0x%08x\n", __func__, cmd);
 
@@ -677,6 +701,10 @@ static int64_t ahciidentify(struct aportc *pc, uint16_t *id)
 		if (i & (1 << 14))
 			pm->feat |= Dnop;
 	}
+
+	i = gbit16(id + 76);
+	if ((pm->feat & Datapi) == 0 && i != 0xffff && i & (1 << 8))
+		pm->feat |= Dncq;
 	return s;
 }
 
@@ -858,8 +886,8 @@ static int ahciconfigdrive(struct drive *d)
 	pm = d->portc.pm;
 	if (pm->list == 0) {
 		setupfis(&pm->fis);
-		pm->list = malign(ALIST_SIZE, 1024);
-		pm->ctab = malign(ACTAB_PRDT + APRDT_SIZE, 128);
+		pm->list = malign(ANSLOT * ALIST_SIZE, 1024);
+		pm->ctab = malign(ANSLOT * ACTAB_SLOT, 128);
 	}
 
 	if (d->unit)
@@ -1040,6 +1068,36 @@ static void clearci(void *p)
 	}
 }
 
+/*
+ * complete the queued commands the drive is done with: all of them with
+ * Ferror after an error stopped the port, else those no longer in SActive.
+ * drive must be locked.
+ */
+static void ncqreap(struct drive *d, unsigned char err)
+{
+	int i;
+	uint32_t done;
+	struct aportm *pm;
+
+	pm = &d->portm;
+	if (pm->issued == 0)
+		return;
+	done = pm->issued;
+	if (err == 0)
+		done &= ~(ahci_port_read32(d->port, PORT_SACT) |
+		          ahci_port_read32(d->port, PORT_CI));
+	for (i = 0; done; i++) {
+		if ((done & 1 << i) == 0)
+			continue;
+		done &= ~(1 << i);
+		pm->issued &= ~(1 << i);
+		pm->slot[i].flag = Fdone | err;
+		rendez_wakeup(&pm->slot[i].Rendez);
+	}
+	if (pm->issued == 0)
+		rendez_wakeup(&pm->Rendez);
+}
+
 static void updatedrive(struct drive *d)
 {
 	uint32_t cause, serr, task, sstatus, ie, s0, pr, ewake;
@@ -1057,6 +1115,7 @@ static void updatedrive(struct drive *d)
 	if (d->unit && d->unit->sdperm.name)
 		name = d->unit->sdperm.name;
 
+	ncqreap(d, 0);
 	if (ahci_port_read32(port, PORT_CI) == 0) {
 		d->portm.flag |= Fdone;
 		rendez_wakeup(&d->portm.Rendez);
@@ -1118,6 +1177,7 @@ static void updatedrive(struct drive *d)
 	ahci_port_write32(port, PORT_SERR, serr);
 	if (ewake) {
 		clearci(port);
+		ncqreap(d, Ferror);
 		rendez_wakeup(&d->portm.Rendez);
 	}
 	last = cause;
@@ -1210,6 +1270,21 @@ static void resetdisk(struct drive *d)
 	qunlock(&d->portm.ql);
 }
 
+/* queue depth to use: the smaller of the hba's slots and the drive's */
+static int ncqslots(struct drive *d)
+{
+	int hba, dev;
+
+	if ((d->portm.feat & Dncq) == 0)
+		return 0;
+	hba = ahci_hba_read32(d->ctlr->hba, HBA_CAP);
+	if ((hba & Hsncq) == 0)
+		return 0;
+	hba = ((hba >> 8) & 0x1f) + 1; /* Hncs */
+	dev = (gbit16(d->info + 75) & 0x1f) + 1;
+	return MIN(hba, dev);
+}
+
 static int newdrive(struct drive *d)
 {
 	char *name;
@@ -1239,12 +1314,15 @@ static int newdrive(struct drive *d)
 		if (ahcirecover(pc) == -1)
 			goto lose;
 	}
+	pm->nslot = ncqslots(d);
 	setstate(d, Dready);
 	qunlock(&pc->pm->ql);
 
 	iprintd("%s: %sLBA %llu sectors: %s %s %s %s\n", d->unit->sdperm.name,
 	        (pm->feat & Dllba ? "L" : ""), d->sectors, d->model, d->firmware,
 	        d->serial, d->mediachange ? "[mediachange]" : "");
+	if (pm->nslot)
+		iprintd("%s: ncq, %d slots\n", d->unit->sdperm.name, pm->nslot);
 	return 0;
 
 lose:
@@ -1939,6 +2017,157 @@ retry:
 	return SDok;
 }
 
+/*
+ * native command queuing: reads and writes go out as READ/WRITE FPDMA QUEUED,
+ * each in its own command slot, up to pm->nslot at a time.  pm->ql is only
+ * held to take a slot and issue it, so concurrent callers of iario keep the
+ * drive's queue full; anything else that takes pm->ql drains the queue first.
+ * completions come from SActive in updatedrive.  after an error the hba stops
+ * and we can't tell which command failed, so the whole queue is aborted and
+ * iario reissues each aborted request as a plain dma command, which reports
+ * its own error.
+ */
+static uint32_t slotmask(struct aportm *pm)
+{
+	if (pm->nslot == ANSLOT)
+		return ~0U;
+	return (1U << pm->nslot) - 1;
+}
+
+static int slotfree(void *v)
+{
+	struct aportm *pm;
+
+	pm = v;
+	return (pm->inuse & slotmask(pm)) != slotmask(pm);
+}
+
+static int slotdone(void *v)
+{
+	struct aslot *s;
+
+	s = v;
+	return s->flag & Fdone;
+}
+
+static void ncqbuild(struct drive *d, int slot, int write, void *data, int n,
+                     int64_t lba)
+{
+	void *cfis, *list, *prdt, *ctab;
+	struct aportm *pm;
+	uint32_t flags;
+
+	pm = &d->portm;
+	list = pm->list + slot * ALIST_SIZE;
+	ctab = pm->ctab + slot * ACTAB_SLOT;
+	cfis = ctab;
+
+	memset(cfis, 0, 0x20);
+	ahci_cfis_write8(cfis, 0, 0x27);
+	ahci_cfis_write8(cfis, 1, 0x80);
+	ahci_cfis_write8(cfis, 2, write ? 0x61 : 0x60);
+	ahci_cfis_write8(cfis, 3, n); /* features: sector count */
+
+	ahci_cfis_write8(cfis, 4, lba);
+	ahci_cfis_write8(cfis, 5, lba >> 8);
+	ahci_cfis_write8(cfis, 6, lba >> 16);
+	ahci_cfis_write8(cfis, 7, 0x40); /* lba */
+
+	ahci_cfis_write8(cfis, 8, lba >> 24);
+	ahci_cfis_write8(cfis, 9, lba >> 32);
+	ahci_cfis_write8(cfis, 10, lba >> 40);
+	ahci_cfis_write8(cfis, 11, n >> 8); /* features (exp): count */
+
+	ahci_cfis_write8(cfis, 12, slot << 3); /* sector count: tag */
+
+	flags = 1 << 16 | Lpref | 0x5;
+	if (write)
+		flags |= Lwrite;
+	ahci_list_write32(list, ALIST_FLAGS, flags);
+	ahci_list_write32(list, ALIST_LEN, 0);
+	ahci_list_write32(list, ALIST_CTAB, paddr_low32(ctab));
+	ahci_list_write32(list, ALIST_CTABHI, paddr_high32(ctab));
+
+	prdt = ctab + ACTAB_PRDT;
+	ahci_prdt_write32(prdt, APRDT_DBA, paddr_low32(data));
+	ahci_prdt_write32(prdt, APRDT_DBAHI, paddr_high32(data));
+	ahci_prdt_write32(prdt, APRDT_COUNT,
+	                  1 << 31 | (d->unit->secsize * n - 2) | 1);
+}
+
+/* returns 0 if done, -1 if the caller should retry without ncq */
+static int ncqio(struct drive *d, int write, void *data, int n, int64_t lba)
+{
+	ERRSTACK(2);
+	int s, aborted, flag;
+	uint32_t avail;
+	struct aportm *pm;
+	struct aslot *as;
+
+	pm = &d->portm;
+	for (;;) {
+		if (lockready(d) != 0 || pm->nslot == 0) {
+			qunlock(&pm->ql);
+			return -1;
+		}
+		spin_lock_irqsave(&d->Lock);
+		avail = ~pm->inuse & slotmask(pm);
+		if (avail) {
+			s = __builtin_ctz(avail);
+			pm->inuse |= 1 << s;
+		}
+		spin_unlock_irqsave(&d->Lock);
+		if (avail)
+			break;
+		qunlock(&pm->ql);
+		if (waserror())
+			return -1;
+		rendez_sleep(&pm->slotrendez, slotfree, pm);
+		poperror();
+	}
+	as = &pm->slot[s];
+	ncqbuild(d, s, write, data, n, lba);
+
+	spin_lock_irqsave(&d->Lock);
+	as->flag = 0;
+	pm->issued |= 1 << s;
+	ahci_port_write32(d->port, PORT_SACT, 1 << s);
+	ahci_port_write32(d->port, PORT_CI, 1 << s);
+	d->intick = ms();
+	d->active++;
+	spin_unlock_irqsave(&d->Lock);
+	qunlock(&pm->ql);
+
+	if (!waserror()) {
+		/* don't sleep here forever */
+		rendez_sleep_timeout(&as->Rendez, slotdone, as, (3 * 1000) * 1000);
+		poperror();
+	}
+	if (!slotdone(as)) {
+		qlock(&pm->ql);
+		spin_lock_irqsave(&d->Lock);
+		aborted = (pm->issued & 1 << s) != 0;
+		if (aborted) {
+			clearci(d->port);
+			ncqreap(d, Ferror);
+		}
+		spin_unlock_irqsave(&d->Lock);
+		if (aborted) {
+			printd("%s: ncq slot %d timed out\n", d->unit->sdperm.name, s);
+			ahcirecover(&d->portc);
+		}
+		qunlock(&pm->ql);
+	}
+
+	spin_lock_irqsave(&d->Lock);
+	flag = as->flag;
+	d->active--;
+	pm->inuse &= ~(1 << s);
+	spin_unlock_irqsave(&d->Lock);
+	rendez_wakeup(&pm->slotrendez);
+	return flag == Fdone ? 0 : -1;
+}
+
 static int iario(struct sdreq *r)
 {
 	ERRSTACK(2);
@@ -1995,6 +2224,8 @@ retry:
 		n = count;
 		if (n > max)
 			n = max;
+		if (d->portm.nslot && ncqio(d, *cmd != 0x28, data, n, lba) == 0)
+			goto next;
 		ahcibuild(d, cmd, data, n, lba);
 		switch (waitready(d)) {
 		case -1:
@@ -2006,6 +2237,7 @@ retry:
 			goto retry;
 		}
 		/* d->portm qlock held here */
+		ncqdrain(&d->portm);
 		spin_lock_irqsave(&d->Lock);
 		d->portm.flag = 0;
 		spin_unlock_irqsave(&d->Lock);
@@ -2056,7 +2288,7 @@ retry:
 			r->status = SDeio;
 			return SDeio;
 		}
-
+next:
 		count -= n;
 		lba += n;
 		data += n * unit->secsize;
@@ -2137,7 +2369,7 @@ static int didtype(struct pci_device *p)
 
 static int newctlr(struct ctlr *ctlr, struct sdev *sdev, int nunit)
 {
-	int i, n;
+	int i, j, n;
 	struct drive *drive;
 	uint32_t h_cap, pi;
 
@@ -2172,6 +2404,9 @@ static int newctlr(struct ctlr *ctlr, struct sdev *sdev, int nunit)
 		drive->portc.pm = &drive->portm;
 		qlock_init(&drive->portm.ql);
 		rendez_init(&drive->portm.Rendez);
+		rendez_init(&drive->portm.slotrendez);
+		for (j = 0; j < ANSLOT; j++)
+			rendez_init(&drive->portm.slot[j].Rendez);
 		drive->driveno = n++;
 		ctlr->drive[drive->driveno] = drive;
 		iadrive[niadrive + drive->driveno] = drive;
@@ -2307,6 +2542,8 @@ static int iarctl(struct sdunit *u, char *p, int l)
 			p = seprintf(p, e, "smart\t%s\n", smarttab[d->portm.smart]);
 		p = seprintf(p, e, "flag\t");
 		p = pflag(p, e, d->portm.feat);
+		if (d->portm.nslot)
+			p = seprintf(p, e, "ncq\t%d slots\n", d->portm.nslot);
 	} else
 		p = seprintf(p, e, "no disk present [%s]\n", diskstates[d->state]);
 	serror = ahci_port_read32(port, PORT_SERR);
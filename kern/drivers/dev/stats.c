@@ -0,0 +1,138 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * #stats, the per-core statistics counters (pcpu_counter.h).
+ *
+ *		ctl: 'reset' zeroes every counter.
+ *		counters: one line per counter: its name and its sum over all cores.
+ *
+ * counters is snapshotted when opened. */
+
+#include <ros/common.h>
+#include <ros/errno.h>
+#include <pcpu_counter.h>
+#include <smp.h>
+#include <ns.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <err.h>
+
+enum {
+	Kstatsdirqid = 0,
+	Kstatsctlqid,
+	Kstatscountersqid,
+};
+
+struct dev statsdevtab;
+static struct dirtab statstab[] = {
+	{".",				{Kstatsdirqid,		0, QTDIR}, 0,	DMDIR|0555},
+	{"ctl",				{Kstatsctlqid},		0,	0200},
+	{"counters",		{Kstatscountersqid},	0,	0444},
+};
+
+static char *stats_ctl_usage = "reset";
+
+static struct chan *stats_attach(char *spec)
+{
+	return devattach(statsdevtab.name, spec);
+}
+
+static struct walkqid *stats_walk(struct chan *c, struct chan *nc, char **name,
+                                  int nname)
+{
+	return devwalk(c, nc, name, nname, statstab, ARRAY_SIZE(statstab), devgen);
+}
+
+static int stats_stat(struct chan *c, uint8_t *db, int n)
+{
+	return devstat(c, db, n, statstab, ARRAY_SIZE(statstab), devgen);
+}
+
+static struct chan *stats_open(struct chan *c, int omode)
+{
+	if (c->qid.type & QTDIR) {
+		if (openmode(omode) != O_READ)
+			error(EPERM, ERROR_FIXME);
+	}
+	if ((int) c->qid.path == Kstatscountersqid)
+		c->aux = pcpu_counter_list();
+	c->mode = openmode(omode);
+	c->flag |= COPEN;
+	c->offset = 0;
+	return c;
+}
+
+static void stats_close(struct chan *c)
+{
+	if (!(c->flag & COPEN))
+		return;
+	if ((int) c->qid.path == Kstatscountersqid)
+		kfree(c->aux);
+}
+
+static long stats_read(struct chan *c, void *va, long n, int64_t off)
+{
+	struct sized_alloc *sza;
+
+	switch ((int) c->qid.path) {
+	case Kstatsdirqid:
+		return devdirread(c, va, n, statstab, ARRAY_SIZE(statstab), devgen);
+	case Kstatscountersqid:
+		sza = c->aux;
+		return readmem(off, va, n, sza->buf, sza->size);
+	default:
+		error(EINVAL, ERROR_FIXME);
+	}
+	return 0;
+}
+
+static void stats_ctl(struct cmdbuf *cb)
+{
+	if (cb->nf < 1)
+		error(EINVAL, stats_ctl_usage);
+	if (!strcmp(cb->f[0], "reset")) {
+		pcpu_counter_reset();
+		return;
+	}
+	error(EINVAL, stats_ctl_usage);
+}
+
+static long stats_write(struct chan *c, void *a, long n, int64_t unused)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb;
+
+	if ((int) c->qid.path != Kstatsctlqid)
+		error(EBADFD, ERROR_FIXME);
+	cb = parsecmd(a, n);
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	stats_ctl(cb);
+	kfree(cb);
+	poperror();
+	return n;
+}
+
+struct dev statsdevtab __devtab = {
+	.name = "stats",
+
+	.reset = devreset,
+	.init = devinit,
+	.shutdown = devshutdown,
+	.attach = stats_attach,
+	.walk = stats_walk,
+	.stat = stats_stat,
+	.open = stats_open,
+	.create = devcreate,
+	.close = stats_close,
+	.read = stats_read,
+	.bread = devbread,
+	.write = stats_write,
+	.bwrite = devbwrite,
+	.remove = devremove,
+	.wstat = devwstat,
+};
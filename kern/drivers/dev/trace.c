@@ -0,0 +1,167 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * #trace, the static tracepoints (tracepoint.h).
+ *
+ *		ctl: 'enable NAME...', 'disable NAME...' or 'reset'.  NAME can be
+ *		     'all' or end in '*' to match a prefix.
+ *		tracepoints: one line per tracepoint: its id, whether it's on, its
+ *		     name and the format of its args.
+ *		data: the records in every core's ring, as struct tp_records.
+ *
+ * tracepoints and data are snapshotted when opened. */
+
+#include <ros/common.h>
+#include <ros/errno.h>
+#include <tracepoint.h>
+#include <smp.h>
+#include <ns.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <err.h>
+
+enum {
+	Ktracedirqid = 0,
+	Ktracectlqid,
+	Ktracepointsqid,
+	Ktracedataqid,
+};
+
+struct dev tracedevtab;
+static struct dirtab tracetab[] = {
+	{".",				{Ktracedirqid,		0, QTDIR}, 0,	DMDIR|0550},
+	{"ctl",				{Ktracectlqid},		0,	0200},
+	{"tracepoints",		{Ktracepointsqid},	0,	0444},
+	{"data",			{Ktracedataqid},	0,	0400},
+};
+
+static char *trace_ctl_usage = "enable NAME...|disable NAME...|reset";
+
+static struct chan *trace_attach(char *spec)
+{
+	return devattach(tracedevtab.name, spec);
+}
+
+static struct walkqid *trace_walk(struct chan *c, struct chan *nc, char **name,
+                                  int nname)
+{
+	return devwalk(c, nc, name, nname, tracetab, ARRAY_SIZE(tracetab), devgen);
+}
+
+static int trace_stat(struct chan *c, uint8_t *db, int n)
+{
+	return devstat(c, db, n, tracetab, ARRAY_SIZE(tracetab), devgen);
+}
+
+static struct chan *trace_open(struct chan *c, int omode)
+{
+	if (c->qid.type & QTDIR) {
+		if (openmode(omode) != O_READ)
+			error(EPERM, ERROR_FIXME);
+	}
+	switch ((int) c->qid.path) {
+	case Ktracepointsqid:
+		c->aux = tracepoint_list();
+		break;
+	case Ktracedataqid:
+		c->aux = tracepoint_snapshot();
+		break;
+	}
+	c->mode = openmode(omode);
+	c->flag |= COPEN;
+	c->offset = 0;
+	return c;
+}
+
+static void trace_close(struct chan *c)
+{
+	if (!(c->flag & COPEN))
+		return;
+	switch ((int) c->qid.path) {
+	case Ktracepointsqid:
+	case Ktracedataqid:
+		kfree(c->aux);
+		break;
+	}
+}
+
+static long trace_read(struct chan *c, void *va, long n, int64_t off)
+{
+	struct sized_alloc *sza;
+
+	switch ((int) c->qid.path) {
+	case Ktracedirqid:
+		return devdirread(c, va, n, tracetab, ARRAY_SIZE(tracetab), devgen);
+	case Ktracepointsqid:
+	case Ktracedataqid:
+		sza = c->aux;
+		return readmem(off, va, n, sza->buf, sza->size);
+	default:
+		error(EINVAL, ERROR_FIXME);
+	}
+	return 0;
+}
+
+static void trace_ctl(struct cmdbuf *cb)
+{
+	bool on;
+
+	if (cb->nf < 1)
+		error(EINVAL, trace_ctl_usage);
+	if (!strcmp(cb->f[0], "reset")) {
+		tracepoint_reset();
+		return;
+	}
+	if (!strcmp(cb->f[0], "enable"))
+		on = TRUE;
+	else if (!strcmp(cb->f[0], "disable"))
+		on = FALSE;
+	else
+		error(EINVAL, trace_ctl_usage);
+	if (cb->nf < 2)
+		error(EINVAL, trace_ctl_usage);
+	for (int i = 1; i < cb->nf; i++) {
+		if (!tracepoint_set(cb->f[i], on))
+			error(ENOENT, "No tracepoint %s", cb->f[i]);
+	}
+}
+
+static long trace_write(struct chan *c, void *a, long n, int64_t unused)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb;
+
+	if ((int) c->qid.path != Ktracectlqid)
+		error(EBADFD, ERROR_FIXME);
+	cb = parsecmd(a, n);
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	trace_ctl(cb);
+	kfree(cb);
+	poperror();
+	return n;
+}
+
+struct dev tracedevtab __devtab = {
+	.name = "trace",
+
+	.reset = devreset,
+	.init = devinit,
+	.shutdown = devshutdown,
+	.attach = trace_attach,
+	.walk = trace_walk,
+	.stat = trace_stat,
+	.open = trace_open,
+	.create = devcreate,
+	.close = trace_close,
+	.read = trace_read,
+	.bread = devbread,
+	.write = trace_write,
+	.bwrite = devbwrite,
+	.remove = devremove,
+	.wstat = devwstat,
+};
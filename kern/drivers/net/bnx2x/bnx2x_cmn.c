@@ -55,6 +55,11 @@ static int bnx2x_calc_num_queues(struct bnx2x *bp)
 	/* default is min(8, num_cores) in Linux.  we'll set it elsewhere */
 	int nq = bnx2x_num_queues ? : 8;
 
+	/* AKAROS_PORT: each queue gets its own core (not core 0), and the ether
+	 * layer can only feed MaxEtherQueues of them. */
+	nq = MIN(nq, MaxEtherQueues);
+	nq = MIN(nq, MAX(num_cores - 1, 1));
+
 	/* Reduce memory usage in kdump environment by using only one queue */
 	if (is_kdump_kernel())
 		nq = 1;
@@ -1779,6 +1784,10 @@ static int bnx2x_req_msix_irqs(struct bnx2x *bp)
 			bnx2x_free_msix_irqs(bp, offset);
 			return -EBUSY;
 		}
+		/* AKAROS_PORT: the poll runs where the IRQ lands */
+		if (ether_steer_queue(bp->edev, i,
+		                      get_irq_vector(bnx2x_msix_fp_int, fp)))
+			BNX2X_ERR("could not route fp #%d irq\n", i);
 
 		offset++;
 	}
@@ -2070,7 +2079,7 @@ static void bnx2x_set_rx_buf_size(struct bnx2x *bp)
 	}
 }
 
-static int bnx2x_init_rss(struct bnx2x *bp)
+int bnx2x_init_rss(struct bnx2x *bp)
 {
 	int i;
 	uint8_t num_eth_queues = BNX2X_NUM_ETH_QUEUES(bp);
@@ -2078,10 +2087,12 @@ static int bnx2x_init_rss(struct bnx2x *bp)
 	/* Prepare the initial contents for the indirection table if RSS is
 	 * enabled
 	 */
+	/* AKAROS_PORT: use the ether's table, so a flow's packets come in on
+	 * the queue we send them out of. */
+	static_assert(sizeof(bp->rss_conf_obj.ind_table) == EtherRSSTblLen);
 	for (i = 0; i < sizeof(bp->rss_conf_obj.ind_table); i++)
 		bp->rss_conf_obj.ind_table[i] =
-			bp->fp->cl_id +
-			ethtool_rxfh_indir_default(i, num_eth_queues);
+			bp->fp->cl_id + bp->edev->rss_tbl[i] % num_eth_queues;
 
 	/*
 	 * For 57710 and 57711 SEARCHER configuration (rss_keys) is
@@ -2140,8 +2151,10 @@ int bnx2x_rss(struct bnx2x *bp, struct bnx2x_rss_config_obj *rss_obj,
 		#if 0 // AKAROS_PORT
 		netdev_rss_key_fill(params.rss_key, T_ETH_RSS_KEY * 4);
 		#else
-		/* linux picks a random, once, then uses it here.  it could be 5a! */
-		memset(params.rss_key, 0x5a, T_ETH_RSS_KEY * 4);
+		/* linux picks a random, once, then uses it here.  we use the
+		 * ether's key. */
+		static_assert(sizeof(params.rss_key) == EtherRSSKeyLen);
+		memcpy(params.rss_key, bp->edev->rss_key, EtherRSSKeyLen);
 		#endif
 		__set_bit(BNX2X_RSS_SET_SRCH, &params.rss_flags);
 	}
@@ -3816,7 +3829,6 @@ netdev_tx_t bnx2x_start_xmit(struct block *block,
 #endif
 
 	txq_index = txdata->txq_index;
-	assert(txq_index == 0);	// AKAROS_PORT til we get multi-queue working
 	assert(txdata == &bp->bnx2x_txq[txq_index]);
 
 	assert(!(txq_index >= MAX_ETH_TXQ_IDX(bp) + (CNIC_LOADED(bp) ? 1 : 0)));
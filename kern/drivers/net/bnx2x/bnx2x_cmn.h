@@ -1125,8 +1125,10 @@ static inline void bnx2x_init_txdata(struct bnx2x *bp,
 	/* Poke function - ghetto extern from bnx2x_dev.c */
 	extern void __bnx2x_tx_queue(void *txdata_arg);
 	poke_init(&txdata->poker, __bnx2x_tx_queue);
-	/* TODO: AKAROS_PORT multi queue: assign proper oq */
-	txdata->oq = bp->edev->oq;
+	/* AKAROS_PORT: RSS queue i's CoS 0 ring sends from the ether's oqs[i].
+	 * The other rings (extra CoS, FCoE) have no oq. */
+	txdata->oq = txq_index < bp->edev->nr_queues ? bp->edev->oqs[txq_index]
+	                                             : NULL;
 
 	DP(NETIF_MSG_IFUP, "created tx data cid %d, txq %d\n",
 	   txdata->cid, txdata->txq_index);
@@ -36,6 +36,7 @@ extern int bnx2x_open(struct ether *dev);
 extern void bnx2x_set_rx_mode(struct ether *dev);
 extern netdev_tx_t bnx2x_start_xmit(struct block *block,
                                     struct bnx2x_fp_txdata *txdata);
+extern int bnx2x_init_rss(struct bnx2x *bp);
 
 spinlock_t bnx2x_tq_lock = SPINLOCK_INITIALIZER;
 TAILQ_HEAD(bnx2x_tq, bnx2x);
@@ -185,10 +186,9 @@ void __bnx2x_tx_queue(void *txdata_arg)
 	struct block *block;
 	struct queue *oq = txdata->oq;
 
-	/* TODO: avoid bugs til multi-queue is working */
-	assert(oq);
-	assert(txdata->txq_index == 0);
-
+	/* tx_int pokes the rings that don't send from an oq too */
+	if (!oq)
+		return;
 	while ((block = qget(oq))) {
 		if ((bnx2x_start_xmit(block, txdata) != NETDEV_TX_OK)) {
 			/* all queue readers are sync'd by the poke, so we can putback
@@ -208,17 +208,34 @@ void __bnx2x_tx_queue(void *txdata_arg)
 	}
 }
 
-static void bnx2x_transmit(struct ether *edev)
+/* Txq i sends from edev->oqs[i]; see bnx2x_init_txdata(). */
+static void bnx2x_transmit_q(struct ether *edev, int qidx)
 {
 	struct bnx2x *ctlr = edev->ctlr;
 	struct bnx2x_fp_txdata *txdata;
-	/* TODO: determine the tx queue we're supposed to work on */
-	int txq_index = 0;
 
-	txdata = &ctlr->bnx2x_txq[txq_index];
+	txdata = &ctlr->bnx2x_txq[qidx];
 	poke(&txdata->poker, txdata);
 }
 
+static void bnx2x_transmit(struct ether *edev)
+{
+	for (int i = 0; i < edev->nr_queues; i++)
+		bnx2x_transmit_q(edev, i);
+}
+
+/* Pushes the ether's RSS key and table to the NIC.  Before the NIC is up,
+ * there's nothing to do: bnx2x_load() will set them. */
+static void bnx2x_rss_update(struct ether *edev)
+{
+	struct bnx2x *ctlr = edev->ctlr;
+
+	qlock(&ctlr->alock);
+	if (ctlr->attached && (ctlr->state == BNX2X_STATE_OPEN))
+		bnx2x_init_rss(ctlr);
+	qunlock(&ctlr->alock);
+}
+
 /* Not mandatory.  Called to make sure there are free blocks available for
  * incoming packets */
 static void bnx2x_replenish(struct bnx2x *ctlr)
@@ -473,6 +490,8 @@ static int bnx2x_pnp(struct ether *edev)
 	 */
 	edev->attach = bnx2x_attach;
 	edev->transmit = bnx2x_transmit;
+	edev->transmit_q = bnx2x_transmit_q;
+	edev->rss_update = bnx2x_rss_update;
 	edev->ifstat = bnx2x_ifstat;
 	edev->ctl = bnx2x_ctl;
 	edev->shutdown = bnx2x_shutdown;
@@ -482,6 +501,9 @@ static int bnx2x_pnp(struct ether *edev)
 	edev->multicast = bnx2x_multicast;
 
 	bnx2x_reset(ctlr);
+	/* init_one picked the number of fastpaths.  Each one gets a tx ring and
+	 * an MSI-X vector, steered to its own core at attach time. */
+	edev->nr_queues = BNX2X_NUM_ETH_QUEUES(ctlr);
 
 	return 0;
 }
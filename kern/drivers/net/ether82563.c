@@ -31,8 +31,10 @@
  * sequence needs straightened out. Doubt the PHY code
  * for the 82575eb is right.
  *
- * on the assumption that allowing jumbo packets makes the controller
- * much slower (as is true of the 82579), never allow jumbos.
+ * Receive buffers are ctlrtab's mtu, which is the biggest frame the
+ * part takes, so jumbos are on for anything whose mtu is over 2048.
+ * The ipifc's mtu is still 1514 until someone raises it with the
+ * "mtu" ctl.
  */
 #include <vfs.h>
 #include <kfs.h>
@@ -84,6 +86,7 @@ enum {
 	Ics = 0x00C8,	/* Interrupt Cause Set */
 	Ims = 0x00D0,	/* Interrupt Mask Set/Read */
 	Imc = 0x00D8,	/* Interrupt mask Clear */
+	Eitr = 0x1680,	/* Extended Interrupt Throttle 0 (82575 and later) */
 	Iam = 0x00E0,	/* Interrupt acknowledge Auto Mask */
 
 	/* Receive */
@@ -506,6 +509,8 @@ enum {
 	 */
 	Ntd = 32,					/* power of two >= 8 */
 	Nrd = 128,	/* power of two >= 8 */
+	Nrb = 32,	/* rx blocks to allocate at once */
+	Nrxpoll = 64,	/* rx packets per pass, when polling under load */
 	Rbalign = 16,
 	Slop = 32,	/* for vlan headers, crcs, etc. */
 };
@@ -617,6 +622,12 @@ struct ctlr {
 	uint32_t mta[128];			/* multicast table array */
 
 	struct rendez rrendez;
+	qlock_t rlock;				/* rx ring: rproc and busy pollers */
+	bool rxon;
+	struct ether_itr itr;		/* rx interrupt moderation */
+	bool itradapt;
+	bool rxpoll;				/* under load, poll rx without interrupts */
+	unsigned int rxpolls;
 	int rim;
 	int rdfree;					/* rx descriptors awaiting packets */
 	struct rd *rdba;			/* receive descriptor base address */
@@ -791,6 +802,10 @@ static long i82563ifstat(struct ether *edev, void *a, long n, uint32_t offset)
 
 	p = seprintf(p, e, "lintr: %ud %ud\n", ctlr->lintr, ctlr->lsleep);
 	p = seprintf(p, e, "rintr: %ud %ud\n", ctlr->rintr, ctlr->rsleep);
+	p = seprintf(p, e, "itr: %ud%s\n", ctlr->itr.rate,
+				 ctlr->itradapt ? " adaptive" : "");
+	p = seprintf(p, e, "rxpoll: %s %ud\n", ctlr->rxpoll ? "on" : "off",
+				 ctlr->rxpolls);
 	p = seprintf(p, e, "tintr: %ud %ud\n", ctlr->tintr, ctlr->txdw);
 	p = seprintf(p, e, "ixcs: %ud %ud %ud\n", ctlr->ixsm, ctlr->ipcs,
 				 ctlr->tcpcs);
@@ -827,6 +842,8 @@ enum {
 	CMradv,
 	CMpause,
 	CMan,
+	CMitr,
+	CMrxpoll,
 };
 
 static struct cmdtab i82563ctlmsg[] = {
@@ -834,8 +851,29 @@ static struct cmdtab i82563ctlmsg[] = {
 	{CMradv, "radv", 2},
 	{CMpause, "pause", 1},
 	{CMan, "an", 1},
+	{CMitr, "itr", 2},
+	{CMrxpoll, "rxpoll", 2},
 };
 
+/*
+ * Sets the interrupt throttle, in interrupts a second.  0 turns it off.
+ */
+static void i82563itr(struct ctlr *ctlr, unsigned int rate)
+{
+	switch (ctlr->type) {
+	case i82575:
+	case i82576:
+	case i210:
+		/* interval in usec, from bit 2 */
+		csr32w(ctlr, Eitr, rate ? (1000000 / rate) << 2 : 0);
+		break;
+	default:
+		/* interval in 256ns units */
+		csr32w(ctlr, Itr, rate ? 1000000000 / (rate * 256) : 0);
+		break;
+	}
+}
+
 static long i82563ctl(struct ether *edev, void *buf, long n)
 {
 	ERRSTACK(1);
@@ -877,6 +915,27 @@ static long i82563ctl(struct ether *edev, void *buf, long n)
 		case CMan:
 			csr32w(ctlr, Ctrl, csr32r(ctlr, Ctrl) | Lrst | Phyrst);
 			break;
+		case CMitr:
+			/* itr adaptive | interrupts per second, 0 for no limit */
+			if (!strcmp(cb->f[1], "adaptive")) {
+				ctlr->itradapt = TRUE;
+				break;
+			}
+			v = strtoul(cb->f[1], &p, 0);
+			if (*p || (v && (v < 100 || v > 1000000)))
+				error(EINVAL, "itr adaptive|0|100-1000000");
+			ctlr->itradapt = FALSE;
+			ctlr->itr.rate = v;
+			i82563itr(ctlr, v);
+			break;
+		case CMrxpoll:
+			if (!strcmp(cb->f[1], "on"))
+				ctlr->rxpoll = TRUE;
+			else if (!strcmp(cb->f[1], "off"))
+				ctlr->rxpoll = FALSE;
+			else
+				error(EINVAL, "rxpoll on|off");
+			break;
 	}
 	kfree(cb);
 	poperror();
@@ -1113,6 +1172,8 @@ static void i82563replenish(struct ctlr *ctlr)
 	struct rd *rd;
 	int rdt;
 	struct block *bp;
+	struct block *bps[Nrb];
+	int nr_bps = 0, bi = 0;
 
 	rdt = ctlr->rdt;
 	while (NEXT_RING(rdt, Nrd) != ctlr->rdh) {
@@ -1121,11 +1182,18 @@ static void i82563replenish(struct ctlr *ctlr)
 			printd("#l%d: 82563: rx overrun\n", ctlr->edev->ctlrno);
 			break;
 		}
-		bp = block_alloc(ctlr->rbsz + Slop + Rbalign, MEM_ATOMIC);
-		if (bp == NULL) {
-			warn_once("OOM, trying to survive");
-			break;
+		if (bi == nr_bps) {
+			/* enough for the rest of the ring, a batch at a time */
+			nr_bps = MIN((ctlr->rdh - rdt - 1) & (Nrd - 1), Nrb);
+			nr_bps = block_alloc_bulk(ctlr->rbsz + Slop + Rbalign,
+			                          MEM_ATOMIC, bps, nr_bps);
+			bi = 0;
+			if (!nr_bps) {
+				warn_once("OOM, trying to survive");
+				break;
+			}
 		}
+		bp = bps[bi++];
 		ctlr->rb[rdt] = bp;
 		rd->addr[0] = paddr_low32(bp->rp);
 		rd->addr[1] = paddr_high32(bp->rp);
@@ -1133,6 +1201,9 @@ static void i82563replenish(struct ctlr *ctlr)
 		ctlr->rdfree++;
 		rdt = NEXT_RING(rdt, Nrd);
 	}
+	/* the ring filled up, or we stopped at an overrun */
+	while (bi < nr_bps)
+		freeb(bps[bi++]);
 	if (ctlr->rdt != rdt) {
 		ctlr->rdt = rdt;
 		wmb_f();
@@ -1191,9 +1262,10 @@ static void i82563rxinit(struct ctlr *ctlr)
 	csr32w(ctlr, Rdh, 0);
 	csr32w(ctlr, Rdt, 0);
 
-	/* to hell with interrupt moderation, we want low latency */
+	/* no delay timers: moderation comes from the adaptive throttle */
 	csr32w(ctlr, Rdtr, 0);
 	csr32w(ctlr, Radv, 0);
+	i82563itr(ctlr, ctlr->itr.rate);
 
 	for (i = 0; i < Nrd; i++) {
 		bp = ctlr->rb[i];
@@ -1258,16 +1330,84 @@ static void ckcksums(struct ctlr *ctlr, struct rd *rd, struct block *bp)
 	}
 }
 
-static void i82563rproc(void *arg)
+/*
+ * Passes up to budget received packets upstream.  Hold rlock.
+ */
+static int i82563rx(struct ether *edev, int budget)
 {
 	struct rd *rd;
 	struct block *bp;
 	struct ctlr *ctlr;
 	int rdh, rim, passed;
+
+	ctlr = edev->ctlr;
+	rdh = ctlr->rdh;
+	passed = 0;
+	while (passed < budget) {
+		rim = ctlr->rim;
+		ctlr->rim = 0;
+		rd = &ctlr->rdba[rdh];
+		if (!(rd->status & Rdd))
+			break;
+
+		/*
+		 * Accept eop packets with no errors.
+		 */
+		bp = ctlr->rb[rdh];
+		if ((rd->status & Reop) && rd->errors == 0) {
+			bp->wp += rd->length;
+			bp->lim = bp->wp;	/* lie like a dog. */
+			ctlr->itr.pkts++;
+			ctlr->itr.bytes += rd->length;
+			if (0)
+				ckcksums(ctlr, rd, bp);
+			etheriq(edev, bp, 1);	/* pass pkt upstream */
+			passed++;
+		} else {
+			if (rd->status & Reop && rd->errors)
+				printd("%s: input packet error %#ux\n",
+					   tname[ctlr->type], rd->errors);
+			freeb(bp);
+		}
+		ctlr->rb[rdh] = NULL;
+
+		/* rd needs to be replenished to accept another pkt */
+		rd->status = 0;
+		ctlr->rdfree--;
+		ctlr->rdh = rdh = NEXT_RING(rdh, Nrd);
+		/*
+		 * if number of rds ready for packets is too low,
+		 * set up the unready ones.
+		 */
+		if (ctlr->rdfree <= Nrd - 32 || (rim & Rxdmt0))
+			i82563replenish(ctlr);
+	}
+	etheriq_flush(edev);
+	return passed;
+}
+
+/*
+ * Adapts the throttle to what the last interrupt (or poll) brought in.
+ */
+static void i82563rxupdate(struct ctlr *ctlr)
+{
+	if (!ctlr->itradapt) {
+		ctlr->itr.pkts = ctlr->itr.bytes = 0;
+		return;
+	}
+	if (ether_itr_update(&ctlr->itr))
+		i82563itr(ctlr, ctlr->itr.rate);
+}
+
+static void i82563rproc(void *arg)
+{
+	struct ctlr *ctlr;
 	struct ether *edev;
+	int passed;
 
 	edev = arg;
 	ctlr = edev->ctlr;
+	qlock(&ctlr->rlock);
 	i82563rxinit(ctlr);
 	csr32w(ctlr, Rctl, csr32r(ctlr, Rctl) | Ren);
 
@@ -1276,53 +1416,52 @@ static void i82563rproc(void *arg)
 	 */
 	if (ctlr->type == i210)
 		csr32w(ctlr, Rxdctl, csr32r(ctlr, Rxdctl) | Qenable);
+	ctlr->rxon = TRUE;
 
 	for (;;) {
 		i82563replenish(ctlr);
+		qunlock(&ctlr->rlock);
 		i82563im(ctlr, Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
 		ctlr->rsleep++;
 		rendez_sleep(&ctlr->rrendez, i82563rim, ctlr);
-
-		rdh = ctlr->rdh;
-		passed = 0;
+		qlock(&ctlr->rlock);
+		/*
+		 * With rxpoll, a full pass means more is coming, so we leave the rx
+		 * interrupts off (the interrupt handler masked them) and poll again
+		 * after letting others run.
+		 */
 		for (;;) {
-			rim = ctlr->rim;
-			ctlr->rim = 0;
-			rd = &ctlr->rdba[rdh];
-			if (!(rd->status & Rdd))
+			passed = i82563rx(edev, ctlr->rxpoll ? Nrxpoll : INT32_MAX);
+			i82563rxupdate(ctlr);
+			if (!ctlr->rxpoll || passed < Nrxpoll)
 				break;
+			i82563replenish(ctlr);
+			qunlock(&ctlr->rlock);
+			ctlr->rxpolls++;
+			kthread_yield();
+			qlock(&ctlr->rlock);
+		}
+	}
+}
 
-			/*
-			 * Accept eop packets with no errors.
-			 */
-			bp = ctlr->rb[rdh];
-			if ((rd->status & Reop) && rd->errors == 0) {
-				bp->wp += rd->length;
-				bp->lim = bp->wp;	/* lie like a dog. */
-				if (0)
-					ckcksums(ctlr, rd, bp);
-				etheriq(edev, bp, 1);	/* pass pkt upstream */
-				passed++;
-			} else {
-				if (rd->status & Reop && rd->errors)
-					printd("%s: input packet error %#ux\n",
-						   tname[ctlr->type], rd->errors);
-				freeb(bp);
-			}
-			ctlr->rb[rdh] = NULL;
+/*
+ * Busy polling.  If the rproc or another poller has the ring, they're already
+ * doing our work.
+ */
+static int i82563poll(struct ether *edev, int budget)
+{
+	struct ctlr *ctlr;
+	int passed = 0;
 
-			/* rd needs to be replenished to accept another pkt */
-			rd->status = 0;
-			ctlr->rdfree--;
-			ctlr->rdh = rdh = NEXT_RING(rdh, Nrd);
-			/*
-			 * if number of rds ready for packets is too low,
-			 * set up the unready ones.
-			 */
-			if (ctlr->rdfree <= Nrd - 32 || (rim & Rxdmt0))
-				i82563replenish(ctlr);
-		}
+	ctlr = edev->ctlr;
+	if (!canqlock(&ctlr->rlock))
+		return 0;
+	if (ctlr->rxon) {
+		passed = i82563rx(edev, budget);
+		i82563replenish(ctlr);
 	}
+	qunlock(&ctlr->rlock);
+	return passed;
 }
 
 static int i82563lim(void *ctlr)
@@ -2160,6 +2299,9 @@ static void i82563pci(void)
 		rendez_init(&ctlr->lrendez);
 		qlock_init(&ctlr->slock);
 		rendez_init(&ctlr->rrendez);
+		qlock_init(&ctlr->rlock);
+		ether_itr_init(&ctlr->itr);
+		ctlr->itradapt = TRUE;
 		rendez_init(&ctlr->trendez);
 		qlock_init(&ctlr->tlock);
 
@@ -2219,6 +2361,7 @@ static int pnp(struct ether *edev, int type)
 	 */
 	edev->attach = i82563attach;
 	edev->transmit = i82563transmit;
+	edev->poll = i82563poll;
 	edev->ifstat = i82563ifstat;
 	edev->ctl = i82563ctl;
 
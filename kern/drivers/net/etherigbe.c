@@ -80,6 +80,7 @@ enum {
 	Fcah		= 0x0000002C,	/* Flow Control Address High */
 	Fct		= 0x00000030,	/* Flow Control Type */
 	Icr		= 0x000000C0,	/* Interrupt Cause Read */
+	Itr		= 0x000000C4,	/* Interrupt Throttling Rate */
 	Ics		= 0x000000C8,	/* Interrupt Cause Set */
 	Ims		= 0x000000D0,	/* Interrupt Mask Set/Read */
 	Imc		= 0x000000D8,	/* Interrupt mask Clear */
@@ -468,6 +469,8 @@ enum {
 	Nrd		= 256,		/* multiple of 8 */
 	Ntd		= 64,		/* multiple of 8 */
 	Rbsz		= 2048,
+	Maxmtu		= 9000,		/* jumbos span Rbsz buffers */
+	Nrxpoll		= 64,		/* rx packets per pass, when polling */
 };
 
 struct ctlr {
@@ -516,9 +519,15 @@ struct ctlr {
 	int	rdfree;
 	Rd*	rdba;			/* receive descriptor base address */
 	struct block**	rb;			/* receive buffers */
+	struct block*	rxhead;			/* jumbo so far, til its eop */
+	bool	rxskip;			/* drop descriptors til an eop */
 	int	rdh;			/* receive descriptor head */
 	int	rdt;			/* receive descriptor tail */
 	int	rdtr;			/* receive delay timer ring value */
+	struct ether_itr	itr;		/* rx interrupt moderation */
+	bool	itradapt;
+	bool	rxpoll;			/* under load, poll rx without interrupts */
+	unsigned int	rxpolls;
 
 	spinlock_t	tlock;
 	int	tbusy;
@@ -684,6 +693,10 @@ igbeifstat(struct ether* edev, void* a, long n, uint32_t offset)
 	l += snprintf(p+l, READSTR-l, "ixcs: %ud %ud %ud\n",
 		ctlr->ixsm, ctlr->ipcs, ctlr->tcpcs);
 	l += snprintf(p+l, READSTR-l, "rdtr: %ud\n", ctlr->rdtr);
+	l += snprintf(p+l, READSTR-l, "itr: %ud%s\n", ctlr->itr.rate,
+		ctlr->itradapt ? " adaptive" : "");
+	l += snprintf(p+l, READSTR-l, "rxpoll: %s %ud\n",
+		ctlr->rxpoll ? "on" : "off", ctlr->rxpolls);
 	l += snprintf(p+l, READSTR-l, "Ctrlext: %08x\n", csr32r(ctlr, Ctrlext));
 
 	l += snprintf(p+l, READSTR-l, "eeprom:");
@@ -713,12 +726,35 @@ igbeifstat(struct ether* edev, void* a, long n, uint32_t offset)
 
 enum {
 	CMrdtr,
+	CMitr,
+	CMrxpoll,
 };
 
 static struct cmdtab igbectlmsg[] = {
 	{CMrdtr,	"rdtr",	2},
+	{CMitr,		"itr",	2},
+	{CMrxpoll,	"rxpoll",	2},
 };
 
+/*
+ * Sets the interrupt throttle, in interrupts a second (0 for none).
+ * The 82542 to 82544 don't have one.
+ */
+static void
+igbeitr(struct ctlr* ctlr, unsigned int rate)
+{
+	switch(ctlr->id){
+	case i82542:
+	case i82543gc:
+	case i82544ei:
+	case i82544eif:
+	case i82544gc:
+		return;
+	}
+	/* interval in 256ns units */
+	csr32w(ctlr, Itr, rate ? 1000000000/(rate*256) : 0);
+}
+
 static long
 igbectl(struct ether* edev, void* buf, long n)
 {
@@ -747,6 +783,26 @@ igbectl(struct ether* edev, void* buf, long n)
 		ctlr->rdtr = v;
 		csr32w(ctlr, Rdtr, Fpd|v);
 		break;
+	case CMitr:
+		if(strcmp(cb->f[1], "adaptive") == 0){
+			ctlr->itradapt = TRUE;
+			break;
+		}
+		v = strtol(cb->f[1], &p, 0);
+		if(p == cb->f[1] || v < 0 || (v && (v < 100 || v > 1000000)))
+			error(EINVAL, "itr adaptive|0|100-1000000");
+		ctlr->itradapt = FALSE;
+		ctlr->itr.rate = v;
+		igbeitr(ctlr, v);
+		break;
+	case CMrxpoll:
+		if(strcmp(cb->f[1], "on") == 0)
+			ctlr->rxpoll = TRUE;
+		else if(strcmp(cb->f[1], "off") == 0)
+			ctlr->rxpoll = FALSE;
+		else
+			error(EINVAL, "rxpoll on|off");
+		break;
 	}
 	kfree(cb);
 	poperror();
@@ -1081,7 +1137,7 @@ igberxinit(struct ctlr* ctlr)
 	struct block *bp;
 
 	/* temporarily keep Mpe on */
-	csr32w(ctlr, Rctl, Dpf|Bsize2048|Bam|RdtmsHALF|Mpe);
+	csr32w(ctlr, Rctl, Dpf|Bsize2048|Bam|RdtmsHALF|Mpe|Lpe);
 	csr32w(ctlr, Rdbal, paddr_low32(ctlr->rdba));
 	csr32w(ctlr, Rdbah, paddr_high32(ctlr->rdba));
 	csr32w(ctlr, Rdlen, ctlr->nrd*sizeof(Rd));
@@ -1091,6 +1147,7 @@ igberxinit(struct ctlr* ctlr)
 	csr32w(ctlr, Rdt, 0);
 	ctlr->rdtr = 0;
 	csr32w(ctlr, Rdtr, Fpd|0);
+	igbeitr(ctlr, ctlr->itr.rate);
 
 	for(i = 0; i < ctlr->nrd; i++){
 		if((bp = ctlr->rb[i]) != NULL){
@@ -1098,6 +1155,11 @@ igberxinit(struct ctlr* ctlr)
 			freeb(bp);
 		}
 	}
+	if(ctlr->rxhead != NULL){
+		freeb(ctlr->rxhead);
+		ctlr->rxhead = NULL;
+	}
+	ctlr->rxskip = FALSE;
 	igbereplenish(ctlr);
 
 	switch(ctlr->id){
@@ -1128,13 +1190,62 @@ igberim(void* ctlr)
 	return ((struct ctlr*)ctlr)->rim != 0;
 }
 
+/*
+ * Adapts the throttle to what the last interrupt (or poll) brought in.
+ */
+static void
+igberxupdate(struct ctlr* ctlr)
+{
+	if(!ctlr->itradapt){
+		ctlr->itr.pkts = ctlr->itr.bytes = 0;
+		return;
+	}
+	if(ether_itr_update(&ctlr->itr))
+		igbeitr(ctlr, ctlr->itr.rate);
+}
+
+/*
+ * With Lpe, a frame bigger than Rbsz spans descriptors, and only the
+ * last one has Reop and the errors.  Adds rd's buffer, bp, to the
+ * frame so far and returns the frame once it's whole.  Later buffers
+ * hang off the first one as extra data, the way GRO merges segments.
+ */
+static struct block*
+igberxchain(struct ctlr* ctlr, Rd* rd, struct block* bp)
+{
+	struct block *head = ctlr->rxhead;
+	bool eop = rd->status & Reop;
+
+	if(bp == NULL || ctlr->rxskip || (eop && rd->errors))
+		goto drop;
+	bp->wp += rd->length;
+	if(head != NULL){
+		if(bp->free || bp->extra_data ||
+		   block_append_extra(head, (uintptr_t)bp,
+				      bp->rp - (uint8_t*)bp, BLEN(bp),
+				      MEM_ATOMIC))
+			goto drop;
+		bp = head;
+	}
+	ctlr->rxhead = eop ? NULL : bp;
+	return eop ? bp : NULL;
+drop:
+	if(bp != NULL)
+		freeb(bp);
+	if(head != NULL)
+		freeb(head);
+	ctlr->rxhead = NULL;
+	ctlr->rxskip = !eop;
+	return NULL;
+}
+
 static void
 igberproc(void* arg)
 {
 	Rd *rd;
 	struct block *bp;
 	struct ctlr *ctlr;
-	int r, rdh;
+	int r, rdh, passed, budget;
 	struct ether *edev;
 
 	edev = arg;
@@ -1151,25 +1262,33 @@ igberproc(void* arg)
 		ctlr->rsleep++;
 		rendez_sleep(&ctlr->rrendez, igberim, ctlr);
 
+		/*
+		 * With rxpoll, a full pass means more is coming, so we leave the
+		 * rx interrupts off (the interrupt handler masked them) and come
+		 * back after letting others run.
+		 */
+		budget = ctlr->rxpoll ? Nrxpoll : INT32_MAX;
+poll:
 		rdh = ctlr->rdh;
-		for(;;){
+		for(passed = 0; passed < budget; passed++){
 			rd = &ctlr->rdba[rdh];
 
 			if(!(rd->status & Rdd))
 				break;
 
 			/*
-			 * Accept eop packets with no errors.
+			 * Accept whole packets with no errors.
 			 * With no errors and the Ixsm bit set,
-			 * the descriptor status Tpcs and Ipcs bits give
-			 * an indication of whether the checksums were
-			 * calculated and valid.
+			 * the eop descriptor status Tpcs and Ipcs bits
+			 * give an indication of whether the checksums
+			 * were calculated and valid.
 			 */
-			if((rd->status & Reop) && rd->errors == 0){
-				bp = ctlr->rb[rdh];
-				ctlr->rb[rdh] = NULL;
-				bp->wp += rd->length;
+			bp = igberxchain(ctlr, rd, ctlr->rb[rdh]);
+			ctlr->rb[rdh] = NULL;
+			if(bp != NULL){
 				bp->next = NULL;
+				ctlr->itr.pkts++;
+				ctlr->itr.bytes += BLEN(bp) + bp->extra_len;
 				if(!(rd->status & Ixsm)){
 					ctlr->ixsm++;
 					if(rd->status & Ipcs){
@@ -1193,10 +1312,6 @@ igberproc(void* arg)
 				}
 				etheriq(edev, bp, 1);
 			}
-			else if(ctlr->rb[rdh] != NULL){
-				freeb(ctlr->rb[rdh]);
-				ctlr->rb[rdh] = NULL;
-			}
 
 			memset(rd, 0, sizeof(Rd));
 			wmb();	/* make sure the zeroing happens before free (i think) */
@@ -1204,9 +1319,16 @@ igberproc(void* arg)
 			rdh = NEXT_RING(rdh, ctlr->nrd);
 		}
 		ctlr->rdh = rdh;
+		etheriq_flush(edev);
 
 		if(ctlr->rdfree < ctlr->nrd/2 || (ctlr->rim & Rxdmt0))
 			igbereplenish(ctlr);
+		igberxupdate(ctlr);
+		if(ctlr->rxpoll && passed == budget){
+			ctlr->rxpolls++;
+			kthread_yield();
+			goto poll;
+		}
 	}
 }
 
@@ -2005,6 +2127,8 @@ igbepci(void)
 		qlock_init(&ctlr->slock);
 		rendez_init(&ctlr->lrendez);
 		rendez_init(&ctlr->rrendez);
+		ether_itr_init(&ctlr->itr);
+		ctlr->itradapt = TRUE;
 		/* port seems to be unused, and only used for some comparison with edev.
 		 * plan9 just used the top of the raw bar, regardless of the type. */
 		ctlr->port = pcidev->bar[0].raw_bar & ~0x0f;
@@ -2055,6 +2179,7 @@ igbepnp(struct ether* edev)
 	edev->irq = ctlr->pci->irqline;
 	edev->tbdf = pci_to_tbdf(ctlr->pci);
 	edev->mbps = 1000;
+	edev->maxmtu = Maxmtu;
 	memmove(edev->ea, ctlr->ra, Eaddrlen);
 
 	/*
@@ -2927,6 +2927,8 @@ int mlx4_en_init_netdev(struct mlx4_en_dev *mdev, int port,
 
 	/* Query for default mac and max mtu */
 	priv->max_mtu = mdev->dev->caps.eth_mtu_cap[priv->port];
+	/* Akaros: take jumbos; the ipifc's mtu decides what we actually get */
+	dev->maxmtu = priv->max_mtu;
 
 	if (mdev->dev->caps.rx_checksum_flags_port[priv->port] &
 	    MLX4_RX_CSUM_MODE_VAL_NON_TCP_UDP)
@@ -605,10 +605,10 @@ static void recv_packet(struct mlx4_en_priv *priv,
 			unsigned int length)
 {
 	struct block *block;
+	unsigned int left = length;
+	unsigned int amt;
 	void *va;
 
-	assert(priv->num_frags == 1);
-
 	block = block_alloc(length, MEM_ATOMIC);
 	if (!block) {
 		en_dbg(RX_ERR, priv, "Failed allocating block\n");
@@ -616,9 +616,14 @@ static void recv_packet(struct mlx4_en_priv *priv,
 		return;
 	}
 
-	va = page_address(frags[0].page) + frags[0].page_offset;
-	memcpy(block->wp, va, length);
-	block->wp += length;
+	/* Jumbos are scattered across the frags, see mlx4_en_calc_rx_buf() */
+	for (int i = 0; i < priv->num_frags && left; i++) {
+		amt = MIN(priv->frag_info[i].frag_size, left);
+		va = page_address(frags[i].page) + frags[i].page_offset;
+		memcpy(block->wp, va, amt);
+		block->wp += amt;
+		left -= amt;
+	}
 
 	etheriq(priv->dev, block, 1 /* fromwire */);
 }
@@ -1073,11 +1078,41 @@ out:
 	ring->cons = cq->mcq.cons_index;
 	mlx4_en_refill_rx_buffers(priv, ring);
 	mlx4_en_update_rx_prod_db(ring);
+	etheriq_flush(dev);
 	return polled;
 }
 
 static void mlx4_en_poll_rx_cq(uint32_t srcid, long a0, long a1, long a2);
 
+/* AKAROS_PORT: the rx RKM and busy pollers take turns with the cq.  Whoever
+ * finds it busy leaves a note for the owner. */
+static bool mlx4_en_rx_cq_trylock(struct mlx4_en_cq *cq)
+{
+	bool ret;
+
+	spin_lock_irqsave(&cq->rx_lock);
+	ret = !cq->rx_busy;
+	if (ret)
+		cq->rx_busy = TRUE;
+	else
+		cq->rx_missed = TRUE;
+	spin_unlock_irqsave(&cq->rx_lock);
+	return ret;
+}
+
+/* Returns TRUE if someone wanted the cq while we had it. */
+static bool mlx4_en_rx_cq_unlock(struct mlx4_en_cq *cq)
+{
+	bool ret;
+
+	spin_lock_irqsave(&cq->rx_lock);
+	cq->rx_busy = FALSE;
+	ret = cq->rx_missed;
+	cq->rx_missed = FALSE;
+	spin_unlock_irqsave(&cq->rx_lock);
+	return ret;
+}
+
 void mlx4_en_rx_irq(struct mlx4_cq *mcq)
 {
 	struct mlx4_en_cq *cq = container_of(mcq, struct mlx4_en_cq, mcq);
@@ -1104,9 +1139,13 @@ static void mlx4_en_poll_rx_cq(uint32_t srcid, long a0, long a1, long a2)
 
 	if (!mlx4_en_cq_lock_napi(cq))
 		return;
+	/* A busy poller has the cq.  It'll send us again, and we'll arm it. */
+	if (!mlx4_en_rx_cq_trylock(cq))
+		return;
 
 	done = mlx4_en_process_rx_cq(dev, cq, budget);
 
+	mlx4_en_rx_cq_unlock(cq);
 	mlx4_en_cq_unlock_napi(cq);
 
 #if 0 // AKAROS_PORT
@@ -1135,6 +1174,28 @@ static void mlx4_en_poll_rx_cq(uint32_t srcid, long a0, long a1, long a2)
 	mlx4_en_arm_cq(priv, cq);
 }
 
+/* AKAROS_PORT: ether busy polling, on the calling core. */
+int mlx4_en_busy_poll(struct ether *dev, int budget)
+{
+	struct mlx4_en_priv *priv = netdev_priv(dev);
+	struct mlx4_en_cq *cq;
+	int done = 0;
+
+	if (!priv->port_up)
+		return 0;
+	for (int i = 0; i < priv->rx_ring_num && done < budget; i++) {
+		cq = priv->rx_cq[i];
+		if (!mlx4_en_rx_cq_trylock(cq))
+			continue;
+		done += mlx4_en_process_rx_cq(dev, cq, budget - done);
+		/* The RKM gave up on the cq, so it's not armed. */
+		if (mlx4_en_rx_cq_unlock(cq))
+			send_kernel_message(core_id(), mlx4_en_poll_rx_cq, (long)cq,
+					    0, 0, KMSG_ROUTINE);
+	}
+	return done;
+}
+
 static const int frag_sizes[] = {
 	FRAG_SZ0,
 	FRAG_SZ1,
@@ -3854,6 +3854,7 @@ module_exit(mlx4_cleanup);
 
 extern int mlx4_en_init(void);
 extern int mlx4_en_open(struct ether *dev);
+extern int mlx4_en_busy_poll(struct ether *dev, int budget);
 extern netdev_tx_t mlx4_send_packet(struct block *block, struct ether *dev);
 
 static const struct pci_device_id *search_pci_table(struct pci_device *needle)
@@ -3980,6 +3981,7 @@ static int mlx4_pnp(struct ether *edev)
 
 	edev->attach = ether_attach;
 	edev->transmit = ether_transmit;
+	edev->poll = mlx4_en_busy_poll;
 	edev->ifstat = ether_ifstat;
 	edev->ctl = ether_ctl;
 	edev->shutdown = ether_shutdown;
@@ -344,6 +344,10 @@ struct mlx4_en_cq {
 	spinlock_t poll_lock; /* protects from LLS/napi conflicts */
 #endif  /* CONFIG_NET_RX_BUSY_POLL */
 	struct irq_desc *irq_desc;
+	/* AKAROS_PORT: rx RKM vs. ether busy polling */
+	spinlock_t rx_lock;
+	bool rx_busy;
+	bool rx_missed;
 };
 
 struct mlx4_en_port_profile {
@@ -799,6 +803,7 @@ int mlx4_en_create_drop_qp(struct mlx4_en_priv *priv);
 void mlx4_en_destroy_drop_qp(struct mlx4_en_priv *priv);
 int mlx4_en_free_tx_buf(struct ether *dev, struct mlx4_en_tx_ring *ring);
 void mlx4_en_rx_irq(struct mlx4_cq *mcq);
+int mlx4_en_busy_poll(struct ether *dev, int budget);
 
 int mlx4_SET_MCAST_FLTR(struct mlx4_dev *dev, uint8_t port, uint64_t mac,
 			uint64_t clear, uint8_t mode);
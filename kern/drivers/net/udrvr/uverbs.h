@@ -112,6 +112,14 @@ struct ib_uverbs_event_file {
 	wait_queue_head_t			poll_wait;
 	struct fasync_struct		       *async_queue;
 	struct list_head			event_list;
+#if 1	/* AKAROS */
+	int					id;
+	struct list_head			chan_list;
+	struct proc			       *proc;
+	struct event_queue		       *ev_q;
+	uint32_t				ev_id;
+	bool					deliver_pending;
+#endif	/* AKAROS */
 };
 
 struct ib_uverbs_file {
@@ -121,6 +129,9 @@ struct ib_uverbs_file {
 	struct ib_ucontext		       *ucontext;
 	struct ib_event_handler			event_handler;
 	struct ib_uverbs_event_file	       *async_file;
+#if 1	/* AKAROS */
+	struct list_head			comp_chans;
+#endif	/* AKAROS */
 };
 
 struct ib_uverbs_event {
@@ -185,7 +196,15 @@ void idr_remove_uobj(struct idr *idp, struct ib_uobject *uobj);
 
 struct file *ib_uverbs_alloc_event_file(struct ib_uverbs_file *uverbs_file,
 					int is_async);
+#if 0	/* AKAROS */
 struct ib_uverbs_event_file *ib_uverbs_lookup_comp_file(int fd);
+#else	/* AKAROS */
+struct ib_uverbs_event_file *ib_uverbs_alloc_comp_chan(
+	struct ib_uverbs_file *uverbs_file, struct event_queue *ev_q,
+	uint32_t ev_id);
+struct ib_uverbs_event_file *ib_uverbs_lookup_comp_file(
+	struct ib_uverbs_file *uverbs_file, int id);
+#endif	/* AKAROS */
 
 void ib_uverbs_release_ucq(struct ib_uverbs_file *file,
 			   struct ib_uverbs_event_file *ev_file,
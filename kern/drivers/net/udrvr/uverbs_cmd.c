@@ -1369,6 +1369,12 @@ ssize_t ib_uverbs_create_comp_channel(struct ib_uverbs_file *file,
 	if (out_len < sizeof resp)
 		return -ENOSPC;
 
+#if 1	/* AKAROS */
+	/* Older callers don't send an ev_q, and there's no fd to give them */
+	if (in_len < sizeof(struct ib_uverbs_cmd_hdr) + sizeof cmd)
+		return -EINVAL;
+#endif	/* AKAROS */
+
 	if (copy_from_user(&cmd, buf, sizeof cmd))
 		return -EFAULT;
 
@@ -1392,8 +1398,23 @@ ssize_t ib_uverbs_create_comp_channel(struct ib_uverbs_file *file,
 	}
 
 	fd_install(resp.fd, filp);
-#else
-	BUG_ON(1);
+#else	/* AKAROS */
+	{
+		struct ib_uverbs_event_file *ev_file;
+
+		if (!cmd.ev_q)
+			return -EINVAL;
+		ev_file = ib_uverbs_alloc_comp_chan(file,
+			(struct event_queue *)(unsigned long)cmd.ev_q,
+			cmd.ev_id);
+		if (IS_ERR(ev_file))
+			return PTR_ERR(ev_file);
+		/* the channel lives until the uverbs file closes */
+		resp.fd = ev_file->id;
+		if (copy_to_user((void __user *) (unsigned long) cmd.response,
+				 &resp, sizeof resp))
+			return -EFAULT;
+	}
 #endif	/* AKAROS */
 	return in_len;
 }
@@ -1431,7 +1452,11 @@ ssize_t ib_uverbs_create_cq(struct ib_uverbs_file *file,
 	down_write(&obj->uobject.mutex);
 
 	if (cmd.comp_channel >= 0) {
+#if 0	/* AKAROS */
 		ev_file = ib_uverbs_lookup_comp_file(cmd.comp_channel);
+#else	/* AKAROS */
+		ev_file = ib_uverbs_lookup_comp_file(file, cmd.comp_channel);
+#endif	/* AKAROS */
 		if (!ev_file) {
 			ret = -EINVAL;
 			goto err;
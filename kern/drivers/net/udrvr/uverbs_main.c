@@ -48,6 +48,9 @@
 #include <linux/slab.h>
 
 #include <asm/uaccess.h>
+#else	/* AKAROS */
+#include <event.h>
+#include <trap.h>
 #endif	/* AKAROS */
 
 #include "uverbs.h"
@@ -102,6 +105,9 @@ DEFINE_IDR(ib_uverbs_qp_idr);
 DEFINE_IDR(ib_uverbs_srq_idr);
 DEFINE_IDR(ib_uverbs_xrcd_idr);
 DEFINE_IDR(ib_uverbs_rule_idr);
+#if 1	/* AKAROS */
+static DEFINE_IDR(ib_uverbs_comp_idr);
+#endif	/* AKAROS */
 
 static DEFINE_SPINLOCK(map_lock);
 static DECLARE_BITMAP(dev_map, IB_UVERBS_MAX_DEVICES);
@@ -176,6 +182,10 @@ static void ib_uverbs_release_event_file(struct kref *ref)
 	struct ib_uverbs_event_file *file =
 		container_of(ref, struct ib_uverbs_event_file, ref);
 
+#if 1	/* AKAROS */
+	if (file->proc)
+		proc_decref(file->proc);
+#endif	/* AKAROS */
 	kfree(file);
 }
 
@@ -470,6 +480,42 @@ static const struct file_operations uverbs_event_fops = {
 
 #endif	/* AKAROS */
 
+#if 1	/* AKAROS */
+/*
+ * RKM: sends the completions queued by ib_uverbs_comp_handler() as events.
+ * send_event() can't run in IRQ context.  Eats a ref on the channel.
+ */
+static void __uverbs_comp_deliver(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct ib_uverbs_event_file *file = (struct ib_uverbs_event_file *)a0;
+	struct ib_uverbs_event *entry, *tmp;
+	struct event_msg msg;
+	unsigned long flags;
+	LINUX_LIST_HEAD(events);
+
+	spin_lock_irqsave(&file->lock, flags);
+	file->deliver_pending = FALSE;
+	list_splice_init(&file->event_list, &events);
+	list_for_each_entry(entry, &events, list) {
+		/* the CQ might be destroyed once we unlock */
+		++(*entry->counter);
+		list_del(&entry->obj_list);
+	}
+	spin_unlock_irqrestore(&file->lock, flags);
+
+	list_for_each_entry_safe(entry, tmp, &events, list) {
+		memset(&msg, 0, sizeof(struct event_msg));
+		msg.ev_type = file->ev_id;
+		msg.ev_arg2 = 1;
+		msg.ev_arg3 = (void *)(unsigned long)entry->desc.comp.cq_handle;
+		if (!file->is_closed)
+			send_event(file->proc, file->ev_q, &msg, 0);
+		kfree(entry);
+	}
+	kref_put(&file->ref, ib_uverbs_release_event_file);
+}
+#endif	/* AKAROS */
+
 void ib_uverbs_comp_handler(struct ib_cq *cq, void *cq_context)
 {
 	struct ib_uverbs_event_file    *file = cq_context;
@@ -499,6 +545,14 @@ void ib_uverbs_comp_handler(struct ib_cq *cq, void *cq_context)
 
 	list_add_tail(&entry->list, &file->event_list);
 	list_add_tail(&entry->obj_list, &uobj->comp_list);
+#if 1	/* AKAROS */
+	if (!file->deliver_pending) {
+		file->deliver_pending = TRUE;
+		kref_get(&file->ref);
+		send_kernel_message(core_id(), __uverbs_comp_deliver,
+				    (long)file, 0, 0, KMSG_ROUTINE);
+	}
+#endif	/* AKAROS */
 	spin_unlock_irqrestore(&file->lock, flags);
 
 	wake_up_interruptible(&file->poll_wait);
@@ -619,6 +673,7 @@ struct file *ib_uverbs_alloc_event_file(struct ib_uverbs_file *uverbs_file,
 #endif	/* AKAROS */
 }
 
+#if 0	/* AKAROS */
 /*
  * Look up a completion event file by FD.  If lookup is successful,
  * takes a ref to the event file struct that it returns; if
@@ -646,11 +701,93 @@ struct ib_uverbs_event_file *ib_uverbs_lookup_comp_file(int fd)
 
 out:
 	fdput(f);
-#lse	/* AKAROS */
-	BUG_ON(1);
 #endif	/* AKAROS */
 	return ev_file;
 }
+#else	/* AKAROS */
+/*
+ * Completion channels are not files here.  Each one has an id, returned in
+ * place of the fd, and sends its CQs' completions to the caller's ev_q as
+ * events: ev_type is the channel's ev_id, ev_arg2 is 1 (so a CEQ with
+ * CEQ_ADD counts them) and ev_arg3 is the CQ's user handle.  Give each CQ
+ * its own channel if you need to tell them apart through a CEQ.  Channels
+ * take the place of ibv_get_cq_event(); rearm the CQ with ibv_req_notify_cq()
+ * as usual, and count the events for ibv_ack_cq_events().
+ */
+struct ib_uverbs_event_file *ib_uverbs_alloc_comp_chan(
+	struct ib_uverbs_file *uverbs_file, struct event_queue *ev_q,
+	uint32_t ev_id)
+{
+	struct ib_uverbs_event_file *ev_file;
+	int ret;
+
+	ev_file = kzmalloc(sizeof *ev_file, MEM_WAIT);
+	(kref_init)(&ev_file->ref, ib_uverbs_release_event_file, 1);
+	spin_lock_init(&ev_file->lock);
+	INIT_LIST_HEAD(&ev_file->event_list);
+	ev_file->uverbs_file = uverbs_file;
+	ev_file->ev_q = ev_q;
+	ev_file->ev_id = ev_id;
+
+	spin_lock(&ib_uverbs_idr_lock);
+	ret = idr_alloc(&ib_uverbs_comp_idr, ev_file, 0, 0, GFP_NOWAIT);
+	spin_unlock(&ib_uverbs_idr_lock);
+	if (ret < 0) {
+		kfree(ev_file);
+		return ERR_PTR(ret);
+	}
+	ev_file->id = ret;
+	proc_incref(current, 1);
+	ev_file->proc = current;
+
+	mutex_lock(&uverbs_file->mutex);
+	list_add_tail(&ev_file->chan_list, &uverbs_file->comp_chans);
+	mutex_unlock(&uverbs_file->mutex);
+	return ev_file;
+}
+
+/*
+ * Looks up one of uverbs_file's completion channels.  If lookup is successful,
+ * takes a ref to the channel that it returns; if unsuccessful, returns NULL.
+ */
+struct ib_uverbs_event_file *ib_uverbs_lookup_comp_file(
+	struct ib_uverbs_file *uverbs_file, int id)
+{
+	struct ib_uverbs_event_file *ev_file;
+
+	spin_lock(&ib_uverbs_idr_lock);
+	ev_file = idr_find(&ib_uverbs_comp_idr, id);
+	if (ev_file && ev_file->uverbs_file == uverbs_file)
+		kref_get(&ev_file->ref);
+	else
+		ev_file = NULL;
+	spin_unlock(&ib_uverbs_idr_lock);
+	return ev_file;
+}
+
+/* Called at close, once the CQs are gone. */
+static void ib_uverbs_close_comp_chans(struct ib_uverbs_file *file)
+{
+	struct ib_uverbs_event_file *ev_file, *tmp;
+	struct ib_uverbs_event *entry, *etmp;
+
+	list_for_each_entry_safe(ev_file, tmp, &file->comp_chans, chan_list) {
+		list_del(&ev_file->chan_list);
+		spin_lock(&ib_uverbs_idr_lock);
+		idr_remove(&ib_uverbs_comp_idr, ev_file->id);
+		spin_unlock(&ib_uverbs_idr_lock);
+		spin_lock_irq(&ev_file->lock);
+		ev_file->is_closed = 1;
+		list_for_each_entry_safe(entry, etmp, &ev_file->event_list,
+					 list) {
+			list_del(&entry->list);
+			kfree(entry);
+		}
+		spin_unlock_irq(&ev_file->lock);
+		kref_put(&ev_file->ref, ib_uverbs_release_event_file);
+	}
+}
+#endif	/* AKAROS */
 
 static ssize_t ib_uverbs_write(struct file *filp, const char __user *buf,
 			     size_t count, loff_t *pos)
@@ -828,6 +965,9 @@ static int ib_uverbs_open(struct inode *inode, struct file *filp)
 	file->async_file = NULL;
 	kref_init(&file->ref);
 	mutex_init(&file->mutex);
+#if 1	/* AKAROS */
+	INIT_LIST_HEAD(&file->comp_chans);
+#endif	/* AKAROS */
 
 	filp->private_data = file;
 	kobject_get(&dev->kobj);
@@ -850,6 +990,9 @@ static int ib_uverbs_close(struct inode *inode, struct file *filp)
 	struct ib_uverbs_device *dev = file->device;
 
 	ib_uverbs_cleanup_ucontext(file, file->ucontext);
+#if 1	/* AKAROS */
+	ib_uverbs_close_comp_chans(file);
+#endif	/* AKAROS */
 
 	if (file->async_file)
 		kref_put(&file->async_file->ref, ib_uverbs_release_event_file);
@@ -270,6 +270,10 @@ enum {
 #define ACTAB_ATAPI 0x40 // ATAPI Command (12 or 16 bytes)
 #define ACTAB_RES   0x50 // Reserved
 #define ACTAB_PRDT  0x80 // PRDT (up to 65,535 entries in spec, this has one)
+#define ACTAB_SLOT  0x100 // Per-slot table size, ACTAB_PRDT + one PRDT, aligned
+
+// Command slots in a port's command list
+#define ANSLOT 32
 
 // Portm flags (status flags?)
 enum {
@@ -285,6 +289,13 @@ enum {
 	Dnop = 1 << 3,
 	Datapi = 1 << 4,
 	Datapi16 = 1 << 5,
+	Dncq = 1 << 6,
+};
+
+/* one queued (ncq) command, see ncqio() */
+struct aslot {
+	struct rendez Rendez;
+	unsigned char flag; /* Fdone, Ferror if the queue was aborted */
 };
 
 struct aportm {
@@ -294,8 +305,15 @@ struct aportm {
 	unsigned char feat;
 	unsigned char smart;
 	struct afis fis;
-	void *list;
-	void *ctab;
+	void *list; /* ANSLOT command headers */
+	void *ctab; /* ANSLOT tables, ACTAB_SLOT apart; slot 0 for non-ncq */
+
+	/* ncq state, protected by the drive's lock */
+	unsigned char nslot; /* queue depth, 0 if not using ncq */
+	uint32_t inuse;      /* slots owned by an ncq request */
+	uint32_t issued;     /* slots given to the hba, not yet complete */
+	struct rendez slotrendez; /* waiting for a free slot */
+	struct aslot slot[ANSLOT];
 };
 
 struct aportc {
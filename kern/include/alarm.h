@@ -47,6 +47,12 @@
  * 	set_awaiter_rel(waiter, USEC);
  * 	set_alarm(tchain, waiter);
  *
+ * If you don't need to wake up right on time, give the alarm some slack:
+ * 	set_awaiter_rel_slack(waiter, USEC, SLACK_USEC);
+ * The alarm goes off somewhere between USEC and USEC + SLACK_USEC from now.
+ * The tchain uses the slack to run nearby alarms off a single interrupt.  The
+ * slack sticks with the waiter, so rearming with set_awaiter_rel() keeps it.
+ *
  * If you want the HANDLER to run again, do this at the end of it:
  * 	set_awaiter_rel(waiter, USEC);	// or whenever you want it to fire
  * 	set_alarm(tchain, waiter);
@@ -68,31 +74,50 @@
  * Timer chains (like off a per-core timer) are made of lists/trees of these. */
 struct alarm_waiter {
 	uint64_t 					wake_up_time;	/* ugh, this is a TSC for now */
+	uint64_t					slack;			/* TSC ticks, may run late */
 	union {
 		void (*func) (struct alarm_waiter *waiter);
 		void (*func_irq) (struct alarm_waiter *waiter,
 		                  struct hw_trapframe *hw_tf);
 	};
 	void						*data;
-	TAILQ_ENTRY(alarm_waiter)	next;
+	BSD_LIST_ENTRY(alarm_waiter)	next;
+	uint8_t						wheel_lvl;	/* slot, while on_tchain */
+	uint8_t						wheel_idx;
 	bool						on_tchain;
 	bool						irq_ok;
 	bool						holds_tchain_lock;
 	bool						rkm_pending;
 	struct cond_var				rkm_cv;
 };
-TAILQ_HEAD(awaiters_tailq, alarm_waiter);		/* ideally not a LL */
+BSD_LIST_HEAD(awaiter_list, alarm_waiter);
 
 typedef void (*alarm_handler)(struct alarm_waiter *waiter);
 
+/* Timer wheel geometry.  A level 0 slot covers 2^ALARM_WHEEL_SHIFT TSC ticks,
+ * and each level's slot covers a whole lap of the level below. */
+#define ALARM_WHEEL_SHIFT		12
+#define ALARM_WHEEL_LVL_BITS	6
+#define ALARM_WHEEL_LVL_SZ		(1 << ALARM_WHEEL_LVL_BITS)
+#define ALARM_WHEEL_LVL_MASK	(ALARM_WHEEL_LVL_SZ - 1)
+#define ALARM_WHEEL_LEVELS		6
+
 /* One of these per alarm source, such as a per-core timer.  All tchains come
  * with a lock, even if its rarely needed (like the pcpu tchains).
- * set_interrupt() is a method for setting the interrupt source. */
+ * set_interrupt() is a method for setting the interrupt source.
+ *
+ * Waiters hang off a hierarchical timer wheel, so setting and unsetting are
+ * O(1).  wheel_clk is in level 0 slots; every slot before it has been run.
+ * earliest_time is never later than the first waiter's deadline (its time plus
+ * its slack), but it may be earlier after an unset, which costs us an extra
+ * interrupt. */
 struct timer_chain {
 	spinlock_t					lock;
-	struct awaiters_tailq		waiters;
+	struct awaiter_list		wheel[ALARM_WHEEL_LEVELS][ALARM_WHEEL_LVL_SZ];
+	uint64_t					wheel_bitmap[ALARM_WHEEL_LEVELS];
+	uint64_t					wheel_clk;
+	unsigned long				nr_waiters;
 	uint64_t					earliest_time;
-	uint64_t					latest_time;
 	void (*set_interrupt)(struct timer_chain *);
 };
 
@@ -109,6 +134,10 @@ void init_awaiter_irq(struct alarm_waiter *waiter,
 void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 void set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep);
 void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep);
+/* Sets how late the awaiter may go off, to share an interrupt */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t slack_usec);
+void set_awaiter_rel_slack(struct alarm_waiter *waiter, uint64_t usleep,
+                           uint64_t slack_usec);
 /* Arms/disarms the alarm.  Can be called from within a handler.*/
 void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter);
 /* Unset and reset may block if the alarm is not IRQ.  Do not call from within a
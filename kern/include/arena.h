@@ -0,0 +1,85 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Resource arenas, based on Bonwick and Adams's "Magazines and Vmem" paper.
+ * An arena hands out integer ranges (usually kernel virtual addresses) in
+ * multiples of its quantum, from the spans that were added with arena_add().
+ *
+ * Every segment, free or allocated, has a boundary tag (btag).  The btags are
+ * kept on an address-ordered list, so frees can coalesce with their neighbors
+ * in O(1).  Free segments are also on power-of-two free lists, and allocated
+ * segments are in a hash table, keyed by address, so that frees don't need to
+ * search.  Allocations are 'instant fit': we take the first segment from the
+ * smallest free list that is guaranteed to fit, falling back to a first-fit
+ * scan of the list for our own size class.
+ *
+ * In front of the btags sit the quantum caches, one for each of the small
+ * sizes (1 to qcache_max / quantum quanta).  These are stacks of segments
+ * that are still allocated from the arena's point of view, so allocs and frees
+ * of common sizes skip the btags, the hash, and coalescing entirely, and only
+ * take the qcache's own lock.  arena_reap() gives them back.
+ *
+ * Usage:
+ * 		arena_init(&arena, "name", PGSIZE, 8 * PGSIZE);
+ * 		arena_add(&arena, base, size);
+ * 		addr = arena_alloc(&arena, size, MEM_WAIT);
+ * 		arena_free(&arena, addr, size);
+ *
+ * Arenas never hand out 0, which is their failure value, and their spans can't
+ * be removed. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <sys/queue.h>
+#include <atomic.h>
+
+#define ARENA_NAME_SZ			32
+#define ARENA_NR_FREE_LISTS		64
+#define ARENA_ALLOC_HASH_SZ		64
+#define ARENA_NR_QCACHES		8
+#define ARENA_QCACHE_DEPTH		32
+
+#define BTAG_FREE				1
+#define BTAG_ALLOC				2
+
+struct btag {
+	uintptr_t					start;
+	size_t						size;
+	int							status;
+	TAILQ_ENTRY(btag)			all_link;	/* all btags, by address */
+	BSD_LIST_ENTRY(btag)		misc_link;	/* free list or alloc hash */
+};
+TAILQ_HEAD(btag_tailq, btag);
+BSD_LIST_HEAD(btag_list, btag);
+
+struct arena_qcache {
+	spinlock_t					lock;
+	unsigned int				nr_segs;
+	uintptr_t					segs[ARENA_QCACHE_DEPTH];
+	unsigned long				nr_hits;
+	unsigned long				nr_misses;
+};
+
+struct arena {
+	spinlock_t					lock;
+	char						name[ARENA_NAME_SZ];
+	size_t						quantum;
+	int							qshift;
+	unsigned int				nr_qcaches;
+	struct btag_tailq			all_segs;
+	struct btag_list			free_segs[ARENA_NR_FREE_LISTS];
+	struct btag_list			alloc_hash[ARENA_ALLOC_HASH_SZ];
+	struct arena_qcache			qcaches[ARENA_NR_QCACHES];
+	size_t						amt_total;
+	size_t						amt_alloc;
+	unsigned long				nr_allocs_ever;
+};
+
+void arena_init(struct arena *arena, const char *name, size_t quantum,
+                size_t qcache_max);
+int arena_add(struct arena *arena, uintptr_t base, size_t size, int flags);
+uintptr_t arena_alloc(struct arena *arena, size_t size, int flags);
+void arena_free(struct arena *arena, uintptr_t addr, size_t size);
+void arena_reap(struct arena *arena);
+void print_arena_stats(struct arena *arena);
@@ -45,6 +45,10 @@ struct spinlock {
 	uint32_t calling_core;
 	bool irq_okay;
 #endif
+#ifdef CONFIG_LOCK_PROFILE
+	uintptr_t lp_site;			/* where the holder locked it */
+	uint64_t lp_tsc;			/* when, or 0 if not profiled */
+#endif
 };
 typedef struct spinlock spinlock_t;
 #define SPINLOCK_INITIALIZER {0}
@@ -66,12 +70,11 @@ extern inline void __spin_unlock(spinlock_t *lock);
  * all builds. */
 #include <arch/atomic.h>
 
-#ifdef CONFIG_SPINLOCK_DEBUG
+#if defined(CONFIG_SPINLOCK_DEBUG) || defined(CONFIG_LOCK_PROFILE)
 /* Arch indep, in k/s/atomic.c */
 void spin_lock(spinlock_t *lock);
 bool spin_trylock(spinlock_t *lock);
 void spin_unlock(spinlock_t *lock);
-void spinlock_debug(spinlock_t *lock);
 
 #else
 /* Just inline the arch-specific __ versions */
@@ -90,10 +93,14 @@ static inline void spin_unlock(spinlock_t *lock)
 	__spin_unlock(lock);
 }
 
+#endif /* CONFIG_SPINLOCK_DEBUG || CONFIG_LOCK_PROFILE */
+
+#ifdef CONFIG_SPINLOCK_DEBUG
+void spinlock_debug(spinlock_t *lock);
+#else
 static inline void spinlock_debug(spinlock_t *lock)
 {
 }
-
 #endif /* CONFIG_SPINLOCK_DEBUG */
 
 /* Inlines, defined below */
@@ -250,6 +257,9 @@ static inline void spinlock_init(spinlock_t *lock)
 	lock->calling_core = 0;
 	lock->irq_okay = FALSE;
 #endif
+#ifdef CONFIG_LOCK_PROFILE
+	lock->lp_tsc = 0;
+#endif
 }
 
 static inline void spinlock_init_irqsave(spinlock_t *lock)
@@ -260,6 +270,9 @@ static inline void spinlock_init_irqsave(spinlock_t *lock)
 	lock->calling_core = 0;
 	lock->irq_okay = TRUE;
 #endif
+#ifdef CONFIG_LOCK_PROFILE
+	lock->lp_tsc = 0;
+#endif
 }
 
 // If ints are enabled, disable them and note it in the top bit of the lock
@@ -64,8 +64,8 @@ static __inline__ int get_count_order(unsigned int count)
 
 static inline unsigned long hweight_long(unsigned long w)
 {
-	return __builtin_popcount(w);
-	//return sizeof(w) == 4 ? hweight32(w) : hweight64(w);
+	/* popcount() would only count the low 32 bits */
+	return __builtin_popcountl(w);
 }
 
 static inline unsigned fls_long(unsigned long l)
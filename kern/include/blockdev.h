@@ -11,6 +11,7 @@
 #include <slab.h>
 #include <pagemap.h>
 #include <kthread.h>
+#include <rendez.h>
 
 /* All block IO is done assuming a certain size sector, which is the smallest
  * possible unit of transfer between the kernel and the block layer.  This can
@@ -20,6 +21,55 @@
 #define SECTOR_SZ_LOG 9
 #define SECTOR_SZ (1 << SECTOR_SZ_LOG)
 
+/* Background writeback of a device's dirty buffer pages, by a ktask per
+ * device.  Dirty pages go on young, holding a page ref.  Every
+ * bdev_wb_interval_msec, the ktask writes out old, then young becomes old, so
+ * a page gets written between one and two intervals after it was first
+ * dirtied.  Once more than bdev_wb_dirty_ratio percent of memory is dirty on
+ * the device, the ktask writes out everything right away. */
+BSD_LIST_HEAD(bdev_wb_list, page);
+struct bdev_writeback {
+	spinlock_t					lock;
+	struct bdev_wb_list			young;
+	struct bdev_wb_list			old;
+	unsigned long				nr_dirty;
+	atomic_t					kicked;
+	struct rendez				rv;
+};
+
+extern unsigned int bdev_wb_interval_msec;
+extern unsigned int bdev_wb_dirty_ratio;
+
+/* Per-device request queue.  Requests wait here while the device is busy or
+ * the queue is plugged.  They are kept sorted by sector, for a one-way
+ * elevator, and in arrival order per direction, for the deadline: a request
+ * that has waited past its expiry goes next, reads first.  A request whose BHs
+ * are back to back gets merged with a queued one in the same direction that it
+ * continues (or that continues it), and the device gets them as one. */
+struct block_request;
+TAILQ_HEAD(breq_tailq, block_request);
+struct bdev_queue {
+	spinlock_t					lock;				/* irqsave */
+	struct breq_tailq			sorted;
+	struct breq_tailq			fifo[2];			/* reads, writes */
+	unsigned int				plugged;
+	unsigned int				nr_inflight;		/* at the device */
+	unsigned long				next_sector;		/* elevator position */
+	unsigned long				nr_dispatched;
+	unsigned long				nr_merged;
+};
+
+extern unsigned int bdev_read_expire_msec;
+extern unsigned int bdev_write_expire_msec;
+
+/* Buffer cache: a device's buffers live in its page map, b_pm, whose LRU picks
+ * which clean, unused pages to drop.  Once b_pm holds more than
+ * bdev_cache_ratio percent of memory, bdev_get_buffer() shrinks it.  A miss
+ * reads every block of the page that isn't up to date, not just the one asked
+ * for, since neighboring metadata (bitmaps, inode tables) tends to get used
+ * together. */
+extern unsigned int bdev_cache_ratio;
+
 /* Every block device is represented by one of these, with custom methods, as
  * applicable for the type of device.  Subject to massive changes. */
 #define BDEV_INLINE_NAME 10
@@ -31,10 +81,8 @@ struct block_device {
 	struct page_map				b_pm;
 	void						*b_data;			/* dev-specific use */
 	char						b_name[BDEV_INLINE_NAME];
-	// TODO: list or something of buffer heads (?)
-	// list of outstanding requests
-	// io scheduler
-	// callbacks for completion
+	struct bdev_writeback		b_wb;
+	struct bdev_queue			b_queue;
 };
 
 /* So far, only NEEDS_ZEROED is used */
@@ -61,7 +109,10 @@ struct kmem_cache *bh_kcache;
 struct buffer_head *bdev_get_buffer(struct block_device *bdev,
                                     unsigned long blk_num, unsigned int blk_sz);
 void bdev_dirty_buffer(struct buffer_head *bh);
+void bdev_dirty_page(struct page *page);
 void bdev_put_buffer(struct buffer_head *bh);
+int block_writepage(struct page_map *pm, struct page *page);
+void bdev_writeback_init(struct block_device *bdev);
 
 /* This encapsulates the work of a request (instead of having a variety of
  * slightly-different functions for things like read/write and scatter-gather
@@ -72,9 +123,11 @@ void bdev_put_buffer(struct buffer_head *bh);
  *
  * bhs normally points to the inline version (enough for a page).  kmalloc
  * another array of BH pointers if you want more.  The BHs do not need to be
- * linked or otherwise associated with a page mapping. */
+ * linked or otherwise associated with a page mapping.
+ *
+ * The callback runs when the IO is done, from a routine kernel message, so it
+ * can block.  The rest of the fields are for the request queue. */
 #define NR_INLINE_BH (PGSIZE >> SECTOR_SZ_LOG)
-struct block_request;
 struct block_request {
 	unsigned int				flags;
 	void						(*callback)(struct block_request *breq);
@@ -83,6 +136,13 @@ struct block_request {
 	struct buffer_head			**bhs;				/* BHs describing the IOs */
 	unsigned int				nr_bhs;
 	struct buffer_head			*local_bhs[NR_INLINE_BH];
+	struct block_device			*bdev;
+	TAILQ_ENTRY(block_request)	sort_link;
+	TAILQ_ENTRY(block_request)	fifo_link;			/* or merged list */
+	struct breq_tailq			merged;				/* merged into us */
+	unsigned long				sector;				/* of the first BH */
+	unsigned long				nr_sector;			/* 0 if not contiguous */
+	uint64_t					deadline;			/* in TSC ticks */
 };
 struct kmem_cache *breq_kcache;	/* for the block requests */
 
@@ -93,6 +153,9 @@ struct kmem_cache *breq_kcache;	/* for the block requests */
 void block_init(void);
 struct block_device *get_bdev(char *path);
 void free_bhs(struct page *page);
+void bdev_queue_init(struct block_device *bdev);
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq);
+void bdev_plug(struct block_device *bdev);
+void bdev_unplug(struct block_device *bdev);
 void generic_breq_done(struct block_request *breq);
 void sleep_on_breq(struct block_request *breq);
@@ -12,4 +12,9 @@
 #include <ros/ceq.h>
 #include <process.h>
 
+/* Most idxs we post to the ring with one CAS */
+#define CEQ_POST_BATCH			32
+
 void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg);
+void send_ceq_msgs(struct ceq *ceq, struct proc *p, struct event_msg *msgs,
+                   unsigned int nr);
@@ -0,0 +1,77 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Concurrent hash table, mapping uintptr_t keys to non-null pointers.
+ *
+ * It's open addressing with linear probing, so a lookup is usually one or two
+ * cache lines of a flat array, instead of a chain of pointers.  Readers don't
+ * lock: they just need rcu_read_lock() around the lookup and whatever they do
+ * with the value, so the value should be freed after a grace period too.
+ * Writers are serialized by a per-table spinlock.
+ *
+ * Slots only ever go from empty, to used, to dead (a tombstone).  A dead slot
+ * isn't reused, so a reader can never see a slot's key change underneath it.
+ * Once enough slots are dead or used, we allocate a new array and move the
+ * live entries over a few at a time, during later inserts and removes.  While
+ * that's going on, entries can be in both arrays: moving copies them, removing
+ * kills them in both, and lookups check the new array, then the old one.  The
+ * old array is freed with call_rcu() once it's all been moved.
+ *
+ * 		struct chash pids;
+ *
+ * 		chash_init(&pids, 64);
+ * 		chash_insert(&pids, pid, p);
+ * 		...
+ * 		rcu_read_lock();
+ * 		p = chash_lookup(&pids, pid);
+ * 		if (p && !kref_get_not_zero(&p->p_kref, 1))
+ * 			p = 0;
+ * 		rcu_read_unlock();
+ */
+
+#pragma once
+
+#include <ros/common.h>
+#include <atomic.h>
+#include <rcu.h>
+
+struct chash_slot {
+	uintptr_t					key;
+	void						*val;	/* 0 for empty, CHASH_DEAD for dead */
+};
+
+struct chash_array {
+	size_t						nr_slots;	/* power of two */
+	struct rcu_head				rcu;
+	struct chash_slot			slots[];
+};
+
+struct chash {
+	spinlock_t					lock;		/* for writers */
+	struct chash_array			*cur;
+	struct chash_array			*old;		/* being moved to cur, or 0 */
+	size_t						next_mv;	/* next old slot to move */
+	size_t						nr_items;
+	size_t						nr_used;	/* used or dead slots in cur */
+	size_t						min_slots;
+};
+
+/* min_slots is the initial size, and the size we'll never shrink below. */
+int chash_init(struct chash *ht, size_t min_slots);
+void chash_destroy(struct chash *ht);
+/* Hold rcu_read_lock() */
+void *chash_lookup(struct chash *ht, uintptr_t key);
+/* Returns 0, -EEXIST if key is already in there, or -ENOMEM. */
+int chash_insert(struct chash *ht, uintptr_t key, void *val);
+/* Returns the value that was removed, or 0. */
+void *chash_remove(struct chash *ht, uintptr_t key);
+/* Calls func on every value, without locking.  Values that are in there the
+ * whole time are seen once, and values added or removed during the walk may or
+ * may not be seen.  Hold rcu_read_lock(), so func can't block. */
+void chash_for_each(struct chash *ht, void (*func)(void *val, void *arg),
+                    void *arg);
+
+static inline size_t chash_count(struct chash *ht)
+{
+	return ACCESS_ONCE(ht->nr_items);
+}
@@ -54,3 +54,46 @@ static inline size_t circular_buffer_max_write_size(
 {
 	return cb->allocated - 2 * sizeof(cbuf_size_t);
 }
+
+/* The multi-producer variant.  Any number of writers, in any context, reserve
+ * space for a record, fill it in and commit it, without a lock:
+ *
+ *   char *rec = circular_buffer_mp_reserve(&cbmp, len);
+ *
+ *   if (rec) {
+ *       ... fill in len bytes at rec ...
+ *       circular_buffer_mp_commit(&cbmp, rec);
+ *   }
+ *
+ * A single reader consumes records in the order they were reserved, so a record
+ * that's reserved but not committed holds up everything after it.  Don't block
+ * in between.  Unlike circular_buffer, a full buffer drops the new record, not
+ * the old ones: the writers can't touch what the reader might be looking at.
+ *
+ * head and tail count bytes forever, and the size is a power of two, so their
+ * difference is what's in use.  Each record has a header, which says if it's
+ * committed, or padding up to the end of the buffer. */
+struct circular_buffer_mp {
+	char *base;
+	size_t allocated;
+	uint64_t head;		/* next byte to reserve */
+	uint64_t tail;		/* next byte to read, written by the reader */
+	uint64_t nr_dropped;
+};
+
+bool circular_buffer_mp_init(struct circular_buffer_mp *cb, size_t size);
+void circular_buffer_mp_destroy(struct circular_buffer_mp *cb);
+/* Returns where to write size bytes, or NULL if there's no room. */
+char *circular_buffer_mp_reserve(struct circular_buffer_mp *cb, size_t size);
+void circular_buffer_mp_commit(struct circular_buffer_mp *cb, char *rec);
+/* Consumes whole committed records, copying them into data back to back.  One
+ * that's bigger than size gets cut short.  Only one reader at a time. */
+size_t circular_buffer_mp_read(struct circular_buffer_mp *cb, char *data,
+                               size_t size);
+
+static inline size_t circular_buffer_mp_max_write_size(
+	const struct circular_buffer_mp *cb)
+{
+	/* Less the record's 8 byte header */
+	return cb->allocated / 2 - sizeof(uint64_t);
+}
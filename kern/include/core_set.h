@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <bitops.h>
+#include <bitmap.h>
 
 struct core_set {
 	unsigned long cpus[DIV_ROUND_UP(MAX_NUM_CORES, BITS_PER_LONG)];
@@ -45,14 +46,7 @@ static inline void core_set_fill_available(struct core_set *cset)
 
 static inline int core_set_count(const struct core_set *cset)
 {
-	int count = 0;
-
-	for (size_t i = 0; i < ARRAY_SIZE(cset->cpus); i++) {
-		for (unsigned long v = cset->cpus[i]; v; v >>= 1)
-			count += (int) (v & 1);
-	}
-
-	return count;
+	return bitmap_weight(cset->cpus, ARRAY_SIZE(cset->cpus) * BITS_PER_LONG);
 }
 
 static inline int core_set_remote_count(const struct core_set *cset)
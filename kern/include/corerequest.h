@@ -11,6 +11,8 @@
 #include <arch/topology.h>
 #if defined(CONFIG_COREALLOC_FCFS)
   #include <corealloc_fcfs.h>
+#elif defined(CONFIG_COREALLOC_PACKED)
+  #include <corealloc_packed.h>
 #endif
 
 /* Initialize any data assocaited with doing core allocation. */
@@ -86,15 +88,21 @@ static inline struct proc *get_prov_proc(uint32_t pcoreid)
 	return all_pcores[pcoreid].prov_proc;
 }
 
-/* TODO: need more thorough CG/LL management.  For now, core0 is the only LL
- * core.  This won't play well with the ghetto shit in schedule_init() if you do
- * anything like 'DEDICATED_MONITOR' or the ARSC server.  All that needs an
- * overhaul. */
+/* The first nr_ll_cores() cores are LL cores: they run SCPs and never go to
+ * MCPs.  There is always at least one, core 0, and always at least one CG core
+ * on multicore machines.
+ *
+ * TODO: need more thorough CG/LL management.  This won't play well with the
+ * ghetto shit in schedule_init() if you do anything like 'DEDICATED_MONITOR'
+ * or the ARSC server.  All that needs an overhaul. */
+static inline uint32_t nr_ll_cores(void)
+{
+	return MAX(MIN(CONFIG_NR_LL_CORES, num_cores - 1), 1);
+}
+
 static inline bool is_ll_core(uint32_t pcoreid)
 {
-	if (pcoreid == 0)
-		return TRUE;
-	return FALSE;
+	return pcoreid < nr_ll_cores();
 }
 
 /* Normally it'll be the max number of CG cores ever */
@@ -104,6 +112,6 @@ static inline uint32_t max_vcores(struct proc *p)
 #ifdef CONFIG_DISABLE_SMT
 	return num_cores >> 1;
 #else
-	return num_cores - 1;	/* reserving core 0 */
+	return num_cores - nr_ll_cores();	/* reserving the LL cores */
 #endif /* CONFIG_DISABLE_SMT */
 }
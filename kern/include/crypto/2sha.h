@@ -12,6 +12,12 @@
 
 #include "2crypto.h"
 
+#ifdef CONFIG_X86
+/* Hash some of nr blocks with the SHA extensions, returning how many. */
+size_t x86_sha1_blocks(uint32_t state[5], const uint8_t *data, size_t nr);
+size_t x86_sha256_blocks(uint32_t state[8], const uint8_t *data, size_t nr);
+#endif
+
 /* Hash algorithms may be disabled individually to save code space */
 
 #ifndef VB2_SUPPORT_SHA1
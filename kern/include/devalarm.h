@@ -24,6 +24,8 @@ struct proc_alarm {
 	struct fdtap_slist			fd_taps;
 	unsigned long				period;
 	unsigned long				count;
+	uint32_t					sig_vcoreid;
+	int							sig_nr;		/* 0 for no signal */
 };
 TAILQ_HEAD(proc_alarm_list, proc_alarm);
 
@@ -147,7 +147,9 @@ typedef long elf_aux_t[2];
 #define ELF_HWCAP_SPARC_FLUSH	1
 
 struct file;
+struct inode;
 bool is_valid_elf(struct file *f);
+void elf_cache_free(struct inode *inode);
 int load_elf(struct proc* p, struct file* f,
              int argc, char *argv[], int envc, char *envp[]);
 ssize_t get_startup_argc(struct proc *p);
@@ -16,6 +16,8 @@
 #include <arch/arch.h>
 #include <sys/queue.h>
 #include <atomic.h>
+#include <rcu.h>
+#include <workqueue.h>
 #include <mm.h>
 #include <vfs.h>
 #include <schedule.h>
@@ -24,9 +26,18 @@
 #include <arch/vmm/vmm.h>
 
 TAILQ_HEAD(vcore_tailq, vcore);
+struct proc_sysring;
 /* 'struct proc_list' declared in sched.h (not ideal...) */
 
 #define PROC_PROGNAME_SZ 20
+
+/* Per-vcore counters, bumped by whichever core the vcore is running on (see
+ * proc_vc_stats()), or by anyone for nr_events. */
+struct vcore_counters {
+	uint64_t					nr_syscalls;
+	uint64_t					nr_page_faults;
+	uint64_t					nr_events;		/* atomic */
+} __attribute__((aligned(ARCH_CL_SIZE)));
 // TODO: clean this up.
 struct proc {
 	TAILQ_ENTRY(proc) proc_arsc_link;
@@ -56,6 +67,8 @@ struct proc {
 	struct cond_var child_wait;	/* signal for dying or o/w waitable child */
 	uint32_t state;				// Status of the process
 	struct kref p_kref;		/* Refcnt */
+	struct rcu_head p_rcu;	/* pid2proc() might still be looking at us */
+	struct work_struct p_free_work;	/* __proc_free() hands off to this */
 	uint32_t env_flags;
 	/* Lists of vcores */
 	struct vcore_tailq online_vcs;
@@ -78,6 +91,7 @@ struct proc {
 	// Address space
 	pgdir_t env_pgdir;			// Kernel virtual address of page dir
 	physaddr_t env_cr3;			// Physical address of page dir
+	unsigned long tlb_gen;		/* unique, changes on each TLB shootdown */
 	spinlock_t vmr_lock;		/* Protects VMR tree (mem mgmt) */
 	spinlock_t pte_lock;		/* Protects page tables (mem mgmt) */
 	struct vmr_tailq vm_regions;
@@ -118,6 +132,17 @@ struct proc {
 	struct strace				*strace;
 	bool						strace_on;
 	bool						strace_inherit;
+	/* max_syscall pointers, each stat allocated on the first call */
+	struct sysc_lat_stat		**sysc_lat;
+	/* Vcore FPU saves and restores, and how many we skipped */
+	atomic_t					fp_saves;
+	atomic_t					fp_saves_skipped;
+	atomic_t					fp_restores;
+	atomic_t					fp_restores_skipped;
+	/* max_vcores of these, for #proc/PID/stats */
+	struct vcore_counters		*vc_stats;
+
+	struct proc_sysring			*sysring;
 };
 
 /* Til we remove all Env references */
@@ -127,6 +152,7 @@ typedef struct proc env_t;
 /* Process Flags */
 #define PROC_TRANSITION_TO_M	(1 << 0)
 #define PROC_TRACED				(1 << 1)
+#define PROC_IS_TEMPLATE		(1 << 2)
 
 extern atomic_t num_envs;		// Number of envs
 
@@ -13,7 +13,12 @@
 
 void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
                 uint32_t vcoreid);
+void send_events(struct proc *p, struct event_queue *ev_q,
+                 struct event_msg *msgs, unsigned int nr, uint32_t vcoreid);
 void send_kernel_event(struct proc *p, struct event_msg *msg, uint32_t vcoreid);
 void post_vcore_event(struct proc *p, struct event_msg *msg, uint32_t vcoreid,
                       int ev_flags);
 void send_posix_signal(struct proc *p, int sig_nr);
+void send_vcore_signal(struct proc *p, uint32_t vcoreid, int sig_nr);
+void event_defer_notifs(void);
+void event_flush_notifs(void);
@@ -59,6 +59,10 @@
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE	0x0002	/* 64-bit filesize */
 #define EXT2_FEATURE_RO_COMPAT_BTREE_DIR	0x0004	/* binary tree sorted dir */
 
+/* Misc flags (s_flags) */
+#define EXT2_FLAGS_SIGNED_HASH		0x0001	/* dir hashes use signed chars */
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002	/* dir hashes use unsigned chars */
+
 /* Compression types (s_algo_bitmap) */
 #define EXT2_LZV1_ALG			0x0001
 #define EXT2_LZRW3A_ALG			0x0002
@@ -181,7 +185,16 @@ struct ext2_sb {
 /* Next chunk, Other options */
 	uint32_t					s_default_mount_opts;
 	uint32_t					s_first_meta_bg;	/* BG id of first meta */
-	uint8_t						s_reserved[760];
+/* Next chunk, ext3/4 */
+	uint32_t					s_mkfs_time;
+	uint32_t					s_jnl_blocks[17];	/* backup of journal ino */
+	uint32_t					s_blocks_cnt_hi;
+	uint32_t					s_rblocks_cnt_hi;
+	uint32_t					s_free_blocks_cnt_hi;
+	uint16_t					s_min_extra_isize;
+	uint16_t					s_want_extra_isize;
+	uint32_t					s_flags;			/* misc flags */
+	uint8_t						s_reserved[668];
 };
 
 /* All block ids are absolute (not relative to the BG). */
@@ -242,6 +255,47 @@ struct ext2_dirent {
 	uint8_t						dir_name[256];		/* might be < 255 on disc */
 };
 
+/* Hashed directory indexes (htrees), from ext3.  Block 0 of an indexed dir
+ * starts with the . and .. dirents, with .. covering the rest of the block.
+ * The dx_root_info follows them, then the root's dx_entries.  The other index
+ * nodes are a single empty dirent covering the block, then the dx_entries.  To
+ * anything that doesn't know about the index, the nodes look like empty dirent
+ * blocks.
+ *
+ * Entries are sorted by hash.  The first entry of a node has no hash; its
+ * spot holds the dx_countlimit instead.  Each entry points to the dir block
+ * (relative to the dir, not the FS) holding hashes from its own up to the next
+ * entry's.  A hash with its low bit set means a run of equal hashes carried
+ * over from the previous block. */
+#define EXT2_DX_HASH_LEGACY				0
+#define EXT2_DX_HASH_HALF_MD4			1
+#define EXT2_DX_HASH_TEA				2
+#define EXT2_DX_HASH_LEGACY_UNSIGNED	3
+#define EXT2_DX_HASH_HALF_MD4_UNSIGNED	4
+#define EXT2_DX_HASH_TEA_UNSIGNED		5
+
+#define EXT2_DX_ROOT_INFO_OFF	24		/* after the . and .. dirents */
+#define EXT2_DX_NODE_OFF		8		/* after the empty dirent */
+#define EXT2_DX_MAX_LEVELS		2		/* root, plus one indirect level */
+
+struct ext2_dx_root_info {
+	uint32_t					reserved_zero;
+	uint8_t						hash_version;
+	uint8_t						info_length;		/* 8 */
+	uint8_t						indirect_levels;
+	uint8_t						unused_flags;
+};
+
+struct ext2_dx_countlimit {
+	uint16_t					limit;				/* max entries in node */
+	uint16_t					count;				/* entries, incl this one */
+};
+
+struct ext2_dx_entry {
+	uint32_t					hash;
+	uint32_t					block;				/* dir block of the node */
+};
+
 /* Every FS must extern it's type, and be included in vfs_init() */
 extern struct fs_type ext2_fs_type;
 
@@ -255,9 +309,18 @@ struct ext2_sb_info {
 	unsigned int				nr_bgs;
 };
 
+/* Blocks we reserve past each new data block, so sequential writes get
+ * contiguous blocks without rescanning the bitmap */
+#define EXT2_PREALLOC_BLOCKS	8
+
 /* Inode in-memory data.  This stuff is in cpu-native endianness.  If we start
  * using the data in the actual inode and in the buffer cache, change
- * ext2_my_bh() and its two callers.  Assume this data is dirty. */
+ * ext2_my_bh() and its two callers.  Assume this data is dirty.
+ *
+ * The prealloc window is a run of blocks that are taken in the bitmap, but not
+ * linked into the inode yet.  They go back to the BG when the inode goes. */
 struct ext2_i_info {
 	uint32_t					i_block[15];		/* list of blocks reserved*/
+	uint32_t					i_prealloc_block;	/* next block in window */
+	unsigned int				i_prealloc_count;	/* blocks left in window */
 };
@@ -32,4 +32,5 @@ struct fd_tap {
 
 int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req);
 int remove_fd_tap(struct proc *p, int fd);
+int mod_fd_tap(struct proc *p, struct fd_tap_req *tap_req);
 int fire_tap(struct fd_tap *tap, int filter);
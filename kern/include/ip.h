@@ -29,6 +29,7 @@
 
 #pragma once
 #include <ns.h>
+#include <rcu.h>
 
 enum {
 	Addrlen = 64,
@@ -86,6 +87,7 @@ struct conv {
 	uint32_t ttl;				/* max time to live */
 	uint32_t tos;				/* type of service */
 	int ignoreadvice;			/* don't terminate connection on icmp errors */
+	uint32_t busy_poll_usec;	/* spin reading data this long, then block */
 
 	uint8_t ipversion;
 	uint8_t laddr[IPaddrlen];	/* local IP address */
@@ -104,7 +106,11 @@ struct conv {
 	int reliable;				/* true if reliable udp */
 
 	struct conv *incall;		/* calls waiting to be listened for */
+	struct conv *incall_last;	/* tail of incall, if it's not empty */
+	int nincall;
 	struct conv *next;
+	TAILQ_ENTRY(conv) free_link;	/* on p->free_convs */
+	bool on_free_list;
 
 	struct queue *rq;			/* queued data waiting to be read */
 	struct queue *wq;			/* queued data waiting to be written */
@@ -132,6 +138,8 @@ struct conv {
 
 struct Ipifc;
 struct Fs;
+struct v4_flat;
+struct fragtab;
 
 struct medium {
 	char *name;
@@ -170,6 +178,11 @@ struct medium {
 	/* v6 address generation */
 	void (*pref2addr) (uint8_t * pref, uint8_t * ea);
 
+	/* busy polling: input up to budget packets from the device, on the
+	 * calling core, without waiting for an interrupt.  Hold the ifc rlock.
+	 * Returns the number of packets input. */
+	int (*poll) (struct Ipifc * ifc, int budget);
+
 	int unbindonclose;			/* if non-zero, unbind on last close */
 };
 
@@ -222,6 +235,7 @@ struct Ipifc {
 	char dev[64];				/* device we're attached to */
 	struct medium *m;			/* Media pointer */
 	int maxtu;					/* Maximum transfer unit */
+	int devmaxtu;				/* Largest maxtu the device takes */
 	int mintu;					/* Minumum tranfer unit */
 	unsigned int feat;				/* Offload features */
 	int mbps;					/* megabits per second */
@@ -289,6 +303,8 @@ struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 /*
  *  one per multiplexed Protocol
  */
+TAILQ_HEAD(conv_tailq, conv);
+
 struct Proto {
 	qlock_t qlock;
 	char *name;					/* protocol name */
@@ -306,6 +322,7 @@ struct Proto {
 	void (*ctl)(struct conv *, char **, int);
 	void (*advise) (struct Proto *, struct block *, char *unused_char_p_t);
 	int (*stats) (struct Proto *, char *unused_char_p_t, int);
+	int (*convstats)(struct conv *, char *, int);	/* per-conv stats */
 	int (*local) (struct conv *, char *unused_char_p_t, int);
 	int (*remote) (struct conv *, char *unused_char_p_t, int);
 	int (*inuse) (struct conv *);
@@ -317,6 +334,9 @@ struct Proto {
 	int ptclsize;				/* size of per protocol ctl block */
 	int nc;						/* number of conversations */
 	int ac;
+	/* closed convs, oldest first, so Fsprotoclone() needn't scan for one */
+	spinlock_t free_lock;
+	struct conv_tailq free_convs;
 	struct qid qid;				/* qid for protocol directory */
 	uint16_t nextport;
 	uint16_t nextrport;
@@ -349,12 +369,15 @@ struct Fs {
 	struct IP *ip;
 	struct Ipselftab *self;
 	struct arp *arp;
+	struct fragtab *frags;
 	struct V6params *v6p;
 	struct IProuter iprouter;
 
 	struct route *v4root[1 << Lroot];	/* v4 routing forest */
 	struct route *v6root[1 << Lroot];	/* v6 routing forest */
 	struct route *queue;		/* used as temp when reinjecting routes */
+	struct v4_flat *v4flat;		/* flattened v4root, see iproute.c */
+	uint32_t v4flat_seen;		/* last generation a lookup saw */
 
 	struct Netlog *alog;
 	struct Ifclog *ilog;
@@ -422,6 +445,7 @@ enum {
 	Logrudpmsg = 1 << 16,
 	Logesp = 1 << 17,
 	Logtcpwin = 1 << 18,
+	Logtcptrace = 1 << 19,
 };
 
 void netloginit(struct Fs *);
@@ -471,6 +495,7 @@ struct RouteTree {
 	struct Ipifc *ifc;
 	char tag[4];
 	struct kref kref;
+	struct rcu_head rcu;		/* on its way back to the freelist */
 };
 
 struct V4route {
@@ -541,6 +566,8 @@ struct arpent {
 	uint8_t rxtsrem;
 	struct Ipifc *ifc;
 	uint8_t ifcid;				/* must match ifc->id */
+	seq_ctr_t seq;				/* around changes to state and mac */
+	struct rcu_head rcu;
 };
 
 extern void arpinit(struct Fs *);
@@ -593,6 +620,24 @@ static inline long ipcmp(unsigned char *x, unsigned char *y)
 		(a[2] ^ b[2]) | (a[3] ^ b[3]);
 }
 
+/* Mixes all of the address; on a flat /16, only two bytes differ. */
+static inline uint32_t ipaddrhash(uint8_t *ip)
+{
+	uint32_t x = 0, w;
+
+	for (int i = 0; i < IPaddrlen; i += sizeof(w)) {
+		memcpy(&w, ip + i, sizeof(w));
+		x = (x ^ w) * 0x9e3779b1;
+	}
+	/* murmur3's finalizer */
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
 
 extern uint8_t IPv4bcast[IPaddrlen];
 extern uint8_t IPv4bcastobs[IPaddrlen];
@@ -662,8 +707,40 @@ extern int ipoput6(struct Fs *,
 				   struct block *, int unused_int, int, int, struct conv *);
 extern int ipstats(struct Fs *, char *unused_char_p_t, int);
 extern uint16_t ptclbsum(uint8_t * unused_uint8_p_t, int);
+extern uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len);
 extern uint16_t ptclcsum(struct block *, int unused_int, int);
 extern void ip_init(struct Fs *);
+
+/*
+ *  reassembly queues, shared by v4 and v6.  v4 addresses are v4-mapped.
+ */
+struct fragkey {
+	uint8_t src[IPaddrlen];
+	uint8_t dst[IPaddrlen];
+	uint32_t id;
+	uint8_t proto;
+	uint8_t vers;
+	uint32_t hash;				/* set by fraglock() */
+};
+
+struct fragq {
+	struct fragq *next;			/* hash chain */
+	TAILQ_ENTRY(fragq) lru;
+	struct fragkey key;
+	struct block *blist;		/* sorted by offset */
+	size_t mem;
+	uint64_t age;				/* msec, when we give up on it */
+};
+
+extern struct fragtab *fraginit(struct Fs *, uint32_t *timeouts,
+								uint32_t *fails);
+extern void fraglock(struct Fs *, struct fragkey *);
+extern void fragunlock(struct Fs *, struct fragkey *);
+extern struct fragq *fragfind(struct Fs *, struct fragkey *);
+extern struct fragq *fragnew(struct Fs *, struct fragkey *, struct block *);
+extern void fragupdate(struct Fs *, struct fragq *);
+extern void fragfree(struct Fs *, struct fragq *);
+
 extern void update_mtucache(uint8_t * unused_uint8_p_t, uint32_t);
 extern uint32_t restrict_mtu(uint8_t * unused_uint8_p_t, uint32_t);
 
@@ -915,6 +992,7 @@ enum {
 	Nstatqid,
 	Ntypeqid,
 	Nifstatqid,
+	Ncapringqid,
 };
 
 /*
@@ -941,10 +1019,14 @@ struct netfile {
 	int scan;					/* base station scanning interval */
 	int bridge;					/* bridge mode */
 	int headersonly;			/* headers only - no data */
+	int batch;					/* many frames per data read/write */
+	int vnethdr;				/* batch frames have a netif_vnethdr */
 	uint8_t maddr[8];			/* bitmask of multicast addresses requested */
 	int nmaddr;					/* number of multicast addresses */
 
 	struct queue *in;			/* input buffer */
+	struct net_capring __rcu *capring;	/* if set, frames go here, not in */
+	struct bpf_prog __rcu *filter;	/* if set, decides what we get */
 };
 
 /*
@@ -965,6 +1047,7 @@ struct netaddr {
 #define NETF_PADMIN_SHIFT	(NETF_BASE_SHIFT + 0)
 #define NETF_SG_SHIFT		(NETF_BASE_SHIFT + 1)
 #define NETF_LRO_SHIFT		(NETF_BASE_SHIFT + 2)
+#define NETF_GSO_SHIFT		(NETF_BASE_SHIFT + 3)
 enum {
 	NETF_IPCK = (1 << NS_IPCK_SHIFT),	/* xmit ip checksum */
 	NETF_UDPCK = (1 << NS_UDPCK_SHIFT),	/* xmit udp checksum */
@@ -973,6 +1056,7 @@ enum {
 	NETF_SG	= (1 << NETF_SG_SHIFT),		/* device can do scatter/gather */
 	NETF_TSO = (1 << NS_TSO_SHIFT),		/* device can do TSO */
 	NETF_LRO = (1 << NETF_LRO_SHIFT),	/* device can do LRO */
+	NETF_GSO = (1 << NETF_GSO_SHIFT),	/* TSO, in software if need be */
 };
 /*
  *  a network interface
@@ -1026,12 +1110,24 @@ struct walkqid *netifwalk(struct ether *, struct chan *, struct chan *,
 struct chan *netifopen(struct ether *, struct chan *, int);
 void netifclose(struct ether *, struct chan *);
 long netifread(struct ether *, struct chan *, void *, long, uint32_t);
-struct block *netifbread(struct ether *, struct chan *, long, uint32_t);
+struct block *netifbread(struct ether *, struct chan *, long, int64_t);
 long netifwrite(struct ether *, struct chan *, void *, long);
 int netifwstat(struct ether *, struct chan *, uint8_t *, int);
 int netifstat(struct ether *, struct chan *, uint8_t *, int);
 int activemulti(struct ether *, uint8_t *, int);
 
+struct event_queue;
+void capring_setup(struct netfile *f, uint32_t nr_frames, uint32_t snaplen,
+                   struct event_queue *ev_q, uint16_t ev_id, uint32_t batch);
+void capring_free(struct netfile *f);
+void capring_put(struct net_capring *ncr, struct block *bp, uint32_t snap);
+long capring_read(struct netfile *f, void *va, long n, uint32_t offset);
+
+struct bpf_prog;
+void bpf_attach(struct netfile *f, void *a, long n);
+void bpf_detach(struct netfile *f);
+uint32_t bpf_run(struct bpf_prog *prog, struct block *bp);
+
 /*
  *  Ethernet specific
  */
@@ -1040,6 +1136,31 @@ enum {
 	ETHERMINTU = 60,	/* minimum transmit size */
 	ETHERMAXTU = 1500,	/* maximum transmit size */
 	ETHERHDRSIZE = 14,	/* size of an ethernet header */
+	NETIF_BATCHHDR = 2,	/* length of each frame's record in batch mode */
+	NETIF_MAXREC = 0xffff,	/* the most a batch record's length can say */
+};
+
+/* With "vnethdr", each batch record's frame comes after one of these, and the
+ * record's length covers both.  It's a virtio_net_hdr_v1 (little endian), so a
+ * virtio-net device can pass its guest's offloads straight through.  Writers
+ * can ask for checksum offload and TSO, and readers learn which checksums the
+ * NIC checked.  We ignore hdr_len and num_buffers. */
+struct netif_vnethdr {
+	uint8_t flags;
+	uint8_t gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;		/* from the start of the frame */
+	uint16_t csum_offset;		/* from csum_start */
+	uint16_t num_buffers;
+} __attribute__((packed));
+
+enum {
+	NETIF_VNET_F_NEEDS_CSUM = 1,
+	NETIF_VNET_F_DATA_VALID = 2,
+	NETIF_VNET_GSO_NONE = 0,
+	NETIF_VNET_GSO_TCPV4 = 1,
+	NETIF_VNET_GSO_TCPV6 = 4,
 };
 
 struct etherpkt {
@@ -1052,6 +1173,26 @@ enum {
 	MaxEther = 32,
 	MaxFID = 16,
 	Ntypes = 8,
+	MaxEtherQueues = 16,
+	EtherRSSKeyLen = 40,		/* Toeplitz key, enough for IPv6 4-tuples */
+	EtherRSSTblLen = 128,		/* RSS indirection table entries */
+	EtherGROFlows = 8,			/* flows GRO can hold at once */
+};
+
+/* Adaptive interrupt moderation, for NICs with an interrupt throttle.  Drivers
+ * keep one per vector, count what each interrupt brings in, and reprogram the
+ * throttle when ether_itr_update() says so.  Rates are interrupts a second. */
+enum {
+	EtherItrLowest = 70000,		/* a trickle of small packets, e.g. RPCs */
+	EtherItrLow = 20000,
+	EtherItrBulk = 4000,		/* streams of full-sized packets */
+};
+
+struct ether_itr {
+	int class;
+	unsigned int rate;
+	unsigned int pkts;			/* since the last update */
+	unsigned int bytes;
 };
 
 struct ether {
@@ -1074,21 +1215,52 @@ struct ether {
 	long (*ctl) (struct ether *, void *, long);	/* custom ctl messages */
 	void (*power) (struct ether *, int);	/* power on/off */
 	void (*shutdown) (struct ether *);	/* shutdown hardware before reboot */
+	/* if set, does the receive interrupt's work for up to budget packets, on
+	 * the calling core.  Returns how many it passed to etheriq().  Called
+	 * from busy polling reads, so it shouldn't block. */
+	int (*poll) (struct ether *, int budget);
 	void *ctlr;
 	int pcmslot;				/* PCMCIA */
 	int fullduplex;				/* non-zero if full duplex */
 	int vlanid;					/* non-zero if vlan */
 
-	struct queue *oq;
+	struct queue *oq;			/* oqs[0] */
+
+	/* Multiqueue NICs set nr_queues (up to MaxEtherQueues) and transmit_q in
+	 * their reset.  transmit_q starts sending from oqs[qidx].  Each queue
+	 * should have its own ring and MSI-X vector, steered with
+	 * ether_steer_queue() to the core that should run that queue's input.
+	 * Outbound packets pick their queue with the Toeplitz hash of their flow,
+	 * through rss_tbl, so a flow stays in order.  rss_update, if set, pushes
+	 * rss_key and rss_tbl to the NIC's receive side scaling. */
+	int nr_queues;
+	struct queue *oqs[MaxEtherQueues];
+	void (*transmit_q)(struct ether *, int qidx);
+	void (*rss_update)(struct ether *);
+	uint8_t rss_key[EtherRSSKeyLen];
+	uint8_t rss_tbl[EtherRSSTblLen];
 
 	qlock_t vlq;				/* array change */
 	int nvlan;
 	struct ether *vlans[MaxFID];
 
+	/* GRO, for drivers that call etheriq_flush() after each receive batch */
+	spinlock_t gro_lock;
+	bool gro_on;
+	struct block *gro[EtherGROFlows];
+
 	struct netif;
 };
 
 extern struct block *etheriq(struct ether *, struct block *, int);
+extern void etheriq_flush(struct ether *);
+extern struct block *ether_busy_poll(struct chan *, int budget);
+extern struct queue *ether_chan_inq(struct chan *);
+extern uint32_t ether_rss_hash(struct ether *, struct block *);
+extern void ether_itr_init(struct ether_itr *);
+extern bool ether_itr_update(struct ether_itr *);
+extern int ether_queue_core(struct ether *, int qidx);
+extern int ether_steer_queue(struct ether *, int qidx, int apic_vec);
 extern void addethercard(char *unused_char_p_t, int (*)(struct ether *));
 extern int archether(int unused_int, struct ether *);
 
@@ -46,6 +46,16 @@ void gen_backtrace(void (*pfunc)(void *, const char *), void *opaque);
 /* Arch dependent, listed here for ease-of-use */
 static inline uintptr_t get_caller_pc(void);
 
+/* Generated by scripts/link-kernel.sh.  gbl_symtab_addrs[i] is
+ * gbl_symtab[i].addr, sorted. */
+extern struct symtab_entry gbl_symtab[];
+extern uintptr_t gbl_symtab_addrs[];
+extern size_t gbl_symtab_nr;
+
+/* Returns the name of the function containing pc, or NULL.  The name is in the
+ * symbol table, so don't free it.  This doesn't lock or allocate, so it is safe
+ * from IRQ and NMI context. */
+const char *lookup_fn_name(uintptr_t pc);
 /* Returns a null-terminated string with the function name for a given PC /
  * instruction pointer.  kfree() the result. */
 char *get_fn_name(uintptr_t pc);
@@ -15,12 +15,16 @@
 /* Every FS must extern it's type, and be included in vfs_init() */
 extern struct fs_type kfs_fs_type;
 
+struct kfs_cpio_ent;
+
 /* KFS-specific inode info.  Could use a union, but I want to init filestart to
- * 0 to catch bugs. */
+ * 0 to catch bugs.  With CONFIG_KFS_LAZY, a directory's CPIO entries wait in
+ * lazy_kids until someone looks inside it. */
 struct kfs_i_info {
 	struct dentry_tailq		children;		/* our childrens */
 	void					*filestart;		/* or our file location */
 	size_t					init_size;		/* file size on the backing store */
+	struct kfs_cpio_ent		*lazy_kids;		/* not built yet */
 };
 
 /* KFS VFS functions.  Exported for use by similar FSs (devices, for now) */
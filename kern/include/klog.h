@@ -0,0 +1,42 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * The kernel log: printk()'s per-core rings.
+ *
+ * printk() formats into its core's ring, without any locks, and leaves the
+ * console to the klog ktask, which prints every core's new records in sequence
+ * order every KLOG_FLUSH_USEC.  Until that ktask is running, and whenever we're
+ * in sync mode (panics and the monitor), printk() flushes the rings to the
+ * console itself before it returns.
+ *
+ * The rings overwrite.  If the console falls too far behind a core, its oldest
+ * records are lost, and the console says so.  #cons/klog has the messages that
+ * are still in the rings, merged in sequence order. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <kmalloc.h>
+#include <stdarg.h>
+
+#define KLOG_REC_SZ				128
+#define KLOG_REC_TEXT_SZ		(KLOG_REC_SZ - 24)
+
+struct klog_rec {
+	uint64_t					seq;		/* 0 while being written */
+	uint64_t					tsc;
+	uint16_t					coreid;
+	uint16_t					len;
+	uint32_t					flags;
+	char						text[KLOG_REC_TEXT_SZ];
+};
+
+void klog_init(void);
+/* Returns the number of chars logged, or -1 if the caller needs to print it
+ * straight to the console.  lock is whether we can take output_lock. */
+int klog_vprintf(bool lock, const char *fmt, va_list ap);
+void klog_flush(bool lock);
+void klog_sync_begin(void);
+void klog_sync_end(void);
+void klog_emergency(void);
+struct sized_alloc *klog_snapshot(void);
@@ -10,13 +10,21 @@
 #include <ros/common.h>
 #include <kref.h>
 
-#define NUM_KMALLOC_CACHES 13
+/* kmalloc's caches cover KMALLOC_NR_ORDERS powers of two, starting from
+ * KMALLOC_SMALLEST (sizes include the tag).  Each order (2^n, 2^(n+1)] is split
+ * into KMALLOC_STEPS_PER_ORDER size classes (1.25x, 1.5x, 1.75x, 2x), to cut
+ * down on internal fragmentation. */
+#define KMALLOC_NR_ORDERS 13
+#define KMALLOC_STEPS_SHIFT 2
+#define KMALLOC_STEPS_PER_ORDER (1 << KMALLOC_STEPS_SHIFT)
+#define NUM_KMALLOC_CACHES (1 + (KMALLOC_NR_ORDERS - 1) * KMALLOC_STEPS_PER_ORDER)
 #define KMALLOC_ALIGNMENT 16
 #define KMALLOC_SMALLEST (sizeof(struct kmalloc_tag) << 1)
-#define KMALLOC_LARGEST KMALLOC_SMALLEST << NUM_KMALLOC_CACHES
+#define KMALLOC_LARGEST KMALLOC_SMALLEST << KMALLOC_NR_ORDERS
 
 void kmalloc_init(void);
 void *kmalloc(size_t size, int flags);
+void *kmalloc_node(size_t size, int flags, int node);
 void *kmalloc_array(size_t nmemb, size_t size, int flags);
 void *kzmalloc(size_t size, int flags);
 void *kmalloc_align(size_t size, int flags, size_t align);
@@ -0,0 +1,25 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Compresses buffers into the frames of ros/kpz.h.  Big buffers are split up,
+ * and the pieces are deflated in parallel on idle cores, if we can get any. */
+
+#pragma once
+
+#include <ros/kpz.h>
+#include <kmalloc.h>
+
+#ifdef CONFIG_ZLIB_DEFLATE
+
+/* Returns len bytes of src as kpz frames, or 0 on failure.  This blocks, and
+ * src has to stay put until it returns.  Free with kfree. */
+struct sized_alloc *kpz_compress(const void *src, size_t len);
+
+#else
+
+static inline struct sized_alloc *kpz_compress(const void *src, size_t len)
+{
+	return 0;
+}
+
+#endif
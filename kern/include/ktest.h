@@ -61,3 +61,20 @@ extern char ktest_msg[1024];
 void register_ktest_suite(struct ktest_suite *suite);
 void run_ktest_suite(struct ktest_suite *suite);
 void run_registered_ktest_suites();
+
+/* Benchmarks.  fn does iters operations; with more than one core, idx says
+ * which participant we are.  Participant 0 runs on the caller's core, and
+ * participant i on the ith core after it.  Each run is timed on every core, and
+ * the run's cost is the slowest core's time divided by iters. */
+#define KTEST_BENCH_WARMUP		2		/* untimed runs */
+#define KTEST_BENCH_RUNS		10		/* timed runs */
+
+struct ktest_bench {
+	const char					*name;
+	void (*fn)(void *arg, unsigned int idx, unsigned long iters);
+	void						*arg;
+	unsigned long				iters;	/* per run, per core */
+};
+
+void ktest_bench_run(struct ktest_bench *kb, unsigned int nr_cores);
+void ktest_bench_scale(struct ktest_bench *kb);
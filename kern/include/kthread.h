@@ -25,6 +25,7 @@ TAILQ_HEAD(kthread_tailq, kthread);
 TAILQ_HEAD(semaphore_tailq, semaphore);
 
 #define GENBUF_SZ 128	/* plan9 uses this as a scratch space, per syscall */
+#define KTH_OFFCPU_MAX_PCS		16
 
 #define KTH_IS_KTASK			(1 << 0)
 #define KTH_SAVE_ADDR_SPACE		(1 << 1)
@@ -46,6 +47,10 @@ struct kthread {
 	char						*name;
 	char						generic_buf[GENBUF_SZ];
 	struct systrace_record		*strace;
+	/* Off-CPU profiling: where and when we blocked, if we're recording it */
+	size_t						offcpu_nr_pcs;
+	uint64_t					offcpu_start;
+	uintptr_t					offcpu_pcs[KTH_OFFCPU_MAX_PCS];
 };
 
 /* Semaphore for kthreads to sleep on.  0 or less means you need to sleep */
@@ -54,6 +59,14 @@ struct semaphore {
 	int 						nr_signals;
 	spinlock_t 					lock;
 	bool						irq_okay;
+	bool						adaptive;	/* binary, spins on a holder */
+	struct kthread				*owner;		/* only tracked if adaptive */
+	uint32_t					owner_core;
+	int							spin_avg;	/* polls it takes to get it */
+#ifdef CONFIG_LOCK_PROFILE
+	uintptr_t					lp_site;	/* only for adaptive */
+	uint64_t					lp_tsc;
+#endif
 #ifdef CONFIG_SEMAPHORE_DEBUG
 	TAILQ_ENTRY(semaphore)		link;
 	bool						is_on_list;	/* would like better sys/queue.h */
@@ -77,6 +90,15 @@ struct semaphore {
     .irq_okay   = TRUE,                                                        \
 }
 
+#define SEMAPHORE_INITIALIZER_ADAPTIVE(name, n)                                \
+{                                                                              \
+    .waiters    = TAILQ_HEAD_INITIALIZER((name).waiters),                      \
+	.nr_signals = (n),                                                         \
+    .lock       = SPINLOCK_INITIALIZER,                                        \
+    .irq_okay   = FALSE,                                                       \
+    .adaptive   = TRUE,                                                        \
+}
+
 struct cond_var {
 	struct semaphore			sem;
 	spinlock_t 					*lock;		/* usually points to internal_ */
@@ -105,6 +127,7 @@ void restart_kthread(struct kthread *kthread);
 void kthread_runnable(struct kthread *kthread);
 void kthread_yield(void);
 void kthread_usleep(uint64_t usec);
+void kthread_usleep_slack(uint64_t usec, uint64_t slack_usec);
 void ktask(char *name, void (*fn)(void*), void *arg);
 
 static inline bool is_ktask(struct kthread *kthread)
@@ -117,6 +140,7 @@ void check_poison(char *msg);
 
 void sem_init(struct semaphore *sem, int signals);
 void sem_init_irqsave(struct semaphore *sem, int signals);
+void sem_init_adaptive(struct semaphore *sem, int signals);
 bool sem_trydown(struct semaphore *sem);
 void sem_down(struct semaphore *sem);
 bool sem_up(struct semaphore *sem);
@@ -154,10 +178,11 @@ uintptr_t switch_to_ktask(void);
 void switch_back_from_ktask(uintptr_t old_ret);
 
 /* qlocks are plan9's binary sempahore, which are wrappers around our sems.
- * Not sure if they'll need irqsave or normal sems. */
+ * Not sure if they'll need irqsave or normal sems.  They are adaptive: a
+ * qlock() spins for a bit while the holder is running (CONFIG_SEM_ADAPTIVE). */
 typedef struct semaphore qlock_t;
-#define qlock_init(x) sem_init((x), 1)
+#define qlock_init(x) sem_init_adaptive((x), 1)
 #define qlock(x) sem_down(x)
 #define qunlock(x) sem_up(x)
 #define canqlock(x) sem_trydown(x)
-#define QLOCK_INITIALIZER(name) SEMAPHORE_INITIALIZER(name, 1)
+#define QLOCK_INITIALIZER(name) SEMAPHORE_INITIALIZER_ADAPTIVE(name, 1)
@@ -637,6 +637,12 @@ void *dma_pool_alloc(struct dma_pool *pool, int mem_flags, dma_addr_t *handle);
 
 void dma_pool_free(struct dma_pool *pool, void *vaddr, dma_addr_t addr);
 
+int dma_pool_alloc_bulk(struct dma_pool *pool, int mem_flags, void **vaddrs,
+                        dma_addr_t *handles, int nr);
+
+void dma_pool_free_bulk(struct dma_pool *pool, void **vaddrs,
+                        dma_addr_t *handles, int nr);
+
 #define pci_pool dma_pool
 #define pci_pool_create(name, pdev, size, align, allocation) \
 		dma_pool_create(name, pdev, size, align, allocation)
@@ -337,6 +337,10 @@ struct ib_uverbs_dealloc_mw {
 
 struct ib_uverbs_create_comp_channel {
 	__u64 response;
+	/* AKAROS: completions are sent to ev_q, with ev_type ev_id */
+	__u64 ev_q;
+	__u32 ev_id;
+	__u32 reserved;
 };
 
 struct ib_uverbs_create_comp_channel_resp {
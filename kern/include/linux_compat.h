@@ -25,6 +25,7 @@
 #include <taskqueue.h>
 #include <zlib.h>
 #include <list.h>
+#include <rcu.h>
 #include <linux/errno.h>
 /* temporary dumping ground */
 #include "compat_todo.h"
@@ -35,15 +36,6 @@
 //#define CONFIG_INET 1 	// will deal with this manually
 #define CONFIG_PCI_MSI 1
 
-#define __rcu
-#define rcu_read_lock()
-#define rcu_read_unlock()
-#define rcu_dereference(x) (x)
-#define rcu_dereference_protected(x, y) (x)
-#define rcu_assign_pointer(dst, src) (dst) = (src)
-#define RCU_INIT_POINTER(dst, src) rcu_assign_pointer(dst, src)
-#define synchronize_rcu()
-
 #define atomic_cmpxchg(_addr, _old, _new)                                      \
 ({                                                                             \
 	typeof(_old) _ret;                                                         \
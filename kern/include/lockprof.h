@@ -0,0 +1,36 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Lock contention profiling for spinlocks and blocking semaphore downs
+ * (qlocks), with CONFIG_LOCK_PROFILE.
+ *
+ * When enabled (#kprof/kplock or the monitor), each acquisition counts against
+ * its lock and call site in a per-core table: how often it was acquired, how
+ * often it had to wait, and the cycles spent waiting for and holding it.  Holds
+ * are charged to the site that locked, on the core that unlocked.  Only qlocks
+ * count blocking time; other semaphores are signals, not locks, and only their
+ * waits count.  The report merges the cores and sorts by wait time.
+ *
+ * Without CONFIG_LOCK_PROFILE, the locks are untouched, and the controls just
+ * complain. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <compiler.h>
+
+#define LOCKPROF_SPIN			0
+#define LOCKPROF_SEM			1
+#define LOCKPROF_NR_TYPES		2
+
+extern bool lockprof_enabled;
+
+void __lockprof_acquired(void *lock, uintptr_t site, int type, bool contended,
+                         uint64_t wait_cycles);
+void __lockprof_released(void *lock, uintptr_t site, int type,
+                         uint64_t hold_cycles);
+
+int lockprof_start(void);
+void lockprof_stop(void);
+char *lockprof_report(size_t *len);
+void print_lockprof_report(void);
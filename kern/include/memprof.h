@@ -0,0 +1,41 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Allocation-site profiling for kmalloc, the slab caches, and kernel pages.
+ *
+ * When enabled (#kprof/kpmem), every Nth allocation on each core records its
+ * backtrace and size.  Frees of sampled objects subtract from their site, so
+ * the report is of live memory, by site.  When disabled, the allocator hooks
+ * are a single predicted-not-taken branch. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <compiler.h>
+
+#define MEMPROF_KMALLOC			0
+#define MEMPROF_SLAB			1
+#define MEMPROF_PAGE			2
+#define MEMPROF_NR_TYPES		3
+
+extern bool memprof_enabled;
+
+void __memprof_alloc(void *addr, size_t size, int type);
+void __memprof_free(void *addr);
+
+static inline void memprof_alloc(void *addr, size_t size, int type)
+{
+	if (unlikely(memprof_enabled))
+		__memprof_alloc(addr, size, type);
+}
+
+static inline void memprof_free(void *addr)
+{
+	if (unlikely(memprof_enabled))
+		__memprof_free(addr);
+}
+
+void memprof_start(unsigned int rate);
+void memprof_stop(void);
+char *memprof_report(size_t *len);
+void print_memprof_report(void);
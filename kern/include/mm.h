@@ -48,6 +48,9 @@ struct vm_region *find_vmr(struct proc *p, uintptr_t va);
 struct vm_region *find_first_vmr(struct proc *p, uintptr_t va);
 void isolate_vmrs(struct proc *p, uintptr_t va, size_t len);
 void unmap_and_destroy_vmrs(struct proc *p);
+extern atomic_t nr_pending_free_pages;
+void vmrs_pending_free(struct proc *p);
+void teardown_vmrs(struct proc *p);
 int duplicate_vmrs(struct proc *p, struct proc *new_p);
 void print_vmrs(struct proc *p);
 void enumerate_vmrs(struct proc *p,
@@ -59,21 +62,47 @@ void enumerate_vmrs(struct proc *p,
  * be a dynamic proc-specific variable later. */
 #define MMAP_LOWEST_VA PAGE_SIZE
 #define MMAP_LD_FIXED_VA 0x100000
+extern unsigned int fault_around_pgs;
 void *mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
            int fd, size_t offset);
 void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
               struct file *f, size_t offset);
 int mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
 int munmap(struct proc *p, uintptr_t addr, size_t len);
+int madvise(struct proc *p, uintptr_t addr, size_t len, int advice);
 int handle_page_fault(struct proc *p, uintptr_t va, int prot);
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot);
 unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs);
 
+/* Zero-copy reads swap whole pages into the user's buffer instead of copying.
+ * The user's old pages wait here until one TLB shootdown covers the lot. */
+#define PAGE_SWAP_BATCH 32
+
+struct page;
+struct page_swap {
+	struct proc					*p;
+	uintptr_t					start;
+	uintptr_t					end;		/* 0 if we swapped nothing */
+	unsigned int				nr_old;
+	struct page					*old[PAGE_SWAP_BATCH];
+};
+
+static inline void page_swap_init(struct page_swap *ps, struct proc *p)
+{
+	ps->p = p;
+	ps->start = ps->end = 0;
+	ps->nr_old = 0;
+}
+
+int page_swap_add(struct page_swap *ps, uintptr_t va, struct page *page);
+void page_swap_finish(struct page_swap *ps);
+
 /* These assume the mm_lock is held already */
 int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
 int __do_munmap(struct proc *p, uintptr_t addr, size_t len);
 
 /* Kernel Dynamic Memory Mappings */
+void vmap_init(void);
 /* These two are just about reserving VA space */
 uintptr_t get_vmap_segment(unsigned long num_pages);
 uintptr_t put_vmap_segment(uintptr_t vaddr, unsigned long num_pages);
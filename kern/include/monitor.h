@@ -43,3 +43,5 @@ int mon_kpfret(int argc, char **argv, struct hw_trapframe *hw_tf);
 int mon_ks(int argc, char **argv, struct hw_trapframe *hw_tf);
 int mon_gfp(int argc, char **argv, struct hw_trapframe *hw_tf);
 int mon_coreinfo(int argc, char **argv, struct hw_trapframe *hw_tf);
+int mon_memprof(int argc, char **argv, struct hw_trapframe *hw_tf);
+int mon_lockprof(int argc, char **argv, struct hw_trapframe *hw_tf);
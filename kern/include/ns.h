@@ -36,6 +36,7 @@
 #include <fdtap.h>
 #include <ros/fs.h>
 #include <vfs.h>
+#include <rcu.h>
 
 /*
  * functions (possibly) linked in, complete, from libc.
@@ -367,11 +368,15 @@ enum {
 };
 #define BCKSUM_FLAGS (Bipck|Budpck|Btcpck|Bpktck|Btso)
 
+/* Extra data buffers are kmalloc'd and refcounted with kmalloc_incref(), unless
+ * page is set: then base is page's KVA (e.g. a page cache page), and we hold a
+ * page ref.  Use block_extra_incref() and block_extra_release(). */
 struct extra_bdata {
 	uintptr_t base;
 	/* using u32s for packing reasons.  this means no extras > 4GB */
 	uint32_t off;
 	uint32_t len;
+	struct page *page;
 };
 
 struct block {
@@ -441,6 +446,17 @@ struct cname {
 	char *s;
 };
 
+/* read, write, bread and bwrite can run concurrently on the same chan, e.g.
+ * when several threads pread() and pwrite() one FD.  Nothing above the device
+ * serializes them, so a device should:
+ * - Use the offset it's given.  c->offset belongs to sysfile.c, which only
+ *   moves it for read() and write(), never for pread() and pwrite().
+ * - Keep per-request state on the stack or in a per-request allocation, not in
+ *   the chan or device, and only lock what the requests really share.
+ * Concurrent I/O to overlapping ranges finishes in some order, but each request
+ * should see either all or none of another's data for a given byte.  Devices
+ * that can't run requests in parallel, e.g. because their protocol is
+ * stateful, serialize them internally. */
 struct dev {
 	char *name;
 
@@ -454,9 +470,9 @@ struct dev {
 	void (*create) (struct chan *, char *, int, uint32_t);
 	void (*close) (struct chan *);
 	long (*read) (struct chan *, void *, long, int64_t);
-	struct block *(*bread) (struct chan *, long, uint32_t);
+	struct block *(*bread) (struct chan *, long, int64_t);
 	long (*write) (struct chan *, void *, long, int64_t);
-	long (*bwrite) (struct chan *, struct block *, uint32_t);
+	long (*bwrite) (struct chan *, struct block *, int64_t);
 	void (*remove) (struct chan *);
 	int (*wstat) (struct chan *, uint8_t * unused_uint8_p_t, int);
 	void (*power) (int);		/* power mgt: power(1) → on, power (0) → off */
@@ -510,6 +526,7 @@ struct mhead {
 	struct chan *from;			/* channel mounted upon */
 	struct mount *mount;		/* what's mounted upon it */
 	struct mhead *hash;			/* Hash chain */
+	struct rcu_head rcu;
 };
 
 struct mnt {
@@ -531,6 +548,7 @@ enum {
 	RENDHASH = 1 << RENDLOG,	/* Hash to lookup rendezvous tags */
 	MNTLOG = 5,
 	MNTHASH = 1 << MNTLOG,	/* Hash to walk mount table */
+	WALKCACHE_HASH = 32,	/* Hash for a pgrp's cached walks */
 	DELTAFD = 20,	/* allocation quantum for process file descriptors */
 	MAXNFD = 4000,	/* max per process file descriptors */
 	MAXKEY = 8,	/* keys for signed modules */
@@ -551,6 +569,10 @@ struct pgrp {
 	struct rwlock ns;			/* Namespace n read/one write lock */
 	qlock_t nsh;
 	struct mhead *mnthash[MNTHASH];
+	atomic_t mntgen;			/* bumped after every mount change */
+	spinlock_t wc_lock;			/* protects the walk cache */
+	struct walkcache_entry *walkcache[WALKCACHE_HASH];
+	int nr_walkcache;
 	int progmode;
 	struct chan *dot;
 	struct chan *slash;
@@ -634,6 +656,7 @@ enum {
 	Qcoalesce = (1 << 4),	/* coalesce empty packets on read */
 	Qkick = (1 << 5),	/* always call the kick routine after qwrite */
 	Qdropoverflow = (1 << 6),	/* writes that would block will be dropped */
+	Qspsc = (1 << 7),	/* one producer and one consumer, mostly lockless */
 };
 
 #define DEVDOTDOT -1
@@ -650,9 +673,15 @@ void addprog(struct proc *);
 void addrootfile(char *unused_char_p_t, uint8_t * unused_uint8_p_t, uint32_t);
 struct block *adjustblock(struct block *, int);
 struct block *block_alloc(size_t, int);
+int block_alloc_bulk(size_t size, int mem_flags, struct block **blocks,
+                     int nr);
 int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags);
 int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
                        uint32_t len, int mem_flags);
+int block_append_page(struct block *b, struct page *page, uint32_t off,
+                      uint32_t len, int mem_flags);
+void block_extra_incref(struct extra_bdata *ebd);
+void block_extra_release(struct extra_bdata *ebd);
 int anyhigher(void);
 int anyready(void);
 void _assert(char *unused_char_p_t);
@@ -669,6 +698,7 @@ void chanrec(struct mnt *);
 void checkalarms(void);
 void checkb(struct block *, char *unused_char_p_t);
 void cinit(void);
+unsigned long cevict(unsigned long nr_wanted);
 struct chan *cclone(struct chan *);
 void cclose(struct chan *);
 void closeegrp(struct egrp *);
@@ -685,7 +715,11 @@ void confinit(void);
 void cons_add_char(char c);
 void copen(struct chan *);
 struct block *copyblock(struct block *b, int mem_flags);
+struct block *copyblock_n(struct block *b, size_t len, int mem_flags);
 int cread(struct chan *, uint8_t * unused_uint8_p_t, int unused_int, int64_t);
+int cstat(struct chan *c, uint8_t *dp, int n);
+void cstatupdate(struct chan *c, uint8_t *dp, int n);
+void cstatinval(struct chan *c);
 struct chan *cunique(struct chan *);
 struct chan *createdir(struct chan *, struct mhead *);
 void cunmount(struct chan *, struct chan *);
@@ -697,8 +731,8 @@ int cursoron(int);
 void cursoroff(int);
 void cwrite(struct chan *, uint8_t * unused_uint8_p_t, int unused_int, int64_t);
 struct chan *devattach(const char *name, char *spec);
-struct block *devbread(struct chan *, long, uint32_t);
-long devbwrite(struct chan *, struct block *, uint32_t);
+struct block *devbread(struct chan *, long, int64_t);
+long devbwrite(struct chan *, struct block *, int64_t);
 struct chan *devclone(struct chan *);
 void devcreate(struct chan *, char *name, int mode, uint32_t perm);
 void devdir(struct chan *, struct qid, char *, int64_t, char *, long,
@@ -731,7 +765,9 @@ void drawcmap(void);
 void dumpstack(void);
 void egrpcpy(struct egrp *, struct egrp *);
 int emptystr(char *unused_char_p_t);
+int isdotdot(char *p);
 int eqchan(struct chan *, struct chan *, int);
+int eqchantdqid(struct chan *, int, int, struct qid, int);
 int eqqid(struct qid, struct qid);
 
 void errstr(char *unused_char_p_t, int);
@@ -901,6 +937,13 @@ uint32_t userpc(void);
 void validname(char *, int);
 void validwstatname(char *);
 int walk(struct chan **, char **unused_char_pp_t, int unused_int, bool, int *);
+uint64_t walkcache_gen(void);
+struct chan *walkcache_lookup(struct chan *from, char **names, int nnames,
+                              bool can_mount);
+void walkcache_insert(struct chan *from, char **names, int nnames,
+                      bool can_mount, struct chan *c, uint64_t gen);
+void walkcache_fs_changed(void);
+void walkcache_free(struct pgrp *pg);
 void *xalloc(uint32_t);
 void *xallocz(uint32_t, int);
 void xfree(void *);
@@ -965,6 +1008,8 @@ long unionread(struct chan *c, void *va, long n);
 void read_exactly_n(struct chan *c, void *vp, long n);
 long sysread(int fd, void *va, long n);
 long syspread(int fd, void *va, long n, int64_t off);
+long sysreadv(int fd, const struct iovec *iov, int iovcnt);
+long syspreadv(int fd, const struct iovec *iov, int iovcnt, int64_t off);
 int sysremove(char *path);
 int64_t sysseek(int fd, int64_t off, int whence);
 void validstat(uint8_t * s, int n, int slashok);
@@ -972,6 +1017,10 @@ int sysstat(char *path, uint8_t*, int n);
 int sysstatakaros(char *path, struct kstat *);
 long syswrite(int fd, void *va, long n);
 long syspwrite(int fd, void *va, long n, int64_t off);
+long syswritev(int fd, const struct iovec *iov, int iovcnt);
+long syspwritev(int fd, const struct iovec *iov, int iovcnt, int64_t off);
+long syssendfile(int fd, struct file *file, int64_t *offp, long n);
+long syssplice(int fd_in, int fd_out, long n);
 int syswstat(char *path, uint8_t * buf, int n);
 struct dir *chandirstat(struct chan *c);
 struct dir *sysdirstat(char *name);
@@ -33,6 +33,9 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
 #define PG_PAGEMAP		0x010	/* belongs to a page map */
 #define PG_REMOVAL		0x020	/* Working flag for page map removal */
+#define PG_WRITEBACK	0x040	/* on a block device's writeback list */
+#define PG_ACTIVE		0x080	/* on its page map's active LRU */
+#define PG_REFERENCED	0x100	/* page map, used since the last aging */
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -46,23 +49,51 @@ struct page {
 	struct page_map				*pg_mapping; /* for debugging... */
 	unsigned long				pg_index;
 	void						**pg_tree_slot;
+	TAILQ_ENTRY(page)			pg_lru_link;	/* page map's LRU */
 	void						*pg_private;	/* type depends on page usage */
 	struct semaphore 			pg_sem;		/* for blocking on IO */
 	uint64_t				gpa;		/* physical address in guest */
 								/* pg_private is overloaded. */
 };
 
+/* NUMA memory node limits */
+#define MAX_MEM_NODES			16
+#define MAX_MEM_NODE_RANGES		64
+
 /******** Externally visible global variables ************/
 extern uint8_t* global_cache_colors_map;
 extern spinlock_t colored_page_free_list_lock;
 extern page_list_t *colored_page_free_list;
+extern size_t nr_free_pages_low;
+extern size_t nr_free_pages_high;
+extern int nr_mem_nodes;
+extern size_t nr_free_pages_node[MAX_MEM_NODES];
+extern unsigned int pcp_high;
+extern unsigned int pcp_batch;
+extern unsigned int zero_pool_high;
+extern unsigned int zero_pool_batch;
 
 /*************** Functional Interface *******************/
 void page_alloc_init(struct multiboot_info *mbi);
 void colored_page_alloc_init(void);
+void page_reclaim_init(void);
+void page_numa_init(void);
+int arch_mem_node_init(void);
+void page_numa_add_range(physaddr_t start, physaddr_t end, int node);
+void page_numa_set_core_node(int coreid, int node);
+int pa_to_mem_node(physaddr_t pa);
+int local_mem_node(void);
+void page_pcp_drain_all(void);
+void print_page_pcp_info(void);
+bool page_zero_idle(void);
+void page_zero_pool_drain_all(void);
+void print_page_zero_pool_info(void);
 
 error_t upage_alloc(struct proc* p, page_t **page, int zero);
+size_t upage_alloc_bulk(struct proc *p, struct page **pages, size_t nr,
+                        int zero);
 error_t kpage_alloc(page_t **page);
+error_t kpage_alloc_node(page_t **page, int node);
 void *kpage_alloc_addr(void);
 void *kpage_zalloc_addr(void);
 error_t upage_alloc_specific(struct proc* p, page_t **page, size_t ppn);
@@ -71,6 +102,7 @@ error_t kpage_alloc_specific(page_t **page, size_t ppn);
 void *get_cont_pages(size_t order, int flags);
 void *get_cont_pages_node(int node, size_t order, int flags);
 void *get_cont_phys_pages_at(size_t order, physaddr_t at, int flags);
+void *get_aligned_cont_pages(size_t order, int flags);
 void free_cont_pages(void *buf, size_t order);
 
 void page_incref(page_t *page);
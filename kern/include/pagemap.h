@@ -18,8 +18,11 @@ struct page;
 struct inode;
 struct block_device;
 struct chan;
+struct kref;
 struct page_map_operations;
 
+TAILQ_HEAD(pm_lru_list, page);
+
 /* Every object that has pages, like an inode or the swap (or even direct block
  * devices) has a page_map, tracking which of its pages are currently in memory.
  * It is a map, per object, from index to physical page frame. */
@@ -35,6 +38,9 @@ struct page_map {
 	spinlock_t					pm_lock;
 	struct vmr_tailq			pm_vmrs;
 	atomic_t					pm_removal;
+	struct pm_lru_list			pm_active;		/* most recent at the head */
+	struct pm_lru_list			pm_inactive;
+	unsigned long				pm_nr_active;
 };
 
 /* Operations performed on a page_map.  These are usually FS specific, which
@@ -43,8 +49,9 @@ struct page_map {
 struct page_map_operations {
 	int (*readpage) (struct page_map *, struct page *);
 	int (*writepage) (struct page_map *, struct page *);
-/*	readpages: read a list of pages
-	writepage: write from a page to its backing store
+	/* Optional, like readpage for each page, but in one go */
+	int (*readpages) (struct page_map *, struct page **, unsigned int);
+/*	writepage: write from a page to its backing store
 	writepages: write a list of pages
 	sync_page: start the IO of already scheduled ops
 	set_page_dirty: mark the given page dirty
@@ -56,14 +63,35 @@ struct page_map_operations {
 	direct_io: bypass the page cache */
 };
 
+/* Readahead window bounds, in pages */
+#define PM_RA_MIN_PGS				4
+#define PM_RA_MAX_PGS				32
+
+/* Per-file readahead state, for pm_readahead_seq().  The window doubles while
+ * reads are sequential and halves when they aren't, down to nothing.  Unlocked;
+ * concurrent readers of one file just make the guesses worse. */
+struct pm_ra_state {
+	unsigned long				ra_last;	/* last index read */
+	unsigned long				ra_end;		/* end of the last readahead */
+	unsigned int				ra_size;	/* window, in pages */
+};
+
 /* Page cache functions */
 void pm_init(struct page_map *pm, struct page_map_operations *op, void *host);
 int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
 void pm_put_page(struct page *page);
+unsigned int pm_readahead(struct page_map *pm, unsigned long index,
+                          unsigned int nr, struct kref *owner);
+void pm_readahead_seq(struct page_map *pm, struct pm_ra_state *ra,
+                      unsigned long first, unsigned long last,
+                      unsigned long nr_pgs, struct kref *owner);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 int pm_remove_contig(struct page_map *pm, unsigned long index,
                      unsigned long nr_pgs);
+int pm_remove_clean_contig(struct page_map *pm, unsigned long index,
+                           unsigned long nr_pgs);
+unsigned long pm_shrink(struct page_map *pm, unsigned long nr_wanted);
 void print_page_map_info(struct page_map *pm);
@@ -0,0 +1,57 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Per-core statistics counters.  Each core bumps its own copy with a plain add,
+ * so hot paths don't bounce a shared cache line, and readers sum the copies.
+ * Sums taken while cores are bumping are approximate.  The add isn't atomic
+ * against the core's own IRQ handlers, so a counter bumped from both IRQ and
+ * regular context can lose the odd count.
+ *
+ * Define a counter once, and declare it anywhere else that bumps it:
+ *
+ * 		DEFINE_PCPU_COUNTER(page_faults);
+ * 		DECLARE_PCPU_COUNTER(page_faults);
+ *
+ * 		pcpu_counter_inc(page_faults);
+ * 		pcpu_counter_add(page_faults, nr);
+ *
+ * The linker gathers the counters into one table (linker_tables.ld), which
+ * #stats exports.  The names are global symbols, so they must be unique. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <percpu.h>
+
+/* sizeof must match the alignment, so the table is a plain array. */
+struct pcpu_counter {
+	const char					*name;
+	uint64_t					*pcpu;		/* the PERCPU var */
+} __attribute__((aligned(16)));
+
+#define __pcpu_counters __attribute__((__section__(".pcpu_counters"), used))
+
+extern struct pcpu_counter __pcpu_countersstart[];
+extern struct pcpu_counter __pcpu_countersend[];
+
+#define DEFINE_PCPU_COUNTER(_name)                                             \
+	DEFINE_PERCPU(uint64_t, __pcpu_ctr_##_name);                               \
+	static struct pcpu_counter __pcpu_counters __pcpu_ctr_ent_##_name = {      \
+		.name = #_name,                                                        \
+		.pcpu = &PERCPU_VARNAME(__pcpu_ctr_##_name),                           \
+	}
+
+#define DECLARE_PCPU_COUNTER(_name)                                            \
+	DECLARE_PERCPU(uint64_t, __pcpu_ctr_##_name)
+
+#define pcpu_counter_add(_name, _n)                                            \
+	(PERCPU_VAR(__pcpu_ctr_##_name) += (_n))
+
+#define pcpu_counter_inc(_name) pcpu_counter_add(_name, 1)
+
+struct sized_alloc;
+
+uint64_t pcpu_counter_sum(struct pcpu_counter *ctr);
+struct pcpu_counter *pcpu_counter_lookup(const char *name);
+void pcpu_counter_reset(void);
+struct sized_alloc *pcpu_counter_list(void);
@@ -91,15 +91,33 @@ void	page_decref(page_t *pp);
 
 void	tlb_invalidate(pgdir_t pgdir, void *ga);
 void tlb_flush_global(void);
+
+/* Past this many pages, flushing the whole TLB is cheaper than invlpgs */
+#define TLB_FLUSH_RANGE_MAX_PGS		32
+
+/* Flushes our TLB entries for [start, end), or everything if end <= start. */
+static inline void tlb_flush_range(uintptr_t start, uintptr_t end)
+{
+	if ((end <= start) || (end - start > TLB_FLUSH_RANGE_MAX_PGS * PGSIZE)) {
+		tlbflush();
+		return;
+	}
+	for (uintptr_t va = ROUNDDOWN(start, PGSIZE); va < end; va += PGSIZE)
+		invlpg((void*)va);
+}
 bool regions_collide_unsafe(uintptr_t start1, uintptr_t end1,
                             uintptr_t start2, uintptr_t end2);
 
 /* Arch specific implementations for these */
 pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create);
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int create);
+size_t pgdir_walk_range(pgdir_t pgdir, const void *va, size_t nr,
+                        pte_t *ptes);
 int get_va_perms(pgdir_t pgdir, const void *va);
 int arch_pgdir_setup(pgdir_t boot_copy, pgdir_t *new_pd);
 physaddr_t arch_pgdir_get_cr3(pgdir_t pd);
 void arch_pgdir_clear(pgdir_t *pd);
+void arch_pgdir_load(struct proc *p);
 int arch_max_jumbo_page_shift(void);
 
 static inline page_t *ppn2page(size_t ppn)
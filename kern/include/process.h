@@ -12,6 +12,7 @@
 #include <trap.h>
 #include <atomic.h>
 #include <kref.h>
+#include <chash.h>
 #include <schedule.h>
 
 /* Process States.  Not 100% on the names yet.  RUNNABLE_* are waiting to go to
@@ -73,9 +74,8 @@ struct process_set {
 	struct proc **procs;
 };
 
-/* Can use a htable iterator to iterate through all active procs */
-extern struct hashtable *pid_hash;
-extern spinlock_t pid_hash_lock;
+/* Use chash_for_each() to iterate through all active procs */
+extern struct chash pid_hash;
 
 /* Initialization */
 void proc_init(void);
@@ -145,6 +145,8 @@ void __unmap_vcore(struct proc *p, uint32_t vcoreid);
 void vcore_account_online(struct proc *p, uint32_t vcoreid);
 void vcore_account_offline(struct proc *p, uint32_t vcoreid);
 uint64_t vcore_account_gettotal(struct proc *p, uint32_t vcoreid);
+struct vcore_counters *proc_vc_stats(struct proc *p);
+struct sized_alloc *proc_stats_report(struct proc *p);
 
 /* Preemption management.  Some of these will change */
 void __proc_preempt_warn(struct proc *p, uint32_t vcoreid, uint64_t when);
@@ -152,6 +154,7 @@ void __proc_preempt_warnall(struct proc *p, uint64_t when);
 void __proc_preempt_core(struct proc *p, uint32_t pcoreid);
 uint32_t __proc_preempt_all(struct proc *p, uint32_t *pc_arr);
 bool proc_preempt_core(struct proc *p, uint32_t pcoreid, uint64_t usec);
+void proc_preempt_warn_core(struct proc *p, uint32_t pcoreid, uint64_t when);
 void proc_preempt_all(struct proc *p, uint64_t usec);
 
 /* Current / cr3 / context management */
@@ -160,6 +163,7 @@ void switch_back(struct proc *new_p, uintptr_t old_ret);
 void abandon_core(void);
 void clear_owning_proc(uint32_t coreid);
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end);
+void proc_load_pgdir(struct proc *p);
 
 /* Kernel message handlers for process management */
 void __startcore(uint32_t srcid, long a0, long a1, long a2);
@@ -13,6 +13,9 @@ struct proc;
 struct file;
 struct cmdbuf;
 
+/* sem_down() records where kthreads block while this is set */
+extern bool profiler_offcpu_tracing;
+
 int profiler_configure(struct cmdbuf *cb);
 void profiler_append_configure_usage(char *msgbuf, size_t buflen);
 void profiler_init(void);
@@ -24,7 +27,13 @@ void profiler_push_kernel_backtrace(uintptr_t *pc_list, size_t nr_pcs,
                                     uint64_t info);
 void profiler_push_user_backtrace(uintptr_t *pc_list, size_t nr_pcs,
                                   uint64_t info);
+void profiler_push_offcpu_backtrace(uintptr_t *pc_list, size_t nr_pcs,
+                                    uint64_t start);
 void profiler_trace_data_flush(void);
+char *profiler_encode_kernel_trace64(char *ptr, const uintptr_t *trace,
+                                     size_t count, uint64_t info, uint32_t pid,
+                                     uint16_t cpu);
+size_t profiler_kernel_trace64_size(size_t count);
 int profiler_size(void);
 int profiler_read(void *va, int n);
 void profiler_notify_mmap(struct proc *p, uintptr_t addr, size_t size, int prot,
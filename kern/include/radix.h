@@ -14,7 +14,13 @@
  *
  * You can also store a tag along with the void* for a given item, and do
  * lookups based on those tags.  Or you will be able to, once it is
- * implemented. */
+ * implemented.
+ *
+ * Writers (insert, delete) need to be serialized by the caller.  Lookups can
+ * run concurrently with a writer, under rcu_read_lock(): nodes are initialized
+ * before they are linked in, and are freed with call_rcu().  A lockless lookup
+ * might miss an item that is being inserted, and a slot it returns is only
+ * good until rcu_read_unlock(). */
 
 #pragma once
 
@@ -22,13 +28,16 @@
 #define NR_RNODE_SLOTS (1 << LOG_RNODE_SLOTS)
 
 #include <ros/common.h>
+#include <rcu.h>
 
 struct radix_node {
 	void						*items[NR_RNODE_SLOTS];
 	unsigned int				num_items;
+	unsigned int				height;		/* levels, including this one */
 	bool						leaf;
 	struct radix_node			*parent;
 	struct radix_node			**my_slot;
+	struct rcu_head				rcu;
 };
 
 /* Defines the whole tree. */
@@ -51,6 +60,8 @@ void *radix_lookup(struct radix_tree *tree, unsigned long key);
 void **radix_lookup_slot(struct radix_tree *tree, unsigned long key);
 int radix_gang_lookup(struct radix_tree *tree, void **results,
                       unsigned long first, unsigned int max_items);
+unsigned int radix_gang_insert(struct radix_tree *tree, unsigned long first,
+                               void **items, unsigned int nr, void ***slots);
 
 /* Memory management */
 int radix_grow(struct radix_tree *tree, unsigned long max);
@@ -0,0 +1,16 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * The ChaCha20 block function, for the kernel's CSPRNGs.  This is Bernstein's
+ * original layout, with a 64 bit block counter and a 64 bit nonce. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define CHACHA20_KEY_SZ			32
+#define CHACHA20_BLOCK_SZ		64
+
+/* Writes the keystream block for counter and nonce to out. */
+void chacha20_block(const uint32_t key[CHACHA20_KEY_SZ / 4], uint64_t counter,
+                    uint64_t nonce, uint8_t out[CHACHA20_BLOCK_SZ]);
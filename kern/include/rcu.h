@@ -0,0 +1,68 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Read-copy-update, for read-mostly structures.
+ *
+ * Readers wrap their accesses in rcu_read_lock() and rcu_read_unlock(), and
+ * must not block in between.  Writers still exclude each other with their own
+ * lock, publish with rcu_assign_pointer(), and free whatever they unlinked with
+ * call_rcu() (or wait for the readers with synchronize_rcu()).
+ *
+ * A grace period ends once every core has passed through a quiescent state.
+ * The kernel isn't preemptive, and routine kmsgs only run when a core has no
+ * other kernel context in progress, so process_routine_kmsg() is a quiescent
+ * state.  smp_idle() and the return to userspace both go through it.  If a
+ * core doesn't get there on its own for a while, say because it is halted or
+ * running a process, we send it an empty RKM.
+ *
+ * Only one grace period runs at a time.  Callbacks that arrive during one wait
+ * for the next, which starts as soon as the current one ends.  Callbacks run
+ * from an RKM, so they may block. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <sys/queue.h>
+#include <atomic.h>
+
+struct rcu_head {
+	STAILQ_ENTRY(rcu_head)		link;
+	void (*func)(struct rcu_head *head);
+};
+STAILQ_HEAD(rcu_head_list, rcu_head);
+
+#define __rcu
+
+/* Readers don't do anything, other than keep the compiler from moving their
+ * loads out of the critical section. */
+#define rcu_read_lock() cmb()
+#define rcu_read_unlock() cmb()
+
+#define rcu_dereference(p)                                                     \
+({                                                                             \
+	typeof(p) __rcu_p = ACCESS_ONCE(p);                                        \
+	cmb();                                                                     \
+	__rcu_p;                                                                   \
+})
+#define rcu_dereference_protected(p, c) (p)
+
+/* The writes initializing the new object must be visible before the pointer */
+#define rcu_assign_pointer(p, v)                                               \
+do {                                                                           \
+	wmb();                                                                     \
+	ACCESS_ONCE(p) = (v);                                                      \
+} while (0)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+
+/* Like Linux, kfree_rcu() passes the offset of the rcu_head in place of a
+ * callback.  No real function lives in the first page. */
+#define RCU_KFREE_MAX_OFFSET	4096
+#define kfree_rcu(ptr, field)                                                  \
+	call_rcu(&(ptr)->field,                                                    \
+	         (void (*)(struct rcu_head *))offsetof(typeof(*(ptr)), field))
+
+void rcu_init(void);
+void rcu_note_qs(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void synchronize_rcu(void);
+void print_rcu_info(void);
@@ -13,6 +13,8 @@
  * 		rendez_sleep(&rv, some_func_taking_void*, void *arg);
  * 			or
  * 		rendez_sleep_timeout(&rv, some_func_taking_void*, void *arg, usec);
+ * 			or, if the timeout can be a little late (see alarm.h)
+ * 		rendez_sleep_timeout_slack(&rv, func, arg, usec, slack_usec);
  *
  * Waker usage: (can be used from IRQ context)
  * 		// set the condition to TRUE, then:
@@ -48,4 +50,6 @@ void rendez_init(struct rendez *rv);
 void rendez_sleep(struct rendez *rv, int (*cond)(void*), void *arg);
 void rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
                           uint64_t usec);
+void rendez_sleep_timeout_slack(struct rendez *rv, int (*cond)(void*),
+                                void *arg, uint64_t usec, uint64_t slack_usec);
 bool rendez_wakeup(struct rendez *rv);
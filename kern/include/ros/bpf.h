@@ -0,0 +1,89 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Packet filters for #ether: classic BPF programs, run by the kernel on each
+ * frame before it copies the frame out to a conversation.
+ *
+ * Write "filter NR_INSNS CODE JT JF K [CODE JT JF K ...]" to a conversation's
+ * ctl to attach a program, replacing any old one, and "filter off" to remove
+ * it.  That's the format tcpdump -ddd prints, with newlines allowed between
+ * the numbers.  A program returns how many bytes of the frame to keep: 0 drops
+ * the frame, and anything less than its length truncates it, both for the data
+ * file and for a capring.  Loads past the end of the frame drop it.
+ *
+ * Programs are checked when they're attached: jumps only go forward, the last
+ * instruction is a RET, and there's no BPF extensions (ancillary loads). */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define BPF_MAXINSNS				4096
+#define BPF_MEMWORDS				16
+
+struct bpf_insn {
+	uint16_t					code;
+	uint8_t						jt;
+	uint8_t						jf;
+	uint32_t					k;
+};
+
+/* Instruction classes */
+#define BPF_CLASS(code)				((code) & 0x07)
+#define BPF_LD						0x00
+#define BPF_LDX						0x01
+#define BPF_ST						0x02
+#define BPF_STX						0x03
+#define BPF_ALU						0x04
+#define BPF_JMP						0x05
+#define BPF_RET						0x06
+#define BPF_MISC					0x07
+
+/* ld/ldx fields */
+#define BPF_SIZE(code)				((code) & 0x18)
+#define BPF_W						0x00
+#define BPF_H						0x08
+#define BPF_B						0x10
+#define BPF_MODE(code)				((code) & 0xe0)
+#define BPF_IMM						0x00
+#define BPF_ABS						0x20
+#define BPF_IND						0x40
+#define BPF_MEM						0x60
+#define BPF_LEN						0x80
+#define BPF_MSH						0xa0
+
+/* alu/jmp fields */
+#define BPF_OP(code)				((code) & 0xf0)
+#define BPF_ADD						0x00
+#define BPF_SUB						0x10
+#define BPF_MUL						0x20
+#define BPF_DIV						0x30
+#define BPF_OR						0x40
+#define BPF_AND						0x50
+#define BPF_LSH						0x60
+#define BPF_RSH						0x70
+#define BPF_NEG						0x80
+#define BPF_MOD						0x90
+#define BPF_XOR						0xa0
+
+#define BPF_JA						0x00
+#define BPF_JEQ						0x10
+#define BPF_JGT						0x20
+#define BPF_JGE						0x30
+#define BPF_JSET					0x40
+
+#define BPF_SRC(code)				((code) & 0x08)
+#define BPF_K						0x00
+#define BPF_X						0x08
+
+/* ret - BPF_K also applies */
+#define BPF_RVAL(code)				((code) & 0x18)
+#define BPF_A						0x10
+
+/* misc */
+#define BPF_MISCOP(code)			((code) & 0xf8)
+#define BPF_TAX						0x00
+#define BPF_TXA						0x80
+
+#define BPF_STMT(code, k)			{ (uint16_t)(code), 0, 0, k }
+#define BPF_JUMP(code, k, jt, jf)	{ (uint16_t)(code), jt, jf, k }
@@ -0,0 +1,50 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Memory-mapped packet capture rings for #ether.
+ *
+ * Writing "capring NR_FRAMES SNAPLEN [EV_Q EV_ID BATCH]" to a conversation's
+ * ctl maps a ring into the writer and sends the conversation's frames there
+ * instead of to its data file.  EV_Q is the hex address of an event queue,
+ * usually a CEQ.  Reading the conversation's capring file gives "ADDR
+ * NR_FRAMES FRAME_SZ".
+ *
+ * The kernel writes each frame, cut down to SNAPLEN bytes, into slot
+ * tail & (nr_frames - 1), then advances tail.  Every BATCH frames, it sends an
+ * event with ev_type EV_ID and ev_arg2 BATCH.  Reap by advancing head.  When
+ * the ring is full, the kernel drops frames and counts them in nr_drops.  The
+ * ring goes away when the conversation is closed, but the mapping stays until
+ * you unmap it. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define CAPRING_MAX_FRAMES			65536
+#define CAPRING_MAX_SNAPLEN			65536
+#define CAPRING_MAX_SZ				(64 * 1024 * 1024)
+
+struct capring_frame {
+	uint64_t					tstamp;		/* nsec since boot */
+	uint32_t					len;		/* length on the wire */
+	uint32_t					caplen;		/* bytes in data */
+	uint8_t						data[];
+};
+
+struct capring {
+	uint32_t					nr_frames;	/* power of two */
+	uint32_t					frame_sz;	/* bytes per slot */
+	uint32_t					head;		/* user reaps from here */
+	uint32_t					tail;		/* kernel writes here */
+	uint64_t					nr_drops;
+	uint8_t						padding[40];
+	uint8_t						frames[];
+};
+
+#define CAPRING_FRAME_SZ(snaplen)                                              \
+	ROUNDUP(sizeof(struct capring_frame) + (snaplen), 16)
+#define CAPRING_SZ(nr_frames, snaplen)                                         \
+	(sizeof(struct capring) + (nr_frames) * CAPRING_FRAME_SZ(snaplen))
+#define CAPRING_FRAME(cr, idx)                                                 \
+	((struct capring_frame*)((cr)->frames +                                    \
+	                         ((idx) & ((cr)->nr_frames - 1)) * (cr)->frame_sz))
@@ -77,4 +77,9 @@ struct preempt_data {
 	bool						notif_pending;		/* notif k_msg on the way */
 	struct event_mbox			ev_mbox_public;		/* can be read remotely */
 	struct event_mbox			ev_mbox_private;	/* for this vcore only */
+	atomic_t					sig_pending;		/* 1 << signo, see below */
 };
+
+/* The kernel can post a POSIX signal straight to a vcore by setting its bit in
+ * sig_pending and sending a notif, skipping the event mboxes.  The vcore hands
+ * the signals to its current uthread the next time it enters vcore context. */
@@ -7,7 +7,11 @@
 #include <ros/event.h>
 
 /* FD Tap commands.  The commands get passed to the device, but intermediate
- * code will process them to some extent. */
+ * code will process them to some extent.
+ *
+ * MOD changes the filter of an existing tap.  Devices that track readiness
+ * fire the tap for any events that are already true on ADD and MOD, so a MOD
+ * with the same filter re-arms a tap. */
 #define FDTAP_CMD_ADD 			1
 #define FDTAP_CMD_REM 			2
 #define FDTAP_CMD_MOD 			3
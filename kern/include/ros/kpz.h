@@ -0,0 +1,21 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * The format of #kprof's compressed files, kpdata.z and kptrace.z.  They're a
+ * series of frames, each a struct kpz_hdr followed by z_len bytes of zlib data
+ * (RFC 1950) that inflate to raw_len bytes.  All in the kernel's byte order.
+ *
+ * Each frame is compressed on its own, and the frames' raw bytes, in order, are
+ * what the uncompressed file would have had.  Records can span frames. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define KPZ_MAGIC				0x317a706b	/* "kpz1" */
+
+struct kpz_hdr {
+	uint32_t					magic;
+	uint32_t					raw_len;
+	uint32_t					z_len;
+};
@@ -38,6 +38,13 @@
 
 #define MAP_FAILED		((void*)-1)
 
+/* madvise advice.  Only DONTNEED does anything; the rest are hints we ignore */
+#define MADV_NORMAL		0
+#define MADV_RANDOM		1
+#define MADV_SEQUENTIAL	2
+#define MADV_WILLNEED	3
+#define MADV_DONTNEED	4
+
 /* Other mmap flags, which we probably won't support
 #define MAP_32BIT
 */
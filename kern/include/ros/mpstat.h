@@ -0,0 +1,35 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * The binary format of #kprof/mpstat-raw.  A struct mpstat_raw_hdr, then
+ * nr_states names of MPSTAT_NAME_LEN bytes each, NUL-padded, then nr_cores
+ * struct mpstat_raw_cores, each followed by nr_states uint64_t tick counts, in
+ * the order of the names.  All in the kernel's byte order.
+ *
+ * Collectors should find states by name, not by position, and skip hdr_size
+ * bytes for the header: new states and header fields can show up without a
+ * version bump.  The version changes if anything else does. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define MPSTAT_RAW_MAGIC		0x6d707374	/* "mpst" */
+#define MPSTAT_RAW_VERSION		2
+#define MPSTAT_NAME_LEN			8
+
+struct mpstat_raw_hdr {
+	uint32_t					magic;
+	uint16_t					version;
+	uint16_t					hdr_size;
+	uint32_t					nr_cores;
+	uint32_t					nr_states;
+	uint64_t					tsc_freq;
+	uint64_t					tsc;		/* when we took the snapshot */
+};
+
+struct mpstat_raw_core {
+	uint32_t					coreid;
+	uint32_t					cur_state;	/* index into the names */
+	uint64_t					ticks[];
+};
@@ -12,6 +12,7 @@
 
 /* Process creation flags */
 #define PROC_DUP_FGRP			1
+#define PROC_TEMPLATE			2	/* never runs, only spawned from */
 
 #define PROCINFO_MAX_ARGP 32
 #define PROCINFO_ARGBUF_SIZE 3072
@@ -64,6 +65,45 @@ typedef struct procinfo {
 } procinfo_t;
 #define PROCINFO_NUM_PAGES  ((sizeof(procinfo_t)-1)/PGSIZE + 1)
 
+#define GINFO_TSC_SHIFT		32
+
+/* Each pcore publishes its own load info whenever it goes idle or wakes up, and
+ * not otherwise.  To get the ticks as of now, add (now - since) to the bucket
+ * for the current state.  Readers use the seq_ctr, like with the coremap. */
+struct pcore_load {
+	seq_ctr_t			seq;
+	bool				idle;
+	uint64_t			since;			/* TSC of the last change */
+	uint64_t			busy_ticks;		/* up to 'since' */
+	uint64_t			idle_ticks;		/* up to 'since' */
+} __attribute__((aligned(64)));
+
+/* #proc/PID/stats is a struct proc_stats, followed by nr_vcores struct
+ * vcore_stats.  It's binary, so monitors can grab everything with one pread and
+ * no parsing.  The counters are cumulative over the life of the process. */
+#define PROC_STATS_VERSION	1
+
+struct vcore_stats {
+	uint64_t			total_ticks;		/* online, as of the read */
+	uint64_t			nr_syscalls;
+	uint64_t			nr_page_faults;
+	uint64_t			nr_events;			/* posted to this vcore's mboxes */
+	uint32_t			pcoreid;
+	uint32_t			online;
+};
+
+struct proc_stats {
+	uint32_t			version;
+	uint32_t			nr_vcores;
+	uint64_t			tsc_freq;
+	uint64_t			vm_bytes;			/* in VMRs, maybe not resident */
+	uint64_t			nr_vmrs;
+	/* The sums of the vcores' */
+	uint64_t			nr_syscalls;
+	uint64_t			nr_page_faults;
+	uint64_t			nr_events;
+};
+
 /* We align this so that the kernel can easily allocate it in the BSS */
 struct proc_global_info {
 	unsigned long cpu_feats[__NR_CPU_FEAT_BITS];
@@ -71,8 +111,22 @@ struct proc_global_info {
 	uint64_t tsc_freq;
 	uint64_t tsc_overhead;
 	uint64_t bus_freq;
+	/* The walltime at tsc_cycles_last, protected by walltime_seqctr.  Convert
+	 * with the mults: nsec = (tsc * tsc2nsec_mult) >> GINFO_TSC_SHIFT. */
+	seq_ctr_t walltime_seqctr;
 	uint64_t walltime_ns_last;
 	uint64_t tsc_cycles_last;
+	uint64_t tsc2nsec_mult;
+	uint64_t nsec2tsc_mult;
+	/* Socket of each pcore, for topology-aware locks.  0 if unknown.  The
+	 * socket is also the LLC domain on the machines we run on. */
+	uint32_t nr_sockets;
+	uint8_t core_socket[MAX_NUM_CORES];
+	/* NUMA node and physical core of each pcore.  SMT siblings share a cpu. */
+	uint32_t nr_numa;
+	uint8_t core_numa[MAX_NUM_CORES];
+	uint8_t core_cpu[MAX_NUM_CORES];
+	struct pcore_load pcore_load[MAX_NUM_CORES];
 } __attribute__((aligned(PGSIZE)));
 #define PROCGINFO_NUM_PAGES  (sizeof(struct proc_global_info) / PGSIZE)
 
@@ -47,3 +47,24 @@ struct proftype_new_process {
 	uint32_t pid;
 	uint8_t path[0];
 } __attribute__((packed));
+
+#define PROFTYPE_DROPPED		5
+
+/* Samples a core dropped since its last PROFTYPE_DROPPED */
+struct proftype_dropped {
+	uint64_t tstamp;
+	uint64_t nr_dropped;
+	uint16_t cpu;
+} __attribute__((packed));
+
+#define PROFTYPE_OFFCPU_TRACE64	6
+
+/* A kthread blocked at trace[0] for duration nsec, until tstamp */
+struct proftype_offcpu_trace64 {
+	uint64_t tstamp;
+	uint64_t duration;
+	uint32_t pid;
+	uint16_t cpu;
+	uint16_t num_traces;
+	uint64_t trace[0];
+} __attribute__((packed));
@@ -0,0 +1,50 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Shared-memory syscall rings.
+ *
+ * SYS_sysring_setup maps a ring into the process and returns its address.  The
+ * ring holds pointers to ordinary struct syscalls: a submission queue (SQ) and
+ * a completion queue (CQ), each nr_entries long.  To submit, fill in the
+ * syscall like any other async syscall, write its pointer to
+ * sq[sq_tail & mask], wmb(), then advance sq_tail.  Any number of syscalls go
+ * to the kernel with one SYS_sysring_enter.  With a kernel poller, you only
+ * need to enter when the kernel sets SYSRING_F_NEED_WAKEUP.
+ *
+ * Syscalls finish the usual way, with SC_DONE and the syscall's own ev_q.  The
+ * kernel also writes each finished syscall's pointer to cq[cq_tail & mask],
+ * advances cq_tail, and sends an EV_SYSCALL (ev_arg3 is the syscall) to the
+ * ring's ev_q, if any.  That way one ucq or ceq can cover the whole ring.
+ * Reap by advancing cq_head.
+ *
+ * The kernel never takes more syscalls than there are free CQ slots, so the CQ
+ * can't overflow.  Until you reap, submissions wait in the SQ. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define SYSRING_MAX_ENTRIES			4096
+
+/* Flags for SYS_sysring_setup */
+#define SYSRING_SETUP_POLL			(1 << 0)	/* kernel poller, own core */
+
+/* sysring->flags, written by the kernel */
+#define SYSRING_F_NEED_WAKEUP		(1 << 0)	/* poller stopped, enter */
+
+struct syscall;
+
+struct sysring {
+	uint32_t					sq_head;	/* kernel takes from here */
+	uint32_t					sq_tail;	/* user submits here */
+	uint32_t					cq_head;	/* user reaps from here */
+	uint32_t					cq_tail;	/* kernel completes here */
+	uint32_t					nr_entries;	/* power of two */
+	uint32_t					flags;
+	struct syscall				*entries[];	/* SQ, then CQ */
+};
+
+#define SYSRING_SQ(sr)				((sr)->entries)
+#define SYSRING_CQ(sr)				((sr)->entries + (sr)->nr_entries)
+#define SYSRING_SZ(nr_entries)                                                 \
+	(sizeof(struct sysring) + 2 * (nr_entries) * sizeof(struct syscall*))
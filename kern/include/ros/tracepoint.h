@@ -0,0 +1,20 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * The records in #trace/data.  id is the tracepoint's line in
+ * #trace/tracepoints, counting from 0, and that line's format says what the
+ * args are.  Unused args are 0. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define TP_NR_ARGS				6
+
+struct tp_record {
+	uint64_t					tsc;
+	uint16_t					id;
+	uint16_t					coreid;
+	uint32_t					pid;		/* of current, 0 if none */
+	uint64_t					args[TP_NR_ARGS];
+};
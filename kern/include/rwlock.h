@@ -8,13 +8,24 @@
  * info.
  *
  * One consequence of this: "if some reader holds a rwlock, then any other
- * thread (including itself) can get an rlock". */
+ * thread (including itself) can get an rlock".
+ *
+ * Locks set up with brinit() are big-reader locks: each core has its own count
+ * of readers, so readers don't share a cache line, and writers pay for it by
+ * checking every core.  They have the same interface and semantics, other than
+ * needing rwdestroy(). */
 
 #pragma once
 
 #include <ros/common.h>
 #include <kthread.h>
 #include <atomic.h>
+#include <arch/arch.h>
+
+/* A core's count can go negative: readers can block and runlock elsewhere */
+struct rwlock_pcpu {
+	unsigned long				nr_readers;
+} __attribute__((aligned(ARCH_CL_SIZE)));
 
 struct rwlock {
 	spinlock_t					lock;
@@ -22,10 +33,14 @@ struct rwlock {
 	bool						writing;
 	struct cond_var				readers;
 	struct cond_var				writers;
+	struct rwlock_pcpu			*pcpu;		/* only for brlocks */
+	unsigned int				nr_wwaiting;
 };
 typedef struct rwlock rwlock_t;
 
 void rwinit(struct rwlock *rw_lock);
+void brinit(struct rwlock *rw_lock);
+void rwdestroy(struct rwlock *rw_lock);
 void rlock(struct rwlock *rw_lock);
 bool canrlock(struct rwlock *rw_lock);
 void runlock(struct rwlock *rw_lock);
@@ -14,12 +14,26 @@
 
 struct proc;	/* process.h includes us, but we need pointers now */
 TAILQ_HEAD(proc_list, proc);		/* Declares 'struct proc_list' */
+struct scp_runq;
+
+/* MCPs split the CG cores in proportion to their shares */
+#define SCHED_DEFAULT_SHARES		100
+#define SCHED_MAX_SHARES			10000
+/* Most warning an MCP can ask for before we preempt one of its cores */
+#define SCHED_MAX_PREEMPT_LEAD_USEC	1000000
 
 /* One of these embedded in every struct proc */
 struct sched_proc_data {
 	TAILQ_ENTRY(proc)			proc_link;			/* tailq linkage */
 	struct proc_list 			*cur_list;			/* which tailq we're on */
 	struct core_request_data	crd;				/* prov/alloc cores */
+	uint32_t					shares;
+	uint32_t					fair_share;			/* cores we're owed */
+	uint32_t					demand;				/* scratch for fair_share */
+	uint32_t					nr_reserved;		/* cores we're guaranteed */
+	uint64_t					preempt_lead;		/* usec of preempt warning */
+	struct scp_runq				*runq;				/* SCP run queue we're on */
+	uint32_t					scp_core;			/* LL core we last ran on */
 	/* count of lists? */
 	/* other accounting info */
 };
@@ -81,6 +95,11 @@ void put_idle_core(int coreid);
  * this from generic kernel code, since it might not be present in all kernel
  * schedulers. */
 int provision_core(struct proc *p, uint32_t pcoreid);
+/* Sets p's shares of the CG cores.  Returns 0 or -1 with errno set. */
+int sched_set_shares(struct proc *p, uint32_t shares);
+/* Reserves nr CG cores for p, with lead_usec of warning before any of p's cores
+ * get preempted.  Returns 0 or -1 with errno set. */
+int sched_reserve_cores(struct proc *p, uint32_t nr, uint64_t lead_usec);
 
 /************** Debugging **************/
 void sched_diag(void);
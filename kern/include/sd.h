@@ -41,6 +41,7 @@ struct sdunit {
 	struct sdperm sdperm;
 
 	qlock_t ctl;
+	struct rwlock wrlock; /* partial-sector writes exclude other writes */
 	uint64_t sectors;
 	uint32_t secsize;
 	struct sdpart *part; /* nil or array of size npart */
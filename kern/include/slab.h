@@ -8,7 +8,8 @@
  *
  * There is a list of kmem_cache, which are the caches of objects of a given
  * size.  This list is sorted in order of size.  Each kmem_cache has three
- * lists of slabs: full, partial, and empty.
+ * lists of slabs, full, partial, and empty, for each NUMA memory node.  A slab
+ * is on the lists of the node its memory is on.
  *
  * For large objects, the kmem_slabs point to bufctls, which have the address
  * of their large buffers.  These slabs can consist of more than one contiguous
@@ -19,6 +20,18 @@
  * address of the next free item.  The slab structure is stored at the end of
  * the page.  There is only one page per slab.
  *
+ * In front of the slab lists sits a per-core magazine layer, based on Bonwick
+ * and Adams's "Magazines and Vmem" paper.  Each core has a loaded and a
+ * previous magazine, each of which is an array of pointers to constructed
+ * objects (rounds).  Allocs and frees only touch the current core's
+ * kmem_pcpu_cache, unless both magazines are empty (alloc) or full (free), in
+ * which case we swap magazines with the depot of the core's node.  Only when
+ * the depot can't help do we fall back to the slab lists.
+ *
+ * The magazines only hold objects from their core's node.  Frees of objects
+ * from other nodes go straight back to their slabs, and allocs for a specific
+ * node (kmem_cache_alloc_node()) skip the magazines unless it's ours.
+ *
  * TODO: Note, that this is a minor pain in the ass, and worth thinking about
  * before implementing.  To keep the constructor's state valid, we can't just
  * overwrite things, so we need to add an extra 4-8 bytes per object for the
@@ -33,11 +46,23 @@
 #include <sys/queue.h>
 #include <atomic.h>
 
+/* Must be at least MAX_MEM_NODES; slab.c checks. */
+#define KMC_MAX_NODES 16
+
 /* Back in the day, their cutoff for "large objects" was 512B, based on
  * measurements and on not wanting more than 1/8 of internal fragmentation. */
 #define NUM_BUF_PER_SLAB 8
 #define SLAB_LARGE_CUTOFF (PGSIZE / NUM_BUF_PER_SLAB)
 
+/* Magazines hold up to KMC_MAG_MAX_SZ rounds.  The depot's magsize, which is
+ * tunable per cache, determines how many of those are actually used. */
+#define KMC_MAG_MIN_SZ 8
+#define KMC_MAG_MAX_SZ 64
+
+/* Cache flags */
+#define KMC_NOMAG 0x0001	/* no per-core magazine layer */
+#define KMC_NOTRACE 0x0002	/* skipped by memprof */
+
 struct kmem_slab;
 
 /* Control block for buffers for large-object slabs */
@@ -57,6 +82,7 @@ struct kmem_slab {
 	size_t obj_size;
 	size_t num_busy_obj;
 	size_t num_total_obj;
+	int node;
 	union {
 		struct kmem_bufctl_list bufctl_freelist;
 		void *free_small_obj;
@@ -64,6 +90,40 @@ struct kmem_slab {
 };
 TAILQ_HEAD(kmem_slab_list, kmem_slab);
 
+struct kmem_magazine {
+	SLIST_ENTRY(kmem_magazine) link;
+	unsigned int nr_rounds;
+	void *rounds[KMC_MAG_MAX_SZ];
+};
+SLIST_HEAD(kmem_mag_slist, kmem_magazine);
+
+/* Each core's view of a cache.  The lock is only contended when someone
+ * flushes the magazines (e.g. kmem_cache_reap()), or before core_id() works. */
+struct kmem_pcpu_cache {
+	spinlock_t lock;
+	unsigned int magsize;
+	struct kmem_magazine *loaded;
+	struct kmem_magazine *prev;
+	unsigned long nr_allocs_ever;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+/* A node's store of full and empty magazines */
+struct kmem_depot {
+	spinlock_t lock;
+	struct kmem_mag_slist not_empty;
+	struct kmem_mag_slist empty;
+	unsigned int magsize;
+	unsigned int nr_not_empty;
+	unsigned int nr_empty;
+};
+
+/* A node's slabs, under the cache_lock */
+struct kmem_node_slabs {
+	struct kmem_slab_list full;
+	struct kmem_slab_list partial;
+	struct kmem_slab_list empty;
+};
+
 /* Actual cache */
 struct kmem_cache {
 	SLIST_ENTRY(kmem_cache) link;
@@ -72,12 +132,12 @@ struct kmem_cache {
 	size_t obj_size;
 	int align;
 	int flags;
-	struct kmem_slab_list full_slab_list;
-	struct kmem_slab_list partial_slab_list;
-	struct kmem_slab_list empty_slab_list;
+	struct kmem_node_slabs nodes[KMC_MAX_NODES];
 	void (*ctor)(void *, size_t);
 	void (*dtor)(void *, size_t);
 	unsigned long nr_cur_alloc;
+	struct kmem_pcpu_cache *pcpu_caches;
+	struct kmem_depot depots[KMC_MAX_NODES];
 };
 
 /* List of all kmem_caches, sorted in order of size */
@@ -92,10 +152,14 @@ struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
 void kmem_cache_destroy(struct kmem_cache *cp);
 /* Front end: clients of caches use these */
 void *kmem_cache_alloc(struct kmem_cache *cp, int flags);
+/* Prefers an object from node's memory.  node < 0 means the local node. */
+void *kmem_cache_alloc_node(struct kmem_cache *cp, int flags, int node);
 void kmem_cache_free(struct kmem_cache *cp, void *buf);
 /* Back end: internal functions */
 void kmem_cache_init(void);
 void kmem_cache_reap(struct kmem_cache *cp);
+void kmem_reap_all(void);
+void kmem_cache_set_magsize(struct kmem_cache *cp, unsigned int magsize);
 
 /* Debug */
 void print_kmem_cache(struct kmem_cache *kc);
@@ -2,36 +2,86 @@
  * Ron Minnich <rminnich@google.com>
  * Barret Rhoden <brho@cs.berkeley.edu>
  *
- * Trivial thread-safe ID pool for small sets of things (< 64K)
- * implemented as a stack.
- */
+ * Thread-safe ID pools, for things like 9p tags that get allocated and freed
+ * on every request.
+ *
+ * The free IDs live in a bitmap, under the pool's lock, but gets and puts
+ * usually don't touch it.  Each core caches a few free IDs, and only goes to
+ * the bitmap to grab or give back U32_POOL_BATCH of them at a time.  A core's
+ * cache has its own lock, which no one else takes unless the pool is about to
+ * run out: then a get will steal from the other cores before it fails.
+ *
+ * A new pool hands out its lowest ID first, so callers can reserve an ID (like
+ * tag 0) by getting it right away.
+ *
+ * We track which IDs are handed out, so we can catch double puts and frees of
+ * IDs we never handed out.  u16 pools are just u32 pools with a smaller max
+ * size, for callers whose IDs go into 16 bit fields. */
 
 #pragma once
 
 #define MAX_U16_POOL_SZ (1 << 16)
 
 #include <atomic.h>
+#include <arch/arch.h>
 
-/* IDS is the stack of 16 bit integers we give out.  TOS is the top of stack -
- * it is the index of the next slot that can be popped, if there are any.  It's
- * a u32 so it can be greater than a u16.
- *
- * All free slots in ids will be below the TOS, ranging from indexes [0, TOS),
- * where if TOS == 0, then there are no free slots to push.
- *
- * We can hand out u16s in the range [0, 65535].
- *
- * The check array is used instead of a bitfield because these architectures
- * suck at those. */
+#define U32_POOL_BATCH			16
+#define U32_POOL_CACHE			(2 * U32_POOL_BATCH)
 
-struct u16_pool {
+struct u32_pool_pcpu {
 	spinlock_t lock;
-	uint32_t tos;
-	uint16_t *ids;
-	uint8_t *check;
-	int size;
+	unsigned int nr;
+	uint32_t ids[U32_POOL_CACHE];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct u32_pool {
+	spinlock_t lock;			/* protects free, nr_free, and next */
+	size_t size;
+	size_t nr_free;				/* set bits in free */
+	size_t next;				/* no free bits in the words below this */
+	unsigned long *free;
+	unsigned long *used;		/* handed out, changed atomically */
+	struct u32_pool_pcpu *pcpu;
+	int nr_pcpu;
 };
 
-struct u16_pool *create_u16_pool(unsigned int size);
-int get_u16(struct u16_pool *id);
-void put_u16(struct u16_pool *id, int v);
+struct u32_pool *create_u32_pool(size_t size);
+void destroy_u32_pool(struct u32_pool *id);
+/* Returns an unused ID, or -1 on failure (pool full or corruption). */
+long get_u32(struct u32_pool *id);
+void put_u32(struct u32_pool *id, uint32_t v);
+/* The number of IDs that aren't handed out.  Racy, unless the pool is idle. */
+size_t u32_pool_nr_free(struct u32_pool *id);
+
+struct u16_pool {
+	struct u32_pool up;
+};
+
+static inline struct u16_pool *create_u16_pool(unsigned int size)
+{
+	/* We could have size be a u16, but this might catch bugs where users
+	 * tried to ask for more than 2^16 and had it succeed. */
+	if (size > MAX_U16_POOL_SZ)
+		return NULL;
+	return (struct u16_pool*)create_u32_pool(size);
+}
+
+static inline void destroy_u16_pool(struct u16_pool *id)
+{
+	destroy_u32_pool(&id->up);
+}
+
+static inline int get_u16(struct u16_pool *id)
+{
+	return get_u32(&id->up);
+}
+
+static inline void put_u16(struct u16_pool *id, int v)
+{
+	put_u32(&id->up, v);
+}
+
+static inline size_t u16_pool_nr_free(struct u16_pool *id)
+{
+	return u32_pool_nr_free(&id->up);
+}
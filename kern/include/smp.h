@@ -19,18 +19,32 @@
 #include <trace.h>
 #include <core_set.h>
 
+/* Where a core's time goes.  The core adds the TSC delta to the old state on
+ * every transition.  A kthread restarted by a routine kmsg counts as rkm until
+ * it gets to the next transition. */
 #define CPU_STATE_IRQ			0
-#define CPU_STATE_KERNEL		1
-#define CPU_STATE_USER			2
-#define CPU_STATE_IDLE			3
-#define NR_CPU_STATES			4
-
+#define CPU_STATE_KERNEL		1	/* traps, faults, anything else */
+#define CPU_STATE_SYSCALL		2
+#define CPU_STATE_RKM			3	/* routine kernel messages */
+#define CPU_STATE_KSCHED		4	/* cpu_bored(), from the idle loop */
+#define CPU_STATE_USER_MCP		5
+#define CPU_STATE_USER_SCP		6
+#define CPU_STATE_IDLE_HALT		7
+#define CPU_STATE_IDLE_POLL		8	/* in the idle loop, not halted */
+#define NR_CPU_STATES			9
+
+/* At most 6 chars, for mpstat-raw */
 static char *cpu_state_names[NR_CPU_STATES] =
 {
 	"irq",
 	"kern",
-	"user",
-	"idle",
+	"sys",
+	"rkm",
+	"ksched",
+	"umcp",
+	"uscp",
+	"halt",
+	"poll",
 };
 
 struct per_cpu_info {
@@ -41,12 +55,14 @@ struct per_cpu_info {
 	uintptr_t nmi_worker_stacktop;
 	int vmx_enabled;
 	int guest_pcoreid;
+	bool lapic_tsc_deadline;	/* LAPIC timer is in TSC-deadline mode */
 #endif
 	spinlock_t lock;
 	/* Process management */
 	// cur_proc should be valid on all cores that are not management cores.
 	struct proc *cur_proc;		/* which process context is loaded */
 	struct proc *owning_proc;	/* proc owning the core / cur_ctx */
+	struct proc *pgdir_proc;	/* whose page tables are in cr3, for TLBs */
 	uint32_t owning_vcoreid;	/* vcoreid of owning proc (if applicable */
 	struct user_context *cur_ctx;	/* user ctx we came in on (can be 0) */
 	struct user_context actual_ctx;	/* storage for cur_ctx */
@@ -58,6 +74,7 @@ struct per_cpu_info {
 	unsigned int lock_depth;
 	struct trace_ring traces;
 	int cpu_state;
+	int cpu_state_pre_irq;		/* what the outermost IRQ interrupted */
 	uint64_t last_tick_cnt;
 	uint64_t state_ticks[NR_CPU_STATES];
 	/* TODO: 64b (not sure if we'll need these at all */
@@ -65,11 +82,15 @@ struct per_cpu_info {
 	taskstate_t *tss;
 	segdesc_t *gdt;
 #endif
-	/* KMSGs */
-	spinlock_t immed_amsg_lock;
+	/* KMSGs.  Senders push onto the _in stacks, and this core moves them to
+	 * the lists.  See trap.c. */
+	struct kernel_message *immed_amsgs_in;
 	struct kernel_msg_list immed_amsgs;
-	spinlock_t routine_amsg_lock;
+	struct kernel_message *routine_amsgs_in;
 	struct kernel_msg_list routine_amsgs;
+	/* Set while cpu_halt() is waiting on a write to routine_amsgs_in, so
+	 * senders of routine KMSGs don't need to IPI. */
+	bool kmsg_mwait;
 	/* profiling -- opaque to all but the profiling code. */
 	void *profiling;
 }__attribute__((aligned(ARCH_CL_SIZE)));
@@ -93,6 +114,8 @@ void smp_percpu_init(void); // this must be called by each core individually
 void __arch_pcpu_init(uint32_t coreid);	/* each arch has one of these */
 
 void __set_cpu_state(struct per_cpu_info *pcpui, int state);
+void __cpu_state_irq_enter(struct per_cpu_info *pcpui);
+void __cpu_state_irq_exit(struct per_cpu_info *pcpui);
 void reset_cpu_state_ticks(int coreid);
 
 /* SMP utility functions */
@@ -38,6 +38,12 @@ void *sigscan(uint8_t *address, int length, char *signature);
 /* In arch/support64.S */
 void bcopy(const void *src, void *dst, size_t len);
 
+#ifdef CONFIG_X86
+/* In arch/string.c */
+void *__arch_memcpy(void *dst, const void *src, size_t n);
+void *__arch_memset(void *dst, int c, size_t n);
+#endif
+
 #ifdef CONFIG_RISCV
 #warning Implement bcopy
 #endif
@@ -16,6 +16,9 @@ enum uio_seg {
 	UIO_NOCOPY		/* don't copy, already in object */
 };
 
+/* Most iovecs a readv() or writev() can take */
+#define UIO_MAXIOV		1024
+
 // Straight out of bsd definition
 struct iovec {
     void    *iov_base;  /* Base address. */
@@ -7,6 +7,7 @@
 #include <process.h>
 #include <kref.h>
 #include <ns.h>
+#include <rendez.h>
 
 #define SYSTRACE_ON					0x01
 #define SYSTRACE_LOUD				0x02
@@ -19,9 +20,9 @@
 #define MAX_ASRC_BATCH				10
 
 #define SYSTR_RECORD_SZ				256
-#define SYSTR_BUF_SZ 				PGSIZE
-#define SYSTR_PRETTY_BUF_SZ			(SYSTR_BUF_SZ -                            \
-                                     sizeof(struct systrace_record))
+#define SYSTR_PRETTY_BUF_SZ			PGSIZE
+#define SYSTR_RING_SZ				64		/* records per core, power of two */
+
 struct systrace_record {
 	struct systrace_record_anon {
 		uint64_t		start_timestamp, end_timestamp;
@@ -36,12 +37,20 @@ struct systrace_record {
 		int				pid;
 		uint32_t		coreid;
 		uint32_t		vcoreid;
-		char			*pretty_buf;
+		bool			is_exit;
 		uint8_t			datalen;
 	};
 	uint8_t			data[SYSTR_RECORD_SZ - sizeof(struct systrace_record_anon)];
 };
 
+/* Single producer (the core), single consumer (whoever holds the strace's
+ * drain_lock).  Records are formatted when they are drained. */
+struct systrace_ring {
+	unsigned long				prod;
+	unsigned long				cons __attribute__((aligned(ARCH_CL_SIZE)));
+	struct systrace_record		recs[SYSTR_RING_SZ];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 struct strace {
 	bool tracing;
 	bool inherit;
@@ -50,10 +59,28 @@ struct strace {
 	struct kref procs; /* when procs goes to zero, q is hung up. */
 	struct kref users; /* when users goes to zero, q and struct are freed. */
 	struct queue *q;
+	struct systrace_ring *rings;	/* one per core */
+	spinlock_t drain_lock;
+	struct rendez rv;				/* readers wait here for records */
+	atomic_t nr_readers_waiting;
 };
 
 extern bool systrace_loud;
 
+/* Syscall latency accounting.  Each syscall's time from dispatch to return,
+ * including any time blocked, goes in a log2 histogram of cycles, both per
+ * core for the whole system and per process: bucket i has the calls that took
+ * fewer than 2^(SYSC_LAT_HIST_SHIFT + i + 1) cycles, and the last bucket has
+ * everything else.  Syscalls that never return (exec, yield) aren't counted. */
+#define SYSC_LAT_HIST_SHIFT			8
+#define SYSC_LAT_NR_BUCKETS			24
+
+struct sysc_lat_stat {
+	uint64_t					count;
+	uint64_t					cycles;
+	uint64_t					hist[SYSC_LAT_NR_BUCKETS];
+};
+
 /* Syscall table */
 typedef intreg_t (*syscall_t)(struct proc *, uintreg_t, uintreg_t, uintreg_t,
                               uintreg_t, uintreg_t, uintreg_t);
@@ -66,6 +93,7 @@ extern const int max_syscall;
 /* Syscall invocation */
 void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_calls);
 void run_local_syscall(struct syscall *sysc);
+void run_sysring_syscall(struct syscall *sysc);
 intreg_t syscall(struct proc *p, uintreg_t sc_num, uintreg_t a0, uintreg_t a1,
                  uintreg_t a2, uintreg_t a3, uintreg_t a4, uintreg_t a5);
 void set_errno(int errno);
@@ -80,6 +108,16 @@ void set_cur_errbuf(struct errbuf *ebuf);
 char *get_cur_genbuf(void);
 void __signal_syscall(struct syscall *sysc, struct proc *p);
 
+/* Latency stats */
+struct sized_alloc;
+void sysc_lat_free(struct proc *p);
+void sysc_lat_reset(void);
+struct sized_alloc *sysc_lat_report(struct proc *p);
+
+/* Tracing */
+bool systrace_pending(struct strace *strace);
+void systrace_drain(struct strace *strace);
+
 /* Utility */
 bool syscall_uses_fd(struct syscall *sysc, int fd);
 void print_sysc(struct proc *p, struct syscall *sysc);
@@ -0,0 +1,17 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Kernel side of the shared-memory syscall rings.  See ros/sysring.h for the
+ * interface to userspace. */
+
+#pragma once
+
+#include <ros/sysring.h>
+#include <ros/event.h>
+
+struct proc;
+
+void *sysring_setup(struct proc *p, unsigned int nr_entries,
+                    struct event_queue *ev_q, int flags, int poll_core);
+int sysring_enter(struct proc *p);
+void sysring_free(struct proc *p);
@@ -0,0 +1,51 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * TMPFS: an in-memory filesystem for scratch data, mounted at /tmp.  See
+ * tmpfs.c. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <vfs.h>
+
+/* Every FS must extern it's type, and be included in vfs_init() */
+extern struct fs_type tmpfs_fs_type;
+
+struct tmpfs_dirent;
+BSD_LIST_HEAD(tmpfs_dirent_list, tmpfs_dirent);
+TAILQ_HEAD(tmpfs_dirent_tailq, tmpfs_dirent);
+
+/* A directory's entry for one of its kids.  The kid's dentry points back at it
+ * with d_fs_info. */
+struct tmpfs_dirent {
+	struct dentry				*dentry;
+	unsigned long				hash;		/* of the dentry's name */
+	unsigned long				cookie;		/* readdir d_off */
+	BSD_LIST_ENTRY(tmpfs_dirent) hash_link;
+	TAILQ_ENTRY(tmpfs_dirent)	link;		/* oldest first */
+};
+
+struct tmpfs_sb_info {
+	unsigned long				next_ino;
+	size_t						nr_bytes;	/* charged to files */
+	size_t						max_bytes;
+};
+
+/* TMPFS-specific inode info.  lock protects the directory fields.  The file
+ * fields are under the inode's i_lock, like i_size. */
+struct tmpfs_i_info {
+	spinlock_t					lock;
+	struct tmpfs_dirent_list	*ht;
+	size_t						nr_buckets;
+	size_t						nr_ents;
+	struct tmpfs_dirent_tailq	ents;
+	unsigned long				next_cookie;
+	struct tmpfs_dirent			*rd_hint;	/* last one readdir returned */
+	size_t						charged;	/* bytes, against nr_bytes */
+	unsigned long				pg_hi;		/* no pages at or above this */
+	bool						stale;		/* pages past EOF, from a trunc */
+	char						*symname;
+};
+
+void tmpfs_mount(char *path);
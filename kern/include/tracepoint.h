@@ -0,0 +1,57 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Static tracepoints.  Each one is compiled in, off, and costs a load and a
+ * branch until someone turns it on through #trace/ctl.  Once on, each hit
+ * writes a fixed-size binary record, with up to TP_NR_ARGS integer args, into
+ * the core's trace ring.  The rings overwrite, so they hold the latest records
+ * per core.  #trace/data has all of them.
+ *
+ * Define a tracepoint once, in the file that hits it, with a printf-ish format
+ * for its args.  The format is only for whoever decodes the records:
+ *
+ * 		DEFINE_TRACEPOINT(page_fault, "pid %d va %p prot %d ret %d");
+ *
+ * 		tracepoint(page_fault, p->pid, va, prot, ret);
+ *
+ * Args are converted to uint64_t, so cast pointers.  The linker gathers the
+ * tracepoints into one table (linker_tables.ld), so names should be unique. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <ros/tracepoint.h>
+#include <compiler.h>
+
+/* sizeof must match the alignment, so the table is a plain array. */
+struct tracepoint {
+	const char					*name;
+	const char					*fmt;
+	bool						enabled;
+} __attribute__((aligned(32)));
+
+#define __tracepoints __attribute__((__section__(".tracepoints"), used))
+
+extern struct tracepoint __tracepointsstart[];
+extern struct tracepoint __tracepointsend[];
+
+#define DEFINE_TRACEPOINT(_name, _fmt)                                         \
+	static struct tracepoint __tracepoints __tp_##_name = {                    \
+		.name = #_name,                                                        \
+		.fmt = _fmt,                                                           \
+	}
+
+#define tracepoint(_name, ...)                                                 \
+do {                                                                           \
+	if (unlikely(__tp_##_name.enabled))                                        \
+		__tracepoint_hit(&__tp_##_name,                                        \
+		                 (uint64_t[TP_NR_ARGS]){__VA_ARGS__});                 \
+} while (0)
+
+struct sized_alloc;
+
+void __tracepoint_hit(struct tracepoint *tp, const uint64_t *args);
+int tracepoint_set(const char *name, bool on);
+void tracepoint_reset(void);
+struct sized_alloc *tracepoint_list(void);
+struct sized_alloc *tracepoint_snapshot(void);
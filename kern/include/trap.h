@@ -16,6 +16,11 @@ typedef void (*isr_t)(struct hw_trapframe *hw_tf, void *data);
 void idt_init(void);
 int register_irq(int irq, isr_t handler, void *irq_arg, uint32_t tbdf);
 int route_irqs(int cpu_vec, int coreid);
+int route_irqs_spread(int cpu_vec, int idx);
+int irq_spread_core(int idx);
+void irq_rebalance(void);
+void irq_core_allocated(uint32_t coreid);
+int get_irq_vector(isr_t handler, void *irq_arg);
 void print_trapframe(struct hw_trapframe *hw_tf);
 void print_swtrapframe(struct sw_trapframe *sw_tf);
 void print_vmtrapframe(struct vm_trapframe *vm_tf);
@@ -23,6 +28,9 @@ void print_user_ctx(struct user_context *ctx);
 /* Generic per-core timer interrupt handler.  set_percore_timer() will fire the
  * timer_interrupt(). */
 void set_core_timer(uint32_t usec, bool periodic);
+/* Arms the core's timer for an absolute TSC time.  Times in the past go off
+ * right away. */
+void set_core_timer_deadline(uint64_t deadline);
 void timer_interrupt(struct hw_trapframe *hw_tf, void *data);
 
 extern inline void save_fp_state(struct ancillary_state *silly);
@@ -89,8 +97,8 @@ void copy_current_ctx_to(struct user_context *to_ctx);
  *
  * Also, a big difference is that smp_calls can use the same message (registered
  * in the interrupt_handlers[] for x86) for every recipient, but the kernel
- * messages require a unique message.  Also for now, but it might be like that
- * for a while on x86 (til we have a broadcast). */
+ * messages require a unique message.  send_kernel_message_cores() hides that,
+ * and sends at most one IPI per core. */
 
 #define KMSG_IMMEDIATE 			1
 #define KMSG_ROUTINE 			2
@@ -114,6 +122,9 @@ typedef struct kernel_message kernel_message_t;
 void kernel_msg_init(void);
 uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
                              long arg2, int type);
+struct core_set;
+void send_kernel_message_cores(const struct core_set *cset, amr_t pc,
+                               long arg0, long arg1, long arg2, int type);
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data);
 bool has_routine_kmsg(void);
 void process_routine_kmsg(void);
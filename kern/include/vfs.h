@@ -21,6 +21,7 @@
 #include <time.h>
 #include <radix.h>
 #include <hashtable.h>
+#include <rcu.h>
 #include <pagemap.h>
 #include <blockdev.h>
 #include <fdtap.h>
@@ -28,6 +29,8 @@
 /* ghetto preprocessor hacks (since proc includes vfs) */
 struct page;
 struct vm_region;
+struct block;
+struct elf_cache;
 
 // TODO: temp typedefs, etc.  remove when we support this stuff.
 typedef int dev_t;
@@ -63,6 +66,7 @@ struct pipe_inode_info;
 TAILQ_HEAD(sb_tailq, super_block);
 TAILQ_HEAD(dentry_tailq, dentry);
 SLIST_HEAD(dentry_slist, dentry);
+BSD_LIST_HEAD(dentry_hlist, dentry);
 TAILQ_HEAD(inode_tailq, inode);
 SLIST_HEAD(inode_slist, inode);
 TAILQ_HEAD(file_tailq, file);
@@ -111,6 +115,22 @@ struct nameidata {
 #define LOOKUP_CREATE 		0x11	/* create a file if it doesn't exist */
 #define LOOKUP_ACCESS 		0x12	/* access / check user permissions */
 
+/* Dentry cache hash tables.  Each bucket has its own lock.  When a table gets
+ * too full, we make one twice as big and move the old buckets over a few at a
+ * time, from dcache_put().  Until a bucket is moved, its dentries stay in the
+ * old table. */
+struct dcache_bucket {
+	spinlock_t					lock;
+	bool						moved;		/* contents are in the new table */
+	struct dentry_hlist			chain;
+};
+
+struct dcache_table {
+	size_t						nr_buckets;	/* power of two */
+	struct dcache_bucket		*buckets;
+	struct rcu_head				rcu;
+};
+
 /* Superblock: Specific instance of a mounted filesystem.  All synchronization
  * is done with the one spinlock. */
 
@@ -133,9 +153,14 @@ struct super_block {
 	struct io_wb_tailq			s_io_wb;		/* writebacks */
 	struct file_tailq			s_files;		/* assigned files */
 	struct dentry_tailq			s_lru_d;		/* unused dentries (in dcache)*/
+	struct dentry_tailq			s_lru_neg;		/* unused negative dentries */
+	unsigned long				s_nr_neg;		/* on s_lru_neg */
 	spinlock_t					s_lru_lock;
-	struct hashtable			*s_dcache;		/* dentry cache */
-	spinlock_t					s_dcache_lock;
+	struct dcache_table			*s_dcache;		/* dentry cache */
+	struct dcache_table			*s_dcache_old;	/* old table, if resizing */
+	size_t						s_dcache_next_mv;	/* next old bucket to move */
+	atomic_t					s_nr_dentries;	/* in the dcache */
+	spinlock_t					s_dcache_lock;	/* for resizing */
 	struct hashtable			*s_icache;		/* inode cache */
 	spinlock_t					s_icache_lock;
 	struct block_device			*s_bdev;
@@ -201,6 +226,8 @@ struct inode {
 	unsigned int				i_flags;		/* filesystem mount flags */
 	bool						i_socket;
 	atomic_t					i_writecount;	/* number of writers */
+	unsigned long				i_gen;			/* bumped on writes/truncs */
+	struct elf_cache			*i_elf;			/* under i_lock, see elf.c */
 	void						*i_fs_info;
 };
 
@@ -241,6 +268,7 @@ struct dentry {
 	spinlock_t					d_lock;
 	struct inode				*d_inode;
 	TAILQ_ENTRY(dentry)			d_lru;			/* unused list */
+	BSD_LIST_ENTRY(dentry)		d_hash;			/* dcache bucket chain */
 	TAILQ_ENTRY(dentry)			d_alias;		/* linkage for i_dentry */
 	struct dentry_tailq			d_subdirs;
 	TAILQ_ENTRY(dentry)			d_subdirs_link;
@@ -253,6 +281,7 @@ struct dentry {
 	struct qstr					d_name;			/* pts to iname and holds hash*/
 	char						d_iname[DNAME_INLINE_LEN];
 	void						*d_fs_info;
+	struct rcu_head				d_rcu;
 };
 
 /* Checks is a struct dentry pointer if the root.
@@ -292,6 +321,8 @@ struct file {
 	spinlock_t					f_ep_lock;
 	void						*f_privdata;	/* tty/socket driver hook */
 	struct page_map				*f_mapping;		/* page cache mapping */
+	struct pm_ra_state			f_ra;			/* readahead state */
+	struct rcu_head				f_rcu;			/* lookup_fd() can see it */
 
 	/* Ghetto appserver support */
 	int fd; // all it contains is an appserver fd (for pid 0, aka kernel)
@@ -390,7 +421,9 @@ struct file_desc {
 	struct fd_tap				*fd_tap;
 };
 
-/* All open files for a process */
+/* All open files for a process.  The lock protects everything, but lookup_fd()
+ * doesn't take it: it reads fd[] under RCU.  fd and max_files are only ever
+ * replaced by bigger ones, with the old fd freed after a grace period. */
 struct fd_table {
 	spinlock_t					lock;
 	bool						closed;
@@ -424,6 +457,7 @@ extern struct sb_tailq super_blocks;			/* list of all sbs */
 extern spinlock_t super_blocks_lock;
 extern struct fs_type_tailq file_systems;		/* lock this if it's dynamic */
 extern struct namespace default_ns;
+extern unsigned long dcache_max_negative;	/* unused, per superblock */
 
 /* Slab caches for common objects */
 extern struct kmem_cache *dentry_kcache;
@@ -463,6 +497,8 @@ struct dentry *dcache_get(struct super_block *sb, struct dentry *what_i_want);
 void dcache_put(struct super_block *sb, struct dentry *key_val);
 struct dentry *dcache_remove(struct super_block *sb, struct dentry *key);
 void dcache_prune(struct super_block *sb, bool negative_only);
+void dcache_for_each(struct super_block *sb,
+                     void (*func)(struct dentry *, void *), void *arg);
 int generic_dentry_hash(struct dentry *dentry, struct qstr *qstr);
 
 /* Inode Functions */
@@ -474,6 +510,7 @@ int create_symlink(struct inode *dir, struct dentry *dentry,
                    const char *symname, int mode);
 int check_perms(struct inode *inode, int access_mode);
 void inode_release(struct kref *kref);
+unsigned long vfs_evict_clean_pages(unsigned long nr_wanted);
 void stat_inode(struct inode *inode, struct kstat *kstat);
 struct inode *icache_get(struct super_block *sb, unsigned long ino);
 void icache_put(struct super_block *sb, struct inode *inode);
@@ -484,6 +521,12 @@ ssize_t generic_file_read(struct file *file, char *buf, size_t count,
                           off64_t *offset);
 ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
                            off64_t *offset);
+ssize_t generic_file_readv(struct file *file, const struct iovec *iov,
+                           unsigned long iovcnt, off64_t *offset);
+ssize_t generic_file_writev(struct file *file, const struct iovec *iov,
+                            unsigned long iovcnt, off64_t *offset);
+ssize_t generic_file_block(struct file *file, size_t count, off64_t *offset,
+                           struct block **bp);
 ssize_t generic_dir_read(struct file *file, char *u_buf, size_t count,
                          off64_t *offset);
 struct file *alloc_file(void);
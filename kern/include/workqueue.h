@@ -0,0 +1,165 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Workqueues: deferred work run by pools of worker kthreads, with the Linux
+ * interface, since that's who uses them.
+ *
+ * There is a pool of workers for each core, shared by all of the bound
+ * workqueues, and one unbound pool.  Work queued to a bound queue starts on the
+ * core it was queued on (or the core given to queue_work_on()), with the idle
+ * worker woken by a kmsg to that core.  A work item that blocks may finish on
+ * another core, like any kthread.  Pools start with no workers, and start a
+ * new one whenever work arrives and all of their workers are busy, up to a
+ * limit.  Ordered queues (create_singlethread_workqueue()) have their own
+ * unbound pool with a single worker, so their work runs one at a time, in
+ * order.
+ *
+ * A work item is only ever on one queue.  Queueing pending work does nothing
+ * and returns FALSE.  Delayed work sits on an IRQ alarm on the queueing core
+ * until its delay (in ticks of 1/HZ, 10ms) runs out, and it is pending the
+ * whole time.
+ *
+ * Work functions may free their work_struct; the pools never touch it after
+ * running it.  Flushing a workqueue waits until it has no queued or running
+ * work, flush_work() waits for one item, and the _sync cancels also wait for a
+ * running item to finish.  All of those block, and the rest can be called from
+ * IRQ context.
+ *
+ * Usage:
+ * 		INIT_WORK(&foo->work, foo_work_fn);
+ * 		queue_work(system_wq, &foo->work);
+ * 		...
+ * 		cancel_work_sync(&foo->work); */
+
+#pragma once
+
+#include <ros/common.h>
+#include <sys/queue.h>
+#include <atomic.h>
+#include <alarm.h>
+#include <kthread.h>
+
+#define WQ_USEC_PER_TICK		10000		/* 1/HZ */
+#define WQ_NAME_SZ				32
+#define WQ_MAX_BOUND_WORKERS	4			/* per core */
+#define WQ_MAX_UNBOUND_WORKERS	16
+
+/* workqueue flags */
+#define WQ_UNBOUND				(1 << 0)
+#define WQ_ORDERED				(1 << 1)	/* implies unbound */
+
+struct work_struct;
+struct workqueue_struct;
+struct wq_pool;
+STAILQ_HEAD(work_stailq, work_struct);
+
+struct work_struct {
+	void (*func)(struct work_struct *);
+	STAILQ_ENTRY(work_struct)	link;
+	uint32_t					pending;	/* queued or on its alarm */
+	bool						queued;		/* on pool's list, pool locked */
+	struct workqueue_struct		*wq;		/* last one we were queued to */
+	struct wq_pool				*pool;		/* last one we were queued to */
+	void						*arg;
+};
+
+/* Delayed work is embedded in other structs.  Handlers will expect to get a
+ * work_struct pointer. */
+struct delayed_work {
+	struct work_struct 			work;
+	struct alarm_waiter			alarm;
+	struct timer_chain			*tchain;	/* where the alarm is set */
+	struct workqueue_struct		*wq;		/* where it will be queued */
+	int							coreid;
+};
+
+/* Lives on its worker kthread's stack */
+struct wq_worker {
+	BSD_LIST_ENTRY(wq_worker)	link;
+	struct work_struct			*cur;
+};
+BSD_LIST_HEAD(wq_worker_list, wq_worker);
+
+/* Pools are protected by their lock, which their CVs share.  'work_cv' is for
+ * idle workers, 'done_cv' for anyone waiting on work to finish.  nr_idle counts
+ * idle workers that no one has woken up yet. */
+struct wq_pool {
+	spinlock_t					lock;
+	struct cond_var				work_cv;
+	struct cond_var				done_cv;
+	struct work_stailq			work;
+	struct wq_worker_list		busy;
+	int							coreid;		/* -1 for unbound */
+	unsigned int				nr_workers;
+	unsigned int				nr_idle;
+	unsigned int				max_workers;
+	bool						dying;
+	char						*name;
+};
+
+struct workqueue_struct {
+	char						name[WQ_NAME_SZ];
+	int							flags;
+	spinlock_t					lock;
+	struct cond_var				flush_cv;
+	unsigned long				nr_inflight;	/* queued or running */
+	struct wq_pool				*ordered_pool;	/* only for WQ_ORDERED */
+};
+
+extern struct workqueue_struct *system_wq;
+extern struct workqueue_struct *system_unbound_wq;
+
+static inline struct delayed_work *to_delayed_work(struct work_struct *work)
+{
+	return container_of(work, struct delayed_work, work);
+}
+
+static inline bool work_pending(struct work_struct *work)
+{
+	return ACCESS_ONCE(work->pending) ? TRUE : FALSE;
+}
+
+static inline bool delayed_work_pending(struct delayed_work *dwork)
+{
+	return work_pending(&dwork->work);
+}
+
+#define INIT_WORK(wp, funcp)                                                   \
+do {                                                                           \
+	(wp)->func = (funcp);                                                      \
+	(wp)->pending = 0;                                                         \
+	(wp)->queued = FALSE;                                                      \
+	(wp)->wq = 0;                                                              \
+	(wp)->pool = 0;                                                            \
+} while (0)
+
+#define INIT_DELAYED_WORK(dwp, funcp)                                          \
+do {                                                                           \
+	INIT_WORK(&(dwp)->work, (funcp));                                          \
+	(dwp)->tchain = 0;                                                         \
+} while (0)
+
+void workqueue_init(void);
+struct workqueue_struct *alloc_workqueue(const char *name, int flags,
+                                         int max_active);
+struct workqueue_struct *create_singlethread_workqueue(char *name);
+#define create_workqueue(name) alloc_workqueue((name), 0, 0)
+void flush_workqueue(struct workqueue_struct *wq);
+void destroy_workqueue(struct workqueue_struct *wq);
+
+bool queue_work_on(int coreid, struct workqueue_struct *wq,
+                   struct work_struct *work);
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+bool schedule_work(struct work_struct *work);
+bool flush_work(struct work_struct *work);
+bool cancel_work(struct work_struct *work);
+bool cancel_work_sync(struct work_struct *work);
+
+bool queue_delayed_work_on(int coreid, struct workqueue_struct *wq,
+                           struct delayed_work *dwork, unsigned long delay);
+bool queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
+                        unsigned long delay);
+bool schedule_delayed_work(struct delayed_work *dwork, unsigned long delay);
+bool flush_delayed_work(struct delayed_work *dwork);
+bool cancel_delayed_work(struct delayed_work *dwork);
+bool cancel_delayed_work_sync(struct delayed_work *dwork);
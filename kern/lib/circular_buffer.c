@@ -138,3 +138,103 @@ size_t circular_buffer_read(struct circular_buffer *cb, char *data, size_t size,
 
 	return rsize;
 }
+
+/* A record's header is one word, so the reader sees all of it or none.  It's
+ * the record's length, including the header and rounding, plus the flags.  The
+ * reader zeroes what it consumes, so space that's been reserved but not written
+ * yet reads as uncommitted. */
+#define CBMP_COMMITTED			(1ULL << 32)
+#define CBMP_PAD				(1ULL << 33)
+#define CBMP_LEN_MASK			((1ULL << 32) - 1)
+#define CBMP_ALIGN				sizeof(uint64_t)
+
+bool circular_buffer_mp_init(struct circular_buffer_mp *cb, size_t size)
+{
+	assert(IS_PWR2(size) && size >= 4 * CBMP_ALIGN);
+	cb->base = kzmalloc(size, MEM_WAIT);
+	if (!cb->base)
+		return FALSE;
+	cb->allocated = size;
+	cb->head = cb->tail = 0;
+	cb->nr_dropped = 0;
+	return TRUE;
+}
+
+void circular_buffer_mp_destroy(struct circular_buffer_mp *cb)
+{
+	kfree(cb->base);
+	cb->base = NULL;
+	cb->allocated = 0;
+}
+
+static uint64_t *cbmp_hdr(struct circular_buffer_mp *cb, uint64_t pos)
+{
+	return (uint64_t*)(cb->base + (pos & (cb->allocated - 1)));
+}
+
+char *circular_buffer_mp_reserve(struct circular_buffer_mp *cb, size_t size)
+{
+	size_t esize = ROUNDUP(size + sizeof(uint64_t), CBMP_ALIGN);
+	uint64_t head, tail, pad;
+
+	if (unlikely(size > circular_buffer_mp_max_write_size(cb))) {
+		__sync_fetch_and_add(&cb->nr_dropped, 1);
+		return NULL;
+	}
+	do {
+		head = ACCESS_ONCE(cb->head);
+		tail = ACCESS_ONCE(cb->tail);
+		/* Records don't wrap; they skip the rest of the buffer instead. */
+		pad = cb->allocated - (head & (cb->allocated - 1));
+		if (pad >= esize)
+			pad = 0;
+		if (head + pad + esize - tail > cb->allocated) {
+			__sync_fetch_and_add(&cb->nr_dropped, 1);
+			return NULL;
+		}
+	} while (!__sync_bool_compare_and_swap(&cb->head, head,
+	                                       head + pad + esize));
+	if (pad)
+		ACCESS_ONCE(*cbmp_hdr(cb, head)) = pad | CBMP_PAD | CBMP_COMMITTED;
+	head += pad;
+	/* Still uncommitted; this just saves the length for commit */
+	*cbmp_hdr(cb, head) = esize;
+	return (char*)(cbmp_hdr(cb, head) + 1);
+}
+
+void circular_buffer_mp_commit(struct circular_buffer_mp *cb, char *rec)
+{
+	uint64_t *hdr = (uint64_t*)rec - 1;
+
+	wmb();	/* the record, then the flag */
+	ACCESS_ONCE(*hdr) = *hdr | CBMP_COMMITTED;
+}
+
+size_t circular_buffer_mp_read(struct circular_buffer_mp *cb, char *data,
+                               size_t size)
+{
+	uint64_t tail = cb->tail, hdr;
+	size_t len, amt, rsize = 0;
+
+	while (tail != ACCESS_ONCE(cb->head)) {
+		hdr = ACCESS_ONCE(*cbmp_hdr(cb, tail));
+		if (!(hdr & CBMP_COMMITTED))
+			break;
+		rmb();	/* pairs with the commit's wmb */
+		len = hdr & CBMP_LEN_MASK;
+		if (!(hdr & CBMP_PAD)) {
+			amt = MIN(len - sizeof(uint64_t), size - rsize);
+			/* It'll fit next time, unless it's the first one */
+			if (amt < len - sizeof(uint64_t) && rsize)
+				break;
+			memcpy(data + rsize, cbmp_hdr(cb, tail) + 1, amt);
+			rsize += amt;
+		}
+		memset(cbmp_hdr(cb, tail), 0, len);
+		/* Writers can have the space once it's zeroed */
+		wmb();
+		tail += len;
+		ACCESS_ONCE(cb->tail) = tail;
+	}
+	return rsize;
+}
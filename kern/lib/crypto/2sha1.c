@@ -238,16 +238,40 @@ static void sha1_transform(struct vb2_sha1_context *ctx)
 	ctx->state[4] += E;
 }
 
+/* Hashes nr whole blocks straight from data. */
+static void sha1_blocks(struct vb2_sha1_context *ctx, const uint8_t *data,
+			uint32_t nr)
+{
+	uint32_t i = 0;
+
+#ifdef CONFIG_X86
+	i = x86_sha1_blocks(ctx->state, data, nr);
+#endif
+	for (; i < nr; i++) {
+		memcpy(ctx->buf, data + i * sizeof(ctx->buf), sizeof(ctx->buf));
+		sha1_transform(ctx);
+	}
+}
+
 void vb2_sha1_update(struct vb2_sha1_context *ctx,
 		     const uint8_t *data,
 		     uint32_t size)
 {
 	int i = (int)(ctx->count % sizeof(ctx->buf));
 	const uint8_t* p = (const uint8_t*) data;
+	uint32_t nr;
 
 	ctx->count += size;
 
-	while (size--) {
+	while (size) {
+		if (!i && size >= sizeof(ctx->buf)) {
+			nr = size / sizeof(ctx->buf);
+			sha1_blocks(ctx, p, nr);
+			p += nr * sizeof(ctx->buf);
+			size -= nr * sizeof(ctx->buf);
+			continue;
+		}
+		size--;
 		ctx->buf[i++] = *p++;
 		if (i == sizeof(ctx->buf)) {
 			sha1_transform(ctx);
@@ -141,6 +141,12 @@ static void vb2_sha256_transform(struct vb2_sha256_context *ctx,
 	int j;
 #endif
 
+#ifdef CONFIG_X86
+	i = x86_sha256_blocks(ctx->h, message, block_nb);
+	message += i << 6;
+	block_nb -= i;
+#endif
+
 	for (i = 0; i < (int) block_nb; i++) {
 		sub_block = message + (i << 6);
 
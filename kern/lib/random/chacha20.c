@@ -0,0 +1,54 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * ChaCha20 block function.  See chacha20.h. */
+
+#include <random/chacha20.h>
+
+#define ROTL32(v, n)			(((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(x, a, b, c, d)										\
+do {																	\
+	x[a] += x[b]; x[d] = ROTL32(x[d] ^ x[a], 16);						\
+	x[c] += x[d]; x[b] = ROTL32(x[b] ^ x[c], 12);						\
+	x[a] += x[b]; x[d] = ROTL32(x[d] ^ x[a], 8);						\
+	x[c] += x[d]; x[b] = ROTL32(x[b] ^ x[c], 7);						\
+} while (0)
+
+void chacha20_block(const uint32_t key[CHACHA20_KEY_SZ / 4], uint64_t counter,
+                    uint64_t nonce, uint8_t out[CHACHA20_BLOCK_SZ])
+{
+	uint32_t in[16], x[16];
+
+	/* "expand 32-byte k" */
+	in[0] = 0x61707865;
+	in[1] = 0x3320646e;
+	in[2] = 0x79622d32;
+	in[3] = 0x6b206574;
+	for (int i = 0; i < 8; i++)
+		in[4 + i] = key[i];
+	in[12] = counter;
+	in[13] = counter >> 32;
+	in[14] = nonce;
+	in[15] = nonce >> 32;
+	for (int i = 0; i < 16; i++)
+		x[i] = in[i];
+	for (int i = 0; i < 10; i++) {
+		QUARTERROUND(x, 0, 4, 8, 12);
+		QUARTERROUND(x, 1, 5, 9, 13);
+		QUARTERROUND(x, 2, 6, 10, 14);
+		QUARTERROUND(x, 3, 7, 11, 15);
+		QUARTERROUND(x, 0, 5, 10, 15);
+		QUARTERROUND(x, 1, 6, 11, 12);
+		QUARTERROUND(x, 2, 7, 8, 13);
+		QUARTERROUND(x, 3, 4, 9, 14);
+	}
+	/* The keystream is little-endian, whatever we are */
+	for (int i = 0; i < 16; i++) {
+		x[i] += in[i];
+		out[i * 4 + 0] = x[i];
+		out[i * 4 + 1] = x[i] >> 8;
+		out[i * 4 + 2] = x[i] >> 16;
+		out[i * 4 + 3] = x[i] >> 24;
+	}
+}
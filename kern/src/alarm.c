@@ -6,6 +6,9 @@
  * per-core, global or whatever.  Like with most systems, you won't wake up til
  * after the time you specify. (for now, this might change).
  *
+ * Each tchain is a hierarchical timer wheel (Varghese and Lauck), so setting
+ * and unsetting alarms doesn't depend on how many are pending.
+ *
  * TODO:
  * 	- have a kernel sense of time, instead of just the TSC or whatever timer the
  * 	chain uses...
@@ -20,19 +23,152 @@
 #include <smp.h>
 #include <kmalloc.h>
 
-/* Helper, resets the earliest/latest times, based on the elements of the list.
- * If the list is empty, we set the times to be the 12345 poison time.  Since
- * the list is empty, the alarm shouldn't be going off. */
+/* Timer wheel internals.  Waiters are unsorted in their slots.  A waiter due
+ * within a lap of wheel_clk goes in level 0, at the slot for its time.  One due
+ * later goes in the first level whose lap covers it, in the slot whose range
+ * holds its time.  When wheel_clk reaches a higher level slot's start, we
+ * cascade that slot: its waiters get reinserted, which moves them down.  Each
+ * waiter cascades at most once per level, and a slot's waiters never expire
+ * before the slot's start.  Anything past the top level's lap is parked in the
+ * top level's farthest slot, and comes back around later. */
+
+static uint64_t lvl_shift(int lvl)
+{
+	return lvl * ALARM_WHEEL_LVL_BITS;
+}
+
+static uint64_t ror64(uint64_t x, unsigned int n)
+{
+	n &= 63;
+	return n ? (x >> n) | (x << (64 - n)) : x;
+}
+
+static void __wheel_insert(struct timer_chain *tchain,
+                           struct alarm_waiter *waiter)
+{
+	uint64_t expires = waiter->wake_up_time >> ALARM_WHEEL_SHIFT;
+	uint64_t delta, max_delta;
+	int lvl, idx;
+
+	/* Anything in the past goes in the current slot, which runs next */
+	expires = MAX(expires, tchain->wheel_clk);
+	delta = expires - tchain->wheel_clk;
+	for (lvl = 0; lvl < ALARM_WHEEL_LEVELS - 1; lvl++) {
+		if (delta < 1ULL << lvl_shift(lvl + 1))
+			break;
+	}
+	max_delta = (1ULL << lvl_shift(ALARM_WHEEL_LEVELS)) - 1;
+	if (delta > max_delta)
+		expires = tchain->wheel_clk + max_delta;
+	idx = (expires >> lvl_shift(lvl)) & ALARM_WHEEL_LVL_MASK;
+	BSD_LIST_INSERT_HEAD(&tchain->wheel[lvl][idx], waiter, next);
+	tchain->wheel_bitmap[lvl] |= 1ULL << idx;
+	waiter->wheel_lvl = lvl;
+	waiter->wheel_idx = idx;
+}
+
+static void __wheel_remove(struct timer_chain *tchain,
+                           struct alarm_waiter *waiter)
+{
+	int lvl = waiter->wheel_lvl;
+	int idx = waiter->wheel_idx;
+
+	BSD_LIST_REMOVE(waiter, next);
+	if (BSD_LIST_EMPTY(&tchain->wheel[lvl][idx]))
+		tchain->wheel_bitmap[lvl] &= ~(1ULL << idx);
+}
+
+/* Returns the wheel_clk at which lvl next needs attention, or -1 if the level
+ * is empty.  For level 0, that's when its first waiters are due.  For the
+ * others, it's when their first non-empty slot cascades.  The current slot on
+ * those levels cascaded when we got to it, so it goes last. */
+static uint64_t __wheel_lvl_next(struct timer_chain *tchain, int lvl)
+{
+	uint64_t bitmap = tchain->wheel_bitmap[lvl];
+	uint64_t lap_nr = tchain->wheel_clk >> lvl_shift(lvl);
+	unsigned int cur = lap_nr & ALARM_WHEEL_LVL_MASK;
+
+	if (!bitmap)
+		return (uint64_t)-1;
+	if (!lvl)
+		return tchain->wheel_clk + __builtin_ctzll(ror64(bitmap, cur));
+	lap_nr += __builtin_ctzll(ror64(bitmap, cur + 1)) + 1;
+	return lap_nr << lvl_shift(lvl);
+}
+
+static uint64_t __wheel_next(struct timer_chain *tchain)
+{
+	uint64_t next = (uint64_t)-1;
+
+	for (int i = 0; i < ALARM_WHEEL_LEVELS; i++)
+		next = MIN(next, __wheel_lvl_next(tchain, i));
+	return next;
+}
+
+/* Reinserts the waiters of the slots that start at wheel_clk. */
+static void __wheel_cascade(struct timer_chain *tchain)
+{
+	struct awaiter_list slot = BSD_LIST_HEAD_INITIALIZER(slot);
+	struct alarm_waiter *i;
+	uint64_t clk = tchain->wheel_clk;
+	int idx;
+
+	for (int lvl = 1; lvl < ALARM_WHEEL_LEVELS; lvl++) {
+		if (clk & ((1ULL << lvl_shift(lvl)) - 1))
+			break;
+		idx = (clk >> lvl_shift(lvl)) & ALARM_WHEEL_LVL_MASK;
+		BSD_LIST_SWAP(&slot, &tchain->wheel[lvl][idx], alarm_waiter, next);
+		tchain->wheel_bitmap[lvl] &= ~(1ULL << idx);
+		while ((i = BSD_LIST_FIRST(&slot))) {
+			BSD_LIST_REMOVE(i, next);
+			__wheel_insert(tchain, i);
+		}
+	}
+}
+
+/* The latest the waiter can go off */
+static uint64_t awaiter_deadline(struct alarm_waiter *waiter)
+{
+	uint64_t deadline = waiter->wake_up_time + waiter->slack;
+
+	return deadline < waiter->wake_up_time ? (uint64_t)-1 : deadline;
+}
+
+/* Helper, resets the earliest time, based on the wheel.  If the wheel is
+ * empty, we set the time to be the 12345 poison time.  Since the wheel is
+ * empty, the alarm shouldn't be going off.
+ *
+ * The interrupt goes off at the earliest deadline, and everyone who is due by
+ * then runs with it; that's how slack coalesces alarms.  Only level 0 gets
+ * scanned for deadlines, and only until its slots start after the best one so
+ * far.  Otherwise, we wake up when the next slot cascades, which is never after
+ * its waiters. */
 static void reset_tchain_times(struct timer_chain *tchain)
 {
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	struct alarm_waiter *i;
+	uint64_t next, clk;
+	int idx;
+
+	if (!tchain->nr_waiters) {
 		tchain->earliest_time = ALARM_POISON_TIME;
-		tchain->latest_time = ALARM_POISON_TIME;
-	} else {
-		tchain->earliest_time = TAILQ_FIRST(&tchain->waiters)->wake_up_time;
-		tchain->latest_time =
-		        TAILQ_LAST(&tchain->waiters, awaiters_tailq)->wake_up_time;
+		return;
 	}
+	next = (uint64_t)-1;
+	for (int lvl = 1; lvl < ALARM_WHEEL_LEVELS; lvl++)
+		next = MIN(next, __wheel_lvl_next(tchain, lvl));
+	if (next != (uint64_t)-1)
+		next <<= ALARM_WHEEL_SHIFT;
+	clk = tchain->wheel_clk;
+	for (int j = 0; j < ALARM_WHEEL_LVL_SZ; j++, clk++) {
+		if (clk << ALARM_WHEEL_SHIFT >= next)
+			break;
+		idx = clk & ALARM_WHEEL_LVL_MASK;
+		if (!(tchain->wheel_bitmap[0] & (1ULL << idx)))
+			continue;
+		BSD_LIST_FOREACH(i, &tchain->wheel[0][idx], next)
+			next = MIN(next, awaiter_deadline(i));
+	}
+	tchain->earliest_time = next;
 }
 
 /* One time set up of a tchain, currently called in per_cpu_init() */
@@ -40,7 +176,13 @@ void init_timer_chain(struct timer_chain *tchain,
                       void (*set_interrupt)(struct timer_chain *))
 {
 	spinlock_init_irqsave(&tchain->lock);
-	TAILQ_INIT(&tchain->waiters);
+	for (int i = 0; i < ALARM_WHEEL_LEVELS; i++) {
+		for (int j = 0; j < ALARM_WHEEL_LVL_SZ; j++)
+			BSD_LIST_INIT(&tchain->wheel[i][j]);
+		tchain->wheel_bitmap[i] = 0;
+	}
+	tchain->wheel_clk = read_tsc() >> ALARM_WHEEL_SHIFT;
+	tchain->nr_waiters = 0;
 	tchain->set_interrupt = set_interrupt;
 	reset_tchain_times(tchain);
 }
@@ -48,6 +190,7 @@ void init_timer_chain(struct timer_chain *tchain,
 static void __init_awaiter(struct alarm_waiter *waiter)
 {
 	waiter->wake_up_time = ALARM_POISON_TIME;
+	waiter->slack = 0;
 	waiter->on_tchain = FALSE;
 	waiter->holds_tchain_lock = FALSE;
 }
@@ -101,12 +244,26 @@ void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 	waiter->wake_up_time += usec2tsc(usleep);
 }
 
+/* Lets the alarm go off up to slack_usec late, so that it can share an
+ * interrupt with its neighbors.  This sticks until you change it. */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t slack_usec)
+{
+	waiter->slack = usec2tsc(slack_usec);
+}
+
+void set_awaiter_rel_slack(struct alarm_waiter *waiter, uint64_t usleep,
+                           uint64_t slack_usec)
+{
+	set_awaiter_slack(waiter, slack_usec);
+	set_awaiter_rel(waiter, usleep);
+}
+
 /* Helper, makes sure the interrupt is turned on at the right time.  Most of the
  * heavy lifting is in the timer-source specific function pointer. */
 static void reset_tchain_interrupt(struct timer_chain *tchain)
 {
 	assert(!irq_is_enabled());
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	if (!tchain->nr_waiters) {
 		/* Turn it off */
 		printd("Turning alarm off\n");
 		tchain->set_interrupt(tchain);
@@ -150,39 +307,67 @@ static void wake_awaiter(struct alarm_waiter *waiter,
 	}
 }
 
+/* Helper, wakes the waiters in wheel_clk's level 0 slot that are due.  Caller
+ * holds the lock. */
+static void __run_wheel_slot(struct timer_chain *tchain, uint64_t now,
+                             struct hw_trapframe *hw_tf)
+{
+	struct awaiter_list slot = BSD_LIST_HEAD_INITIALIZER(slot);
+	struct alarm_waiter *i;
+	int idx = tchain->wheel_clk & ALARM_WHEEL_LVL_MASK;
+
+	/* Handlers can rearm into this slot, so we work off a private list */
+	BSD_LIST_SWAP(&slot, &tchain->wheel[0][idx], alarm_waiter, next);
+	tchain->wheel_bitmap[0] &= ~(1ULL << idx);
+	while ((i = BSD_LIST_FIRST(&slot))) {
+		printd("Trying to wake up %p who is due at %llu and now is %llu\n",
+		       i, i->wake_up_time, now);
+		BSD_LIST_REMOVE(i, next);
+		if (i->wake_up_time > now) {
+			/* Only in the slot for now, which we don't run past */
+			__wheel_insert(tchain, i);
+			continue;
+		}
+		tchain->nr_waiters--;
+		i->on_tchain = FALSE;
+		cmb();	/* enforce waking after removal */
+		/* Don't touch the waiter after waking it, since it could be in use
+		 * on another core (and the waiter can be clobbered as the kthread
+		 * unwinds its stack).  Or it could be kfreed */
+		wake_awaiter(i, hw_tf);
+	}
+}
+
 /* This is called when an interrupt triggers a tchain, and needs to wake up
  * everyone whose time is up.  Called from IRQ context. */
 void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 {
-	struct alarm_waiter *i, *temp;
 	uint64_t now = read_tsc();
-	bool changed_list = FALSE;
+	uint64_t now_clk = now >> ALARM_WHEEL_SHIFT;
+	uint64_t next;
+
 	/* why do we disable irqs here?  the lock is irqsave, but we (think we) know
 	 * the timer IRQ for this tchain won't fire again.  disabling irqs is nice
 	 * for the lock debugger.  i don't want to disable the debugger completely,
 	 * and we can't make the debugger ignore irq context code either in the
 	 * general case.  it might be nice for handlers to have IRQs disabled too.*/
 	spin_lock_irqsave(&tchain->lock);
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		printd("Trying to wake up %p who is due at %llu and now is %llu\n",
-		       i, i->wake_up_time, now);
-		/* TODO: Could also do something in cases where we're close to now */
-		if (i->wake_up_time <= now) {
-			changed_list = TRUE;
-			i->on_tchain = FALSE;
-			TAILQ_REMOVE(&tchain->waiters, i, next);
-			cmb();	/* enforce waking after removal */
-			/* Don't touch the waiter after waking it, since it could be in use
-			 * on another core (and the waiter can be clobbered as the kthread
-			 * unwinds its stack).  Or it could be kfreed */
-			wake_awaiter(i, hw_tf);
-		} else {
+	/* Jump from one interesting slot to the next, up to now.  Handlers that
+	 * rearm in the past will run again, unless we're already at now. */
+	while (tchain->nr_waiters) {
+		next = __wheel_next(tchain);
+		if (next > now_clk)
 			break;
+		if (next != tchain->wheel_clk) {
+			tchain->wheel_clk = next;
+			__wheel_cascade(tchain);
+			continue;
 		}
+		__run_wheel_slot(tchain, now, hw_tf);
+		if (next == now_clk)
+			break;
 	}
-	if (changed_list) {
-		reset_tchain_times(tchain);
-	}
+	reset_tchain_times(tchain);
 	/* Need to reset the interrupt no matter what */
 	reset_tchain_interrupt(tchain);
 	spin_unlock_irqsave(&tchain->lock);
@@ -193,45 +378,23 @@ void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 static bool __insert_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *i, *temp;
 	/* This will fail if you don't set a time */
 	assert(waiter->wake_up_time != ALARM_POISON_TIME);
 	assert(!waiter->on_tchain);
 	waiter->on_tchain = TRUE;
-	/* Either the list is empty, or not. */
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = waiter->wake_up_time;
-		tchain->latest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Need to turn on the timer interrupt later */
+	/* An empty wheel's clock may be way behind.  Catch it up, so we don't
+	 * cascade through slots that are long gone. */
+	if (!tchain->nr_waiters)
+		tchain->wheel_clk = MAX(tchain->wheel_clk,
+		                        read_tsc() >> ALARM_WHEEL_SHIFT);
+	__wheel_insert(tchain, waiter);
+	if (!tchain->nr_waiters++ ||
+	    (awaiter_deadline(waiter) < tchain->earliest_time)) {
+		tchain->earliest_time = awaiter_deadline(waiter);
+		/* Need to reset the timer interrupt later */
 		return TRUE;
 	}
-	/* If not, either we're first, last, or in the middle.  Reset the interrupt
-	 * and adjust the tchain's times accordingly. */
-	if (waiter->wake_up_time < tchain->earliest_time) {
-		tchain->earliest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Changed the first entry; we'll need to reset the interrupt later */
-		return TRUE;
-	}
-	/* If there is a tie for last, the newer one will really go last.  We need
-	 * to handle equality here since the loop later won't catch it. */
-	if (waiter->wake_up_time >= tchain->latest_time) {
-		tchain->latest_time = waiter->wake_up_time;
-		/* Proactively put it at the end if we know we're last */
-		TAILQ_INSERT_TAIL(&tchain->waiters, waiter, next);
-		return FALSE;
-	}
-	/* Insert before the first one you are earlier than.  This won't scale well
-	 * (TODO) if we have a lot of inserts.  The proactive insert_tail up above
-	 * will help a bit. */
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		if (waiter->wake_up_time < i->wake_up_time) {
-			TAILQ_INSERT_BEFORE(i, waiter, next);
-			return FALSE;
-		}
-	}
-	panic("Could not find a spot for awaiter %p\n", waiter);
+	return FALSE;
 }
 
 static void __set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
@@ -272,28 +435,22 @@ void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
 		return __set_alarm_rkm(tchain, waiter);
 }
 
-/* Helper, rips the waiter from the tchain, knowing that it is on the list.
+/* Helper, rips the waiter from the tchain, knowing that it is on the wheel.
  * Returns TRUE if the tchain interrupt needs to be reset.  Callers hold the
- * lock. */
+ * lock.
+ *
+ * We leave earliest_time alone unless the wheel empties.  If this waiter was
+ * the earliest, the interrupt goes off early, finds nothing, and looks again.
+ * That beats searching the wheel on every unset. */
 static bool __remove_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *temp;
-	bool reset_int = FALSE;		/* whether or not to reset the interrupt */
-	/* Need to make sure earliest and latest are set, in case we're mucking with
-	 * the first and/or last element of the chain. */
-	if (TAILQ_FIRST(&tchain->waiters) == waiter) {
-		temp = TAILQ_NEXT(waiter, next);
-		tchain->earliest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
-		reset_int = TRUE;		/* we'll need to reset the timer later */
-	}
-	if (TAILQ_LAST(&tchain->waiters, awaiters_tailq) == waiter) {
-		temp = TAILQ_PREV(waiter, awaiters_tailq, next);
-		tchain->latest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
-	}
-	TAILQ_REMOVE(&tchain->waiters, waiter, next);
+	__wheel_remove(tchain, waiter);
 	waiter->on_tchain = FALSE;
-	return reset_int;
+	if (--tchain->nr_waiters)
+		return FALSE;
+	tchain->earliest_time = ALARM_POISON_TIME;
+	return TRUE;
 }
 
 static bool __unset_alarm_irq(struct timer_chain *tchain,
@@ -413,7 +570,7 @@ bool reset_alarm_rel(struct timer_chain *tchain, struct alarm_waiter *waiter,
  * locking). */
 void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 {
-	uint64_t time, rel_usec, now;
+	uint64_t time;
 	int pcoreid = core_id();
 	struct per_cpu_info *rem_pcpui, *pcpui = &per_cpu_info[pcoreid];
 	struct timer_chain *pcpui_tchain = &pcpui->tchain;
@@ -430,19 +587,12 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 		send_ipi(rem_pcpui - &per_cpu_info[0], IdtLAPIC_TIMER);
 		return;
 	}
-	time = TAILQ_EMPTY(&tchain->waiters) ? 0 : tchain->earliest_time;
+	time = tchain->nr_waiters ? tchain->earliest_time : 0;
 	if (time) {
-		/* Arm the alarm.  For times in the past, we just need to make sure it
-		 * goes off. */
-		now = read_tsc();
-		if (time <= now)
-			rel_usec = 1;
-		else
-			rel_usec = tsc2usec(time - now);
-		rel_usec = MAX(rel_usec, 1);
-		printd("Setting alarm for %llu, it is now %llu, rel_time %llu "
-		       "tchain %p\n", time, now, rel_usec, pcpui_tchain);
-		set_core_timer(rel_usec, FALSE);
+		/* Arm the alarm.  The arch handles times in the past. */
+		printd("Setting alarm for %llu, it is now %llu, tchain %p\n", time,
+		       read_tsc(), pcpui_tchain);
+		set_core_timer_deadline(time);
 	} else  {
 		/* Disarm */
 		set_core_timer(0, FALSE);
@@ -455,22 +605,26 @@ void print_chain(struct timer_chain *tchain)
 {
 	struct alarm_waiter *i;
 	spin_lock_irqsave(&tchain->lock);
-	printk("Chain %p is%s empty, early: %llu latest: %llu\n", tchain,
-	       TAILQ_EMPTY(&tchain->waiters) ? "" : " not",
-	       tchain->earliest_time,
-	       tchain->latest_time);
-	TAILQ_FOREACH(i, &tchain->waiters, next) {
-		uintptr_t f;
-		char *f_name;
-
-		if (i->irq_ok)
-			f = (uintptr_t)i->func_irq;
-		else
-			f = (uintptr_t)i->func;
-		f_name = get_fn_name(f);
-		printk("\tWaiter %p, time %llu, func %p (%s)\n", i,
-		       i->wake_up_time, f, f_name);
-		kfree(f_name);
+	printk("Chain %p has %lu waiters, early: %llu, clk: %llu\n", tchain,
+	       tchain->nr_waiters, tchain->earliest_time,
+	       tchain->wheel_clk << ALARM_WHEEL_SHIFT);
+	for (int lvl = 0; lvl < ALARM_WHEEL_LEVELS; lvl++) {
+		for (int idx = 0; idx < ALARM_WHEEL_LVL_SZ; idx++) {
+			BSD_LIST_FOREACH(i, &tchain->wheel[lvl][idx], next) {
+				uintptr_t f;
+				char *f_name;
+
+				if (i->irq_ok)
+					f = (uintptr_t)i->func_irq;
+				else
+					f = (uintptr_t)i->func;
+				f_name = get_fn_name(f);
+				printk("\tWaiter %p, time %llu, slack %llu, slot %d/%d, "
+				       "func %p (%s)\n", i, i->wake_up_time, i->slack, lvl,
+				       idx, f, f_name);
+				kfree(f_name);
+			}
+		}
 	}
 	spin_unlock_irqsave(&tchain->lock);
 }
@@ -0,0 +1,287 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Resource arenas.  See arena.h for the design.
+ *
+ * Lock ordering: qcache -> arena lock.  We never call into the slab allocator
+ * while holding the arena lock; allocs grab their spare btag beforehand, and
+ * frees give back their coalesced btags afterwards. */
+
+#include <arena.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+static struct kmem_cache *btag_kcache;
+
+void arena_init(struct arena *arena, const char *name, size_t quantum,
+                size_t qcache_max)
+{
+	assert(IS_PWR2(quantum));
+	if (!btag_kcache)
+		btag_kcache = kmem_cache_create("btag", sizeof(struct btag),
+		                                __alignof__(struct btag), 0, 0, 0);
+	memset(arena, 0, sizeof(struct arena));
+	spinlock_init(&arena->lock);
+	strlcpy(arena->name, name, ARENA_NAME_SZ);
+	arena->quantum = quantum;
+	arena->qshift = LOG2_DOWN(quantum);
+	arena->nr_qcaches = MIN(qcache_max >> arena->qshift, ARENA_NR_QCACHES);
+	TAILQ_INIT(&arena->all_segs);
+	for (int i = 0; i < ARENA_NR_FREE_LISTS; i++)
+		BSD_LIST_INIT(&arena->free_segs[i]);
+	for (int i = 0; i < ARENA_ALLOC_HASH_SZ; i++)
+		BSD_LIST_INIT(&arena->alloc_hash[i]);
+	for (int i = 0; i < arena->nr_qcaches; i++)
+		spinlock_init(&arena->qcaches[i].lock);
+}
+
+/* Free segments of n quanta are on list LOG2_DOWN(n). */
+static struct btag_list *free_list_of(struct arena *arena, size_t size)
+{
+	return &arena->free_segs[LOG2_DOWN(size >> arena->qshift)];
+}
+
+static struct btag_list *hash_list_of(struct arena *arena, uintptr_t start)
+{
+	return &arena->alloc_hash[(start >> arena->qshift) % ARENA_ALLOC_HASH_SZ];
+}
+
+static void __insert_free(struct arena *arena, struct btag *bt)
+{
+	bt->status = BTAG_FREE;
+	BSD_LIST_INSERT_HEAD(free_list_of(arena, bt->size), bt, misc_link);
+}
+
+/* Instant fit: any segment on a list at or above LOG2_UP(n) is big enough.
+ * If those are all empty, our own size class might still have one that fits.
+ * Hold the lock. */
+static struct btag *__find_free_seg(struct arena *arena, size_t size)
+{
+	size_t nr_quanta = size >> arena->qshift;
+	int up = LOG2_UP(nr_quanta);
+	int down = LOG2_DOWN(nr_quanta);
+	struct btag *bt;
+
+	for (int i = up; i < ARENA_NR_FREE_LISTS; i++) {
+		bt = BSD_LIST_FIRST(&arena->free_segs[i]);
+		if (bt)
+			return bt;
+	}
+	if (up != down) {
+		BSD_LIST_FOREACH(bt, &arena->free_segs[down], misc_link) {
+			if (bt->size >= size)
+				return bt;
+		}
+	}
+	return NULL;
+}
+
+/* Adds the span [base, base + size) to the arena.  Spans can't overlap, and
+ * both base and size need to be quantum aligned.  Returns 0 or -ENOMEM. */
+int arena_add(struct arena *arena, uintptr_t base, size_t size, int flags)
+{
+	struct btag *bt, *bt_i;
+
+	assert(!(base & (arena->quantum - 1)) && !(size & (arena->quantum - 1)));
+	assert(base && size);
+	bt = kmem_cache_alloc(btag_kcache, flags);
+	if (!bt)
+		return -ENOMEM;
+	bt->start = base;
+	bt->size = size;
+	spin_lock(&arena->lock);
+	TAILQ_FOREACH(bt_i, &arena->all_segs, all_link) {
+		if (bt_i->start > base)
+			break;
+		assert(bt_i->start + bt_i->size <= base);
+	}
+	if (bt_i) {
+		assert(base + size <= bt_i->start);
+		TAILQ_INSERT_BEFORE(bt_i, bt, all_link);
+	} else {
+		TAILQ_INSERT_TAIL(&arena->all_segs, bt, all_link);
+	}
+	__insert_free(arena, bt);
+	arena->amt_total += size;
+	spin_unlock(&arena->lock);
+	return 0;
+}
+
+static uintptr_t __arena_alloc(struct arena *arena, size_t size, int flags)
+{
+	struct btag *bt, *spare;
+
+	/* We need at most one new btag, for the remainder of a split */
+	spare = kmem_cache_alloc(btag_kcache, flags);
+	if (!spare)
+		return 0;
+	spin_lock(&arena->lock);
+	bt = __find_free_seg(arena, size);
+	if (!bt) {
+		spin_unlock(&arena->lock);
+		kmem_cache_free(btag_kcache, spare);
+		return 0;
+	}
+	BSD_LIST_REMOVE(bt, misc_link);
+	if (bt->size > size) {
+		spare->start = bt->start + size;
+		spare->size = bt->size - size;
+		TAILQ_INSERT_AFTER(&arena->all_segs, bt, spare, all_link);
+		__insert_free(arena, spare);
+		bt->size = size;
+		spare = NULL;
+	}
+	bt->status = BTAG_ALLOC;
+	BSD_LIST_INSERT_HEAD(hash_list_of(arena, bt->start), bt, misc_link);
+	arena->amt_alloc += size;
+	arena->nr_allocs_ever++;
+	spin_unlock(&arena->lock);
+	if (spare)
+		kmem_cache_free(btag_kcache, spare);
+	return bt->start;
+}
+
+/* Returns the start of a segment of at least size (rounded up to the quantum),
+ * or 0 if the arena is out of space or we couldn't get a btag. */
+uintptr_t arena_alloc(struct arena *arena, size_t size, int flags)
+{
+	struct arena_qcache *qc;
+	uintptr_t ret;
+
+	size = ROUNDUP(size, arena->quantum);
+	if (!size)
+		return 0;
+	if ((size >> arena->qshift) <= arena->nr_qcaches) {
+		qc = &arena->qcaches[(size >> arena->qshift) - 1];
+		spin_lock(&qc->lock);
+		if (qc->nr_segs) {
+			ret = qc->segs[--qc->nr_segs];
+			qc->nr_hits++;
+			spin_unlock(&qc->lock);
+			return ret;
+		}
+		qc->nr_misses++;
+		spin_unlock(&qc->lock);
+	}
+	return __arena_alloc(arena, size, flags);
+}
+
+/* Merges bt with its right neighbor, if it is free, returning the neighbor's
+ * btag for our caller to free.  Hold the lock. */
+static struct btag *__merge_right(struct arena *arena, struct btag *bt)
+{
+	struct btag *next = TAILQ_NEXT(bt, all_link);
+
+	if (!next || (next->status != BTAG_FREE) ||
+	    (bt->start + bt->size != next->start))
+		return NULL;
+	BSD_LIST_REMOVE(next, misc_link);
+	TAILQ_REMOVE(&arena->all_segs, next, all_link);
+	bt->size += next->size;
+	return next;
+}
+
+static void __arena_free(struct arena *arena, uintptr_t addr, size_t size)
+{
+	struct btag *bt, *prev, *to_free[2] = {0};
+
+	spin_lock(&arena->lock);
+	BSD_LIST_FOREACH(bt, hash_list_of(arena, addr), misc_link) {
+		if (bt->start == addr)
+			break;
+	}
+	if (!bt || (bt->size != size)) {
+		spin_unlock(&arena->lock);
+		warn("Arena %s: bad free of %p, size %p", arena->name, addr, size);
+		return;
+	}
+	BSD_LIST_REMOVE(bt, misc_link);
+	bt->status = BTAG_FREE;
+	arena->amt_alloc -= size;
+	to_free[0] = __merge_right(arena, bt);
+	prev = TAILQ_PREV(bt, btag_tailq, all_link);
+	if (prev && (prev->status == BTAG_FREE) &&
+	    (prev->start + prev->size == bt->start)) {
+		BSD_LIST_REMOVE(prev, misc_link);
+		TAILQ_REMOVE(&arena->all_segs, bt, all_link);
+		prev->size += bt->size;
+		to_free[1] = bt;
+		bt = prev;
+	}
+	__insert_free(arena, bt);
+	spin_unlock(&arena->lock);
+	for (int i = 0; i < 2; i++) {
+		if (to_free[i])
+			kmem_cache_free(btag_kcache, to_free[i]);
+	}
+}
+
+/* Gives back a segment from arena_alloc().  size must match the alloc. */
+void arena_free(struct arena *arena, uintptr_t addr, size_t size)
+{
+	struct arena_qcache *qc;
+
+	size = ROUNDUP(size, arena->quantum);
+	if ((size >> arena->qshift) <= arena->nr_qcaches) {
+		qc = &arena->qcaches[(size >> arena->qshift) - 1];
+		spin_lock(&qc->lock);
+		if (qc->nr_segs < ARENA_QCACHE_DEPTH) {
+			qc->segs[qc->nr_segs++] = addr;
+			spin_unlock(&qc->lock);
+			return;
+		}
+		spin_unlock(&qc->lock);
+	}
+	__arena_free(arena, addr, size);
+}
+
+/* Drains the quantum caches, so their segments can coalesce. */
+void arena_reap(struct arena *arena)
+{
+	struct arena_qcache *qc;
+	uintptr_t segs[ARENA_QCACHE_DEPTH];
+	unsigned int nr;
+
+	for (int i = 0; i < arena->nr_qcaches; i++) {
+		qc = &arena->qcaches[i];
+		spin_lock(&qc->lock);
+		nr = qc->nr_segs;
+		memcpy(segs, qc->segs, nr * sizeof(uintptr_t));
+		qc->nr_segs = 0;
+		spin_unlock(&qc->lock);
+		for (int j = 0; j < nr; j++)
+			__arena_free(arena, segs[j], (i + 1) << arena->qshift);
+	}
+}
+
+void print_arena_stats(struct arena *arena)
+{
+	struct btag *bt;
+	size_t nr_free = 0, nr_alloc = 0, largest_free = 0;
+	struct arena_qcache *qc;
+
+	spin_lock(&arena->lock);
+	TAILQ_FOREACH(bt, &arena->all_segs, all_link) {
+		if (bt->status == BTAG_FREE) {
+			nr_free++;
+			largest_free = MAX(largest_free, bt->size);
+		} else {
+			nr_alloc++;
+		}
+	}
+	printk("Arena %s: quantum %p, total %p, alloc %p, allocs ever %lu\n",
+	       arena->name, arena->quantum, arena->amt_total, arena->amt_alloc,
+	       arena->nr_allocs_ever);
+	printk("\tSegments: %lu free (largest %p), %lu alloc\n", nr_free,
+	       largest_free, nr_alloc);
+	spin_unlock(&arena->lock);
+	for (int i = 0; i < arena->nr_qcaches; i++) {
+		qc = &arena->qcaches[i];
+		printk("\tQcache %p: %u segs, %lu hits, %lu misses\n",
+		       (i + 1) << arena->qshift, qc->nr_segs, qc->nr_hits,
+		       qc->nr_misses);
+	}
+}
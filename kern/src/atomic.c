@@ -10,6 +10,7 @@
 #include <smp.h>
 #include <kmalloc.h>
 #include <kdebug.h>
+#include <lockprof.h>
 
 static void increase_lock_depth(uint32_t coreid)
 {
@@ -38,27 +39,14 @@ static bool can_trace(spinlock_t *lock)
 	return TRUE;
 }
 
-/* spinlock and trylock call this after locking */
-static void post_lock(spinlock_t *lock, uint32_t coreid)
-{
-	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
-	if ((pcpui->__lock_checking_enabled == 1) && can_trace(lock))
-		pcpui_trace_locks(pcpui, lock);
-	lock->call_site = get_caller_pc();
-	lock->calling_core = coreid;
-	/* TODO consider merging this with __ctx_depth (unused field) */
-	increase_lock_depth(lock->calling_core);
-}
-
-void spin_lock(spinlock_t *lock)
+static void pre_lock(spinlock_t *lock, uint32_t coreid)
 {
-	uint32_t coreid = core_id_early();
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
 	/* Short circuit our lock checking, so we can print or do other things to
 	 * announce the failure that require locks.  Also avoids anything else
 	 * requiring pcpui initialization. */
 	if (pcpui->__lock_checking_enabled != 1)
-		goto lock;
+		return;
 	if (lock->irq_okay) {
 		if (!can_spinwait_irq(pcpui)) {
 			pcpui->__lock_checking_enabled--;
@@ -74,49 +62,156 @@ void spin_lock(spinlock_t *lock)
 			pcpui->__lock_checking_enabled++;
 		}
 	}
-lock:
-	__spin_lock(lock);
-	/* Memory barriers are handled by the particular arches */
-	post_lock(lock, coreid);
 }
 
-/* Trylock doesn't check for irq/noirq, in case we want to try and lock a
- * non-irqsave lock from irq context. */
-bool spin_trylock(spinlock_t *lock)
+/* spinlock and trylock call this after locking */
+static void post_lock(spinlock_t *lock, uint32_t coreid, uintptr_t site)
 {
-	uint32_t coreid = core_id_early();
-	bool ret = __spin_trylock(lock);
-	if (ret)
-		post_lock(lock, coreid);
-	return ret;
+	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
+	if ((pcpui->__lock_checking_enabled == 1) && can_trace(lock))
+		pcpui_trace_locks(pcpui, lock);
+	lock->call_site = site;
+	lock->calling_core = coreid;
+	/* TODO consider merging this with __ctx_depth (unused field) */
+	increase_lock_depth(lock->calling_core);
 }
 
-void spin_unlock(spinlock_t *lock)
+static void pre_unlock(spinlock_t *lock)
 {
 	decrease_lock_depth(lock->calling_core);
-	/* Memory barriers are handled by the particular arches */
 	assert(spin_locked(lock));
-	__spin_unlock(lock);
 }
 
 void spinlock_debug(spinlock_t *lock)
 {
 	uintptr_t pc = lock->call_site;
-	char *func_name;
+	const char *func_name;
 
 	if (!pc) {
 		printk("Lock %p: never locked\n", lock);
 		return;
 	}
-	func_name = get_fn_name(pc);
+	func_name = lookup_fn_name(pc);
 	printk("Lock %p: currently %slocked.  Last locked at [<%p>] in %s on "
 	       "core %d\n", lock, spin_locked(lock) ? "" : "un", pc, func_name,
 	       lock->calling_core);
-	kfree(func_name);
+}
+
+#else
+
+static void pre_lock(spinlock_t *lock, uint32_t coreid)
+{
+}
+
+static void post_lock(spinlock_t *lock, uint32_t coreid, uintptr_t site)
+{
+}
+
+static void pre_unlock(spinlock_t *lock)
+{
 }
 
 #endif /* CONFIG_SPINLOCK_DEBUG */
 
+#ifdef CONFIG_LOCK_PROFILE
+
+/* Locks, timing how long we wait if we have to, and notes when and where we
+ * got it for the unlock. */
+static void lockprof_spin_lock(spinlock_t *lock, uintptr_t site)
+{
+	uint64_t start;
+	bool contended = FALSE;
+
+	if (likely(!lockprof_enabled)) {
+		__spin_lock(lock);
+		return;
+	}
+	start = read_tsc();
+	if (!__spin_trylock(lock)) {
+		contended = TRUE;
+		__spin_lock(lock);
+	}
+	lock->lp_tsc = read_tsc();
+	lock->lp_site = site;
+	__lockprof_acquired(lock, site, LOCKPROF_SPIN, contended,
+	                    lock->lp_tsc - start);
+}
+
+static bool lockprof_spin_trylock(spinlock_t *lock, uintptr_t site)
+{
+	if (!__spin_trylock(lock))
+		return FALSE;
+	if (unlikely(lockprof_enabled)) {
+		lock->lp_tsc = read_tsc();
+		lock->lp_site = site;
+		__lockprof_acquired(lock, site, LOCKPROF_SPIN, FALSE, 0);
+	}
+	return TRUE;
+}
+
+/* Call while still holding the lock */
+static void lockprof_spin_unlock(spinlock_t *lock)
+{
+	if (!lock->lp_tsc)
+		return;
+	if (lockprof_enabled)
+		__lockprof_released(lock, lock->lp_site, LOCKPROF_SPIN,
+		                    read_tsc() - lock->lp_tsc);
+	lock->lp_tsc = 0;
+}
+
+#else
+
+static void lockprof_spin_lock(spinlock_t *lock, uintptr_t site)
+{
+	__spin_lock(lock);
+}
+
+static bool lockprof_spin_trylock(spinlock_t *lock, uintptr_t site)
+{
+	return __spin_trylock(lock);
+}
+
+static void lockprof_spin_unlock(spinlock_t *lock)
+{
+}
+
+#endif /* CONFIG_LOCK_PROFILE */
+
+#if defined(CONFIG_SPINLOCK_DEBUG) || defined(CONFIG_LOCK_PROFILE)
+
+void spin_lock(spinlock_t *lock)
+{
+	uint32_t coreid = core_id_early();
+	uintptr_t site = get_caller_pc();
+
+	pre_lock(lock, coreid);
+	/* Memory barriers are handled by the particular arches */
+	lockprof_spin_lock(lock, site);
+	post_lock(lock, coreid, site);
+}
+
+/* Trylock doesn't check for irq/noirq, in case we want to try and lock a
+ * non-irqsave lock from irq context. */
+bool spin_trylock(spinlock_t *lock)
+{
+	uint32_t coreid = core_id_early();
+	bool ret = lockprof_spin_trylock(lock, get_caller_pc());
+	if (ret)
+		post_lock(lock, coreid, get_caller_pc());
+	return ret;
+}
+
+void spin_unlock(spinlock_t *lock)
+{
+	pre_unlock(lock);
+	lockprof_spin_unlock(lock);
+	/* Memory barriers are handled by the particular arches */
+	__spin_unlock(lock);
+}
+
+#endif /* CONFIG_SPINLOCK_DEBUG || CONFIG_LOCK_PROFILE */
+
 /* Inits a hashlock. */
 void hashlock_init(struct hashlock *hl, unsigned int nr_entries)
 {
@@ -12,6 +12,7 @@
 #include <assert.h>
 #include <bitops.h>
 #include <bitmap.h>
+#include <cpu_feat.h>
 
 /*
  * bitmaps provide an array of bits, implemented using an an
@@ -250,6 +251,16 @@ int __bitmap_weight(const unsigned long *bitmap, int bits)
 {
 	int k, w = 0, lim = bits/BITS_PER_LONG;
 
+#ifdef CONFIG_X86
+	/* The compiler can't use popcnt, since not every CPU has it */
+	if (cpu_has_feat(CPU_FEAT_X86_POPCNT)) {
+		for (k = 0; k < lim; k++)
+			w += __arch_popcnt(bitmap[k]);
+		if (bits % BITS_PER_LONG)
+			w += __arch_popcnt(bitmap[k] & BITMAP_LAST_WORD_MASK(bits));
+		return w;
+	}
+#endif
 	for (k = 0; k < lim; k++)
 		w += hweight_long(bitmap[k]);
 
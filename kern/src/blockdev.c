@@ -10,6 +10,8 @@
 #include <slab.h>
 #include <page_alloc.h>
 #include <pmap.h>
+#include <sort.h>
+#include <tracepoint.h>
 /* These two are needed for the fake interrupt */
 #include <alarm.h>
 #include <smp.h>
@@ -18,6 +20,28 @@ struct file_operations block_f_op;
 struct page_map_operations block_pm_op;
 struct kmem_cache *breq_kcache;
 
+/* Writeback tunables, see struct bdev_writeback */
+unsigned int bdev_wb_interval_msec = 2500;
+unsigned int bdev_wb_dirty_ratio = 10;
+
+/* Request queue tunables, see struct bdev_queue */
+unsigned int bdev_read_expire_msec = 500;
+unsigned int bdev_write_expire_msec = 5000;
+
+/* Buffer cache tunable, see bdev_get_buffer() */
+unsigned int bdev_cache_ratio = 10;
+
+/* Pages we try to evict at a time, once the buffer cache is too big */
+#define BDEV_CACHE_SHRINK_BATCH 32
+
+/* Most pages the writeback ktask writes with one block request */
+#define BDEV_WB_BATCH 32
+/* Writeback batches we get to the queue before waiting on any of them */
+#define BDEV_WB_INFLIGHT 4
+
+#define BDEV_QUEUE_DEPTH 4			/* requests at the device at once */
+#define BDEV_MAX_MERGE_SECTORS 256	/* largest merged request */
+
 void block_init(void)
 {
 	breq_kcache = kmem_cache_create("block_reqs", sizeof(struct block_request),
@@ -37,6 +61,7 @@ void block_init(void)
 	ram_bd->b_nr_sector = (unsigned long)_binary_mnt_ext2fs_img_size / 512;
 	kref_init(&ram_bd->b_kref, fake_release, 1);
 	pm_init(&ram_bd->b_pm, &block_pm_op, ram_bd);
+	bdev_queue_init(ram_bd);
 	ram_bd->b_data = _binary_mnt_ext2fs_img_start;
 	strlcpy(ram_bd->b_name, "RAMDISK", BDEV_INLINE_NAME);
 	/* Connect it to the file system */
@@ -46,6 +71,7 @@ void block_init(void)
 	ram_bf->f_dentry->d_inode->i_mapping = &ram_bd->b_pm;
 	ram_bf->f_dentry->d_inode->i_bdev = ram_bd;	/* this holds the bd kref */
 	kref_put(&ram_bf->f_kref);
+	bdev_writeback_init(ram_bd);
 	#endif /* CONFIG_EXT2FS */
 }
 
@@ -79,10 +105,179 @@ void free_bhs(struct page *page)
 	page->pg_private = 0;		/* catch bugs */
 }
 
-/* This ultimately will handle the actual request processing, all the way down
- * to the driver, and will deal with blocking.  For now, we just fulfill the
- * request right away (RAM based block devs). */
-int bdev_submit_request(struct block_device *bdev, struct block_request *breq)
+void bdev_queue_init(struct block_device *bdev)
+{
+	struct bdev_queue *q = &bdev->b_queue;
+
+	spinlock_init_irqsave(&q->lock);
+	TAILQ_INIT(&q->sorted);
+	TAILQ_INIT(&q->fifo[0]);
+	TAILQ_INIT(&q->fifo[1]);
+	q->plugged = 0;
+	q->nr_inflight = 0;
+	q->next_sector = 0;
+	q->nr_dispatched = 0;
+	q->nr_merged = 0;
+}
+
+static int breq_dir(struct block_request *breq)
+{
+	return breq->flags & BREQ_WRITE ? 1 : 0;
+}
+
+/* Sets breq's sector range.  Only requests whose BHs are in order and back to
+ * back get a length, and only those can merge. */
+static void breq_set_extent(struct block_request *breq)
+{
+	struct buffer_head *bh;
+
+	breq->sector = breq->nr_bhs ? breq->bhs[0]->bh_sector : 0;
+	breq->nr_sector = 0;
+	for (int i = 0; i < breq->nr_bhs; i++) {
+		bh = breq->bhs[i];
+		if (bh->bh_sector != breq->sector + breq->nr_sector) {
+			breq->nr_sector = 0;
+			return;
+		}
+		breq->nr_sector += bh->bh_nr_sector;
+	}
+}
+
+/* Tries to merge breq into a queued request.  If breq comes right before one,
+ * it takes that one's place in the queue (and its deadline), so the merged
+ * list stays in sector order.  Hold the lock. */
+static bool __bdev_try_merge(struct bdev_queue *q, struct block_request *breq)
+{
+	struct block_request *i;
+
+	if (!breq->nr_sector)
+		return FALSE;
+	TAILQ_FOREACH(i, &q->sorted, sort_link) {
+		if (i->sector > breq->sector + breq->nr_sector)
+			break;
+		if ((i->flags != breq->flags) || !i->nr_sector ||
+		    (i->nr_sector + breq->nr_sector > BDEV_MAX_MERGE_SECTORS))
+			continue;
+		if (i->sector + i->nr_sector == breq->sector) {
+			TAILQ_INSERT_TAIL(&i->merged, breq, fifo_link);
+			i->nr_sector += breq->nr_sector;
+			q->nr_merged++;
+			return TRUE;
+		}
+		if (breq->sector + breq->nr_sector == i->sector) {
+			TAILQ_INSERT_BEFORE(i, breq, sort_link);
+			TAILQ_REMOVE(&q->sorted, i, sort_link);
+			TAILQ_INSERT_BEFORE(i, breq, fifo_link);
+			TAILQ_REMOVE(&q->fifo[breq_dir(i)], i, fifo_link);
+			breq->deadline = i->deadline;
+			breq->nr_sector += i->nr_sector;
+			TAILQ_INSERT_TAIL(&breq->merged, i, fifo_link);
+			TAILQ_CONCAT(&breq->merged, &i->merged, fifo_link);
+			q->nr_merged++;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Hold the lock. */
+static void __bdev_insert(struct bdev_queue *q, struct block_request *breq)
+{
+	struct block_request *i;
+
+	TAILQ_FOREACH(i, &q->sorted, sort_link) {
+		if (i->sector > breq->sector)
+			break;
+	}
+	if (i)
+		TAILQ_INSERT_BEFORE(i, breq, sort_link);
+	else
+		TAILQ_INSERT_TAIL(&q->sorted, breq, sort_link);
+	TAILQ_INSERT_TAIL(&q->fifo[breq_dir(breq)], breq, fifo_link);
+}
+
+/* Picks and dequeues the next request for the device, or returns 0.  Expired
+ * requests go first, then we continue the sweep up the disk from the last one,
+ * wrapping around at the end.  Hold the lock. */
+static struct block_request *__bdev_next_request(struct bdev_queue *q)
+{
+	struct block_request *breq;
+	uint64_t now = read_tsc();
+
+	for (int dir = 0; dir < 2; dir++) {
+		breq = TAILQ_FIRST(&q->fifo[dir]);
+		if (breq && (breq->deadline <= now))
+			goto found;
+	}
+	TAILQ_FOREACH(breq, &q->sorted, sort_link) {
+		if (breq->sector >= q->next_sector)
+			break;
+	}
+	if (!breq)
+		breq = TAILQ_FIRST(&q->sorted);
+	if (!breq)
+		return 0;
+found:
+	TAILQ_REMOVE(&q->sorted, breq, sort_link);
+	TAILQ_REMOVE(&q->fifo[breq_dir(breq)], breq, fifo_link);
+	q->next_sector = breq->sector + breq->nr_sector;
+	return breq;
+}
+
+static void bdev_ram_dispatch(struct block_device *bdev,
+                              struct block_request *breq);
+
+/* nr_sector is 0 if the request's BHs aren't contiguous */
+DEFINE_TRACEPOINT(bdev_submit, "sector %lu nr_sector %lu flags %x");
+DEFINE_TRACEPOINT(bdev_done, "sector %lu nr_sector %lu flags %x");
+
+/* Sends requests to the device until it's full, the queue is empty, or someone
+ * plugged it. */
+static void bdev_run_queue(struct block_device *bdev)
+{
+	struct bdev_queue *q = &bdev->b_queue;
+	struct block_request *breq;
+
+	while (1) {
+		spin_lock_irqsave(&q->lock);
+		if (q->plugged || (q->nr_inflight >= BDEV_QUEUE_DEPTH) ||
+		    !(breq = __bdev_next_request(q))) {
+			spin_unlock_irqsave(&q->lock);
+			return;
+		}
+		q->nr_inflight++;
+		q->nr_dispatched++;
+		spin_unlock_irqsave(&q->lock);
+		bdev_ram_dispatch(bdev, breq);
+	}
+}
+
+/* Called by the driver when the device is done with breq and everything
+ * merged into it. */
+static void bdev_request_done(struct block_request *breq)
+{
+	struct block_device *bdev = breq->bdev;
+	struct bdev_queue *q = &bdev->b_queue;
+	struct block_request *i, *temp;
+
+	tracepoint(bdev_done, breq->sector, breq->nr_sector, breq->flags);
+	spin_lock_irqsave(&q->lock);
+	q->nr_inflight--;
+	spin_unlock_irqsave(&q->lock);
+	/* Callbacks can free their breq, so don't touch one after its callback */
+	TAILQ_FOREACH_SAFE(i, &breq->merged, fifo_link, temp) {
+		if (i->callback)
+			i->callback(i);
+	}
+	if (breq->callback)
+		breq->callback(breq);
+	bdev_run_queue(bdev);
+}
+
+/* The RAM disk 'driver'.  We do the IO right away, and fake the device
+ * interrupt with an alarm. */
+static void bdev_ram_copy(struct block_device *bdev,
+                          struct block_request *breq)
 {
 	void *src, *dst;
 	unsigned long first_sector;
@@ -91,51 +286,107 @@ int bdev_submit_request(struct block_device *bdev, struct block_request *breq)
 	for (int i = 0; i < breq->nr_bhs; i++) {
 		first_sector = breq->bhs[i]->bh_sector;
 		nr_sector = breq->bhs[i]->bh_nr_sector;
-		/* Sectors are indexed starting with 0, for now. */
-		if (first_sector + nr_sector > bdev->b_nr_sector) {
-			warn("Exceeding the num sectors!");
-			return -1;
-		}
 		if (breq->flags & BREQ_READ) {
 			dst = breq->bhs[i]->bh_buffer;
 			src = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-		} else if (breq->flags & BREQ_WRITE) {
+		} else {
 			dst = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
 			src = breq->bhs[i]->bh_buffer;
-		} else {
-			panic("Need a request type!\n");
 		}
 		memcpy(dst, src, nr_sector << SECTOR_SZ_LOG);
 	}
-	/* Faking the device interrupt with an alarm */
-	void breq_handler(struct alarm_waiter *waiter)
-	{
-		/* In the future, we'll need to figure out which breq this was in
-		 * response to */
-		struct block_request *breq = (struct block_request*)waiter->data;
-		if (breq->callback)
-			breq->callback(breq);
-		kfree(waiter);
-	}
+}
+
+static void bdev_ram_irq(struct alarm_waiter *waiter)
+{
+	struct block_request *breq = (struct block_request*)waiter->data;
+
+	kfree(waiter);
+	bdev_request_done(breq);
+}
+
+static void bdev_ram_dispatch(struct block_device *bdev,
+                              struct block_request *breq)
+{
 	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
-	struct alarm_waiter *waiter = kmalloc(sizeof(struct alarm_waiter), 0);
-	init_awaiter(waiter, breq_handler);
+	struct alarm_waiter *waiter;
+	struct block_request *i;
+
+	bdev_ram_copy(bdev, breq);
+	TAILQ_FOREACH(i, &breq->merged, fifo_link)
+		bdev_ram_copy(bdev, i);
+	waiter = kmalloc(sizeof(struct alarm_waiter), MEM_WAIT);
+	init_awaiter(waiter, bdev_ram_irq);
 	/* Stitch things up, so we know how to find things later */
 	waiter->data = breq;
 	/* Set for 5ms. */
 	set_awaiter_rel(waiter, 5000);
 	set_alarm(tchain, waiter);
+}
+
+/* Queues breq for the device.  The callback runs once it's done.  Returns -1 if
+ * the request is bogus. */
+int bdev_submit_request(struct block_device *bdev, struct block_request *breq)
+{
+	struct bdev_queue *q = &bdev->b_queue;
+	unsigned int expire_msec;
+
+	if (!(breq->flags & (BREQ_READ | BREQ_WRITE)))
+		panic("Need a request type!\n");
+	for (int i = 0; i < breq->nr_bhs; i++) {
+		/* Sectors are indexed starting with 0, for now. */
+		if (breq->bhs[i]->bh_sector + breq->bhs[i]->bh_nr_sector >
+		    bdev->b_nr_sector) {
+			warn("Exceeding the num sectors!");
+			return -1;
+		}
+	}
+	breq->bdev = bdev;
+	TAILQ_INIT(&breq->merged);
+	breq_set_extent(breq);
+	expire_msec = breq->flags & BREQ_READ ? bdev_read_expire_msec
+	                                      : bdev_write_expire_msec;
+	breq->deadline = read_tsc() + usec2tsc((uint64_t)expire_msec * 1000);
+	tracepoint(bdev_submit, breq->sector, breq->nr_sector, breq->flags);
+	spin_lock_irqsave(&q->lock);
+	if (!__bdev_try_merge(q, breq))
+		__bdev_insert(q, breq);
+	spin_unlock_irqsave(&q->lock);
+	bdev_run_queue(bdev);
 	return 0;
 }
 
-/* Helper method, unblocks someone blocked on sleep_on_breq(). */
+/* While a device is plugged, its requests wait in the queue, so that a batch
+ * submitted together can merge.  Plugs nest, and the last unplug sends the
+ * requests along.  Since this holds up everyone's IO, don't block for long
+ * while plugged. */
+void bdev_plug(struct block_device *bdev)
+{
+	struct bdev_queue *q = &bdev->b_queue;
+
+	spin_lock_irqsave(&q->lock);
+	q->plugged++;
+	spin_unlock_irqsave(&q->lock);
+}
+
+void bdev_unplug(struct block_device *bdev)
+{
+	struct bdev_queue *q = &bdev->b_queue;
+
+	spin_lock_irqsave(&q->lock);
+	assert(q->plugged);
+	q->plugged--;
+	spin_unlock_irqsave(&q->lock);
+	bdev_run_queue(bdev);
+}
+
+/* Helper method, unblocks someone blocked on sleep_on_breq().  They might not
+ * be there yet, if they submitted a few requests before waiting on any. */
 void generic_breq_done(struct block_request *breq)
 {
 	int8_t irq_state = 0;
-	if (!sem_up_irqsave(&breq->sem, &irq_state)) {
-		/* This shouldn't happen anymore.  Let brho know if it does. */
-		warn("[kernel] no one waiting on breq %p", breq);
-	}
+
+	sem_up_irqsave(&breq->sem, &irq_state);
 }
 
 /* Helper, pairs with generic_breq_done().  Note we sleep here on a semaphore
@@ -159,45 +410,27 @@ int block_readpage(struct page_map *pm, struct page *page)
 	return 0;
 }
 
-/* Returns a BH pointing to the buffer where blk_num from bdev is located (given
- * blocks of size blk_sz).  This uses the page cache for the page allocations
- * and evictions, but only caches blocks that are requested.  Check the docs for
- * more info.  The BH isn't refcounted, but a page refcnt is returned.  Call
- * put_block (nand/xor dirty block).
- *
- * Note we're using the lock_page() to sync (which is what we do with the page
- * cache too.  It's not ideal, but keeps things simpler for now.
- *
- * Also note we're a little inconsistent with the use of sector sizes in certain
- * files.  We'll sort it eventually. */
-struct buffer_head *bdev_get_buffer(struct block_device *bdev,
-                                    unsigned long blk_num, unsigned int blk_sz)
+/* Finds or makes the BH for blk_num (of size blk_sz) in page, which holds it.
+ * The page's BHs are sorted by buffer address. */
+static struct buffer_head *__bdev_get_bh(struct block_device *bdev,
+                                         struct page *page,
+                                         unsigned long blk_num,
+                                         unsigned int blk_sz)
 {
-	struct page *page;
-	struct page_map *pm = &bdev->b_pm;
 	struct buffer_head *bh, *new, *prev, **next_loc;
-	struct block_request *breq;
-	int error;
 	unsigned int blk_per_pg = PGSIZE / blk_sz;
 	unsigned int sct_per_blk = blk_sz / bdev->b_sector_sz;
 	unsigned int blk_offset = (blk_num % blk_per_pg) * blk_sz;
-	void *my_buf;
+	void *my_buf = page2kva(page) + blk_offset;
+
 	assert(blk_offset < PGSIZE);
-	if (!blk_num)
-		warn("Asking for the 0th block of a bdev...");
-	/* Make sure there's a page in the page cache.  Should always be one. */
-	error = pm_load_page(pm, blk_num / blk_per_pg, &page);
-	if (error)
-		panic("Failed to load page! (%d)", error);
-	my_buf = page2kva(page) + blk_offset;
-	atomic_or(&page->pg_flags, PG_BUFFER);
 retry:
 	bh = (struct buffer_head*)page->pg_private;
 	prev = 0;
 	/* look through all the BHs for ours, stopping if we go too far. */
 	while (bh) {
 		if (bh->bh_buffer == my_buf) {
-			goto found;
+			return bh;
 		} else if (bh->bh_buffer > my_buf) {
 			break;
 		}
@@ -225,8 +458,50 @@ retry:
 		kmem_cache_free(bh_kcache, new);
 		goto retry;
 	}
-	bh = new;
-found:
+	return new;
+}
+
+/* Keeps bdev's buffer cache under bdev_cache_ratio percent of memory. */
+static void bdev_cache_trim(struct block_device *bdev)
+{
+	struct page_map *pm = &bdev->b_pm;
+	unsigned long max_pages = max_nr_pages / 100 * bdev_cache_ratio;
+
+	if (ACCESS_ONCE(pm->pm_num_pages) > max_pages)
+		pm_shrink(pm, BDEV_CACHE_SHRINK_BATCH);
+}
+
+/* Returns a BH pointing to the buffer where blk_num from bdev is located (given
+ * blocks of size blk_sz).  This uses the page cache for the page allocations
+ * and evictions, but only caches blocks that are requested, along with their
+ * neighbors in the same page.  Check the docs for more info.  The BH isn't
+ * refcounted, but a page refcnt is returned.  Call put_block (nand/xor dirty
+ * block).
+ *
+ * Note we're using the lock_page() to sync (which is what we do with the page
+ * cache too.  It's not ideal, but keeps things simpler for now.
+ *
+ * Also note we're a little inconsistent with the use of sector sizes in certain
+ * files.  We'll sort it eventually. */
+struct buffer_head *bdev_get_buffer(struct block_device *bdev,
+                                    unsigned long blk_num, unsigned int blk_sz)
+{
+	struct page *page;
+	struct page_map *pm = &bdev->b_pm;
+	struct buffer_head *bh, *bh_i;
+	struct block_request *breq;
+	int error;
+	unsigned int blk_per_pg = PGSIZE / blk_sz;
+	unsigned long first_blk = ROUNDDOWN(blk_num, blk_per_pg);
+
+	if (!blk_num)
+		warn("Asking for the 0th block of a bdev...");
+	/* Make sure there's a page in the page cache.  Should always be one. */
+	error = pm_load_page(pm, blk_num / blk_per_pg, &page);
+	if (error)
+		panic("Failed to load page! (%d)", error);
+	atomic_or(&page->pg_flags, PG_BUFFER);
+	bh = __bdev_get_bh(bdev, page, blk_num, blk_sz);
 	/* At this point, we have the BH for our buf, but it might not be up to
 	 * date, and there might be someone else trying to update it. */
 	/* is it already here and up to date?  if so, we're done */
@@ -239,7 +514,9 @@ found:
 		unlock_page(page);
 		return bh;
 	}
-	/* if we're here, the page is locked by us, we need to read the block */
+	/* if we're here, the page is locked by us, we need to read the block.  We
+	 * read the rest of the page's missing blocks too; the request's BHs are in
+	 * sector order. */
 	breq = kmem_cache_alloc(breq_kcache, 0);
 	assert(breq);
 	breq->flags = BREQ_READ;
@@ -247,18 +524,54 @@ found:
 	breq->data = 0;
 	sem_init_irqsave(&breq->sem, 0);
 	breq->bhs = breq->local_bhs;
-	breq->bhs[0] = bh;
-	breq->nr_bhs = 1;
+	breq->nr_bhs = 0;
+	for (unsigned long i = first_blk; i < first_blk + blk_per_pg; i++) {
+		if (i == blk_num) {
+			breq->bhs[breq->nr_bhs++] = bh;
+			continue;
+		}
+		/* neighbors past the end of the device don't exist */
+		if ((i + 1) * (blk_sz / bdev->b_sector_sz) > bdev->b_nr_sector)
+			break;
+		bh_i = __bdev_get_bh(bdev, page, i, blk_sz);
+		if (bh_i->bh_flags & (BH_UPTODATE | BH_DIRTY))
+			continue;
+		breq->bhs[breq->nr_bhs++] = bh_i;
+	}
 	error = bdev_submit_request(bdev, breq);
 	assert(!error);
 	sleep_on_breq(breq);
-	kmem_cache_free(breq_kcache, breq);
 	/* after the data is read, we mark it up to date and unlock the page. */
-	bh->bh_flags |= BH_UPTODATE;
+	for (int i = 0; i < breq->nr_bhs; i++)
+		breq->bhs[i]->bh_flags |= BH_UPTODATE;
+	kmem_cache_free(breq_kcache, breq);
 	unlock_page(page);
+	bdev_cache_trim(bdev);
 	return bh;
 }
 
+/* Puts page on bdev's writeback list, unless it's there already, and kicks the
+ * writeback ktask if too much of memory is dirty. */
+static void bdev_queue_dirty_page(struct block_device *bdev, struct page *page)
+{
+	struct bdev_writeback *wb = &bdev->b_wb;
+	bool kick;
+
+	spin_lock(&wb->lock);
+	if (atomic_read(&page->pg_flags) & PG_WRITEBACK) {
+		spin_unlock(&wb->lock);
+		return;
+	}
+	atomic_or(&page->pg_flags, PG_WRITEBACK);
+	page_incref(page);
+	BSD_LIST_INSERT_HEAD(&wb->young, page, pg_link);
+	wb->nr_dirty++;
+	kick = wb->nr_dirty > max_nr_pages / 100 * bdev_wb_dirty_ratio;
+	spin_unlock(&wb->lock);
+	if (kick && !atomic_swap(&wb->kicked, 1))
+		rendez_wakeup(&wb->rv);
+}
+
 /* Will dirty the block/BH/page for the given block/buffer.  Will have to be
  * careful with the page reclaimer - if someone holds a reference, they can
  * still dirty it. */
@@ -268,6 +581,224 @@ void bdev_dirty_buffer(struct buffer_head *bh)
 	/* TODO: race on flag modification */
 	bh->bh_flags |= BH_DIRTY;
 	atomic_or(&page->pg_flags, PG_DIRTY);
+	bdev_queue_dirty_page(bh->bh_bdev, page);
+}
+
+/* Dirties every buffer of a buffer page, e.g. after a write() to it. */
+void bdev_dirty_page(struct page *page)
+{
+	struct buffer_head *bh = (struct buffer_head*)page->pg_private;
+
+	assert(atomic_read(&page->pg_flags) & PG_BUFFER);
+	for (; bh; bh = bh->bh_next)
+		bdev_dirty_buffer(bh);
+}
+
+static void __bdev_put_breq(struct block_request *breq)
+{
+	if (breq->bhs != breq->local_bhs)
+		kfree(breq->bhs);
+	kmem_cache_free(breq_kcache, breq);
+}
+
+/* Builds a block request to write pages' buffers, returning 0 if there's
+ * nothing to write.  We write the dirty BHs, or every BH if all.  We clear the
+ * dirty flags now, so anything dirtied while the IO is in flight gets written
+ * again later.  Submit it, sleep_on_breq(), then __bdev_put_breq(). */
+static struct block_request *__bdev_prep_write(struct page **pages,
+                                               unsigned int nr, bool all)
+{
+	struct block_request *breq;
+	struct buffer_head *bh;
+	unsigned int nr_bhs = 0;
+
+	for (int i = 0; i < nr; i++) {
+		for (bh = pages[i]->pg_private; bh; bh = bh->bh_next)
+			nr_bhs++;
+	}
+	if (!nr_bhs)
+		return 0;
+	breq = kmem_cache_alloc(breq_kcache, MEM_WAIT);
+	breq->flags = BREQ_WRITE;
+	breq->callback = generic_breq_done;
+	breq->data = 0;
+	sem_init_irqsave(&breq->sem, 0);
+	breq->bhs = breq->local_bhs;
+	if (nr_bhs > NR_INLINE_BH)
+		breq->bhs = kmalloc(nr_bhs * sizeof(struct buffer_head*), MEM_WAIT);
+	breq->nr_bhs = 0;
+	for (int i = 0; i < nr; i++) {
+		atomic_and(&pages[i]->pg_flags, ~PG_DIRTY);
+		for (bh = pages[i]->pg_private; bh; bh = bh->bh_next) {
+			if (!all && !(bh->bh_flags & BH_DIRTY))
+				continue;
+			bh->bh_flags &= ~BH_DIRTY;
+			breq->bhs[breq->nr_bhs++] = bh;
+		}
+	}
+	if (!breq->nr_bhs) {
+		__bdev_put_breq(breq);
+		return 0;
+	}
+	return breq;
+}
+
+/* Writes out pages' buffers with one block request, and waits for it. */
+static void __bdev_write_pages(struct block_device *bdev, struct page **pages,
+                               unsigned int nr, bool all)
+{
+	struct block_request *breq = __bdev_prep_write(pages, nr, all);
+	int error;
+
+	if (!breq)
+		return;
+	error = bdev_submit_request(bdev, breq);
+	assert(!error);
+	sleep_on_breq(breq);
+	__bdev_put_breq(breq);
+}
+
+/* Writes a dirty buffer page, for page maps' writepage.  If none of its BHs are
+ * dirty, the page was dirtied through a mapping, which only the page's flags
+ * know about, so we write all of them. */
+int block_writepage(struct page_map *pm, struct page *page)
+{
+	struct buffer_head *bh = (struct buffer_head*)page->pg_private;
+	bool any_dirty = FALSE;
+
+	if (!(atomic_read(&page->pg_flags) & PG_BUFFER) || !bh)
+		return 0;
+	for (; bh; bh = bh->bh_next)
+		any_dirty |= !!(bh->bh_flags & BH_DIRTY);
+	bh = (struct buffer_head*)page->pg_private;
+	__bdev_write_pages(bh->bh_bdev, &page, 1, !any_dirty);
+	return 0;
+}
+
+struct bdev_wb_batch {
+	struct page					*pages[BDEV_WB_BATCH];
+	unsigned int				nr;
+	struct block_request		*breq;
+};
+
+static int page_index_cmp(const void *a, const void *b)
+{
+	const struct page *pa = *(const struct page**)a;
+	const struct page *pb = *(const struct page**)b;
+
+	return pa->pg_index < pb->pg_index ? -1 : pa->pg_index > pb->pg_index;
+}
+
+/* Pulls up to a batch of pages off list, keeping the ones that still need to be
+ * written, sorted by index so their BHs tend to be back to back.  Pages that
+ * fell out of their page map or were cleaned by someone else since they got
+ * queued just lose the list's ref.  Returns how many came off the list. */
+static unsigned int bdev_wb_collect(struct block_device *bdev,
+                                    struct bdev_wb_list *list,
+                                    struct bdev_wb_batch *b)
+{
+	struct bdev_writeback *wb = &bdev->b_wb;
+	struct page *page;
+	unsigned int nr = 0;
+	int flags;
+
+	spin_lock(&wb->lock);
+	while ((nr < BDEV_WB_BATCH) && (page = BSD_LIST_FIRST(list))) {
+		BSD_LIST_REMOVE(page, pg_link);
+		atomic_and(&page->pg_flags, ~PG_WRITEBACK);
+		wb->nr_dirty--;
+		b->pages[nr++] = page;
+	}
+	spin_unlock(&wb->lock);
+	b->nr = 0;
+	for (int i = 0; i < nr; i++) {
+		flags = atomic_read(&b->pages[i]->pg_flags);
+		if ((flags & PG_PAGEMAP) && (flags & PG_DIRTY))
+			b->pages[b->nr++] = b->pages[i];
+		else
+			page_decref(b->pages[i]);
+	}
+	sort(b->pages, b->nr, sizeof(struct page*), page_index_cmp);
+	return nr;
+}
+
+/* Writes out every page on list.  We plug the queue and submit a few batches
+ * before waiting on any, so the device stays busy and neighboring batches can
+ * merge. */
+static void bdev_wb_flush_list(struct block_device *bdev,
+                               struct bdev_wb_list *list)
+{
+	struct bdev_wb_batch *batches, *b;
+	unsigned int nr_batches, nr_taken;
+	int error;
+
+	batches = kmalloc(sizeof(struct bdev_wb_batch) * BDEV_WB_INFLIGHT,
+	                  MEM_WAIT);
+	do {
+		bdev_plug(bdev);
+		nr_batches = 0;
+		do {
+			b = &batches[nr_batches++];
+			nr_taken = bdev_wb_collect(bdev, list, b);
+			b->breq = __bdev_prep_write(b->pages, b->nr, FALSE);
+			if (b->breq) {
+				error = bdev_submit_request(bdev, b->breq);
+				assert(!error);
+			}
+		} while ((nr_taken == BDEV_WB_BATCH) &&
+		         (nr_batches < BDEV_WB_INFLIGHT));
+		bdev_unplug(bdev);
+		for (int i = 0; i < nr_batches; i++) {
+			b = &batches[i];
+			if (b->breq) {
+				sleep_on_breq(b->breq);
+				__bdev_put_breq(b->breq);
+			}
+			for (int j = 0; j < b->nr; j++)
+				page_decref(b->pages[j]);
+		}
+	} while (nr_taken == BDEV_WB_BATCH);
+	kfree(batches);
+}
+
+static int bdev_wb_is_kicked(void *arg)
+{
+	struct bdev_writeback *wb = arg;
+
+	return atomic_read(&wb->kicked);
+}
+
+static void bdev_writeback_ktask(void *arg)
+{
+	struct block_device *bdev = arg;
+	struct bdev_writeback *wb = &bdev->b_wb;
+	bool kicked;
+
+	while (1) {
+		rendez_sleep_timeout(&wb->rv, bdev_wb_is_kicked, wb,
+		                     MAX(bdev_wb_interval_msec, 1) * 1000);
+		kicked = atomic_swap(&wb->kicked, 0);
+		bdev_wb_flush_list(bdev, &wb->old);
+		if (kicked)
+			bdev_wb_flush_list(bdev, &wb->young);
+		spin_lock(&wb->lock);
+		BSD_LIST_SWAP(&wb->young, &wb->old, page, pg_link);
+		spin_unlock(&wb->lock);
+	}
+}
+
+/* Sets up bdev's writeback and starts its ktask.  Needs kthreads. */
+void bdev_writeback_init(struct block_device *bdev)
+{
+	struct bdev_writeback *wb = &bdev->b_wb;
+
+	spinlock_init(&wb->lock);
+	BSD_LIST_INIT(&wb->young);
+	BSD_LIST_INIT(&wb->old);
+	wb->nr_dirty = 0;
+	atomic_init(&wb->kicked, 0);
+	rendez_init(&wb->rv);
+	ktask("bdev_writeback", bdev_writeback_ktask, bdev);
 }
 
 /* Decrefs the buffer from bdev_get_buffer().  Call this when you no longer
@@ -281,6 +812,7 @@ void bdev_put_buffer(struct buffer_head *bh)
 /* Block device page map ops: */
 struct page_map_operations block_pm_op = {
 	block_readpage,
+	block_writepage,
 };
 
 /* Block device file ops: for now, we don't let you do much of anything */
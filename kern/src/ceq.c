@@ -20,27 +20,24 @@ static void error_addr(struct ceq *ceq, struct proc *p, void *addr)
 	       addr, p->pid);
 }
 
-void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
+/* Coalesces msg into its ceq_event.  Returns TRUE if the event needs to be
+ * posted to the ring. */
+static bool ceq_coalesce(struct ceq *ceq, struct proc *p,
+                         struct event_msg *msg)
 {
 	struct ceq_event *ceq_ev;
-	int32_t *ring_slot;
-	unsigned long my_slot;
-	int loops = 0;
-	#define NR_RING_TRIES 10
 
-	/* should have been checked by the kernel func that called us */
-	assert(is_user_rwaddr(ceq, sizeof(struct ceq)));
 	if (msg->ev_type >= ceq->nr_events) {
 		printk("[kernel] CEQ %p too small.  Wanted %d, had %d\n", ceq,
 		       msg->ev_type, ceq->nr_events);
-		return;
+		return FALSE;
 	}
 	/* ACCESS_ONCE, prevent the compiler from rereading ceq->events later, and
 	 * possibly getting a new, illegal version after our check */
 	ceq_ev = &(ACCESS_ONCE(ceq->events))[msg->ev_type];
 	if (!is_user_rwaddr(ceq_ev, sizeof(struct ceq_event))) {
 		error_addr(ceq, p, ceq);
-		return;
+		return FALSE;
 	}
 	/* ideally, we'd like the blob to be posted after the coal, so that the
 	 * 'reason' for the blob is present when the blob is.  but we can't
@@ -59,7 +56,7 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 			break;
 		default:
 			printk("[kernel] CEQ %p invalid op%d\n", ceq, ceq->operation);
-			return;
+			return FALSE;
 	}
 	/* write before checking if we need to post (covered by the atomic) */
 	if (ceq_ev->idx_posted) {
@@ -68,13 +65,27 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 		 * codes or something from send_*_msg, then we can tell the kernel to
 		 * not bother with INDIRS/IPIs/etc.  This is unnecessary now since
 		 * INDIRs are throttled */
-		return;
+		return FALSE;
 	}
 	/* at this point, we need to make sure the cons looks at our entry.  it may
 	 * have already done so while we were mucking around, but 'poking' them to
 	 * look again can't hurt */
 	ceq_ev->idx_posted = TRUE;
-	/* idx_posted write happens before the writes posting it.  the following
+	return TRUE;
+}
+
+/* Puts the nr idxs in the ring, in one go: we grab all of their slots with a
+ * single CAS.  If they don't all fit, none of them go in the ring, and the
+ * consumer will find them when it recovers from the overflow. */
+static void ceq_post_idxs(struct ceq *ceq, struct proc *p, int32_t *idxs,
+                          unsigned int nr)
+{
+	int32_t *ring_slot;
+	unsigned long my_slot;
+	int loops = 0;
+	#define NR_RING_TRIES 10
+
+	/* idx_posted writes happen before the writes posting them.  the following
 	 * atomic provides the cpu mb() */
 	cmb();
 	/* I considered checking the buffer for full-ness or the ceq overflow here.
@@ -94,8 +105,8 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 	do {
 		cmb();	/* reread the indices */
 		my_slot = atomic_read(&ceq->prod_idx);
-		if (__ring_full(ceq->ring_sz, my_slot,
-		                atomic_read(&ceq->cons_pub_idx))) {
+		if (__ring_nr_full(my_slot, atomic_read(&ceq->cons_pub_idx)) + nr >
+		    ceq->ring_sz) {
 			ceq->ring_overflowed = TRUE;
 			return;
 		}
@@ -103,16 +114,47 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 			ceq->ring_overflowed = TRUE;
 			return;
 		}
-	} while (!atomic_cas(&ceq->prod_idx, my_slot, my_slot + 1));
-	/* ring_slot is a user pointer, calculated by ring, my_slot, and sz */
-	ring_slot = &(ACCESS_ONCE(ceq->ring))[my_slot & (ceq->ring_sz - 1)];
-	if (!is_user_rwaddr(ring_slot, sizeof(int32_t))) {
-		/* This is a serious user error.  We're just bailing out, and any
-		 * consumers might be spinning waiting on us to produce.  Probably not
-		 * though, since the ring slot is bad memory. */
-		error_addr(ceq, p, ring_slot);
-		return;
+	} while (!atomic_cas(&ceq->prod_idx, my_slot, my_slot + nr));
+	for (unsigned int i = 0; i < nr; i++) {
+		/* ring_slot is a user pointer, calculated by ring, my_slot, and sz */
+		ring_slot = &(ACCESS_ONCE(ceq->ring))[(my_slot + i) &
+		                                      (ceq->ring_sz - 1)];
+		if (!is_user_rwaddr(ring_slot, sizeof(int32_t))) {
+			/* This is a serious user error.  We're just bailing out, and any
+			 * consumers might be spinning waiting on us to produce.  Probably
+			 * not though, since the ring slot is bad memory. */
+			error_addr(ceq, p, ring_slot);
+			return;
+		}
+		/* At this point, we have a valid slot */
+		*ring_slot = idxs[i];
 	}
-	/* At this point, we have a valid slot */
-	*ring_slot = msg->ev_type;
+}
+
+/* Coalesces the nr msgs, then posts the ones that need it to the ring, a batch
+ * at a time. */
+void send_ceq_msgs(struct ceq *ceq, struct proc *p, struct event_msg *msgs,
+                   unsigned int nr)
+{
+	int32_t idxs[CEQ_POST_BATCH];
+	unsigned int nr_idxs = 0;
+
+	/* should have been checked by the kernel func that called us */
+	assert(is_user_rwaddr(ceq, sizeof(struct ceq)));
+	for (unsigned int i = 0; i < nr; i++) {
+		if (!ceq_coalesce(ceq, p, &msgs[i]))
+			continue;
+		idxs[nr_idxs++] = msgs[i].ev_type;
+		if (nr_idxs == CEQ_POST_BATCH) {
+			ceq_post_idxs(ceq, p, idxs, nr_idxs);
+			nr_idxs = 0;
+		}
+	}
+	if (nr_idxs)
+		ceq_post_idxs(ceq, p, idxs, nr_idxs);
+}
+
+void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
+{
+	send_ceq_msgs(ceq, p, msg, 1);
 }
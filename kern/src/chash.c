@@ -0,0 +1,253 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Concurrent hash table.  See chash.h.
+ *
+ * Only cur's slots get filled, and we keep cur under 3/4 full, counting the
+ * dead.  A new array is sized for the live entries about four times over, and
+ * we move CHASH_MOVE_BATCH old slots per write, so a move always finishes
+ * before cur needs another one.  Just in case, we'd finish it right then. */
+
+#include <chash.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <assert.h>
+
+#define CHASH_DEAD				((void*)1)
+#define CHASH_MIN_SLOTS			8
+#define CHASH_MOVE_BATCH		16
+
+static struct chash_array *chash_array_alloc(size_t nr_slots, int mem_flags)
+{
+	struct chash_array *a;
+
+	a = kzmalloc(sizeof(struct chash_array) +
+	             nr_slots * sizeof(struct chash_slot), mem_flags);
+	if (!a)
+		return 0;
+	a->nr_slots = nr_slots;
+	return a;
+}
+
+static void __chash_array_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct chash_array, rcu));
+}
+
+/* Fibonacci hashing: the top bits of the product are the well-mixed ones,
+ * which matters for keys like PIDs that mostly differ in their low bits. */
+static size_t chash_first_slot(struct chash_array *a, uintptr_t key)
+{
+	return ((uint64_t)key * 0x9e3779b97f4a7c15ULL) >>
+	       (64 - LOG2_UP(a->nr_slots));
+}
+
+static size_t chash_next_slot(struct chash_array *a, size_t idx)
+{
+	return (idx + 1) & (a->nr_slots - 1);
+}
+
+/* Safe for readers. */
+static struct chash_slot *__chash_array_find(struct chash_array *a,
+                                             uintptr_t key)
+{
+	struct chash_slot *s;
+	size_t idx = chash_first_slot(a, key);
+	void *val;
+
+	for (size_t i = 0; i < a->nr_slots; i++, idx = chash_next_slot(a, idx)) {
+		s = &a->slots[idx];
+		val = ACCESS_ONCE(s->val);
+		if (!val)
+			return 0;
+		rmb();	/* pairs with the wmb in __chash_add() */
+		if ((val != CHASH_DEAD) && (s->key == key))
+			return s;
+	}
+	return 0;
+}
+
+/* Puts key in cur, which doesn't have it and isn't full. */
+static void __chash_add(struct chash *ht, uintptr_t key, void *val)
+{
+	struct chash_array *a = ht->cur;
+	size_t idx = chash_first_slot(a, key);
+
+	while (a->slots[idx].val)
+		idx = chash_next_slot(a, idx);
+	a->slots[idx].key = key;
+	/* Readers check the val first, then the key */
+	wmb();
+	ACCESS_ONCE(a->slots[idx].val) = val;
+	ht->nr_used++;
+}
+
+/* Copies up to nr of old's slots into cur.  The copies in old stay put for any
+ * readers that are looking there.  Hold the lock. */
+static void __chash_move(struct chash *ht, size_t nr)
+{
+	struct chash_array *old = ht->old;
+	struct chash_slot *s;
+
+	for (; nr && (ht->next_mv < old->nr_slots); nr--) {
+		s = &old->slots[ht->next_mv++];
+		if (s->val && (s->val != CHASH_DEAD))
+			__chash_add(ht, s->key, s->val);
+	}
+	if (ht->next_mv == old->nr_slots) {
+		rcu_assign_pointer(ht->old, 0);
+		call_rcu(&old->rcu, __chash_array_free_rcu);
+	}
+}
+
+/* Switches to a new array, if we can get one.  Hold the lock. */
+static void __chash_start_move(struct chash *ht)
+{
+	struct chash_array *new;
+	size_t nr_slots;
+
+	if (ht->old)
+		__chash_move(ht, SIZE_MAX);
+	nr_slots = ROUNDUPPWR2(MAX(ht->nr_items * 4, ht->min_slots));
+	/* Keeps a move from a mostly-dead array short enough */
+	nr_slots = MAX(nr_slots, ht->cur->nr_slots / 2);
+	/* We're under a spinlock.  If this fails, cur just fills up some more. */
+	new = chash_array_alloc(nr_slots, MEM_ATOMIC);
+	if (!new)
+		return;
+	ht->next_mv = 0;
+	ht->nr_used = 0;
+	/* Readers look at cur and then old, so old has to be set first */
+	rcu_assign_pointer(ht->old, ht->cur);
+	rcu_assign_pointer(ht->cur, new);
+}
+
+int chash_init(struct chash *ht, size_t min_slots)
+{
+	min_slots = ROUNDUPPWR2(MAX(min_slots, CHASH_MIN_SLOTS));
+	ht->cur = chash_array_alloc(min_slots, MEM_WAIT);
+	if (!ht->cur)
+		return -ENOMEM;
+	spinlock_init(&ht->lock);
+	ht->old = 0;
+	ht->next_mv = 0;
+	ht->nr_items = 0;
+	ht->nr_used = 0;
+	ht->min_slots = min_slots;
+	return 0;
+}
+
+/* No one can be using it, including readers. */
+void chash_destroy(struct chash *ht)
+{
+	kfree(ht->old);
+	kfree(ht->cur);
+	ht->old = ht->cur = 0;
+}
+
+void *chash_lookup(struct chash *ht, uintptr_t key)
+{
+	struct chash_array *cur, *old;
+	struct chash_slot *s;
+	void *val;
+
+	cur = rcu_dereference(ht->cur);
+	rmb();	/* old was set before cur, and cleared after everything moved */
+	old = rcu_dereference(ht->old);
+	s = __chash_array_find(cur, key);
+	if (!s && old)
+		s = __chash_array_find(old, key);
+	if (!s)
+		return 0;
+	/* It might have just been removed */
+	val = ACCESS_ONCE(s->val);
+	return val == CHASH_DEAD ? 0 : val;
+}
+
+int chash_insert(struct chash *ht, uintptr_t key, void *val)
+{
+	assert(val && (val != CHASH_DEAD));
+	spin_lock(&ht->lock);
+	if (__chash_array_find(ht->cur, key) ||
+	    (ht->old && __chash_array_find(ht->old, key))) {
+		spin_unlock(&ht->lock);
+		return -EEXIST;
+	}
+	if (ht->old)
+		__chash_move(ht, CHASH_MOVE_BATCH);
+	if ((ht->nr_used + 1) * 4 > ht->cur->nr_slots * 3)
+		__chash_start_move(ht);
+	/* We always need one empty slot, to end the probes */
+	if (ht->nr_used + 1 >= ht->cur->nr_slots) {
+		spin_unlock(&ht->lock);
+		return -ENOMEM;
+	}
+	__chash_add(ht, key, val);
+	ht->nr_items++;
+	spin_unlock(&ht->lock);
+	return 0;
+}
+
+void *chash_remove(struct chash *ht, uintptr_t key)
+{
+	struct chash_slot *s, *s_old = 0;
+	void *val = 0;
+
+	spin_lock(&ht->lock);
+	s = __chash_array_find(ht->cur, key);
+	if (ht->old)
+		s_old = __chash_array_find(ht->old, key);
+	/* If it's in both, it's the same value */
+	if (s) {
+		val = s->val;
+		ACCESS_ONCE(s->val) = CHASH_DEAD;
+	}
+	if (s_old) {
+		val = s_old->val;
+		ACCESS_ONCE(s_old->val) = CHASH_DEAD;
+	}
+	if (val)
+		ht->nr_items--;
+	/* Removes help out too, so a move can't get stuck */
+	if (ht->old)
+		__chash_move(ht, CHASH_MOVE_BATCH);
+	spin_unlock(&ht->lock);
+	return val;
+}
+
+static void __chash_array_for_each(struct chash_array *a,
+                                   struct chash_array *skip,
+                                   void (*func)(void *val, void *arg),
+                                   void *arg)
+{
+	struct chash_slot *s;
+	void *val;
+
+	for (size_t i = 0; i < a->nr_slots; i++) {
+		s = &a->slots[i];
+		val = ACCESS_ONCE(s->val);
+		if (!val || (val == CHASH_DEAD))
+			continue;
+		rmb();
+		if (skip && __chash_array_find(skip, s->key))
+			continue;
+		func(val, arg);
+	}
+}
+
+/* Everything in old that isn't dead gets seen there.  Moving doesn't take
+ * entries out of old, so that covers anything cur got from old. */
+void chash_for_each(struct chash *ht, void (*func)(void *val, void *arg),
+                    void *arg)
+{
+	struct chash_array *cur, *old;
+
+	cur = rcu_dereference(ht->cur);
+	rmb();
+	old = rcu_dereference(ht->old);
+	if (old == cur)
+		old = 0;
+	if (old)
+		__chash_array_for_each(old, 0, func, arg);
+	__chash_array_for_each(cur, old, func, arg);
+}
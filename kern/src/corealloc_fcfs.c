@@ -10,6 +10,7 @@
 #include <env.h>
 #include <corerequest.h>
 #include <kmalloc.h>
+#include <trap.h>
 
 /* The pcores in the system. (array gets alloced in init()).  */
 struct sched_pcore *all_pcores;
@@ -78,6 +79,8 @@ void __track_core_alloc(struct proc *p, uint32_t pcoreid)
 	}
 	/* Actually allocate the core, removing it from the idle core list. */
 	TAILQ_REMOVE(&idlecores, spc, alloc_next);
+	/* Get the kernel's IRQs out of its way */
+	irq_core_allocated(pcoreid);
 }
 
 /* Track the pcore properly when it is deallocated from p. This code assumes
@@ -0,0 +1,340 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Topology-aware core allocation.  Like FCFS, a process first gets the idle
+ * cores provisioned to it.  Beyond that, we score every candidate core against
+ * the process's current allocation and take the best one.  In order of
+ * importance, we prefer cores that:
+ * - don't share a physical core (hyperthread siblings) with another process
+ * - aren't provisioned to another process
+ * - are on the socket where the process already has the most cores
+ * - are hyperthread siblings of one of the process's cores
+ * - are on the socket with the most idle cores, so the process can grow there
+ *
+ * We don't know about LLCs separately from sockets; on x86, they are usually
+ * the same thing. */
+
+#include <arch/topology.h>
+#include <sys/queue.h>
+#include <env.h>
+#include <corerequest.h>
+#include <kmalloc.h>
+#include <trap.h>
+#include <string.h>
+
+/* The pcores in the system. (array gets alloced in init()).  */
+struct sched_pcore *all_pcores;
+
+/* TAILQ of all unallocated, idle (CG) cores */
+struct sched_pcore_tailq idlecores = TAILQ_HEAD_INITIALIZER(idlecores);
+
+/* Scratch space for scoring, protected by the ksched lock */
+static uint32_t *socket_nr_proc;
+static uint32_t *socket_nr_idle;
+
+static void __idle_insert_tail(struct sched_pcore *spc)
+{
+	TAILQ_INSERT_TAIL(&idlecores, spc, alloc_next);
+	spc->idle = TRUE;
+}
+
+static void __idle_remove(struct sched_pcore *spc)
+{
+	TAILQ_REMOVE(&idlecores, spc, alloc_next);
+	spc->idle = FALSE;
+}
+
+/* Links the hyperthreads of each cpu into rings.  If we only know of one cpu,
+ * the topology is flat (or unknown), and we treat every core as its own cpu. */
+static void init_siblings(void)
+{
+	struct core_info *ci_i, *ci_j;
+
+	for (int i = 0; i < num_cores; i++) {
+		all_pcores[i].sibling = &all_pcores[i];
+		all_pcores[i].socket_id = cpu_topology_info.core_list[i].socket_id;
+	}
+	if (cpu_topology_info.num_cpus <= 1)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		ci_i = &cpu_topology_info.core_list[i];
+		/* Find the next core of our cpu, wrapping around to the first */
+		for (int j = 1; j < num_cores; j++) {
+			ci_j = &cpu_topology_info.core_list[(i + j) % num_cores];
+			if (ci_j->cpu_id == ci_i->cpu_id) {
+				all_pcores[i].sibling = &all_pcores[(i + j) % num_cores];
+				break;
+			}
+		}
+	}
+}
+
+/* Initialize any data assocaited with doing core allocation. */
+void corealloc_init(void)
+{
+	/* Allocate all of our pcores. */
+	all_pcores = kzmalloc(sizeof(struct sched_pcore) * num_cores, 0);
+	socket_nr_proc = kzmalloc(sizeof(uint32_t) * num_cores, 0);
+	socket_nr_idle = kzmalloc(sizeof(uint32_t) * num_cores, 0);
+	init_siblings();
+	/* init the idlecore list.  if they turned off hyperthreading, give them the
+	 * odds from 1..max-1.  otherwise, give them everything by 0 (default mgmt
+	 * core).  TODO: (CG/LL) better LL/CG mgmt */
+#ifndef CONFIG_DISABLE_SMT
+	for (int i = 0; i < num_cores; i++)
+		if (!is_ll_core(i))
+			__idle_insert_tail(pcoreid2spc(i));
+#else
+	assert(!(num_cores % 2));
+	/* TODO: rethink starting at 1 here. If SMT is really disabled, the entire
+	 * core of an "ll" core shouldn't be available. */
+	for (int i = 1; i < num_cores; i += 2)
+		if (!is_ll_core(i))
+			__idle_insert_tail(pcoreid2spc(i));
+#endif /* CONFIG_DISABLE_SMT */
+}
+
+/* Initialize any data associated with allocating cores to a process. */
+void corealloc_proc_init(struct proc *p)
+{
+	TAILQ_INIT(&p->ksched_data.crd.prov_alloc_me);
+	TAILQ_INIT(&p->ksched_data.crd.prov_not_alloc_me);
+}
+
+/* Counts p's cores and the idle cores on each socket, for __score_core().  p
+ * may be 0. */
+static void __count_socket_usage(struct proc *p)
+{
+	struct sched_pcore *spc;
+
+	memset(socket_nr_proc, 0, sizeof(uint32_t) * num_cores);
+	memset(socket_nr_idle, 0, sizeof(uint32_t) * num_cores);
+	for (int i = 0; i < num_cores; i++) {
+		spc = &all_pcores[i];
+		if (p && (spc->alloc_proc == p))
+			socket_nr_proc[spc->socket_id]++;
+		else if (spc->idle)
+			socket_nr_idle[spc->socket_id]++;
+	}
+}
+
+/* Scores spc as a core for p (which may be 0, for the kernel's own use).
+ * Higher is better.  Call __count_socket_usage(p) first. */
+static uint64_t __score_core(struct proc *p, struct sched_pcore *spc)
+{
+	bool foreign_sibling = FALSE, our_sibling = FALSE;
+	uint64_t score;
+
+	for (struct sched_pcore *sib = spc->sibling; sib != spc;
+	     sib = sib->sibling) {
+		if (!sib->alloc_proc)
+			continue;
+		if (p && (sib->alloc_proc == p))
+			our_sibling = TRUE;
+		else
+			foreign_sibling = TRUE;
+	}
+	score = (uint64_t)!foreign_sibling << 42;
+	score |= (uint64_t)!(spc->prov_proc && (spc->prov_proc != p)) << 41;
+	score |= (uint64_t)MIN(socket_nr_proc[spc->socket_id], 0xfffff) << 21;
+	score |= (uint64_t)our_sibling << 20;
+	score |= MIN(socket_nr_idle[spc->socket_id], 0xfffff);
+	return score;
+}
+
+/* Returns the best idle core for p, out of those that are idle and for which
+ * allowed(spc) is true, or 0. */
+static struct sched_pcore *__best_idle_core(struct proc *p,
+                                  bool (*allowed)(struct sched_pcore *spc))
+{
+	struct sched_pcore *spc_i, *best = NULL;
+	uint64_t score, best_score = 0;
+
+	__count_socket_usage(p);
+	TAILQ_FOREACH(spc_i, &idlecores, alloc_next) {
+		if (allowed && !allowed(spc_i))
+			continue;
+		score = __score_core(p, spc_i);
+		if (!best || (score > best_score)) {
+			best = spc_i;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+/* Find the best core to allocate to a process as dictated by the core
+ * allocation algorithm. This code assumes that the scheduler that uses it
+ * holds a lock for the duration of the call. */
+uint32_t __find_best_core_to_alloc(struct proc *p)
+{
+	struct sched_pcore_tailq *prov_list = &p->ksched_data.crd.prov_not_alloc_me;
+	struct sched_pcore *spc_i, *best = NULL;
+	uint64_t score, best_score = 0;
+
+	/* Provisioned cores come first.  Of those, we take the best idle one, and
+	 * only then one we'd have to preempt. */
+	if (!TAILQ_EMPTY(prov_list)) {
+		__count_socket_usage(p);
+		TAILQ_FOREACH(spc_i, prov_list, prov_next) {
+			score = __score_core(p, spc_i) | ((uint64_t)spc_i->idle << 43);
+			if (!best || (score > best_score)) {
+				best = spc_i;
+				best_score = score;
+			}
+		}
+		return spc2pcoreid(best);
+	}
+	best = __best_idle_core(p, NULL);
+	if (!best)
+		return -1;
+	return spc2pcoreid(best);
+}
+
+/* Track the pcore properly when it is allocated to p. This code assumes that
+ * the scheduler that uses it holds a lock for the duration of the call. */
+void __track_core_alloc(struct proc *p, uint32_t pcoreid)
+{
+	struct sched_pcore *spc;
+
+	assert(pcoreid < num_cores);	/* catch bugs */
+	spc = pcoreid2spc(pcoreid);
+	assert(spc->alloc_proc != p);	/* corruption or double-alloc */
+	spc->alloc_proc = p;
+	/* if the pcore is prov to them and now allocated, move lists */
+	if (spc->prov_proc == p) {
+		TAILQ_REMOVE(&p->ksched_data.crd.prov_not_alloc_me, spc, prov_next);
+		TAILQ_INSERT_TAIL(&p->ksched_data.crd.prov_alloc_me, spc, prov_next);
+	}
+	/* Actually allocate the core, removing it from the idle core list. */
+	__idle_remove(spc);
+	/* Get the kernel's IRQs out of its way */
+	irq_core_allocated(pcoreid);
+}
+
+/* Track the pcore properly when it is deallocated from p. This code assumes
+ * that the scheduler that uses it holds a lock for the duration of the call.
+ * */
+void __track_core_dealloc(struct proc *p, uint32_t pcoreid)
+{
+	struct sched_pcore *spc;
+
+	assert(pcoreid < num_cores);	/* catch bugs */
+	spc = pcoreid2spc(pcoreid);
+	spc->alloc_proc = 0;
+	/* if the pcore is prov to them and now deallocated, move lists */
+	if (spc->prov_proc == p) {
+		TAILQ_REMOVE(&p->ksched_data.crd.prov_alloc_me, spc, prov_next);
+		/* this is the victim list, which can be sorted so that we pick the
+		 * right victim (sort by alloc_proc reverse priority, etc).  In this
+		 * case, the core isn't alloc'd by anyone, so it should be the first
+		 * victim. */
+		TAILQ_INSERT_HEAD(&p->ksched_data.crd.prov_not_alloc_me, spc,
+		                  prov_next);
+	}
+	/* Actually dealloc the core, putting it back on the idle core list. */
+	__idle_insert_tail(spc);
+}
+
+/* Bulk interface for __track_core_dealloc */
+void __track_core_dealloc_bulk(struct proc *p, uint32_t *pc_arr,
+                               uint32_t nr_cores)
+{
+	for (int i = 0; i < nr_cores; i++)
+		__track_core_dealloc(p, pc_arr[i]);
+}
+
+static bool __spc_not_provisioned(struct sched_pcore *spc)
+{
+	return !spc->prov_proc;
+}
+
+/* Get an idle core from our pcore list and return its core_id. Don't
+ * consider the chosen core in the future when handing out cores to a
+ * process. This code assumes that the scheduler that uses it holds a lock
+ * for the duration of the call. This will not give out provisioned cores.
+ *
+ * The kernel's cores are scored like a process with no cores, so we'll take a
+ * whole, idle physical core if there is one. */
+int __get_any_idle_core(void)
+{
+	struct sched_pcore *spc;
+
+	spc = __best_idle_core(NULL, __spc_not_provisioned);
+	if (!spc)
+		return -1;
+	assert(!spc->alloc_proc);
+	__idle_remove(spc);
+	return spc2pcoreid(spc);
+}
+
+/* Same as __get_any_idle_core() except for a specific core id. */
+int __get_specific_idle_core(int coreid)
+{
+	struct sched_pcore *spc = pcoreid2spc(coreid);
+	int ret = -1;
+
+	assert((coreid >= 0) && (coreid < num_cores));
+	if (spc->idle && !spc->prov_proc) {
+		assert(!spc->alloc_proc);
+		__idle_remove(spc);
+		ret = coreid;
+	}
+	return ret;
+}
+
+/* Reinsert a core obtained via __get_any_idle_core() or
+ * __get_specific_idle_core() back into the idlecore map. This code assumes
+ * that the scheduler that uses it holds a lock for the duration of the call.
+ * This will not give out provisioned cores. */
+void __put_idle_core(int coreid)
+{
+	struct sched_pcore *spc = pcoreid2spc(coreid);
+
+	assert((coreid >= 0) && (coreid < num_cores));
+	__idle_insert_tail(spc);
+}
+
+/* One off function to make 'pcoreid' the next core chosen by the core
+ * allocation algorithm (so long as no provisioned cores are still idle).
+ * This code assumes that the scheduler that uses it holds a lock for the
+ * duration of the call.
+ *
+ * With this policy, the order of the idle list only breaks ties between
+ * equally good cores, so this is just a hint. */
+void __next_core_to_alloc(uint32_t pcoreid)
+{
+	struct sched_pcore *spc = pcoreid2spc(pcoreid);
+
+	if (spc->idle) {
+		TAILQ_REMOVE(&idlecores, spc, alloc_next);
+		TAILQ_INSERT_HEAD(&idlecores, spc, alloc_next);
+		printk("Pcore %d will be given out next (from the idles)\n", pcoreid);
+	}
+}
+
+/* One off function to sort the idle core list for debugging in the kernel
+ * monitor. This code assumes that the scheduler that uses it holds a lock
+ * for the duration of the call. */
+void __sort_idle_cores(void)
+{
+	TAILQ_INIT(&idlecores);
+	for (int i = 0; i < num_cores; i++) {
+		if (all_pcores[i].idle)
+			TAILQ_INSERT_TAIL(&idlecores, &all_pcores[i], alloc_next);
+	}
+}
+
+/* Print the map of idle cores that are still allocatable through our core
+ * allocation algorithm. */
+void print_idle_core_map(void)
+{
+	struct sched_pcore *spc_i;
+	/* not locking, so we can look at this without deadlocking. */
+	printk("Idle cores (unlocked!):\n");
+	TAILQ_FOREACH(spc_i, &idlecores, alloc_next)
+		printk("Core %d, socket %d, sibling %d, prov to %d (%p)\n",
+		       spc2pcoreid(spc_i), spc_i->socket_id,
+		       spc2pcoreid(spc_i->sibling),
+		       spc_i->prov_proc ? spc_i->prov_proc->pid : 0, spc_i->prov_proc);
+}
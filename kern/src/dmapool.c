@@ -20,10 +20,27 @@
  * least 'size' bytes.  Free blocks are tracked in an unsorted singly-linked
  * list of free blocks within the page.  Used blocks aren't tracked, but we
  * keep a count of how many are currently allocated from each page.
+ *
+ * In front of the pages sit small per-core caches of free blocks, so the NIC
+ * ring refill paths don't take the pool lock for every descriptor.  A core
+ * whose cache runs dry pulls DMA_POOL_PCPU_BATCH extra blocks from the pages,
+ * and a full cache sends frees straight to the pages.  The bulk versions of
+ * alloc and free let a driver refill a ring with one call.  Lock ordering is
+ * pcpu cache -> pool.
  */
 
 #include <linux_compat.h>
 
+#define DMA_POOL_PCPU_MAX	64
+#define DMA_POOL_PCPU_BATCH	16
+
+struct dma_pool_pcpu {
+	spinlock_t lock;
+	unsigned int nr_blocks;
+	void *vaddrs[DMA_POOL_PCPU_MAX];
+	dma_addr_t handles[DMA_POOL_PCPU_MAX];
+};
+
 struct dma_pool {
 	struct list_head page_list;
 	spinlock_t lock;
@@ -33,6 +50,7 @@ struct dma_pool {
 	size_t boundary;
 	char name[32];
 	struct list_head pools;
+	struct dma_pool_pcpu *pcpu_caches;
 };
 
 struct dma_page {
@@ -75,13 +93,19 @@ struct dma_pool *dma_pool_create(const char *name, void *dev,
 	retval = kmalloc(sizeof(*retval), MEM_WAIT);
 	if (!retval)
 		return retval;
+	retval->pcpu_caches = kmalloc(sizeof(struct dma_pool_pcpu) * num_cores,
+	                              MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		spinlock_init_irqsave(&retval->pcpu_caches[i].lock);
+		retval->pcpu_caches[i].nr_blocks = 0;
+	}
 
 	strlcpy(retval->name, name, sizeof(retval->name));
 
 	retval->dev = dev;	/* FIXME */
 
 	INIT_LIST_HEAD(&retval->page_list);
-	spinlock_init(&retval->lock);
+	spinlock_init_irqsave(&retval->lock);
 	retval->size = size;
 	retval->boundary = boundary;
 	retval->allocation = allocation;
@@ -93,11 +117,6 @@ struct dma_pool *dma_pool_create(const char *name, void *dev,
 	return retval;
 }
 
-void dma_pool_destroy(struct dma_pool *pool)
-{
-	/* TODO */
-}
-
 static void pool_initialise_page(struct dma_pool *pool, struct dma_page *page)
 {
 	unsigned int offset = 0;
@@ -134,34 +153,166 @@ static struct dma_page *pool_alloc_page(struct dma_pool *pool, int mem_flags)
 	return page;
 }
 
-void *dma_pool_alloc(struct dma_pool *pool, int mem_flags, dma_addr_t *handle)
+/* Pulls up to nr blocks off the pages, allocating pages as needed.  Returns how
+ * many we got. */
+static int pool_get_blocks(struct dma_pool *pool, int mem_flags, void **vaddrs,
+                           dma_addr_t *handles, int nr)
 {
 	struct dma_page *page;
-	size_t offset;
-	void *retval;
+	unsigned int offset;
+	int got = 0;
+
+	spin_lock_irqsave(&pool->lock);
+	while (got < nr) {
+		list_for_each_entry(page, &pool->page_list, page_list) {
+			if (page->offset < pool->allocation)
+				goto ready;
+		}
+		/* Can't allocate with the lock held; we might block */
+		spin_unlock_irqsave(&pool->lock);
+		page = pool_alloc_page(pool, mem_flags);
+		spin_lock_irqsave(&pool->lock);
+		if (!page)
+			break;
+		list_add(&page->page_list, &pool->page_list);
+ready:
+		page->in_use++;
+		offset = page->offset;
+		page->offset = *(int *)(page->vaddr + offset);	/* "next" */
+		vaddrs[got] = offset + page->vaddr;
+		handles[got] = offset + page->dma;
+		got++;
+	}
+	spin_unlock_irqsave(&pool->lock);
+	return got;
+}
 
-	/* FIXME take care of locks */
+/* Gives blocks back to the free lists of their pages. */
+static void pool_put_blocks(struct dma_pool *pool, void **vaddrs,
+                            dma_addr_t *handles, int nr)
+{
+	struct dma_page *page;
+	unsigned int offset;
 
-	list_for_each_entry(page, &pool->page_list, page_list) {
-		if (page->offset < pool->allocation)
-			goto ready;
+	spin_lock_irqsave(&pool->lock);
+	for (int i = 0; i < nr; i++) {
+		list_for_each_entry(page, &pool->page_list, page_list) {
+			if ((page->dma <= handles[i]) &&
+			    (handles[i] < page->dma + pool->allocation))
+				goto found;
+		}
+		warn("dma_pool %s: freeing %p, which isn't ours", pool->name,
+		     vaddrs[i]);
+		continue;
+found:
+		offset = vaddrs[i] - page->vaddr;
+		*(int *)vaddrs[i] = page->offset;
+		page->offset = offset;
+		page->in_use--;
 	}
+	spin_unlock_irqsave(&pool->lock);
+}
 
-	page = pool_alloc_page(pool, mem_flags);
-	if (!page)
-		return NULL;
+static struct dma_pool_pcpu *get_my_pcpu_cache(struct dma_pool *pool)
+{
+	return &pool->pcpu_caches[core_id_early()];
+}
 
-	list_add(&page->page_list, &pool->page_list);
-ready:
-	page->in_use++;
-	offset = page->offset;
-	page->offset = *(int *)(page->vaddr + offset);	/* "next" */
-	retval = offset + page->vaddr;
-	*handle = offset + page->dma;
+/**
+ * dma_pool_alloc_bulk - Allocates up to nr blocks, returning how many we got.
+ *
+ * Block i's vaddr and dma address go in vaddrs[i] and handles[i].
+ */
+int dma_pool_alloc_bulk(struct dma_pool *pool, int mem_flags, void **vaddrs,
+                        dma_addr_t *handles, int nr)
+{
+	struct dma_pool_pcpu *pcc = get_my_pcpu_cache(pool);
+	void *refill_vaddrs[DMA_POOL_PCPU_BATCH];
+	dma_addr_t refill_handles[DMA_POOL_PCPU_BATCH];
+	int got = 0, nr_refill;
+
+	spin_lock_irqsave(&pcc->lock);
+	while ((got < nr) && pcc->nr_blocks) {
+		pcc->nr_blocks--;
+		vaddrs[got] = pcc->vaddrs[pcc->nr_blocks];
+		handles[got] = pcc->handles[pcc->nr_blocks];
+		got++;
+	}
+	spin_unlock_irqsave(&pcc->lock);
+	if (got == nr)
+		return got;
+	got += pool_get_blocks(pool, mem_flags, vaddrs + got, handles + got,
+	                       nr - got);
+	if (got < nr)
+		return got;
+	/* We ran our cache dry; stock up for next time */
+	nr_refill = pool_get_blocks(pool, mem_flags, refill_vaddrs,
+	                            refill_handles, DMA_POOL_PCPU_BATCH);
+	dma_pool_free_bulk(pool, refill_vaddrs, refill_handles, nr_refill);
+	return got;
+}
+
+/**
+ * dma_pool_free_bulk - Frees nr blocks from dma_pool_alloc{,_bulk}.
+ */
+void dma_pool_free_bulk(struct dma_pool *pool, void **vaddrs,
+                        dma_addr_t *handles, int nr)
+{
+	struct dma_pool_pcpu *pcc = get_my_pcpu_cache(pool);
+	int i = 0;
+
+	spin_lock_irqsave(&pcc->lock);
+	for (; (i < nr) && (pcc->nr_blocks < DMA_POOL_PCPU_MAX); i++) {
+		pcc->vaddrs[pcc->nr_blocks] = vaddrs[i];
+		pcc->handles[pcc->nr_blocks] = handles[i];
+		pcc->nr_blocks++;
+	}
+	spin_unlock_irqsave(&pcc->lock);
+	if (i < nr)
+		pool_put_blocks(pool, vaddrs + i, handles + i, nr - i);
+}
+
+void *dma_pool_alloc(struct dma_pool *pool, int mem_flags, dma_addr_t *handle)
+{
+	void *retval;
+
+	if (dma_pool_alloc_bulk(pool, mem_flags, &retval, handle, 1) != 1)
+		return NULL;
 	return retval;
 }
 
 void dma_pool_free(struct dma_pool *pool, void *vaddr, dma_addr_t addr)
 {
-	/* TODO */
+	dma_pool_free_bulk(pool, &vaddr, &addr, 1);
+}
+
+/**
+ * dma_pool_destroy - Frees the pool and its pages.
+ *
+ * All of the blocks should have been freed already.
+ */
+void dma_pool_destroy(struct dma_pool *pool)
+{
+	struct dma_pool_pcpu *pcc;
+	struct dma_page *page, *temp;
+
+	for (int i = 0; i < num_cores; i++) {
+		pcc = &pool->pcpu_caches[i];
+		pool_put_blocks(pool, pcc->vaddrs, pcc->handles, pcc->nr_blocks);
+		pcc->nr_blocks = 0;
+	}
+	list_for_each_entry_safe(page, temp, &pool->page_list, page_list) {
+		if (page->in_use) {
+			/* Someone still has a block; leak the page rather than
+			 * let the device scribble on free memory. */
+			warn("dma_pool %s destroyed with blocks in use", pool->name);
+			continue;
+		}
+		list_del(&page->page_list);
+		dma_free_coherent(pool->dev, pool->allocation, page->vaddr,
+		                  page->dma);
+		kfree(page);
+	}
+	kfree(pool->pcpu_caches);
+	kfree(pool);
 }
@@ -15,26 +15,155 @@
 # define elf_field(obj, field) ((obj##32)->field)
 #endif
 
-/* Check if the file is valid elf file (i.e. by checking for ELF_MAGIC in the
- * header) */
-bool is_valid_elf(struct file *f)
+/* A binary's ELF header and program headers, already checked, hung off its
+ * inode so that every exec of it doesn't have to read and check them again.
+ * It's stale once the inode's i_gen moves.  Writes through a shared, writable
+ * mmap don't bump i_gen, but no one should be doing that to a running binary.
+ *
+ * Users hold a kref, so they don't need i_lock while they look at it. */
+struct elf_cache {
+	struct kref					kref;
+	unsigned long				gen;
+	elf64_t						hdr;
+	size_t						phdrs_sz;
+	uint8_t						phdrs[];
+};
+
+static void elf_cache_release(struct kref *kref)
 {
-	elf64_t h;
-	off64_t o = 0;
-	uintptr_t c = switch_to_ktask();
+	kfree(container_of(kref, struct elf_cache, kref));
+}
 
-	if (f->f_op->read(f, (char*)&h, sizeof(elf64_t), &o) != sizeof(elf64_t)) {
-		goto fail;
+/* Called when the inode is going away. */
+void elf_cache_free(struct inode *inode)
+{
+	if (inode->i_elf)
+		kref_put(&inode->i_elf->kref);
+}
+
+static struct elf_cache *elf_cache_get(struct inode *inode)
+{
+	struct elf_cache *ec;
+
+	spin_lock(&inode->i_lock);
+	ec = inode->i_elf;
+	if (ec && ec->gen == ACCESS_ONCE(inode->i_gen))
+		kref_get(&ec->kref, 1);
+	else
+		ec = NULL;
+	spin_unlock(&inode->i_lock);
+	return ec;
+}
+
+/* Caches ec, unless the file changed since we started reading it. */
+static void elf_cache_set(struct inode *inode, struct elf_cache *ec)
+{
+	struct elf_cache *old = NULL;
+
+	spin_lock(&inode->i_lock);
+	if (ec->gen == ACCESS_ONCE(inode->i_gen)) {
+		old = inode->i_elf;
+		kref_get(&ec->kref, 1);
+		inode->i_elf = ec;
 	}
-	if (h.e_magic != ELF_MAGIC) {
-		goto fail;
+	spin_unlock(&inode->i_lock);
+	if (old)
+		kref_put(&old->kref);
+}
+
+/* Returns f's headers, with a ref for the caller, or 0 if f isn't an ELF we
+ * can run.  Call from a ktask. */
+static struct elf_cache *elf_get_hdrs(struct file *f, bool verbose)
+{
+	struct inode *inode = f->f_dentry->d_inode;
+	struct elf_cache *ec;
+	elf64_t elfhdr_storage;
+	elf32_t *elfhdr32 = (elf32_t*)&elfhdr_storage;
+	elf64_t *elfhdr64 = &elfhdr_storage;
+	unsigned long gen;
+	off64_t f_off = 0;
+	bool elf32, elf64;
+	size_t phsz;
+	uint16_t e_phnum;
+	uint64_t e_phoff;
+
+	ec = elf_cache_get(inode);
+	if (ec)
+		return ec;
+	/* Any write that starts after this will make us not cache what we read */
+	gen = ACCESS_ONCE(inode->i_gen);
+	cmb();
+	if (f->f_op->read(f, (char*)elfhdr64, sizeof(elf64_t), &f_off)
+	        != sizeof(elf64_t)) {
+		/* if you ever debug this, be sure to 0 out elfhrd_storage in advance */
+		if (verbose)
+			printk("[kernel] load_one_elf: failed to read file\n");
+		return NULL;
+	}
+	if (elfhdr64->e_magic != ELF_MAGIC) {
+		if (verbose)
+			printk("[kernel] load_one_elf: file is not an elf!\n");
+		return NULL;
+	}
+	elf32 = elfhdr32->e_ident[ELF_IDENT_CLASS] == ELFCLASS32;
+	elf64 = elfhdr64->e_ident[ELF_IDENT_CLASS] == ELFCLASS64;
+	if (elf64 == elf32) {
+		printk("[kernel] load_one_elf: ID as both 32 and 64 bit\n");
+		return NULL;
+	}
+	#ifndef CONFIG_64BIT
+	if (elf64) {
+		printk("[kernel] load_one_elf: 64 bit elf on 32 bit kernel\n");
+		return NULL;
+	}
+	#endif
+	/* Not sure what RISCV's 64 bit kernel can do here, so this check is x86
+	 * only */
+	#ifdef CONFIG_X86
+	if (elf32) {
+		printk("[kernel] load_one_elf: 32 bit elf on 64 bit kernel\n");
+		return NULL;
+	}
+	#endif
+
+	phsz = elf64 ? sizeof(proghdr64_t) : sizeof(proghdr32_t);
+	e_phnum = elf_field(elfhdr, e_phnum);
+	e_phoff = elf_field(elfhdr, e_phoff);
+	if (e_phnum > 10000 || e_phoff % (elf32 ? 4 : 8) != 0) {
+		printk("[kernel] load_one_elf: Bad program headers\n");
+		return NULL;
+	}
+	ec = kmalloc(sizeof(struct elf_cache) + e_phnum * phsz, 0);
+	if (!ec) {
+		printk("[kernel] load_one_elf: could not get program headers\n");
+		return NULL;
 	}
-success:
+	kref_init(&ec->kref, elf_cache_release, 1);
+	ec->gen = gen;
+	ec->hdr = elfhdr_storage;
+	ec->phdrs_sz = e_phnum * phsz;
+	f_off = e_phoff;
+	if (f->f_op->read(f, (char*)ec->phdrs, ec->phdrs_sz, &f_off) !=
+	    ec->phdrs_sz) {
+		printk("[kernel] load_one_elf: could not get program headers\n");
+		kref_put(&ec->kref);
+		return NULL;
+	}
+	elf_cache_set(inode, ec);
+	return ec;
+}
+
+/* Check if the file is an elf file that we can load. */
+bool is_valid_elf(struct file *f)
+{
+	uintptr_t c = switch_to_ktask();
+	struct elf_cache *ec = elf_get_hdrs(f, FALSE);
+
 	switch_back_from_ktask(c);
+	if (!ec)
+		return FALSE;
+	kref_put(&ec->kref);
 	return TRUE;
-fail:
-	switch_back_from_ktask(c);
-	return FALSE;
 }
 
 static uintptr_t populate_stack(struct proc *p, int argc, char *argv[],
@@ -143,64 +272,26 @@ static int load_one_elf(struct proc *p, struct file *f, uintptr_t pg_num,
 	ei->dynamic = 0;
 	ei->highest_addr = 0;
 	off64_t f_off = 0;
-	void* phdrs = 0;
+	struct elf_cache *ec;
+	void* phdrs;
 	int mm_perms, mm_flags = MAP_FIXED;
 
 	/* When reading on behalf of the kernel, we need to switch to a ktask so
 	 * the VFS (and maybe other places) know. (TODO: KFOP) */
 	uintptr_t old_ret = switch_to_ktask();
 
-	/* Read in ELF header. */
-	elf64_t elfhdr_storage;
-	elf32_t* elfhdr32 = (elf32_t*)&elfhdr_storage;
-	elf64_t* elfhdr64 = &elfhdr_storage;
-	if (f->f_op->read(f, (char*)elfhdr64, sizeof(elf64_t), &f_off)
-	        != sizeof(elf64_t)) {
-		/* if you ever debug this, be sure to 0 out elfhrd_storage in advance */
-		printk("[kernel] load_one_elf: failed to read file\n");
-		goto fail;
-	}
-	if (elfhdr64->e_magic != ELF_MAGIC) {
-		printk("[kernel] load_one_elf: file is not an elf!\n");
+	/* Get the ELF and program headers, which are already checked. */
+	ec = elf_get_hdrs(f, TRUE);
+	if (!ec)
 		goto fail;
-	}
-	bool elf32 = elfhdr32->e_ident[ELF_IDENT_CLASS] == ELFCLASS32;
+	elf64_t* elfhdr64 = &ec->hdr;
+	elf32_t* elfhdr32 = (elf32_t*)elfhdr64;
 	bool elf64 = elfhdr64->e_ident[ELF_IDENT_CLASS] == ELFCLASS64;
-	if (elf64 == elf32) {
-		printk("[kernel] load_one_elf: ID as both 32 and 64 bit\n");
-		goto fail;
-	}
-	#ifndef CONFIG_64BIT
-	if (elf64) {
-		printk("[kernel] load_one_elf: 64 bit elf on 32 bit kernel\n");
-		goto fail;
-	}
-	#endif
-	/* Not sure what RISCV's 64 bit kernel can do here, so this check is x86
-	 * only */
-	#ifdef CONFIG_X86
-	if (elf32) {
-		printk("[kernel] load_one_elf: 32 bit elf on 64 bit kernel\n");
-		goto fail;
-	}
-	#endif
-
 	size_t phsz = elf64 ? sizeof(proghdr64_t) : sizeof(proghdr32_t);
 	uint16_t e_phnum = elf_field(elfhdr, e_phnum);
-	uint16_t e_phoff = elf_field(elfhdr, e_phoff);
+	uint64_t e_phoff = elf_field(elfhdr, e_phoff);
+	phdrs = ec->phdrs;
 
-	/* Read in program headers. */
-	if (e_phnum > 10000 || e_phoff % (elf32 ? 4 : 8) != 0) {
-		printk("[kernel] load_one_elf: Bad program headers\n");
-		goto fail;
-	}
-	phdrs = kmalloc(e_phnum * phsz, 0);
-	f_off = e_phoff;
-	if (!phdrs || f->f_op->read(f, phdrs, e_phnum * phsz, &f_off) !=
-	              e_phnum * phsz) {
-		printk("[kernel] load_one_elf: could not get program headers\n");
-		goto fail;
-	}
 	for (int i = 0; i < e_phnum; i++) {
 		proghdr32_t* ph32 = (proghdr32_t*)phdrs + i;
 		proghdr64_t* ph64 = (proghdr64_t*)phdrs + i;
@@ -273,6 +364,14 @@ static int load_one_elf(struct proc *p, struct file *f, uintptr_t pg_num,
 				 * the proc's mapping */
 				uintptr_t partial = PGOFF(filesz);
 
+				/* Read-only segments with no BSS, like text and rodata, have
+				 * nothing to zero, so the last page can come straight from the
+				 * page cache too, shared with everyone else running it. */
+				if (partial && !(p_flags & ELF_PROT_WRITE) &&
+				    p_memsz == p_filesz) {
+					filesz = ROUNDUP(filesz, PGSIZE);
+					partial = 0;
+				}
 				if (filesz - partial) {
 					/* Map the complete pages. */
 					if (do_mmap(p, memstart, filesz - partial, mm_perms,
@@ -348,8 +447,8 @@ static int load_one_elf(struct proc *p, struct file *f, uintptr_t pg_num,
 	ret = 0;
 	/* Fall-through */
 fail:
-	if (phdrs)
-		kfree(phdrs);
+	if (ec)
+		kref_put(&ec->kref);
 	switch_back_from_ktask(old_ret);
 	return ret;
 }
@@ -17,6 +17,32 @@
 #include <assert.h>
 #include <pmap.h>
 #include <schedule.h>
+#include <percpu.h>
+
+/* Max distinct (proc, vcore) notifs a core can hold back at once */
+#define EV_NOTIF_DEFER_MAX		16
+/* Max CEQ msgs a core can hold back at once */
+#define EV_CEQ_DEFER_MAX		32
+
+struct ev_ceq_dst {
+	struct proc					*p;
+	struct event_queue			*ev_q;		/* user pointer */
+	uint32_t					vcoreid;
+};
+
+struct ev_notif_defer {
+	unsigned int				depth;
+	unsigned int				nr;
+	struct {
+		struct proc				*p;
+		uint32_t				vcoreid;
+	} notifs[EV_NOTIF_DEFER_MAX];
+	bool						flushing_msgs;
+	unsigned int				nr_msgs;
+	struct ev_ceq_dst			msg_dsts[EV_CEQ_DEFER_MAX];
+	struct event_msg			msgs[EV_CEQ_DEFER_MAX];
+};
+static DEFINE_PERCPU(struct ev_notif_defer, ev_notif_defer);
 
 /* Userspace could give us a vcoreid that causes us to compute a vcpd that is
  * outside procdata.  If we hit UWLIM, then we've gone farther than we should.
@@ -104,6 +130,8 @@ static void post_vc_msg(struct proc *p, uint32_t vcoreid,
 {
 	struct preempt_data *vcpd = &__procdata.vcore_preempt_data[vcoreid];
 	post_ev_msg(p, ev_mbox, ev_msg, ev_flags);
+	if (vcoreid < p->procinfo->max_vcores)
+		__sync_fetch_and_add(&p->vc_stats[vcoreid].nr_events, 1);
 	/* Set notif pending so userspace doesn't miss the message while yielding */
 	wmb(); /* Ensure ev_msg write is before notif_pending */
 	/* proc_notify() also sets this, but the ev_q might not have requested an
@@ -111,13 +139,129 @@ static void post_vc_msg(struct proc *p, uint32_t vcoreid,
 	vcpd->notif_pending = TRUE;
 }
 
+/* Holds back a notif for vcoreid until event_flush_notifs(), if the core is
+ * deferring.  Returns FALSE if the caller needs to send it now. */
+static bool defer_notify(struct proc *p, uint32_t vcoreid)
+{
+	struct ev_notif_defer *evd = PERCPU_VARPTR(ev_notif_defer);
+
+	if (!evd->depth)
+		return FALSE;
+	for (int i = 0; i < evd->nr; i++) {
+		if ((evd->notifs[i].p == p) && (evd->notifs[i].vcoreid == vcoreid))
+			return TRUE;
+	}
+	if (evd->nr == EV_NOTIF_DEFER_MAX)
+		return FALSE;
+	evd->notifs[evd->nr].p = p;
+	evd->notifs[evd->nr].vcoreid = vcoreid;
+	evd->nr++;
+	return TRUE;
+}
+
 /* Helper: will IPI / proc_notify if the flags say so.  We also check to make
  * sure it is mapped (slight optimization) */
 static void try_notify(struct proc *p, uint32_t vcoreid, int ev_flags)
 {
 	/* Note this is an unlocked-peek at the vcoremap */
-	if ((ev_flags & EVENT_IPI) && vcore_is_mapped(p, vcoreid))
-		proc_notify(p, vcoreid);
+	if ((ev_flags & EVENT_IPI) && vcore_is_mapped(p, vcoreid)) {
+		if (!defer_notify(p, vcoreid))
+			proc_notify(p, vcoreid);
+	}
+}
+
+static void __send_events(struct proc *p, struct event_queue *ev_q,
+                          struct event_msg *msgs, unsigned int nr,
+                          uint32_t vcoreid);
+
+/* Sends the CEQ msgs we held back, one __send_events() per (proc, ev_q), so
+ * each CEQ gets one ring post and one alert.  We're still deferring, so the
+ * notifs those alerts make are held back too. */
+static void flush_ceq_msgs(struct ev_notif_defer *evd)
+{
+	struct ev_ceq_dst *dst, tmp_dst;
+	struct event_msg tmp_msg;
+	unsigned int i, j, k;
+
+	evd->flushing_msgs = TRUE;
+	for (i = 0; i < evd->nr_msgs; i = k) {
+		dst = &evd->msg_dsts[i];
+		/* Pull the rest of i's batch up behind it, keeping its order */
+		for (k = i + 1, j = i + 1; j < evd->nr_msgs; j++) {
+			if ((evd->msg_dsts[j].p != dst->p) ||
+			    (evd->msg_dsts[j].ev_q != dst->ev_q))
+				continue;
+			tmp_dst = evd->msg_dsts[k];
+			tmp_msg = evd->msgs[k];
+			evd->msg_dsts[k] = evd->msg_dsts[j];
+			evd->msgs[k] = evd->msgs[j];
+			evd->msg_dsts[j] = tmp_dst;
+			evd->msgs[j] = tmp_msg;
+			k++;
+		}
+		__send_events(dst->p, dst->ev_q, &evd->msgs[i], k - i, dst->vcoreid);
+	}
+	evd->nr_msgs = 0;
+	evd->flushing_msgs = FALSE;
+}
+
+/* Holds back msgs for a CEQ ev_q until the flush, if the core is deferring.
+ * Returns FALSE if the caller needs to send them now. */
+static bool defer_ceq_msgs(struct proc *p, struct event_queue *ev_q,
+                           struct event_msg *msgs, unsigned int nr,
+                           uint32_t vcoreid)
+{
+	struct ev_notif_defer *evd = PERCPU_VARPTR(ev_notif_defer);
+	struct event_mbox *ev_mbox;
+
+	if (!evd->depth || evd->flushing_msgs || (nr > EV_CEQ_DEFER_MAX))
+		return FALSE;
+	if (ev_q->ev_flags & EVENT_SPAM_PUBLIC)
+		return FALSE;
+	ev_mbox = ev_q->ev_mbox;
+	if (!ev_mbox || !is_user_rwaddr(ev_mbox, sizeof(struct event_mbox)) ||
+	    (ev_mbox->type != EV_MBOX_CEQ))
+		return FALSE;
+	if (evd->nr_msgs + nr > EV_CEQ_DEFER_MAX)
+		flush_ceq_msgs(evd);
+	for (unsigned int i = 0; i < nr; i++) {
+		evd->msg_dsts[evd->nr_msgs].p = p;
+		evd->msg_dsts[evd->nr_msgs].ev_q = ev_q;
+		evd->msg_dsts[evd->nr_msgs].vcoreid = vcoreid;
+		evd->msgs[evd->nr_msgs] = msgs[i];
+		evd->nr_msgs++;
+	}
+	return TRUE;
+}
+
+/* Starts holding back this core's notifs (IPIs), so that a burst of events for
+ * the same vcore sends it only one.  Messages for CEQ mboxes are held back too,
+ * so that taps firing together post to each CEQ's ring once, and alert it
+ * once.  Other messages still go out right away.  Pair with
+ * event_flush_notifs(); pairs can nest.
+ *
+ * Don't block in between: the notifs are per core.  The caller must also keep
+ * every proc it sends to alive until the flush, e.g. with a lock on the list
+ * of taps it is firing. */
+void event_defer_notifs(void)
+{
+	PERCPU_VARPTR(ev_notif_defer)->depth++;
+}
+
+/* Sends the msgs and notifs held back since the outermost
+ * event_defer_notifs(). */
+void event_flush_notifs(void)
+{
+	struct ev_notif_defer *evd = PERCPU_VARPTR(ev_notif_defer);
+
+	assert(evd->depth);
+	if ((evd->depth == 1) && evd->nr_msgs)
+		flush_ceq_msgs(evd);
+	if (--evd->depth)
+		return;
+	for (int i = 0; i < evd->nr; i++)
+		proc_notify(evd->notifs[i].p, evd->notifs[i].vcoreid);
+	evd->nr = 0;
 }
 
 /* Helper: sends the message and an optional IPI to the vcore.  Sends to the
@@ -353,14 +497,11 @@ static void send_indir(struct proc *p, struct event_queue *ev_q,
 	spam_public_msg(p, &local_msg, vcoreid, ev_q->ev_flags);
 }
 
-/* Send an event to ev_q, based on the parameters in ev_q's flag.  We don't
- * accept null ev_qs, since the caller ought to be checking before bothering to
- * make a msg and send it to the event_q.  Vcoreid is who the kernel thinks the
- * message ought to go to (for IPIs).  Appropriate for things like
- * EV_PREEMPT_PENDING, where we tell the affected vcore.  To have the message go
- * where the kernel suggests, set EVENT_VCORE_APPRO(priate). */
-void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
-                uint32_t vcoreid)
+/* Helper: sends nr msgs to ev_q, with at most one alert for the lot.  See
+ * send_event(). */
+static void __send_events(struct proc *p, struct event_queue *ev_q,
+                          struct event_msg *msgs, unsigned int nr,
+                          uint32_t vcoreid)
 {
 	uintptr_t old_proc;
 	struct event_mbox *ev_mbox = 0;
@@ -389,6 +530,8 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 	/* ev_q is a user pointer, so we need to make sure we're in the right
 	 * address space */
 	old_proc = switch_to(p);
+	if (defer_ceq_msgs(p, ev_q, msgs, nr, vcoreid))
+		goto out;
 	/* Get the vcoreid that we'll message (if appropriate).  For INDIR and
 	 * SPAMMING, this is the first choice of a vcore, but other vcores might get
 	 * it.  Common case is !APPRO and !ROUNDROBIN.  Note we are clobbering the
@@ -413,7 +556,10 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 	 * we'll prefer to send it to whatever vcoreid we determined at this point
 	 * (via APPRO or whatever). */
 	if (ev_q->ev_flags & EVENT_SPAM_PUBLIC) {
-		spam_public_msg(p, msg, vcoreid, ev_q->ev_flags);
+		event_defer_notifs();
+		for (int i = 0; i < nr; i++)
+			spam_public_msg(p, &msgs[i], vcoreid, ev_q->ev_flags);
+		event_flush_notifs();
 		goto wakeup;
 	}
 	/* We aren't spamming and we know the default vcore, and now we need to
@@ -437,7 +583,12 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 		printk("[kernel] Illegal addr for ev_mbox\n");
 		goto out;
 	}
-	post_ev_msg(p, ev_mbox, msg, ev_q->ev_flags);
+	if (ev_mbox->type == EV_MBOX_CEQ) {
+		send_ceq_msgs(&ev_mbox->ceq, p, msgs, nr);
+	} else {
+		for (int i = 0; i < nr; i++)
+			post_ev_msg(p, ev_mbox, &msgs[i], ev_q->ev_flags);
+	}
 	wmb();	/* ensure ev_msg write is before alerting the vcore */
 	/* Prod/alert a vcore with an IPI or INDIR, if desired.  INDIR will also
 	 * call try_notify (IPI) later */
@@ -456,6 +607,28 @@ out:
 	switch_back(p, old_proc);
 }
 
+/* Send an event to ev_q, based on the parameters in ev_q's flag.  We don't
+ * accept null ev_qs, since the caller ought to be checking before bothering to
+ * make a msg and send it to the event_q.  Vcoreid is who the kernel thinks the
+ * message ought to go to (for IPIs).  Appropriate for things like
+ * EV_PREEMPT_PENDING, where we tell the affected vcore.  To have the message go
+ * where the kernel suggests, set EVENT_VCORE_APPRO(priate). */
+void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
+                uint32_t vcoreid)
+{
+	__send_events(p, ev_q, msg, 1, vcoreid);
+}
+
+/* Sends the nr msgs in msgs to ev_q, like nr send_event() calls, but with one
+ * pass over the ev_q and at most one INDIR or IPI for the batch. */
+void send_events(struct proc *p, struct event_queue *ev_q,
+                 struct event_msg *msgs, unsigned int nr, uint32_t vcoreid)
+{
+	if (!nr)
+		return;
+	__send_events(p, ev_q, msgs, nr, vcoreid);
+}
+
 /* Send an event for the kernel event ev_num.  These are the "one sided" kernel
  * initiated events, that require a lookup of the ev_q in procdata.  This is
  * roughly equivalent to the old "proc_notify()" */
@@ -499,3 +672,18 @@ void send_posix_signal(struct proc *p, int sig_nr)
 	local_msg.ev_arg1 = sig_nr;
 	send_kernel_event(p, &local_msg, 0);
 }
+
+/* Posts a posix signal directly to vcoreid's pending set in procdata and
+ * notifies it.  This is for per-vcore ticks, like profiling alarms, so if the
+ * vcore isn't running, the signal is dropped: no one was there to get it.
+ * Safe from IRQ context. */
+void send_vcore_signal(struct proc *p, uint32_t vcoreid, int sig_nr)
+{
+	struct preempt_data *vcpd = &p->procdata->vcore_preempt_data[vcoreid];
+
+	assert((sig_nr > 0) && (sig_nr < sizeof(long) * 8));
+	if (!vcore_is_mapped(p, vcoreid))
+		return;
+	atomic_or(&vcpd->sig_pending, 1UL << sig_nr);
+	proc_notify(p, vcoreid);
+}
@@ -15,6 +15,7 @@
 #include <error.h>
 #include <pmap.h>
 #include <bitmask.h>
+#include <bitmap.h>
 
 /* These structs are declared again and initialized farther down */
 struct page_map_operations ext2_pm_op;
@@ -157,45 +158,62 @@ void ext2_dirty_metablock(struct super_block *sb, void *buffer)
 		bdev_dirty_buffer(bh);
 }
 
-/* Helper for alloc_block.  It will try to alloc a block from the BG, starting
- * with blk_idx (relative number within the BG).   If successful, it will return
- * the FS block number via *block_num.  TODO: concurrency protection */
+/* Helper for alloc_blocks.  It will try to alloc up to *nr contiguous blocks
+ * from the BG, starting the search with blk_idx (relative number within the
+ * BG).  The run starts at the first free block and stops at the next used one
+ * or the end of the BG.  If successful, it will return the FS block number of
+ * the first via *block_num and the length of the run in *nr.  TODO:
+ * concurrency protection */
 static bool ext2_tryalloc(struct super_block *sb, struct ext2_block_group *bg,
-                          unsigned int blk_idx, uint32_t *block_num)
+                          unsigned int blk_idx, uint32_t *block_num,
+                          unsigned int *nr)
 {
 	uint8_t *blk_bitmap;
+	unsigned long *map;
 	struct ext2_sb_info *e2sbi = (struct ext2_sb_info*)sb->s_fs_info;
 	unsigned int blks_per_bg = le32_to_cpu(e2sbi->e2sb->s_blocks_per_group);
-	bool found = FALSE;
+	unsigned int free_cnt = le16_to_cpu(bg->bg_free_blocks_cnt);
+	unsigned int got = 0;
 
 	/* Check to see if there are any free blocks */
-	if (!le32_to_cpu(bg->bg_free_blocks_cnt))
+	if (!free_cnt)
 		return FALSE;
-	/* Check the bitmap for your desired block.  We'll loop through the whole
-	 * BG, starting with the one we want first. */
+	/* The on-disk bitmap is a little-endian byte array, which is the same as
+	 * an array of longs on our (little-endian) arches, so we can scan it a
+	 * word at a time.  Blocks are long-aligned. */
 	blk_bitmap = ext2_get_metablock(sb, bg->bg_block_bitmap);
-	for (int i = 0; i < blks_per_bg; i++) {
-		if (!(GET_BITMASK_BIT(blk_bitmap, blk_idx))) {
-			SET_BITMASK_BIT(blk_bitmap, blk_idx);
-			bg->bg_free_blocks_cnt--;
-			ext2_dirty_metablock(sb, blk_bitmap);
-			found = TRUE;
-			break;
-		}
-		/* Note: the wrap-around hasn't been tested yet */
-		blk_idx = (blk_idx + 1) % blks_per_bg;
+	map = (unsigned long*)blk_bitmap;
+	/* Check the bitmap for your desired block.  We'll look through the whole
+	 * BG, starting with the one we want first, and then wrap around.  Note:
+	 * the wrap-around hasn't been tested yet */
+	blk_idx = find_next_zero_bit(map, blks_per_bg, blk_idx);
+	if (blk_idx == blks_per_bg)
+		blk_idx = find_first_zero_bit(map, blks_per_bg);
+	/* If we found one, take it and as many free ones after it as we can */
+	if (blk_idx < blks_per_bg) {
+		got = find_next_bit(map, blks_per_bg, blk_idx) - blk_idx;
+		got = MIN(got, MIN(*nr, free_cnt));
+		bitmap_set(map, blk_idx, got);
+	}
+	if (got) {
+		bg->bg_free_blocks_cnt = cpu_to_le16(free_cnt - got);
+		ext2_dirty_metablock(sb, blk_bitmap);
 	}
 	ext2_put_metablock(sb, blk_bitmap);
-	if (found)
-		*block_num = ext2_bgidx2block(sb, bg, blk_idx);
-	return found;
+	if (!got)
+		return FALSE;
+	*block_num = ext2_bgidx2block(sb, bg, blk_idx);
+	*nr = got;
+	return TRUE;
 }
 
-/* This allocates a fresh block for the inode, preferably 'fetish' (name
- * courtesy of L.F.), returning the FS block number that's been allocated.
- * Note, Linux does some block preallocation here.  Consider doing the same (off
- * the in-memory inode).  Note the lack of concurrency protections here. */
-uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
+/* This allocates a run of up to *nr contiguous blocks for the inode, preferably
+ * starting at 'fetish' (name courtesy of L.F.), returning the FS block number
+ * of the first one and the length of the run in *nr.  We take the first free
+ * run we find instead of hunting for a longer one, so you might get less than
+ * you asked for.  Note the lack of concurrency protections here. */
+uint32_t ext2_alloc_blocks(struct inode *inode, uint32_t fetish,
+                           unsigned int *nr)
 {
 	struct ext2_sb_info *e2sbi = (struct ext2_sb_info*)inode->i_sb->s_fs_info;
 	struct ext2_block_group *fetish_bg, *bg_i = e2sbi->e2bg;
@@ -203,11 +221,12 @@ uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
 	bool found = FALSE;
 	uint32_t retval = 0;
 
+	assert(*nr);
 	/* Get our ideal starting point */
 	fetish_bg = ext2_block2bg(inode->i_sb, fetish);
 	blk_idx = ext2_block2bgidx(inode->i_sb, fetish);
 	/* Try to find a free block in the BG of the one we desire */
-	found = ext2_tryalloc(inode->i_sb, fetish_bg, blk_idx, &retval);
+	found = ext2_tryalloc(inode->i_sb, fetish_bg, blk_idx, &retval, nr);
 	if (found)
 		return retval;
 
@@ -217,7 +236,7 @@ uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
 	for (int i = 0; i < e2sbi->nr_bgs; i++, bg_i++) {
 		if (bg_i == fetish_bg)
 			continue;
-		found = ext2_tryalloc(inode->i_sb, bg_i, 0, &retval);
+		found = ext2_tryalloc(inode->i_sb, bg_i, 0, &retval, nr);
 		if (found)
 			break;
 	}
@@ -226,6 +245,72 @@ uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
 	return retval;
 }
 
+/* Gives back nr blocks starting at block_num.  They must all be in one BG, like
+ * the runs from ext2_alloc_blocks(). */
+static void ext2_free_blocks(struct super_block *sb, uint32_t block_num,
+                             unsigned int nr)
+{
+	struct ext2_block_group *bg = ext2_block2bg(sb, block_num);
+	unsigned int blk_idx = ext2_block2bgidx(sb, block_num);
+	uint8_t *blk_bitmap;
+
+	blk_bitmap = ext2_get_metablock(sb, bg->bg_block_bitmap);
+	for (int i = 0; i < nr; i++) {
+		assert(GET_BITMASK_BIT(blk_bitmap, blk_idx + i));
+		CLR_BITMASK_BIT(blk_bitmap, blk_idx + i);
+	}
+	bg->bg_free_blocks_cnt = cpu_to_le16(le16_to_cpu(bg->bg_free_blocks_cnt) +
+	                                     nr);
+	ext2_dirty_metablock(sb, blk_bitmap);
+	ext2_put_metablock(sb, blk_bitmap);
+}
+
+/* Gives the inode's unused prealloc window back to its BG */
+static void ext2_discard_prealloc(struct inode *inode)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+
+	if (!e2ii->i_prealloc_count)
+		return;
+	ext2_free_blocks(inode->i_sb, e2ii->i_prealloc_block,
+	                 e2ii->i_prealloc_count);
+	e2ii->i_prealloc_count = 0;
+}
+
+/* Returns a good hint for the inode's next data block: the next block of its
+ * prealloc window, or the start of its BG if it doesn't have one. */
+static uint32_t ext2_goal_block(struct inode *inode)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+
+	if (e2ii->i_prealloc_count)
+		return e2ii->i_prealloc_block;
+	return ext2_bgidx2block(inode->i_sb, ext2_inode2bg(inode), 0);
+}
+
+/* This allocates a fresh data block for the inode, preferably 'fetish',
+ * returning the FS block number that's been allocated.  Like Linux, we
+ * preallocate: if fetish is the next block in the inode's window, we hand it
+ * out without touching the bitmap.  O/w, we drop the window and start a new one
+ * of up to EXT2_PREALLOC_BLOCKS at fetish, so the blocks of a sequential write
+ * end up contiguous.  Note the lack of concurrency protections here. */
+uint32_t ext2_alloc_block(struct inode *inode, uint32_t fetish)
+{
+	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
+	unsigned int nr = EXT2_PREALLOC_BLOCKS;
+	uint32_t retval;
+
+	if (e2ii->i_prealloc_count && (fetish == e2ii->i_prealloc_block)) {
+		e2ii->i_prealloc_count--;
+		return e2ii->i_prealloc_block++;
+	}
+	ext2_discard_prealloc(inode);
+	retval = ext2_alloc_blocks(inode, fetish, &nr);
+	e2ii->i_prealloc_block = retval + 1;
+	e2ii->i_prealloc_count = nr - 1;
+	return retval;
+}
+
 /* Inode Management */
 
 /* Helper for alloc_diskinode.  It will try to alloc a disk inode from the BG.
@@ -321,13 +406,15 @@ static uint32_t *ext2_find_inotable_slot(struct inode *inode, uint32_t blkid,
 static void ext2_fill_inotable_slot(struct inode *inode, uint32_t *blk_slot)
 {
 	uint32_t new_blkid, hint_blk;
+	unsigned int nr = 1;
 	void *new_blk;
 
 	if (le32_to_cpu(*blk_slot))
 		return;
-	/* Use any block in our inode's BG as a hint for the indirect block */
+	/* Use any block in our inode's BG as a hint for the indirect block.  It
+	 * doesn't come from the prealloc window, which is for the data blocks. */
 	hint_blk = ext2_bgidx2block(inode->i_sb, ext2_inode2bg(inode), 0);
-	new_blkid = ext2_alloc_block(inode, hint_blk);
+	new_blkid = ext2_alloc_blocks(inode, hint_blk, &nr);
 	/* Actually read in the block we alloc'd */
 	new_blk = ext2_get_metablock(inode->i_sb, new_blkid);
 	memset(new_blk, 0, inode->i_sb->s_blocksize);
@@ -444,9 +531,7 @@ void *ext2_get_ino_metablock(struct inode *inode, unsigned long ino_block)
 	}
 	/* If there isn't a block there, alloc and insert one.  This block will be
 	 * the next big chunk of "file" data for this inode. */
-	blkid = ext2_alloc_block(inode, ext2_bgidx2block(inode->i_sb,
-	                                                 ext2_inode2bg(inode),
-	                                                 0));
+	blkid = ext2_alloc_block(inode, ext2_goal_block(inode));
 	*blk_slot = cpu_to_le32(blkid);
 	ext2_dirty_metablock(inode->i_sb, blk_slot);
 	ext2_put_metablock(inode->i_sb, blk_slot);
@@ -661,11 +746,8 @@ int ext2_mappage(struct page_map *pm, struct page *page)
 		/* If there isn't a block there, lets get one.  The previous fs_blk_num
 		 * is our hint (or we have to compute one). */
 		if (!*fs_blk_slot) {
-			if (!fs_blk_num) {
-				fs_blk_num = ext2_bgidx2block(inode->i_sb,
-				                              ext2_inode2bg(inode), 0);
-			}
-			fs_blk_num = ext2_alloc_block(inode, fs_blk_num + 1);
+			fs_blk_num = fs_blk_num ? fs_blk_num + 1 : ext2_goal_block(inode);
+			fs_blk_num = ext2_alloc_block(inode, fs_blk_num);
 			/* Link it, and dirty the inode indirect block */
 			*fs_blk_slot = cpu_to_le32(fs_blk_num);
 			ext2_dirty_metablock(inode->i_sb, fs_blk_slot);
@@ -693,21 +775,27 @@ int ext2_mappage(struct page_map *pm, struct page *page)
 	return 0;
 }
 
-/* Fills page with its contents from its backing store file.  Note that we do
- * the zero padding here, instead of higher in the VFS.  Might change in the
- * future.  TODO: make this a block FS generic call. */
-int ext2_readpage(struct page_map *pm, struct page *page)
+/* Fills pages with their contents from the backing store file, with one block
+ * request for all of them.  Note that we do the zero padding here, instead of
+ * higher in the VFS.  Might change in the future.  TODO: make this a block FS
+ * generic call. */
+int ext2_readpages(struct page_map *pm, struct page **pages, unsigned int nr)
 {
 	int retval;
 	struct block_device *bdev = pm->pm_host->i_sb->s_bdev;
 	struct buffer_head *bh;
 	struct block_request *breq;
-	void *eobh;
+	unsigned int nr_bhs = 0;
+	uintptr_t eof_off;
 
-	atomic_or(&page->pg_flags, PG_BUFFER);
-	retval = ext2_mappage(pm, page);
-	if (retval)
-		return retval;
+	for (int i = 0; i < nr; i++) {
+		atomic_or(&pages[i]->pg_flags, PG_BUFFER);
+		retval = ext2_mappage(pm, pages[i]);
+		if (retval)
+			return retval;
+		for (bh = pages[i]->pg_private; bh; bh = bh->bh_next)
+			nr_bhs++;
+	}
 	/* Build and submit the request */
 	breq = kmem_cache_alloc(breq_kcache, 0);
 	if (!breq)
@@ -717,46 +805,60 @@ int ext2_readpage(struct page_map *pm, struct page *page)
 	breq->data = 0;
 	sem_init_irqsave(&breq->sem, 0);
 	breq->bhs = breq->local_bhs;
+	if (nr_bhs > NR_INLINE_BH) {
+		breq->bhs = kmalloc(nr_bhs * sizeof(struct buffer_head*), 0);
+		if (!breq->bhs) {
+			kmem_cache_free(breq_kcache, breq);
+			return -ENOMEM;
+		}
+	}
 	breq->nr_bhs = 0;
-	/* Pack the BH pointers in the block request */
-	bh = (struct buffer_head*)page->pg_private;
-	assert(bh);
-	/* Either read the block in, or zero the buffer.  If we wanted to ensure no
-	 * data is leaked after a crash, we'd write a 0 block too. */
-	for (int i = 0; bh; bh = bh->bh_next) {
-		if (!(bh->bh_flags & BH_NEEDS_ZEROED)) {
-			breq->bhs[i] = bh;
-			breq->nr_bhs++;
-			i++;
-		} else {
-			memset(bh->bh_buffer, 0, pm->pm_host->i_sb->s_blocksize);
-			bh->bh_flags |= BH_DIRTY;
-			atomic_or(&bh->bh_page->pg_flags, PG_DIRTY);
+	/* Pack the BH pointers in the block request.  Either read the block in, or
+	 * zero the buffer.  If we wanted to ensure no data is leaked after a
+	 * crash, we'd write a 0 block too. */
+	for (int i = 0; i < nr; i++) {
+		bh = (struct buffer_head*)pages[i]->pg_private;
+		assert(bh);
+		for (; bh; bh = bh->bh_next) {
+			if (!(bh->bh_flags & BH_NEEDS_ZEROED)) {
+				breq->bhs[breq->nr_bhs++] = bh;
+			} else {
+				memset(bh->bh_buffer, 0, pm->pm_host->i_sb->s_blocksize);
+				bdev_dirty_buffer(bh);
+			}
 		}
 	}
 	retval = bdev_submit_request(bdev, breq);
 	assert(!retval);
 	sleep_on_breq(breq);
+	if (breq->bhs != breq->local_bhs)
+		kfree(breq->bhs);
 	kmem_cache_free(breq_kcache, breq);
-	/* zero out whatever is beyond the EOF.  we could do this by figuring out
-	 * where the BHs end and zeroing from there, but I'd rather zero from where
-	 * the file ends (which could be in the middle of an FS block */
-	uintptr_t eof_off;
-	eof_off = (pm->pm_host->i_size - page->pg_index * PGSIZE);
-	eof_off = MIN(eof_off, PGSIZE) % PGSIZE;
-	/* at this point, eof_off is the offset into the page of the EOF, or 0 */
-	if (eof_off)
-		memset(eof_off + page2kva(page), 0, PGSIZE - eof_off);
-	/* Now the page is up to date */
-	atomic_or(&page->pg_flags, PG_UPTODATE);
-	/* Useful debugging.  Put one higher up if the page is not getting mapped */
-	//print_pageinfo(page);
+	for (int i = 0; i < nr; i++) {
+		/* zero out whatever is beyond the EOF.  we could do this by figuring
+		 * out where the BHs end and zeroing from there, but I'd rather zero
+		 * from where the file ends (which could be in the middle of an FS
+		 * block */
+		eof_off = (pm->pm_host->i_size - pages[i]->pg_index * PGSIZE);
+		eof_off = MIN(eof_off, PGSIZE) % PGSIZE;
+		/* at this point, eof_off is the offset into the page of the EOF, or
+		 * 0 */
+		if (eof_off)
+			memset(eof_off + page2kva(pages[i]), 0, PGSIZE - eof_off);
+		/* Now the page is up to date */
+		atomic_or(&pages[i]->pg_flags, PG_UPTODATE);
+	}
 	return 0;
 }
 
+int ext2_readpage(struct page_map *pm, struct page *page)
+{
+	return ext2_readpages(pm, &page, 1);
+}
+
 int ext2_writepage(struct page_map *pm, struct page *page)
 {
-	return -1;
+	return block_writepage(pm, page);
 }
 
 /* Super Operations */
@@ -782,6 +884,7 @@ struct inode *ext2_alloc_inode(struct super_block *sb)
  * inode is still on disc is irrelevant. */
 void ext2_dealloc_inode(struct inode *inode)
 {
+	ext2_discard_prealloc(inode);
 	kmem_cache_free(ext2_i_kcache, inode->i_fs_info);
 }
 
@@ -852,6 +955,7 @@ void ext2_read_inode(struct inode *inode)
 	struct ext2_i_info *e2ii = (struct ext2_i_info*)inode->i_fs_info;
 	for (int i = 0; i < 15; i++)
 		e2ii->i_block[i] = le32_to_cpu(my_ino->i_block[i]);
+	e2ii->i_prealloc_count = 0;
 	/* TODO: (HASH) unused: inode->i_hash add to hash (saves on disc reading) */
 	/* TODO: we could consider saving a pointer to the disk inode and pinning
 	 * its buffer in memory, but for now we'll just free it. */
@@ -1001,6 +1105,349 @@ static uint32_t ext2_foreach_dirent(struct inode *dir, each_func_t my_work,
 	return dir_block;
 }
 
+/* Performs my_work on each dirent in a single dir block, returning TRUE if one
+ * of the calls succeeded. */
+static bool ext2_foreach_dirent_blk(struct inode *dir, uint32_t dir_block,
+                                    each_func_t my_work, long a1, long a2,
+                                    long a3)
+{
+	struct ext2_dirent *dir_buf, *dir_i;
+	void *buf_end;
+	bool retval = FALSE;
+
+	dir_buf = ext2_get_ino_metablock(dir, dir_block);
+	buf_end = (void*)dir_buf + dir->i_sb->s_blocksize;
+	for (dir_i = dir_buf; (void*)dir_i < buf_end;
+	     dir_i = (void*)dir_i + le16_to_cpu(dir_i->dir_reclen)) {
+		/* a reclen of 0 would loop forever; the block is corrupt */
+		if (!dir_i->dir_reclen)
+			break;
+		if (my_work(dir_i, a1, a2, a3)) {
+			retval = TRUE;
+			break;
+		}
+	}
+	ext2_put_metablock(dir->i_sb, dir_buf);
+	return retval;
+}
+
+/* Directory index hashes.  These need to match ext3/4 bit for bit, since the
+ * hashes are on disk. */
+
+#define DX_ROL32(x, s)		(((x) << (s)) | ((x) >> (32 - (s))))
+
+static inline int dx_char(const char *name, int i, bool is_unsigned)
+{
+	return is_unsigned ? (int)(unsigned char)name[i]
+	                   : (int)(signed char)name[i];
+}
+
+static uint32_t dx_hack_hash(const char *name, int len, bool is_unsigned)
+{
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+	for (int i = 0; i < len; i++) {
+		hash = hash1 + (hash0 ^ (dx_char(name, i, is_unsigned) * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+/* Packs up to num words of name into buf, padding with the length */
+static void dx_str2hashbuf(const char *name, int len, uint32_t *buf, int num,
+                           bool is_unsigned)
+{
+	uint32_t pad, val;
+
+	pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (int i = 0; i < len; i++) {
+		val = dx_char(name, i, is_unsigned) + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+static void dx_tea_transform(uint32_t buf[4], uint32_t const in[4])
+{
+	uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+	for (int n = 0; n < 16; n++) {
+		sum += 0x9e3779b9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+#define DX_F(x, y, z)		((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z)		(((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z)		((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s)                                          \
+	((a) += f((b), (c), (d)) + (x), (a) = DX_ROL32((a), (s)))
+#define DX_K1				0
+#define DX_K2				013240474631UL
+#define DX_K3				015666365641UL
+
+static void dx_half_md4_transform(uint32_t buf[4], uint32_t const in[8])
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	DX_ROUND(DX_F, a, b, c, d, in[0] + DX_K1, 3);
+	DX_ROUND(DX_F, d, a, b, c, in[1] + DX_K1, 7);
+	DX_ROUND(DX_F, c, d, a, b, in[2] + DX_K1, 11);
+	DX_ROUND(DX_F, b, c, d, a, in[3] + DX_K1, 19);
+	DX_ROUND(DX_F, a, b, c, d, in[4] + DX_K1, 3);
+	DX_ROUND(DX_F, d, a, b, c, in[5] + DX_K1, 7);
+	DX_ROUND(DX_F, c, d, a, b, in[6] + DX_K1, 11);
+	DX_ROUND(DX_F, b, c, d, a, in[7] + DX_K1, 19);
+
+	DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2, 3);
+	DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2, 5);
+	DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2, 9);
+	DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+	DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2, 3);
+	DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2, 5);
+	DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2, 9);
+	DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+	DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3, 3);
+	DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3, 9);
+	DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+	DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3, 3);
+	DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3, 9);
+	DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+/* Computes the major hash of name for the given hash version (already adjusted
+ * for the FS's signedness).  The low bit is always clear, since the index uses
+ * it for collisions. */
+static uint32_t ext2_dx_hash(struct super_block *sb, int version,
+                             const char *name, int len)
+{
+	struct ext2_sb *e2sb = ((struct ext2_sb_info*)sb->s_fs_info)->e2sb;
+	uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	uint32_t in[8], hash;
+	bool is_unsigned = version >= EXT2_DX_HASH_LEGACY_UNSIGNED;
+
+	/* An all-zero seed means use the default */
+	for (int i = 0; i < 4; i++) {
+		if (e2sb->s_hash_seed[i]) {
+			for (int j = 0; j < 4; j++)
+				buf[j] = le32_to_cpu(e2sb->s_hash_seed[j]);
+			break;
+		}
+	}
+	switch (version) {
+		case (EXT2_DX_HASH_LEGACY):
+		case (EXT2_DX_HASH_LEGACY_UNSIGNED):
+			hash = dx_hack_hash(name, len, is_unsigned);
+			break;
+		case (EXT2_DX_HASH_HALF_MD4):
+		case (EXT2_DX_HASH_HALF_MD4_UNSIGNED):
+			for (const char *p = name; len > 0; len -= 32, p += 32) {
+				dx_str2hashbuf(p, len, in, 8, is_unsigned);
+				dx_half_md4_transform(buf, in);
+			}
+			hash = buf[1];
+			break;
+		case (EXT2_DX_HASH_TEA):
+		case (EXT2_DX_HASH_TEA_UNSIGNED):
+			for (const char *p = name; len > 0; len -= 16, p += 16) {
+				dx_str2hashbuf(p, len, in, 4, is_unsigned);
+				dx_tea_transform(buf, in);
+			}
+			hash = buf[0];
+			break;
+		default:
+			panic("Unknown dir hash version %d", version);
+	}
+	hash &= ~1;
+	/* 0x7fffffff << 1 is reserved for EOF by readdir */
+	if (hash == (0x7fffffff << 1))
+		hash = 0x7ffffffe << 1;
+	return hash;
+}
+
+/* One level of a walk down a dir index */
+struct ext2_dx_frame {
+	void						*buf;		/* metablock of the node */
+	struct ext2_dx_entry		*entries;
+	struct ext2_dx_entry		*at;		/* the entry we followed */
+};
+
+static unsigned int dx_count(struct ext2_dx_entry *entries)
+{
+	return le16_to_cpu(((struct ext2_dx_countlimit*)entries)->count);
+}
+
+static unsigned int dx_limit(struct ext2_dx_entry *entries)
+{
+	return le16_to_cpu(((struct ext2_dx_countlimit*)entries)->limit);
+}
+
+/* The top byte is reserved */
+static uint32_t dx_block(struct ext2_dx_entry *entry)
+{
+	return le32_to_cpu(entry->block) & 0x00ffffff;
+}
+
+static bool ext2_dir_is_indexed(struct inode *dir)
+{
+	struct ext2_sb *e2sb = ((struct ext2_sb_info*)dir->i_sb->s_fs_info)->e2sb;
+
+	return (le32_to_cpu(e2sb->s_feature_compat) &
+	        EXT2_FEATURE_COMPAT_DIR_INDEX) && (dir->i_flags & EXT2_INDEX_FL);
+}
+
+/* Binary search for the last entry whose hash is <= hash.  Entry 0 has no hash
+ * and covers everything below entry 1's. */
+static struct ext2_dx_entry *ext2_dx_search(struct ext2_dx_entry *entries,
+                                            uint32_t hash)
+{
+	struct ext2_dx_entry *p = entries + 1, *q = entries + dx_count(entries) - 1;
+	struct ext2_dx_entry *m;
+
+	while (p <= q) {
+		m = p + (q - p) / 2;
+		if (le32_to_cpu(m->hash) > hash)
+			q = m - 1;
+		else
+			p = m + 1;
+	}
+	return p - 1;
+}
+
+static void ext2_dx_release(struct super_block *sb,
+                            struct ext2_dx_frame *frames, int nr_frames)
+{
+	for (int i = 0; i < nr_frames; i++)
+		ext2_put_metablock(sb, frames[i].buf);
+}
+
+/* Checks that a node's entries and the dir block they point to make sense, so
+ * we don't walk off into garbage (or allocate blocks for the dir). */
+static bool ext2_dx_node_ok(struct inode *dir, struct ext2_dx_entry *entries,
+                            struct ext2_dx_entry *at)
+{
+	unsigned int nr_blocks = dir->i_size / dir->i_sb->s_blocksize;
+
+	return dx_count(entries) && (dx_count(entries) <= dx_limit(entries)) &&
+	       (dx_block(at) < nr_blocks);
+}
+
+/* Walks dir's index down to the leaf that would hold name, filling in a frame
+ * per level and the name's hash in *hash.  Returns the number of frames (put
+ * them with ext2_dx_release()), or 0 if the index is something we don't
+ * understand, in which case the caller should just scan the dir. */
+static int ext2_dx_probe(struct inode *dir, const char *name, int len,
+                         uint32_t *hash, struct ext2_dx_frame *frames)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ext2_sb *e2sb = ((struct ext2_sb_info*)sb->s_fs_info)->e2sb;
+	struct ext2_dx_root_info *info;
+	struct ext2_dx_entry *entries;
+	int version, nr_frames;
+	void *buf;
+
+	buf = ext2_get_ino_metablock(dir, 0);
+	info = buf + EXT2_DX_ROOT_INFO_OFF;
+	version = info->hash_version;
+	if (info->reserved_zero || (info->info_length < 8) ||
+	    (info->indirect_levels >= EXT2_DX_MAX_LEVELS) ||
+	    (version > EXT2_DX_HASH_TEA)) {
+		ext2_put_metablock(sb, buf);
+		return 0;
+	}
+	if (le32_to_cpu(e2sb->s_flags) & EXT2_FLAGS_UNSIGNED_HASH)
+		version += EXT2_DX_HASH_LEGACY_UNSIGNED;
+	*hash = ext2_dx_hash(sb, version, name, len);
+	nr_frames = info->indirect_levels + 1;
+	entries = (void*)info + info->info_length;
+	for (int i = 0; i < nr_frames; i++) {
+		frames[i].buf = buf;
+		frames[i].entries = entries;
+		frames[i].at = ext2_dx_search(entries, *hash);
+		if (!ext2_dx_node_ok(dir, entries, frames[i].at)) {
+			ext2_dx_release(sb, frames, i + 1);
+			return 0;
+		}
+		if (i == nr_frames - 1)
+			break;
+		buf = ext2_get_ino_metablock(dir, dx_block(frames[i].at));
+		entries = buf + EXT2_DX_NODE_OFF;
+	}
+	return nr_frames;
+}
+
+/* Moves the frames on to the next leaf, if equal hashes might carry over into
+ * it.  Returns FALSE if there's nothing more to look at for hash. */
+static bool ext2_dx_next_leaf(struct inode *dir, uint32_t hash,
+                              struct ext2_dx_frame *frames, int nr_frames)
+{
+	struct ext2_dx_frame *f;
+	int i;
+
+	/* Find the lowest level with another entry after the one we took */
+	for (i = nr_frames - 1; i >= 0; i--) {
+		f = &frames[i];
+		if (f->at + 1 < f->entries + dx_count(f->entries))
+			break;
+	}
+	if (i < 0)
+		return FALSE;
+	f->at++;
+	if ((le32_to_cpu(f->at->hash) & ~1) != hash)
+		return FALSE;
+	/* Go down the left edge of the subtree under the new entry */
+	for (i++; i < nr_frames; i++) {
+		f = &frames[i];
+		ext2_put_metablock(dir->i_sb, f->buf);
+		f->buf = ext2_get_ino_metablock(dir, dx_block(frames[i - 1].at));
+		f->entries = f->buf + EXT2_DX_NODE_OFF;
+		f->at = f->entries;
+		if (!ext2_dx_node_ok(dir, f->entries, f->at))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Turns off dir's index, for when we're about to change the dir in a way the
+ * index can't track.  The index nodes look like empty dirent blocks, so the dir
+ * is still a valid linear dir.  This is what ext3 without dir_index does. */
+static void ext2_dx_drop_index(struct inode *dir)
+{
+	struct ext2_inode *disk_inode;
+
+	dir->i_flags &= ~EXT2_INDEX_FL;
+	disk_inode = ext2_get_diskinode(dir);
+	disk_inode->i_flags = cpu_to_le32(dir->i_flags);
+	ext2_dirty_metablock(dir->i_sb, disk_inode);
+	ext2_put_metablock(dir->i_sb, disk_inode);
+}
+
 /* Returns the actual length of a dirent, not just how far to the next entry.
  * If there is no inode, the entry is unused, and it has no length (as far as
  * users of this should care). */
@@ -1062,10 +1509,9 @@ static bool create_each_func(struct ext2_dirent *dir_i, long a1, long a2,
 	unsigned int real_len = ext2_dirent_len(dir_i);
 	/* How much room is available after this dir_i before the next one */
 	unsigned int record_slack = le16_to_cpu(dir_i->dir_reclen) - real_len;
-	/* TODO: Note that this technique will clobber any directory indexing.  They
-	 * exist after the .. entry with an inode of 0.  Check the docs for
-	 * specifics and think up a nice way to tell the diff between a reserved
-	 * entry and an unused one, when inode == 0. */
+	/* Note that this technique will clobber any directory indexing, since the
+	 * index nodes look like unused entries.  Only run this on leaf blocks of
+	 * an indexed dir (or drop the index first). */
 	if (record_slack < our_rec_len)
 		return FALSE;
 	/* At this point, there is enough room for us.  Stick our new one in right
@@ -1089,9 +1535,12 @@ int ext2_create(struct inode *dir, struct dentry *dentry, int mode,
 	struct ext2_block_group *dir_bg = ext2_inode2bg(dir);
 	struct ext2_inode *disk_inode;
 	struct ext2_i_info *e2ii;
-	uint32_t dir_block;
+	struct ext2_dx_frame frames[EXT2_DX_MAX_LEVELS];
+	int nr_frames;
+	uint32_t dir_block, hash;
 	unsigned int our_rec_len;
 	struct ext2_dirent *new_dirent;
+	bool done;
 	/* Set basic inode stuff for files, get a disk inode, etc */
 	SET_FTYPE(inode->i_mode, __S_IFREG);
 	inode->i_fop = &ext2_f_op_file;
@@ -1104,6 +1553,7 @@ int ext2_create(struct inode *dir, struct dentry *dentry, int mode,
 	e2ii = (struct ext2_i_info*)inode->i_fs_info;
 	for (int i = 0; i < 15; i++)
 		e2ii->i_block[i] = le32_to_cpu(disk_inode->i_block[i]);
+	e2ii->i_prealloc_count = 0;
 	/* Dirty and put the disk inode */
 	ext2_dirty_metablock(dentry->d_sb, disk_inode);
 	ext2_put_metablock(dentry->d_sb, disk_inode);
@@ -1111,8 +1561,24 @@ int ext2_create(struct inode *dir, struct dentry *dentry, int mode,
 	/* Note the disk dir_name is not null terminated */
 	our_rec_len = ROUNDUP(8 + dentry->d_name.len, 4);
 	assert(our_rec_len <= 8 + 256);
-	/* Consider caching the start point for future dirent ops.  Or even using
-	 * the indexed directory.... */
+	/* If the dir is indexed, the name can go in the leaf for its hash, if
+	 * there's room.  We don't split leaves, so if it's full, we give up on the
+	 * index and fall back to the linear dir underneath. */
+	if (ext2_dir_is_indexed(dir)) {
+		nr_frames = ext2_dx_probe(dir, dentry->d_name.name,
+		                          dentry->d_name.len, &hash, frames);
+		if (nr_frames) {
+			done = ext2_foreach_dirent_blk(dir,
+			                               dx_block(frames[nr_frames - 1].at),
+			                               create_each_func, (long)dentry,
+			                               (long)our_rec_len, (long)mode);
+			ext2_dx_release(dir->i_sb, frames, nr_frames);
+			if (done)
+				return 0;
+		}
+		ext2_dx_drop_index(dir);
+	}
+	/* Consider caching the start point for future dirent ops. */
 	dir_block = ext2_foreach_dirent(dir, create_each_func, (long)dentry,
 	                                (long)our_rec_len, (long)mode);
 	/* If this returned a block number, we didn't find room in any of the
@@ -1135,8 +1601,10 @@ static bool lookup_each_func(struct ext2_dirent *dir_i, long a1, long a2,
 {
 	struct dentry *dentry = (struct dentry*)a1;
 	/* Test if we're the one (TODO: use d_compare).  Note, dir_name is not
-	 * null terminated, hence the && test. */
-	if (!strncmp((char*)dir_i->dir_name, dentry->d_name.name,
+	 * null terminated, hence the && test.  Unused entries (including index
+	 * nodes) have no inode. */
+	if (le32_to_cpu(dir_i->dir_inode) &&
+	    !strncmp((char*)dir_i->dir_name, dentry->d_name.name,
 	             dir_i->dir_namelen) &&
 	            (dentry->d_name.name[dir_i->dir_namelen] == '\0')) {
 		load_inode(dentry, (long)le32_to_cpu(dir_i->dir_inode));
@@ -1157,9 +1625,30 @@ struct dentry *ext2_lookup(struct inode *dir, struct dentry *dentry,
                            struct nameidata *nd)
 {
 	assert(S_ISDIR(dir->i_mode));
-	struct ext2_dirent *dir_buf, *dir_i;
-	if (!ext2_foreach_dirent(dir, lookup_each_func, (long)dentry, 0, 0))
+	struct ext2_dx_frame frames[EXT2_DX_MAX_LEVELS];
+	int nr_frames = 0;
+	uint32_t hash;
+	bool found = FALSE;
+
+	/* With an index, we only need to look in the leaf (or leaves, with hash
+	 * collisions) for the name's hash */
+	if (ext2_dir_is_indexed(dir))
+		nr_frames = ext2_dx_probe(dir, dentry->d_name.name,
+		                          dentry->d_name.len, &hash, frames);
+	if (nr_frames) {
+		do {
+			found = ext2_foreach_dirent_blk(dir,
+			                                dx_block(frames[nr_frames - 1].at),
+			                                lookup_each_func, (long)dentry, 0,
+			                                0);
+		} while (!found && ext2_dx_next_leaf(dir, hash, frames, nr_frames));
+		ext2_dx_release(dir->i_sb, frames, nr_frames);
+		if (found)
+			return dentry;
+	} else if (!ext2_foreach_dirent(dir, lookup_each_func, (long)dentry, 0,
+	                                0)) {
 		return dentry;
+	}
 	printd("EXT2: Not Found, %s\n", dentry->d_name.name);
 	return 0;
 }
@@ -1254,6 +1743,8 @@ I_AM_HERE;
 /* Modifies the size of the file of inode to whatever its i_size is set to */
 void ext2_truncate(struct inode *inode)
 {
+	/* the window was for appending past the old end */
+	ext2_discard_prealloc(inode);
 }
 
 /* Checks whether the the access mode is allowed for the file belonging to the
@@ -1441,6 +1932,7 @@ int ext2_check_flags(int flags)
 struct page_map_operations ext2_pm_op = {
 	ext2_readpage,
 	ext2_writepage,
+	ext2_readpages,
 };
 
 struct super_operations ext2_s_op = {
@@ -1494,8 +1986,8 @@ struct file_operations ext2_f_op_file = {
 	ext2_release,
 	ext2_fsync,
 	ext2_poll,
-	ext2_readv,
-	ext2_writev,
+	generic_file_readv,
+	generic_file_writev,
 	ext2_sendpage,
 	ext2_check_flags,
 };
@@ -1528,8 +2020,8 @@ struct file_operations ext2_f_op_sym = {
 	ext2_release,
 	ext2_fsync,
 	ext2_poll,
-	ext2_readv,
-	ext2_writev,
+	generic_file_readv,
+	generic_file_writev,
 	ext2_sendpage,
 	ext2_check_flags,
 };
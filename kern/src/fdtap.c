@@ -138,6 +138,40 @@ int remove_fd_tap(struct proc *p, int fd)
 	}
 }
 
+/* Changes the filter of FD's tap.  The device gets a FDTAP_CMD_MOD, and it
+ * should fire the tap for any of the new filter's events that are already
+ * pending, which lets the user re-arm a tap.  Returns 0 on success, -1 with
+ * errno/errstr on failure, in which case the tap keeps its old filter. */
+int mod_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
+{
+	struct fd_table *fdt = &p->open_files;
+	struct fd_tap *tap;
+	int fd = tap_req->fd;
+	int ret, old_filter;
+
+	if (fd < 0) {
+		set_errno(EBADF);
+		return -1;
+	}
+	spin_lock(&fdt->lock);
+	if ((fd >= fdt->max_fdset) || !fdt->fd[fd].fd_tap) {
+		spin_unlock(&fdt->lock);
+		set_error(EBADF, "FD %d was not tapped", fd);
+		return -1;
+	}
+	tap = fdt->fd[fd].fd_tap;
+	/* Keeps the tap from being released while we talk to the device */
+	kref_get(&tap->kref, 1);
+	spin_unlock(&fdt->lock);
+	old_filter = tap->filter;
+	ACCESS_ONCE(tap->filter) = tap_req->filter;
+	ret = devtab[tap->chan->type].tapfd(tap->chan, tap, FDTAP_CMD_MOD);
+	if (ret)
+		ACCESS_ONCE(tap->filter) = old_filter;
+	kref_put(&tap->kref);
+	return ret;
+}
+
 /* Fires off tap, with the events of filter having occurred.  Returns -1 on
  * error, though this need a little more thought.
  *
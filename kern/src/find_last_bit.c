@@ -34,6 +34,11 @@ unsigned long find_last_bit(const unsigned long *addr, unsigned long size)
 			goto found;
 	}
 
+	/* Skip empty words four at a time, like find_next_bit() */
+	while ((words >= 4) &&
+	       !(addr[words - 1] | addr[words - 2] | addr[words - 3] |
+	         addr[words - 4]))
+		words -= 4;
 	while (words) {
 		tmp = addr[--words];
 		if (tmp) {
@@ -18,6 +18,20 @@
 #include <bitmap.h>
 
 #define BITOP_WORD(nr)		((nr) / BITS_PER_LONG)
+/* Big bitmaps tend to have long runs of empty (or full) words.  We skip over
+ * those four words at a time, with one branch instead of four. */
+#define BITOP_CHUNK_WORDS	4
+#define BITOP_CHUNK_BITS	(BITOP_CHUNK_WORDS * BITS_PER_LONG)
+
+static inline bool chunk_is_zero(const unsigned long *p)
+{
+	return !(p[0] | p[1] | p[2] | p[3]);
+}
+
+static inline bool chunk_is_full(const unsigned long *p)
+{
+	return !~(p[0] & p[1] & p[2] & p[3]);
+}
 
 /*
  * Find the next set bit in a memory region.
@@ -43,6 +57,11 @@ unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
 		size -= BITS_PER_LONG;
 		result += BITS_PER_LONG;
 	}
+	while ((size >= BITOP_CHUNK_BITS) && chunk_is_zero(p)) {
+		p += BITOP_CHUNK_WORDS;
+		result += BITOP_CHUNK_BITS;
+		size -= BITOP_CHUNK_BITS;
+	}
 	while (size & ~(BITS_PER_LONG-1)) {
 		if ((tmp = *(p++)))
 			goto found_middle;
@@ -86,6 +105,11 @@ unsigned long find_next_zero_bit(const unsigned long *addr, unsigned long size,
 		size -= BITS_PER_LONG;
 		result += BITS_PER_LONG;
 	}
+	while ((size >= BITOP_CHUNK_BITS) && chunk_is_full(p)) {
+		p += BITOP_CHUNK_WORDS;
+		result += BITOP_CHUNK_BITS;
+		size -= BITOP_CHUNK_BITS;
+	}
 	while (size & ~(BITS_PER_LONG-1)) {
 		if (~(tmp = *(p++)))
 			goto found_middle;
@@ -113,6 +137,11 @@ unsigned long find_first_bit(const unsigned long *addr, unsigned long size)
 	unsigned long result = 0;
 	unsigned long tmp;
 
+	while ((size >= BITOP_CHUNK_BITS) && chunk_is_zero(p)) {
+		p += BITOP_CHUNK_WORDS;
+		result += BITOP_CHUNK_BITS;
+		size -= BITOP_CHUNK_BITS;
+	}
 	while (size & ~(BITS_PER_LONG-1)) {
 		if ((tmp = *(p++)))
 			goto found;
@@ -138,6 +167,11 @@ unsigned long find_first_zero_bit(const unsigned long *addr, unsigned long size)
 	unsigned long result = 0;
 	unsigned long tmp;
 
+	while ((size >= BITOP_CHUNK_BITS) && chunk_is_full(p)) {
+		p += BITOP_CHUNK_WORDS;
+		result += BITOP_CHUNK_BITS;
+		size -= BITOP_CHUNK_BITS;
+	}
 	while (size & ~(BITS_PER_LONG-1)) {
 		if (~(tmp = *(p++)))
 			goto found;
@@ -40,11 +40,15 @@
 #include <devfs.h>
 #include <blockdev.h>
 #include <ext2fs.h>
+#include <tmpfs.h>
 #include <kthread.h>
+#include <workqueue.h>
+#include <rcu.h>
 #include <linker_func.h>
 #include <ip.h>
 #include <acpi.h>
 #include <coreboot_tables.h>
+#include <klog.h>
 
 #define MAX_BOOT_CMDLINE_SIZE 4096
 
@@ -147,19 +151,25 @@ void kernel_init(multiboot_info_t *mboot_info)
 	colored_page_alloc_init();      // Allocates colors for agnostic processes
 	acpiinit();
 	topology_init();
+	page_numa_init();               // Splits free memory into NUMA nodes
 	percpu_init();
 	kthread_init();					/* might need to tweak when this happens */
 	vmr_init();
+	vmap_init();
 	file_init();
 	page_check();
 	idt_init();
 	kernel_msg_init();
 	timer_init();
+	rcu_init();
+	workqueue_init();
+	klog_init();
 	vfs_init();
 	devfs_init();
 	time_init();
 	arch_init();
 	block_init();
+	page_reclaim_init();
 	enable_irq();
 	run_linker_funcs();
 	/* reset/init devtab after linker funcs 3 and 4.  these run NIC and medium
@@ -170,6 +180,9 @@ void kernel_init(multiboot_info_t *mboot_info)
 #ifdef CONFIG_EXT2FS
 	mount_fs(&ext2_fs_type, "/dev/ramdisk", "/mnt", 0);
 #endif /* CONFIG_EXT2FS */
+#ifdef CONFIG_TMPFS
+	tmpfs_mount("/tmp");
+#endif /* CONFIG_TMPFS */
 #ifdef CONFIG_ETH_AUDIO
 	eth_audio_init();
 #endif /* CONFIG_ETH_AUDIO */
@@ -245,6 +258,7 @@ void _panic(const char *file, int line, const char *fmt,...)
 	/* We're panicing, possibly in a place that can't handle the lock checker */
 	pcpui = &per_cpu_info[core_id_early()];
 	pcpui->__lock_checking_enabled--;
+	klog_emergency();
 	va_start(ap, fmt);
 	printk("kernel panic at %s:%d, from core %d: ", file, line,
 	       core_id_early());
@@ -11,32 +11,43 @@
 #include <smp.h>
 
 struct symtab_entry gbl_symtab[1] __attribute__((weak)) = {{0, 0}};
+uintptr_t gbl_symtab_addrs[1] __attribute__((weak)) = {0};
+size_t gbl_symtab_nr __attribute__((weak)) = 0;
+
+/* gbl_symtab_addrs is in ascending order.  We want the last symbol at or below
+ * pc.  This is only right if we were given a good PC: random addresses will
+ * just find the previous symbol.  PCs past the last symbol aren't in the
+ * kernel, and neither are PCs below the first. */
+const char *lookup_fn_name(uintptr_t pc)
+{
+	size_t lo = 0, hi = gbl_symtab_nr, mid;
+
+	/* Find the first symbol above pc */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (gbl_symtab_addrs[mid] > pc)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (lo == 0 || lo == gbl_symtab_nr)
+		return NULL;
+	return gbl_symtab[lo - 1].name;
+}
 
-/* Returns a null-terminated string with the function name for a given PC /
- * instruction pointer.  kfree() the result. */
 char *get_fn_name(uintptr_t pc)
 {
-	struct symtab_entry *i, *prev = 0, *found = 0;
+	const char *name = lookup_fn_name(pc);
 	char *buf;
 	size_t name_len;
-	/* Table is in ascending order.  As soon as we get to an entry greater than
-	 * us, we were in the previous one.  This is only true if we were given a
-	 * good PC.  Random addresses will just find the previous symbol. */
-	for (i = &gbl_symtab[0]; i->name; i++) {
-		if (i->addr > pc) {
-			found = prev;
-			break;
-		}
-		prev = i;
-	}
-	if (!found)
+
+	if (!name)
 		return 0;
-	assert(found->name);
-	name_len = strlen(found->name) + 1;
+	name_len = strlen(name) + 1;
 	buf = kmalloc(name_len, 0);
 	if (!buf)
 		return 0;
-	strlcpy(buf, found->name, name_len);
+	strlcpy(buf, name, name_len);
 	return buf;
 }
 
@@ -204,15 +215,14 @@ void debug_addr_pid(int pid, unsigned long addr)
 void print_backtrace_list(uintptr_t *pcs, size_t nr_pcs,
 						  void (*pfunc)(void *, const char *), void *opaque)
 {
-	char *func_name;
+	const char *func_name;
 	char bt_line[128];
 
 	for (size_t i = 0; i < nr_pcs; i++) {
-		func_name = get_fn_name(pcs[i]);
+		func_name = lookup_fn_name(pcs[i]);
 		snprintf(bt_line, sizeof(bt_line), "#%02d [<%p>] in %s\n", i + 1,
 				 pcs[i], func_name);
 		pfunc(opaque, bt_line);
-		kfree(func_name);
 	}
 }
 
@@ -20,6 +20,22 @@
 #define KFS_MAX_FILE_SIZE 1024*1024*128
 #define KFS_MAGIC 0xdead0001
 
+/* With CONFIG_KFS_LAZY, an entry in the CPIO archive.  Each directory's entry
+ * keeps a list of its children's entries, in archive order, which move to the
+ * directory's inode once we build it. */
+struct kfs_cpio_ent {
+	struct cpio_bin_hdr			hdr;
+	char						*name;		/* last part of the path */
+	struct kfs_cpio_ent			*next;		/* in the parent's list */
+	struct kfs_cpio_ent			*kids;
+	struct kfs_cpio_ent			**kids_tail;
+	struct kfs_cpio_ent			*hash_next;	/* directories only */
+};
+
+#define KFS_LAZY_HASH_SZ 256
+
+static void kfs_populate(struct dentry *dir_d);
+
 /* VFS required Functions */
 /* These structs are declared again and initialized farther down */
 struct page_map_operations kfs_pm_op;
@@ -178,6 +194,7 @@ struct inode *kfs_alloc_inode(struct super_block *sb)
 	TAILQ_INIT(&((struct kfs_i_info*)inode->i_fs_info)->children);
 	((struct kfs_i_info*)inode->i_fs_info)->filestart = 0;
 	((struct kfs_i_info*)inode->i_fs_info)->init_size = 0;
+	((struct kfs_i_info*)inode->i_fs_info)->lazy_kids = 0;
 	return inode;
 }
 
@@ -343,6 +360,7 @@ struct dentry *kfs_lookup(struct inode *dir, struct dentry *dentry,
 	 * a symlink like lib2 -> lib work okay. */
 	assert(S_ISDIR(dir->i_mode));
 	assert(kref_refcnt(&dentry->d_kref) == 1);
+	kfs_populate(dir_dent);
 	TAILQ_FOREACH(d_i, &dir_dent->d_subdirs, d_subdirs_link) {
 		if (!strcmp(d_i->d_name.name, dentry->d_name.name)) {
 			/* since this dentry is already in memory (that's how KFS works), we
@@ -428,6 +446,8 @@ int kfs_rmdir(struct inode *dir, struct dentry *dentry)
 	struct kfs_i_info *d_info = (struct kfs_i_info*)dentry->d_inode->i_fs_info;
 	struct dentry *d_i;
 	bool empty = TRUE;
+
+	kfs_populate(dentry);
 	/* Check if we are empty.  If not, error out, need to check the sub-dirs as
 	 * well as the sub-"files" */
 	TAILQ_FOREACH(d_i, &dentry->d_subdirs, d_subdirs_link) {
@@ -601,6 +621,7 @@ int kfs_readdir(struct file *dir, struct dirent *dirent)
 		}
 	}
 
+	kfs_populate(dir_d);
 	/* Handle . and .. (first two dirents) */
 	if (desired_file == 0) {
 		dirent->d_ino = dir_d->d_inode->i_ino;
@@ -760,8 +781,8 @@ struct file_operations kfs_f_op_file = {
 	kfs_release,
 	kfs_fsync,
 	kfs_poll,
-	kfs_readv,
-	kfs_writev,
+	generic_file_readv,
+	generic_file_writev,
 	kfs_sendpage,
 	kfs_check_flags,
 };
@@ -794,14 +815,81 @@ struct file_operations kfs_f_op_sym = {
 	kfs_release,
 	kfs_fsync,
 	kfs_poll,
-	kfs_readv,
-	kfs_writev,
+	generic_file_readv,
+	generic_file_writev,
 	kfs_sendpage,
 	kfs_check_flags,
 };
 
 /* KFS Specific Internal Functions */
 
+/* Adds the CPIO entry c_bhdr to parent, under name.  lazy_kids is the list of
+ * a directory's children, for KFS_LAZY. */
+static int add_kfs_leaf(struct dentry *parent, char *name,
+                        struct cpio_bin_hdr *c_bhdr,
+                        struct kfs_cpio_ent *lazy_kids)
+{
+	struct dentry *dentry;
+	struct inode *inode;
+	int err;
+	char *symname, old_end;			/* for symlink manipulation */
+
+	printd("Adding file/dir %s to dentry %s (start: %p, size %d)\n", name,
+	       parent->d_name.name, c_bhdr->c_filestart, c_bhdr->c_filesize);
+	/* Init the dentry for this path */
+	dentry = get_dentry(parent->d_sb, parent, name);
+	// want to test the regular/natural dentry caching paths
+	//dcache_put(dentry->d_sb, dentry);
+	/* build the inode */
+	switch (c_bhdr->c_mode & CPIO_FILE_MASK) {
+		case (CPIO_DIRECTORY):
+			err = create_dir(parent->d_inode, dentry, c_bhdr->c_mode);
+			assert(!err);
+			((struct kfs_i_info*)dentry->d_inode->i_fs_info)->lazy_kids =
+			                                                    lazy_kids;
+			break;
+		case (CPIO_SYMLINK):
+			/* writing the '\0' is safe since the next entry is always still
+			 * in the CPIO (and we are processing sequentially). */
+			symname = c_bhdr->c_filestart;
+			old_end = symname[c_bhdr->c_filesize];
+			symname[c_bhdr->c_filesize] = '\0';
+			err = create_symlink(parent->d_inode, dentry, symname,
+			                     c_bhdr->c_mode & CPIO_PERM_MASK);
+			assert(!err);
+			symname[c_bhdr->c_filesize] = old_end;
+			break;
+		case (CPIO_REG_FILE):
+			err = create_file(parent->d_inode, dentry,
+			                  c_bhdr->c_mode & CPIO_PERM_MASK);
+			assert(!err);
+			((struct kfs_i_info*)dentry->d_inode->i_fs_info)->filestart =
+													c_bhdr->c_filestart;
+			((struct kfs_i_info*)dentry->d_inode->i_fs_info)->init_size =
+													c_bhdr->c_filesize;
+			break;
+		default:
+			printk("Unknown file type %d in the CPIO!",
+			       c_bhdr->c_mode & CPIO_FILE_MASK);
+			kref_put(&dentry->d_kref);
+			return -1;
+	}
+	inode = dentry->d_inode;
+	/* Set other info from the CPIO entry */
+	inode->i_uid = c_bhdr->c_uid;
+	inode->i_gid = c_bhdr->c_gid;
+	inode->i_atime.tv_sec = c_bhdr->c_mtime;
+	inode->i_ctime.tv_sec = c_bhdr->c_mtime;
+	inode->i_mtime.tv_sec = c_bhdr->c_mtime;
+	inode->i_size = c_bhdr->c_filesize;
+	//inode->i_XXX = c_bhdr->c_dev;			/* and friends */
+	inode->i_bdev = 0;						/* assuming blockdev? */
+	inode->i_socket = FALSE;
+	inode->i_blocks = c_bhdr->c_filesize;	/* blocksize == 1 */
+	kref_put(&dentry->d_kref);
+	return 0;
+}
+
 /* Need to pass path separately, since we'll recurse on it.  TODO: this recurses,
  * and takes up a lot of stack space (~270 bytes).  Core 0's KSTACK is 8 pages,
  * which can handle about 120 levels deep...  Other cores are not so fortunate.
@@ -813,9 +901,7 @@ static int __add_kfs_entry(struct dentry *parent, char *path,
 	char dir[MAX_FILENAME_SZ + 1];	/* room for the \0 */
 	size_t dirname_sz;				/* not counting the \0 */
 	struct dentry *dentry = 0;
-	struct inode *inode;
-	int err, retval;
-	char *symname, old_end;			/* for symlink manipulation */
+	int retval;
 
 	if (first_slash) {
 		/* get the first part, find that dentry, pass in the second part,
@@ -839,61 +925,9 @@ static int __add_kfs_entry(struct dentry *parent, char *path,
 		retval = __add_kfs_entry(dentry, first_slash + 1, c_bhdr);
 		kref_put(&dentry->d_kref);
 		return retval;
-	} else {
-		/* no directories left in the path.  add the 'file' to the dentry */
-		printd("Adding file/dir %s to dentry %s (start: %p, size %d)\n", path,
-		       parent->d_name.name, c_bhdr->c_filestart, c_bhdr->c_filesize);
-		/* Init the dentry for this path */
-		dentry = get_dentry(parent->d_sb, parent, path);
-		// want to test the regular/natural dentry caching paths
-		//dcache_put(dentry->d_sb, dentry);
-		/* build the inode */
-		switch (c_bhdr->c_mode & CPIO_FILE_MASK) {
-			case (CPIO_DIRECTORY):
-				err = create_dir(parent->d_inode, dentry, c_bhdr->c_mode);
-				assert(!err);
-				break;
-			case (CPIO_SYMLINK):
-				/* writing the '\0' is safe since the next entry is always still
-				 * in the CPIO (and we are processing sequentially). */
-				symname = c_bhdr->c_filestart;
-				old_end = symname[c_bhdr->c_filesize];
-				symname[c_bhdr->c_filesize] = '\0';
-				err = create_symlink(parent->d_inode, dentry, symname,
-				                     c_bhdr->c_mode & CPIO_PERM_MASK);
-				assert(!err);
-				symname[c_bhdr->c_filesize] = old_end;
-				break;
-			case (CPIO_REG_FILE):
-				err = create_file(parent->d_inode, dentry,
-				                  c_bhdr->c_mode & CPIO_PERM_MASK);
-				assert(!err);
-				((struct kfs_i_info*)dentry->d_inode->i_fs_info)->filestart =
-														c_bhdr->c_filestart;
-				((struct kfs_i_info*)dentry->d_inode->i_fs_info)->init_size =
-														c_bhdr->c_filesize;
-				break;
-			default:
-				printk("Unknown file type %d in the CPIO!",
-				       c_bhdr->c_mode & CPIO_FILE_MASK);
-				kref_put(&dentry->d_kref);
-				return -1;
-		}
-		inode = dentry->d_inode;
-		/* Set other info from the CPIO entry */
-		inode->i_uid = c_bhdr->c_uid;
-		inode->i_gid = c_bhdr->c_gid;
-		inode->i_atime.tv_sec = c_bhdr->c_mtime;
-		inode->i_ctime.tv_sec = c_bhdr->c_mtime;
-		inode->i_mtime.tv_sec = c_bhdr->c_mtime;
-		inode->i_size = c_bhdr->c_filesize;
-		//inode->i_XXX = c_bhdr->c_dev;			/* and friends */
-		inode->i_bdev = 0;						/* assuming blockdev? */
-		inode->i_socket = FALSE;
-		inode->i_blocks = c_bhdr->c_filesize;	/* blocksize == 1 */
-		kref_put(&dentry->d_kref);
 	}
-	return 0;
+	/* no directories left in the path.  add the 'file' to the dentry */
+	return add_kfs_leaf(parent, path, c_bhdr, 0);
 }
 
 /* Adds an entry (from a CPIO archive) to KFS.  This will put all the FS
@@ -917,6 +951,88 @@ static int add_kfs_entry(struct super_block *sb, struct cpio_bin_hdr *c_bhdr)
 	return __add_kfs_entry(sb->s_mount->mnt_root, path, c_bhdr);
 }
 
+#ifdef CONFIG_KFS_LAZY
+static struct kfs_cpio_ent kfs_lazy_root = {.kids_tail = &kfs_lazy_root.kids};
+static struct kfs_cpio_ent *kfs_lazy_dirs[KFS_LAZY_HASH_SZ];
+
+static unsigned long kfs_path_hash(const char *path, size_t len)
+{
+	unsigned long hash = 5381;
+
+	for (size_t i = 0; i < len; i++)
+		hash = hash * 33 + path[i];
+	return hash % KFS_LAZY_HASH_SZ;
+}
+
+static struct kfs_cpio_ent *kfs_lazy_find_dir(const char *path, size_t len)
+{
+	struct kfs_cpio_ent *ent = kfs_lazy_dirs[kfs_path_hash(path, len)];
+
+	for (; ent; ent = ent->hash_next) {
+		if (!strncmp(ent->hdr.c_filename, path, len) &&
+		    (ent->hdr.c_filename[len] == '\0'))
+			return ent;
+	}
+	return 0;
+}
+
+/* For KFS_LAZY, the alternative to add_kfs_entry(): copies the entry into its
+ * parent directory's list, without building anything.  Like add_kfs_entry(),
+ * parents must come before their children.  The paths and file contents stay
+ * in the archive. */
+static int index_kfs_entry(struct super_block *sb, struct cpio_bin_hdr *c_bhdr)
+{
+	char *path = c_bhdr->c_filename;
+	char *last_slash;
+	struct kfs_cpio_ent *ent, *parent = &kfs_lazy_root;
+	unsigned long idx;
+
+	if (!strcmp(path, "."))
+		return 0;
+	last_slash = strrchr(path, '/');
+	if (last_slash) {
+		parent = kfs_lazy_find_dir(path, last_slash - path);
+		if (!parent) {
+			printk("Missing dir in CPIO archive or something, aborting.\n");
+			return -1;
+		}
+	}
+	ent = kzmalloc(sizeof(struct kfs_cpio_ent), MEM_WAIT);
+	ent->hdr = *c_bhdr;
+	ent->name = last_slash ? last_slash + 1 : path;
+	ent->kids_tail = &ent->kids;
+	*parent->kids_tail = ent;
+	parent->kids_tail = &ent->next;
+	if ((c_bhdr->c_mode & CPIO_FILE_MASK) == CPIO_DIRECTORY) {
+		idx = kfs_path_hash(path, strlen(path));
+		ent->hash_next = kfs_lazy_dirs[idx];
+		kfs_lazy_dirs[idx] = ent;
+	}
+	return 0;
+}
+#endif /* CONFIG_KFS_LAZY */
+
+/* Builds the dentries and inodes for a directory's CPIO entries, if we haven't
+ * already.  Call before looking at a directory's children.  The entries are
+ * never freed, like the rest of KFS. */
+static void kfs_populate(struct dentry *dir_d)
+{
+	static qlock_t populate_lock = QLOCK_INITIALIZER(populate_lock);
+	struct kfs_i_info *k_i_info = (struct kfs_i_info*)dir_d->d_inode->i_fs_info;
+	struct kfs_cpio_ent *ent;
+
+	if (!ACCESS_ONCE(k_i_info->lazy_kids))
+		return;
+	qlock(&populate_lock);
+	for (ent = k_i_info->lazy_kids; ent; ent = ent->next) {
+		if (add_kfs_leaf(dir_d, ent->name, &ent->hdr, ent->kids))
+			printk("Failed to add %s to KFS!\n", ent->hdr.c_filename);
+	}
+	wmb();	/* the kids are in place before lookups can skip populating */
+	k_i_info->lazy_kids = 0;
+	qunlock(&populate_lock);
+}
+
 void parse_cpio_entries(struct super_block *sb, void *cpio_b)
 {
 	struct cpio_newc_header *c_hdr = (struct cpio_newc_header*)cpio_b;
@@ -932,7 +1048,7 @@ void parse_cpio_entries(struct super_block *sb, void *cpio_b)
 		offset += sizeof(*c_hdr);
 		if (strncmp(c_hdr->c_magic, "070701", 6)) {
 			printk("Invalid magic number in CPIO header, aborting.\n");
-			return;
+			break;
 		}
 		c_bhdr->c_filename = (char*)c_hdr + sizeof(*c_hdr);
 		namesize = cpio_strntol(buf, c_hdr->c_namesize, 8);
@@ -955,8 +1071,11 @@ void parse_cpio_entries(struct super_block *sb, void *cpio_b)
 		/* header + name will be padded out to 4-byte alignment */
 		offset = ROUNDUP(offset, 4);
 		c_bhdr->c_filestart = cpio_b + offset;
-		/* make this a function pointer or something */
+#ifdef CONFIG_KFS_LAZY
+		if (index_kfs_entry(sb, c_bhdr)) {
+#else
 		if (add_kfs_entry(sb, c_bhdr)) {
+#endif
 			printk("Failed to add an entry to KFS!\n");
 			break;
 		}
@@ -966,4 +1085,8 @@ void parse_cpio_entries(struct super_block *sb, void *cpio_b)
 		c_hdr = (struct cpio_newc_header*)(cpio_b + offset);
 	}
 	kfree(c_bhdr);
+#ifdef CONFIG_KFS_LAZY
+	((struct kfs_i_info*)sb->s_mount->mnt_root->d_inode->i_fs_info)->lazy_kids =
+	                                                    kfs_lazy_root.kids;
+#endif
 }
@@ -0,0 +1,330 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * The kernel log.  See klog.h.
+ *
+ * Each core has a trace_ring of struct klog_recs, which only that core writes,
+ * with IRQs disabled.  A message longer than a record takes a few records,
+ * with consecutive sequence numbers.  A writer fills in a slot, then bumps
+ * tr_next, so the flusher only looks at slots below tr_next.  A slot is
+ * overwritten once tr_next gets to its index plus tr_max, so the flusher
+ * copies a record out, then checks tr_next again.
+ *
+ * While we're booting, core_id() might not work yet and the other cores don't
+ * have rings, so everyone uses core 0's ring, under output_lock.  It's all
+ * synchronous then anyway.
+ *
+ * Sequence numbers are grabbed before the record is written, so a record can
+ * show up on the console after a later one from another core, if both cores
+ * print at the same time.  klog_snapshot() sorts them. */
+
+#include <klog.h>
+#include <arch/arch.h>
+#include <atomic.h>
+#include <smp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sort.h>
+#include <trace.h>
+#include <kthread.h>
+#include <assert.h>
+
+#define KLOG_RING_SZ			(64 * 1024)
+#define KLOG_LINE_SZ			512
+#define KLOG_FLUSH_USEC			10000
+#define KLOG_FLUSH_BATCH		64
+
+struct klog_core {
+	struct trace_ring			tr;
+	unsigned long				flushed;	/* under output_lock */
+	bool						busy;
+	char						line[KLOG_LINE_SZ];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+extern spinlock_t output_lock;
+
+static struct klog_core klog_cores[MAX_NUM_CORES];
+static uint8_t klog_boot_ring[KLOG_RING_SZ];
+static uint64_t klog_seq = 1;
+static bool klog_ready;
+static bool klog_async;
+static bool klog_panicked;
+static atomic_t klog_sync_cnt;
+
+static bool klog_is_sync(void)
+{
+	extern int booting;
+
+	return booting || !ACCESS_ONCE(klog_async) || ACCESS_ONCE(klog_panicked)
+	       || atomic_read(&klog_sync_cnt);
+}
+
+static void klog_flusher(void *arg)
+{
+	klog_async = TRUE;
+	while (1) {
+		klog_flush(TRUE);
+		kthread_usleep(KLOG_FLUSH_USEC);
+	}
+}
+
+void klog_init(void)
+{
+	struct klog_core *kc;
+	void *buf;
+
+	for (int i = 1; i < num_cores; i++) {
+		kc = &klog_cores[i];
+		buf = kzmalloc(KLOG_RING_SZ, MEM_WAIT);
+		trace_ring_init(&kc->tr, buf, KLOG_RING_SZ, sizeof(struct klog_rec));
+	}
+	wmb();	/* rings are ready before anyone uses them */
+	klog_ready = TRUE;
+	ktask("klog_flusher", klog_flusher, 0);
+}
+
+static void klog_lock(bool lock, int8_t *irq_state)
+{
+	if (!lock)
+		return;
+	#ifdef CONFIG_TRACE_LOCKS
+	disable_irqsave(irq_state);
+	__spin_lock(&output_lock);
+	#else
+	spin_lock_irqsave(&output_lock);
+	#endif
+}
+
+static void klog_unlock(bool lock, int8_t *irq_state)
+{
+	if (!lock)
+		return;
+	#ifdef CONFIG_TRACE_LOCKS
+	__spin_unlock(&output_lock);
+	enable_irqsave(irq_state);
+	#else
+	spin_unlock_irqsave(&output_lock);
+	#endif
+}
+
+/* Splits the line into records.  The caller owns kc's ring. */
+static void klog_record(struct klog_core *kc, int coreid, size_t len)
+{
+	struct trace_ring *tr = &kc->tr;
+	struct klog_rec *rec;
+	size_t nr = DIV_ROUND_UP(len, KLOG_REC_TEXT_SZ);
+	uint64_t seq = __sync_fetch_and_add(&klog_seq, nr);
+	uint64_t tsc = read_tsc();
+	size_t amt;
+
+	for (size_t off = 0; off < len; off += amt) {
+		amt = MIN(len - off, KLOG_REC_TEXT_SZ);
+		rec = __get_tr_slot_overwrite(tr, tr->tr_next);
+		rec->seq = 0;
+		wmb();	/* readers see the new tr_next before the slot changes */
+		rec->tsc = tsc;
+		rec->coreid = coreid;
+		rec->len = amt;
+		rec->flags = 0;
+		memcpy(rec->text, kc->line + off, amt);
+		wmb();
+		rec->seq = seq++;
+		wmb();
+		ACCESS_ONCE(tr->tr_next) = tr->tr_next + 1;
+	}
+}
+
+int klog_vprintf(bool lock, const char *fmt, va_list ap)
+{
+	extern int booting;
+	struct klog_core *kc;
+	int8_t irq_state = 0;
+	int coreid = 0;
+	bool early = booting || !ACCESS_ONCE(klog_ready);
+	int len;
+
+	if (early) {
+		klog_lock(lock, &irq_state);
+	} else {
+		disable_irqsave(&irq_state);
+		coreid = core_id();
+	}
+	kc = &klog_cores[coreid];
+	/* A fault or an NMI in the middle of a printk.  The caller will print it
+	 * straight out. */
+	if (kc->busy) {
+		if (early)
+			klog_unlock(lock, &irq_state);
+		else
+			enable_irqsave(&irq_state);
+		return -1;
+	}
+	kc->busy = TRUE;
+	if (!kc->tr.tr_buf)
+		trace_ring_init(&kc->tr, klog_boot_ring, KLOG_RING_SZ,
+		                sizeof(struct klog_rec));
+	len = vsnprintf(kc->line, KLOG_LINE_SZ, fmt, ap);
+	/* early messages go out right away, so they're already flushed */
+	klog_record(kc, coreid, len);
+	if (early) {
+		klog_flush(FALSE);
+		kc->busy = FALSE;
+		klog_unlock(lock, &irq_state);
+		return len;
+	}
+	kc->busy = FALSE;
+	enable_irqsave(&irq_state);
+	if (klog_is_sync())
+		klog_flush(lock);
+	return len;
+}
+
+static void klog_print_lost(int coreid, unsigned long nr)
+{
+	char buf[64];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "[klog: lost %lu records from core %d]\n",
+	               nr, coreid);
+	cputbuf(buf, len);
+}
+
+/* Catches kc's cursor up to its oldest record that's still around. */
+static void klog_skip_lost(struct klog_core *kc, int coreid)
+{
+	struct trace_ring *tr = &kc->tr;
+	unsigned long next = ACCESS_ONCE(tr->tr_next);
+
+	/* The writer might be overwriting the oldest one right now */
+	if (next - kc->flushed < tr->tr_max)
+		return;
+	klog_print_lost(coreid, next - tr->tr_max + 1 - kc->flushed);
+	kc->flushed = next - tr->tr_max + 1;
+}
+
+/* Copies out idx's record.  Returns FALSE if it was overwritten. */
+static bool klog_copy_rec(struct trace_ring *tr, unsigned long idx,
+                          struct klog_rec *rec)
+{
+	*rec = *(struct klog_rec*)__get_tr_slot_overwrite(tr, idx);
+	rmb();
+	return ACCESS_ONCE(tr->tr_next) - idx < tr->tr_max;
+}
+
+/* Prints up to KLOG_FLUSH_BATCH records, in sequence order.  Returns how many
+ * it got through. */
+static int __klog_flush_batch(void)
+{
+	struct klog_core *kc, *best;
+	struct klog_rec *peek, rec;
+	uint64_t best_seq;
+	int best_core, nr;
+
+	for (nr = 0; nr < KLOG_FLUSH_BATCH; nr++) {
+		best = 0;
+		best_seq = UINT64_MAX;
+		best_core = 0;
+		for (int i = 0; i < MAX(num_cores, 1); i++) {
+			kc = &klog_cores[i];
+			if (!kc->tr.tr_buf)
+				continue;
+			klog_skip_lost(kc, i);
+			if (kc->flushed == ACCESS_ONCE(kc->tr.tr_next))
+				continue;
+			rmb();
+			peek = __get_tr_slot_overwrite(&kc->tr, kc->flushed);
+			if (ACCESS_ONCE(peek->seq) < best_seq) {
+				best_seq = ACCESS_ONCE(peek->seq);
+				best = kc;
+				best_core = i;
+			}
+		}
+		if (!best)
+			break;
+		if (klog_copy_rec(&best->tr, best->flushed, &rec))
+			cputbuf(rec.text, rec.len);
+		else
+			klog_print_lost(best_core, 1);
+		best->flushed++;
+	}
+	return nr;
+}
+
+/* Prints everything that hasn't been printed.  Without the lock, we'd better be
+ * the only one printing. */
+void klog_flush(bool lock)
+{
+	int8_t irq_state = 0;
+	int nr;
+
+	do {
+		klog_lock(lock, &irq_state);
+		nr = __klog_flush_batch();
+		klog_unlock(lock, &irq_state);
+	} while (nr == KLOG_FLUSH_BATCH);
+}
+
+/* The monitor wants to see its output right away. */
+void klog_sync_begin(void)
+{
+	atomic_inc(&klog_sync_cnt);
+	klog_flush(TRUE);
+}
+
+void klog_sync_end(void)
+{
+	atomic_dec(&klog_sync_cnt);
+}
+
+/* We're panicking: get out whatever we have, and don't wait on the flusher any
+ * more.  Whoever holds output_lock might never let go of it. */
+void klog_emergency(void)
+{
+	klog_panicked = TRUE;
+	wmb();
+	klog_flush(FALSE);
+}
+
+static int klog_rec_cmp(const void *a, const void *b)
+{
+	const struct klog_rec *ra = a, *rb = b;
+
+	if (ra->seq < rb->seq)
+		return -1;
+	return ra->seq > rb->seq;
+}
+
+/* Returns the text of every record that's still in the rings, in sequence
+ * order.  Free with kfree. */
+struct sized_alloc *klog_snapshot(void)
+{
+	struct klog_core *kc;
+	struct klog_rec *recs;
+	struct sized_alloc *sza;
+	unsigned long next, nr;
+	size_t nr_recs = 0, off = 0;
+
+	recs = kmalloc(MAX(num_cores, 1) * KLOG_RING_SZ, MEM_WAIT);
+	for (int i = 0; i < MAX(num_cores, 1); i++) {
+		kc = &klog_cores[i];
+		if (!kc->tr.tr_buf)
+			continue;
+		next = ACCESS_ONCE(kc->tr.tr_next);
+		rmb();
+		/* The oldest one might be getting overwritten */
+		nr = MIN(next, kc->tr.tr_max - 1);
+		for (unsigned long j = next - nr; j < next; j++) {
+			if (klog_copy_rec(&kc->tr, j, &recs[nr_recs]))
+				nr_recs++;
+		}
+	}
+	sort(recs, nr_recs, sizeof(struct klog_rec), klog_rec_cmp);
+	sza = sized_kzmalloc(nr_recs * KLOG_REC_TEXT_SZ, MEM_WAIT);
+	for (size_t i = 0; i < nr_recs; i++) {
+		memcpy(sza->buf + off, recs[i].text, recs[i].len);
+		off += recs[i].len;
+	}
+	sza->size = off;
+	kfree(recs);
+	return sza;
+}
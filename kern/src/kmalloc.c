@@ -11,6 +11,7 @@
 #include <kmalloc.h>
 #include <stdio.h>
 #include <slab.h>
+#include <memprof.h>
 #include <assert.h>
 
 #define kmallocdebug(args...)  //printk(args)
@@ -23,38 +24,72 @@ struct kmem_cache *kmalloc_caches[NUM_KMALLOC_CACHES];
 
 static void __kfree_release(struct kref *kref);
 
+/* Maps ksize (which includes the tag) to the smallest size class that holds it.
+ * Class 0 is KMALLOC_SMALLEST.  After that, each order (2^n, 2^(n+1)] gets
+ * KMALLOC_STEPS_PER_ORDER classes, 2^(n - KMALLOC_STEPS_SHIFT) bytes apart.
+ * Returns >= NUM_KMALLOC_CACHES if ksize is too big for any of the caches. */
+static size_t kmalloc_size_class(size_t ksize)
+{
+	size_t order;
+
+	if (ksize <= KMALLOC_SMALLEST)
+		return 0;
+	order = LOG2_DOWN(ksize - 1);
+	return 1 + (order - LOG2_DOWN(KMALLOC_SMALLEST)) * KMALLOC_STEPS_PER_ORDER
+	       + ((ksize - 1 - (1UL << order)) >> (order - KMALLOC_STEPS_SHIFT));
+}
+
+/* The inverse of kmalloc_size_class(): the object size of a class's cache. */
+static size_t kmalloc_class_size(size_t class)
+{
+	size_t order, step;
+
+	if (!class)
+		return KMALLOC_SMALLEST;
+	order = (class - 1) / KMALLOC_STEPS_PER_ORDER + LOG2_DOWN(KMALLOC_SMALLEST);
+	step = (class - 1) % KMALLOC_STEPS_PER_ORDER + 1;
+	return (1UL << order) + step * (1UL << (order - KMALLOC_STEPS_SHIFT));
+}
+
 void kmalloc_init(void)
 {
+	size_t ksize;
+
 	/* we want at least a 16 byte alignment of the tag so that the bufs kmalloc
 	 * returns are 16 byte aligned.  we used to check the actual size == 16,
 	 * since we adjusted the KMALLOC_SMALLEST based on that. */
 	static_assert(ALIGNED(sizeof(struct kmalloc_tag), 16));
+	/* the smallest step needs to keep the caches' sizes aligned */
+	static_assert(ALIGNED(KMALLOC_SMALLEST >> KMALLOC_STEPS_SHIFT,
+	                      KMALLOC_ALIGNMENT));
 	/* build caches of common sizes.  this size will later include the tag and
 	 * the actual returned buffer. */
-	size_t ksize = KMALLOC_SMALLEST;
 	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
+		ksize = kmalloc_class_size(i);
+		assert(kmalloc_size_class(ksize) == i);
+		/* kmalloc() does its own memprof accounting */
 		kmalloc_caches[i] = kmem_cache_create("kmalloc_cache", ksize,
-		                                      KMALLOC_ALIGNMENT, 0, 0, 0);
-		ksize <<= 1;
+		                                      KMALLOC_ALIGNMENT, KMC_NOTRACE,
+		                                      0, 0);
 	}
 }
 
-void *kmalloc(size_t size, int flags)
+/* Prefers memory from node.  node < 0 means the local node. */
+void *kmalloc_node(size_t size, int flags, int node)
 {
 	// reserve space for bookkeeping and preserve alignment
 	size_t ksize = size + sizeof(struct kmalloc_tag);
 	void *buf;
-	int cache_id;
+	size_t cache_id;
 	// determine cache to pull from
-	if (ksize <= KMALLOC_SMALLEST)
-		cache_id = 0;
-	else
-		cache_id = LOG2_UP(ksize) - LOG2_UP(KMALLOC_SMALLEST);
+	cache_id = kmalloc_size_class(ksize);
 	// if we don't have a cache to handle it, alloc cont pages
 	if (cache_id >= NUM_KMALLOC_CACHES) {
 		size_t num_pgs = ROUNDUP(size + sizeof(struct kmalloc_tag), PGSIZE) /
 		                           PGSIZE;
-		buf = get_cont_pages(LOG2_UP(num_pgs), flags);
+		if (node < 0)
+			node = local_mem_node();
+		buf = get_cont_pages_node(node, LOG2_UP(num_pgs), flags);
 		if (!buf)
 			panic("Kmalloc failed!  Handle me!");
 		// fill in the kmalloc tag
@@ -63,10 +98,11 @@ void *kmalloc(size_t size, int flags)
 		tag->num_pages = num_pgs;
 		tag->canary = KMALLOC_CANARY;
 		kref_init(&tag->kref, __kfree_release, 1);
+		memprof_alloc(tag, size, MEMPROF_KMALLOC);
 		return buf + sizeof(struct kmalloc_tag);
 	}
 	// else, alloc from the appropriate cache
-	buf = kmem_cache_alloc(kmalloc_caches[cache_id], flags);
+	buf = kmem_cache_alloc_node(kmalloc_caches[cache_id], flags, node);
 	if (!buf)
 		panic("Kmalloc failed!  Handle me!");
 	// store a pointer to the buffers kmem_cache in it's bookkeeping space
@@ -75,9 +111,15 @@ void *kmalloc(size_t size, int flags)
 	tag->my_cache = kmalloc_caches[cache_id];
 	tag->canary = KMALLOC_CANARY;
 	kref_init(&tag->kref, __kfree_release, 1);
+	memprof_alloc(tag, size, MEMPROF_KMALLOC);
 	return buf + sizeof(struct kmalloc_tag);
 }
 
+void *kmalloc(size_t size, int flags)
+{
+	return kmalloc_node(size, flags, -1);
+}
+
 void *kzmalloc(size_t size, int flags)
 {
 	void *v = kmalloc(size, flags);
@@ -214,6 +256,8 @@ int kmalloc_refcnt(void *buf)
 static void __kfree_release(struct kref *kref)
 {
 	struct kmalloc_tag *tag = container_of(kref, struct kmalloc_tag, kref);
+
+	memprof_free(tag);
 	if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_CACHE)
 		kmem_cache_free(tag->my_cache, tag);
 	else if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_PAGES)
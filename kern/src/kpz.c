@@ -0,0 +1,149 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * kpz frames.  See kpz.h.
+ *
+ * We cut the buffer into KPZ_CHUNK_SZ chunks, one frame each, and deal them out
+ * round-robin to ourselves and whatever idle cores we could borrow.  Each
+ * worker deflates its chunks into their own buffers with one workspace, and we
+ * glue the frames together once they're all done.  Workers know their chunks by
+ * their number, so there's nothing to lock. */
+
+#include <kpz.h>
+#include <zlib.h>
+#include <completion.h>
+#include <schedule.h>
+#include <smp.h>
+#include <string.h>
+#include <assert.h>
+
+#define KPZ_CHUNK_SZ			(256 * 1024)
+#define KPZ_MAX_HELPERS			8
+#define KPZ_LEVEL				Z_BEST_SPEED
+
+struct kpz_chunk {
+	const void					*src;
+	size_t						raw_len;
+	void						*frame;		/* kpz_hdr, then the zlib data */
+	size_t						frame_len;
+};
+
+/* Lives on kpz_compress()'s stack, which waits for all of the helpers. */
+struct kpz_work {
+	struct kpz_chunk			*chunks;
+	size_t						nr_chunks;
+	size_t						nr_workers;
+	bool						failed;
+	struct completion			done;
+};
+
+/* Deflate can grow incompressible data a little: 5 bytes per stored block,
+ * which are at least 16KB with the default memLevel, plus the zlib wrapper. */
+static size_t kpz_bound(size_t len)
+{
+	return len + (len >> 10) + 64;
+}
+
+static bool kpz_deflate_chunk(struct kpz_chunk *ck, void *workspace)
+{
+	struct z_stream_s zs;
+	struct kpz_hdr *hdr;
+	size_t room = sizeof(struct kpz_hdr) + kpz_bound(ck->raw_len);
+	int ret;
+
+	ck->frame = kmalloc(room, MEM_WAIT);
+	memset(&zs, 0, sizeof(zs));
+	zs.workspace = workspace;
+	if (zlib_deflateInit(&zs, KPZ_LEVEL) != Z_OK)
+		return FALSE;
+	zs.next_in = ck->src;
+	zs.avail_in = ck->raw_len;
+	zs.next_out = ck->frame + sizeof(struct kpz_hdr);
+	zs.avail_out = room - sizeof(struct kpz_hdr);
+	ret = zlib_deflate(&zs, Z_FINISH);
+	zlib_deflateEnd(&zs);
+	if (ret != Z_STREAM_END)
+		return FALSE;
+	hdr = ck->frame;
+	hdr->magic = KPZ_MAGIC;
+	hdr->raw_len = ck->raw_len;
+	hdr->z_len = zs.total_out;
+	ck->frame_len = sizeof(struct kpz_hdr) + zs.total_out;
+	return TRUE;
+}
+
+/* Worker w does chunks w, w + nr_workers, and so on. */
+static void kpz_do_chunks(struct kpz_work *kw, size_t w)
+{
+	void *workspace;
+
+	workspace = kmalloc(zlib_deflate_workspacesize(MAX_WBITS, DEF_MEM_LEVEL),
+	                    MEM_WAIT);
+	for (size_t i = w; i < kw->nr_chunks; i += kw->nr_workers) {
+		if (!kpz_deflate_chunk(&kw->chunks[i], workspace))
+			kw->failed = TRUE;
+	}
+	kfree(workspace);
+}
+
+static void __kpz_rkm(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct kpz_work *kw = (struct kpz_work*)a0;
+
+	kpz_do_chunks(kw, a1);
+	completion_complete(&kw->done, 1);
+}
+
+struct sized_alloc *kpz_compress(const void *src, size_t len)
+{
+	struct kpz_work kw;
+	int helpers[KPZ_MAX_HELPERS];
+	int nr_helpers = 0, max_helpers, coreid;
+	struct sized_alloc *sza = 0;
+	size_t total = 0;
+
+	kw.nr_chunks = DIV_ROUND_UP(len, KPZ_CHUNK_SZ);
+	kw.chunks = kzmalloc(MAX(kw.nr_chunks, 1) * sizeof(struct kpz_chunk),
+	                     MEM_WAIT);
+	for (size_t i = 0; i < kw.nr_chunks; i++) {
+		kw.chunks[i].src = src + i * KPZ_CHUNK_SZ;
+		kw.chunks[i].raw_len = MIN(len - i * KPZ_CHUNK_SZ, KPZ_CHUNK_SZ);
+	}
+	/* We do the first chunk ourselves */
+	max_helpers = kw.nr_chunks ? MIN(kw.nr_chunks - 1, KPZ_MAX_HELPERS) : 0;
+	while (nr_helpers < max_helpers) {
+		coreid = get_any_idle_core();
+		if (coreid < 0)
+			break;
+		if (coreid == core_id()) {
+			put_idle_core(coreid);
+			break;
+		}
+		helpers[nr_helpers++] = coreid;
+	}
+	kw.nr_workers = nr_helpers + 1;
+	kw.failed = FALSE;
+	completion_init(&kw.done, nr_helpers);
+	for (int i = 0; i < nr_helpers; i++)
+		send_kernel_message(helpers[i], __kpz_rkm, (long)&kw, i + 1, 0,
+		                    KMSG_ROUTINE);
+	kpz_do_chunks(&kw, 0);
+	completion_wait(&kw.done);
+	for (int i = 0; i < nr_helpers; i++)
+		put_idle_core(helpers[i]);
+	if (kw.failed)
+		goto out;
+	for (size_t i = 0; i < kw.nr_chunks; i++)
+		total += kw.chunks[i].frame_len;
+	sza = sized_kzmalloc(total, MEM_WAIT);
+	total = 0;
+	for (size_t i = 0; i < kw.nr_chunks; i++) {
+		memcpy(sza->buf + total, kw.chunks[i].frame, kw.chunks[i].frame_len);
+		total += kw.chunks[i].frame_len;
+	}
+out:
+	for (size_t i = 0; i < kw.nr_chunks; i++)
+		kfree(kw.chunks[i].frame);
+	kfree(kw.chunks);
+	return sza;
+}
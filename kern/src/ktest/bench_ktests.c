@@ -0,0 +1,289 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Kernel microbenchmarks.  These always pass; they print their costs with
+ * ktest_bench_run(). */
+
+#include <ktest.h>
+#include <linker_func.h>
+#include <slab.h>
+#include <page_alloc.h>
+#include <alarm.h>
+#include <smp.h>
+#include <trap.h>
+#include <kthread.h>
+#include <ns.h>
+#include <ip.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+
+KTEST_SUITE("BENCH")
+
+#define BENCH_CSUM_LEN			1500
+
+struct bench_mem {
+	void						*dst;
+	void						*src;
+	size_t						len;
+};
+
+/* Sizes for the mem benchmarks: a small message, a packet, a page and a jumbo
+ * page.  The biggest gets the non-temporal stores. */
+static const size_t bench_mem_lens[] = {64, 1500, PGSIZE, 512 * PGSIZE};
+
+static void bench_kmem_cache_fn(void *arg, unsigned int idx,
+                                unsigned long iters)
+{
+	struct kmem_cache *kc = arg;
+	void *obj;
+
+	for (unsigned long i = 0; i < iters; i++) {
+		obj = kmem_cache_alloc(kc, MEM_WAIT);
+		kmem_cache_free(kc, obj);
+	}
+}
+
+bool test_bench_kmem_cache(void)
+{
+	struct kmem_cache *kc = kmem_cache_create("bench_kmc", 64, 8, 0, NULL,
+	                                          NULL);
+	struct ktest_bench kb = {"kmem_cache", bench_kmem_cache_fn, kc, 100000};
+
+	ktest_bench_scale(&kb);
+	kmem_cache_destroy(kc);
+	return true;
+}
+
+static void bench_kpage_fn(void *arg, unsigned int idx, unsigned long iters)
+{
+	struct page *page;
+
+	for (unsigned long i = 0; i < iters; i++) {
+		if (kpage_alloc(&page))
+			panic("Out of pages");
+		page_decref(page);
+	}
+}
+
+bool test_bench_kpage(void)
+{
+	struct ktest_bench kb = {"kpage_alloc", bench_kpage_fn, NULL, 10000};
+
+	ktest_bench_scale(&kb);
+	return true;
+}
+
+static void bench_alarm_handler(struct alarm_waiter *waiter)
+{
+}
+
+static void bench_alarm_fn(void *arg, unsigned int idx, unsigned long iters)
+{
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+	struct alarm_waiter waiter;
+
+	init_awaiter(&waiter, bench_alarm_handler);
+	for (unsigned long i = 0; i < iters; i++) {
+		/* Far enough out that it never fires */
+		set_awaiter_rel(&waiter, 1000000);
+		set_alarm(tchain, &waiter);
+		unset_alarm(tchain, &waiter);
+	}
+}
+
+bool test_bench_alarm(void)
+{
+	struct ktest_bench kb = {"set/unset_alarm", bench_alarm_fn, NULL, 10000};
+
+	ktest_bench_scale(&kb);
+	return true;
+}
+
+static void __bench_kmsg_pong(uint32_t srcid, long a0, long a1, long a2)
+{
+	ACCESS_ONCE(*(bool*)a0) = TRUE;
+}
+
+static void __bench_kmsg_ping(uint32_t srcid, long a0, long a1, long a2)
+{
+	send_kernel_message(srcid, __bench_kmsg_pong, a0, 0, 0, KMSG_IMMEDIATE);
+}
+
+/* Participant 1 just sits there, so its core can take the ping. */
+static void bench_kmsg_fn(void *arg, unsigned int idx, unsigned long iters)
+{
+	uint32_t partner = (core_id() + 1) % num_cores;
+	bool pong;
+
+	if (idx)
+		return;
+	for (unsigned long i = 0; i < iters; i++) {
+		pong = FALSE;
+		send_kernel_message(partner, __bench_kmsg_ping, (long)&pong, 0, 0,
+		                    KMSG_IMMEDIATE);
+		while (!ACCESS_ONCE(pong))
+			cpu_relax();
+	}
+}
+
+bool test_bench_kmsg(void)
+{
+	struct ktest_bench kb = {"kmsg round-trip", bench_kmsg_fn, NULL, 10000};
+
+	if (num_cores < 2) {
+		printk("\tBENCH %s needs 2 cores\n", kb.name);
+		return true;
+	}
+	ktest_bench_run(&kb, 2);
+	return true;
+}
+
+/* Ping-pong between two kthreads.  A woken kthread restarts on its waker's
+ * core, so both sides usually end up on one core. */
+static void bench_sem_fn(void *arg, unsigned int idx, unsigned long iters)
+{
+	struct semaphore *sems = arg;
+
+	for (unsigned long i = 0; i < iters; i++) {
+		if (idx) {
+			sem_down(&sems[0]);
+			sem_up(&sems[1]);
+		} else {
+			sem_up(&sems[0]);
+			sem_down(&sems[1]);
+		}
+	}
+}
+
+bool test_bench_sem(void)
+{
+	struct semaphore sems[2];
+	struct ktest_bench kb = {"sem handoff", bench_sem_fn, sems, 10000};
+
+	if (num_cores < 2) {
+		printk("\tBENCH %s needs 2 cores\n", kb.name);
+		return true;
+	}
+	sem_init(&sems[0], 0);
+	sem_init(&sems[1], 0);
+	ktest_bench_run(&kb, 2);
+	return true;
+}
+
+static void bench_qio_fn(void *arg, unsigned int idx, unsigned long iters)
+{
+	struct queue *q = qopen(64 * 1024, 0, NULL, NULL);
+	struct block *b;
+
+	for (unsigned long i = 0; i < iters; i++) {
+		b = block_alloc(64, MEM_WAIT);
+		b->wp += 64;
+		qbwrite(q, b);
+		freeb(qbread(q, 64));
+	}
+	qfree(q);
+}
+
+bool test_bench_qio(void)
+{
+	struct ktest_bench kb = {"qbwrite/qbread", bench_qio_fn, NULL, 10000};
+
+	ktest_bench_scale(&kb);
+	return true;
+}
+
+static void bench_ptclbsum_fn(void *arg, unsigned int idx,
+                              unsigned long iters)
+{
+	uint8_t *buf = arg;
+	uint16_t sum = 0;
+
+	for (unsigned long i = 0; i < iters; i++)
+		sum += ptclbsum(buf, BENCH_CSUM_LEN);
+	ACCESS_ONCE(buf[0]) = sum;
+}
+
+bool test_bench_ptclbsum(void)
+{
+	uint8_t *buf = kmalloc(BENCH_CSUM_LEN, MEM_WAIT);
+	struct ktest_bench kb = {"ptclbsum", bench_ptclbsum_fn, buf, 10000};
+
+	for (int i = 0; i < BENCH_CSUM_LEN; i++)
+		buf[i] = i;
+	ktest_bench_scale(&kb);
+	kfree(buf);
+	return true;
+}
+
+static void bench_memcpy_fn(void *arg, unsigned int idx, unsigned long iters)
+{
+	struct bench_mem *bm = arg;
+
+	for (unsigned long i = 0; i < iters; i++)
+		memcpy(bm->dst, bm->src, bm->len);
+}
+
+static void bench_memset_fn(void *arg, unsigned int idx, unsigned long iters)
+{
+	struct bench_mem *bm = arg;
+
+	for (unsigned long i = 0; i < iters; i++)
+		memset(bm->dst, i, bm->len);
+}
+
+/* Runs fn on one core for each of bench_mem_lens.  More cores would just be
+ * fighting over the same buffers. */
+static void bench_mem_sizes(const char *what,
+                            void (*fn)(void *, unsigned int, unsigned long))
+{
+	size_t max_len = bench_mem_lens[ARRAY_SIZE(bench_mem_lens) - 1];
+	struct bench_mem bm;
+	struct ktest_bench kb = {0, fn, &bm, 0};
+	char name[32];
+
+	bm.dst = kmalloc(max_len, MEM_WAIT);
+	bm.src = kmalloc(max_len, MEM_WAIT);
+	memset(bm.src, 0xaa, max_len);
+	for (int i = 0; i < ARRAY_SIZE(bench_mem_lens); i++) {
+		bm.len = bench_mem_lens[i];
+		snprintf(name, sizeof(name), "%s %lu bytes", what, bm.len);
+		kb.name = name;
+		/* About 64MB per timed run */
+		kb.iters = MAX(1, (64 << 20) / bm.len);
+		ktest_bench_run(&kb, 1);
+	}
+	kfree(bm.src);
+	kfree(bm.dst);
+}
+
+bool test_bench_memcpy(void)
+{
+	bench_mem_sizes("memcpy", bench_memcpy_fn);
+	return true;
+}
+
+bool test_bench_memset(void)
+{
+	bench_mem_sizes("memset", bench_memset_fn);
+	return true;
+}
+
+static struct ktest ktests[] = {
+	KTEST_REG(bench_kmem_cache,		CONFIG_TEST_bench_kmem_cache),
+	KTEST_REG(bench_kpage,			CONFIG_TEST_bench_kpage),
+	KTEST_REG(bench_alarm,			CONFIG_TEST_bench_alarm),
+	KTEST_REG(bench_kmsg,			CONFIG_TEST_bench_kmsg),
+	KTEST_REG(bench_sem,			CONFIG_TEST_bench_sem),
+	KTEST_REG(bench_qio,			CONFIG_TEST_bench_qio),
+	KTEST_REG(bench_ptclbsum,		CONFIG_TEST_bench_ptclbsum),
+	KTEST_REG(bench_memcpy,			CONFIG_TEST_bench_memcpy),
+	KTEST_REG(bench_memset,			CONFIG_TEST_bench_memset),
+};
+
+static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
+
+linker_func_1(register_bench_ktests)
+{
+	REGISTER_KTESTS(ktests, num_ktests);
+}
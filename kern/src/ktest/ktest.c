@@ -1,6 +1,12 @@
 #include <stdbool.h>
 #include <ktest.h>
 #include <sys/queue.h>
+#include <smp.h>
+#include <trap.h>
+#include <kthread.h>
+#include <atomic.h>
+#include <sort.h>
+#include <assert.h>
 
 /* Global string used to report info about the last completed test */
 char ktest_msg[1024];
@@ -49,3 +55,131 @@ void run_ktest_suite(struct ktest_suite *suite)
 	printk("<-- END_KERNEL_%s_TESTS -->\n", suite->name);
 }
 
+#define KB_NR_RUNS (KTEST_BENCH_WARMUP + KTEST_BENCH_RUNS)
+
+struct kb_run {
+	struct ktest_bench			*kb;
+	unsigned int				nr_cores;
+	unsigned int				go;			/* runs started */
+	atomic_t					done;		/* helper runs finished */
+	uint64_t					*elapsed;	/* per participant, in ticks */
+};
+
+/* Participants wait by yielding, not spinning: the kthreads of a benchmark may
+ * need to run on a core whose helper is waiting. */
+static void kb_wait_go(struct kb_run *run, unsigned int r)
+{
+	while (ACCESS_ONCE(run->go) <= r)
+		kthread_yield();
+}
+
+static void kb_time_one(struct kb_run *run, unsigned int idx)
+{
+	uint64_t start = read_tsc();
+
+	run->kb->fn(run->kb->arg, idx, run->kb->iters);
+	run->elapsed[idx] = read_tsc() - start;
+}
+
+static void __kb_helper(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct kb_run *run = (struct kb_run*)a0;
+	unsigned int idx = a1;
+
+	for (unsigned int r = 0; r < KB_NR_RUNS; r++) {
+		kb_wait_go(run, r);
+		kb_time_one(run, idx);
+		wmb();
+		/* Last touch of run on the last pass; the caller may free it. */
+		atomic_inc(&run->done);
+	}
+}
+
+static int kb_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t kb_isqrt(uint64_t x)
+{
+	uint64_t r = 0, bit = 1ULL << 62;
+
+	while (bit > x)
+		bit >>= 2;
+	for (; bit; bit >>= 2) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+	}
+	return r;
+}
+
+static void kb_report(struct ktest_bench *kb, unsigned int nr_cores,
+                      uint64_t *ns)
+{
+	uint64_t sum = 0, var = 0, mean, d;
+
+	sort(ns, KTEST_BENCH_RUNS, sizeof(uint64_t), kb_cmp_u64);
+	for (int i = 0; i < KTEST_BENCH_RUNS; i++)
+		sum += ns[i];
+	mean = sum / KTEST_BENCH_RUNS;
+	for (int i = 0; i < KTEST_BENCH_RUNS; i++) {
+		d = ns[i] > mean ? ns[i] - mean : mean - ns[i];
+		var += d * d;
+	}
+	printk("\tBENCH %-20s %3u cores, ns/op: min %llu med %llu mean %llu "
+	       "sd %llu max %llu\n", kb->name, nr_cores, ns[0],
+	       ns[KTEST_BENCH_RUNS / 2], mean,
+	       kb_isqrt(var / KTEST_BENCH_RUNS), ns[KTEST_BENCH_RUNS - 1]);
+}
+
+/* Runs kb on nr_cores cores at once and prints the stats of the timed runs.
+ * The helpers are routine kmsgs, so the other cores must not be busy running
+ * processes. */
+void ktest_bench_run(struct ktest_bench *kb, unsigned int nr_cores)
+{
+	struct kb_run run[1] = {{0}};
+	uint64_t ns[KTEST_BENCH_RUNS], slowest;
+	unsigned int coreid = core_id();
+
+	assert(nr_cores && nr_cores <= num_cores);
+	run->kb = kb;
+	run->nr_cores = nr_cores;
+	atomic_init(&run->done, 0);
+	run->elapsed = kzmalloc(nr_cores * sizeof(uint64_t), MEM_WAIT);
+	for (unsigned int i = 1; i < nr_cores; i++)
+		send_kernel_message((coreid + i) % num_cores, __kb_helper, (long)run,
+		                    i, 0, KMSG_ROUTINE);
+	for (unsigned int r = 0; r < KB_NR_RUNS; r++) {
+		wmb();
+		ACCESS_ONCE(run->go) = r + 1;
+		kb_time_one(run, 0);
+		while (atomic_read(&run->done) < (nr_cores - 1) * (r + 1))
+			kthread_yield();
+		rmb();
+		if (r < KTEST_BENCH_WARMUP)
+			continue;
+		slowest = 0;
+		for (unsigned int i = 0; i < nr_cores; i++)
+			slowest = MAX(slowest, run->elapsed[i]);
+		ns[r - KTEST_BENCH_WARMUP] = tsc2nsec(slowest) / kb->iters;
+	}
+	kb_report(kb, nr_cores, ns);
+	kfree(run->elapsed);
+}
+
+/* Runs kb on 1, 2, 4, ... cores, and on all of them. */
+void ktest_bench_scale(struct ktest_bench *kb)
+{
+	unsigned int nr;
+
+	for (nr = 1; nr < num_cores; nr *= 2)
+		ktest_bench_run(kb, nr);
+	ktest_bench_run(kb, num_cores);
+}
+
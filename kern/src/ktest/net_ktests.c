@@ -44,6 +44,36 @@ bool test_ptclbsum(void)
 	return true;
 }
 
+bool test_ptclbsum_copy(void)
+{
+	uint16_t csum, expected;
+	uint8_t buf[300], dst[300];
+	int i, len;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = (i * 7) & 0xff;
+	for (i = 0; i < 8; i++) {
+		for (len = 0; len <= sizeof(buf) - 8; len++) {
+			memset(dst, 0, sizeof(dst));
+			csum = ptclbsum_copy(dst + (i ^ 3), buf + i, len);
+			expected = simplesum(buf + i, len);
+			if (csum != expected || memcmp(dst + (i ^ 3), buf + i, len)) {
+				printk("i %d len %d csum %04x expected %04x\n",
+					   i, len, csum, expected);
+				return false;
+			}
+			/* Long enough for the unrolled loop */
+			csum = ptclbsum(buf + i, len);
+			if (csum != expected) {
+				printk("i %d len %d ptclbsum %04x expected %04x\n",
+					   i, len, csum, expected);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
 #define CSUM_BENCH_BUFSIZE 4000
 
 bool test_simplesum_bench(void)
@@ -80,10 +110,49 @@ bool test_ptclbsum_bench(void)
 	return true;
 }
 
+/* Freed blocks of a pooled size come back, but not while someone else holds a
+ * ref on one. */
+bool test_block_pool(void)
+{
+	struct block *bps[8], *again[8], *bp;
+	int nr;
+
+	nr = block_alloc_bulk(1514, MEM_WAIT, bps, ARRAY_SIZE(bps));
+	KT_ASSERT(nr == ARRAY_SIZE(bps));
+	for (int i = 0; i < nr; i++) {
+		KT_ASSERT(BLEN(bps[i]) == 0);
+		KT_ASSERT(bps[i]->lim - bps[i]->wp >= 1514);
+		KT_ASSERT(bps[i]->rp - bps[i]->base >= 128);
+	}
+	/* this one's body is still in use, so it can't be recycled */
+	kmalloc_incref(bps[0]);
+	for (int i = 0; i < nr; i++)
+		freeb(bps[i]);
+	/* we might move cores, so a block might not come back, but b0 can't */
+	nr = block_alloc_bulk(1514, MEM_WAIT, again, ARRAY_SIZE(again));
+	KT_ASSERT(nr == ARRAY_SIZE(again));
+	for (int i = 0; i < nr; i++) {
+		KT_ASSERT(again[i] != bps[0]);
+		KT_ASSERT(again[i]->flag == 0 && !again[i]->extra_data);
+		freeb(again[i]);
+	}
+	kfree(bps[0]);
+	/* small and odd sizes still work */
+	bp = block_alloc(0, MEM_WAIT);
+	KT_ASSERT(bp && BLEN(bp) == 0);
+	freeb(bp);
+	bp = block_alloc(9000, MEM_WAIT);
+	KT_ASSERT(bp && bp->lim - bp->wp >= 9000);
+	freeb(bp);
+	return true;
+}
+
 static struct ktest ktests[] = {
 	KTEST_REG(ptclbsum,				CONFIG_TEST_ptclbsum),
+	KTEST_REG(ptclbsum_copy,		CONFIG_TEST_ptclbsum_copy),
 	KTEST_REG(simplesum_bench,		CONFIG_TEST_simplesum_bench),
 	KTEST_REG(ptclbsum_bench,		CONFIG_TEST_ptclbsum_bench),
+	KTEST_REG(block_pool,			CONFIG_TEST_block_pool),
 };
 
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
@@ -33,6 +33,7 @@
 #include <slab.h>
 #include <kmalloc.h>
 #include <hashtable.h>
+#include <chash.h>
 #include <radix.h>
 #include <circular_buffer.h>
 #include <monitor.h>
@@ -50,6 +51,18 @@
 #include <ktest.h>
 #include <smallidpool.h>
 #include <linker_func.h>
+#include <arena.h>
+#include <memprof.h>
+#include <tracepoint.h>
+#include <pcpu_counter.h>
+#include <workqueue.h>
+#include <rcu.h>
+#include <ip.h>
+#include <crypto/2sha.h>
+#include <random/chacha20.h>
+#include <kpz.h>
+#include <zlib.h>
+#include <ros/profiler_records.h>
 
 KTEST_SUITE("POSTBOOT")
 
@@ -731,12 +744,49 @@ void a_dtor(void *buf, size_t size)
 	printk("destructin tests\n");
 }
 
+/* Frees and reallocs enough objects to go through the depot.  Reaping should
+ * drain all of the magazines back to the slabs. */
+static bool test_slab_magazines(size_t size)
+{
+	struct kmem_cache *test_cache;
+	struct kmem_depot *depot;
+	int nr_objs = KMC_MAG_MAX_SZ * 4;
+	void *objects[nr_objs];
+
+	test_cache = kmem_cache_create("test_mag_cache", size, 8, 0, 0, 0);
+	depot = &test_cache->depots[local_mem_node()];
+	KT_ASSERT_M("Cache should have a magazine layer", test_cache->pcpu_caches);
+	for (int i = 0; i < nr_objs; i++)
+		objects[i] = kmem_cache_alloc(test_cache, 0);
+	for (int i = 0; i < nr_objs; i++)
+		kmem_cache_free(test_cache, objects[i]);
+	KT_ASSERT_M("Depot should have full magazines",
+	            depot->nr_not_empty);
+	for (int i = 0; i < nr_objs; i++)
+		objects[i] = kmem_cache_alloc(test_cache, 0);
+	for (int i = 0; i < nr_objs; i++)
+		for (int j = i + 1; j < nr_objs; j++)
+			KT_ASSERT_M("Got the same object twice", objects[i] != objects[j]);
+	for (int i = 0; i < nr_objs; i++)
+		kmem_cache_free(test_cache, objects[i]);
+	kmem_cache_reap(test_cache);
+	KT_ASSERT_M("Reap should empty the magazines",
+	            test_cache->nr_cur_alloc == 0);
+	KT_ASSERT_M("Reap should empty the depot", !depot->nr_not_empty);
+	kmem_cache_destroy(test_cache);
+	return true;
+}
+
 // TODO: Make test_single_cache return something, and then add assertions here.
 bool test_slab(void)
 {
 	test_single_cache(10, 128, 512, 0, 0, 0);
 	test_single_cache(10, 128, 4, 0, a_ctor, a_dtor);
 	test_single_cache(10, 1024, 16, 0, 0, 0);
+	if (!test_slab_magazines(64))
+		return false;
+	if (!test_slab_magazines(1024))
+		return false;
 
 	return true;
 }
@@ -745,17 +795,35 @@ bool test_slab(void)
 bool test_kmalloc(void)
 {
 	printk("Testing Kmalloc\n");
-	void *bufs[NUM_KMALLOC_CACHES + 1];
-	size_t size;
-	for (int i = 0; i < NUM_KMALLOC_CACHES + 1; i++){
+	void *bufs[KMALLOC_NR_ORDERS + 1];
+	size_t size, obj_size;
+	struct kmalloc_tag *tag;
+	for (int i = 0; i < KMALLOC_NR_ORDERS + 1; i++){
 		size = (KMALLOC_SMALLEST << i) - sizeof(struct kmalloc_tag);
 		bufs[i] = kmalloc(size, 0);
 		printk("Size %d, Addr = %p\n", size, bufs[i]);
 	}
-	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
+	for (int i = 0; i < KMALLOC_NR_ORDERS + 1; i++) {
 		printk("Freeing buffer %d\n", i);
 		kfree(bufs[i]);
 	}
+	/* Every size should land in a class that fits it, with less than a step's
+	 * worth of waste. */
+	for (size = 1; size < (KMALLOC_SMALLEST << (KMALLOC_NR_ORDERS - 1)) -
+	                      sizeof(struct kmalloc_tag); size += 13) {
+		bufs[0] = kmalloc(size, 0);
+		tag = (struct kmalloc_tag*)(bufs[0] - sizeof(struct kmalloc_tag));
+		KT_ASSERT_M("Small kmallocs should come from a cache",
+		            (tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_CACHE);
+		obj_size = tag->my_cache->obj_size;
+		KT_ASSERT_M("Size class too small",
+		            obj_size >= size + sizeof(struct kmalloc_tag));
+		KT_ASSERT_M("Size class too big",
+		            (size + sizeof(struct kmalloc_tag) <= KMALLOC_SMALLEST) ||
+		            (obj_size - (size + sizeof(struct kmalloc_tag)) <
+		             ROUNDDOWNPWR2(obj_size - 1) >> KMALLOC_STEPS_SHIFT));
+		kfree(bufs[0]);
+	}
 	printk("Testing a large kmalloc\n");
 	size = (KMALLOC_LARGEST << 2);
 	bufs[0] = kmalloc(size, 0);
@@ -770,6 +838,320 @@ static size_t test_hash_fn_col(void *k)
 	return (size_t)k % 2; // collisions in slots 0 and 1
 }
 
+bool test_page_pcp(void)
+{
+	struct page *page, *page2;
+	size_t old_nr_free;
+
+	KT_ASSERT_M("Couldn't get a page", !kpage_alloc(&page));
+	KT_ASSERT_M("pcp pages should be local",
+	            pa_to_mem_node(page2pa(page)) == local_mem_node());
+	page_decref(page);
+	KT_ASSERT_M("Freed page should be in the pcp cache, not the free list",
+	            !page_is_free(page2ppn(page)));
+	/* The pcp caches are LIFO, so the hot page comes right back */
+	KT_ASSERT_M("Couldn't get a page", !kpage_alloc(&page2));
+	KT_ASSERT_M("Didn't get the hot page back", page == page2);
+	page_decref(page2);
+	old_nr_free = nr_free_pages;
+	page_pcp_drain_all();
+	KT_ASSERT_M("Drain didn't give the page back", page_is_free(page2ppn(page)));
+	KT_ASSERT_M("Drain didn't update nr_free_pages",
+	            nr_free_pages > old_nr_free);
+	return true;
+}
+
+bool test_page_zero_pool(void)
+{
+	uint64_t *kva;
+
+	/* Scribble on a free page, so the zeroer has something to do */
+	KT_ASSERT_M("Couldn't get a page", (kva = kpage_alloc_addr()));
+	memset(kva, 0xff, PGSIZE);
+	page_decref(kva2page(kva));
+	page_pcp_drain_all();
+	page_zero_pool_drain_all();
+	/* Might not zero anything if we're low on memory; that's OK */
+	page_zero_idle();
+	KT_ASSERT_M("Couldn't get a zeroed page", (kva = kpage_zalloc_addr()));
+	for (int i = 0; i < PGSIZE / sizeof(uint64_t); i++)
+		KT_ASSERT_M("Zeroed page wasn't zero", !kva[i]);
+	page_decref(kva2page(kva));
+	page_zero_pool_drain_all();
+	return true;
+}
+
+bool test_arena(void)
+{
+	static struct arena arena;
+	uintptr_t base = 0x1000000, a, b, c;
+	size_t span = 64 * PGSIZE;
+
+	arena_init(&arena, "test", PGSIZE, 2 * PGSIZE);
+	KT_ASSERT_M("Couldn't add a span", !arena_add(&arena, base, span,
+	                                              MEM_WAIT));
+	a = arena_alloc(&arena, 3 * PGSIZE, MEM_WAIT);
+	b = arena_alloc(&arena, 5 * PGSIZE - 1, MEM_WAIT);
+	KT_ASSERT_M("Couldn't alloc", a && b);
+	KT_ASSERT_M("Allocs outside the span",
+	            (a >= base) && (a + 3 * PGSIZE <= base + span) &&
+	            (b >= base) && (b + 5 * PGSIZE <= base + span));
+	KT_ASSERT_M("Allocs overlap",
+	            (a + 3 * PGSIZE <= b) || (b + 5 * PGSIZE <= a));
+	KT_ASSERT_M("Alloc bigger than the arena worked",
+	            !arena_alloc(&arena, span, MEM_WAIT));
+	arena_free(&arena, a, 3 * PGSIZE);
+	arena_free(&arena, b, 5 * PGSIZE - 1);
+	/* Frees coalesce, so we can get the whole span back */
+	c = arena_alloc(&arena, span, MEM_WAIT);
+	KT_ASSERT_M("Frees didn't coalesce", c == base);
+	arena_free(&arena, c, span);
+	/* Small frees go to the qcaches, which hand them right back */
+	a = arena_alloc(&arena, PGSIZE, MEM_WAIT);
+	arena_free(&arena, a, PGSIZE);
+	b = arena_alloc(&arena, PGSIZE, MEM_WAIT);
+	KT_ASSERT_M("Qcache didn't return the freed segment", a == b);
+	arena_free(&arena, b, PGSIZE);
+	arena_reap(&arena);
+	c = arena_alloc(&arena, span, MEM_WAIT);
+	KT_ASSERT_M("Reap didn't give back the qcached segment", c == base);
+	arena_free(&arena, c, span);
+	return true;
+}
+
+static const char *vb_decode_uint64(const char *data, uint64_t *pval)
+{
+	uint64_t val = 0;
+
+	for (int i = 0; ; i += 7) {
+		val |= (uint64_t)(*data & 0x7f) << i;
+		if (!(*data++ & 0x80))
+			break;
+	}
+	*pval = val;
+	return data;
+}
+
+/* Returns the biggest live byte count of the kmalloc sites in a report */
+static uint64_t memprof_max_kmalloc_site(const char *buf, size_t len)
+{
+	const char *ptr = buf;
+	struct proftype_kern_trace64 *rec;
+	uint64_t type, size, max = 0;
+
+	while (ptr < buf + len) {
+		ptr = vb_decode_uint64(ptr, &type);
+		ptr = vb_decode_uint64(ptr, &size);
+		rec = (struct proftype_kern_trace64*)ptr;
+		ptr += size;
+		if ((type == PROFTYPE_KERN_TRACE64) && (rec->cpu == MEMPROF_KMALLOC))
+			max = MAX(max, rec->info);
+	}
+	return max;
+}
+
+bool test_memprof(void)
+{
+	#define NR_MEMPROF_BUFS 64
+	#define MEMPROF_BUF_SZ 4000
+	void *bufs[NR_MEMPROF_BUFS];
+	char *report;
+	size_t len;
+
+	/* Rate 1: every allocation is sampled */
+	memprof_start(1);
+	for (int i = 0; i < NR_MEMPROF_BUFS; i++)
+		bufs[i] = kmalloc(MEMPROF_BUF_SZ, MEM_WAIT);
+	memprof_stop();
+	report = memprof_report(&len);
+	KT_ASSERT_M("Didn't find our kmalloc site",
+	            memprof_max_kmalloc_site(report, len) >=
+	            NR_MEMPROF_BUFS * MEMPROF_BUF_SZ);
+	kfree(report);
+	for (int i = 0; i < NR_MEMPROF_BUFS; i++)
+		kfree(bufs[i]);
+	memprof_start(1);
+	for (int i = 0; i < NR_MEMPROF_BUFS; i++)
+		bufs[i] = kmalloc(MEMPROF_BUF_SZ, MEM_WAIT);
+	for (int i = 0; i < NR_MEMPROF_BUFS; i++)
+		kfree(bufs[i]);
+	memprof_stop();
+	report = memprof_report(&len);
+	KT_ASSERT_M("Freed objects are still live",
+	            memprof_max_kmalloc_site(report, len) <
+	            NR_MEMPROF_BUFS * MEMPROF_BUF_SZ);
+	kfree(report);
+	return true;
+}
+
+DEFINE_TRACEPOINT(ktest_tp, "cookie %lx i %d");
+
+/* Counts the ktest_tp records in a snapshot with the given cookie. */
+static int count_ktest_tp(uint64_t cookie)
+{
+	struct sized_alloc *sza = tracepoint_snapshot();
+	struct tp_record *rec = sza->buf;
+	int id = &__tp_ktest_tp - __tracepointsstart;
+	int nr = 0;
+
+	for (size_t i = 0; i < sza->size / sizeof(struct tp_record); i++) {
+		if (rec[i].id == id && rec[i].args[0] == cookie)
+			nr++;
+	}
+	kfree(sza);
+	return nr;
+}
+
+bool test_tracepoint(void)
+{
+	uint64_t cookie = read_tsc();
+
+	tracepoint(ktest_tp, cookie, -1);
+	KT_ASSERT_M("Hit a tracepoint that was off", count_ktest_tp(cookie) == 0);
+	KT_ASSERT_M("Couldn't find ktest_tp", tracepoint_set("ktest_*", TRUE));
+	for (int i = 0; i < 10; i++)
+		tracepoint(ktest_tp, cookie, i);
+	tracepoint_set("ktest_tp", FALSE);
+	tracepoint(ktest_tp, cookie, -1);
+	KT_ASSERT_M("Wrong number of ktest_tp records",
+	            count_ktest_tp(cookie) == 10);
+	return true;
+}
+
+DEFINE_PCPU_COUNTER(ktest_ctr);
+
+static void __test_pcpu_counter_handler(struct hw_trapframe *hw_tf, void *data)
+{
+	pcpu_counter_add(ktest_ctr, 3);
+}
+
+bool test_pcpu_counter(void)
+{
+	struct pcpu_counter *ctr = pcpu_counter_lookup("ktest_ctr");
+	handler_wrapper_t *waiter;
+	uint64_t start;
+
+	KT_ASSERT_M("Couldn't find ktest_ctr", ctr == &__pcpu_ctr_ent_ktest_ctr);
+	start = pcpu_counter_sum(ctr);
+	for (int i = 0; i < 10; i++)
+		pcpu_counter_inc(ktest_ctr);
+	KT_ASSERT_M("Lost local increments", pcpu_counter_sum(ctr) == start + 10);
+	smp_call_function_all(__test_pcpu_counter_handler, NULL, &waiter);
+	smp_call_wait(waiter);
+	KT_ASSERT_M("Lost remote increments",
+	            pcpu_counter_sum(ctr) == start + 10 + 3 * num_cores);
+	return true;
+}
+
+static atomic_t wq_test_ctr;
+static int wq_test_last;
+
+static void __test_wq_fn(struct work_struct *work)
+{
+	atomic_inc(&wq_test_ctr);
+}
+
+static void __test_wq_ordered_fn(struct work_struct *work)
+{
+	int *id = (int*)work->arg;
+
+	/* ordered work runs one at a time, in order */
+	if (*id == wq_test_last + 1)
+		wq_test_last = *id;
+	atomic_inc(&wq_test_ctr);
+}
+
+bool test_workqueue(void)
+{
+	#define NR_WQ_TEST_WORK 16
+	struct work_struct work[NR_WQ_TEST_WORK];
+	struct delayed_work dwork;
+	struct workqueue_struct *wq;
+	int ids[NR_WQ_TEST_WORK];
+
+	atomic_set(&wq_test_ctr, 0);
+	for (int i = 0; i < NR_WQ_TEST_WORK; i++) {
+		INIT_WORK(&work[i], __test_wq_fn);
+		KT_ASSERT(queue_work_on(i % num_cores, system_wq, &work[i]));
+	}
+	flush_workqueue(system_wq);
+	KT_ASSERT_M("Flush returned before the work ran",
+	            atomic_read(&wq_test_ctr) == NR_WQ_TEST_WORK);
+
+	INIT_DELAYED_WORK(&dwork, __test_wq_fn);
+	KT_ASSERT(schedule_delayed_work(&dwork, 1000));
+	KT_ASSERT_M("Pending work was queued twice",
+	            !schedule_delayed_work(&dwork, 1000));
+	KT_ASSERT_M("Couldn't cancel delayed work",
+	            cancel_delayed_work_sync(&dwork));
+	KT_ASSERT(!delayed_work_pending(&dwork));
+	KT_ASSERT(schedule_delayed_work(&dwork, 1000));
+	flush_delayed_work(&dwork);
+	KT_ASSERT_M("Flushed delayed work didn't run",
+	            atomic_read(&wq_test_ctr) == NR_WQ_TEST_WORK + 1);
+
+	atomic_set(&wq_test_ctr, 0);
+	wq_test_last = 0;
+	wq = create_singlethread_workqueue("test_wq");
+	for (int i = 0; i < NR_WQ_TEST_WORK; i++) {
+		ids[i] = i + 1;
+		INIT_WORK(&work[i], __test_wq_ordered_fn);
+		work[i].arg = &ids[i];
+		queue_work(wq, &work[i]);
+	}
+	flush_workqueue(wq);
+	destroy_workqueue(wq);
+	KT_ASSERT(atomic_read(&wq_test_ctr) == NR_WQ_TEST_WORK);
+	KT_ASSERT_M("Ordered work ran out of order",
+	            wq_test_last == NR_WQ_TEST_WORK);
+	return true;
+}
+
+struct rcu_test {
+	int						x;
+	struct rcu_head			rcu;
+};
+
+static atomic_t rcu_test_ctr;
+
+static void __test_rcu_cb(struct rcu_head *head)
+{
+	atomic_inc(&rcu_test_ctr);
+}
+
+bool test_rcu(void)
+{
+	#define NR_RCU_TEST_CBS 16
+	struct rcu_head heads[NR_RCU_TEST_CBS];
+	struct rcu_test *old, *new;
+	struct rcu_test *gp;
+
+	atomic_set(&rcu_test_ctr, 0);
+	for (int i = 0; i < NR_RCU_TEST_CBS; i++)
+		call_rcu(&heads[i], __test_rcu_cb);
+	/* Callbacks run in order, and are all done by the end of the next GP */
+	synchronize_rcu();
+	KT_ASSERT_M("Callbacks didn't run before synchronize_rcu() returned",
+	            atomic_read(&rcu_test_ctr) == NR_RCU_TEST_CBS);
+
+	old = kzmalloc(sizeof(struct rcu_test), MEM_WAIT);
+	old->x = 1;
+	rcu_assign_pointer(gp, old);
+	new = kzmalloc(sizeof(struct rcu_test), MEM_WAIT);
+	new->x = 2;
+	rcu_read_lock();
+	KT_ASSERT(rcu_dereference(gp)->x == 1);
+	rcu_read_unlock();
+	rcu_assign_pointer(gp, new);
+	kfree_rcu(old, rcu);
+	synchronize_rcu();
+	rcu_read_lock();
+	KT_ASSERT(rcu_dereference(gp)->x == 2);
+	rcu_read_unlock();
+	kfree(new);
+	return true;
+}
+
 bool test_hashtable(void)
 {
 	struct test {int x; int y;};
@@ -880,6 +1262,169 @@ bool test_hashtable(void)
 	return true;
 }
 
+static void __test_chash_count(void *val, void *arg)
+{
+	(*(int*)arg)++;
+}
+
+/* Enough keys to go through a few resizes, with removes mixed in so we leave
+ * dead slots behind. */
+bool test_chash(void)
+{
+	#define NR_CHASH_TEST_KEYS 1000
+	static int vals[NR_CHASH_TEST_KEYS];
+	struct chash ht;
+	int nr_seen = 0;
+
+	KT_ASSERT(!chash_init(&ht, 8));
+	for (int i = 0; i < NR_CHASH_TEST_KEYS; i++) {
+		KT_ASSERT_M("Couldn't insert a new key",
+		            !chash_insert(&ht, i, &vals[i]));
+		if (i % 3 == 0)
+			KT_ASSERT(chash_remove(&ht, i) == &vals[i]);
+	}
+	KT_ASSERT_M("Inserted a duplicate key", chash_insert(&ht, 1, &vals[1]));
+	rcu_read_lock();
+	for (int i = 0; i < NR_CHASH_TEST_KEYS; i++) {
+		KT_ASSERT_M("Lookup got the wrong value",
+		            chash_lookup(&ht, i) == (i % 3 ? &vals[i] : 0));
+	}
+	chash_for_each(&ht, __test_chash_count, &nr_seen);
+	rcu_read_unlock();
+	KT_ASSERT(chash_count(&ht) == NR_CHASH_TEST_KEYS - 334);
+	KT_ASSERT_M("for_each saw the wrong number of values",
+	            nr_seen == chash_count(&ht));
+	for (int i = 0; i < NR_CHASH_TEST_KEYS; i++) {
+		if (i % 3)
+			KT_ASSERT(chash_remove(&ht, i) == &vals[i]);
+	}
+	KT_ASSERT(!chash_count(&ht));
+	KT_ASSERT(!chash_remove(&ht, 1));
+	/* Any old arrays waiting on a grace period free themselves */
+	chash_destroy(&ht);
+	return true;
+}
+
+/* Hashes the same data in one go, which takes the SHA-NI path if we have it,
+ * and in odd-sized pieces, which mostly doesn't. */
+static bool __test_sha_alg(enum vb2_hash_algorithm alg, const uint8_t *buf,
+                           size_t len, const uint8_t *expect, size_t dig_sz)
+{
+	static const uint32_t pieces[] = {1, 63, 130, 64 * 70};
+	struct vb2_digest_context dc;
+	uint8_t digest[VB2_MAX_DIGEST_SIZE];
+	size_t off = 0, amt;
+
+	KT_ASSERT(!vb2_digest_buffer(buf, len, alg, digest, dig_sz));
+	KT_ASSERT_M("Wrong digest for the whole buffer",
+	            !memcmp(digest, expect, dig_sz));
+	KT_ASSERT(!vb2_digest_init(&dc, alg));
+	for (int i = 0; off < len; i = (i + 1) % ARRAY_SIZE(pieces)) {
+		amt = MIN(pieces[i], len - off);
+		KT_ASSERT(!vb2_digest_extend(&dc, buf + off, amt));
+		off += amt;
+	}
+	KT_ASSERT(!vb2_digest_finalize(&dc, digest, dig_sz));
+	KT_ASSERT_M("Wrong digest for the pieces", !memcmp(digest, expect, dig_sz));
+	return true;
+}
+
+bool test_sha(void)
+{
+	#define SHA_TEST_LEN 5000
+	static const uint8_t sha1_expect[] = {
+		0x6c, 0x0a, 0x58, 0x6b, 0x27, 0x61, 0xee, 0x38, 0x3b, 0xb0, 0xe7, 0x63,
+		0x9c, 0x4e, 0xd0, 0x91, 0x53, 0x84, 0x42, 0xea};
+	static const uint8_t sha256_expect[] = {
+		0x34, 0x39, 0x8b, 0x85, 0x29, 0x7b, 0xf7, 0xd9, 0xdf, 0xb5, 0x9b, 0x8d,
+		0x51, 0x1d, 0x8b, 0xbb, 0x44, 0xab, 0x23, 0xe8, 0x91, 0x57, 0x0e, 0x43,
+		0x95, 0xe7, 0x87, 0x14, 0x75, 0xfc, 0x8a, 0xfb};
+	uint8_t *buf = kmalloc(SHA_TEST_LEN, MEM_WAIT);
+	bool ret;
+
+	for (int i = 0; i < SHA_TEST_LEN; i++)
+		buf[i] = i * 7 + 3;
+	ret = __test_sha_alg(VB2_HASH_SHA1, buf, SHA_TEST_LEN, sha1_expect,
+	                     sizeof(sha1_expect)) &&
+	      __test_sha_alg(VB2_HASH_SHA256, buf, SHA_TEST_LEN, sha256_expect,
+	                     sizeof(sha256_expect));
+	kfree(buf);
+	return ret;
+}
+
+/* The block function test vector from RFC 7539, section 2.3.2.  Its 32 bit
+ * counter and 96 bit nonce are the same words as our 64 bit ones. */
+bool test_chacha20(void)
+{
+	static const uint8_t expect[CHACHA20_BLOCK_SZ] = {
+		0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f,
+		0xa3, 0x20, 0x71, 0xc4, 0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03,
+		0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e, 0xd2, 0x82, 0x64, 0x46,
+		0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+		0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8,
+		0xa2, 0x50, 0x3c, 0x4e};
+	uint32_t key[CHACHA20_KEY_SZ / 4];
+	uint8_t out[CHACHA20_BLOCK_SZ];
+	uint64_t a = 0, b = 0;
+
+	for (int i = 0; i < ARRAY_SIZE(key); i++)
+		key[i] = (4 * i) | ((4 * i + 1) << 8) | ((4 * i + 2) << 16) |
+		         ((4 * i + 3) << 24);
+	chacha20_block(key, 1 | (0x09000000ULL << 32), 0x4a000000, out);
+	KT_ASSERT_M("Wrong ChaCha20 block", !memcmp(out, expect, sizeof(out)));
+	/* Not much of a test of urandom, other than that it works */
+	urandom_read(&a, sizeof(a));
+	urandom_read(&b, sizeof(b));
+	KT_ASSERT_M("urandom gave us the same thing twice", a != b);
+	return true;
+}
+
+/* Compresses a few chunks' worth, and inflates each frame back. */
+bool test_kpz(void)
+{
+	#define KPZ_TEST_LEN (600 * 1024)
+	struct sized_alloc *sza;
+	struct kpz_hdr *hdr;
+	struct z_stream_s zs;
+	uint8_t *src = kmalloc(KPZ_TEST_LEN, MEM_WAIT);
+	uint8_t *dst = kmalloc(KPZ_TEST_LEN, MEM_WAIT);
+	size_t off = 0, raw_off = 0;
+	bool ret = false;
+
+	for (int i = 0; i < KPZ_TEST_LEN; i++)
+		src[i] = (i % 1000) * (i / 1000);
+	sza = kpz_compress(src, KPZ_TEST_LEN);
+	if (!sza)
+		goto out;
+	memset(&zs, 0, sizeof(zs));
+	zs.workspace = kmalloc(zlib_inflate_workspacesize(), MEM_WAIT);
+	while (off + sizeof(struct kpz_hdr) <= sza->size) {
+		hdr = (struct kpz_hdr*)(sza->buf + off);
+		if (hdr->magic != KPZ_MAGIC ||
+		    raw_off + hdr->raw_len > KPZ_TEST_LEN)
+			break;
+		zlib_inflateInit(&zs);
+		zs.next_in = (uint8_t*)(hdr + 1);
+		zs.avail_in = hdr->z_len;
+		zs.next_out = dst + raw_off;
+		zs.avail_out = hdr->raw_len;
+		if (zlib_inflate(&zs, Z_FINISH) != Z_STREAM_END)
+			break;
+		zlib_inflateEnd(&zs);
+		raw_off += hdr->raw_len;
+		off += sizeof(struct kpz_hdr) + hdr->z_len;
+	}
+	ret = (off == sza->size) && (raw_off == KPZ_TEST_LEN) &&
+	      !memcmp(src, dst, KPZ_TEST_LEN);
+	kfree(zs.workspace);
+	kfree(sza);
+out:
+	kfree(src);
+	kfree(dst);
+	KT_ASSERT_M("kpz frames didn't inflate back to the original", ret);
+	return true;
+}
+
 bool test_circular_buffer(void)
 {
 	static const size_t cbsize = 4096;
@@ -957,6 +1502,92 @@ bool test_circular_buffer(void)
 	return TRUE;
 }
 
+#define CBMP_TEST_PER_CORE 1000
+
+struct cbmp_test_rec {
+	uint32_t coreid;
+	uint32_t seq;
+	uint64_t check;
+};
+
+static struct circular_buffer_mp cbmp_test;
+
+static void __cbmp_test_writer(void *arg)
+{
+	struct cbmp_test_rec *rec;
+	uint32_t coreid = core_id();
+
+	for (uint32_t i = 0; i < CBMP_TEST_PER_CORE; i++) {
+		rec = (struct cbmp_test_rec*)
+			circular_buffer_mp_reserve(&cbmp_test, sizeof(*rec));
+		if (!rec)
+			continue;
+		rec->coreid = coreid;
+		rec->seq = i;
+		rec->check = coreid * 1000003ULL + i;
+		circular_buffer_mp_commit(&cbmp_test, (char*)rec);
+	}
+}
+
+bool test_circular_buffer_mp(void)
+{
+	struct circular_buffer_mp cb;
+	struct cbmp_test_rec recs[16];
+	struct core_set cset;
+	uint32_t *next_seq;
+	size_t nr_read = 0, csize;
+	char buf[64], *rec;
+
+	/* Odd sizes, so records start all over and the ends get padded */
+	KT_ASSERT(circular_buffer_mp_init(&cb, 256));
+	for (int i = 0; i < 200; i++) {
+		size_t len = 1 + i % 41;
+
+		rec = circular_buffer_mp_reserve(&cb, len);
+		KT_ASSERT_M("Reserve in an empty buffer failed", rec);
+		memset(rec, i, len);
+		circular_buffer_mp_commit(&cb, rec);
+		csize = circular_buffer_mp_read(&cb, buf, sizeof(buf));
+		KT_ASSERT_M("Wrong record size", csize == len);
+		for (size_t j = 0; j < len; j++)
+			KT_ASSERT_M("Wrong record contents", buf[j] == (char)i);
+	}
+	/* Full: the new one goes, and uncommitted ones hold up the reader */
+	while ((rec = circular_buffer_mp_reserve(&cb, 24)))
+		nr_read++;
+	KT_ASSERT_M("Should have dropped a record", cb.nr_dropped == 1);
+	KT_ASSERT_M("Read an uncommitted record",
+				!circular_buffer_mp_read(&cb, buf, sizeof(buf)));
+	circular_buffer_mp_destroy(&cb);
+
+	KT_ASSERT(circular_buffer_mp_init(&cbmp_test, 64 * 1024));
+	core_set_init(&cset);
+	core_set_fill_available(&cset);
+	smp_do_in_cores(&cset, __cbmp_test_writer, NULL);
+	next_seq = kzmalloc(num_cores * sizeof(uint32_t), MEM_WAIT);
+	nr_read = 0;
+	while ((csize = circular_buffer_mp_read(&cbmp_test, (char*)recs,
+											sizeof(recs)))) {
+		for (size_t i = 0; i < csize / sizeof(recs[0]); i++) {
+			struct cbmp_test_rec *r = &recs[i];
+
+			KT_ASSERT_M("Corrupt record",
+						r->coreid < num_cores &&
+						r->check == r->coreid * 1000003ULL + r->seq);
+			KT_ASSERT_M("A core's records are out of order",
+						r->seq >= next_seq[r->coreid]);
+			next_seq[r->coreid] = r->seq + 1;
+			nr_read++;
+		}
+	}
+	KT_ASSERT_M("Lost records",
+				nr_read + cbmp_test.nr_dropped ==
+				core_set_count(&cset) * CBMP_TEST_PER_CORE);
+	kfree(next_seq);
+	circular_buffer_mp_destroy(&cbmp_test);
+	return TRUE;
+}
+
 /* Ghetto test, only tests one prod or consumer at a time */
 // TODO: Un-guetto test, add assertions.
 bool test_bcq(void)
@@ -1295,6 +1926,7 @@ bool test_radix_tree(void)
 	struct radix_tree real_tree = RADIX_INITIALIZER;
 	struct radix_tree *tree = &real_tree;
 	void *retval;
+	void *gang[8];
 
 	KT_ASSERT_M("It should be possible to insert at 0",
 	            !radix_insert(tree, 0, (void*)0xdeadbeef, 0));
@@ -1321,6 +1953,18 @@ bool test_radix_tree(void)
 	            !radix_insert(tree, 4095, (void*)0x4095, 0));
 	KT_ASSERT_M("It should be possible to insert a three-tier",
 	            !radix_insert(tree, 4096, (void*)0x4096, 0));
+	KT_ASSERT_M("Gang lookup should find items in key order",
+	            (radix_gang_lookup(tree, gang, 4, 3) == 3) &&
+	            (gang[0] == (void*)0x04040404) &&
+	            (gang[1] == (void*)0xcafebabe) && (gang[2] == (void*)0x4095));
+	for (int i = 0; i < 8; i++)
+		gang[i] = (void*)(0x1000UL + i);
+	KT_ASSERT_M("Gang insert should cross leaves and stop at an item",
+	            radix_gang_insert(tree, 60, gang, 8, 0) == 5);
+	KT_ASSERT((void*)0x1004 == radix_lookup(tree, 64));
+	KT_ASSERT((void*)0xcafebabe == radix_lookup(tree, 65));
+	for (int i = 60; i < 65; i++)
+		radix_delete(tree, i);
 	//print_radix_tree(tree);
 	radix_delete(tree, 65);
 	radix_delete(tree, 3);
@@ -1477,6 +2121,50 @@ bool test_kref(void)
 	return true;
 }
 
+/* Bumps the counter at a0 if a1 is the next expected number; poisons it o/w */
+static void __test_kmsg_order(uint32_t srcid, long a0, long a1, long a2)
+{
+	long *next = (long*)a0;
+
+	*next = *next == a1 ? *next + 1 : -1;
+}
+
+static void __test_kmsg_tally(uint32_t srcid, long a0, long a1, long a2)
+{
+	atomic_inc((atomic_t*)a0);
+}
+
+/* Checks that kmsgs from one core run in order, and that a multicast hits each
+ * core once.  Needs at least 3 cores. */
+bool test_kmsg_order(void)
+{
+	long next_immed = 0, next_routine = 0;
+	atomic_t tally;
+	struct core_set cset;
+	int nr_msgs = 1000;
+
+	KT_ASSERT_M("Needs at least 3 cores", num_cores >= 3);
+	for (int i = 0; i < nr_msgs; i++) {
+		send_kernel_message(1, __test_kmsg_order, (long)&next_immed, i, 0,
+		                    KMSG_IMMEDIATE);
+		send_kernel_message(2, __test_kmsg_order, (long)&next_routine, i, 0,
+		                    KMSG_ROUTINE);
+	}
+	udelay(1000000);
+	KT_ASSERT_M("Immediates ran in order", next_immed == nr_msgs);
+	KT_ASSERT_M("Routines ran in order", next_routine == nr_msgs);
+	atomic_init(&tally, 0);
+	core_set_init(&cset);
+	core_set_setcpu(&cset, 1);
+	core_set_setcpu(&cset, 2);
+	send_kernel_message_cores(&cset, __test_kmsg_tally, (long)&tally, 0, 0,
+	                          KMSG_IMMEDIATE);
+	udelay(1000000);
+	KT_ASSERT_M("Multicast hit each core once", atomic_read(&tally) == 2);
+
+	return true;
+}
+
 // TODO: Add more descriptive assertion messages.
 bool test_atomics(void)
 {
@@ -1852,54 +2540,65 @@ bool test_apipe(void)
 
 static struct rwlock rwlock, *rwl = &rwlock;
 static atomic_t rwlock_counter;
-// TODO: Add assertions.
-bool test_rwlock(void)
+
+/* Just some half-assed different operations */
+static void __test_rwlock(uint32_t srcid, long a0, long a1, long a2)
 {
-	bool ret;
-	rwinit(rwl);
-	/* Basic: can i lock twice, recursively? */
-	rlock(rwl);
-	ret = canrlock(rwl);
-	KT_ASSERT(ret);
-	runlock(rwl);
-	runlock(rwl);
-	/* Other simply tests */
-	wlock(rwl);
-	wunlock(rwl);
-
-	/* Just some half-assed different operations */
-	void __test_rwlock(uint32_t srcid, long a0, long a1, long a2)
-	{
-		int rand = read_tsc() & 0xff;
-		for (int i = 0; i < 10000; i++) {
-			switch ((rand * i) % 5) {
-				case 0:
-				case 1:
-					rlock(rwl);
+	int rand = read_tsc() & 0xff;
+	for (int i = 0; i < 10000; i++) {
+		switch ((rand * i) % 5) {
+			case 0:
+			case 1:
+				rlock(rwl);
+				runlock(rwl);
+				break;
+			case 2:
+			case 3:
+				if (canrlock(rwl))
 					runlock(rwl);
-					break;
-				case 2:
-				case 3:
-					if (canrlock(rwl))
-						runlock(rwl);
-					break;
-				case 4:
-					wlock(rwl);
-					wunlock(rwl);
-					break;
-			}
+				break;
+			case 4:
+				wlock(rwl);
+				wunlock(rwl);
+				break;
 		}
-		/* signal to allow core 0 to finish */
-		atomic_dec(&rwlock_counter);
 	}
+	/* signal to allow core 0 to finish */
+	atomic_dec(&rwlock_counter);
+}
 
-	/* send 4 messages to each non core 0 */
-	atomic_init(&rwlock_counter, (num_cores - 1) * 4);
-	for (int i = 1; i < num_cores; i++)
-		for (int j = 0; j < 4; j++)
-			send_kernel_message(i, __test_rwlock, 0, 0, 0, KMSG_ROUTINE);
-	while (atomic_read(&rwlock_counter))
-		cpu_relax();
+// TODO: Add assertions.
+bool test_rwlock(void)
+{
+	bool ret;
+
+	/* Once as a regular rwlock, once as a big-reader lock */
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass)
+			brinit(rwl);
+		else
+			rwinit(rwl);
+		/* Basic: can i lock twice, recursively? */
+		rlock(rwl);
+		ret = canrlock(rwl);
+		KT_ASSERT(ret);
+		runlock(rwl);
+		runlock(rwl);
+		/* Other simply tests */
+		wlock(rwl);
+		KT_ASSERT_M("Got an rlock while write locked", !canrlock(rwl));
+		wunlock(rwl);
+
+		/* send 4 messages to each non core 0 */
+		atomic_init(&rwlock_counter, (num_cores - 1) * 4);
+		for (int i = 1; i < num_cores; i++)
+			for (int j = 0; j < 4; j++)
+				send_kernel_message(i, __test_rwlock, 0, 0, 0,
+				                    KMSG_ROUTINE);
+		while (atomic_read(&rwlock_counter))
+			cpu_relax();
+		rwdestroy(rwl);
+	}
 	printk("rwlock test complete\n");
 
 	return true;
@@ -2029,6 +2728,65 @@ bool test_alarm(void)
 	return true;
 }
 
+static atomic_t alarm_wheel_fired;
+static atomic_t alarm_wheel_early;
+
+static void __alarm_wheel_handler(struct alarm_waiter *waiter,
+                                  struct hw_trapframe *hw_tf)
+{
+	if (read_tsc() < waiter->wake_up_time)
+		atomic_inc(&alarm_wheel_early);
+	atomic_inc(&alarm_wheel_fired);
+}
+
+/* Spreads alarms, some with slack, across the wheel's levels, unsets some, and
+ * makes sure the rest fire, and not early. */
+bool test_alarm_wheel(void)
+{
+	#define NR_WHEEL_WAITERS 128
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+	struct alarm_waiter *waiters, *far;
+	int nr_unset = 0;
+
+	waiters = kzmalloc(sizeof(struct alarm_waiter) * NR_WHEEL_WAITERS,
+	                   MEM_WAIT);
+	far = kzmalloc(sizeof(struct alarm_waiter) * 2, MEM_WAIT);
+	atomic_init(&alarm_wheel_fired, 0);
+	atomic_init(&alarm_wheel_early, 0);
+	/* One an hour out, and one far past the top level */
+	init_awaiter_irq(&far[0], __alarm_wheel_handler);
+	set_awaiter_rel(&far[0], 3600ULL * 1000000);
+	set_alarm(tchain, &far[0]);
+	init_awaiter_irq(&far[1], __alarm_wheel_handler);
+	set_awaiter_rel(&far[1], 100ULL * 3600 * 1000000);
+	set_alarm(tchain, &far[1]);
+	for (int i = 0; i < NR_WHEEL_WAITERS; i++) {
+		init_awaiter_irq(&waiters[i], __alarm_wheel_handler);
+		/* Half of them can share interrupts with their neighbors */
+		set_awaiter_rel_slack(&waiters[i], 1 + (i * 397) % 50000,
+		                      i % 2 ? 1000 : 0);
+		set_alarm(tchain, &waiters[i]);
+	}
+	for (int i = 0; i < NR_WHEEL_WAITERS; i += 4) {
+		if (unset_alarm(tchain, &waiters[i]))
+			nr_unset++;
+	}
+	enable_irq();
+	udelay(100000);
+	KT_ASSERT(unset_alarm(tchain, &far[0]));
+	KT_ASSERT(unset_alarm(tchain, &far[1]));
+	KT_ASSERT_M("All set alarms should fire",
+	            atomic_read(&alarm_wheel_fired) ==
+	            NR_WHEEL_WAITERS - nr_unset);
+	KT_ASSERT_M("No alarm should fire early",
+	            !atomic_read(&alarm_wheel_early));
+	for (int i = 0; i < NR_WHEEL_WAITERS; i++)
+		KT_ASSERT(!waiters[i].on_tchain);
+	kfree(waiters);
+	kfree(far);
+	return true;
+}
+
 bool test_kmalloc_incref(void)
 {
 	/* this test is a bit invasive of the kmalloc internals */
@@ -2093,8 +2851,8 @@ bool test_u16pool(void)
 
 	t = kzmalloc(sizeof(int) * (AMT + 1), MEM_WAIT);
 	for (x = 0; x < 1024; x++) {
-		KT_ASSERT_M("Should be empty", id->tos == 0);
-		for (i = 0; i < id->size; i++) {
+		KT_ASSERT_M("Should be empty", u16_pool_nr_free(id) == AMT);
+		for (i = 0; i < AMT; i++) {
 			int p = get_u16(id);
 			if (p < 0)
 				KT_ASSERT_M("Couldn't get enough", 0);
@@ -2112,11 +2870,11 @@ bool test_u16pool(void)
 			t[f] = 0;
 			i++;
 			/* that's long enough... */
-			if (y > 2 * id->size)
+			if (y > 2 * AMT)
 				break;
 		}
 		/* grab the leftovers */
-		for (i = 0; i < id->size; i++) {
+		for (i = 0; i < AMT; i++) {
 			if (!t[i])
 				continue;
 			put_u16(id, t[i]);
@@ -2128,7 +2886,7 @@ bool test_u16pool(void)
 
 	// pop too many.
 	bool we_broke = FALSE;
-	for (i = 0; i < id->size * 2; i++) {
+	for (i = 0; i < AMT * 2; i++) {
 		x = get_u16(id);
 		if (x == -1) {
 			we_broke = TRUE;
@@ -2145,11 +2903,11 @@ bool test_u16pool(void)
 		put_u16(id, t[i]);
 		t[i] = 0;
 	}
-	KT_ASSERT_M("Should be empty", id->tos == 0);
+	KT_ASSERT_M("Should be empty", u16_pool_nr_free(id) == AMT);
 
 	printk("Ignore next BAD, testing bad alloc\n");
 	put_u16(id, 25);	// should get an error.
-	for (i = 0; i < id->size; i++) {
+	for (i = 0; i < AMT; i++) {
 		int v = get_u16(id);
 		if (t[v])
 			printd("BAD: %d pops twice!\n", v);
@@ -2158,7 +2916,7 @@ bool test_u16pool(void)
 		//printk("%d,", v);
 	}
 
-	for (i = 1; i < id->size; i++) {
+	for (i = 1; i < AMT; i++) {
 		if (!t[i])
 			printd("BAD: %d was not set\n", i);
 		KT_ASSERT_M("Wasn't set!", t[i]);
@@ -2168,6 +2926,83 @@ bool test_u16pool(void)
 	return FALSE;
 }
 
+#define U32POOL_TEST_SZ		1000
+#define U32POOL_TEST_HELD	8
+
+static struct u32_pool *u32pool_test;
+static atomic_t u32pool_test_errs;
+static int u32pool_test_owner[U32POOL_TEST_SZ];
+
+/* Gets and puts IDs, holding a few at a time, and makes sure no one else has
+ * the ones it got.  The pool is small enough that cores run it dry, so the
+ * steals get some exercise. */
+static void __u32pool_test_core(void *arg)
+{
+	long held[U32POOL_TEST_HELD];
+	int me = core_id() + 1;
+	long v;
+
+	for (int i = 0; i < 10000; i++) {
+		for (int j = 0; j < U32POOL_TEST_HELD; j++) {
+			v = get_u32(u32pool_test);
+			held[j] = v;
+			if (v < 0)
+				continue;
+			if (!__sync_bool_compare_and_swap(&u32pool_test_owner[v], 0,
+			                                  me))
+				atomic_inc(&u32pool_test_errs);
+		}
+		for (int j = 0; j < U32POOL_TEST_HELD; j++) {
+			v = held[j];
+			if (v < 0)
+				continue;
+			if (!__sync_bool_compare_and_swap(&u32pool_test_owner[v], me,
+			                                  0))
+				atomic_inc(&u32pool_test_errs);
+			put_u32(u32pool_test, v);
+		}
+	}
+}
+
+bool test_u32pool(void)
+{
+	struct core_set cset;
+	uint8_t *seen;
+	long v;
+
+	u32pool_test = create_u32_pool(U32POOL_TEST_SZ);
+	KT_ASSERT(u32pool_test);
+	KT_ASSERT_M("40 bit pools are too big", !create_u32_pool(1ULL << 40));
+	atomic_init(&u32pool_test_errs, 0);
+	memset(u32pool_test_owner, 0, sizeof(u32pool_test_owner));
+	KT_ASSERT_M("New pools start at 0", get_u32(u32pool_test) == 0);
+	put_u32(u32pool_test, 0);
+
+	core_set_init(&cset);
+	core_set_fill_available(&cset);
+	smp_do_in_cores(&cset, __u32pool_test_core, NULL);
+	KT_ASSERT_M("Two cores had the same ID",
+	            !atomic_read(&u32pool_test_errs));
+	KT_ASSERT_M("IDs went missing",
+	            u32_pool_nr_free(u32pool_test) == U32POOL_TEST_SZ);
+
+	/* Every ID is still in there somewhere, including other cores' caches */
+	seen = kzmalloc(U32POOL_TEST_SZ, MEM_WAIT);
+	for (int i = 0; i < U32POOL_TEST_SZ; i++) {
+		v = get_u32(u32pool_test);
+		KT_ASSERT_M("Ran out of IDs", v >= 0 && v < U32POOL_TEST_SZ);
+		KT_ASSERT_M("Got an ID twice", !seen[v]);
+		seen[v] = 1;
+	}
+	KT_ASSERT_M("Got too many IDs", get_u32(u32pool_test) == -1);
+	for (int i = 0; i < U32POOL_TEST_SZ; i++)
+		put_u32(u32pool_test, i);
+	KT_ASSERT(u32_pool_nr_free(u32pool_test) == U32POOL_TEST_SZ);
+	kfree(seen);
+	destroy_u32_pool(u32pool_test);
+	return TRUE;
+}
+
 static bool uaccess_mapped(void *addr, char *buf, char *buf2)
 {
 	KT_ASSERT_M(
@@ -2389,6 +3224,47 @@ bool test_cmdline_parse(void)
 	return TRUE;
 }
 
+bool test_bpf(void)
+{
+	ERRSTACK(1);
+	/* ldh [12]; jeq #0x800, keep 20 bytes, else drop */
+	static char *ip_only = "filter 4\n40 0 0 12\n21 0 1 2048\n6 0 0 20\n6 0 0 0";
+	/* ja past the end */
+	static char *bad_jump = "filter 2 5 0 0 1 6 0 0 0";
+	struct netfile f;
+	struct block *bp;
+	bool threw = FALSE;
+
+	memset(&f, 0, sizeof(f));
+	bpf_attach(&f, ip_only, strlen(ip_only));
+	KT_ASSERT_M("Didn't attach the program", f.filter);
+
+	bp = block_alloc(64, MEM_WAIT);
+	memset(bp->wp, 0, 60);
+	bp->wp[12] = 0x08;
+	bp->wp += 60;
+	KT_ASSERT_M("Should keep 20 bytes of IPv4", bpf_run(f.filter, bp) == 20);
+	bp->rp[12] = 0x86;
+	KT_ASSERT_M("Should drop non-IPv4", bpf_run(f.filter, bp) == 0);
+	bp->wp = bp->rp + 13;
+	KT_ASSERT_M("Should drop a short frame", bpf_run(f.filter, bp) == 0);
+	freeb(bp);
+
+	if (waserror()) {
+		poperror();
+		threw = TRUE;
+	} else {
+		bpf_attach(&f, bad_jump, strlen(bad_jump));
+		poperror();
+	}
+	KT_ASSERT_M("Took a jump out of the program", threw);
+	KT_ASSERT_M("Lost the old program", f.filter);
+
+	bpf_detach(&f);
+	KT_ASSERT_M("Didn't detach the program", !f.filter);
+	return TRUE;
+}
+
 static struct ktest ktests[] = {
 #ifdef CONFIG_X86
 	KTEST_REG(ipi_sending,        CONFIG_TEST_ipi_sending),
@@ -2409,8 +3285,21 @@ static struct ktest ktests[] = {
 	KTEST_REG(smp_call_functions, CONFIG_TEST_smp_call_functions),
 	KTEST_REG(slab,               CONFIG_TEST_slab),
 	KTEST_REG(kmalloc,            CONFIG_TEST_kmalloc),
+	KTEST_REG(page_pcp,           CONFIG_TEST_page_pcp),
+	KTEST_REG(page_zero_pool,     CONFIG_TEST_page_zero_pool),
+	KTEST_REG(arena,              CONFIG_TEST_arena),
+	KTEST_REG(memprof,            CONFIG_TEST_memprof),
+	KTEST_REG(tracepoint,         CONFIG_TEST_tracepoint),
+	KTEST_REG(pcpu_counter,       CONFIG_TEST_pcpu_counter),
+	KTEST_REG(workqueue,          CONFIG_TEST_workqueue),
+	KTEST_REG(rcu,                CONFIG_TEST_rcu),
 	KTEST_REG(hashtable,          CONFIG_TEST_hashtable),
+	KTEST_REG(chash,              CONFIG_TEST_chash),
+	KTEST_REG(sha,                CONFIG_TEST_sha),
+	KTEST_REG(chacha20,           CONFIG_TEST_chacha20),
+	KTEST_REG(kpz,                CONFIG_TEST_kpz),
 	KTEST_REG(circular_buffer,    CONFIG_TEST_circular_buffer),
+	KTEST_REG(circular_buffer_mp, CONFIG_TEST_circular_buffer_mp),
 	KTEST_REG(bcq,                CONFIG_TEST_bcq),
 	KTEST_REG(ucq,                CONFIG_TEST_ucq),
 	KTEST_REG(vm_regions,         CONFIG_TEST_vm_regions),
@@ -2418,6 +3307,7 @@ static struct ktest ktests[] = {
 	KTEST_REG(random_fs,          CONFIG_TEST_random_fs),
 	KTEST_REG(kthreads,           CONFIG_TEST_kthreads),
 	KTEST_REG(kref,               CONFIG_TEST_kref),
+	KTEST_REG(kmsg_order,         CONFIG_TEST_kmsg_order),
 	KTEST_REG(atomics,            CONFIG_TEST_atomics),
 	KTEST_REG(abort_halt,         CONFIG_TEST_abort_halt),
 	KTEST_REG(cv,                 CONFIG_TEST_cv),
@@ -2427,11 +3317,14 @@ static struct ktest ktests[] = {
 	KTEST_REG(rwlock,             CONFIG_TEST_rwlock),
 	KTEST_REG(rv,                 CONFIG_TEST_rv),
 	KTEST_REG(alarm,              CONFIG_TEST_alarm),
+	KTEST_REG(alarm_wheel,        CONFIG_TEST_alarm_wheel),
 	KTEST_REG(kmalloc_incref,     CONFIG_TEST_kmalloc_incref),
 	KTEST_REG(u16pool,            CONFIG_TEST_u16pool),
+	KTEST_REG(u32pool,            CONFIG_TEST_u32pool),
 	KTEST_REG(uaccess,            CONFIG_TEST_uaccess),
 	KTEST_REG(sort,               CONFIG_TEST_sort),
 	KTEST_REG(cmdline_parse,      CONFIG_TEST_cmdline_parse),
+	KTEST_REG(bpf,                CONFIG_TEST_bpf),
 };
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
 linker_func_1(register_pb_ktests)
@@ -12,6 +12,10 @@
 #include <smp.h>
 #include <schedule.h>
 #include <kstack.h>
+#include <percpu.h>
+#include <lockprof.h>
+#include <kdebug.h>
+#include <profiler.h>
 #include <arch/uaccess.h>
 
 uintptr_t get_kstack(void)
@@ -59,6 +63,55 @@ struct kthread *__kthread_zalloc(void)
 	return kthread;
 }
 
+/* Each core keeps a few retired kthreads, stacks and all, so that a sem_down()
+ * that blocks doesn't need to allocate and zero a kthread or get a new stack.
+ * Like pcpui->spare, the cache is only used from process or RKM context on its
+ * own core, never from IRQ handlers, so it needs no lock. */
+#define KTHREAD_CACHE_SZ		8
+
+struct kthread_cache {
+	unsigned int				nr;
+	struct kthread				*kths[KTHREAD_CACHE_SZ];
+};
+static DEFINE_PERCPU(struct kthread_cache, kthread_cache);
+
+/* Retires a kthread that is not running, keeping it and its stack around if
+ * there's room. */
+static void put_cached_kthread(struct kthread *kthread)
+{
+	struct kthread_cache *kc = PERCPU_VARPTR(kthread_cache);
+
+	if (kc->nr < KTHREAD_CACHE_SZ) {
+		kc->kths[kc->nr++] = kthread;
+		return;
+	}
+	put_kstack(kthread->stacktop);
+	kmem_cache_free(kthread_kcache, kthread);
+}
+
+/* Returns a kthread with a stack, ready to take over the core.  Cached kthreads
+ * were the spare at some point, so they only need the same fields reset. */
+static struct kthread *get_cached_kthread(void)
+{
+	struct kthread_cache *kc = PERCPU_VARPTR(kthread_cache);
+	struct kthread *kthread;
+
+	if (kc->nr) {
+		kthread = kc->kths[--kc->nr];
+		kthread->flags = KTH_DEFAULT_FLAGS;
+		kthread->proc = 0;
+		kthread->name = 0;
+		return kthread;
+	}
+	kthread = __kthread_zalloc();
+	kthread->flags = KTH_DEFAULT_FLAGS;
+	kthread->stacktop = get_kstack();
+#ifdef CONFIG_KTHREAD_POISON
+	*kstack_bottom_addr(kthread->stacktop) = 0;
+#endif /* CONFIG_KTHREAD_POISON */
+	return kthread;
+}
+
 /* Starts kthread on the calling core.  This does not return, and will handle
  * the details of cleaning up whatever is currently running (freeing its stack,
  * etc).  Pairs with sem_down(). */
@@ -70,14 +123,12 @@ void restart_kthread(struct kthread *kthread)
 	/* Avoid messy complications.  The kthread will enable_irqsave() when it
 	 * comes back up. */
 	disable_irq();
-	/* Free any spare, since we need the current to become the spare.  Without
-	 * the spare, we can't free our current kthread/stack (we could free the
-	 * kthread, but not the stack, since we're still on it).  And we can't free
-	 * anything after popping kthread, since we never return. */
-	if (pcpui->spare) {
-		put_kstack(pcpui->spare->stacktop);
-		kmem_cache_free(kthread_kcache, pcpui->spare);
-	}
+	/* Retire any spare, since we need the current to become the spare.
+	 * Without the spare, we can't free our current kthread/stack (we could free
+	 * the kthread, but not the stack, since we're still on it).  And we can't
+	 * free anything after popping kthread, since we never return. */
+	if (pcpui->spare)
+		put_cached_kthread(pcpui->spare);
 	current_kthread = pcpui->cur_kthread;
 	current_stacktop = current_kthread->stacktop;
 	assert(!current_kthread->sysc);	/* catch bugs, prev user should clear */
@@ -105,7 +156,7 @@ void restart_kthread(struct kthread *kthread)
 			kthread->proc = 0;
 		} else {
 			/* Load our page tables before potentially decreffing cur_proc */
-			lcr3(kthread->proc->env_cr3);
+			proc_load_pgdir(kthread->proc);
 			/* Might have to clear out an existing current.  If they need to be
 			 * set later (like in restartcore), it'll be done on demand. */
 			if (pcpui->cur_proc)
@@ -189,11 +240,12 @@ void kthread_yield(void)
 	sem_down(sem);
 }
 
-void kthread_usleep(uint64_t usec)
+/* Sleeps for usec, or up to slack_usec longer, if that lets the alarm share an
+ * interrupt. */
+void kthread_usleep_slack(uint64_t usec, uint64_t slack_usec)
 {
 	ERRSTACK(1);
 	/* TODO: classic ksched issue: where do we want the wake up to happen? */
-	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
 	struct rendez rv;
 
 	int ret_zero(void *ignored)
@@ -204,11 +256,16 @@ void kthread_usleep(uint64_t usec)
 	/* "discard the error" style (we run the conditional code) */
 	if (!waserror()) {
 		rendez_init(&rv);
-		rendez_sleep_timeout(&rv, ret_zero, 0, usec);
+		rendez_sleep_timeout_slack(&rv, ret_zero, 0, usec, slack_usec);
 	}
 	poperror();
 }
 
+void kthread_usleep(uint64_t usec)
+{
+	kthread_usleep_slack(usec, 0);
+}
+
 static void __ktask_wrapper(uint32_t srcid, long a0, long a1, long a2)
 {
 	ERRSTACK(1);
@@ -266,6 +323,12 @@ static void sem_init_common(struct semaphore *sem, int signals)
 {
 	TAILQ_INIT(&sem->waiters);
 	sem->nr_signals = signals;
+	sem->adaptive = FALSE;
+	sem->owner = 0;
+	sem->spin_avg = 0;
+#ifdef CONFIG_LOCK_PROFILE
+	sem->lp_tsc = 0;
+#endif
 #ifdef CONFIG_SEMAPHORE_DEBUG
 	sem->is_on_list = FALSE;
 #endif
@@ -285,6 +348,54 @@ void sem_init_irqsave(struct semaphore *sem, int signals)
 	sem->irq_okay = TRUE;
 }
 
+/* Adaptive sems are binary (qlocks), so that whoever downed it is the owner */
+void sem_init_adaptive(struct semaphore *sem, int signals)
+{
+	sem_init(sem, signals);
+	sem->adaptive = TRUE;
+}
+
+#ifdef CONFIG_LOCK_PROFILE
+/* Call after downing sem.  Only qlocks have holders, the rest are signals. */
+static void lockprof_sem_down(struct semaphore *sem, uintptr_t site,
+                              bool contended, uint64_t start)
+{
+	uint64_t now;
+
+	if (likely(!lockprof_enabled) || !start)
+		return;
+	now = read_tsc();
+	__lockprof_acquired(sem, site, LOCKPROF_SEM, contended, now - start);
+	if (sem->adaptive) {
+		sem->lp_site = site;
+		sem->lp_tsc = now;
+	}
+}
+
+/* Call before upping sem, which could be freed right after. */
+static void lockprof_sem_up(struct semaphore *sem)
+{
+	if (!sem->lp_tsc)
+		return;
+	if (lockprof_enabled)
+		__lockprof_released(sem, sem->lp_site, LOCKPROF_SEM,
+		                    read_tsc() - sem->lp_tsc);
+	sem->lp_tsc = 0;
+}
+#endif /* CONFIG_LOCK_PROFILE */
+
+/* Call after downing sem, from the kthread that downed it. */
+static void sem_set_owner(struct semaphore *sem)
+{
+#ifdef CONFIG_SEM_ADAPTIVE
+	if (sem->adaptive) {
+		sem->owner_core = core_id();
+		wmb();	/* spinners check the core once they see the owner */
+		sem->owner = per_cpu_info[core_id()].cur_kthread;
+	}
+#endif
+}
+
 bool sem_trydown(struct semaphore *sem)
 {
 	bool ret = FALSE;
@@ -297,12 +408,44 @@ bool sem_trydown(struct semaphore *sem)
 		sem->nr_signals--;
 		ret = TRUE;
 		debug_downed_sem(sem);
+		sem_set_owner(sem);
 	}
 	spin_unlock(&sem->lock);
 	debug_unlock_semlist();
 	return ret;
 }
 
+#ifdef CONFIG_SEM_ADAPTIVE
+/* Polls an adaptive sem for as long as its owner is running on another core,
+ * up to a bit more than it usually takes to get the sem.  A blocked owner is no
+ * longer its core's cur_kthread.  Returns TRUE if we downed the sem.
+ *
+ * The spin_avg update is racy, but it's just a hint. */
+static bool sem_adaptive_spin(struct semaphore *sem)
+{
+	int max_spins = MIN(CONFIG_SEM_ADAPTIVE_MAX_SPINS,
+	                    ACCESS_ONCE(sem->spin_avg) * 2 + 16);
+	struct kthread *owner;
+
+	for (int i = 0; i < max_spins; i++) {
+		if (sem_trydown(sem)) {
+			sem->spin_avg += (i - sem->spin_avg) / 8;
+			return TRUE;
+		}
+		owner = ACCESS_ONCE(sem->owner);
+		/* No owner could be a racing down or a handoff to a waiter.  Either
+		 * way, someone should have it soon. */
+		if (owner && (ACCESS_ONCE(per_cpu_info[sem->owner_core].cur_kthread)
+		              != owner))
+			return FALSE;
+		cpu_relax();
+	}
+	/* Spinning didn't pay off this time; drift towards spinning less */
+	sem->spin_avg -= sem->spin_avg / 8;
+	return FALSE;
+}
+#endif /* CONFIG_SEM_ADAPTIVE */
+
 /* Helper, pushes the sem pointer on the top of the stack, returning the stack
  * pointer to use. */
 static uintptr_t push_sem_ptr(uintptr_t stack_top, struct semaphore *sem)
@@ -345,6 +488,11 @@ void sem_down(struct semaphore *sem)
 	register uintptr_t new_stacktop;
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	bool irqs_were_on = irq_is_enabled();
+#ifdef CONFIG_LOCK_PROFILE
+	uintptr_t lp_site = get_caller_pc();
+	uint64_t lp_start = lockprof_enabled ? read_tsc() : 0;
+	bool lp_contended = FALSE;
+#endif
 
 	assert(can_block(pcpui));
 	/* Make sure we aren't holding any locks (only works if SPINLOCK_DEBUG) */
@@ -362,12 +510,20 @@ void sem_down(struct semaphore *sem)
 #else
 	if (sem_trydown(sem))
 		goto block_return_path;
+#endif
+#ifdef CONFIG_LOCK_PROFILE
+	lp_contended = TRUE;
+#endif
+#ifdef CONFIG_SEM_ADAPTIVE
+	if (sem->adaptive && sem_adaptive_spin(sem))
+		goto block_return_path;
 #endif
 	/* We're probably going to sleep, so get ready.  We'll check again later. */
 	kthread = pcpui->cur_kthread;
 	/* We need to have a spare slot for restart, so we also use it when
 	 * sleeping.  Right now, we need a new kthread to take over if/when our
-	 * current kthread sleeps.  Use the spare, and if not, get a new one.
+	 * current kthread sleeps.  Use the spare, and if not, get one from the
+	 * core's cache, and only allocate if that is empty too.
 	 *
 	 * Note we do this with interrupts disabled (which protects us from
 	 * concurrent modifications). */
@@ -383,13 +539,8 @@ void sem_down(struct semaphore *sem)
 		new_kthread->proc = 0;
 		new_kthread->name = 0;
 	} else {
-		new_kthread = __kthread_zalloc();
-		new_kthread->flags = KTH_DEFAULT_FLAGS;
-		new_stacktop = get_kstack();
-		new_kthread->stacktop = new_stacktop;
-#ifdef CONFIG_KTHREAD_POISON
-		*kstack_bottom_addr(new_stacktop) = 0;
-#endif /* CONFIG_KTHREAD_POISON */
+		new_kthread = get_cached_kthread();
+		new_stacktop = new_kthread->stacktop;
 	}
 	/* Set the core's new default stack and kthread */
 	set_stack_top(new_stacktop);
@@ -423,8 +574,23 @@ void sem_down(struct semaphore *sem)
 	} else {
 		assert(kthread->proc == 0);
 	}
-	if (setjmp(&kthread->context))
+	/* We only find out we slept once we're restarted, so we note where we are
+	 * now, in case we do. */
+	if (profiler_offcpu_tracing) {
+		kthread->offcpu_nr_pcs = backtrace_list(read_pc(), read_bp(),
+		                                        kthread->offcpu_pcs,
+		                                        KTH_OFFCPU_MAX_PCS);
+		kthread->offcpu_start = nsec();
+	}
+	if (setjmp(&kthread->context)) {
+		if (kthread->offcpu_nr_pcs) {
+			profiler_push_offcpu_backtrace(kthread->offcpu_pcs,
+			                               kthread->offcpu_nr_pcs,
+			                               kthread->offcpu_start);
+			kthread->offcpu_nr_pcs = 0;
+		}
 		goto block_return_path;
+	}
 	debug_lock_semlist();
 	spin_lock(&sem->lock);
 	if (sem->nr_signals-- <= 0) {
@@ -449,6 +615,7 @@ void sem_down(struct semaphore *sem)
 	spin_unlock(&sem->lock);
 	debug_unlock_semlist();
 	printd("[kernel] Didn't sleep, unwinding...\n");
+	kthread->offcpu_nr_pcs = 0;
 	/* Restore the core's current and default stacktop */
 	if (kthread->flags & KTH_SAVE_ADDR_SPACE) {
 		proc_decref(kthread->proc);
@@ -466,6 +633,11 @@ void sem_down(struct semaphore *sem)
 #endif /* CONFIG_KTHREAD_POISON */
 block_return_path:
 	printd("[kernel] Returning from being 'blocked'! at %llu\n", read_tsc());
+	/* We hold it now, whether we slept or not (a trydown already set it) */
+	sem_set_owner(sem);
+#ifdef CONFIG_LOCK_PROFILE
+	lockprof_sem_down(sem, lp_site, lp_contended, lp_start);
+#endif
 	/* restart_kthread and longjmp did not reenable IRQs.  We need to make sure
 	 * irqs are on if they were on when we started to block.  If they were
 	 * already on and we short-circuited the block, it's harmless to reenable
@@ -483,8 +655,13 @@ bool sem_up(struct semaphore *sem)
 {
 	struct kthread *kthread = 0;
 
+#ifdef CONFIG_LOCK_PROFILE
+	lockprof_sem_up(sem);
+#endif
 	debug_lock_semlist();
 	spin_lock(&sem->lock);
+	if (sem->adaptive)
+		sem->owner = 0;
 	if (sem->nr_signals++ < 0) {
 		assert(!TAILQ_EMPTY(&sem->waiters));
 		/* could do something with 'priority' here */
@@ -0,0 +1,284 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Lock contention profiling.  See lockprof.h.
+ *
+ * Each core has an open-addressed table of (lock, site) entries, allocated on
+ * the first start so the hooks never allocate.  The hooks run inside
+ * spin_lock(), so they take no locks: IRQs off keeps a core's table to itself.
+ * When a table fills up, we drop the event and count it.  Readers look at the
+ * tables without stopping anyone, so a report taken while running may be a
+ * little behind. */
+
+#include <lockprof.h>
+#include <kdebug.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <percpu.h>
+#include <atomic.h>
+#include <sort.h>
+#include <smp.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define LOCKPROF_HASH_SZ		1024	/* power of two, per core */
+#define LOCKPROF_MAX_PROBES		16
+#define LOCKPROF_PRINT_ENTRIES	32
+#define LOCKPROF_LINE_SZ		160
+
+struct lockprof_entry {
+	uintptr_t					lock;
+	uintptr_t					site;
+	int							type;
+	uint64_t					nr_acquires;
+	uint64_t					nr_contended;
+	uint64_t					wait_cycles;
+	uint64_t					hold_cycles;
+};
+
+struct lockprof_pcpu {
+	struct lockprof_entry		*table;
+	unsigned long				nr_dropped;
+};
+
+bool lockprof_enabled;
+static qlock_t lockprof_mtx = QLOCK_INITIALIZER(lockprof_mtx);
+static DEFINE_PERCPU(struct lockprof_pcpu, lockprof_pcpu);
+
+static unsigned long hash_lock_site(uintptr_t lock, uintptr_t site)
+{
+	return ((lock >> 3) ^ (site * 31)) & (LOCKPROF_HASH_SZ - 1);
+}
+
+/* Call with IRQs disabled.  Returns 0 if the table is full around our slot. */
+static struct lockprof_entry *get_entry(struct lockprof_pcpu *lpc,
+                                        uintptr_t lock, uintptr_t site,
+                                        int type)
+{
+	unsigned long idx = hash_lock_site(lock, site);
+	struct lockprof_entry *e;
+
+	for (int i = 0; i < LOCKPROF_MAX_PROBES; i++) {
+		e = &lpc->table[(idx + i) & (LOCKPROF_HASH_SZ - 1)];
+		if ((e->lock == lock) && (e->site == site))
+			return e;
+		if (!e->lock) {
+			e->lock = lock;
+			e->site = site;
+			e->type = type;
+			return e;
+		}
+	}
+	return 0;
+}
+
+void __lockprof_acquired(void *lock, uintptr_t site, int type, bool contended,
+                         uint64_t wait_cycles)
+{
+	struct lockprof_pcpu *lpc;
+	struct lockprof_entry *e;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	lpc = _PERCPU_VARPTR(lockprof_pcpu, core_id());
+	if (!lpc->table)
+		goto out;
+	e = get_entry(lpc, (uintptr_t)lock, site, type);
+	if (!e) {
+		lpc->nr_dropped++;
+		goto out;
+	}
+	e->nr_acquires++;
+	if (contended) {
+		e->nr_contended++;
+		e->wait_cycles += wait_cycles;
+	}
+out:
+	enable_irqsave(&irq_state);
+}
+
+void __lockprof_released(void *lock, uintptr_t site, int type,
+                         uint64_t hold_cycles)
+{
+	struct lockprof_pcpu *lpc;
+	struct lockprof_entry *e;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	lpc = _PERCPU_VARPTR(lockprof_pcpu, core_id());
+	if (!lpc->table)
+		goto out;
+	e = get_entry(lpc, (uintptr_t)lock, site, type);
+	if (!e) {
+		lpc->nr_dropped++;
+		goto out;
+	}
+	e->hold_cycles += hold_cycles;
+out:
+	enable_irqsave(&irq_state);
+}
+
+/* Starts a new profile, discarding any previous one.  Returns -1 if the kernel
+ * wasn't built with CONFIG_LOCK_PROFILE. */
+int lockprof_start(void)
+{
+	struct lockprof_pcpu *lpc;
+	size_t tblsz = LOCKPROF_HASH_SZ * sizeof(struct lockprof_entry);
+
+#ifndef CONFIG_LOCK_PROFILE
+	return -1;
+#endif
+	qlock(&lockprof_mtx);
+	lockprof_enabled = FALSE;
+	wmb();
+	for (int i = 0; i < num_cores; i++) {
+		lpc = _PERCPU_VARPTR(lockprof_pcpu, i);
+		if (!lpc->table)
+			lpc->table = kmalloc(tblsz, MEM_WAIT);
+		memset(lpc->table, 0, tblsz);
+		lpc->nr_dropped = 0;
+	}
+	wmb();
+	lockprof_enabled = TRUE;
+	qunlock(&lockprof_mtx);
+	return 0;
+}
+
+/* Stops recording.  The tables stay around for the report.  Locks held across
+ * the stop don't count their hold. */
+void lockprof_stop(void)
+{
+	qlock(&lockprof_mtx);
+	lockprof_enabled = FALSE;
+	qunlock(&lockprof_mtx);
+}
+
+static int entry_cmp_key(const void *a, const void *b)
+{
+	const struct lockprof_entry *ea = a, *eb = b;
+
+	if (ea->lock != eb->lock)
+		return ea->lock < eb->lock ? -1 : 1;
+	return ea->site < eb->site ? -1 : ea->site > eb->site ? 1 : 0;
+}
+
+static int entry_cmp_wait(const void *a, const void *b)
+{
+	const struct lockprof_entry *ea = a, *eb = b;
+
+	if (ea->wait_cycles != eb->wait_cycles)
+		return ea->wait_cycles < eb->wait_cycles ? 1 : -1;
+	return ea->nr_acquires < eb->nr_acquires ? 1 :
+	       ea->nr_acquires > eb->nr_acquires ? -1 : 0;
+}
+
+/* Returns a kmalloc'd array of every core's entries, merged by (lock, site) and
+ * sorted by wait time, biggest first.  Call with lockprof_mtx held. */
+static struct lockprof_entry *get_merged_entries(size_t *nr,
+                                                 unsigned long *nr_dropped)
+{
+	struct lockprof_entry *arr, *e, *m;
+	struct lockprof_pcpu *lpc;
+	size_t n = 0, nr_merged = 0;
+
+	*nr_dropped = 0;
+	arr = kmalloc(MAX(num_cores * LOCKPROF_HASH_SZ, 1) *
+	              sizeof(struct lockprof_entry), MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		lpc = _PERCPU_VARPTR(lockprof_pcpu, i);
+		*nr_dropped += ACCESS_ONCE(lpc->nr_dropped);
+		if (!lpc->table)
+			continue;
+		for (int j = 0; j < LOCKPROF_HASH_SZ; j++) {
+			e = &lpc->table[j];
+			if (ACCESS_ONCE(e->lock))
+				arr[n++] = *e;
+		}
+	}
+	/* Sort by key, so each lock and site's entries are next to each other */
+	sort(arr, n, sizeof(struct lockprof_entry), entry_cmp_key);
+	for (e = arr; e < arr + n; e++) {
+		m = nr_merged ? &arr[nr_merged - 1] : NULL;
+		if (m && !entry_cmp_key(m, e)) {
+			m->nr_acquires += e->nr_acquires;
+			m->nr_contended += e->nr_contended;
+			m->wait_cycles += e->wait_cycles;
+			m->hold_cycles += e->hold_cycles;
+		} else {
+			arr[nr_merged++] = *e;
+		}
+	}
+	sort(arr, nr_merged, sizeof(struct lockprof_entry), entry_cmp_wait);
+	*nr = nr_merged;
+	return arr;
+}
+
+/* Lines are at most LOCKPROF_LINE_SZ - 1 chars; long names get cut off. */
+static int snprint_entry(char *buf, size_t bufsz, struct lockprof_entry *e)
+{
+	static const char * const type_names[LOCKPROF_NR_TYPES] = {
+		"spin", "sem"
+	};
+	char *fn_name = get_fn_name(e->site);
+	int ret;
+
+	ret = snprintf(buf, bufsz,
+	               "%-4s %p %p %-24s %10llu %10llu %14llu %14llu\n",
+	               type_names[e->type], (void*)e->lock, (void*)e->site,
+	               fn_name ? fn_name : "?", e->nr_acquires, e->nr_contended,
+	               e->wait_cycles, e->hold_cycles);
+	kfree(fn_name);
+	return MIN(ret, bufsz - 1);
+}
+
+static const char lockprof_header[] =
+	"type lock               site               function                   "
+	"  acquires  contended    wait cycles    hold cycles\n";
+
+/* Returns a kmalloc'd text report of every (lock, site), most wait first. */
+char *lockprof_report(size_t *len)
+{
+	struct lockprof_entry *arr;
+	unsigned long nr_dropped;
+	size_t nr, bufsz, off = 0;
+	char *buf;
+
+	qlock(&lockprof_mtx);
+	arr = get_merged_entries(&nr, &nr_dropped);
+	bufsz = sizeof(lockprof_header) + LOCKPROF_LINE_SZ * (nr + 1);
+	buf = kmalloc(bufsz, MEM_WAIT);
+	off += snprintf(buf + off, bufsz - off, "Lockprof: %s, %lu dropped\n",
+	                lockprof_enabled ? "on" : "off", nr_dropped);
+	off += snprintf(buf + off, bufsz - off, "%s", lockprof_header);
+	for (int i = 0; i < nr; i++)
+		off += snprint_entry(buf + off, LOCKPROF_LINE_SZ, &arr[i]);
+	qunlock(&lockprof_mtx);
+	kfree(arr);
+	*len = off;
+	return buf;
+}
+
+void print_lockprof_report(void)
+{
+	struct lockprof_entry *arr;
+	unsigned long nr_dropped;
+	size_t nr;
+	char line[LOCKPROF_LINE_SZ];
+
+#ifndef CONFIG_LOCK_PROFILE
+	printk("Lockprof needs CONFIG_LOCK_PROFILE\n");
+	return;
+#endif
+	qlock(&lockprof_mtx);
+	arr = get_merged_entries(&nr, &nr_dropped);
+	printk("Lockprof: %s, %lu entries, %lu dropped\n",
+	       lockprof_enabled ? "on" : "off", nr, nr_dropped);
+	printk("%s", lockprof_header);
+	for (int i = 0; i < MIN(nr, LOCKPROF_PRINT_ENTRIES); i++) {
+		snprint_entry(line, sizeof(line), &arr[i]);
+		printk("%s", line);
+	}
+	qunlock(&lockprof_mtx);
+	kfree(arr);
+}
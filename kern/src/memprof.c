@@ -0,0 +1,360 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Allocation-site profiling.  See memprof.h.
+ *
+ * Each core counts down its allocations and samples every memprof_rate'th one.
+ * A sample's backtrace picks (or creates) a site, and the object is remembered
+ * in a hash by address, so that its free can find the site again.  Sites and
+ * objects come from fixed pools, allocated on the first start, so the hooks
+ * never call back into the allocators.  When a pool runs dry, we drop the
+ * sample and count it.
+ *
+ * Slab pages come from kpage_alloc(), so a cache's growth shows up as page
+ * sites (with the slab grow path in the backtrace), in addition to the slab
+ * sites of its objects.  kmalloc's own caches are not traced by the slab hook,
+ * so kmalloc'd objects are only counted once. */
+
+#include <memprof.h>
+#include <profiler.h>
+#include <kdebug.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <percpu.h>
+#include <atomic.h>
+#include <sort.h>
+#include <smp.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define MEMPROF_MAX_PCS			16
+#define MEMPROF_NR_SITES		2048
+#define MEMPROF_SITE_HASH_SZ	1024
+#define MEMPROF_NR_OBJS			32768
+#define MEMPROF_OBJ_HASH_SZ		4096
+#define MEMPROF_DEFAULT_RATE	64
+#define MEMPROF_PRINT_SITES		32
+
+struct memprof_site {
+	struct memprof_site			*next;
+	int							type;
+	size_t						nr_pcs;
+	uintptr_t					pcs[MEMPROF_MAX_PCS];
+	atomic_t					live_bytes;
+	atomic_t					live_objs;
+	atomic_t					nr_allocs;
+};
+
+struct memprof_obj {
+	struct memprof_obj			*next;
+	void						*addr;
+	size_t						size;
+	struct memprof_site			*site;
+};
+
+struct memprof_obj_bucket {
+	spinlock_t					lock;
+	struct memprof_obj			*head;
+};
+
+struct memprof_pcpu {
+	unsigned int				countdown;
+	uintptr_t					pcs[MEMPROF_MAX_PCS];
+};
+
+bool memprof_enabled;
+static unsigned int memprof_rate = MEMPROF_DEFAULT_RATE;
+static qlock_t memprof_mtx = QLOCK_INITIALIZER(memprof_mtx);
+static DEFINE_PERCPU(struct memprof_pcpu, memprof_pcpu);
+
+/* Sites are only ever added, under site_lock, until the next reset. */
+static spinlock_t site_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static struct memprof_site *sites;
+static struct memprof_site **site_hash;
+static size_t nr_sites;
+
+static spinlock_t obj_free_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static struct memprof_obj *objs;
+static struct memprof_obj *obj_free_list;
+static struct memprof_obj_bucket *obj_hash;
+
+static atomic_t nr_dropped;
+
+static unsigned long hash_pcs(uintptr_t *pcs, size_t nr_pcs)
+{
+	unsigned long hash = nr_pcs;
+
+	for (int i = 0; i < nr_pcs; i++)
+		hash = hash * 31 + (pcs[i] >> 2);
+	return hash;
+}
+
+static struct memprof_obj_bucket *obj_bucket_of(void *addr)
+{
+	return &obj_hash[((uintptr_t)addr >> 4) % MEMPROF_OBJ_HASH_SZ];
+}
+
+static struct memprof_site *find_site(uintptr_t *pcs, size_t nr_pcs, int type)
+{
+	struct memprof_site **bucket, *site;
+
+	bucket = &site_hash[hash_pcs(pcs, nr_pcs) % MEMPROF_SITE_HASH_SZ];
+	spin_lock_irqsave(&site_lock);
+	for (site = *bucket; site; site = site->next) {
+		if ((site->type == type) && (site->nr_pcs == nr_pcs) &&
+		    !memcmp(site->pcs, pcs, nr_pcs * sizeof(uintptr_t)))
+			break;
+	}
+	if (!site && (nr_sites < MEMPROF_NR_SITES)) {
+		site = &sites[nr_sites++];
+		site->type = type;
+		site->nr_pcs = nr_pcs;
+		memcpy(site->pcs, pcs, nr_pcs * sizeof(uintptr_t));
+		site->next = *bucket;
+		*bucket = site;
+	}
+	spin_unlock_irqsave(&site_lock);
+	return site;
+}
+
+static struct memprof_obj *get_obj(void)
+{
+	struct memprof_obj *obj;
+
+	spin_lock_irqsave(&obj_free_lock);
+	obj = obj_free_list;
+	if (obj)
+		obj_free_list = obj->next;
+	spin_unlock_irqsave(&obj_free_lock);
+	return obj;
+}
+
+static void put_obj(struct memprof_obj *obj)
+{
+	spin_lock_irqsave(&obj_free_lock);
+	obj->next = obj_free_list;
+	obj_free_list = obj;
+	spin_unlock_irqsave(&obj_free_lock);
+}
+
+void __memprof_alloc(void *addr, size_t size, int type)
+{
+	struct memprof_pcpu *mpc;
+	struct memprof_site *site;
+	struct memprof_obj *obj;
+	struct memprof_obj_bucket *bkt;
+	size_t nr_pcs;
+	int8_t irq_state = 0;
+
+	if (!addr)
+		return;
+	/* IRQs off protects our pcpu scratch space, and keeps us on this core */
+	disable_irqsave(&irq_state);
+	mpc = _PERCPU_VARPTR(memprof_pcpu, core_id());
+	if (--mpc->countdown) {
+		enable_irqsave(&irq_state);
+		return;
+	}
+	mpc->countdown = memprof_rate;
+	nr_pcs = backtrace_list(read_pc(), read_bp(), mpc->pcs, MEMPROF_MAX_PCS);
+	site = find_site(mpc->pcs, nr_pcs, type);
+	obj = site ? get_obj() : NULL;
+	if (!obj) {
+		atomic_inc(&nr_dropped);
+		enable_irqsave(&irq_state);
+		return;
+	}
+	obj->addr = addr;
+	obj->size = size;
+	obj->site = site;
+	atomic_add(&site->live_bytes, size);
+	atomic_inc(&site->live_objs);
+	atomic_inc(&site->nr_allocs);
+	bkt = obj_bucket_of(addr);
+	spin_lock(&bkt->lock);
+	obj->next = bkt->head;
+	bkt->head = obj;
+	spin_unlock(&bkt->lock);
+	enable_irqsave(&irq_state);
+}
+
+void __memprof_free(void *addr)
+{
+	struct memprof_obj_bucket *bkt;
+	struct memprof_obj *obj, **pp;
+
+	if (!addr)
+		return;
+	bkt = obj_bucket_of(addr);
+	spin_lock_irqsave(&bkt->lock);
+	for (pp = &bkt->head; (obj = *pp); pp = &obj->next) {
+		if (obj->addr == addr) {
+			*pp = obj->next;
+			break;
+		}
+	}
+	spin_unlock_irqsave(&bkt->lock);
+	if (!obj)
+		return;
+	atomic_add(&obj->site->live_bytes, -(long)obj->size);
+	atomic_dec(&obj->site->live_objs);
+	put_obj(obj);
+}
+
+/* Clears all sites and objects.  Call with memprof_mtx held and profiling off.
+ * A core that saw memprof_enabled just before it was cleared could still be in
+ * a hook; at worst, its object ends up in the new run. */
+static void memprof_reset(void)
+{
+	for (int i = 0; i < MEMPROF_OBJ_HASH_SZ; i++) {
+		spin_lock_irqsave(&obj_hash[i].lock);
+		obj_hash[i].head = NULL;
+		spin_unlock_irqsave(&obj_hash[i].lock);
+	}
+	spin_lock_irqsave(&obj_free_lock);
+	obj_free_list = NULL;
+	for (int i = MEMPROF_NR_OBJS - 1; i >= 0; i--) {
+		objs[i].next = obj_free_list;
+		obj_free_list = &objs[i];
+	}
+	spin_unlock_irqsave(&obj_free_lock);
+	spin_lock_irqsave(&site_lock);
+	memset(sites, 0, MEMPROF_NR_SITES * sizeof(struct memprof_site));
+	memset(site_hash, 0, MEMPROF_SITE_HASH_SZ * sizeof(struct memprof_site *));
+	nr_sites = 0;
+	spin_unlock_irqsave(&site_lock);
+	atomic_set(&nr_dropped, 0);
+}
+
+/* Starts a new profile, sampling one in every rate allocations per core.  A
+ * rate of 0 keeps the previous rate.  Any previous profile is discarded. */
+void memprof_start(unsigned int rate)
+{
+	qlock(&memprof_mtx);
+	if (memprof_enabled) {
+		memprof_enabled = FALSE;
+		wmb();
+	}
+	if (!sites) {
+		sites = kmalloc(MEMPROF_NR_SITES * sizeof(struct memprof_site),
+		                MEM_WAIT);
+		site_hash = kmalloc(MEMPROF_SITE_HASH_SZ *
+		                    sizeof(struct memprof_site *), MEM_WAIT);
+		objs = kmalloc(MEMPROF_NR_OBJS * sizeof(struct memprof_obj), MEM_WAIT);
+		obj_hash = kzmalloc(MEMPROF_OBJ_HASH_SZ *
+		                    sizeof(struct memprof_obj_bucket), MEM_WAIT);
+		for (int i = 0; i < MEMPROF_OBJ_HASH_SZ; i++)
+			spinlock_init_irqsave(&obj_hash[i].lock);
+	}
+	memprof_reset();
+	if (rate)
+		memprof_rate = rate;
+	for (int i = 0; i < num_cores; i++)
+		_PERCPU_VARPTR(memprof_pcpu, i)->countdown = memprof_rate;
+	wmb();
+	memprof_enabled = TRUE;
+	qunlock(&memprof_mtx);
+}
+
+/* Stops sampling.  The profile is frozen: frees from here on are not subtracted,
+ * so the report is of what was live at the time of the stop. */
+void memprof_stop(void)
+{
+	qlock(&memprof_mtx);
+	memprof_enabled = FALSE;
+	qunlock(&memprof_mtx);
+}
+
+static int site_cmp_live(const void *a, const void *b)
+{
+	long la = atomic_read(&(*(struct memprof_site **)a)->live_bytes);
+	long lb = atomic_read(&(*(struct memprof_site **)b)->live_bytes);
+
+	return la < lb ? 1 : la > lb ? -1 : 0;
+}
+
+/* Returns a kmalloc'd array of the sites with live bytes, biggest first.  The
+ * sites themselves are only valid until the next start. */
+static struct memprof_site **get_sorted_sites(size_t *nr)
+{
+	struct memprof_site **arr;
+	size_t n = 0, max;
+
+	spin_lock_irqsave(&site_lock);
+	max = nr_sites;
+	spin_unlock_irqsave(&site_lock);
+	arr = kmalloc(MAX(max, 1) * sizeof(struct memprof_site *), MEM_WAIT);
+	for (int i = 0; i < max; i++) {
+		if (atomic_read(&sites[i].live_bytes) > 0)
+			arr[n++] = &sites[i];
+	}
+	sort(arr, n, sizeof(struct memprof_site *), site_cmp_live);
+	*nr = n;
+	return arr;
+}
+
+/* Returns a kmalloc'd buffer of PROFTYPE_KERN_TRACE64 records, one per site
+ * with live bytes, biggest first.  Each record's info is the site's estimated
+ * live bytes, i.e. its sampled bytes times the sampling rate, and its cpu is
+ * the MEMPROF_ type. */
+char *memprof_report(size_t *len)
+{
+	struct memprof_site **arr;
+	size_t nr = 0, bufsz;
+	char *buf, *ptr;
+
+	qlock(&memprof_mtx);
+	if (!sites) {
+		qunlock(&memprof_mtx);
+		*len = 0;
+		return NULL;
+	}
+	arr = get_sorted_sites(&nr);
+	bufsz = MAX(nr * profiler_kernel_trace64_size(MEMPROF_MAX_PCS), 1);
+	buf = kmalloc(bufsz, MEM_WAIT);
+	ptr = buf;
+	for (int i = 0; i < nr; i++)
+		ptr = profiler_encode_kernel_trace64(ptr, arr[i]->pcs, arr[i]->nr_pcs,
+		                   atomic_read(&arr[i]->live_bytes) * memprof_rate,
+		                   -1, arr[i]->type);
+	qunlock(&memprof_mtx);
+	kfree(arr);
+	*len = ptr - buf;
+	return buf;
+}
+
+static void printk_func(void *opaque, const char *str)
+{
+	printk("%s", str);
+}
+
+void print_memprof_report(void)
+{
+	static const char * const type_names[MEMPROF_NR_TYPES] = {
+		"kmalloc", "slab", "page"
+	};
+	struct memprof_site **arr;
+	size_t nr;
+
+	qlock(&memprof_mtx);
+	if (!sites) {
+		qunlock(&memprof_mtx);
+		printk("Memprof was never started\n");
+		return;
+	}
+	arr = get_sorted_sites(&nr);
+	printk("Memprof: %s, rate 1/%u, %lu sites, %ld dropped samples\n",
+	       memprof_enabled ? "on" : "off", memprof_rate, nr_sites,
+	       atomic_read(&nr_dropped));
+	for (int i = 0; i < MIN(nr, MEMPROF_PRINT_SITES); i++) {
+		printk("%s: ~%ld bytes live in ~%ld objs (%ld allocs sampled)\n",
+		       type_names[arr[i]->type],
+		       atomic_read(&arr[i]->live_bytes) * memprof_rate,
+		       atomic_read(&arr[i]->live_objs) * memprof_rate,
+		       atomic_read(&arr[i]->nr_allocs));
+		print_backtrace_list(arr[i]->pcs, arr[i]->nr_pcs, printk_func, NULL);
+	}
+	qunlock(&memprof_mtx);
+	kfree(arr);
+}
@@ -22,12 +22,35 @@
 #include <syscall.h>
 #include <slab.h>
 #include <kmalloc.h>
+#include <arena.h>
 #include <vfs.h>
 #include <smp.h>
+#include <schedule.h>
+#include <workqueue.h>
+#include <trap.h>
 #include <profiler.h>
+#include <tracepoint.h>
+#include <pcpu_counter.h>
+
+/* Anonymous populates allocate and map this many pages at a time */
+#define POPULATE_BATCH_PGS			64
+/* Anonymous populates at least this big borrow idle cores to help */
+#define POPULATE_PAR_MIN_PGS		(4 * (PTSIZE >> PGSHIFT))
+#define POPULATE_MAX_HELPERS		8
+/* Cap on fault_around_pgs */
+#define FAULT_AROUND_MAX_PGS		32
+
+/* On a fault in a shared file mapping, we also map the page cache pages in the
+ * fault_around_pgs window (rounded down to a power of two) around the fault,
+ * if they are already loaded.  0 or 1 turns it off. */
+unsigned int fault_around_pgs = 16;
 
 struct kmem_cache *vmr_kcache;
 
+DEFINE_TRACEPOINT(page_fault, "pid %d va %p prot %d ret %d");
+DEFINE_PCPU_COUNTER(page_faults);
+DEFINE_PCPU_COUNTER(page_faults_blocked);	/* waited on a file page */
+
 static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg);
 static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
                           int pte_prot, struct page_map *pm, size_t offset,
@@ -270,9 +293,171 @@ void unmap_and_destroy_vmrs(struct proc *p)
 	spin_unlock(&p->vmr_lock);
 }
 
-/* Helper: copies the contents of pages from p to new p.  For pages that aren't
- * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+/* Dead procs free their VMRs a chunk at a time.  Big address spaces get help
+ * from idle cores, each of which grabs chunks until there are none left. */
+#define TEARDOWN_CHUNK			(32 * PTSIZE)
+#define TEARDOWN_PAR_CHUNKS		16		/* per helper */
+#define TEARDOWN_MAX_HELPERS	8
+
+/* Pages of dead procs' VMRs that we haven't freed yet.  It's VA, so it's more
+ * than the memory we'll actually get back. */
+atomic_t nr_pending_free_pages;
+
+struct vmr_teardown {
+	struct proc					*p;
+	spinlock_t					lock;		/* protects vmr and va */
+	struct vm_region			*vmr;		/* the next chunk is at va */
+	uintptr_t					va;
+	atomic_t					nr_helpers;	/* still running */
+};
+
+struct vmr_teardown_helper {
+	struct work_struct			work;
+	struct vmr_teardown			*td;
+	int							coreid;
+};
+
+/* p is dead, and teardown_vmrs() will free its VMRs soon. */
+void vmrs_pending_free(struct proc *p)
+{
+	struct vm_region *vmr;
+	long nr = 0;
+
+	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link)
+		nr += (vmr->vm_end - vmr->vm_base) >> PGSHIFT;
+	atomic_add(&nr_pending_free_pages, nr);
+}
+
+/* Frees the next chunk.  Returns FALSE if there aren't any left. */
+static bool teardown_chunk(struct vmr_teardown *td)
+{
+	struct vm_region *vmr;
+	uintptr_t va;
+	size_t len;
+
+	spin_lock(&td->lock);
+	vmr = td->vmr;
+	if (!vmr) {
+		spin_unlock(&td->lock);
+		return FALSE;
+	}
+	va = td->va;
+	len = MIN(vmr->vm_end - va, TEARDOWN_CHUNK);
+	td->va += len;
+	if (td->va == vmr->vm_end) {
+		td->vmr = TAILQ_NEXT(vmr, vm_link);
+		if (td->vmr)
+			td->va = td->vmr->vm_base;
+	}
+	spin_unlock(&td->lock);
+	/* No one else can get to the PTEs of a dead proc's anonymous memory, but
+	 * page map removers can still find the file-backed VMRs. */
+	if (vmr->vm_file)
+		spin_lock(&td->p->pte_lock);
+	env_user_mem_walk(td->p, (void*)va, len, __vmr_free_pgs, 0);
+	if (vmr->vm_file)
+		spin_unlock(&td->p->pte_lock);
+	atomic_add(&nr_pending_free_pages, -(long)(len >> PGSHIFT));
+	return TRUE;
+}
+
+static void teardown_helper(struct work_struct *work)
+{
+	struct vmr_teardown_helper *h = container_of(work,
+	                                             struct vmr_teardown_helper,
+	                                             work);
+	struct vmr_teardown *td = h->td;
+
+	while (teardown_chunk(td))
+		;
+	put_idle_core(h->coreid);
+	/* h and td are on teardown_vmrs()'s stack, which can go away now */
+	atomic_dec(&td->nr_helpers);
+}
+
+/* Frees a dead proc's VMRs and their memory, like unmap_and_destroy_vmrs().
+ * We let other kthreads run between chunks, and borrow idle cores to help with
+ * big address spaces.  Call from a kthread that can block, after
+ * vmrs_pending_free(). */
+void teardown_vmrs(struct proc *p)
+{
+	struct vmr_teardown td;
+	struct vmr_teardown_helper helpers[TEARDOWN_MAX_HELPERS];
+	struct vmr_teardown_helper *h;
+	struct vm_region *vmr_i, *vmr_temp;
+	size_t nr_chunks = 0;
+	int nr_helpers, coreid;
+
+	td.p = p;
+	spinlock_init(&td.lock);
+	td.vmr = TAILQ_FIRST(&p->vm_regions);
+	td.va = td.vmr ? td.vmr->vm_base : 0;
+	atomic_init(&td.nr_helpers, 0);
+	TAILQ_FOREACH(vmr_i, &p->vm_regions, vm_link)
+		nr_chunks += DIV_ROUND_UP(vmr_i->vm_end - vmr_i->vm_base,
+		                          TEARDOWN_CHUNK);
+	nr_helpers = MIN(nr_chunks / TEARDOWN_PAR_CHUNKS, TEARDOWN_MAX_HELPERS);
+	for (int i = 0; i < nr_helpers; i++) {
+		coreid = get_any_idle_core();
+		if (coreid < 0)
+			break;
+		h = &helpers[i];
+		INIT_WORK(&h->work, teardown_helper);
+		h->td = &td;
+		h->coreid = coreid;
+		atomic_inc(&td.nr_helpers);
+		queue_work_on(coreid, system_wq, &h->work);
+	}
+	while (teardown_chunk(&td))
+		kthread_yield();
+	while (atomic_read(&td.nr_helpers))
+		kthread_yield();
+	spin_lock(&p->vmr_lock);
+	p->vmr_history++;
+	TAILQ_FOREACH_SAFE(vmr_i, &p->vm_regions, vm_link, vmr_temp)
+		destroy_vmr(vmr_i);
+	spin_unlock(&p->vmr_lock);
+}
+
+/* Settings for a PTE shared copy-on-write: read-only, and marked COW so that
+ * write faults (and mprotect) know the page isn't ours alone. */
+static int cow_pte_settings(pte_t pte)
+{
+	return (pte_get_settings(pte) & ~PTE_PERM) | PTE_USER_RO | PTE_COW;
+}
+
+/* Helper: if p has a jumbo at the PTSIZE-aligned va, shares it COW with new_p.
+ * Each little page gets a ref for the child.  Returns 0 on success, or -error
+ * if the caller needs to share the little pages instead (which splits p's
+ * jumbo).  Hold p's pte_lock. */
+static int share_jumbo(struct proc *p, struct proc *new_p, uintptr_t va)
+{
+	struct page *page;
+	pte_t pte, new_pte;
+	int settings;
+
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+	if (!pte_walk_okay(pte) || !pte_is_mapped(pte) || !pte_is_jumbo(pte))
+		return -EINVAL;
+	new_pte = pgdir_walk_jumbo(new_p->env_pgdir, (void*)va, TRUE);
+	if (!pte_walk_okay(new_pte) || !pte_is_unmapped(new_pte))
+		return -ENOMEM;
+	page = pa2page(pte_get_paddr(pte));
+	for (int i = 0; i < PTSIZE >> PGSHIFT; i++)
+		page_incref(&page[i]);
+	settings = cow_pte_settings(pte);
+	pte_write(new_pte, page2pa(page), settings);
+	pte_write(pte, page2pa(page), settings);
+	return 0;
+}
+
+/* Helper: gives new_p the pages from p, shared copy-on-write.  The first
+ * process to write to a page gets its own copy in handle_page_fault().  For
+ * pages that aren't present, once we support swapping, we can do something
+ * more intelligent.  0 on success, -ERROR on failure.  Jumbos are shared as
+ * jumbos.
+ *
+ * This makes p's pages read-only, so the caller needs to shoot down p's TLB. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
                       uintptr_t va_end)
 {
@@ -289,20 +474,36 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 	int copy_page(struct proc *p, pte_t pte, void *va, void *arg) {
 		struct proc *new_p = (struct proc*)arg;
 		struct page *pp;
+		pte_t new_pte;
+		int settings;
 		if (pte_is_unmapped(pte))
 			return 0;
 		/* pages could be !P, but right now that's only for file backed VMRs
 		 * undergoing page removal, which isn't the caller of copy_pages. */
 		if (pte_is_mapped(pte)) {
-			/* TODO: check for jumbos */
-			if (upage_alloc(new_p, &pp, 0))
-				return -ENOMEM;
-			if (page_insert(new_p->env_pgdir, pp, va, pte_get_settings(pte))) {
+			/* copy_pages() took care of the jumbos it could */
+			pp = pa2page(pte_get_paddr(pte));
+			/* Private mappings never point at the page cache, but if one
+			 * does, we can't COW it: the PM owns that page. */
+			if (page_is_pagemap(pp)) {
+				if (upage_alloc(new_p, &pp, 0))
+					return -ENOMEM;
+				if (page_insert(new_p->env_pgdir, pp, va,
+				                pte_get_settings(pte))) {
+					page_decref(pp);
+					return -ENOMEM;
+				}
+				memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
 				page_decref(pp);
-				return -ENOMEM;
+				return 0;
 			}
-			memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
-			page_decref(pp);
+			new_pte = pgdir_walk(new_p->env_pgdir, va, TRUE);
+			if (!pte_walk_okay(new_pte))
+				return -ENOMEM;
+			page_incref(pp);
+			settings = cow_pte_settings(pte);
+			pte_write(new_pte, page2pa(pp), settings);
+			pte_write(pte, page2pa(pp), settings);
 		} else if (pte_is_paged_out(pte)) {
 			/* TODO: (SWAP) will need to either make a copy or CoW/refcnt the
 			 * backend store.  For now, this PTE will be the same as the
@@ -313,8 +514,71 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		}
 		return 0;
 	}
-	return env_user_mem_walk(p, (void*)va_start, va_end - va_start, &copy_page,
-	                         new_p);
+	uintptr_t va = va_start, chunk_end;
+	int ret = 0;
+
+	spin_lock(&p->pte_lock);	/* changing p's PTEs */
+	/* Go a jumbo-sized chunk at a time, so we can share any jumbos whole */
+	while (va < va_end) {
+		chunk_end = MIN(ROUNDDOWN(va + PTSIZE, PTSIZE), va_end);
+		if ((chunk_end - va == PTSIZE) && !share_jumbo(p, new_p, va)) {
+			va = chunk_end;
+			continue;
+		}
+		ret = env_user_mem_walk(p, (void*)va, chunk_end - va, &copy_page,
+		                        new_p);
+		if (ret)
+			break;
+		va = chunk_end;
+	}
+	spin_unlock(&p->pte_lock);
+	return ret;
+}
+
+/* Helper for write faults: if va's PTE is shared COW, gives p its own writable
+ * page, copying if anyone else still has the page.  Returns TRUE if va was COW
+ * and we dealt with it, with the result in *ret.  Hold the vmr_lock. */
+static bool __hpf_cow(struct proc *p, uintptr_t va, int pte_prot, int *ret)
+{
+	struct page *old_page, *new_page;
+	int settings;
+	pte_t pte;
+
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, FALSE);
+	if (!pte_walk_okay(pte) || !pte_is_mapped(pte) ||
+	    !(pte_get_settings(pte) & PTE_COW)) {
+		spin_unlock(&p->pte_lock);
+		return FALSE;
+	}
+	*ret = 0;
+	/* Creating walks split jumbos.  The little PTEs stay COW. */
+	if (pte_is_jumbo(pte)) {
+		pte = pgdir_walk(p->env_pgdir, (void*)va, TRUE);
+		if (!pte_walk_okay(pte)) {
+			*ret = -ENOMEM;
+			goto out;
+		}
+	}
+	old_page = pa2page(pte_get_paddr(pte));
+	settings = (pte_get_settings(pte) & ~(PTE_COW | PTE_PERM)) | pte_prot;
+	if (kref_refcnt(&old_page->pg_kref) == 1) {
+		/* Everyone else already broke their COW; the page is ours */
+		pte_write(pte, page2pa(old_page), settings);
+	} else {
+		if (upage_alloc(p, &new_page, FALSE)) {
+			*ret = -ENOMEM;
+			goto out;
+		}
+		memcpy(page2kva(new_page), page2kva(old_page), PGSIZE);
+		pte_write(pte, page2pa(new_page), settings);
+		page_decref(old_page);
+	}
+out:
+	spin_unlock(&p->pte_lock);
+	if (!*ret)
+		proc_tlbshootdown(p, va, va + PGSIZE);
+	return TRUE;
 }
 
 static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
@@ -384,6 +648,8 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 		}
 		TAILQ_INSERT_TAIL(&new_p->vm_regions, vmr, vm_link);
 	}
+	/* copy_pages() made our private pages read-only, for COW */
+	proc_tlbshootdown(p, 0, UMAPTOP);
 	return 0;
 }
 
@@ -521,30 +787,19 @@ out_error:	/* for debugging */
 	return FALSE;
 }
 
-/* Helper, maps in page at addr, but only if nothing is mapped there.  Returns
- * 0 on success.  If this is called by non-PM code, we'll store your ref in the
+/* Helper, maps in page at pte, but only if nothing is present there.  Hold
+ * the pte_lock.  If this is called by non-PM code, we'll store your ref in the
  * PTE. */
-static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
-                            int prot)
+static void __map_page_at_pte(struct page *page, pte_t pte, int prot)
 {
-	pte_t pte;
-	spin_lock(&p->pte_lock);	/* walking and changing PTEs */
-	/* find offending PTE (prob don't read this in).  This might alloc an
-	 * intermediate page table page. */
-	pte = pgdir_walk(p->env_pgdir, (void*)addr, TRUE);
-	if (!pte_walk_okay(pte)) {
-		spin_unlock(&p->pte_lock);
-		return -ENOMEM;
-	}
 	/* a spurious, valid PF is possible due to a legit race: the page might have
 	 * been faulted in by another core already (and raced on the memory lock),
 	 * in which case we should just return. */
 	if (pte_is_present(pte)) {
-		spin_unlock(&p->pte_lock);
 		/* non-PM callers expect us to eat the ref if we succeed. */
 		if (!page_is_pagemap(page))
 			page_decref(page);
-		return 0;
+		return;
 	}
 	if (pte_is_mapped(pte)) {
 		/* we're clobbering an old entry.  if we're just updating the prot, then
@@ -560,6 +815,95 @@ static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
 	prot |= (pte_is_dirty(pte) ? PTE_D : 0);
 	/* We have a ref to page, which we are storing in the PTE */
 	pte_write(pte, page2pa(page), prot);
+}
+
+/* Helper, maps in page at addr, but only if nothing is mapped there.  Returns
+ * 0 on success.  If this is called by non-PM code, we'll store your ref in the
+ * PTE. */
+static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
+                            int prot)
+{
+	pte_t pte;
+	spin_lock(&p->pte_lock);	/* walking and changing PTEs */
+	/* find offending PTE (prob don't read this in).  This might alloc an
+	 * intermediate page table page. */
+	pte = pgdir_walk(p->env_pgdir, (void*)addr, TRUE);
+	if (!pte_walk_okay(pte)) {
+		spin_unlock(&p->pte_lock);
+		return -ENOMEM;
+	}
+	__map_page_at_pte(page, pte, prot);
+	spin_unlock(&p->pte_lock);
+	return 0;
+}
+
+/* Helper, maps up to POPULATE_BATCH_PGS non-PM pages, pages[i] at addr + i *
+ * PGSIZE, walking once per page table.  Returns how many we mapped, eating
+ * their refs.  Fewer than nr means we ran out of memory for page tables. */
+static size_t map_pages_at_addr(struct proc *p, struct page **pages,
+                                size_t nr, uintptr_t addr, int prot)
+{
+	pte_t ptes[POPULATE_BATCH_PGS];
+	size_t nr_ptes, done = 0;
+
+	assert(nr <= POPULATE_BATCH_PGS);
+	spin_lock(&p->pte_lock);
+	while (done < nr) {
+		nr_ptes = pgdir_walk_range(p->env_pgdir,
+		                           (void*)(addr + done * PGSIZE), nr - done,
+		                           ptes);
+		if (!nr_ptes)
+			break;
+		for (size_t i = 0; i < nr_ptes; i++)
+			__map_page_at_pte(pages[done + i], ptes[i], prot);
+		done += nr_ptes;
+	}
+	spin_unlock(&p->pte_lock);
+	return done;
+}
+
+/* Returns TRUE if we should try to back the PTSIZE-aligned region around va
+ * with a jumbo page, given that [start, end) is anonymous memory. */
+static bool anon_jumbo_fits(uintptr_t va, uintptr_t start, uintptr_t end)
+{
+#ifdef CONFIG_USER_JUMBO_PAGES
+	uintptr_t jumbo_va = ROUNDDOWN(va, PTSIZE);
+
+	return (start <= jumbo_va) && (jumbo_va + PTSIZE <= end);
+#else
+	return FALSE;
+#endif
+}
+
+/* Helper, tries to back the PTSIZE-aligned region at va with a zeroed jumbo
+ * page, storing the refs in the PTE.  Returns 0 on success, or -error if the
+ * caller should use small pages instead, e.g. if some of the region is already
+ * mapped or we're out of contiguous memory. */
+static int map_anon_jumbo_at_addr(struct proc *p, uintptr_t va, int prot)
+{
+	size_t order = LOG2_UP(PTSIZE >> PGSHIFT);
+	void *kva;
+	pte_t pte;
+
+	assert(!(va % PTSIZE));
+	/* Cheap check before we go looking for memory.  We'll check it again. */
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+	spin_unlock(&p->pte_lock);
+	if (pte_walk_okay(pte) && !pte_is_unmapped(pte))
+		return -EEXIST;
+	kva = get_aligned_cont_pages(order, 0);
+	if (!kva)
+		return -ENOMEM;
+	memset(kva, 0, PTSIZE);
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, TRUE);
+	if (!pte_walk_okay(pte) || !pte_is_unmapped(pte)) {
+		spin_unlock(&p->pte_lock);
+		free_cont_pages(kva, order);
+		return -EEXIST;
+	}
+	pte_write(pte, PADDR(kva), prot | PTE_PS);
 	spin_unlock(&p->pte_lock);
 	return 0;
 }
@@ -577,24 +921,110 @@ static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
 	return 0;
 }
 
+/* Helper, populates anonymous memory on the calling core.  PTSIZE-aligned
+ * regions get jumbos if we can; the rest is allocated and mapped in batches. */
+static int __populate_anon_va(struct proc *p, uintptr_t va,
+                              unsigned long nr_pgs, int pte_prot)
+{
+	struct page *pages[POPULATE_BATCH_PGS];
+	uintptr_t pg_va = va, end = va + nr_pgs * PGSIZE;
+	size_t batch, got, mapped;
+
+	while (pg_va < end) {
+		if (!(pg_va % PTSIZE) && anon_jumbo_fits(pg_va, va, end) &&
+		    !map_anon_jumbo_at_addr(p, pg_va, pte_prot)) {
+			pg_va += PTSIZE;
+			continue;
+		}
+		/* Stop at the next PTSIZE boundary, so we get a shot at a jumbo */
+		batch = MIN(end, ROUNDUP(pg_va + 1, PTSIZE)) - pg_va;
+		batch = MIN(batch >> PGSHIFT, POPULATE_BATCH_PGS);
+		got = upage_alloc_bulk(p, pages, batch, TRUE);
+		mapped = map_pages_at_addr(p, pages, got, pg_va, pte_prot);
+		for (size_t i = mapped; i < got; i++)
+			page_decref(pages[i]);
+		if (mapped < batch)
+			return -ENOMEM;
+		pg_va += batch << PGSHIFT;
+	}
+	return 0;
+}
+
+/* A big anonymous populate, shared with idle cores.  It lives on the caller's
+ * stack; the caller waits for nr_left to hit 0 before returning. */
+struct populate_work {
+	struct proc					*p;
+	int							pte_prot;
+	bool						failed;
+	atomic_t					nr_left;
+};
+
+/* RKM, populates [a1, a1 + a2 pages) for the populate_work at a0. */
+static void __populate_anon_rkm(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct populate_work *pw = (struct populate_work*)a0;
+
+	if (__populate_anon_va(pw->p, a1, a2, pw->pte_prot))
+		pw->failed = TRUE;
+	wmb();	/* failed must be visible before the caller can return */
+	atomic_dec(&pw->nr_left);
+}
+
 /* Hold the VMR lock when you call this - it'll assume the entire VA range is
- * mappable, which isn't true if there are concurrent changes to the VMRs. */
+ * mappable, which isn't true if there are concurrent changes to the VMRs.
+ *
+ * Big ranges get split into chunks of whole jumbos, and we borrow idle cores to
+ * fill all but the first chunk, which we do ourselves.  The helpers only need
+ * the pte_lock, so we can wait for them while holding the VMR lock. */
 static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
                             int pte_prot)
 {
-	struct page *page;
-	int ret;
-	for (long i = 0; i < nr_pgs; i++) {
-		if (upage_alloc(p, &page, TRUE))
-			return -ENOMEM;
-		/* could imagine doing a memwalk instead of a for loop */
-		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot);
-		if (ret) {
-			page_decref(page);
-			return ret;
+	struct populate_work pw;
+	int helpers[POPULATE_MAX_HELPERS];
+	int nr_helpers = 0, coreid, ret;
+	uintptr_t first, start, stop, end = va + nr_pgs * PGSIZE;
+	size_t chunk_sz;
+
+	if (nr_pgs < POPULATE_PAR_MIN_PGS)
+		return __populate_anon_va(p, va, nr_pgs, pte_prot);
+	while (nr_helpers < POPULATE_MAX_HELPERS) {
+		coreid = get_any_idle_core();
+		if (coreid < 0)
+			break;
+		if (coreid == core_id()) {
+			put_idle_core(coreid);
+			break;
 		}
+		helpers[nr_helpers++] = coreid;
 	}
-	return 0;
+	if (!nr_helpers)
+		return __populate_anon_va(p, va, nr_pgs, pte_prot);
+	pw.p = p;
+	pw.pte_prot = pte_prot;
+	pw.failed = FALSE;
+	atomic_init(&pw.nr_left, 0);
+	chunk_sz = ROUNDUP(DIV_ROUND_UP(nr_pgs, nr_helpers + 1) << PGSHIFT,
+	                   PTSIZE);
+	first = ROUNDUP(va, PTSIZE);
+	for (int i = 0; i < nr_helpers; i++) {
+		start = MIN(first + (i + 1) * chunk_sz, end);
+		stop = MIN(first + (i + 2) * chunk_sz, end);
+		if (start == stop)
+			continue;
+		atomic_inc(&pw.nr_left);
+		send_kernel_message(helpers[i], __populate_anon_rkm, (long)&pw,
+		                    start, (stop - start) >> PGSHIFT, KMSG_ROUTINE);
+	}
+	stop = MIN(first + chunk_sz, end);
+	ret = __populate_anon_va(p, va, (stop - va) >> PGSHIFT, pte_prot);
+	while (atomic_read(&pw.nr_left))
+		cpu_relax();
+	rmb();	/* nr_left before failed */
+	for (int i = 0; i < nr_helpers; i++)
+		put_idle_core(helpers[i]);
+	if (!ret && pw.failed)
+		ret = -ENOMEM;
+	return ret;
 }
 
 /* This will periodically unlock the vmr lock. */
@@ -772,16 +1202,115 @@ int mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 	return ret;
 }
 
+/* Gathers the PTEs we changed into one range, so a whole munmap or mprotect
+ * is one shootdown, covering only what was actually mapped.  end == 0 means we
+ * changed nothing. */
+struct tlb_gather {
+	uintptr_t					start;
+	uintptr_t					end;
+};
+
+static void tlb_gather_add(struct tlb_gather *tlb, void *va)
+{
+	tlb->start = tlb->end ? MIN(tlb->start, (uintptr_t)va) : (uintptr_t)va;
+	tlb->end = MAX(tlb->end, (uintptr_t)va + PGSIZE);
+}
+
+static void tlb_gather_flush(struct proc *p, struct tlb_gather *tlb)
+{
+	if (tlb->end)
+		proc_tlbshootdown(p, tlb->start, tlb->end);
+}
+
+/* Maps page, which has the data the user wants at va, in place of the page
+ * that's there.  Takes the caller's ref on page, which must be the only one.
+ * The swap is only invisible to the user if the old page is theirs alone:
+ * present, writable, private, anonymous, and unshared.  Returns 0 on success,
+ * or -error if the caller needs to copy instead. */
+int page_swap_add(struct page_swap *ps, uintptr_t va, struct page *page)
+{
+	struct proc *p = ps->p;
+	struct vm_region *vmr;
+	struct page *old;
+	pte_t pte;
+	int ret = -EINVAL;
+
+	if (PGOFF(va) || (kref_refcnt(&page->pg_kref) != 1) ||
+	    page_is_pagemap(page))
+		return -EINVAL;
+	if (ps->nr_old == PAGE_SWAP_BATCH)
+		page_swap_finish(ps);
+	spin_lock(&p->vmr_lock);
+	vmr = find_vmr(p, va);
+	if (!vmr || vmr->vm_file || (vmr->vm_flags & MAP_SHARED) ||
+	    !(vmr->vm_prot & PROT_WRITE))
+		goto out_vmr;
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, FALSE);
+	/* COW pages aren't writable yet */
+	if (!pte_walk_okay(pte) || !pte_is_present(pte) || pte_is_jumbo(pte) ||
+	    !pte_has_perm_urw(pte))
+		goto out_pte;
+	old = pa2page(pte_get_paddr(pte));
+	if ((kref_refcnt(&old->pg_kref) != 1) || page_is_pagemap(old))
+		goto out_pte;
+	pte_write(pte, page2pa(page), pte_get_settings(pte));
+	ps->old[ps->nr_old++] = old;
+	ps->start = ps->end ? MIN(ps->start, va) : va;
+	ps->end = MAX(ps->end, va + PGSIZE);
+	ret = 0;
+out_pte:
+	spin_unlock(&p->pte_lock);
+out_vmr:
+	spin_unlock(&p->vmr_lock);
+	return ret;
+}
+
+/* Shoots down the swapped PTEs, then frees the user's old pages.  Until then,
+ * other cores might still be using them. */
+void page_swap_finish(struct page_swap *ps)
+{
+	if (!ps->end)
+		return;
+	proc_tlbshootdown(ps->p, ps->start, ps->end);
+	for (int i = 0; i < ps->nr_old; i++)
+		page_decref(ps->old[i]);
+	ps->start = ps->end = 0;
+	ps->nr_old = 0;
+}
+
+struct mprotect_args {
+	int							pte_prot;
+	struct tlb_gather			tlb;
+};
+
+static int __mprotect_replace_perm(struct proc *p, pte_t pte, void *va,
+                                   void *arg)
+{
+	struct mprotect_args *args = (struct mprotect_args*)arg;
+
+	if (!pte_is_mapped(pte))
+		return 0;
+	/* COW pages stay read-only until a write fault gets us our own copy */
+	if ((pte_get_settings(pte) & PTE_COW) && (args->pte_prot == PTE_USER_RW))
+		pte_replace_perm(pte, PTE_USER_RO);
+	else
+		pte_replace_perm(pte, args->pte_prot);
+	tlb_gather_add(&args->tlb, va);
+	return 0;
+}
+
 /* This does not care if the region is not mapped.  POSIX says you should return
  * ENOMEM if any part of it is unmapped.  Can do this later if we care, based on
  * the VMRs, not the actual page residency. */
 int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 {
 	struct vm_region *vmr, *next_vmr;
-	pte_t pte;
-	bool shootdown_needed = FALSE;
-	int pte_prot = (prot & PROT_WRITE) ? PTE_USER_RW :
-	               (prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : PTE_NONE;
+	struct mprotect_args args;
+
+	args.pte_prot = (prot & PROT_WRITE) ? PTE_USER_RW :
+	                (prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : PTE_NONE;
+	args.tlb.end = 0;
 	/* TODO: this is aggressively splitting, when we might not need to if the
 	 * prots are the same as the previous.  Plus, there are three excessive
 	 * scans.  Finally, we might be able to merge when we are done. */
@@ -796,25 +1325,20 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 		}
 		vmr->vm_prot = prot;
 		spin_lock(&p->pte_lock);	/* walking and changing PTEs */
-		/* TODO: use a memwalk.  At a minimum, we need to change every existing
-		 * PTE that won't trigger a PF (meaning, present PTEs) to have the new
-		 * prot.  The others will fault on access, and we'll change the PTE
-		 * then.  In the off chance we have a mapped but not present PTE, we
-		 * might as well change it too, since we're already here. */
-		for (uintptr_t va = vmr->vm_base; va < vmr->vm_end; va += PGSIZE) {
-			pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
-			if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
-				pte_replace_perm(pte, pte_prot);
-				shootdown_needed = TRUE;
-			}
-		}
+		/* At a minimum, we need to change every existing PTE that won't
+		 * trigger a PF (meaning, present PTEs) to have the new prot.  The
+		 * others will fault on access, and we'll change the PTE then.  In the
+		 * off chance we have a mapped but not present PTE, we might as well
+		 * change it too, since we're already here.  The memwalk splits any
+		 * jumbos, since the VMR might only cover part of one. */
+		env_user_mem_walk(p, (void*)vmr->vm_base, vmr->vm_end - vmr->vm_base,
+		                  __mprotect_replace_perm, &args);
 		spin_unlock(&p->pte_lock);
 		vmr = merge_me(vmr);
 		next_vmr = TAILQ_NEXT(vmr, vm_link);
 		vmr = next_vmr;
 	}
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_gather_flush(p, &args.tlb);
 	return 0;
 }
 
@@ -845,12 +1369,12 @@ int munmap(struct proc *p, uintptr_t addr, size_t len)
 static int __munmap_mark_not_present(struct proc *p, pte_t pte, void *va,
                                      void *arg)
 {
-	bool *shootdown_needed = (bool*)arg;
+	struct tlb_gather *tlb = (struct tlb_gather*)arg;
 	/* could put in some checks here for !P and also !0 */
 	if (!pte_is_present(pte))	/* unmapped (== 0) *ptes are also not PTE_P */
 		return 0;
 	pte_clear_present(pte);
-	*shootdown_needed = TRUE;
+	tlb_gather_add(tlb, va);
 	return 0;
 }
 
@@ -882,7 +1406,7 @@ static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg)
 int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 {
 	struct vm_region *vmr, *next_vmr, *first_vmr;
-	bool shootdown_needed = FALSE;
+	struct tlb_gather tlb = {0};
 
 	/* TODO: this will be a bit slow, since we end up doing three linear
 	 * searches (two in isolate, one in find_first). */
@@ -892,15 +1416,14 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 	spin_lock(&p->pte_lock);	/* changing PTEs */
 	while (vmr && vmr->vm_base < addr + len) {
 		env_user_mem_walk(p, (void*)vmr->vm_base, vmr->vm_end - vmr->vm_base,
-		                  __munmap_mark_not_present, &shootdown_needed);
+		                  __munmap_mark_not_present, &tlb);
 		vmr = TAILQ_NEXT(vmr, vm_link);
 	}
 	spin_unlock(&p->pte_lock);
 	/* we haven't freed the pages yet; still using the PTEs to store the them.
 	 * There should be no races with inserts/faults, since we still hold the mm
 	 * lock since the previous CB. */
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_gather_flush(p, &tlb);
 	vmr = first_vmr;
 	while (vmr && vmr->vm_base < addr + len) {
 		/* there is rarely more than one VMR in this loop.  o/w, we'll need to
@@ -916,6 +1439,80 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 	return 0;
 }
 
+/* Throws away the pages backing [addr, addr + len), but keeps the VMRs.  The
+ * next touch faults in a fresh zeroed page (anonymous) or the file's page.
+ * This is how a VMM hands guest memory back, e.g. for a balloon. */
+static int __do_madvise_dontneed(struct proc *p, uintptr_t addr, size_t len)
+{
+	struct vm_region *vmr, *first_vmr;
+	struct tlb_gather tlb = {0};
+	uintptr_t end = addr + len;
+	uintptr_t covered = addr;
+
+	/* Like mprotect ought to, we want ENOMEM for holes, and we don't toss
+	 * locked memory.  Check before touching anything. */
+	first_vmr = find_first_vmr(p, addr);
+	for (vmr = first_vmr; vmr && vmr->vm_base < end;
+	     vmr = TAILQ_NEXT(vmr, vm_link)) {
+		if (vmr->vm_base > covered) {
+			set_errno(ENOMEM);
+			return -1;
+		}
+		if (vmr->vm_flags & MAP_LOCKED) {
+			set_errno(EINVAL);
+			return -1;
+		}
+		covered = vmr->vm_end;
+	}
+	if (covered < end) {
+		set_errno(ENOMEM);
+		return -1;
+	}
+	/* Same two passes as munmap: no one can use the PTEs once we've shot them
+	 * down, then we can free the pages.  The walks split any jumbos that
+	 * straddle the edges of the range. */
+	spin_lock(&p->pte_lock);
+	env_user_mem_walk(p, (void*)addr, len, __munmap_mark_not_present, &tlb);
+	spin_unlock(&p->pte_lock);
+	tlb_gather_flush(p, &tlb);
+	spin_lock(&p->pte_lock);
+	env_user_mem_walk(p, (void*)addr, len, __vmr_free_pgs, 0);
+	spin_unlock(&p->pte_lock);
+	return 0;
+}
+
+int madvise(struct proc *p, uintptr_t addr, size_t len, int advice)
+{
+	int ret;
+
+	if (!len)
+		return 0;
+	len = ROUNDUP(len, PGSIZE);
+	if ((addr % PGSIZE) || (addr < MMAP_LOWEST_VA) || (addr + len < addr) ||
+	    (addr + len > UMAPTOP)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	switch (advice) {
+		case MADV_NORMAL:
+		case MADV_RANDOM:
+		case MADV_SEQUENTIAL:
+		case MADV_WILLNEED:
+			return 0;
+		case MADV_DONTNEED:
+			break;
+		default:
+			set_errno(EINVAL);
+			return -1;
+	}
+	/* The VMRs don't change, but we need them stable while we walk, and we
+	 * hold off faults the same way munmap does. */
+	spin_lock(&p->vmr_lock);
+	ret = __do_madvise_dontneed(p, addr, len);
+	spin_unlock(&p->vmr_lock);
+	return ret;
+}
+
 /* Helper - drop the page differently based on where it is from */
 static void __put_page(struct page *page)
 {
@@ -979,6 +1576,56 @@ static int __hpf_load_page(struct proc *p, struct page_map *pm,
 	return 0;
 }
 
+/* Helper for file faults: maps whatever is already up to date in the page cache
+ * around va, which we just faulted in, into the empty PTEs of the aligned
+ * fault-around window.  Only for mappings of the page cache itself, not private
+ * copies.  Best effort; it never blocks or allocates pages.  Hold the vmr_lock,
+ * but not the pte_lock, since finding pages takes the PM lock. */
+static void fault_around(struct proc *p, struct vm_region *vmr, uintptr_t va,
+                         int pte_prot)
+{
+	struct page *pages[FAULT_AROUND_MAX_PGS];
+	pte_t ptes[FAULT_AROUND_MAX_PGS];
+	struct page_map *pm = vmr->vm_file->f_mapping;
+	unsigned long nr_file_pgs, f_idx0;
+	unsigned int win_pgs;
+	uintptr_t start, end;
+	size_t nr, nr_ptes, i;
+
+	win_pgs = MIN(ACCESS_ONCE(fault_around_pgs), FAULT_AROUND_MAX_PGS);
+	if (win_pgs < 2)
+		return;
+	win_pgs = 1 << LOG2_DOWN(win_pgs);
+	/* Aligned to its size, the window is within va's page table */
+	start = MAX(ROUNDDOWN(va, win_pgs * PGSIZE), vmr->vm_base);
+	end = MIN(ROUNDDOWN(va, win_pgs * PGSIZE) + win_pgs * PGSIZE,
+	          vmr->vm_end);
+	f_idx0 = (start - vmr->vm_base + vmr->vm_foff) >> PGSHIFT;
+	nr_file_pgs = nr_pages(vmr->vm_file->f_dentry->d_inode->i_size);
+	if (f_idx0 >= nr_file_pgs)
+		return;
+	nr = MIN((end - start) >> PGSHIFT, nr_file_pgs - f_idx0);
+	for (i = 0; i < nr; i++) {
+		if ((start + i * PGSIZE == va) ||
+		    pm_load_page_nowait(pm, f_idx0 + i, &pages[i]))
+			pages[i] = NULL;
+		else if (vmr->vm_prot & PROT_EXEC)
+			icache_flush_page((void*)(start + i * PGSIZE),
+			                  page2kva(pages[i]));
+	}
+	spin_lock(&p->pte_lock);
+	nr_ptes = pgdir_walk_range(p->env_pgdir, (void*)start, nr, ptes);
+	for (i = 0; i < nr_ptes; i++) {
+		if (pages[i] && pte_is_unmapped(ptes[i]))
+			pte_write(ptes[i], page2pa(pages[i]), pte_prot);
+	}
+	spin_unlock(&p->pte_lock);
+	for (i = 0; i < nr; i++) {
+		if (pages[i])
+			pm_put_page(pages[i]);
+	}
+}
+
 /* Returns 0 on success, or an appropriate -error code.
  *
  * Notes: if your TLB caches negative results, you'll need to flush the
@@ -1010,8 +1657,17 @@ refault:
 		ret = -EPERM;
 		goto out;
 	}
+	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
+	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
+	/* Writes to pages we share with our fork()ed relatives need a copy */
+	if ((prot & PROT_WRITE) && __hpf_cow(p, va, pte_prot, &ret))
+		goto out;
 	if (!vmr->vm_file) {
-		/* No file - just want anonymous memory */
+		/* No file - just want anonymous memory.  Try for the whole jumbo
+		 * around va first. */
+		if (anon_jumbo_fits(va, vmr->vm_base, vmr->vm_end) &&
+		    !map_anon_jumbo_at_addr(p, ROUNDDOWN(va, PTSIZE), pte_prot))
+			goto out;
 		if (upage_alloc(p, &a_page, TRUE)) {
 			ret = -ENOMEM;
 			goto out;
@@ -1044,6 +1700,7 @@ refault:
 		if (ret) {
 			if (ret != -EAGAIN)
 				goto out;
+			pcpu_counter_inc(page_faults_blocked);
 			/* keep the file alive after we unlock */
 			kref_get(&vmr->vm_file->f_kref, 1);
 			spin_unlock(&p->vmr_lock);
@@ -1072,11 +1729,11 @@ refault:
 	}
 	/* update the page table TODO: careful with MAP_PRIVATE etc.  might do this
 	 * separately (file, no file) */
-	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
-	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	ret = map_page_at_addr(p, a_page, va, pte_prot);
 	if (ret) {
 		printd("map_page_at for %p fails with %d\n", va, ret);
+	} else if (page_is_pagemap(a_page)) {
+		fault_around(p, vmr, va, pte_prot);
 	}
 	/* fall through, even for errors */
 out_put_pg:
@@ -1092,12 +1749,22 @@ out:
 
 int handle_page_fault(struct proc *p, uintptr_t va, int prot)
 {
-	return __hpf(p, va, prot, TRUE);
+	int ret = __hpf(p, va, prot, TRUE);
+
+	proc_vc_stats(p)->nr_page_faults++;
+	pcpu_counter_inc(page_faults);
+	tracepoint(page_fault, p->pid, va, prot, ret);
+	return ret;
 }
 
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot)
 {
-	return __hpf(p, va, prot, FALSE);
+	int ret = __hpf(p, va, prot, FALSE);
+
+	proc_vc_stats(p)->nr_page_faults++;
+	pcpu_counter_inc(page_faults);
+	tracepoint(page_fault, p->pid, va, prot, ret);
+	return ret;
 }
 
 /* Attempts to populate the pages, as if there was a page faults.  Bails on
@@ -1154,31 +1821,109 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 	return nr_filled;
 }
 
-/* Kernel Dynamic Memory Mappings */
-uintptr_t dyn_vmap_llim = KERN_DYN_TOP;
+/* Kernel Dynamic Memory Mappings
+ *
+ * The vmap arena hands out kernel virtual space in [KERN_DYN_BOT, KERN_DYN_TOP).
+ * Frees are lazy: vunmap_vmem() clears the PTEs, but the range doesn't go back
+ * to the arena until every core's TLB has been flushed.  Freed ranges wait in
+ * vmap_lazy_segs, and once there are enough of them (or the arena runs dry), we
+ * do one global shootdown for the whole batch.  Until then, a stale TLB entry
+ * can only point at a range that no one else can get.
+ *
+ * We can't IPI while booting, so ranges freed then wait for the first flush
+ * after boot.  dyn_vmap_lock protects the boot pgdir's dynamic mappings. */
+#define VMAP_LAZY_MAX_SEGS		64
+#define VMAP_LAZY_MAX_PAGES		4096
+
+struct vmap_lazy_seg {
+	uintptr_t					vaddr;
+	unsigned long				nr_pages;
+};
+
+static struct arena vmap_arena;
 spinlock_t dyn_vmap_lock = SPINLOCK_INITIALIZER;
+static spinlock_t vmap_lazy_lock = SPINLOCK_INITIALIZER;
+static struct vmap_lazy_seg vmap_lazy_segs[VMAP_LAZY_MAX_SEGS];
+static unsigned int nr_vmap_lazy_segs;
+static unsigned long nr_vmap_lazy_pages;
+
+void vmap_init(void)
+{
+	arena_init(&vmap_arena, "vmap", PGSIZE, ARENA_NR_QCACHES * PGSIZE);
+	if (arena_add(&vmap_arena, KERN_DYN_BOT, KERN_DYN_TOP - KERN_DYN_BOT,
+	              MEM_WAIT))
+		panic("Unable to set up the vmap arena!");
+}
+
+static void __vmap_tlb_flush(struct hw_trapframe *hw_tf, void *data)
+{
+	tlb_flush_global();
+}
+
+/* Flushes every core's TLB, then gives the lazily freed ranges back to the
+ * arena. */
+static void vmap_lazy_flush(void)
+{
+	extern int booting;
+	struct vmap_lazy_seg segs[VMAP_LAZY_MAX_SEGS];
+	handler_wrapper_t *wrapper;
+	unsigned int nr;
+
+	if (booting)
+		return;
+	spin_lock(&vmap_lazy_lock);
+	nr = nr_vmap_lazy_segs;
+	memcpy(segs, vmap_lazy_segs, nr * sizeof(struct vmap_lazy_seg));
+	nr_vmap_lazy_segs = 0;
+	nr_vmap_lazy_pages = 0;
+	spin_unlock(&vmap_lazy_lock);
+	if (!nr)
+		return;
+	smp_call_function_all(__vmap_tlb_flush, NULL, &wrapper);
+	smp_call_wait(wrapper);
+	for (int i = 0; i < nr; i++)
+		arena_free(&vmap_arena, segs[i].vaddr, segs[i].nr_pages * PGSIZE);
+}
 
 /* Reserve space in the kernel dynamic memory map area */
 uintptr_t get_vmap_segment(unsigned long num_pages)
 {
 	uintptr_t retval;
-	spin_lock(&dyn_vmap_lock);
-	retval = dyn_vmap_llim - num_pages * PGSIZE;
-	if ((retval > ULIM) && (retval < KERN_DYN_TOP)) {
-		dyn_vmap_llim = retval;
-	} else {
-		warn("[kernel] dynamic mapping failed!");
-		retval = 0;
+
+	retval = arena_alloc(&vmap_arena, num_pages * PGSIZE, 0);
+	if (!retval) {
+		/* Freed space might be waiting on a shootdown or in the qcaches */
+		vmap_lazy_flush();
+		arena_reap(&vmap_arena);
+		retval = arena_alloc(&vmap_arena, num_pages * PGSIZE, 0);
 	}
-	spin_unlock(&dyn_vmap_lock);
+	if (!retval)
+		warn("[kernel] dynamic mapping failed!");
 	return retval;
 }
 
-/* Give up your space.  Note this isn't supported yet */
+/* Give up your space.  Unmap it first.  The space goes back to the arena after
+ * the next TLB shootdown, which we'll do once enough space is waiting. */
 uintptr_t put_vmap_segment(uintptr_t vaddr, unsigned long num_pages)
 {
-	/* TODO: use vmem regions for adjustable vmap segments */
-	warn("Not implemented, leaking vmem space.\n");
+	bool need_flush;
+
+	spin_lock(&vmap_lazy_lock);
+	if (nr_vmap_lazy_segs == VMAP_LAZY_MAX_SEGS) {
+		/* Only happens while booting, when we can't flush */
+		spin_unlock(&vmap_lazy_lock);
+		warn("Too many lazy vmap frees, leaking vmem space.\n");
+		return 0;
+	}
+	vmap_lazy_segs[nr_vmap_lazy_segs].vaddr = vaddr;
+	vmap_lazy_segs[nr_vmap_lazy_segs].nr_pages = num_pages;
+	nr_vmap_lazy_segs++;
+	nr_vmap_lazy_pages += num_pages;
+	need_flush = (nr_vmap_lazy_segs == VMAP_LAZY_MAX_SEGS) ||
+	             (nr_vmap_lazy_pages >= VMAP_LAZY_MAX_PAGES);
+	spin_unlock(&vmap_lazy_lock);
+	if (need_flush)
+		vmap_lazy_flush();
 	return 0;
 }
 
@@ -1224,24 +1969,21 @@ int map_vmap_segment(uintptr_t vaddr, uintptr_t paddr, unsigned long num_pages,
 	return 0;
 }
 
-/* Unmaps / 0's the PTEs of a chunk of vaddr space */
+/* Unmaps / 0's the PTEs of a chunk of vaddr space.  This doesn't flush the
+ * TLBs; put_vmap_segment() does that lazily, before anyone can reuse the space.
+ * The dynamic mappings are in the part of the boot pgdir that every process
+ * shares, and they are global (on x86), so the shootdown is a global flush on
+ * every core. */
 int unmap_vmap_segment(uintptr_t vaddr, unsigned long num_pages)
 {
-	/* Not a big deal - won't need this til we do something with kthreads */
-	warn("Incomplete, don't call this yet.");
-	spin_lock(&dyn_vmap_lock);
-	/* TODO: For all pgdirs */
 	pte_t pte;
+
+	spin_lock(&dyn_vmap_lock);
 	for (int i = 0; i < num_pages; i++) {
-		pte = pgdir_walk(boot_pgdir, (void*)(vaddr + i * PGSIZE), 1);
+		pte = pgdir_walk(boot_pgdir, (void*)(vaddr + i * PGSIZE), 0);
 		if (pte_walk_okay(pte))
 			pte_clear(pte);
 	}
-	/* TODO: TLB shootdown.  Also note that the global flag is set on the PTE
-	 * (for x86 for now), which requires a global shootdown.  bigger issue is
-	 * the TLB shootdowns for multiple pgdirs.  We'll need to remove from every
-	 * pgdir, and send tlb shootdowns to those that are active (which we don't
-	 * track yet). */
 	spin_unlock(&dyn_vmap_lock);
 	return 0;
 }
@@ -1284,9 +2026,14 @@ uintptr_t vmap_pmem_writecomb(uintptr_t paddr, size_t nr_bytes)
 	return vmap_pmem_flags(paddr, nr_bytes, PTE_WRITECOMB);
 }
 
+/* Like vmap_pmem, this can handle the unaligned vaddrs that it hands out */
 int vunmap_vmem(uintptr_t vaddr, size_t nr_bytes)
 {
-	unsigned long nr_pages = ROUNDUP(nr_bytes, PGSIZE) >> PGSHIFT;
+	unsigned long nr_pages;
+
+	nr_bytes += PGOFF(vaddr);
+	vaddr = ROUNDDOWN(vaddr, PGSIZE);
+	nr_pages = ROUNDUP(nr_bytes, PGSIZE) >> PGSHIFT;
 	unmap_vmap_segment(vaddr, nr_pages);
 	put_vmap_segment(vaddr, nr_pages);
 	return 0;
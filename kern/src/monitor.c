@@ -24,6 +24,9 @@
 #include <trap.h>
 #include <time.h>
 #include <percpu.h>
+#include <memprof.h>
+#include <lockprof.h>
+#include <klog.h>
 
 #include <ros/memlayout.h>
 #include <ros/event.h>
@@ -71,8 +74,10 @@ static command_t commands[] = {
 	{ "px", "Toggle printx", mon_px},
 	{ "kpfret", "Attempt to idle after a kernel fault", mon_kpfret},
 	{ "ks", "Kernel scheduler hacks", mon_ks},
-	{ "gfp", "Get free pages", mon_gfp },
+	{ "gfp", "Get free pages (or cache stats with 'pcp' or 'zero')", mon_gfp },
 	{ "coreinfo", "Print diagnostics for a core", mon_coreinfo},
+	{ "memprof", "Allocation-site profile: [start [rate]|stop]", mon_memprof},
+	{ "lockprof", "Lock contention profile: [start|stop]", mon_lockprof},
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -904,6 +909,7 @@ void monitor(struct hw_trapframe *hw_tf)
 	int cnt;
 	int coreid = core_id_early();
 
+	klog_sync_begin();
 	/* they are always disabled, since we have this irqsave lock */
 	if (irq_is_enabled())
 		printk("Entering Nanwan's Dungeon on Core %d (Ints on):\n", coreid);
@@ -925,6 +931,7 @@ void monitor(struct hw_trapframe *hw_tf)
 				break;
 		}
 	}
+	klog_sync_end();
 }
 
 static void pm_flusher(void *unused)
@@ -997,13 +1004,12 @@ int mon_fs(int argc, char **argv, struct hw_trapframe *hw_tf)
 			printk("DENTRY     FLAGS      REFCNT NAME\n");
 			printk("--------------------------------\n");
 			/* Hash helper */
-			void print_dcache_entry(void *item, void *opaque)
+			void print_dcache_entry(struct dentry *d_i, void *opaque)
 			{
-				struct dentry *d_i = (struct dentry*)item;
 				printk("%p %p %02d     %s\n", d_i, d_i->d_flags,
 				       kref_refcnt(&d_i->d_kref), d_i->d_name.name);
 			}
-			hash_for_each(sb->s_dcache, print_dcache_entry, NULL);
+			dcache_for_each(sb, print_dcache_entry, NULL);
 		}
 		if (argc < 3)
 			return 0;
@@ -1014,6 +1020,10 @@ int mon_fs(int argc, char **argv, struct hw_trapframe *hw_tf)
 				TAILQ_FOREACH(dentry, &sb->s_lru_d, d_lru)
 					printk("Dentry: %p, Name: %s\n", dentry,
 					       dentry->d_name.name);
+				printk("Negative (%lu):\n", sb->s_nr_neg);
+				TAILQ_FOREACH(dentry, &sb->s_lru_neg, d_lru)
+					printk("Dentry: %p, Name: %s\n", dentry,
+					       dentry->d_name.name);
 			}
 		} else if (!strcmp(argv[2], "prune")) {
 			printk("Pruning unused dentries\n");
@@ -1245,6 +1255,15 @@ usage:
 int mon_gfp(int argc, char **argv, struct hw_trapframe *hw_tf)
 {
 	size_t naddrpages = max_paddr / PGSIZE;
+
+	if (argc > 1 && !strcmp(argv[1], "pcp")) {
+		print_page_pcp_info();
+		return 0;
+	}
+	if (argc > 1 && !strcmp(argv[1], "zero")) {
+		print_page_zero_pool_info();
+		return 0;
+	}
 	spin_lock_irqsave(&colored_page_free_list_lock);
 	printk("%9s %9s %9s\n", "start", "end", "size");
 	for (int i = 0; i < naddrpages; i++) {
@@ -1289,3 +1308,34 @@ int mon_coreinfo(int argc, char **argv, struct hw_trapframe *hw_tf)
 	}
 	return 0;
 }
+
+/* Prints the allocation-site profile, or starts/stops it. */
+int mon_memprof(int argc, char **argv, struct hw_trapframe *hw_tf)
+{
+	if (argc > 1 && !strcmp(argv[1], "start")) {
+		memprof_start(argc > 2 ? strtoul(argv[2], 0, 0) : 0);
+		return 0;
+	}
+	if (argc > 1 && !strcmp(argv[1], "stop")) {
+		memprof_stop();
+		return 0;
+	}
+	print_memprof_report();
+	return 0;
+}
+
+/* Prints the lock contention profile, or starts/stops it. */
+int mon_lockprof(int argc, char **argv, struct hw_trapframe *hw_tf)
+{
+	if (argc > 1 && !strcmp(argv[1], "start")) {
+		if (lockprof_start())
+			printk("Lockprof needs CONFIG_LOCK_PROFILE\n");
+		return 0;
+	}
+	if (argc > 1 && !strcmp(argv[1], "stop")) {
+		lockprof_stop();
+		return 0;
+	}
+	print_lockprof_report();
+	return 0;
+}
@@ -42,11 +42,29 @@
 
 /*
  *  address resolution tables
+ *
+ *  Entries hang off a hash of the whole address.  The table starts with
+ *  ARP_MIN_BUCKETS buckets and doubles, up to ARP_MAX_BUCKETS, whenever it
+ *  has more entries than buckets.  Past ARP_MAX_ENTS, a new entry replaces the
+ *  least recently used one under its lock.
+ *
+ *  Writers take one of NARPLOCK qlocks, picked by the low bits of the hash.
+ *  The table always has a multiple of NARPLOCK buckets, so an address keeps
+ *  its lock across a resize, and the resize takes all of them.  The rxmt chain
+ *  and the drop list have their own spinlock, which nests inside the qlocks.
+ *
+ *  The transmit path looks up under RCU and copies the mac under the entry's
+ *  seq counter.  Anything but a fresh AOK entry, including a miss from racing
+ *  with a resize, goes to the locked path.  Entries never change address, and
+ *  they are freed with kfree_rcu().
  */
 
 enum {
-	NHASH = (1 << 6),
-	NCACHE = 256,
+	NARPLOCK = (1 << 6),
+	ARP_MIN_BUCKETS = (1 << 8),
+	ARP_MAX_BUCKETS = (1 << 14),
+	ARP_MAX_ENTS = (1 << 16),
+	ARP_MAX_AGE = 15 * 60 * 1000,	/* msec */
 
 	AOK = 1,
 	AWAIT = 2,
@@ -58,29 +76,109 @@ char *arpstate[] = {
 	"WAIT",
 };
 
+struct arp_tbl {
+	struct rcu_head rcu;
+	unsigned int mask;
+	struct arpent *b[];
+};
+
 /*
  *  one per Fs
  */
 struct arp {
-	qlock_t qlock;
+	qlock_t locks[NARPLOCK];
+	struct arp_tbl *tbl;
+	atomic_t nr_ents;
 	struct Fs *f;
-	struct arpent *hash[NHASH];
-	struct arpent cache[NCACHE];
+	spinlock_t rxmt_lock;		/* rxmt and the drop list */
 	struct arpent *rxmt;
 	struct proc *rxmitp;		/* neib sol re-transmit proc */
 	struct rendez rxmtq;
 	struct block *dropf, *dropl;
 };
 
-#define haship(s) ((s)[IPaddrlen-1]%NHASH)
-
 int ReTransTimer = RETRANS_TIMER;
 static void rxmitproc(void *v);
 
+static qlock_t *arp_lock(struct arp *arp, uint32_t hash)
+{
+	return &arp->locks[hash & (NARPLOCK - 1)];
+}
+
+static qlock_t *arpent_lock(struct arp *arp, struct arpent *a)
+{
+	return arp_lock(arp, ipaddrhash(a->ip));
+}
+
+static void arp_lock_all(struct arp *arp)
+{
+	for (int i = 0; i < NARPLOCK; i++)
+		qlock(&arp->locks[i]);
+}
+
+static void arp_unlock_all(struct arp *arp)
+{
+	for (int i = NARPLOCK - 1; i >= 0; i--)
+		qunlock(&arp->locks[i]);
+}
+
+static struct arp_tbl *arp_tbl_alloc(unsigned int nr_buckets)
+{
+	struct arp_tbl *t;
+
+	t = kzmalloc(sizeof(struct arp_tbl) +
+	             nr_buckets * sizeof(struct arpent *), MEM_WAIT);
+	t->mask = nr_buckets - 1;
+	return t;
+}
+
+static bool arp_needs_grow(struct arp *arp, struct arp_tbl *t)
+{
+	return (t->mask + 1 < ARP_MAX_BUCKETS) &&
+	       (atomic_read(&arp->nr_ents) > t->mask + 1);
+}
+
+/* Doubles the table.  Call without any of the arp locks.  Readers racing with
+ * us might wander onto a new chain and miss, which just sends them to the
+ * locked path. */
+static void arp_grow(struct arp *arp)
+{
+	struct arp_tbl *old, *new;
+	struct arpent *a, *next;
+	unsigned int nr_buckets, idx;
+
+	old = ACCESS_ONCE(arp->tbl);
+	if (!arp_needs_grow(arp, old))
+		return;
+	nr_buckets = (old->mask + 1) * 2;
+	new = arp_tbl_alloc(nr_buckets);
+	arp_lock_all(arp);
+	if (arp->tbl != old) {
+		arp_unlock_all(arp);
+		kfree(new);
+		return;
+	}
+	for (int i = 0; i <= old->mask; i++) {
+		for (a = old->b[i]; a; a = next) {
+			next = a->hash;
+			idx = ipaddrhash(a->ip) & new->mask;
+			ACCESS_ONCE(a->hash) = new->b[idx];
+			new->b[idx] = a;
+		}
+	}
+	rcu_assign_pointer(arp->tbl, new);
+	arp_unlock_all(arp);
+	kfree_rcu(old, rcu);
+}
+
 void arpinit(struct Fs *f)
 {
 	f->arp = kzmalloc(sizeof(struct arp), MEM_WAIT);
-	qlock_init(&f->arp->qlock);
+	for (int i = 0; i < NARPLOCK; i++)
+		qlock_init(&f->arp->locks[i]);
+	f->arp->tbl = arp_tbl_alloc(ARP_MIN_BUCKETS);
+	atomic_init(&f->arp->nr_ents, 0);
+	spinlock_init(&f->arp->rxmt_lock);
 	rendez_init(&f->arp->rxmtq);
 	f->arp->f = f;
 	f->arp->rxmt = NULL;
@@ -88,139 +186,207 @@ void arpinit(struct Fs *f)
 	ktask("rxmitproc", rxmitproc, f->arp);
 }
 
-/*
- *  create a new arp entry for an ip address.
- */
-static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
-                              int addrxt)
+/* Works under RCU or a's lock */
+static struct arpent *arp_find(struct arp_tbl *t, uint32_t hash, uint8_t *ip,
+                               struct medium *type)
 {
-	unsigned int t;
-	struct block *next, *xp;
-	struct arpent *a, *e, *f, **l;
-	struct medium *m = ifc->m;
-	int empty;
-
-	/* find oldest entry */
-	e = &arp->cache[NCACHE];
-	a = arp->cache;
-	t = a->utime;
-	for (f = a; f < e; f++) {
-		if (f->utime < t) {
-			t = f->utime;
-			a = f;
+	struct arpent *a;
+
+	for (a = rcu_dereference(t->b[hash & t->mask]); a;
+	     a = rcu_dereference(a->hash)) {
+		if ((a->type == type) && (ipcmp(ip, a->ip) == 0))
+			return a;
+	}
+	return NULL;
+}
+
+/* Finds the least recently used entry under the same lock as hash.  Hold that
+ * lock. */
+static struct arpent *arp_lru(struct arp_tbl *t, uint32_t hash)
+{
+	struct arpent *a, *lru = NULL;
+
+	for (unsigned int i = hash & (NARPLOCK - 1); i <= t->mask; i += NARPLOCK) {
+		for (a = t->b[i]; a; a = a->hash) {
+			if (!lru || (a->utime < lru->utime))
+				lru = a;
+		}
+	}
+	return lru;
+}
+
+/* called with rxmt_lock held */
+static void __rxmt_remove(struct arp *arp, struct arpent *a)
+{
+	struct arpent *f, **l;
+
+	l = &arp->rxmt;
+	for (f = *l; f; f = f->nextrxt) {
+		if (f == a) {
+			*l = a->nextrxt;
+			break;
 		}
+		l = &f->nextrxt;
 	}
+	a->nextrxt = NULL;
+}
+
+/* put to the end of re-transmit chain.  Returns TRUE if the chain was empty.
+ * called with rxmt_lock held */
+static bool __rxmt_append(struct arp *arp, struct arpent *a)
+{
+	struct arpent *f, **l;
+	bool empty = arp->rxmt == NULL;
+
+	__rxmt_remove(arp, a);
+	l = &arp->rxmt;
+	for (f = *l; f; f = f->nextrxt)
+		l = &f->nextrxt;
+	*l = a;
+	return empty;
+}
+
+/* queue icmp unreachable for rxmitproc later, w/o arp locks.  called with
+ * rxmt_lock held */
+static void __queue_drops(struct arp *arp, struct block *xp)
+{
+	struct block *next;
+
+	if (arp->dropl == NULL)
+		arp->dropf = xp;
+	else
+		arp->dropl->list = xp;
+	for (next = xp->list; next; next = next->list)
+		xp = next;
+	arp->dropl = xp;
+}
+
+/* dump waiting packets.  called with a's lock held */
+static void dumphold(struct arp *arp, struct arpent *a)
+{
+	struct block *next, *xp;
 
-	/* dump waiting packets */
 	xp = a->hold;
 	a->hold = NULL;
-
+	a->last = NULL;
+	if (xp == NULL)
+		return;
 	if (isv4(a->ip)) {
 		while (xp) {
 			next = xp->list;
 			freeblist(xp);
 			xp = next;
 		}
-	} else {
-		/* queue icmp unreachable for rxmitproc later, w/o arp lock */
-		if (xp) {
-			if (arp->dropl == NULL)
-				arp->dropf = xp;
-			else
-				arp->dropl->list = xp;
-
-			for (next = xp->list; next; next = next->list)
-				xp = next;
-			arp->dropl = xp;
-			rendez_wakeup(&arp->rxmtq);
-		}
+		return;
 	}
+	spin_lock(&arp->rxmt_lock);
+	__queue_drops(arp, xp);
+	spin_unlock(&arp->rxmt_lock);
+	rendez_wakeup(&arp->rxmtq);
+}
+
+/*
+ *  unhash an entry and free it once the readers are done.  its packets must
+ *  be gone already.  called with a's lock held
+ */
+static void cleanarpent(struct arp *arp, struct arpent *a)
+{
+	struct arp_tbl *t = arp->tbl;
+	struct arpent *f, **l;
 
 	/* take out of current chain */
-	l = &arp->hash[haship(a->ip)];
+	l = &t->b[ipaddrhash(a->ip) & t->mask];
 	for (f = *l; f; f = f->hash) {
 		if (f == a) {
-			*l = a->hash;
+			ACCESS_ONCE(*l) = a->hash;
 			break;
 		}
 		l = &f->hash;
 	}
 
-	/* insert into new chain */
-	l = &arp->hash[haship(ip)];
-	a->hash = *l;
-	*l = a;
+	spin_lock(&arp->rxmt_lock);
+	__rxmt_remove(arp, a);
+	spin_unlock(&arp->rxmt_lock);
+
+	atomic_dec(&arp->nr_ents);
+	kfree_rcu(a, rcu);
+}
+
+/*
+ *  create a new arp entry for an ip address.  called with the lock for hash
+ *  held.
+ */
+static struct arpent *newarp6(struct arp *arp, uint8_t *ip, uint32_t hash,
+                              struct Ipifc *ifc, int addrxt)
+{
+	struct arp_tbl *t = arp->tbl;
+	struct arpent *a, **l;
+	bool empty;
 
+	if (atomic_read(&arp->nr_ents) >= ARP_MAX_ENTS) {
+		a = arp_lru(t, hash);
+		if (a) {
+			dumphold(arp, a);
+			cleanarpent(arp, a);
+		}
+	}
+
+	a = kzmalloc(sizeof(struct arpent), MEM_WAIT);
 	memmove(a->ip, ip, sizeof(a->ip));
 	a->utime = NOW;
 	a->ctime = 0;	/* somewhat of a "last sent time".  0, to trigger a send. */
-	a->type = m;
+	a->type = ifc->m;
 
 	a->rtime = NOW + ReTransTimer;
 	a->rxtsrem = MAX_MULTICAST_SOLICIT;
 	a->ifc = ifc;
 	a->ifcid = ifc->ifcid;
 
-	/* put to the end of re-transmit chain; addrxt is 0 when isv4(a->ip) */
-	if (!ipismulticast(a->ip) && addrxt) {
-		l = &arp->rxmt;
-		empty = (*l == NULL);
+	/* insert into new chain */
+	l = &t->b[hash & t->mask];
+	a->hash = *l;
+	rcu_assign_pointer(*l, a);
+	atomic_inc(&arp->nr_ents);
 
-		for (f = *l; f; f = f->nextrxt) {
-			if (f == a) {
-				*l = a->nextrxt;
-				break;
-			}
-			l = &f->nextrxt;
-		}
-		for (f = *l; f; f = f->nextrxt) {
-			l = &f->nextrxt;
-		}
-		*l = a;
+	/* addrxt is 0 when isv4(a->ip) */
+	if (!ipismulticast(a->ip) && addrxt) {
+		spin_lock(&arp->rxmt_lock);
+		empty = __rxmt_append(arp, a);
+		spin_unlock(&arp->rxmt_lock);
 		if (empty)
 			rendez_wakeup(&arp->rxmtq);
 	}
 
-	a->nextrxt = NULL;
-
 	return a;
 }
 
-/* called with arp qlocked */
-
-void cleanarpent(struct arp *arp, struct arpent *a)
+/* Lockless lookup for the transmit path.  Only hits on an AOK entry that
+ * isn't due to age out. */
+static bool arpget_fast(struct arp *arp, uint32_t hash, uint8_t *ip,
+                        struct medium *type, uint8_t *mac)
 {
-	struct arpent *f, **l;
-
-	a->utime = 0;
-	a->ctime = 0;
-	a->type = 0;
-	a->state = 0;
-
-	/* take out of current chain */
-	l = &arp->hash[haship(a->ip)];
-	for (f = *l; f; f = f->hash) {
-		if (f == a) {
-			*l = a->hash;
-			break;
-		}
-		l = &f->hash;
-	}
+	struct arpent *a;
+	seq_ctr_t seq;
+	uint64_t now = NOW;
+	bool hit;
 
-	/* take out of re-transmit chain */
-	l = &arp->rxmt;
-	for (f = *l; f; f = f->nextrxt) {
-		if (f == a) {
-			*l = a->nextrxt;
-			break;
-		}
-		l = &f->nextrxt;
+	rcu_read_lock();
+	a = arp_find(rcu_dereference(arp->tbl), hash, ip, type);
+	if (a == NULL) {
+		rcu_read_unlock();
+		return FALSE;
 	}
-	a->nextrxt = NULL;
-	a->hash = NULL;
-	a->hold = NULL;
-	a->last = NULL;
-	a->ifc = NULL;
+	do {
+		seq = ACCESS_ONCE(a->seq);
+		rmb();
+		hit = (a->state == AOK) && (now - a->ctime <= ARP_MAX_AGE);
+		if (hit)
+			memmove(mac, a->mac, type->maclen);
+	} while (seqctr_retry(seq, ACCESS_ONCE(a->seq)));
+	if (hit)
+		a->utime = now;
+	rcu_read_unlock();
+	return hit;
 }
 
 /*
@@ -232,27 +398,27 @@ void cleanarpent(struct arp *arp, struct arpent *a)
 struct arpent *arpget(struct arp *arp, struct block *bp, int version,
                       struct Ipifc *ifc, uint8_t *ip, uint8_t *mac)
 {
-	int hash, len;
+	uint32_t hash;
+	qlock_t *lock;
 	struct arpent *a;
 	struct medium *type = ifc->m;
 	uint8_t v6ip[IPaddrlen];
-	uint16_t *s, *d;
 
 	if (version == V4) {
 		v4tov6(v6ip, ip);
 		ip = v6ip;
 	}
 
-	qlock(&arp->qlock);
-	hash = haship(ip);
-	for (a = arp->hash[hash]; a; a = a->hash) {
-		if (ipcmp(ip, a->ip) == 0)
-			if (type == a->type)
-				break;
-	}
+	hash = ipaddrhash(ip);
+	if (arpget_fast(arp, hash, ip, type, mac))
+		return NULL;
 
+	arp_grow(arp);
+	lock = arp_lock(arp, hash);
+	qlock(lock);
+	a = arp_find(arp->tbl, hash, ip, type);
 	if (a == NULL) {
-		a = newarp6(arp, ip, ifc, (version != V4));
+		a = newarp6(arp, ip, hash, ifc, (version != V4));
 		a->state = AWAIT;
 	}
 	a->utime = NOW;
@@ -265,67 +431,58 @@ struct arpent *arpget(struct arp *arp, struct block *bp, int version,
 			a->last = bp;
 			bp->list = NULL;
 		}
-		return a;	/* return with arp qlocked */
+		return a;	/* return with a's lock held */
 	}
 
-	s = (uint16_t *)a->mac;
-	d = (uint16_t *)mac;
-	len = a->type->maclen / 2;
-	while (len) {
-		*d++ = *s++;
-		len--;
-	}
+	memmove(mac, a->mac, a->type->maclen);
 
 	/* remove old entries */
-	if (NOW - a->ctime > 15 * 60 * 1000)
+	if (NOW - a->ctime > ARP_MAX_AGE)
 		cleanarpent(arp, a);
 
-	qunlock(&arp->qlock);
+	qunlock(lock);
 	return NULL;
 }
 
 /*
- * called with arp locked
+ * called with a's lock held.  a might be gone as soon as we return.
  */
 void arprelease(struct arp *arp, struct arpent *a)
 {
-	qunlock(&arp->qlock);
+	qunlock(arpent_lock(arp, a));
 }
 
 /*
  * Copy out the mac address from the arpent.  Return the
  * block waiting to get sent to this mac address.
  *
- * called with arp locked
+ * called with a's lock held
  */
 struct block *arpresolve(struct arp *arp, struct arpent *a, struct medium *type,
                          uint8_t *mac)
 {
 	struct block *bp;
-	struct arpent *f, **l;
 
 	if (!isv4(a->ip)) {
-		l = &arp->rxmt;
-		for (f = *l; f; f = f->nextrxt) {
-			if (f == a) {
-				*l = a->nextrxt;
-				break;
-			}
-			l = &f->nextrxt;
-		}
+		spin_lock(&arp->rxmt_lock);
+		__rxmt_remove(arp, a);
+		spin_unlock(&arp->rxmt_lock);
 	}
 
+	__seq_start_write(&a->seq);
 	memmove(a->mac, mac, type->maclen);
 	a->type = type;
 	a->state = AOK;
+	__seq_end_write(&a->seq);
 	a->utime = NOW;
 	bp = a->hold;
 	a->hold = NULL;
+	a->last = NULL;
 	/* brho: it looks like we return the entire hold list, though it might be
 	 * purged by now via some other crazy arp list management.  our callers
 	 * can't handle the arp's b->list stuff. */
 	assert(!bp->list);
-	qunlock(&arp->qlock);
+	arprelease(arp, a);
 
 	return bp;
 }
@@ -336,11 +493,13 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 	ERRSTACK(1);
 	struct arp *arp;
 	struct route *r;
-	struct arpent *a, *f, **l;
+	struct arpent *a;
 	struct Ipifc *ifc;
 	struct medium *type;
 	struct block *bp, *next;
 	uint8_t v6ip[IPaddrlen];
+	uint32_t hash;
+	qlock_t *lock;
 
 	arp = fs->arp;
 
@@ -369,36 +528,37 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 	ifc = r->rt.ifc;
 	type = ifc->m;
 
-	qlock(&arp->qlock);
-	for (a = arp->hash[haship(ip)]; a; a = a->hash) {
+	arp_grow(arp);
+	hash = ipaddrhash(ip);
+	lock = arp_lock(arp, hash);
+	qlock(lock);
+	for (a = arp->tbl->b[hash & arp->tbl->mask]; a; a = a->hash) {
 		if (a->type != type || (a->state != AWAIT && a->state != AOK))
 			continue;
 
 		if (ipcmp(a->ip, ip) == 0) {
+			__seq_start_write(&a->seq);
 			a->state = AOK;
 			memmove(a->mac, mac, type->maclen);
+			a->utime = NOW;
+			a->ctime = a->utime;
+			__seq_end_write(&a->seq);
 
 			if (version == V6) {
 				/* take out of re-transmit chain */
-				l = &arp->rxmt;
-				for (f = *l; f; f = f->nextrxt) {
-					if (f == a) {
-						*l = a->nextrxt;
-						break;
-					}
-					l = &f->nextrxt;
-				}
+				spin_lock(&arp->rxmt_lock);
+				__rxmt_remove(arp, a);
+				spin_unlock(&arp->rxmt_lock);
 			}
 
 			a->ifc = ifc;
 			a->ifcid = ifc->ifcid;
 			bp = a->hold;
 			a->hold = NULL;
+			a->last = NULL;
 			if (version == V4)
 				ip += IPv4off;
-			a->utime = NOW;
-			a->ctime = a->utime;
-			qunlock(&arp->qlock);
+			qunlock(lock);
 
 			while (bp) {
 				next = bp->list;
@@ -423,14 +583,16 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 	}
 
 	if (refresh == 0) {
-		a = newarp6(arp, ip, ifc, 0);
+		a = newarp6(arp, ip, hash, ifc, 0);
+		__seq_start_write(&a->seq);
 		a->state = AOK;
 		a->type = type;
 		a->ctime = NOW;
 		memmove(a->mac, mac, type->maclen);
+		__seq_end_write(&a->seq);
 	}
 
-	qunlock(&arp->qlock);
+	qunlock(lock);
 }
 
 int arpwrite(struct Fs *fs, char *s, long len)
@@ -438,11 +600,14 @@ int arpwrite(struct Fs *fs, char *s, long len)
 	int n;
 	struct route *r;
 	struct arp *arp;
-	struct block *bp;
-	struct arpent *a, *fl, **l;
+	struct arp_tbl *t;
+	struct block *bp, *bnext;
+	struct arpent *a, *next;
 	struct medium *m;
 	char *f[4], buf[256];
 	uint8_t ip[IPaddrlen], mac[MAClen];
+	uint32_t hash;
+	qlock_t *lock;
 
 	arp = fs->arp;
 
@@ -456,25 +621,34 @@ int arpwrite(struct Fs *fs, char *s, long len)
 
 	n = getfields(buf, f, 4, 1, " ");
 	if (strcmp(f[0], "flush") == 0) {
-		qlock(&arp->qlock);
-		for (a = arp->cache; a < &arp->cache[NCACHE]; a++) {
-			memset(a->ip, 0, sizeof(a->ip));
-			memset(a->mac, 0, sizeof(a->mac));
-			a->hash = NULL;
-			a->state = 0;
-			a->utime = 0;
-			while (a->hold != NULL) {
-				bp = a->hold->list;
-				freeblist(a->hold);
-				a->hold = bp;
+		arp_lock_all(arp);
+		t = arp->tbl;
+		for (int i = 0; i <= t->mask; i++) {
+			a = t->b[i];
+			ACCESS_ONCE(t->b[i]) = NULL;
+			for (; a; a = next) {
+				next = a->hash;
+				while (a->hold != NULL) {
+					bp = a->hold->list;
+					freeblist(a->hold);
+					a->hold = bp;
+				}
+				kfree_rcu(a, rcu);
 			}
 		}
-		memset(arp->hash, 0, sizeof(arp->hash));
+		atomic_set(&arp->nr_ents, 0);
 		/* clear all pkts on these lists (rxmt, dropf/l) */
+		spin_lock(&arp->rxmt_lock);
 		arp->rxmt = NULL;
+		bp = arp->dropf;
 		arp->dropf = NULL;
 		arp->dropl = NULL;
-		qunlock(&arp->qlock);
+		spin_unlock(&arp->rxmt_lock);
+		arp_unlock_all(arp);
+		for (; bp; bp = bnext) {
+			bnext = bp->list;
+			freeblist(bp);
+		}
 	} else if (strcmp(f[0], "add") == 0) {
 		switch (n) {
 			default:
@@ -508,37 +682,21 @@ int arpwrite(struct Fs *fs, char *s, long len)
 			error(EINVAL, ERROR_FIXME);
 
 		parseip(ip, f[1]);
-		qlock(&arp->qlock);
+		hash = ipaddrhash(ip);
+		lock = arp_lock(arp, hash);
+		qlock(lock);
 
-		l = &arp->hash[haship(ip)];
-		for (a = *l; a; a = a->hash) {
-			if (memcmp(ip, a->ip, sizeof(a->ip)) == 0) {
-				*l = a->hash;
+		t = arp->tbl;
+		for (a = t->b[hash & t->mask]; a; a = a->hash) {
+			if (memcmp(ip, a->ip, sizeof(a->ip)) == 0)
 				break;
-			}
-			l = &a->hash;
 		}
 
 		if (a) {
-			/* take out of re-transmit chain */
-			l = &arp->rxmt;
-			for (fl = *l; fl; fl = fl->nextrxt) {
-				if (fl == a) {
-					*l = a->nextrxt;
-					break;
-				}
-				l = &fl->nextrxt;
-			}
-
-			a->nextrxt = NULL;
-			a->hash = NULL;
-			a->hold = NULL;
-			a->last = NULL;
-			a->ifc = NULL;
-			memset(a->ip, 0, sizeof(a->ip));
-			memset(a->mac, 0, sizeof(a->mac));
+			dumphold(arp, a);
+			cleanarpent(arp, a);
 		}
-		qunlock(&arp->qlock);
+		qunlock(lock);
 	} else
 		error(EINVAL, ERROR_FIXME);
 
@@ -553,6 +711,7 @@ static char *aformat = "%-6.6s %-8.8s %-40.40I %E\n";
 
 int arpread(struct arp *arp, char *p, uint32_t offset, int len)
 {
+	struct arp_tbl *t;
 	struct arpent *a;
 	int n;
 	int left = len;
@@ -564,106 +723,112 @@ int arpread(struct arp *arp, char *p, uint32_t offset, int len)
 	offset = offset / Alinelen;
 	len = len / Alinelen;
 
+	/* an entry's lock never changes, so each lock's buckets stay put while we
+	 * hold it, even if the table grows in between */
 	n = 0;
-	for (a = arp->cache; len > 0 && a < &arp->cache[NCACHE]; a++) {
-		if (a->state == 0)
-			continue;
-		if (offset > 0) {
-			offset--;
-			continue;
+	for (int i = 0; len > 0 && i < NARPLOCK; i++) {
+		qlock(&arp->locks[i]);
+		t = arp->tbl;
+		for (int j = i; len > 0 && j <= t->mask; j += NARPLOCK) {
+			for (a = t->b[j]; len > 0 && a; a = a->hash) {
+				if (a->state == 0)
+					continue;
+				if (offset > 0) {
+					offset--;
+					continue;
+				}
+				len--;
+				left--;
+				amt = snprintf(p + n, left, aformat, a->type->name,
+				               arpstate[a->state], a->ip, a->mac);
+				n += amt;
+				left -= amt;
+			}
 		}
-		len--;
-		left--;
-		qlock(&arp->qlock);
-		amt = snprintf(p + n, left, aformat, a->type->name, arpstate[a->state],
-		               a->ip, a->mac);
-		n += amt;
-		left -= amt;
-		qunlock(&arp->qlock);
+		qunlock(&arp->locks[i]);
 	}
 
 	return n;
 }
 
+/* Retransmits the first solicitation on the rxmt chain, if it's due, dropping
+ * entries that ran out of tries or lost their ifc along the way.  Returns how
+ * long until the next one is due, or 0 if there's none. */
 static uint64_t rxmitsols(struct arp *arp)
 {
 	unsigned int sflag;
 	struct block *next, *xp;
-	struct arpent *a, *b, **l;
+	struct arpent *a;
 	struct Fs *f;
-	uint8_t ipsrc[IPaddrlen];
+	uint8_t ip[IPaddrlen], ipsrc[IPaddrlen];
 	struct Ipifc *ifc = NULL;
+	qlock_t *lock;
 	uint64_t nrxt;
 
-	qlock(&arp->qlock);
 	f = arp->f;
 
-	a = arp->rxmt;
-	if (a == NULL) {
-		nrxt = 0;
-		goto dodrops;	/* return nrxt; */
-	}
-	nrxt = a->rtime - NOW;
-	if (nrxt > 3 * ReTransTimer / 4)
-		goto dodrops;	/* return nrxt; */
+	for (;;) {
+		spin_lock(&arp->rxmt_lock);
+		a = arp->rxmt;
+		if (a == NULL) {
+			nrxt = 0;
+			goto dodrops;	/* return nrxt; */
+		}
+		nrxt = a->rtime - NOW;
+		if (nrxt > 3 * ReTransTimer / 4)
+			goto dodrops;	/* return nrxt; */
+
+		/* the entry lock comes first.  whatever is at the head once we have
+		 * both is fine, so long as it is under the same lock. */
+		lock = arpent_lock(arp, a);
+		spin_unlock(&arp->rxmt_lock);
+		qlock(lock);
+		spin_lock(&arp->rxmt_lock);
+		a = arp->rxmt;
+		if (a == NULL || arpent_lock(arp, a) != lock) {
+			spin_unlock(&arp->rxmt_lock);
+			qunlock(lock);
+			continue;
+		}
 
-	for (; a; a = a->nextrxt) {
 		ifc = a->ifc;
 		assert(ifc != NULL);
-		if ((a->rxtsrem <= 0) || !(canrlock(&ifc->rwlock))
-			|| (a->ifcid != ifc->ifcid)) {
-			xp = a->hold;
-			a->hold = NULL;
-
-			if (xp) {
-				if (arp->dropl == NULL)
-					arp->dropf = xp;
-				else
-					arp->dropl->list = xp;
-			}
-
-			cleanarpent(arp, a);
-		} else
-			break;
+		if ((a->rxtsrem > 0) && canrlock(&ifc->rwlock)) {
+			if (a->ifcid == ifc->ifcid)
+				break;
+			runlock(&ifc->rwlock);
+		}
+		xp = a->hold;
+		a->hold = NULL;
+		a->last = NULL;
+		if (xp)
+			__queue_drops(arp, xp);
+		spin_unlock(&arp->rxmt_lock);
+		cleanarpent(arp, a);
+		qunlock(lock);
 	}
-	if (a == NULL)
-		goto dodrops;
-
-	qunlock(&arp->qlock);	/* for icmpns */
-	if ((sflag = ipv6anylocal(ifc, ipsrc)) != SRC_UNSPEC)
-		icmpns(f, ipsrc, sflag, a->ip, TARG_MULTI, ifc->mac);
-
-	runlock(&ifc->rwlock);
-	qlock(&arp->qlock);
 
 	/* put to the end of re-transmit chain */
-	l = &arp->rxmt;
-	for (b = *l; b; b = b->nextrxt) {
-		if (b == a) {
-			*l = a->nextrxt;
-			break;
-		}
-		l = &b->nextrxt;
-	}
-	for (b = *l; b; b = b->nextrxt) {
-		l = &b->nextrxt;
-	}
-	*l = a;
+	__rxmt_append(arp, a);
 	a->rxtsrem--;
-	a->nextrxt = NULL;
 	a->rtime = NOW + ReTransTimer;
+	memmove(ip, a->ip, sizeof(ip));
+	nrxt = arp->rxmt->rtime - NOW;
+	spin_unlock(&arp->rxmt_lock);
+	qunlock(lock);
 
-	a = arp->rxmt;
-	if (a == NULL)
-		nrxt = 0;
-	else
-		nrxt = a->rtime - NOW;
+	/* for icmpns */
+	if ((sflag = ipv6anylocal(ifc, ipsrc)) != SRC_UNSPEC)
+		icmpns(f, ipsrc, sflag, ip, TARG_MULTI, ifc->mac);
+
+	runlock(&ifc->rwlock);
+	spin_lock(&arp->rxmt_lock);
 
 dodrops:
 	xp = arp->dropf;
 	arp->dropf = NULL;
 	arp->dropl = NULL;
-	qunlock(&arp->qlock);
+	spin_unlock(&arp->rxmt_lock);
 
 	for (; xp; xp = next) {
 		next = xp->list;
@@ -702,7 +867,8 @@ static void rxmitproc(void *v)
 		if (wakeupat == 0)
 			rendez_sleep(&arp->rxmtq, rxready, v);
 		else if (wakeupat > ReTransTimer / 4)
-			kthread_usleep(wakeupat * 1000);
+			kthread_usleep_slack(wakeupat * 1000,
+			                     ReTransTimer / 4 * 1000);
 	}
 	poperror();
 }
@@ -0,0 +1,416 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Packet filters for #ether conversations.  See ros/bpf.h.
+ *
+ * We check a program once, when it's attached, so bpf_run() doesn't have to:
+ * every opcode is one we know, every jump lands inside the program, the last
+ * instruction returns, and scratch memory indices and constant divisors are
+ * sane.  Jumps only go forward, so every run ends at a RET.  Packet loads are
+ * still checked at run time.
+ *
+ * etheriq() runs the filters from whatever context the driver hands it
+ * packets, so the netfile's pointer to its program is RCU protected, like its
+ * capring. */
+
+#include <ip.h>
+#include <ros/bpf.h>
+#include <kmalloc.h>
+#include <rcu.h>
+#include <process.h>
+#include <smp.h>
+#include <string.h>
+#include <stdio.h>
+#include <error.h>
+#include <assert.h>
+
+struct bpf_prog {
+	unsigned int				nr;
+	struct bpf_insn				insns[];
+};
+
+/* Returns a pointer to the n bytes of bp at off, or 0 if they go past the end
+ * of the frame.  If they aren't all in the main body, we copy them to buf. */
+static uint8_t *bpf_ptr(struct block *bp, uint64_t off, uint32_t n,
+                        uint8_t *buf)
+{
+	struct extra_bdata *ebd;
+	uint8_t *p = buf;
+	uint32_t amt;
+
+	if (off + n <= BHLEN(bp))
+		return bp->rp + off;
+	if (off + n > BLEN(bp))
+		return 0;
+	if (off < BHLEN(bp)) {
+		amt = BHLEN(bp) - off;
+		memcpy(p, bp->rp + off, amt);
+		p += amt;
+		n -= amt;
+		off = 0;
+	} else {
+		off -= BHLEN(bp);
+	}
+	for (int i = 0; (i < bp->nr_extra_bufs) && n; i++) {
+		ebd = &bp->extra_data[i];
+		if (!ebd->base || !ebd->len)
+			continue;
+		if (off >= ebd->len) {
+			off -= ebd->len;
+			continue;
+		}
+		amt = MIN(ebd->len - off, n);
+		memcpy(p, (void*)(ebd->base + ebd->off + off), amt);
+		p += amt;
+		n -= amt;
+		off = 0;
+	}
+	return buf;
+}
+
+/* Returns how many bytes of bp to keep, at most BLEN(bp).  Call from an RCU
+ * read-side section, which keeps prog around. */
+uint32_t bpf_run(struct bpf_prog *prog, struct block *bp)
+{
+	struct bpf_insn *pc = prog->insns;
+	uint32_t len = BLEN(bp);
+	uint32_t A = 0, X = 0;
+	uint32_t mem[BPF_MEMWORDS] = {0};
+	uint8_t buf[4], *p;
+
+	for (;; pc++) {
+		switch (pc->code) {
+		case BPF_RET | BPF_K:
+			return MIN(pc->k, len);
+		case BPF_RET | BPF_A:
+			return MIN(A, len);
+
+		case BPF_LD | BPF_W | BPF_ABS:
+			if (!(p = bpf_ptr(bp, pc->k, 4, buf)))
+				return 0;
+			A = nhgetl(p);
+			break;
+		case BPF_LD | BPF_H | BPF_ABS:
+			if (!(p = bpf_ptr(bp, pc->k, 2, buf)))
+				return 0;
+			A = nhgets(p);
+			break;
+		case BPF_LD | BPF_B | BPF_ABS:
+			if (!(p = bpf_ptr(bp, pc->k, 1, buf)))
+				return 0;
+			A = *p;
+			break;
+		case BPF_LD | BPF_W | BPF_IND:
+			if (!(p = bpf_ptr(bp, (uint64_t)X + pc->k, 4, buf)))
+				return 0;
+			A = nhgetl(p);
+			break;
+		case BPF_LD | BPF_H | BPF_IND:
+			if (!(p = bpf_ptr(bp, (uint64_t)X + pc->k, 2, buf)))
+				return 0;
+			A = nhgets(p);
+			break;
+		case BPF_LD | BPF_B | BPF_IND:
+			if (!(p = bpf_ptr(bp, (uint64_t)X + pc->k, 1, buf)))
+				return 0;
+			A = *p;
+			break;
+		case BPF_LD | BPF_W | BPF_LEN:
+			A = len;
+			break;
+		case BPF_LD | BPF_IMM:
+			A = pc->k;
+			break;
+		case BPF_LD | BPF_MEM:
+			A = mem[pc->k];
+			break;
+		case BPF_LDX | BPF_W | BPF_IMM:
+			X = pc->k;
+			break;
+		case BPF_LDX | BPF_W | BPF_LEN:
+			X = len;
+			break;
+		case BPF_LDX | BPF_W | BPF_MEM:
+			X = mem[pc->k];
+			break;
+		case BPF_LDX | BPF_B | BPF_MSH:
+			if (!(p = bpf_ptr(bp, pc->k, 1, buf)))
+				return 0;
+			X = (*p & 0xf) << 2;
+			break;
+		case BPF_ST:
+			mem[pc->k] = A;
+			break;
+		case BPF_STX:
+			mem[pc->k] = X;
+			break;
+
+		case BPF_ALU | BPF_ADD | BPF_K:
+			A += pc->k;
+			break;
+		case BPF_ALU | BPF_SUB | BPF_K:
+			A -= pc->k;
+			break;
+		case BPF_ALU | BPF_MUL | BPF_K:
+			A *= pc->k;
+			break;
+		case BPF_ALU | BPF_DIV | BPF_K:
+			A /= pc->k;
+			break;
+		case BPF_ALU | BPF_MOD | BPF_K:
+			A %= pc->k;
+			break;
+		case BPF_ALU | BPF_AND | BPF_K:
+			A &= pc->k;
+			break;
+		case BPF_ALU | BPF_OR | BPF_K:
+			A |= pc->k;
+			break;
+		case BPF_ALU | BPF_XOR | BPF_K:
+			A ^= pc->k;
+			break;
+		case BPF_ALU | BPF_LSH | BPF_K:
+			A = pc->k < 32 ? A << pc->k : 0;
+			break;
+		case BPF_ALU | BPF_RSH | BPF_K:
+			A = pc->k < 32 ? A >> pc->k : 0;
+			break;
+		case BPF_ALU | BPF_ADD | BPF_X:
+			A += X;
+			break;
+		case BPF_ALU | BPF_SUB | BPF_X:
+			A -= X;
+			break;
+		case BPF_ALU | BPF_MUL | BPF_X:
+			A *= X;
+			break;
+		case BPF_ALU | BPF_DIV | BPF_X:
+			if (!X)
+				return 0;
+			A /= X;
+			break;
+		case BPF_ALU | BPF_MOD | BPF_X:
+			if (!X)
+				return 0;
+			A %= X;
+			break;
+		case BPF_ALU | BPF_AND | BPF_X:
+			A &= X;
+			break;
+		case BPF_ALU | BPF_OR | BPF_X:
+			A |= X;
+			break;
+		case BPF_ALU | BPF_XOR | BPF_X:
+			A ^= X;
+			break;
+		case BPF_ALU | BPF_LSH | BPF_X:
+			A = X < 32 ? A << X : 0;
+			break;
+		case BPF_ALU | BPF_RSH | BPF_X:
+			A = X < 32 ? A >> X : 0;
+			break;
+		case BPF_ALU | BPF_NEG:
+			A = -A;
+			break;
+
+		case BPF_JMP | BPF_JA:
+			pc += pc->k;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_K:
+			pc += (A == pc->k) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_K:
+			pc += (A > pc->k) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_K:
+			pc += (A >= pc->k) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_K:
+			pc += (A & pc->k) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_X:
+			pc += (A == X) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_X:
+			pc += (A > X) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_X:
+			pc += (A >= X) ? pc->jt : pc->jf;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_X:
+			pc += (A & X) ? pc->jt : pc->jf;
+			break;
+
+		case BPF_MISC | BPF_TAX:
+			X = A;
+			break;
+		case BPF_MISC | BPF_TXA:
+			A = X;
+			break;
+		default:
+			/* bpf_insn_ok() let in something we can't run */
+			panic("Bad BPF opcode 0x%x", pc->code);
+		}
+	}
+}
+
+/* Checks the instruction at pc, one of nr. */
+static bool bpf_insn_ok(struct bpf_insn *ins, unsigned int pc, unsigned int nr)
+{
+	unsigned int left = nr - pc - 1;	/* how far we can jump */
+
+	switch (ins->code) {
+	case BPF_RET | BPF_K:
+	case BPF_RET | BPF_A:
+	case BPF_LD | BPF_W | BPF_ABS:
+	case BPF_LD | BPF_H | BPF_ABS:
+	case BPF_LD | BPF_B | BPF_ABS:
+	case BPF_LD | BPF_W | BPF_IND:
+	case BPF_LD | BPF_H | BPF_IND:
+	case BPF_LD | BPF_B | BPF_IND:
+	case BPF_LD | BPF_W | BPF_LEN:
+	case BPF_LD | BPF_IMM:
+	case BPF_LDX | BPF_W | BPF_IMM:
+	case BPF_LDX | BPF_W | BPF_LEN:
+	case BPF_LDX | BPF_B | BPF_MSH:
+	case BPF_ALU | BPF_ADD | BPF_K:
+	case BPF_ALU | BPF_SUB | BPF_K:
+	case BPF_ALU | BPF_MUL | BPF_K:
+	case BPF_ALU | BPF_AND | BPF_K:
+	case BPF_ALU | BPF_OR | BPF_K:
+	case BPF_ALU | BPF_XOR | BPF_K:
+	case BPF_ALU | BPF_LSH | BPF_K:
+	case BPF_ALU | BPF_RSH | BPF_K:
+	case BPF_ALU | BPF_ADD | BPF_X:
+	case BPF_ALU | BPF_SUB | BPF_X:
+	case BPF_ALU | BPF_MUL | BPF_X:
+	case BPF_ALU | BPF_DIV | BPF_X:
+	case BPF_ALU | BPF_MOD | BPF_X:
+	case BPF_ALU | BPF_AND | BPF_X:
+	case BPF_ALU | BPF_OR | BPF_X:
+	case BPF_ALU | BPF_XOR | BPF_X:
+	case BPF_ALU | BPF_LSH | BPF_X:
+	case BPF_ALU | BPF_RSH | BPF_X:
+	case BPF_ALU | BPF_NEG:
+	case BPF_MISC | BPF_TAX:
+	case BPF_MISC | BPF_TXA:
+		return TRUE;
+	case BPF_LD | BPF_MEM:
+	case BPF_LDX | BPF_W | BPF_MEM:
+	case BPF_ST:
+	case BPF_STX:
+		return ins->k < BPF_MEMWORDS;
+	case BPF_ALU | BPF_DIV | BPF_K:
+	case BPF_ALU | BPF_MOD | BPF_K:
+		return ins->k != 0;
+	case BPF_JMP | BPF_JA:
+		return ins->k < left;
+	case BPF_JMP | BPF_JEQ | BPF_K:
+	case BPF_JMP | BPF_JGT | BPF_K:
+	case BPF_JMP | BPF_JGE | BPF_K:
+	case BPF_JMP | BPF_JSET | BPF_K:
+	case BPF_JMP | BPF_JEQ | BPF_X:
+	case BPF_JMP | BPF_JGT | BPF_X:
+	case BPF_JMP | BPF_JGE | BPF_X:
+	case BPF_JMP | BPF_JSET | BPF_X:
+		return ins->jt < left && ins->jf < left;
+	}
+	return FALSE;
+}
+
+/* Parses the next number at *p, which can come after newlines, like in
+ * tcpdump's output.  Throws if there isn't one or it's more than max. */
+static uint32_t bpf_num(char **p, uint32_t max)
+{
+	char *s = *p;
+	unsigned long v;
+
+	while (*s == ' ' || *s == '\t' || *s == '\n')
+		s++;
+	v = strtoul(s, p, 0);
+	if (*p == s)
+		error(EINVAL, "bpf: program too short, or junk at '%.8s'", s);
+	if (v > max)
+		error(EINVAL, "bpf: %lu is out of range", v);
+	return v;
+}
+
+static struct bpf_prog *bpf_parse(char *p)
+{
+	ERRSTACK(1);
+	struct bpf_prog *prog;
+	struct bpf_insn *ins;
+	uint32_t nr;
+
+	nr = bpf_num(&p, BPF_MAXINSNS);
+	if (!nr)
+		error(EINVAL, "bpf: empty program");
+	prog = kmalloc(sizeof(struct bpf_prog) + nr * sizeof(struct bpf_insn),
+	               MEM_WAIT);
+	prog->nr = nr;
+	if (waserror()) {
+		kfree(prog);
+		nexterror();
+	}
+	for (int i = 0; i < nr; i++) {
+		ins = &prog->insns[i];
+		ins->code = bpf_num(&p, UINT16_MAX);
+		ins->jt = bpf_num(&p, UINT8_MAX);
+		ins->jf = bpf_num(&p, UINT8_MAX);
+		ins->k = bpf_num(&p, UINT32_MAX);
+		if (!bpf_insn_ok(ins, i, nr))
+			error(EINVAL, "bpf: bad instruction %d, code 0x%x", i,
+			      ins->code);
+	}
+	if (BPF_CLASS(prog->insns[nr - 1].code) != BPF_RET)
+		error(EINVAL, "bpf: program doesn't end with a ret");
+	poperror();
+	return prog;
+}
+
+/* Handles "filter ..." writes to f's ctl.  a is the whole write, which can be
+ * longer than most ctl messages.  Hold the netif's qlock.  Throws on error. */
+void bpf_attach(struct netfile *f, void *a, long n)
+{
+	ERRSTACK(1);
+	struct bpf_prog *prog, *old;
+	char *cmd, *p;
+
+	/* Plenty for BPF_MAXINSNS, in hex */
+	if (n > BPF_MAXINSNS * 32)
+		error(EINVAL, "bpf: ctl message is too long");
+	cmd = kmalloc(n + 1, MEM_WAIT);
+	memmove(cmd, a, n);
+	cmd[n] = 0;
+	if (waserror()) {
+		kfree(cmd);
+		nexterror();
+	}
+	p = cmd + strlen("filter");
+	while (*p == ' ' || *p == '\t')
+		p++;
+	if (!strncmp(p, "off", 3))
+		prog = NULL;
+	else
+		prog = bpf_parse(p);
+	poperror();
+	kfree(cmd);
+	old = f->filter;
+	rcu_assign_pointer(f->filter, prog);
+	if (old) {
+		synchronize_rcu();
+		kfree(old);
+	}
+}
+
+/* Unhooks and frees f's program, if any.  Blocks. */
+void bpf_detach(struct netfile *f)
+{
+	struct bpf_prog *prog = f->filter;
+
+	if (!prog)
+		return;
+	rcu_assign_pointer(f->filter, NULL);
+	synchronize_rcu();
+	kfree(prog);
+}
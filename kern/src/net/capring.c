@@ -0,0 +1,235 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Memory-mapped packet capture rings.  See ros/capring.h.
+ *
+ * etheriq() writes frames straight into the ring, from whatever context the
+ * driver hands it packets, so the producer side takes an irqsave lock: with
+ * multiqueue NICs, several cores can be writing at once.  Like the sysrings,
+ * we keep our own copies of the indices and sizes and only read the user's
+ * head, once per frame.
+ *
+ * The netfile's pointer to the ring is RCU protected.  etheriq() can't block,
+ * so closing the file unhooks the ring and waits out the readers before
+ * dropping the pages.  send_event() doesn't work from IRQ context, so batch
+ * events go out from an RKM, which holds its own proc ref. */
+
+#include <ip.h>
+#include <ros/capring.h>
+#include <process.h>
+#include <event.h>
+#include <kmalloc.h>
+#include <pmap.h>
+#include <mm.h>
+#include <smp.h>
+#include <trap.h>
+#include <umem.h>
+#include <time.h>
+#include <string.h>
+#include <stdio.h>
+#include <error.h>
+#include <assert.h>
+
+struct net_capring {
+	spinlock_t					lock;
+	struct capring				*ring;		/* KVA of the shared ring */
+	size_t						order;
+	void						*uva;
+	uint32_t					mask;
+	uint32_t					frame_sz;
+	uint32_t					snaplen;
+	uint32_t					tail;
+	uint64_t					nr_drops;
+	struct proc					*proc;		/* ref'd iff ev_q */
+	struct event_queue			*ev_q;		/* user pointer, may be 0 */
+	uint16_t					ev_id;
+	uint32_t					batch;
+	uint32_t					nr_unsent;	/* frames since the last event */
+};
+
+/* RKM, sends one batch event.  a2 is ev_id << 32 | batch.  Eats a proc ref. */
+static void __capring_notify(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct proc *p = (struct proc*)a0;
+	struct event_msg msg;
+
+	memset(&msg, 0, sizeof(struct event_msg));
+	msg.ev_type = a2 >> 32;
+	msg.ev_arg2 = (uint32_t)a2;
+	send_event(p, (struct event_queue*)a1, &msg, 0);
+	proc_decref(p);
+}
+
+/* Copies up to caplen bytes of bp, including its extra data, to va. */
+static void capring_copy(struct block *bp, uint8_t *va, uint32_t caplen)
+{
+	struct extra_bdata *ebd;
+	uint32_t amt;
+
+	amt = MIN(BHLEN(bp), caplen);
+	memcpy(va, bp->rp, amt);
+	va += amt;
+	caplen -= amt;
+	for (int i = 0; (i < bp->nr_extra_bufs) && caplen; i++) {
+		ebd = &bp->extra_data[i];
+		if (!ebd->base || !ebd->len)
+			continue;
+		amt = MIN(ebd->len, caplen);
+		memcpy(va, (void*)(ebd->base + ebd->off), amt);
+		va += amt;
+		caplen -= amt;
+	}
+}
+
+/* Called from etheriq(), in any context, with at most snap bytes of bp to
+ * keep.  Doesn't consume bp. */
+void capring_put(struct net_capring *ncr, struct block *bp, uint32_t snap)
+{
+	struct capring *cr = ncr->ring;
+	struct capring_frame *frame;
+	uint32_t len = BLEN(bp);
+	uint32_t caplen = MIN(MIN(len, snap), ncr->snaplen);
+	bool notify = FALSE;
+
+	spin_lock_irqsave(&ncr->lock);
+	if (ncr->tail - ACCESS_ONCE(cr->head) > ncr->mask) {
+		ncr->nr_drops++;
+		ACCESS_ONCE(cr->nr_drops) = ncr->nr_drops;
+		spin_unlock_irqsave(&ncr->lock);
+		return;
+	}
+	frame = (struct capring_frame*)(cr->frames +
+	                                (ncr->tail & ncr->mask) * ncr->frame_sz);
+	frame->tstamp = tsc2nsec(read_tsc());
+	frame->len = len;
+	frame->caplen = caplen;
+	capring_copy(bp, frame->data, caplen);
+	wmb();	/* the frame must be visible before the tail */
+	ncr->tail++;
+	ACCESS_ONCE(cr->tail) = ncr->tail;
+	if (ncr->ev_q && (++ncr->nr_unsent == ncr->batch)) {
+		ncr->nr_unsent = 0;
+		notify = TRUE;
+	}
+	spin_unlock_irqsave(&ncr->lock);
+	if (notify) {
+		proc_incref(ncr->proc, 1);
+		send_kernel_message(core_id(), __capring_notify, (long)ncr->proc,
+		                    (long)ncr->ev_q,
+		                    ((long)ncr->ev_id << 32) | ncr->batch,
+		                    KMSG_ROUTINE);
+	}
+}
+
+/* Maps the ring into p, which gets its own page refs. */
+static void *capring_map(struct proc *p, struct net_capring *ncr)
+{
+	size_t len = PGSIZE << ncr->order;
+	struct page *page = kva2page(ncr->ring);
+	void *uva;
+
+	uva = do_mmap(p, 0, len, PROT_READ | PROT_WRITE,
+	              MAP_SHARED | MAP_ANONYMOUS, NULL, 0);
+	if (uva == MAP_FAILED)
+		return MAP_FAILED;
+	spin_lock(&p->pte_lock);
+	for (int i = 0; i < 1 << ncr->order; i++) {
+		if (page_insert(p->env_pgdir, &page[i], uva + i * PGSIZE,
+		                PTE_USER_RW)) {
+			spin_unlock(&p->pte_lock);
+			munmap(p, (uintptr_t)uva, len);
+			return MAP_FAILED;
+		}
+	}
+	spin_unlock(&p->pte_lock);
+	return uva;
+}
+
+static void capring_put_pages(struct net_capring *ncr)
+{
+	struct page *page = kva2page(ncr->ring);
+
+	for (int i = 0; i < 1 << ncr->order; i++)
+		page_decref(&page[i]);
+}
+
+/* Sets up f's ring, mapped into the current process.  Hold f's netif qlock.
+ * Throws on error. */
+void capring_setup(struct netfile *f, uint32_t nr_frames, uint32_t snaplen,
+                   struct event_queue *ev_q, uint16_t ev_id, uint32_t batch)
+{
+	struct net_capring *ncr;
+
+	if (!IS_PWR2(nr_frames) || (nr_frames > CAPRING_MAX_FRAMES))
+		error(EINVAL, "capring: nr_frames %u must be a power of two <= %u",
+		      nr_frames, CAPRING_MAX_FRAMES);
+	if (!snaplen || (snaplen > CAPRING_MAX_SNAPLEN))
+		error(EINVAL, "capring: bad snaplen %u", snaplen);
+	if (CAPRING_SZ((size_t)nr_frames, snaplen) > CAPRING_MAX_SZ)
+		error(EINVAL, "capring: ring bigger than %d", CAPRING_MAX_SZ);
+	if (ev_q && (!batch || !is_user_rwaddr(ev_q, sizeof(*ev_q))))
+		error(EINVAL, "capring: bad ev_q %p or batch %u", ev_q, batch);
+	if (f->capring)
+		error(EBUSY, "capring: already set up");
+	ncr = kzmalloc(sizeof(struct net_capring), MEM_WAIT);
+	spinlock_init_irqsave(&ncr->lock);
+	ncr->order = LOG2_UP(nr_pages(CAPRING_SZ((size_t)nr_frames, snaplen)));
+	ncr->ring = get_cont_pages(ncr->order, 0);
+	if (!ncr->ring) {
+		kfree(ncr);
+		error(ENOMEM, "capring: no memory for %u frames", nr_frames);
+	}
+	memset(ncr->ring, 0, PGSIZE << ncr->order);
+	ncr->mask = nr_frames - 1;
+	ncr->snaplen = snaplen;
+	ncr->frame_sz = CAPRING_FRAME_SZ(snaplen);
+	ncr->ring->nr_frames = nr_frames;
+	ncr->ring->frame_sz = ncr->frame_sz;
+	ncr->uva = capring_map(current, ncr);
+	if (ncr->uva == MAP_FAILED) {
+		capring_put_pages(ncr);
+		kfree(ncr);
+		error(ENOMEM, "capring: could not map the ring");
+	}
+	if (ev_q) {
+		ncr->ev_q = ev_q;
+		ncr->ev_id = ev_id;
+		ncr->batch = batch;
+		ncr->proc = current;
+		proc_incref(current, 1);
+	}
+	rcu_assign_pointer(f->capring, ncr);
+}
+
+/* Unhooks and frees f's ring, if any.  Blocks. */
+void capring_free(struct netfile *f)
+{
+	struct net_capring *ncr = f->capring;
+
+	if (!ncr)
+		return;
+	rcu_assign_pointer(f->capring, NULL);
+	synchronize_rcu();
+	capring_put_pages(ncr);
+	if (ncr->proc)
+		proc_decref(ncr->proc);
+	kfree(ncr);
+}
+
+/* Reads "ADDR NR_FRAMES FRAME_SZ", or nothing if there's no ring. */
+long capring_read(struct netfile *f, void *va, long n, uint32_t offset)
+{
+	struct net_capring *ncr;
+	char buf[64];
+
+	qlock(&f->qlock);
+	ncr = f->capring;
+	if (!ncr) {
+		qunlock(&f->qlock);
+		return 0;
+	}
+	snprintf(buf, sizeof(buf), "%p %u %u\n", ncr->uva, ncr->mask + 1,
+	         ncr->frame_sz);
+	qunlock(&f->qlock);
+	return readstr(offset, va, n, buf);
+}
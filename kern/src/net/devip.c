@@ -39,6 +39,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <event.h>
 
 struct dev ipdevtab;
 
@@ -71,6 +72,7 @@ enum {
 	Qlocal,
 	Qremote,
 	Qstatus,
+	Qconvstats,
 	Qsnoop,
 
 	Logtype = 5,
@@ -83,6 +85,8 @@ enum {
 	Shiftproto = Logtype + Logconv,
 
 	Nfs = 32,
+
+	Maxfreeprobe = 8,	/* busy free convs Fsprotoclone() passes over */
 };
 #define TYPE(x) 	( ((uint32_t)(x).path) & Masktype )
 #define CONV(x) 	( (((uint32_t)(x).path) >> Shiftconv) & Maskconv )
@@ -99,6 +103,7 @@ extern void pktmediumlink(void);
 extern char *eve;
 static long ndbwrite(struct Fs *, char *unused_char_p_t, uint32_t, int);
 static void closeconv(struct conv *);
+static void conv_put_free(struct conv *c);
 
 static struct conv *chan2conv(struct chan *chan)
 {
@@ -170,6 +175,11 @@ static int ip3gen(struct chan *c, int i, struct dir *dp)
 		case Qstatus:
 			p = "status";
 			break;
+		case Qconvstats:
+			if (!cv->p->convstats)
+				return 0;
+			p = "stats";
+			break;
 	}
 	return founddevdir(c, q, p, 0, cv->owner, 0444, dp);
 }
@@ -290,6 +300,7 @@ ipgen(struct chan *c, char *unused_char_p_t, struct dirtab *d, int unused_int,
 		case Qlocal:
 		case Qremote:
 		case Qstatus:
+		case Qconvstats:
 		case Qsnoop:
 			return ip3gen(c, TYPE(c->qid), dp);
 	}
@@ -437,6 +448,7 @@ static struct chan *ipopen(struct chan *c, int omode)
 		case Qprotodir:
 		case Qconvdir:
 		case Qstatus:
+		case Qconvstats:
 		case Qremote:
 		case Qlocal:
 		case Qstats:
@@ -560,6 +572,7 @@ static struct chan *ipopen(struct chan *c, int omode)
 				nc = cv->incall;
 				if (nc != NULL) {
 					cv->incall = nc->next;
+					cv->nincall--;
 					mkqid(&c->qid, QID(PROTO(c->qid), nc->x, Qctl), 0, QTFILE);
 					kstrdup(&cv->owner, ATTACHER(c));
 				}
@@ -689,6 +702,7 @@ static void closeconv(struct conv *cv)
 		closeconv(nc);
 	}
 	cv->incall = NULL;
+	cv->nincall = 0;
 
 	kstrdup(&cv->owner, network);
 	cv->perm = 0660;
@@ -698,8 +712,10 @@ static void closeconv(struct conv *cv)
 
 	cv->r = NULL;
 	cv->rgen = 0;
+	cv->busy_poll_usec = 0;
 	cv->p->close(cv);
 	cv->state = Idle;
+	conv_put_free(cv);
 	qunlock(&cv->qlock);
 	poperror();
 }
@@ -738,8 +754,53 @@ static void ipclose(struct chan *c)
 
 enum {
 	Statelen = 32 * 1024,
+	BusyPollMaxUsec = 100000,
+	BusyPollBudget = 8,			/* packets per call to the medium */
 };
 
+/* Busy polling: before blocking on c's data, spin for up to busy_poll_usec,
+ * getting packets from the interface that c's route goes out on.  That saves
+ * the reader the NIC interrupt and the wakeups between it and c's rq. */
+static void ipbusypoll(struct Fs *f, struct conv *c)
+{
+	ERRSTACK(1);
+	struct route *r;
+	struct Ipifc *ifc;
+	uint64_t end;
+	int n;
+
+	if (!c->busy_poll_usec || qcanread(c->rq) ||
+	    !ipcmp(c->raddr, IPnoaddr))
+		return;
+	if (isv4(c->raddr))
+		r = v4lookup(f, c->raddr + IPv4off, c);
+	else
+		r = v6lookup(f, c->raddr, c);
+	if (!r || !r->rt.ifc)
+		return;
+	ifc = r->rt.ifc;
+	end = read_tsc() + usec2tsc(c->busy_poll_usec);
+	while (!qcanread(c->rq) && !qisclosed(c->rq) && (read_tsc() < end)) {
+		if (!canrlock(&ifc->rwlock))
+			return;
+		if (waserror()) {
+			/* the blocking read will find out if something's wrong */
+			runlock(&ifc->rwlock);
+			poperror();
+			return;
+		}
+		n = -1;
+		if (ifc->m && ifc->m->poll)
+			n = ifc->m->poll(ifc, BusyPollBudget);
+		runlock(&ifc->rwlock);
+		poperror();
+		if (n < 0)
+			return;
+		if (!n)
+			cpu_relax();
+	}
+}
+
 static long ipread(struct chan *ch, void *a, long n, int64_t off)
 {
 	struct conv *c;
@@ -812,12 +873,20 @@ static long ipread(struct chan *ch, void *a, long n, int64_t off)
 			rv = readstr(offset, p, n, buf);
 			kfree(buf);
 			return rv;
+		case Qconvstats:
+			x = f->p[PROTO(ch->qid)];
+			c = x->conv[CONV(ch->qid)];
+			buf = kzmalloc(Statelen, MEM_WAIT);
+			(*x->convstats) (c, buf, Statelen);
+			rv = readstr(offset, p, n, buf);
+			kfree(buf);
+			return rv;
 		case Qdata:
 			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
 			if (ch->flag & O_NONBLOCK)
 				return qread_nonblock(c->rq, a, n);
-			else
-				return qread(c->rq, a, n);
+			ipbusypoll(f, c);
+			return qread(c->rq, a, n);
 		case Qerr:
 			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
 			return qread(c->eq, a, n);
@@ -836,7 +905,7 @@ static long ipread(struct chan *ch, void *a, long n, int64_t off)
 	}
 }
 
-static struct block *ipbread(struct chan *ch, long n, uint32_t offset)
+static struct block *ipbread(struct chan *ch, long n, int64_t offset)
 {
 	struct conv *c;
 
@@ -845,8 +914,8 @@ static struct block *ipbread(struct chan *ch, long n, uint32_t offset)
 			c = chan2conv(ch);
 			if (ch->flag & O_NONBLOCK)
 				return qbread_nonblock(c->rq, n);
-			else
-				return qbread(c->rq, n);
+			ipbusypoll(c->p->f, c);
+			return qbread(c->rq, n);
 		default:
 			return devbread(ch, n, offset);
 	}
@@ -1175,6 +1244,14 @@ static void tosctlmsg(struct conv *c, struct cmdbuf *cb)
 		c->tos = atoi(cb->f[1]);
 }
 
+static void busypollctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (cb->nf < 2)
+		c->busy_poll_usec = 0;
+	else
+		c->busy_poll_usec = MIN(strtoul(cb->f[1], 0, 0), BusyPollMaxUsec);
+}
+
 static void ttlctlmsg(struct conv *c, struct cmdbuf *cb)
 {
 	if (cb->nf < 2)
@@ -1242,6 +1319,8 @@ static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 				ttlctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "tos") == 0)
 				tosctlmsg(c, cb);
+			else if (strcmp(cb->f[0], "busypoll") == 0)
+				busypollctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "ignoreadvice") == 0)
 				c->ignoreadvice = 1;
 			else if (strcmp(cb->f[0], "addmulti") == 0) {
@@ -1277,7 +1356,7 @@ static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 	return n;
 }
 
-static long ipbwrite(struct chan *ch, struct block *bp, uint32_t offset)
+static long ipbwrite(struct chan *ch, struct block *bp, int64_t offset)
 {
 	struct conv *c;
 	int n;
@@ -1329,11 +1408,28 @@ static void ip_wake_cb(struct queue *q, void *data, int filter)
 	 * events on this *same* conversation, or other tap registration.  not a
 	 * huge deal. */
 	spin_lock(&conv->tap_lock);
+	event_defer_notifs();
 	SLIST_FOREACH(tap_i, &conv->data_taps, link)
 		fire_tap(tap_i, filter);
+	event_flush_notifs();
 	spin_unlock(&conv->tap_lock);
 }
 
+/* Returns the data tap events that are already true for conv, so a new or
+ * re-armed tap hears about them even if the queue never changes again. */
+static int ip_data_ready(struct conv *conv)
+{
+	int filter = 0;
+
+	if (qreadable(conv->rq))
+		filter |= FDTAP_FILT_READABLE;
+	if (qwritable(conv->wq))
+		filter |= FDTAP_FILT_WRITABLE;
+	if (qisclosed(conv->rq))
+		filter |= FDTAP_FILT_HANGUP;
+	return filter;
+}
+
 int iptapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 {
 	struct conv *conv = chan2conv(chan);
@@ -1360,6 +1456,12 @@ int iptapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 						qio_set_wake_cb(conv->wq, ip_wake_cb, conv);
 					}
 					SLIST_INSERT_HEAD(&conv->data_taps, tap, link);
+					fire_tap(tap, ip_data_ready(conv));
+					ret = 0;
+					break;
+				case (FDTAP_CMD_MOD):
+					/* the filter was already changed; just re-arm */
+					fire_tap(tap, ip_data_ready(conv));
 					ret = 0;
 					break;
 				case (FDTAP_CMD_REM):
@@ -1389,6 +1491,13 @@ int iptapfd(struct chan *chan, struct fd_tap *tap, int cmd)
 			switch (cmd) {
 				case (FDTAP_CMD_ADD):
 					SLIST_INSERT_HEAD(&conv->listen_taps, tap, link);
+					if (conv->incall)
+						fire_tap(tap, FDTAP_FILT_READABLE);
+					ret = 0;
+					break;
+				case (FDTAP_CMD_MOD):
+					if (conv->incall)
+						fire_tap(tap, FDTAP_FILT_READABLE);
 					ret = 0;
 					break;
 				case (FDTAP_CMD_REM):
@@ -1453,6 +1562,8 @@ int Fsproto(struct Fs *f, struct Proto *p)
 	p->conv = kzmalloc(sizeof(struct conv *) * (p->nc + 1), 0);
 	if (p->conv == NULL)
 		panic("Fsproto");
+	spinlock_init(&p->free_lock);
+	TAILQ_INIT(&p->free_convs);
 
 	p->x = f->np;
 	p->nextport = 0;
@@ -1471,6 +1582,87 @@ int Fsbuiltinproto(struct Fs *f, uint8_t proto)
 	return f->t2p[proto] != NULL;
 }
 
+/* Puts a conv that no one has open on its proto's free list, for
+ * Fsprotoclone().  Call with the conv qlocked. */
+static void conv_put_free(struct conv *c)
+{
+	struct Proto *p = c->p;
+
+	spin_lock(&p->free_lock);
+	if (!c->on_free_list) {
+		TAILQ_INSERT_TAIL(&p->free_convs, c, free_link);
+		c->on_free_list = TRUE;
+	}
+	spin_unlock(&p->free_lock);
+}
+
+/* Returns a conv from the free list that no one is using, qlocked, or 0.  The
+ * protocol may still be using a closed conv (e.g. TCP in Time_wait), so those
+ * go to the back of the list, and we only look at a few before giving up.
+ * Convs opened again since they closed come off the list; they'll be back on
+ * when they close. */
+static struct conv *conv_get_free(struct Proto *p)
+{
+	struct conv *c;
+
+	spin_lock(&p->free_lock);
+	for (int i = 0; i < Maxfreeprobe; i++) {
+		c = TAILQ_FIRST(&p->free_convs);
+		if (!c)
+			break;
+		TAILQ_REMOVE(&p->free_convs, c, free_link);
+		if (ACCESS_ONCE(c->inuse)) {
+			c->on_free_list = FALSE;
+			continue;
+		}
+		if (canqlock(&c->qlock)) {
+			if (c->inuse == 0 &&
+			    (p->inuse == NULL || (*p->inuse) (c) == 0)) {
+				c->on_free_list = FALSE;
+				spin_unlock(&p->free_lock);
+				return c;
+			}
+			qunlock(&c->qlock);
+		}
+		TAILQ_INSERT_TAIL(&p->free_convs, c, free_link);
+	}
+	spin_unlock(&p->free_lock);
+	return 0;
+}
+
+/* Allocates the conv for the empty slot pp.  Returns it qlocked. */
+static struct conv *conv_alloc(struct Proto *p, struct conv **pp)
+{
+	struct conv *c;
+
+	c = kzmalloc(sizeof(struct conv), 0);
+	if (c == NULL)
+		error(ENOMEM, ERROR_FIXME);
+	qlock_init(&c->qlock);
+	qlock_init(&c->listenq);
+	rendez_init(&c->cr);
+	rendez_init(&c->listenr);
+	SLIST_INIT(&c->data_taps);	/* already = 0; set to be futureproof */
+	SLIST_INIT(&c->listen_taps);
+	spinlock_init(&c->tap_lock);
+	qlock(&c->qlock);
+	c->p = p;
+	c->x = pp - p->conv;
+	if (p->ptclsize != 0) {
+		c->ptcl = kzmalloc(p->ptclsize, 0);
+		if (c->ptcl == NULL) {
+			kfree(c);
+			error(ENOMEM, ERROR_FIXME);
+		}
+	}
+	*pp = c;
+	p->ac++;
+	c->eq = qopen(1024, Qmsg, 0, 0);
+	(*p->create) (c);
+	assert(c->rq && c->wq);
+	return c;
+}
+
 /*
  *  called with protocol locked
  */
@@ -1478,37 +1670,23 @@ struct conv *Fsprotoclone(struct Proto *p, char *user)
 {
 	struct conv *c, **pp, **ep;
 
+	/* Reuse a closed conv, else take the next never-used slot.  Slots are
+	 * filled in order, so [0, ac) have convs.  Only if both fail do we scan,
+	 * which also gets the protocol to gc. */
+	c = conv_get_free(p);
+	if (c)
+		goto found;
+	if (p->ac < p->nc && p->conv[p->ac] == NULL) {
+		c = conv_alloc(p, &p->conv[p->ac]);
+		goto found;
+	}
 retry:
 	c = NULL;
 	ep = &p->conv[p->nc];
 	for (pp = p->conv; pp < ep; pp++) {
 		c = *pp;
 		if (c == NULL) {
-			c = kzmalloc(sizeof(struct conv), 0);
-			if (c == NULL)
-				error(ENOMEM, ERROR_FIXME);
-			qlock_init(&c->qlock);
-			qlock_init(&c->listenq);
-			rendez_init(&c->cr);
-			rendez_init(&c->listenr);
-			SLIST_INIT(&c->data_taps);	/* already = 0; set to be futureproof */
-			SLIST_INIT(&c->listen_taps);
-			spinlock_init(&c->tap_lock);
-			qlock(&c->qlock);
-			c->p = p;
-			c->x = pp - p->conv;
-			if (p->ptclsize != 0) {
-				c->ptcl = kzmalloc(p->ptclsize, 0);
-				if (c->ptcl == NULL) {
-					kfree(c);
-					error(ENOMEM, ERROR_FIXME);
-				}
-			}
-			*pp = c;
-			p->ac++;
-			c->eq = qopen(1024, Qmsg, 0, 0);
-			(*p->create) (c);
-			assert(c->rq && c->wq);
+			c = conv_alloc(p, pp);
 			break;
 		}
 		if (canqlock(&c->qlock)) {
@@ -1527,7 +1705,15 @@ retry:
 			goto retry;
 		return NULL;
 	}
-
+found:
+	if (c->on_free_list) {
+		spin_lock(&p->free_lock);
+		if (c->on_free_list) {
+			TAILQ_REMOVE(&p->free_convs, c, free_link);
+			c->on_free_list = FALSE;
+		}
+		spin_unlock(&p->free_lock);
+	}
 	c->inuse = 1;
 	kstrdup(&c->owner, user);
 	c->perm = 0660;
@@ -1536,6 +1722,7 @@ retry:
 	ipmove(c->raddr, IPnoaddr);
 	c->r = NULL;
 	c->rgen = 0;
+	c->busy_poll_usec = 0;
 	c->lport = 0;
 	c->rport = 0;
 	c->restricted = 0;
@@ -1587,8 +1774,10 @@ static void fire_listener_taps(struct conv *conv)
 	if (SLIST_EMPTY(&conv->listen_taps))
 		return;
 	spin_lock(&conv->tap_lock);
+	event_defer_notifs();
 	SLIST_FOREACH(tap_i, &conv->listen_taps, link)
 		fire_tap(tap_i, FDTAP_FILT_READABLE);
+	event_flush_notifs();
 	spin_unlock(&conv->tap_lock);
 }
 
@@ -1599,14 +1788,9 @@ struct conv *Fsnewcall(struct conv *c, uint8_t * raddr, uint16_t rport,
 					   uint8_t * laddr, uint16_t lport, uint8_t version)
 {
 	struct conv *nc;
-	struct conv **l;
-	int i;
 
 	qlock(&c->qlock);
-	i = 0;
-	for (l = &c->incall; *l; l = &(*l)->next)
-		i++;
-	if (i >= Maxincall) {
+	if (c->nincall >= Maxincall) {
 		qunlock(&c->qlock);
 		return NULL;
 	}
@@ -1622,7 +1806,12 @@ struct conv *Fsnewcall(struct conv *c, uint8_t * raddr, uint16_t rport,
 	ipmove(nc->laddr, laddr);
 	nc->lport = lport;
 	nc->next = NULL;
-	*l = nc;
+	if (c->incall)
+		c->incall_last->next = nc;
+	else
+		c->incall = nc;
+	c->incall_last = nc;
+	c->nincall++;
 	nc->state = Connected;
 	nc->ipversion = version;
 
@@ -72,6 +72,7 @@ static int multicastea(uint8_t * ea, uint8_t * ip);
 static void recvarpproc(void *);
 static void resolveaddr6(struct Ipifc *ifc, struct arpent *a);
 static void etherpref2addr(uint8_t * pref, uint8_t * ea);
+static int etherpoll(struct Ipifc *ifc, int budget);
 
 struct medium ethermedium = {
 	.name = "ether",
@@ -87,6 +88,7 @@ struct medium ethermedium = {
 	.ares = arpenter,
 	.areg = sendgarp,
 	.pref2addr = etherpref2addr,
+	.poll = etherpoll,
 };
 
 struct medium trexmedium = {
@@ -163,6 +165,8 @@ static unsigned int parsefeat(char *ptr)
 		feat |= NETF_SG;
 	if (strstr(ptr, "tso"))
 		feat |= NETF_TSO;
+	if (strstr(ptr, "gso"))
+		feat |= NETF_GSO;
 	return feat;
 }
 
@@ -252,6 +256,12 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	} else
 		ifc->mbps = 100;
 
+	/* the device's maxmtu doesn't count the ether header, but our mtus do */
+	ptr = strstr(buf, "maxmtu: ");
+	if (ptr) {
+		ptr += 8;
+		ifc->devmaxtu = MAX(ifc->devmaxtu, atoi(ptr) + ETHERHDRSIZE);
+	}
 
 	ptr = strstr(buf, "feat: ");
 	if (ptr) {
@@ -372,8 +382,8 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 
 	/* get mac address of destination.
 	 *
-	 * Locking is tricky here.  If we get arpent 'a' back, the f->arp is
-	 * qlocked.  if multicastarp returns bp, then it unlocked it for us.  if
+	 * Locking is tricky here.  If we get arpent 'a' back, its f->arp lock
+	 * is held.  if multicastarp returns bp, then it unlocked it for us.  if
 	 * not, sendarp or resolveaddr6 unlocked it for us.  yikes. */
 	a = arpget(er->f->arp, bp, version, ifc, ip, mac);
 	if (a) {
@@ -482,7 +492,7 @@ static void etherread6(void *a)
 		return;
 	}
 	for (;;) {
-		bp = devtab[er->mchan6->type].bread(er->mchan6, ifc->maxtu, 0);
+		bp = devtab[er->mchan6->type].bread(er->mchan6, ifc->devmaxtu, 0);
 		if (!canrlock(&ifc->rwlock)) {
 			freeb(bp);
 			continue;
@@ -503,6 +513,38 @@ static void etherread6(void *a)
 	poperror();
 }
 
+/*
+ *  busy polling, called with ifc rlock'd.  we do the work of etherread4 and 6
+ *  ourselves, so the packets don't wait on those processes.  they can still
+ *  run at the same time, so packets from a flow can be input out of order.
+ */
+static int etherpoll(struct Ipifc *ifc, int budget)
+{
+	Etherrock *er = ifc->arg;
+	struct block *bp;
+	int n = 0;
+
+	while (n < budget && (bp = ether_busy_poll(er->mchan4, budget - n))) {
+		ifc->in++;
+		bp->rp += ifc->m->hsize;
+		if (ifc->lifc == NULL)
+			freeb(bp);
+		else
+			ipiput4(er->f, ifc, bp);
+		n++;
+	}
+	while (n < budget && (bp = ether_busy_poll(er->mchan6, budget - n))) {
+		ifc->in++;
+		bp->rp += ifc->m->hsize;
+		if (ifc->lifc == NULL)
+			freeb(bp);
+		else
+			ipiput6(er->f, ifc, bp);
+		n++;
+	}
+	return n;
+}
+
 static void etheraddmulti(struct Ipifc *ifc, uint8_t * a, uint8_t * unused)
 {
 	uint8_t mac[6];
@@ -556,6 +598,7 @@ static void sendarp(struct Ipifc *ifc, struct arpent *a)
 	struct block *bp;
 	Etherarp *e;
 	Etherrock *er = ifc->arg;
+	uint8_t tpa[IPv4addrlen];
 
 	/* don't do anything if it's been less than a second since the last.  ctime
 	 * is set to 0 for the first time through.  we hold the f->arp qlock, so
@@ -575,17 +618,18 @@ static void sendarp(struct Ipifc *ifc, struct arpent *a)
 		freeblist(bp);
 	}
 
-	/* update last sent time */
+	/* update last sent time.  a might be freed once we release it. */
 	a->ctime = NOW;
-	arprelease(er->f->arp, a);
-
 	n = sizeof(Etherarp);
 	if (n < a->type->mintu)
 		n = a->type->mintu;
+	memmove(tpa, a->ip + IPv4off, sizeof(tpa));
+	arprelease(er->f->arp, a);
+
 	bp = block_alloc(n, MEM_WAIT);
 	memset(bp->rp, 0, n);
 	e = (Etherarp *) bp->rp;
-	memmove(e->tpa, a->ip + IPv4off, sizeof(e->tpa));
+	memmove(e->tpa, tpa, sizeof(e->tpa));
 	ipv4local(ifc, e->spa);
 	memmove(e->sha, ifc->mac, sizeof(e->sha));
 	memset(e->d, 0xff, sizeof(e->d));	/* ethernet broadcast */
@@ -609,7 +653,7 @@ static void resolveaddr6(struct Ipifc *ifc, struct arpent *a)
 	int sflag;
 	struct block *bp;
 	Etherrock *er = ifc->arg;
-	uint8_t ipsrc[IPaddrlen];
+	uint8_t ipsrc[IPaddrlen], ip[IPaddrlen];
 
 	/* don't do anything if it's been less than a second since the last */
 	if (NOW - a->ctime < ReTransTimer) {
@@ -634,10 +678,11 @@ static void resolveaddr6(struct Ipifc *ifc, struct arpent *a)
 	}
 
 	a->rxtsrem--;
+	memmove(ip, a->ip, sizeof(ip));
 	arprelease(er->f->arp, a);
 
 	if ((sflag = ipv6anylocal(ifc, ipsrc)))
-		icmpns(er->f, ipsrc, sflag, a->ip, TARG_MULTI, ifc->mac);
+		icmpns(er->f, ipsrc, sflag, ip, TARG_MULTI, ifc->mac);
 }
 
 /*
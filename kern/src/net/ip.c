@@ -42,8 +42,6 @@
 
 typedef struct Ip4hdr Ip4hdr;
 typedef struct IP IP;
-typedef struct Fragment4 Fragment4;
-typedef struct Fragment6 Fragment6;
 typedef struct Ipfrag Ipfrag;
 
 enum {
@@ -97,24 +95,6 @@ enum {
 	Nstats,
 };
 
-struct fragment4 {
-	struct block *blist;
-	struct fragment4 *next;
-	uint32_t src;
-	uint32_t dst;
-	uint16_t id;
-	uint64_t age;
-};
-
-struct fragment6 {
-	struct block *blist;
-	struct fragment6 *next;
-	uint8_t src[IPaddrlen];
-	uint8_t dst[IPaddrlen];
-	unsigned int id;
-	uint64_t age;
-};
-
 struct Ipfrag {
 	uint16_t foff;
 	uint16_t flen;
@@ -124,14 +104,7 @@ struct Ipfrag {
 struct IP {
 	uint32_t stats[Nstats];
 
-	qlock_t fraglock4;
-	struct fragment4 *flisthead4;
-	struct fragment4 *fragfree4;
 	int id4;
-
-	qlock_t fraglock6;
-	struct fragment6 *flisthead6;
-	struct fragment6 *fragfree6;
 	int id6;
 
 	int iprouting;				/* true if we route like a gateway */
@@ -167,10 +140,8 @@ static char *statnames[] = {
 #define BKFG(xp)	((struct Ipfrag*)((xp)->base))
 
 uint16_t ipcsum(uint8_t * unused_uint8_p_t);
-struct block *ip4reassemble(struct IP *, int unused_int,
+struct block *ip4reassemble(struct Fs *, int unused_int,
 							struct block *, struct Ip4hdr *);
-void ipfragfree4(struct IP *, struct fragment4 *);
-struct fragment4 *ipfragallo4(struct IP *);
 
 void ip_init_6(struct Fs *f)
 {
@@ -196,42 +167,12 @@ void ip_init_6(struct Fs *f)
 
 }
 
-void initfrag(struct IP *ip, int size)
-{
-	struct fragment4 *fq4, *eq4;
-	struct fragment6 *fq6, *eq6;
-
-	ip->fragfree4 =
-		(struct fragment4 *)kzmalloc(sizeof(struct fragment4) * size, 0);
-	if (ip->fragfree4 == NULL)
-		panic("initfrag");
-
-	eq4 = &ip->fragfree4[size];
-	for (fq4 = ip->fragfree4; fq4 < eq4; fq4++)
-		fq4->next = fq4 + 1;
-
-	ip->fragfree4[size - 1].next = NULL;
-
-	ip->fragfree6 =
-		(struct fragment6 *)kzmalloc(sizeof(struct fragment6) * size, 0);
-	if (ip->fragfree6 == NULL)
-		panic("initfrag");
-
-	eq6 = &ip->fragfree6[size];
-	for (fq6 = ip->fragfree6; fq6 < eq6; fq6++)
-		fq6->next = fq6 + 1;
-
-	ip->fragfree6[size - 1].next = NULL;
-}
-
 void ip_init(struct Fs *f)
 {
 	struct IP *ip;
 
 	ip = kzmalloc(sizeof(struct IP), 0);
-	qlock_init(&ip->fraglock4);
-	qlock_init(&ip->fraglock6);
-	initfrag(ip, 100);
+	f->frags = fraginit(f, &ip->stats[ReasmTimeout], &ip->stats[ReasmFails]);
 	f->ip = ip;
 
 	ip_init_6(f);
@@ -519,7 +460,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 				h->tos = 0;
 				if (frag & IP_MF)
 					h->tos = 1;
-				bp = ip4reassemble(ip, frag, bp, h);
+				bp = ip4reassemble(f, frag, bp, h);
 				if (bp == NULL)
 					return;
 				h = (struct Ip4hdr *)(bp->rp);
@@ -538,7 +479,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 		h->tos = 0;
 		if (frag & IP_MF)
 			h->tos = 1;
-		bp = ip4reassemble(ip, frag, bp, h);
+		bp = ip4reassemble(f, frag, bp, h);
 		if (bp == NULL)
 			return;
 		h = (struct Ip4hdr *)(bp->rp);
@@ -576,19 +517,21 @@ int ipstats(struct Fs *f, char *buf, int len)
 	return p - buf;
 }
 
-struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
+struct block *ip4reassemble(struct Fs *fs, int offset, struct block *bp,
 							struct Ip4hdr *ih)
 {
+	struct IP *ip = fs->ip;
 	int fend;
-	uint16_t id;
-	struct fragment4 *f, *fnext;
-	uint32_t src, dst;
+	struct fragkey key;
+	struct fragq *f;
 	struct block *bl, **l, *last, *prev;
 	int ovlap, len, fragsize, pktposn;
 
-	src = nhgetl(ih->src);
-	dst = nhgetl(ih->dst);
-	id = nhgets(ih->id);
+	v4tov6(key.src, ih->src);
+	v4tov6(key.dst, ih->dst);
+	key.id = nhgets(ih->id);
+	key.proto = ih->proto;
+	key.vers = IP_VER4;
 
 	/*
 	 *  block lists are too hard, pullupblock into a single block
@@ -598,20 +541,11 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 		ih = (struct Ip4hdr *)(bp->rp);
 	}
 
-	qlock(&ip->fraglock4);
-
 	/*
 	 *  find a reassembly queue for this fragment
 	 */
-	for (f = ip->flisthead4; f; f = fnext) {
-		fnext = f->next;	/* because ipfragfree4 changes the list */
-		if (f->src == src && f->dst == dst && f->id == id)
-			break;
-		if (f->age < NOW) {
-			ip->stats[ReasmTimeout]++;
-			ipfragfree4(ip, f);
-		}
-	}
+	fraglock(fs, &key);
+	f = fragfind(fs, &key);
 
 	/*
 	 *  if this isn't a fragmented packet, accept it
@@ -620,10 +554,10 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 	 */
 	if (!ih->tos && (offset & ~(IP_MF | IP_DF)) == 0) {
 		if (f != NULL) {
-			ipfragfree4(ip, f);
+			fragfree(fs, f);
 			ip->stats[ReasmFails]++;
 		}
-		qunlock(&ip->fraglock4);
+		fragunlock(fs, &key);
 		return bp;
 	}
 
@@ -637,15 +571,13 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 
 	/* First fragment allocates a reassembly queue */
 	if (f == NULL) {
-		f = ipfragallo4(ip);
-		f->id = id;
-		f->src = src;
-		f->dst = dst;
-
-		f->blist = bp;
-
-		qunlock(&ip->fraglock4);
-		ip->stats[ReasmReqds]++;
+		if (fragnew(fs, &key, bp) == NULL) {
+			freeblist(bp);
+			ip->stats[ReasmFails]++;
+		} else {
+			ip->stats[ReasmReqds]++;
+		}
+		fragunlock(fs, &key);
 		return NULL;
 	}
 
@@ -667,7 +599,7 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 		if (ovlap > 0) {
 			if (ovlap >= BKFG(bp)->flen) {
 				freeblist(bp);
-				qunlock(&ip->fraglock4);
+				fragunlock(fs, &key);
 				return NULL;
 			}
 			BKFG(prev)->flen -= ovlap;
@@ -727,68 +659,20 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 
 			bl = f->blist;
 			f->blist = NULL;
-			ipfragfree4(ip, f);
+			fragfree(fs, f);
 			ih = BLKIP(bl);
 			hnputs(ih->length, len);
-			qunlock(&ip->fraglock4);
+			fragunlock(fs, &key);
 			ip->stats[ReasmOKs]++;
 			return bl;
 		}
 		pktposn += BKFG(bl)->flen;
 	}
-	qunlock(&ip->fraglock4);
+	fragupdate(fs, f);
+	fragunlock(fs, &key);
 	return NULL;
 }
 
-/*
- * ipfragfree4 - Free a list of fragments - assume hold fraglock4
- */
-void ipfragfree4(struct IP *ip, struct fragment4 *frag)
-{
-	struct fragment4 *fl, **l;
-
-	if (frag->blist)
-		freeblist(frag->blist);
-
-	frag->src = 0;
-	frag->id = 0;
-	frag->blist = NULL;
-
-	l = &ip->flisthead4;
-	for (fl = *l; fl; fl = fl->next) {
-		if (fl == frag) {
-			*l = frag->next;
-			break;
-		}
-		l = &fl->next;
-	}
-
-	frag->next = ip->fragfree4;
-	ip->fragfree4 = frag;
-
-}
-
-/*
- * ipfragallo4 - allocate a reassembly queue - assume hold fraglock4
- */
-struct fragment4 *ipfragallo4(struct IP *ip)
-{
-	struct fragment4 *f;
-
-	while (ip->fragfree4 == NULL) {
-		/* free last entry on fraglist */
-		for (f = ip->flisthead4; f->next; f = f->next) ;
-		ipfragfree4(ip, f);
-	}
-	f = ip->fragfree4;
-	ip->fragfree4 = f->next;
-	f->next = ip->flisthead4;
-	ip->flisthead4 = f;
-	f->age = NOW + 30000;
-
-	return f;
-}
-
 /* coreboot.c among other things needs this
  * type of checksum.
  */
@@ -0,0 +1,251 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * IP reassembly queues.
+ *
+ * Queues hash on (src, dst, id, proto, version) into NFRAGHASH buckets, each
+ * with its own qlock.  ip4reassemble() and ip6reassemble() lock the bucket for
+ * their key, then find, make, change, and free queues under it.  The hash has
+ * a random seed, so a flood can't aim at one bucket.
+ *
+ * Every queue is also on an LRU list, under a spinlock that nests inside the
+ * bucket locks.  When the fragments we're holding take more than
+ * FRAG_HIGH_MEM, fragunlock() throws out the least recently used queues until
+ * we're under FRAG_LOW_MEM.  It has to let go of its own bucket first, so it
+ * peeks at the LRU head, locks the head's bucket, and makes sure the queue is
+ * still there.
+ *
+ * A queue is good for FRAG_TIMEOUT msec from its first fragment.  Lookups toss
+ * the stale ones they walk past, and a ktask sweeps the rest once a second. */
+
+#include <vfs.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <kthread.h>
+#include <arch/arch.h>
+#include <ip.h>
+
+enum {
+	NFRAGHASH = (1 << 10),
+	FRAG_TIMEOUT = 30000,		/* msec */
+	FRAG_HIGH_MEM = (4 << 20),
+	FRAG_LOW_MEM = (3 << 20),
+	FRAG_SWEEP_USEC = 1000000,
+};
+
+struct fragbucket {
+	qlock_t qlock;
+	struct fragq *head;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+TAILQ_HEAD(fragq_tailq, fragq);
+
+struct fragtab {
+	struct fragbucket b[NFRAGHASH];
+	spinlock_t lru_lock;
+	struct fragq_tailq lru;
+	atomic_t mem;				/* BALLOC of the blocks we hold */
+	uint32_t seed;
+	uint32_t *timeouts;
+	uint32_t *fails;
+};
+
+static uint32_t fraghash(struct fragtab *ft, struct fragkey *k)
+{
+	uint32_t x = ft->seed;
+
+	x = (x ^ ipaddrhash(k->src)) * 0x9e3779b1;
+	x = (x ^ ipaddrhash(k->dst)) * 0x9e3779b1;
+	x = (x ^ k->id ^ (k->proto << 24) ^ k->vers) * 0x85ebca6b;
+	return x ^ (x >> 16);
+}
+
+static struct fragbucket *fragbucket(struct fragtab *ft, uint32_t hash)
+{
+	return &ft->b[hash & (NFRAGHASH - 1)];
+}
+
+static bool fragkeyeq(struct fragkey *a, struct fragkey *b)
+{
+	return a->id == b->id && a->proto == b->proto && a->vers == b->vers &&
+	       ipcmp(a->src, b->src) == 0 && ipcmp(a->dst, b->dst) == 0;
+}
+
+/* Called with q's bucket locked. */
+static void __fragfree(struct fragtab *ft, struct fragq *q)
+{
+	struct fragq **l;
+
+	for (l = &fragbucket(ft, q->key.hash)->head; *l; l = &(*l)->next) {
+		if (*l == q) {
+			*l = q->next;
+			break;
+		}
+	}
+	spin_lock(&ft->lru_lock);
+	TAILQ_REMOVE(&ft->lru, q, lru);
+	spin_unlock(&ft->lru_lock);
+	atomic_add(&ft->mem, -(long)q->mem);
+	if (q->blist)
+		freeblist(q->blist);
+	kfree(q);
+}
+
+/* Called with the bucket locked. */
+static void fragsweep(struct fragtab *ft, struct fragbucket *b, uint64_t now)
+{
+	struct fragq *q, *next;
+
+	for (q = b->head; q; q = next) {
+		next = q->next;
+		if (q->age < now) {
+			(*ft->timeouts)++;
+			__fragfree(ft, q);
+		}
+	}
+}
+
+static void fragsweeper(void *arg)
+{
+	struct fragtab *ft = arg;
+	struct fragbucket *b;
+
+	while (1) {
+		kthread_usleep(FRAG_SWEEP_USEC);
+		for (int i = 0; i < NFRAGHASH; i++) {
+			b = &ft->b[i];
+			if (!ACCESS_ONCE(b->head))
+				continue;
+			qlock(&b->qlock);
+			fragsweep(ft, b, NOW);
+			qunlock(&b->qlock);
+		}
+	}
+}
+
+/* Throws out the oldest queue.  Returns FALSE if there aren't any. */
+static bool fragevict(struct fragtab *ft)
+{
+	struct fragbucket *b;
+	struct fragq *q, *i;
+
+	spin_lock(&ft->lru_lock);
+	q = TAILQ_FIRST(&ft->lru);
+	if (!q) {
+		spin_unlock(&ft->lru_lock);
+		return FALSE;
+	}
+	b = fragbucket(ft, q->key.hash);
+	spin_unlock(&ft->lru_lock);
+	/* q might be freed by the time we get the lock */
+	qlock(&b->qlock);
+	for (i = b->head; i; i = i->next) {
+		if (i == q) {
+			(*ft->fails)++;
+			__fragfree(ft, q);
+			break;
+		}
+	}
+	qunlock(&b->qlock);
+	return TRUE;
+}
+
+struct fragtab *fraginit(struct Fs *f, uint32_t *timeouts, uint32_t *fails)
+{
+	struct fragtab *ft;
+
+	ft = kzmalloc_align(sizeof(struct fragtab), MEM_WAIT, ARCH_CL_SIZE);
+	for (int i = 0; i < NFRAGHASH; i++)
+		qlock_init(&ft->b[i].qlock);
+	spinlock_init(&ft->lru_lock);
+	TAILQ_INIT(&ft->lru);
+	atomic_init(&ft->mem, 0);
+	ft->seed = read_tsc();
+	ft->timeouts = timeouts;
+	ft->fails = fails;
+	ktask("fragsweeper", fragsweeper, ft);
+	return ft;
+}
+
+void fraglock(struct Fs *f, struct fragkey *k)
+{
+	k->hash = fraghash(f->frags, k);
+	qlock(&fragbucket(f->frags, k->hash)->qlock);
+}
+
+/* Unlocks k's bucket, then gets us back under our memory limit. */
+void fragunlock(struct Fs *f, struct fragkey *k)
+{
+	struct fragtab *ft = f->frags;
+
+	qunlock(&fragbucket(ft, k->hash)->qlock);
+	if (atomic_read(&ft->mem) <= FRAG_HIGH_MEM)
+		return;
+	while (atomic_read(&ft->mem) > FRAG_LOW_MEM) {
+		if (!fragevict(ft))
+			break;
+	}
+}
+
+/* Returns k's queue, or NULL.  Call with k locked. */
+struct fragq *fragfind(struct Fs *f, struct fragkey *k)
+{
+	struct fragtab *ft = f->frags;
+	struct fragbucket *b = fragbucket(ft, k->hash);
+	struct fragq *q;
+
+	fragsweep(ft, b, NOW);
+	for (q = b->head; q; q = q->next) {
+		if (q->key.hash == k->hash && fragkeyeq(&q->key, k))
+			return q;
+	}
+	return NULL;
+}
+
+/* Makes a queue for k, holding bp.  Returns NULL if we're out of memory, in
+ * which case bp is still the caller's.  Call with k locked. */
+struct fragq *fragnew(struct Fs *f, struct fragkey *k, struct block *bp)
+{
+	struct fragtab *ft = f->frags;
+	struct fragbucket *b = fragbucket(ft, k->hash);
+	struct fragq *q;
+
+	q = kzmalloc(sizeof(struct fragq), MEM_ATOMIC);
+	if (!q)
+		return NULL;
+	q->key = *k;
+	q->blist = bp;
+	q->age = NOW + FRAG_TIMEOUT;
+	q->next = b->head;
+	b->head = q;
+	spin_lock(&ft->lru_lock);
+	TAILQ_INSERT_TAIL(&ft->lru, q, lru);
+	spin_unlock(&ft->lru_lock);
+	fragupdate(f, q);
+	return q;
+}
+
+/* Recounts q's memory after its blist changed, and marks it as used. */
+void fragupdate(struct Fs *f, struct fragq *q)
+{
+	struct fragtab *ft = f->frags;
+	size_t mem = 0;
+
+	for (struct block *bp = q->blist; bp; bp = bp->next)
+		mem += BALLOC(bp);
+	atomic_add(&ft->mem, (long)mem - (long)q->mem);
+	q->mem = mem;
+	spin_lock(&ft->lru_lock);
+	TAILQ_REMOVE(&ft->lru, q, lru);
+	TAILQ_INSERT_TAIL(&ft->lru, q, lru);
+	spin_unlock(&ft->lru_lock);
+}
+
+/* Frees q and whatever is still on its blist.  Call with q's key locked. */
+void fragfree(struct Fs *f, struct fragq *q)
+{
+	__fragfree(f->frags, q);
+}
@@ -45,7 +45,8 @@
 enum {
 	Maxmedia = 32,
 	Nself = Maxmedia * 5,
-	NHASH = (1 << 6),
+	NSELF_MIN_BUCKETS = (1 << 6),
+	NSELF_MAX_BUCKETS = (1 << 14),
 	NCACHE = 256,
 	QMAX = 64 * 1024 - 1,
 };
@@ -56,22 +57,47 @@ struct medium *media[Maxmedia] = {
 
 /*
  *  cache of local addresses (addresses we answer to)
+ *
+ *  Every input packet looks here, so readers don't lock.  ipforme() and
+ *  iptentative() walk the chains under RCU, and writers change them under the
+ *  qlock.  Entries never change address or type, and they are freed with
+ *  kfree_rcu().  The table doubles when it has more entries than buckets.
+ *
+ *  Removals and resizes bump the seq counter.  A reader that misses while it
+ *  changed might have been on a chain that was being moved, so it tries again.
+ *  Each core also remembers its last hit, along with the seq it was found at,
+ *  since a burst of packets is usually for one address.  Only that core touches
+ *  its slot, and never from IRQ context.
  */
 struct Ipself {
 	uint8_t a[IPaddrlen];
 	struct Ipself *hnext;		/* next address in the hash table */
 	struct Iplink *link;		/* binding twixt Ipself and Ipifc */
-	uint32_t expire;
 	uint8_t type;				/* type of address */
 	int ref;
-	struct Ipself *next;		/* free list */
+	struct rcu_head rcu;
+};
+
+struct Ipselfhash {
+	struct rcu_head rcu;
+	unsigned int mask;
+	struct Ipself *b[];
 };
 
+struct Ipself_pcpu {
+	seq_ctr_t seq;
+	struct Ipself *last;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 struct Ipselftab {
 	qlock_t qlock;
 	int inited;
 	int acceptall;				/* true if an interface has the null address */
-	struct Ipself *hash[NHASH];	/* hash chains */
+	seq_ctr_t seq;
+	unsigned int nr_self;
+	struct Ipselfhash *ht;
+	struct Ipself_pcpu *pcpu;
+	int nr_pcpu;
 };
 
 /*
@@ -85,15 +111,13 @@ struct Ipmcast {
 	uint8_t ia[IPaddrlen];		/* interface address */
 };
 
-/* quick hash for ip addresses */
-#define hashipa(a) ( ( ((a)[IPaddrlen-2]<<8) | (a)[IPaddrlen-1] )%NHASH )
-
 static char tifc[] = "ifc ";
 
 static void addselfcache(struct Fs *f, struct Ipifc *ifc, struct Iplifc *lifc,
 						 uint8_t * a, int type);
 static void remselfcache(struct Fs *f,
 						 struct Ipifc *ifc, struct Iplifc *lifc, uint8_t * a);
+static struct Ipselfhash *selfhash_alloc(unsigned int nr_buckets);
 static void ipifcjoinmulti(struct Ipifc *ifc, char **argv, int argc);
 static void ipifcleavemulti(struct Ipifc *ifc, char **argv, int argc);
 static void ipifcregisterproxy(struct Fs *, struct Ipifc *,
@@ -158,7 +182,9 @@ static void ipifcbind(struct conv *c, char **argv, int argc)
 		nexterror();
 	}
 
-	/* do medium specific binding */
+	/* do medium specific binding.  The medium can raise devmaxtu if the
+	 * device takes bigger frames, e.g. jumbos. */
+	ifc->devmaxtu = m->maxtu;
 	(*m->bind) (ifc, argc, argv);
 
 	/* set the bound device name */
@@ -339,6 +365,10 @@ static void ipifccreate(struct conv *c)
 	c->sq = qopen(2 * QMAX, Qmsg | Qcoalesce, 0, 0);
 	c->wq = qopen(QMAX, Qkick, ipifckick, c);
 	ifc = (struct Ipifc *)c->ptcl;
+	/* Convs and their ptcls get reused, so only set up the lock once.  Every
+	 * packet in or out rlocks its interface. */
+	if (!ifc->rwlock.pcpu)
+		brinit(&ifc->rwlock);
 	ifc->conv = c;
 	ifc->unbinding = 0;
 	ifc->m = NULL;
@@ -372,9 +402,9 @@ static void ipifcsetmtu(struct Ipifc *ifc, char **argv, int argc)
 	if (ifc->m == NULL)
 		error(EFAIL, "No medium on IFC");
 	mtu = strtoul(argv[1], 0, 0);
-	if (mtu < ifc->m->mintu || mtu > ifc->m->maxtu)
+	if (mtu < ifc->m->mintu || mtu > ifc->devmaxtu)
 		error(EFAIL, "Bad MTU size %d (%d, %d)", mtu, ifc->m->mintu,
-		      ifc->m->maxtu);
+		      ifc->devmaxtu);
 	ifc->maxtu = mtu;
 }
 
@@ -407,7 +437,7 @@ static void ipifcadd(struct Ipifc *ifc, char **argv, int argc, int tentative,
 			/* fall through */
 		case 5:
 			mtu = strtoul(argv[4], 0, 0);
-			if (mtu >= ifc->m->mintu && mtu <= ifc->m->maxtu)
+			if (mtu >= ifc->m->mintu && mtu <= ifc->devmaxtu)
 				ifc->maxtu = mtu;
 			/* fall through */
 		case 4:
@@ -859,6 +889,10 @@ void ipifcinit(struct Fs *f)
 	f->ipifc = ipifc;	/* hack for ipifcremroute, findipifc, ... */
 	f->self = kzmalloc(sizeof(struct Ipselftab), 0);	/* hack for ipforme */
 	qlock_init(&f->self->qlock);
+	f->self->ht = selfhash_alloc(NSELF_MIN_BUCKETS);
+	f->self->nr_pcpu = MAX(num_cores, 1);
+	f->self->pcpu = kzmalloc_align(sizeof(struct Ipself_pcpu) *
+	                               f->self->nr_pcpu, MEM_WAIT, ARCH_CL_SIZE);
 
 	Fsproto(f, ipifc);
 }
@@ -874,6 +908,53 @@ static void link_release(struct kref *kref)
 	(void)kref;
 }
 
+static struct Ipselfhash *selfhash_alloc(unsigned int nr_buckets)
+{
+	struct Ipselfhash *ht;
+
+	ht = kzmalloc(sizeof(struct Ipselfhash) +
+	              nr_buckets * sizeof(struct Ipself *), MEM_WAIT);
+	ht->mask = nr_buckets - 1;
+	return ht;
+}
+
+static struct Ipself *selffind(struct Ipselfhash *ht, uint8_t *a)
+{
+	struct Ipself *p;
+
+	for (p = rcu_dereference(ht->b[ipaddrhash(a) & ht->mask]); p;
+	     p = rcu_dereference(p->hnext)) {
+		if (ipcmp(a, p->a) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+/* Doubles the table.  Called with f->self locked.  The entries move over one
+ * at a time, within the seq write, so readers that miss will retry. */
+static void selfgrow(struct Ipselftab *st)
+{
+	struct Ipselfhash *old = st->ht, *new;
+	struct Ipself *p, *next;
+	unsigned int idx;
+
+	if (old->mask + 1 >= NSELF_MAX_BUCKETS || st->nr_self <= old->mask + 1)
+		return;
+	new = selfhash_alloc((old->mask + 1) * 2);
+	__seq_start_write(&st->seq);
+	for (int i = 0; i <= old->mask; i++) {
+		for (p = old->b[i]; p; p = next) {
+			next = p->hnext;
+			idx = ipaddrhash(p->a) & new->mask;
+			ACCESS_ONCE(p->hnext) = new->b[idx];
+			new->b[idx] = p;
+		}
+	}
+	rcu_assign_pointer(st->ht, new);
+	__seq_end_write(&st->seq);
+	kfree_rcu(old, rcu);
+}
+
 /*
  *  add to self routing cache
  *	called with c locked
@@ -882,25 +963,24 @@ static void
 addselfcache(struct Fs *f, struct Ipifc *ifc,
 			 struct Iplifc *lifc, uint8_t * a, int type)
 {
-	struct Ipself *p;
+	struct Ipself *p, **l;
 	struct Iplink *lp;
-	int h;
 
 	qlock(&f->self->qlock);
 
 	/* see if the address already exists */
-	h = hashipa(a);
-	for (p = f->self->hash[h]; p; p = p->next)
-		if (memcmp(a, p->a, IPaddrlen) == 0)
-			break;
+	p = selffind(f->self->ht, a);
 
 	/* allocate a local address and add to hash chain */
 	if (p == NULL) {
-		p = kzmalloc(sizeof(*p), 0);
+		p = kzmalloc(sizeof(*p), MEM_WAIT);
 		ipmove(p->a, a);
 		p->type = type;
-		p->next = f->self->hash[h];
-		f->self->hash[h] = p;
+		l = &f->self->ht->b[ipaddrhash(a) & f->self->ht->mask];
+		p->hnext = *l;
+		rcu_assign_pointer(*l, p);
+		f->self->nr_self++;
+		selfgrow(f->self);
 
 		/* if the null address, accept all packets */
 		if (ipcmp(a, v4prefix) == 0 || ipcmp(a, IPnoaddr) == 0)
@@ -946,7 +1026,6 @@ addselfcache(struct Fs *f, struct Ipifc *ifc,
  *	called with f->self locked
  */
 static struct Iplink *freeiplink;
-static struct Ipself *freeipself;
 
 static void iplinkfree(struct Iplink *p)
 {
@@ -967,25 +1046,6 @@ static void iplinkfree(struct Iplink *p)
 	*l = p;
 }
 
-static void ipselffree(struct Ipself *p)
-{
-	struct Ipself **l, *np;
-	uint64_t now = NOW;
-
-	l = &freeipself;
-	for (np = *l; np; np = *l) {
-		if (np->expire > now) {
-			*l = np->next;
-			kfree(np);
-			continue;
-		}
-		l = &np->next;
-	}
-	p->expire = now + 5000;	/* give other threads 5 secs to get out */
-	p->next = NULL;
-	*l = p;
-}
-
 /*
  *  Decrement reference for this address on this link.
  *  Unlink from selftab if this is the last ref.
@@ -1000,11 +1060,11 @@ remselfcache(struct Fs *f, struct Ipifc *ifc, struct Iplifc *lifc, uint8_t *a)
 	qlock(&f->self->qlock);
 
 	/* find the unique selftab entry */
-	l = &f->self->hash[hashipa(a)];
+	l = &f->self->ht->b[ipaddrhash(a) & f->self->ht->mask];
 	for (p = *l; p; p = *l) {
 		if (ipcmp(p->a, a) == 0)
 			break;
-		l = &p->next;
+		l = &p->hnext;
 	}
 
 	if (p == NULL)
@@ -1077,8 +1137,11 @@ remselfcache(struct Fs *f, struct Ipifc *ifc, struct Iplifc *lifc, uint8_t *a)
 		v6delroute(f, a, IPallbits, 1);
 
 	/* no more links, remove from hash and free */
-	*l = p->next;
-	ipselffree(p);
+	__seq_start_write(&f->self->seq);
+	ACCESS_ONCE(*l) = p->hnext;
+	__seq_end_write(&f->self->seq);
+	f->self->nr_self--;
+	kfree_rcu(p, rcu);
 
 	/* if IPnoaddr, forget */
 	if (ipcmp(a, v4prefix) == 0 || ipcmp(a, IPnoaddr) == 0)
@@ -1103,8 +1166,8 @@ long ipselftabread(struct Fs *f, char *cp, uint32_t offset, int n)
 	m = 0;
 	off = offset;
 	qlock(&f->self->qlock);
-	for (i = 0; i < NHASH && m < n; i++) {
-		for (p = f->self->hash[i]; p != NULL && m < n; p = p->next) {
+	for (i = 0; i <= f->self->ht->mask && m < n; i++) {
+		for (p = f->self->ht->b[i]; p != NULL && m < n; p = p->hnext) {
 			nifc = 0;
 			for (link = p->link; link; link = link->selflink)
 				nifc++;
@@ -1120,17 +1183,48 @@ long ipselftabread(struct Fs *f, char *cp, uint32_t offset, int n)
 	return m;
 }
 
-int iptentative(struct Fs *f, uint8_t * addr)
+/* Returns addr's entry, or NULL if we don't answer to it.  Called under RCU;
+ * the entry is only good until the rcu_read_unlock(). */
+static struct Ipself *selflookup(struct Ipselftab *st, uint8_t *addr)
 {
+	struct Ipself_pcpu *pc = NULL;
 	struct Ipself *p;
-
-	p = f->self->hash[hashipa(addr)];
-	for (; p; p = p->next) {
-		if (ipcmp(addr, p->a) == 0) {
-			return p->link->lifc->tentative;
+	seq_ctr_t seq;
+	int coreid = core_id();
+
+	if (coreid < st->nr_pcpu)
+		pc = &st->pcpu[coreid];
+	do {
+		seq = ACCESS_ONCE(st->seq);
+		rmb();
+		if (pc && pc->seq == seq && pc->last &&
+		    ipcmp(addr, pc->last->a) == 0)
+			return pc->last;
+		p = selffind(rcu_dereference(st->ht), addr);
+		if (p) {
+			rmb();
+			if (pc && !seqctr_retry(seq, ACCESS_ONCE(st->seq))) {
+				pc->seq = seq;
+				pc->last = p;
+			}
+			return p;
 		}
-	}
-	return 0;
+		rmb();
+	} while (seqctr_retry(seq, ACCESS_ONCE(st->seq)));
+	return NULL;
+}
+
+int iptentative(struct Fs *f, uint8_t * addr)
+{
+	struct Ipself *p;
+	int ret = 0;
+
+	rcu_read_lock();
+	p = selflookup(f->self, addr);
+	if (p)
+		ret = p->link->lifc->tentative;
+	rcu_read_unlock();
+	return ret;
 }
 
 /*
@@ -1143,12 +1237,15 @@ int iptentative(struct Fs *f, uint8_t * addr)
 int ipforme(struct Fs *f, uint8_t * addr)
 {
 	struct Ipself *p;
-
-	p = f->self->hash[hashipa(addr)];
-	for (; p; p = p->next) {
-		if (ipcmp(addr, p->a) == 0)
-			return p->type;
-	}
+	int type = 0;
+
+	rcu_read_lock();
+	p = selflookup(f->self, addr);
+	if (p)
+		type = p->type;
+	rcu_read_unlock();
+	if (type)
+		return type;
 
 	/* hack to say accept anything */
 	if (f->self->acceptall)
@@ -39,6 +39,8 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <rcu.h>
+#include <percpu.h>
 
 static void walkadd(struct Fs *, struct route **, struct route *);
 static void addnode(struct Fs *, struct route **, struct route *);
@@ -47,9 +49,55 @@ static void calcd(struct route *);
 /* these are used for all instances of IP */
 struct route *v4freelist;
 struct route *v6freelist;
+static spinlock_t routefreelock = SPINLOCK_INITIALIZER;
 rwlock_t routelock;
 uint32_t v4routegeneration, v6routegeneration;
 
+/* Lookups don't take routelock.  They walk the trees under RCU, so the nodes
+ * they see aren't reused, and retry if the walk overlapped a change.  Writers
+ * hold the wlock, and bump route_seq around anything that changes a tree;
+ * rebalancing moves nodes around, so a walk could miss one. */
+static seq_ctr_t route_seq = SEQCTR_INITIALIZER;
+
+/* Flattened v4 routes.  Each root tree becomes a sorted array of disjoint
+ * ranges, each naming the innermost route that covers it, so a lookup is a
+ * binary search over an array instead of a pointer chase down the tree.
+ * Lookups build it lazily, once the table stops changing: the first lookup to
+ * see a new generation just notes it, and one that sees it again rebuilds.
+ * When routes are being injected, lookups just walk the trees. */
+struct v4_range {
+	uint32_t start;
+	uint32_t end;
+	struct route *r;
+};
+
+struct v4_flat {
+	struct rcu_head rcu;
+	uint32_t gen;
+	uint32_t root[(1 << Lroot) + 1];	/* first range of each root tree */
+	struct v4_range ranges[];
+};
+
+static spinlock_t v4flat_lock = SPINLOCK_INITIALIZER;
+
+/* Per-core cache of recent lookups, by destination, good until the route
+ * generation changes.  Misses are cached too. */
+#define ROUTE_CACHE_SHIFT		7
+
+struct route_cache_ent {
+	struct Fs *f;
+	uint32_t gen;
+	uint32_t addr[IPllen];		/* v4 only uses addr[0] */
+	struct route *r;
+};
+
+struct route_cache {
+	struct route_cache_ent v4[1 << ROUTE_CACHE_SHIFT];
+	struct route_cache_ent v6[1 << ROUTE_CACHE_SHIFT];
+};
+
+static DEFINE_PERCPU(struct route_cache, route_cache);
+
 /*
  * TODO: Change this to a proper release.
  * At the moment this is difficult to do since deleting
@@ -63,8 +111,9 @@ static void route_release(struct kref *kref)
 	(void)kref;
 }
 
-static void freeroute(struct route *r)
+static void __freeroute_rcu(struct rcu_head *head)
 {
+	struct route *r = container_of(head, struct route, rt.rcu);
 	struct route **l;
 
 	r->rt.left = NULL;
@@ -73,8 +122,17 @@ static void freeroute(struct route *r)
 		l = &v4freelist;
 	else
 		l = &v6freelist;
+	spin_lock(&routefreelock);
 	r->rt.mid = *l;
 	*l = r;
+	spin_unlock(&routefreelock);
+}
+
+/* Lookups might still be walking through r, so it can't go back on the
+ * freelist until they are done. */
+static void freeroute(struct route *r)
+{
+	call_rcu(&r->rt.rcu, __freeroute_rcu);
 }
 
 static struct route *allocroute(int type)
@@ -91,10 +149,12 @@ static struct route *allocroute(int type)
 		l = &v6freelist;
 	}
 
+	spin_lock(&routefreelock);
 	r = *l;
-	if (r != NULL) {
+	if (r != NULL)
 		*l = r->rt.mid;
-	} else {
+	spin_unlock(&routefreelock);
+	if (r == NULL) {
 		r = kzmalloc(n, 0);
 		if (r == NULL)
 			panic("out of routing nodes");
@@ -348,15 +408,18 @@ v4addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		memmove(p->rt.tag, tag, sizeof(p->rt.tag));
 
 		wlock(&routelock);
+		__seq_start_write(&route_seq);
 		addnode(f, &f->v4root[h], p);
 		while ((p = f->queue)) {
 			f->queue = p->rt.mid;
 			walkadd(f, &f->v4root[h], p->rt.left);
 			freeroute(p);
 		}
+		__seq_end_write(&route_seq);
+		/* under the lock, so racing changes can't lose a bump */
+		v4routegeneration++;
 		wunlock(&routelock);
 	}
-	v4routegeneration++;
 
 	ipifcaddroute(f, Rv4, a, mask, gate, type);
 }
@@ -394,15 +457,17 @@ v6addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		memmove(p->rt.tag, tag, sizeof(p->rt.tag));
 
 		wlock(&routelock);
+		__seq_start_write(&route_seq);
 		addnode(f, &f->v6root[h], p);
 		while ((p = f->queue)) {
 			f->queue = p->rt.mid;
 			walkadd(f, &f->v6root[h], p->rt.left);
 			freeroute(p);
 		}
+		__seq_end_write(&route_seq);
+		v6routegeneration++;
 		wunlock(&routelock);
 	}
-	v6routegeneration++;
 
 	ipifcaddroute(f, 0, a, mask, gate, type);
 }
@@ -457,6 +522,7 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 			 * this one, since it looks like the if code is when we want to
 			 * release.  btw, use better code reuse btw v4 and v6... */
 			if (kref_put(&p->rt.kref)) {
+				__seq_start_write(&route_seq);
 				*r = 0;
 				addqueue(&f->queue, p->rt.left);
 				addqueue(&f->queue, p->rt.mid);
@@ -467,12 +533,13 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 					walkadd(f, &f->v4root[h], p->rt.left);
 					freeroute(p);
 				}
+				__seq_end_write(&route_seq);
 			}
 		}
+		v4routegeneration++;
 		if (dolock)
 			wunlock(&routelock);
 	}
-	v4routegeneration++;
 
 	ipifcremroute(f, Rv4, a, mask);
 }
@@ -503,6 +570,7 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 			 * this one, since it looks like the if code is when we want to
 			 * release.  btw, use better code reuse btw v4 and v6... */
 			if (kref_put(&p->rt.kref)) {
+				__seq_start_write(&route_seq);
 				*r = 0;
 				addqueue(&f->queue, p->rt.left);
 				addqueue(&f->queue, p->rt.mid);
@@ -513,38 +581,221 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 					walkadd(f, &f->v6root[h], p->rt.left);
 					freeroute(p);
 				}
+				__seq_end_write(&route_seq);
 			}
 		}
+		v6routegeneration++;
 		if (dolock)
 			wunlock(&routelock);
 	}
-	v6routegeneration++;
 
 	ipifcremroute(f, 0, a, mask);
 }
 
-struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
+/* Looks up a in core's cache.  Returns TRUE and sets *r on a hit. */
+static bool route_cache_get(struct route_cache_ent *e, struct Fs *f,
+                            uint32_t gen, uint32_t *addr, int nr_words,
+                            struct route **r)
+{
+	int8_t irq_state = 0;
+	bool hit;
+
+	disable_irqsave(&irq_state);
+	hit = (e->f == f) && (e->gen == gen) &&
+	      !memcmp(e->addr, addr, nr_words * sizeof(uint32_t));
+	if (hit)
+		*r = e->r;
+	enable_irqsave(&irq_state);
+	return hit;
+}
+
+static void route_cache_put(struct route_cache_ent *e, struct Fs *f,
+                            uint32_t gen, uint32_t *addr, int nr_words,
+                            struct route *r)
+{
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	e->f = f;
+	e->gen = gen;
+	memcpy(e->addr, addr, nr_words * sizeof(uint32_t));
+	e->r = r;
+	enable_irqsave(&irq_state);
+}
+
+static unsigned int route_cache_hash(uint32_t *addr, int nr_words)
+{
+	uint32_t x = 0;
+
+	for (int i = 0; i < nr_words; i++)
+		x ^= addr[i];
+	return (x * 2654435761U) >> (32 - ROUTE_CACHE_SHIFT);
+}
+
+static size_t v4_count_nodes(struct route *p)
+{
+	if (!p)
+		return 0;
+	return 1 + v4_count_nodes(rcu_dereference(p->rt.left)) +
+	       v4_count_nodes(rcu_dereference(p->rt.mid)) +
+	       v4_count_nodes(rcu_dereference(p->rt.right));
+}
+
+static void v4_emit(struct v4_range *out, size_t *n, size_t max,
+                    uint64_t start, uint64_t end, struct route *r)
+{
+	if (*n < max) {
+		out[*n].start = start;
+		out[*n].end = end;
+		out[*n].r = r;
+	}
+	(*n)++;
+}
+
+/* Appends p's tree's ranges, in order, from *cur on.  Gaps between them belong
+ * to owner, the route whose mid tree p is, if any.  Each node adds at most two
+ * ranges: the gap before it and its own tail. */
+static void v4_flatten(struct route *p, struct route *owner, uint64_t *cur,
+                       struct v4_range *out, size_t *n, size_t max)
+{
+	if (!p)
+		return;
+	v4_flatten(rcu_dereference(p->rt.left), owner, cur, out, n, max);
+	if (owner && (*cur < p->v4.address))
+		v4_emit(out, n, max, *cur, p->v4.address - 1, owner);
+	*cur = p->v4.address;
+	v4_flatten(rcu_dereference(p->rt.mid), p, cur, out, n, max);
+	if (*cur <= p->v4.endaddress)
+		v4_emit(out, n, max, *cur, p->v4.endaddress, p);
+	*cur = (uint64_t)p->v4.endaddress + 1;
+	v4_flatten(rcu_dereference(p->rt.right), owner, cur, out, n, max);
+}
+
+/* Call under RCU.  Returns 0 if it can't allocate, or the trees changed while
+ * we were at it. */
+static struct v4_flat *v4_flat_build(struct Fs *f, uint32_t gen)
+{
+	struct v4_flat *fl;
+	size_t nr = 0, n = 0, max;
+	uint64_t cur;
+	seq_ctr_t seq;
+
+	seq = ACCESS_ONCE(route_seq);
+	for (int h = 0; h < 1 << Lroot; h++)
+		nr += v4_count_nodes(rcu_dereference(f->v4root[h]));
+	max = 2 * nr;
+	fl = kmalloc(sizeof(struct v4_flat) + max * sizeof(struct v4_range),
+	             MEM_ATOMIC);
+	if (!fl)
+		return NULL;
+	for (int h = 0; h < 1 << Lroot; h++) {
+		fl->root[h] = n;
+		cur = 0;
+		v4_flatten(rcu_dereference(f->v4root[h]), NULL, &cur, fl->ranges,
+		           &n, max);
+	}
+	fl->root[1 << Lroot] = n;
+	if ((n > max) || seqctr_retry(seq, ACCESS_ONCE(route_seq))) {
+		kfree(fl);
+		return NULL;
+	}
+	fl->gen = gen;
+	return fl;
+}
+
+/* Call under RCU.  Returns f's flat table for gen, or 0 if there isn't one yet
+ * and the caller should walk the trees. */
+static struct v4_flat *v4_flat_get(struct Fs *f, uint32_t gen)
+{
+	struct v4_flat *fl = rcu_dereference(f->v4flat), *old;
+
+	if (fl && (fl->gen == gen))
+		return fl;
+	if (ACCESS_ONCE(f->v4flat_seen) != gen) {
+		f->v4flat_seen = gen;
+		return NULL;
+	}
+	if (!spin_trylock(&v4flat_lock))
+		return NULL;
+	old = f->v4flat;
+	if (old && (old->gen == gen)) {
+		fl = old;
+	} else {
+		fl = v4_flat_build(f, gen);
+		if (fl) {
+			rcu_assign_pointer(f->v4flat, fl);
+			if (old)
+				kfree_rcu(old, rcu);
+		}
+	}
+	spin_unlock(&v4flat_lock);
+	return fl;
+}
+
+static struct route *v4_flat_lookup(struct v4_flat *fl, uint32_t la)
+{
+	size_t lo = fl->root[V4H(la)], hi = fl->root[V4H(la) + 1], mid;
+
+	/* Find the last range starting at or before la */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (fl->ranges[mid].start <= la)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if ((lo > fl->root[V4H(la)]) && (la <= fl->ranges[lo - 1].end))
+		return fl->ranges[lo - 1].r;
+	return NULL;
+}
+
+/* Call under RCU. */
+static struct route *v4_walk(struct Fs *f, uint32_t la)
 {
 	struct route *p, *q;
-	uint32_t la;
+	seq_ctr_t seq;
+
+	do {
+		seq = ACCESS_ONCE(route_seq);
+		q = NULL;
+		for (p = rcu_dereference(f->v4root[V4H(la)]); p;)
+			if (la >= p->v4.address) {
+				if (la <= p->v4.endaddress) {
+					q = p;
+					p = rcu_dereference(p->rt.mid);
+				} else
+					p = rcu_dereference(p->rt.right);
+			} else
+				p = rcu_dereference(p->rt.left);
+	} while (seqctr_retry(seq, ACCESS_ONCE(route_seq)));
+	return q;
+}
+
+struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
+{
+	struct route *q;
+	uint32_t la, gen;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
+	struct route_cache_ent *e;
+	struct v4_flat *fl;
 
-	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
-		&& c->rgen == v4routegeneration)
+	/* Check the generation first; an old c->r may have been reused. */
+	if (c != NULL && c->rgen == v4routegeneration && c->r != NULL
+		&& c->r->rt.ifc != NULL)
 		return c->r;
 
 	la = nhgetl(a);
-	q = NULL;
-	for (p = f->v4root[V4H(la)]; p;)
-		if (la >= p->v4.address) {
-			if (la <= p->v4.endaddress) {
-				q = p;
-				p = p->rt.mid;
-			} else
-				p = p->rt.right;
-		} else
-			p = p->rt.left;
+	gen = ACCESS_ONCE(v4routegeneration);
+	rmb();	/* read the generation before the routes it covers */
+	e = &PERCPU_VAR(route_cache).v4[route_cache_hash(&la, 1)];
+	if (!route_cache_get(e, f, gen, &la, 1, &q)) {
+		rcu_read_lock();
+		fl = v4_flat_get(f, gen);
+		q = fl ? v4_flat_lookup(fl, la) : v4_walk(f, la);
+		rcu_read_unlock();
+		route_cache_put(e, f, gen, &la, 1, q);
+	}
 
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
 		if (q->rt.type & Rifc) {
@@ -561,7 +812,7 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 
 	if (c != NULL) {
 		c->r = q;
-		c->rgen = v4routegeneration;
+		c->rgen = gen;
 	}
 
 	return q;
@@ -570,11 +821,13 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 {
 	struct route *p, *q;
-	uint32_t la[IPllen];
+	uint32_t la[IPllen], gen;
 	int h;
 	uint32_t x, y;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
+	struct route_cache_ent *e;
+	seq_ctr_t seq;
 
 	if (memcmp(a, v4prefix, IPv4off) == 0) {
 		q = v4lookup(f, a + IPv4off, c);
@@ -582,42 +835,54 @@ struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 			return q;
 	}
 
-	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
-		&& c->rgen == v6routegeneration)
+	if (c != NULL && c->rgen == v6routegeneration && c->r != NULL
+		&& c->r->rt.ifc != NULL)
 		return c->r;
 
 	for (h = 0; h < IPllen; h++)
 		la[h] = nhgetl(a + 4 * h);
-
-	q = 0;
-	for (p = f->v6root[V6H(la)]; p;) {
-		for (h = 0; h < IPllen; h++) {
-			x = la[h];
-			y = p->v6.address[h];
-			if (x == y)
-				continue;
-			if (x < y) {
-				p = p->rt.left;
-				goto next;
+	gen = ACCESS_ONCE(v6routegeneration);
+	rmb();	/* read the generation before the routes it covers */
+	e = &PERCPU_VAR(route_cache).v6[route_cache_hash(la, IPllen)];
+	if (route_cache_get(e, f, gen, la, IPllen, &q))
+		goto found;
+
+	rcu_read_lock();
+	do {
+		seq = ACCESS_ONCE(route_seq);
+		q = 0;
+		for (p = rcu_dereference(f->v6root[V6H(la)]); p;) {
+			for (h = 0; h < IPllen; h++) {
+				x = la[h];
+				y = p->v6.address[h];
+				if (x == y)
+					continue;
+				if (x < y) {
+					p = rcu_dereference(p->rt.left);
+					goto next;
+				}
+				break;
 			}
-			break;
-		}
-		for (h = 0; h < IPllen; h++) {
-			x = la[h];
-			y = p->v6.endaddress[h];
-			if (x == y)
-				continue;
-			if (x > y) {
-				p = p->rt.right;
-				goto next;
+			for (h = 0; h < IPllen; h++) {
+				x = la[h];
+				y = p->v6.endaddress[h];
+				if (x == y)
+					continue;
+				if (x > y) {
+					p = rcu_dereference(p->rt.right);
+					goto next;
+				}
+				break;
 			}
-			break;
+			q = p;
+			p = rcu_dereference(p->rt.mid);
+next:		;
 		}
-		q = p;
-		p = p->rt.mid;
-next:	;
-	}
+	} while (seqctr_retry(seq, ACCESS_ONCE(route_seq)));
+	rcu_read_unlock();
+	route_cache_put(e, f, gen, la, IPllen, q);
 
+found:
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
 		if (q->rt.type & Rifc) {
 			for (h = 0; h < IPllen; h++)
@@ -632,7 +897,7 @@ next:	;
 	}
 	if (c != NULL) {
 		c->r = q;
-		c->rgen = v6routegeneration;
+		c->rgen = gen;
 	}
 
 	return q;
@@ -48,13 +48,10 @@ enum {
  * This sleazy macro is stolen shamelessly from ip.c, see comment there.
  */
 #define BKFG(xp)	((struct Ipfrag*)((xp)->base))
-struct fragment6;
 
-struct block *ip6reassemble(struct IP *, int unused_int, struct block *,
+struct block *ip6reassemble(struct Fs *, int unused_int, struct block *,
                             struct ip6hdr *);
-void ipfragfree6(struct IP *, struct fragment6 *);
-struct fragment6 *ipfragallo6(struct IP *);
-static struct block *procxtns(struct IP *ip, struct block *bp, int doreasm);
+static struct block *procxtns(struct Fs *f, struct block *bp, int doreasm);
 int unfraglen(struct block *bp, uint8_t * nexthdr, int setfh);
 struct block *procopts(struct block *bp);
 
@@ -105,24 +102,6 @@ static char *statnames[] = {
 	[FragCreates] "FragCreates",
 };
 
-struct Fragment4 {
-	struct block *blist;
-	struct fragment4 *next;
-	uint32_t src;
-	uint32_t dst;
-	uint16_t id;
-	uint64_t age;
-};
-
-struct fragment6 {
-	struct block *blist;
-	struct fragment6 *next;
-	uint8_t src[IPaddrlen];
-	uint8_t dst[IPaddrlen];
-	unsigned int id;
-	uint64_t age;
-};
-
 struct Ipfrag {
 	uint16_t foff;
 	uint16_t flen;
@@ -132,14 +111,7 @@ struct Ipfrag {
 struct IP {
 	uint32_t stats[Nstats];
 
-	qlock_t fraglock4;
-	struct fragment4 *flisthead4;
-	struct fragment4 *fragfree4;
 	int id4;
-
-	qlock_t fraglock6;
-	struct fragment6 *flisthead6;
-	struct fragment6 *fragfree6;
 	int id6;
 
 	int iprouting;				/* true if we route like a gateway */
@@ -421,7 +393,7 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 		}
 
 		/* process headers & reassemble if the interface expects it */
-		bp = procxtns(ip, bp, r->rt.ifc->reassemble);
+		bp = procxtns(f, bp, r->rt.ifc->reassemble);
 
 		if (bp == NULL)
 			return;
@@ -435,7 +407,7 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	}
 
 	/* reassemble & process headers if needed */
-	bp = procxtns(ip, bp, 1);
+	bp = procxtns(f, bp, 1);
 
 	if (bp == NULL)
 		return;
@@ -454,56 +426,7 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	freeblist(bp);
 }
 
-/*
- * ipfragfree6 - copied from ipfragfree4 - assume hold fraglock6
- */
-void ipfragfree6(struct IP *ip, struct fragment6 *frag)
-{
-	struct fragment6 *fl, **l;
-
-	if (frag->blist)
-		freeblist(frag->blist);
-
-	memset(frag->src, 0, IPaddrlen);
-	frag->id = 0;
-	frag->blist = NULL;
-
-	l = &ip->flisthead6;
-	for (fl = *l; fl; fl = fl->next) {
-		if (fl == frag) {
-			*l = frag->next;
-			break;
-		}
-		l = &fl->next;
-	}
-
-	frag->next = ip->fragfree6;
-	ip->fragfree6 = frag;
-
-}
-
-/*
- * ipfragallo6 - copied from ipfragalloc4
- */
-struct fragment6 *ipfragallo6(struct IP *ip)
-{
-	struct fragment6 *f;
-
-	while (ip->fragfree6 == NULL) {
-		/* free last entry on fraglist */
-		for (f = ip->flisthead6; f->next; f = f->next) ;
-		ipfragfree6(ip, f);
-	}
-	f = ip->fragfree6;
-	ip->fragfree6 = f->next;
-	f->next = ip->flisthead6;
-	ip->flisthead6 = f;
-	f->age = NOW + 30000;
-
-	return f;
-}
-
-static struct block *procxtns(struct IP *ip, struct block *bp, int doreasm)
+static struct block *procxtns(struct Fs *f, struct block *bp, int doreasm)
 {
 
 	int offset;
@@ -514,7 +437,7 @@ static struct block *procxtns(struct IP *ip, struct block *bp, int doreasm)
 	offset = unfraglen(bp, &proto, 0);
 
 	if ((proto == FH) && (doreasm != 0)) {
-		bp = ip6reassemble(ip, offset, bp, h);
+		bp = ip6reassemble(f, offset, bp, h);
 		if (bp == NULL)
 			return NULL;
 		offset = unfraglen(bp, &proto, 0);
@@ -567,22 +490,23 @@ struct block *procopts(struct block *bp)
 	return bp;
 }
 
-struct block *ip6reassemble(struct IP *ip, int uflen, struct block *bp,
+struct block *ip6reassemble(struct Fs *fs, int uflen, struct block *bp,
                             struct ip6hdr *ih)
 {
-
+	struct IP *ip = fs->ip;
 	int fend, offset;
-	unsigned int id;
-	struct fragment6 *f, *fnext;
+	struct fragq *f;
+	struct fragkey key;
 	struct fraghdr6 *fraghdr;
-	uint8_t src[IPaddrlen], dst[IPaddrlen];
 	struct block *bl, **l, *last, *prev;
 	int ovlap, len, fragsize, pktposn;
 
 	fraghdr = (struct fraghdr6 *)(bp->rp + uflen);
-	memmove(src, ih->src, IPaddrlen);
-	memmove(dst, ih->dst, IPaddrlen);
-	id = nhgetl(fraghdr->id);
+	memmove(key.src, ih->src, IPaddrlen);
+	memmove(key.dst, ih->dst, IPaddrlen);
+	key.id = nhgetl(fraghdr->id);
+	key.proto = fraghdr->nexthdr;
+	key.vers = IP_VER6;
 	offset = nhgets(fraghdr->offsetRM) & ~7;
 
 	/*
@@ -593,20 +517,11 @@ struct block *ip6reassemble(struct IP *ip, int uflen, struct block *bp,
 		ih = (struct ip6hdr *)(bp->rp);
 	}
 
-	qlock(&ip->fraglock6);
-
 	/*
 	 *  find a reassembly queue for this fragment
 	 */
-	for (f = ip->flisthead6; f; f = fnext) {
-		fnext = f->next;
-		if (ipcmp(f->src, src) == 0 && ipcmp(f->dst, dst) == 0 && f->id == id)
-			break;
-		if (f->age < NOW) {
-			ip->stats[ReasmTimeout]++;
-			ipfragfree6(ip, f);
-		}
-	}
+	fraglock(fs, &key);
+	f = fragfind(fs, &key);
 
 	/*
 	 *  if this isn't a fragmented packet, accept it
@@ -615,10 +530,10 @@ struct block *ip6reassemble(struct IP *ip, int uflen, struct block *bp,
 	 */
 	if (nhgets(fraghdr->offsetRM) == 0) {	// first frag is also the last
 		if (f != NULL) {
-			ipfragfree6(ip, f);
+			fragfree(fs, f);
 			ip->stats[ReasmFails]++;
 		}
-		qunlock(&ip->fraglock6);
+		fragunlock(fs, &key);
 		return bp;
 	}
 
@@ -632,15 +547,13 @@ struct block *ip6reassemble(struct IP *ip, int uflen, struct block *bp,
 
 	/* First fragment allocates a reassembly queue */
 	if (f == NULL) {
-		f = ipfragallo6(ip);
-		f->id = id;
-		memmove(f->src, src, IPaddrlen);
-		memmove(f->dst, dst, IPaddrlen);
-
-		f->blist = bp;
-
-		qunlock(&ip->fraglock6);
-		ip->stats[ReasmReqds]++;
+		if (fragnew(fs, &key, bp) == NULL) {
+			freeblist(bp);
+			ip->stats[ReasmFails]++;
+		} else {
+			ip->stats[ReasmReqds]++;
+		}
+		fragunlock(fs, &key);
 		return NULL;
 	}
 
@@ -662,7 +575,7 @@ struct block *ip6reassemble(struct IP *ip, int uflen, struct block *bp,
 		if (ovlap > 0) {
 			if (ovlap >= BKFG(bp)->flen) {
 				freeblist(bp);
-				qunlock(&ip->fraglock6);
+				fragunlock(fs, &key);
 				return NULL;
 			}
 			BKFG(prev)->flen -= ovlap;
@@ -732,16 +645,17 @@ struct block *ip6reassemble(struct IP *ip, int uflen, struct block *bp,
 
 			bl = f->blist;
 			f->blist = NULL;
-			ipfragfree6(ip, f);
+			fragfree(fs, f);
 			ih = (struct ip6hdr *)(bl->rp);
 			hnputs(ih->ploadlen, len);
-			qunlock(&ip->fraglock6);
+			fragunlock(fs, &key);
 			ip->stats[ReasmOKs]++;
 			return bl;
 		}
 		pktposn += BKFG(bl)->flen;
 	}
-	qunlock(&ip->fraglock6);
+	fragupdate(fs, f);
+	fragunlock(fs, &key);
 
 	return NULL;
 }
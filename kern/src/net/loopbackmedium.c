@@ -38,21 +38,31 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <trap.h>
 #include <ip.h>
 
+/* Loopback packets skip the kproc: loopbackbwrite() hands each one to a
+ * routine kernel message on the sending core, which feeds it to ipiput4().
+ * RKMs run once the sender is out of the stack, so we never reenter a protocol
+ * that is holding its locks, and the sender's packets stay in order.  The
+ * packet never left memory, so we skip the checksums.  The transport layers
+ * already skip theirs, since no one finalizes them on the way out, and we mark
+ * the IP header checked too.
+ *
+ * inflight counts the bytes handed off but not yet delivered, so a sender that
+ * outruns the receive side gets dropped, like it used to at the queue. */
+
 enum {
 	Maxtu = 16 * 1024,
+	Maxinflight = 128 * 1024,
 };
 
 typedef struct LB LB;
 struct LB {
-	struct proc *readp;
-	struct queue *q;
 	struct Fs *f;
+	atomic_t inflight;
 };
 
-static void loopbackread(void *a);
-
 static void
 loopbackbind(struct Ipifc *ifc, int unused_int, char **unused_char_pp_t)
 {
@@ -60,32 +70,49 @@ loopbackbind(struct Ipifc *ifc, int unused_int, char **unused_char_pp_t)
 
 	lb = kzmalloc(sizeof(*lb), 0);
 	lb->f = ifc->conv->p->f;
-	/* TO DO: make queue size a function of kernel memory */
-	lb->q = qopen(128 * 1024, Qmsg, NULL, NULL);
+	atomic_init(&lb->inflight, 0);
 	ifc->arg = lb;
 	ifc->mbps = 1000;
-
-	ktask("loopbackread", loopbackread, ifc);
-
 }
 
 static void loopbackunbind(struct Ipifc *ifc)
 {
 	LB *lb = ifc->arg;
 
-	printk("%s is messed up, shouldn't track procs\n", __FUNCTION__);
-
-	/*if(lb->readp)
-	   postnote(lb->readp, 1, "unbind", 0);
-	 */
+	/* wait for the packets in flight, which point at the ifc */
+	while (atomic_read(&lb->inflight))
+		kthread_usleep(1000);
+	kfree(lb);
+}
 
-	/* wait for reader to die */
-	while (lb->readp != 0)
-		kthread_usleep(300 * 1000);
+/* RKM: delivers one packet sent by loopbackbwrite() */
+static void __loopback_deliver(uint32_t srcid, long a0, long a1, long a2)
+{
+	ERRSTACK(1);
+	struct Ipifc *ifc = (struct Ipifc *)a0;
+	struct block *bp = (struct block *)a1;
+	LB *lb = ifc->arg;
 
-	/* clean up */
-	qfree(lb->q);
-	kfree(lb);
+	ifc->in++;
+	if (!canrlock(&ifc->rwlock)) {
+		freeblist(bp);
+		goto out;
+	}
+	if (waserror()) {
+		runlock(&ifc->rwlock);
+		poperror();
+		goto out;
+	}
+	if (ifc->lifc == NULL) {
+		freeblist(bp);
+	} else {
+		ipifc_trace_block(ifc, bp);
+		ipiput4(lb->f, ifc, bp);
+	}
+	runlock(&ifc->rwlock);
+	poperror();
+out:
+	atomic_add(&lb->inflight, -a2);
 }
 
 static void
@@ -93,52 +120,20 @@ loopbackbwrite(struct Ipifc *ifc, struct block *bp, int unused_int,
 			   uint8_t * unused_uint8_p_t)
 {
 	LB *lb;
+	long len;
 
 	lb = ifc->arg;
-	if (qpass(lb->q, bp) < 0)
-		ifc->outerr++;
 	ifc->out++;
-}
-
-static void loopbackread(void *a)
-{
-	ERRSTACK(2);
-	struct Ipifc *ifc;
-	struct block *bp;
-	LB *lb;
-
-	ifc = a;
-	lb = ifc->arg;
-	lb->readp = current;	/* hide identity under a rock for unbind */
-	if (waserror()) {
-		lb->readp = 0;
-		warn("loopbackread exits unexpectedly");
+	len = blocklen(bp);
+	if (atomic_fetch_and_add(&lb->inflight, len) + len > Maxinflight) {
+		atomic_add(&lb->inflight, -len);
+		ifc->outerr++;
+		freeblist(bp);
 		return;
-		poperror();
 	}
-	for (;;) {
-		bp = qbread(lb->q, Maxtu);
-		if (bp == NULL)
-			continue;
-		ifc->in++;
-		if (!canrlock(&ifc->rwlock)) {
-			freeb(bp);
-			continue;
-		}
-		if (waserror()) {
-			runlock(&ifc->rwlock);
-			nexterror();
-		}
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput4(lb->f, ifc, bp);
-		}
-		runlock(&ifc->rwlock);
-		poperror();
-	}
-	poperror();
+	bp->flag |= Bipck;
+	send_kernel_message(core_id(), __loopback_deliver, (long)ifc, (long)bp,
+	                    len, KMSG_ROUTINE);
 }
 
 struct medium loopbackmedium = {
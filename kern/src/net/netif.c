@@ -210,6 +210,10 @@ netifgen(struct chan *c, char *unused_char_p_t, struct dirtab *vp,
 			q.path = NETQID(NETID(c->qid.path), Nifstatqid);
 			devdir(c, q, "ifstats", 0, eve, 0444, dp);
 			break;
+		case 5:
+			q.path = NETQID(NETID(c->qid.path), Ncapringqid);
+			devdir(c, q, "capring", 0, o, perm & 0444, dp);
+			break;
 		default:
 			return -1;
 	}
@@ -262,6 +266,79 @@ struct chan *netifopen(struct ether *nif, struct chan *c, int omode)
 	return c;
 }
 
+/*
+ *  with vnethdr, a batch record is a header and then the frame.  the header
+ *  says which checksums the NIC checked.  returns the record's length, or 0 if
+ *  there's no frame.
+ */
+static long netif_vnethdr_read(struct netfile *f, uint8_t *va, long n,
+                               bool nonblock)
+{
+	struct netif_vnethdr vh = {0};
+	struct block *bp;
+	size_t len;
+
+	n = MIN(n, NETIF_MAXREC) - sizeof(vh);
+	bp = nonblock ? qbread_nonblock(f->in, n) : qbread(f->in, n);
+	if (!bp)
+		return 0;
+	if (bp->flag & (Btcpck | Budpck))
+		vh.flags = NETIF_VNET_F_DATA_VALID;
+	memcpy(va, &vh, sizeof(vh));
+	len = BLEN(bp);
+	bl2mem(va + sizeof(vh), bp, len);
+	return sizeof(vh) + len;
+}
+
+static long netif_batch_rec(struct netfile *f, uint8_t *va, long n,
+                            bool nonblock)
+{
+	if (f->vnethdr)
+		return netif_vnethdr_read(f, va, n, nonblock);
+	return nonblock ? qread_nonblock(f->in, va, n) : qread(f->in, va, n);
+}
+
+/*
+ *  in batch mode, a read of the data file returns as many frames as fit, each
+ *  a 2 byte big-endian length and then the frame.  only the first frame can
+ *  block.  the queue is Qmsg, so a frame that doesn't fit is cut short; we only
+ *  go back for another while there is room for a full-sized one.
+ */
+static long netif_batch_read(struct ether *nif, struct netfile *f, uint8_t *va,
+                             long n)
+{
+	ERRSTACK(1);
+	long max_rec = NETIF_BATCHHDR + nif->maxmtu + ETHERHDRSIZE;
+	long done;
+	size_t len;
+
+	/* vnethdr readers take GRO frames, which can be up to 64K */
+	if (f->vnethdr)
+		max_rec = NETIF_BATCHHDR + NETIF_MAXREC;
+	if (n <= NETIF_BATCHHDR)
+		error(EINVAL, "batch read too short for a record");
+	len = netif_batch_rec(f, va + NETIF_BATCHHDR, n - NETIF_BATCHHDR, FALSE);
+	if (!len)
+		return 0;
+	hnputs(va, len);
+	done = NETIF_BATCHHDR + len;
+	/* the rest are only what's already queued */
+	if (waserror()) {
+		poperror();
+		return done;
+	}
+	while (n - done >= max_rec) {
+		len = netif_batch_rec(f, va + done + NETIF_BATCHHDR,
+		                      n - done - NETIF_BATCHHDR, TRUE);
+		if (!len)
+			break;
+		hnputs(va + done, len);
+		done += NETIF_BATCHHDR + len;
+	}
+	poperror();
+	return done;
+}
+
 long
 netifread(struct ether *nif, struct chan *c, void *a, long n,
 	  uint32_t offset)
@@ -276,6 +353,8 @@ netifread(struct ether *nif, struct chan *c, void *a, long n,
 	switch (NETTYPE(c->qid.path)) {
 		case Ndataqid:
 			f = nif->f[NETID(c->qid.path)];
+			if (f->batch)
+				return netif_batch_read(nif, f, a, n);
 			return qread(f->in, a, n);
 		case Nctlqid:
 			return readnum(offset, a, n, NETID(c->qid.path), NUMSIZE);
@@ -297,6 +376,7 @@ netifread(struct ether *nif, struct chan *c, void *a, long n,
 			j += snprintf(p + j, READSTR - j, "output errs: %d\n", nif->oerrs);
 			j += snprintf(p + j, READSTR - j, "prom: %d\n", nif->prom);
 			j += snprintf(p + j, READSTR - j, "mbps: %d\n", nif->mbps);
+			j += snprintf(p + j, READSTR - j, "maxmtu: %d\n", nif->maxmtu);
 			j += snprintf(p + j, READSTR - j, "addr: ");
 			for (i = 0; i < nif->alen; i++)
 				j += snprintf(p + j, READSTR - j, "%02.2x", nif->addr[i]);
@@ -316,6 +396,8 @@ netifread(struct ether *nif, struct chan *c, void *a, long n,
 				j += snprintf(p + j, READSTR - j, "tso ");
 			if (nif->feat & NETF_LRO)
 				j += snprintf(p + j, READSTR - j, "lro ");
+			if (nif->feat & NETF_GSO)
+				j += snprintf(p + j, READSTR - j, "gso ");
 			snprintf(p + j, READSTR - j, "\n");
 			n = readstr(offset, a, n, p);
 			kfree(p);
@@ -335,18 +417,35 @@ netifread(struct ether *nif, struct chan *c, void *a, long n,
 			return readnum(offset, a, n, f->type, NUMSIZE);
 		case Nifstatqid:
 			return 0;
+		case Ncapringqid:
+			f = nif->f[NETID(c->qid.path)];
+			return capring_read(f, a, n, offset);
 	}
 	error(EINVAL, ERROR_FIXME);
 	return -1;	/* not reached */
 }
 
 struct block *netifbread(struct ether *nif, struct chan *c, long n,
-						 uint32_t offset)
+						 int64_t offset)
 {
+	ERRSTACK(1);
+	struct netfile *f;
+	struct block *bp;
+
 	if ((c->qid.type & QTDIR) || NETTYPE(c->qid.path) != Ndataqid)
 		return devbread(c, n, offset);
 
-	return qbread(nif->f[NETID(c->qid.path)]->in, n);
+	f = nif->f[NETID(c->qid.path)];
+	if (!f->batch)
+		return qbread(f->in, n);
+	bp = block_alloc(n, MEM_WAIT);
+	if (waserror()) {
+		freeb(bp);
+		nexterror();
+	}
+	bp->wp += netif_batch_read(nif, f, bp->wp, n);
+	poperror();
+	return bp;
 }
 
 /*
@@ -380,10 +479,14 @@ long netifwrite(struct ether *nif, struct chan *c, void *a, long n)
 	int type;
 	char *p, buf[64];
 	uint8_t binaddr[Nmaxaddr];
+	uint32_t nr_frames, snaplen, ev_id, batch;
+	struct event_queue *ev_q;
+	long full;
 
 	if (NETTYPE(c->qid.path) != Nctlqid)
 		error(EPERM, ERROR_FIXME);
 
+	full = n;
 	if (n >= sizeof(buf))
 		n = sizeof(buf) - 1;
 	memmove(buf, a, n);
@@ -425,6 +528,12 @@ long netifwrite(struct ether *nif, struct chan *c, void *a, long n)
 		f->bridge = 1;
 	} else if (matchtoken(buf, "headersonly")) {
 		f->headersonly = 1;
+	} else if ((p = matchtoken(buf, "batch")) != 0) {
+		/* batch [off]: many frames per data read or write */
+		f->batch = !matchtoken(p, "off");
+	} else if ((p = matchtoken(buf, "vnethdr")) != 0) {
+		/* vnethdr [off]: offload headers on batch records */
+		f->vnethdr = !matchtoken(p, "off");
 	} else if ((p = matchtoken(buf, "addmulti")) != 0) {
 		if (parseaddr(binaddr, p, nif->alen) < 0)
 			error(EFAIL, "bad address");
@@ -437,6 +546,18 @@ long netifwrite(struct ether *nif, struct chan *c, void *a, long n)
 		p = netmulti(nif, f, binaddr, 0);
 		if (p)
 			error(EFAIL, p);
+	} else if ((p = matchtoken(buf, "capring")) != 0) {
+		/* capring nr_frames snaplen [ev_q ev_id batch] */
+		nr_frames = strtoul(p, &p, 0);
+		snaplen = strtoul(p, &p, 0);
+		ev_q = (struct event_queue*)strtoul(p, &p, 16);
+		ev_id = strtoul(p, &p, 0);
+		batch = strtoul(p, &p, 0);
+		capring_setup(f, nr_frames, snaplen, ev_q, ev_id, batch);
+	} else if (matchtoken(buf, "filter")) {
+		/* filter off | filter NR_INSNS CODE JT JF K ..., maybe long */
+		bpf_attach(f, a, full);
+		n = full;
 	} else if (matchtoken(buf, "oneblock")) {
 		/* Qmsg + Qcoal = one block at a time. */
 		q_toggle_qmsg(f->in, TRUE);
@@ -530,6 +651,10 @@ void netifclose(struct ether *nif, struct chan *c)
 		f->type = 0;
 		f->bridge = 0;
 		f->headersonly = 0;
+		f->batch = 0;
+		f->vnethdr = 0;
+		capring_free(f);
+		bpf_detach(f);
 		qclose(f->in);
 	}
 	qunlock(&f->qlock);
@@ -81,6 +81,7 @@ static Netlogflag flags[] = {
 	{"gre", Loggre,},
 	{"tcpwin", Logtcp | Logtcpwin,},
 	{"tcprxmt", Logtcp | Logtcprxmt,},
+	{"tcptrace", Logtcptrace,},
 	{"udpmsg", Logudp | Logudpmsg,},
 	{"ipmsg", Logip | Logipmsg,},
 	{"esp", Logesp,},
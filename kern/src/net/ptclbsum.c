@@ -127,6 +127,30 @@ union q_util {
 	uint64_t q;
 };
 
+/* Sums nr 64 byte blocks with a chain of add-with-carries, which keeps the
+ * adder busy on every cycle.  Returns the sum folded to 33 bits, so the caller
+ * can add it to its own sum.  We can't use SSE or AVX in the kernel: we don't
+ * save the user's vector state on entry. */
+static uint64_t in_cksum_adc(const uint32_t *lw, size_t nr)
+{
+	uint64_t sum = 0;
+
+	for (; nr; nr--, lw += 16) {
+		asm("addq 0(%[p]), %[sum]\n\t"
+		    "adcq 8(%[p]), %[sum]\n\t"
+		    "adcq 16(%[p]), %[sum]\n\t"
+		    "adcq 24(%[p]), %[sum]\n\t"
+		    "adcq 32(%[p]), %[sum]\n\t"
+		    "adcq 40(%[p]), %[sum]\n\t"
+		    "adcq 48(%[p]), %[sum]\n\t"
+		    "adcq 56(%[p]), %[sum]\n\t"
+		    "adcq $0, %[sum]"
+		    : [sum] "+r" (sum)
+		    : [p] "r" (lw), "m" (*(const uint8_t (*)[64])lw));
+	}
+	return (sum & 0xffffffff) + (sum >> 32);
+}
+
 static uint64_t
 in_cksumdata(const void *buf, int len)
 {
@@ -152,6 +176,15 @@ in_cksumdata(const void *buf, int len)
 			return sum;
 		}
 	}
+	if (len >= 64) {
+		sum += in_cksum_adc(lw, len / 64);
+		lw += (len / 64) * 16;
+		len &= 63;
+		if (!len) {
+			REDUCE32;
+			return sum;
+		}
+	}
 #if 0
 	/*
 	 * Force to cache line boundary.
@@ -217,6 +250,28 @@ uint16_t ptclbsum(uint8_t * addr, int len)
 	REDUCE16;
 	return cpu_to_be16(sum);
 }
+
+/* Copies len bytes from src to dst and returns ptclbsum() of them, in one pass
+ * over the data. */
+uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len)
+{
+	uint64_t sum = 0, w;
+	uint8_t tail[8] = {0};
+	union q_util q_util;
+	union l_util l_util;
+
+	for (; len >= 8; len -= 8, src += 8, dst += 8) {
+		__builtin_memcpy(&w, src, 8);
+		__builtin_memcpy(dst, &w, 8);
+		sum += (uint32_t)w + (w >> 32);
+	}
+	memcpy(tail, src, len);
+	memcpy(dst, tail, len);
+	__builtin_memcpy(&w, tail, 8);
+	sum += (uint32_t)w + (w >> 32);
+	REDUCE16;
+	return cpu_to_be16(sum);
+}
 #else
 uint16_t ptclbsum(uint8_t * addr, int len)
 {
@@ -284,4 +339,10 @@ uint16_t ptclbsum(uint8_t * addr, int len)
 
 	return losum & 0xffff;
 }
+
+uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len)
+{
+	memcpy(dst, src, len);
+	return ptclbsum(dst, len);
+}
 #endif
@@ -53,6 +53,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <tracepoint.h>
 
 enum {
 	QMAX = 64 * 1024 - 1,
@@ -69,11 +70,13 @@ enum {
 	TCP6_HDRSIZE = 20,
 	TCP6_TCBPHDRSZ = 60,
 	TCP6_PKT = TCP6_IPLEN + TCP6_PHDRSIZE,
+	TSO_MAX = QMAX - TCP4_PKT - TCP4_HDRSIZE,	/* biggest super-segment */
 
 	TcptimerOFF = 0,
 	TcptimerON = 1,
 	TcptimerDONE = 2,
 	MAX_TIME = (1 << 20),	/* Forever */
+	NTIMERSLOTS = 4096,	/* Timer wheel size, in ticks */
 	TCP_ACK = 50,	/* Timed ack sequence in ms */
 	MAXBACKMS = 9 * 60 * 1000,	/* longest backoff time (ms) before hangup */
 
@@ -90,8 +93,17 @@ enum {
 	MSS_LENGTH = 4,	/* Mean segment size */
 	WSOPT = 3,
 	WS_LENGTH = 3,	/* Bits to scale window size by */
+	SACK_OK_OPT = 4,
+	SACK_OK_LENGTH = 2,	/* SACK permitted, only on SYNs */
+	SACK_OPT = 5,
+	SACK_HDR_LENGTH = 2,	/* kind and length, then the blocks */
+	SACK_BLK_LENGTH = 8,
+	MAX_NR_SACKS_PER_PACKET = 4,	/* 34 of the 40 bytes of options */
+	MAX_NR_RCV_SACKS = MAX_NR_SACKS_PER_PACKET,
+	MAX_NR_SND_SACKS = 16,	/* scoreboard size */
 	MSL2 = 10,
 	MSPTICK = 50,	/* Milliseconds per timer tick */
+	TICK_SLACK = 5,	/* Milliseconds a timer tick may run late */
 	DEF_MSS = 1460,	/* Default mean segment */
 	DEF_MSS6 = 1280,	/* Default mean segment (min) for v6 */
 	DEF_RTT = 500,	/* Default round trip */
@@ -102,6 +114,10 @@ enum {
 
 	TCPREXMTTHRESH = 3,	/* dupack threshhold for rxt */
 
+	TAHOE_RECOVERY = 1,	/* snd.recovery: go back to snd.una */
+	SACK_RECOVERY = 2,	/* snd.recovery: fill in the holes, RFC 6675 */
+	RENO_RECOVERY = 3,	/* snd.recovery: newreno, a hole per partial ack */
+
 	FORCE = 1,
 	CLONE = 2,
 	RETRAN = 4,
@@ -124,9 +140,10 @@ enum {
 	Last_ack,
 	Time_wait,
 
-	Maxlimbo = 1000,	/* maximum procs waiting for response to SYN ACK */
-	NLHT = 256,	/* hash table size, must be a power of 2 */
-	LHTMASK = NLHT - 1,
+	Maxlimbo = 16384,	/* maximum procs waiting for response to SYN ACK */
+	NLHT = 256,	/* initial hash table size, must be a power of 2 */
+	Maxlht = 8192,	/* the table doubles up to this, at 2 calls per bucket */
+	SYNCOOKIE_SHIFT = 16,	/* cookies age every 2^16 ms, about a minute */
 
 	HaveWS = 1 << 8,
 };
@@ -145,7 +162,7 @@ struct Tcptimer {
 	Tcptimer *readynext;
 	int state;
 	uint64_t start;
-	uint64_t count;
+	uint64_t when;				/* tick it goes off at */
 	void (*func) (void *);
 	void *arg;
 };
@@ -198,6 +215,12 @@ struct Tcp6hdr {
 	uint8_t tcpopt[1];
 };
 
+/* [left, right) of sequence space the receiver has */
+struct sack_block {
+	uint32_t left;
+	uint32_t right;
+};
+
 /*
  *  this represents the control info
  *  for a single packet.  It is derived from
@@ -216,6 +239,9 @@ struct Tcp {
 	uint16_t urg;
 	uint16_t mss;				/* max segment size option (if not zero) */
 	uint16_t len;				/* size of data */
+	uint8_t sack_ok;			/* SACK permitted option (SYN only) */
+	uint8_t nr_sacks;			/* SACK option blocks (not on SYNs) */
+	struct sack_block sacks[MAX_NR_SACKS_PER_PACKET];
 };
 
 /*
@@ -234,6 +260,62 @@ struct Reseq {
  *  the qlock in the Conv locks this structure
  */
 typedef struct Tcpctl Tcpctl;
+
+/*
+ *  congestion control only decides how cwind grows past ssthresh and what
+ *  ssthresh becomes after a loss.  slow start, loss recovery and timeouts
+ *  are the same for everyone.
+ */
+struct tcp_cc_ops {
+	char *name;
+	void (*init)(Tcpctl *tcb);
+	void (*cong_avoid)(Tcpctl *tcb, uint32_t acked);
+	uint32_t (*ssthresh)(Tcpctl *tcb);
+};
+
+struct cubic {
+	uint64_t epoch;				/* ms this curve started, 0 for none */
+	uint32_t w_max;				/* cwind at the last loss */
+	uint32_t w_start;			/* cwind when the curve started */
+	uint32_t origin;			/* the curve's plateau */
+	uint32_t k;					/* ms from the epoch to the plateau */
+};
+
+enum {
+	TCP_HIST_SZ = 20,			/* log2(usec) buckets, the last has the rest */
+};
+
+/*
+ *  per-conversation stats, for #ip/tcp/N/stats.  the latency samples go into
+ *  histograms and, one in trace_every, into the tcptrace netlog.  the queueing
+ *  delays track one block at a time: the wq sample is how long a write waited
+ *  until it was first sent, and the rq sample is how long a segment waited
+ *  until it was read.  we find out about reads at the next TCP event, so the
+ *  rq delay is an upper bound.
+ */
+struct tcp_convstats {
+	uint64_t segs_in;
+	uint64_t segs_out;
+	uint64_t bytes_in;			/* payload only */
+	uint64_t bytes_out;
+	uint64_t rexmit_segs;
+	uint64_t rexmit_bytes;
+	uint64_t timeouts;
+	uint64_t rtt_hist[TCP_HIST_SZ];
+	uint64_t rq_delay_hist[TCP_HIST_SZ];
+	uint64_t wq_delay_hist[TCP_HIST_SZ];
+	uint64_t wnd_blocked_usec;	/* time unsent data waited on snd.wnd */
+	uint64_t wnd_blocked_tsc;	/* when we were blocked, 0 if we aren't */
+	uint64_t rtt_tsc;			/* when the rtt_timer started */
+	uint64_t rq_bytes;			/* total ever put on the rq */
+	uint64_t rq_mark;			/* rq_bytes through the sampled block */
+	uint64_t rq_mark_tsc;		/* 0 for no sample */
+	uint32_t wq_mark;			/* seq after the sampled write */
+	uint64_t wq_mark_tsc;		/* 0 for no sample */
+	uint32_t trace_every;		/* 0 for no tracing */
+	uint32_t trace_count;
+};
+
 struct Tcpctl {
 	uint8_t state;				/* Connection state */
 	uint8_t type;				/* Listening or active connection */
@@ -250,6 +332,10 @@ struct Tcpctl {
 		uint32_t dupacks;		/* number of duplicate acks rcvd */
 		int recovery;			/* loss recovery flag */
 		uint32_t rxt;			/* right window marker for recovery */
+		/* SACK scoreboard: sorted, disjoint, all above una */
+		uint32_t rtx;			/* next to retransmit in sack recovery */
+		int nr_sacks;
+		struct sack_block sacks[MAX_NR_SND_SACKS];
 	} snd;
 	struct {
 		uint32_t nxt;			/* Receive pointer to next uint8_t slot */
@@ -258,12 +344,17 @@ struct Tcpctl {
 		int blocked;
 		int una;				/* unacked data segs */
 		int scale;				/* how much to left shift window in rcved packets */
+		int nr_sacks;			/* most recently changed first */
+		struct sack_block sacks[MAX_NR_RCV_SACKS];
 	} rcv;
 	uint32_t iss;				/* Initial sequence number */
 	int sawwsopt;				/* true if we saw a wsopt on the incoming SYN */
+	int sack_ok;				/* both sides do SACK */
 	uint32_t cwind;				/* Congestion window */
 	int scale;					/* desired snd.scale */
-	uint16_t ssthresh;			/* Slow start threshold */
+	uint32_t ssthresh;			/* Slow start threshold */
+	struct tcp_cc_ops *cc;		/* Congestion control */
+	struct cubic cubic;
 	int resent;					/* Bytes just resent */
 	int irs;					/* Initial received squence */
 	uint16_t mss;				/* Mean segment size */
@@ -285,6 +376,7 @@ struct Tcpctl {
 	uint64_t time;				/* time Finwait2 or Syn_received was sent */
 	int nochecksum;				/* non-zero means don't send checksums */
 	int flgcnt;					/* number of flags in the sequence (FIN,SEQ) */
+	struct tcp_convstats cstats;
 
 	union {
 		Tcp4hdr tcp4hdr;
@@ -301,9 +393,12 @@ struct Tcpctl {
  *  In particular they aren't on a listener's queue so that they don't figure
  *  in the input queue limit.
  *
- *  If 1/2 of a T3 was attacking SYN packets, we'ld have a permanent queue
- *  of 70000 limbo'd calls.  Not great for a linear list but doable.  Therefore
- *  there is no hashing of this list.
+ *  The hash table grows with the number of calls, keyed with a random secret
+ *  so no one can aim at a single bucket.  Once Maxlimbo calls are waiting, new
+ *  SYNs get a SYN cookie instead of a limbo entry: the SYN ACK's sequence
+ *  number encodes the call, and tcpincoming() rebuilds the call from the ACK.
+ *  Cookies can't remember window scaling or SACK, and only approximate the
+ *  MSS, so they are just for overflow.
  */
 typedef struct Limbo Limbo;
 struct Limbo {
@@ -321,6 +416,7 @@ struct Limbo {
 	uint64_t lastsend;			/* last time we sent a synack */
 	uint8_t version;			/* v4 or v6 */
 	uint8_t rexmits;			/* number of retransmissions */
+	uint8_t sack_ok;			/* the SYN offered SACK */
 };
 
 int tcp_irtt = DEF_RTT;			/* Initial guess at round trip time */
@@ -345,6 +441,11 @@ enum {
 	HlenErrs,
 	LenErrs,
 	OutOfOrder,
+	SackRecoveries,
+	RenoRecoveries,
+	SynCookiesSent,
+	SynCookiesRecv,
+	SynCookiesFailed,
 
 	Nstats
 };
@@ -365,20 +466,29 @@ static char *statnames[] = {
 	[HlenErrs] "HlenErrs",
 	[LenErrs] "LenErrs",
 	[OutOfOrder] "OutOfOrder",
+	[SackRecoveries] "SackRecoveries",
+	[RenoRecoveries] "RenoRecoveries",
+	[SynCookiesSent] "SynCookiesSent",
+	[SynCookiesRecv] "SynCookiesRecv",
+	[SynCookiesFailed] "SynCookiesFailed",
 };
 
 typedef struct Tcppriv Tcppriv;
 struct tcppriv {
-	/* List of active timers */
+	/* active timers, hashed on the tick they go off at */
 	qlock_t tl;
-	Tcptimer *timers;
+	uint64_t tick;
+	Tcptimer *timers[NTIMERSLOTS];
 
 	/* hash table for matching conversations */
 	struct Ipht ht;
 
 	/* calls in limbo waiting for an ACK to our SYN ACK */
 	int nlimbo;
-	Limbo *lht[NLHT];
+	int nlht;					/* power of two */
+	Limbo **lht;
+	uint64_t secret;			/* for the limbo hash and SYN cookies */
+	uint64_t lastcookie;		/* when we last sent a SYN cookie */
 
 	/* for keeping track of tcpackproc */
 	qlock_t apl;
@@ -398,6 +508,14 @@ struct tcppriv {
  */
 int tcpporthogdefense = 0;
 
+/* ticks until t goes off (or would have, if it was halted) */
+static uint64_t tcptimerleft(struct tcppriv *priv, Tcptimer *t)
+{
+	uint64_t tick = ACCESS_ONCE(priv->tick);
+
+	return t->when > tick ? t->when - tick : 0;
+}
+
 int addreseq(Tcpctl *, struct tcppriv *, Tcp *, struct block *, uint16_t);
 void getreseq(Tcpctl *, Tcp *, struct block **, uint16_t *);
 void localclose(struct conv *, char *unused_char_p_t);
@@ -416,11 +534,15 @@ void tcprxmit(struct conv *);
 void tcpsettimer(Tcpctl *);
 void tcpsynackrtt(struct conv *);
 void tcpsetscale(struct conv *, Tcpctl *, uint16_t, uint16_t);
+int seq_gt(uint32_t, uint32_t);
+int seq_ge(uint32_t, uint32_t);
 
 static void limborexmit(struct Proto *);
 static void limbo(struct conv *, uint8_t * unused_uint8_p_t, uint8_t *, Tcp *,
 				  int);
 
+DEFINE_TRACEPOINT(tcp_state, "conv %d lport %d rport %d old %d new %d");
+
 void tcpsetstate(struct conv *s, uint8_t newstate)
 {
 	Tcpctl *tcb;
@@ -440,6 +562,8 @@ void tcpsetstate(struct conv *s, uint8_t newstate)
 	if (newstate == Established)
 		tpriv->stats[CurrEstab]++;
 
+	tracepoint(tcp_state, s->x, s->lport, s->rport, oldstate, newstate);
+
 	/**
 	print( "%d/%d %s->%s CurrEstab=%d\n", s->lport, s->rport,
 		tcpstates[oldstate], tcpstates[newstate], tpriv->tstats.tcpCurrEstab );
@@ -472,18 +596,22 @@ static void tcpconnect(struct conv *c, char **argv, int argc)
 static int tcpstate(struct conv *c, char *state, int n)
 {
 	Tcpctl *s;
+	struct tcppriv *priv = c->p->priv;
 
 	s = (Tcpctl *) (c->ptcl);
 
 	return snprintf(state, n,
-					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %llu katimer.count %llu ssthresh %u cc %s\n",
 					tcpstates[s->state],
 					c->rq ? qlen(c->rq) : 0,
 					c->wq ? qlen(c->wq) : 0,
 					s->srtt, s->mdev,
 					s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
-					s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-					s->katimer.start, s->katimer.count);
+					s->snd.scale, s->timer.start,
+					tcptimerleft(priv, &s->timer), s->rerecv,
+					s->katimer.start, tcptimerleft(priv, &s->katimer),
+					s->ssthresh,
+					s->cc ? s->cc->name : "none");
 }
 
 static int tcpinuse(struct conv *c)
@@ -565,6 +693,96 @@ static void tcpclose(struct conv *c)
 	}
 }
 
+static void tcp_hist_add(uint64_t *hist, uint64_t usec)
+{
+	int idx = usec ? LOG2_DOWN(usec) : 0;
+
+	hist[MIN(idx, TCP_HIST_SZ - 1)]++;
+}
+
+/* Adds a latency sample to hist, and traces it if it's our turn. */
+static void tcp_sample(struct conv *s, uint64_t *hist, char *what,
+                       uint64_t usec)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+	struct tcp_convstats *cs = &tcb->cstats;
+
+	tcp_hist_add(hist, usec);
+	if (!cs->trace_every || ++cs->trace_count < cs->trace_every)
+		return;
+	cs->trace_count = 0;
+	netlog(s->p->f, Logtcptrace,
+	       "tcptrace %d %s %llu srtt %d cwin %u swin %u qin %d qout %d\n",
+	       s->x, what, usec, tcb->srtt >> LOGAGAIN, tcb->cwind, tcb->snd.wnd,
+	       qlen(s->rq), qlen(s->wq));
+}
+
+/* Call with tcb locked, after putting len bytes on the rq */
+static void tcp_set_rq_mark(struct conv *s, int len)
+{
+	struct tcp_convstats *cs = &((Tcpctl *) s->ptcl)->cstats;
+
+	cs->rq_bytes += len;
+	if (cs->rq_mark_tsc)
+		return;
+	cs->rq_mark = cs->rq_bytes;
+	cs->rq_mark_tsc = read_tsc();
+}
+
+/* Call with tcb locked.  Once the reader got past the sampled block, that's
+ * our rq delay. */
+static void tcp_check_rq_mark(struct conv *s)
+{
+	struct tcp_convstats *cs = &((Tcpctl *) s->ptcl)->cstats;
+
+	if (!cs->rq_mark_tsc || cs->rq_bytes - qlen(s->rq) < cs->rq_mark)
+		return;
+	tcp_sample(s, cs->rq_delay_hist, "rqdelay",
+	           tsc2usec(read_tsc() - cs->rq_mark_tsc));
+	cs->rq_mark_tsc = 0;
+}
+
+/* Call with tcb locked, after a write. */
+static void tcp_set_wq_mark(struct conv *s)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+	struct tcp_convstats *cs = &tcb->cstats;
+	uint32_t end = tcb->snd.una + qlen(s->wq);
+
+	if (cs->wq_mark_tsc || !seq_gt(end, tcb->snd.nxt))
+		return;
+	cs->wq_mark = end;
+	cs->wq_mark_tsc = read_tsc();
+}
+
+/* Call with tcb locked, after sending. */
+static void tcp_check_wq_mark(struct conv *s)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+	struct tcp_convstats *cs = &tcb->cstats;
+
+	if (!cs->wq_mark_tsc || !seq_ge(tcb->snd.nxt, cs->wq_mark))
+		return;
+	tcp_sample(s, cs->wq_delay_hist, "wqdelay",
+	           tsc2usec(read_tsc() - cs->wq_mark_tsc));
+	cs->wq_mark_tsc = 0;
+}
+
+/* Call with tcb locked, whenever we check if we can send. */
+static void tcp_track_wnd_blocked(struct conv *s, bool blocked)
+{
+	struct tcp_convstats *cs = &((Tcpctl *) s->ptcl)->cstats;
+
+	if (blocked == !!cs->wnd_blocked_tsc)
+		return;
+	if (blocked) {
+		cs->wnd_blocked_tsc = read_tsc();
+	} else {
+		cs->wnd_blocked_usec += tsc2usec(read_tsc() - cs->wnd_blocked_tsc);
+		cs->wnd_blocked_tsc = 0;
+	}
+}
+
 void tcpkick(void *x)
 {
 	ERRSTACK(1);
@@ -587,6 +805,7 @@ void tcpkick(void *x)
 			/*
 			 * Push data
 			 */
+			tcp_set_wq_mark(s);
 			tcprcvwin(s);
 			tcpoutput(s);
 			break;
@@ -611,6 +830,7 @@ void tcprcvwin(struct conv *s)
 	tcb->rcv.wnd = w;
 	if (w == 0)
 		tcb->rcv.blocked = 1;
+	tcp_check_rq_mark(s);
 }
 
 void tcpacktimer(void *v)
@@ -638,17 +858,23 @@ void tcpacktimer(void *v)
 
 static void tcpcreate(struct conv *c)
 {
-	c->rq = qopen(QMAX, Qcoalesce, 0, 0);
+	c->rq = qopen(QMAX, Qcoalesce | Qspsc, 0, 0);
 	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
 }
 
+/*
+ *  The timers hang off a hashed wheel, so each tick only looks at the timers
+ *  that hash to it: the ones going off, and a few more a lap or more away.
+ */
 static void timerstate(struct tcppriv *priv, Tcptimer * t, int newstate)
 {
+	Tcptimer **slot = &priv->timers[t->when % NTIMERSLOTS];
+
 	if (newstate != TcptimerON) {
 		if (t->state == TcptimerON) {
 			// unchain
-			if (priv->timers == t) {
-				priv->timers = t->next;
+			if (*slot == t) {
+				*slot = t->next;
 				if (t->prev != NULL)
 					panic("timerstate1");
 			}
@@ -664,10 +890,10 @@ static void timerstate(struct tcppriv *priv, Tcptimer * t, int newstate)
 			if (t->prev != NULL || t->next != NULL)
 				panic("timerstate2");
 			t->prev = NULL;
-			t->next = priv->timers;
+			t->next = *slot;
 			if (t->next)
 				t->next->prev = t;
-			priv->timers = t;
+			*slot = t;
 		}
 	}
 	t->state = newstate;
@@ -679,36 +905,27 @@ void tcpackproc(void *a)
 	Tcptimer *t, *tp, *timeo;
 	struct Proto *tcp;
 	struct tcppriv *priv;
-	int loop;
 
 	tcp = a;
 	priv = tcp->priv;
 
 	for (;;) {
-		kthread_usleep(MSPTICK * 1000);
+		kthread_usleep_slack(MSPTICK * 1000, TICK_SLACK * 1000);
 
 		qlock(&priv->tl);
 		timeo = NULL;
-		loop = 0;
-		for (t = priv->timers; t != NULL; t = tp) {
-			if (loop++ > 10000)
-				panic("tcpackproc1");
+		priv->tick++;
+		for (t = priv->timers[priv->tick % NTIMERSLOTS]; t != NULL; t = tp) {
 			tp = t->next;
-			if (t->state == TcptimerON) {
-				t->count--;
-				if (t->count == 0) {
-					timerstate(priv, t, TcptimerDONE);
-					t->readynext = timeo;
-					timeo = t;
-				}
+			if (t->when == priv->tick) {
+				timerstate(priv, t, TcptimerDONE);
+				t->readynext = timeo;
+				timeo = t;
 			}
 		}
 		qunlock(&priv->tl);
 
-		loop = 0;
 		for (t = timeo; t != NULL; t = t->readynext) {
-			if (loop++ > 10000)
-				panic("tcpackproc2");
 			if (t->state == TcptimerDONE && t->func != NULL) {
 				/* discard error style */
 				if (!waserror())
@@ -727,7 +944,9 @@ void tcpgo(struct tcppriv *priv, Tcptimer * t)
 		return;
 
 	qlock(&priv->tl);
-	t->count = t->start;
+	/* off first, so we can move it to its new slot */
+	timerstate(priv, t, TcptimerOFF);
+	t->when = priv->tick + t->start;
 	timerstate(priv, t, TcptimerON);
 	qunlock(&priv->tl);
 }
@@ -808,13 +1027,19 @@ int tcpmtu(struct Proto *tcp, uint8_t * addr, int version, int *scale,
 	*flags &= ~TSO;
 
 	if (ifc != NULL) {
-		if (ifc->mbps > 100)
+		if (ifc->mbps >= 10000)
+			*scale = HaveWS | 7;
+		else if (ifc->mbps > 1000)
+			*scale = HaveWS | 5;
+		else if (ifc->mbps > 100)
 			*scale = HaveWS | 3;
 		else if (ifc->mbps > 10)
 			*scale = HaveWS | 1;
 		else
 			*scale = HaveWS | 0;
-		if (ifc->feat & NETF_TSO)
+		/* GSO cuts up IPv4 super-segments below us; v6 would fragment */
+		if ((ifc->feat & NETF_TSO) ||
+		    ((version == V4) && (ifc->feat & NETF_GSO)))
 			*flags |= TSO;
 	} else
 		*scale = HaveWS | 0;
@@ -822,6 +1047,125 @@ int tcpmtu(struct Proto *tcp, uint8_t * addr, int version, int *scale,
 	return mtu;
 }
 
+/*
+ *  NewReno, RFC 5681 and 6582: a segment per round trip, and half of what's
+ *  in flight after a loss.
+ */
+static void newreno_init(Tcpctl *tcb)
+{
+}
+
+static void newreno_cong_avoid(Tcpctl *tcb, uint32_t acked)
+{
+	tcb->cwind += MAX((uint64_t)tcb->mss * acked / tcb->cwind, 1);
+}
+
+static uint32_t newreno_ssthresh(Tcpctl *tcb)
+{
+	return MAX((tcb->snd.nxt - tcb->snd.una) / 2, 2 * tcb->mss);
+}
+
+/*
+ *  CUBIC, RFC 8312: after a loss, cwind follows a cubic in the time since
+ *  the loss, leveling off at the old window and then probing past it.  The
+ *  growth doesn't depend on the round trip, which lets long fat pipes fill.
+ *  C is 0.4 segments/s^3 and beta is 0.7.  Times are in ms.
+ */
+enum {
+	CUBIC_BETA = 7,				/* in tenths */
+	CUBIC_MAX_T = 1 << 17,		/* ms, keeps t^3 in 64 bits */
+};
+
+static uint32_t cubic_root(uint64_t a)
+{
+	uint64_t x = 0, b;
+
+	for (int s = 63; s >= 0; s -= 3) {
+		x <<= 1;
+		b = 3 * x * (x + 1) + 1;
+		if ((a >> s) >= b) {
+			a -= b << s;
+			x++;
+		}
+	}
+	return x;
+}
+
+/* C * t^3, in bytes, for t in ms */
+static uint64_t cubic_delta(Tcpctl *tcb, uint64_t t)
+{
+	t = MIN(t, CUBIC_MAX_T);
+	return t * t * t / 1000 * 4 * tcb->mss / 10000000;
+}
+
+static void cubic_init(Tcpctl *tcb)
+{
+	memset(&tcb->cubic, 0, sizeof(struct cubic));
+}
+
+static void cubic_cong_avoid(Tcpctl *tcb, uint32_t acked)
+{
+	struct cubic *cu = &tcb->cubic;
+	uint64_t now = NOW, t, target, w_est;
+	uint32_t rtt = MAX(tcb->srtt >> LOGAGAIN, 1);
+
+	if (!cu->epoch) {
+		cu->epoch = MAX(now, 1);
+		cu->w_start = tcb->cwind;
+		if (cu->w_max > tcb->cwind) {
+			/* C * K^3 = w_max - cwind, in segments */
+			cu->k = cubic_root((uint64_t)(cu->w_max - tcb->cwind) *
+			                   2500000000ULL / tcb->mss);
+			cu->origin = cu->w_max;
+		} else {
+			cu->k = 0;
+			cu->origin = tcb->cwind;
+		}
+	}
+	/* aim for where the curve will be a round trip from now */
+	t = now - cu->epoch + rtt;
+	if (t < cu->k)
+		target = cu->origin - MIN(cubic_delta(tcb, cu->k - t), cu->origin);
+	else
+		target = cu->origin + cubic_delta(tcb, t - cu->k);
+	/* never slower than reno: 3 * (1 - beta) / (1 + beta) segments per rtt */
+	w_est = cu->w_start + (uint64_t)tcb->mss * 9 * (now - cu->epoch) /
+	                      (17 * rtt);
+	target = MAX(target, w_est);
+	target = MIN(target, tcb->cwind + tcb->cwind / 2);
+	if (target > tcb->cwind)
+		tcb->cwind += (target - tcb->cwind) * acked / tcb->cwind;
+}
+
+static uint32_t cubic_ssthresh(Tcpctl *tcb)
+{
+	struct cubic *cu = &tcb->cubic;
+
+	cu->epoch = 0;
+	/* lost before the last plateau: leave some room for new flows */
+	if (tcb->cwind < cu->w_max)
+		cu->w_max = (uint64_t)tcb->cwind * (10 + CUBIC_BETA) / 20;
+	else
+		cu->w_max = tcb->cwind;
+	return MAX((uint64_t)tcb->cwind * CUBIC_BETA / 10, 2 * tcb->mss);
+}
+
+/* the first one is the default */
+static struct tcp_cc_ops tcp_cc_algs[] = {
+	{
+		.name = "newreno",
+		.init = newreno_init,
+		.cong_avoid = newreno_cong_avoid,
+		.ssthresh = newreno_ssthresh,
+	},
+	{
+		.name = "cubic",
+		.init = cubic_init,
+		.cong_avoid = cubic_cong_avoid,
+		.ssthresh = cubic_ssthresh,
+	},
+};
+
 void inittcpctl(struct conv *s, int mode)
 {
 	Tcpctl *tcb;
@@ -833,7 +1177,9 @@ void inittcpctl(struct conv *s, int mode)
 
 	memset(tcb, 0, sizeof(Tcpctl));
 
-	tcb->ssthresh = 65535;
+	tcb->ssthresh = UINT32_MAX;
+	tcb->cc = &tcp_cc_algs[0];
+	tcb->cc->init(tcb);
 	tcb->srtt = tcp_irtt << LOGAGAIN;
 	tcb->mdev = 0;
 
@@ -956,26 +1302,120 @@ static char *tcpflag(uint16_t flag)
 	return buf;
 }
 
+/* Length of tcph's options, padded out to a multiple of 4 */
+static uint16_t tcpoptlen(Tcp *tcph)
+{
+	uint16_t len = 0;
+
+	if (tcph->flags & SYN) {
+		if (tcph->mss)
+			len += MSS_LENGTH;
+		if (tcph->ws)
+			len += WS_LENGTH;
+		if (tcph->sack_ok)
+			len += SACK_OK_LENGTH;
+	} else if (tcph->nr_sacks) {
+		len += SACK_HDR_LENGTH + tcph->nr_sacks * SACK_BLK_LENGTH;
+	}
+	return ROUNDUP(len, 4);
+}
+
+/* Writes optlen bytes of tcph's options (from tcpoptlen()) to opt */
+static void tcpputopts(Tcp *tcph, uint8_t *opt, uint16_t optlen)
+{
+	uint8_t *end = opt + optlen;
+
+	if (tcph->flags & SYN) {
+		if (tcph->mss != 0) {
+			*opt++ = MSSOPT;
+			*opt++ = MSS_LENGTH;
+			hnputs(opt, tcph->mss);
+			opt += 2;
+		}
+		if (tcph->ws != 0) {
+			*opt++ = WSOPT;
+			*opt++ = WS_LENGTH;
+			*opt++ = tcph->ws;
+		}
+		if (tcph->sack_ok) {
+			*opt++ = SACK_OK_OPT;
+			*opt++ = SACK_OK_LENGTH;
+		}
+	} else if (tcph->nr_sacks) {
+		*opt++ = SACK_OPT;
+		*opt++ = SACK_HDR_LENGTH + tcph->nr_sacks * SACK_BLK_LENGTH;
+		for (int i = 0; i < tcph->nr_sacks; i++) {
+			hnputl(opt, tcph->sacks[i].left);
+			hnputl(opt + 4, tcph->sacks[i].right);
+			opt += SACK_BLK_LENGTH;
+		}
+	}
+	while (opt < end)
+		*opt++ = NOOPOPT;
+}
+
+/* Parses the n bytes of options at optr into tcph */
+static void tcpgetopts(Tcp *tcph, uint8_t *optr, int n)
+{
+	uint16_t optlen;
+
+	tcph->mss = 0;
+	tcph->ws = 0;
+	tcph->sack_ok = 0;
+	tcph->nr_sacks = 0;
+	while (n > 0 && *optr != EOLOPT) {
+		if (*optr == NOOPOPT) {
+			n--;
+			optr++;
+			continue;
+		}
+		if (n < 2)
+			break;
+		optlen = optr[1];
+		if (optlen < 2 || optlen > n)
+			break;
+		switch (*optr) {
+			case MSSOPT:
+				if (optlen == MSS_LENGTH)
+					tcph->mss = nhgets(optr + 2);
+				break;
+			case WSOPT:
+				if (optlen == WS_LENGTH && *(optr + 2) <= 14)
+					tcph->ws = HaveWS | *(optr + 2);
+				break;
+			case SACK_OK_OPT:
+				if (optlen == SACK_OK_LENGTH)
+					tcph->sack_ok = 1;
+				break;
+			case SACK_OPT:
+				if ((optlen - SACK_HDR_LENGTH) % SACK_BLK_LENGTH)
+					break;
+				for (int i = SACK_HDR_LENGTH; i < optlen;
+				     i += SACK_BLK_LENGTH) {
+					if (tcph->nr_sacks == MAX_NR_SACKS_PER_PACKET)
+						break;
+					tcph->sacks[tcph->nr_sacks].left = nhgetl(optr + i);
+					tcph->sacks[tcph->nr_sacks].right =
+						nhgetl(optr + i + 4);
+					tcph->nr_sacks++;
+				}
+				break;
+		}
+		n -= optlen;
+		optr += optlen;
+	}
+}
+
 struct block *htontcp6(Tcp * tcph, struct block *data, Tcp6hdr * ph,
 					   Tcpctl * tcb)
 {
 	int dlen;
 	Tcp6hdr *h;
 	uint16_t csum;
-	uint16_t hdrlen, optpad = 0;
-	uint8_t *opt;
+	uint16_t hdrlen, optlen;
 
-	hdrlen = TCP6_HDRSIZE;
-	if (tcph->flags & SYN) {
-		if (tcph->mss)
-			hdrlen += MSS_LENGTH;
-		if (tcph->ws)
-			hdrlen += WS_LENGTH;
-		optpad = hdrlen & 3;
-		if (optpad)
-			optpad = 4 - optpad;
-		hdrlen += optpad;
-	}
+	optlen = tcpoptlen(tcph);
+	hdrlen = TCP6_HDRSIZE + optlen;
 
 	if (data) {
 		dlen = blocklen(data);
@@ -1007,22 +1447,7 @@ struct block *htontcp6(Tcp * tcph, struct block *data, Tcp6hdr * ph,
 	hnputs(h->tcpwin, tcph->wnd >> (tcb != NULL ? tcb->snd.scale : 0));
 	hnputs(h->tcpurg, tcph->urg);
 
-	if (tcph->flags & SYN) {
-		opt = h->tcpopt;
-		if (tcph->mss != 0) {
-			*opt++ = MSSOPT;
-			*opt++ = MSS_LENGTH;
-			hnputs(opt, tcph->mss);
-			opt += 2;
-		}
-		if (tcph->ws != 0) {
-			*opt++ = WSOPT;
-			*opt++ = WS_LENGTH;
-			*opt++ = tcph->ws;
-		}
-		while (optpad-- > 0)
-			*opt++ = NOOPOPT;
-	}
+	tcpputopts(tcph, h->tcpopt, optlen);
 
 	if (tcb != NULL && tcb->nochecksum) {
 		h->tcpcksum[0] = h->tcpcksum[1] = 0;
@@ -1046,20 +1471,10 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 	int dlen;
 	Tcp4hdr *h;
 	uint16_t csum;
-	uint16_t hdrlen, optpad = 0;
-	uint8_t *opt;
+	uint16_t hdrlen, optlen;
 
-	hdrlen = TCP4_HDRSIZE;
-	if (tcph->flags & SYN) {
-		if (tcph->mss)
-			hdrlen += MSS_LENGTH;
-		if (tcph->ws)
-			hdrlen += WS_LENGTH;
-		optpad = hdrlen & 3;
-		if (optpad)
-			optpad = 4 - optpad;
-		hdrlen += optpad;
-	}
+	optlen = tcpoptlen(tcph);
+	hdrlen = TCP4_HDRSIZE + optlen;
 
 	if (data) {
 		dlen = blocklen(data);
@@ -1087,22 +1502,7 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 	hnputs(h->tcpwin, tcph->wnd >> (tcb != NULL ? tcb->snd.scale : 0));
 	hnputs(h->tcpurg, tcph->urg);
 
-	if (tcph->flags & SYN) {
-		opt = h->tcpopt;
-		if (tcph->mss != 0) {
-			*opt++ = MSSOPT;
-			*opt++ = MSS_LENGTH;
-			hnputs(opt, tcph->mss);
-			opt += 2;
-		}
-		if (tcph->ws != 0) {
-			*opt++ = WSOPT;
-			*opt++ = WS_LENGTH;
-			*opt++ = tcph->ws;
-		}
-		while (optpad-- > 0)
-			*opt++ = NOOPOPT;
-	}
+	tcpputopts(tcph, h->tcpopt, optlen);
 
 	if (tcb != NULL && tcb->nochecksum) {
 		h->tcpcksum[0] = h->tcpcksum[1] = 0;
@@ -1120,10 +1520,7 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 int ntohtcp6(Tcp * tcph, struct block **bpp)
 {
 	Tcp6hdr *h;
-	uint8_t *optr;
 	uint16_t hdrlen;
-	uint16_t optlen;
-	int n;
 
 	*bpp = pullupblock(*bpp, TCP6_PKT + TCP6_HDRSIZE);
 	if (*bpp == NULL)
@@ -1143,48 +1540,21 @@ int ntohtcp6(Tcp * tcph, struct block **bpp)
 	tcph->flags = h->tcpflag[1];
 	tcph->wnd = nhgets(h->tcpwin);
 	tcph->urg = nhgets(h->tcpurg);
-	tcph->mss = 0;
-	tcph->ws = 0;
 	tcph->len = nhgets(h->ploadlen) - hdrlen;
 
 	*bpp = pullupblock(*bpp, hdrlen + TCP6_PKT);
 	if (*bpp == NULL)
 		return -1;
 
-	optr = h->tcpopt;
-	n = hdrlen - TCP6_HDRSIZE;
-	while (n > 0 && *optr != EOLOPT) {
-		if (*optr == NOOPOPT) {
-			n--;
-			optr++;
-			continue;
-		}
-		optlen = optr[1];
-		if (optlen < 2 || optlen > n)
-			break;
-		switch (*optr) {
-			case MSSOPT:
-				if (optlen == MSS_LENGTH)
-					tcph->mss = nhgets(optr + 2);
-				break;
-			case WSOPT:
-				if (optlen == WS_LENGTH && *(optr + 2) <= 14)
-					tcph->ws = HaveWS | *(optr + 2);
-				break;
-		}
-		n -= optlen;
-		optr += optlen;
-	}
+	h = (Tcp6hdr *) ((*bpp)->rp);
+	tcpgetopts(tcph, h->tcpopt, hdrlen - TCP6_HDRSIZE);
 	return hdrlen;
 }
 
 int ntohtcp4(Tcp * tcph, struct block **bpp)
 {
 	Tcp4hdr *h;
-	uint8_t *optr;
 	uint16_t hdrlen;
-	uint16_t optlen;
-	int n;
 
 	*bpp = pullupblock(*bpp, TCP4_PKT + TCP4_HDRSIZE);
 	if (*bpp == NULL)
@@ -1205,38 +1575,14 @@ int ntohtcp4(Tcp * tcph, struct block **bpp)
 	tcph->flags = h->tcpflag[1];
 	tcph->wnd = nhgets(h->tcpwin);
 	tcph->urg = nhgets(h->tcpurg);
-	tcph->mss = 0;
-	tcph->ws = 0;
 	tcph->len = nhgets(h->length) - (hdrlen + TCP4_PKT);
 
 	*bpp = pullupblock(*bpp, hdrlen + TCP4_PKT);
 	if (*bpp == NULL)
 		return -1;
 
-	optr = h->tcpopt;
-	n = hdrlen - TCP4_HDRSIZE;
-	while (n > 0 && *optr != EOLOPT) {
-		if (*optr == NOOPOPT) {
-			n--;
-			optr++;
-			continue;
-		}
-		optlen = optr[1];
-		if (optlen < 2 || optlen > n)
-			break;
-		switch (*optr) {
-			case MSSOPT:
-				if (optlen == MSS_LENGTH)
-					tcph->mss = nhgets(optr + 2);
-				break;
-			case WSOPT:
-				if (optlen == WS_LENGTH && *(optr + 2) <= 14)
-					tcph->ws = HaveWS | *(optr + 2);
-				break;
-		}
-		n -= optlen;
-		optr += optlen;
-	}
+	h = (Tcp4hdr *) ((*bpp)->rp);
+	tcpgetopts(tcph, h->tcpopt, hdrlen - TCP4_HDRSIZE);
 	return hdrlen;
 }
 
@@ -1326,6 +1672,8 @@ sndrst(struct Proto *tcp, uint8_t * source, uint8_t * dest,
 	seg->urg = 0;
 	seg->mss = 0;
 	seg->ws = 0;
+	seg->sack_ok = 0;
+	seg->nr_sacks = 0;
 	switch (version) {
 		case V4:
 			hbp = htontcp4(seg, NULL, &ph4, NULL);
@@ -1367,6 +1715,8 @@ static void tcphangup(struct conv *s)
 			seg.urg = 0;
 			seg.mss = 0;
 			seg.ws = 0;
+			seg.sack_ok = 0;
+			seg.nr_sacks = 0;
 			switch (s->ipversion) {
 				case V4:
 					tcb->protohdr.tcp4hdr.vihl = IP_VER4;
@@ -1431,6 +1781,8 @@ int sndsynack(struct Proto *tcp, Limbo * lp)
 	seg.urg = 0;
 	seg.mss = tcpmtu(tcp, lp->laddr, lp->version, &scale, &flag);
 	seg.wnd = QMAX;
+	seg.sack_ok = lp->sack_ok;
+	seg.nr_sacks = 0;
 
 	/* if the other side set scale, we should too */
 	if (lp->rcvscale) {
@@ -1461,7 +1813,151 @@ int sndsynack(struct Proto *tcp, Limbo * lp)
 	return 0;
 }
 
-#define hashipa(a, p) ( ( (a)[IPaddrlen-2] + (a)[IPaddrlen-1] + p )&LHTMASK )
+/* Not a cryptographic hash, but keyed with a secret the far end can't see */
+static uint64_t tcp_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int limbo_hash(struct tcppriv *tpriv, uint8_t *raddr, uint16_t rport)
+{
+	uint32_t a;
+
+	memcpy(&a, raddr + IPaddrlen - sizeof(a), sizeof(a));
+	return tcp_mix(tpriv->secret ^ a ^ ((uint64_t)rport << 32)) &
+	       (tpriv->nlht - 1);
+}
+
+/* Doubles the limbo table once it averages 2 calls per bucket.  If we can't
+ * get the memory, we just carry on with longer chains. */
+static void limbo_grow(struct tcppriv *tpriv)
+{
+	Limbo **old = tpriv->lht, *lp;
+	int oldsz = tpriv->nlht, h;
+
+	if (tpriv->nlimbo <= 2 * oldsz || oldsz >= Maxlht)
+		return;
+	tpriv->lht = kzmalloc(2 * oldsz * sizeof(Limbo *), 0);
+	if (!tpriv->lht) {
+		tpriv->lht = old;
+		return;
+	}
+	tpriv->nlht = 2 * oldsz;
+	for (int i = 0; i < oldsz; i++) {
+		while ((lp = old[i])) {
+			old[i] = lp->next;
+			h = limbo_hash(tpriv, lp->raddr, lp->rport);
+			lp->next = tpriv->lht[h];
+			tpriv->lht[h] = lp;
+		}
+	}
+	kfree(old);
+}
+
+/* MSSs a SYN cookie can encode, in its 3 bits */
+static const uint16_t syncookie_mss[] = {
+	536, 1220, 1380, 1440, 1460, 4036, 8940, 16344
+};
+
+static uint32_t syncookie_hash(struct tcppriv *tpriv, uint8_t *laddr,
+                               uint8_t *raddr, uint16_t lport, uint16_t rport,
+                               uint32_t count, uint32_t mssidx)
+{
+	uint64_t h = tpriv->secret ^ ((uint64_t)count << 32) ^ mssidx;
+	uint32_t a;
+
+	for (int i = 0; i < IPaddrlen; i += sizeof(a)) {
+		memcpy(&a, laddr + i, sizeof(a));
+		h = tcp_mix(h ^ a);
+		memcpy(&a, raddr + i, sizeof(a));
+		h = tcp_mix(h ^ a);
+	}
+	return tcp_mix(h ^ ((uint32_t)lport << 16 | rport));
+}
+
+/* The cookie is our ISS: 5 bits of the time, 3 bits of MSS, and 24 bits of
+ * hash over the call, the time and the MSS, offset by the peer's ISS. */
+static uint32_t syncookie_make(struct tcppriv *tpriv, Limbo *lp)
+{
+	uint32_t count = NOW >> SYNCOOKIE_SHIFT;
+	uint32_t mssidx = 0, h;
+
+	for (int i = 0; i < ARRAY_SIZE(syncookie_mss); i++) {
+		if (lp->mss >= syncookie_mss[i])
+			mssidx = i;
+	}
+	h = syncookie_hash(tpriv, lp->laddr, lp->raddr, lp->lport, lp->rport,
+	                   count, mssidx);
+	return (count & 0x1f) << 27 | mssidx << 24 | ((h + lp->irs) & 0xffffff);
+}
+
+/* Checks an ACK from a call we sent a cookie to.  On success, fills in lp
+ * like limbo() would have, and returns 0. */
+static int syncookie_check(struct tcppriv *tpriv, Tcp *segp, uint8_t *src,
+                           uint8_t *dst, uint8_t version, Limbo *lp)
+{
+	uint32_t cookie = segp->ack - 1, irs = segp->seq - 1;
+	uint32_t count = NOW >> SYNCOOKIE_SHIFT;
+	uint32_t mssidx = (cookie >> 24) & 7, h;
+
+	/* nothing to check unless we've sent cookies in the last two periods */
+	if (!tpriv->lastcookie ||
+	    NOW - tpriv->lastcookie > 2ULL << SYNCOOKIE_SHIFT)
+		return -1;
+	/* the cookie is from this period or the last one */
+	if ((count & 0x1f) != cookie >> 27)
+		count--;
+	if ((count & 0x1f) != cookie >> 27)
+		goto fail;
+	h = syncookie_hash(tpriv, dst, src, segp->dest, segp->source, count,
+	                   mssidx);
+	if (((h + irs) & 0xffffff) != (cookie & 0xffffff))
+		goto fail;
+	memset(lp, 0, sizeof(Limbo));
+	ipmove(lp->laddr, dst);
+	ipmove(lp->raddr, src);
+	lp->lport = segp->dest;
+	lp->rport = segp->source;
+	lp->irs = irs;
+	lp->iss = cookie;
+	lp->mss = syncookie_mss[mssidx];
+	lp->version = version;
+	/* no idea when we sent it, so guess */
+	lp->lastsend = NOW - tcp_irtt;
+	tpriv->stats[SynCookiesRecv]++;
+	return 0;
+fail:
+	tpriv->stats[SynCookiesFailed]++;
+	return -1;
+}
+
+/* Answers a SYN with a cookie instead of a limbo entry. */
+static void syncookie_reply(struct conv *s, uint8_t *source, uint8_t *dest,
+                            Tcp *seg, int version)
+{
+	struct tcppriv *tpriv = s->p->priv;
+	Limbo lp;
+
+	memset(&lp, 0, sizeof(Limbo));
+	lp.version = version;
+	ipmove(lp.laddr, dest);
+	ipmove(lp.raddr, source);
+	lp.lport = seg->dest;
+	lp.rport = seg->source;
+	lp.mss = seg->mss ? seg->mss : syncookie_mss[0];
+	lp.irs = seg->seq;
+	lp.iss = syncookie_make(tpriv, &lp);
+	/* lp.rcvscale and sack_ok stay 0: the cookie can't hold them */
+	if (sndsynack(s->p, &lp) == 0) {
+		tpriv->lastcookie = lp.lastsend;
+		tpriv->stats[SynCookiesSent]++;
+	}
+}
 
 /*
  *  put a call into limbo and respond with a SYN ACK
@@ -1476,7 +1972,9 @@ limbo(struct conv *s, uint8_t * source, uint8_t * dest, Tcp * seg, int version)
 	int h;
 
 	tpriv = s->p->priv;
-	h = hashipa(source, seg->source);
+	if (!tpriv->secret)
+		urandom_read(&tpriv->secret, sizeof(tpriv->secret));
+	h = limbo_hash(tpriv, source, seg->source);
 
 	for (l = &tpriv->lht[h]; *l != NULL; l = &lp->next) {
 		lp = *l;
@@ -1494,16 +1992,16 @@ limbo(struct conv *s, uint8_t * source, uint8_t * dest, Tcp * seg, int version)
 	}
 	lp = *l;
 	if (lp == NULL) {
-		if (tpriv->nlimbo >= Maxlimbo && tpriv->lht[h]) {
-			lp = tpriv->lht[h];
-			tpriv->lht[h] = lp->next;
-			lp->next = NULL;
-		} else {
-			lp = kzmalloc(sizeof(*lp), 0);
-			if (lp == NULL)
-				return;
-			tpriv->nlimbo++;
+		if (tpriv->nlimbo >= Maxlimbo) {
+			syncookie_reply(s, source, dest, seg, version);
+			return;
 		}
+		lp = kzmalloc(sizeof(*lp), 0);
+		if (lp == NULL) {
+			syncookie_reply(s, source, dest, seg, version);
+			return;
+		}
+		tpriv->nlimbo++;
 		*l = lp;
 		lp->version = version;
 		ipmove(lp->laddr, dest);
@@ -1512,6 +2010,7 @@ limbo(struct conv *s, uint8_t * source, uint8_t * dest, Tcp * seg, int version)
 		lp->rport = seg->source;
 		lp->mss = seg->mss;
 		lp->rcvscale = seg->ws;
+		lp->sack_ok = seg->sack_ok;
 		lp->irs = seg->seq;
 		urandom_read(&lp->iss, sizeof(lp->iss));
 	}
@@ -1520,7 +2019,9 @@ limbo(struct conv *s, uint8_t * source, uint8_t * dest, Tcp * seg, int version)
 		*l = lp->next;
 		tpriv->nlimbo--;
 		kfree(lp);
+		return;
 	}
+	limbo_grow(tpriv);
 }
 
 /*
@@ -1540,7 +2041,7 @@ static void limborexmit(struct Proto *tcp)
 		return;
 	seen = 0;
 	now = NOW;
-	for (h = 0; h < NLHT && seen < tpriv->nlimbo; h++) {
+	for (h = 0; h < tpriv->nlht && seen < tpriv->nlimbo; h++) {
 		for (l = &tpriv->lht[h]; *l != NULL && seen < tpriv->nlimbo;) {
 			lp = *l;
 			seen++;
@@ -1588,7 +2089,7 @@ limborst(struct conv *s, Tcp * segp, uint8_t * src, uint8_t * dst,
 	tpriv = s->p->priv;
 
 	/* find a call in limbo */
-	h = hashipa(src, segp->source);
+	h = limbo_hash(tpriv, src, segp->source);
 	for (l = &tpriv->lht[h]; *l != NULL; l = &lp->next) {
 		lp = *l;
 		if (lp->lport != segp->dest || lp->rport != segp->source
@@ -1623,7 +2124,7 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 	struct tcppriv *tpriv;
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
-	Limbo *lp, **l;
+	Limbo *lp, **l, cookie_lp;
 	int h;
 
 	/* unless it's just an ack, it can't be someone coming out of limbo */
@@ -1633,7 +2134,7 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 	tpriv = s->p->priv;
 
 	/* find a call in limbo */
-	h = hashipa(src, segp->source);
+	h = limbo_hash(tpriv, src, segp->source);
 	for (l = &tpriv->lht[h]; (lp = *l) != NULL; l = &lp->next) {
 		netlog(s->p->f, Logtcp,
 			   "tcpincoming s %I!%d/%I!%d d %I!%d/%I!%d v %d/%d\n", src,
@@ -1652,19 +2153,25 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 		if (segp->seq != lp->irs + 1 || segp->ack != lp->iss + 1) {
 			netlog(s->p->f, Logtcp, "tcpincoming s 0x%lx/0x%lx a 0x%lx 0x%lx\n",
 				   segp->seq, lp->irs + 1, segp->ack, lp->iss + 1);
-			lp = NULL;
-		} else {
-			tpriv->nlimbo--;
-			*l = lp->next;
+			return NULL;
 		}
+		tpriv->nlimbo--;
+		*l = lp->next;
 		break;
 	}
-	if (lp == NULL)
-		return NULL;
+	/* not in limbo, but it might be the answer to a SYN cookie */
+	if (lp == NULL) {
+		if (syncookie_check(tpriv, segp, src, dst, version, &cookie_lp))
+			return NULL;
+		lp = &cookie_lp;
+	}
 
 	new = Fsnewcall(s, src, segp->source, dst, segp->dest, version);
-	if (new == NULL)
+	if (new == NULL) {
+		if (lp != &cookie_lp)
+			kfree(lp);
 		return NULL;
+	}
 
 	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
 	tcb = (Tcpctl *) new->ptcl;
@@ -1677,6 +2184,8 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 	tcb->katimer.state = TcptimerOFF;
 	tcb->rtt_timer.arg = new;
 	tcb->rtt_timer.state = TcptimerOFF;
+	/* the listener's congestion control, but none of its state */
+	tcb->cc->init(tcb);
 
 	tcb->irs = lp->irs;
 	tcb->rcv.nxt = tcb->irs + 1;
@@ -1698,6 +2207,9 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 	/* window scaling */
 	tcpsetscale(new, tcb, lp->rcvscale, lp->sndscale);
 
+	/* we offered SACK in the SYN ACK iff they did in the SYN */
+	tcb->sack_ok = lp->sack_ok;
+
 	/* the congestion window always starts out as a single segment */
 	tcb->snd.wnd = segp->wnd;
 	tcb->cwind = tcb->mss;
@@ -1706,7 +2218,8 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 	tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
 	tcpsynackrtt(new);
 
-	kfree(lp);
+	if (lp != &cookie_lp)
+		kfree(lp);
 
 	/* set up proto header */
 	switch (version) {
@@ -1792,12 +2305,330 @@ void tcpsynackrtt(struct conv *s)
 	tcphalt(tpriv, &tcb->rtt_timer);
 }
 
+/*
+ *  SACK, RFC 2018, with the sender's loss recovery from RFC 6675.
+ *
+ *  As the receiver, we report the runs in the resequence queue, the one the
+ *  last segment landed in first.  As the sender, the scoreboard is what the
+ *  other end says it has above snd.una.  We only discard data once snd.una
+ *  passes it, so the receiver is free to renege.
+ */
+
+/* Drops the parts of the n blocks in sb below seq.  Returns the new n. */
+static int sack_trim(struct sack_block *sb, int n, uint32_t seq)
+{
+	int i, j;
+
+	for (i = 0, j = 0; i < n; i++) {
+		if (seq_le(sb[i].right, seq))
+			continue;
+		sb[j] = sb[i];
+		if (seq_lt(sb[j].left, seq))
+			sb[j].left = seq;
+		j++;
+	}
+	return j;
+}
+
+/* Puts the run of the resequence queue holding seq at the front of the SACK
+ * blocks we send, followed by the ones we were already sending. */
+static void tcp_rcv_sack_add(Tcpctl *tcb, uint32_t seq)
+{
+	struct sack_block blks[MAX_NR_RCV_SACKS], *sb;
+	Reseq *rp = tcb->reseq;
+	uint32_t left, right, end;
+	int n = 1;
+
+	for (;;) {
+		if (rp == NULL)
+			return;
+		left = rp->seg.seq;
+		right = left + rp->length;
+		for (rp = rp->next; rp && seq_le(rp->seg.seq, right); rp = rp->next) {
+			end = rp->seg.seq + rp->length;
+			if (seq_gt(end, right))
+				right = end;
+		}
+		if (seq_ge(seq, left) && seq_lt(seq, right))
+			break;
+	}
+	blks[0].left = left;
+	blks[0].right = right;
+	for (int i = 0; i < tcb->rcv.nr_sacks && n < MAX_NR_RCV_SACKS; i++) {
+		sb = &tcb->rcv.sacks[i];
+		if (seq_ge(sb->left, left) && seq_le(sb->right, right))
+			continue;
+		blks[n++] = *sb;
+	}
+	memcpy(tcb->rcv.sacks, blks, n * sizeof(struct sack_block));
+	tcb->rcv.nr_sacks = n;
+}
+
+static void tcpsetsacks(Tcpctl *tcb, Tcp *seg)
+{
+	seg->nr_sacks = tcb->rcv.nr_sacks;
+	memcpy(seg->sacks, tcb->rcv.sacks,
+	       seg->nr_sacks * sizeof(struct sack_block));
+}
+
+/* How much data fits in a segment next to our SACK blocks */
+static uint32_t tcppayload(Tcpctl *tcb)
+{
+	if (!tcb->rcv.nr_sacks)
+		return tcb->mss;
+	return tcb->mss - ROUNDUP(SACK_HDR_LENGTH +
+	                          tcb->rcv.nr_sacks * SACK_BLK_LENGTH, 4);
+}
+
+/* Merges seg's SACK blocks into the scoreboard */
+static void tcp_sack_update(Tcpctl *tcb, Tcp *seg)
+{
+	struct sack_block *sb = tcb->snd.sacks, b;
+	int n = tcb->snd.nr_sacks, i, j;
+
+	for (i = 0; i < seg->nr_sacks; i++) {
+		b = seg->sacks[i];
+		/* D-SACKs are below the ack, and anything past nxt is bogus */
+		if (!seq_lt(b.left, b.right) || seq_le(b.right, seg->ack) ||
+		    seq_gt(b.right, tcb->snd.nxt))
+			continue;
+		if (seq_lt(b.left, seg->ack))
+			b.left = seg->ack;
+		if (n == MAX_NR_SND_SACKS) {
+			/* out of room; the low blocks tell us what to resend */
+			if (!seq_lt(b.left, sb[n - 1].left))
+				continue;
+			n--;
+		}
+		for (j = n; j > 0 && seq_gt(sb[j - 1].left, b.left); j--)
+			sb[j] = sb[j - 1];
+		sb[j] = b;
+		n++;
+	}
+	/* merge overlapping and adjacent blocks */
+	for (i = 0, j = 0; i < n; i++) {
+		if (j && seq_le(sb[i].left, sb[j - 1].right)) {
+			if (seq_gt(sb[i].right, sb[j - 1].right))
+				sb[j - 1].right = sb[i].right;
+			continue;
+		}
+		sb[j++] = sb[i];
+	}
+	tcb->snd.nr_sacks = j;
+}
+
+/* RFC 6675 IsLost(): enough has been SACKed above seq */
+static bool tcp_sack_is_lost(Tcpctl *tcb, uint32_t seq)
+{
+	struct sack_block *sb;
+	uint32_t sacked = 0;
+	int nr = 0;
+
+	for (int i = tcb->snd.nr_sacks - 1; i >= 0; i--) {
+		sb = &tcb->snd.sacks[i];
+		if (!seq_gt(sb->left, seq))
+			break;
+		sacked += sb->right - sb->left;
+		nr++;
+	}
+	return (nr >= TCPREXMTTHRESH) ||
+	       (sacked > (TCPREXMTTHRESH - 1) * tcb->mss);
+}
+
+/* RFC 6675 SetPipe(): how much we think is still in the network.  Holes count
+ * unless they are lost, and again for what we've resent of them. */
+static uint32_t tcp_sack_pipe(Tcpctl *tcb)
+{
+	uint32_t pipe = 0, l = tcb->snd.una, r;
+	int nr = tcb->snd.nr_sacks;
+
+	for (int i = 0; i <= nr; i++) {
+		/* [l, r) is a hole, or whatever is past the last block */
+		r = i < nr ? tcb->snd.sacks[i].left : tcb->snd.nxt;
+		if (!tcp_sack_is_lost(tcb, l))
+			pipe += r - l;
+		if (seq_gt(tcb->snd.rtx, l))
+			pipe += (seq_lt(tcb->snd.rtx, r) ? tcb->snd.rtx : r) - l;
+		if (i < nr)
+			l = tcb->snd.sacks[i].right;
+	}
+	return pipe;
+}
+
+/* RFC 6675 NextSeg(), rules 1 and 3: the first part of a hole we haven't
+ * resent yet, if it's lost or we don't care.  Returns its length, at most len,
+ * or 0 if there is none. */
+static uint32_t tcp_sack_next_seg(Tcpctl *tcb, uint32_t *seq, uint32_t len,
+                                  bool lost_only)
+{
+	uint32_t l = tcb->snd.una, r, start;
+
+	for (int i = 0; i < tcb->snd.nr_sacks; i++) {
+		r = tcb->snd.sacks[i].left;
+		start = seq_gt(tcb->snd.rtx, l) ? tcb->snd.rtx : l;
+		if (seq_lt(start, r) &&
+		    (!lost_only || tcp_sack_is_lost(tcb, start))) {
+			*seq = start;
+			return MIN(r - start, len);
+		}
+		l = tcb->snd.sacks[i].right;
+	}
+	return 0;
+}
+
+/*
+ *  resend [seq, seq + len) without touching snd.ptr.
+ *  called with s qlocked
+ */
+static void tcpsndrxmit(struct conv *s, uint32_t seq, uint32_t len)
+{
+	Tcp seg;
+	Tcpctl *tcb;
+	struct block *hbp, *bp;
+	struct tcppriv *tpriv;
+
+	tcb = (Tcpctl *) s->ptcl;
+	tpriv = s->p->priv;
+
+	tcprcvwin(s);
+	tcphalt(tpriv, &tcb->acktimer);
+	tcb->rcv.una = 0;
+	seg.source = s->lport;
+	seg.dest = s->rport;
+	seg.flags = ACK;
+	seg.urg = 0;
+	seg.mss = 0;
+	seg.ws = 0;
+	seg.sack_ok = 0;
+	tcpsetsacks(tcb, &seg);
+	seg.seq = seq;
+	seg.ack = tcb->rcv.nxt;
+	seg.wnd = tcb->rcv.wnd;
+
+	/* a short copy means the range covers our FIN */
+	bp = qcopy(s->wq, len, seq - tcb->snd.una);
+	if (BLEN(bp) != len)
+		seg.flags |= FIN;
+
+	tcb->flags |= RETRAN;
+	tcb->resent += len;
+	tpriv->stats[RetransSegs]++;
+	tpriv->stats[OutSegs]++;
+	tcb->cstats.segs_out++;
+	tcb->cstats.bytes_out += len;
+	tcb->cstats.rexmit_segs++;
+	tcb->cstats.rexmit_bytes += len;
+	netlog(s->p->f, Logtcprxmt, "sack rexmit 0x%lx len %lu una 0x%lx\n",
+	       seq, len, tcb->snd.una);
+
+	switch (s->ipversion) {
+		case V4:
+			tcb->protohdr.tcp4hdr.vihl = IP_VER4;
+			hbp = htontcp4(&seg, bp, &tcb->protohdr.tcp4hdr, tcb);
+			if (hbp == NULL) {
+				freeblist(bp);
+				return;
+			}
+			if (ipoput4(s->p->f, hbp, 0, s->ttl, s->tos, s) < 0)
+				localclose(s, "no route");
+			break;
+		case V6:
+			tcb->protohdr.tcp6hdr.vcf[0] = IP_VER6;
+			hbp = htontcp6(&seg, bp, &tcb->protohdr.tcp6hdr, tcb);
+			if (hbp == NULL) {
+				freeblist(bp);
+				return;
+			}
+			if (ipoput6(s->p->f, hbp, 0, s->ttl, s->tos, s) < 0)
+				localclose(s, "no route");
+			break;
+		default:
+			panic("tcpsndrxmit: version %d", s->ipversion);
+	}
+}
+
+/*
+ *  fill the pipe during sack recovery: lost holes first, then new data (which
+ *  tcpoutput sends), then the rest of the holes.
+ */
+static void tcp_sack_recover(struct conv *s)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+	uint32_t seq, len, sent, mss = tcppayload(tcb);
+
+	while (tcb->state != Closed &&
+	       tcb->cwind >= tcp_sack_pipe(tcb) + mss) {
+		len = tcp_sack_next_seg(tcb, &seq, mss, TRUE);
+		if (!len) {
+			sent = tcb->snd.nxt - tcb->snd.una;
+			if ((qlen(s->wq) + tcb->flgcnt > sent) && (tcb->snd.wnd > sent))
+				return;
+			len = tcp_sack_next_seg(tcb, &seq, mss, FALSE);
+			if (!len)
+				return;
+		}
+		tcb->snd.rtx = seq + len;
+		tcpsndrxmit(s, seq, len);
+	}
+}
+
+/* Once we're going back to snd.una after a timeout, that has to finish. */
+static bool tcp_sack_can_recover(Tcpctl *tcb)
+{
+	return tcb->sack_ok && !tcb->snd.recovery &&
+	       (tcb->snd.ptr == tcb->snd.nxt) && (tcb->flags & SYNACK);
+}
+
+static void tcp_sack_enter_recovery(struct conv *s)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+	struct tcppriv *tpriv = s->p->priv;
+	uint32_t flight = tcb->snd.nxt - tcb->snd.una;
+	uint32_t len = MIN(tcppayload(tcb), flight);
+
+	netlog(s->p->f, Logtcprxmt, "sack rxt %lu, nxt %lu\n", tcb->snd.una,
+	       tcb->snd.nxt);
+	tpriv->stats[SackRecoveries]++;
+	tcb->snd.recovery = SACK_RECOVERY;
+	tcb->snd.rxt = tcb->snd.nxt;
+	tcb->ssthresh = tcb->cc->ssthresh(tcb);
+	tcb->cwind = tcb->ssthresh;
+
+	/* the first hole goes now, whatever the pipe says */
+	if (tcb->snd.nr_sacks)
+		len = MIN(len, tcb->snd.sacks[0].left - tcb->snd.una);
+	tcb->snd.rtx = tcb->snd.una + len;
+	if (len)
+		tcpsndrxmit(s, tcb->snd.una, len);
+	tcp_sack_recover(s);
+}
+
+/*
+ *  NewReno fast recovery, RFC 6582, for when there's no SACK: resend the first
+ *  segment, let another one out per dupack, and resend the next hole on each
+ *  partial ack until everything we'd sent is acked.
+ */
+static void tcp_reno_enter_recovery(struct conv *s)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+	struct tcppriv *tpriv = s->p->priv;
+	uint32_t flight = tcb->snd.nxt - tcb->snd.una;
+
+	netlog(s->p->f, Logtcprxmt, "reno rxt %lu, nxt %lu\n", tcb->snd.una,
+	       tcb->snd.nxt);
+	tpriv->stats[RenoRecoveries]++;
+	tcb->snd.recovery = RENO_RECOVERY;
+	tcb->snd.rxt = tcb->snd.nxt;
+	tcb->ssthresh = tcb->cc->ssthresh(tcb);
+	tcb->cwind = tcb->ssthresh + TCPREXMTTHRESH * tcb->mss;
+	tcpsndrxmit(s, tcb->snd.una, MIN(tcppayload(tcb), flight));
+}
+
 void update(struct conv *s, Tcp * seg)
 {
 	int rtt, delta;
 	Tcpctl *tcb;
 	uint32_t acked;
-	uint32_t expand;
 	struct tcppriv *tpriv;
 
 	tpriv = s->p->priv;
@@ -1809,6 +2640,9 @@ void update(struct conv *s, Tcp * seg)
 		return;
 	}
 
+	if (tcb->sack_ok)
+		tcp_sack_update(tcb, seg);
+
 	/* added by Dong Lin for fast retransmission */
 	if (seg->ack == tcb->snd.una
 		&& tcb->snd.una != tcb->snd.nxt
@@ -1818,18 +2652,30 @@ void update(struct conv *s, Tcp * seg)
 		netlog(s->p->f, Logtcprxmt, "dupack %lu ack %lu sndwnd %d advwin %d\n",
 			   tcb->snd.dupacks, seg->ack, tcb->snd.wnd, seg->wnd);
 
-		if (++tcb->snd.dupacks == TCPREXMTTHRESH) {
+		++tcb->snd.dupacks;
+		if (tcb->snd.recovery == SACK_RECOVERY) {
+			tcp_sack_recover(s);
+		} else if (tcb->snd.recovery == RENO_RECOVERY) {
+			/* another segment left the network */
+			tcb->cwind += tcb->mss;
+		} else if (tcp_sack_can_recover(tcb) &&
+		           (tcb->snd.dupacks >= TCPREXMTTHRESH ||
+		            tcp_sack_is_lost(tcb, tcb->snd.una))) {
+			tcp_sack_enter_recovery(s);
+		} else if (tcb->snd.dupacks == TCPREXMTTHRESH &&
+		           !tcb->snd.recovery && tcb->snd.ptr == tcb->snd.nxt &&
+		           (tcb->flags & SYNACK)) {
+			tcp_reno_enter_recovery(s);
+		} else if (tcb->snd.dupacks == TCPREXMTTHRESH) {
 			/*
 			 *  tahoe tcp rxt the packet, half sshthresh,
 			 *  and set cwnd to one packet
 			 */
-			tcb->snd.recovery = 1;
+			tcb->snd.recovery = TAHOE_RECOVERY;
 			tcb->snd.rxt = tcb->snd.nxt;
 			netlog(s->p->f, Logtcprxmt, "fast rxt %lu, nxt %lu\n", tcb->snd.una,
 				   tcb->snd.nxt);
 			tcprxmit(s);
-		} else {
-			/* do reno tcp here. */
 		}
 	}
 
@@ -1854,10 +2700,14 @@ void update(struct conv *s, Tcp * seg)
 	}
 
 	/*
-	 *  any positive ack turns off fast rxt,
-	 *  (should we do new-reno on partial acks?)
+	 *  any positive ack turns off fast rxt, except for partial acks
 	 */
 	if (!tcb->snd.recovery || seq_ge(seg->ack, tcb->snd.rxt)) {
+		/* deflate what the dupacks inflated */
+		if (tcb->snd.recovery == RENO_RECOVERY)
+			tcb->cwind = MIN(tcb->ssthresh,
+			                 MAX(tcb->snd.nxt - seg->ack, tcb->mss) +
+			                 tcb->mss);
 		tcb->snd.dupacks = 0;
 		tcb->snd.recovery = 0;
 	} else
@@ -1877,18 +2727,11 @@ void update(struct conv *s, Tcp * seg)
 
 	/* slow start as long as we're not recovering from lost packets */
 	if (tcb->cwind < tcb->snd.wnd && !tcb->snd.recovery) {
-		if (tcb->cwind < tcb->ssthresh) {
-			expand = tcb->mss;
-			if (acked < expand)
-				expand = acked;
-		} else
-			expand = ((int)tcb->mss * tcb->mss) / tcb->cwind;
-
-		if (tcb->cwind + expand < tcb->cwind)
-			expand = tcb->snd.wnd - tcb->cwind;
-		if (tcb->cwind + expand > tcb->snd.wnd)
-			expand = tcb->snd.wnd - tcb->cwind;
-		tcb->cwind += expand;
+		if (tcb->cwind < tcb->ssthresh)
+			tcb->cwind += MIN(acked, tcb->mss);
+		else
+			tcb->cc->cong_avoid(tcb, acked);
+		tcb->cwind = MIN(tcb->cwind, tcb->snd.wnd);
 	}
 
 	/* Adjust the timers according to the round trip time */
@@ -1897,7 +2740,10 @@ void update(struct conv *s, Tcp * seg)
 		if ((tcb->flags & RETRAN) == 0) {
 			tcb->backoff = 0;
 			tcb->backedoff = 0;
-			rtt = tcb->rtt_timer.start - tcb->rtt_timer.count;
+			tcp_sample(s, tcb->cstats.rtt_hist, "rtt",
+			           tsc2usec(read_tsc() - tcb->cstats.rtt_tsc));
+			rtt = tcb->rtt_timer.start -
+			      tcptimerleft(tpriv, &tcb->rtt_timer);
 			if (rtt == 0)
 				rtt = 1;	/* otherwise all close systems will rexmit in 0 time */
 			rtt *= MSPTICK;
@@ -1938,6 +2784,22 @@ done:
 	tcb->flags &= ~RETRAN;
 	tcb->backoff = 0;
 	tcb->backedoff = 0;
+
+	tcb->snd.nr_sacks = sack_trim(tcb->snd.sacks, tcb->snd.nr_sacks,
+	                              tcb->snd.una);
+	if (tcb->snd.recovery == SACK_RECOVERY) {
+		/* a partial ack; keep filling holes */
+		if (seq_lt(tcb->snd.rtx, tcb->snd.una))
+			tcb->snd.rtx = tcb->snd.una;
+		tcp_sack_recover(s);
+	} else if (tcb->snd.recovery == RENO_RECOVERY) {
+		/* a partial ack: the next hole goes now, and the acked data left */
+		tcpsndrxmit(s, tcb->snd.una,
+		            MIN(tcppayload(tcb), tcb->snd.nxt - tcb->snd.una));
+		tcb->cwind -= MIN(acked, tcb->cwind - tcb->mss);
+		if (acked >= tcb->mss)
+			tcb->cwind += tcb->mss;
+	}
 }
 
 void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
@@ -2093,6 +2955,9 @@ reset:
 	qlock(&s->qlock);
 	qunlock(&tcp->qlock);
 
+	tcb->cstats.segs_in++;
+	tcb->cstats.bytes_in += length;
+
 	/* fix up window */
 	seg.wnd <<= tcb->rcv.scale;
 
@@ -2198,9 +3063,12 @@ reset:
 	if (seg.seq != tcb->rcv.nxt)
 		if (length != 0 || (seg.flags & (SYN | FIN))) {
 			update(s, &seg);
-			if (addreseq(tcb, tpriv, &seg, bp, length) < 0)
+			if (addreseq(tcb, tpriv, &seg, bp, length) < 0) {
 				printd("reseq %I.%d -> %I.%d\n", s->raddr, s->rport, s->laddr,
 					   s->lport);
+			} else if (tcb->sack_ok && length) {
+				tcp_rcv_sack_add(tcb, seg.seq);
+			}
 			tcb->flags |= FORCE;
 			goto output;
 		}
@@ -2306,6 +3174,7 @@ reset:
 						bp = packblock(bp);
 						if (bp == NULL)
 							panic("tcp packblock");
+						tcp_set_rq_mark(s, BLEN(bp));
 						qpassnolim(s->rq, bp);
 						bp = NULL;
 
@@ -2431,7 +3300,7 @@ void tcpoutput(struct conv *s)
 	Tcpctl *tcb;
 	struct block *hbp, *bp;
 	int sndcnt, n;
-	uint32_t ssize, dsize, usable, sent;
+	uint32_t ssize, dsize, usable, sent, pipe, mss;
 	struct Fs *f;
 	struct tcppriv *tpriv;
 	uint8_t version;
@@ -2450,6 +3319,11 @@ void tcpoutput(struct conv *s)
 				return;
 		}
 
+		/* SACK blocks take room from the data */
+		tcb->rcv.nr_sacks = sack_trim(tcb->rcv.sacks, tcb->rcv.nr_sacks,
+		                              tcb->rcv.nxt);
+		mss = tcppayload(tcb);
+
 		/* force an ack when a window has opened up */
 		if (tcb->rcv.blocked && tcb->rcv.wnd > 0) {
 			tcb->rcv.blocked = 0;
@@ -2458,6 +3332,7 @@ void tcpoutput(struct conv *s)
 
 		sndcnt = qlen(s->wq) + tcb->flgcnt;
 		sent = tcb->snd.ptr - tcb->snd.una;
+		tcp_track_wnd_blocked(s, sndcnt > sent && tcb->snd.wnd <= sent);
 
 		/* Don't send anything else until our SYN has been acked */
 		if (tcb->snd.ptr != tcb->iss && (tcb->flags & SYNACK) == 0)
@@ -2473,11 +3348,18 @@ void tcpoutput(struct conv *s)
 //              tcb->snd.ptr = tcb->snd.una;
 			}
 			usable = 1;
+		} else if (tcb->snd.recovery == SACK_RECOVERY) {
+			/* only new data comes through here, and it goes by the pipe */
+			pipe = tcp_sack_pipe(tcb);
+			usable = tcb->cwind > pipe ? tcb->cwind - pipe : 0;
+			if (tcb->snd.wnd < sent + usable)
+				usable = tcb->snd.wnd > sent ? tcb->snd.wnd - sent : 0;
 		} else {
 			usable = tcb->cwind;
 			if (tcb->snd.wnd < usable)
 				usable = tcb->snd.wnd;
-			usable -= sent;
+			/* cwind can drop below what's in flight */
+			usable = usable > sent ? usable - sent : 0;
 		}
 		ssize = sndcnt - sent;
 		if (ssize && usable < 2)
@@ -2485,16 +3367,17 @@ void tcpoutput(struct conv *s)
 				   tcb->snd.wnd, tcb->cwind);
 		if (usable < ssize)
 			ssize = usable;
-		if (ssize > tcb->mss) {
+		if (ssize > mss) {
 			if ((tcb->flags & TSO) == 0) {
-				ssize = tcb->mss;
+				ssize = mss;
 			} else {
 				int segs, window;
 
-				/*  Don't send too much.  32K is arbitrary..
+				/*  Don't send more than one IP packet can
+				 *  carry.
 				 */
-				if (ssize > 32 * 1024)
-					ssize = 32 * 1024;
+				if (ssize > TSO_MAX)
+					ssize = TSO_MAX;
 
 				/* Clamp xmit to an integral MSS to
 				 * avoid ragged tail segments causing
@@ -2504,8 +3387,8 @@ void tcpoutput(struct conv *s)
 				 * next multiple of 4, to ensure we
 				 * still yeild.
 				 */
-				segs = ssize / tcb->mss;
-				ssize = segs * tcb->mss;
+				segs = ssize / mss;
+				ssize = segs * mss;
 				msgs += segs;
 				if (segs > 3)
 					msgs = (msgs + 4) & ~3;
@@ -2530,6 +3413,8 @@ void tcpoutput(struct conv *s)
 		seg.flags = ACK;
 		seg.mss = 0;
 		seg.ws = 0;
+		seg.sack_ok = 0;
+		tcpsetsacks(tcb, &seg);
 		switch (tcb->state) {
 			case Syn_sent:
 				seg.flags = 0;
@@ -2538,6 +3423,7 @@ void tcpoutput(struct conv *s)
 					dsize--;
 					seg.mss = tcb->mss;
 					seg.ws = tcb->scale;
+					seg.sack_ok = 1;
 				}
 				break;
 			case Syn_received:
@@ -2552,6 +3438,7 @@ void tcpoutput(struct conv *s)
 					ssize = 1;
 					seg.mss = tcb->mss;
 					seg.ws = tcb->scale;
+					seg.sack_ok = tcb->sack_ok;
 				}
 				break;
 		}
@@ -2567,9 +3454,9 @@ void tcpoutput(struct conv *s)
 				seg.flags |= FIN;
 				dsize--;
 			}
-			if (BLEN(bp) > tcb->mss) {
+			if (BLEN(bp) > mss) {
 				bp->flag |= Btso;
-				bp->mss = tcb->mss;
+				bp->mss = mss;
 			}
 		}
 
@@ -2586,6 +3473,8 @@ void tcpoutput(struct conv *s)
 				   s->raddr, s->rport, s->laddr, s->lport, tcb->snd.ptr,
 				   tcb->snd.nxt);
 			tpriv->stats[RetransSegs]++;
+			tcb->cstats.rexmit_segs++;
+			tcb->cstats.rexmit_bytes += n;
 		}
 
 		tcb->snd.ptr += ssize;
@@ -2631,13 +3520,17 @@ void tcpoutput(struct conv *s)
 			 *  transmission time dominates RTT
 			 */
 			if (tcb->rtt_timer.state != TcptimerON)
-				if (ssize == tcb->mss) {
+				if (ssize == mss) {
 					tcpgo(tpriv, &tcb->rtt_timer);
 					tcb->rttseq = tcb->snd.ptr;
+					tcb->cstats.rtt_tsc = read_tsc();
 				}
 		}
 
 		tpriv->stats[OutSegs]++;
+		tcb->cstats.segs_out++;
+		tcb->cstats.bytes_out += dsize;
+		tcp_check_wq_mark(s);
 
 		/* put off the next keep alive */
 		tcpgo(tpriv, &tcb->katimer);
@@ -2684,6 +3577,8 @@ void tcpsendka(struct conv *s)
 	seg.flags = ACK | PSH;
 	seg.mss = 0;
 	seg.ws = 0;
+	seg.sack_ok = 0;
+	seg.nr_sacks = 0;
 	if (tcpporthogdefense)
 		urandom_read(&seg.seq, sizeof(seg.seq));
 	else
@@ -2798,11 +3693,7 @@ void tcprxmit(struct conv *s)
 	tcb->flags |= RETRAN | FORCE;
 	tcb->snd.ptr = tcb->snd.una;
 
-	/*
-	 *  We should be halving the slow start threshhold (down to one
-	 *  mss) but leaving it at mss seems to work well enough
-	 */
-	tcb->ssthresh = tcb->mss;
+	tcb->ssthresh = tcb->cc->ssthresh(tcb);
 
 	/*
 	 *  pull window down to a single packet
@@ -2843,8 +3734,16 @@ void tcptimeout(void *arg)
 			netlog(s->p->f, Logtcprxmt, "timeout rexmit 0x%lx %llu/%llu\n",
 				   tcb->snd.una, tcb->timer.start, NOW);
 			tcpsettimer(tcb);
+			/* go back to snd.una; the scoreboard doesn't survive this */
+			tcb->snd.nr_sacks = 0;
+			if (tcb->snd.recovery == RENO_RECOVERY)
+				tcb->cwind = tcb->ssthresh;
+			if (tcb->snd.recovery == SACK_RECOVERY ||
+			    tcb->snd.recovery == RENO_RECOVERY)
+				tcb->snd.recovery = 0;
 			tcprxmit(s);
 			tpriv->stats[RetransTimeouts]++;
+			tcb->cstats.timeouts++;
 			tcb->snd.dupacks = 0;
 			break;
 		case Time_wait:
@@ -2880,6 +3779,9 @@ void procsyn(struct conv *s, Tcp * seg)
 	if (seg->mss != 0 && seg->mss < tcb->mss)
 		tcb->mss = seg->mss;
 
+	/* we offer SACK in our SYN, so it's up to them */
+	tcb->sack_ok = seg->sack_ok;
+
 	/* the congestion window always starts out as a single segment */
 	tcb->snd.wnd = seg->wnd;
 	tcb->cwind = tcb->mss;
@@ -2945,6 +3847,7 @@ addreseq(Tcpctl * tcb, struct tcppriv *tpriv, Tcp * seg,
 			kfree(rp);
 		}
 		tcb->reseq = NULL;
+		tcb->rcv.nr_sacks = 0;
 
 		return -1;
 	}
@@ -3097,6 +4000,38 @@ static void tcpporthogdefensectl(char *val)
 		error(EINVAL, "unknown value for tcpporthogdefense");
 }
 
+/* picks c's congestion control.  calls it accepts get the same. */
+static void tcpsetcc(struct conv *c, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) c->ptcl;
+
+	if (n != 2)
+		error(EINVAL, "usage: cc newreno|cubic");
+	for (int i = 0; i < ARRAY_SIZE(tcp_cc_algs); i++) {
+		if (strcmp(f[1], tcp_cc_algs[i].name) == 0) {
+			tcb->cc = &tcp_cc_algs[i];
+			tcb->cc->init(tcb);
+			return;
+		}
+	}
+	error(EINVAL, "unknown congestion control %s", f[1]);
+}
+
+/*
+ *  trace N: send one in N latency samples to the tcptrace netlog.  0 or no
+ *  argument turns it off.
+ */
+static void tcpsettrace(struct conv *c, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) c->ptcl;
+	long every = n > 1 ? strtol(f[1], 0, 0) : 0;
+
+	if (every < 0)
+		error(EINVAL, "bad trace rate %s", f[1]);
+	tcb->cstats.trace_every = every;
+	tcb->cstats.trace_count = 0;
+}
+
 /* called with c qlocked */
 static void tcpctl(struct conv *c, char **f, int n)
 {
@@ -3106,8 +4041,12 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpstartka(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "checksum") == 0)
 		tcpsetchecksum(c, f, n);
+	else if (n >= 1 && strcmp(f[0], "cc") == 0)
+		tcpsetcc(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
+	else if (n >= 1 && strcmp(f[0], "trace") == 0)
+		tcpsettrace(c, f, n);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -3126,6 +4065,48 @@ int tcpstats(struct Proto *tcp, char *buf, int len)
 	return p - buf;
 }
 
+static char *tcp_hist_print(char *p, char *e, char *name, uint64_t *hist)
+{
+	p = seprintf(p, e, "%s:", name);
+	for (int i = 0; i < TCP_HIST_SZ; i++)
+		p = seprintf(p, e, " %llu", hist[i]);
+	return seprintf(p, e, "\n");
+}
+
+/*
+ *  one "name: value" per line.  histogram bucket i counts samples of
+ *  [2^i, 2^(i+1)) usec; bucket 0 also has 0 and 1, and the last bucket has
+ *  everything bigger.
+ */
+static int tcpconvstats(struct conv *c, char *buf, int len)
+{
+	Tcpctl *tcb = (Tcpctl *) c->ptcl;
+	struct tcp_convstats *cs = &tcb->cstats;
+	uint64_t blocked = cs->wnd_blocked_usec;
+	uint64_t blocked_tsc = ACCESS_ONCE(cs->wnd_blocked_tsc);
+	char *p = buf, *e = buf + len;
+
+	if (blocked_tsc)
+		blocked += tsc2usec(read_tsc() - blocked_tsc);
+	p = seprintf(p, e, "SegsIn: %llu\n", cs->segs_in);
+	p = seprintf(p, e, "SegsOut: %llu\n", cs->segs_out);
+	p = seprintf(p, e, "BytesIn: %llu\n", cs->bytes_in);
+	p = seprintf(p, e, "BytesOut: %llu\n", cs->bytes_out);
+	p = seprintf(p, e, "RetransSegs: %llu\n", cs->rexmit_segs);
+	p = seprintf(p, e, "RetransBytes: %llu\n", cs->rexmit_bytes);
+	p = seprintf(p, e, "RetransTimeouts: %llu\n", cs->timeouts);
+	p = seprintf(p, e, "SrttUsec: %llu\n",
+	             (uint64_t)(tcb->srtt >> LOGAGAIN) * 1000);
+	p = seprintf(p, e, "MdevUsec: %llu\n",
+	             (uint64_t)(tcb->mdev >> LOGDGAIN) * 1000);
+	p = seprintf(p, e, "WndBlockedUsec: %llu\n", blocked);
+	p = seprintf(p, e, "HistBuckets: %d\n", TCP_HIST_SZ);
+	p = tcp_hist_print(p, e, "RttHist", cs->rtt_hist);
+	p = tcp_hist_print(p, e, "RqDelayHist", cs->rq_delay_hist);
+	p = tcp_hist_print(p, e, "WqDelayHist", cs->wq_delay_hist);
+	return p - buf;
+}
+
 /*
  *  garbage collect any stale conversations:
  *	- SYN received but no SYN-ACK after 5 seconds (could be the SYN attack)
@@ -3194,6 +4175,8 @@ void tcpinit(struct Fs *fs)
 	tpriv = tcp->priv = kzmalloc(sizeof(struct tcppriv), 0);
 	qlock_init(&tpriv->tl);
 	qlock_init(&tpriv->apl);
+	tpriv->nlht = NLHT;
+	tpriv->lht = kzmalloc(NLHT * sizeof(Limbo *), 0);
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
 	tcp->announce = tcpannounce;
@@ -3205,6 +4188,7 @@ void tcpinit(struct Fs *fs)
 	tcp->rcv = tcpiput;
 	tcp->advise = tcpadvise;
 	tcp->stats = tcpstats;
+	tcp->convstats = tcpconvstats;
 	tcp->inuse = tcpinuse;
 	tcp->gc = tcpgc;
 	tcp->ipproto = IP_TCPPROTO;
@@ -3223,6 +4207,8 @@ tcpsetscale(struct conv *s, Tcpctl * tcb, uint16_t rcvscale, uint16_t sndscale)
 		tcb->snd.scale = sndscale & 0xff;
 		tcb->window = QMAX << tcb->snd.scale;
 		qsetlimit(s->rq, tcb->window);
+		/* enough queued to fill a big window, within reason */
+		qsetlimit(s->wq, MAX(8 * QMAX, QMAX << MIN(tcb->rcv.scale, 8)));
 	} else {
 		tcb->rcv.scale = 0;
 		tcb->snd.scale = 0;
@@ -70,6 +70,7 @@ enum {
 	IP_UDPPROTO = 17,
 	UDP_USEAD7 = 52,
 	UDP_USEAD6 = 36,
+	UDP_BATCHHDR = 2,	/* length of each record in batch mode */
 
 	Udprxms = 200,
 	Udptickms = 100,
@@ -144,6 +145,7 @@ typedef struct Udpcb Udpcb;
 struct Udpcb {
 	qlock_t qlock;
 	uint8_t headers;
+	uint8_t batch;
 };
 
 static void udpconnect(struct conv *c, char **argv, int argc)
@@ -199,13 +201,61 @@ static void udpclose(struct conv *c)
 
 	ucb = (Udpcb *) c->ptcl;
 	ucb->headers = 0;
+	if (ucb->batch) {
+		ucb->batch = 0;
+		q_toggle_qmsg(c->rq, TRUE);
+	}
 
 	qunlock(&c->qlock);
 }
 
+static void udpkick1(struct conv *c, struct block *bp);
+
+/*
+ *  in batch mode, a write holds any number of records, each a 2 byte length
+ *  and then that many bytes of headers and data.  we send them one at a time.
+ *  a record that runs off the end of the write is dropped.  writes bigger
+ *  than Maxatomic get split, so batches should stay under that.
+ */
+static void udpkickbatch(struct conv *c, struct block *bp)
+{
+	struct block *b;
+	int len;
+
+	if (bp->next)
+		bp = concatblock(bp);
+	while (BLEN(bp) >= UDP_BATCHHDR) {
+		len = nhgets(bp->rp);
+		bp->rp += UDP_BATCHHDR;
+		if (len > BLEN(bp)) {
+			netlog(c->p->f, Logudp, "udp: short batch record\n");
+			break;
+		}
+		b = block_alloc(len, MEM_WAIT);
+		memmove(b->wp, bp->rp, len);
+		b->wp += len;
+		bp->rp += len;
+		udpkick1(c, b);
+	}
+	freeb(bp);
+}
+
 void udpkick(void *x, struct block *bp)
 {
 	struct conv *c = x;
+	Udpcb *ucb;
+
+	if (bp == NULL)
+		return;
+	ucb = (Udpcb *) c->ptcl;
+	if (ucb->batch)
+		udpkickbatch(c, bp);
+	else
+		udpkick1(c, bp);
+}
+
+static void udpkick1(struct conv *c, struct block *bp)
+{
 	Udp4hdr *uh4;
 	Udp6hdr *uh6;
 	uint16_t rport;
@@ -222,8 +272,6 @@ void udpkick(void *x, struct block *bp)
 	f = c->p->f;
 
 	netlog(c->p->f, Logudp, "udp: kick\n");
-	if (bp == NULL)
-		return;
 
 	ucb = (Udpcb *) c->ptcl;
 	switch (ucb->headers) {
@@ -560,6 +608,12 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 	if (bp->next)
 		bp = concatblock(bp);
 
+	/* records may share a read, which takes as many whole blocks as fit */
+	if (ucb->batch) {
+		bp = padblock(bp, UDP_BATCHHDR);
+		hnputs(bp->rp, BLEN(bp) - UDP_BATCHHDR);
+	}
+
 	if (qfull(c->rq)) {
 		qunlock(&c->qlock);
 		netlog(f, Logudp, "udp: qfull %I.%d -> %I.%d\n", raddr, rport,
@@ -581,7 +635,22 @@ static void udpctl(struct conv *c, char **f, int n)
 		ucb->headers = 6;
 	else if ((n == 1) && strcmp(f[0], "headers") == 0)
 		ucb->headers = 7;
-	else
+	else if (strcmp(f[0], "batch") == 0) {
+		/* batch [off]: many datagrams, with headers, per read or write */
+		if ((n == 2) && strcmp(f[1], "off") == 0) {
+			if (ucb->batch)
+				q_toggle_qmsg(c->rq, TRUE);
+			ucb->batch = 0;
+		} else if (n == 1) {
+			if (!ucb->headers)
+				ucb->headers = 7;
+			if (!ucb->batch)
+				q_toggle_qmsg(c->rq, FALSE);
+			ucb->batch = 1;
+		} else {
+			error(EINVAL, "batch [off]");
+		}
+	} else
 		error(EINVAL, "unknown command to %s", __func__);
 }
 
@@ -40,6 +40,7 @@
 #include <smp.h>
 #include <ip.h>
 #include <process.h>
+#include <percpu.h>
 
 /* Note that Hdrspc is only available via padblock (to the 'left' of the rp). */
 enum {
@@ -48,22 +49,19 @@ enum {
 	BLOCKALIGN = 32,	/* was the old BY2V in inferno, which was 8 */
 };
 
-/*
- *  allocate blocks (round data base address to 64 bit boundary).
- *  if mallocz gives us more than we asked for, leave room at the front
- *  for header.
- */
-struct block *block_alloc(size_t size, int mem_flags)
+/* Room for a block with size bytes of data, from one kmalloc. */
+static size_t block_kmsize(size_t size)
+{
+	return sizeof(struct block) + size + Hdrspc + (BLOCKALIGN - 1);
+}
+
+/* Sets up b, which came from a kmalloc of block_kmsize(bufsz), to hold size
+ * bytes.  Anything past size is left at the front for headers. */
+static void block_setup(struct block *b, size_t bufsz, size_t size)
 {
-	struct block *b;
 	uintptr_t addr;
 	int n;
 
-	b = kmalloc(sizeof(struct block) + size + Hdrspc + (BLOCKALIGN - 1),
-				mem_flags);
-	if (b == NULL)
-		return NULL;
-
 	b->next = NULL;
 	b->list = NULL;
 	b->free = NULL;
@@ -81,9 +79,7 @@ struct block *block_alloc(size_t size, int mem_flags)
 	 * Not on akaros yet.
 	 b->lim = ((uint8_t*)b) + msize(b);
 	 */
-	b->lim =
-		((uint8_t *) b) + sizeof(struct block) + size + Hdrspc + (BLOCKALIGN -
-																  1);
+	b->lim = ((uint8_t *) b) + block_kmsize(bufsz);
 	b->rp = b->base;
 	n = b->lim - b->base - size;
 	b->rp += n & ~(BLOCKALIGN - 1);
@@ -92,7 +88,182 @@ struct block *block_alloc(size_t size, int mem_flags)
 	 * b->lim is the upper bound on our malloc
 	 * b->rp is advanced by some aligned amount, based on how much extra we
 	 * received from kmalloc and the Hdrspc. */
-	return b;
+}
+
+/* Block pools.  Drivers refill their rings with blocks of one size, and those
+ * blocks come back through freeb() soon after, often on another core.  Blocks
+ * of a pooled size go back to a per-core cache instead of kfree, and the caches
+ * trade with a depot in batches.
+ *
+ * Pooled blocks are still ordinary kmalloc buffers, so anything that takes a
+ * ref on a block's body, like an ebd pointing into it, still works.  We only
+ * recycle a block when freeb() drops the last ref. */
+#define BPOOL_CACHE_SZ			64
+#define BPOOL_BATCH				(BPOOL_CACHE_SZ / 2)
+#define NR_BPOOLS				2
+
+struct bpool {
+	size_t						size;
+	unsigned int				depot_max;
+	spinlock_t					lock;
+	struct block				*depot;		/* chained on b->next */
+	unsigned int				nr_depot;
+};
+
+struct bpool_cache {
+	unsigned int				nr;
+	struct block				*blocks[BPOOL_CACHE_SZ];
+};
+
+struct bpool_pcpu {
+	struct bpool_cache			caches[NR_BPOOLS];
+};
+
+/* An MTU frame and a jumbo one, each with room for a driver's slop.  The jumbo
+ * size is the biggest the 82563 driver asks for (9728). */
+static struct bpool bpools[NR_BPOOLS] = {
+	{.size = 2048 + 128, .depot_max = 4096,
+	 .lock = SPINLOCK_INITIALIZER_IRQSAVE},
+	{.size = 9728 + 128, .depot_max = 512,
+	 .lock = SPINLOCK_INITIALIZER_IRQSAVE},
+};
+
+static DEFINE_PERCPU(struct bpool_pcpu, bpool_pcpu);
+
+/* Pools take anything that fits without wasting more than half a block. */
+static struct bpool *size_to_bpool(size_t size)
+{
+	for (int i = 0; i < NR_BPOOLS; i++) {
+		if (size <= bpools[i].size)
+			return size > bpools[i].size / 2 ? &bpools[i] : NULL;
+	}
+	return NULL;
+}
+
+static struct bpool *block_to_bpool(struct block *b)
+{
+	size_t kmsize = b->lim - (uint8_t*)b;
+
+	for (int i = 0; i < NR_BPOOLS; i++) {
+		if (kmsize == block_kmsize(bpools[i].size))
+			return &bpools[i];
+	}
+	return NULL;
+}
+
+/* IRQs must be off */
+static struct bpool_cache *bpool_get_cache(struct bpool *bp)
+{
+	return &PERCPU_VAR(bpool_pcpu).caches[bp - bpools];
+}
+
+/* Moves up to a batch from the depot to an empty cache.  IRQs must be off. */
+static void bpool_refill(struct bpool *bp, struct bpool_cache *bc)
+{
+	struct block *b;
+
+	spin_lock_irqsave(&bp->lock);
+	while (bp->depot && (bc->nr < BPOOL_BATCH)) {
+		b = bp->depot;
+		bp->depot = b->next;
+		bp->nr_depot--;
+		bc->blocks[bc->nr++] = b;
+	}
+	spin_unlock_irqsave(&bp->lock);
+}
+
+/* Moves a batch from a full cache to the depot, freeing whatever doesn't fit.
+ * IRQs must be off. */
+static void bpool_flush(struct bpool *bp, struct bpool_cache *bc)
+{
+	struct block *b;
+
+	spin_lock_irqsave(&bp->lock);
+	while ((bc->nr > BPOOL_CACHE_SZ - BPOOL_BATCH) &&
+	       (bp->nr_depot < bp->depot_max)) {
+		b = bc->blocks[--bc->nr];
+		b->next = bp->depot;
+		bp->depot = b;
+		bp->nr_depot++;
+	}
+	spin_unlock_irqsave(&bp->lock);
+	while (bc->nr > BPOOL_CACHE_SZ - BPOOL_BATCH)
+		kfree(bc->blocks[--bc->nr]);
+}
+
+/* Takes up to nr blocks from bp, returning how many we got. */
+static int bpool_get(struct bpool *bp, struct block **blocks, int nr)
+{
+	struct bpool_cache *bc;
+	int8_t irq_state = 0;
+	int got = 0;
+
+	/* before then, every core would share the boot core's caches */
+	if (!percpu_base)
+		return 0;
+	disable_irqsave(&irq_state);
+	bc = bpool_get_cache(bp);
+	while (got < nr) {
+		if (!bc->nr)
+			bpool_refill(bp, bc);
+		if (!bc->nr)
+			break;
+		blocks[got++] = bc->blocks[--bc->nr];
+	}
+	enable_irqsave(&irq_state);
+	return got;
+}
+
+/* Keeps a freed block for reuse, if it's the right size and no one else has a
+ * ref on it.  Returns TRUE if it did. */
+static bool bpool_put(struct block *b)
+{
+	struct bpool *bp = block_to_bpool(b);
+	struct bpool_cache *bc;
+	int8_t irq_state = 0;
+
+	if (!bp || !percpu_base || (kmalloc_refcnt(b) != 1))
+		return FALSE;
+	disable_irqsave(&irq_state);
+	bc = bpool_get_cache(bp);
+	if (bc->nr == BPOOL_CACHE_SZ)
+		bpool_flush(bp, bc);
+	bc->blocks[bc->nr++] = b;
+	enable_irqsave(&irq_state);
+	return TRUE;
+}
+
+/*
+ *  allocate blocks (round data base address to 64 bit boundary).
+ *  if mallocz gives us more than we asked for, leave room at the front
+ *  for header.
+ */
+struct block *block_alloc(size_t size, int mem_flags)
+{
+	struct block *b;
+
+	return block_alloc_bulk(size, mem_flags, &b, 1) ? b : NULL;
+}
+
+/* Allocates nr blocks, each like block_alloc(size), for refilling rings.
+ * Returns how many it got, which is only less than nr if we ran out of memory
+ * (e.g. for MEM_ATOMIC). */
+int block_alloc_bulk(size_t size, int mem_flags, struct block **blocks, int nr)
+{
+	struct bpool *bp = size_to_bpool(size);
+	size_t bufsz = bp ? bp->size : size;
+	int got = 0;
+
+	if (bp)
+		got = bpool_get(bp, blocks, nr);
+	for (; got < nr; got++) {
+		blocks[got] = kmalloc(block_kmsize(bufsz), mem_flags);
+		if (!blocks[got])
+			break;
+	}
+	for (int i = 0; i < got; i++)
+		block_setup(blocks[i], bufsz, size);
+	return got;
 }
 
 /* Makes sure b has nr_bufs extra_data.  Will grow, but not shrink, an existing
@@ -139,11 +310,9 @@ static struct extra_bdata *next_unused_slot(struct block *b)
 	return ebd;
 }
 
-/* Append an extra data buffer @base with offset @off of length @len to block
- * @b.  Reuse an unused extra data slot if there's any.
- * Return 0 on success or -1 on error. */
-int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
-                       uint32_t len, int mem_flags)
+static struct extra_bdata *__block_append_extra(struct block *b,
+                                                uintptr_t base, uint32_t off,
+                                                uint32_t len, int mem_flags)
 {
 	unsigned int nr_bufs = b->nr_extra_bufs + 1;
 	struct extra_bdata *ebd;
@@ -151,27 +320,73 @@ int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
 	ebd = next_unused_slot(b);
 	if (!ebd) {
 		if (block_add_extd(b, nr_bufs, mem_flags) != 0)
-			return -1;
+			return NULL;
 		ebd = next_unused_slot(b);
 		assert(ebd);
 	}
 	ebd->base = base;
 	ebd->off = off;
 	ebd->len = len;
+	ebd->page = NULL;
 	b->extra_len += ebd->len;
+	return ebd;
+}
+
+/* Append an extra data buffer @base with offset @off of length @len to block
+ * @b.  Reuse an unused extra data slot if there's any.
+ * Return 0 on success or -1 on error. */
+int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
+                       uint32_t len, int mem_flags)
+{
+	return __block_append_extra(b, base, off, len, mem_flags) ? 0 : -1;
+}
+
+/* Append @len bytes of @page, starting at @off, to block @b, without copying.
+ * The block takes the caller's page ref, even on failure.
+ * Return 0 on success or -1 on error. */
+int block_append_page(struct block *b, struct page *page, uint32_t off,
+                      uint32_t len, int mem_flags)
+{
+	struct extra_bdata *ebd;
+
+	ebd = __block_append_extra(b, (uintptr_t)page2kva(page), off, len,
+	                           mem_flags);
+	if (!ebd) {
+		page_decref(page);
+		return -1;
+	}
+	ebd->page = page;
 	return 0;
 }
 
+/* Get another ref on ebd's buffer, for a second ebd that points into it. */
+void block_extra_incref(struct extra_bdata *ebd)
+{
+	if (ebd->page)
+		page_incref(ebd->page);
+	else
+		kmalloc_incref((void*)ebd->base);
+}
+
+/* Drop ebd's ref on its buffer and clear it out. */
+void block_extra_release(struct extra_bdata *ebd)
+{
+	if (ebd->page)
+		page_decref(ebd->page);
+	else if (ebd->base)
+		kfree((void*)ebd->base);
+	ebd->base = ebd->off = ebd->len = 0;
+	ebd->page = NULL;
+}
+
 void free_block_extra(struct block *b)
 {
 	struct extra_bdata *ebd;
 
-	/* assuming our release method is kfree, which will change when we support
-	 * user buffers */
 	for (int i = 0; i < b->nr_extra_bufs; i++) {
 		ebd = &b->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			block_extra_release(ebd);
 	}
 	b->extra_len = 0;
 	b->nr_extra_bufs = 0;
@@ -197,6 +412,8 @@ size_t freeb(struct block *b)
 		b->free(b);
 		return ret;
 	}
+	if (bpool_put(b))
+		return ret;
 	/* poison the block in case someone is still holding onto it */
 	b->next = dead;
 	b->rp = dead;
@@ -256,7 +473,7 @@ void checkb(struct block *b, char *msg)
 			panic("checkb %s: ebd %d has no base, but has off %d and len %d",
 			      msg, i, ebd->off, ebd->len);
 		if (ebd->base) {
-			if (!kmalloc_refcnt((void*)ebd->base))
+			if (!ebd->page && !kmalloc_refcnt((void*)ebd->base))
 				panic("checkb %s: buf %d, base %p has no refcnt!\n", msg, i,
 				      ebd->base);
 			extra_len += ebd->len;
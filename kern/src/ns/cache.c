@@ -26,41 +26,393 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE. */
 
+/* Client-side cache for 9P mounts made with MCACHE (mount -C).
+ *
+ * Each file we've seen gets an mcache, keyed by the chan's dev, which is unique
+ * per attach, and its qid.path.  The data lives in page-map pages, which the
+ * page reclaimer can take back like any other page cache.  A page only holds
+ * bytes that are contiguous from its start; pg_private says how many.  Reads
+ * stop at the first gap and go to the server for the rest.
+ *
+ * The data is good for one qid.vers.  copen() checks the version the server
+ * gave us at open time, and a stat with a newer version drops the data too.
+ * Our own writes go through to the server and into the cache, and bump the
+ * version the way the server will, like Plan 9's cache did.  If the server
+ * doesn't count versions that way, the next open just misses.
+ *
+ * Stat results are cached for CACHE_STAT_LEASE_USEC, since other clients can
+ * change attributes without changing the version. */
+
 #include <vfs.h>
-#include <kfs.h>
-#include <slab.h>
 #include <kmalloc.h>
 #include <kref.h>
+#include <pagemap.h>
+#include <page_alloc.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
 #include <error.h>
-#include <cpio.h>
 #include <pmap.h>
-#include <smp.h>
-#include <ip.h>
+#include <time.h>
+#include <ns.h>
+
+#define NCACHE_HASH				64
+#define NCACHE					512		/* most files we track */
+#define CACHE_STAT_LEASE_USEC	1000000
+#define CACHE_EVICT_BATCH		32		/* files per cevict() */
+
+/* Offset of qid.vers in a stat buffer: size[2] type[2] dev[4] qid.type[1] */
+#define STAT_QID_VERS			(BIT16SZ + BIT16SZ + BIT32SZ + BIT8SZ)
+
+struct mcache {
+	struct kref					kref;
+	struct mcache				*hash_next;
+	TAILQ_ENTRY(mcache)			lru_link;
+	uint32_t					dev;
+	uint64_t					path;
+	/* These are protected by cache_lock */
+	uint32_t					vers;		/* of the data and the stat */
+	unsigned long				nr_idx;		/* bound on pm's indexes */
+	uint8_t						*stat;		/* last stat reply, or 0 */
+	int							nstat;
+	uint64_t					stat_expire;	/* tsc */
+	struct page_map				pm;
+};
+TAILQ_HEAD(mcache_tailq, mcache);
+
+static spinlock_t cache_lock = SPINLOCK_INITIALIZER;
+static struct mcache *cache_hash[NCACHE_HASH];
+static struct mcache_tailq cache_lru = TAILQ_HEAD_INITIALIZER(cache_lru);
+static unsigned int nr_mcache;
+
+/* The server has the data; pages only go in the PM once we have something to
+ * put in them, and start out with no valid bytes. */
+static int cache_readpage(struct page_map *pm, struct page *page)
+{
+	page->pg_private = 0;
+	atomic_or(&page->pg_flags, PG_UPTODATE);
+	return 0;
+}
+
+static int cache_writepage(struct page_map *pm, struct page *page)
+{
+	panic("9P cache pages are never dirty");
+}
+
+static struct page_map_operations cache_pm_op = {
+	.readpage = cache_readpage,
+	.writepage = cache_writepage,
+};
+
+static void mcache_release(struct kref *kref)
+{
+	struct mcache *mc = container_of(kref, struct mcache, kref);
+
+	/* No one else has a ref, so nothing can hold a page */
+	if (mc->nr_idx)
+		pm_remove_contig(&mc->pm, 0, mc->nr_idx);
+	assert(!mc->pm.pm_num_pages);
+	kfree(mc->stat);
+	kfree(mc);
+}
+
+static struct mcache **__mcache_bucket(uint32_t dev, uint64_t path)
+{
+	return &cache_hash[(path ^ dev) % NCACHE_HASH];
+}
+
+/* Takes mc out of the table.  Hold cache_lock.  The caller drops the table's
+ * ref, outside the lock. */
+static void __mcache_unhash(struct mcache *mc)
+{
+	struct mcache **pp = __mcache_bucket(mc->dev, mc->path);
+
+	for (; *pp; pp = &(*pp)->hash_next) {
+		if (*pp == mc) {
+			*pp = mc->hash_next;
+			break;
+		}
+	}
+	TAILQ_REMOVE(&cache_lru, mc, lru_link);
+	nr_mcache--;
+}
+
+/* Hold cache_lock.  Returns a ref, and counts as a use. */
+static struct mcache *__mcache_lookup(uint32_t dev, uint64_t path)
+{
+	struct mcache *mc;
+
+	for (mc = *__mcache_bucket(dev, path); mc; mc = mc->hash_next) {
+		if ((mc->dev == dev) && (mc->path == path)) {
+			TAILQ_REMOVE(&cache_lru, mc, lru_link);
+			TAILQ_INSERT_HEAD(&cache_lru, mc, lru_link);
+			kref_get(&mc->kref, 1);
+			return mc;
+		}
+	}
+	return 0;
+}
+
+static struct mcache *mcache_lookup(struct chan *c)
+{
+	struct mcache *mc;
+
+	spin_lock(&cache_lock);
+	mc = __mcache_lookup(c->dev, c->qid.path);
+	spin_unlock(&cache_lock);
+	return mc;
+}
+
+/* Like mcache_lookup(), but only returns an mcache whose data is for vers. */
+static struct mcache *mcache_lookup_vers(struct chan *c, uint32_t vers)
+{
+	struct mcache *mc = mcache_lookup(c);
+
+	if (mc && (ACCESS_ONCE(mc->vers) != vers)) {
+		kref_put(&mc->kref);
+		return 0;
+	}
+	return mc;
+}
+
+/* Returns a ref on c's mcache for vers, replacing any that has some other
+ * version.  The old one goes away once its users are done with it. */
+static struct mcache *mcache_get(struct chan *c, uint32_t vers)
+{
+	struct mcache *mc, *new, *old = 0, *victim = 0;
+
+	mc = mcache_lookup_vers(c, vers);
+	if (mc)
+		return mc;
+	new = kzmalloc(sizeof(struct mcache), MEM_WAIT);
+	kref_init(&new->kref, mcache_release, 1);
+	new->dev = c->dev;
+	new->path = c->qid.path;
+	new->vers = vers;
+	pm_init(&new->pm, &cache_pm_op, new);
+	spin_lock(&cache_lock);
+	mc = __mcache_lookup(c->dev, c->qid.path);
+	if (mc && (mc->vers == vers)) {
+		spin_unlock(&cache_lock);
+		kref_put(&new->kref);
+		return mc;
+	}
+	if (mc) {
+		__mcache_unhash(mc);
+		old = mc;
+	} else if (nr_mcache >= NCACHE) {
+		victim = TAILQ_LAST(&cache_lru, mcache_tailq);
+		__mcache_unhash(victim);
+	}
+	new->hash_next = *__mcache_bucket(new->dev, new->path);
+	*__mcache_bucket(new->dev, new->path) = new;
+	TAILQ_INSERT_HEAD(&cache_lru, new, lru_link);
+	nr_mcache++;
+	kref_get(&new->kref, 1);	/* the table keeps the first ref */
+	spin_unlock(&cache_lock);
+	if (old) {
+		kref_put(&old->kref);	/* our lookup */
+		kref_put(&old->kref);	/* the table's */
+	}
+	if (victim)
+		kref_put(&victim->kref);
+	return new;
+}
+
+/* Copies buf, which the server says is the file at off, into mc's pages.  Only
+ * extends pages whose valid bytes reach off; anything past a gap is dropped. */
+static void mcache_fill(struct mcache *mc, uint8_t *buf, int n, int64_t off)
+{
+	struct page *page;
+	unsigned long idx;
+	uintptr_t pgoff, valid, amt;
+	int ret;
+
+	while (n > 0) {
+		idx = off >> PGSHIFT;
+		pgoff = PGOFF(off);
+		amt = MIN(n, PGSIZE - pgoff);
+		/* Only a write to the start of a page can make a new one */
+		if (pgoff)
+			ret = pm_load_page_nowait(&mc->pm, idx, &page);
+		else
+			ret = pm_load_page(&mc->pm, idx, &page);
+		if (ret)
+			break;
+		lock_page(page);
+		valid = (uintptr_t)page->pg_private;
+		if (pgoff <= valid) {
+			memcpy(page2kva(page) + pgoff, buf, amt);
+			page->pg_private = (void*)MAX(valid, pgoff + amt);
+		}
+		unlock_page(page);
+		pm_put_page(page);
+		spin_lock(&cache_lock);
+		mc->nr_idx = MAX(mc->nr_idx, idx + 1);
+		spin_unlock(&cache_lock);
+		buf += amt;
+		off += amt;
+		n -= amt;
+	}
+}
 
-/*
- * no cache in hosted mode
- */
 void cinit(void)
 {
 }
 
+/* c was just opened, so its qid has the server's current version. */
 void copen(struct chan *c)
 {
-	c->flag &= ~CCACHE;
+	if (c->qid.type & QTDIR) {
+		c->flag &= ~CCACHE;
+		return;
+	}
+	kref_put(&mcache_get(c, c->qid.vers)->kref);
 }
 
-int cread(struct chan *c, uint8_t * b, int n, int64_t off)
+/* Returns how much of [off, off + n) we had, starting at off. */
+int cread(struct chan *c, uint8_t *buf, int n, int64_t off)
 {
-	return 0;
+	struct mcache *mc = mcache_lookup_vers(c, c->qid.vers);
+	struct page *page;
+	uintptr_t pgoff, valid, amt;
+	int total = 0;
+
+	if (!mc)
+		return 0;
+	while (n > 0) {
+		pgoff = PGOFF(off);
+		if (pm_load_page_nowait(&mc->pm, off >> PGSHIFT, &page))
+			break;
+		lock_page(page);
+		valid = (uintptr_t)page->pg_private;
+		amt = pgoff < valid ? MIN(n, valid - pgoff) : 0;
+		memcpy(buf, page2kva(page) + pgoff, amt);
+		unlock_page(page);
+		pm_put_page(page);
+		total += amt;
+		buf += amt;
+		off += amt;
+		n -= amt;
+		if (PGOFF(off) || !amt)
+			break;
+	}
+	kref_put(&mc->kref);
+	return total;
+}
+
+/* buf came from the server for c at off. */
+void cupdate(struct chan *c, uint8_t *buf, int n, int64_t off)
+{
+	struct mcache *mc = mcache_lookup_vers(c, c->qid.vers);
+
+	if (!mc)
+		return;
+	mcache_fill(mc, buf, n, off);
+	kref_put(&mc->kref);
 }
 
-void cwrite(struct chan *c, uint8_t * buf, int n, int64_t off)
+/* c's write of buf at off went through to the server. */
+void cwrite(struct chan *c, uint8_t *buf, int n, int64_t off)
 {
+	struct mcache *mc = mcache_lookup_vers(c, c->qid.vers);
+	uint8_t *stat = 0;
+
+	if (!mc)
+		return;
+	mcache_fill(mc, buf, n, off);
+	spin_lock(&cache_lock);
+	if (mc->vers == c->qid.vers) {
+		mc->vers++;
+		c->qid.vers++;
+	}
+	/* the length and times changed */
+	stat = mc->stat;
+	mc->stat = 0;
+	spin_unlock(&cache_lock);
+	kfree(stat);
+	kref_put(&mc->kref);
 }
 
-void cupdate(struct chan *c, uint8_t * buf, int n, int64_t off)
+/* Copies out c's stat, if we have one that fits in n and is still good.
+ * Returns its length, or 0. */
+int cstat(struct chan *c, uint8_t *dp, int n)
 {
+	struct mcache *mc = mcache_lookup(c);
+	int ret = 0;
+
+	if (!mc)
+		return 0;
+	spin_lock(&cache_lock);
+	if (mc->stat && (mc->nstat <= n) && (read_tsc() < mc->stat_expire)) {
+		memcpy(dp, mc->stat, mc->nstat);
+		ret = mc->nstat;
+	}
+	spin_unlock(&cache_lock);
+	kref_put(&mc->kref);
+	return ret;
+}
+
+/* dp is the server's stat for c.  A new version means our data is stale. */
+void cstatupdate(struct chan *c, uint8_t *dp, int n)
+{
+	struct mcache *mc;
+	uint8_t *stat, *old;
+
+	if ((c->qid.type & QTDIR) || (n < STATFIXLEN))
+		return;
+	mc = mcache_get(c, GBIT32(dp + STAT_QID_VERS));
+	stat = kmalloc(n, MEM_WAIT);
+	memcpy(stat, dp, n);
+	spin_lock(&cache_lock);
+	old = mc->stat;
+	mc->stat = stat;
+	mc->nstat = n;
+	mc->stat_expire = read_tsc() + usec2tsc(CACHE_STAT_LEASE_USEC);
+	spin_unlock(&cache_lock);
+	kfree(old);
+	kref_put(&mc->kref);
+}
+
+/* c's attributes changed, so its stat is no good. */
+void cstatinval(struct chan *c)
+{
+	struct mcache *mc = mcache_lookup(c);
+	uint8_t *stat;
+
+	if (!mc)
+		return;
+	spin_lock(&cache_lock);
+	stat = mc->stat;
+	mc->stat = 0;
+	spin_unlock(&cache_lock);
+	kfree(stat);
+	kref_put(&mc->kref);
+}
+
+/* Called by the page reclaimer.  Evicts up to nr_wanted clean, cold pages from
+ * the least recently used files that have any.  Returns the number evicted. */
+unsigned long cevict(unsigned long nr_wanted)
+{
+	struct mcache *batch[CACHE_EVICT_BATCH];
+	struct mcache *mc;
+	unsigned long nr_evicted = 0;
+	int nr = 0;
+
+	spin_lock(&cache_lock);
+	TAILQ_FOREACH_REVERSE(mc, &cache_lru, mcache_tailq, lru_link) {
+		if (nr == CACHE_EVICT_BATCH)
+			break;
+		if (!mc->pm.pm_num_pages)
+			continue;
+		kref_get(&mc->kref, 1);
+		batch[nr++] = mc;
+	}
+	spin_unlock(&cache_lock);
+	for (int i = 0; i < nr; i++) {
+		if (nr_evicted < nr_wanted)
+			nr_evicted += pm_shrink(&batch[i]->pm, nr_wanted - nr_evicted);
+		kref_put(&batch[i]->kref);
+	}
+	return nr_evicted;
 }
@@ -370,11 +370,17 @@ int eqchantdqid(struct chan *a, int type, int dev, struct qid qid, int pathonly)
 	return 1;
 }
 
+static void __mh_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct mhead, rcu));
+}
+
+/* findmount() may still be looking at mh in the hash chain */
 static void mh_release(struct kref *kref)
 {
 	struct mhead *mh = container_of(kref, struct mhead, ref);
 	mh->mount = (struct mount *)0xCafeBeef;
-	kfree(mh);
+	call_rcu(&mh->rcu, __mh_free_rcu);
 }
 
 struct mhead *newmhead(struct chan *from)
@@ -454,7 +460,7 @@ int cmount(struct chan *new, struct chan *old, int flag, char *spec)
 		 *  head and add to the hash table.
 		 */
 		m = newmhead(old);
-		*l = m;
+		rcu_assign_pointer(*l, m);
 
 		/*
 		 *  if this is a union mount, add the old
@@ -503,6 +509,9 @@ int cmount(struct chan *new, struct chan *old, int flag, char *spec)
 		f->next = m->mount;
 		m->mount = nm;
 	}
+	/* new walks wait on m->lock, but older ones could have seen the old table,
+	 * so their cached walks are no good */
+	atomic_inc(&pg->mntgen);
 
 	wunlock(&m->lock);
 	poperror();
@@ -548,6 +557,7 @@ void cunmount(struct chan *mnt, struct chan *mounted)
 		wunlock(&pg->ns);
 		mountfree(m->mount);
 		m->mount = NULL;
+		atomic_inc(&pg->mntgen);
 		cclose(m->from);
 		wunlock(&m->lock);
 		putmhead(m);
@@ -562,6 +572,7 @@ void cunmount(struct chan *mnt, struct chan *mounted)
 			*p = f->next;
 			f->next = 0;
 			mountfree(f);
+			atomic_inc(&pg->mntgen);
 			if (m->mount == NULL) {
 				*l = m->hash;
 				cclose(m->from);
@@ -603,36 +614,52 @@ findmount(struct chan **cp,
 {
 	struct pgrp *pg;
 	struct mhead *m;
-
+	struct chan *from;
+
+	/* Every walk ends up here, so we don't take pg->ns.  We look through the
+	 * hash chain under RCU, and pin the mhead that matches.  m->from can be
+	 * closed under us, but chans are never freed, so comparing against it is
+	 * safe; we check again with m locked.  An mhead with no mounts is on its
+	 * way out of the chain, or on its way in, with cmount() about to fill it
+	 * in, so we look again. */
 	pg = current->pgrp;
-	rlock(&pg->ns);
-	for (m = MOUNTH(pg, qid); m; m = m->hash) {
-		rlock(&m->lock);
-		if (m->from == NULL) {
+retry:
+	rcu_read_lock();
+	for (m = rcu_dereference(MOUNTH(pg, qid)); m;
+	     m = rcu_dereference(m->hash)) {
+		from = ACCESS_ONCE(m->from);
+		if (from == NULL) {
 			printd("m %p m->from 0\n", m);
-			runlock(&m->lock);
 			continue;
 		}
-		if (eqchantdqid(m->from, type, dev, qid, 1)) {
-			runlock(&pg->ns);
-			if (mp != NULL) {
-				kref_get(&m->ref, 1);
-				if (*mp != NULL)
-					putmhead(*mp);
-				*mp = m;
-			}
-			if (*cp != NULL)
-				cclose(*cp);
-			chan_incref(m->mount->to);
-			*cp = m->mount->to;
-			runlock(&m->lock);
-			return 1;
-		}
-		runlock(&m->lock);
+		if (!eqchantdqid(from, type, dev, qid, 1))
+			continue;
+		if (kref_get_not_zero(&m->ref, 1))
+			break;
 	}
+	rcu_read_unlock();
+	if (m == NULL)
+		return 0;
 
-	runlock(&pg->ns);
-	return 0;
+	rlock(&m->lock);
+	if (m->mount == NULL || !eqchantdqid(m->from, type, dev, qid, 1)) {
+		runlock(&m->lock);
+		putmhead(m);
+		goto retry;
+	}
+	if (mp != NULL) {
+		if (*mp != NULL)
+			putmhead(*mp);
+		*mp = m;
+	}
+	if (*cp != NULL)
+		cclose(*cp);
+	chan_incref(m->mount->to);
+	*cp = m->mount->to;
+	runlock(&m->lock);
+	if (mp == NULL)
+		putmhead(m);
+	return 1;
 }
 
 int domount(struct chan **cp, struct mhead **mp)
@@ -688,7 +715,8 @@ struct chan *undomount(struct chan *c, struct cname *name)
  * Either walks all the way or not at all.  No partial results in *cp.
  * *nerror is the number of names to display in an error message.
  */
-int walk(struct chan **cp, char **names, int nnames, bool can_mount, int *nerror)
+static int __walk(struct chan **cp, char **names, int nnames, bool can_mount,
+                  int *nerror)
 {
 	int dev, dotdot, i, n, nhave, ntry, type;
 	struct chan *c, *nc, *lastmountpoint = NULL;
@@ -847,6 +875,46 @@ int walk(struct chan **cp, char **names, int nnames, bool can_mount, int *nerror
 	return 0;
 }
 
+/*
+ * Like __walk(), but the directory above the last name comes from the pgrp's
+ * walk cache when it can.  On a miss, we walk to that directory and cache it,
+ * then walk the last name from there.
+ */
+int walk(struct chan **cp, char **names, int nnames, bool can_mount, int *nerror)
+{
+	struct chan *dir, *mountpoint;
+	uint64_t gen;
+
+	if (nnames < 2)
+		return __walk(cp, names, nnames, can_mount, nerror);
+	dir = walkcache_lookup(*cp, names, nnames - 1, can_mount);
+	if (!dir) {
+		gen = walkcache_gen();
+		dir = *cp;
+		chan_incref(dir);
+		if (__walk(&dir, names, nnames - 1, can_mount, nerror) < 0) {
+			cclose(dir);
+			return -1;
+		}
+		walkcache_insert(*cp, names, nnames - 1, can_mount, dir, gen);
+	}
+	mountpoint = dir->mountpoint;
+	if (__walk(&dir, names + nnames - 1, 1, can_mount, nerror) < 0) {
+		cclose(dir);
+		if (nerror)
+			*nerror += nnames - 1;
+		return -1;
+	}
+	/* the last name might not have crossed a mount, but the others did */
+	if (!dir->mountpoint)
+		dir->mountpoint = mountpoint;
+	cclose(*cp);
+	*cp = dir;
+	if (nerror)
+		*nerror = 0;
+	return 0;
+}
+
 /*
  * c is a mounted non-creatable directory.  find a creatable one.
  */
@@ -1132,8 +1200,6 @@ Open:
 						c->umh = m;
 					else
 						putmhead(m);
-					if (omode == O_EXEC)
-						c->flag &= ~CCACHE;
 					/* here is where convert omode/vfs flags to c->flags.
 					 * careful, O_CLOEXEC and O_REMCLO are in there.  might need
 					 * to change that. */
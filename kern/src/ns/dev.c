@@ -444,7 +444,7 @@ devcreate(struct chan *c, char *unused_char_p_t, int unused_int, uint32_t u)
 	error(EPERM, ERROR_FIXME);
 }
 
-struct block *devbread(struct chan *c, long n, uint32_t offset)
+struct block *devbread(struct chan *c, long n, int64_t offset)
 {
 	ERRSTACK(1);
 	struct block *bp;
@@ -461,7 +461,7 @@ struct block *devbread(struct chan *c, long n, uint32_t offset)
 	return bp;
 }
 
-long devbwrite(struct chan *c, struct block *bp, uint32_t offset)
+long devbwrite(struct chan *c, struct block *bp, int64_t offset)
 {
 	ERRSTACK(1);
 	long n;
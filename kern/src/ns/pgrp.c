@@ -65,6 +65,8 @@ void closepgrp(struct pgrp *p)
 		}
 	}
 	wunlock(&p->ns);
+	rwdestroy(&p->ns);
+	walkcache_free(p);
 	cclose(p->dot);
 	cclose(p->slash);
 	kfree(p);
@@ -85,8 +87,10 @@ struct pgrp *newpgrp(void)
 	p->pgrpid = NEXT_ID(pgrpid);
 	p->progmode = 0644;
 	qlock_init(&p->debug);
-	rwinit(&p->ns);
+	/* Walking through ".." out of a mount rlocks the namespace */
+	brinit(&p->ns);
 	qlock_init(&p->nsh);
+	spinlock_init(&p->wc_lock);
 	return p;
 }
 
@@ -39,6 +39,8 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <mm.h>
+#include <umem.h>
 
 #define PANIC_EXTRA(b)							\
 {									\
@@ -63,6 +65,20 @@ static int debugging;
 
 /*
  *  IO queues
+ *
+ *  Qspsc queues are for one producer and one consumer, like a driver or
+ *  protocol feeding a reader.  Writes put blocks on a ring without the lock,
+ *  and reads of whole blocks take them off without it, so the two sides don't
+ *  fight over the lock.  The producers must be serialized by the caller.
+ *  Consumers take blocks off the ring with a CAS, so anyone can qflush or
+ *  qclose, but a second concurrent reader could see blocks out of order.
+ *
+ *  The order of the data is bfirst, then the ring, then the overflow list.
+ *  Only consumers add to bfirst, under the lock: anything that needs the lock
+ *  first moves the ring and overflow onto bfirst.  The producer uses the
+ *  overflow list, under the lock, when the ring is full, and keeps using it
+ *  until a consumer empties it.  len and dlen cover all three, and in Qspsc
+ *  queues they are only changed atomically.
  */
 
 struct queue {
@@ -87,6 +103,14 @@ struct queue {
 	qio_wake_cb_t wake_cb;		/* callbacks for qio wakeups */
 	void *wake_data;
 
+	/* Qspsc */
+	struct block **ring;
+	unsigned int ring_mask;
+	unsigned int ring_prod;		/* only the producer writes */
+	unsigned int ring_cons;		/* consumers CAS this */
+	struct block *ofirst;		/* overflow, newer than the ring */
+	struct block *olast;
+
 	char err[ERRMAX];
 };
 
@@ -98,6 +122,7 @@ enum {
 	QIO_JUST_ONE_BLOCK = (1 << 3),	/* when qbreading, just get one block */
 	QIO_NON_BLOCK = (1 << 4),		/* throw EAGAIN instead of blocking */
 	QIO_DONT_KICK = (1 << 5),		/* don't kick when waking */
+	QSPSC_RING_SZ = 1024,			/* blocks, power of two */
 };
 
 unsigned int qiomaxatomic = Maxatomic;
@@ -115,6 +140,93 @@ static void qwake_cb(struct queue *q, int filter)
 		q->wake_cb(q, q->wake_data, filter);
 }
 
+/* Helper: adjusts q's len and dlen, returning the old len.  Qspsc producers
+ * don't hold the lock. */
+static int qadd_len(struct queue *q, int len, int dlen)
+{
+	int old_len;
+
+	if (q->state & Qspsc) {
+		__sync_fetch_and_add(&q->dlen, dlen);
+		return __sync_fetch_and_add(&q->len, len);
+	}
+	old_len = q->len;
+	q->len += len;
+	q->dlen += dlen;
+	return old_len;
+}
+
+static bool qempty(struct queue *q)
+{
+	return !q->bfirst && !ACCESS_ONCE(q->ofirst) &&
+	       (ACCESS_ONCE(q->ring_cons) == ACCESS_ONCE(q->ring_prod));
+}
+
+/* Producer: puts each of the nr blocks of b in its own ring slot, if they all
+ * fit and nothing is waiting on the overflow list. */
+static bool spsc_put(struct queue *q, struct block *b, unsigned int nr)
+{
+	unsigned int prod = q->ring_prod;
+	struct block *next;
+
+	if (ACCESS_ONCE(q->ofirst) ||
+	    (prod - ACCESS_ONCE(q->ring_cons) + nr > q->ring_mask + 1))
+		return FALSE;
+	for (; b; b = next) {
+		next = b->next;
+		b->next = NULL;
+		q->ring[prod++ & q->ring_mask] = b;
+	}
+	wmb();	/* the slots must be visible before the producer index */
+	ACCESS_ONCE(q->ring_prod) = prod;
+	return TRUE;
+}
+
+/* Consumer: takes the oldest block off the ring, if there is one and it has no
+ * more than max bytes. */
+static struct block *spsc_get(struct queue *q, size_t max)
+{
+	unsigned int cons;
+	struct block *b;
+
+	do {
+		cons = ACCESS_ONCE(q->ring_cons);
+		if (cons == ACCESS_ONCE(q->ring_prod))
+			return NULL;
+		rmb();	/* read the slot after the producer index */
+		b = ACCESS_ONCE(q->ring[cons & q->ring_mask]);
+		/* if another consumer beat us to b, we'll fail the CAS */
+		if (BLEN(b) > max)
+			return NULL;
+	} while (!__sync_bool_compare_and_swap(&q->ring_cons, cons, cons + 1));
+	return b;
+}
+
+/* Moves the ring and then the overflow list onto bfirst.  Hold the lock. */
+static void qspsc_drain(struct queue *q)
+{
+	struct block *b;
+
+	if (!(q->state & Qspsc))
+		return;
+	while ((b = spsc_get(q, SIZE_MAX))) {
+		if (q->bfirst)
+			q->blast->next = b;
+		else
+			q->bfirst = b;
+		q->blast = b;
+	}
+	/* the producer won't touch the ring while there's overflow */
+	if (q->ofirst) {
+		if (q->bfirst)
+			q->blast->next = q->ofirst;
+		else
+			q->bfirst = q->ofirst;
+		q->blast = q->olast;
+		q->ofirst = q->olast = NULL;
+	}
+}
+
 void ixsummary(void)
 {
 	debugging ^= 1;
@@ -244,24 +356,28 @@ struct block *concatblock(struct block *bp)
  * body.  It does not point to the contents of the original, it is a copy
  * (unlike qclone).  Since we're copying, we might as well put the memory into
  * one contiguous chunk. */
-struct block *copyblock(struct block *bp, int mem_flags)
+/* Copies the first len bytes of bp, or all of it if it's shorter. */
+struct block *copyblock_n(struct block *bp, size_t len, int mem_flags)
 {
 	struct block *newb;
 	struct extra_bdata *ebd;
 	size_t amt;
 
 	QDEBUG checkb(bp, "copyblock 0");
-	newb = block_alloc(BLEN(bp), mem_flags);
+	len = MIN(len, BLEN(bp));
+	newb = block_alloc(len, mem_flags);
 	if (!newb)
 		return 0;
-	amt = copy_to_block_body(newb, bp->rp, BHLEN(bp));
-	assert(amt == BHLEN(bp));
-	for (int i = 0; i < bp->nr_extra_bufs; i++) {
+	amt = copy_to_block_body(newb, bp->rp, MIN(BHLEN(bp), len));
+	len -= amt;
+	for (int i = 0; (i < bp->nr_extra_bufs) && len; i++) {
 		ebd = &bp->extra_data[i];
 		if (!ebd->base || !ebd->len)
 			continue;
-		amt = copy_to_block_body(newb, (void*)ebd->base + ebd->off, ebd->len);
-		assert(amt == ebd->len);
+		amt = copy_to_block_body(newb, (void*)ebd->base + ebd->off,
+		                         MIN(ebd->len, len));
+		assert(amt == MIN(ebd->len, len));
+		len -= amt;
 	}
 	/* TODO: any other flags that need copied over? */
 	if (bp->flag & BCKSUM_FLAGS) {
@@ -275,6 +391,11 @@ struct block *copyblock(struct block *bp, int mem_flags)
 	return newb;
 }
 
+struct block *copyblock(struct block *bp, int mem_flags)
+{
+	return copyblock_n(bp, BLEN(bp), mem_flags);
+}
+
 /* Returns a block with the remaining contents of b all in the main body of the
  * returned block.  Replace old references to b with the returned value (which
  * may still be 'b', if no change was needed. */
@@ -334,11 +455,8 @@ struct block *pullupblock(struct block *bp, int n)
 			ebd->len -= seglen;
 			ebd->off += seglen;
 			bp->extra_len -= seglen;
-			if (ebd->len == 0) {
-				kfree((void *)ebd->base);
-				ebd->off = 0;
-				ebd->base = 0;
-			}
+			if (ebd->len == 0)
+				block_extra_release(ebd);
 		}
 		/* maybe just call pullupblock recursively here */
 		if (len)
@@ -422,11 +540,8 @@ static int pullext(struct block *bp, int count)
 		bytes += rem;
 		ed->off += rem;
 		ed->len -= rem;
-		if (ed->len == 0) {
-			kfree((void *)ed->base);
-			ed->base = 0;
-			ed->off = 0;
-		}
+		if (ed->len == 0)
+			block_extra_release(ed);
 	}
 	return bytes;
 }
@@ -448,11 +563,8 @@ static int dropext(struct block *bp, int count)
 		count -= rem;
 		bytes += rem;
 		ed->len -= rem;
-		if (ed->len == 0) {
-			kfree((void *)ed->base);
-			ed->base = 0;
-			ed->off = 0;
-		}
+		if (ed->len == 0)
+			block_extra_release(ed);
 	}
 	return bytes;
 }
@@ -597,9 +709,7 @@ struct block *adjustblock(struct block *bp, int len)
 	}
 	for (; i < bp->nr_extra_bufs; i++) {
 		ebd = &bp->extra_data[i];
-		if (ebd->base)
-			kfree((void*)ebd->base);
-		ebd->base = ebd->off = ebd->len = 0;
+		block_extra_release(ebd);
 	}
 	QDEBUG checkb(bp, "adjustblock 4");
 	return bp;
@@ -610,8 +720,8 @@ static struct block *pop_first_block(struct queue *q)
 {
 	struct block *b = q->bfirst;
 
-	q->len -= BALLOC(b);  // XXX all usages of q->len with extra_data are fucked
-	q->dlen -= BLEN(b);
+	// XXX all usages of q->len with extra_data are fucked
+	qadd_len(q, -BALLOC(b), -BLEN(b));
 	q->bfirst = b->next;
 	b->next = 0;
 	return b;
@@ -630,8 +740,7 @@ static size_t copy_to_block_body(struct block *to, void *from, size_t copy_amt)
 static void block_and_q_lost_extra(struct block *b, struct queue *q, size_t amt)
 {
 	b->extra_len -= amt;
-	q->len -= amt;
-	q->dlen -= amt;
+	qadd_len(q, -amt, -amt);
 }
 
 /* Helper: moves ebd from a block (in from_q) to another block.  The *ebd is
@@ -643,10 +752,19 @@ static size_t move_ebd(struct extra_bdata *ebd, struct block *to,
 {
 	size_t ret = ebd->len;
 
-	if (block_append_extra(to, ebd->base, ebd->off, ebd->len, MEM_ATOMIC))
+	if (ebd->page) {
+		/* the new ebd takes our page ref, even on failure */
+		page_incref(ebd->page);
+		if (block_append_page(to, ebd->page, ebd->off, ebd->len, MEM_ATOMIC))
+			return 0;
+		page_decref(ebd->page);
+	} else if (block_append_extra(to, ebd->base, ebd->off, ebd->len,
+	                              MEM_ATOMIC)) {
 		return 0;
+	}
 	block_and_q_lost_extra(from, from_q, ebd->len);
 	ebd->base = ebd->len = ebd->off = 0;
+	ebd->page = NULL;
 	return ret;
 }
 
@@ -673,7 +791,7 @@ static size_t copy_from_first_block(struct queue *q, struct block *to,
 		from->rp += copy_amt;
 		/* We only change dlen, (data len), not q->len, since the q still has
 		 * the same block memory allocation (no kfrees happened) */
-		q->dlen -= copy_amt;
+		qadd_len(q, 0, -copy_amt);
 	}
 	/* Try to extract the remainder from the extra data */
 	len -= copy_amt;
@@ -721,8 +839,70 @@ enum {
 	QBR_FAIL,
 	QBR_SPARE,	/* we need a spare block */
 	QBR_AGAIN,	/* do it again, we are coalescing blocks */
+	QBR_LOCKED,	/* for the spsc read: take the lock and do it the usual way */
 };
 
+/* Helper for consumers that didn't hold the lock: they took blocks out of q,
+ * which had old_len before. */
+static void qspsc_taken(struct queue *q, int old_len, int qio_flags)
+{
+	bool dowakeup = FALSE;
+
+	/* writers set Qflow before sleeping, and the atomic sub was a barrier */
+	if (ACCESS_ONCE(q->state) & Qflow) {
+		spin_lock_irqsave(&q->lock);
+		if ((q->state & Qflow) && q->len < q->limit) {
+			q->state &= ~Qflow;
+			dowakeup = TRUE;
+		}
+		spin_unlock_irqsave(&q->lock);
+	}
+	if (dowakeup) {
+		if (q->kick && !(qio_flags & QIO_DONT_KICK))
+			q->kick(q->arg);
+		rendez_wakeup(&q->wr);
+	}
+	if (old_len >= q->limit)
+		qwake_cb(q, FDTAP_FILT_WRITABLE);
+}
+
+/* Qspsc reads without the lock: whole blocks off the ring, as long as nothing
+ * older is on bfirst.  Anything else, including sleeping, needs the lock. */
+static int __try_qbread_spsc(struct queue *q, size_t len, int qio_flags,
+                             struct block **real_ret)
+{
+	struct block *ret = NULL, *last = NULL, *b;
+	size_t max = q->state & Qmsg ? SIZE_MAX : len;
+	int alloc = 0, dlen = 0, old_len;
+
+	if (ACCESS_ONCE(q->bfirst))
+		return QBR_LOCKED;
+	while ((b = spsc_get(q, max))) {
+		alloc += BALLOC(b);
+		dlen += BLEN(b);
+		if ((q->state & Qcoalesce) && !BLEN(b)) {
+			freeb(b);
+			continue;
+		}
+		if (ret)
+			last->next = b;
+		else
+			ret = b;
+		last = b;
+		max -= BLEN(b);
+		if ((q->state & Qmsg) || (qio_flags & QIO_JUST_ONE_BLOCK) || !max)
+			break;
+	}
+	if (!alloc)
+		return QBR_LOCKED;
+	old_len = qadd_len(q, -alloc, -dlen);
+	qspsc_taken(q, old_len, qio_flags);
+	if (!ret)
+		return QBR_AGAIN;
+	*real_ret = ret;
+	return QBR_OK;
+}
+
 /* Helper and back-end for __qbread: extracts and returns a list of blocks
  * containing up to len bytes.  It may contain less than len even if q has more
  * data.
@@ -735,7 +915,13 @@ static int __try_qbread(struct queue *q, size_t len, int qio_flags,
 	size_t blen;
 	bool was_unwritable = FALSE;
 	int dowakeup = 0;
+	int fast_ret;
 
+	if (q->state & Qspsc) {
+		fast_ret = __try_qbread_spsc(q, len, qio_flags, real_ret);
+		if (fast_ret != QBR_LOCKED)
+			return fast_ret;
+	}
 	if (qio_flags & QIO_CAN_ERR_SLEEP) {
 		if (!qwait_and_ilock(q, qio_flags)) {
 			spin_unlock_irqsave(&q->lock);
@@ -745,6 +931,7 @@ static int __try_qbread(struct queue *q, size_t len, int qio_flags,
 		first = q->bfirst;
 	} else {
 		spin_lock_irqsave(&q->lock);
+		qspsc_drain(q);
 		first = q->bfirst;
 		if (!first) {
 			spin_unlock_irqsave(&q->lock);
@@ -947,8 +1134,7 @@ struct block *packblock(struct block *bp)
 /* Add an extra_data entry to newb at newb_idx pointing to b's body, starting at
  * body_rp, for up to len.  Returns the len consumed.
  *
- * The base is 'b', so that we can kfree it later.  This currently ties us to
- * using kfree for the release method for all extra_data.
+ * The base is 'b', so that we can kfree it later.
  *
  * It is possible to have a body size that is 0, if there is no offset, and
  * b->wp == b->rp.  This will have an extra data entry of 0 length. */
@@ -984,8 +1170,9 @@ static size_t point_to_buf(struct block *b, unsigned int b_idx, uint32_t b_off,
 	assert(b_idx < b->nr_extra_bufs);
 	assert(newb_idx < newb->nr_extra_bufs);
 
-	kmalloc_incref((void*)b_ebd->base);
+	block_extra_incref(b_ebd);
 	n_ebd->base = b_ebd->base;
+	n_ebd->page = b_ebd->page;
 	n_ebd->off = b_ebd->off + b_off;
 	n_ebd->len = MIN(b_ebd->len - b_off, len);
 	newb->extra_len += n_ebd->len;
@@ -1093,6 +1280,7 @@ struct block *qclone(struct queue *q, int header_len, int len, uint32_t offset)
 	do {
 		/* TODO: RCU: protecting the q list (b->next) (need read lock) */
 		spin_lock_irqsave(&q->lock);
+		qspsc_drain(q);
 		ret = __blist_clone_to(q->bfirst, newb, len, offset);
 		spin_unlock_irqsave(&q->lock);
 		if (ret)
@@ -1114,6 +1302,7 @@ struct block *qcopy_old(struct queue *q, int len, uint32_t offset)
 	nb = block_alloc(len, MEM_WAIT);
 
 	spin_lock_irqsave(&q->lock);
+	qspsc_drain(q);
 
 	/* go to offset */
 	b = q->bfirst;
@@ -1179,6 +1368,14 @@ struct queue *qopen(int limit, int msg, void (*kick) (void *), void *arg)
 	if (q == 0)
 		return 0;
 	qinit_common(q);
+	if (msg & Qspsc) {
+		q->ring = kzmalloc(QSPSC_RING_SZ * sizeof(struct block *), 0);
+		if (!q->ring) {
+			kfree(q);
+			return 0;
+		}
+		q->ring_mask = QSPSC_RING_SZ - 1;
+	}
 
 	q->limit = q->inilim = limit;
 	q->kick = kick;
@@ -1212,7 +1409,7 @@ static int notempty(void *a)
 {
 	struct queue *q = a;
 
-	return (q->state & Qclosed) || q->bfirst != 0;
+	return (q->state & Qclosed) || !qempty(q);
 }
 
 /* Block, waiting for the queue to be non-empty or closed.  Returns with
@@ -1222,6 +1419,7 @@ static bool qwait_and_ilock(struct queue *q, int qio_flags)
 {
 	while (1) {
 		spin_lock_irqsave(&q->lock);
+		qspsc_drain(q);
 		if (q->bfirst != NULL)
 			return TRUE;
 		if (q->state & Qclosed) {
@@ -1260,14 +1458,33 @@ void qaddlist(struct queue *q, struct block *b)
 		q->blast->next = b;
 	else
 		q->bfirst = b;
-	q->len += blockalloclen(b);
-	q->dlen += blocklen(b);
+	qadd_len(q, blockalloclen(b), blocklen(b));
 	while (b->next)
 		b = b->next;
 	q->blast = b;
 }
 
-static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
+/* Gives the user ebd's page at to instead of copying into it, if ebd is a whole
+ * page and to is the start of a page the user can give up.  Returns TRUE if it
+ * did. */
+static bool read_page_swap(struct page_swap *ps, struct block *b,
+                           struct extra_bdata *ebd, uint8_t *to)
+{
+	if (!ps || PGOFF(to) || !ebd->page || (ebd->len != PGSIZE) ||
+	    (ebd->base + ebd->off != (uintptr_t)page2kva(ebd->page)))
+		return FALSE;
+	if (page_swap_add(ps, (uintptr_t)to, ebd->page))
+		return FALSE;
+	/* The user has our page ref now */
+	ebd->page = NULL;
+	ebd->base = ebd->off = ebd->len = 0;
+	b->extra_len -= PGSIZE;
+	return TRUE;
+}
+
+/* ps is for zero-copy reads into user memory, and can be 0. */
+static size_t read_from_block(struct block *b, uint8_t *to, size_t amt,
+                              struct page_swap *ps)
 {
 	size_t copy_amt, retval = 0;
 	struct extra_bdata *ebd;
@@ -1286,6 +1503,12 @@ static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
 		 * just start the for loop early */
 		if (!ebd->base || !ebd->len)
 			continue;
+		if ((amt >= PGSIZE) && read_page_swap(ps, b, ebd, to)) {
+			to += PGSIZE;
+			amt -= PGSIZE;
+			retval += PGSIZE;
+			continue;
+		}
 		copy_amt = MIN(ebd->len, amt);
 		memcpy(to, (void*)(ebd->base + ebd->off), copy_amt);
 		/* we're actually consuming the entries, just like how we advance rp up
@@ -1296,8 +1519,7 @@ static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
 		if (!ebd->len) {
 			/* we don't actually have to decref here.  it's also done in
 			 * freeb().  this is the earliest we can free. */
-			kfree((void*)ebd->base);
-			ebd->base = ebd->off = 0;
+			block_extra_release(ebd);
 		}
 		to += copy_amt;
 		amt -= copy_amt;
@@ -1321,11 +1543,11 @@ struct block *bl2mem(uint8_t * p, struct block *b, int n)
 		i = BLEN(b);
 		if (i > n) {
 			/* partial block, consume some */
-			read_from_block(b, p, n);
+			read_from_block(b, p, n, NULL);
 			return b;
 		}
 		/* full block, consume all and move on */
-		i = read_from_block(b, p, i);
+		i = read_from_block(b, p, i, NULL);
 		n -= i;
 		p += i;
 		next = b->next;
@@ -1336,7 +1558,8 @@ struct block *bl2mem(uint8_t * p, struct block *b, int n)
 
 /* Extract the contents of all blocks and copy to va, up to len.  Returns the
  * actual amount copied. */
-static size_t read_all_blocks(struct block *b, void *va, size_t len)
+static size_t read_all_blocks(struct block *b, void *va, size_t len,
+                              struct page_swap *ps)
 {
 	size_t sofar = 0;
 	struct block *next;
@@ -1347,7 +1570,7 @@ static size_t read_all_blocks(struct block *b, void *va, size_t len)
 		assert(va);
 		assert(va + sofar);
 		assert(b->rp);
-		sofar += read_from_block(b, va + sofar, len - sofar);
+		sofar += read_from_block(b, va + sofar, len - sofar, ps);
 		next = b->next;
 		freeb(b);
 		b = next;
@@ -1355,6 +1578,28 @@ static size_t read_all_blocks(struct block *b, void *va, size_t len)
 	return sofar;
 }
 
+/* read_all_blocks() into user memory, swapping whole pages of the blocks (like
+ * the payloads from header-split NICs) into page-aligned buffers instead of
+ * copying. */
+static size_t read_all_blocks_user(struct block *b, void *va, size_t len)
+{
+	ERRSTACK(1);
+	struct page_swap ps;
+	size_t ret;
+
+	if ((len < PGSIZE) || !current || !is_user_rwaddr(va, len))
+		return read_all_blocks(b, va, len, NULL);
+	page_swap_init(&ps, current);
+	if (waserror()) {
+		page_swap_finish(&ps);
+		nexterror();
+	}
+	ret = read_all_blocks(b, va, len, &ps);
+	poperror();
+	page_swap_finish(&ps);
+	return ret;
+}
+
 /*
  *  copy the contents of memory into a string of blocks.
  *  return NULL on error.
@@ -1399,8 +1644,7 @@ void qputback(struct queue *q, struct block *b)
 	if (q->bfirst == NULL)
 		q->blast = b;
 	q->bfirst = b;
-	q->len += BALLOC(b);
-	q->dlen += BLEN(b);
+	qadd_len(q, BALLOC(b), BLEN(b));
 }
 
 /*
@@ -1425,7 +1669,7 @@ size_t qread(struct queue *q, void *va, size_t len)
 
 	if (!blist)
 		return 0;
-	return read_all_blocks(blist, va, len);
+	return read_all_blocks_user(blist, va, len);
 }
 
 size_t qread_nonblock(struct queue *q, void *va, size_t len)
@@ -1435,7 +1679,7 @@ size_t qread_nonblock(struct queue *q, void *va, size_t len)
 
 	if (!blist)
 		return 0;
-	return read_all_blocks(blist, va, len);
+	return read_all_blocks_user(blist, va, len);
 }
 
 static int qnotfull(void *a)
@@ -1445,28 +1689,59 @@ static int qnotfull(void *a)
 	return q->len < q->limit || (q->state & Qclosed);
 }
 
-/* Helper: enqueues a list of blocks to a queue.  Returns the total length. */
-static size_t enqueue_blist(struct queue *q, struct block *b)
+/* Helper: enqueues a list of blocks to a queue.  Returns the total length,
+ * and whether q was empty.
+ *
+ * For Qspsc, this is the producer, and it only needs the lock for the overflow
+ * list.  If it doesn't hold the lock and the blocks don't fit in the ring, it
+ * returns -1, and you'll need to try again with the lock. */
+static ssize_t enqueue_blist(struct queue *q, struct block *b, bool locked,
+                             bool *was_empty)
 {
+	struct block *first = b;
 	size_t len, dlen;
+	unsigned int nr = 1;
 
-	if (q->bfirst)
-		q->blast->next = b;
-	else
-		q->bfirst = b;
 	len = BALLOC(b);
 	dlen = BLEN(b);
 	while (b->next) {
 		b = b->next;
 		len += BALLOC(b);
 		dlen += BLEN(b);
+		nr++;
 	}
-	q->blast = b;
-	q->len += len;
-	q->dlen += dlen;
+	if (q->state & Qspsc) {
+		if (!spsc_put(q, first, nr)) {
+			if (!locked)
+				return -1;
+			if (q->ofirst)
+				q->olast->next = first;
+			else
+				q->ofirst = first;
+			q->olast = b;
+		}
+	} else {
+		if (q->bfirst)
+			q->blast->next = first;
+		else
+			q->bfirst = first;
+		q->blast = b;
+	}
+	/* a lockless reader can take blocks before we count them */
+	*was_empty = qadd_len(q, len, dlen) <= 0;
 	return dlen;
 }
 
+/* Qspsc producers can skip the lock if the q is open and has room. */
+static bool qspsc_can_write(struct queue *q, int qio_flags)
+{
+	int state = ACCESS_ONCE(q->state);
+
+	if (!(state & Qspsc) || (state & Qclosed))
+		return FALSE;
+	return !(qio_flags & QIO_LIMIT) || (q->len < q->limit);
+}
+
 /* Adds block (which can be a list of blocks) to the queue, subject to
  * qio_flags.  Returns the length written on success or -1 on non-throwable
  * error.  Adjust qio_flags to control the value-added features!. */
@@ -1481,8 +1756,23 @@ static ssize_t __qbwrite(struct queue *q, struct block *b, int qio_flags)
 		(*q->bypass) (q->arg, b);
 		return ret;
 	}
+	if (qspsc_can_write(q, qio_flags)) {
+		ret = enqueue_blist(q, b, FALSE, &was_empty);
+		if (ret >= 0) {
+			/* readers set Qstarve before sleeping, and the atomic add was a
+			 * barrier, so only a reader of an empty q can be waiting */
+			if (ACCESS_ONCE(q->state) & Qstarve) {
+				spin_lock_irqsave(&q->lock);
+				if (q->state & Qstarve) {
+					q->state &= ~Qstarve;
+					dowakeup = TRUE;
+				}
+				spin_unlock_irqsave(&q->lock);
+			}
+			goto out_wake;
+		}
+	}
 	spin_lock_irqsave(&q->lock);
-	was_empty = q->len == 0;
 	if (q->state & Qclosed) {
 		spin_unlock_irqsave(&q->lock);
 		freeblist(b);
@@ -1508,7 +1798,7 @@ static ssize_t __qbwrite(struct queue *q, struct block *b, int qio_flags)
 			error(EAGAIN, "queue full");
 		}
 	}
-	ret = enqueue_blist(q, b);
+	ret = enqueue_blist(q, b, TRUE, &was_empty);
 	QDEBUG checkb(b, "__qbwrite");
 	/* make sure other end gets awakened */
 	if (q->state & Qstarve) {
@@ -1516,6 +1806,7 @@ static ssize_t __qbwrite(struct queue *q, struct block *b, int qio_flags)
 		dowakeup = TRUE;
 	}
 	spin_unlock_irqsave(&q->lock);
+out_wake:
 	/* TODO: not sure if the usage of a kick is mutually exclusive with a
 	 * wakeup, meaning that actual users either want a kick or have qreaders. */
 	if (q->kick && (dowakeup || (q->state & Qkick)))
@@ -1660,9 +1951,25 @@ ssize_t qiwrite(struct queue *q, void *vp, int len)
 void qfree(struct queue *q)
 {
 	qclose(q);
+	kfree(q->ring);
 	kfree(q);
 }
 
+/* Helper: empties q, returning the blocks in *bfirst.  Hold the lock.  A Qspsc
+ * producer could be adding more as we go, so we only take out what we took. */
+static void __qflush(struct queue *q, struct block **bfirst)
+{
+	qspsc_drain(q);
+	*bfirst = q->bfirst;
+	q->bfirst = 0;
+	if (q->state & Qspsc) {
+		qadd_len(q, -blockalloclen(*bfirst), -blocklen(*bfirst));
+	} else {
+		q->len = 0;
+		q->dlen = 0;
+	}
+}
+
 /*
  *  Mark a queue as closed.  No further IO is permitted.
  *  All blocks are released.
@@ -1679,10 +1986,7 @@ void qclose(struct queue *q)
 	q->state |= Qclosed;
 	q->state &= ~(Qflow | Qstarve | Qdropoverflow);
 	q->err[0] = 0;
-	bfirst = q->bfirst;
-	q->bfirst = 0;
-	q->len = 0;
-	q->dlen = 0;
+	__qflush(q, &bfirst);
 	spin_unlock_irqsave(&q->lock);
 
 	/* free queued blocks */
@@ -1766,7 +2070,7 @@ int qwindow(struct queue *q)
  */
 int qcanread(struct queue *q)
 {
-	return q->bfirst != 0;
+	return !qempty(q);
 }
 
 /*
@@ -1823,10 +2127,7 @@ void qflush(struct queue *q)
 
 	/* mark it */
 	spin_lock_irqsave(&q->lock);
-	bfirst = q->bfirst;
-	q->bfirst = 0;
-	q->len = 0;
-	q->dlen = 0;
+	__qflush(q, &bfirst);
 	spin_unlock_irqsave(&q->lock);
 
 	/* free queued blocks */
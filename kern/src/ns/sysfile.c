@@ -37,6 +37,7 @@
 #include <error.h>
 #include <cpio.h>
 #include <pmap.h>
+#include <umem.h>
 #include <smp.h>
 #include <ip.h>
 
@@ -372,6 +373,8 @@ int sysfwstat(int fd, uint8_t * buf, int n)
 	n = devtab[c->type].wstat(c, buf, n);
 	poperror();
 	cclose(c);
+	/* might have been a rename */
+	walkcache_fs_changed();
 
 	poperror();
 	return n;
@@ -689,9 +692,12 @@ static long rread(int fd, void *va, long n, int64_t * offp)
 		} else {
 			n = 0;
 		}
-		spin_lock(&c->lock);
-		c->offset += n;
-		spin_unlock(&c->lock);
+		/* pread()s leave the chan's offset alone, like preadv() */
+		if (offp == NULL) {
+			spin_lock(&c->lock);
+			c->offset += n;
+			spin_unlock(&c->lock);
+		}
 	}
 
 	/* dirty kdirent hack */
@@ -749,6 +755,114 @@ long syspread(int fd, void *va, long n, int64_t off)
 	return rread(fd, va, n, &off);
 }
 
+/* Vectored I/O gathers small iovecs into (or scatters them from) a bounce
+ * buffer, so a device sees one big call instead of many little ones.  Streams
+ * that take blocks get blocks of up to this much instead. */
+#define IOV_BOUNCE_SZ			(64 * 1024)
+
+static long iov_total(const struct iovec *iov, int iovcnt)
+{
+	long total = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	return total;
+}
+
+/* Reads into the iovecs from c at off, with one call into the device, since a
+ * second call to a stream could block even though we have data.  A device with
+ * its own bread gets asked for everything at once, and we scatter its blocks.
+ * Otherwise we read into a bounce buffer; readv() may return short, so we
+ * don't ask for more than we're willing to allocate. */
+static long chan_readv(struct chan *c, const struct iovec *iov, int iovcnt,
+                       int64_t off)
+{
+	ERRSTACK(1);
+	struct dev *dev = &devtab[c->type];
+	long total = iov_total(iov, iovcnt);
+	struct block *b;
+	uint8_t *bounce;
+	long n, amt, sofar;
+
+	if (iovcnt == 1)
+		return dev->read(c, iov[0].iov_base, iov[0].iov_len, off);
+	if (dev->bread != devbread) {
+		b = dev->bread(c, total, off);
+		n = b ? blocklen(b) : 0;
+		for (int i = 0; b && (i < iovcnt); i++)
+			b = bl2mem(iov[i].iov_base, b, iov[i].iov_len);
+		freeblist(b);
+		return n;
+	}
+	total = MIN(total, 16 * IOV_BOUNCE_SZ);
+	bounce = kmalloc(total, MEM_WAIT);
+	if (waserror()) {
+		kfree(bounce);
+		nexterror();
+	}
+	n = dev->read(c, bounce, total, off);
+	sofar = 0;
+	for (int i = 0; sofar < n; i++) {
+		amt = MIN(iov[i].iov_len, n - sofar);
+		if (memcpy_to_user(current, iov[i].iov_base, bounce + sofar, amt))
+			error(EFAULT, "bad readv buffer %p", iov[i].iov_base);
+		sofar += amt;
+	}
+	poperror();
+	kfree(bounce);
+	return n;
+}
+
+static long rreadv(int fd, const struct iovec *iov, int iovcnt, int64_t *offp)
+{
+	ERRSTACK(2);
+	struct chan *c;
+	int64_t off;
+	long n;
+
+	if (waserror()) {
+		poperror();
+		return -1;
+	}
+	c = fdtochan(&current->open_files, fd, O_READ, 1, 1);
+	if (waserror()) {
+		cclose(c);
+		nexterror();
+	}
+	/* directory reads go through the kdirent hack, one at a time */
+	if (c->qid.type & QTDIR)
+		error(EISDIR, "can't readv a directory");
+	if (offp == NULL) {
+		spin_lock(&c->lock);	/* lock for int64_t assignment */
+		off = c->offset;
+		spin_unlock(&c->lock);
+	} else
+		off = *offp;
+	if (off < 0)
+		error(EINVAL, ERROR_FIXME);
+	n = c->ateof ? 0 : chan_readv(c, iov, iovcnt, off);
+	if (offp == NULL) {
+		spin_lock(&c->lock);
+		c->offset += n;
+		spin_unlock(&c->lock);
+	}
+	poperror();
+	cclose(c);
+
+	poperror();
+	return n;
+}
+
+long sysreadv(int fd, const struct iovec *iov, int iovcnt)
+{
+	return rreadv(fd, iov, iovcnt, NULL);
+}
+
+long syspreadv(int fd, const struct iovec *iov, int iovcnt, int64_t off)
+{
+	return rreadv(fd, iov, iovcnt, &off);
+}
+
 int sysremove(char *path)
 {
 	ERRSTACK(2);
@@ -773,6 +887,7 @@ int sysremove(char *path)
 	c->type = -1;
 	poperror();
 	cclose(c);
+	walkcache_fs_changed();
 
 	poperror();
 	return 0;
@@ -952,13 +1067,86 @@ int sysstatakaros(char *path, struct kstat *ks)
 	return n;
 }
 
-static long rwrite(int fd, void *va, long n, int64_t * offp)
+/* Gathers the iovecs into blocks for a device with its own bwrite, like a
+ * stream, or into a bounce buffer for everyone else.  An iovec that would fill
+ * the buffer by itself goes straight to the device.  Stops at a short write. */
+static long chan_writev(struct chan *c, const struct iovec *iov, int iovcnt,
+                        int64_t off)
+{
+	ERRSTACK(1);
+	struct dev *dev = &devtab[c->type];
+	bool blocks = dev->bwrite != devbwrite;
+	struct block *b = NULL, *bp;
+	uint8_t *bounce = NULL, *dst;
+	long sofar = 0, amt, n;
+	int i = 0, j;
+
+	if (waserror()) {
+		freeb(b);
+		kfree(bounce);
+		nexterror();
+	}
+	if (!blocks)
+		bounce = kmalloc(IOV_BOUNCE_SZ, MEM_WAIT);
+	while (i < iovcnt) {
+		if (!blocks && (iov[i].iov_len >= IOV_BOUNCE_SZ)) {
+			n = dev->write(c, iov[i].iov_base, iov[i].iov_len, off + sofar);
+			sofar += n;
+			if (n < iov[i].iov_len)
+				break;
+			i++;
+			continue;
+		}
+		for (j = i, amt = 0; j < iovcnt; j++) {
+			if (amt + iov[j].iov_len > IOV_BOUNCE_SZ)
+				break;
+			amt += iov[j].iov_len;
+		}
+		/* a big iovec in a stream gets a block of its own */
+		if (j == i)
+			amt = iov[j++].iov_len;
+		if (!amt) {
+			i = j;
+			continue;
+		}
+		if (blocks) {
+			b = block_alloc(amt, MEM_WAIT);
+			dst = b->wp;
+		} else {
+			dst = bounce;
+		}
+		for (; i < j; i++) {
+			if (memcpy_from_user(current, dst, iov[i].iov_base,
+			                     iov[i].iov_len))
+				error(EFAULT, "bad writev buffer %p", iov[i].iov_base);
+			dst += iov[i].iov_len;
+		}
+		if (blocks) {
+			b->wp += amt;
+			/* bwrite eats the block, even if it throws */
+			bp = b;
+			b = NULL;
+			n = dev->bwrite(c, bp, off + sofar);
+		} else {
+			n = dev->write(c, bounce, amt, off + sofar);
+		}
+		sofar += n;
+		if (n < amt)
+			break;
+	}
+	poperror();
+	kfree(bounce);
+	return sofar;
+}
+
+static long rwritev(int fd, const struct iovec *iov, int iovcnt,
+                    int64_t *offp)
 {
 	ERRSTACK(3);
 	struct chan *c;
 	struct dir *dir;
 	int64_t off;
-	long m;
+	long m, n;
 
 	if (waserror()) {
 		poperror();
@@ -972,6 +1160,7 @@ static long rwrite(int fd, void *va, long n, int64_t * offp)
 	if (c->qid.type & QTDIR)
 		error(EISDIR, ERROR_FIXME);
 
+	n = iov_total(iov, iovcnt);
 	if (n < 0)
 		error(EINVAL, ERROR_FIXME);
 
@@ -1004,7 +1193,10 @@ static long rwrite(int fd, void *va, long n, int64_t * offp)
 	}
 	if (off < 0)
 		error(EINVAL, ERROR_FIXME);
-	m = devtab[c->type].write(c, va, n, off);
+	if (iovcnt == 1)
+		m = devtab[c->type].write(c, iov[0].iov_base, n, off);
+	else
+		m = chan_writev(c, iov, iovcnt, off);
 	poperror();
 
 	if (offp == NULL && m < n) {
@@ -1020,6 +1212,17 @@ static long rwrite(int fd, void *va, long n, int64_t * offp)
 	return n;
 }
 
+static long rwrite(int fd, void *va, long n, int64_t *offp)
+{
+	struct iovec iov = {va, n};
+
+	if (n < 0) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	return rwritev(fd, &iov, 1, offp);
+}
+
 long syswrite(int fd, void *va, long n)
 {
 	return rwrite(fd, va, n, NULL);
@@ -1030,6 +1233,143 @@ long syspwrite(int fd, void *va, long n, int64_t off)
 	return rwrite(fd, va, n, &off);
 }
 
+long syswritev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return rwritev(fd, iov, iovcnt, NULL);
+}
+
+long syspwritev(int fd, const struct iovec *iov, int iovcnt, int64_t off)
+{
+	return rwritev(fd, iov, iovcnt, &off);
+}
+
+/* Each block we send covers at most this much of the file. */
+#define SENDFILE_BLOCK_SZ		(64 * 1024)
+
+/* Writes up to n bytes of the VFS file, from *offp, to fd, and advances *offp
+ * by the amount sent.  The blocks point at the file's page cache pages, so a
+ * chan with its own bwrite, like a TCP conversation, queues them without a
+ * copy; the pages stay referenced until the blocks are freed (for TCP, when the
+ * data is ACKed).  Returns the amount sent, or -1 if we didn't send any. */
+long syssendfile(int fd, struct file *file, int64_t *offp, long n)
+{
+	ERRSTACK(2);
+	struct chan *c;
+	struct block *b;
+	int64_t start = *offp;
+	off64_t pos;
+	ssize_t amt;
+	int64_t off;
+
+	if (waserror()) {
+		poperror();
+		return *offp != start ? *offp - start : -1;
+	}
+	c = fdtochan(&current->open_files, fd, O_WRITE, 1, 1);
+	if (waserror()) {
+		cclose(c);
+		nexterror();
+	}
+	if (c->qid.type & QTDIR)
+		error(EISDIR, ERROR_FIXME);
+	if (n < 0)
+		error(EINVAL, ERROR_FIXME);
+	while (*offp - start < n) {
+		pos = *offp;
+		amt = generic_file_block(file, MIN(n - (*offp - start),
+		                                   SENDFILE_BLOCK_SZ), &pos, &b);
+		if (amt < 0)
+			error(get_errno(), "sendfile: can't read the file");
+		if (!amt)
+			break;
+		spin_lock(&c->lock);	/* legacy lock for int64 assignment */
+		off = c->offset;
+		c->offset += amt;
+		spin_unlock(&c->lock);
+		/* the chan owns the block now, even if it throws */
+		devtab[c->type].bwrite(c, b, off);
+		*offp = pos;
+	}
+	poperror();
+	cclose(c);
+
+	poperror();
+	return *offp - start;
+}
+
+/* Moves up to n bytes from fd_in to fd_out without copying them through
+ * userspace.  Chans with their own bread and bwrite, like pipes and #ip
+ * conversations, just pass the blocks along; a proxy can go from a TCP conv
+ * through a pipe to another conv without a copy.  Other chans get copied into
+ * or out of a block.  Like a read, this blocks until there is some data, then
+ * moves what one bread gave us, which may be less than n.  Both chans' offsets
+ * advance.  Returns the amount moved, 0 at EOF, or -1.  If the write fails,
+ * what we read is gone. */
+long syssplice(int fd_in, int fd_out, long n)
+{
+	ERRSTACK(4);
+	struct chan *in, *out;
+	struct block *b, *next;
+	int64_t off;
+	long amt;
+
+	if (waserror()) {
+		poperror();
+		return -1;
+	}
+	in = fdtochan(&current->open_files, fd_in, O_READ, 1, 1);
+	if (waserror()) {
+		cclose(in);
+		nexterror();
+	}
+	out = fdtochan(&current->open_files, fd_out, O_WRITE, 1, 1);
+	if (waserror()) {
+		cclose(out);
+		nexterror();
+	}
+	if ((in->qid.type | out->qid.type) & QTDIR)
+		error(EISDIR, ERROR_FIXME);
+	if (n < 0)
+		error(EINVAL, ERROR_FIXME);
+	/* devbread() allocates all of n up front */
+	if (devtab[in->type].bread == devbread)
+		n = MIN(n, IOV_BOUNCE_SZ);
+	spin_lock(&in->lock);	/* legacy lock for int64 assignment */
+	off = in->offset;
+	spin_unlock(&in->lock);
+	b = n ? devtab[in->type].bread(in, n, off) : NULL;
+	amt = b ? blocklen(b) : 0;
+	spin_lock(&in->lock);
+	in->offset += amt;
+	spin_unlock(&in->lock);
+	spin_lock(&out->lock);
+	off = out->offset;
+	out->offset += amt;
+	spin_unlock(&out->lock);
+	for (; b; b = next) {
+		next = b->next;
+		b->next = NULL;
+		if (!BLEN(b)) {
+			freeb(b);
+			continue;
+		}
+		if (waserror()) {
+			freeblist(next);
+			nexterror();
+		}
+		/* the chan owns the block now, even if it throws */
+		off += devtab[out->type].bwrite(out, b, off);
+		poperror();
+	}
+	poperror();
+	cclose(out);
+	poperror();
+	cclose(in);
+
+	poperror();
+	return amt;
+}
+
 int syswstat(char *path, uint8_t * buf, int n)
 {
 	ERRSTACK(2);
@@ -1049,6 +1389,8 @@ int syswstat(char *path, uint8_t * buf, int n)
 	n = devtab[c->type].wstat(c, buf, n);
 	poperror();
 	cclose(c);
+	/* might have been a rename */
+	walkcache_fs_changed();
 
 	poperror();
 	return n;
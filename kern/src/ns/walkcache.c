@@ -0,0 +1,247 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Walk result cache.  Each pgrp remembers where recent walks ended up, keyed by
+ * the chan they started from and the names they walked.  walk() only caches the
+ * directory above the last name, so a hit skips the mount table and device
+ * walks for the prefix, but the last name still gets walked (and checked) for
+ * real.
+ *
+ * An entry is good for one generation of its pgrp's mount table, which
+ * cmount() and cunmount() bump, and one generation of removes and wstats
+ * anywhere, since those can take away or rename a cached directory.  Stale
+ * entries get dropped as we come across them.  Walks with a ".." aren't
+ * cached, since undomount() depends on the name we came in on. */
+
+#include <ns.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <atomic.h>
+#include <smp.h>
+#include <process.h>
+
+#define WALKCACHE_MAX			128		/* entries per pgrp */
+
+struct walkcache_entry {
+	struct walkcache_entry		*next;
+	uint32_t					hash;
+	uint64_t					gen;		/* walkcache_gen() */
+	/* the starting chan */
+	int							type;
+	uint32_t					dev;
+	struct qid					qid;
+	bool						can_mount;
+	/* where we ended up, with a ref */
+	struct chan					*c;
+	int							nnames;
+	size_t						names_len;
+	char						names[];	/* each with its \0 */
+};
+
+static atomic_t walkcache_fsgen;
+
+static uint32_t hash_walk(struct chan *from, char **names, int nnames)
+{
+	uint32_t hash = 2166136261U ^ from->type ^ from->dev ^ from->qid.path;
+
+	for (int i = 0; i < nnames; i++) {
+		for (char *s = names[i]; *s; s++)
+			hash = (hash ^ *s) * 16777619U;
+		hash = (hash ^ '/') * 16777619U;
+	}
+	return hash;
+}
+
+static bool wce_matches(struct walkcache_entry *wce, uint32_t hash,
+                        struct chan *from, char **names, int nnames,
+                        bool can_mount)
+{
+	char *p = wce->names;
+	size_t len;
+
+	if ((wce->hash != hash) || (wce->nnames != nnames) ||
+	    (wce->can_mount != can_mount) ||
+	    !eqchantdqid(from, wce->type, wce->dev, wce->qid, 1))
+		return FALSE;
+	for (int i = 0; i < nnames; i++) {
+		len = strlen(names[i]) + 1;
+		if (memcmp(p, names[i], len))
+			return FALSE;
+		p += len;
+	}
+	return TRUE;
+}
+
+/* Sample this before walking, and pass it to walkcache_insert(), so a change
+ * in the middle of the walk makes the entry stale. */
+uint64_t walkcache_gen(void)
+{
+	return ((uint64_t)atomic_read(&current->pgrp->mntgen) << 32) |
+	       (uint32_t)atomic_read(&walkcache_fsgen);
+}
+
+static bool wce_is_stale(struct walkcache_entry *wce)
+{
+	return wce->gen != walkcache_gen();
+}
+
+/* Moves *pp from its chain to the dead list.  Hold the lock. */
+static void __wce_unlink(struct pgrp *pg, struct walkcache_entry **pp,
+                         struct walkcache_entry **dead)
+{
+	struct walkcache_entry *wce = *pp;
+
+	*pp = wce->next;
+	wce->next = *dead;
+	*dead = wce;
+	pg->nr_walkcache--;
+}
+
+static bool walk_is_cacheable(char **names, int nnames)
+{
+	if (!nnames)
+		return FALSE;
+	for (int i = 0; i < nnames; i++) {
+		if (isdotdot(names[i]))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Takes every stale entry off the chains, returning them on a list.  Hold the
+ * lock. */
+static struct walkcache_entry *__walkcache_reap(struct pgrp *pg)
+{
+	struct walkcache_entry *wce, **pp, *dead = NULL;
+
+	for (int i = 0; i < WALKCACHE_HASH; i++) {
+		pp = &pg->walkcache[i];
+		while ((wce = *pp)) {
+			if (wce_is_stale(wce))
+				__wce_unlink(pg, pp, &dead);
+			else
+				pp = &wce->next;
+		}
+	}
+	return dead;
+}
+
+static void wce_free_list(struct walkcache_entry *wce)
+{
+	struct walkcache_entry *next;
+
+	for (; wce; wce = next) {
+		next = wce->next;
+		cclose(wce->c);
+		kfree(wce);
+	}
+}
+
+/* Returns a ref on where walking names from 'from' took us last time, or NULL
+ * if we don't know or the namespace has changed since. */
+struct chan *walkcache_lookup(struct chan *from, char **names, int nnames,
+                              bool can_mount)
+{
+	struct pgrp *pg = current->pgrp;
+	struct walkcache_entry *wce;
+	struct chan *c = NULL;
+	uint32_t hash;
+
+	if (!walk_is_cacheable(names, nnames))
+		return NULL;
+	hash = hash_walk(from, names, nnames);
+	spin_lock(&pg->wc_lock);
+	for (wce = pg->walkcache[hash % WALKCACHE_HASH]; wce; wce = wce->next) {
+		if (!wce_matches(wce, hash, from, names, nnames, can_mount))
+			continue;
+		if (!wce_is_stale(wce)) {
+			c = wce->c;
+			chan_incref(c);
+		}
+		break;
+	}
+	spin_unlock(&pg->wc_lock);
+	return c;
+}
+
+/* Remembers that walking names from 'from' got us to c, as of gen.  Takes its
+ * own ref on c. */
+void walkcache_insert(struct chan *from, char **names, int nnames,
+                      bool can_mount, struct chan *c, uint64_t gen)
+{
+	struct pgrp *pg = current->pgrp;
+	struct walkcache_entry *wce, **pp, **victim, *dead;
+	size_t names_len = 0, len;
+	char *p;
+
+	if (!walk_is_cacheable(names, nnames))
+		return;
+	for (int i = 0; i < nnames; i++)
+		names_len += strlen(names[i]) + 1;
+	wce = kmalloc(sizeof(struct walkcache_entry) + names_len, MEM_WAIT);
+	wce->hash = hash_walk(from, names, nnames);
+	wce->gen = gen;
+	wce->type = from->type;
+	wce->dev = from->dev;
+	wce->qid = from->qid;
+	wce->can_mount = can_mount;
+	wce->nnames = nnames;
+	wce->names_len = names_len;
+	p = wce->names;
+	for (int i = 0; i < nnames; i++) {
+		len = strlen(names[i]) + 1;
+		memcpy(p, names[i], len);
+		p += len;
+	}
+	chan_incref(c);
+	wce->c = c;
+
+	spin_lock(&pg->wc_lock);
+	dead = __walkcache_reap(pg);
+	pp = &pg->walkcache[wce->hash % WALKCACHE_HASH];
+	/* Replace any entry for the same walk.  If we're full, make room in our
+	 * own chain, or failing that, any other. */
+	for (victim = pp; *victim; victim = &(*victim)->next) {
+		if (wce_matches(*victim, wce->hash, from, names, nnames, can_mount)) {
+			__wce_unlink(pg, victim, &dead);
+			break;
+		}
+	}
+	if (pg->nr_walkcache >= WALKCACHE_MAX) {
+		victim = pp;
+		for (int i = 1; !*victim && i < WALKCACHE_HASH; i++)
+			victim = &pg->walkcache[(wce->hash + i) % WALKCACHE_HASH];
+		if (*victim)
+			__wce_unlink(pg, victim, &dead);
+	}
+	wce->next = *pp;
+	*pp = wce;
+	pg->nr_walkcache++;
+	spin_unlock(&pg->wc_lock);
+	wce_free_list(dead);
+}
+
+/* Something was removed or renamed, so no cached walk can be trusted. */
+void walkcache_fs_changed(void)
+{
+	atomic_inc(&walkcache_fsgen);
+}
+
+/* Called when the pgrp is going away. */
+void walkcache_free(struct pgrp *pg)
+{
+	struct walkcache_entry *dead = NULL, *wce, *next;
+
+	spin_lock(&pg->wc_lock);
+	for (int i = 0; i < WALKCACHE_HASH; i++) {
+		for (wce = pg->walkcache[i]; wce; wce = next) {
+			next = wce->next;
+			wce->next = dead;
+			dead = wce;
+		}
+		pg->walkcache[i] = NULL;
+	}
+	pg->nr_walkcache = 0;
+	spin_unlock(&pg->wc_lock);
+	wce_free_list(dead);
+}
@@ -14,13 +14,22 @@
 #include <string.h>
 #include <kmalloc.h>
 #include <blockdev.h>
+#include <slab.h>
+#include <rendez.h>
+#include <vfs.h>
+#include <ns.h>
+#include <percpu.h>
+#include <memprof.h>
 
 #define l1 (available_caches.l1)
 #define l2 (available_caches.l2)
 #define l3 (available_caches.l3)
 
-static void __page_decref(page_t *page);
 static error_t __page_alloc_specific(page_t **page, size_t ppn);
+static void check_free_page_watermark(void);
+static bool pcp_alloc(struct page **page);
+static error_t __kpage_alloc(page_t **page);
+static ssize_t __kpage_alloc_node(page_t **page, int node);
 
 #ifdef CONFIG_PAGE_COLORING
 #define NUM_KERNEL_COLORS 8
@@ -42,6 +51,113 @@ void colored_page_alloc_init()
 		cache_color_alloc(llc_cache, global_cache_colors_map);
 }
 
+/* NUMA memory nodes.  The arch code tells us, via arch_mem_node_init(), which
+ * node each core is on and which node each range of physical memory is on.
+ * Memory the arch doesn't tell us about is on node 0.  Each node gets its own
+ * set of colored free lists, and allocations prefer the local node of the
+ * calling core, falling back to the other nodes in order.
+ *
+ * Until page_numa_init() runs, or if the machine is flat, there is one node and
+ * none of the lookups touch the tables.  nr_mem_nodes changes under the free
+ * list lock, in the same critical section that installs the per-node lists. */
+struct mem_node_range {
+	physaddr_t					start;
+	physaddr_t					end;
+	int							node;
+};
+
+static struct mem_node_range mem_node_ranges[MAX_MEM_NODE_RANGES];
+static int nr_mem_node_ranges;
+static int core_mem_node[MAX_NUM_CORES];
+int nr_mem_nodes = 1;
+size_t nr_free_pages_node[MAX_MEM_NODES];
+
+void page_numa_add_range(physaddr_t start, physaddr_t end, int node)
+{
+	struct mem_node_range *r;
+
+	if (nr_mem_node_ranges == MAX_MEM_NODE_RANGES) {
+		warn("Out of NUMA memory ranges, [%p, %p) will be on node 0", start,
+		     end);
+		return;
+	}
+	r = &mem_node_ranges[nr_mem_node_ranges++];
+	r->start = start;
+	r->end = end;
+	r->node = MIN(node, MAX_MEM_NODES - 1);
+}
+
+void page_numa_set_core_node(int coreid, int node)
+{
+	core_mem_node[coreid] = MIN(node, MAX_MEM_NODES - 1);
+}
+
+int pa_to_mem_node(physaddr_t pa)
+{
+	if (nr_mem_nodes == 1)
+		return 0;
+	for (int i = 0; i < nr_mem_node_ranges; i++) {
+		if ((mem_node_ranges[i].start <= pa) && (pa < mem_node_ranges[i].end))
+			return mem_node_ranges[i].node;
+	}
+	return 0;
+}
+
+static int page_to_mem_node(struct page *page)
+{
+	return pa_to_mem_node(page2pa(page));
+}
+
+/* The node of the calling core, which is where we try to allocate from. */
+int local_mem_node(void)
+{
+	if (nr_mem_nodes == 1)
+		return 0;
+	return core_mem_node[core_id_early()];
+}
+
+/* Each node's free lists are num_colors long.  Hold the free list lock. */
+static page_list_t *node_free_lists(int node)
+{
+	return &colored_page_free_list[node * llc_cache->num_colors];
+}
+
+/* Splits the free pages into per-node lists.  Call after the ACPI tables and
+ * the topology are set up. */
+void page_numa_init(void)
+{
+	int nr_nodes = MIN(arch_mem_node_init(), MAX_MEM_NODES);
+	size_t nr_colors = llc_cache->num_colors;
+	page_list_t *lists;
+	struct page *page;
+	int node;
+
+	if (nr_nodes <= 1)
+		return;
+	lists = kmalloc(nr_nodes * nr_colors * sizeof(page_list_t), MEM_WAIT);
+	for (int i = 0; i < nr_nodes * nr_colors; i++)
+		BSD_LIST_INIT(&lists[i]);
+	page_pcp_drain_all();
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	/* pa_to_mem_node() needs to see the ranges, which means nr_mem_nodes > 1.
+	 * No one else can look until we unlock. */
+	nr_mem_nodes = nr_nodes;
+	nr_free_pages_node[0] = 0;
+	for (int i = 0; i < nr_colors; i++) {
+		while ((page = BSD_LIST_FIRST(&colored_page_free_list[i]))) {
+			BSD_LIST_REMOVE(page, pg_link);
+			node = page_to_mem_node(page);
+			BSD_LIST_INSERT_HEAD(&lists[node * nr_colors + i], page, pg_link);
+			nr_free_pages_node[node]++;
+		}
+	}
+	/* The old lists came from boot_alloc, so we can't free them. */
+	colored_page_free_list = lists;
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	for (int i = 0; i < nr_mem_nodes; i++)
+		printk("NUMA node %d: %lu free pages\n", i, nr_free_pages_node[i]);
+}
+
 /* Initializes a page.  We can optimize this a bit since 0 usually works to init
  * most structures, but we'll hold off on that til it is a problem. */
 static void __page_init(struct page *page)
@@ -51,9 +167,11 @@ static void __page_init(struct page *page)
 	sem_init(&page->pg_sem, 0);
 }
 
-#define __PAGE_ALLOC_FROM_RANGE_GENERIC(page, base_color, range, predicate) \
+#define __PAGE_ALLOC_FROM_RANGE_GENERIC(page, node, base_color, range,       \
+                                        predicate)                           \
 	/* Find first available color with pages available */                   \
     /* in the given range */                                                \
+	page_list_t *lists = node_free_lists(node);                             \
 	int i = base_color;                                                     \
 	for (i; i < (base_color+range); i++) {                                  \
 		if((predicate))                                                     \
@@ -61,42 +179,48 @@ static void __page_init(struct page *page)
 	}                                                                       \
 	/* Allocate a page from that color */                                   \
 	if(i < (base_color+range)) {                                            \
-		*page = BSD_LIST_FIRST(&colored_page_free_list[i]);                 \
+		*page = BSD_LIST_FIRST(&lists[i]);                                  \
 		BSD_LIST_REMOVE(*page, pg_link);                                    \
+		nr_free_pages--;                                                    \
+		nr_free_pages_node[node]--;                                         \
 		__page_init(*page);                                                 \
 		return i;                                                           \
 	}                                                                       \
 	return -ENOMEM;
 
-static ssize_t __page_alloc_from_color_range(page_t** page,
+static ssize_t __page_alloc_from_color_range(page_t** page, int node,
                                            uint16_t base_color,
                                            uint16_t range)
 {
-	__PAGE_ALLOC_FROM_RANGE_GENERIC(page, base_color, range,
-	                 !BSD_LIST_EMPTY(&colored_page_free_list[i]));
+	__PAGE_ALLOC_FROM_RANGE_GENERIC(page, node, base_color, range,
+	                 !BSD_LIST_EMPTY(&lists[i]));
 }
 
-static ssize_t __page_alloc_from_color_map_range(page_t** page, uint8_t* map,
+static ssize_t __page_alloc_from_color_map_range(page_t** page, int node,
+                                              uint8_t* map,
                                               size_t base_color, size_t range)
 {
-	__PAGE_ALLOC_FROM_RANGE_GENERIC(page, base_color, range,
+	__PAGE_ALLOC_FROM_RANGE_GENERIC(page, node, base_color, range,
 		    GET_BITMASK_BIT(map, i) &&
-			!BSD_LIST_EMPTY(&colored_page_free_list[i]))
+			!BSD_LIST_EMPTY(&lists[i]))
 }
 
 static ssize_t __colored_page_alloc(uint8_t* map, page_t** page,
-                                               size_t next_color)
+                                    size_t next_color, int node)
 {
 	ssize_t ret;
-	if((ret = __page_alloc_from_color_map_range(page, map,
+	if((ret = __page_alloc_from_color_map_range(page, node, map,
 	                           next_color, llc_cache->num_colors - next_color)) < 0)
-		ret = __page_alloc_from_color_map_range(page, map, 0, next_color);
+		ret = __page_alloc_from_color_map_range(page, node, map, 0,
+		                                        next_color);
 	return ret;
 }
 
 static void __real_page_alloc(struct page *page)
 {
 	BSD_LIST_REMOVE(page, pg_link);
+	nr_free_pages--;
+	nr_free_pages_node[page_to_mem_node(page)]--;
 	__page_init(page);
 }
 
@@ -111,6 +235,363 @@ static error_t __page_alloc_specific(page_t** page, size_t ppn)
 	return 0;
 }
 
+/* Gives a page back to its colored free list.  Hold the free list lock. */
+static void __page_free_to_list(struct page *page)
+{
+	int node = page_to_mem_node(page);
+
+	page_setref(page, 0);
+	BSD_LIST_INSERT_HEAD(
+	   &(node_free_lists(node)[get_page_color(page2ppn(page), llc_cache)]),
+	   page,
+	   pg_link
+	);
+	nr_free_pages++;
+	nr_free_pages_node[node]++;
+}
+
+/* Per-core page caches, in front of the colored free lists.  Frees go to the
+ * local core's cache, and kpage_alloc() (and upage_alloc(), if we aren't
+ * coloring) pull from it, so the common case doesn't touch the global free
+ * list lock.  The cache is a stack: the most recently freed pages are the
+ * hottest, so we alloc and free from the top and drain the coldest pages from
+ * the bottom.  An empty cache refills pcp_batch pages at once, and a cache at
+ * pcp_high drains pcp_batch pages at once.
+ *
+ * Pages in a pcp cache keep a refcnt of 1, so the rest of the allocator (e.g.
+ * get_cont_pages()) treats them as in use, and they aren't counted in
+ * nr_free_pages.  page_pcp_drain_all() gives them back.  The pcp lock is
+ * irqsave, since pages are freed from IRQ context, and before core_id() works
+ * everyone shares core 0's cache.  Lock ordering is pcp -> free list. */
+#define PCP_MAX_PAGES 256
+
+struct page_pcp {
+	spinlock_t					lock;
+	unsigned int				nr_pages;
+	unsigned long				nr_allocs;
+	unsigned long				nr_frees;
+	unsigned long				nr_refills;
+	unsigned long				nr_drains;
+	struct page					*pages[PCP_MAX_PAGES];
+};
+
+/* Tunables, capped at PCP_MAX_PAGES.  Setting pcp_high to 0 turns off the
+ * caches (after the next drain). */
+unsigned int pcp_high = 64;
+unsigned int pcp_batch = 16;
+
+static DEFINE_PERCPU(struct page_pcp, page_pcp);
+/* Set once the percpu areas exist.  Until then, we go straight to the lists. */
+static bool page_pcp_ready;
+
+DEFINE_PERCPU_INIT(page_pcp_init);
+
+static void page_pcp_init(void)
+{
+	for (int i = 0; i < num_cores; i++) {
+		struct page_pcp *pcp = _PERCPU_VARPTR(page_pcp, i);
+
+		memset(pcp, 0, sizeof(struct page_pcp));
+		spinlock_init_irqsave(&pcp->lock);
+	}
+	wmb();
+	page_pcp_ready = TRUE;
+}
+
+static struct page_pcp *get_my_pcp(void)
+{
+	return _PERCPU_VARPTR(page_pcp, core_id_early());
+}
+
+static unsigned int pcp_get_high(void)
+{
+	return MIN(pcp_high, PCP_MAX_PAGES);
+}
+
+static unsigned int pcp_get_batch(void)
+{
+	return MAX(MIN(pcp_batch, pcp_get_high()), 1);
+}
+
+/* Pulls up to nr pages from the free lists.  Hold the pcp lock. */
+static void __pcp_refill(struct page_pcp *pcp, unsigned int nr)
+{
+	struct page *page;
+
+	nr = MIN(nr, PCP_MAX_PAGES - pcp->nr_pages);
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	for (int i = 0; i < nr; i++) {
+		if (__kpage_alloc(&page))
+			break;
+		pcp->pages[pcp->nr_pages++] = page;
+	}
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	pcp->nr_refills++;
+}
+
+/* Gives the coldest nr pages back to the free lists.  Hold the pcp lock. */
+static void __pcp_drain(struct page_pcp *pcp, unsigned int nr)
+{
+	nr = MIN(nr, pcp->nr_pages);
+	if (!nr)
+		return;
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	for (int i = 0; i < nr; i++)
+		__page_free_to_list(pcp->pages[i]);
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	pcp->nr_pages -= nr;
+	memmove(&pcp->pages[0], &pcp->pages[nr],
+	        pcp->nr_pages * sizeof(struct page*));
+	pcp->nr_drains++;
+}
+
+/* Returns TRUE and an initialized page if the local pcp cache came through. */
+static bool pcp_alloc(struct page **page)
+{
+	struct page_pcp *pcp;
+
+	if (!page_pcp_ready || !pcp_get_high())
+		return FALSE;
+	pcp = get_my_pcp();
+	spin_lock_irqsave(&pcp->lock);
+	if (!pcp->nr_pages)
+		__pcp_refill(pcp, pcp_get_batch());
+	if (!pcp->nr_pages) {
+		spin_unlock_irqsave(&pcp->lock);
+		return FALSE;
+	}
+	*page = pcp->pages[--pcp->nr_pages];
+	pcp->nr_allocs++;
+	spin_unlock_irqsave(&pcp->lock);
+	__page_init(*page);
+	return TRUE;
+}
+
+/* Returns TRUE if the local pcp cache took the page.  Remote pages go back to
+ * their own node's lists, so the pcp caches only hand out local memory. */
+static bool pcp_free(struct page *page)
+{
+	struct page_pcp *pcp;
+	unsigned int high = pcp_get_high();
+
+	if (!page_pcp_ready || !high)
+		return FALSE;
+	if (page_to_mem_node(page) != local_mem_node())
+		return FALSE;
+	pcp = get_my_pcp();
+	spin_lock_irqsave(&pcp->lock);
+	if (pcp->nr_pages >= high)
+		__pcp_drain(pcp, pcp->nr_pages - high + pcp_get_batch());
+	page_setref(page, 1);
+	pcp->pages[pcp->nr_pages++] = page;
+	pcp->nr_frees++;
+	spin_unlock_irqsave(&pcp->lock);
+	return TRUE;
+}
+
+/* Gives every core's cached pages back to the free lists.  Don't hold the free
+ * list lock. */
+void page_pcp_drain_all(void)
+{
+	struct page_pcp *pcp;
+
+	if (!page_pcp_ready)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		pcp = _PERCPU_VARPTR(page_pcp, i);
+		spin_lock_irqsave(&pcp->lock);
+		__pcp_drain(pcp, pcp->nr_pages);
+		spin_unlock_irqsave(&pcp->lock);
+	}
+}
+
+void print_page_pcp_info(void)
+{
+	struct page_pcp *pcp;
+
+	if (!page_pcp_ready) {
+		printk("Page pcp caches are not set up yet\n");
+		return;
+	}
+	printk("Page pcp caches: high %u, batch %u\n", pcp_get_high(),
+	       pcp_get_batch());
+	printk("%4s %6s %12s %12s %10s %10s\n", "core", "pages", "allocs",
+	       "frees", "refills", "drains");
+	for (int i = 0; i < num_cores; i++) {
+		pcp = _PERCPU_VARPTR(page_pcp, i);
+		printk("%4d %6u %12lu %12lu %10lu %10lu\n", i, pcp->nr_pages,
+		       pcp->nr_allocs, pcp->nr_frees, pcp->nr_refills,
+		       pcp->nr_drains);
+	}
+}
+
+/* Pools of pre-zeroed pages, one per node.  Idle cores call page_zero_idle()
+ * from cpu_bored(), which pulls free pages off their node's lists, zeroes them,
+ * and stashes them here, up to zero_pool_high pages.  Allocations that want a
+ * zeroed page (upage_alloc() with zero, kpage_zalloc_addr()) try the local pool
+ * first, so the memset happens off the fault path.  Idle cores zero in
+ * batches of zero_pool_batch.
+ *
+ * Like the pcp caches, pooled pages keep a refcnt of 1 and aren't counted in
+ * nr_free_pages; page_zero_pool_drain_all() gives them back.  The idle zeroer
+ * leaves the free lists alone when memory is below the high watermark.  Lock
+ * ordering is zero pool -> free list. */
+#define ZERO_POOL_MAX_BATCH 32
+
+struct page_zero_pool {
+	spinlock_t					lock;
+	page_list_t					pages;
+	unsigned int				nr_pages;
+	unsigned long				nr_hits;
+	unsigned long				nr_misses;
+	unsigned long				nr_zeroed;
+};
+
+/* Tunables, with the batch capped at ZERO_POOL_MAX_BATCH.  Setting
+ * zero_pool_high to 0 turns off idle zeroing. */
+unsigned int zero_pool_high = 1024;
+unsigned int zero_pool_batch = 8;
+
+static struct page_zero_pool zero_pools[MAX_MEM_NODES] = {
+	[0 ... MAX_MEM_NODES - 1] = { .lock = SPINLOCK_INITIALIZER_IRQSAVE }
+};
+/* Set once the nodes are settled (page_reclaim_init()).  Until then, there's
+ * nothing in the pools. */
+static bool page_zero_ready;
+
+/* Returns TRUE and an initialized, zeroed page if the local pool had one. */
+static bool zero_pool_alloc(struct page **page)
+{
+	struct page_zero_pool *pool;
+
+	if (!page_zero_ready)
+		return FALSE;
+	pool = &zero_pools[local_mem_node()];
+	spin_lock_irqsave(&pool->lock);
+	*page = BSD_LIST_FIRST(&pool->pages);
+	if (!*page) {
+		pool->nr_misses++;
+		spin_unlock_irqsave(&pool->lock);
+		return FALSE;
+	}
+	BSD_LIST_REMOVE(*page, pg_link);
+	pool->nr_pages--;
+	pool->nr_hits++;
+	spin_unlock_irqsave(&pool->lock);
+	__page_init(*page);
+	return TRUE;
+}
+
+/* Takes up to nr zeroed pages from the local pool, with one trip through the
+ * lock.  Returns how many we got. */
+static size_t zero_pool_alloc_bulk(struct page **pages, size_t nr)
+{
+	struct page_zero_pool *pool;
+	size_t got = 0;
+
+	if (!page_zero_ready)
+		return 0;
+	pool = &zero_pools[local_mem_node()];
+	spin_lock_irqsave(&pool->lock);
+	for (; got < nr; got++) {
+		pages[got] = BSD_LIST_FIRST(&pool->pages);
+		if (!pages[got])
+			break;
+		BSD_LIST_REMOVE(pages[got], pg_link);
+	}
+	pool->nr_pages -= got;
+	pool->nr_hits += got;
+	if (got < nr)
+		pool->nr_misses++;
+	spin_unlock_irqsave(&pool->lock);
+	for (size_t i = 0; i < got; i++)
+		__page_init(pages[i]);
+	return got;
+}
+
+/* Zeroes a batch of free pages into the local node's pool.  Returns
+ * TRUE if the pool could use more.  Called by idle cores with IRQs disabled,
+ * so we keep the batches small.  We don't hold the pool lock while zeroing;
+ * it's OK if a couple of idle cores overfill the pool a bit. */
+bool page_zero_idle(void)
+{
+	struct page *pages[ZERO_POOL_MAX_BATCH];
+	struct page_zero_pool *pool;
+	unsigned int high = zero_pool_high;
+	unsigned int batch = MAX(MIN(zero_pool_batch, ZERO_POOL_MAX_BATCH), 1);
+	int node, nr = 0;
+
+	if (!page_zero_ready || !high)
+		return FALSE;
+	node = local_mem_node();
+	pool = &zero_pools[node];
+	if (pool->nr_pages >= high)
+		return FALSE;
+	if (nr_free_pages < nr_free_pages_high)
+		return FALSE;
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	for (; nr < MIN(batch, high - pool->nr_pages); nr++) {
+		if (__kpage_alloc_node(&pages[nr], node) < 0)
+			break;
+	}
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	for (int i = 0; i < nr; i++)
+		memset(page2kva(pages[i]), 0, PGSIZE);
+	spin_lock_irqsave(&pool->lock);
+	for (int i = 0; i < nr; i++)
+		BSD_LIST_INSERT_HEAD(&pool->pages, pages[i], pg_link);
+	pool->nr_pages += nr;
+	pool->nr_zeroed += nr;
+	spin_unlock_irqsave(&pool->lock);
+	return nr && (pool->nr_pages < high);
+}
+
+/* Gives every node's pre-zeroed pages back to the free lists.  Don't hold the
+ * free list lock. */
+void page_zero_pool_drain_all(void)
+{
+	struct page_zero_pool *pool;
+	struct page *page;
+
+	if (!page_zero_ready)
+		return;
+	for (int i = 0; i < nr_mem_nodes; i++) {
+		pool = &zero_pools[i];
+		spin_lock_irqsave(&pool->lock);
+		spin_lock_irqsave(&colored_page_free_list_lock);
+		while ((page = BSD_LIST_FIRST(&pool->pages))) {
+			BSD_LIST_REMOVE(page, pg_link);
+			__page_free_to_list(page);
+		}
+		spin_unlock_irqsave(&colored_page_free_list_lock);
+		pool->nr_pages = 0;
+		spin_unlock_irqsave(&pool->lock);
+	}
+}
+
+/* Gives back all of the pages the allocator is sitting on, for when the free
+ * lists come up short. */
+static void page_caches_drain_all(void)
+{
+	page_pcp_drain_all();
+	page_zero_pool_drain_all();
+}
+
+void print_page_zero_pool_info(void)
+{
+	struct page_zero_pool *pool;
+
+	printk("Zeroed page pools: high %u, batch %u\n", zero_pool_high,
+	       zero_pool_batch);
+	printk("%4s %6s %12s %12s %12s\n", "node", "pages", "hits", "misses",
+	       "zeroed");
+	for (int i = 0; i < nr_mem_nodes; i++) {
+		pool = &zero_pools[i];
+		printk("%4d %6u %12lu %12lu %12lu\n", i, pool->nr_pages,
+		       pool->nr_hits, pool->nr_misses, pool->nr_zeroed);
+	}
+}
+
 /**
  * @brief Allocates a physical page from a pool of unused physical memory.
  * Note, the page IS reference counted.
@@ -123,13 +604,46 @@ static error_t __page_alloc_specific(page_t** page, size_t ppn)
  * @return ESUCCESS on success
  * @return -ENOMEM  otherwise
  */
-error_t upage_alloc(struct proc* p, page_t** page, int zero)
+static ssize_t __upage_alloc(struct proc *p, page_t **page)
 {
+	ssize_t ret = -ENOMEM;
+	int local = local_mem_node();
+
 	spin_lock_irqsave(&colored_page_free_list_lock);
-	ssize_t ret = __colored_page_alloc(p->cache_colors_map,
-	                                     page, p->next_cache_color);
+	for (int i = 0; i < nr_mem_nodes; i++) {
+		ret = __colored_page_alloc(p->cache_colors_map, page,
+		                           p->next_cache_color,
+		                           (local + i) % nr_mem_nodes);
+		if (ret >= 0)
+			break;
+	}
 	spin_unlock_irqsave(&colored_page_free_list_lock);
+	return ret;
+}
 
+error_t upage_alloc(struct proc* p, page_t** page, int zero)
+{
+	ssize_t ret;
+
+	/* The pcp caches and zero pools don't track colors, so we can only use
+	 * them when there is just one color to hand out. */
+	if (llc_cache->num_colors == 1 && zero && zero_pool_alloc(page)) {
+		zero = FALSE;
+		ret = 0;
+	} else if (llc_cache->num_colors == 1 && pcp_alloc(page)) {
+		ret = 0;
+	} else {
+		ret = __upage_alloc(p, page);
+	}
+	if (ret < 0) {
+		/* Last ditch effort before failing: give back the pcp caches', the
+		 * zero pools', and the slabs' free pages.  Evicting from the page
+		 * cache is left to the reclaim ktask. */
+		page_caches_drain_all();
+		kmem_reap_all();
+		ret = __upage_alloc(p, page);
+	}
+	check_free_page_watermark();
 	if (ret >= 0) {
 		if(zero)
 			memset(page2kva(*page),0,PGSIZE);
@@ -139,24 +653,138 @@ error_t upage_alloc(struct proc* p, page_t** page, int zero)
 	return ret;
 }
 
-/* Allocates a refcounted page of memory for the kernel's use */
-error_t kpage_alloc(page_t** page)
+/* Bulk version of __upage_alloc(), holding the free list lock once for the
+ * lot.  Returns how many pages we got. */
+static size_t __upage_alloc_bulk(struct proc *p, struct page **pages,
+                                 size_t nr)
 {
 	ssize_t ret;
+	size_t got = 0;
+	int local = local_mem_node();
+
 	spin_lock_irqsave(&colored_page_free_list_lock);
-	if ((ret = __page_alloc_from_color_range(page, global_next_color,
+	for (; got < nr; got++) {
+		ret = -ENOMEM;
+		for (int i = 0; i < nr_mem_nodes; i++) {
+			ret = __colored_page_alloc(p->cache_colors_map, &pages[got],
+			                           p->next_cache_color,
+			                           (local + i) % nr_mem_nodes);
+			if (ret >= 0)
+				break;
+		}
+		if (ret < 0)
+			break;
+		p->next_cache_color = (ret + 1) & (llc_cache->num_colors - 1);
+	}
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	return got;
+}
+
+/* Allocates up to nr pages for p, like nr calls to upage_alloc(), but with one
+ * trip through the locks per batch instead of one per page.  Cold pages come
+ * straight from the free lists, skipping the pcp caches, which are sized for
+ * single pages.  Returns how many pages we got, which is less than nr only if
+ * we're out of memory. */
+size_t upage_alloc_bulk(struct proc *p, struct page **pages, size_t nr,
+                        int zero)
+{
+	size_t nr_zeroed = 0, got;
+
+	if (llc_cache->num_colors == 1 && zero)
+		nr_zeroed = zero_pool_alloc_bulk(pages, nr);
+	got = nr_zeroed;
+	got += __upage_alloc_bulk(p, pages + got, nr - got);
+	if (got < nr) {
+		/* Same last ditch effort as upage_alloc() */
+		page_caches_drain_all();
+		kmem_reap_all();
+		got += __upage_alloc_bulk(p, pages + got, nr - got);
+	}
+	check_free_page_watermark();
+	if (zero) {
+		for (size_t i = nr_zeroed; i < got; i++)
+			memset(page2kva(pages[i]), 0, PGSIZE);
+	}
+	return got;
+}
+
+/* Internal version of kpage_alloc, which skips the pcp caches.  Grab the lock
+ * first. */
+static ssize_t __kpage_alloc_node(page_t **page, int node)
+{
+	ssize_t ret;
+
+	if ((ret = __page_alloc_from_color_range(page, node, global_next_color,
 	                            llc_cache->num_colors - global_next_color)) < 0)
-		ret = __page_alloc_from_color_range(page, 0, global_next_color);
+		ret = __page_alloc_from_color_range(page, node, 0, global_next_color);
+	return ret;
+}
 
-	if (ret >= 0) {
-		global_next_color = ret;
-		ret = ESUCCESS;
+static error_t __kpage_alloc(page_t **page)
+{
+	ssize_t ret = -ENOMEM;
+	int local = local_mem_node();
+
+	for (int i = 0; i < nr_mem_nodes; i++) {
+		ret = __kpage_alloc_node(page, (local + i) % nr_mem_nodes);
+		if (ret >= 0)
+			break;
 	}
+	if (ret < 0)
+		return ret;
+	global_next_color = ret;
+	return ESUCCESS;
+}
+
+static error_t kpage_alloc_global(page_t **page)
+{
+	error_t ret;
+
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	ret = __kpage_alloc(page);
 	spin_unlock_irqsave(&colored_page_free_list_lock);
+	return ret;
+}
 
+/* Allocates a refcounted page of memory for the kernel's use */
+error_t kpage_alloc(page_t** page)
+{
+	error_t ret = ESUCCESS;
+
+	if (!pcp_alloc(page)) {
+		ret = kpage_alloc_global(page);
+		if (ret < 0) {
+			/* Other cores might be sitting on free pages */
+			page_caches_drain_all();
+			ret = kpage_alloc_global(page);
+		}
+	}
+	check_free_page_watermark();
+	if (!ret)
+		memprof_alloc(page2kva(*page), PGSIZE, MEMPROF_PAGE);
 	return ret;
 }
 
+/* Like kpage_alloc(), but from node if it has any free pages.  The pcp caches
+ * only have local pages, so we skip them for other nodes. */
+error_t kpage_alloc_node(page_t **page, int node)
+{
+	ssize_t ret;
+
+	if ((node < 0) || (node >= nr_mem_nodes) || (node == local_mem_node()))
+		return kpage_alloc(page);
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	ret = __kpage_alloc_node(page, node);
+	if (ret >= 0)
+		global_next_color = ret;
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	if (ret < 0)
+		return kpage_alloc(page);
+	check_free_page_watermark();
+	memprof_alloc(page2kva(*page), PGSIZE, MEMPROF_PAGE);
+	return ESUCCESS;
+}
+
 /* Helper: allocates a refcounted page of memory for the kernel's use and
  * returns the kernel address (kernbase), or 0 on error. */
 void *kpage_alloc_addr(void)
@@ -169,7 +797,15 @@ void *kpage_alloc_addr(void)
 
 void *kpage_zalloc_addr(void)
 {
-	void *retval = kpage_alloc_addr();
+	struct page *a_page;
+	void *retval;
+
+	if (zero_pool_alloc(&a_page)) {
+		check_free_page_watermark();
+		memprof_alloc(page2kva(a_page), PGSIZE, MEMPROF_PAGE);
+		return page2kva(a_page);
+	}
+	retval = kpage_alloc_addr();
 	if (retval)
 		memset(retval, 0, PGSIZE);
 	return retval;
@@ -184,18 +820,18 @@ void *kpage_zalloc_addr(void)
  *
  * @return The KVA of the first page, NULL otherwise.
  */
-void *get_cont_pages(size_t order, int flags)
+/* Finds 'npages' free consecutive pages on 'node' (or any node, if node < 0),
+ * returning the first ppn or -1.  Hold the free list lock. */
+static int __find_cont_pages(size_t npages, int node)
 {
-	size_t npages = 1 << order;
-
 	size_t naddrpages = max_paddr / PGSIZE;
-	// Find 'npages' free consecutive pages
 	int first = -1;
-	spin_lock_irqsave(&colored_page_free_list_lock);
+
 	for(int i=(naddrpages-1); i>=(npages-1); i--) {
 		int j;
 		for(j=i; j>=(i-(npages-1)); j--) {
-			if( !page_is_free(j) ) {
+			if (!page_is_free(j) ||
+			    ((node >= 0) && (page_to_mem_node(ppn2page(j)) != node))) {
 				/* i will be j - 1 next time around the outer loop */
 				i = j;
 				break;
@@ -209,6 +845,44 @@ void *get_cont_pages(size_t order, int flags)
 			break;
 		}
 	}
+	return first;
+}
+
+void *get_cont_pages(size_t order, int flags)
+{
+	return get_cont_pages_node(local_mem_node(), order, flags);
+}
+
+/**
+ * @brief Allocated 2^order contiguous physical pages.  Will increment the
+ * reference count for the pages. Get them from NUMA node node if we can, and
+ * from any node otherwise.
+ *
+ * @param[in] node which node to allocate from
+ * @param[in] order order of the allocation
+ * @param[in] flags memory allocation flags
+ *
+ * @return The KVA of the first page, NULL otherwise.
+ */
+void *get_cont_pages_node(int node, size_t order, int flags)
+{
+	size_t npages = 1 << order;
+	int first;
+
+	if (nr_mem_nodes == 1)
+		node = -1;
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	first = __find_cont_pages(npages, node);
+	if (first == -1) {
+		/* Pages in the pcp caches and zero pools look like they are in use,
+		 * and they might be the ones breaking up our range. */
+		spin_unlock_irqsave(&colored_page_free_list_lock);
+		page_caches_drain_all();
+		spin_lock_irqsave(&colored_page_free_list_lock);
+		first = __find_cont_pages(npages, node);
+	}
+	if ((first == -1) && (node >= 0))
+		first = __find_cont_pages(npages, -1);
 	//If we couldn't find them, return NULL
 	if( first == -1 ) {
 		spin_unlock_irqsave(&colored_page_free_list_lock);
@@ -222,22 +896,79 @@ void *get_cont_pages(size_t order, int flags)
 		__page_alloc_specific(&page, first+i);
 	}
 	spin_unlock_irqsave(&colored_page_free_list_lock);
+	check_free_page_watermark();
 	return ppn2kva(first);
 }
 
+/* Finds 'npages' free consecutive pages, starting on an npages boundary, on
+ * 'node' (or any node, if node < 0).  Returns the first ppn or -1.  We only
+ * check the node of the first page; nodes don't split jumbo-sized chunks.  Hold
+ * the free list lock. */
+static long __find_aligned_cont_pages(size_t npages, int node)
+{
+	size_t naddrpages = max_paddr / PGSIZE;
+	size_t i;
+
+	if (naddrpages < npages)
+		return -1;
+	for (long first = ROUNDDOWN(naddrpages - npages, npages); first >= 0;
+	     first -= npages) {
+		if ((node >= 0) && (page_to_mem_node(ppn2page(first)) != node))
+			continue;
+		for (i = first; i < first + npages; i++) {
+			if (!page_is_free(i))
+				break;
+		}
+		if (i == first + npages)
+			return first;
+	}
+	return -1;
+}
+
 /**
- * @brief Allocated 2^order contiguous physical pages.  Will increment the
- * reference count for the pages. Get them from NUMA node node.
+ * @brief Allocates 2^order contiguous physical pages, aligned to their size,
+ * e.g. for a jumbo page.  Will increment the reference count for each page.
+ * Prefers the local NUMA node.
+ *
+ * Unlike get_cont_pages(), this doesn't drain the pcp caches: callers should
+ * have a fallback to smaller pages.
  *
- * @param[in] node which node to allocate from. Unimplemented.
  * @param[in] order order of the allocation
  * @param[in] flags memory allocation flags
  *
  * @return The KVA of the first page, NULL otherwise.
  */
-void *get_cont_pages_node(int node, size_t order, int flags)
+void *get_aligned_cont_pages(size_t order, int flags)
+{
+	size_t npages = 1 << order;
+	int node = nr_mem_nodes == 1 ? -1 : local_mem_node();
+	long first;
+
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	first = __find_aligned_cont_pages(npages, node);
+	if ((first == -1) && (node >= 0))
+		first = __find_aligned_cont_pages(npages, -1);
+	if (first == -1) {
+		spin_unlock_irqsave(&colored_page_free_list_lock);
+		if (flags & MEM_ERROR)
+			error(ENOMEM, ERROR_FIXME);
+		return NULL;
+	}
+	for (long i = first; i < first + npages; i++)
+		__real_page_alloc(ppn2page(i));
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	check_free_page_watermark();
+	return ppn2kva(first);
+}
+
+static bool __cont_pages_are_free(unsigned long first_pg_nr,
+                                  unsigned long nr_pgs)
 {
-	return get_cont_pages(order, flags);
+	for (unsigned long i = first_pg_nr; i < first_pg_nr + nr_pgs; i++) {
+		if (!page_is_free(i))
+			return FALSE;
+	}
+	return TRUE;
 }
 
 /**
@@ -267,8 +998,11 @@ void *get_cont_phys_pages_at(size_t order, physaddr_t at, int flags)
 	if (first_pg_nr + nr_pgs > pa2ppn(max_paddr))
 		return 0;
 	spin_lock_irqsave(&colored_page_free_list_lock);
-	for (unsigned long i = first_pg_nr; i < first_pg_nr + nr_pgs; i++) {
-		if (!page_is_free(i)) {
+	if (!__cont_pages_are_free(first_pg_nr, nr_pgs)) {
+		spin_unlock_irqsave(&colored_page_free_list_lock);
+		page_caches_drain_all();
+		spin_lock_irqsave(&colored_page_free_list_lock);
+		if (!__cont_pages_are_free(first_pg_nr, nr_pgs)) {
 			spin_unlock_irqsave(&colored_page_free_list_lock);
 			if (flags & MEM_ERROR)
 				error(ENOMEM, ERROR_FIXME);
@@ -278,6 +1012,7 @@ void *get_cont_phys_pages_at(size_t order, physaddr_t at, int flags)
 	for (unsigned long i = first_pg_nr; i < first_pg_nr + nr_pgs; i++)
 		__real_page_alloc(ppn2page(i));
 	spin_unlock_irqsave(&colored_page_free_list_lock);
+	check_free_page_watermark();
 	return KADDR(at);
 }
 
@@ -287,8 +1022,9 @@ void free_cont_pages(void *buf, size_t order)
 	spin_lock_irqsave(&colored_page_free_list_lock);
 	for (size_t i = kva2ppn(buf); i < kva2ppn(buf) + npages; i++) {
 		page_t* page = ppn2page(i);
-		__page_decref(ppn2page(i));
-		assert(page_is_free(i));
+		/* Skip the pcp caches, so the pages stay contiguous */
+		assert(kref_refcnt(&page->pg_kref) == 1);
+		__page_free_to_list(page);
 	}
 	spin_unlock_irqsave(&colored_page_free_list_lock);
 	return;
@@ -340,17 +1076,8 @@ void page_incref(page_t *page)
 }
 
 /* Decrement the reference count on a page, freeing it if there are no more
- * refs. */
+ * refs.  page_release() takes whatever locks it needs. */
 void page_decref(page_t *page)
-{
-	spin_lock_irqsave(&colored_page_free_list_lock);
-	__page_decref(page);
-	spin_unlock_irqsave(&colored_page_free_list_lock);
-}
-
-/* Decrement the reference count on a page, freeing it if there are no more
- * refs.  Don't call this without holding the lock already. */
-static void __page_decref(page_t *page)
 {
 	kref_put(&page->pg_kref);
 }
@@ -360,15 +1087,14 @@ static void page_release(struct kref *kref)
 {
 	struct page *page = container_of(kref, struct page, pg_kref);
 
+	memprof_free(page2kva(page));
 	if (atomic_read(&page->pg_flags) & PG_BUFFER)
 		free_bhs(page);
-	/* Give our page back to the free list.  The protections for this are that
-	 * the list lock is grabbed by page_decref. */
-	BSD_LIST_INSERT_HEAD(
-	   &(colored_page_free_list[get_page_color(page2ppn(page), llc_cache)]),
-	   page,
-	   pg_link
-	);
+	if (pcp_free(page))
+		return;
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	__page_free_to_list(page);
+	spin_unlock_irqsave(&colored_page_free_list_lock);
 }
 
 /* Helper when initializing a page - just to prevent the proliferation of
@@ -398,6 +1124,67 @@ void unlock_page(struct page *page)
 	sem_up(&page->pg_sem);
 }
 
+/* Free page watermarks.  Once nr_free_pages drops below the low mark, we kick
+ * the reclaim ktask, which tries to get us back above the high mark by reaping
+ * the slab caches and evicting clean pages from the page cache.  The marks are
+ * 0 (off) until page_reclaim_init(), and can be changed at runtime. */
+size_t nr_free_pages_low;
+size_t nr_free_pages_high;
+
+/* If reclaim can't get us back above the low mark, it waits this long before
+ * trying again, so it doesn't spin while allocators keep kicking it. */
+#define PAGE_RECLAIM_BACKOFF_USEC 10000
+
+static struct rendez reclaim_rv;
+static atomic_t reclaim_kicked;
+
+/* Callers can be in IRQ context, but can't hold the free list lock. */
+static void check_free_page_watermark(void)
+{
+	if (likely(nr_free_pages >= nr_free_pages_low))
+		return;
+	/* Only the first one in needs to wake the reclaimer */
+	if (atomic_swap(&reclaim_kicked, 1))
+		return;
+	rendez_wakeup(&reclaim_rv);
+}
+
+static int reclaim_is_kicked(void *arg)
+{
+	return atomic_read(&reclaim_kicked);
+}
+
+static void page_reclaimer(void *arg)
+{
+	while (1) {
+		rendez_sleep(&reclaim_rv, reclaim_is_kicked, 0);
+		page_caches_drain_all();
+		kmem_reap_all();
+		if (nr_free_pages < nr_free_pages_high)
+			vfs_evict_clean_pages(nr_free_pages_high - nr_free_pages);
+		if (nr_free_pages < nr_free_pages_high)
+			cevict(nr_free_pages_high - nr_free_pages);
+		if (nr_free_pages < nr_free_pages_low)
+			kthread_usleep(PAGE_RECLAIM_BACKOFF_USEC);
+		atomic_set(&reclaim_kicked, 0);
+	}
+}
+
+/* Sets the default watermarks, based on how much memory we had free at boot,
+ * and starts the reclaim ktask.  Needs kthreads. */
+void page_reclaim_init(void)
+{
+	rendez_init(&reclaim_rv);
+	atomic_init(&reclaim_kicked, 0);
+	ktask("page_reclaimer", page_reclaimer, 0);
+	nr_free_pages_high = nr_free_pages / 32;
+	/* The reclaimer needs to be ready before anyone can see a low mark */
+	wmb();
+	nr_free_pages_low = nr_free_pages / 64;
+	/* The nodes are settled, so the idle cores can start zeroing */
+	page_zero_ready = TRUE;
+}
+
 void print_pageinfo(struct page *page)
 {
 	int i;
@@ -9,8 +9,15 @@
 #include <atomic.h>
 #include <radix.h>
 #include <kref.h>
+#include <kmalloc.h>
+#include <trap.h>
 #include <assert.h>
 #include <stdio.h>
+#include <sort.h>
+#include <rcu.h>
+
+/* Max pages pm_shrink() removes per trip through the pm_lock */
+#define PM_SHRINK_BATCH 32
 
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 {
@@ -103,6 +110,62 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 	spinlock_init(&pm->pm_lock);
 	TAILQ_INIT(&pm->pm_vmrs);
 	atomic_set(&pm->pm_removal, 0);
+	TAILQ_INIT(&pm->pm_active);
+	TAILQ_INIT(&pm->pm_inactive);
+	pm->pm_nr_active = 0;
+}
+
+/* Page map LRU.  Every page in a PM is on one of two lists, protected by the
+ * pm_lock.  New pages start at the head of the inactive list.  Lookups set
+ * PG_REFERENCED, and a second lookup while inactive activates the page.  Pages
+ * that were referenced, either by a lookup or through a PTE's accessed bit,
+ * get activated when they reach the inactive tail, and the active list is aged
+ * onto the inactive one so that it's never the bigger of the two.  The
+ * shrinker evicts clean, unreferenced pages from the inactive tail. */
+static void __pm_lru_activate(struct page_map *pm, struct page *page)
+{
+	TAILQ_REMOVE(&pm->pm_inactive, page, pg_lru_link);
+	TAILQ_INSERT_HEAD(&pm->pm_active, page, pg_lru_link);
+	atomic_or(&page->pg_flags, PG_ACTIVE);
+	pm->pm_nr_active++;
+}
+
+static void __pm_lru_deactivate(struct page_map *pm, struct page *page)
+{
+	TAILQ_REMOVE(&pm->pm_active, page, pg_lru_link);
+	TAILQ_INSERT_HEAD(&pm->pm_inactive, page, pg_lru_link);
+	atomic_and(&page->pg_flags, ~PG_ACTIVE);
+	pm->pm_nr_active--;
+}
+
+static void __pm_lru_del(struct page_map *pm, struct page *page)
+{
+	if (atomic_read(&page->pg_flags) & PG_ACTIVE) {
+		TAILQ_REMOVE(&pm->pm_active, page, pg_lru_link);
+		pm->pm_nr_active--;
+	} else {
+		TAILQ_REMOVE(&pm->pm_inactive, page, pg_lru_link);
+	}
+}
+
+/* Call with a slot ref, which keeps the page in the PM.  Only the second use
+ * of an inactive page needs the lock. */
+static void pm_mark_accessed(struct page_map *pm, struct page *page)
+{
+	int flags = atomic_read(&page->pg_flags);
+
+	if (flags & PG_ACTIVE)
+		return;
+	if (!(flags & PG_REFERENCED)) {
+		atomic_or(&page->pg_flags, PG_REFERENCED);
+		return;
+	}
+	spin_lock(&pm->pm_lock);
+	if (!(atomic_read(&page->pg_flags) & PG_ACTIVE)) {
+		atomic_and(&page->pg_flags, ~PG_REFERENCED);
+		__pm_lru_activate(pm, page);
+	}
+	spin_unlock(&pm->pm_lock);
 }
 
 /* Looks up the index'th page in the page map, returning a refcnt'd reference
@@ -112,15 +175,17 @@ static struct page *pm_find_page(struct page_map *pm, unsigned long index)
 	void **tree_slot;
 	void *old_slot_val, *slot_val;
 	struct page *page = 0;
-	/* Read walking the PM tree TODO: (RCU) */
-	spin_lock(&pm->pm_lock);
-	/* We're syncing with removal.  The deal is that if we grab the page (and
+	/* Read walking the PM tree, without the pm_lock.  The tree's nodes are
+	 * freed after an RCU grace period, so the slot stays good til we're done.
+	 * We're syncing with removal.  The deal is that if we grab the page (and
 	 * we'd only do that if the page != 0), we up the slot ref and clear
 	 * removal.  A remover will only remove it if removal is still set.  If we
 	 * grab and release while removal is in progress, even though we no longer
 	 * hold the ref, we have unset removal.  Also, to prevent removal where we
 	 * get a page well before the removal process, the removal won't even bother
-	 * when the slot refcnt is upped. */
+	 * when the slot refcnt is upped.  Removal clears the slot's page before it
+	 * deletes the slot, so a stale slot just has no page. */
+	rcu_read_lock();
 	tree_slot = radix_lookup_slot(&pm->pm_tree, index);
 	if (!tree_slot)
 		goto out;
@@ -135,10 +200,39 @@ static struct page *pm_find_page(struct page_map *pm, unsigned long index)
 	} while (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val));
 	assert(page->pg_tree_slot == tree_slot);
 out:
-	spin_unlock(&pm->pm_lock);
+	rcu_read_unlock();
+	if (page)
+		pm_mark_accessed(pm, page);
 	return page;
 }
 
+/* Like pm_find_page(), but only checks, so it doesn't count as a use. */
+static bool pm_has_page(struct page_map *pm, unsigned long index)
+{
+	void **tree_slot;
+	bool ret = FALSE;
+
+	rcu_read_lock();
+	tree_slot = radix_lookup_slot(&pm->pm_tree, index);
+	if (tree_slot)
+		ret = pm_slot_get_page(ACCESS_ONCE(*tree_slot)) != 0;
+	rcu_read_unlock();
+	return ret;
+}
+
+/* Lockless lookups can find a slot as soon as it is in the tree, so slots go
+ * in with just the slot ref, and we add the page once it knows its slot.  Hold
+ * the pm_lock. */
+static void __pm_publish_page(struct page_map *pm, struct page *page,
+                              void **tree_slot)
+{
+	page->pg_tree_slot = tree_slot;
+	/* passing the page ref from the caller to the slot */
+	rcu_assign_pointer(*tree_slot, pm_slot_set_page(*tree_slot, page));
+	pm->pm_num_pages++;
+	TAILQ_INSERT_HEAD(&pm->pm_inactive, page, pg_lru_link);
+}
+
 /* Attempts to insert the page into the page_map, returns 0 for success, or an
  * error code if there was one already (EEXIST) or we ran out of memory
  * (ENOMEM).
@@ -158,25 +252,45 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 	spin_lock(&pm->pm_lock);
 	page->pg_mapping = pm;	/* debugging */
 	page->pg_index = index;
-	/* no one should be looking at the tree slot til we stop write locking.  the
-	 * only other one who looks is removal, who requires a PM write lock. */
 	page->pg_tree_slot = (void*)0xdeadbeef;	/* poison */
 	slot_val = pm_slot_inc_refcnt(slot_val);
-	/* passing the page ref from the caller to the slot */
-	slot_val = pm_slot_set_page(slot_val, page);
-	/* shouldn't need a CAS or anything for the slot write, since we hold the
-	 * write lock.  o/w, we'd need to get the slot and CAS instead of insert. */
+	/* shouldn't need a CAS or anything for the slot writes, since we hold the
+	 * write lock, and lookups won't touch a slot without a page. */
 	ret = radix_insert(&pm->pm_tree, index, slot_val, &tree_slot);
 	if (ret) {
 		spin_unlock(&pm->pm_lock);
 		return ret;
 	}
-	page->pg_tree_slot = tree_slot;
-	pm->pm_num_pages++;
+	__pm_publish_page(pm, page, tree_slot);
 	spin_unlock(&pm->pm_lock);
 	return 0;
 }
 
+/* Like pm_insert_page(), for pages[i] at index + i, in one walk of the tree.
+ * Stops at the first index that is taken, and returns how many were inserted.
+ * Callers keep their refs on the rest. */
+static unsigned int pm_insert_pages(struct page_map *pm, unsigned long index,
+                                    struct page **pages, unsigned int nr)
+{
+	void *slot_vals[PM_RA_MAX_PGS];
+	void **tree_slots[PM_RA_MAX_PGS];
+	unsigned int nr_ins;
+
+	nr = MIN(nr, PM_RA_MAX_PGS);
+	for (int i = 0; i < nr; i++) {
+		pages[i]->pg_mapping = pm;
+		pages[i]->pg_index = index + i;
+		pages[i]->pg_tree_slot = (void*)0xdeadbeef;
+		slot_vals[i] = pm_slot_inc_refcnt(0);
+	}
+	spin_lock(&pm->pm_lock);
+	nr_ins = radix_gang_insert(&pm->pm_tree, index, slot_vals, nr, tree_slots);
+	for (int i = 0; i < nr_ins; i++)
+		__pm_publish_page(pm, pages[i], tree_slots[i]);
+	spin_unlock(&pm->pm_lock);
+	return nr_ins;
+}
+
 /* Decrefs the PM slot ref (usage of a PM page).  The PM's page ref remains. */
 void pm_put_page(struct page *page)
 {
@@ -262,6 +376,110 @@ int pm_load_page_nowait(struct page_map *pm, unsigned long index,
 	return 0;
 }
 
+/* A batch of readahead pages, locked in the PM until their read is done */
+struct pm_ra_req {
+	struct page_map				*pm;
+	struct kref					*owner;
+	unsigned int				nr;
+	struct page					*pages[PM_RA_MAX_PGS];
+};
+
+/* RKM, reads in a pm_ra_req's pages, then unlocks them for anyone waiting in
+ * pm_load_page().  If a read fails, the page stays !UPTODATE and the next
+ * pm_load_page() retries it. */
+static void __pm_readahead_rkm(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct pm_ra_req *req = (struct pm_ra_req*)a0;
+	struct page_map *pm = req->pm;
+
+	if (pm->pm_op->readpages) {
+		pm->pm_op->readpages(pm, req->pages, req->nr);
+	} else {
+		for (int i = 0; i < req->nr; i++)
+			pm->pm_op->readpage(pm, req->pages[i]);
+	}
+	for (int i = 0; i < req->nr; i++) {
+		unlock_page(req->pages[i]);
+		pm_put_page(req->pages[i]);
+	}
+	kref_put(req->owner);
+	kfree(req);
+}
+
+/* Starts reading in up to nr pages from index, stopping at the first page
+ * that's already in the cache, and returns how many it started.  This doesn't
+ * wait for the IO: the pages go in the PM locked, so anyone who wants them
+ * waits in pm_load_page(), and an RKM on this core does the reads.  owner is a
+ * kref that keeps the PM alive, which we hold until the reads are done. */
+unsigned int pm_readahead(struct page_map *pm, unsigned long index,
+                          unsigned int nr, struct kref *owner)
+{
+	struct pm_ra_req *req;
+	struct page *page;
+
+	nr = MIN(nr, PM_RA_MAX_PGS);
+	if (!nr)
+		return 0;
+	req = kmalloc(sizeof(struct pm_ra_req), 0);
+	if (!req)
+		return 0;
+	req->nr = 0;
+	for (unsigned long i = index; i < index + nr; i++) {
+		if (pm_has_page(pm, i))
+			break;
+		if (kpage_alloc(&page))
+			break;
+		/* Same as pm_load_page(): locked and !UPTODATE until the read */
+		atomic_set(&page->pg_flags, PG_LOCKED | PG_PAGEMAP);
+		page->pg_sem.nr_signals = 0;
+		req->pages[req->nr++] = page;
+	}
+	/* we might lose races for some of them */
+	nr = pm_insert_pages(pm, index, req->pages, req->nr);
+	for (int i = nr; i < req->nr; i++)
+		page_decref(req->pages[i]);
+	req->nr = nr;
+	if (!req->nr) {
+		kfree(req);
+		return 0;
+	}
+	req->pm = pm;
+	req->owner = owner;
+	kref_get(owner, 1);
+	send_kernel_message(core_id(), __pm_readahead_rkm, (long)req, 0, 0,
+	                    KMSG_ROUTINE);
+	return req->nr;
+}
+
+/* Readahead for a reader of [first, last] in an object of nr_pgs pages.
+ * Sequential reads, which start on or right after the last page of the
+ * previous read, grow the window; anything else shrinks it.  We keep one
+ * window of pages read ahead of the reader, and only start reads for the part
+ * we haven't asked for yet. */
+void pm_readahead_seq(struct page_map *pm, struct pm_ra_state *ra,
+                      unsigned long first, unsigned long last,
+                      unsigned long nr_pgs, struct kref *owner)
+{
+	unsigned long start, end;
+	unsigned int size = ra->ra_size;
+
+	if ((first == ra->ra_last) || (first == ra->ra_last + 1)) {
+		size = size ? MIN(size * 2, PM_RA_MAX_PGS) : PM_RA_MIN_PGS;
+	} else {
+		size = size / 2 < PM_RA_MIN_PGS ? 0 : size / 2;
+		ra->ra_end = 0;
+	}
+	ra->ra_size = size;
+	ra->ra_last = last;
+	if (!size)
+		return;
+	start = MAX(last + 1, ra->ra_end);
+	end = MIN(last + 1 + size, nr_pgs);
+	if (start >= end)
+		return;
+	ra->ra_end = start + pm_readahead(pm, start, end - start, owner);
+}
+
 static bool vmr_has_page_idx(struct vm_region *vmr, unsigned long pg_idx)
 {
 	unsigned long nr_pgs = (vmr->vm_end - vmr->vm_base) >> PGSHIFT;
@@ -349,6 +567,23 @@ static int __pm_mark_unmap(struct proc *p, pte_t pte, void *va, void *arg)
 	return 0;
 }
 
+/* For LRU aging: moves PTE accessed bits onto the PM page.  We don't shoot
+ * down the TLB, so a cached translation won't set the bit again until it gets
+ * evicted.  That just makes a busy page look idle a little early. */
+static int __pm_clear_accessed(struct proc *p, pte_t pte, void *va, void *arg)
+{
+	struct page *page;
+
+	if (pte_is_unmapped(pte) || !pte_is_accessed(pte))
+		return 0;
+	pte_clear_accessed(pte);
+	page = pa2page(pte_get_paddr(pte));
+	/* private mappings might have their own copy */
+	if (atomic_read(&page->pg_flags) & PG_PAGEMAP)
+		atomic_or(&page->pg_flags, PG_REFERENCED);
+	return 0;
+}
+
 static void shootdown_and_reset_ptrstore(void *proc_ptrs[], int *arr_idx)
 {
 	for (int i = 0; i < *arr_idx; i++)
@@ -358,9 +593,13 @@ static void shootdown_and_reset_ptrstore(void *proc_ptrs[], int *arr_idx)
 
 /* Attempts to remove pages from the pm, from [index, index + nr_pgs).  Returns
  * the number of pages removed.  There can only be one remover at a time per PM
- * - others will return 0. */
-int pm_remove_contig(struct page_map *pm, unsigned long index,
-                     unsigned long nr_pgs)
+ * - others will return 0.
+ *
+ * If clean_only, dirty pages are left in the PM instead of being written back.
+ * They still get unmapped from the VMRs, like any other page we tried to
+ * remove, and will be soft-faulted back in. */
+static int __pm_remove_contig(struct page_map *pm, unsigned long index,
+                              unsigned long nr_pgs, bool clean_only)
 {
 	unsigned long i;
 	int nr_removed = 0;
@@ -526,6 +765,11 @@ handle_dirty:
 		}
 		/* this dirty flag could also be set by write()s, not just VMRs */
 		if (atomic_read(&page->pg_flags) & PG_DIRTY) {
+			if (clean_only) {
+				/* the final pass skips pages without PG_REMOVAL */
+				atomic_and(&page->pg_flags, ~PG_REMOVAL);
+				continue;
+			}
 			/* need to bail out.  after we WB, we'll restart this big loop where
 			 * we left off ('i' is still set) */
 			if (ptr_free_idx == PTR_ARR_LEN)
@@ -582,6 +826,7 @@ handle_dirty:
 		/* at this point, we're free at last!  When we update the radix tree, it
 		 * still thinks it has an item.  This is fine.  Lookups will now fail
 		 * (since the page is 0), and insertions will block on the write lock.*/
+		__pm_lru_del(pm, page);
 		atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
 		page_decref(page);
 		nr_removed++;
@@ -593,11 +838,129 @@ handle_dirty:
 	return nr_removed;
 }
 
+int pm_remove_contig(struct page_map *pm, unsigned long index,
+                     unsigned long nr_pgs)
+{
+	return __pm_remove_contig(pm, index, nr_pgs, FALSE);
+}
+
+/* Like pm_remove_contig(), but only removes pages that don't need a writeback.
+ * Used for reclaiming memory, where we don't want to block on IO. */
+int pm_remove_clean_contig(struct page_map *pm, unsigned long index,
+                           unsigned long nr_pgs)
+{
+	return __pm_remove_contig(pm, index, nr_pgs, TRUE);
+}
+
+/* Returns TRUE if the page was used since we last checked, and clears the
+ * check for next time.  Pages mapped by pinned VMRs always count as used.
+ * Hold the pm_lock. */
+static bool __pm_page_referenced(struct page_map *pm, struct page *page)
+{
+	struct vm_region *vmr_i;
+	bool pinned = FALSE;
+
+	TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
+		if (!vmr_has_page_idx(vmr_i, page->pg_index))
+			continue;
+		if (vmr_i->vm_flags & MAP_LOCKED) {
+			pinned = TRUE;
+			continue;
+		}
+		spin_lock(&vmr_i->vm_proc->pte_lock);
+		vmr_for_each(vmr_i, page->pg_index, 1, __pm_clear_accessed);
+		spin_unlock(&vmr_i->vm_proc->pte_lock);
+	}
+	if (atomic_read(&page->pg_flags) & PG_REFERENCED) {
+		atomic_and(&page->pg_flags, ~PG_REFERENCED);
+		return TRUE;
+	}
+	return pinned;
+}
+
+/* Ages pages off the active tail until the active list is no bigger than the
+ * inactive one.  Referenced pages go back to the active head instead. */
+static void __pm_lru_balance(struct page_map *pm)
+{
+	unsigned long nr_to_scan = pm->pm_nr_active;
+	struct page *page;
+
+	while (nr_to_scan-- &&
+	       (pm->pm_nr_active > pm->pm_num_pages - pm->pm_nr_active)) {
+		page = TAILQ_LAST(&pm->pm_active, pm_lru_list);
+		if (__pm_page_referenced(pm, page)) {
+			TAILQ_REMOVE(&pm->pm_active, page, pg_lru_link);
+			TAILQ_INSERT_HEAD(&pm->pm_active, page, pg_lru_link);
+			continue;
+		}
+		__pm_lru_deactivate(pm, page);
+	}
+}
+
+static int idx_cmp(const void *a, const void *b)
+{
+	unsigned long ia = *(const unsigned long*)a;
+	unsigned long ib = *(const unsigned long*)b;
+
+	return ia < ib ? -1 : ia > ib ? 1 : 0;
+}
+
+/* Evicts up to nr_wanted clean, unreferenced pages from the tail of pm's
+ * inactive list, looking at each page at most once.  Dirty pages are left for
+ * writeback.  Returns the number evicted. */
+unsigned long pm_shrink(struct page_map *pm, unsigned long nr_wanted)
+{
+	unsigned long idxs[PM_SHRINK_BATCH];
+	unsigned long nr_to_scan, nr_evicted = 0;
+	unsigned int nr_idxs, run;
+	struct page *page;
+
+	spin_lock(&pm->pm_lock);
+	nr_to_scan = pm->pm_num_pages;
+	spin_unlock(&pm->pm_lock);
+	while (nr_to_scan && (nr_evicted < nr_wanted)) {
+		nr_idxs = 0;
+		spin_lock(&pm->pm_lock);
+		__pm_lru_balance(pm);
+		while (nr_to_scan && (nr_idxs < MIN(PM_SHRINK_BATCH,
+		                                    nr_wanted - nr_evicted))) {
+			page = TAILQ_LAST(&pm->pm_inactive, pm_lru_list);
+			if (!page) {
+				nr_to_scan = 0;
+				break;
+			}
+			nr_to_scan--;
+			if (__pm_page_referenced(pm, page)) {
+				__pm_lru_activate(pm, page);
+				continue;
+			}
+			/* Rotate, so pages we can't remove don't clog the tail */
+			TAILQ_REMOVE(&pm->pm_inactive, page, pg_lru_link);
+			TAILQ_INSERT_HEAD(&pm->pm_inactive, page, pg_lru_link);
+			if (atomic_read(&page->pg_flags) & (PG_DIRTY | PG_LOCKED))
+				continue;
+			idxs[nr_idxs++] = page->pg_index;
+		}
+		spin_unlock(&pm->pm_lock);
+		/* Removal walks every VMR, so remove contiguous runs in one go */
+		sort(idxs, nr_idxs, sizeof(unsigned long), idx_cmp);
+		for (int i = 0; i < nr_idxs; i += run) {
+			for (run = 1; i + run < nr_idxs; run++) {
+				if (idxs[i + run] != idxs[i] + run)
+					break;
+			}
+			nr_evicted += pm_remove_clean_contig(pm, idxs[i], run);
+		}
+	}
+	return nr_evicted;
+}
+
 void print_page_map_info(struct page_map *pm)
 {
 	struct vm_region *vmr_i;
 	printk("Page Map %p\n", pm);
 	printk("\tNum pages: %lu\n", pm->pm_num_pages);
+	printk("\tNum active: %lu\n", pm->pm_nr_active);
 	spin_lock(&pm->pm_lock);
 	TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
 		printk("\tVMR proc %d: (%p - %p): 0x%08x, 0x%08x, %p, %p\n",
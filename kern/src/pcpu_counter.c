@@ -0,0 +1,79 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Per-core statistics counters.  See pcpu_counter.h.
+ *
+ * Counts from before percpu_init() land in the PERCPU template, which gets
+ * copied to every core, so we keep them in core 0's copy only. */
+
+#include <pcpu_counter.h>
+#include <percpu.h>
+#include <smp.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+
+#define PCPU_CTR_LINE_SZ		64
+
+DEFINE_PERCPU_INIT(pcpu_counter_init);
+
+static void pcpu_counter_init(void)
+{
+	struct pcpu_counter *ctr;
+
+	for (ctr = __pcpu_countersstart; ctr < __pcpu_countersend; ctr++) {
+		for (int i = 1; i < num_cores; i++)
+			*__PERCPU_VARPTR(*ctr->pcpu, i) = 0;
+	}
+}
+
+uint64_t pcpu_counter_sum(struct pcpu_counter *ctr)
+{
+	uint64_t sum = 0;
+
+	for (int i = 0; i < num_cores; i++)
+		sum += ACCESS_ONCE(*__PERCPU_VARPTR(*ctr->pcpu, i));
+	return sum;
+}
+
+struct pcpu_counter *pcpu_counter_lookup(const char *name)
+{
+	struct pcpu_counter *ctr;
+
+	for (ctr = __pcpu_countersstart; ctr < __pcpu_countersend; ctr++) {
+		if (!strcmp(ctr->name, name))
+			return ctr;
+	}
+	return NULL;
+}
+
+/* Racy with the cores bumping: an add in flight can undo its core's reset. */
+void pcpu_counter_reset(void)
+{
+	struct pcpu_counter *ctr;
+
+	for (ctr = __pcpu_countersstart; ctr < __pcpu_countersend; ctr++) {
+		for (int i = 0; i < num_cores; i++)
+			ACCESS_ONCE(*__PERCPU_VARPTR(*ctr->pcpu, i)) = 0;
+	}
+}
+
+/* Returns one line per counter, its name and the sum over all cores.  Free
+ * with kfree. */
+struct sized_alloc *pcpu_counter_list(void)
+{
+	struct pcpu_counter *ctr;
+	struct sized_alloc *sza;
+	size_t nr = __pcpu_countersend - __pcpu_countersstart;
+	size_t bufsz = PCPU_CTR_LINE_SZ * nr, off = 0;
+
+	sza = sized_kzmalloc(bufsz, MEM_WAIT);
+	for (ctr = __pcpu_countersstart; ctr < __pcpu_countersend; ctr++) {
+		if (off >= bufsz)
+			break;
+		off += snprintf(sza->buf + off, bufsz - off, "%-32s %llu\n",
+		                ctr->name, pcpu_counter_sum(ctr));
+	}
+	sza->size = MIN(off, bufsz);
+	return sza;
+}
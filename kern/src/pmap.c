@@ -25,7 +25,7 @@
 physaddr_t max_pmem = 0;	/* Total amount of physical memory (bytes) */
 physaddr_t max_paddr = 0;	/* Maximum addressable physical address */
 size_t max_nr_pages = 0;	/* Number of addressable physical memory pages */
-size_t nr_free_pages = 0;	/* TODO: actually track this, after init */
+size_t nr_free_pages = 0;	/* protected by the page free list lock */
 struct page *pages = 0;
 struct multiboot_info *multiboot_kaddr = 0;
 uintptr_t boot_freemem = 0;
@@ -235,7 +235,7 @@ int page_insert(pgdir_t pgdir, struct page *page, void *va, int perm)
  * of the pte for this page.  This is used by page_remove
  * but should not be used by other callers.
  *
- * For jumbos, right now this returns the first Page* in the 4MB range
+ * For (user, PTSIZE) jumbos, this returns the Page* of the little page at va.
  *
  * @param[in]  pgdir     the page directory from which we should do the lookup
  * @param[in]  va        the virtual address of the page we are looking up
@@ -251,6 +251,9 @@ page_t *page_lookup(pgdir_t pgdir, void *va, pte_t *pte_store)
 		return 0;
 	if (pte_store)
 		*pte_store = pte;
+	if (pte_is_jumbo(pte))
+		return pa2page(pte_get_paddr(pte) +
+		               ROUNDDOWN((uintptr_t)va & (PTSIZE - 1), PGSIZE));
 	return pa2page(pte_get_paddr(pte));
 }
 
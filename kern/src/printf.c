@@ -9,6 +9,7 @@
 #include <stdarg.h>
 #include <smp.h>
 #include <kprof.h>
+#include <klog.h>
 
 spinlock_t output_lock = SPINLOCK_INITIALIZER_IRQSAVE;
 
@@ -61,6 +62,13 @@ int vcprintf(const char *fmt, va_list ap)
 		pcpui = &per_cpu_info[0];
 	else
 		pcpui = &per_cpu_info[core_id()];
+	/* Usually the klog takes it, and prints it later */
+	va_copy(args, ap);
+	cnt = klog_vprintf(!ktrap_depth(pcpui), fmt, args);
+	va_end(args);
+	if (cnt >= 0)
+		return cnt;
+	cnt = 0;
 	/* lock all output.  this will catch any printfs at line granularity.  when
 	 * tracing, we short-circuit the main lock call, so as not to clobber the
 	 * results as we print. */
@@ -16,13 +16,14 @@
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
-#include <hashtable.h>
+#include <chash.h>
 #include <slab.h>
 #include <sys/queue.h>
 #include <frontend.h>
 #include <monitor.h>
 #include <elf.h>
 #include <arsc_server.h>
+#include <sysring.h>
 #include <kmalloc.h>
 #include <ros/procinfo.h>
 
@@ -35,15 +36,14 @@ static uint32_t try_get_pcoreid(struct proc *p, uint32_t vcoreid);
 static uint32_t get_pcoreid(struct proc *p, uint32_t vcoreid);
 static void __proc_free(struct kref *kref);
 static bool scp_is_vcctx_ready(struct preempt_data *vcpd);
-static void save_vc_fp_state(struct preempt_data *vcpd);
-static void restore_vc_fp_state(struct preempt_data *vcpd);
+static void save_vc_fp_state(struct proc *p, struct preempt_data *vcpd);
+static void restore_vc_fp_state(struct proc *p, struct preempt_data *vcpd);
 
 /* PID management. */
 #define PID_MAX 32767 // goes from 0 to 32767, with 0 reserved
 static DECL_BITMASK(pid_bmask, PID_MAX + 1);
 spinlock_t pid_bmask_lock = SPINLOCK_INITIALIZER;
-struct hashtable *pid_hash;
-spinlock_t pid_hash_lock; // initialized in proc_init
+struct chash pid_hash;
 
 /* Finds the next free entry (zero) entry in the pid_bitmask.  Set means busy.
  * PID 0 is reserved (in proc_init).  A return value of 0 is a failure (and
@@ -104,6 +104,64 @@ uint64_t vcore_account_gettotal(struct proc *p, uint32_t vcoreid)
 	return vc->total_ticks;
 }
 
+/* The counters of the vcore we're running, if we're running p.  Anything else
+ * (SCPs, kthreads working for p) gets charged to vcore 0. */
+struct vcore_counters *proc_vc_stats(struct proc *p)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	uint32_t vcoreid = 0;
+
+	if (pcpui->owning_proc == p &&
+	    pcpui->owning_vcoreid < p->procinfo->max_vcores)
+		vcoreid = pcpui->owning_vcoreid;
+	return &p->vc_stats[vcoreid];
+}
+
+/* Builds #proc/PID/stats: a struct proc_stats, then one struct vcore_stats per
+ * vcore.  The counters are racy, but each one is a single word. */
+struct sized_alloc *proc_stats_report(struct proc *p)
+{
+	uint32_t nr_vcores = p->procinfo->max_vcores;
+	struct sized_alloc *sza;
+	struct proc_stats *ps;
+	struct vcore_stats *vcs;
+	struct vcore_counters *vcc;
+	struct vcore *vc;
+	struct vm_region *vmr;
+	uint64_t now = read_tsc();
+
+	sza = sized_kzmalloc(sizeof(struct proc_stats) +
+	                     nr_vcores * sizeof(struct vcore_stats), MEM_WAIT);
+	ps = (struct proc_stats*)sza->buf;
+	vcs = (struct vcore_stats*)(ps + 1);
+	ps->version = PROC_STATS_VERSION;
+	ps->nr_vcores = nr_vcores;
+	ps->tsc_freq = __proc_global_info.tsc_freq;
+	spin_lock(&p->vmr_lock);
+	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
+		ps->vm_bytes += vmr->vm_end - vmr->vm_base;
+		ps->nr_vmrs++;
+	}
+	spin_unlock(&p->vmr_lock);
+	for (uint32_t i = 0; i < nr_vcores; i++) {
+		vc = &p->procinfo->vcoremap[i];
+		vcc = &p->vc_stats[i];
+		vcs[i].online = ACCESS_ONCE(vc->valid);
+		vcs[i].pcoreid = vcs[i].online ? ACCESS_ONCE(vc->pcoreid) : 0;
+		vcs[i].total_ticks = ACCESS_ONCE(vc->total_ticks);
+		/* resume_ticks can be newer than now, if it just came online */
+		if (vcs[i].online && now > ACCESS_ONCE(vc->resume_ticks))
+			vcs[i].total_ticks += now - ACCESS_ONCE(vc->resume_ticks);
+		vcs[i].nr_syscalls = ACCESS_ONCE(vcc->nr_syscalls);
+		vcs[i].nr_page_faults = ACCESS_ONCE(vcc->nr_page_faults);
+		vcs[i].nr_events = ACCESS_ONCE(vcc->nr_events);
+		ps->nr_syscalls += vcs[i].nr_syscalls;
+		ps->nr_page_faults += vcs[i].nr_page_faults;
+		ps->nr_events += vcs[i].nr_events;
+	}
+	return sza;
+}
+
 /* While this could be done with just an assignment, this gives us the
  * opportunity to check for bad transitions.  Might compile these out later, so
  * we shouldn't rely on them for sanity checking from userspace.  */
@@ -177,63 +235,58 @@ int __proc_set_state(struct proc *p, uint32_t state)
 
 /* Returns a pointer to the proc with the given pid, or 0 if there is none.
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * process is dying and we should not have the ref (and thus return 0).  RCU
+ * protects us from getting p, (someone else removes and frees p), then
+ * get_not_zero() on p: procs are freed after a grace period. */
 struct proc *pid2proc(pid_t pid)
 {
-	spin_lock(&pid_hash_lock);
-	struct proc *p = hashtable_search(pid_hash, (void*)(long)pid);
+	struct proc *p;
+
+	rcu_read_lock();
+	p = chash_lookup(&pid_hash, pid);
 	if (p)
 		if (!kref_get_not_zero(&p->p_kref, 1))
 			p = 0;
-	spin_unlock(&pid_hash_lock);
+	rcu_read_unlock();
 	return p;
 }
 
+struct pid_nth_state {
+	unsigned int n;
+	struct proc *p;
+};
+
+static void __pid_nth_cb(void *item, void *opaque)
+{
+	struct proc *p = (struct proc*)item;
+	struct pid_nth_state *st = (struct pid_nth_state*)opaque;
+
+	if (st->p)
+		return;
+	/* if this process is not valid, it doesn't count */
+	if (!kref_get_not_zero(&p->p_kref, 1))
+		return;
+	if (!st->n) {
+		printd("pid_nth: at end, p %p\n", p);
+		st->p = p;
+		return;
+	}
+	kref_put(&p->p_kref);
+	st->n--;
+}
+
 /* Used by devproc for successive reads of the proc table.
  * Returns a pointer to the nth proc, or 0 if there is none.
- * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * This uses get_not_zero, like pid2proc(), and is under RCU for the same
+ * reason. */
 struct proc *pid_nth(unsigned int n)
 {
-	struct proc *p;
-	spin_lock(&pid_hash_lock);
-	if (!hashtable_count(pid_hash)) {
-		spin_unlock(&pid_hash_lock);
-		return NULL;
-	}
-	struct hashtable_itr *iter = hashtable_iterator(pid_hash);
-	p = hashtable_iterator_value(iter);
-
-	while (p) {
-		/* if this process is not valid, it doesn't count,
-		 * so continue
-		 */
-
-		if (kref_get_not_zero(&p->p_kref, 1)) {
-			/* this one counts */
-			if (! n){
-				printd("pid_nth: at end, p %p\n", p);
-				break;
-			}
-			kref_put(&p->p_kref);
-			n--;
-		}
-		if (!hashtable_iterator_advance(iter)) {
-			p = NULL;
-			break;
-		}
-		p = hashtable_iterator_value(iter);
-	}
+	struct pid_nth_state st = {n, 0};
 
-	spin_unlock(&pid_hash_lock);
-	kfree(iter);
-	return p;
+	rcu_read_lock();
+	chash_for_each(&pid_hash, __pid_nth_cb, &st);
+	rcu_read_unlock();
+	return st.p;
 }
 
 /* Performs any initialization related to processes, such as create the proc
@@ -247,10 +300,7 @@ void proc_init(void)
 	             MAX(ARCH_CL_SIZE, __alignof__(struct proc)), 0, 0, 0);
 	/* Init PID mask and hash.  pid 0 is reserved. */
 	SET_BITMASK_BIT(pid_bmask, 0);
-	spinlock_init(&pid_hash_lock);
-	spin_lock(&pid_hash_lock);
-	pid_hash = create_hashtable(100, __generic_hash, __generic_eq);
-	spin_unlock(&pid_hash_lock);
+	assert(!chash_init(&pid_hash, 128));
 	schedule_init();
 
 	atomic_init(&num_envs, 0);
@@ -324,6 +374,14 @@ static void proc_open_stdfds(struct proc *p)
 	current = old_current;
 }
 
+/* TLB generations are never reused, so a stale one can't match a new proc. */
+static unsigned long new_tlb_gen(void)
+{
+	static atomic_t tlb_gen_src;
+
+	return (unsigned long)atomic_fetch_and_add(&tlb_gen_src, 1) + 1;
+}
+
 /* Allocates and initializes a process, with the given parent.  Currently
  * writes the *p into **pp, and returns 0 on success, < 0 for an error.
  * Errors include:
@@ -338,6 +396,7 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 		return -ENOMEM;
 	/* zero everything by default, other specific items are set below */
 	memset(p, 0, sizeof(*p));
+	p->tlb_gen = new_tlb_gen();
 
 	/* only one ref, which we pass back.  the old 'existence' ref is managed by
 	 * the ksched */
@@ -386,6 +445,9 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	/* Init procinfo/procdata.  Procinfo's argp/argb are 0'd */
 	proc_init_procinfo(p);
 	proc_init_procdata(p);
+	p->vc_stats = kzmalloc_align(sizeof(struct vcore_counters) *
+	                             p->procinfo->max_vcores, MEM_WAIT,
+	                             ARCH_CL_SIZE);
 
 	/* Initialize the generic sysevent ring buffer */
 	SHARED_RING_INIT(&p->procdata->syseventring);
@@ -443,9 +505,8 @@ void __proc_ready(struct proc *p)
 	/* Tell the ksched about us.  TODO: do we need to worry about the ksched
 	 * doing stuff to us before we're added to the pid_hash? */
 	__sched_proc_register(p);
-	spin_lock(&pid_hash_lock);
-	hashtable_insert(pid_hash, (void*)(long)p->pid, p);
-	spin_unlock(&pid_hash_lock);
+	if (chash_insert(&pid_hash, p->pid, p))
+		panic("Couldn't add pid %d to the pid hash", p->pid);
 }
 
 /* Creates a process from the specified file, argvs, and envps. */
@@ -464,30 +525,35 @@ struct proc *proc_create(struct file *prog, char **argv, char **envp)
 	return p;
 }
 
+static void __proc_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(proc_cache, container_of(head, struct proc, p_rcu));
+}
+
 static int __cb_assert_no_pg(struct proc *p, pte_t pte, void *va, void *arg)
 {
 	assert(pte_is_unmapped(pte));
 	return 0;
 }
 
-/* This is called by kref_put(), once the last reference to the process is
- * gone.  Don't call this otherwise (it will panic).  It will clean up the
- * address space and deallocate any other used memory. */
-static void __proc_free(struct kref *kref)
+/* Cleans up the address space and deallocates any other used memory of a proc
+ * whose last reference is gone.  This runs from a workqueue, since freeing a
+ * big address space can take a while. */
+static void __proc_free_work(struct work_struct *work)
 {
-	struct proc *p = container_of(kref, struct proc, p_kref);
+	struct proc *p = container_of(work, struct proc, p_free_work);
 	void *hash_ret;
 	physaddr_t pa;
 
 	printd("[PID %d] freeing proc: %d\n", current ? current->pid : 0, p->pid);
-	// All parts of the kernel should have decref'd before __proc_free is called
-	assert(kref_refcnt(&p->p_kref) == 0);
 	assert(TAILQ_EMPTY(&p->alarmset.list));
 
 	if (p->strace) {
 		kref_put(&p->strace->procs);
 		kref_put(&p->strace->users);
 	}
+	sysc_lat_free(p);
+	kfree(p->vc_stats);
 	__vmm_struct_cleanup(p);
 	p->progname[0] = 0;
 	free_path(p, p->binary_path);
@@ -497,7 +563,8 @@ static void __proc_free(struct kref *kref)
 	kref_put(&p->fs_env.root->d_kref);
 	kref_put(&p->fs_env.pwd->d_kref);
 	/* now we'll finally decref files for the file-backed vmrs */
-	unmap_and_destroy_vmrs(p);
+	teardown_vmrs(p);
+	sysring_free(p);
 	frontend_proc_free(p);	/* TODO: please remove me one day */
 	/* Free any colors allocated to this process */
 	if (p->cache_colors_map != global_cache_colors_map) {
@@ -506,9 +573,7 @@ static void __proc_free(struct kref *kref)
 		cache_colors_map_free(p->cache_colors_map);
 	}
 	/* Remove us from the pid_hash and give our PID back (in that order). */
-	spin_lock(&pid_hash_lock);
-	hash_ret = hashtable_remove(pid_hash, (void*)(long)p->pid);
-	spin_unlock(&pid_hash_lock);
+	hash_ret = chash_remove(&pid_hash, p->pid);
 	/* might not be in the hash/ready, if we failed during proc creation */
 	if (hash_ret)
 		put_free_pid(p->pid);
@@ -529,8 +594,24 @@ static void __proc_free(struct kref *kref)
 
 	atomic_dec(&num_envs);
 
-	/* Dealloc the struct proc */
-	kmem_cache_free(proc_cache, p);
+	/* Dealloc the struct proc, once pid2proc() is done with it */
+	call_rcu(&p->p_rcu, __proc_free_rcu);
+}
+
+/* This is called by kref_put(), once the last reference to the process is
+ * gone.  Don't call this otherwise (it will panic).  Whoever dropped that ref
+ * might be the LL core or in the middle of a syscall, so we leave the actual
+ * freeing to __proc_free_work().  Until then, the memory counts as pending
+ * free. */
+static void __proc_free(struct kref *kref)
+{
+	struct proc *p = container_of(kref, struct proc, p_kref);
+
+	// All parts of the kernel should have decref'd before __proc_free is called
+	assert(kref_refcnt(&p->p_kref) == 0);
+	vmrs_pending_free(p);
+	INIT_WORK(&p->p_free_work, __proc_free_work);
+	queue_work(system_unbound_wq, &p->p_free_work);
 }
 
 /* Whether or not actor can control target.  TODO: do something reasonable here.
@@ -569,7 +650,7 @@ static void __set_proc_current(struct proc *p)
 	/* If the process wasn't here, then we need to load its address space. */
 	if (p != pcpui->cur_proc) {
 		proc_incref(p, 1);
-		lcr3(p->env_cr3);
+		proc_load_pgdir(p);
 		/* This is "leaving the process context" of the previous proc.  The
 		 * previous lcr3 unloaded the previous proc's context.  This should
 		 * rarely happen, since we usually proactively leave process context,
@@ -632,7 +713,7 @@ void proc_run_s(struct proc *p)
 			assert(!pcpui->owning_proc);
 			pcpui->owning_proc = p;
 			pcpui->owning_vcoreid = 0;
-			restore_vc_fp_state(vcpd);
+			restore_vc_fp_state(p, vcpd);
 			/* similar to the old __startcore, start them in vcore context if
 			 * they have notifs and aren't already in vcore context.  o/w, start
 			 * them wherever they were before (could be either vc ctx or not) */
@@ -774,7 +855,8 @@ void __proc_startcore(struct proc *p, struct user_context *ctx)
 	 * to block later and lose track of our address space. */
 	assert(!is_ktask(pcpui->cur_kthread));
 	__set_proc_current(p);
-	__set_cpu_state(pcpui, CPU_STATE_USER);
+	__set_cpu_state(pcpui, __proc_is_mcp(p) ? CPU_STATE_USER_MCP
+	                                        : CPU_STATE_USER_SCP);
 	proc_pop_ctx(ctx);
 }
 
@@ -898,6 +980,7 @@ void proc_destroy(struct proc *p)
 	 * Also note that any mmap'd files will still be mmapped.  You can close the
 	 * file after mmapping, with no effect. */
 	close_fdt(&p->open_files, FALSE);
+	vmm_proc_destroy(p);
 	/* Abort any abortable syscalls.  This won't catch every sleeper, but future
 	 * abortable sleepers are already prevented via the DYING_ABORT state.
 	 * (signalled DYING_ABORT, no new sleepers will block, and now we wake all
@@ -965,7 +1048,7 @@ int proc_change_to_m(struct proc *p)
 			/* Copy uthread0's context to VC 0's uthread slot */
 			copy_current_ctx_to(&vcpd->uthread_ctx);
 			clear_owning_proc(core_id());	/* so we don't restart */
-			save_vc_fp_state(vcpd);
+			save_vc_fp_state(p, vcpd);
 			/* Userspace needs to not fuck with notif_disabled before
 			 * transitioning to _M. */
 			if (vcpd->notif_disabled) {
@@ -1023,7 +1106,7 @@ uint32_t __proc_change_to_s(struct proc *p, uint32_t *pc_arr)
 	assert(current_ctx);
 	copy_current_ctx_to(&p->scp_ctx);
 	clear_owning_proc(core_id());	/* so we don't restart */
-	save_vc_fp_state(vcpd);
+	save_vc_fp_state(p, vcpd);
 	/* sending death, since it's not our job to save contexts or anything in
 	 * this case. */
 	num_revoked = __proc_take_allcores(p, pc_arr, FALSE);
@@ -1072,30 +1155,48 @@ static uint32_t get_pcoreid(struct proc *p, uint32_t vcoreid)
  *		Excess flagged FXRSTR: 42 ns
  * If we don't do it, we'll need to initialize every VCPD at process creation
  * time with a good FPU state (x86 control words are initialized as 0s, like the
- * rest of VCPD). */
-static void save_vc_fp_state(struct preempt_data *vcpd)
-{
-	save_fp_state(&vcpd->preempt_anc);
+ * rest of VCPD).
+ *
+ * Plenty of vcores never touch the FPU (or SIMD), and if the FPU is still in
+ * its initial configuration, we just mark VCPD's copy as initial instead of
+ * saving the whole thing. */
+static void save_vc_fp_state(struct proc *p, struct preempt_data *vcpd)
+{
+	atomic_inc(&p->fp_saves);
+	if (fp_state_is_init()) {
+		save_fp_state_init(&vcpd->preempt_anc);
+		atomic_inc(&p->fp_saves_skipped);
+	} else {
+		save_fp_state(&vcpd->preempt_anc);
+	}
 	vcpd->rflags |= VC_FPU_SAVED;
 }
 
 /* Conditionally restores the FP state from VCPD.  If the state was not valid,
- * we don't bother restoring and just initialize the FPU. */
-static void restore_vc_fp_state(struct preempt_data *vcpd)
+ * we don't bother restoring and just initialize the FPU.  Either way, there's
+ * nothing to do if that's what the FPU already has. */
+static void restore_vc_fp_state(struct proc *p, struct preempt_data *vcpd)
 {
-	if (vcpd->rflags & VC_FPU_SAVED) {
+	bool saved = vcpd->rflags & VC_FPU_SAVED;
+
+	vcpd->rflags &= ~VC_FPU_SAVED;
+	atomic_inc(&p->fp_restores);
+	if ((!saved || fp_state_saved_is_init(&vcpd->preempt_anc)) &&
+	    fp_state_is_init()) {
+		atomic_inc(&p->fp_restores_skipped);
+		return;
+	}
+	if (saved)
 		restore_fp_state(&vcpd->preempt_anc);
-		vcpd->rflags &= ~VC_FPU_SAVED;
-	} else {
+	else
 		init_fp_state();
-	}
 }
 
 /* Helper for SCPs, saves the core's FPU state into the VCPD vc0 slot */
 void __proc_save_fpu_s(struct proc *p)
 {
 	struct preempt_data *vcpd = &p->procdata->vcore_preempt_data[0];
-	save_vc_fp_state(vcpd);
+	save_vc_fp_state(p, vcpd);
 }
 
 /* Helper: saves the SCP's GP tf state and unmaps vcore 0.  This does *not* save
@@ -1487,6 +1588,16 @@ bool proc_preempt_core(struct proc *p, uint32_t pcoreid, uint64_t usec)
 	return retval;
 }
 
+/* Warns p that pcoreid will be preempted at tsc 'when', without preempting it.
+ * Does nothing if p no longer has the core. */
+void proc_preempt_warn_core(struct proc *p, uint32_t pcoreid, uint64_t when)
+{
+	spin_lock(&p->proc_lock);
+	if ((p->state == PROC_RUNNING_M) && is_mapped_vcore(p, pcoreid))
+		__proc_preempt_warn(p, get_vcoreid(p, pcoreid), when);
+	spin_unlock(&p->proc_lock);
+}
+
 /* Warns and preempts all from p.  No delaying / alarming, or anything.  The
  * warning will be for u usec from now. */
 void proc_preempt_all(struct proc *p, uint64_t usec)
@@ -1832,10 +1943,7 @@ uintptr_t switch_to(struct proc *new_p)
 	/* If we aren't the proc already, then switch to it */
 	if (old_proc != new_p) {
 		pcpui->cur_proc = new_p;				/* uncounted ref */
-		if (new_p)
-			lcr3(new_p->env_cr3);
-		else
-			lcr3(boot_cr3);
+		proc_load_pgdir(new_p);
 	}
 	ret = (uintptr_t)old_proc;
 	if (is_ktask(kth)) {
@@ -1866,49 +1974,52 @@ void switch_back(struct proc *new_p, uintptr_t old_ret)
 	old_proc = (struct proc*)old_ret;
 	if (old_proc != new_p) {
 		pcpui->cur_proc = old_proc;
-		if (old_proc)
-			lcr3(old_proc->env_cr3);
-		else
-			lcr3(boot_cr3);
+		proc_load_pgdir(old_proc);
 	}
 }
 
-/* Will send a TLB shootdown message to every vcore in the main address space
- * (aka, all vcores for now).  The message will take the start and end virtual
- * addresses as well, in case we want to be more clever about how much we
- * shootdown and batching our messages.  Should do the sanity about rounding up
- * and down in this function too.
+/* Loads p's page tables (the kernel's if p is 0), noting it for
+ * proc_tlbshootdown().  Doesn't touch cur_proc or any refcounts. */
+void proc_load_pgdir(struct proc *p)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+
+	pcpui->pgdir_proc = p;
+	/* Publish pgdir_proc before the arch code reads p->tlb_gen.  Pairs with
+	 * the mb() in proc_tlbshootdown(). */
+	mb();
+	arch_pgdir_load(p);
+}
+
+/* Shoots down p's TLB entries for [start, end), or everything if end <= start.
+ *
+ * First we give p a new tlb_gen.  A core that loads p's page tables after that
+ * flushes anything it kept from before (see arch_pgdir_load()), so we only
+ * need to message the cores that have p loaded right now.  That includes
+ * kthreads that switch_to()ed p, not just p's vcores.  We flush our own TLB
+ * directly, and the others get one immediate kmsg each.
  *
- * Would be nice to have a broadcast kmsg at this point.  Note this may send a
- * message to the calling core (interrupting it, possibly while holding the
- * proc_lock).  We don't need to process routine messages since it's an
- * immediate message. */
+ * Callers with lots of little changes should gather them into one range, like
+ * munmap does. */
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end)
 {
-	/* TODO: need a better way to find cores running our address space.  we can
-	 * have kthreads running syscalls, async calls, processes being created. */
-	struct vcore *vc_i;
-	/* TODO: we might be able to avoid locking here in the future (we must hit
-	 * all online, and we can check __mapped).  it'll be complicated. */
-	spin_lock(&p->proc_lock);
-	switch (p->state) {
-		case (PROC_RUNNING_S):
-			tlbflush();
-			break;
-		case (PROC_RUNNING_M):
-			/* TODO: (TLB) sanity checks and rounding on the ranges */
-			TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
-				send_kernel_message(vc_i->pcoreid, __tlbshootdown, start, end,
-				                    0, KMSG_IMMEDIATE);
-			}
-			break;
-		default:
-			/* TODO: til we fix shootdowns, there are some odd cases where we
-			 * have the address space loaded, but the state is in transition. */
-			if (p == current)
-				tlbflush();
+	struct core_set cset;
+	uint32_t coreid = core_id();
+
+	ACCESS_ONCE(p->tlb_gen) = new_tlb_gen();
+	/* New gen before reading pgdir_proc.  Pairs with proc_load_pgdir(). */
+	mb();
+	core_set_init(&cset);
+	for (int i = 0; i < num_cores; i++) {
+		if (i == coreid)
+			continue;
+		if (ACCESS_ONCE(per_cpu_info[i].pgdir_proc) == p)
+			core_set_setcpu(&cset, i);
 	}
-	spin_unlock(&p->proc_lock);
+	if (per_cpu_info[coreid].pgdir_proc == p)
+		tlb_flush_range(start, end);
+	send_kernel_message_cores(&cset, __tlbshootdown, start, end, 0,
+	                          KMSG_IMMEDIATE);
 }
 
 /* Helper, used by __startcore and __set_curctx, which sets up cur_ctx to run a
@@ -1970,7 +2081,7 @@ static void __set_curctx_to_vcoreid(struct proc *p, uint32_t vcoreid,
 	 * Note this can cause a GP fault on x86 if the state is corrupt.  In lieu
 	 * of reading in the huge FP state and mucking with mxcsr_mask, we should
 	 * handle this like a KPF on user code. */
-	restore_vc_fp_state(vcpd);
+	restore_vc_fp_state(p, vcpd);
 	/* cur_ctx was built above (in actual_ctx), now use it */
 	pcpui->cur_ctx = &pcpui->actual_ctx;
 	/* this cur_ctx will get run when the kernel returns / idles */
@@ -2061,7 +2172,7 @@ int proc_change_to_vcore(struct proc *p, uint32_t new_vcoreid,
 		/* need to set up the calling vcore's ctx so that it'll get restarted by
 		 * __startcore, to make the caller look like it was preempted. */
 		copy_current_ctx_to(&caller_vcpd->vcore_ctx);
-		save_vc_fp_state(caller_vcpd);
+		save_vc_fp_state(p, caller_vcpd);
 	}
 	/* Mark our core as preempted (for userspace recovery).  Userspace checks
 	 * this in handle_indirs, and it needs to check the mbox regardless of
@@ -2138,7 +2249,7 @@ void __startcore(uint32_t srcid, long a0, long a1, long a2)
 	 * with __proc_give_cores() and __proc_run_m(). */
 	if (!pcpui->cur_proc) {
 		pcpui->cur_proc = p_to_run;	/* install the ref to cur_proc */
-		lcr3(p_to_run->env_cr3);	/* load the page tables to match cur_proc */
+		proc_load_pgdir(p_to_run);	/* load the page tables to match cur_proc */
 	} else {
 		proc_decref(p_to_run);		/* can't install, decref the extra one */
 	}
@@ -2234,7 +2345,7 @@ void __preempt(uint32_t srcid, long a0, long a1, long a2)
 	 * hold the K_LOCK (preventing userspace from starting a fresh STEALING
 	 * phase concurrently). */
 	if (!(atomic_read(&vcpd->flags) & VC_UTHREAD_STEALING))
-		save_vc_fp_state(vcpd);
+		save_vc_fp_state(p, vcpd);
 	/* Mark the vcore as preempted and unlock (was locked by the sender). */
 	atomic_or(&vcpd->flags, VC_PREEMPTED);
 	atomic_and(&vcpd->flags, ~VC_K_LOCK);
@@ -2273,11 +2384,12 @@ void __death(uint32_t srcid, long a0, long a1, long a2)
 }
 
 /* Kernel message handler, usually sent IMMEDIATE, to shoot down virtual
- * addresses from a0 to a1. */
+ * addresses from a0 to a1.  We might have moved on to another address space
+ * since it was sent, in which case this flush is wasted but harmless: the
+ * shootdown's new tlb_gen covers us. */
 void __tlbshootdown(uint32_t srcid, long a0, long a1, long a2)
 {
-	/* TODO: (TLB) something more intelligent with the range */
-	tlbflush();
+	tlb_flush_range(a0, a1);
 }
 
 void print_allpids(void)
@@ -2298,9 +2410,9 @@ void print_allpids(void)
 	printk("     PID Name %-*s State      Parent    \n",
 	       PROC_PROGNAME_SZ - 5, "");
 	printk("------------------------------%s\n", dashes);
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, print_proc_state, NULL);
-	spin_unlock(&pid_hash_lock);
+	rcu_read_lock();
+	chash_for_each(&pid_hash, print_proc_state, NULL);
+	rcu_read_unlock();
 }
 
 void proc_get_set(struct process_set *pset)
@@ -2310,9 +2422,9 @@ void proc_get_set(struct process_set *pset)
 		struct proc *p = (struct proc*) item;
 		struct process_set *pset = (struct process_set *) opaque;
 
-		if (pset->num_processes < pset->size) {
-			proc_incref(p, 1);
-
+		/* It might be dying, with its refcnt already at 0 */
+		if (pset->num_processes < pset->size &&
+		    kref_get_not_zero(&p->p_kref, 1)) {
 			pset->procs[pset->num_processes] = p;
 			pset->num_processes++;
 		}
@@ -2331,9 +2443,9 @@ void proc_get_set(struct process_set *pset)
 		if (!pset->procs)
 			error(-ENOMEM, ERROR_FIXME);
 
-		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, enum_proc, pset);
-		spin_unlock(&pid_hash_lock);
+		rcu_read_lock();
+		chash_for_each(&pid_hash, enum_proc, pset);
+		rcu_read_unlock();
 
 	} while (pset->num_processes == pset->size);
 }
@@ -2438,12 +2550,12 @@ void check_my_owner(void)
 			if (vc_i->pcoreid == core_id()) {
 				/* Immediate message was sent, we should get it when we enable
 				 * interrupts, which should cause us to skip cpu_halt() */
-				if (!STAILQ_EMPTY(&pcpui->immed_amsgs))
+				if (!STAILQ_EMPTY(&pcpui->immed_amsgs) ||
+				    pcpui->immed_amsgs_in)
 					continue;
 				printk("Owned pcore (%d) has no owner, by %p, vc %d!\n",
 				       core_id(), p, vcore2vcoreid(p, vc_i));
 				spin_unlock(&p->proc_lock);
-				spin_unlock(&pid_hash_lock);
 				monitor(0);
 			}
 		}
@@ -2452,8 +2564,8 @@ void check_my_owner(void)
 	assert(!irq_is_enabled());
 	extern int booting;
 	if (!booting && !pcpui->owning_proc) {
-		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, shazbot, NULL);
-		spin_unlock(&pid_hash_lock);
+		rcu_read_lock();
+		chash_for_each(&pid_hash, shazbot, NULL);
+		rcu_read_unlock();
 	}
 }
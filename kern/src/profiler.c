@@ -19,7 +19,22 @@
  * - profiler_control_trace() controls the per-core trace collection.  When it
  *   is disabled, it also flushes the per-core blocks to the central queue.
  * - The collection of mmap and comm samples is independent of trace collection.
- *   Those will occur whenever the profiler is open (refcnt check, for now). */
+ *   Those will occur whenever the profiler is open (refcnt check, for now).
+ *
+ * In streaming mode ("prof_stream on"), each core passes its full blocks to its
+ * own Qspsc queue instead of the central queue, so cores never contend on a
+ * lock.  Readers of kpdata drain the per-core queues into the central queue as
+ * they go, and a block is also handed off once it is too old, so that samples
+ * show up while we're still profiling, even at low rates.
+ *
+ * In off-CPU mode ("prof_offcpu on"), sem_down() notes the backtrace of each
+ * kthread that blocks, and when the kthread is restarted, it emits a
+ * PROFTYPE_OFFCPU_TRACE64 with how long it was blocked.  Everything that sleeps
+ * (CVs, rendezes, qlocks) goes through sem_down(), so this covers all of them.
+ *
+ * Whenever a core drops samples, be it for lack of memory or room in a queue,
+ * it counts them.  Draining the cores puts those counts in the stream as
+ * PROFTYPE_DROPPED records. */
 
 #include <ros/common.h>
 #include <ros/mman.h>
@@ -47,17 +62,30 @@
 
 #define VBE_MAX_SIZE(t) ((8 * sizeof(t) + 6) / 7)
 
+#define PROFILER_STREAM_MS		100
+
 /* Do not rely on the contents of the PCPU ctx with IRQs enabled. */
 struct profiler_cpu_context {
 	struct block *block;
 	int cpu;
 	int tracing;
+	size_t nr_records;			/* in block */
+	uint64_t block_tstamp;		/* of block's first record, when streaming */
+	struct queue *stream_q;		/* we produce, drainers consume */
+	/* Only this core writes dropped_data_cnt.  Drainers track what they have
+	 * reported, under profiler_drain_mtx. */
 	size_t dropped_data_cnt;
+	size_t dropped_reported;
 };
 
 static int profiler_queue_limit = 64 * 1024 * 1024;
 static size_t profiler_cpu_buffer_size = 65536;
+static unsigned int profiler_stream_ms;	/* max block age, 0 if off */
+static bool profiler_tracing;
+static bool profiler_offcpu;
+bool profiler_offcpu_tracing;
 static qlock_t profiler_mtx = QLOCK_INITIALIZER(profiler_mtx);
+static qlock_t profiler_drain_mtx = QLOCK_INITIALIZER(profiler_drain_mtx);
 static struct kref profiler_kref;
 static struct profiler_cpu_context *profiler_percpu_ctx;
 static struct queue *profiler_queue;
@@ -79,18 +107,34 @@ static inline char *vb_encode_uint64(char *data, uint64_t n)
 	return data;
 }
 
-static struct block *profiler_buffer_write(struct profiler_cpu_context *cpu_buf,
-                                           struct block *b)
+/* Hands off the core's block.  If it won't fit, its records are dropped. */
+static void profiler_buffer_pass(struct profiler_cpu_context *cpu_buf,
+                                 struct block *b)
 {
+	struct queue *q = profiler_stream_ms ? cpu_buf->stream_q : profiler_queue;
+
 	/* qpass will drop b if the queue is over its limit.  we're willing to lose
 	 * traces, but we won't lose 'control' events, such as MMAP and PID. */
-	if (b) {
-		if (qpass(profiler_queue, b) < 0)
-			cpu_buf->dropped_data_cnt++;
-	}
+	if (qpass(q, b) < 0)
+		cpu_buf->dropped_data_cnt += cpu_buf->nr_records;
+	cpu_buf->nr_records = 0;
+}
+
+static struct block *profiler_buffer_write(struct profiler_cpu_context *cpu_buf,
+                                           struct block *b)
+{
+	if (b)
+		profiler_buffer_pass(cpu_buf, b);
 	return block_alloc(profiler_cpu_buffer_size, MEM_ATOMIC);
 }
 
+/* When streaming, a block with old records goes out even if it isn't full. */
+static bool profiler_block_expired(struct profiler_cpu_context *cpu_buf)
+{
+	return profiler_stream_ms && cpu_buf->nr_records &&
+	       (nsec() - cpu_buf->block_tstamp > profiler_stream_ms * 1000000ULL);
+}
+
 /* Helper, paired with profiler_cpu_buffer_write_commit.  Ensures there is
  * enough room in the pcpu block for our write.  May alloc a new one.
  *
@@ -100,10 +144,13 @@ static char *profiler_cpu_buffer_write_reserve(
 {
 	struct block *b = cpu_buf->block;
 
-	if (unlikely((!b) || (b->lim - b->wp) < size)) {
+	if (unlikely((!b) || (b->lim - b->wp) < size ||
+	             profiler_block_expired(cpu_buf))) {
 		cpu_buf->block = b = profiler_buffer_write(cpu_buf, b);
-		if (unlikely(!b))
+		if (unlikely(!b)) {
+			cpu_buf->dropped_data_cnt++;
 			return NULL;
+		}
 	}
 	*pb = b;
 
@@ -117,6 +164,8 @@ static inline void profiler_cpu_buffer_write_commit(
 	struct profiler_cpu_context *cpu_buf, struct block *b, size_t size)
 {
 	b->wp += size;
+	if (!cpu_buf->nr_records++ && profiler_stream_ms)
+		cpu_buf->block_tstamp = nsec();
 }
 
 static inline size_t profiler_max_envelope_size(void)
@@ -124,12 +173,68 @@ static inline size_t profiler_max_envelope_size(void)
 	return 2 * VBE_MAX_SIZE(uint64_t);
 }
 
+/* Encodes a PROFTYPE_KERN_TRACE64 record, envelope and all, at ptr.  ptr needs
+ * profiler_kernel_trace64_size(count) bytes.  Returns the end of the record. */
+char *profiler_encode_kernel_trace64(char *ptr, const uintptr_t *trace,
+                                     size_t count, uint64_t info, uint32_t pid,
+                                     uint16_t cpu)
+{
+	size_t size = sizeof(struct proftype_kern_trace64) +
+		count * sizeof(uint64_t);
+	struct proftype_kern_trace64 *record;
+
+	ptr = vb_encode_uint64(ptr, PROFTYPE_KERN_TRACE64);
+	ptr = vb_encode_uint64(ptr, size);
+
+	record = (struct proftype_kern_trace64 *) ptr;
+	ptr += size;
+
+	record->info = info;
+	record->tstamp = nsec();
+	record->pid = pid;
+	record->cpu = cpu;
+	record->num_traces = count;
+	for (size_t i = 0; i < count; i++)
+		record->trace[i] = (uint64_t) trace[i];
+	return ptr;
+}
+
+size_t profiler_kernel_trace64_size(size_t count)
+{
+	return sizeof(struct proftype_kern_trace64) + count * sizeof(uint64_t) +
+	       profiler_max_envelope_size();
+}
+
 static void profiler_push_kernel_trace64(struct profiler_cpu_context *cpu_buf,
                                          const uintptr_t *trace, size_t count,
                                          uint64_t info)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	size_t size = sizeof(struct proftype_kern_trace64) +
+	struct block *b;
+	void *resptr, *ptr;
+	uint32_t pid;
+
+	assert(!irq_is_enabled());
+	resptr = profiler_cpu_buffer_write_reserve(
+	    cpu_buf, profiler_kernel_trace64_size(count), &b);
+	ptr = resptr;
+
+	if (likely(ptr)) {
+		if (is_ktask(pcpui->cur_kthread) || !pcpui->cur_proc)
+			pid = -1;
+		else
+			pid = pcpui->cur_proc->pid;
+		ptr = profiler_encode_kernel_trace64(ptr, trace, count, info, pid,
+		                                     cpu_buf->cpu);
+		profiler_cpu_buffer_write_commit(cpu_buf, b, ptr - resptr);
+	}
+}
+
+static void profiler_push_user_trace64(struct profiler_cpu_context *cpu_buf,
+                                       struct proc *p, const uintptr_t *trace,
+                                       size_t count, uint64_t info)
+{
+	size_t size = sizeof(struct proftype_user_trace64) +
 		count * sizeof(uint64_t);
 	struct block *b;
 	void *resptr, *ptr;
@@ -140,20 +245,17 @@ static void profiler_push_kernel_trace64(struct profiler_cpu_context *cpu_buf,
 	ptr = resptr;
 
 	if (likely(ptr)) {
-		struct proftype_kern_trace64 *record;
+		struct proftype_user_trace64 *record;
 
-		ptr = vb_encode_uint64(ptr, PROFTYPE_KERN_TRACE64);
+		ptr = vb_encode_uint64(ptr, PROFTYPE_USER_TRACE64);
 		ptr = vb_encode_uint64(ptr, size);
 
-		record = (struct proftype_kern_trace64 *) ptr;
+		record = (struct proftype_user_trace64 *) ptr;
 		ptr += size;
 
 		record->info = info;
 		record->tstamp = nsec();
-		if (is_ktask(pcpui->cur_kthread) || !pcpui->cur_proc)
-			record->pid = -1;
-		else
-			record->pid = pcpui->cur_proc->pid;
+		record->pid = p->pid;
 		record->cpu = cpu_buf->cpu;
 		record->num_traces = count;
 		for (size_t i = 0; i < count; i++)
@@ -163,11 +265,12 @@ static void profiler_push_kernel_trace64(struct profiler_cpu_context *cpu_buf,
 	}
 }
 
-static void profiler_push_user_trace64(struct profiler_cpu_context *cpu_buf,
-                                       struct proc *p, const uintptr_t *trace,
-                                       size_t count, uint64_t info)
+static void profiler_push_offcpu_trace64(struct profiler_cpu_context *cpu_buf,
+                                         const uintptr_t *trace, size_t count,
+                                         uint64_t start)
 {
-	size_t size = sizeof(struct proftype_user_trace64) +
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	size_t size = sizeof(struct proftype_offcpu_trace64) +
 		count * sizeof(uint64_t);
 	struct block *b;
 	void *resptr, *ptr;
@@ -178,17 +281,20 @@ static void profiler_push_user_trace64(struct profiler_cpu_context *cpu_buf,
 	ptr = resptr;
 
 	if (likely(ptr)) {
-		struct proftype_user_trace64 *record;
+		struct proftype_offcpu_trace64 *record;
 
-		ptr = vb_encode_uint64(ptr, PROFTYPE_USER_TRACE64);
+		ptr = vb_encode_uint64(ptr, PROFTYPE_OFFCPU_TRACE64);
 		ptr = vb_encode_uint64(ptr, size);
 
-		record = (struct proftype_user_trace64 *) ptr;
+		record = (struct proftype_offcpu_trace64 *) ptr;
 		ptr += size;
 
-		record->info = info;
 		record->tstamp = nsec();
-		record->pid = p->pid;
+		record->duration = record->tstamp - start;
+		if (is_ktask(pcpui->cur_kthread) || !pcpui->cur_proc)
+			record->pid = -1;
+		else
+			record->pid = pcpui->cur_proc->pid;
 		record->cpu = cpu_buf->cpu;
 		record->num_traces = count;
 		for (size_t i = 0; i < count; i++)
@@ -254,6 +360,26 @@ static void profiler_push_new_process(struct proc *p)
 	}
 }
 
+static void profiler_push_dropped(uint16_t cpu, uint64_t nr_dropped)
+{
+	char buf[sizeof(struct proftype_dropped) + 2 * VBE_MAX_SIZE(uint64_t)];
+	size_t size = sizeof(struct proftype_dropped);
+	struct proftype_dropped *record;
+	char *ptr = buf;
+
+	ptr = vb_encode_uint64(ptr, PROFTYPE_DROPPED);
+	ptr = vb_encode_uint64(ptr, size);
+
+	record = (struct proftype_dropped *) ptr;
+	ptr += size;
+
+	record->tstamp = nsec();
+	record->nr_dropped = nr_dropped;
+	record->cpu = cpu;
+
+	qiwrite(profiler_queue, buf, (int) (ptr - buf));
+}
+
 static void profiler_emit_current_system_status(void)
 {
 	void enum_proc(struct vm_region *vmr, void *opaque)
@@ -283,8 +409,42 @@ static void profiler_emit_current_system_status(void)
 	proc_free_set(&pset);
 }
 
+static void free_stream_queues(void)
+{
+	profiler_stream_ms = 0;
+	for (int i = 0; i < num_cores; i++) {
+		struct profiler_cpu_context *b = &profiler_percpu_ctx[i];
+
+		qfree(b->stream_q);
+		b->stream_q = NULL;
+	}
+}
+
+/* Each core gets a share of the queue limit.  We drain them only when the
+ * central queue is empty, so they are what actually bounds our memory. */
+static void alloc_stream_queues(unsigned int stream_ms)
+{
+	int limit = MAX(profiler_queue_limit / num_cores,
+	                (int) (4 * profiler_cpu_buffer_size));
+
+	for (int i = 0; i < num_cores; i++) {
+		struct profiler_cpu_context *b = &profiler_percpu_ctx[i];
+
+		if (b->stream_q)
+			continue;
+		b->stream_q = qopen(limit, Qspsc, NULL, NULL);
+		if (!b->stream_q) {
+			free_stream_queues();
+			error(ENOMEM, "Unable to allocate profiler stream queues");
+		}
+	}
+	profiler_stream_ms = stream_ms;
+}
+
 static void free_cpu_buffers(void)
 {
+	if (profiler_percpu_ctx)
+		free_stream_queues();
 	kfree(profiler_percpu_ctx);
 	profiler_percpu_ctx = NULL;
 
@@ -355,6 +515,37 @@ int profiler_configure(struct cmdbuf *cb)
 			cb->f[1], 1024, 16 * 1024, 1024 * 1024);
 		return 1;
 	}
+	if (!strcmp(cb->f[0], "prof_stream")) {
+		if (cb->nf < 2)
+			error(EFAIL, "prof_stream on [MS]|off");
+		if (profiler_tracing)
+			error(EFAIL, "Profiler already running");
+		error_assert(EINVAL, profiler_percpu_ctx);
+		if (!strcmp(cb->f[1], "on")) {
+			alloc_stream_queues(cb->nf > 2 ?
+			                    profiler_get_checked_value(cb->f[2], 1, 1,
+			                                               60 * 1000) :
+			                    PROFILER_STREAM_MS);
+		} else if (!strcmp(cb->f[1], "off")) {
+			free_stream_queues();
+		} else {
+			error(EFAIL, "prof_stream on [MS]|off");
+		}
+		return 1;
+	}
+	if (!strcmp(cb->f[0], "prof_offcpu")) {
+		if (cb->nf < 2)
+			error(EFAIL, "prof_offcpu on|off");
+		if (profiler_tracing)
+			error(EFAIL, "Profiler already running");
+		if (!strcmp(cb->f[1], "on"))
+			profiler_offcpu = TRUE;
+		else if (!strcmp(cb->f[1], "off"))
+			profiler_offcpu = FALSE;
+		else
+			error(EFAIL, "prof_offcpu on|off");
+		return 1;
+	}
 
 	return 0;
 }
@@ -364,6 +555,8 @@ void profiler_append_configure_usage(char *msgbuf, size_t buflen)
 	const char * const cmds[] = {
 		"prof_qlimit",
 		"prof_cpubufsz",
+		"prof_stream",
+		"prof_offcpu",
 	};
 
 	for (int i = 0; i < ARRAY_SIZE(cmds); i++) {
@@ -436,13 +629,46 @@ static void profiler_cpu_flush(struct profiler_cpu_context *cpu_buf)
 
 	disable_irqsave(&irq_state);
 	if (cpu_buf->block && profiler_queue) {
-		qibwrite(profiler_queue, cpu_buf->block);
-
+		if (profiler_stream_ms) {
+			profiler_buffer_pass(cpu_buf, cpu_buf->block);
+		} else {
+			qibwrite(profiler_queue, cpu_buf->block);
+			cpu_buf->nr_records = 0;
+		}
 		cpu_buf->block = NULL;
 	}
 	enable_irqsave(&irq_state);
 }
 
+/* Moves a core's blocks to the central queue, and reports the samples it
+ * dropped since last time.  The core's queue is Qspsc, and we're its only
+ * consumer, so neither side takes a lock for the blocks. */
+static void profiler_drain_cpu(struct profiler_cpu_context *cpu_buf)
+{
+	struct block *b;
+	size_t dropped;
+
+	if (cpu_buf->stream_q) {
+		/* The per-core limits already bound what we hold, and we only drain
+		 * an empty queue. */
+		while ((b = qget(cpu_buf->stream_q)))
+			qpassnolim(profiler_queue, b);
+	}
+	dropped = ACCESS_ONCE(cpu_buf->dropped_data_cnt);
+	if (dropped != cpu_buf->dropped_reported) {
+		profiler_push_dropped(cpu_buf->cpu, dropped - cpu_buf->dropped_reported);
+		cpu_buf->dropped_reported = dropped;
+	}
+}
+
+static void profiler_drain_cpus(void)
+{
+	qlock(&profiler_drain_mtx);
+	for (int i = 0; i < num_cores; i++)
+		profiler_drain_cpu(profiler_get_cpu_ctx(i));
+	qunlock(&profiler_drain_mtx);
+}
+
 static void profiler_core_trace_enable(void *opaque)
 {
 	struct profiler_cpu_context *cpu_buf = profiler_get_cpu_ctx(core_id());
@@ -469,12 +695,17 @@ void profiler_start(void)
 	assert(profiler_queue);
 	profiler_control_trace(1);
 	qreopen(profiler_queue);
+	profiler_tracing = TRUE;
+	profiler_offcpu_tracing = profiler_offcpu;
 }
 
 void profiler_stop(void)
 {
 	assert(profiler_queue);
+	profiler_tracing = FALSE;
+	profiler_offcpu_tracing = FALSE;
 	profiler_control_trace(0);
+	profiler_drain_cpus();
 	qhangup(profiler_queue, 0);
 }
 
@@ -494,6 +725,7 @@ void profiler_trace_data_flush(void)
 	core_set_init(&cset);
 	core_set_fill_available(&cset);
 	smp_do_in_cores(&cset, profiler_core_flush, NULL);
+	profiler_drain_cpus();
 }
 
 void profiler_push_kernel_backtrace(uintptr_t *pc_list, size_t nr_pcs,
@@ -508,6 +740,19 @@ void profiler_push_kernel_backtrace(uintptr_t *pc_list, size_t nr_pcs,
 	}
 }
 
+/* Called by a kthread that was restarted after blocking at pc_list, at start */
+void profiler_push_offcpu_backtrace(uintptr_t *pc_list, size_t nr_pcs,
+                                    uint64_t start)
+{
+	if (kref_get_not_zero(&profiler_kref, 1)) {
+		struct profiler_cpu_context *cpu_buf = profiler_get_cpu_ctx(core_id());
+
+		if (profiler_percpu_ctx && cpu_buf->tracing)
+			profiler_push_offcpu_trace64(cpu_buf, pc_list, nr_pcs, start);
+		kref_put(&profiler_kref);
+	}
+}
+
 void profiler_push_user_backtrace(uintptr_t *pc_list, size_t nr_pcs,
                                   uint64_t info)
 {
@@ -526,9 +771,24 @@ int profiler_size(void)
 	return profiler_queue ? qlen(profiler_queue) : 0;
 }
 
+/* When streaming, nothing wakes us when a core's queue gets a block, so we
+ * poll them until there's something to read or the profiler stops.  Once it
+ * stops, profiler_stop() drains the cores and hangs up the queue. */
 int profiler_read(void *va, int n)
 {
-	return profiler_queue ? qread(profiler_queue, va, n) : 0;
+	if (!profiler_queue)
+		return 0;
+	while (profiler_stream_ms && ACCESS_ONCE(profiler_tracing) &&
+	       !qlen(profiler_queue)) {
+		if (!kref_get_not_zero(&profiler_kref, 1))
+			break;
+		profiler_drain_cpus();
+		kref_put(&profiler_kref);
+		if (qlen(profiler_queue))
+			break;
+		kthread_usleep(profiler_stream_ms * 1000);
+	}
+	return qread(profiler_queue, va, n);
 }
 
 void profiler_notify_mmap(struct proc *p, uintptr_t addr, size_t size, int prot,
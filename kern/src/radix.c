@@ -2,7 +2,9 @@
  * Barret Rhoden <brho@cs.berkeley.edu>
  * See LICENSE for details.
  *
- * Radix Trees!  Just the basics, doesn't do tagging or anything fancy. */
+ * Radix Trees!  Just the basics, doesn't do tagging or anything fancy.
+ *
+ * Lookups may run without the writer's lock, under RCU.  See radix.h. */
 
 #include <ros/errno.h>
 #include <radix.h>
@@ -42,22 +44,35 @@ void radix_tree_destroy(struct radix_tree *tree)
 	panic("Not implemented");
 }
 
-/* Attempts to insert an item in the tree at the given key.  ENOMEM if we ran
- * out of memory, EEXIST if an item is already in the tree.  On success, will
- * also return the slot pointer, if requested. */
-int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
-                 void ***slot_p)
+static void __radix_node_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(radix_kcache, container_of(head, struct radix_node, rcu));
+}
+
+/* Returns TRUE if key is within the range of keys under r_node */
+static bool __radix_node_covers(struct radix_node *r_node, unsigned long key)
+{
+	unsigned int shift = LOG_RNODE_SLOTS * r_node->height;
+
+	if (shift >= sizeof(unsigned long) * 8)
+		return TRUE;
+	return !(key >> shift);
+}
+
+/* Makes the tree tall enough for key, adding levels at the top.  This will
+ * also create the initial node (upper bound starts at 0).  Lockless readers
+ * see either the old root or the new one, which is ready before it is
+ * published. */
+static int __radix_grow_to(struct radix_tree *tree, unsigned long key)
 {
-	printd("RADIX: insert %p at %d\n", item, key);
 	struct radix_node *r_node;
-	void **slot;
-	/* Is the tree tall enough?  if not, it needs to grow a level.  This will
-	 * also create the initial node (upper bound starts at 0). */
+
 	while (key >= tree->upper_bound) {
 		r_node = kmem_cache_alloc(radix_kcache, 0);
 		if (!r_node)
 			return -ENOMEM;
 		memset(r_node, 0, sizeof(struct radix_node));
+		r_node->height = tree->depth + 1;
 		if (tree->root) {
 			/* tree->root is the old root, now a child of the future root */
 			r_node->items[0] = tree->root;
@@ -69,11 +84,29 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
 			r_node->leaf = TRUE;
 			r_node->parent = 0;
 		}
-		tree->root = r_node;
 		r_node->my_slot = &tree->root;
+		rcu_assign_pointer(tree->root, r_node);
 		tree->depth++;
 		tree->upper_bound = 1ULL << (LOG_RNODE_SLOTS * tree->depth);
 	}
+	return 0;
+}
+
+/* Attempts to insert an item in the tree at the given key.  ENOMEM if we ran
+ * out of memory, EEXIST if an item is already in the tree.  On success, will
+ * also return the slot pointer, if requested. */
+int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
+                 void ***slot_p)
+{
+	printd("RADIX: insert %p at %d\n", item, key);
+	struct radix_node *r_node;
+	void **slot;
+	int ret;
+
+	/* Is the tree tall enough?  if not, it needs to grow a level. */
+	ret = __radix_grow_to(tree, key);
+	if (ret)
+		return ret;
 	assert(tree->root);
 	/* the tree now thinks it is tall enough, so find the last node, insert in
 	 * it, etc */
@@ -82,19 +115,56 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
 	slot = &r_node->items[key & (NR_RNODE_SLOTS - 1)];
 	if (*slot)
 		return -EEXIST;
-	*slot = item;
+	rcu_assign_pointer(*slot, item);
 	r_node->num_items++;
 	if (slot_p)
 		*slot_p = slot;
 	return 0;
 }
 
+/* Inserts items[i] at key first + i, for up to nr items, walking down to each
+ * leaf once.  Stops at the first key that already has an item or that we
+ * couldn't get memory for.  Returns the number inserted.  If slots is
+ * non-zero, it gets each inserted item's slot. */
+unsigned int radix_gang_insert(struct radix_tree *tree, unsigned long first,
+                               void **items, unsigned int nr, void ***slots)
+{
+	struct radix_node *r_node = 0;
+	unsigned long key;
+	void **slot;
+	unsigned int i;
+
+	if (!nr)
+		return 0;
+	/* don't wrap past the last key */
+	if (first + nr - 1 < first)
+		nr = -first;
+	if (__radix_grow_to(tree, first + nr - 1))
+		return 0;
+	for (i = 0; i < nr; i++) {
+		key = first + i;
+		if (!r_node || !(key & (NR_RNODE_SLOTS - 1)))
+			r_node = __radix_lookup_node(tree, key, TRUE);
+		if (!r_node)
+			break;
+		slot = &r_node->items[key & (NR_RNODE_SLOTS - 1)];
+		if (*slot)
+			break;
+		rcu_assign_pointer(*slot, items[i]);
+		r_node->num_items++;
+		if (slots)
+			slots[i] = slot;
+	}
+	return i;
+}
+
 /* Removes an item from it's parent's structure, freeing the parent if there is
- * nothing left, potentially recursively. */
+ * nothing left, potentially recursively.  Lockless lookups might still be
+ * looking at the nodes, so they are freed after a grace period. */
 static void __radix_remove_slot(struct radix_node *r_node, struct radix_node **slot)
 {
 	assert(*slot);		/* make sure there is something there */
-	*slot = 0;
+	ACCESS_ONCE(*slot) = 0;
 	r_node->num_items--;
 	/* this check excludes the root, but the if else handles it.  For now, once
 	 * we have a root, we'll always keep it (will need some changing in
@@ -104,7 +174,7 @@ static void __radix_remove_slot(struct radix_node *r_node, struct radix_node **s
 			__radix_remove_slot(r_node->parent, r_node->my_slot);
 		else			/* we're the last node, attached to the actual tree */
 			*(r_node->my_slot) = 0;
-		kmem_cache_free(radix_kcache, r_node);
+		call_rcu(&r_node->rcu, __radix_node_free_rcu);
 	}
 }
 
@@ -138,7 +208,7 @@ void *radix_lookup(struct radix_tree *tree, unsigned long key)
 	void **slot = radix_lookup_slot(tree, key);
 	if (!slot)
 		return 0;
-	return *slot;
+	return rcu_dereference(*slot);
 }
 
 /* Returns a pointer to the radix_node holding a given key.  0 if there is no
@@ -149,42 +219,42 @@ void *radix_lookup(struct radix_tree *tree, unsigned long key)
  * ......444444333333222222111111
  *
  * If an interior node of the tree is missing, this will add one if it was
- * directed to extend the tree. */
+ * directed to extend the tree.  Without extend, this is safe for lockless
+ * readers: we go by the heights in the nodes, not the tree's depth, which
+ * might be ahead of the root we saw. */
 static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
                                               unsigned long key, bool extend)
 {
 	printd("RADIX: lookup_node %d, %d\n", key, extend);
 	unsigned long idx;
-	struct radix_node *child_node, *r_node = tree->root;
-	if (key	>= tree->upper_bound) {
+	struct radix_node *child_node, *r_node = rcu_dereference(tree->root);
+	if (!r_node || !__radix_node_covers(r_node, key)) {
 		if (extend)
 			warn("Bound (%d) not set for key %d!\n", tree->upper_bound, key);
 		return 0;
 	}
-	for (int i = tree->depth; i > 1; i--) {	 /* i = ..., 4, 3, 2 */
+	for (int i = r_node->height; i > 1; i--) {	 /* i = ..., 4, 3, 2 */
 		idx = (key >> (LOG_RNODE_SLOTS * (i - 1))) & (NR_RNODE_SLOTS - 1);
+		child_node = rcu_dereference(r_node->items[idx]);
 		/* There might not be a node at this part of the tree */
-		if (!r_node->items[idx]) {
-			if (!extend) {
+		if (!child_node) {
+			if (!extend)
 				return 0;
-			} else {
-				/* so build one, possibly returning 0 if we couldn't */
-				child_node = kmem_cache_alloc(radix_kcache, 0);
-				if (!child_node)
-					return 0;
-				r_node->items[idx] = child_node;
-				memset(child_node, 0, sizeof(struct radix_node));
-				/* when we are on the last iteration (i == 2), the child will be
-				 * a leaf. */
-				child_node->leaf = (i == 2) ? TRUE : FALSE;
-				child_node->parent = r_node;
-				child_node->my_slot = (struct radix_node**)&r_node->items[idx];
-				r_node->num_items++;
-				r_node = (struct radix_node*)r_node->items[idx];
-			}
-		} else {
-			r_node = (struct radix_node*)r_node->items[idx];
+			/* so build one, possibly returning 0 if we couldn't */
+			child_node = kmem_cache_alloc(radix_kcache, 0);
+			if (!child_node)
+				return 0;
+			memset(child_node, 0, sizeof(struct radix_node));
+			/* when we are on the last iteration (i == 2), the child will be
+			 * a leaf. */
+			child_node->height = i - 1;
+			child_node->leaf = (i == 2) ? TRUE : FALSE;
+			child_node->parent = r_node;
+			child_node->my_slot = (struct radix_node**)&r_node->items[idx];
+			r_node->num_items++;
+			rcu_assign_pointer(r_node->items[idx], child_node);
 		}
+		r_node = child_node;
 	}
 	return r_node;
 }
@@ -201,11 +271,44 @@ void **radix_lookup_slot(struct radix_tree *tree, unsigned long key)
 	return &r_node->items[key];
 }
 
+/* Collects items from r_node, which starts at key base, skipping keys below
+ * first. */
+static void __radix_gang_collect(struct radix_node *r_node, unsigned long base,
+                                 unsigned long first, void **results,
+                                 unsigned int *nr, unsigned int max_items)
+{
+	unsigned int shift = LOG_RNODE_SLOTS * (r_node->height - 1);
+	unsigned long child_base;
+	void *item;
+
+	for (int i = (first - base) >> shift; i < NR_RNODE_SLOTS; i++) {
+		if (*nr == max_items)
+			return;
+		item = rcu_dereference(r_node->items[i]);
+		if (!item)
+			continue;
+		if (r_node->leaf) {
+			results[(*nr)++] = item;
+			continue;
+		}
+		child_base = base + ((unsigned long)i << shift);
+		__radix_gang_collect(item, child_base, MAX(first, child_base), results,
+		                     nr, max_items);
+	}
+}
+
+/* Finds up to max_items items with keys of at least first, in key order, and
+ * returns how many it found.  Safe for lockless readers. */
 int radix_gang_lookup(struct radix_tree *tree, void **results,
                       unsigned long first, unsigned int max_items)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
+	struct radix_node *root = rcu_dereference(tree->root);
+	unsigned int nr = 0;
+
+	if (!root || !max_items || !__radix_node_covers(root, first))
+		return 0;
+	__radix_gang_collect(root, 0, first, results, &nr, max_items);
+	return nr;
 }
 
 
@@ -0,0 +1,174 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Read-copy-update.  See rcu.h for the design.
+ *
+ * Each core remembers the last grace period (GP) it reported a quiescent state
+ * for.  When the count of cores that haven't reported yet hits zero, the GP is
+ * over and its callbacks move to the done list, which an RKM on that core
+ * drains. */
+
+#include <rcu.h>
+#include <alarm.h>
+#include <kthread.h>
+#include <kmalloc.h>
+#include <percpu.h>
+#include <smp.h>
+#include <trap.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* How long a GP can go before we poke the cores that haven't reported */
+#define RCU_KICK_USEC			1000
+
+static spinlock_t rcu_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static unsigned long rcu_gp_num;		/* last GP started */
+static bool rcu_gp_active;
+static unsigned int rcu_nr_pending;		/* cores yet to report for gp_num */
+static unsigned long rcu_nr_cbs;		/* ever run, for debugging */
+/* 'next' waits for a GP to start, 'cur' for the current GP to end */
+static struct rcu_head_list rcu_next = STAILQ_HEAD_INITIALIZER(rcu_next);
+static struct rcu_head_list rcu_cur = STAILQ_HEAD_INITIALIZER(rcu_cur);
+static struct rcu_head_list rcu_done = STAILQ_HEAD_INITIALIZER(rcu_done);
+static struct alarm_waiter rcu_kick_waiter;
+static bool rcu_kick_armed;
+
+static DEFINE_PERCPU(unsigned long, rcu_qs_gp);
+
+static void __rcu_run_cbs(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct rcu_head_list done = STAILQ_HEAD_INITIALIZER(done);
+	struct rcu_head *head;
+	uintptr_t func;
+
+	spin_lock_irqsave(&rcu_lock);
+	STAILQ_CONCAT(&done, &rcu_done);
+	spin_unlock_irqsave(&rcu_lock);
+	while ((head = STAILQ_FIRST(&done))) {
+		STAILQ_REMOVE_HEAD(&done, link);
+		func = (uintptr_t)head->func;
+		if (func < RCU_KFREE_MAX_OFFSET)
+			kfree((void*)head - func);
+		else
+			head->func(head);
+		rcu_nr_cbs++;
+	}
+}
+
+/* Hold the lock. */
+static void __rcu_start_gp(void)
+{
+	STAILQ_CONCAT(&rcu_cur, &rcu_next);
+	rcu_gp_num++;
+	rcu_nr_pending = num_cores;
+	wmb();	/* cores that see the GP must see the count */
+	rcu_gp_active = TRUE;
+	if (!rcu_kick_armed) {
+		rcu_kick_armed = TRUE;
+		set_awaiter_rel(&rcu_kick_waiter, RCU_KICK_USEC);
+		set_alarm(&per_cpu_info[core_id()].tchain, &rcu_kick_waiter);
+	}
+}
+
+/* Hold the lock. */
+static void __rcu_end_gp(void)
+{
+	rcu_gp_active = FALSE;
+	STAILQ_CONCAT(&rcu_done, &rcu_cur);
+	send_kernel_message(core_id(), __rcu_run_cbs, 0, 0, 0, KMSG_ROUTINE);
+	if (!STAILQ_EMPTY(&rcu_next))
+		__rcu_start_gp();
+}
+
+/* The calling core is in a quiescent state: it is not in any RCU read-side
+ * critical section.  Cheap when there's no GP or we already reported. */
+void rcu_note_qs(void)
+{
+	unsigned long *qs_gp = PERCPU_VARPTR(rcu_qs_gp);
+
+	if (!ACCESS_ONCE(rcu_gp_active) || (*qs_gp == ACCESS_ONCE(rcu_gp_num)))
+		return;
+	spin_lock_irqsave(&rcu_lock);
+	if (rcu_gp_active && (*qs_gp != rcu_gp_num)) {
+		*qs_gp = rcu_gp_num;
+		if (!--rcu_nr_pending)
+			__rcu_end_gp();
+	}
+	spin_unlock_irqsave(&rcu_lock);
+}
+
+/* Running any RKM means process_routine_kmsg() already noted our QS */
+static void __rcu_qs_kmsg(uint32_t srcid, long a0, long a1, long a2)
+{
+	rcu_note_qs();
+}
+
+/* RKM alarm: pokes the cores holding up the GP, and keeps poking until the GP
+ * is over. */
+static void __rcu_kick(struct alarm_waiter *waiter)
+{
+	spin_lock_irqsave(&rcu_lock);
+	if (!rcu_gp_active) {
+		rcu_kick_armed = FALSE;
+		spin_unlock_irqsave(&rcu_lock);
+		return;
+	}
+	for (int i = 0; i < num_cores; i++) {
+		if (_PERCPU_VAR(rcu_qs_gp, i) != rcu_gp_num)
+			send_kernel_message(i, __rcu_qs_kmsg, 0, 0, 0, KMSG_ROUTINE);
+	}
+	set_awaiter_rel(waiter, RCU_KICK_USEC);
+	set_alarm(&per_cpu_info[core_id()].tchain, waiter);
+	spin_unlock_irqsave(&rcu_lock);
+}
+
+void rcu_init(void)
+{
+	init_awaiter(&rcu_kick_waiter, __rcu_kick);
+}
+
+/* Runs func(head) after a grace period, from an RKM.  Safe to call from any
+ * context, including read-side critical sections. */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	head->func = func;
+	spin_lock_irqsave(&rcu_lock);
+	STAILQ_INSERT_TAIL(&rcu_next, head, link);
+	if (!rcu_gp_active)
+		__rcu_start_gp();
+	spin_unlock_irqsave(&rcu_lock);
+}
+
+struct rcu_sync {
+	struct rcu_head				head;
+	struct semaphore			sem;
+};
+
+static void __rcu_sync_cb(struct rcu_head *head)
+{
+	struct rcu_sync *sync = container_of(head, struct rcu_sync, head);
+
+	sem_up(&sync->sem);
+}
+
+/* Blocks until every reader that might have seen the old version is done. */
+void synchronize_rcu(void)
+{
+	struct rcu_sync sync;
+
+	sem_init(&sync.sem, 0);
+	call_rcu(&sync.head, __rcu_sync_cb);
+	sem_down(&sync.sem);
+}
+
+void print_rcu_info(void)
+{
+	spin_lock_irqsave(&rcu_lock);
+	printk("RCU: GP %lu %s, %u cores pending, %lu callbacks run\n",
+	       rcu_gp_num, rcu_gp_active ? "active" : "done", rcu_nr_pending,
+	       rcu_nr_cbs);
+	for (int i = 0; i < num_cores; i++)
+		printk("\tCore %d: last QS for GP %lu\n", i,
+		       _PERCPU_VAR(rcu_qs_gp, i));
+	spin_unlock_irqsave(&rcu_lock);
+}
@@ -60,9 +60,10 @@ static void rendez_alarm_handler(struct alarm_waiter *awaiter,
 	rendez_wakeup(rv);
 }
 
-/* Like sleep, but it will timeout in 'usec' microseconds. */
-void rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
-                          uint64_t usec)
+/* Like sleep, but it will timeout in 'usec' microseconds, give or take
+ * 'slack_usec'. */
+void rendez_sleep_timeout_slack(struct rendez *rv, int (*cond)(void*),
+                                void *arg, uint64_t usec, uint64_t slack_usec)
 {
 	int8_t irq_state = 0;
 	struct alarm_waiter awaiter;
@@ -86,7 +87,7 @@ void rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
 	 * with unset_alarm blocking. */
 	init_awaiter_irq(&awaiter, rendez_alarm_handler);
 	awaiter.data = rv;
-	set_awaiter_rel(&awaiter, usec);
+	set_awaiter_rel_slack(&awaiter, usec, slack_usec);
 	/* Set our alarm on this cpu's tchain.  Note that when we sleep in cv_wait,
 	 * we could be migrated, and later on we could be unsetting the alarm
 	 * remotely. */
@@ -114,6 +115,13 @@ void rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
 	unset_alarm(pcpui_tchain, &awaiter);
 }
 
+/* Like sleep, but it will timeout in 'usec' microseconds. */
+void rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
+                          uint64_t usec)
+{
+	rendez_sleep_timeout_slack(rv, cond, arg, usec, 0);
+}
+
 /* plan9 rendez returned a pointer to the proc woken up.  we return "true" if we
  * woke someone up. */
 bool rendez_wakeup(struct rendez *rv)
@@ -28,11 +28,25 @@
  * signalled the new writer.  Even worse, in this case, the readers that we
  * didn't wake up are still sleeping, even though a reader now holds the lock.
  * It won't deadlock, (since eventually the reader will wake the writer, who
- * wakes the old readers) but it breaks the notion of a RW lock a bit. */
+ * wakes the old readers) but it breaks the notion of a RW lock a bit.
+ *
+ * Big-reader locks (brinit()) count their readers per core.  A reader bumps its
+ * core's count, then checks for a writer; a writer sets 'writing', then sums
+ * the counts.  With a full barrier in between on both sides, at least one of
+ * them sees the other.  A reader that sees a writer backs out and waits under
+ * the lock.  A writer that sees readers backs out too, and waits for a runlock
+ * to wake it, which keeps the "readers can always rlock" property: a reader
+ * that already holds the lock might need another rlock to finish.  Since the
+ * writer can't tell when a particular core's readers are done, wunlock does not
+ * pass the lock; woken readers and writers go through the lock again. */
 
 #include <rwlock.h>
 #include <atomic.h>
 #include <kthread.h>
+#include <kmalloc.h>
+#include <smp.h>
+#include <string.h>
+#include <assert.h>
 
 void rwinit(struct rwlock *rw_lock)
 {
@@ -41,10 +55,133 @@ void rwinit(struct rwlock *rw_lock)
 	rw_lock->writing = FALSE;
 	cv_init_with_lock(&rw_lock->readers, &rw_lock->lock);
 	cv_init_with_lock(&rw_lock->writers, &rw_lock->lock);
+	rw_lock->pcpu = NULL;
+	rw_lock->nr_wwaiting = 0;
+}
+
+void brinit(struct rwlock *rw_lock)
+{
+	rwinit(rw_lock);
+	rw_lock->pcpu = kmalloc_align(sizeof(struct rwlock_pcpu) * num_cores,
+	                              MEM_WAIT, ARCH_CL_SIZE);
+	memset(rw_lock->pcpu, 0, sizeof(struct rwlock_pcpu) * num_cores);
+}
+
+void rwdestroy(struct rwlock *rw_lock)
+{
+	if (rw_lock->pcpu)
+		kfree(rw_lock->pcpu);
+	rw_lock->pcpu = NULL;
+}
+
+/* Wraps around to 0 when there are no readers, even if some cores' counts
+ * are negative. */
+static unsigned long __br_nr_readers(struct rwlock *rw_lock)
+{
+	unsigned long sum = 0;
+
+	for (int i = 0; i < num_cores; i++)
+		sum += ACCESS_ONCE(rw_lock->pcpu[i].nr_readers);
+	return sum;
+}
+
+/* Rlocks never run from IRQ context, and we don't block between reading
+ * core_id() and the add, so the per-core counts need no atomics. */
+static void __br_add_reader(struct rwlock *rw_lock, long amt)
+{
+	rw_lock->pcpu[core_id()].nr_readers += amt;
+}
+
+/* Drops our read count, then wakes any writer that might be waiting on it. */
+static void __br_put_reader(struct rwlock *rw_lock)
+{
+	__br_add_reader(rw_lock, -1);
+	wrmb();	/* order the count write before the nr_wwaiting read */
+	if (ACCESS_ONCE(rw_lock->nr_wwaiting)) {
+		spin_lock(&rw_lock->lock);
+		__cv_broadcast(&rw_lock->writers);
+		spin_unlock(&rw_lock->lock);
+	}
+}
+
+/* Fast path for readers; returns FALSE if there's a writer. */
+static bool __br_tryrlock(struct rwlock *rw_lock)
+{
+	__br_add_reader(rw_lock, 1);
+	wrmb();	/* order the count write before the writing read */
+	if (!ACCESS_ONCE(rw_lock->writing))
+		return TRUE;
+	__br_put_reader(rw_lock);
+	return FALSE;
+}
+
+static void __br_rlock(struct rwlock *rw_lock)
+{
+	if (__br_tryrlock(rw_lock))
+		return;
+	/* Writers only set 'writing' with the lock held, so once we see it clear,
+	 * the writer will see our count. */
+	spin_lock(&rw_lock->lock);
+	while (rw_lock->writing)
+		cv_wait(&rw_lock->readers);
+	__br_add_reader(rw_lock, 1);
+	spin_unlock(&rw_lock->lock);
+}
+
+static bool __br_canrlock(struct rwlock *rw_lock)
+{
+	bool ret = FALSE;
+
+	if (__br_tryrlock(rw_lock))
+		return TRUE;
+	/* A writer might have been checking for readers, and will back off if it
+	 * saw any.  Only fail if a writer actually holds the lock. */
+	spin_lock(&rw_lock->lock);
+	if (!rw_lock->writing) {
+		__br_add_reader(rw_lock, 1);
+		ret = TRUE;
+	}
+	spin_unlock(&rw_lock->lock);
+	return ret;
+}
+
+static void __br_wlock(struct rwlock *rw_lock)
+{
+	spin_lock(&rw_lock->lock);
+	rw_lock->nr_wwaiting++;
+	for (;;) {
+		if (rw_lock->writing) {
+			cv_wait(&rw_lock->writers);
+			continue;
+		}
+		rw_lock->writing = TRUE;
+		wrmb();	/* order the writing write before the count reads */
+		if (!__br_nr_readers(rw_lock))
+			break;
+		/* Let the readers in, and wait for the next runlock */
+		rw_lock->writing = FALSE;
+		__cv_broadcast(&rw_lock->readers);
+		cv_wait(&rw_lock->writers);
+	}
+	rw_lock->nr_wwaiting--;
+	spin_unlock(&rw_lock->lock);
+}
+
+static void __br_wunlock(struct rwlock *rw_lock)
+{
+	spin_lock(&rw_lock->lock);
+	rw_lock->writing = FALSE;
+	__cv_broadcast(&rw_lock->readers);
+	__cv_broadcast(&rw_lock->writers);
+	spin_unlock(&rw_lock->lock);
 }
 
 void rlock(struct rwlock *rw_lock)
 {
+	if (rw_lock->pcpu) {
+		__br_rlock(rw_lock);
+		return;
+	}
 	/* If we already have a reader, we can just increment and return.  This is
 	 * the only access to nr_readers outside the lock.  All locked uses need to
 	 * be aware that the nr could be concurrently increffed (unless it is 0). */
@@ -64,6 +201,8 @@ void rlock(struct rwlock *rw_lock)
 
 bool canrlock(struct rwlock *rw_lock)
 {
+	if (rw_lock->pcpu)
+		return __br_canrlock(rw_lock);
 	if (atomic_add_not_zero(&rw_lock->nr_readers, 1))
 		return TRUE;
 	spin_lock(&rw_lock->lock);
@@ -78,6 +217,10 @@ bool canrlock(struct rwlock *rw_lock)
 
 void runlock(struct rwlock *rw_lock)
 {
+	if (rw_lock->pcpu) {
+		__br_put_reader(rw_lock);
+		return;
+	}
 	spin_lock(&rw_lock->lock);
 	/* sub and test will tell us if we got the refcnt to 0, atomically.  syncing
 	 * with the atomic_add_not_zero of new readers.  Since we're passing the
@@ -94,6 +237,10 @@ void runlock(struct rwlock *rw_lock)
 
 void wlock(struct rwlock *rw_lock)
 {
+	if (rw_lock->pcpu) {
+		__br_wlock(rw_lock);
+		return;
+	}
 	spin_lock(&rw_lock->lock);
 	if (atomic_read(&rw_lock->nr_readers) || rw_lock->writing) {
 		/* If we slept, the lock was passed to us */
@@ -106,6 +253,10 @@ void wlock(struct rwlock *rw_lock)
 
 void wunlock(struct rwlock *rw_lock)
 {
+	if (rw_lock->pcpu) {
+		__br_wunlock(rw_lock);
+		return;
+	}
 	/* Pass the lock to another writer (we leave writing = TRUE) */
 	spin_lock(&rw_lock->lock);
 	if (rw_lock->writers.nr_waiters) {
@@ -16,11 +16,25 @@
 #include <alarm.h>
 #include <sys/queue.h>
 #include <arsc_server.h>
+#include <page_alloc.h>
+#include <trap.h>
+#include <tracepoint.h>
+#include <kmalloc.h>
+
+/* SCP run queues, one per LL core, each with its own lock.  Only runnable SCPs
+ * are on a queue; running, waiting, and new SCPs are on none.  An SCP wakes up
+ * on the queue of the core it last ran on, unless that queue is noticeably
+ * longer than the shortest one, and idle LL cores steal from the longest.
+ *
+ * Lock ordering: runq lock -> proc_lock.  We never hold two runq locks. */
+struct scp_runq {
+	spinlock_t					lock;
+	struct proc_list			runnable;
+	unsigned int				nr_runnable;
+	uint32_t					coreid;
+};
+static struct scp_runq scp_runqs[CONFIG_NR_LL_CORES];
 
-/* Process Lists.  'unrunnable' is a holding list for SCPs that are running or
- * waiting or otherwise not considered for sched decisions. */
-struct proc_list unrunnable_scps = TAILQ_HEAD_INITIALIZER(unrunnable_scps);
-struct proc_list runnable_scps = TAILQ_HEAD_INITIALIZER(runnable_scps);
 /* mcp lists.  we actually could get by with one list and a TAILQ_CONCAT, but
  * I'm expecting to want the flexibility of the pointers later. */
 struct proc_list all_mcps_1 = TAILQ_HEAD_INITIALIZER(all_mcps_1);
@@ -28,6 +42,9 @@ struct proc_list all_mcps_2 = TAILQ_HEAD_INITIALIZER(all_mcps_2);
 struct proc_list *primary_mcps = &all_mcps_1;
 struct proc_list *secondary_mcps = &all_mcps_2;
 
+DEFINE_TRACEPOINT(sched_scp_run, "pid %d pcoreid %d");
+DEFINE_TRACEPOINT(sched_mcp_grant, "pid %d nr_cores %d amt_needed %d");
+
 /* Helper, defined below */
 static void __core_request(struct proc *p, uint32_t amt_needed);
 static void add_to_list(struct proc *p, struct proc_list *list);
@@ -36,6 +53,8 @@ static void switch_lists(struct proc *p, struct proc_list *old,
                          struct proc_list *new);
 static void __run_mcp_ksched(void *arg);	/* don't call directly */
 static uint32_t get_cores_needed(struct proc *p);
+static uint32_t get_cores_demand(struct proc *p);
+static void __compute_fair_shares(void);
 
 /* Locks / sync tools */
 
@@ -65,17 +84,62 @@ struct poke_tracker ksched_poker = POKE_INITIALIZER(__run_mcp_ksched);
 //spinlock_t alloc_lock = SPINLOCK_INITIALIZER;
 spinlock_t sched_lock = SPINLOCK_INITIALIZER;
 
+/* Cores reserved by all procs, never more than the CG cores.  Protected by the
+ * sched_lock. */
+static uint32_t nr_cores_reserved;
+/* Per pcore, the tsc at which we told its owner we'd preempt it, or 0.  Any
+ * entry is cleared when the core is next allocated.  Protected by the
+ * sched_lock. */
+static uint64_t *preempt_deadline;
+
 /* Alarm struct, for our example 'timer tick' */
 struct alarm_waiter ksched_waiter;
 
 #define TIMER_TICK_USEC 10000 	/* 10msec */
+#define KSCHED_TICK_CORE 0		/* the LL core that runs the tick */
+
+/* The tick only runs while there is something for it to do: SCPs waiting for
+ * the LL core or MCPs with outstanding core requests.  Anything that could
+ * create such work calls kick_ksched_tick(), which arms the tick if it isn't
+ * already.  'pending' tells a tick that is about to disarm itself that it
+ * raced with a kick and should check again next tick. */
+static spinlock_t ksched_tick_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static bool ksched_tick_armed;
+static bool ksched_tick_pending;
 
-/* Helper: Sets up a timer tick on the calling core to go off 10 msec from now.
- * This assumes the calling core is an LL core, etc. */
-static void set_ksched_alarm(void)
+/* Makes sure the tick will run at least once more.  Safe to call from any
+ * core, in any context, with or without the sched_lock. */
+static void kick_ksched_tick(void)
 {
-	set_awaiter_rel(&ksched_waiter, TIMER_TICK_USEC);
-	set_alarm(&per_cpu_info[core_id()].tchain, &ksched_waiter);
+	spin_lock_irqsave(&ksched_tick_lock);
+	ksched_tick_pending = TRUE;
+	if (!ksched_tick_armed) {
+		ksched_tick_armed = TRUE;
+		set_awaiter_rel(&ksched_waiter, TIMER_TICK_USEC);
+		set_alarm(&per_cpu_info[KSCHED_TICK_CORE].tchain, &ksched_waiter);
+	}
+	spin_unlock_irqsave(&ksched_tick_lock);
+}
+
+/* Returns TRUE if the tick still has work: SCPs waiting to time-slice on the LL
+ * cores, or runnable MCPs that want more cores than they have.  Hold the
+ * sched_lock. */
+static bool __ksched_tick_needed(void)
+{
+	struct proc_list *lists[2] = {primary_mcps, secondary_mcps};
+	struct proc *p;
+
+	for (int i = 0; i < nr_ll_cores(); i++) {
+		if (ACCESS_ONCE(scp_runqs[i].nr_runnable))
+			return TRUE;
+	}
+	for (int i = 0; i < 2; i++) {
+		TAILQ_FOREACH(p, lists[i], ksched_data.proc_link) {
+			if (get_cores_demand(p) > p->procinfo->res_grant[RES_CORES])
+				return TRUE;
+		}
+	}
+	return FALSE;
 }
 
 /* Need a kmsg to just run the sched, but not to rearm */
@@ -90,23 +154,49 @@ static void __just_sched(uint32_t srcid, long a0, long a1, long a2)
  * quiescent state. */
 static void __ksched_tick(struct alarm_waiter *waiter)
 {
+	bool needed;
+
 	/* TODO: imagine doing some accounting here */
+	spin_lock_irqsave(&ksched_tick_lock);
+	ksched_tick_pending = FALSE;
+	spin_unlock_irqsave(&ksched_tick_lock);
+	/* The other LL cores time-slice their own queues */
+	for (int i = 0; i < nr_ll_cores(); i++) {
+		if ((i != core_id()) && ACCESS_ONCE(scp_runqs[i].nr_runnable))
+			send_kernel_message(i, __just_sched, 0, 0, 0, KMSG_ROUTINE);
+	}
 	run_scheduler();
+	spin_lock(&sched_lock);
+	needed = __ksched_tick_needed();
+	spin_unlock(&sched_lock);
+	spin_lock_irqsave(&ksched_tick_lock);
+	if (!needed && !ksched_tick_pending) {
+		ksched_tick_armed = FALSE;
+		spin_unlock_irqsave(&ksched_tick_lock);
+		return;
+	}
 	/* Set our alarm to go off, incrementing from our last tick (instead of
 	 * setting it relative to now, since some time has passed since the alarm
 	 * first went off.  Note, this may be now or in the past! */
 	set_awaiter_inc(&ksched_waiter, TIMER_TICK_USEC);
 	set_alarm(&per_cpu_info[core_id()].tchain, &ksched_waiter);
+	spin_unlock_irqsave(&ksched_tick_lock);
 }
 
 void schedule_init(void)
 {
 	spin_lock(&sched_lock);
-	assert(!core_id());		/* want the alarm on core0 for now */
+	assert(core_id() == KSCHED_TICK_CORE);	/* want the alarm on core0 */
 	init_awaiter(&ksched_waiter, __ksched_tick);
-	set_ksched_alarm();
+	for (int i = 0; i < CONFIG_NR_LL_CORES; i++) {
+		spinlock_init(&scp_runqs[i].lock);
+		TAILQ_INIT(&scp_runqs[i].runnable);
+		scp_runqs[i].nr_runnable = 0;
+		scp_runqs[i].coreid = i;
+	}
 	corealloc_init();
 	spin_unlock(&sched_lock);
+	preempt_deadline = kzmalloc(num_cores * sizeof(uint64_t), MEM_WAIT);
 
 #ifdef CONFIG_ARSC_SERVER
 	int arsc_coreid = get_any_idle_core();
@@ -147,6 +237,49 @@ static void remove_from_any_list(struct proc *p)
 	}
 }
 
+/* SCP run queue helpers.  Hold the runq's lock.  These use the same linkage as
+ * the MCP lists; a proc is never on both. */
+static void __runq_add(struct scp_runq *rq, struct proc *p, bool head)
+{
+	assert(!p->ksched_data.runq && !p->ksched_data.cur_list);
+	if (head)
+		TAILQ_INSERT_HEAD(&rq->runnable, p, ksched_data.proc_link);
+	else
+		TAILQ_INSERT_TAIL(&rq->runnable, p, ksched_data.proc_link);
+	p->ksched_data.runq = rq;
+	rq->nr_runnable++;
+}
+
+static void __runq_remove(struct scp_runq *rq, struct proc *p)
+{
+	assert(p->ksched_data.runq == rq);
+	TAILQ_REMOVE(&rq->runnable, p, ksched_data.proc_link);
+	p->ksched_data.runq = 0;
+	rq->nr_runnable--;
+}
+
+/* Picks the runq for a waking SCP: the one it last ran on, for cache warmth,
+ * unless that one is more than one proc longer than the shortest.  The lengths
+ * are read locklessly; this is just a hint. */
+static struct scp_runq *pick_scp_runq(struct proc *p)
+{
+	uint32_t last = p->ksched_data.scp_core;
+	struct scp_runq *rq, *shortest;
+
+	if (last >= nr_ll_cores())
+		last = 0;
+	rq = &scp_runqs[last];
+	shortest = rq;
+	for (int i = 0; i < nr_ll_cores(); i++) {
+		if (ACCESS_ONCE(scp_runqs[i].nr_runnable) <
+		    ACCESS_ONCE(shortest->nr_runnable))
+			shortest = &scp_runqs[i];
+	}
+	if (ACCESS_ONCE(rq->nr_runnable) > ACCESS_ONCE(shortest->nr_runnable) + 1)
+		return shortest;
+	return rq;
+}
+
 /************** Process Management Callbacks **************/
 /* a couple notes:
  * - the proc lock is NOT held for any of these calls.  currently, there is no
@@ -164,7 +297,12 @@ void __sched_proc_register(struct proc *p)
 	proc_incref(p, 1);	/* need at least this OR the 'one for existing' */
 	spin_lock(&sched_lock);
 	corealloc_proc_init(p);
-	add_to_list(p, &unrunnable_scps);
+	p->ksched_data.shares = SCHED_DEFAULT_SHARES;
+	p->ksched_data.nr_reserved = 0;
+	p->ksched_data.preempt_lead = 0;
+	/* new SCPs are on no list until their first wakeup */
+	p->ksched_data.runq = 0;
+	p->ksched_data.scp_core = 0;
 	spin_unlock(&sched_lock);
 }
 
@@ -184,12 +322,13 @@ void __sched_proc_change_to_m(struct proc *p)
 		printk("[kernel] process needs to specify amt_wanted\n");
 		p->procdata->res_req[RES_CORES].amt_wanted = 1;
 	}
-	/* For now, this should only ever be called on an unrunnable.  It's
-	 * probably a bug, at this stage in development, to do o/w. */
-	remove_from_list(p, &unrunnable_scps);
-	//remove_from_any_list(p); 	/* ^^ instead of this */
+	/* For now, this should only ever be called on a running SCP, which is on
+	 * no run queue.  It's probably a bug, at this stage in development, to do
+	 * o/w. */
+	assert(!p->ksched_data.runq);
 	add_to_list(p, primary_mcps);
 	spin_unlock(&sched_lock);
+	kick_ksched_tick();
 	//poke_ksched(p, RES_CORES);
 }
 
@@ -200,14 +339,27 @@ void __sched_proc_change_to_m(struct proc *p)
  * __proc_free will be called (when the last one is done). */
 void __sched_proc_destroy(struct proc *p, uint32_t *pc_arr, uint32_t nr_cores)
 {
+	struct scp_runq *rq;
+
+	/* p is DYING, so it can't be added to a runq anymore, but it might still be
+	 * on one.  The runq lock is what protects p's membership. */
+	for (int i = 0; i < nr_ll_cores(); i++) {
+		rq = &scp_runqs[i];
+		spin_lock(&rq->lock);
+		if (p->ksched_data.runq == rq)
+			__runq_remove(rq, p);
+		spin_unlock(&rq->lock);
+	}
 	spin_lock(&sched_lock);
 	/* Unprovision any cores.  Note this is different than track_core_dealloc.
 	 * The latter does bookkeeping when an allocation changes.  This is a
 	 * bulk *provisioning* change. */
 	__unprovision_all_cores(p);
-	/* Remove from whatever list we are on (if any - might not be on one if it
-	 * was in the middle of __run_mcp_sched) */
+	/* Remove from whatever MCP list we are on (if any - might not be on one if
+	 * it was an SCP or in the middle of __run_mcp_sched) */
 	remove_from_any_list(p);
+	nr_cores_reserved -= p->ksched_data.nr_reserved;
+	p->ksched_data.nr_reserved = 0;
 	if (nr_cores)
 		__track_core_dealloc_bulk(p, pc_arr, nr_cores);
 	spin_unlock(&sched_lock);
@@ -227,37 +379,32 @@ void __sched_mcp_wakeup(struct proc *p)
 	spin_unlock(&sched_lock);
 	/* note they could be dying at this point too. */
 	poke(&ksched_poker, p);
+	kick_ksched_tick();
 }
 
 /* ksched callbacks.  p just woke up and is UNLOCKED. */
 void __sched_scp_wakeup(struct proc *p)
 {
-	spin_lock(&sched_lock);
-	if (proc_is_dying(p)) {
-		spin_unlock(&sched_lock);
+	struct scp_runq *rq = pick_scp_runq(p);
+
+	spin_lock(&rq->lock);
+	/* Checking under the runq lock orders us with __sched_proc_destroy() */
+	if (proc_is_dying(p) || p->ksched_data.runq) {
+		spin_unlock(&rq->lock);
 		return;
 	}
-	/* might not be on a list if it is new.  o/w, it should be unrunnable */
-	remove_from_any_list(p);
-	add_to_list(p, &runnable_scps);
-	spin_unlock(&sched_lock);
-	/* we could be on a CG core, and all the mgmt cores could be halted.  if we
-	 * don't tell one of them about the new proc, they will sleep until the
-	 * timer tick goes off. */
-	if (!management_core()) {
-		/* TODO: pick a better core and only send if halted.
-		 *
-		 * FYI, a POKE on x86 might lose a rare race with halt code, since the
-		 * poke handler does not abort halts.  if this happens, the next timer
-		 * IRQ would wake up the core.
-		 *
-		 * ideally, we'd know if a specific mgmt core is sleeping and wake it
-		 * up.  o/w, we could interrupt an already-running mgmt core that won't
-		 * get to our new proc anytime soon.  also, by poking core 0, a
-		 * different mgmt core could remain idle (and this process would sleep)
-		 * until its tick goes off */
-		send_ipi(0, I_POKE_CORE);
-	}
+	__runq_add(rq, p, FALSE);
+	spin_unlock(&rq->lock);
+	/* the tick time-slices the LL cores between runnable SCPs */
+	kick_ksched_tick();
+	/* the target core could be halted.  if we don't tell it about the new
+	 * proc, it will sleep until the timer tick goes off.
+	 *
+	 * TODO: only send if halted.  FYI, a POKE on x86 might lose a rare race
+	 * with halt code, since the poke handler does not abort halts.  if this
+	 * happens, the next timer IRQ would wake up the core. */
+	if (rq->coreid != core_id())
+		send_ipi(rq->coreid, I_POKE_CORE);
 }
 
 /* Callback to return a core to the ksched, which tracks it as idle and
@@ -270,6 +417,9 @@ void __sched_put_idle_core(struct proc *p, uint32_t coreid)
 	spin_lock(&sched_lock);
 	__track_core_dealloc(p, coreid);
 	spin_unlock(&sched_lock);
+	/* We can't run the ksched with the proclock held, but the tick can give
+	 * the core to someone still waiting for one. */
+	kick_ksched_tick();
 }
 
 /* Callback, bulk interface for put_idle. The proclock is held for this. */
@@ -278,21 +428,58 @@ void __sched_put_idle_cores(struct proc *p, uint32_t *pc_arr, uint32_t num)
 	spin_lock(&sched_lock);
 	__track_core_dealloc_bulk(p, pc_arr, num);
 	spin_unlock(&sched_lock);
-	/* could trigger a sched decision here */
+	kick_ksched_tick();
 }
 
-/* mgmt/LL cores should call this to schedule the calling core and give it to an
- * SCP.  will also prune the dead SCPs from the list.  hold the lock before
- * calling.  returns TRUE if it scheduled a proc. */
+/* Takes the first SCP off the longest runq other than ours, with a ref for our
+ * caller.  Returns 0 if there was nothing to steal. */
+static struct proc *steal_scp(struct scp_runq *ours)
+{
+	struct scp_runq *victim = 0;
+	struct proc *p;
+
+	for (int i = 0; i < nr_ll_cores(); i++) {
+		if ((&scp_runqs[i] == ours) || !ACCESS_ONCE(scp_runqs[i].nr_runnable))
+			continue;
+		if (!victim || (ACCESS_ONCE(scp_runqs[i].nr_runnable) >
+		                ACCESS_ONCE(victim->nr_runnable)))
+			victim = &scp_runqs[i];
+	}
+	if (!victim)
+		return 0;
+	spin_lock(&victim->lock);
+	if ((p = TAILQ_FIRST(&victim->runnable))) {
+		__runq_remove(victim, p);
+		proc_incref(p, 1);
+	}
+	spin_unlock(&victim->lock);
+	return p;
+}
+
+/* LL cores should call this to schedule the calling core and give it to an
+ * SCP from its runq, or to one stolen from another LL core if we're idle.  Any
+ * currently running SCP goes on the tail of our runq.  returns TRUE if it
+ * scheduled a proc. */
 static bool __schedule_scp(void)
 {
-	// TODO: sort out lock ordering (proc_run_s also locks)
 	struct proc *p;
 	uint32_t pcoreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
-	/* if there are any runnables, run them here and put any currently running
-	 * SCP on the tail of the runnable queue. */
-	if ((p = TAILQ_FIRST(&runnable_scps))) {
+	struct scp_runq *rq = &scp_runqs[pcoreid];
+
+	spin_lock(&rq->lock);
+	if ((p = TAILQ_FIRST(&rq->runnable))) {
+		__runq_remove(rq, p);
+		proc_incref(p, 1);
+	} else if (!pcpui->owning_proc) {
+		spin_unlock(&rq->lock);
+		/* no one is running here, so we can't need to deschedule anyone */
+		p = steal_scp(rq);
+		if (!p)
+			return FALSE;
+		spin_lock(&rq->lock);
+	}
+	if (p) {
 		/* someone is currently running, dequeue them */
 		if (pcpui->owning_proc) {
 			spin_lock(&pcpui->owning_proc->proc_lock);
@@ -302,6 +489,10 @@ static bool __schedule_scp(void)
 				send_kernel_message(core_id(), __just_sched, 0, 0, 0,
 				                    KMSG_ROUTINE);
 				spin_unlock(&pcpui->owning_proc->proc_lock);
+				/* p was ours; owning_proc rules out a stolen p */
+				__runq_add(rq, p, TRUE);
+				spin_unlock(&rq->lock);
+				proc_decref(p);
 				return FALSE;
 			}
 			printd("Descheduled %d in favor of %d\n", pcpui->owning_proc->pid,
@@ -316,8 +507,9 @@ static bool __schedule_scp(void)
 			__unmap_vcore(p, 0);
 			__seq_end_write(&p->procinfo->coremap_seqctr);
 			spin_unlock(&pcpui->owning_proc->proc_lock);
-			/* round-robin the SCPs (inserts at the end of the queue) */
-			switch_lists(pcpui->owning_proc, &unrunnable_scps, &runnable_scps);
+			/* round-robin the SCPs (inserts at the end of the queue).  we
+			 * still hold the runq lock, so a racing destroy will find it. */
+			__runq_add(rq, pcpui->owning_proc, FALSE);
 			clear_owning_proc(pcoreid);
 			/* Note we abandon core.  It's not strictly necessary.  If
 			 * we didn't, the TLB would still be loaded with the old
@@ -326,12 +518,16 @@ static bool __schedule_scp(void)
 			 * future changes, but has an extra (empty) TLB flush.  */
 			abandon_core();
 		}
+		spin_unlock(&rq->lock);
 		/* Run the new proc */
-		switch_lists(p, &runnable_scps, &unrunnable_scps);
+		p->ksched_data.scp_core = pcoreid;
 		printd("PID of the SCP i'm running: %d\n", p->pid);
+		tracepoint(sched_scp_run, p->pid, pcoreid);
 		proc_run_s(p);	/* gives it core we're running on */
+		proc_decref(p);
 		return TRUE;
 	}
+	spin_unlock(&rq->lock);
 	return FALSE;
 }
 
@@ -371,6 +567,155 @@ static uint32_t get_cores_needed(struct proc *p)
 	return amt_wanted - amt_granted;
 }
 
+/* Returns how many cores p wants, for the fair share computation.  Like
+ * get_cores_needed(), this is an unlocked peek, but without the side effects.
+ * WAITING procs want nothing. */
+static uint32_t get_cores_demand(struct proc *p)
+{
+	uint32_t amt_wanted;
+
+	if (p->state == PROC_WAITING)
+		return 0;
+	amt_wanted = p->procdata->res_req[RES_CORES].amt_wanted;
+	if (!amt_wanted || (amt_wanted > p->procinfo->max_vcores))
+		return 1;
+	return amt_wanted;
+}
+
+/* Hands one core each to procs that still want more, until we run out.  If
+ * holders_only, we only consider procs that already have more cores than their
+ * fair share, so that rounding doesn't make us preempt anyone. */
+static uint32_t __fair_share_leftovers(uint32_t avail, bool holders_only)
+{
+	struct proc_list *lists[2] = {primary_mcps, secondary_mcps};
+	struct sched_proc_data *sd;
+	struct proc *p;
+
+	for (int i = 0; i < 2; i++) {
+		TAILQ_FOREACH(p, lists[i], ksched_data.proc_link) {
+			if (!avail)
+				return 0;
+			sd = &p->ksched_data;
+			if (sd->fair_share >= sd->demand)
+				continue;
+			if (holders_only &&
+			    (p->procinfo->res_grant[RES_CORES] <= sd->fair_share))
+				continue;
+			sd->fair_share++;
+			avail--;
+		}
+	}
+	return avail;
+}
+
+/* Splits the CG cores between the MCPs by their shares, capping each MCP at
+ * what it wants and handing the rest to the others (weighted max-min
+ * fairness).  Reserved cores come off the top, before the split.  The result is
+ * each MCP's fair_share.
+ *
+ * The ksched is still work-conserving: __core_request() will give out idle
+ * cores regardless of fair_share.  fair_share only decides who an MCP may
+ * preempt when there are no idle cores: any MCP that is over its share, in
+ * favor of an MCP that is under its share. */
+static void __compute_fair_shares(void)
+{
+	struct proc_list *lists[2] = {primary_mcps, secondary_mcps};
+	struct sched_proc_data *sd;
+	struct proc *p;
+	/* max_vcores() is the same for every proc: the number of CG cores */
+	uint32_t avail = max_vcores(NULL);
+	uint32_t given, amt;
+	uint64_t total_shares;
+
+	for (int i = 0; i < 2; i++) {
+		TAILQ_FOREACH(p, lists[i], ksched_data.proc_link) {
+			sd = &p->ksched_data;
+			sd->demand = get_cores_demand(p);
+			/* The reservations sum to at most avail */
+			sd->fair_share = MIN(sd->nr_reserved, sd->demand);
+			avail -= sd->fair_share;
+		}
+	}
+	while (avail) {
+		total_shares = 0;
+		for (int i = 0; i < 2; i++) {
+			TAILQ_FOREACH(p, lists[i], ksched_data.proc_link) {
+				sd = &p->ksched_data;
+				if (sd->fair_share < sd->demand)
+					total_shares += sd->shares;
+			}
+		}
+		if (!total_shares)
+			return;
+		given = 0;
+		for (int i = 0; i < 2; i++) {
+			TAILQ_FOREACH(p, lists[i], ksched_data.proc_link) {
+				sd = &p->ksched_data;
+				if (sd->fair_share >= sd->demand)
+					continue;
+				amt = MIN(avail * sd->shares / total_shares,
+				          sd->demand - sd->fair_share);
+				sd->fair_share += amt;
+				given += amt;
+			}
+		}
+		if (!given)
+			break;
+		avail -= given;
+	}
+	/* Whatever didn't divide evenly */
+	avail = __fair_share_leftovers(avail, TRUE);
+	__fair_share_leftovers(avail, FALSE);
+}
+
+/* Finds a core that p can preempt to get closer to its fair share, given that
+ * p has or is about to get nr_held cores.  We take from whoever is the most
+ * over their share, but never cores provisioned to their current owner, nor
+ * from an owner at or below its reservation.  Returns the pcoreid or -1. */
+static uint32_t __find_fair_share_core(struct proc *p, uint32_t nr_held)
+{
+	struct proc *owner;
+	long over, max_over = 0;
+	uint32_t ret = -1;
+
+	if (nr_held >= p->ksched_data.fair_share)
+		return -1;
+	for (int i = 0; i < num_cores; i++) {
+		owner = get_alloc_proc(i);
+		if (!owner || (owner == p) || (get_prov_proc(i) == owner))
+			continue;
+		if (owner->procinfo->res_grant[RES_CORES] <=
+		    owner->ksched_data.nr_reserved)
+			continue;
+		over = (long)owner->procinfo->res_grant[RES_CORES] -
+		       (long)owner->ksched_data.fair_share;
+		if (over > max_over) {
+			max_over = over;
+			ret = i;
+		}
+	}
+	return ret;
+}
+
+/* Returns TRUE if we can preempt pcoreid from owner now.  An owner with a
+ * preempt lead keeps the core until the lead passes, counting from the first
+ * time we ask.  That first time, we return the deadline in *warn_at, and the
+ * caller warns the owner once it unlocks.  Hold the sched_lock. */
+static bool __preempt_lead_passed(struct proc *owner, uint32_t pcoreid,
+                                  uint64_t *warn_at)
+{
+	uint64_t lead = owner->ksched_data.preempt_lead;
+
+	*warn_at = 0;
+	if (!lead)
+		return TRUE;
+	if (preempt_deadline[pcoreid])
+		return read_tsc() >= preempt_deadline[pcoreid];
+	preempt_deadline[pcoreid] = read_tsc() + usec2tsc(lead);
+	*warn_at = preempt_deadline[pcoreid];
+	return FALSE;
+}
+
 /* Actual work of the MCP kscheduler.  if we were called by poke_ksched, *arg
  * might be the process who wanted special service.  this would be the case if
  * we weren't already running the ksched.  Sort of a ghetto way to "post work",
@@ -382,6 +727,7 @@ static void __run_mcp_ksched(void *arg)
 	struct proc_list *temp_mcp_list;
 	/* locking to protect the MCP lists' integrity and membership */
 	spin_lock(&sched_lock);
+	__compute_fair_shares();
 	/* 2-pass scheme: check each proc on the primary list (FCFS).  if they need
 	 * nothing, put them on the secondary list.  if they need something, rip
 	 * them off the list, service them, and if they are still not dying, put
@@ -447,11 +793,8 @@ void run_scheduler(void)
 	/* MCP scheduling: post work, then poke.  for now, i just want the func to
 	 * run again, so merely a poke is sufficient. */
 	poke(&ksched_poker, 0);
-	if (management_core()) {
-		spin_lock(&sched_lock);
+	if (is_ll_core(core_id()))
 		__schedule_scp();
-		spin_unlock(&sched_lock);
-	}
 }
 
 /* A process is asking the ksched to look at its resource desires.  The
@@ -464,6 +807,19 @@ void poke_ksched(struct proc *p, unsigned int res_type)
 	if (!__proc_is_mcp(p))
 		return;
 	poke(&ksched_poker, p);
+	/* in case we couldn't give them everything, keep trying */
+	kick_ksched_tick();
+}
+
+/* Zeroes free pages for the page allocator's zero pools until they are full or
+ * we have something better to do.  We let IRQs in between batches, so we don't
+ * hold up IPIs and timers.  Any RKMs that come in will get run by smp_idle(). */
+static void idle_zero_pages(void)
+{
+	while (!has_routine_kmsg() && page_zero_idle()) {
+		enable_irq();
+		disable_irq();
+	}
 }
 
 /* The calling cpu/core has nothing to do and plans to idle/halt.  This is an
@@ -473,17 +829,18 @@ void poke_ksched(struct proc *p, unsigned int res_type)
 void cpu_bored(void)
 {
 	bool new_proc = FALSE;
-	if (!management_core())
+	if (!is_ll_core(core_id())) {
+		idle_zero_pages();
 		return;
-	spin_lock(&sched_lock);
+	}
 	new_proc = __schedule_scp();
-	spin_unlock(&sched_lock);
 	/* if we just scheduled a proc, we need to manually restart it, instead of
 	 * returning.  if we return, the core will halt. */
 	if (new_proc) {
 		proc_restartcore();
 		assert(0);
 	}
+	idle_zero_pages();
 	/* Could drop into the monitor if there are no processes at all.  For now,
 	 * the 'call of the giraffe' suffices. */
 }
@@ -495,6 +852,7 @@ void cpu_bored(void)
 void avail_res_changed(int res_type, long change)
 {
 	printk("[kernel] ksched doesn't track any resources yet!\n");
+	kick_ksched_tick();
 }
 
 int get_any_idle_core(void)
@@ -519,24 +877,26 @@ void put_idle_core(int coreid)
 	spin_lock(&sched_lock);
 	__put_idle_core(coreid);
 	spin_unlock(&sched_lock);
+	kick_ksched_tick();
 }
 
 /* This deals with a request for more cores.  The amt of new cores needed is
  * passed in.  The ksched lock is held, but we are free to unlock if we want
  * (and we must, if calling out of the ksched to anything high-level).
  *
- * Side note: if we want to warn, then we can't deal with this proc's prov'd
- * cores until we wait til the alarm goes off.  would need to put all
- * alarmed cores on a list and wait til the alarm goes off to do the full
- * preempt.  and when those cores come in voluntarily, we'd need to know to
- * give them to this proc. */
+ * If the core we want belongs to a proc with a preempt lead, we warn it and
+ * stop: the owner can yield the core, which puts it on the idle list, and
+ * otherwise a later tick takes it once the lead has passed.  Either way, we
+ * hand out what we have so far. */
 static void __core_request(struct proc *p, uint32_t amt_needed)
 {
 	uint32_t nr_to_grant = 0;
 	uint32_t corelist[num_cores];
 	uint32_t pcoreid;
 	struct proc *proc_to_preempt;
-	bool success;
+	uint32_t nr_held = p->procinfo->res_grant[RES_CORES];
+	uint64_t warn_at;
+	bool success, fair_preempt;
 	/* we come in holding the ksched lock, and we hold it here to protect
 	 * allocations and provisioning. */
 	/* get all available cores from their prov_not_alloc list.  the list might
@@ -546,22 +906,39 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 		/* Find the next best core to allocate to p. It may be a core
 		 * provisioned to p, and it might not be. */
 		pcoreid = __find_best_core_to_alloc(p);
+		/* If there's nothing idle or provisioned to us, we might be owed a
+		 * core by someone over their fair share. */
+		fair_preempt = FALSE;
+		if (pcoreid == -1) {
+			pcoreid = __find_fair_share_core(p, nr_held + nr_to_grant);
+			fair_preempt = TRUE;
+		}
 		/* If no core is returned, we know that there are no more cores to give
 		 * out, so we exit the loop. */
 		if (pcoreid == -1)
 			break;
 		/* If the pcore chosen currently has a proc allocated to it, we know
-		 * it must be provisioned to p, but not allocated to it. We need to try
-		 * to preempt. After this block, the core will be track_dealloc'd and
+		 * it must be provisioned to p, but not allocated to it, or that its
+		 * owner is over its fair share. We need to try to preempt. After this block, the core will be track_dealloc'd and
 		 * on the idle list (regardless of whether we had to preempt or not) */
 		if (get_alloc_proc(pcoreid)) {
 			proc_to_preempt = get_alloc_proc(pcoreid);
 			/* would break both preemption and maybe the later decref */
 			assert(proc_to_preempt != p);
+			if (!__preempt_lead_passed(proc_to_preempt, pcoreid, &warn_at)) {
+				if (warn_at) {
+					proc_incref(proc_to_preempt, 1);
+					spin_unlock(&sched_lock);
+					proc_preempt_warn_core(proc_to_preempt, pcoreid, warn_at);
+					spin_lock(&sched_lock);
+					proc_decref(proc_to_preempt);
+				}
+				break;
+			}
 			/* need to keep a valid, external ref when we unlock */
 			proc_incref(proc_to_preempt, 1);
 			spin_unlock(&sched_lock);
-			/* sending no warning time for now - just an immediate preempt. */
+			/* any lead time has passed, so this is an immediate preempt */
 			success = proc_preempt_core(proc_to_preempt, pcoreid, 0);
 			/* reaquire locks to protect provisioning and idle lists */
 			spin_lock(&sched_lock);
@@ -603,8 +980,9 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 			/* no longer need to keep p_to_pre alive */
 			proc_decref(proc_to_preempt);
 			/* might not be prov to p anymore (rare race). pcoreid is idle - we
-			 * might get it later, or maybe we'll give it to its rightful proc*/
-			if (get_prov_proc(pcoreid) != p)
+			 * might get it later, or maybe we'll give it to its rightful proc.
+			 * Fair share preemptions were never about provisioning. */
+			if (!fair_preempt && (get_prov_proc(pcoreid) != p))
 				continue;
 		}
 		/* At this point, the pcore is idle, regardless of how we got here
@@ -618,6 +996,7 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 		 * (regardless of how we got here). */
 		corelist[nr_to_grant] = pcoreid;
 		nr_to_grant++;
+		preempt_deadline[pcoreid] = 0;
 		__track_core_alloc(p, pcoreid);
 	}
 	/* Now, actually give them out */
@@ -646,6 +1025,7 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 			 * RUNNING_Ms).  You can give small groups of cores, then run them
 			 * (which is more efficient than interleaving runs with the gives
 			 * for bulk preempted processes). */
+			tracepoint(sched_mcp_grant, p->pid, nr_to_grant, amt_needed);
 			__proc_run_m(p);
 			spin_unlock(&p->proc_lock);
 			/* main mcp_ksched wants this held (it came to __core_req held) */
@@ -679,15 +1059,68 @@ int provision_core(struct proc *p, uint32_t pcoreid)
 	return 0;
 }
 
+int sched_set_shares(struct proc *p, uint32_t shares)
+{
+	if (!shares || (shares > SCHED_MAX_SHARES)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	spin_lock(&sched_lock);
+	p->ksched_data.shares = shares;
+	spin_unlock(&sched_lock);
+	/* The new split takes effect the next time the ksched runs */
+	poke(&ksched_poker, p);
+	kick_ksched_tick();
+	return 0;
+}
+
+/* Reserves nr CG cores for p: they count toward p's fair share before the rest
+ * are split by shares, and we won't preempt p below them for someone else's
+ * fair share.  Whenever we do preempt one of p's cores, p gets lead_usec of
+ * warning first.  The reservations can't add up to more than the CG cores. */
+int sched_reserve_cores(struct proc *p, uint32_t nr, uint64_t lead_usec)
+{
+	if (lead_usec > SCHED_MAX_PREEMPT_LEAD_USEC) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	spin_lock(&sched_lock);
+	/* __sched_proc_destroy() gives back the reservation under this lock */
+	if (proc_is_dying(p)) {
+		spin_unlock(&sched_lock);
+		set_errno(ESRCH);
+		return -1;
+	}
+	if (nr_cores_reserved - p->ksched_data.nr_reserved + nr >
+	    max_vcores(NULL)) {
+		spin_unlock(&sched_lock);
+		set_errno(EBUSY);
+		return -1;
+	}
+	nr_cores_reserved = nr_cores_reserved - p->ksched_data.nr_reserved + nr;
+	p->ksched_data.nr_reserved = nr;
+	p->ksched_data.preempt_lead = lead_usec;
+	spin_unlock(&sched_lock);
+	poke(&ksched_poker, p);
+	kick_ksched_tick();
+	return 0;
+}
+
 /************** Debugging **************/
 void sched_diag(void)
 {
 	struct proc *p;
+	struct scp_runq *rq;
+
+	for (int i = 0; i < nr_ll_cores(); i++) {
+		rq = &scp_runqs[i];
+		spin_lock(&rq->lock);
+		printk("LL core %d: %u runnable _Ss\n", i, rq->nr_runnable);
+		TAILQ_FOREACH(p, &rq->runnable, ksched_data.proc_link)
+			printk("\tRunnable _S PID: %d\n", p->pid);
+		spin_unlock(&rq->lock);
+	}
 	spin_lock(&sched_lock);
-	TAILQ_FOREACH(p, &runnable_scps, ksched_data.proc_link)
-		printk("Runnable _S PID: %d\n", p->pid);
-	TAILQ_FOREACH(p, &unrunnable_scps, ksched_data.proc_link)
-		printk("Unrunnable _S PID: %d\n", p->pid);
 	TAILQ_FOREACH(p, primary_mcps, ksched_data.proc_link)
 		printk("Primary MCP PID: %d\n", p->pid);
 	TAILQ_FOREACH(p, secondary_mcps, ksched_data.proc_link)
@@ -700,6 +1133,10 @@ void print_resources(struct proc *p)
 {
 	printk("--------------------\n");
 	printk("PID: %d\n", p->pid);
+	printk("Shares: %u, fair share: %u cores\n", p->ksched_data.shares,
+	       p->ksched_data.fair_share);
+	printk("Reserved: %u cores, preempt lead: %llu usec\n",
+	       p->ksched_data.nr_reserved, p->ksched_data.preempt_lead);
 	printk("--------------------\n");
 	for (int i = 0; i < MAX_NUM_RESOURCES; i++)
 		printk("Res type: %02d, amt wanted: %08d, amt granted: %08d\n", i,
@@ -713,9 +1150,9 @@ void print_all_resources(void)
 	{
 		print_resources((struct proc*)item);
 	}
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, __print_resources, NULL);
-	spin_unlock(&pid_hash_lock);
+	rcu_read_lock();
+	chash_for_each(&pid_hash, __print_resources, NULL);
+	rcu_read_unlock();
 }
 
 void next_core_to_alloc(uint32_t pcoreid)
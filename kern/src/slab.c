@@ -9,6 +9,15 @@
  * Note that we don't have a hash table for buf to bufctl for the large buffer
  * objects, so we use the same style for small objects: store the pointer to the
  * controlling bufctl at the top of the slab object.  Fix this with TODO (BUF).
+ *
+ * The magazine layer can't be set up until we know num_cores, which is after
+ * the slab allocator is up.  Until then (and for KMC_NOMAG caches), allocs and
+ * frees go straight to the slab layer.  Lock ordering is pcpu cache -> depot ->
+ * cache_lock.
+ *
+ * Slabs get their pages from their node when they can, but the page allocator
+ * falls back to other nodes.  A slab's node is wherever its memory actually
+ * came from, worked out when it's grown, and it stays on that node's lists.
  */
 
 #include <slab.h>
@@ -16,17 +25,46 @@
 #include <assert.h>
 #include <pmap.h>
 #include <kmalloc.h>
+#include <percpu.h>
+#include <memprof.h>
 
 struct kmem_cache_list kmem_caches;
 spinlock_t kmem_caches_lock;
 
 /* Backend/internal functions, defined later.  Grab the lock before calling
- * these. */
-static bool kmem_cache_grow(struct kmem_cache *cp);
+ * kmem_cache_grow().  The slab layer's alloc and free grab it themselves. */
+static struct kmem_slab *kmem_cache_grow(struct kmem_cache *cp, int node);
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags,
+                                    int node);
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf);
+static void kmem_cache_build_pcpu(struct kmem_cache *cp);
 
 /* Cache of the kmem_cache objects, needed for bootstrapping */
 struct kmem_cache kmem_cache_cache;
-struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache;
+struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache, *kmem_magazine_cache;
+
+/* Set once num_cores is known and we can build the pcpu caches. */
+static bool kmem_pcpu_ready;
+
+/* Smaller objects get bigger magazines, roughly following the paper. */
+static unsigned int kmem_default_magsize(size_t obj_size)
+{
+	if (obj_size <= 64)
+		return KMC_MAG_MAX_SZ / 2;
+	if (obj_size <= SLAB_LARGE_CUTOFF)
+		return KMC_MAG_MIN_SZ * 2;
+	return KMC_MAG_MIN_SZ;
+}
+
+static void kmem_depot_init(struct kmem_depot *depot, size_t obj_size)
+{
+	spinlock_init_irqsave(&depot->lock);
+	SLIST_INIT(&depot->not_empty);
+	SLIST_INIT(&depot->empty);
+	depot->magsize = kmem_default_magsize(obj_size);
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+}
 
 static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                                 size_t obj_size, int align, int flags,
@@ -40,12 +78,18 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->obj_size = obj_size;
 	kc->align = align;
 	kc->flags = flags;
-	TAILQ_INIT(&kc->full_slab_list);
-	TAILQ_INIT(&kc->partial_slab_list);
-	TAILQ_INIT(&kc->empty_slab_list);
+	for (int i = 0; i < KMC_MAX_NODES; i++) {
+		TAILQ_INIT(&kc->nodes[i].full);
+		TAILQ_INIT(&kc->nodes[i].partial);
+		TAILQ_INIT(&kc->nodes[i].empty);
+		kmem_depot_init(&kc->depots[i], obj_size);
+	}
 	kc->ctor = ctor;
 	kc->dtor = dtor;
 	kc->nr_cur_alloc = 0;
+	kc->pcpu_caches = NULL;
+	if (kmem_pcpu_ready)
+		kmem_cache_build_pcpu(kc);
 
 	/* put in cache list based on it's size */
 	struct kmem_cache *i, *prev = NULL;
@@ -66,19 +110,26 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 
 void kmem_cache_init(void)
 {
+	static_assert(KMC_MAX_NODES >= MAX_MEM_NODES);
 	spinlock_init_irqsave(&kmem_caches_lock);
 	SLIST_INIT(&kmem_caches);
 	/* We need to call the __ version directly to bootstrap the global
 	 * kmem_cache_cache. */
 	__kmem_cache_create(&kmem_cache_cache, "kmem_cache",
 	                    sizeof(struct kmem_cache),
-	                    __alignof__(struct kmem_cache), 0, NULL, NULL);
-	/* Build the slab and bufctl caches */
+	                    __alignof__(struct kmem_cache), KMC_NOMAG, NULL, NULL);
+	/* Build the slab and bufctl caches.  These, and the magazines themselves,
+	 * are used by the magazine layer, so they can't have one. */
 	kmem_slab_cache = kmem_cache_create("kmem_slab", sizeof(struct kmem_slab),
-	                       __alignof__(struct kmem_slab), 0, NULL, NULL);
+	                       __alignof__(struct kmem_slab), KMC_NOMAG, NULL, NULL);
 	kmem_bufctl_cache = kmem_cache_create("kmem_bufctl",
 	                         sizeof(struct kmem_bufctl),
-	                         __alignof__(struct kmem_bufctl), 0, NULL, NULL);
+	                         __alignof__(struct kmem_bufctl), KMC_NOMAG, NULL,
+	                         NULL);
+	kmem_magazine_cache = kmem_cache_create("kmem_magazine",
+	                           sizeof(struct kmem_magazine),
+	                           __alignof__(struct kmem_magazine), KMC_NOMAG,
+	                           NULL, NULL);
 }
 
 /* Cache management */
@@ -128,24 +179,201 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 	}
 }
 
-/* Once you call destroy, never use this cache again... o/w there may be weird
- * races, and other serious issues.  */
-void kmem_cache_destroy(struct kmem_cache *cp)
+/* Magazine layer helpers.  Magazines come straight from the slab layer of
+ * kmem_magazine_cache, which has no magazines of its own. */
+
+static struct kmem_magazine *kmem_mag_alloc(void)
+{
+	struct kmem_magazine *mag;
+
+	mag = __kmem_alloc_from_slab(kmem_magazine_cache, 0, local_mem_node());
+	if (mag)
+		mag->nr_rounds = 0;
+	return mag;
+}
+
+static void kmem_mag_free(struct kmem_magazine *mag)
+{
+	__kmem_free_to_slab(kmem_magazine_cache, mag);
+}
+
+/* Returns all of a magazine's rounds to the slab layer. */
+static void kmem_mag_drain(struct kmem_cache *cp, struct kmem_magazine *mag)
+{
+	for (int i = 0; i < mag->nr_rounds; i++)
+		__kmem_free_to_slab(cp, mag->rounds[i]);
+	mag->nr_rounds = 0;
+}
+
+static void kmem_pcc_swap_mags(struct kmem_pcpu_cache *pcc)
+{
+	struct kmem_magazine *temp = pcc->loaded;
+
+	pcc->loaded = pcc->prev;
+	pcc->prev = temp;
+}
+
+static struct kmem_pcpu_cache *get_my_pcpu_cache(struct kmem_cache *cp)
+{
+	/* Before core_id() works, everyone shares core 0's, which is safe since
+	 * the pcpu cache is locked. */
+	return &cp->pcpu_caches[core_id_early()];
+}
+
+static struct kmem_depot *get_my_depot(struct kmem_cache *cp)
+{
+	return &cp->depots[local_mem_node()];
+}
+
+/* Sets up the magazine layer for cp.  If we can't get the magazines, the cache
+ * will just work without them. */
+static void kmem_cache_build_pcpu(struct kmem_cache *cp)
+{
+	struct kmem_pcpu_cache *pcpu_caches, *pcc;
+	int i;
+
+	if (cp->flags & KMC_NOMAG)
+		return;
+	pcpu_caches = kmalloc_align(sizeof(struct kmem_pcpu_cache) * num_cores,
+	                            0, ARCH_CL_SIZE);
+	if (!pcpu_caches)
+		return;
+	for (i = 0; i < num_cores; i++) {
+		pcc = &pcpu_caches[i];
+		spinlock_init_irqsave(&pcc->lock);
+		pcc->magsize = cp->depots[0].magsize;
+		pcc->nr_allocs_ever = 0;
+		pcc->loaded = kmem_mag_alloc();
+		pcc->prev = kmem_mag_alloc();
+		if (!pcc->loaded || !pcc->prev)
+			goto out_nomem;
+	}
+	/* Other cores can see the pcpu caches as soon as we publish the pointer */
+	wmb();
+	cp->pcpu_caches = pcpu_caches;
+	return;
+
+out_nomem:
+	for (int j = 0; j <= i; j++) {
+		if (pcpu_caches[j].loaded)
+			kmem_mag_free(pcpu_caches[j].loaded);
+		if (pcpu_caches[j].prev)
+			kmem_mag_free(pcpu_caches[j].prev);
+	}
+	kfree(pcpu_caches);
+	warn("Unable to build the magazine layer for %s", cp->name);
+}
+
+/* Caches made before percpu_init() (e.g. kmalloc's) get their magazines now.
+ * Anyone created later builds its own in __kmem_cache_create(). */
+DEFINE_PERCPU_INIT(kmem_cache_init_pcpu);
+
+static void kmem_cache_init_pcpu(void)
+{
+	struct kmem_cache *i;
+
+	spin_lock_irqsave(&kmem_caches_lock);
+	SLIST_FOREACH(i, &kmem_caches, link)
+		kmem_cache_build_pcpu(i);
+	kmem_pcpu_ready = TRUE;
+	spin_unlock_irqsave(&kmem_caches_lock);
+}
+
+/* Returns all of a depot's rounds to the slab layer and frees its magazines. */
+static void kmem_depot_flush(struct kmem_cache *cp, struct kmem_depot *depot)
+{
+	struct kmem_mag_slist not_empty, empty;
+	struct kmem_magazine *mag;
+
+	/* Pull the lists out of the depot, so we don't drain with it locked */
+	spin_lock_irqsave(&depot->lock);
+	not_empty = depot->not_empty;
+	empty = depot->empty;
+	SLIST_INIT(&depot->not_empty);
+	SLIST_INIT(&depot->empty);
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+	spin_unlock_irqsave(&depot->lock);
+	while ((mag = SLIST_FIRST(&not_empty))) {
+		SLIST_REMOVE_HEAD(&not_empty, link);
+		kmem_mag_drain(cp, mag);
+		kmem_mag_free(mag);
+	}
+	while ((mag = SLIST_FIRST(&empty))) {
+		SLIST_REMOVE_HEAD(&empty, link);
+		kmem_mag_free(mag);
+	}
+}
+
+/* Returns every round in the magazine layer (every core's magazines, plus the
+ * depots) to the slab layer.  The pcpu caches keep their empty magazines, but
+ * the depots' are freed. */
+static void kmem_cache_flush_mags(struct kmem_cache *cp)
+{
+	struct kmem_pcpu_cache *pcc;
+
+	if (!cp->pcpu_caches)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		pcc = &cp->pcpu_caches[i];
+		spin_lock_irqsave(&pcc->lock);
+		kmem_mag_drain(cp, pcc->loaded);
+		kmem_mag_drain(cp, pcc->prev);
+		spin_unlock_irqsave(&pcc->lock);
+	}
+	for (int i = 0; i < nr_mem_nodes; i++)
+		kmem_depot_flush(cp, &cp->depots[i]);
+}
+
+/* Sets the number of rounds per magazine.  The pcpu caches pick up the new size
+ * the next time they swap magazines with the depot. */
+void kmem_cache_set_magsize(struct kmem_cache *cp, unsigned int magsize)
+{
+	magsize = MAX(magsize, KMC_MAG_MIN_SZ);
+	magsize = MIN(magsize, KMC_MAG_MAX_SZ);
+	for (int i = 0; i < KMC_MAX_NODES; i++) {
+		spin_lock_irqsave(&cp->depots[i].lock);
+		cp->depots[i].magsize = magsize;
+		spin_unlock_irqsave(&cp->depots[i].lock);
+	}
+}
+
+/* Destroys every slab on the list.  We can't use a regular FOREACH here, since
+ * the link element is stored in the slab struct, which is stored on the page
+ * that we are freeing.  Hold the cache_lock. */
+static void kmem_slab_list_destroy(struct kmem_cache *cp,
+                                   struct kmem_slab_list *list)
 {
 	struct kmem_slab *a_slab, *next;
 
-	spin_lock_irqsave(&cp->cache_lock);
-	assert(TAILQ_EMPTY(&cp->full_slab_list));
-	assert(TAILQ_EMPTY(&cp->partial_slab_list));
-	/* Clean out the empty list.  We can't use a regular FOREACH here, since the
-	 * link element is stored in the slab struct, which is stored on the page
-	 * that we are freeing. */
-	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
+	a_slab = TAILQ_FIRST(list);
 	while (a_slab) {
 		next = TAILQ_NEXT(a_slab, link);
 		kmem_slab_destroy(cp, a_slab);
 		a_slab = next;
 	}
+	TAILQ_INIT(list);
+}
+
+/* Once you call destroy, never use this cache again... o/w there may be weird
+ * races, and other serious issues.  */
+void kmem_cache_destroy(struct kmem_cache *cp)
+{
+	kmem_cache_flush_mags(cp);
+	if (cp->pcpu_caches) {
+		for (int i = 0; i < num_cores; i++) {
+			kmem_mag_free(cp->pcpu_caches[i].loaded);
+			kmem_mag_free(cp->pcpu_caches[i].prev);
+		}
+		kfree(cp->pcpu_caches);
+		cp->pcpu_caches = NULL;
+	}
+	spin_lock_irqsave(&cp->cache_lock);
+	for (int i = 0; i < KMC_MAX_NODES; i++) {
+		assert(TAILQ_EMPTY(&cp->nodes[i].full));
+		assert(TAILQ_EMPTY(&cp->nodes[i].partial));
+		kmem_slab_list_destroy(cp, &cp->nodes[i].empty);
+	}
 	spin_lock_irqsave(&kmem_caches_lock);
 	SLIST_REMOVE(&kmem_caches, cp, kmem_cache, link);
 	spin_unlock_irqsave(&kmem_caches_lock);
@@ -153,28 +381,50 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
-/* Front end: clients of caches use these */
-void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+/* Returns a slab with a free object from ns, making it partial if it was
+ * empty, or 0 if ns has none.  Hold the cache_lock. */
+static struct kmem_slab *__kmem_node_get_slab(struct kmem_node_slabs *ns)
+{
+	struct kmem_slab *a_slab = TAILQ_FIRST(&ns->partial);
+
+	if (a_slab)
+		return a_slab;
+	a_slab = TAILQ_FIRST(&ns->empty);
+	if (!a_slab)
+		return NULL;
+	TAILQ_REMOVE(&ns->empty, a_slab, link);
+	TAILQ_INSERT_HEAD(&ns->partial, a_slab, link);
+	return a_slab;
+}
+
+/* Slab layer: gets an object from node's slab lists, growing if necessary.  If
+ * we can't grow, we'll take one from another node.  Returns 0 if there aren't
+ * any anywhere. */
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags,
+                                    int node)
 {
+	struct kmem_node_slabs *ns = &cp->nodes[node];
+	struct kmem_slab *a_slab;
 	void *retval = NULL;
+
 	spin_lock_irqsave(&cp->cache_lock);
-	// look at partial list
-	struct kmem_slab *a_slab = TAILQ_FIRST(&cp->partial_slab_list);
-	// 	if none, go to empty list and get an empty and make it partial
+	a_slab = __kmem_node_get_slab(ns);
 	if (!a_slab) {
 		// TODO: think about non-sleeping flags
-		if (TAILQ_EMPTY(&cp->empty_slab_list) &&
-			!kmem_cache_grow(cp)) {
-			spin_unlock_irqsave(&cp->cache_lock);
-			if (flags & MEM_ERROR)
-				error(ENOMEM, ERROR_FIXME);
-			else
-				panic("[German Accent]: OOM for a small slab growth!!!");
+		a_slab = kmem_cache_grow(cp, node);
+		if (a_slab) {
+			/* The pages might have come from another node */
+			ns = &cp->nodes[a_slab->node];
+			a_slab = __kmem_node_get_slab(ns);
 		}
-		// move to partial list
-		a_slab = TAILQ_FIRST(&cp->empty_slab_list);
-		TAILQ_REMOVE(&cp->empty_slab_list, a_slab, link);
-		TAILQ_INSERT_HEAD(&cp->partial_slab_list, a_slab, link);
+	}
+	for (int i = 1; !a_slab && (i < nr_mem_nodes); i++) {
+		ns = &cp->nodes[(node + i) % nr_mem_nodes];
+		a_slab = __kmem_node_get_slab(ns);
+	}
+	if (!a_slab) {
+		spin_unlock_irqsave(&cp->cache_lock);
+		return NULL;
 	}
 	// have a partial now (a_slab), get an item, return item
 	if (cp->obj_size <= SLAB_LARGE_CUTOFF) {
@@ -192,22 +442,92 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
 	a_slab->num_busy_obj++;
 	// Check if we are full, if so, move to the full list
 	if (a_slab->num_busy_obj == a_slab->num_total_obj) {
-		TAILQ_REMOVE(&cp->partial_slab_list, a_slab, link);
-		TAILQ_INSERT_HEAD(&cp->full_slab_list, a_slab, link);
+		TAILQ_REMOVE(&ns->partial, a_slab, link);
+		TAILQ_INSERT_HEAD(&ns->full, a_slab, link);
 	}
 	cp->nr_cur_alloc++;
 	spin_unlock_irqsave(&cp->cache_lock);
 	return retval;
 }
 
+static void *__kmem_cache_alloc(struct kmem_cache *cp, int flags, int node)
+{
+	struct kmem_depot *depot;
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+	void *retval;
+
+	if ((node < 0) || (node >= nr_mem_nodes))
+		node = local_mem_node();
+	/* Our magazines only have our node's objects */
+	if (!cp->pcpu_caches || (node != local_mem_node()))
+		goto slab_alloc;
+	depot = get_my_depot(cp);
+	pcc = get_my_pcpu_cache(cp);
+	spin_lock_irqsave(&pcc->lock);
+try_loaded:
+	if (pcc->loaded->nr_rounds) {
+		retval = pcc->loaded->rounds[--pcc->loaded->nr_rounds];
+		pcc->nr_allocs_ever++;
+		spin_unlock_irqsave(&pcc->lock);
+		return retval;
+	}
+	if (pcc->prev->nr_rounds) {
+		kmem_pcc_swap_mags(pcc);
+		goto try_loaded;
+	}
+	/* Both are empty: trade our prev for a full one from the depot */
+	spin_lock_irqsave(&depot->lock);
+	mag = SLIST_FIRST(&depot->not_empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		depot->nr_not_empty--;
+		SLIST_INSERT_HEAD(&depot->empty, pcc->prev, link);
+		depot->nr_empty++;
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		pcc->magsize = depot->magsize;
+		spin_unlock_irqsave(&depot->lock);
+		goto try_loaded;
+	}
+	spin_unlock_irqsave(&depot->lock);
+	spin_unlock_irqsave(&pcc->lock);
+slab_alloc:
+	retval = __kmem_alloc_from_slab(cp, flags, node);
+	if (!retval) {
+		if (flags & MEM_ERROR)
+			error(ENOMEM, ERROR_FIXME);
+		else
+			panic("[German Accent]: OOM for a small slab growth!!!");
+	}
+	return retval;
+}
+
+/* Front end: clients of caches use these */
+void *kmem_cache_alloc_node(struct kmem_cache *cp, int flags, int node)
+{
+	void *retval = __kmem_cache_alloc(cp, flags, node);
+
+	if (!(cp->flags & KMC_NOTRACE))
+		memprof_alloc(retval, cp->obj_size, MEMPROF_SLAB);
+	return retval;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+{
+	return kmem_cache_alloc_node(cp, flags, -1);
+}
+
 static inline struct kmem_bufctl *buf2bufctl(void *buf, size_t offset)
 {
 	// TODO: hash table for back reference (BUF)
 	return *((struct kmem_bufctl**)(buf + offset));
 }
 
-void kmem_cache_free(struct kmem_cache *cp, void *buf)
+/* Slab layer: returns buf to its slab */
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 {
+	struct kmem_node_slabs *ns;
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
 
@@ -229,27 +549,83 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf)
 	}
 	a_slab->num_busy_obj--;
 	cp->nr_cur_alloc--;
+	ns = &cp->nodes[a_slab->node];
 	// if it was full, move it to partial
 	if (a_slab->num_busy_obj + 1 == a_slab->num_total_obj) {
-		TAILQ_REMOVE(&cp->full_slab_list, a_slab, link);
-		TAILQ_INSERT_HEAD(&cp->partial_slab_list, a_slab, link);
+		TAILQ_REMOVE(&ns->full, a_slab, link);
+		TAILQ_INSERT_HEAD(&ns->partial, a_slab, link);
 	} else if (!a_slab->num_busy_obj) {
 		// if there are none, move to from partial to empty
-		TAILQ_REMOVE(&cp->partial_slab_list, a_slab, link);
-		TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+		TAILQ_REMOVE(&ns->partial, a_slab, link);
+		TAILQ_INSERT_HEAD(&ns->empty, a_slab, link);
 	}
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
+void kmem_cache_free(struct kmem_cache *cp, void *buf)
+{
+	struct kmem_depot *depot;
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+
+	if (!(cp->flags & KMC_NOTRACE))
+		memprof_free(buf);
+	if (!cp->pcpu_caches)
+		goto slab_free;
+	/* Other nodes' objects go home, so they don't get reused over here */
+	if ((nr_mem_nodes > 1) && (pa_to_mem_node(PADDR(buf)) != local_mem_node()))
+		goto slab_free;
+	depot = get_my_depot(cp);
+	pcc = get_my_pcpu_cache(cp);
+	spin_lock_irqsave(&pcc->lock);
+try_free:
+	if (pcc->loaded->nr_rounds < pcc->magsize) {
+		pcc->loaded->rounds[pcc->loaded->nr_rounds++] = buf;
+		spin_unlock_irqsave(&pcc->lock);
+		return;
+	}
+	if (pcc->prev->nr_rounds < pcc->magsize) {
+		kmem_pcc_swap_mags(pcc);
+		goto try_free;
+	}
+	/* Both are full: trade our prev for an empty one from the depot */
+	spin_lock_irqsave(&depot->lock);
+	mag = SLIST_FIRST(&depot->empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		depot->nr_empty--;
+		SLIST_INSERT_HEAD(&depot->not_empty, pcc->prev, link);
+		depot->nr_not_empty++;
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		pcc->magsize = depot->magsize;
+		spin_unlock_irqsave(&depot->lock);
+		goto try_free;
+	}
+	spin_unlock_irqsave(&depot->lock);
+	/* The depot is out of empty magazines, so we'll try to make one. */
+	mag = kmem_mag_alloc();
+	if (mag) {
+		spin_lock_irqsave(&depot->lock);
+		SLIST_INSERT_HEAD(&depot->empty, mag, link);
+		depot->nr_empty++;
+		spin_unlock_irqsave(&depot->lock);
+		goto try_free;
+	}
+	spin_unlock_irqsave(&pcc->lock);
+slab_free:
+	__kmem_free_to_slab(cp, buf);
+}
+
 /* Back end: internal functions */
-/* When this returns, the cache has at least one slab in the empty list.  If
- * page_alloc fails, there are some serious issues.  This only grows by one slab
- * at a time.
+/* Adds a slab to the empty list of the node its memory came from, preferably
+ * node, and returns it.  If page_alloc fails, there are some serious issues and
+ * we return 0.  This only grows by one slab at a time.
  *
  * Grab the cache lock before calling this.
  *
  * TODO: think about page colouring issues with kernel memory allocation. */
-static bool kmem_cache_grow(struct kmem_cache *cp)
+static struct kmem_slab *kmem_cache_grow(struct kmem_cache *cp, int node)
 {
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
@@ -257,8 +633,8 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		// Just get a single page for small slabs
 		page_t *a_page;
 
-		if (kpage_alloc(&a_page))
-			return FALSE;
+		if (kpage_alloc_node(&a_page, node))
+			return NULL;
 		// the slab struct is stored at the end of the page
 		a_slab = (struct kmem_slab*)(page2kva(a_page) + PGSIZE -
 		                             sizeof(struct kmem_slab));
@@ -267,6 +643,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		a_slab->num_busy_obj = 0;
 		a_slab->num_total_obj = (PGSIZE - sizeof(struct kmem_slab)) /
 		                        a_slab->obj_size;
+		a_slab->node = pa_to_mem_node(page2pa(a_page));
 		// TODO: consider staggering this IAW section 4.3
 		a_slab->free_small_obj = page2kva(a_page);
 		/* Walk and create the free list, which is circular.  Each item stores
@@ -283,7 +660,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 	} else {
 		a_slab = kmem_cache_alloc(kmem_slab_cache, 0);
 		if (!a_slab)
-			return FALSE;
+			return NULL;
 		// TODO: hash table for back reference (BUF)
 		a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
 		/* Figure out how much memory we want.  We need at least min_pgs.  We'll
@@ -291,12 +668,13 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		size_t min_pgs = ROUNDUP(NUM_BUF_PER_SLAB * a_slab->obj_size, PGSIZE) /
 		                         PGSIZE;
 		size_t order_pg_alloc = LOG2_UP(min_pgs);
-		void *buf = get_cont_pages(order_pg_alloc, 0);
+		void *buf = get_cont_pages_node(node, order_pg_alloc, 0);
 
 		if (!buf) {
 			kmem_cache_free(kmem_slab_cache, a_slab);
-			return FALSE;
+			return NULL;
 		}
+		a_slab->node = pa_to_mem_node(PADDR(buf));
 		a_slab->num_busy_obj = 0;
 		/* The number of objects is based on the rounded up amt requested. */
 		a_slab->num_total_obj = ((1 << order_pg_alloc) * PGSIZE) /
@@ -316,32 +694,39 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 			buf += a_slab->obj_size;
 		}
 	}
-	// add a_slab to the empty_list
-	TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+	// add a_slab to its node's empty list
+	TAILQ_INSERT_HEAD(&cp->nodes[a_slab->node].empty, a_slab, link);
 
-	return TRUE;
+	return a_slab;
 }
 
-/* This deallocs every slab from the empty list.  TODO: think a bit more about
- * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
+/* This flushes the magazine layer, then deallocs every slab from the empty
+ * list.  TODO: think a bit more about this.  We can do things like not free all
+ * of the empty lists to prevent thrashing.  See 3.4 in the paper. */
 void kmem_cache_reap(struct kmem_cache *cp)
 {
-	struct kmem_slab *a_slab, *next;
-
-	// Destroy all empty slabs.  Refer to the notes about the while loop
+	kmem_cache_flush_mags(cp);
 	spin_lock_irqsave(&cp->cache_lock);
-	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
-	while (a_slab) {
-		next = TAILQ_NEXT(a_slab, link);
-		kmem_slab_destroy(cp, a_slab);
-		a_slab = next;
-	}
+	for (int i = 0; i < KMC_MAX_NODES; i++)
+		kmem_slab_list_destroy(cp, &cp->nodes[i].empty);
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
+/* Reaps every cache in the system.  Used when we're low on memory. */
+void kmem_reap_all(void)
+{
+	struct kmem_cache *i;
+
+	spin_lock_irqsave(&kmem_caches_lock);
+	SLIST_FOREACH(i, &kmem_caches, link)
+		kmem_cache_reap(i);
+	spin_unlock_irqsave(&kmem_caches_lock);
+}
+
 void print_kmem_cache(struct kmem_cache *cp)
 {
+	unsigned int nr_not_empty = 0, nr_empty = 0;
+
 	spin_lock_irqsave(&cp->cache_lock);
 	printk("\nPrinting kmem_cache:\n---------------------\n");
 	printk("Name: %s\n", cp->name);
@@ -350,10 +735,18 @@ void print_kmem_cache(struct kmem_cache *cp)
 	printk("Flags: 0x%08x\n", cp->flags);
 	printk("Constructor: %p\n", cp->ctor);
 	printk("Destructor: %p\n", cp->dtor);
-	printk("Slab Full: %p\n", cp->full_slab_list);
-	printk("Slab Partial: %p\n", cp->partial_slab_list);
-	printk("Slab Empty: %p\n", cp->empty_slab_list);
+	for (int i = 0; i < nr_mem_nodes; i++) {
+		printk("Node %d: Slab Full: %p, Partial: %p, Empty: %p\n", i,
+		       TAILQ_FIRST(&cp->nodes[i].full),
+		       TAILQ_FIRST(&cp->nodes[i].partial),
+		       TAILQ_FIRST(&cp->nodes[i].empty));
+		nr_not_empty += cp->depots[i].nr_not_empty;
+		nr_empty += cp->depots[i].nr_empty;
+	}
 	printk("Current Allocations: %d\n", cp->nr_cur_alloc);
+	printk("Magazine size: %d\n", cp->depots[0].magsize);
+	printk("Depot magazines: %d not empty, %d empty\n", nr_not_empty,
+	       nr_empty);
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
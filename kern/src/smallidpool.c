@@ -2,72 +2,177 @@
  * Ron Minnich <rminnich@google.com>
  * Barret Rhoden <brho@cs.berkeley.edu>
  *
- * Trivial thread-safe ID pool for small sets of things (< 64K)
- * implemented as a stack.
+ * Thread-safe ID pools, with per-core caches.  See smallidpool.h.
+ *
+ * Lock ordering is pcpu cache -> pool.  A get never holds two pcpu locks: it
+ * drops its own before it goes stealing.
  */
 
 #include <smallidpool.h>
 #include <kmalloc.h>
 #include <atomic.h>
+#include <bitops.h>
+#include <smp.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
-struct u16_pool *create_u16_pool(unsigned int size)
+struct u32_pool *create_u32_pool(size_t size)
 {
-	struct u16_pool *id;
-	/* We could have size be a u16, but this might catch bugs where users
-	 * tried to ask for more than 2^16 and had it succeed. */
-	if (size > MAX_U16_POOL_SZ)
+	struct u32_pool *id;
+	size_t nr_longs = BITS_TO_LONGS(size);
+
+	if (!size || size > (1ULL << 32))
 		return NULL;
-	/* ids and check are alloced and aligned right after the id struct */
-	id = kmalloc(sizeof(*id) + sizeof(uint16_t) * size + size, MEM_WAIT);
+	id = kzmalloc(sizeof(*id), MEM_WAIT);
 	spinlock_init_irqsave(&id->lock);
 	id->size = size;
-	id->ids = (void *)&id[1];
-	id->check = (void *)&id->ids[id->size];
-	for (int i = 0; i < id->size; i++) {
-		id->ids[i] = i;
-		// fe rhymes with "free"
-		id->check[i] = 0xfe;
-	}
-	id->tos = 0;
+	id->nr_free = size;
+	id->next = 0;
+	id->free = kmalloc(nr_longs * sizeof(long), MEM_WAIT);
+	id->used = kzmalloc(nr_longs * sizeof(long), MEM_WAIT);
+	memset(id->free, 0xff, nr_longs * sizeof(long));
+	if (size % BITS_PER_LONG)
+		id->free[nr_longs - 1] = BIT(size % BITS_PER_LONG) - 1;
+	id->nr_pcpu = MAX(num_cores, 1);
+	id->pcpu = kzmalloc_align(sizeof(struct u32_pool_pcpu) * id->nr_pcpu,
+	                          MEM_WAIT, ARCH_CL_SIZE);
+	for (int i = 0; i < id->nr_pcpu; i++)
+		spinlock_init_irqsave(&id->pcpu[i].lock);
 	return id;
 }
 
-/* Returns an unused u16, or -1 on failure (pool full or corruption).
- *
- * The invariant is that the stackpointer (TOS) will always point to the next
- * slot that can be popped, if there are any.  All free slots will be below the
- * TOS, ranging from indexes [0, TOS), where if TOS == 0, then there are no free
- * slots to push.  The last valid slot is when TOS == size - 1. */
-int get_u16(struct u16_pool *id)
+/* No one can be using it. */
+void destroy_u32_pool(struct u32_pool *id)
+{
+	kfree(id->pcpu);
+	kfree(id->used);
+	kfree(id->free);
+	kfree(id);
+}
+
+static struct u32_pool_pcpu *get_my_pcpu(struct u32_pool *id)
+{
+	int coreid = core_id_early();
+
+	/* Locked, so sharing one is just slower */
+	return &id->pcpu[coreid < id->nr_pcpu ? coreid : 0];
+}
+
+/* Moves up to U32_POOL_BATCH of the lowest free IDs into pcc, which is empty,
+ * such that the lowest one gets popped first. */
+static void __refill(struct u32_pool *id, struct u32_pool_pcpu *pcc)
 {
-	uint16_t v;
+	uint32_t batch[U32_POOL_BATCH];
+	unsigned int nr = 0;
+	unsigned long *w;
+	unsigned int bit;
+
 	spin_lock_irqsave(&id->lock);
-	if (id->tos == id->size) {
-		spin_unlock_irqsave(&id->lock);
-		return -1;
+	while (nr < U32_POOL_BATCH && id->nr_free) {
+		w = &id->free[id->next];
+		if (!*w) {
+			id->next++;
+			continue;
+		}
+		bit = __builtin_ctzl(*w);
+		*w &= ~BIT(bit);
+		batch[nr++] = id->next * BITS_PER_LONG + bit;
+		id->nr_free--;
+	}
+	spin_unlock_irqsave(&id->lock);
+	for (unsigned int i = 0; i < nr; i++)
+		pcc->ids[i] = batch[nr - 1 - i];
+	pcc->nr = nr;
+}
+
+/* Gives the U32_POOL_BATCH IDs at the bottom of pcc's stack, its oldest, back
+ * to the bitmap. */
+static void __flush(struct u32_pool *id, struct u32_pool_pcpu *pcc)
+{
+	uint32_t v;
+
+	spin_lock_irqsave(&id->lock);
+	for (int i = 0; i < U32_POOL_BATCH; i++) {
+		v = pcc->ids[i];
+		id->free[BIT_WORD(v)] |= BIT_MASK(v);
+		id->next = MIN(id->next, BIT_WORD(v));
 	}
-	v = id->ids[id->tos++];
+	id->nr_free += U32_POOL_BATCH;
 	spin_unlock_irqsave(&id->lock);
-	/* v is ours, we can freely read and write its check field */
-	if (id->check[v] != 0xfe) {
-		printk("BAD! %d is already allocated (0x%x)\n", v, id->check[v]);
+	pcc->nr -= U32_POOL_BATCH;
+	memmove(pcc->ids, pcc->ids + U32_POOL_BATCH, pcc->nr * sizeof(uint32_t));
+}
+
+/* The bitmap and our cache are empty, but someone else might be sitting on a
+ * few. */
+static long __steal(struct u32_pool *id)
+{
+	struct u32_pool_pcpu *pcc;
+	long v = -1;
+
+	for (int i = 0; i < id->nr_pcpu && v < 0; i++) {
+		pcc = &id->pcpu[i];
+		if (!ACCESS_ONCE(pcc->nr))
+			continue;
+		spin_lock_irqsave(&pcc->lock);
+		if (pcc->nr)
+			v = pcc->ids[--pcc->nr];
+		spin_unlock_irqsave(&pcc->lock);
+	}
+	return v;
+}
+
+long get_u32(struct u32_pool *id)
+{
+	struct u32_pool_pcpu *pcc = get_my_pcpu(id);
+	long v = -1;
+
+	spin_lock_irqsave(&pcc->lock);
+	if (!pcc->nr)
+		__refill(id, pcc);
+	if (pcc->nr)
+		v = pcc->ids[--pcc->nr];
+	spin_unlock_irqsave(&pcc->lock);
+	if (v < 0)
+		v = __steal(id);
+	if (v < 0)
+		return -1;
+	/* v is ours, but other IDs share its word in used */
+	if (__sync_fetch_and_or(&id->used[BIT_WORD(v)], BIT_MASK(v)) &
+	    BIT_MASK(v)) {
+		printk("BAD! %ld is already allocated\n", v);
 		return -1;
 	}
-	id->check[v] = 0x5a;
 	return v;
 }
 
-void put_u16(struct u16_pool *id, int v)
+void put_u32(struct u32_pool *id, uint32_t v)
 {
-	/* we could check for if v is in range before dereferencing. */
-	if (id->check[v] != 0x5a) {
-		printk("BAD! freeing non-allocated: %d(0x%x)\n", v, id->check[v]);
+	struct u32_pool_pcpu *pcc;
+
+	if (v >= id->size) {
+		printk("BAD! freeing out of range: %u\n", v);
 		return;
 	}
-	id->check[v] = 0xfe;
-	spin_lock_irqsave(&id->lock);
-	id->ids[--id->tos] = v;
-	spin_unlock_irqsave(&id->lock);
+	if (!(__sync_fetch_and_and(&id->used[BIT_WORD(v)], ~BIT_MASK(v)) &
+	      BIT_MASK(v))) {
+		printk("BAD! freeing non-allocated: %u\n", v);
+		return;
+	}
+	pcc = get_my_pcpu(id);
+	spin_lock_irqsave(&pcc->lock);
+	if (pcc->nr == U32_POOL_CACHE)
+		__flush(id, pcc);
+	pcc->ids[pcc->nr++] = v;
+	spin_unlock_irqsave(&pcc->lock);
+}
+
+size_t u32_pool_nr_free(struct u32_pool *id)
+{
+	size_t nr = ACCESS_ONCE(id->nr_free);
+
+	for (int i = 0; i < id->nr_pcpu; i++)
+		nr += ACCESS_ONCE(id->pcpu[i].nr);
+	return nr;
 }
@@ -68,14 +68,21 @@ static void __attribute__((noinline, noreturn)) __smp_idle(void)
 	enable_irq();	/* one-shot change to get any IRQs before we halt later */
 	while (1) {
 		disable_irq();
+		__set_cpu_state(pcpui, CPU_STATE_IDLE_POLL);
 		process_routine_kmsg();
 		try_run_proc();
+		__set_cpu_state(pcpui, CPU_STATE_KSCHED);
 		cpu_bored();		/* call out to the ksched */
+		disable_irq();
+		__set_cpu_state(pcpui, CPU_STATE_IDLE_POLL);
+		/* cpu_bored() might have let IRQs in, and with them, an RKM */
+		if (has_routine_kmsg())
+			continue;
 		/* cpu_halt() atomically turns on interrupts and halts the core.
 		 * Important to do this, since we could have a RKM come in via an
 		 * interrupt right while PRKM is returning, and we wouldn't catch
 		 * it. */
-		__set_cpu_state(pcpui, CPU_STATE_IDLE);
+		__set_cpu_state(pcpui, CPU_STATE_IDLE_HALT);
 		cpu_halt();
 		/* interrupts are back on now (given our current semantics) */
 	}
@@ -116,9 +123,9 @@ void smp_percpu_init(void)
 	kthread->flags = KTH_KTASK_FLAGS;
 	per_cpu_info[coreid].spare = 0;
 	/* Init relevant lists */
-	spinlock_init_irqsave(&per_cpu_info[coreid].immed_amsg_lock);
+	per_cpu_info[coreid].immed_amsgs_in = 0;
 	STAILQ_INIT(&per_cpu_info[coreid].immed_amsgs);
-	spinlock_init_irqsave(&per_cpu_info[coreid].routine_amsg_lock);
+	per_cpu_info[coreid].routine_amsgs_in = 0;
 	STAILQ_INIT(&per_cpu_info[coreid].routine_amsgs);
 	/* Initialize the per-core timer chain */
 	init_timer_chain(&per_cpu_info[coreid].tchain, set_pcpu_alarm_interrupt);
@@ -133,6 +140,7 @@ void smp_percpu_init(void)
 	for (int i = 0; i < NR_CPU_STATES; i++)
 		pcpui->state_ticks[i] = 0;
 	pcpui->last_tick_cnt = read_tsc();
+	__proc_global_info.pcore_load[coreid].since = pcpui->last_tick_cnt;
 	/* Core 0 is in the KERNEL state, called from smp_boot.  The other cores are
 	 * too, at least on x86, where we were called from asm (woken by POKE). */
 	pcpui->cpu_state = CPU_STATE_KERNEL;
@@ -145,12 +153,36 @@ void smp_percpu_init(void)
  * a halted core (state IDLE) get woken up by an IRQ that does not trigger the
  * IRQ handling state.  for example, there is the I_POKE_CORE ipi.  smp_idle
  * will just sleep again, and reset the state from IDLE to IDLE. */
+/* Tells userspace that our core went idle or woke up.  We don't bother for the
+ * other state changes, since userspace only cares about busy vs idle, and this
+ * keeps the writes to the shared page down. */
+static void __publish_pcore_load(struct per_cpu_info *pcpui, bool idle,
+                                 uint64_t now_ticks)
+{
+	struct pcore_load *pl =
+	    &__proc_global_info.pcore_load[pcpui - per_cpu_info];
+
+	__seq_start_write(&pl->seq);
+	if (pl->idle)
+		pl->idle_ticks += now_ticks - pl->since;
+	else
+		pl->busy_ticks += now_ticks - pl->since;
+	pl->idle = idle;
+	pl->since = now_ticks;
+	__seq_end_write(&pl->seq);
+}
+
 void __set_cpu_state(struct per_cpu_info *pcpui, int state)
 {
 	uint64_t now_ticks;
 	assert(!irq_is_enabled());
 	/* TODO: could put in an option to enable/disable state tracking. */
 	now_ticks = read_tsc();
+	/* Only halting counts as idle here, so the idle loop's polling doesn't
+	 * bounce the shared page around. */
+	if ((pcpui->cpu_state == CPU_STATE_IDLE_HALT) !=
+	    (state == CPU_STATE_IDLE_HALT))
+		__publish_pcore_load(pcpui, state == CPU_STATE_IDLE_HALT, now_ticks);
 	pcpui->state_ticks[pcpui->cpu_state] += now_ticks - pcpui->last_tick_cnt;
 	/* TODO: if the state was user, we could account for the vcore's time,
 	 * similar to the total_ticks in struct vcore.  the difference is that the
@@ -160,6 +192,31 @@ void __set_cpu_state(struct per_cpu_info *pcpui, int state)
 	pcpui->last_tick_cnt = now_ticks;
 }
 
+/* Called on the way in and out of the outermost IRQ.  We go back to whatever we
+ * interrupted, except that a halted core is awake now, and a core that left
+ * userspace is in the kernel until it pops back out. */
+void __cpu_state_irq_enter(struct per_cpu_info *pcpui)
+{
+	pcpui->cpu_state_pre_irq = pcpui->cpu_state;
+	__set_cpu_state(pcpui, CPU_STATE_IRQ);
+}
+
+void __cpu_state_irq_exit(struct per_cpu_info *pcpui)
+{
+	int state = pcpui->cpu_state_pre_irq;
+
+	switch (state) {
+	case CPU_STATE_IDLE_HALT:
+		state = CPU_STATE_IDLE_POLL;
+		break;
+	case CPU_STATE_USER_MCP:
+	case CPU_STATE_USER_SCP:
+		state = CPU_STATE_KERNEL;
+		break;
+	}
+	__set_cpu_state(pcpui, state);
+}
+
 void reset_cpu_state_ticks(int coreid)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
@@ -180,28 +237,25 @@ void reset_cpu_state_ticks(int coreid)
 static void pcpui_trace_kmsg_handler(void *event, void *data)
 {
 	struct pcpu_trace_event *te = (struct pcpu_trace_event*)event;
-	char *func_name;
+	const char *func_name;
 	uintptr_t addr;
 	addr = te->arg1;
-	func_name = get_fn_name(addr);
+	func_name = lookup_fn_name(addr);
 	printk("\tKMSG %p: %s\n", addr, func_name);
-	kfree(func_name);
 }
 
 static void pcpui_trace_locks_handler(void *event, void *data)
 {
 	struct pcpu_trace_event *te = (struct pcpu_trace_event*)event;
-	char *func_name;
+	const char *func_name;
 	uintptr_t lock_addr = te->arg1;
 	if (lock_addr > KERN_LOAD_ADDR)
-		func_name = get_fn_name(lock_addr);
+		func_name = lookup_fn_name(lock_addr);
 	else
 		func_name = "Dynamic lock";
 	printk("Time %uus, lock %p (%s)\n", te->arg0, lock_addr, func_name);
 	printk("\t");
 	spinlock_debug((spinlock_t*)lock_addr);
-	if (lock_addr > KERN_LOAD_ADDR)
-		kfree(func_name);
 }
 
 /* Add specific trace handlers here: */
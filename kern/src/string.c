@@ -222,6 +222,9 @@ memsetw(long* _v, long c, size_t n)
 void *
 memset(void *v, int c, size_t _n)
 {
+#ifdef CONFIG_X86
+	return __arch_memset(v, c, _n);
+#else
 	char *p;
 	size_t n0;
 	size_t n = _n;
@@ -251,11 +254,15 @@ memset(void *v, int c, size_t _n)
 	}
 
 	return v;
+#endif
 }
 
 void *
 memcpy(void* dst, const void* src, size_t _n)
 {
+#ifdef CONFIG_X86
+	return __arch_memcpy(dst, src, _n);
+#else
 	const char* s;
 	char* d;
 	size_t n0 = 0;
@@ -289,6 +296,7 @@ memcpy(void* dst, const void* src, size_t _n)
 		*d++ = *s++;
 
 	return dst;
+#endif
 }
 
 void *
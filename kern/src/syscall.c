@@ -31,11 +31,13 @@
 #include <devfs.h>
 #include <smp.h>
 #include <arsc_server.h>
+#include <sysring.h>
 #include <event.h>
 #include <kprof.h>
 #include <termios.h>
 #include <manager.h>
 #include <ros/procinfo.h>
+#include <percpu.h>
 
 static int execargs_stringer(struct proc *p, char *d, size_t slen,
 			     char *path, size_t path_l,
@@ -44,20 +46,18 @@ static int execargs_stringer(struct proc *p, char *d, size_t slen,
 /* Global, used by the kernel monitor for syscall debugging. */
 bool systrace_loud = FALSE;
 
-/* Helper, given the trace record, pretty-print the trace's contents into the
- * trace's pretty buf.  'entry' says whether we're an entry record or not
- * (exit).  Returns the number of bytes put into the pretty_buf. */
+/* Helper, given the trace record, pretty-prints the trace's contents into buf.
+ * Entry records have retval set to ---, and begin with E.  Exit records begin
+ * with X.  Returns the number of bytes put into buf. */
 static size_t systrace_fill_pretty_buf(struct systrace_record *trace,
-                                       bool entry)
+                                       char *buf, size_t bufsz)
 {
 	size_t len = 0;
 	struct timespec ts_start = tsc2timespec(trace->start_timestamp);
 	struct timespec ts_end = tsc2timespec(trace->end_timestamp);
 
-	/* Slightly different formats between entry and exit.  Entry has retval set
-	 * to ---, and begins with E.  Exit begins with X. */
-	if (entry) {
-		len = snprintf(trace->pretty_buf, SYSTR_PRETTY_BUF_SZ - len,
+	if (!trace->is_exit) {
+		len = snprintf(buf, bufsz - len,
 		      "E [%7d.%09d]-[%7d.%09d] Syscall %3d (%12s):(0x%llx, 0x%llx, "
 		      "0x%llx, 0x%llx, 0x%llx, 0x%llx) ret: --- proc: %d core: %d "
 		      "vcore: %d data: ",
@@ -77,7 +77,7 @@ static size_t systrace_fill_pretty_buf(struct systrace_record *trace,
 		               trace->coreid,
 		               trace->vcoreid);
 	} else {
-		len = snprintf(trace->pretty_buf, SYSTR_PRETTY_BUF_SZ - len,
+		len = snprintf(buf, bufsz - len,
 		      "X [%7d.%09d]-[%7d.%09d] Syscall %3d (%12s):(0x%llx, 0x%llx, "
 		      "0x%llx, 0x%llx, 0x%llx, 0x%llx) ret: 0x%llx proc: %d core: %d "
 		      "vcore: %d data: ",
@@ -98,24 +98,47 @@ static size_t systrace_fill_pretty_buf(struct systrace_record *trace,
 		               trace->coreid,
 		               trace->vcoreid);
 	}
-	len += printdump(trace->pretty_buf + len, trace->datalen,
-	                 SYSTR_PRETTY_BUF_SZ - len - 1,
-	                 trace->data);
-	len += snprintf(trace->pretty_buf + len, SYSTR_PRETTY_BUF_SZ - len, "\n");
+	len += printdump(buf + len, trace->datalen, bufsz - len - 1, trace->data);
+	len += snprintf(buf + len, bufsz - len, "\n");
 	return len;
 }
 
+/* Helper: copies the trace into this core's ring.  This runs on every traced
+ * syscall, so it takes no locks and formats nothing.  Can't block: another
+ * kthread on this core could come in and write the same slot. */
+static void systrace_push(struct strace *strace, struct systrace_record *trace)
+{
+	struct systrace_ring *ring = &strace->rings[core_id()];
+	unsigned long prod = ring->prod;
+
+	if (prod - ACCESS_ONCE(ring->cons) >= SYSTR_RING_SZ) {
+		atomic_inc(&strace->nr_drops);
+		return;
+	}
+	ring->recs[prod & (SYSTR_RING_SZ - 1)] = *trace;
+	wmb();	/* the record must be visible before prod */
+	ACCESS_ONCE(ring->prod) = prod + 1;
+	mb();	/* publish prod before checking for sleeping readers */
+	if (atomic_read(&strace->nr_readers_waiting))
+		rendez_wakeup(&strace->rv);
+}
+
 /* Helper: spits out our trace to the various sinks. */
 static void systrace_output(struct systrace_record *trace,
-                            struct strace *strace, bool entry)
+                            struct strace *strace)
 {
-	size_t pretty_len;
+	char *buf;
 
-	pretty_len = systrace_fill_pretty_buf(trace, entry);
 	if (strace)
-		qiwrite(strace->q, trace->pretty_buf, pretty_len);
-	if (systrace_loud)
-		printk("%s", trace->pretty_buf);
+		systrace_push(strace, trace);
+	if (systrace_loud) {
+		buf = kmalloc(SYSTR_PRETTY_BUF_SZ, MEM_ATOMIC);
+		if (!buf)
+			return;
+		systrace_fill_pretty_buf(trace, buf, SYSTR_PRETTY_BUF_SZ);
+		printk("%s", buf);
+		kfree(buf);
+	}
 }
 
 /* Starts a trace for p running sysc, attaching it to kthread.  Pairs with
@@ -130,18 +153,8 @@ static void systrace_start_trace(struct kthread *kthread, struct syscall *sysc)
 	kthread->strace = 0;
 	if (!p->strace_on && !systrace_loud)
 		return;
-	trace = kmalloc(SYSTR_BUF_SZ, MEM_ATOMIC);
+	trace = kmalloc(sizeof(struct systrace_record), MEM_ATOMIC);
 	if (p->strace) {
-		/* We're using qiwrite below, which has no flow control.  We'll do it
-		 * manually.  TODO: consider a block_alloc and qpass, though note that
-		 * we actually write the same trace in twice (entry and exit).
-		 * Alternatively, we can add another qio method that has flow control
-		 * and non blocking. */
-		if (qfull(p->strace->q)) {
-			atomic_inc(&p->strace->nr_drops);
-			kfree(trace);
-			return;
-		}
 		if (!trace)
 			atomic_inc(&p->strace->nr_drops);
 		/* Avoiding the atomic op.  We sacrifice accuracy for less overhead. */
@@ -167,7 +180,7 @@ static void systrace_start_trace(struct kthread *kthread, struct syscall *sysc)
 	trace->pid = p->pid;
 	trace->coreid = core_id();
 	trace->vcoreid = proc_get_vcoreid(p);
-	trace->pretty_buf = (char*)trace + sizeof(struct systrace_record);
+	trace->is_exit = FALSE;
 	trace->datalen = 0;
 	trace->data[0] = 0;
 
@@ -204,7 +217,7 @@ static void systrace_start_trace(struct kthread *kthread, struct syscall *sysc)
 		copy_from_user(trace->data, (void*)data_arg, trace->datalen);
 	}
 
-	systrace_output(trace, p->strace, TRUE);
+	systrace_output(trace, p->strace);
 
 	kthread->strace = trace;
 }
@@ -223,6 +236,7 @@ static void systrace_finish_trace(struct kthread *kthread, long retval)
 	trace = kthread->strace;
 	trace->end_timestamp = read_tsc();
 	trace->retval = retval;
+	trace->is_exit = TRUE;
 
 	/* Only try to do the trace data if we didn't do it on entry */
 	if (!trace->datalen) {
@@ -237,11 +251,71 @@ static void systrace_finish_trace(struct kthread *kthread, long retval)
 			copy_from_user(trace->data, (void*)data_arg, trace->datalen);
 	}
 
-	systrace_output(trace, p->strace, FALSE);
+	systrace_output(trace, p->strace);
 	kfree(kthread->strace);
 	kthread->strace = 0;
 }
 
+static struct systrace_record *systrace_ring_peek(struct systrace_ring *ring)
+{
+	if (ring->cons == ACCESS_ONCE(ring->prod))
+		return NULL;
+	rmb();	/* read the record after prod */
+	return &ring->recs[ring->cons & (SYSTR_RING_SZ - 1)];
+}
+
+static uint64_t systrace_record_tsc(struct systrace_record *trace)
+{
+	return trace->is_exit ? trace->end_timestamp : trace->start_timestamp;
+}
+
+/* Whether any core has records that haven't been drained yet. */
+bool systrace_pending(struct strace *strace)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (systrace_ring_peek(&strace->rings[i]))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Formats the per-core records into the strace's queue, oldest first, until
+ * the queue fills up.  Whatever doesn't fit stays in the rings. */
+void systrace_drain(struct strace *strace)
+{
+	struct systrace_ring *ring, *oldest;
+	struct systrace_record *trace, *oldest_trace;
+	size_t len;
+	char *buf;
+
+	buf = kmalloc(SYSTR_PRETTY_BUF_SZ, MEM_ATOMIC);
+	if (!buf)
+		return;
+	spin_lock(&strace->drain_lock);
+	while (!qfull(strace->q)) {
+		oldest = NULL;
+		for (int i = 0; i < num_cores; i++) {
+			ring = &strace->rings[i];
+			trace = systrace_ring_peek(ring);
+			if (!trace)
+				continue;
+			if (!oldest || (systrace_record_tsc(trace) <
+			                systrace_record_tsc(oldest_trace))) {
+				oldest = ring;
+				oldest_trace = trace;
+			}
+		}
+		if (!oldest)
+			break;
+		len = systrace_fill_pretty_buf(oldest_trace, buf, SYSTR_PRETTY_BUF_SZ);
+		qiwrite(strace->q, buf, len);
+		mb();	/* done with the record before the core can reuse it */
+		ACCESS_ONCE(oldest->cons) = oldest->cons + 1;
+	}
+	spin_unlock(&strace->drain_lock);
+	kfree(buf);
+}
+
 #ifdef CONFIG_SYSCALL_STRING_SAVING
 
 static void alloc_sysc_str(struct kthread *kth)
@@ -689,6 +763,8 @@ static int sys_proc_create(struct proc *p, char *path, size_t path_l,
 		goto error_with_kargenv;
 	}
 	inherit_strace(p, new_p);
+	if (flags & PROC_TEMPLATE)
+		new_p->env_flags |= PROC_IS_TEMPLATE;
 	/* close the CLOEXEC ones, even though this isn't really an exec */
 	close_fdt(&new_p->open_files, TRUE);
 	/* Load the elf. */
@@ -721,6 +797,62 @@ error_with_path:
 	return -1;
 }
 
+/* Makes a new process from template tmpl_pid, which was created with
+ * PROC_TEMPLATE and is sitting loaded and stopped before main.  Instead of
+ * loading the ELF again, the new process shares the template's memory COW and
+ * gets copies of its context and open files.  Like with sys_proc_create(), you
+ * run the new process with sys_proc_run(). */
+static int sys_proc_spawn(struct proc *p, pid_t tmpl_pid, int flags)
+{
+	struct proc *tmpl, *new_p;
+	char *t_path;
+	int pid;
+
+	if (flags) {
+		set_error(EINVAL, "Unknown spawn flags 0x%x", flags);
+		return -1;
+	}
+	tmpl = get_controllable_proc(p, tmpl_pid);
+	if (!tmpl)
+		return -1;
+	if (!(tmpl->env_flags & PROC_IS_TEMPLATE) ||
+	    (tmpl->state != PROC_CREATED)) {
+		set_error(EINVAL, "PID %d is not a template", tmpl_pid);
+		goto error_with_tmpl;
+	}
+	if (proc_alloc(&new_p, current, 0)) {
+		set_error(ENOMEM, "Failed to alloc new proc");
+		goto error_with_tmpl;
+	}
+	inherit_strace(p, new_p);
+	proc_set_progname(new_p, tmpl->progname);
+	if (tmpl->binary_path) {
+		kstrdup(&t_path, tmpl->binary_path);
+		proc_replace_binary_path(new_p, t_path);
+	}
+	clone_fdt(&tmpl->open_files, &new_p->open_files);
+	if (duplicate_vmrs(tmpl, new_p)) {
+		set_error(ENOMEM, "Failed to share the template's memory");
+		goto error_with_proc;
+	}
+	new_p->scp_ctx = tmpl->scp_ctx;
+	new_p->args_base = tmpl->args_base;
+	*new_p->procdata = *tmpl->procdata;
+	new_p->procinfo->program_end = tmpl->procinfo->program_end;
+	__proc_ready(new_p);
+	pid = new_p->pid;
+	profiler_notify_new_process(new_p);
+	proc_decref(new_p);	/* give up the reference created in proc_alloc() */
+	proc_decref(tmpl);
+	return pid;
+error_with_proc:
+	/* Same as sys_proc_create(): the ksched hasn't heard of new_p */
+	proc_destroy(new_p);
+error_with_tmpl:
+	proc_decref(tmpl);
+	return -1;
+}
+
 /* Makes process PID runnable.  Consider moving the functionality to process.c */
 static error_t sys_proc_run(struct proc *p, unsigned pid)
 {
@@ -728,7 +860,9 @@ static error_t sys_proc_run(struct proc *p, unsigned pid)
 	struct proc *target = get_controllable_proc(p, pid);
 	if (!target)
 		return -1;
-	if (target->state != PROC_CREATED) {
+	/* Templates only exist to be spawned from */
+	if ((target->state != PROC_CREATED) ||
+	    (target->env_flags & PROC_IS_TEMPLATE)) {
 		set_errno(EINVAL);
 		proc_decref(target);
 		return -1;
@@ -1228,6 +1362,11 @@ static intreg_t sys_munmap(struct proc *p, void *addr, size_t len)
 	return munmap(p, (uintptr_t)addr, len);
 }
 
+static intreg_t sys_madvise(struct proc *p, void *addr, size_t len, int advice)
+{
+	return madvise(p, (uintptr_t)addr, len, advice);
+}
+
 static ssize_t sys_shared_page_alloc(env_t* p1,
                                      void **_addr, pid_t p2_id,
                                      int p1_flags, int p2_flags
@@ -1364,14 +1503,14 @@ static int sys_halt_core(struct proc *p, unsigned long usec)
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	struct preempt_data *vcpd;
 	/* The user can only halt CG cores!  (ones it owns) */
-	if (management_core())
+	if (is_ll_core(core_id()))
 		return -1;
 	disable_irq();
 	/* both for accounting and possible RKM optimizations */
-	__set_cpu_state(pcpui, CPU_STATE_IDLE);
+	__set_cpu_state(pcpui, CPU_STATE_IDLE_HALT);
 	wrmb();
 	if (has_routine_kmsg()) {
-		__set_cpu_state(pcpui, CPU_STATE_KERNEL);
+		__set_cpu_state(pcpui, CPU_STATE_SYSCALL);
 		enable_irq();
 		return 0;
 	}
@@ -1381,12 +1520,15 @@ static int sys_halt_core(struct proc *p, unsigned long usec)
 	 * aborted early. */
 	vcpd = &p->procdata->vcore_preempt_data[pcpui->owning_vcoreid];
 	if (vcpd->notif_pending) {
-		__set_cpu_state(pcpui, CPU_STATE_KERNEL);
+		__set_cpu_state(pcpui, CPU_STATE_SYSCALL);
 		enable_irq();
 		return 0;
 	}
-	/* CPU_STATE is reset to KERNEL by the IRQ handler that wakes us */
 	cpu_halt();
+	/* The IRQ that woke us left us in IDLE_POLL */
+	disable_irq();
+	__set_cpu_state(pcpui, CPU_STATE_SYSCALL);
+	enable_irq();
 	return 0;
 }
 
@@ -1475,6 +1617,31 @@ static int sys_vmm_poke_guest(struct proc *p, int guest_pcoreid)
 	return vmm_poke_guest(p, guest_pcoreid);
 }
 
+static int sys_vmm_vhost_net(struct proc *p, struct vmm_vhost_net_init *init)
+{
+	ERRSTACK(1);
+
+	if (waserror()) {
+		poperror();
+		return -1;
+	}
+	vhost_net_setup(p, init);
+	poperror();
+	return 0;
+}
+
+static void *sys_sysring_setup(struct proc *p, unsigned int nr_entries,
+                               struct event_queue *ev_q, int flags,
+                               int poll_core)
+{
+	return sysring_setup(p, nr_entries, ev_q, flags, poll_core);
+}
+
+static int sys_sysring_enter(struct proc *p)
+{
+	return sysring_enter(p);
+}
+
 /* Pokes the ksched for the given resource for target_pid.  If the target pid
  * == 0, we just poke for the calling process.  The common case is poking for
  * self, so we avoid the lookup.
@@ -1575,6 +1742,224 @@ static intreg_t sys_write(struct proc *p, int fd, const void *buf, size_t len)
 	return ret;
 }
 
+/* Copies in the user's iovecs, checking them like Linux does: at most
+ * UIO_MAXIOV of them, with a total that fits in a ssize_t.  Returns a kmalloc'd
+ * copy, or 0 with errno set. */
+static struct iovec *copy_in_iov(struct proc *p, const struct iovec *u_iov,
+                                 int iovcnt)
+{
+	struct iovec *iov;
+	size_t total = 0;
+
+	if ((iovcnt <= 0) || (iovcnt > UIO_MAXIOV)) {
+		set_errno(EINVAL);
+		return 0;
+	}
+	iov = kmalloc(iovcnt * sizeof(struct iovec), MEM_WAIT);
+	if (memcpy_from_user_errno(p, iov, u_iov, iovcnt * sizeof(struct iovec)))
+		goto out_error;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > (SIZE_MAX >> 1) - total) {
+			set_errno(EINVAL);
+			goto out_error;
+		}
+		total += iov[i].iov_len;
+	}
+	return iov;
+out_error:
+	kfree(iov);
+	return 0;
+}
+
+/* Backs readv() and preadv().  VFS files use their f_op->readv, if any, and
+ * chans pass the whole vector down, so a device can fill every buffer in one
+ * call.  Position I/O (offp) leaves the file's position alone. */
+static intreg_t do_readv(struct proc *p, int fd, const struct iovec *u_iov,
+                         int iovcnt, off64_t *offp)
+{
+	struct file *file;
+	struct iovec *iov;
+	ssize_t ret, amt;
+
+	iov = copy_in_iov(p, u_iov, iovcnt);
+	if (!iov)
+		return -1;
+	file = get_file_from_fd(&p->open_files, fd);
+	if (!file) {
+		ret = offp ? syspreadv(fd, iov, iovcnt, *offp)
+		           : sysreadv(fd, iov, iovcnt);
+		kfree(iov);
+		return ret;
+	}
+	if (!offp)
+		offp = &file->f_pos;
+	if (file->f_op->readv) {
+		ret = file->f_op->readv(file, iov, iovcnt, offp);
+	} else if (file->f_op->read) {
+		ret = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			amt = file->f_op->read(file, iov[i].iov_base, iov[i].iov_len,
+			                       offp);
+			if (amt < 0) {
+				ret = ret ? ret : -1;
+				break;
+			}
+			ret += amt;
+			if (amt < iov[i].iov_len)
+				break;
+		}
+	} else {
+		set_errno(EINVAL);
+		ret = -1;
+	}
+	kref_put(&file->f_kref);
+	kfree(iov);
+	return ret;
+}
+
+/* Backs writev() and pwritev(), like do_readv(). */
+static intreg_t do_writev(struct proc *p, int fd, const struct iovec *u_iov,
+                          int iovcnt, off64_t *offp)
+{
+	struct file *file;
+	struct iovec *iov;
+	ssize_t ret, amt;
+
+	iov = copy_in_iov(p, u_iov, iovcnt);
+	if (!iov)
+		return -1;
+	file = get_file_from_fd(&p->open_files, fd);
+	if (!file) {
+		ret = offp ? syspwritev(fd, iov, iovcnt, *offp)
+		           : syswritev(fd, iov, iovcnt);
+		kfree(iov);
+		return ret;
+	}
+	if (!offp)
+		offp = &file->f_pos;
+	if (file->f_op->writev) {
+		ret = file->f_op->writev(file, iov, iovcnt, offp);
+	} else if (file->f_op->write) {
+		ret = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			amt = file->f_op->write(file, iov[i].iov_base, iov[i].iov_len,
+			                        offp);
+			if (amt < 0) {
+				ret = ret ? ret : -1;
+				break;
+			}
+			ret += amt;
+			if (amt < iov[i].iov_len)
+				break;
+		}
+	} else {
+		set_errno(EINVAL);
+		ret = -1;
+	}
+	kref_put(&file->f_kref);
+	kfree(iov);
+	return ret;
+}
+
+static intreg_t sys_readv(struct proc *p, int fd, const struct iovec *iov,
+                          int iovcnt)
+{
+	sysc_save_str("readv on fd %d", fd);
+	return do_readv(p, fd, iov, iovcnt, NULL);
+}
+
+static intreg_t sys_writev(struct proc *p, int fd, const struct iovec *iov,
+                           int iovcnt)
+{
+	sysc_save_str("writev on fd %d", fd);
+	return do_writev(p, fd, iov, iovcnt, NULL);
+}
+
+static intreg_t sys_preadv(struct proc *p, int fd, const struct iovec *iov,
+                           int iovcnt, off64_t offset)
+{
+	sysc_save_str("preadv on fd %d", fd);
+	if (offset < 0) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	return do_readv(p, fd, iov, iovcnt, &offset);
+}
+
+static intreg_t sys_pwritev(struct proc *p, int fd, const struct iovec *iov,
+                            int iovcnt, off64_t offset)
+{
+	sysc_save_str("pwritev on fd %d", fd);
+	if (offset < 0) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	return do_writev(p, fd, iov, iovcnt, &offset);
+}
+
+/* Sends up to count bytes of the VFS file in_fd to out_fd, without copying
+ * them through userspace.  Like Linux's sendfile(): with an offset, we start
+ * at *offset and write back where we stopped, leaving in_fd's position alone.
+ * Otherwise we use and advance the position. */
+static intreg_t sys_sendfile(struct proc *p, int out_fd, int in_fd,
+                             off64_t *offset, size_t count)
+{
+	struct file *file = get_file_from_fd(&p->open_files, in_fd);
+	int64_t off;
+	intreg_t ret;
+
+	sysc_save_str("sendfile fd %d to fd %d", in_fd, out_fd);
+	if (!file) {
+		set_error(EINVAL, "Can only sendfile from a VFS file");
+		return -1;
+	}
+	if (!S_ISREG(file->f_dentry->d_inode->i_mode)) {
+		kref_put(&file->f_kref);
+		set_errno(EINVAL);
+		return -1;
+	}
+	if (offset) {
+		if (memcpy_from_user_errno(p, &off, offset, sizeof(off))) {
+			kref_put(&file->f_kref);
+			return -1;
+		}
+	} else {
+		off = file->f_pos;
+	}
+	ret = syssendfile(out_fd, file, &off, count);
+	if (offset) {
+		if (memcpy_to_user_errno(p, offset, &off, sizeof(off)))
+			ret = -1;
+	} else {
+		file->f_pos = off;
+	}
+	kref_put(&file->f_kref);
+	return ret;
+}
+
+/* Moves up to len bytes from one chan to another, as blocks, without copying
+ * them through userspace.  See syssplice(). */
+static intreg_t sys_splice(struct proc *p, int fd_in, int fd_out, size_t len,
+                           int flags)
+{
+	struct file *file;
+
+	sysc_save_str("splice fd %d to fd %d", fd_in, fd_out);
+	if (flags || (len > (SIZE_MAX >> 1))) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	file = get_file_from_fd(&p->open_files, fd_in);
+	if (!file)
+		file = get_file_from_fd(&p->open_files, fd_out);
+	if (file) {
+		kref_put(&file->f_kref);
+		set_error(EINVAL, "Can't splice a VFS file; try sendfile");
+		return -1;
+	}
+	return syssplice(fd_in, fd_out, len);
+}
+
 /* Checks args/reads in the path, opens the file (relative to fromfd if the path
  * is not absolute), and inserts it into the process's open file list. */
 static intreg_t sys_openat(struct proc *p, int fromfd, const char *path,
@@ -2493,6 +2878,8 @@ static int handle_tap_req(struct proc *p, struct fd_tap_req *req)
 			return add_fd_tap(p, req);
 		case (FDTAP_CMD_REM):
 			return remove_fd_tap(p, req->fd);
+		case (FDTAP_CMD_MOD):
+			return mod_fd_tap(p, req);
 		default:
 			set_error(ENOSYS, "FD Tap Command %d not supported", req->cmd);
 			return -1;
@@ -2539,6 +2926,8 @@ const struct sys_table_entry syscall_table[] = {
 	[SYS_mmap] = {(syscall_t)sys_mmap, "mmap"},
 	[SYS_munmap] = {(syscall_t)sys_munmap, "munmap"},
 	[SYS_mprotect] = {(syscall_t)sys_mprotect, "mprotect"},
+	[SYS_madvise] = {(syscall_t)sys_madvise, "madvise"},
+	[SYS_proc_spawn] = {(syscall_t)sys_proc_spawn, "proc_spawn"},
 	[SYS_shared_page_alloc] = {(syscall_t)sys_shared_page_alloc, "pa"},
 	[SYS_shared_page_free] = {(syscall_t)sys_shared_page_free, "pf"},
 	[SYS_provision] = {(syscall_t)sys_provision, "provision"},
@@ -2552,6 +2941,9 @@ const struct sys_table_entry syscall_table[] = {
 	[SYS_change_to_m] = {(syscall_t)sys_change_to_m, "change_to_m"},
 	[SYS_vmm_setup] = {(syscall_t)sys_vmm_setup, "vmm_setup"},
 	[SYS_vmm_poke_guest] = {(syscall_t)sys_vmm_poke_guest, "vmm_poke_guest"},
+	[SYS_sysring_setup] = {(syscall_t)sys_sysring_setup, "sysring_setup"},
+	[SYS_sysring_enter] = {(syscall_t)sys_sysring_enter, "sysring_enter"},
+	[SYS_vmm_vhost_net] = {(syscall_t)sys_vmm_vhost_net, "vmm_vhost_net"},
 	[SYS_poke_ksched] = {(syscall_t)sys_poke_ksched, "poke_ksched"},
 	[SYS_abort_sysc] = {(syscall_t)sys_abort_sysc, "abort_sysc"},
 	[SYS_abort_sysc_fd] = {(syscall_t)sys_abort_sysc_fd, "abort_sysc_fd"},
@@ -2593,9 +2985,174 @@ const struct sys_table_entry syscall_table[] = {
 	[SYS_rename] ={(syscall_t)sys_rename, "rename"},
 	[SYS_dup_fds_to] = {(syscall_t)sys_dup_fds_to, "dup_fds_to"},
 	[SYS_tap_fds] = {(syscall_t)sys_tap_fds, "tap_fds"},
+	[SYS_sendfile] = {(syscall_t)sys_sendfile, "sendfile"},
+	[SYS_readv] = {(syscall_t)sys_readv, "readv"},
+	[SYS_writev] = {(syscall_t)sys_writev, "writev"},
+	[SYS_preadv] = {(syscall_t)sys_preadv, "preadv"},
+	[SYS_pwritev] = {(syscall_t)sys_pwritev, "pwritev"},
+	[SYS_splice] = {(syscall_t)sys_splice, "splice"},
 };
 const int max_syscall = sizeof(syscall_table)/sizeof(syscall_table[0]);
 
+/* Each core has a max_syscall array of stats for the syscalls that finish on
+ * it, so the system-wide counters need no atomics.  A process's stats are
+ * shared by all of its cores, so those use atomics.  Readers and resetters
+ * race with the updaters, which is fine for stats. */
+static DEFINE_PERCPU(struct sysc_lat_stat *, sysc_lat_pcpu);
+DEFINE_PERCPU_INIT(sysc_lat_init);
+
+#define SYSC_LAT_LINE_SZ			(48 + 11 * SYSC_LAT_NR_BUCKETS)
+
+static void sysc_lat_init(void)
+{
+	for (int i = 0; i < num_cores; i++)
+		_PERCPU_VAR(sysc_lat_pcpu, i) =
+			kzmalloc(max_syscall * sizeof(struct sysc_lat_stat), MEM_WAIT);
+}
+
+static unsigned int sysc_lat_bucket(uint64_t cycles)
+{
+	uint64_t c = cycles >> SYSC_LAT_HIST_SHIFT;
+	unsigned int bucket = 0;
+
+	while ((c > 1) && (bucket < SYSC_LAT_NR_BUCKETS - 1)) {
+		c >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/* Returns p's stat for sc_num, allocating it (and p's table) if this is the
+ * first such call.  Returns 0 if we couldn't allocate; we just lose the
+ * sample. */
+static struct sysc_lat_stat *sysc_lat_proc_stat(struct proc *p,
+                                                unsigned int sc_num)
+{
+	struct sysc_lat_stat **tbl = ACCESS_ONCE(p->sysc_lat);
+	struct sysc_lat_stat *st;
+
+	if (!tbl) {
+		tbl = kzmalloc(max_syscall * sizeof(struct sysc_lat_stat *),
+		               MEM_ATOMIC);
+		if (!tbl)
+			return 0;
+		if (!atomic_cas_ptr((void**)&p->sysc_lat, NULL, tbl)) {
+			kfree(tbl);
+			tbl = p->sysc_lat;
+		}
+	}
+	st = ACCESS_ONCE(tbl[sc_num]);
+	if (!st) {
+		st = kzmalloc(sizeof(struct sysc_lat_stat), MEM_ATOMIC);
+		if (!st)
+			return 0;
+		if (!atomic_cas_ptr((void**)&tbl[sc_num], NULL, st)) {
+			kfree(st);
+			st = tbl[sc_num];
+		}
+	}
+	return st;
+}
+
+static void sysc_lat_account(struct proc *p, unsigned int sc_num,
+                             uint64_t cycles)
+{
+	struct sysc_lat_stat *st;
+	unsigned int bucket;
+
+	if (sc_num >= max_syscall)
+		return;
+	bucket = sysc_lat_bucket(cycles);
+	st = &PERCPU_VAR(sysc_lat_pcpu)[sc_num];
+	st->count++;
+	st->cycles += cycles;
+	st->hist[bucket]++;
+	st = sysc_lat_proc_stat(p, sc_num);
+	if (!st)
+		return;
+	__sync_fetch_and_add(&st->count, 1);
+	__sync_fetch_and_add(&st->cycles, cycles);
+	__sync_fetch_and_add(&st->hist[bucket], 1);
+}
+
+/* Called when p is freed; no one else can be looking at p's stats. */
+void sysc_lat_free(struct proc *p)
+{
+	if (!p->sysc_lat)
+		return;
+	for (int i = 0; i < max_syscall; i++)
+		kfree(p->sysc_lat[i]);
+	kfree(p->sysc_lat);
+	p->sysc_lat = 0;
+}
+
+/* Resets the system-wide stats.  Processes keep theirs. */
+void sysc_lat_reset(void)
+{
+	for (int i = 0; i < num_cores; i++)
+		memset(_PERCPU_VAR(sysc_lat_pcpu, i), 0,
+		       max_syscall * sizeof(struct sysc_lat_stat));
+}
+
+/* Merges the system-wide or p's stat for sc_num into st.  Returns the count. */
+static uint64_t sysc_lat_get(struct proc *p, unsigned int sc_num,
+                             struct sysc_lat_stat *st)
+{
+	struct sysc_lat_stat *from;
+	struct sysc_lat_stat **tbl;
+
+	memset(st, 0, sizeof(struct sysc_lat_stat));
+	if (p) {
+		tbl = ACCESS_ONCE(p->sysc_lat);
+		from = tbl ? ACCESS_ONCE(tbl[sc_num]) : 0;
+		if (from)
+			memcpy(st, from, sizeof(struct sysc_lat_stat));
+		return st->count;
+	}
+	for (int i = 0; i < num_cores; i++) {
+		from = &_PERCPU_VAR(sysc_lat_pcpu, i)[sc_num];
+		st->count += from->count;
+		st->cycles += from->cycles;
+		for (int j = 0; j < SYSC_LAT_NR_BUCKETS; j++)
+			st->hist[j] += from->hist[j];
+	}
+	return st->count;
+}
+
+/* Returns a report of p's syscall latencies, or the whole system's if p is 0,
+ * with one line per syscall that has been called.  sza->size is the length of
+ * the report.  Free with kfree. */
+struct sized_alloc *sysc_lat_report(struct proc *p)
+{
+	struct sysc_lat_stat st;
+	struct sized_alloc *sza;
+	size_t nr_lines = 1, bufsz, off = 0;
+
+	for (int i = 0; i < max_syscall; i++) {
+		if (sysc_lat_get(p, i, &st))
+			nr_lines++;
+	}
+	/* A syscall could get its first call while we print; leave room. */
+	bufsz = SYSC_LAT_LINE_SZ * (nr_lines + 8);
+	sza = sized_kzmalloc(bufsz, MEM_WAIT);
+	off += snprintf(sza->buf + off, bufsz - off, "%-20s %10s %10s  %s%d\n",
+	                "Syscall", "Count", "AvgCyc",
+	                "Histogram, log2 cycles from ", SYSC_LAT_HIST_SHIFT + 1);
+	for (int i = 0; i < max_syscall; i++) {
+		if (!sysc_lat_get(p, i, &st))
+			continue;
+		off += snprintf(sza->buf + off, bufsz - off, "%-20s %10llu %10llu ",
+		                syscall_table[i].name ?: "?", st.count,
+		                st.cycles / st.count);
+		for (int j = 0; j < SYSC_LAT_NR_BUCKETS; j++)
+			off += snprintf(sza->buf + off, bufsz - off, " %llu",
+			                st.hist[j]);
+		off += snprintf(sza->buf + off, bufsz - off, "\n");
+	}
+	sza->size = MIN(off, bufsz);
+	return sza;
+}
+
 /* Executes the given syscall.
  *
  * Note tf is passed in, which points to the tf of the context on the kernel
@@ -2627,6 +3184,7 @@ intreg_t syscall(struct proc *p, uintreg_t sc_num, uintreg_t a0, uintreg_t a1,
 		 */
 		return -1;
 	}
+	proc_vc_stats(p)->nr_syscalls++;
 	//printd("before syscall errstack %p\n", errstack);
 	//printd("before syscall errstack base %p\n", get_cur_errbuf());
 	ret = syscall_table[sc_num].call(p, a0, a1, a2, a3, a4, a5);
@@ -2643,11 +3201,36 @@ intreg_t syscall(struct proc *p, uintreg_t sc_num, uintreg_t a0, uintreg_t a1,
 	return ret;
 }
 
-/* Execute the syscall on the local core */
-void run_local_syscall(struct syscall *sysc)
+/* Syscalls that need the user context they trapped from, or that change the
+ * process's vcores.  They can't run from a sysring, where there is no trap. */
+static bool syscall_needs_ctx(unsigned int sc_num)
+{
+	switch (sc_num) {
+	case SYS_getvcoreid:
+	case SYS_yield:
+	case SYS_change_vcore:
+	case SYS_fork:
+	case SYS_exec:
+	case SYS_halt_core:
+	case SYS_init_arsc:
+	case SYS_change_to_m:
+	case SYS_vmm_setup:
+	case SYS_vc_entry:
+	case SYS_pop_ctx:
+	case SYS_vmm_poke_guest:
+	case SYS_sysring_setup:
+	case SYS_sysring_enter:
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static void __run_local_syscall(struct syscall *sysc, bool from_ring)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	struct proc *p = pcpui->cur_proc;
+	unsigned int sc_num;
+	uint64_t start;
 
 	/* In lieu of pinning, we just check the sysc and will PF on the user addr
 	 * later (if the addr was unmapped).  Which is the plan for all UMEM. */
@@ -2661,10 +3244,19 @@ void run_local_syscall(struct syscall *sysc)
 	alloc_sysc_str(pcpui->cur_kthread);
 	/* syscall() does not return for exec and yield, so put any cleanup in there
 	 * too. */
-	sysc->retval = syscall(pcpui->cur_proc, sysc->num, sysc->arg0, sysc->arg1,
-	                       sysc->arg2, sysc->arg3, sysc->arg4, sysc->arg5);
+	sc_num = ACCESS_ONCE(sysc->num);
+	start = read_tsc();
+	if (from_ring && syscall_needs_ctx(sc_num)) {
+		set_errno(ENOTSUP);
+		sysc->retval = -1;
+	} else {
+		sysc->retval = syscall(pcpui->cur_proc, sc_num, sysc->arg0,
+		                       sysc->arg1, sysc->arg2, sysc->arg3, sysc->arg4,
+		                       sysc->arg5);
+	}
 	/* Need to re-load pcpui, in case we migrated */
 	pcpui = &per_cpu_info[core_id()];
+	sysc_lat_account(p, sc_num, read_tsc() - start);
 	free_sysc_str(pcpui->cur_kthread);
 	systrace_finish_trace(pcpui->cur_kthread, sysc->retval);
 	/* Some 9ns paths set errstr, but not errno.  glibc will ignore errstr.
@@ -2675,6 +3267,19 @@ void run_local_syscall(struct syscall *sysc)
 	pcpui->cur_kthread->sysc = NULL;	/* No longer working on sysc */
 }
 
+/* Execute the syscall on the local core */
+void run_local_syscall(struct syscall *sysc)
+{
+	__run_local_syscall(sysc, FALSE);
+}
+
+/* Execute a syscall from the process's sysring, from a ktask on the local core
+ * in the process's address space. */
+void run_sysring_syscall(struct syscall *sysc)
+{
+	__run_local_syscall(sysc, TRUE);
+}
+
 /* A process can trap and call this function, which will set up the core to
  * handle all the syscalls.  a.k.a. "sys_debutante(needs, wants)".  If there is
  * at least one, it will run it directly. */
@@ -0,0 +1,304 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Shared-memory syscall rings.  See ros/sysring.h.
+ *
+ * Each taken syscall runs from its own RKM, on the core that took it, in the
+ * process's address space.  If one blocks, the core moves on to the next RKM,
+ * so a slow syscall doesn't hold up the rest of the batch.  Each RKM holds a
+ * ref on the proc, which keeps the ring around until the last syscall lands in
+ * the CQ.
+ *
+ * Userspace can scribble on the ring at any time, so we keep our own copies of
+ * the indices we own (sq_head, cq_tail) and only ever read theirs once.  A
+ * bogus sq_tail or cq_head only hurts the process itself: we still never have
+ * more than nr_entries syscalls taken but unreaped, and run_sysring_syscall()
+ * checks every syscall pointer.
+ *
+ * The optional poller is an RKM that resends itself on a core we took from the
+ * idle pool.  It holds a proc ref while running.  Once it has been idle for a
+ * while, it sets SYSRING_F_NEED_WAKEUP and stops, and sysring_enter() starts
+ * it again.  The core stays reserved until the proc is freed. */
+
+#include <sysring.h>
+#include <process.h>
+#include <schedule.h>
+#include <syscall.h>
+#include <event.h>
+#include <kmalloc.h>
+#include <pmap.h>
+#include <mm.h>
+#include <smp.h>
+#include <time.h>
+#include <string.h>
+#include <assert.h>
+
+/* How long the poller spins on an empty SQ before stopping */
+#define SYSRING_POLL_IDLE_USEC		1000
+
+struct proc_sysring {
+	spinlock_t					lock;
+	struct sysring				*ring;		/* KVA of the shared ring */
+	size_t						order;
+	uint32_t					mask;
+	uint32_t					sq_head;
+	uint32_t					cq_tail;
+	uint32_t					nr_taken;	/* taken, but not in the CQ yet */
+	struct event_queue			*ev_q;		/* user pointer, may be 0 */
+	int							poll_core;	/* -1 for no poller */
+	bool						poller_running;
+	uint64_t					last_work_tsc;
+};
+
+static void __sysring_run(uint32_t srcid, long a0, long a1, long a2);
+
+/* Takes as many submissions as the CQ has room for, sending each to coreid.
+ * Hold the lock.  Returns the number taken. */
+static unsigned int __sysring_take(struct proc *p, struct proc_sysring *psr,
+                                   int coreid)
+{
+	struct sysring *sr = psr->ring;
+	uint32_t nr_entries = psr->mask + 1;
+	uint32_t unreaped, room, nr;
+	struct syscall *sysc;
+
+	unreaped = MIN(psr->cq_tail - ACCESS_ONCE(sr->cq_head), nr_entries);
+	room = nr_entries - MIN(unreaped + psr->nr_taken, nr_entries);
+	nr = MIN(ACCESS_ONCE(sr->sq_tail) - psr->sq_head, room);
+	if (!nr)
+		return 0;
+	rmb();	/* read the entries after the tail */
+	for (uint32_t i = 0; i < nr; i++) {
+		sysc = ACCESS_ONCE(SYSRING_SQ(sr)[(psr->sq_head + i) & psr->mask]);
+		proc_incref(p, 1);
+		send_kernel_message(coreid, __sysring_run, (long)p, (long)sysc, 0,
+		                    KMSG_ROUTINE);
+	}
+	psr->sq_head += nr;
+	psr->nr_taken += nr;
+	mb();	/* done reading the slots before userspace can reuse them */
+	ACCESS_ONCE(sr->sq_head) = psr->sq_head;
+	return nr;
+}
+
+static void __sysring_complete(struct proc *p, struct proc_sysring *psr,
+                               struct syscall *sysc)
+{
+	struct sysring *sr = psr->ring;
+	struct event_msg msg;
+
+	spin_lock(&psr->lock);
+	SYSRING_CQ(sr)[psr->cq_tail & psr->mask] = sysc;
+	wmb();	/* the entry must be visible before the tail */
+	psr->cq_tail++;
+	ACCESS_ONCE(sr->cq_tail) = psr->cq_tail;
+	psr->nr_taken--;
+	spin_unlock(&psr->lock);
+	if (psr->ev_q) {
+		memset(&msg, 0, sizeof(struct event_msg));
+		msg.ev_type = EV_SYSCALL;
+		msg.ev_arg3 = sysc;
+		send_event(p, psr->ev_q, &msg, 0);
+	}
+}
+
+/* RKM, runs one syscall taken from p's ring.  Eats a proc ref. */
+static void __sysring_run(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct proc *p = (struct proc*)a0;
+	struct syscall *sysc = (struct syscall*)a1;
+	uintptr_t prev = switch_to(p);
+
+	run_sysring_syscall(sysc);
+	__sysring_complete(p, p->sysring, sysc);
+	switch_back(p, prev);
+	proc_decref(p);
+}
+
+/* RKM, one pass of the poller.  Holds a proc ref, which it eats when it
+ * stops. */
+static void __sysring_poll(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct proc *p = (struct proc*)a0;
+	struct proc_sysring *psr = p->sysring;
+	struct sysring *sr = psr->ring;
+	uint64_t now;
+
+	spin_lock(&psr->lock);
+	if (proc_is_dying(p))
+		goto out_stop;
+	now = read_tsc();
+	if (__sysring_take(p, psr, core_id())) {
+		psr->last_work_tsc = now;
+	} else if (tsc2usec(now - psr->last_work_tsc) > SYSRING_POLL_IDLE_USEC) {
+		ACCESS_ONCE(sr->flags) |= SYSRING_F_NEED_WAKEUP;
+		mb();	/* set the flag before the last look at the SQ */
+		if (!__sysring_take(p, psr, core_id()))
+			goto out_stop;
+		ACCESS_ONCE(sr->flags) &= ~SYSRING_F_NEED_WAKEUP;
+		psr->last_work_tsc = now;
+	} else {
+		cpu_relax();
+	}
+	spin_unlock(&psr->lock);
+	/* Goes behind any syscalls we just sent, so they get to run first */
+	send_kernel_message(core_id(), __sysring_poll, a0, 0, 0, KMSG_ROUTINE);
+	return;
+out_stop:
+	psr->poller_running = FALSE;
+	spin_unlock(&psr->lock);
+	proc_decref(p);
+}
+
+/* Hold the lock. */
+static void __sysring_start_poller(struct proc *p, struct proc_sysring *psr)
+{
+	psr->poller_running = TRUE;
+	psr->last_work_tsc = read_tsc();
+	ACCESS_ONCE(psr->ring->flags) &= ~SYSRING_F_NEED_WAKEUP;
+	proc_incref(p, 1);
+	send_kernel_message(psr->poll_core, __sysring_poll, (long)p, 0, 0,
+	                    KMSG_ROUTINE);
+}
+
+/* Maps the ring into p's address space.  The user mappings get their own page
+ * refs, so the kernel's mapping stays good even if the process unmaps it. */
+static void *__sysring_map(struct proc *p, struct proc_sysring *psr)
+{
+	size_t len = PGSIZE << psr->order;
+	struct page *page = kva2page(psr->ring);
+	void *uva;
+
+	uva = do_mmap(p, 0, len, PROT_READ | PROT_WRITE,
+	              MAP_SHARED | MAP_ANONYMOUS, NULL, 0);
+	if (uva == MAP_FAILED)
+		return MAP_FAILED;
+	spin_lock(&p->pte_lock);
+	for (int i = 0; i < 1 << psr->order; i++) {
+		if (page_insert(p->env_pgdir, &page[i], uva + i * PGSIZE,
+		                PTE_USER_RW)) {
+			spin_unlock(&p->pte_lock);
+			munmap(p, (uintptr_t)uva, len);
+			set_errno(ENOMEM);
+			return MAP_FAILED;
+		}
+	}
+	spin_unlock(&p->pte_lock);
+	return uva;
+}
+
+/* Drops the kernel's refs on the ring's pages.  Children that inherited the
+ * mapping hold their own refs, so we can't just free_cont_pages(). */
+static void __sysring_put_pages(struct proc_sysring *psr)
+{
+	struct page *page = kva2page(psr->ring);
+
+	for (int i = 0; i < 1 << psr->order; i++)
+		page_decref(&page[i]);
+}
+
+/* Sets up p's ring and returns its user address, or MAP_FAILED with errno set.
+ * With SYSRING_SETUP_POLL, the poller gets poll_core, which must be idle, or
+ * any idle core if poll_core is -1.  The ring lasts until the process is
+ * freed; each process gets at most one. */
+void *sysring_setup(struct proc *p, unsigned int nr_entries,
+                    struct event_queue *ev_q, int flags, int poll_core)
+{
+	struct proc_sysring *psr;
+	void *uva;
+	bool lost_race;
+
+	if (!IS_PWR2(nr_entries) || (nr_entries > SYSRING_MAX_ENTRIES) ||
+	    (flags & ~SYSRING_SETUP_POLL)) {
+		set_errno(EINVAL);
+		return MAP_FAILED;
+	}
+	if (ACCESS_ONCE(p->sysring)) {
+		set_errno(EBUSY);
+		return MAP_FAILED;
+	}
+	psr = kzmalloc(sizeof(struct proc_sysring), MEM_WAIT);
+	spinlock_init(&psr->lock);
+	psr->order = LOG2_UP(nr_pages(SYSRING_SZ(nr_entries)));
+	psr->ring = get_cont_pages(psr->order, 0);
+	if (!psr->ring) {
+		set_errno(ENOMEM);
+		goto out_psr;
+	}
+	memset(psr->ring, 0, PGSIZE << psr->order);
+	psr->ring->nr_entries = nr_entries;
+	psr->mask = nr_entries - 1;
+	psr->ev_q = ev_q;
+	psr->poll_core = -1;
+	if (flags & SYSRING_SETUP_POLL) {
+		psr->poll_core = poll_core < 0 ? get_any_idle_core()
+		                               : get_specific_idle_core(poll_core);
+		if (psr->poll_core < 0) {
+			set_errno(EBUSY);
+			goto out_pages;
+		}
+	}
+	uva = __sysring_map(p, psr);
+	if (uva == MAP_FAILED)
+		goto out_core;
+	spin_lock(&p->proc_lock);
+	lost_race = p->sysring != NULL;
+	if (!lost_race) {
+		wmb();	/* enter might see the pointer without the lock */
+		p->sysring = psr;
+	}
+	spin_unlock(&p->proc_lock);
+	if (lost_race) {
+		munmap(p, (uintptr_t)uva, PGSIZE << psr->order);
+		set_errno(EBUSY);
+		goto out_core;
+	}
+	return uva;
+
+out_core:
+	if (psr->poll_core >= 0)
+		put_idle_core(psr->poll_core);
+out_pages:
+	__sysring_put_pages(psr);
+out_psr:
+	kfree(psr);
+	return MAP_FAILED;
+}
+
+/* Takes everything submitted so far, or wakes the poller.  Returns how many
+ * syscalls were taken (always 0 with a poller), or -1 if there's no ring. */
+int sysring_enter(struct proc *p)
+{
+	struct proc_sysring *psr = ACCESS_ONCE(p->sysring);
+	int ret = 0;
+
+	if (!psr) {
+		set_errno(ENXIO);
+		return -1;
+	}
+	spin_lock(&psr->lock);
+	if (psr->poll_core >= 0) {
+		if (!psr->poller_running && !proc_is_dying(p))
+			__sysring_start_poller(p, psr);
+	} else {
+		ret = __sysring_take(p, psr, core_id());
+	}
+	spin_unlock(&psr->lock);
+	return ret;
+}
+
+/* Called from __proc_free().  No one else has a ref, so nothing is in flight
+ * and the poller has stopped. */
+void sysring_free(struct proc *p)
+{
+	struct proc_sysring *psr = p->sysring;
+
+	if (!psr)
+		return;
+	assert(!psr->nr_taken && !psr->poller_running);
+	if (psr->poll_core >= 0)
+		put_idle_core(psr->poll_core);
+	__sysring_put_pages(psr);
+	kfree(psr);
+	p->sysring = NULL;
+}
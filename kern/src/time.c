@@ -66,11 +66,12 @@ static inline uint64_t mult_shift_64(uint64_t a, uint64_t b, uint8_t shift)
 	return ((unsigned __int128)a * b) >> shift;
 }
 
-static uint64_t cycles_to_nsec_mult;
-static uint64_t nsec_to_cycles_mult;
+/* The mults live in procinfo, so userspace can do these conversions too. */
+#define cycles_to_nsec_mult		(__proc_global_info.tsc2nsec_mult)
+#define nsec_to_cycles_mult		(__proc_global_info.nsec2tsc_mult)
 
-#define CYCLES_TO_NSEC_SHIFT	32
-#define NSEC_TO_CYCLES_SHIFT	32
+#define CYCLES_TO_NSEC_SHIFT	GINFO_TSC_SHIFT
+#define NSEC_TO_CYCLES_SHIFT	GINFO_TSC_SHIFT
 
 static void cycles_to_nsec_init(uint64_t tsc_freq_hz)
 {
@@ -108,17 +109,26 @@ uint64_t nsec2tsc(uint64_t nsec)
  */
 uint64_t epoch_nsec(void)
 {
-	uint64_t cycles = read_tsc() - __proc_global_info.tsc_cycles_last;
-
-	return __proc_global_info.walltime_ns_last + tsc2nsec(cycles);
+	seq_ctr_t *seqctr = &__proc_global_info.walltime_seqctr;
+	uint64_t cycles, walltime;
+	seq_ctr_t seq;
+
+	do {
+		seq = ACCESS_ONCE(*seqctr);
+		cycles = __proc_global_info.tsc_cycles_last;
+		walltime = __proc_global_info.walltime_ns_last;
+	} while (seqctr_retry(seq, ACCESS_ONCE(*seqctr)));
+	return walltime + tsc2nsec(read_tsc() - cycles);
 }
 
 void time_init(void)
 {
 	train_timing();
 
+	__seq_start_write(&__proc_global_info.walltime_seqctr);
 	__proc_global_info.walltime_ns_last = read_persistent_clock();
 	__proc_global_info.tsc_cycles_last  = read_tsc();
+	__seq_end_write(&__proc_global_info.walltime_seqctr);
 
 	cycles_to_nsec_init(__proc_global_info.tsc_freq);
 	nsec_to_cycles_init(__proc_global_info.tsc_freq);
@@ -0,0 +1,657 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * TMPFS: an in-memory filesystem for scratch data, mounted at /tmp.
+ *
+ * Like KFS, every dentry and inode stays in memory, pinned by an extra dentry
+ * ref, and a file's data only lives in its page map.  The differences are in
+ * the directories and the accounting:
+ *
+ * - Each directory has its own hash table of its entries, under its own lock.
+ *   Lookups that miss the dcache don't scan, and creates and unlinks in one
+ *   directory don't touch any other.  The table doubles as it fills.  The
+ *   entries are also on a list in the order they were made, for readdir, which
+ *   picks up after the last entry it returned.
+ * - A page is the only copy of its data, so readpage marks it dirty and the
+ *   page cache shrinker leaves it alone.  writepage does nothing: pages only
+ *   leave the page map for truncates and deletes, which throw the data away.
+ * - Each file is charged for its size, rounded up to a page, against the
+ *   mount's max_bytes.  Holes count too.  Writes that would go over the limit
+ *   fail with ENOSPC, and writes past s_maxbytes with EFBIG.  Truncates can't
+ *   fail, and are charged regardless.
+ *
+ * Lock ordering: a rename locks both directories, in address order. */
+
+#include <vfs.h>
+#include <kfs.h>
+#include <tmpfs.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <pmap.h>
+#include <smp.h>
+
+#define TMPFS_MAX_FILE_SIZE		(1ULL << 40)
+#define TMPFS_MAGIC				0xdead0002
+#define TMPFS_DIR_MIN_BUCKETS	8
+
+struct page_map_operations tmpfs_pm_op;
+struct super_operations tmpfs_s_op;
+struct inode_operations tmpfs_i_op;
+struct dentry_operations tmpfs_d_op;
+struct file_operations tmpfs_f_op_file;
+struct file_operations tmpfs_f_op_dir;
+
+static struct kmem_cache *tmpfs_i_kcache;
+static struct kmem_cache *tmpfs_de_kcache;
+
+static void tmpfs_init(void)
+{
+	tmpfs_i_kcache = kmem_cache_create("tmpfs_ino_info",
+	                                   sizeof(struct tmpfs_i_info),
+	                                   __alignof__(struct tmpfs_i_info), 0, 0,
+	                                   0);
+	tmpfs_de_kcache = kmem_cache_create("tmpfs_dirent",
+	                                    sizeof(struct tmpfs_dirent),
+	                                    __alignof__(struct tmpfs_dirent), 0, 0,
+	                                    0);
+}
+
+static size_t tmpfs_max_bytes(void)
+{
+	#if CONFIG_TMPFS_MAX_MB
+	return (size_t)CONFIG_TMPFS_MAX_MB << 20;
+	#else
+	return max_pmem / 2;
+	#endif
+}
+
+struct super_block *tmpfs_get_sb(struct fs_type *fs, int flags,
+                                 char *dev_name, struct vfsmount *vmnt)
+{
+	static bool ran_once = FALSE;
+	struct super_block *sb;
+	struct tmpfs_sb_info *sbi;
+
+	if (!ran_once) {
+		ran_once = TRUE;
+		tmpfs_init();
+	}
+	sbi = kzmalloc(sizeof(struct tmpfs_sb_info), MEM_WAIT);
+	sbi->next_ino = 1;					/* 1 is the root */
+	sbi->max_bytes = tmpfs_max_bytes();
+	sb = get_sb();
+	sb->s_dev = 0;
+	sb->s_blocksize = PGSIZE;
+	sb->s_maxbytes = TMPFS_MAX_FILE_SIZE;
+	sb->s_type = &tmpfs_fs_type;
+	sb->s_op = &tmpfs_s_op;
+	sb->s_flags = flags;
+	sb->s_magic = TMPFS_MAGIC;
+	sb->s_mount = vmnt;
+	sb->s_syncing = FALSE;
+	sb->s_bdev = 0;
+	strlcpy(sb->s_name, "TMPFS", 32);
+	sb->s_fs_info = sbi;
+	init_sb(sb, vmnt, &tmpfs_d_op, 1, 0);
+	return sb;
+}
+
+void tmpfs_kill_sb(struct super_block *sb)
+{
+	panic("Killing TMPFS is not supported!");
+}
+
+struct fs_type tmpfs_fs_type = {"TMPFS", 0, tmpfs_get_sb, tmpfs_kill_sb, {0, 0},
+               TAILQ_HEAD_INITIALIZER(tmpfs_fs_type.fs_supers)};
+
+/* Mounts a TMPFS at path, making the directory if it isn't there. */
+void tmpfs_mount(char *path)
+{
+	struct dentry *dentry = lookup_dentry(path, 0);
+
+	if (!dentry)
+		assert(!do_mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO));
+	else
+		kref_put(&dentry->d_kref);
+	if (mount_fs(&tmpfs_fs_type, "tmpfs", path, 0))
+		warn("Failed to mount TMPFS at %s", path);
+}
+
+/* Page Map Operations */
+
+/* Pages we don't have yet are holes.  Since the page is the only copy, it is
+ * never clean. */
+int tmpfs_readpage(struct page_map *pm, struct page *page)
+{
+	struct inode *inode = pm->pm_host;
+	struct tmpfs_i_info *ti = inode->i_fs_info;
+
+	memset(page2kva(page), 0, PGSIZE);
+	spin_lock(&inode->i_lock);
+	ti->pg_hi = MAX(ti->pg_hi, page->pg_index + 1);
+	spin_unlock(&inode->i_lock);
+	atomic_or(&page->pg_flags, PG_UPTODATE | PG_DIRTY);
+	return 0;
+}
+
+/* Nothing backs us.  Whoever is removing the page is tossing its data. */
+int tmpfs_writepage(struct page_map *pm, struct page *page)
+{
+	return 0;
+}
+
+/* Charges inode for size bytes, instead of what it had.  Returns -ENOSPC if
+ * that would put the mount over its limit, unless we're forced to.  Hold the
+ * i_lock. */
+static int __tmpfs_charge(struct inode *inode, size_t size, bool force)
+{
+	struct tmpfs_sb_info *sbi = inode->i_sb->s_fs_info;
+	struct tmpfs_i_info *ti = inode->i_fs_info;
+	size_t new = ROUNDUP(size, PGSIZE);
+	size_t old = ti->charged;
+
+	if (new > old) {
+		if (__sync_add_and_fetch(&sbi->nr_bytes, new - old) > sbi->max_bytes
+		    && !force) {
+			__sync_fetch_and_sub(&sbi->nr_bytes, new - old);
+			return -ENOSPC;
+		}
+	} else {
+		__sync_fetch_and_sub(&sbi->nr_bytes, old - new);
+	}
+	ti->charged = new;
+	return 0;
+}
+
+/* Super Operations */
+
+struct inode *tmpfs_alloc_inode(struct super_block *sb)
+{
+	struct inode *inode = kmem_cache_alloc(inode_kcache, MEM_WAIT);
+	struct tmpfs_i_info *ti = kmem_cache_alloc(tmpfs_i_kcache, MEM_WAIT);
+
+	memset(inode, 0, sizeof(struct inode));
+	inode->i_op = &tmpfs_i_op;
+	inode->i_pm.pm_op = &tmpfs_pm_op;
+	memset(ti, 0, sizeof(struct tmpfs_i_info));
+	spinlock_init(&ti->lock);
+	TAILQ_INIT(&ti->ents);
+	inode->i_fs_info = ti;
+	return inode;
+}
+
+void tmpfs_dealloc_inode(struct inode *inode)
+{
+	struct tmpfs_i_info *ti = inode->i_fs_info;
+
+	assert(!ti->nr_ents);
+	kfree(ti->ht);
+	kfree(ti->symname);
+	kmem_cache_free(tmpfs_i_kcache, ti);
+}
+
+static void tmpfs_dir_init(struct inode *inode)
+{
+	struct tmpfs_i_info *ti = inode->i_fs_info;
+
+	ti->ht = kzmalloc(TMPFS_DIR_MIN_BUCKETS * sizeof(struct tmpfs_dirent_list),
+	                  MEM_WAIT);
+	ti->nr_buckets = TMPFS_DIR_MIN_BUCKETS;
+	ti->next_cookie = 2;				/* after . and .. */
+}
+
+/* Only the root is ever read in.  Everything else is made by a create. */
+void tmpfs_read_inode(struct inode *inode)
+{
+	assert(inode->i_ino == 1);
+	inode->i_mode = S_IRWXU | S_IRWXG | S_IRWXO;
+	SET_FTYPE(inode->i_mode, __S_IFDIR);
+	inode->i_fop = &tmpfs_f_op_dir;
+	inode->i_nlink = 1;
+	tmpfs_dir_init(inode);
+}
+
+/* Called once the last link is gone and no one has the inode open. */
+void tmpfs_delete_inode(struct inode *inode)
+{
+	struct tmpfs_i_info *ti = inode->i_fs_info;
+
+	if (ti->pg_hi)
+		pm_remove_contig(inode->i_mapping, 0, ti->pg_hi);
+	spin_lock(&inode->i_lock);
+	__tmpfs_charge(inode, 0, TRUE);
+	spin_unlock(&inode->i_lock);
+}
+
+/* inode_operations */
+
+static unsigned long tmpfs_get_free_ino(struct super_block *sb)
+{
+	struct tmpfs_sb_info *sbi = sb->s_fs_info;
+
+	return __sync_add_and_fetch(&sbi->next_ino, 1);
+}
+
+/* Doubles dir's hash table, unless someone beat us to it. */
+static void tmpfs_dir_grow(struct tmpfs_i_info *ti, size_t old_nr)
+{
+	size_t nr = old_nr * 2;
+	struct tmpfs_dirent_list *ht, *old_ht;
+	struct tmpfs_dirent *de;
+
+	ht = kzmalloc(nr * sizeof(struct tmpfs_dirent_list), MEM_WAIT);
+	spin_lock(&ti->lock);
+	if (ti->nr_buckets != old_nr) {
+		spin_unlock(&ti->lock);
+		kfree(ht);
+		return;
+	}
+	TAILQ_FOREACH(de, &ti->ents, link)
+		BSD_LIST_INSERT_HEAD(&ht[de->hash & (nr - 1)], de, hash_link);
+	old_ht = ti->ht;
+	ti->ht = ht;
+	ti->nr_buckets = nr;
+	spin_unlock(&ti->lock);
+	kfree(old_ht);
+}
+
+/* Hold ti's lock. */
+static void __tmpfs_dir_insert(struct tmpfs_i_info *ti, struct tmpfs_dirent *de)
+{
+	de->cookie = ti->next_cookie++;
+	BSD_LIST_INSERT_HEAD(&ti->ht[de->hash & (ti->nr_buckets - 1)], de,
+	                     hash_link);
+	TAILQ_INSERT_TAIL(&ti->ents, de, link);
+	ti->nr_ents++;
+}
+
+/* Hold ti's lock. */
+static void __tmpfs_dir_del(struct tmpfs_i_info *ti, struct tmpfs_dirent *de)
+{
+	BSD_LIST_REMOVE(de, hash_link);
+	TAILQ_REMOVE(&ti->ents, de, link);
+	ti->nr_ents--;
+	if (ti->rd_hint == de)
+		ti->rd_hint = NULL;
+}
+
+/* Adds dentry to dir, and pins it. */
+static void tmpfs_dir_add(struct inode *dir, struct dentry *dentry)
+{
+	struct tmpfs_i_info *ti = dir->i_fs_info;
+	struct tmpfs_dirent *de = kmem_cache_alloc(tmpfs_de_kcache, MEM_WAIT);
+	size_t nr_buckets = ACCESS_ONCE(ti->nr_buckets);
+
+	if (ACCESS_ONCE(ti->nr_ents) >= 2 * nr_buckets)
+		tmpfs_dir_grow(ti, nr_buckets);
+	kref_get(&dentry->d_kref, 1);
+	de->dentry = dentry;
+	de->hash = dentry->d_name.hash;
+	dentry->d_fs_info = de;
+	spin_lock(&ti->lock);
+	__tmpfs_dir_insert(ti, de);
+	spin_unlock(&ti->lock);
+}
+
+/* Removes dentry from dir, and unpins it. */
+static void tmpfs_dir_remove(struct inode *dir, struct dentry *dentry)
+{
+	struct tmpfs_i_info *ti = dir->i_fs_info;
+	struct tmpfs_dirent *de = dentry->d_fs_info;
+
+	spin_lock(&ti->lock);
+	__tmpfs_dir_del(ti, de);
+	spin_unlock(&ti->lock);
+	dentry->d_fs_info = 0;
+	kmem_cache_free(tmpfs_de_kcache, de);
+	kref_put(&dentry->d_kref);
+}
+
+static void tmpfs_init_inode(struct inode *dir, struct dentry *dentry,
+                             int type, struct file_operations *fop)
+{
+	struct inode *inode = dentry->d_inode;
+
+	inode->i_ino = tmpfs_get_free_ino(inode->i_sb);
+	SET_FTYPE(inode->i_mode, type);
+	inode->i_fop = fop;
+	tmpfs_dir_add(dir, dentry);
+}
+
+int tmpfs_create(struct inode *dir, struct dentry *dentry, int mode,
+                 struct nameidata *nd)
+{
+	tmpfs_init_inode(dir, dentry, __S_IFREG, &tmpfs_f_op_file);
+	return 0;
+}
+
+/* Every dentry we have is already in memory, so we return the one we have,
+ * not the one passed in. */
+struct dentry *tmpfs_lookup(struct inode *dir, struct dentry *dentry,
+                            struct nameidata *nd)
+{
+	struct tmpfs_i_info *ti = dir->i_fs_info;
+	struct tmpfs_dirent *de;
+	struct dentry *found = 0;
+
+	assert(S_ISDIR(dir->i_mode));
+	spin_lock(&ti->lock);
+	BSD_LIST_FOREACH(de, &ti->ht[dentry->d_name.hash & (ti->nr_buckets - 1)],
+	                 hash_link) {
+		if (de->hash == dentry->d_name.hash &&
+		    de->dentry->d_name.len == dentry->d_name.len &&
+		    !strcmp(de->dentry->d_name.name, dentry->d_name.name)) {
+			found = de->dentry;
+			kref_get(&found->d_kref, 1);
+			break;
+		}
+	}
+	spin_unlock(&ti->lock);
+	return found;
+}
+
+int tmpfs_link(struct dentry *old_dentry, struct inode *dir,
+               struct dentry *new_dentry)
+{
+	tmpfs_dir_add(dir, new_dentry);
+	return 0;
+}
+
+int tmpfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	tmpfs_dir_remove(dir, dentry);
+	return 0;
+}
+
+int tmpfs_symlink(struct inode *dir, struct dentry *dentry,
+                  const char *symname)
+{
+	struct tmpfs_i_info *ti = dentry->d_inode->i_fs_info;
+	size_t len = strlen(symname);
+
+	ti->symname = kmalloc(len + 1, MEM_WAIT);
+	strlcpy(ti->symname, symname, len + 1);
+	tmpfs_init_inode(dir, dentry, __S_IFLNK, &tmpfs_f_op_file);
+	return 0;
+}
+
+int tmpfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
+{
+	tmpfs_dir_init(dentry->d_inode);
+	tmpfs_init_inode(dir, dentry, __S_IFDIR, &tmpfs_f_op_dir);
+	return 0;
+}
+
+int tmpfs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+	struct tmpfs_i_info *ti = dentry->d_inode->i_fs_info;
+
+	if (ACCESS_ONCE(ti->nr_ents))
+		return -ENOTEMPTY;
+	tmpfs_dir_remove(dir, dentry);
+	return 0;
+}
+
+int tmpfs_mknod(struct inode *dir, struct dentry *dentry, int mode, dev_t rdev)
+{
+	return -EINVAL;
+}
+
+/* Moves old_d from old_dir to new_dir, under new_d's name.  The VFS renames
+ * old_d after we return. */
+int tmpfs_rename(struct inode *old_dir, struct dentry *old_d,
+                 struct inode *new_dir, struct dentry *new_d)
+{
+	struct tmpfs_i_info *old_ti = old_dir->i_fs_info;
+	struct tmpfs_i_info *new_ti = new_dir->i_fs_info;
+	struct tmpfs_dirent *de = old_d->d_fs_info;
+
+	if (old_ti == new_ti) {
+		spin_lock(&old_ti->lock);
+	} else {
+		spin_lock(old_ti < new_ti ? &old_ti->lock : &new_ti->lock);
+		spin_lock(old_ti < new_ti ? &new_ti->lock : &old_ti->lock);
+	}
+	__tmpfs_dir_del(old_ti, de);
+	de->hash = new_d->d_name.hash;
+	__tmpfs_dir_insert(new_ti, de);
+	if (old_ti != new_ti)
+		spin_unlock(&new_ti->lock);
+	spin_unlock(&old_ti->lock);
+	return 0;
+}
+
+char *tmpfs_readlink(struct dentry *dentry)
+{
+	struct tmpfs_i_info *ti = dentry->d_inode->i_fs_info;
+
+	if (!S_ISLNK(dentry->d_inode->i_mode))
+		return 0;
+	return ti->symname;
+}
+
+/* Called with the i_lock held, after i_size changed. */
+void tmpfs_truncate(struct inode *inode)
+{
+	struct tmpfs_i_info *ti = inode->i_fs_info;
+
+	if (nr_pages(inode->i_size) < ti->pg_hi)
+		ti->stale = TRUE;
+	__tmpfs_charge(inode, inode->i_size, TRUE);
+}
+
+/* file_operations */
+
+/* A truncate that shrank the file left its old pages in the page map, and a
+ * write past EOF would bring their contents back.  We toss them, and zero the
+ * rest of the last page. */
+static void tmpfs_trim(struct inode *inode)
+{
+	struct tmpfs_i_info *ti = inode->i_fs_info;
+	struct page *page;
+	size_t size;
+	unsigned long first, pg_hi;
+
+	spin_lock(&inode->i_lock);
+	size = inode->i_size;
+	pg_hi = ti->pg_hi;
+	ti->stale = FALSE;
+	spin_unlock(&inode->i_lock);
+	first = nr_pages(size);
+	if (PGOFF(size) && !pm_load_page(inode->i_mapping, size >> PGSHIFT,
+	                                 &page)) {
+		memset(page2kva(page) + PGOFF(size), 0, PGSIZE - PGOFF(size));
+		pm_put_page(page);
+	}
+	if (pg_hi > first)
+		pm_remove_contig(inode->i_mapping, first, pg_hi - first);
+}
+
+/* Charges the file for a write of count bytes at off, before the VFS extends
+ * it.  Returns 0 or a negative errno. */
+static int tmpfs_write_charge(struct file *file, size_t count, off64_t off)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+	struct tmpfs_i_info *ti = inode->i_fs_info;
+	size_t end;
+	bool stale;
+	int ret = 0;
+
+	spin_lock(&inode->i_lock);
+	end = (file->f_flags & O_APPEND ? inode->i_size : off) + count;
+	if (end > inode->i_sb->s_maxbytes)
+		ret = -EFBIG;
+	else if (end > ti->charged)
+		ret = __tmpfs_charge(inode, end, FALSE);
+	stale = ti->stale && end > inode->i_size;
+	spin_unlock(&inode->i_lock);
+	if (!ret && stale)
+		tmpfs_trim(inode);
+	return ret;
+}
+
+ssize_t tmpfs_write(struct file *file, const char *buf, size_t count,
+                    off64_t *offset)
+{
+	int ret;
+
+	if (count) {
+		ret = tmpfs_write_charge(file, count, ACCESS_ONCE(*offset));
+		if (ret) {
+			set_errno(-ret);
+			return -1;
+		}
+	}
+	return generic_file_write(file, buf, count, offset);
+}
+
+ssize_t tmpfs_writev(struct file *file, const struct iovec *iov,
+                     unsigned long iovcnt, off64_t *offset)
+{
+	size_t total = 0;
+	int ret;
+
+	for (unsigned long i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (total) {
+		ret = tmpfs_write_charge(file, total, ACCESS_ONCE(*offset));
+		if (ret) {
+			set_errno(-ret);
+			return -1;
+		}
+	}
+	return generic_file_writev(file, iov, iovcnt, offset);
+}
+
+static void tmpfs_fill_dirent(struct dirent *dirent, unsigned long ino,
+                              unsigned long next, const char *name, size_t len)
+{
+	dirent->d_ino = ino;
+	dirent->d_off = next;
+	dirent->d_reclen = len;
+	assert(len < sizeof(dirent->d_name));
+	strlcpy(dirent->d_name, name, sizeof(dirent->d_name));
+}
+
+/* d_off 0 and 1 are . and .., and the rest are the cookies of the entries.
+ * Sequential readdirs start from where the last one left off.  Returns 1 if
+ * there's more, 0 for the last entry, or -ENOENT if there was nothing. */
+int tmpfs_readdir(struct file *dir, struct dirent *dirent)
+{
+	struct dentry *dir_d = dir->f_dentry;
+	struct tmpfs_i_info *ti = dir_d->d_inode->i_fs_info;
+	unsigned long want = dirent->d_off;
+	struct tmpfs_dirent *de;
+	int ret;
+
+	spin_lock(&ti->lock);
+	if (want < 2) {
+		if (want == 0)
+			tmpfs_fill_dirent(dirent, dir_d->d_inode->i_ino, 1, ".", 1);
+		else
+			tmpfs_fill_dirent(dirent, dir_d->d_parent->d_inode->i_ino, 2,
+			                  "..", 2);
+		ret = want == 1 && TAILQ_EMPTY(&ti->ents) ? 0 : 1;
+		spin_unlock(&ti->lock);
+		return ret;
+	}
+	de = ti->rd_hint && ti->rd_hint->cookie < want ? ti->rd_hint
+	                                                : TAILQ_FIRST(&ti->ents);
+	while (de && de->cookie < want)
+		de = TAILQ_NEXT(de, link);
+	if (!de) {
+		spin_unlock(&ti->lock);
+		return -ENOENT;
+	}
+	tmpfs_fill_dirent(dirent, de->dentry->d_inode->i_ino, de->cookie + 1,
+	                  de->dentry->d_name.name, de->dentry->d_name.len);
+	ti->rd_hint = de;
+	ret = TAILQ_NEXT(de, link) ? 1 : 0;
+	spin_unlock(&ti->lock);
+	return ret;
+}
+
+/* Redeclaration and initialization of the FS ops structures.  We borrow KFS's
+ * nops. */
+struct page_map_operations tmpfs_pm_op = {
+	tmpfs_readpage,
+	tmpfs_writepage,
+};
+
+struct super_operations tmpfs_s_op = {
+	tmpfs_alloc_inode,
+	tmpfs_dealloc_inode,
+	tmpfs_read_inode,
+	kfs_dirty_inode,
+	kfs_write_inode,
+	kfs_put_inode,
+	kfs_drop_inode,
+	tmpfs_delete_inode,
+	kfs_put_super,
+	kfs_write_super,
+	kfs_sync_fs,
+	kfs_remount_fs,
+	kfs_umount_begin,
+};
+
+struct inode_operations tmpfs_i_op = {
+	tmpfs_create,
+	tmpfs_lookup,
+	tmpfs_link,
+	tmpfs_unlink,
+	tmpfs_symlink,
+	tmpfs_mkdir,
+	tmpfs_rmdir,
+	tmpfs_mknod,
+	tmpfs_rename,
+	tmpfs_readlink,
+	tmpfs_truncate,
+	kfs_permission,
+};
+
+struct dentry_operations tmpfs_d_op = {
+	kfs_d_revalidate,
+	generic_dentry_hash,
+	kfs_d_compare,
+	kfs_d_delete,
+	kfs_d_release,
+	kfs_d_iput,
+};
+
+struct file_operations tmpfs_f_op_file = {
+	kfs_llseek,
+	generic_file_read,
+	tmpfs_write,
+	tmpfs_readdir,
+	kfs_mmap,
+	kfs_open,
+	kfs_flush,
+	kfs_release,
+	kfs_fsync,
+	kfs_poll,
+	generic_file_readv,
+	tmpfs_writev,
+	kfs_sendpage,
+	kfs_check_flags,
+};
+
+struct file_operations tmpfs_f_op_dir = {
+	kfs_llseek,
+	generic_dir_read,
+	0,
+	tmpfs_readdir,
+	kfs_mmap,
+	kfs_open,
+	kfs_flush,
+	kfs_release,
+	kfs_fsync,
+	kfs_poll,
+	kfs_readv,
+	kfs_writev,
+	kfs_sendpage,
+	kfs_check_flags,
+};
@@ -0,0 +1,146 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Static tracepoints.  See tracepoint.h.
+ *
+ * The per-core rings are allocated the first time anything is turned on, and
+ * are never freed.  Only the core itself writes its ring, with IRQs off, so we
+ * use the racy slot getters.  Readers copy the rings while the writers keep
+ * going, so a record being written during the copy can come out torn. */
+
+#include <tracepoint.h>
+#include <trace.h>
+#include <percpu.h>
+#include <smp.h>
+#include <kthread.h>
+#include <kmalloc.h>
+#include <process.h>
+#include <arch/arch.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define TP_RING_SZ				(64 * 1024)	/* per core */
+#define TP_LIST_LINE_SZ			128
+
+static DEFINE_PERCPU(struct trace_ring, tp_rings);
+static qlock_t tp_lock = QLOCK_INITIALIZER(tp_lock);
+static bool tp_rings_ready;
+
+static void __tp_rings_alloc(void)
+{
+	void *buf;
+
+	if (tp_rings_ready)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		buf = kzmalloc(TP_RING_SZ, MEM_WAIT);
+		trace_ring_init(_PERCPU_VARPTR(tp_rings, i), buf, TP_RING_SZ,
+		                sizeof(struct tp_record));
+	}
+	tp_rings_ready = TRUE;
+}
+
+void __tracepoint_hit(struct tracepoint *tp, const uint64_t *args)
+{
+	struct tp_record *rec;
+	struct proc *p;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	rec = get_trace_slot_overwrite_racy(PERCPU_VARPTR(tp_rings));
+	p = current;
+	rec->tsc = read_tsc();
+	rec->id = tp - __tracepointsstart;
+	rec->coreid = core_id();
+	rec->pid = p ? p->pid : 0;
+	memcpy(rec->args, args, sizeof(rec->args));
+	enable_irqsave(&irq_state);
+}
+
+/* Turns on or off the tracepoint called name.  "all" matches every tracepoint,
+ * and a trailing '*' matches by prefix, e.g. "sched_*".  Returns how many
+ * matched. */
+int tracepoint_set(const char *name, bool on)
+{
+	struct tracepoint *tp;
+	size_t len = strlen(name);
+	bool prefix = len && name[len - 1] == '*';
+	int nr = 0;
+
+	static_assert(sizeof(struct tp_record) == 64);
+	qlock(&tp_lock);
+	/* The rings must exist before anyone sees enabled */
+	if (on)
+		__tp_rings_alloc();
+	for (tp = __tracepointsstart; tp < __tracepointsend; tp++) {
+		if (strcmp(name, "all")) {
+			if (prefix ? strncmp(name, tp->name, len - 1)
+			           : strcmp(name, tp->name))
+				continue;
+		}
+		tp->enabled = on;
+		nr++;
+	}
+	qunlock(&tp_lock);
+	return nr;
+}
+
+/* Empties the rings. */
+void tracepoint_reset(void)
+{
+	qlock(&tp_lock);
+	if (tp_rings_ready) {
+		for (int i = 0; i < num_cores; i++)
+			trace_ring_reset_and_clear(_PERCPU_VARPTR(tp_rings, i));
+	}
+	qunlock(&tp_lock);
+}
+
+/* Returns the tracepoints, one per line, in id order.  Free with kfree. */
+struct sized_alloc *tracepoint_list(void)
+{
+	struct tracepoint *tp;
+	struct sized_alloc *sza;
+	size_t nr = __tracepointsend - __tracepointsstart;
+	size_t bufsz = TP_LIST_LINE_SZ * (nr + 1), off = 0;
+
+	sza = sized_kzmalloc(bufsz, MEM_WAIT);
+	off += snprintf(sza->buf + off, bufsz - off, "%4s %-3s %-24s %s\n", "ID",
+	                "On", "Name", "Format");
+	for (tp = __tracepointsstart; tp < __tracepointsend; tp++)
+		off += snprintf(sza->buf + off, bufsz - off, "%4d %-3s %-24s %s\n",
+		                tp - __tracepointsstart, tp->enabled ? "on" : "off",
+		                tp->name, tp->fmt);
+	sza->size = MIN(off, bufsz);
+	return sza;
+}
+
+/* Returns a copy of every core's ring, each from oldest to newest, as an array
+ * of struct tp_record.  Cores interleave in time, so sort by tsc if you care.
+ * Free with kfree. */
+struct sized_alloc *tracepoint_snapshot(void)
+{
+	struct sized_alloc *sza;
+	struct trace_ring *tr;
+	struct tp_record *out;
+	unsigned long next, nr;
+
+	qlock(&tp_lock);
+	if (!tp_rings_ready) {
+		qunlock(&tp_lock);
+		return sized_kzmalloc(0, MEM_WAIT);
+	}
+	sza = sized_kzmalloc(num_cores * TP_RING_SZ, MEM_WAIT);
+	out = sza->buf;
+	for (int i = 0; i < num_cores; i++) {
+		tr = _PERCPU_VARPTR(tp_rings, i);
+		next = ACCESS_ONCE(tr->tr_next);
+		nr = MIN(next, tr->tr_max);
+		for (unsigned long j = next - nr; j < next; j++)
+			*out++ = *(struct tp_record*)__get_tr_slot_overwrite(tr, j);
+	}
+	sza->size = (void*)out - sza->buf;
+	qunlock(&tp_lock);
+	return sza;
+}
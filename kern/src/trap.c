@@ -12,6 +12,10 @@
 #include <assert.h>
 #include <kdebug.h>
 #include <kmalloc.h>
+#include <rcu.h>
+#include <tracepoint.h>
+
+DEFINE_TRACEPOINT(kmsg_send, "dst %d pc %p type %d");
 
 static void print_unhandled_trap(struct proc *p, struct user_context *ctx,
                                  unsigned int trap_nr, unsigned int err,
@@ -113,11 +117,63 @@ void kernel_msg_init(void)
 	                   sizeof(struct kernel_message), ARCH_CL_SIZE, 0, 0, 0);
 }
 
-uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
-                             long arg2, int type)
+/* Each core's KMSG queues are MPSC.  Senders push onto a lock-free stack (the
+ * _in pointers) with a CAS.  Only the destination core takes from it: it swaps
+ * out the whole stack and appends it, reversed, to its private FIFO list, so
+ * messages still run in the order they were sent.
+ *
+ * Only the sender that makes the stack non-empty needs to IPI.  A later sender
+ * found a message that hasn't been pulled yet, and whatever pulls that message
+ * pulls ours too.
+ *
+ * An idle core might be waiting for its routine stack to change (kmsg_mwait),
+ * in which case our push wakes it and we skip the IPI.  The core sets the flag
+ * before it starts watching and checks the stack after, so either it sees our
+ * message or it sees our write.  Immediates always IPI: they run from the IRQ
+ * handler. */
+
+/* Returns TRUE if the stack was empty. */
+static bool kmsg_push(struct kernel_message **stack,
+                      struct kernel_message *kmsg)
+{
+	struct kernel_message *old;
+
+	do {
+		old = ACCESS_ONCE(*stack);
+		kmsg->link.stqe_next = old;
+	} while (!atomic_cas_ptr((void**)stack, old, kmsg));
+	return !old;
+}
+
+/* Moves everything sent so far onto list.  Call from list's core, with IRQs
+ * disabled. */
+static void kmsg_pull(struct kernel_message **stack,
+                      struct kernel_msg_list *list)
+{
+	struct kernel_msg_list batch = STAILQ_HEAD_INITIALIZER(batch);
+	struct kernel_message *kmsg, *next;
+
+	/* Avoid the swap if the stack appears empty (lockless peek is okay) */
+	if (!ACCESS_ONCE(*stack))
+		return;
+	kmsg = (struct kernel_message*)atomic_swap((atomic_t*)stack, 0);
+	for (; kmsg; kmsg = next) {
+		next = kmsg->link.stqe_next;
+		STAILQ_INSERT_HEAD(&batch, kmsg, link);
+	}
+	STAILQ_CONCAT(list, &batch);
+}
+
+/* Queues a message for dst.  Returns TRUE if dst needs an IPI.  Call with IRQs
+ * disabled, so we send the IPI promptly after making the stack non-empty. */
+static bool __send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
+                                  long arg2, int type)
 {
 	kernel_message_t *k_msg;
+	bool was_empty;
+
 	assert(pc);
+	tracepoint(kmsg_send, dst, (uintptr_t)pc, type);
 	// note this will be freed on the destination core
 	k_msg = kmem_cache_alloc(kernel_msg_cache, 0);
 	k_msg->srcid = core_id();
@@ -128,26 +184,59 @@ uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
 	k_msg->arg2 = arg2;
 	switch (type) {
 		case KMSG_IMMEDIATE:
-			spin_lock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
-			STAILQ_INSERT_TAIL(&per_cpu_info[dst].immed_amsgs, k_msg, link);
-			spin_unlock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
+			was_empty = kmsg_push(&per_cpu_info[dst].immed_amsgs_in, k_msg);
 			break;
 		case KMSG_ROUTINE:
-			spin_lock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
-			STAILQ_INSERT_TAIL(&per_cpu_info[dst].routine_amsgs, k_msg, link);
-			spin_unlock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
+			was_empty = kmsg_push(&per_cpu_info[dst].routine_amsgs_in, k_msg);
 			break;
 		default:
 			panic("Unknown type of kernel message!");
 	}
-	/* since we touched memory the other core will touch (the lock), we don't
-	 * need an wmb_f() */
+	/* the CAS is a full barrier, so we don't need an wmb_f(), and kmsg_mwait
+	 * is read after the push */
+	if (!was_empty)
+		return FALSE;
+	if ((type == KMSG_ROUTINE) && ACCESS_ONCE(per_cpu_info[dst].kmsg_mwait))
+		return FALSE;
 	/* if we're sending a routine message locally, we don't want/need an IPI */
-	if ((dst != k_msg->srcid) || (type == KMSG_IMMEDIATE))
+	return (dst != k_msg->srcid) || (type == KMSG_IMMEDIATE);
+}
+
+uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
+                             long arg2, int type)
+{
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	if (__send_kernel_message(dst, pc, arg0, arg1, arg2, type))
 		send_ipi(dst, I_KERNEL_MSG);
+	enable_irqsave(&irq_state);
 	return 0;
 }
 
+/* Sends the same message to every core in cset.  All of the messages are queued
+ * before any IPIs go out, and each core gets at most one IPI. */
+void send_kernel_message_cores(const struct core_set *cset, amr_t pc,
+                               long arg0, long arg1, long arg2, int type)
+{
+	struct core_set needs_ipi;
+	int8_t irq_state = 0;
+
+	core_set_init(&needs_ipi);
+	disable_irqsave(&irq_state);
+	for (int i = 0; i < num_cores; i++) {
+		if (!core_set_getcpu(cset, i))
+			continue;
+		if (__send_kernel_message(i, pc, arg0, arg1, arg2, type))
+			core_set_setcpu(&needs_ipi, i);
+	}
+	for (int i = 0; i < num_cores; i++) {
+		if (core_set_getcpu(&needs_ipi, i))
+			send_ipi(i, I_KERNEL_MSG);
+	}
+	enable_irqsave(&irq_state);
+}
+
 /* Kernel message IPI/IRQ handler.
  *
  * This processes immediate messages, and that's it (it used to handle routines
@@ -160,26 +249,25 @@ uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	struct kernel_message *kmsg_i, *temp;
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->immed_amsgs))
-		return;
-	/* The lock serves as a cmb to force a re-read of the head of the list */
-	spin_lock_irqsave(&pcpui->immed_amsg_lock);
-	STAILQ_FOREACH_SAFE(kmsg_i, &pcpui->immed_amsgs, link, temp) {
+	struct kernel_message *kmsg_i;
+
+	kmsg_pull(&pcpui->immed_amsgs_in, &pcpui->immed_amsgs);
+	/* Immediates don't block or enable IRQs, so no one else can touch the
+	 * list while we run them. */
+	while ((kmsg_i = STAILQ_FIRST(&pcpui->immed_amsgs))) {
 		pcpui_trace_kmsg(pcpui, (uintptr_t)kmsg_i->pc);
 		kmsg_i->pc(kmsg_i->srcid, kmsg_i->arg0, kmsg_i->arg1, kmsg_i->arg2);
-		STAILQ_REMOVE(&pcpui->immed_amsgs, kmsg_i, kernel_message, link);
+		STAILQ_REMOVE_HEAD(&pcpui->immed_amsgs, link);
 		kmem_cache_free(kernel_msg_cache, (void*)kmsg_i);
 	}
-	spin_unlock_irqsave(&pcpui->immed_amsg_lock);
 }
 
 bool has_routine_kmsg(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	/* lockless peek */
-	return !STAILQ_EMPTY(&pcpui->routine_amsgs);
+	return !STAILQ_EMPTY(&pcpui->routine_amsgs) ||
+	       ACCESS_ONCE(pcpui->routine_amsgs_in);
 }
 
 /* Helper function, gets the next routine KMSG (RKM).  Returns 0 if the list was
@@ -187,16 +275,12 @@ bool has_routine_kmsg(void)
 static kernel_message_t *get_next_rkmsg(struct per_cpu_info *pcpui)
 {
 	struct kernel_message *kmsg;
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->routine_amsgs))
-		return 0;
-	/* The lock serves as a cmb to force a re-read of the head of the list.
-	 * IRQs are disabled by our caller. */
-	spin_lock(&pcpui->routine_amsg_lock);
+
+	/* IRQs are disabled by our caller, and only this core touches the list. */
+	kmsg_pull(&pcpui->routine_amsgs_in, &pcpui->routine_amsgs);
 	kmsg = STAILQ_FIRST(&pcpui->routine_amsgs);
 	if (kmsg)
 		STAILQ_REMOVE_HEAD(&pcpui->routine_amsgs, link);
-	spin_unlock(&pcpui->routine_amsg_lock);
 	return kmsg;
 }
 
@@ -214,17 +298,23 @@ void process_routine_kmsg(void)
 	uint32_t pcoreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
 	struct kernel_message msg_cp, *kmsg;
+	int prev_state = -1;
 
 	/* Important that callers have IRQs disabled.  When sending cross-core RKMs,
 	 * the IPI is used to keep the core from going to sleep - even though RKMs
 	 * aren't handled in the kmsg handler.  Check smp_idle() for more info. */
 	assert(!irq_is_enabled());
+	/* Callers hold no references to RCU-protected objects */
+	rcu_note_qs();
 	while ((kmsg = get_next_rkmsg(pcpui))) {
 		/* Copy in, and then free, in case we don't return */
 		msg_cp = *kmsg;
 		kmem_cache_free(kernel_msg_cache, (void*)kmsg);
 		assert(msg_cp.dstid == pcoreid);	/* caught a brutal bug with this */
 		set_rkmsg(pcpui);					/* we're now in early RKM ctx */
+		if (prev_state < 0)
+			prev_state = pcpui->cpu_state;
+		__set_cpu_state(pcpui, CPU_STATE_RKM);
 		/* The kmsg could block.  If it does, we want the kthread code to know
 		 * it's not running on behalf of a process, and we're actually spawning
 		 * a kernel task.  While we do have a syscall that does work in an RKM
@@ -252,6 +342,8 @@ void process_routine_kmsg(void)
 		 * return. */
 		disable_irq();
 	}
+	if (prev_state >= 0)
+		__set_cpu_state(pcpui, prev_state);
 }
 
 /* extremely dangerous and racy: prints out the immed and routine kmsgs for a
@@ -271,45 +363,50 @@ void print_kmsgs(uint32_t coreid)
 			kfree(fn_name);
 		}
 	}
+	void __print_kmsg_stack(struct kernel_message *kmsg_i, char *type)
+	{
+		struct kernel_msg_list list;
+
+		/* Not in order, but good enough */
+		list.stqh_first = kmsg_i;
+		__print_kmsgs(&list, type);
+	}
 	__print_kmsgs(&pcpui->immed_amsgs, "Immedte");
+	__print_kmsg_stack(ACCESS_ONCE(pcpui->immed_amsgs_in), "Immedte (new)");
 	__print_kmsgs(&pcpui->routine_amsgs, "Routine");
+	__print_kmsg_stack(ACCESS_ONCE(pcpui->routine_amsgs_in), "Routine (new)");
 }
 
-/* Debugging stuff */
+/* Debugging stuff.  Racy, like print_kmsgs(): the queues are lock-free, so the
+ * messages we print might be getting run and freed. */
 void kmsg_queue_stat(void)
 {
 	struct kernel_message *kmsg;
-	bool immed_emp, routine_emp;
+	void __print_kmsg(struct kernel_message *kmsg, char *type, int coreid)
+	{
+		printk("%s msg on core %d:\n", type, coreid);
+		printk("\tsrc:  %d\n", kmsg->srcid);
+		printk("\tdst:  %d\n", kmsg->dstid);
+		printk("\tpc:   %p\n", kmsg->pc);
+		printk("\targ0: %p\n", kmsg->arg0);
+		printk("\targ1: %p\n", kmsg->arg1);
+		printk("\targ2: %p\n", kmsg->arg2);
+	}
 	for (int i = 0; i < num_cores; i++) {
-		spin_lock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		immed_emp = STAILQ_EMPTY(&per_cpu_info[i].immed_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		spin_lock_irqsave(&per_cpu_info[i].routine_amsg_lock);
-		routine_emp = STAILQ_EMPTY(&per_cpu_info[i].routine_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].routine_amsg_lock);
-		printk("Core %d's immed_emp: %d, routine_emp %d\n", i, immed_emp,
-               routine_emp);
-		if (!immed_emp) {
-			kmsg = STAILQ_FIRST(&per_cpu_info[i].immed_amsgs);
-			printk("Immed msg on core %d:\n", i);
-			printk("\tsrc:  %d\n", kmsg->srcid);
-			printk("\tdst:  %d\n", kmsg->dstid);
-			printk("\tpc:   %p\n", kmsg->pc);
-			printk("\targ0: %p\n", kmsg->arg0);
-			printk("\targ1: %p\n", kmsg->arg1);
-			printk("\targ2: %p\n", kmsg->arg2);
-		}
-		if (!routine_emp) {
-			kmsg = STAILQ_FIRST(&per_cpu_info[i].routine_amsgs);
-			printk("Routine msg on core %d:\n", i);
-			printk("\tsrc:  %d\n", kmsg->srcid);
-			printk("\tdst:  %d\n", kmsg->dstid);
-			printk("\tpc:   %p\n", kmsg->pc);
-			printk("\targ0: %p\n", kmsg->arg0);
-			printk("\targ1: %p\n", kmsg->arg1);
-			printk("\targ2: %p\n", kmsg->arg2);
-		}
+		struct kernel_message *immed, *routine;
 
+		immed = STAILQ_FIRST(&per_cpu_info[i].immed_amsgs);
+		if (!immed)
+			immed = ACCESS_ONCE(per_cpu_info[i].immed_amsgs_in);
+		routine = STAILQ_FIRST(&per_cpu_info[i].routine_amsgs);
+		if (!routine)
+			routine = ACCESS_ONCE(per_cpu_info[i].routine_amsgs_in);
+		printk("Core %d's immed_emp: %d, routine_emp %d\n", i, !immed,
+		       !routine);
+		if (immed)
+			__print_kmsg(immed, "Immed", i);
+		if (routine)
+			__print_kmsg(routine, "Routine", i);
 	}
 }
 
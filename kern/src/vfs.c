@@ -14,11 +14,13 @@
 #include <kmalloc.h>
 #include <kfs.h>
 #include <ext2fs.h>
+#include <tmpfs.h>
 #include <pmap.h>
 #include <umem.h>
 #include <smp.h>
 #include <ns.h>
 #include <fdtap.h>
+#include <elf.h>
 
 struct sb_tailq super_blocks = TAILQ_HEAD_INITIALIZER(super_blocks);
 spinlock_t super_blocks_lock = SPINLOCK_INITIALIZER;
@@ -29,6 +31,23 @@ struct kmem_cache *dentry_kcache; // not to be confused with the dcache
 struct kmem_cache *inode_kcache;
 struct kmem_cache *file_kcache;
 
+unsigned long dcache_max_negative = 1024;
+
+#define DCACHE_INIT_BUCKETS		128
+#define DCACHE_MOVE_BATCH		8		/* buckets moved per dcache_put() */
+#define DCACHE_TRIM_BATCH		16
+
+static void dcache_trim_negative(struct super_block *sb);
+static struct dcache_bucket *dcache_lock_bucket(struct super_block *sb,
+                                                size_t hash);
+static struct dentry *__dcache_bucket_find(struct dcache_bucket *b,
+                                           struct dentry *parent,
+                                           struct qstr *name);
+static bool __dcache_bucket_has(struct dcache_bucket *b, struct dentry *dentry);
+static void __dcache_get_found(struct super_block *sb, struct dentry *found);
+static struct dentry *dcache_get_name(struct dentry *parent, struct qstr *name,
+                                      bool *negative);
+
 /* Mounts fs from dev_name at mnt_pt in namespace ns.  There could be no mnt_pt,
  * such as with the root of (the default) namespace.  Not sure how it would work
  * with multiple namespaces on the same FS yet.  Note if you mount the same FS
@@ -104,6 +123,9 @@ void vfs_init(void)
 	TAILQ_INSERT_TAIL(&file_systems, &kfs_fs_type, list);
 #ifdef CONFIG_EXT2FS
 	TAILQ_INSERT_TAIL(&file_systems, &ext2_fs_type, list);
+#endif
+#ifdef CONFIG_TMPFS
+	TAILQ_INSERT_TAIL(&file_systems, &tmpfs_fs_type, list);
 #endif
 	TAILQ_FOREACH(fs, &file_systems, list)
 		printk("Supports the %s Filesystem\n", fs->name);
@@ -184,6 +206,16 @@ char *dentry_path(struct dentry *dentry, char *path, size_t max_size)
 static struct dentry *do_lookup(struct dentry *parent, char *name)
 {
 	struct dentry *result, *query;
+	struct qstr qstr;
+	bool negative;
+
+	/* Most lookups hit, so try without building the query dentry */
+	qstr.name = name;
+	qstr.len = strnlen(name, MAX_FILENAME_SZ);
+	qstr.hash = parent->d_op->d_hash(parent, &qstr);
+	result = dcache_get_name(parent, &qstr, &negative);
+	if (result || negative)
+		return result;
 	query = get_dentry(parent->d_sb, parent, name);
 	if (!query) {
 		warn("OOM in do_lookup(), probably wasn't expected\n");
@@ -281,6 +313,7 @@ static int follow_mount(struct nameidata *nd)
 }
 
 static int link_path_walk(char *path, struct nameidata *nd);
+static void walk_cached(struct nameidata *nd, char **path);
 
 /* When nd->dentry is for a symlink, this will recurse and follow that symlink,
  * so that nd contains the results of following the symlink (dentry and mnt).
@@ -349,6 +382,77 @@ static void stash_nd_name(struct nameidata *nd, char *name)
 	nd->last.hash = nd->dentry->d_op->d_hash(nd->dentry, &nd->last);
 }
 
+/* Optimistically walks the intermediate links at *path that are in the dcache,
+ * without refcnting each dentry along the way.  A hashed dentry can't be freed
+ * while its bucket is locked, and its memory outlasts our RCU read (see
+ * __dentry_free()), so we can use it as the next parent after we unlock.
+ *
+ * We stop at anything that needs more care: a miss, a negative, a mount point,
+ * a non-directory (like a symlink), a .., or the last link.  If we moved, and
+ * the dentry we stopped on is still hashed, we ref it and move nd and *path
+ * there.  O/w, nd and *path are untouched and the slow path redoes the work.
+ *
+ * Like the slow path, this can race with a rename of a directory we passed
+ * through - we just look like we got there first. */
+static void walk_cached(struct nameidata *nd, char **path)
+{
+	struct super_block *sb = nd->dentry->d_sb;
+	struct dentry_operations *d_op = nd->dentry->d_op;
+	struct dentry *parent = nd->dentry, *child;
+	struct dcache_bucket *b;
+	struct qstr name;
+	char *link = *path, *next_slash, *end;
+	bool ok;
+
+	rcu_read_lock();
+	while (1) {
+		if (!strncmp("../", link, 3))
+			break;
+		next_slash = strchr(link, '/');
+		if (!next_slash)
+			break;
+		/* trailing slashes: leave them for the slow path to parse */
+		for (end = next_slash; *end == '/'; end++)
+			;
+		if (*end == '\0')
+			break;
+		if (strncmp("./", link, 2)) {
+			/* all dentries on an sb share its d_op, so the hash is the same
+			 * as the one the slow path would use */
+			*next_slash = '\0';
+			name.name = link;
+			name.len = next_slash - link;
+			name.hash = d_op->d_hash(parent, &name);
+			b = dcache_lock_bucket(sb, name.hash);
+			child = __dcache_bucket_find(b, parent, &name);
+			*next_slash = '/';
+			ok = child && !(child->d_flags & (DENTRY_NEGATIVE | DENTRY_DYING))
+			     && !child->d_mount_point
+			     && S_ISDIR(child->d_inode->i_mode)
+			     && !check_perms(child->d_inode, nd->intent);
+			spin_unlock(&b->lock);
+			if (!ok)
+				break;
+			parent = child;
+		}
+		link = end;
+	}
+	ok = FALSE;
+	if (parent != nd->dentry) {
+		b = dcache_lock_bucket(sb, parent->d_name.hash);
+		ok = __dcache_bucket_has(b, parent);
+		if (ok)
+			__dcache_get_found(sb, parent);
+		spin_unlock(&b->lock);
+	}
+	rcu_read_unlock();
+	if (!ok)
+		return;
+	next_link(parent, nd);
+	kref_put(&parent->d_kref);
+	*path = link;
+}
+
 /* Resolves the links in a basic path walk.  0 for success, -EWHATEVER
  * otherwise.  The final lookup is returned via nd. */
 static int link_path_walk(char *path, struct nameidata *nd)
@@ -384,6 +488,9 @@ static int link_path_walk(char *path, struct nameidata *nd)
 		nd_inode = nd->dentry->d_inode;
 		if ((error = check_perms(nd_inode, nd->intent)))
 			return error;
+		/* skip ahead over whatever is already in the dcache.  we carry on
+		 * from wherever it stopped, which usually needs the slow path. */
+		walk_cached(nd, &link);
 		/* find the next link, break out if it is the end */
 		next_slash = strchr(link, '/');
 		if (!next_slash) {
@@ -566,23 +673,46 @@ out:
 
 /* Superblock functions */
 
-/* Dentry "hash" function for the hash table to use.  Since we already have the
- * hash in the qstr, we don't need to rehash.  Also, note we'll be using the
- * dentry in question as both the key and the value. */
-static size_t __dcache_hash(void *k)
+/* Dentry cache equality function.  Since we already have the hash in the
+ * qstr, we don't need to rehash.  Only compares parent pointers, so it's fine
+ * if the parent is gone. */
+static bool __dcache_eq(struct dentry *dentry, struct dentry *parent,
+                        struct qstr *name)
 {
-	return (size_t)((struct dentry*)k)->d_name.hash;
+	if (dentry->d_parent != parent)
+		return FALSE;
+	if (dentry->d_name.hash != name->hash)
+		return FALSE;
+	/* TODO: use the FS-specific string comparison */
+	return !strcmp(dentry->d_name.name, name->name);
 }
 
-/* Dentry cache hashtable equality function.  This means we need to pass in some
- * minimal dentry when doing a lookup. */
-static ssize_t __dcache_eq(void *k1, void *k2)
+static struct dcache_table *dcache_table_alloc(size_t nr_buckets)
 {
-	if (((struct dentry*)k1)->d_parent != ((struct dentry*)k2)->d_parent)
+	struct dcache_table *table = kmalloc(sizeof(struct dcache_table), 0);
+
+	if (!table)
 		return 0;
-	/* TODO: use the FS-specific string comparison */
-	return !strcmp(((struct dentry*)k1)->d_name.name,
-	               ((struct dentry*)k2)->d_name.name);
+	table->buckets = kmalloc(nr_buckets * sizeof(struct dcache_bucket), 0);
+	if (!table->buckets) {
+		kfree(table);
+		return 0;
+	}
+	table->nr_buckets = nr_buckets;
+	for (int i = 0; i < nr_buckets; i++) {
+		spinlock_init(&table->buckets[i].lock);
+		table->buckets[i].moved = FALSE;
+		BSD_LIST_INIT(&table->buckets[i].chain);
+	}
+	return table;
+}
+
+static void __dcache_table_free_rcu(struct rcu_head *head)
+{
+	struct dcache_table *table = container_of(head, struct dcache_table, rcu);
+
+	kfree(table->buckets);
+	kfree(table);
 }
 
 /* Helper to alloc and initialize a generic superblock.  This handles all the
@@ -598,8 +728,14 @@ struct super_block *get_sb(void)
 	TAILQ_INIT(&sb->s_dirty_i);
 	TAILQ_INIT(&sb->s_io_wb);
 	TAILQ_INIT(&sb->s_lru_d);
+	TAILQ_INIT(&sb->s_lru_neg);
+	sb->s_nr_neg = 0;
 	TAILQ_INIT(&sb->s_files);
-	sb->s_dcache = create_hashtable(100, __dcache_hash, __dcache_eq);
+	sb->s_dcache = dcache_table_alloc(DCACHE_INIT_BUCKETS);
+	assert(sb->s_dcache);
+	sb->s_dcache_old = 0;
+	sb->s_dcache_next_mv = 0;
+	atomic_init(&sb->s_nr_dentries, 0);
 	sb->s_icache = create_hashtable(100, __generic_hash, __generic_eq);
 	spinlock_init(&sb->s_lru_lock);
 	spinlock_init(&sb->s_dcache_lock);
@@ -737,6 +873,8 @@ struct dentry *get_dentry(struct super_block *sb, struct dentry *parent,
 void dentry_release(struct kref *kref)
 {
 	struct dentry *dentry = container_of(kref, struct dentry, d_kref);
+	struct super_block *sb = dentry->d_sb;
+	bool trim = FALSE;
 
 	printd("'Releasing' dentry %p: %s\n", dentry, dentry->d_name.name);
 	/* DYING dentries (recently unlinked / rmdir'd) just get freed */
@@ -747,15 +885,26 @@ void dentry_release(struct kref *kref)
 	/* This lock ensures the USED state and the TAILQ membership is in sync.
 	 * Also used to check the refcnt, though that might not be necessary. */
 	spin_lock(&dentry->d_lock);
+	/* dcache_put() can set DYING while we're on our way here */
+	if (dentry->d_flags & DENTRY_DYING) {
+		spin_unlock(&dentry->d_lock);
+		__dentry_free(dentry);
+		return;
+	}
 	/* While locked, we need to double check the kref, in case someone already
 	 * reup'd it.  Re-up? you're crazy!  Reee-up, you're outta yo mind! */
 	if (!kref_refcnt(&dentry->d_kref)) {
 		/* Note this is where negative dentries get set UNUSED */
 		if (dentry->d_flags & DENTRY_USED) {
 			dentry->d_flags &= ~DENTRY_USED;
-			spin_lock(&dentry->d_sb->s_lru_lock);
-			TAILQ_INSERT_TAIL(&dentry->d_sb->s_lru_d, dentry, d_lru);
-			spin_unlock(&dentry->d_sb->s_lru_lock);
+			spin_lock(&sb->s_lru_lock);
+			if (dentry->d_flags & DENTRY_NEGATIVE) {
+				TAILQ_INSERT_TAIL(&sb->s_lru_neg, dentry, d_lru);
+				trim = ++sb->s_nr_neg > dcache_max_negative;
+			} else {
+				TAILQ_INSERT_TAIL(&sb->s_lru_d, dentry, d_lru);
+			}
+			spin_unlock(&sb->s_lru_lock);
 		} else {
 			/* and make sure it wasn't USED, then UNUSED again */
 			/* TODO: think about issues with this */
@@ -763,6 +912,15 @@ void dentry_release(struct kref *kref)
 		}
 	}
 	spin_unlock(&dentry->d_lock);
+	/* Negative dentries have no children, so we're not in the middle of some
+	 * other dcache operation. */
+	if (trim)
+		dcache_trim_negative(sb);
+}
+
+static void __dentry_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(dentry_kcache, container_of(head, struct dentry, d_rcu));
 }
 
 /* Called when we really dealloc and get rid of a dentry (like when it is
@@ -792,7 +950,8 @@ void __dentry_free(struct dentry *dentry)
 		TAILQ_REMOVE(&dentry->d_inode->i_dentry, dentry, d_alias);
 		kref_put(&dentry->d_inode->i_kref);	/* dentries kref inodes */
 	}
-	kmem_cache_free(dentry_kcache, dentry);
+	/* walk_cached() might still be looking at it */
+	call_rcu(&dentry->d_rcu, __dentry_free_rcu);
 }
 
 /* Looks up the dentry for the given path, returning a refcnt'd dentry (or 0).
@@ -816,6 +975,156 @@ struct dentry *lookup_dentry(char *path, int flags)
 	return dentry;
 }
 
+/* Locks and returns the bucket that has (or would have) dentries with hash.
+ * While resizing, that's the old table's bucket until it gets moved.  A
+ * locked, unmoved bucket keeps its table from being freed, so the caller
+ * doesn't need RCU once we return. */
+static struct dcache_bucket *dcache_lock_bucket(struct super_block *sb,
+                                                size_t hash)
+{
+	struct dcache_table *cur, *old;
+	struct dcache_bucket *b;
+
+	rcu_read_lock();
+	while (1) {
+		cur = rcu_dereference(sb->s_dcache);
+		rmb();	/* resizes set the old table before the new one */
+		old = rcu_dereference(sb->s_dcache_old);
+		if (old && (old != cur)) {
+			b = &old->buckets[hash & (old->nr_buckets - 1)];
+			spin_lock(&b->lock);
+			if (!b->moved)
+				break;
+			spin_unlock(&b->lock);
+		}
+		b = &cur->buckets[hash & (cur->nr_buckets - 1)];
+		spin_lock(&b->lock);
+		/* happens if we raced with the start of a resize */
+		if (!b->moved)
+			break;
+		spin_unlock(&b->lock);
+	}
+	rcu_read_unlock();
+	return b;
+}
+
+static struct dentry *__dcache_bucket_find(struct dcache_bucket *b,
+                                           struct dentry *parent,
+                                           struct qstr *name)
+{
+	struct dentry *d_i;
+
+	BSD_LIST_FOREACH(d_i, &b->chain, d_hash) {
+		if (__dcache_eq(d_i, parent, name))
+			return d_i;
+	}
+	return 0;
+}
+
+static bool __dcache_bucket_has(struct dcache_bucket *b, struct dentry *dentry)
+{
+	struct dentry *d_i;
+
+	BSD_LIST_FOREACH(d_i, &b->chain, d_hash) {
+		if (d_i == dentry)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Takes an unused dentry off its LRU list.  Hold the LRU lock. */
+static void __dentry_lru_remove(struct super_block *sb, struct dentry *dentry)
+{
+	if (dentry->d_flags & DENTRY_NEGATIVE) {
+		TAILQ_REMOVE(&sb->s_lru_neg, dentry, d_lru);
+		sb->s_nr_neg--;
+	} else {
+		TAILQ_REMOVE(&sb->s_lru_d, dentry, d_lru);
+	}
+}
+
+/* Moves up to nr buckets from the old table to the new one, finishing the
+ * resize if that was the last of them.  Hold s_dcache_lock. */
+static void __dcache_move_buckets(struct super_block *sb, size_t nr)
+{
+	struct dcache_table *cur = sb->s_dcache, *old = sb->s_dcache_old;
+	struct dcache_bucket *ob, *nb;
+	struct dentry *d_i;
+
+	for (; nr && (sb->s_dcache_next_mv < old->nr_buckets); nr--) {
+		ob = &old->buckets[sb->s_dcache_next_mv++];
+		spin_lock(&ob->lock);
+		while ((d_i = BSD_LIST_FIRST(&ob->chain))) {
+			BSD_LIST_REMOVE(d_i, d_hash);
+			nb = &cur->buckets[d_i->d_name.hash & (cur->nr_buckets - 1)];
+			spin_lock(&nb->lock);
+			BSD_LIST_INSERT_HEAD(&nb->chain, d_i, d_hash);
+			spin_unlock(&nb->lock);
+		}
+		ob->moved = TRUE;
+		spin_unlock(&ob->lock);
+	}
+	if (sb->s_dcache_next_mv == old->nr_buckets) {
+		rcu_assign_pointer(sb->s_dcache_old, 0);
+		call_rcu(&old->rcu, __dcache_table_free_rcu);
+	}
+}
+
+/* Makes a little progress on a resize, or starts one if the table is getting
+ * full.  If someone else is already at it, we let them be. */
+static void dcache_resize_step(struct super_block *sb)
+{
+	struct dcache_table *new;
+
+	if (!spin_trylock(&sb->s_dcache_lock))
+		return;
+	if (sb->s_dcache_old) {
+		__dcache_move_buckets(sb, DCACHE_MOVE_BATCH);
+	} else if (atomic_read(&sb->s_nr_dentries) > 2 * sb->s_dcache->nr_buckets) {
+		/* If this fails, we'll try again on a later put */
+		new = dcache_table_alloc(sb->s_dcache->nr_buckets * 2);
+		if (new) {
+			sb->s_dcache_next_mv = 0;
+			rcu_assign_pointer(sb->s_dcache_old, sb->s_dcache);
+			rcu_assign_pointer(sb->s_dcache, new);
+		}
+	}
+	spin_unlock(&sb->s_dcache_lock);
+}
+
+/* Moves a negative dentry to the young end of the LRU, so it's the last to
+ * go.  It's on the LRU iff it's not USED, which the d_lock keeps in sync.
+ * Hold its bucket lock. */
+static void __dcache_touch_negative(struct super_block *sb,
+                                    struct dentry *dentry)
+{
+	spin_lock(&dentry->d_lock);
+	if (!(dentry->d_flags & DENTRY_USED)) {
+		spin_lock(&sb->s_lru_lock);
+		TAILQ_REMOVE(&sb->s_lru_neg, dentry, d_lru);
+		TAILQ_INSERT_TAIL(&sb->s_lru_neg, dentry, d_lru);
+		spin_unlock(&sb->s_lru_lock);
+	}
+	spin_unlock(&dentry->d_lock);
+}
+
+/* The "kref resurrection" of a positive dentry we found in the dcache (see
+ * below).  Hold its bucket lock. */
+static void __dcache_get_found(struct super_block *sb, struct dentry *found)
+{
+	spin_lock(&found->d_lock);
+	__kref_get(&found->d_kref, 1);	/* prob could be done outside the lock*/
+	/* If we're here (after kreffing) and it is not USED, we are the one who
+	 * should resurrect */
+	if (!(found->d_flags & DENTRY_USED)) {
+		found->d_flags |= DENTRY_USED;
+		spin_lock(&sb->s_lru_lock);
+		TAILQ_REMOVE(&sb->s_lru_d, found, d_lru);
+		spin_unlock(&sb->s_lru_lock);
+	}
+	spin_unlock(&found->d_lock);
+}
+
 /* Get a dentry from the dcache.  At a minimum, we need the name hash and parent
  * in what_i_want, though most uses will probably be from a get_dentry() call.
  * We pass in the SB in the off chance that we don't want to use a get'd dentry.
@@ -834,34 +1143,48 @@ struct dentry *lookup_dentry(char *path, int flags)
  * This is where we do the "kref resurrection" - we are returning a kref'd
  * object, even if it wasn't kref'd before.  This means the dcache does NOT hold
  * krefs (it is a weak/internal ref), but it is a source of kref generation.  We
- * sync up with the possible freeing of the dentry by locking the table.  See
+ * sync up with the possible freeing of the dentry by locking its bucket.  See
  * Doc/kref for more info. */
 struct dentry *dcache_get(struct super_block *sb, struct dentry *what_i_want)
 {
+	struct dcache_bucket *b;
 	struct dentry *found;
-	/* This lock protects the hash, as well as ensures the returned object
-	 * doesn't get deleted/freed out from under us */
-	spin_lock(&sb->s_dcache_lock);
-	found = hashtable_search(sb->s_dcache, what_i_want);
-	if (found) {
-		if (found->d_flags & DENTRY_NEGATIVE) {
-			what_i_want->d_flags |= DENTRY_NEGATIVE;
-			spin_unlock(&sb->s_dcache_lock);
-			return 0;
-		}
-		spin_lock(&found->d_lock);
-		__kref_get(&found->d_kref, 1);	/* prob could be done outside the lock*/
-		/* If we're here (after kreffing) and it is not USED, we are the one who
-		 * should resurrect */
-		if (!(found->d_flags & DENTRY_USED)) {
-			found->d_flags |= DENTRY_USED;
-			spin_lock(&sb->s_lru_lock);
-			TAILQ_REMOVE(&sb->s_lru_d, found, d_lru);
-			spin_unlock(&sb->s_lru_lock);
-		}
-		spin_unlock(&found->d_lock);
-	}
-	spin_unlock(&sb->s_dcache_lock);
+	/* The bucket lock protects the chain, as well as ensures the returned
+	 * object doesn't get deleted/freed out from under us */
+	b = dcache_lock_bucket(sb, what_i_want->d_name.hash);
+	found = __dcache_bucket_find(b, what_i_want->d_parent,
+	                             &what_i_want->d_name);
+	if (found && (found->d_flags & DENTRY_NEGATIVE)) {
+		what_i_want->d_flags |= DENTRY_NEGATIVE;
+		__dcache_touch_negative(sb, found);
+		found = 0;
+	} else if (found) {
+		__dcache_get_found(sb, found);
+	}
+	spin_unlock(&b->lock);
+	return found;
+}
+
+/* Like dcache_get(), but by name, so we don't need a query dentry.  Returns
+ * a kref'd dentry, or 0 with *negative set if we cached a failed lookup. */
+static struct dentry *dcache_get_name(struct dentry *parent, struct qstr *name,
+                                      bool *negative)
+{
+	struct super_block *sb = parent->d_sb;
+	struct dcache_bucket *b;
+	struct dentry *found;
+
+	*negative = FALSE;
+	b = dcache_lock_bucket(sb, name->hash);
+	found = __dcache_bucket_find(b, parent, name);
+	if (found && (found->d_flags & DENTRY_NEGATIVE)) {
+		*negative = TRUE;
+		__dcache_touch_negative(sb, found);
+		found = 0;
+	} else if (found) {
+		__dcache_get_found(sb, found);
+	}
+	spin_unlock(&b->lock);
 	return found;
 }
 
@@ -870,29 +1193,44 @@ struct dentry *dcache_get(struct super_block *sb, struct dentry *what_i_want)
  * now we'll remove it and put the new one in there. */
 void dcache_put(struct super_block *sb, struct dentry *key_val)
 {
+	struct dcache_bucket *b;
 	struct dentry *old;
-	int retval;
-	spin_lock(&sb->s_dcache_lock);
-	old = hashtable_remove(sb->s_dcache, key_val);
+
+	b = dcache_lock_bucket(sb, key_val->d_name.hash);
+	old = __dcache_bucket_find(b, key_val->d_parent, &key_val->d_name);
+	if (old == key_val) {
+		/* already in there */
+		spin_unlock(&b->lock);
+		return;
+	}
 	/* if it is old and non-negative, our caller lost a race with someone else
-	 * adding the dentry.  but since we yanked it out, like a bunch of idiots,
-	 * we still have to put it back.  should be fairly rare. */
-	if (old && (old->d_flags & DENTRY_NEGATIVE)) {
-		/* This is possible, but rare for now (about to be put on the LRU) */
-		assert(!(old->d_flags & DENTRY_USED));
-		assert(!kref_refcnt(&old->d_kref));
-		spin_lock(&sb->s_lru_lock);
-		TAILQ_REMOVE(&sb->s_lru_d, old, d_lru);
-		spin_unlock(&sb->s_lru_lock);
-		/* TODO: this seems suspect.  isn't this the same memory as key_val?
-		 * in which case, we just adjust the flags (remove NEG) and reinsert? */
-		assert(old != key_val); // checking TODO comment
-		__dentry_free(old);
+	 * adding the dentry.  should be fairly rare.  either way, we yank the old
+	 * one out.  unused dentries are always in the dcache, so if no one is
+	 * using it, we free it.  o/w, it gets freed when its last user is done. */
+	if (old) {
+		BSD_LIST_REMOVE(old, d_hash);
+		atomic_dec(&sb->s_nr_dentries);
+		spin_lock(&old->d_lock);
+		if (old->d_flags & DENTRY_USED) {
+			/* This is possible, but rare for now (about to be put on the LRU) */
+			assert(!(old->d_flags & DENTRY_NEGATIVE));
+			old->d_flags |= DENTRY_DYING;
+			spin_unlock(&old->d_lock);
+			old = 0;
+		} else {
+			assert(!kref_refcnt(&old->d_kref));
+			spin_lock(&sb->s_lru_lock);
+			__dentry_lru_remove(sb, old);
+			spin_unlock(&sb->s_lru_lock);
+			spin_unlock(&old->d_lock);
+		}
 	}
-	/* this returns 0 on failure (TODO: Fix this ghetto shit) */
- 	retval = hashtable_insert(sb->s_dcache, key_val, key_val);
-	assert(retval);
-	spin_unlock(&sb->s_dcache_lock);
+	BSD_LIST_INSERT_HEAD(&b->chain, key_val, d_hash);
+	atomic_inc(&sb->s_nr_dentries);
+	spin_unlock(&b->lock);
+	if (old)
+		__dentry_free(old);
+	dcache_resize_step(sb);
 }
 
 /* Will remove and return the dentry.  Caller deallocs the key, but the retval
@@ -902,39 +1240,102 @@ void dcache_put(struct super_block *sb, struct dentry *key_val)
  * there. */
 struct dentry *dcache_remove(struct super_block *sb, struct dentry *key)
 {
+	struct dcache_bucket *b;
 	struct dentry *retval;
-	spin_lock(&sb->s_dcache_lock);
-	retval = hashtable_remove(sb->s_dcache, key);
-	spin_unlock(&sb->s_dcache_lock);
+
+	b = dcache_lock_bucket(sb, key->d_name.hash);
+	retval = __dcache_bucket_find(b, key->d_parent, &key->d_name);
+	if (retval) {
+		BSD_LIST_REMOVE(retval, d_hash);
+		atomic_dec(&sb->s_nr_dentries);
+	}
+	spin_unlock(&b->lock);
 	return retval;
 }
 
-/* This will clean out the LRU list, which are the unused dentries of the dentry
- * cache.  This will optionally only free the negative ones.  Note that we grab
- * the hash lock for the time we traverse the LRU list - this prevents someone
- * from getting a kref from the dcache, which could cause us trouble (we rip
- * someone off the list, who isn't unused, and they try to rip them off the
- * list). */
-void dcache_prune(struct super_block *sb, bool negative_only)
+/* Frees the oldest unused negative dentries, til we're under the limit (or
+ * have done a batch).  The LRU lock nests inside the bucket locks, so we peek
+ * at the oldest, lock its bucket, and then make sure it's still the oldest.
+ * Unused dentries are always in the dcache, so it's in that bucket. */
+static void dcache_trim_negative(struct super_block *sb)
+{
+	struct dcache_bucket *b;
+	struct dentry *victim;
+	unsigned int hash;
+
+	for (int i = 0; i < DCACHE_TRIM_BATCH; i++) {
+		spin_lock(&sb->s_lru_lock);
+		victim = TAILQ_FIRST(&sb->s_lru_neg);
+		if (!victim || (sb->s_nr_neg <= dcache_max_negative)) {
+			spin_unlock(&sb->s_lru_lock);
+			return;
+		}
+		hash = victim->d_name.hash;
+		spin_unlock(&sb->s_lru_lock);
+		b = dcache_lock_bucket(sb, hash);
+		spin_lock(&sb->s_lru_lock);
+		if ((TAILQ_FIRST(&sb->s_lru_neg) != victim) ||
+		    (victim->d_name.hash != hash)) {
+			spin_unlock(&sb->s_lru_lock);
+			spin_unlock(&b->lock);
+			continue;
+		}
+		__dentry_lru_remove(sb, victim);
+		spin_unlock(&sb->s_lru_lock);
+		BSD_LIST_REMOVE(victim, d_hash);
+		atomic_dec(&sb->s_nr_dentries);
+		spin_unlock(&b->lock);
+		assert(!kref_refcnt(&victim->d_kref));
+		__dentry_free(victim);
+	}
+}
+
+/* Pulls the unused (maybe only negative) dentries out of a table's buckets,
+ * onto victims.  The d_lock syncs with dentry_release(), which puts a dentry
+ * on the LRU at the same time it clears USED. */
+static void __dcache_prune_table(struct super_block *sb,
+                                 struct dcache_table *table, bool negative_only,
+                                 struct dentry_tailq *victims)
 {
+	struct dcache_bucket *b;
 	struct dentry *d_i, *temp;
-	struct dentry_tailq victims = TAILQ_HEAD_INITIALIZER(victims);
 
-	spin_lock(&sb->s_dcache_lock);
-	spin_lock(&sb->s_lru_lock);
-	TAILQ_FOREACH_SAFE(d_i, &sb->s_lru_d, d_lru, temp) {
-		if (!(d_i->d_flags & DENTRY_USED)) {
+	if (!table)
+		return;
+	for (int i = 0; i < table->nr_buckets; i++) {
+		b = &table->buckets[i];
+		spin_lock(&b->lock);
+		BSD_LIST_FOREACH_SAFE(d_i, &b->chain, d_hash, temp) {
 			if (negative_only && !(d_i->d_flags & DENTRY_NEGATIVE))
 				continue;
-			/* another place where we'd be better off with tools, not sol'ns */
-			hashtable_remove(sb->s_dcache, d_i);
-			TAILQ_REMOVE(&sb->s_lru_d, d_i, d_lru);
-			TAILQ_INSERT_HEAD(&victims, d_i, d_lru);
+			spin_lock(&d_i->d_lock);
+			if (!(d_i->d_flags & DENTRY_USED)) {
+				BSD_LIST_REMOVE(d_i, d_hash);
+				atomic_dec(&sb->s_nr_dentries);
+				spin_lock(&sb->s_lru_lock);
+				__dentry_lru_remove(sb, d_i);
+				spin_unlock(&sb->s_lru_lock);
+				TAILQ_INSERT_HEAD(victims, d_i, d_lru);
+			}
+			spin_unlock(&d_i->d_lock);
 		}
+		spin_unlock(&b->lock);
 	}
-	spin_unlock(&sb->s_lru_lock);
+}
+
+/* This will clean out the unused dentries of the dentry cache.  This will
+ * optionally only free the negative ones.  We hold the resize lock while we
+ * walk the tables, so the dentries stay put. */
+void dcache_prune(struct super_block *sb, bool negative_only)
+{
+	struct dentry *d_i, *temp;
+	struct dentry_tailq victims = TAILQ_HEAD_INITIALIZER(victims);
+
+	spin_lock(&sb->s_dcache_lock);
+	__dcache_prune_table(sb, sb->s_dcache_old, negative_only, &victims);
+	__dcache_prune_table(sb, sb->s_dcache, negative_only, &victims);
 	spin_unlock(&sb->s_dcache_lock);
-	/* Now do the actual freeing, outside of the hash/LRU list locks.  This is
+	/* Now do the actual freeing, outside of the bucket/LRU list locks.  This is
 	 * necessary since __dentry_free() will decref its parent, which may get
 	 * released and try to add itself to the LRU. */
 	TAILQ_FOREACH_SAFE(d_i, &victims, d_lru, temp) {
@@ -946,6 +1347,32 @@ void dcache_prune(struct super_block *sb, bool negative_only)
 	 * could loop back until that list is empty, if we care about this. */
 }
 
+/* Calls func on every dentry in sb's dcache, with its bucket locked.  For
+ * debugging. */
+void dcache_for_each(struct super_block *sb,
+                     void (*func)(struct dentry *, void *), void *arg)
+{
+	struct dcache_table *tables[2];
+	struct dcache_bucket *b;
+	struct dentry *d_i;
+
+	spin_lock(&sb->s_dcache_lock);
+	tables[0] = sb->s_dcache_old;
+	tables[1] = sb->s_dcache;
+	for (int t = 0; t < 2; t++) {
+		if (!tables[t])
+			continue;
+		for (int i = 0; i < tables[t]->nr_buckets; i++) {
+			b = &tables[t]->buckets[i];
+			spin_lock(&b->lock);
+			BSD_LIST_FOREACH(d_i, &b->chain, d_hash)
+				func(d_i, arg);
+			spin_unlock(&b->lock);
+		}
+	}
+	spin_unlock(&sb->s_dcache_lock);
+}
+
 /* Inode Functions */
 
 /* Creates and initializes a new inode.  Generic fields are filled in.
@@ -982,6 +1409,8 @@ struct inode *get_inode(struct dentry *dentry)
 	inode->dirtied_when = 0;
 	inode->i_flags = 0;
 	atomic_set(&inode->i_writecount, 0);
+	inode->i_gen = 0;
+	inode->i_elf = 0;
 	/* Set up the page_map structures.  Default is to use the embedded one.
 	 * Might push some of this back into specific FSs.  For now, the FS tells us
 	 * what pm_op they want via i_pm.pm_op, which we set again in pm_init() */
@@ -1129,11 +1558,37 @@ void inode_release(struct kref *kref)
 	/* Either way, we dealloc the in-memory version */
 	inode->i_sb->s_op->dealloc_inode(inode);	/* FS-specific clean-up */
 	kref_put(&inode->i_sb->s_kref);
+	elf_cache_free(inode);
 	/* TODO: clean this up */
 	assert(inode->i_mapping == &inode->i_pm);
 	kmem_cache_free(inode_kcache, inode);
 }
 
+/* The page cache shrinker: evicts clean, cold pages from the inodes' page
+ * caches, stopping once we've gotten nr_wanted of them.  Each PM gives up its
+ * least recently used pages.  Returns the number evicted. */
+unsigned long vfs_evict_clean_pages(unsigned long nr_wanted)
+{
+	struct super_block *sb;
+	struct inode *inode;
+	unsigned long nr_evicted = 0;
+
+	spin_lock(&super_blocks_lock);
+	TAILQ_FOREACH(sb, &super_blocks, s_list) {
+		TAILQ_FOREACH(inode, &sb->s_inodes, i_sb_list) {
+			if (!inode->i_mapping->pm_num_pages)
+				continue;
+			nr_evicted += pm_shrink(inode->i_mapping,
+			                        nr_wanted - nr_evicted);
+			if (nr_evicted >= nr_wanted)
+				goto out;
+		}
+	}
+out:
+	spin_unlock(&super_blocks_lock);
+	return nr_evicted;
+}
+
 /* Fills in kstat with the stat information for the inode */
 void stat_inode(struct inode *inode, struct kstat *kstat)
 {
@@ -1244,6 +1699,10 @@ ssize_t generic_file_read(struct file *file, char *buf, size_t count,
 	first_idx = orig_off >> PGSHIFT;
 	last_idx = (orig_off + count) >> PGSHIFT;
 	buf_end = buf + count;
+	/* Get the pages after this read coming, if we're reading sequentially */
+	pm_readahead_seq(file->f_mapping, &file->f_ra, first_idx, last_idx,
+	                 nr_pages(file->f_dentry->d_inode->i_size),
+	                 &file->f_kref);
 	/* For each file page, make sure it's in the page cache, then copy it out.
 	 * TODO: will probably need to consider concurrently truncated files here.*/
 	for (int i = first_idx; i <= last_idx; i++) {
@@ -1268,51 +1727,101 @@ ssize_t generic_file_read(struct file *file, char *buf, size_t count,
 	return count;
 }
 
-/* Write count bytes from buf to the file, starting at *offset, which is
- * increased accordingly, returning the number of bytes transfered.  Most
- * filesystems will use this function for their f_op->write.  Note, this uses
- * the page cache.
- *
- * Changes don't get flushed to disc til there is an fsync, page cache eviction,
- * or other means of trying to writeback the pages. */
-ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
-                           off64_t *offset)
+/* Builds a block out of up to count bytes of the file, starting at *offset,
+ * which is increased accordingly, and returns the number of bytes in it.  The
+ * block's extra data points at the file's page cache pages, with a page ref on
+ * each, instead of copying.  Pages can leave the page cache while a block holds
+ * them; they just won't see later writes.  Returns 0 at EOF, with no block, or
+ * -1 on error. */
+ssize_t generic_file_block(struct file *file, size_t count, off64_t *offset,
+                           struct block **bp)
 {
+	struct block *b;
 	struct page *page;
 	int error;
 	off64_t page_off;
 	unsigned long first_idx, last_idx;
-	size_t copy_amt;
-	const char *buf_end;
+	size_t amt;
 	off64_t orig_off = ACCESS_ONCE(*offset);
+	off64_t size = file->f_dentry->d_inode->i_size;
 
-	/* Consider pushing some error checking higher in the VFS */
-	if (!count)
-		return 0;
-	if (!(file->f_flags & O_WRITE)) {
+	if (!(file->f_flags & O_READ)) {
 		set_errno(EBADF);
+		return -1;
+	}
+	if (!count || orig_off >= size)
 		return 0;
+	count = MIN(count, size - orig_off);
+	page_off = orig_off & (PGSIZE - 1);
+	first_idx = orig_off >> PGSHIFT;
+	last_idx = (orig_off + count - 1) >> PGSHIFT;
+	pm_readahead_seq(file->f_mapping, &file->f_ra, first_idx, last_idx,
+	                 nr_pages(size), &file->f_kref);
+	b = block_alloc(0, MEM_WAIT);
+	block_add_extd(b, last_idx - first_idx + 1, MEM_WAIT);
+	for (unsigned long i = first_idx; i <= last_idx; i++) {
+		error = pm_load_page(file->f_mapping, i, &page);
+		if (error) {
+			freeb(b);
+			set_errno(-error);
+			return -1;
+		}
+		/* trade the PM slot ref for a page ref, which the block keeps */
+		page_incref(page);
+		pm_put_page(page);
+		amt = MIN(PGSIZE - page_off, count - BLEN(b));
+		block_append_page(b, page, page_off, amt, MEM_WAIT);
+		page_off = 0;
 	}
+	assert(BLEN(b) == count);
+	*offset = orig_off + count;
+	*bp = b;
+	return count;
+}
+
+/* Makes sure the file covers count bytes at *offset.  For O_APPEND, this
+ * atomically reserves them at the end of the file and points *offset at them
+ * instead. */
+static void file_write_reserve(struct file *file, size_t count,
+                               off64_t *offset)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+
 	if (file->f_flags & O_APPEND) {
-		spin_lock(&file->f_dentry->d_inode->i_lock);
-		orig_off = file->f_dentry->d_inode->i_size;
+		spin_lock(&inode->i_lock);
+		*offset = inode->i_size;
 		/* setting the filesize here, instead of during the extend-check, since
 		 * we need to atomically reserve space and set our write position. */
-		file->f_dentry->d_inode->i_size += count;
-		spin_unlock(&file->f_dentry->d_inode->i_lock);
+		inode->i_size += count;
+		spin_unlock(&inode->i_lock);
 	} else {
-		if (orig_off + count > file->f_dentry->d_inode->i_size) {
+		if (*offset + count > inode->i_size) {
 			/* lock for writes to i_size.  we allow lockless reads.  recheck
 			 * i_size in case of concurrent writers since our orig check.  */
-			spin_lock(&file->f_dentry->d_inode->i_lock);
-			if (orig_off + count > file->f_dentry->d_inode->i_size)
-				file->f_dentry->d_inode->i_size = orig_off + count;
-			spin_unlock(&file->f_dentry->d_inode->i_lock);
+			spin_lock(&inode->i_lock);
+			if (*offset + count > inode->i_size)
+				inode->i_size = *offset + count;
+			spin_unlock(&inode->i_lock);
 		}
 	}
-	page_off = orig_off & (PGSIZE - 1);
-	first_idx = orig_off >> PGSHIFT;
-	last_idx = (orig_off + count) >> PGSHIFT;
+}
+
+/* Copies count bytes from buf into the file's page cache pages, starting at
+ * offset, which file_write_reserve() already covered. */
+static void file_write_pages(struct file *file, const char *buf, size_t count,
+                             off64_t offset)
+{
+	struct page *page;
+	int error;
+	off64_t page_off;
+	unsigned long first_idx, last_idx;
+	size_t copy_amt;
+	const char *buf_end;
+
+	__sync_fetch_and_add(&file->f_dentry->d_inode->i_gen, 1);
+	page_off = offset & (PGSIZE - 1);
+	first_idx = offset >> PGSHIFT;
+	last_idx = (offset + count) >> PGSHIFT;
 	buf_end = buf + count;
 	/* For each file page, make sure it's in the page cache, then write it.*/
 	for (int i = first_idx; i <= last_idx; i++) {
@@ -1326,14 +1835,93 @@ ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
 			memcpy(page2kva(page) + page_off, buf, copy_amt);
 		buf += copy_amt;
 		page_off = 0;
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		/* Buffer pages go to their device's writeback */
+		if (atomic_read(&page->pg_flags) & PG_BUFFER)
+			bdev_dirty_page(page);
+		else
+			atomic_or(&page->pg_flags, PG_DIRTY);
 		pm_put_page(page);	/* it's still in the cache, we just don't need it */
 	}
 	assert(buf == buf_end);
+}
+
+/* Write count bytes from buf to the file, starting at *offset, which is
+ * increased accordingly, returning the number of bytes transfered.  Most
+ * filesystems will use this function for their f_op->write.  Note, this uses
+ * the page cache.
+ *
+ * Changes don't get flushed to disc til there is an fsync, page cache eviction,
+ * or other means of trying to writeback the pages. */
+ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
+                           off64_t *offset)
+{
+	off64_t orig_off = ACCESS_ONCE(*offset);
+
+	/* Consider pushing some error checking higher in the VFS */
+	if (!count)
+		return 0;
+	if (!(file->f_flags & O_WRITE)) {
+		set_errno(EBADF);
+		return 0;
+	}
+	file_write_reserve(file, count, &orig_off);
+	file_write_pages(file, buf, count, orig_off);
 	*offset = orig_off + count;
 	return count;
 }
 
+/* Like generic_file_read(), but scatters into each of the iovcnt buffers in
+ * turn, stopping early at EOF.  Most filesystems will use this for their
+ * f_op->readv. */
+ssize_t generic_file_readv(struct file *file, const struct iovec *iov,
+                           unsigned long iovcnt, off64_t *offset)
+{
+	off64_t off = ACCESS_ONCE(*offset);
+	ssize_t ret, total = 0;
+
+	if (!(file->f_flags & O_READ)) {
+		set_errno(EBADF);
+		return -1;
+	}
+	for (unsigned long i = 0; i < iovcnt; i++) {
+		ret = generic_file_read(file, iov[i].iov_base, iov[i].iov_len, &off);
+		total += ret;
+		if (ret < iov[i].iov_len)
+			break;
+	}
+	*offset = off;
+	return total;
+}
+
+/* Like generic_file_write(), but gathers from each of the iovcnt buffers.  The
+ * whole write gets one reservation, so an O_APPEND writev lands in one piece,
+ * like a single write would.  Most filesystems will use this for their
+ * f_op->writev. */
+ssize_t generic_file_writev(struct file *file, const struct iovec *iov,
+                            unsigned long iovcnt, off64_t *offset)
+{
+	off64_t off = ACCESS_ONCE(*offset);
+	size_t total = 0;
+
+	if (!(file->f_flags & O_WRITE)) {
+		set_errno(EBADF);
+		return -1;
+	}
+	for (unsigned long i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (!total)
+		return 0;
+	file_write_reserve(file, total, &off);
+	for (unsigned long i = 0; i < iovcnt; i++) {
+		if (!iov[i].iov_len)
+			continue;
+		file_write_pages(file, iov[i].iov_base, iov[i].iov_len, off);
+		off += iov[i].iov_len;
+	}
+	*offset = off;
+	return total;
+}
+
 /* Directories usually use this for their read method, which is the way glibc
  * currently expects us to do a readdir (short of doing linux's getdents).  Will
  * probably need work, based on whatever real programs want. */
@@ -1474,6 +2062,8 @@ open_the_file:
 		spin_lock(&file_d->d_inode->i_lock);
 		nr_pages = ROUNDUP(file_d->d_inode->i_size, PGSIZE) >> PGSHIFT;
 		file_d->d_inode->i_size = 0;
+		__sync_fetch_and_add(&file_d->d_inode->i_gen, 1);
+		file_d->d_inode->i_op->truncate(file_d->d_inode);
 		spin_unlock(&file_d->d_inode->i_lock);
 		pm_remove_contig(file_d->d_inode->i_mapping, 0, nr_pages);
 	}
@@ -2227,6 +2817,7 @@ int do_truncate(struct inode *inode, off64_t len)
 		return 0;
 	}
 	inode->i_size = len;
+	__sync_fetch_and_add(&inode->i_gen, 1);
 	/* truncate can't block, since we're holding the spinlock.  but it can rely
 	 * on that lock being held */
 	inode->i_op->truncate(inode);
@@ -2253,6 +2844,7 @@ struct file *alloc_file(void)
 	}
 	/* one for the ref passed out*/
 	kref_init(&file->f_kref, file_release, 1);
+	memset(&file->f_ra, 0, sizeof(struct pm_ra_state));
 	return file;
 }
 
@@ -2299,6 +2891,11 @@ error_access:
 /* Closes a file, fsync, whatever else is necessary.  Called when the kref hits
  * 0.  Note that the file is not refcounted on the s_files list, nor is the
  * f_mapping refcounted (it is pinned by the i_mapping). */
+static void __file_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(file_kcache, container_of(head, struct file, f_rcu));
+}
+
 void file_release(struct kref *kref)
 {
 	struct file *file = container_of(kref, struct file, f_kref);
@@ -2314,7 +2911,7 @@ void file_release(struct kref *kref)
 	/* Clean up the other refs we hold */
 	kref_put(&file->f_dentry->d_kref);
 	kref_put(&file->f_vfsmnt->mnt_kref);
-	kmem_cache_free(file_kcache, file);
+	call_rcu(&file->f_rcu, __file_free_rcu);
 }
 
 ssize_t kread_file(struct file *file, void *buf, size_t sz)
@@ -2355,40 +2952,85 @@ void *kread_whole_file(struct file *file)
 
 /* Process-related File management functions */
 
+/* Grown fd arrays, so the old ones can be freed after the lockless readers are
+ * done with them.  The fd_table points at fds. */
+struct fd_array_rcu {
+	struct rcu_head				rcu;
+	struct file_desc			fds[];
+};
+
+static void fd_array_free(struct file_desc *fds)
+{
+	kfree_rcu(container_of(fds, struct fd_array_rcu, fds), rcu);
+}
+
+/* Returns fd's file or chan, without a ref.  Hold rcu_read_lock().
+ *
+ * The slots are 0 unless the FD is open, so we don't need the bitmap.  Files
+ * are freed after a grace period, and chans are never freed (they go back on
+ * chanalloc's list), so whatever we find is safe to look at until we unlock.
+ * Until we have a ref, it might be getting closed or even reused. */
+static void *__lookup_fd(struct fd_table *fdt, int fd, bool vfs)
+{
+	struct file_desc *fds;
+
+	if (ACCESS_ONCE(fdt->closed))
+		return 0;
+	if (fd >= ACCESS_ONCE(fdt->max_files))
+		return 0;
+	/* pairs with the wmb in grow_fd_set(): fd is at least max_files long */
+	rmb();
+	fds = rcu_dereference(fdt->fd);
+	if (vfs)
+		return ACCESS_ONCE(fds[fd].fd_file);
+	return ACCESS_ONCE(fds[fd].fd_chan);
+}
+
+static bool __lookup_fd_get_ref(void *obj, bool vfs)
+{
+	if (vfs)
+		return kref_get_not_zero(&((struct file*)obj)->f_kref, 1) != 0;
+	return kref_get_not_zero(&((struct chan*)obj)->ref, 1) != 0;
+}
+
 /* Given any FD, get the appropriate object, 0 o/w.  Set vfs if you're looking
  * for a file, o/w a chan.  Set incref if you want a reference count (which is a
- * 9ns thing, you can't use the pointer if you didn't incref). */
+ * 9ns thing, you can't use the pointer if you didn't incref).
+ *
+ * This doesn't lock the fd_table.  Once we have a ref, we check that the object
+ * is still at fd.  If it isn't, then the FD was closed while we were getting
+ * the ref, and the object might have been reused, so we try again. */
 void *lookup_fd(struct fd_table *fdt, int fd, bool incref, bool vfs)
 {
-	void *retval = 0;
+	void *retval;
+
 	if (fd < 0)
 		return 0;
-	spin_lock(&fdt->lock);
-	if (fdt->closed) {
-		spin_unlock(&fdt->lock);
-		return 0;
-	}
-	if (fd < fdt->max_fdset) {
-		if (GET_BITMASK_BIT(fdt->open_fds->fds_bits, fd)) {
-			/* while max_files and max_fdset might not line up, we should never
-			 * have a valid fdset higher than files */
-			assert(fd < fdt->max_files);
-			if (vfs)
-				retval = fdt->fd[fd].fd_file;
-			else
-				retval = fdt->fd[fd].fd_chan;
-			/* retval could be 0 if we asked for the wrong one (e.g. it's a
-			 * file, but we asked for a chan) */
-			if (retval && incref) {
-				if (vfs)
-					kref_get(&((struct file*)retval)->f_kref, 1);
-				else
-					chan_incref((struct chan*)retval);
-			}
+	while (1) {
+		rcu_read_lock();
+		/* retval could be 0 if we asked for the wrong one (e.g. it's a file,
+		 * but we asked for a chan) */
+		retval = __lookup_fd(fdt, fd, vfs);
+		if (!retval || !incref) {
+			rcu_read_unlock();
+			return retval;
+		}
+		/* A zero ref means it was closed, after it left the slot */
+		if (!__lookup_fd_get_ref(retval, vfs)) {
+			rcu_read_unlock();
+			return 0;
+		}
+		if (__lookup_fd(fdt, fd, vfs) == retval) {
+			rcu_read_unlock();
+			return retval;
 		}
+		rcu_read_unlock();
+		/* Need to decref/cclose outside RCU; they could sleep */
+		if (vfs)
+			kref_put(&((struct file*)retval)->f_kref);
+		else
+			cclose(retval);
 	}
-	spin_unlock(&fdt->lock);
-	return retval;
 }
 
 /* Given any FD, get the appropriate file, 0 o/w */
@@ -2401,6 +3043,7 @@ struct file *get_file_from_fd(struct fd_table *open_files, int file_desc)
 static int grow_fd_set(struct fd_table *open_files)
 {
 	int n;
+	struct fd_array_rcu *nfa;
 	struct file_desc *nfd, *ofd;
 
 	/* Only update open_fds once. If currently pointing to open_fds_init, then
@@ -2412,26 +3055,32 @@ static int grow_fd_set(struct fd_table *open_files)
 		        sizeof(struct small_fd_set));
 	}
 
-	/* Grow the open_files->fd array in increments of NR_OPEN_FILES_DEFAULT */
-	n = open_files->max_files + NR_OPEN_FILES_DEFAULT;
-	if (n > NR_FILE_DESC_MAX)
+	/* Double the open_files->fd array, so a process that opens a lot of FDs
+	 * only copies them a few times. */
+	if (open_files->max_files >= NR_FILE_DESC_MAX)
 		return -EMFILE;
-	nfd = kzmalloc(n * sizeof(struct file_desc), 0);
-	if (nfd == NULL)
+	n = MIN(open_files->max_files * 2, NR_FILE_DESC_MAX);
+	nfa = kzmalloc(sizeof(struct fd_array_rcu) + n * sizeof(struct file_desc),
+	               0);
+	if (nfa == NULL)
 		return -ENOMEM;
+	nfd = nfa->fds;
 
-	/* Move the old array on top of the new one */
+	/* Copy the old array on top of the new one.  Lockless readers might still
+	 * be looking at the old one. */
 	ofd = open_files->fd;
 	memmove(nfd, ofd, open_files->max_files * sizeof(struct file_desc));
 
-	/* Update the array and the maxes for both max_files and max_fdset */
-	open_files->fd = nfd;
-	open_files->max_files = n;
+	/* Update the array and the maxes for both max_files and max_fdset.  The
+	 * array has to be out there before anyone sees the new max_files. */
+	rcu_assign_pointer(open_files->fd, nfd);
+	wmb();
+	ACCESS_ONCE(open_files->max_files) = n;
 	open_files->max_fdset = n;
 
 	/* Only free the old one if it wasn't pointing to open_files->fd_array */
 	if (ofd != open_files->fd_array)
-		kfree(ofd);
+		fd_array_free(ofd);
 	return 0;
 }
 
@@ -2451,9 +3100,13 @@ static void free_fd_set(struct fd_table *open_files)
 		open_files->open_fds = (struct fd_set*)&open_files->open_fds_init;
 		kfree(free_me);
 
-		free_me = open_files->fd;
-		open_files->fd = open_files->fd_array;
-		kfree(free_me);
+		/* Lockless readers could have read the old max_files, and would
+		 * overrun fd_array.  Instead, no one gets past the new max of 0, and
+		 * anyone who got past the old one has the old fd until a grace period
+		 * passes.  Nothing can grow it again, since fdt is closed. */
+		ACCESS_ONCE(open_files->max_files) = 0;
+		open_files->max_fdset = 0;
+		fd_array_free(open_files->fd);
 	}
 }
 
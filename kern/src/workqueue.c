@@ -0,0 +1,393 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Workqueues.  See workqueue.h for the design.
+ *
+ * Lock ordering: pool lock -> workqueue lock.  Workers and cancellers drop the
+ * workqueue's inflight count while holding the pool lock; queueing bumps it
+ * before taking the pool lock. */
+
+#include <workqueue.h>
+#include <kmalloc.h>
+#include <smp.h>
+#include <trap.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+static struct wq_pool *bound_pools;		/* one per core */
+static struct wq_pool unbound_pool;
+static struct workqueue_struct __system_wq;
+static struct workqueue_struct __system_unbound_wq;
+
+struct workqueue_struct *system_wq = &__system_wq;
+struct workqueue_struct *system_unbound_wq = &__system_unbound_wq;
+
+static void pool_init(struct wq_pool *pool, int coreid,
+                      unsigned int max_workers, char *name)
+{
+	memset(pool, 0, sizeof(struct wq_pool));
+	spinlock_init_irqsave(&pool->lock);
+	cv_init_irqsave_with_lock(&pool->work_cv, &pool->lock);
+	cv_init_irqsave_with_lock(&pool->done_cv, &pool->lock);
+	STAILQ_INIT(&pool->work);
+	BSD_LIST_INIT(&pool->busy);
+	pool->coreid = coreid;
+	pool->max_workers = max_workers;
+	pool->name = name;
+}
+
+static void wq_init(struct workqueue_struct *wq, const char *name, int flags)
+{
+	memset(wq, 0, sizeof(struct workqueue_struct));
+	strlcpy(wq->name, name, WQ_NAME_SZ);
+	wq->flags = flags;
+	spinlock_init_irqsave(&wq->lock);
+	cv_init_irqsave_with_lock(&wq->flush_cv, &wq->lock);
+	if (flags & WQ_ORDERED) {
+		wq->flags |= WQ_UNBOUND;
+		wq->ordered_pool = kmalloc(sizeof(struct wq_pool), MEM_WAIT);
+		pool_init(wq->ordered_pool, -1, 1, wq->name);
+	}
+}
+
+void workqueue_init(void)
+{
+	bound_pools = kmalloc(num_cores * sizeof(struct wq_pool), MEM_WAIT);
+	for (int i = 0; i < num_cores; i++)
+		pool_init(&bound_pools[i], i, WQ_MAX_BOUND_WORKERS, "wq_bound");
+	pool_init(&unbound_pool, -1, WQ_MAX_UNBOUND_WORKERS, "wq_unbound");
+	wq_init(&__system_wq, "system", 0);
+	wq_init(&__system_unbound_wq, "system_unbound", WQ_UNBOUND);
+}
+
+/* Called once the work that bumped nr_inflight is done or cancelled. */
+static void wq_work_done(struct workqueue_struct *wq)
+{
+	spin_lock_irqsave(&wq->lock);
+	if (!--wq->nr_inflight)
+		__cv_broadcast(&wq->flush_cv);
+	spin_unlock_irqsave(&wq->lock);
+}
+
+/* Hold the pool lock.  TRUE if work is on pool's list or being run by one of
+ * its workers. */
+static bool __work_busy(struct wq_pool *pool, struct work_struct *work)
+{
+	struct wq_worker *worker;
+
+	if (work->queued && (work->pool == pool))
+		return TRUE;
+	BSD_LIST_FOREACH(worker, &pool->busy, link) {
+		if (worker->cur == work)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* The body of every worker kthread.  Runs work until its pool dies, and sleeps
+ * when there is none. */
+static void wq_worker(void *arg)
+{
+	struct wq_pool *pool = (struct wq_pool*)arg;
+	struct wq_worker worker = {0};
+	struct work_struct *work;
+	struct workqueue_struct *wq;
+	int8_t irq_state = 0;
+
+	cv_lock_irqsave(&pool->work_cv, &irq_state);
+	while (1) {
+		while (!(work = STAILQ_FIRST(&pool->work))) {
+			if (pool->dying) {
+				pool->nr_workers--;
+				__cv_broadcast(&pool->done_cv);
+				cv_unlock_irqsave(&pool->work_cv, &irq_state);
+				return;
+			}
+			/* Whoever wakes us decrements nr_idle */
+			pool->nr_idle++;
+			cv_wait(&pool->work_cv);
+		}
+		STAILQ_REMOVE_HEAD(&pool->work, link);
+		work->queued = FALSE;
+		/* Clearing pending before running lets the work requeue itself */
+		wq = work->wq;
+		ACCESS_ONCE(work->pending) = 0;
+		worker.cur = work;
+		BSD_LIST_INSERT_HEAD(&pool->busy, &worker, link);
+		cv_unlock_irqsave(&pool->work_cv, &irq_state);
+		work->func(work);
+		cv_lock_irqsave(&pool->work_cv, &irq_state);
+		BSD_LIST_REMOVE(&worker, link);
+		worker.cur = 0;
+		__cv_broadcast(&pool->done_cv);
+		wq_work_done(wq);
+	}
+}
+
+static void __wq_start_worker(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct wq_pool *pool = (struct wq_pool*)a0;
+
+	ktask(pool->name, wq_worker, pool);
+}
+
+static void __wq_wake_worker(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct wq_pool *pool = (struct wq_pool*)a0;
+	int8_t irq_state = 0;
+
+	cv_signal_irqsave(&pool->work_cv, &irq_state);
+}
+
+/* Wakes or starts a worker for pool.  Bound pools do this from their own
+ * core, since kthreads restart on the core that woke them. */
+static void pool_kick(struct wq_pool *pool, bool spawn)
+{
+	int8_t irq_state = 0;
+	int coreid = pool->coreid < 0 ? core_id() : pool->coreid;
+
+	if (spawn) {
+		send_kernel_message(coreid, __wq_start_worker, (long)pool, 0, 0,
+		                    KMSG_ROUTINE);
+	} else if (coreid == core_id()) {
+		cv_signal_irqsave(&pool->work_cv, &irq_state);
+	} else {
+		send_kernel_message(coreid, __wq_wake_worker, (long)pool, 0, 0,
+		                    KMSG_ROUTINE);
+	}
+}
+
+static struct wq_pool *pick_pool(struct workqueue_struct *wq, int coreid)
+{
+	if (wq->ordered_pool)
+		return wq->ordered_pool;
+	if (wq->flags & WQ_UNBOUND)
+		return &unbound_pool;
+	assert((coreid >= 0) && (coreid < num_cores));
+	return &bound_pools[coreid];
+}
+
+/* Puts work, which our caller marked pending, on one of wq's pools. */
+static void __queue_work(int coreid, struct workqueue_struct *wq,
+                         struct work_struct *work)
+{
+	struct wq_pool *pool = pick_pool(wq, coreid);
+	bool kick = FALSE, spawn = FALSE;
+
+	spin_lock_irqsave(&wq->lock);
+	wq->nr_inflight++;
+	spin_unlock_irqsave(&wq->lock);
+	spin_lock_irqsave(&pool->lock);
+	assert(!work->queued);
+	work->wq = wq;
+	work->pool = pool;
+	work->queued = TRUE;
+	STAILQ_INSERT_TAIL(&pool->work, work, link);
+	if (pool->nr_idle) {
+		pool->nr_idle--;
+		kick = TRUE;
+	} else if (pool->nr_workers < pool->max_workers) {
+		pool->nr_workers++;
+		kick = spawn = TRUE;
+	}
+	spin_unlock_irqsave(&pool->lock);
+	if (kick)
+		pool_kick(pool, spawn);
+}
+
+bool queue_work_on(int coreid, struct workqueue_struct *wq,
+                   struct work_struct *work)
+{
+	if (!atomic_cas_u32(&work->pending, 0, 1))
+		return FALSE;
+	__queue_work(coreid, wq, work);
+	return TRUE;
+}
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	return queue_work_on(core_id(), wq, work);
+}
+
+bool schedule_work(struct work_struct *work)
+{
+	return queue_work(system_wq, work);
+}
+
+/* Waits for work to finish, if it is queued or running.  Returns TRUE if we
+ * waited. */
+bool flush_work(struct work_struct *work)
+{
+	struct wq_pool *pool = ACCESS_ONCE(work->pool);
+	int8_t irq_state = 0;
+	bool ret = FALSE;
+
+	if (!pool)
+		return FALSE;
+	cv_lock_irqsave(&pool->done_cv, &irq_state);
+	while (__work_busy(pool, work)) {
+		ret = TRUE;
+		cv_wait(&pool->done_cv);
+	}
+	cv_unlock_irqsave(&pool->done_cv, &irq_state);
+	return ret;
+}
+
+/* Takes work off its queue, if it is still queued.  Returns TRUE if it was. */
+bool cancel_work(struct work_struct *work)
+{
+	struct wq_pool *pool;
+	struct workqueue_struct *wq = 0;
+
+	while ((pool = ACCESS_ONCE(work->pool))) {
+		spin_lock_irqsave(&pool->lock);
+		if (work->pool != pool) {
+			/* requeued elsewhere while we were locking */
+			spin_unlock_irqsave(&pool->lock);
+			continue;
+		}
+		if (work->queued) {
+			STAILQ_REMOVE(&pool->work, work, work_struct, link);
+			work->queued = FALSE;
+			wq = work->wq;
+			ACCESS_ONCE(work->pending) = 0;
+			__cv_broadcast(&pool->done_cv);
+		}
+		spin_unlock_irqsave(&pool->lock);
+		break;
+	}
+	if (!wq)
+		return FALSE;
+	wq_work_done(wq);
+	return TRUE;
+}
+
+/* Like cancel_work(), but also waits for it to finish if it is running. */
+bool cancel_work_sync(struct work_struct *work)
+{
+	bool ret = cancel_work(work);
+
+	flush_work(work);
+	return ret;
+}
+
+static void __dwork_fire(struct alarm_waiter *waiter,
+                         struct hw_trapframe *hw_tf)
+{
+	struct delayed_work *dwork = container_of(waiter, struct delayed_work,
+	                                          alarm);
+
+	__queue_work(dwork->coreid, dwork->wq, &dwork->work);
+}
+
+/* Queues dwork after delay ticks.  The alarm is on the calling core. */
+bool queue_delayed_work_on(int coreid, struct workqueue_struct *wq,
+                           struct delayed_work *dwork, unsigned long delay)
+{
+	if (!atomic_cas_u32(&dwork->work.pending, 0, 1))
+		return FALSE;
+	if (!delay) {
+		__queue_work(coreid, wq, &dwork->work);
+		return TRUE;
+	}
+	dwork->wq = wq;
+	dwork->coreid = coreid;
+	dwork->tchain = &per_cpu_info[core_id()].tchain;
+	init_awaiter_irq(&dwork->alarm, __dwork_fire);
+	set_awaiter_rel(&dwork->alarm, delay * WQ_USEC_PER_TICK);
+	set_alarm(dwork->tchain, &dwork->alarm);
+	return TRUE;
+}
+
+bool queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
+                        unsigned long delay)
+{
+	return queue_delayed_work_on(core_id(), wq, dwork, delay);
+}
+
+bool schedule_delayed_work(struct delayed_work *dwork, unsigned long delay)
+{
+	return queue_delayed_work(system_wq, dwork, delay);
+}
+
+/* IRQ alarms run with the tchain lock held, so once unset_alarm() returns, the
+ * alarm either never fired or already queued the work. */
+static bool disarm_dwork(struct delayed_work *dwork)
+{
+	return dwork->tchain && unset_alarm(dwork->tchain, &dwork->alarm);
+}
+
+/* Runs dwork now if it is waiting on its alarm, then waits for it. */
+bool flush_delayed_work(struct delayed_work *dwork)
+{
+	if (disarm_dwork(dwork))
+		__queue_work(dwork->coreid, dwork->wq, &dwork->work);
+	return flush_work(&dwork->work);
+}
+
+bool cancel_delayed_work(struct delayed_work *dwork)
+{
+	if (disarm_dwork(dwork)) {
+		ACCESS_ONCE(dwork->work.pending) = 0;
+		return TRUE;
+	}
+	return cancel_work(&dwork->work);
+}
+
+bool cancel_delayed_work_sync(struct delayed_work *dwork)
+{
+	bool ret = cancel_delayed_work(dwork);
+
+	flush_work(&dwork->work);
+	return ret;
+}
+
+struct workqueue_struct *alloc_workqueue(const char *name, int flags,
+                                         int max_active)
+{
+	struct workqueue_struct *wq;
+
+	wq = kmalloc(sizeof(struct workqueue_struct), MEM_WAIT);
+	wq_init(wq, name, flags);
+	return wq;
+}
+
+struct workqueue_struct *create_singlethread_workqueue(char *name)
+{
+	return alloc_workqueue(name, WQ_ORDERED, 1);
+}
+
+/* Waits until wq has no queued or running work.  Delayed work that is still on
+ * its alarm doesn't count. */
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	int8_t irq_state = 0;
+
+	cv_lock_irqsave(&wq->flush_cv, &irq_state);
+	while (wq->nr_inflight)
+		cv_wait(&wq->flush_cv);
+	cv_unlock_irqsave(&wq->flush_cv, &irq_state);
+}
+
+/* Flushes wq and frees it.  The caller needs to have cancelled any of its
+ * delayed work. */
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	struct wq_pool *pool = wq->ordered_pool;
+	int8_t irq_state = 0;
+
+	assert((wq != system_wq) && (wq != system_unbound_wq));
+	flush_workqueue(wq);
+	if (pool) {
+		cv_lock_irqsave(&pool->done_cv, &irq_state);
+		pool->dying = TRUE;
+		pool->nr_idle = 0;
+		__cv_broadcast(&pool->work_cv);
+		while (pool->nr_workers)
+			cv_wait(&pool->done_cv);
+		cv_unlock_irqsave(&pool->done_cv, &irq_state);
+		kfree(pool);
+	}
+	kfree(wq);
+}
@@ -11,14 +11,23 @@
 # we repeat the creation of the ksyms and relink.  For more info, check out
 # Linux's kallsyms, their build script, and
 # http://stackoverflow.com/questions/11254891/can-a-running-c-program-access-its-own-symbol-table
+#
+# nm -n sorts the symbols by address.  Next to gbl_symtab, we emit just the
+# addresses, in the same order, so the kernel can binary search them without
+# pulling the names into the cache.
 
 gen_symtab_obj()
 {
 	$NM -n $KERNEL_OBJECT > $KSYM_MAP
 	awk 'BEGIN{ print "#include <kdebug.h>";
 	            print "struct symtab_entry gbl_symtab[]={" }
-	     { if(NF==3){print "{\"" $3 "\", 0x" $1 "},"}}
-	     END{print "{0,0} };"}' $KSYM_MAP > $KSYM_C
+	     { if(NF==3){print "{\"" $3 "\", 0x" $1 "},"; addrs[nr++] = $1}}
+	     END{print "{0,0} };";
+	         print "uintptr_t gbl_symtab_addrs[]={";
+	         for (i = 0; i < nr; i++)
+	             print "0x" addrs[i] ",";
+	         print "0 };";
+	         print "size_t gbl_symtab_nr = " nr + 0 ";"}' $KSYM_MAP > $KSYM_C
 	$CC $NOSTDINC_FLAGS $AKAROSINCLUDE $CFLAGS_KERNEL -o $KSYM_O -c $KSYM_C
 }
 
@@ -36,6 +36,7 @@
 
 #include <parlib/tsc-compat.h>
 #include <benchutil/measure.h>
+#include <benchutil/hdr_hist.h>
 
 #else
 
@@ -45,6 +46,8 @@
 
 #include "../user/benchutil/include/benchutil/measure.h"
 #include "../user/benchutil/measure.c"
+#include "../user/benchutil/include/benchutil/hdr_hist.h"
+#include "../user/benchutil/hdr_hist.c"
 
 static void os_prep_work(pthread_t *worker_threads, int nr_threads)
 {
@@ -465,6 +468,7 @@ static struct argp_option options[] = {
 	                                             "\tmcspdr\n"
 	                                             "\tmcspdro\n"
 	                                             "\t__mcspdro\n"
+	                                             "\tmcscohort\n"
 	                                             "\tspin\n"
 	                                             "\tspinpdr"},
 	{0, 0, 0, 0, "Other options (not mandatory):"},
@@ -500,7 +504,10 @@ struct time_stamp {
 	uint64_t un;
 	bool valid;
 };
+/* Only kept for the throughput printout and the outfile */
 struct time_stamp **times;
+/* Per thread, in TSC ticks */
+struct hdr_hist *acq_hists, *hld_hists;
 bool run_locktest = TRUE;
 pthread_barrier_t start_test;
 
@@ -547,13 +554,17 @@ void *lock_name##_thread(void *arg)                                            \
 		unlock_cmd                                                             \
                                                                                \
 		un_lock = read_tsc_serialized();                                       \
-		this_time = &times[thread_id][i];                                      \
-		this_time->pre = pre_lock;                                             \
-		this_time->acq = acq_lock;                                             \
-		this_time->un = un_lock;                                               \
-		/* Can turn these on or off to control which samples we gather */      \
-		this_time->valid = TRUE;                                               \
-		/* this_time->valid = (num_vcores() == max_vcores());  */              \
+		hdr_hist_record(&acq_hists[thread_id],                                 \
+		                acq_lock - pre_lock - get_tsc_overhead());             \
+		hdr_hist_record(&hld_hists[thread_id],                                 \
+		                un_lock - acq_lock - get_tsc_overhead());              \
+		if (times) {                                                           \
+			this_time = &times[thread_id][i];                                  \
+			this_time->pre = pre_lock;                                         \
+			this_time->acq = acq_lock;                                         \
+			this_time->un = un_lock;                                           \
+			this_time->valid = TRUE;                                           \
+		}                                                                      \
                                                                                \
 		if (delay_time)                                                        \
 			ndelay(delay_time);                                                \
@@ -607,6 +618,7 @@ lock_func(spin,
 struct spin_pdr_lock spdr_lock = SPINPDR_INITIALIZER;
 struct mcs_pdr_lock mcspdr_lock;
 struct mcs_pdro_lock mcspdro_lock = MCSPDRO_LOCK_INIT;
+struct mcs_cohort_lock mcscohort_lock;
 
 lock_func(mcspdr,
           mcs_pdr_lock(&mcspdr_lock);,
@@ -620,41 +632,21 @@ lock_func(__mcspdro,
 lock_func(spinpdr,
           spin_pdr_lock(&spdr_lock);,
           spin_pdr_unlock(&spdr_lock);)
+/* the qnode just needs to outlive the critical section */
+lock_func(mcscohort,
+          struct mcs_cohort_qnode cohort_qnode;
+          mcs_cohort_lock_notifsafe(&mcscohort_lock, &cohort_qnode);,
+          mcs_cohort_unlock_notifsafe(&mcscohort_lock, &cohort_qnode);)
 #else
 
 fake_lock_func(mcspdr, 0, 0);
 fake_lock_func(mcspdro, 0, 0);
 fake_lock_func(__mcspdro, 0, 0);
+fake_lock_func(mcscohort, 0, 0);
 fake_lock_func(spinpdr, 0, 0);
 
 #endif
 
-static int get_acq_latency(void **data, int i, int j, uint64_t *sample)
-{
-	struct time_stamp **times = (struct time_stamp**)data;
-	/* 0 for initial time means we didn't measure */
-	if (times[i][j].pre == 0)
-		return -1;
-	/* can optionally throw out invalid times (keep this in sync with the
-	 * lock_test macro, based on what you want to meaasure. */
-	#if 0
-	if (!times[i][j].valid)
-		return -1;
-	#endif
-	*sample = times[i][j].acq - times[i][j].pre - get_tsc_overhead();
-	return 0;
-}
-
-static int get_hld_latency(void **data, int i, int j, uint64_t *sample)
-{
-	struct time_stamp **times = (struct time_stamp**)data;
-	/* 0 for initial time means we didn't measure */
-	if (times[i][j].pre == 0)
-		return -1;
-	*sample = times[i][j].un - times[i][j].acq - get_tsc_overhead();
-	return 0;
-}
-
 static int get_acq_timestamp(void **data, int i, int j, uint64_t *sample)
 {
 	struct time_stamp **times = (struct time_stamp**)data;
@@ -827,6 +819,10 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 				pargs->lock_type = __mcspdro_thread;
 				break;
 			}
+			if (!strcmp("mcscohort", arg)) {
+				pargs->lock_type = mcscohort_thread;
+				break;
+			}
 			if (!strcmp("spin", arg)) {
 				pargs->lock_type = spin_thread;
 				break;
@@ -876,12 +872,15 @@ int main(int argc, char** argv)
 	uint64_t starttsc;
 	int nr_threads, nr_loops;
 	FILE *outfile;
-	struct sample_stats acq_stats, hld_stats;
+	struct hdr_hist *all_hist;
 
 	argp_parse(&argp, argc, argv, 0, 0, &pargs);
 	nr_threads = pargs.nr_threads;
 	nr_loops = pargs.nr_loops;
 	mcs_pdr_init(&mcspdr_lock);
+#ifdef __ros__
+	mcs_cohort_init(&mcscohort_lock);
+#endif
 
 	if (pargs.outfile_path) {
 		/* RDWR, CREAT, TRUNC, O666 */
@@ -907,18 +906,25 @@ int main(int argc, char** argv)
 	       pargs.fake_vc_ctx ? "" : "not ");
 	pthread_barrier_init(&start_test, NULL, nr_threads);
 
-	times = malloc(sizeof(struct time_stamp *) * nr_threads);
-	assert(times);
-	for (int i = 0; i < nr_threads; i++) {
-		times[i] = malloc(sizeof(struct time_stamp) * nr_loops);
-		if (!times[i]) {
-			perror("Record keeping malloc");
-			exit(-1);
+	acq_hists = hdr_hist_alloc(nr_threads);
+	hld_hists = hdr_hist_alloc(nr_threads);
+	assert(acq_hists && hld_hists);
+	/* The histograms are enough for the stats.  Only keep every sample if we
+	 * need the timeline. */
+	if (pargs.nr_print_rows || pargs.outfile_path) {
+		times = malloc(sizeof(struct time_stamp *) * nr_threads);
+		assert(times);
+		for (int i = 0; i < nr_threads; i++) {
+			times[i] = malloc(sizeof(struct time_stamp) * nr_loops);
+			if (!times[i]) {
+				perror("Record keeping malloc");
+				exit(-1);
+			}
+			memset(times[i], 0, sizeof(struct time_stamp) * nr_loops);
 		}
-		memset(times[i], 0, sizeof(struct time_stamp) * nr_loops);
+		printf("Record tracking takes %ld bytes of memory\n",
+		       nr_threads * nr_loops * sizeof(struct time_stamp));
 	}
-	printf("Record tracking takes %ld bytes of memory\n",
-	       nr_threads * nr_loops * sizeof(struct time_stamp));
 	os_prep_work(worker_threads, nr_threads);	/* ensure we have enough VCs */
 	/* Doing this in MCP ctx, so we might have been getting a few preempts
 	 * already.  Want to read start before the threads pass their barrier */
@@ -938,32 +944,44 @@ int main(int argc, char** argv)
 	if (gettimeofday(&end_tv, 0))
 		perror("End time error...");
 
+	for (int i = 0; i < nr_threads; i++) {
+		total_loops += (long)loops_done[i];
+		if (!loops_done[i])
+			printf("WARNING: thread %d performed 0 loops!\n", i);
+	}
+
+	all_hist = hdr_hist_alloc(1);
+	assert(all_hist);
 	printf("Acquire times (TSC Ticks)\n---------------------------\n");
-	acq_stats.get_sample = get_acq_latency;
-	compute_stats((void**)times, nr_threads, nr_loops, &acq_stats);
+	hdr_hist_merge_all(all_hist, acq_hists, nr_threads);
+	hdr_hist_print(all_hist, "ticks");
+	printf("\n");
 
 	printf("Held times (from acq til rel done) (TSC Ticks)\n------\n");
-	hld_stats.get_sample = get_hld_latency;
-	compute_stats((void**)times, nr_threads, nr_loops, &hld_stats);
+	hdr_hist_init(all_hist);
+	hdr_hist_merge_all(all_hist, hld_hists, nr_threads);
+	hdr_hist_print(all_hist, "ticks");
+	printf("\n");
+	free(all_hist);
 
 	usec_diff = (end_tv.tv_sec - start_tv.tv_sec) * 1000000 +
 	            (end_tv.tv_usec - start_tv.tv_usec);
 	printf("Time to run: %ld usec\n", usec_diff);
 
 	printf("\nLock throughput:\n-----------------\n");
-	/* throughput for the entire duration (in ms), 1ms steps.  print as many
-	 * steps as they ask for (up to the end of the run). */
-	print_throughput((void**)times, usec_diff / 1000 + 1, msec2tsc(1),
-	                 pargs.nr_print_rows,
-	                 starttsc, nr_threads,
-	                 nr_loops, get_acq_timestamp);
+	if (times) {
+		/* throughput for the entire duration (in ms), 1ms steps.  print as
+		 * many steps as they ask for (up to the end of the run). */
+		print_throughput((void**)times, usec_diff / 1000 + 1, msec2tsc(1),
+		                 pargs.nr_print_rows,
+		                 starttsc, nr_threads,
+		                 nr_loops, get_acq_timestamp);
+	} else {
+		printf("Average throughput: %ld acquires per msec\n",
+		       total_loops * 1000 / MAX(usec_diff, 1));
+	}
 	print_preempt_trace(starttsc, pargs.nr_print_rows);
 
-	for (int i = 0; i < nr_threads; i++) {
-		total_loops += (long)loops_done[i];
-		if (!loops_done[i])
-			printf("WARNING: thread %d performed 0 loops!\n", i);
-	}
 	printf("Average number of loops done, per thread: %ld\n",
 	       total_loops / nr_threads);
 	for (int i = 0; i < nr_threads; i++)
@@ -16,7 +16,8 @@
  *
  * This macro will run your test and print the results.  Pick a loop amount that
  * is reasonable for your operation.  You can also use test_time_us() for longer
- * operations.
+ * operations.  The loops are run in batches, and besides the average, we print
+ * the median, p99 and max per-iteration cost across the batches.
  *
  * Notes:
  * - I went with this style so you could do some prep work before and after the
@@ -40,11 +41,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <assert.h>
 
 /* OS dependent #incs */
 #include <parlib/parlib.h>
 #include <parlib/vcore.h>
 #include <parlib/timing.h>
+#include <parlib/tsc-compat.h>
+#include <benchutil/hdr_hist.h>
 
 static uint32_t __get_pcoreid(void)
 {
@@ -99,23 +103,42 @@ void loop_overhead(unsigned long nr_loops)
 	(__test_time_us((func), (loops)) * 1000);                                  \
 })
 
+#define NR_BATCHES 100
+
+/* Runs func(loops) in NR_BATCHES batches, subtracts the loop overhead, and
+ * prints the cost per iteration, in units of div nsec. */
+static void __test_time_batches(const char *name, void (*func)(unsigned long),
+                                unsigned long loops,
+                                unsigned long long nsec_per_loop,
+                                unsigned long div, const char *unit)
+{
+	struct hdr_hist *hist = hdr_hist_alloc(1);
+	unsigned long batch = MAX(loops / NR_BATCHES, 1);
+	uint64_t start, nsec, total = 0;
+
+	assert(hist);
+	for (unsigned long done = 0; done < loops; done += batch) {
+		start = read_tsc();
+		func(batch);
+		nsec = tsc2nsec(read_tsc() - start);
+		nsec -= MIN(nsec, nsec_per_loop * batch);
+		total += nsec;
+		hdr_hist_record(hist, nsec / batch);
+	}
+	printf("\"%s\" total: %llu%s, per iteration: %llu%s "
+	       "(med %llu, p99 %llu, max %llu)\n", name, total / div, unit,
+	       total / loops / div, unit, hdr_hist_percentile(hist, 50) / div,
+	       hdr_hist_percentile(hist, 99) / div, hist->max / div);
+	free(hist);
+}
+
 /* Runs func(loops), subtracts the loop overhead, and prints the result */
 #define test_time_us(func, loops)                                              \
-({                                                                             \
-	unsigned long long usec_diff;                                              \
-	usec_diff = __test_time_us((func), (loops)) - nsec_per_loop * loops / 1000;\
-	printf("\"%s\" total: %lluus, per iteration: %lluus\n", #func, usec_diff,  \
-	       usec_diff / (loops));                                               \
-})
+	__test_time_batches(#func, (func), (loops), nsec_per_loop, 1000, "us")
 
 /* Runs func(loops), subtracts the loop overhead, and prints the result */
 #define test_time_ns(func, loops)                                              \
-({                                                                             \
-	unsigned long long nsec_diff;                                              \
-	nsec_diff = __test_time_ns((func), (loops)) - nsec_per_loop * (loops);     \
-	printf("\"%s\" total: %lluns, per iteration: %lluns\n", #func, nsec_diff,  \
-	       nsec_diff / (loops));                                               \
-})
+	__test_time_batches(#func, (func), (loops), nsec_per_loop, 1, "ns")
 
 static void microb_test(void)
 {
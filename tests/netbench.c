@@ -0,0 +1,662 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * netbench: netperf-style network benchmarks.  Run a server on one machine:
+ *
+ * 		netbench -s
+ *
+ * and a client on another:
+ *
+ * 		netbench -H HOST -t TEST [-l SECS] [-m BYTES] [-r BYTES] [-w N] [-v N]
+ *
+ * Tests:
+ * - stream: each worker writes -m byte messages down a TCP connection.  Both
+ *   sides print the rate they saw.
+ * - rr: each worker sends a -m byte request and waits for a -r byte response,
+ *   over one TCP connection.  Prints the rate and the latency histogram and
+ *   percentiles.
+ * - crr: like rr, but with a new connection for every transaction, which
+ *   measures connection setup and teardown.
+ * - udp: each worker sends -m byte datagrams as fast as it can.  The server
+ *   counts what arrives, and the client prints both rates.
+ *
+ * By default we use the #ip file API (iplib's dial9 and friends).  -b uses the
+ * BSD socket shim instead.  -w runs that many workers, each with its own
+ * connection, and -v asks for that many vcores, making us an MCP.
+ *
+ * Each TCP connection starts with a struct nb_hello saying which test it is
+ * for.  The udp test also has a TCP connection for control: after the test,
+ * the client sends one byte on it, and the server replies with what arrived.
+ *
+ * Workers stop on their own at the deadline, rather than waiting to be told,
+ * since on an SCP a worker whose syscalls never block would never let the
+ * main thread run. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <argp.h>
+#include <pthread.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/tsc-compat.h>
+#include <parlib/net.h>
+#include <benchutil/measure.h>
+#include <iplib/iplib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define NB_MAGIC				0x6e626e63
+#define NB_DEFAULT_PORT			"5001"
+#define NB_MAX_MSG				(64 * 1024)
+#define NB_MAX_RR_SAMPLES		(1 << 20)	/* per worker */
+
+enum {
+	NB_STREAM = 1,
+	NB_RR,
+	NB_CRR,
+	NB_UDP,
+};
+
+static const char *nb_test_names[] = {
+	[NB_STREAM]	= "stream",
+	[NB_RR]		= "rr",
+	[NB_CRR]	= "crr",
+	[NB_UDP]	= "udp",
+};
+
+struct nb_hello {
+	uint32_t					magic;
+	uint32_t					test;
+	uint32_t					req_sz;
+	uint32_t					resp_sz;
+};
+
+struct nb_udp_result {
+	uint64_t					packets;
+	uint64_t					bytes;
+};
+
+struct nb_worker {
+	pthread_t					thread;
+	uint64_t					ops;		/* messages or transactions */
+	uint64_t					bytes;
+	uint64_t					*samples;	/* rr/crr latencies, nsec */
+	size_t						nr_samples;
+	size_t						max_samples;
+};
+
+const char *argp_program_version = "netbench v0.1";
+const char *argp_program_bug_address = "<akaros+subscribe@googlegroups.com>";
+
+static char doc[] = "netbench -- network throughput and latency benchmarks";
+static char args_doc[] = "-s | -H HOST -t TEST";
+
+static struct argp_option options[] = {
+	{"server",		's', 0,			0, "Run the server"},
+	{"host",		'H', "HOST",	0, "Run the client against HOST"},
+	{"test",		't', "TEST",	0, "stream, rr, crr or udp"},
+	{"port",		'p', "PORT",	0, "TCP and UDP port (default 5001)"},
+	{0, 0, 0, 0, ""},
+	{"length",		'l', "SECS",	0, "Seconds to run (default 10)"},
+	{"msg-size",	'm', "BYTES",	0, "Message or request size"},
+	{"resp-size",	'r', "BYTES",	0, "Response size, rr and crr (default 1)"},
+	{"workers",		'w', "NUM",		0, "Workers, each with a connection"},
+	{"vcores",		'v', "NUM",		0, "Vcores to run on (default: SCP)"},
+	{"bsd",			'b', 0,			0, "Use BSD sockets, not #ip"},
+	{ 0 }
+};
+
+struct prog_args {
+	bool						server;
+	char						*host;
+	char						*port;
+	int							test;
+	int							secs;
+	int							msg_sz;
+	int							resp_sz;
+	int							nr_workers;
+	int							nr_vcores;
+	bool						bsd;
+};
+static struct prog_args pargs;
+
+static volatile bool nb_go;
+static uint64_t nb_end_tsc;
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct prog_args *pargs = state->input;
+
+	switch (key) {
+	case 's':
+		pargs->server = TRUE;
+		break;
+	case 'H':
+		pargs->host = arg;
+		break;
+	case 'p':
+		pargs->port = arg;
+		break;
+	case 't':
+		for (int i = NB_STREAM; i <= NB_UDP; i++) {
+			if (!strcmp(arg, nb_test_names[i]))
+				pargs->test = i;
+		}
+		if (!pargs->test) {
+			printf("Unknown test %s\n\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 'l':
+		pargs->secs = atoi(arg);
+		break;
+	case 'm':
+		pargs->msg_sz = atoi(arg);
+		break;
+	case 'r':
+		pargs->resp_sz = atoi(arg);
+		break;
+	case 'w':
+		pargs->nr_workers = atoi(arg);
+		break;
+	case 'v':
+		pargs->nr_vcores = atoi(arg);
+		break;
+	case 'b':
+		pargs->bsd = TRUE;
+		break;
+	case ARGP_KEY_END:
+		if (pargs->server == !!pargs->host) {
+			printf("Need exactly one of -s or -H\n\n");
+			argp_usage(state);
+		}
+		if (pargs->host && !pargs->test) {
+			printf("Need a test\n\n");
+			argp_usage(state);
+		}
+		if (pargs->secs <= 0 || pargs->nr_workers <= 0 ||
+		    pargs->nr_vcores < 0) {
+			printf("Bad length, workers or vcores\n\n");
+			argp_usage(state);
+		}
+		if (pargs->msg_sz < 0 || pargs->msg_sz > NB_MAX_MSG ||
+		    pargs->resp_sz <= 0 || pargs->resp_sz > NB_MAX_MSG) {
+			printf("Sizes must be 1 to %d bytes\n\n", NB_MAX_MSG);
+			argp_usage(state);
+		}
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+static int nb_read_all(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	for (size_t done = 0; done < len; done += ret) {
+		ret = read(fd, buf + done, len - done);
+		if (ret <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int nb_write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	for (size_t done = 0; done < len; done += ret) {
+		ret = write(fd, buf + done, len - done);
+		if (ret <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Connection setup, through #ip or through the BSD shim.  type is SOCK_STREAM
+ * or SOCK_DGRAM.  All of these return an FD for reads and writes, or -1. */
+
+static int nb_dial(int type)
+{
+	char addr[256];
+	struct addrinfo hints = {0}, *res;
+	int fd, ret;
+
+	if (!pargs.bsd) {
+		ret = snprintf(addr, sizeof(addr), "%s!%s!%s",
+		               type == SOCK_STREAM ? "tcp" : "udp", pargs.host,
+		               pargs.port);
+		if (snprintf_overflow(ret, addr, sizeof(addr)))
+			return -1;
+		return dial9(addr, 0, 0, 0, 0);
+	}
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = type;
+	if (getaddrinfo(pargs.host, pargs.port, &hints, &res))
+		return -1;
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen)) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+struct nb_listener {
+	int							fd;			/* ctl for #ip */
+	char						dir[40];
+};
+
+static int nb_announce(struct nb_listener *nl, int type)
+{
+	char addr[256];
+	struct sockaddr_in sin = {0};
+	int one = 1;
+
+	if (!pargs.bsd) {
+		snprintf(addr, sizeof(addr), "%s!*!%s",
+		         type == SOCK_STREAM ? "tcp" : "udp", pargs.port);
+		nl->fd = announce9(addr, nl->dir, 0);
+		return nl->fd < 0 ? -1 : 0;
+	}
+	nl->fd = socket(AF_INET, type, 0);
+	if (nl->fd < 0)
+		return -1;
+	setsockopt(nl->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	sin.sin_port = htons(atoi(pargs.port));
+	if (bind(nl->fd, (struct sockaddr*)&sin, sizeof(sin)))
+		return -1;
+	if (type == SOCK_STREAM && listen(nl->fd, 128))
+		return -1;
+	return 0;
+}
+
+static int nb_accept(struct nb_listener *nl)
+{
+	char ldir[40];
+	int lcfd, fd;
+
+	if (pargs.bsd)
+		return accept(nl->fd, NULL, NULL);
+	lcfd = listen9(nl->dir, ldir, 0);
+	if (lcfd < 0)
+		return -1;
+	fd = accept9(lcfd, ldir);
+	/* The conversation lives on as long as its data file is open */
+	close(lcfd);
+	return fd;
+}
+
+/* For #ip, an announced UDP conversation hands every datagram to its data file
+ * once we turn on headers. */
+static int nb_udp_data_fd(struct nb_listener *nl)
+{
+	char path[128];
+
+	if (pargs.bsd)
+		return nl->fd;
+	if (write(nl->fd, "headers", 7) != 7)
+		return -1;
+	snprintf(path, sizeof(path), "%s/data", nl->dir);
+	return open(path, O_RDWR);
+}
+
+/* Server */
+
+static uint64_t nb_udp_packets, nb_udp_bytes;
+
+static void *nb_udp_sink(void *arg)
+{
+	int fd = (int)(long)arg;
+	char *buf = malloc(NB_MAX_MSG + Udphdrsize);
+	ssize_t ret;
+
+	/* Only this thread writes the counters */
+	while ((ret = read(fd, buf, NB_MAX_MSG + Udphdrsize)) >= 0) {
+		nb_udp_packets++;
+		nb_udp_bytes += ret - (pargs.bsd ? 0 : Udphdrsize);
+	}
+	perror("UDP read");
+	return NULL;
+}
+
+static void nb_serve_stream(int fd)
+{
+	char *buf = malloc(NB_MAX_MSG);
+	uint64_t start = read_tsc(), bytes = 0, usec;
+	ssize_t ret;
+
+	while ((ret = read(fd, buf, NB_MAX_MSG)) > 0)
+		bytes += ret;
+	usec = MAX(tsc2usec(read_tsc() - start), 1);
+	printf("stream: received %llu bytes in %llu msec, %llu Mbit/s\n", bytes,
+	       usec / 1000, bytes * 8 / usec);
+	free(buf);
+}
+
+static void nb_serve_rr(int fd, struct nb_hello *hello)
+{
+	char *buf = calloc(1, MAX(hello->req_sz, hello->resp_sz));
+
+	while (!nb_read_all(fd, buf, hello->req_sz)) {
+		if (nb_write_all(fd, buf, hello->resp_sz))
+			break;
+	}
+	free(buf);
+}
+
+static void nb_serve_udp(int fd)
+{
+	struct nb_udp_result res;
+	uint64_t packets = nb_udp_packets, bytes = nb_udp_bytes;
+	char done;
+
+	if (nb_read_all(fd, &done, 1))
+		return;
+	res.packets = nb_udp_packets - packets;
+	res.bytes = nb_udp_bytes - bytes;
+	nb_write_all(fd, &res, sizeof(res));
+}
+
+static void *nb_serve_conn(void *arg)
+{
+	int fd = (int)(long)arg;
+	struct nb_hello hello;
+
+	if (nb_read_all(fd, &hello, sizeof(hello)) ||
+	    ntohl(hello.magic) != NB_MAGIC) {
+		fprintf(stderr, "Bad hello\n");
+		close(fd);
+		return NULL;
+	}
+	hello.test = ntohl(hello.test);
+	hello.req_sz = MIN(ntohl(hello.req_sz), NB_MAX_MSG);
+	hello.resp_sz = MIN(ntohl(hello.resp_sz), NB_MAX_MSG);
+	if (!hello.req_sz || !hello.resp_sz) {
+		fprintf(stderr, "Bad sizes\n");
+		close(fd);
+		return NULL;
+	}
+	switch (hello.test) {
+	case NB_STREAM:
+		nb_serve_stream(fd);
+		break;
+	case NB_RR:
+	case NB_CRR:
+		nb_serve_rr(fd, &hello);
+		break;
+	case NB_UDP:
+		nb_serve_udp(fd);
+		break;
+	default:
+		fprintf(stderr, "Unknown test %u\n", hello.test);
+	}
+	close(fd);
+	return NULL;
+}
+
+static void nb_server(void)
+{
+	struct nb_listener tcp, udp;
+	pthread_t thread;
+	int fd, udp_fd;
+
+	if (nb_announce(&tcp, SOCK_STREAM)) {
+		perror("TCP announce");
+		exit(-1);
+	}
+	if (nb_announce(&udp, SOCK_DGRAM) || (udp_fd = nb_udp_data_fd(&udp)) < 0) {
+		perror("UDP announce");
+		exit(-1);
+	}
+	if (pthread_create(&thread, NULL, nb_udp_sink, (void*)(long)udp_fd)) {
+		perror("pthread_create");
+		exit(-1);
+	}
+	printf("netbench serving port %s with %s\n", pargs.port,
+	       pargs.bsd ? "BSD sockets" : "#ip");
+	while ((fd = nb_accept(&tcp)) >= 0) {
+		if (pthread_create(&thread, NULL, nb_serve_conn, (void*)(long)fd)) {
+			perror("pthread_create");
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	perror("Accept");
+	exit(-1);
+}
+
+/* Client */
+
+static int nb_send_hello(int fd, int test)
+{
+	struct nb_hello hello;
+
+	hello.magic = htonl(NB_MAGIC);
+	hello.test = htonl(test);
+	hello.req_sz = htonl(pargs.msg_sz);
+	hello.resp_sz = htonl(pargs.resp_sz);
+	return nb_write_all(fd, &hello, sizeof(hello));
+}
+
+static int nb_dial_test(int test)
+{
+	int fd = nb_dial(SOCK_STREAM);
+
+	if (fd < 0)
+		return -1;
+	if (nb_send_hello(fd, test)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void nb_add_sample(struct nb_worker *w, uint64_t ticks)
+{
+	if (w->nr_samples == w->max_samples) {
+		if (w->max_samples == NB_MAX_RR_SAMPLES)
+			return;
+		w->max_samples = MAX(w->max_samples * 2, 1024);
+		w->samples = realloc(w->samples, w->max_samples * sizeof(uint64_t));
+		assert(w->samples);
+	}
+	w->samples[w->nr_samples++] = tsc2nsec(ticks);
+}
+
+static int nb_transact(int fd, char *buf)
+{
+	if (nb_write_all(fd, buf, pargs.msg_sz))
+		return -1;
+	return nb_read_all(fd, buf, pargs.resp_sz);
+}
+
+static void *nb_worker(void *arg)
+{
+	struct nb_worker *w = arg;
+	char *buf = calloc(1, NB_MAX_MSG);
+	uint64_t start;
+	int fd = -1;
+
+	switch (pargs.test) {
+	case NB_STREAM:
+	case NB_RR:
+		fd = nb_dial_test(pargs.test);
+		break;
+	case NB_UDP:
+		fd = nb_dial(SOCK_DGRAM);
+		break;
+	}
+	if (pargs.test != NB_CRR && fd < 0) {
+		perror("Dial");
+		exit(-1);
+	}
+	while (!nb_go)
+		pthread_yield();
+	while (read_tsc() < nb_end_tsc) {
+		switch (pargs.test) {
+		case NB_STREAM:
+			if (nb_write_all(fd, buf, pargs.msg_sz)) {
+				perror("Write");
+				exit(-1);
+			}
+			break;
+		case NB_UDP:
+			/* Dropping is fine, the server tells us what it got */
+			if (write(fd, buf, pargs.msg_sz) < 0)
+				continue;
+			break;
+		case NB_RR:
+			start = read_tsc();
+			if (nb_transact(fd, buf)) {
+				perror("Transaction");
+				exit(-1);
+			}
+			nb_add_sample(w, read_tsc() - start);
+			break;
+		case NB_CRR:
+			start = read_tsc();
+			fd = nb_dial_test(NB_CRR);
+			if (fd < 0 || nb_transact(fd, buf)) {
+				perror("Connect and transaction");
+				exit(-1);
+			}
+			close(fd);
+			nb_add_sample(w, read_tsc() - start);
+			break;
+		}
+		w->ops++;
+		w->bytes += pargs.msg_sz;
+	}
+	if (pargs.test != NB_CRR)
+		close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int nb_get_latency(void **data, int i, int j, uint64_t *sample)
+{
+	struct nb_worker *w = data[i];
+
+	if (j >= w->nr_samples)
+		return -1;
+	*sample = w->samples[j];
+	return 0;
+}
+
+static void nb_client(void)
+{
+	struct nb_worker *workers;
+	struct nb_udp_result udp_res;
+	struct sample_stats stats = {0};
+	uint64_t start, len, usec, ops = 0, bytes = 0;
+	size_t max_samples = 0;
+	int ctl_fd = -1;
+	char done = 0;
+	void **data;
+
+	workers = calloc(pargs.nr_workers, sizeof(struct nb_worker));
+	data = calloc(pargs.nr_workers, sizeof(void*));
+	assert(workers && data);
+	if (pargs.test == NB_UDP) {
+		ctl_fd = nb_dial_test(NB_UDP);
+		if (ctl_fd < 0) {
+			perror("Dial control");
+			exit(-1);
+		}
+	}
+	for (int i = 0; i < pargs.nr_workers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, nb_worker, &workers[i])) {
+			perror("pthread_create");
+			exit(-1);
+		}
+	}
+	len = sec2tsc(pargs.secs);
+	start = read_tsc();
+	nb_end_tsc = start + len;
+	wmb();
+	nb_go = TRUE;
+	for (int i = 0; i < pargs.nr_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		bytes += workers[i].bytes;
+		data[i] = &workers[i];
+		max_samples = MAX(max_samples, workers[i].nr_samples);
+	}
+	usec = MAX(tsc2usec(nb_end_tsc - start), 1);
+	printf("%s over %s: %d workers, %d vcores, %llu msec\n",
+	       nb_test_names[pargs.test], pargs.bsd ? "BSD sockets" : "#ip",
+	       pargs.nr_workers, pargs.nr_vcores, usec / 1000);
+	switch (pargs.test) {
+	case NB_STREAM:
+		printf("Sent %llu bytes, %llu Mbit/s\n", bytes, bytes * 8 / usec);
+		break;
+	case NB_RR:
+	case NB_CRR:
+		printf("%llu transactions, %llu per sec\n", ops,
+		       ops * 1000000 / usec);
+		printf("Latency (nsec)\n--------------\n");
+		stats.get_sample = nb_get_latency;
+		compute_stats(data, pargs.nr_workers, max_samples, &stats);
+		break;
+	case NB_UDP:
+		/* Let the stragglers land */
+		usleep(100000);
+		if (nb_write_all(ctl_fd, &done, 1) ||
+		    nb_read_all(ctl_fd, &udp_res, sizeof(udp_res))) {
+			perror("UDP control");
+			exit(-1);
+		}
+		printf("Sent %llu packets, %llu pkt/s, %llu Mbit/s\n", ops,
+		       ops * 1000000 / usec, bytes * 8 / usec);
+		printf("Received %llu packets, %llu pkt/s, %llu Mbit/s\n",
+		       udp_res.packets, udp_res.packets * 1000000 / usec,
+		       udp_res.bytes * 8 / usec);
+		close(ctl_fd);
+		break;
+	}
+	for (int i = 0; i < pargs.nr_workers; i++)
+		free(workers[i].samples);
+	free(workers);
+	free(data);
+}
+
+int main(int argc, char **argv)
+{
+	pargs.port = NB_DEFAULT_PORT;
+	pargs.secs = 10;
+	pargs.msg_sz = 0;
+	pargs.resp_sz = 1;
+	pargs.nr_workers = 1;
+	argp_parse(&argp, argc, argv, 0, 0, &pargs);
+	if (!pargs.msg_sz)
+		pargs.msg_sz = pargs.test == NB_STREAM ? 16384 :
+		               pargs.test == NB_UDP ? 64 : 1;
+
+	if (pargs.nr_vcores) {
+		parlib_never_yield = TRUE;
+		pthread_mcp_init();
+		vcore_request_total(pargs.nr_vcores);
+		parlib_never_vc_request = TRUE;
+	}
+	if (pargs.server)
+		nb_server();
+	else
+		nb_client();
+	return 0;
+}
@@ -0,0 +1,65 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Basic test for parlib's async I/O: reads on a pipe are in flight until we
+ * write to it, then we wait for them with wait_any and wait_all. */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <parlib/uaio.h>
+#include <parlib/assert.h>
+
+#define NR_FUTS 4
+
+int main(int argc, char **argv)
+{
+	struct uaio_group grp;
+	struct uaio_future rd[NR_FUTS], wr[NR_FUTS];
+	struct uaio_future *fut;
+	char rbuf[NR_FUTS][8];
+	char wbuf[NR_FUTS][8];
+	int pipefd[2];
+	unsigned int nr;
+
+	if (pipe(pipefd)) {
+		perror("pipe");
+		return -1;
+	}
+	uaio_group_init(&grp);
+	for (int i = 0; i < NR_FUTS; i++)
+		uaio_read(&grp, &rd[i], pipefd[0], rbuf[i], sizeof(rbuf[i]));
+	/* Nothing has been written, so nothing can be done yet. */
+	assert(!uaio_poll(&grp));
+
+	for (int i = 0; i < NR_FUTS; i++) {
+		snprintf(wbuf[i], sizeof(wbuf[i]), "uaio %d", i);
+		uaio_write(&grp, &wr[i], pipefd[1], wbuf[i], sizeof(wbuf[i]));
+	}
+	nr = 0;
+	while ((fut = uaio_wait_any(&grp))) {
+		if (uaio_result(fut) != sizeof(rbuf[0])) {
+			printf("Failed: syscall %p returned %ld: %r\n", fut,
+			       fut->sysc.retval);
+			return -1;
+		}
+		nr++;
+	}
+	assert(nr == 2 * NR_FUTS);
+
+	/* Each write is atomic, so each read got one whole message. */
+	for (int i = 0; i < NR_FUTS; i++)
+		assert(!strncmp(rbuf[i], "uaio ", 5));
+
+	/* Errors come back through the future, not the submitter. */
+	close(pipefd[0]);
+	close(pipefd[1]);
+	for (int i = 0; i < NR_FUTS; i++)
+		uaio_read(&grp, &rd[i], pipefd[0], rbuf[i], sizeof(rbuf[i]));
+	assert(uaio_wait_all(&grp) == NR_FUTS);
+	for (int i = 0; i < NR_FUTS; i++)
+		assert(uaio_result(&rd[i]) == -1);
+	uaio_group_destroy(&grp);
+	printf("uaio test passed\n");
+	return 0;
+}
@@ -0,0 +1,77 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Parallel fib with parlib's stackless tasks.  The main thread spawns the
+ * root task, and a few helper pthreads sync on the root group to steal work.
+ *
+ * Usage: utask [N] [NR_HELPERS] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <parlib/utask.h>
+#include <parlib/parlib.h>
+#include <parlib/assert.h>
+
+struct fib_task {
+	struct utask				task;
+	long						n;
+	long						ret;
+};
+
+static void fib(struct utask *task)
+{
+	struct fib_task *ft = container_of(task, struct fib_task, task);
+	struct fib_task left, right;
+	struct utask_group grp;
+
+	if (ft->n < 2) {
+		ft->ret = ft->n;
+		return;
+	}
+	utask_group_init(&grp);
+	left.n = ft->n - 1;
+	right.n = ft->n - 2;
+	utask_spawn(&grp, &left.task, fib);
+	utask_spawn(&grp, &right.task, fib);
+	utask_sync(&grp);
+	ft->ret = left.ret + right.ret;
+}
+
+static long serial_fib(long n)
+{
+	return n < 2 ? n : serial_fib(n - 1) + serial_fib(n - 2);
+}
+
+static struct utask_group root_grp;
+
+static void *helper(void *arg)
+{
+	utask_sync(&root_grp);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct fib_task root;
+	long n = argc > 1 ? strtol(argv[1], 0, 10) : 20;
+	int nr_helpers = argc > 2 ? strtol(argv[2], 0, 10) : 4;
+	pthread_t *helpers = malloc(sizeof(pthread_t) * nr_helpers);
+
+	assert(helpers);
+	utask_group_init(&root_grp);
+	root.n = n;
+	utask_spawn(&root_grp, &root.task, fib);
+	for (int i = 0; i < nr_helpers; i++)
+		pthread_create(&helpers[i], NULL, helper, NULL);
+	utask_sync(&root_grp);
+	for (int i = 0; i < nr_helpers; i++)
+		pthread_join(helpers[i], NULL);
+	if (root.ret != serial_fib(n)) {
+		printf("Failed: fib(%ld) was %ld, wanted %ld\n", n, root.ret,
+		       serial_fib(n));
+		return -1;
+	}
+	printf("utask fib(%ld) = %ld passed\n", n, root.ret);
+	return 0;
+}
@@ -0,0 +1,383 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Latency benchmarks for uthreads and the 2LS, to check 2LS changes against.
+ *
+ * 		uthread_bench [-n ITERS] [-v VCORES] [-b USEC] [BENCH ...]
+ *
+ * For each vcore count in VCORES (a comma-separated list, default is the
+ * powers of two up to max_vcores()), we get that many vcores, then run each
+ * bench (default is all of them) ITERS times, with one sample per iteration.
+ * The results are one line per bench and vcore count, all in nsec:
+ *
+ * 		bench=yield vcores=1 samples=N min=X mean=X p50=X p99=X max=X
+ *
+ * The benches:
+ * - yield: a pthread_yield() round trip between two threads.
+ * - mutex_cv: a round trip between two threads, handing off a mutex and
+ *   signalling a CV each way.
+ * - futex: FUTEX_WAKE until the waiter runs.
+ * - event: sys_self_notify() until our handler runs in vcore context.
+ * - vcore_request, vcore_yield: vcore_request_total() for one more vcore until
+ *   the kernel grants it, then back down until the idle one yields.  These need
+ *   one more vcore than we're running with.
+ * - syscall_null: a SYS_null round trip.
+ * - syscall_block: a SYS_block of USEC (default 1), minus USEC.  The uthread
+ *   blocks, so this covers the 2LS's syscall blocking paths.
+ * - syscall_async: a SYS_block of USEC, minus USEC, spinning on SC_DONE.
+ *
+ * There is no preemption recovery bench: we can't make the kernel preempt our
+ * own vcores from userspace. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <futex.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/event.h>
+#include <parlib/timing.h>
+#include <parlib/tsc-compat.h>
+#include <benchutil/hdr_hist.h>
+
+#define MAX_VC_COUNTS 32
+
+static unsigned long nr_iters = 10000;
+static unsigned long block_usec = 1;
+static struct hdr_hist *hist;
+static struct hdr_hist *hist2;
+
+static void report(const char *name, struct hdr_hist *h)
+{
+	printf("bench=%s vcores=%d samples=%llu min=%llu mean=%llu p50=%llu "
+	       "p99=%llu max=%llu\n", name, num_vcores(), h->total,
+	       h->total ? h->min : 0, hdr_hist_mean(h),
+	       hdr_hist_percentile(h, 50), hdr_hist_percentile(h, 99), h->max);
+}
+
+static void record_since(struct hdr_hist *h, uint64_t start)
+{
+	hdr_hist_record(h, tsc2nsec(read_tsc() - start));
+}
+
+/* Records the time since start, less the usecs we spent in SYS_block */
+static void record_block_since(struct hdr_hist *h, uint64_t start)
+{
+	uint64_t nsec = tsc2nsec(read_tsc() - start);
+	uint64_t blk = block_usec * 1000;
+
+	hdr_hist_record(h, nsec > blk ? nsec - blk : 0);
+}
+
+/* Runs fn(0) and fn(1) in their own threads.  Thread 0 records. */
+static void run_pair(void *(*fn)(void *))
+{
+	pthread_t th[2];
+
+	for (long i = 0; i < 2; i++) {
+		if (pthread_create(&th[i], NULL, fn, (void*)i)) {
+			perror("pthread_create");
+			exit(-1);
+		}
+	}
+	for (int i = 0; i < 2; i++)
+		pthread_join(th[i], NULL);
+}
+
+static void *yield_thread(void *arg)
+{
+	long id = (long)arg;
+	uint64_t start;
+
+	for (unsigned long i = 0; i < nr_iters; i++) {
+		start = read_tsc();
+		pthread_yield();
+		if (id == 0)
+			record_since(hist, start);
+	}
+	return 0;
+}
+
+static void bench_yield(void)
+{
+	run_pair(yield_thread);
+	report("yield", hist);
+}
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+static int turn;
+
+static void *mutex_cv_thread(void *arg)
+{
+	long id = (long)arg;
+	uint64_t start;
+
+	for (unsigned long i = 0; i < nr_iters; i++) {
+		start = read_tsc();
+		pthread_mutex_lock(&mtx);
+		if (id == 0) {
+			turn = 1;
+			pthread_cond_signal(&cv);
+		}
+		while (turn != id)
+			pthread_cond_wait(&cv, &mtx);
+		if (id == 1) {
+			turn = 0;
+			pthread_cond_signal(&cv);
+		}
+		pthread_mutex_unlock(&mtx);
+		if (id == 0)
+			record_since(hist, start);
+	}
+	return 0;
+}
+
+static void bench_mutex_cv(void)
+{
+	turn = 0;
+	run_pair(mutex_cv_thread);
+	report("mutex_cv", hist);
+}
+
+static int futex_word;
+static bool futex_armed;
+static uint64_t futex_stamp;
+
+/* Thread 0 wakes, thread 1 waits and records. */
+static void *futex_thread(void *arg)
+{
+	long id = (long)arg;
+
+	for (unsigned long i = 0; i < nr_iters; i++) {
+		if (id == 0) {
+			while (!ACCESS_ONCE(futex_armed))
+				pthread_yield();
+			futex_armed = FALSE;
+			futex_stamp = read_tsc();
+			wmb();
+			ACCESS_ONCE(futex_word) = 1;
+			futex(&futex_word, FUTEX_WAKE, 1, NULL, NULL, 0);
+		} else {
+			ACCESS_ONCE(futex_word) = 0;
+			wmb();
+			ACCESS_ONCE(futex_armed) = TRUE;
+			while (!ACCESS_ONCE(futex_word))
+				futex(&futex_word, FUTEX_WAIT, 0, NULL, NULL, 0);
+			rmb();
+			record_since(hist, futex_stamp);
+		}
+	}
+	return 0;
+}
+
+static void bench_futex(void)
+{
+	futex_armed = FALSE;
+	run_pair(futex_thread);
+	report("futex", hist);
+}
+
+static bool ev_seen;
+
+static void ev_handler(struct event_msg *ev_msg, unsigned int ev_type,
+                       void *data)
+{
+	record_since(hist, ev_msg->ev_arg4);
+	wmb();
+	ACCESS_ONCE(ev_seen) = TRUE;
+}
+
+static void bench_event(void)
+{
+	struct event_msg msg = {0};
+
+	register_ev_handler(EV_USER_IPI, ev_handler, 0);
+	for (unsigned long i = 0; i < nr_iters; i++) {
+		ev_seen = FALSE;
+		msg.ev_type = EV_USER_IPI;
+		msg.ev_arg4 = read_tsc();
+		sys_self_notify(vcore_id(), EV_USER_IPI, &msg, TRUE);
+		while (!ACCESS_ONCE(ev_seen))
+			cpu_relax();
+	}
+	deregister_ev_handler(EV_USER_IPI, ev_handler, 0);
+	report("event", hist);
+}
+
+/* Asks for nr vcores and waits til we have them.  Our idle vcores spin, so we
+ * only let them yield while we're shrinking. */
+static void set_vcores(int nr)
+{
+	parlib_never_vc_request = FALSE;
+	vcore_request_total(nr);
+	parlib_never_vc_request = TRUE;
+	if (nr < num_vcores())
+		parlib_never_yield = FALSE;
+	while (num_vcores() != nr)
+		cpu_relax();
+	parlib_never_yield = TRUE;
+}
+
+static void bench_vcore(void)
+{
+	int nr = num_vcores();
+	uint64_t start;
+
+	if (nr >= max_vcores())
+		return;
+	for (unsigned long i = 0; i < nr_iters; i++) {
+		start = read_tsc();
+		set_vcores(nr + 1);
+		record_since(hist, start);
+		start = read_tsc();
+		set_vcores(nr);
+		record_since(hist2, start);
+	}
+	report("vcore_request", hist);
+	report("vcore_yield", hist2);
+}
+
+static void bench_syscall_null(void)
+{
+	uint64_t start;
+
+	for (unsigned long i = 0; i < nr_iters; i++) {
+		start = read_tsc();
+		sys_null();
+		record_since(hist, start);
+	}
+	report("syscall_null", hist);
+}
+
+static void bench_syscall_block(void)
+{
+	uint64_t start;
+
+	for (unsigned long i = 0; i < nr_iters; i++) {
+		start = read_tsc();
+		sys_block(block_usec);
+		record_block_since(hist, start);
+	}
+	report("syscall_block", hist);
+}
+
+static void bench_syscall_async(void)
+{
+	struct syscall sysc;
+	uint64_t start;
+
+	for (unsigned long i = 0; i < nr_iters; i++) {
+		start = read_tsc();
+		syscall_async(&sysc, SYS_block, block_usec);
+		while (!(atomic_read(&sysc.flags) & SC_DONE))
+			cpu_relax();
+		record_block_since(hist, start);
+	}
+	report("syscall_async", hist);
+}
+
+static struct bench {
+	const char *name;
+	void (*fn)(void);
+} benches[] = {
+	{"yield", bench_yield},
+	{"mutex_cv", bench_mutex_cv},
+	{"futex", bench_futex},
+	{"event", bench_event},
+	{"vcore", bench_vcore},
+	{"syscall_null", bench_syscall_null},
+	{"syscall_block", bench_syscall_block},
+	{"syscall_async", bench_syscall_async},
+};
+
+static bool want_bench(struct bench *b, int argc, char **argv)
+{
+	if (optind == argc)
+		return TRUE;
+	for (int i = optind; i < argc; i++) {
+		if (!strcmp(argv[i], b->name))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static int parse_vcores(char *list, int *vcs)
+{
+	int nr = 0;
+
+	for (char *tok = strtok(list, ","); tok && nr < MAX_VC_COUNTS;
+	     tok = strtok(NULL, ","))
+		vcs[nr++] = strtol(tok, 0, 0);
+	return nr;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n ITERS] [-v VC,...] [-b USEC] [BENCH ...]\n",
+	        prog);
+	fprintf(stderr, "benches:");
+	for (int i = 0; i < COUNT_OF(benches); i++)
+		fprintf(stderr, " %s", benches[i].name);
+	fprintf(stderr, "\n");
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	int vcs[MAX_VC_COUNTS];
+	int nr_vcs = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:v:b:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_iters = strtoul(optarg, 0, 0);
+			break;
+		case 'v':
+			nr_vcs = parse_vcores(optarg, vcs);
+			break;
+		case 'b':
+			block_usec = strtoul(optarg, 0, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!nr_vcs) {
+		for (int i = 1; i <= max_vcores() && nr_vcs < MAX_VC_COUNTS; i *= 2)
+			vcs[nr_vcs++] = i;
+	}
+	hist = hdr_hist_alloc(2);
+	if (!hist) {
+		perror("hdr_hist_alloc");
+		exit(-1);
+	}
+	hist2 = &hist[1];
+
+	/* We set our own vcore count, and don't want the 2LS changing it. */
+	parlib_never_yield = TRUE;
+	parlib_never_vc_request = TRUE;
+	pthread_mcp_init();
+
+	for (int i = 0; i < nr_vcs; i++) {
+		if (vcs[i] < 1 || vcs[i] > max_vcores()) {
+			fprintf(stderr, "Skipping %d vcores, max is %d\n", vcs[i],
+			        max_vcores());
+			continue;
+		}
+		set_vcores(vcs[i]);
+		for (int j = 0; j < COUNT_OF(benches); j++) {
+			if (!want_bench(&benches[j], argc, argv))
+				continue;
+			hdr_hist_init(hist);
+			hdr_hist_init(hist2);
+			benches[j].fn();
+		}
+	}
+	free(hist);
+	return 0;
+}
@@ -25,6 +25,8 @@
 
 #include <vmm/virtio.h>
 #include <vmm/virtio_blk.h>
+#include <vmm/virtio_balloon.h>
+#include <vmm/virtio_9p.h>
 #include <vmm/virtio_mmio.h>
 #include <vmm/virtio_ids.h>
 #include <vmm/virtio_config.h>
@@ -135,6 +137,62 @@ unsigned int maxresume = (unsigned int) -1;
 #define KERNSIZE (1024 * MiB + GKERNBASE)
 uint8_t _kernel[KERNSIZE];
 
+/* Guest RAM is [GKERNBASE, KERNSIZE), which is inside _kernel and aligned for
+ * jumbos.  We replace that part of _kernel with fresh, populated anonymous
+ * memory, which the kernel backs with jumbo pages where it can.  The EPT
+ * mirrors our page tables, so the guest gets those jumbos too, instead of
+ * faulting its memory in 4K at a time and taking long 2D walks on TLB misses.
+ * Our bss was zero, and so is the new memory. */
+static void alloc_guest_ram(void)
+{
+	void *ram;
+
+	ram = mmap((void*)GKERNBASE, KERNSIZE - GKERNBASE, PROT_READ | PROT_WRITE,
+	           MAP_FIXED | MAP_POPULATE | MAP_ANONYMOUS, -1, 0);
+	if (ram == MAP_FAILED) {
+		perror("Unable to mmap guest RAM");
+		exit(1);
+	}
+}
+
+/* Maps the guest image into guest RAM at addr, private and writable.  The
+ * guest pages it in as it touches it, through EPT faults on the file's pages,
+ * instead of us reading the whole thing before it can start.  Its writes get
+ * their own copy of the page.  Returns the image's size, or 0 if we can't map
+ * it, e.g. it's on a device without a page cache. */
+static size_t map_guest_image(int fd, uintptr_t addr)
+{
+	struct stat st;
+	void *va;
+
+	if (PGOFF(addr) || fstat(fd, &st) || st.st_size <= 0)
+		return 0;
+	va = mmap((void*)addr, st.st_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+	          MAP_PRIVATE | MAP_FIXED, fd, 0);
+	if (va == MAP_FAILED)
+		return 0;
+	return st.st_size;
+}
+
+/* Reads the guest image into guest RAM at addr, one 2M page at a time. */
+static size_t read_guest_image(int fd, uintptr_t addr)
+{
+	void *xp = (void*)addr;
+	int amt;
+
+	for (;;) {
+		amt = read(fd, xp, PML2_PTE_REACH);
+		if (amt < 0) {
+			perror("read");
+			exit(1);
+		}
+		if (amt == 0)
+			break;
+		xp += amt;
+	}
+	return (uintptr_t)xp - addr;
+}
+
 unsigned long long *p512, *p1, *p2m;
 
 void **my_retvals;
@@ -195,7 +253,8 @@ static struct virtio_vq_dev cons_vqdev = {
 	.name = "console",
 	.dev_id = VIRTIO_ID_CONSOLE,
 	.dev_feat =
-	    (1ULL << VIRTIO_F_VERSION_1) | (1 << VIRTIO_RING_F_INDIRECT_DESC),
+	    (1ULL << VIRTIO_F_VERSION_1) | (1 << VIRTIO_RING_F_INDIRECT_DESC) |
+	    (1 << VIRTIO_RING_F_EVENT_IDX),
 	.num_vqs = 2,
 	.cfg = &cons_cfg,
 	.cfg_d = &cons_cfg_d,
@@ -228,27 +287,21 @@ static struct virtio_net_config net_cfg_d = {
 	.max_virtqueue_pairs = 1
 };
 
+/* net_init_fn() sets up the queues and num_vqs, one pair per guest core. */
 static struct virtio_vq_dev net_vqdev = {
 	.name = "network",
 	.dev_id = VIRTIO_ID_NET,
-	.dev_feat = (1ULL << VIRTIO_F_VERSION_1 | 1 << VIRTIO_NET_F_MAC),
+	.dev_feat = (1ULL << VIRTIO_F_VERSION_1 | 1 << VIRTIO_NET_F_MAC |
+	             1 << VIRTIO_NET_F_CTRL_VQ | 1 << VIRTIO_NET_F_MQ |
+	             1 << VIRTIO_RING_F_EVENT_IDX),
 
-	.num_vqs = 2,
 	.cfg = &net_cfg,
 	.cfg_d = &net_cfg_d,
 	.cfg_sz = sizeof(struct virtio_net_config),
 	.transport_dev = &net_mmio_dev,
 	.vqs = {
-		{
-			.name = "net_receiveq",
+		[0 ... VIRTIO_NET_MAX_VQS - 1] = {
 			.qnum_max = 64,
-			.srv_fn = net_receiveq_fn,
-			.vqdev = &net_vqdev
-		},
-		{
-			.name = "net_transmitq",
-			.qnum_max = 64,
-			.srv_fn = net_transmitq_fn,
 			.vqdev = &net_vqdev
 		},
 	}
@@ -264,26 +317,89 @@ static struct virtio_blk_config blk_cfg = {
 static struct virtio_blk_config blk_cfg_d = {
 };
 
+/* blk_init_fn() sets up the queues and num_vqs, one per guest core. */
 static struct virtio_vq_dev blk_vqdev = {
 	.name = "block",
 	.dev_id = VIRTIO_ID_BLOCK,
-	.dev_feat = (1ULL << VIRTIO_F_VERSION_1),
+	.dev_feat = (1ULL << VIRTIO_F_VERSION_1 | 1 << VIRTIO_BLK_F_MQ |
+	             1 << VIRTIO_RING_F_EVENT_IDX),
 
-	.num_vqs = 1,
 	.cfg = &blk_cfg,
 	.cfg_d = &blk_cfg_d,
 	.cfg_sz = sizeof(struct virtio_blk_config),
 	.transport_dev = &blk_mmio_dev,
 	.vqs = {
-		{
-			.name = "blk_request",
+		[0 ... VIRTIO_BLK_MAX_QUEUES - 1] = {
 			.qnum_max = 64,
-			.srv_fn = blk_request,
 			.vqdev = &blk_vqdev
 		},
 	}
 };
 
+static struct virtio_mmio_dev balloon_mmio_dev = {
+	.poke_guest = virtio_poke_guest,
+};
+
+static struct virtio_balloon_config balloon_cfg;
+static struct virtio_balloon_config balloon_cfg_d;
+
+static struct virtio_vq_dev balloon_vqdev = {
+	.name = "balloon",
+	.dev_id = VIRTIO_ID_BALLOON,
+	.dev_feat = (1ULL << VIRTIO_F_VERSION_1 |
+	             1 << VIRTIO_BALLOON_F_DEFLATE_ON_OOM |
+	             1 << VIRTIO_BALLOON_F_REPORTING |
+	             1 << VIRTIO_RING_F_EVENT_IDX),
+	.num_vqs = VIRTIO_BALLOON_NR_VQS,
+	.cfg = &balloon_cfg,
+	.cfg_d = &balloon_cfg_d,
+	.cfg_sz = sizeof(struct virtio_balloon_config),
+	.transport_dev = &balloon_mmio_dev,
+	.vqs = {
+			{
+				.name = "balloon_inflateq",
+				.qnum_max = 64,
+				.srv_fn = balloon_inflateq_fn,
+				.vqdev = &balloon_vqdev
+			},
+			{
+				.name = "balloon_deflateq",
+				.qnum_max = 64,
+				.srv_fn = balloon_deflateq_fn,
+				.vqdev = &balloon_vqdev
+			},
+			{
+				.name = "balloon_reportq",
+				.qnum_max = 64,
+				.srv_fn = balloon_reportq_fn,
+				.vqdev = &balloon_vqdev
+			},
+		}
+};
+
+static struct virtio_mmio_dev p9_mmio_dev = {
+	.poke_guest = virtio_poke_guest,
+};
+
+/* p9_init_fn() sets up the config, which holds the mount tag. */
+static struct virtio_vq_dev p9_vqdev = {
+	.name = "9p",
+	.dev_id = VIRTIO_ID_9P,
+	.dev_feat = (1ULL << VIRTIO_F_VERSION_1 |
+	             1 << VIRTIO_9P_MOUNT_TAG |
+	             1 << VIRTIO_RING_F_EVENT_IDX),
+	.num_vqs = 1,
+	.transport_dev = &p9_mmio_dev,
+	.vqs = {
+			{
+				.name = "p9_request",
+				.qnum_max = 64,
+				.srv_fn = p9_request,
+				.vqdev = &p9_vqdev
+			},
+		}
+};
+
 void lowmem() {
 	__asm__ __volatile__ (".section .lowmem, \"aw\"\n\tlow: \n\t.=0x1000\n\t.align 0x100000\n\t.previous\n");
 }
@@ -349,12 +465,10 @@ int main(int argc, char **argv)
 	struct acpi_table_xsdt *x;
 	// lowmem is a bump allocated pointer to 2M at the "physbase" of memory
 	void *lowmem = (void *) 0x1000000;
-	int amt;
 	int vmmflags = 0; // Disabled probably forever. VMM_VMCALL_PRINTF;
 	uint64_t entry = 0x1200000, kerneladdress = 0x1200000;
 	int ret;
 	uintptr_t size;
-	void * xp;
 	int kfd = -1;
 	static char cmd[512];
 	int i;
@@ -370,6 +484,10 @@ int main(int argc, char **argv)
 	struct stat stat_result;
 	int num_read;
 	int option_index;
+	bool vhost_net = FALSE;
+	long balloon_pages = -1;
+	int first_pcoreid = -1;
+	char *p9_root = NULL;
 	static struct option long_options[] = {
 		{"debug",         no_argument,       0, 'd'},
 		{"vmm_vmcall",    no_argument,       0, 'v'},
@@ -380,6 +498,10 @@ int main(int argc, char **argv)
 		{"image_file",    required_argument, 0, 'f'},
 		{"cmdline",       required_argument, 0, 'k'},
 		{"nic",           required_argument, 0, 'n'},
+		{"vhost_net",     no_argument,       0, 'K'},
+		{"balloon",       required_argument, 0, 'b'},
+		{"dedicated",     required_argument, 0, 'P'},
+		{"9p_root",       required_argument, 0, 'r'},
 		{"help",          no_argument,       0, 'h'},
 		{0, 0, 0, 0}
 	};
@@ -393,7 +515,7 @@ int main(int argc, char **argv)
 		fprintf(stderr, "kernel array @%p is above , GKERNBASE@%p sucks\n", _kernel, GKERNBASE);
 		exit(1);
 	}
-	memset(_kernel, 0, sizeof(_kernel));
+	alloc_guest_ram();
 	memset(lowmem, 0xff, 2*1048576);
 	vm->low4k = malloc(PGSIZE);
 	memset(vm->low4k, 0xff, PGSIZE);
@@ -418,7 +540,7 @@ int main(int argc, char **argv)
 	((uint32_t *)a_page)[0x30/4] = 0x01060015;
 	//((uint32_t *)a_page)[0x30/4] = 0xDEADBEEF;
 
-	while ((c = getopt_long(argc, argv, "dvm:c:gsf:k:n:h", long_options,
+	while ((c = getopt_long(argc, argv, "dvm:c:gsf:k:n:Kb:P:r:h", long_options,
 	                        &option_index)) != -1) {
 		switch (c) {
 			case 'd':
@@ -467,6 +589,19 @@ int main(int argc, char **argv)
 			case 'n':
 				default_nic = strtoull(optarg, 0, 0);
 				break;
+			case 'K':	/* kernel does the network device */
+				vhost_net = TRUE;
+				break;
+			case 'b':	/* balloon, with a starting target */
+				balloon_pages = strtol(optarg, 0, 0);
+				break;
+			case 'P':	/* dedicated pcores, starting at arg0 */
+				first_pcoreid = strtol(optarg, 0, 0);
+				vmm_sched_dedicated = TRUE;
+				break;
+			case 'r':	/* share arg0 with the guest over 9p */
+				p9_root = optarg;
+				break;
 			case 'h':
 			default:
 				fprintf(stderr, "-d or --debug              : enable debugging\n"
@@ -478,6 +613,10 @@ int main(int argc, char **argv)
 				                "-f or --image_file arg0    : pass arg0 to virtio-blk init\n"
 				                "-k or --cmdline arg0       : grab command line options from the file arg0\n"
 				                "-n or --nic arg0           : specify nic\n"
+				                "-K or --vhost_net          : run the nic in the kernel\n"
+				                "-b or --balloon arg0       : add a balloon, asking for arg0 4K pages\n"
+				                "-P or --dedicated arg0     : one pcore per guest core, plus one for tasks, from pcore arg0 up\n"
+				                "-r or --9p_root arg0       : share directory arg0 with the guest, as 9p tag 'hostfs'\n"
 				                "-h or --help               : show help info\n");
 				exit(0);
 		}
@@ -503,21 +642,14 @@ int main(int argc, char **argv)
 		perror(argv[0]);
 		exit(1);
 	}
-	// read in the kernel, one 2M page at a time.
-	xp = (void *)kerneladdress;
-	for(;;) {
-		amt = read(kfd, xp, PML2_PTE_REACH);
-		if (amt < 0) {
-			perror("read");
-			exit(1);
-		}
-		if (amt == 0) {
-			break;
-		}
-		xp += amt;
+	size = map_guest_image(kfd, kerneladdress);
+	if (size) {
+		fprintf(stderr, "Mapped %d bytes\n", size);
+	} else {
+		size = read_guest_image(kfd, kerneladdress);
+		fprintf(stderr, "Read in %d bytes\n", size);
 	}
-	size = ROUNDUP((uintptr_t)xp - kerneladdress, PML2_PTE_REACH);
-	fprintf(stderr, "Read in %d bytes\n", size);
+	size = ROUNDUP(size, PML2_PTE_REACH);
 	close(kfd);
 
 	// The low 1m so we can fill in bullshit like ACPI. */
@@ -680,9 +812,22 @@ int main(int argc, char **argv)
 		    virtio_mmio_base_addr + PGSIZE * VIRTIO_MMIO_BLOCK_DEV;
 		blk_mmio_dev.vqdev = &blk_vqdev;
 		vm->virtio_mmio_devices[VIRTIO_MMIO_BLOCK_DEV] = &blk_mmio_dev;
-		blk_init_fn(&blk_vqdev, disk_image_file);
 	}
-	net_init_fn(&net_vqdev, default_nic);
+
+	if (balloon_pages >= 0) {
+		balloon_mmio_dev.addr =
+		    virtio_mmio_base_addr + PGSIZE * VIRTIO_MMIO_BALLOON_DEV;
+		balloon_mmio_dev.vqdev = &balloon_vqdev;
+		vm->virtio_mmio_devices[VIRTIO_MMIO_BALLOON_DEV] = &balloon_mmio_dev;
+		balloon_set_target(&balloon_vqdev, balloon_pages);
+	}
+
+	if (p9_root != NULL) {
+		p9_mmio_dev.addr =
+		    virtio_mmio_base_addr + PGSIZE * VIRTIO_MMIO_9P_DEV;
+		p9_mmio_dev.vqdev = &p9_vqdev;
+		vm->virtio_mmio_devices[VIRTIO_MMIO_9P_DEV] = &p9_mmio_dev;
+	}
 
 	/* Set the kernel command line parameters */
 	a += 4096;
@@ -721,6 +866,21 @@ int main(int argc, char **argv)
 
 	vm->nr_gpcs = 1;
 	vm->gpcis = &gpci;
+	/* Guest core i gets pcore first + i + 1; tasks get the first. */
+	for (int i = 0; first_pcoreid >= 0 && i <= vm->nr_gpcs; i++) {
+		if (sys_provision(getpid(), RES_CORES, first_pcoreid + i)) {
+			fprintf(stderr, "Unable to provision pcore %d: %r\n",
+			        first_pcoreid + i);
+			exit(1);
+		}
+	}
+	net_init_fn(&net_vqdev, default_nic, vm->nr_gpcs);
+	if (vhost_net)
+		net_use_vhost(&net_vqdev);
+	if (disk_image_file != NULL)
+		blk_init_fn(&blk_vqdev, disk_image_file, vm->nr_gpcs);
+	if (p9_root != NULL)
+		p9_init_fn(vm, &p9_vqdev, p9_root, "hostfs");
 	ret = vmm_init(vm, vmmflags);
 	assert(!ret);
 
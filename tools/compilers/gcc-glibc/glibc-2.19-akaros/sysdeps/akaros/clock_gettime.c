@@ -12,12 +12,25 @@
 #include <sys/time.h>
 #include <parlib/timing.h>
 
+/* Neither clock needs a syscall: the TSC calibration and walltime offset are
+ * in procinfo.  The monotonic clocks are the time since boot, which can't jump
+ * when the walltime is resynced.  Anything else gets the walltime. */
 int __clock_gettime(clockid_t clk_id, struct timespec *tp)
 {
-	uint64_t epoch_ns = epoch_nsec();
+	uint64_t ns;
 
-	tp->tv_sec = epoch_ns / 1000000000;
-	tp->tv_nsec = epoch_ns % 1000000000;
+	switch (clk_id) {
+	case CLOCK_MONOTONIC:
+	case CLOCK_MONOTONIC_RAW:
+	case CLOCK_MONOTONIC_COARSE:
+		ns = nsec();
+		break;
+	default:
+		ns = epoch_nsec();
+		break;
+	}
+	tp->tv_sec = ns / 1000000000;
+	tp->tv_nsec = ns % 1000000000;
 	return 0;
 }
 weak_alias(__clock_gettime, clock_gettime)
@@ -0,0 +1,11 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * preadv() is preadv64(); off_t is 64 bits on all of our archs. */
+
+#include <sys/uio.h>
+
+ssize_t preadv(int fd, const struct iovec *vector, int count, off_t offset)
+{
+	return preadv64(fd, vector, count, offset);
+}
@@ -0,0 +1,14 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * preadv64() on SYS_preadv.  Like readv(), but at offset, without moving the
+ * file position. */
+
+#include <sys/uio.h>
+#include <ros/syscall.h>
+
+ssize_t preadv64(int fd, const struct iovec *vector, int count,
+                 __off64_t offset)
+{
+	return ros_syscall(SYS_preadv, fd, vector, count, offset, 0, 0);
+}
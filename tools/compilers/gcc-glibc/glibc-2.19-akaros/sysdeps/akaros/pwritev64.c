@@ -0,0 +1,14 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * pwritev64() on SYS_pwritev.  Like writev(), but at offset, without moving
+ * the file position. */
+
+#include <sys/uio.h>
+#include <ros/syscall.h>
+
+ssize_t pwritev64(int fd, const struct iovec *vector, int count,
+                  __off64_t offset)
+{
+	return ros_syscall(SYS_pwritev, fd, vector, count, offset, 0, 0);
+}
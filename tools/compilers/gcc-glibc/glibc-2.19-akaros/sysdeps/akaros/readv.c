@@ -0,0 +1,18 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * readv() on SYS_readv.  The kernel hands the whole vector to the file or
+ * device, instead of us reading into a bounce buffer. */
+
+#include <sys/uio.h>
+#include <ros/syscall.h>
+
+ssize_t
+__libc_readv (int fd, const struct iovec *vector, int count)
+{
+  return ros_syscall(SYS_readv, fd, vector, count, 0, 0, 0);
+}
+#ifndef __libc_readv
+strong_alias (__libc_readv, __readv)
+weak_alias (__libc_readv, readv)
+#endif
@@ -0,0 +1,12 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * sendfile() is sendfile64(); off_t is 64 bits on all of our archs. */
+
+#include <sys/sendfile.h>
+#include <sys/types.h>
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	return sendfile64(out_fd, in_fd, (__off64_t*)offset, count);
+}
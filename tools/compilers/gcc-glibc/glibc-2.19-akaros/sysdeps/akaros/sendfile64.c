@@ -0,0 +1,15 @@
+/* Copyright (c) 2016 Google Inc.
+ * See LICENSE for details.
+ *
+ * Implementation of glibc's sendfile interface, on SYS_sendfile.  in_fd must
+ * be a VFS file; out_fd can be any chan, and TCP conversations send straight
+ * from the page cache. */
+
+#include <sys/sendfile.h>
+#include <sys/types.h>
+#include <ros/syscall.h>
+
+ssize_t sendfile64(int out_fd, int in_fd, __off64_t *offset, size_t count)
+{
+	return ros_syscall(SYS_sendfile, out_fd, in_fd, offset, count, 0, 0);
+}
@@ -48,16 +48,34 @@ void subtract_timespecs(struct timespec *diff, const struct timespec *minuend,
 
 /* Declared in parlib/timing.h */
 
+/* The kernel could resync the walltime, so we read both halves of it under the
+ * seqctr. */
+static void read_walltime(uint64_t *walltime, uint64_t *cycles)
+{
+	seq_ctr_t *seqctr = &__proc_global_info.walltime_seqctr;
+	seq_ctr_t seq;
+
+	do {
+		seq = ACCESS_ONCE(*seqctr);
+		*walltime = __proc_global_info.walltime_ns_last;
+		*cycles = __proc_global_info.tsc_cycles_last;
+	} while (seqctr_retry(seq, ACCESS_ONCE(*seqctr)));
+}
+
 uint64_t epoch_nsec_to_tsc(uint64_t epoch_ns)
 {
-	return nsec2tsc(epoch_ns - __proc_global_info.walltime_ns_last) +
-	       __proc_global_info.tsc_cycles_last;
+	uint64_t walltime, cycles;
+
+	read_walltime(&walltime, &cycles);
+	return nsec2tsc(epoch_ns - walltime) + cycles;
 }
 
 uint64_t tsc_to_epoch_nsec(uint64_t tsc)
 {
-	return tsc2nsec(tsc - __proc_global_info.tsc_cycles_last) +
-	       __proc_global_info.walltime_ns_last;
+	uint64_t walltime, cycles;
+
+	read_walltime(&walltime, &cycles);
+	return tsc2nsec(tsc - cycles) + walltime;
 }
 
 uint64_t epoch_nsec(void)
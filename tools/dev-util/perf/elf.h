@@ -1,8 +1,30 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #define BUILD_ID_SIZE   20
 
+struct elf_symbol {
+	uint64_t start;
+	uint64_t end;
+	char *name;
+};
+
+/* The function symbols of one ELF file, sorted by address.  Addresses are ELF
+ * vaddrs; for ET_DYN objects, a file offset maps to a vaddr by adding
+ * text_bias. */
+struct elf_symtab {
+	struct elf_symbol *syms;
+	size_t nr_syms;
+	bool is_dyn;
+	uint64_t text_bias;
+};
+
 int filename__read_build_id(const char *filename, void *bf, size_t size);
+struct elf_symtab *filename__load_symtab(const char *filename);
+void elf_symtab__delete(struct elf_symtab *st);
+const struct elf_symbol *elf_symtab__find(const struct elf_symtab *st,
+					  uint64_t addr);
 void symbol__elf_init(void);
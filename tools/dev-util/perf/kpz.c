@@ -0,0 +1,388 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Inflates kpz frames, a frame at a time, behind a stdio FILE.
+ *
+ * There's no zlib for us to link against, so this has its own inflate.  It's
+ * the simple kind, after Mark Adler's puff: whole frames in memory, and Huffman
+ * codes decoded a bit at a time from canonical code counts.  That's plenty
+ * fast next to the rest of perf's processing. */
+
+#define _GNU_SOURCE
+#include <ros/kpz.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "xlib.h"
+#include "kpz.h"
+
+#define MAX_BITS 15
+#define MAX_LCODES 286
+#define MAX_DCODES 30
+#define FIX_LCODES 288
+
+struct inflate_state {
+	const uint8_t *in;
+	size_t in_len;
+	size_t in_off;
+	uint32_t bitbuf;
+	int bitcnt;
+	uint8_t *out;
+	size_t out_len;
+	size_t out_off;
+	jmp_buf bail;
+};
+
+struct huffman {
+	short count[MAX_BITS + 1];	/* number of codes of each length */
+	short symbol[FIX_LCODES];	/* in canonical order */
+};
+
+struct kpz_file {
+	FILE *raw;
+	uint8_t *buf;
+	size_t len;
+	size_t off;
+	unsigned long frame_nr;
+};
+
+static int get_bits(struct inflate_state *s, int need)
+{
+	uint32_t val = s->bitbuf;
+
+	while (s->bitcnt < need) {
+		if (s->in_off == s->in_len)
+			longjmp(s->bail, 1);
+		val |= (uint32_t)s->in[s->in_off++] << s->bitcnt;
+		s->bitcnt += 8;
+	}
+	s->bitbuf = val >> need;
+	s->bitcnt -= need;
+	return val & ((1U << need) - 1);
+}
+
+static void put_byte(struct inflate_state *s, uint8_t c)
+{
+	if (s->out_off == s->out_len)
+		longjmp(s->bail, 1);
+	s->out[s->out_off++] = c;
+}
+
+static void stored(struct inflate_state *s)
+{
+	unsigned int len;
+
+	s->bitbuf = 0;
+	s->bitcnt = 0;
+	if (s->in_off + 4 > s->in_len)
+		longjmp(s->bail, 1);
+	len = s->in[s->in_off] | (s->in[s->in_off + 1] << 8);
+	if ((s->in[s->in_off + 2] != (~len & 0xff)) ||
+		(s->in[s->in_off + 3] != ((~len >> 8) & 0xff)))
+		longjmp(s->bail, 1);
+	s->in_off += 4;
+	if ((s->in_off + len > s->in_len) || (s->out_off + len > s->out_len))
+		longjmp(s->bail, 1);
+	memcpy(s->out + s->out_off, s->in + s->in_off, len);
+	s->in_off += len;
+	s->out_off += len;
+}
+
+static int decode(struct inflate_state *s, const struct huffman *h)
+{
+	int code = 0, first = 0, index = 0, count;
+
+	for (int len = 1; len <= MAX_BITS; len++) {
+		code |= get_bits(s, 1);
+		count = h->count[len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+	longjmp(s->bail, 1);
+}
+
+/* Returns 0 for a complete code, > 0 for an incomplete one, and < 0 for an
+ * oversubscribed one. */
+static int construct(struct huffman *h, const short *length, int n)
+{
+	short offs[MAX_BITS + 1];
+	int left = 1;
+
+	memset(h->count, 0, sizeof(h->count));
+	for (int i = 0; i < n; i++)
+		h->count[length[i]]++;
+	if (h->count[0] == n)
+		return 0;
+	for (int len = 1; len <= MAX_BITS; len++) {
+		left = (left << 1) - h->count[len];
+		if (left < 0)
+			return left;
+	}
+	offs[1] = 0;
+	for (int len = 1; len < MAX_BITS; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (int i = 0; i < n; i++) {
+		if (length[i])
+			h->symbol[offs[length[i]]++] = i;
+	}
+	return left;
+}
+
+static void codes(struct inflate_state *s, const struct huffman *lencode,
+				  const struct huffman *distcode)
+{
+	static const short lbase[29] = {
+		3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	static const short lext[29] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	static const short dbase[30] = {
+		1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+		8193, 12289, 16385, 24577};
+	static const short dext[30] = {
+		0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+		12, 12, 13, 13};
+	int symbol, len;
+	size_t dist;
+
+	while ((symbol = decode(s, lencode)) != 256) {
+		if (symbol < 256) {
+			put_byte(s, symbol);
+			continue;
+		}
+		symbol -= 257;
+		if (symbol >= 29)
+			longjmp(s->bail, 1);
+		len = lbase[symbol] + get_bits(s, lext[symbol]);
+		symbol = decode(s, distcode);
+		if (symbol >= 30)
+			longjmp(s->bail, 1);
+		dist = dbase[symbol] + get_bits(s, dext[symbol]);
+		if (dist > s->out_off)
+			longjmp(s->bail, 1);
+		/* Byte at a time, since the copy can overlap itself */
+		while (len--)
+			put_byte(s, s->out[s->out_off - dist]);
+	}
+}
+
+static void fixed(struct inflate_state *s)
+{
+	static struct huffman lencode, distcode;
+	static bool built;
+	short lengths[FIX_LCODES];
+
+	if (!built) {
+		for (int i = 0; i < FIX_LCODES; i++)
+			lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+		construct(&lencode, lengths, FIX_LCODES);
+		for (int i = 0; i < MAX_DCODES; i++)
+			lengths[i] = 5;
+		construct(&distcode, lengths, MAX_DCODES);
+		built = TRUE;
+	}
+	codes(s, &lencode, &distcode);
+}
+
+static void dynamic(struct inflate_state *s)
+{
+	static const short order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+	short lengths[MAX_LCODES + MAX_DCODES];
+	struct huffman lencode, distcode;
+	int nlen, ndist, ncode, index, symbol, len, err;
+
+	nlen = get_bits(s, 5) + 257;
+	ndist = get_bits(s, 5) + 1;
+	ncode = get_bits(s, 4) + 4;
+	if (nlen > MAX_LCODES || ndist > MAX_DCODES)
+		longjmp(s->bail, 1);
+	for (index = 0; index < ncode; index++)
+		lengths[order[index]] = get_bits(s, 3);
+	for (; index < 19; index++)
+		lengths[order[index]] = 0;
+	if (construct(&lencode, lengths, 19))
+		longjmp(s->bail, 1);
+	for (index = 0; index < nlen + ndist;) {
+		symbol = decode(s, &lencode);
+		if (symbol < 16) {
+			lengths[index++] = symbol;
+			continue;
+		}
+		len = 0;
+		if (symbol == 16) {
+			if (!index)
+				longjmp(s->bail, 1);
+			len = lengths[index - 1];
+			symbol = 3 + get_bits(s, 2);
+		} else if (symbol == 17) {
+			symbol = 3 + get_bits(s, 3);
+		} else {
+			symbol = 11 + get_bits(s, 7);
+		}
+		if (index + symbol > nlen + ndist)
+			longjmp(s->bail, 1);
+		while (symbol--)
+			lengths[index++] = len;
+	}
+	if (!lengths[256])
+		longjmp(s->bail, 1);
+	/* Incomplete codes are only allowed for a single length or distance */
+	err = construct(&lencode, lengths, nlen);
+	if (err < 0 || (err > 0 && nlen - lencode.count[0] != 1))
+		longjmp(s->bail, 1);
+	err = construct(&distcode, lengths + nlen, ndist);
+	if (err < 0 || (err > 0 && ndist - distcode.count[0] != 1))
+		longjmp(s->bail, 1);
+	codes(s, &lencode, &distcode);
+}
+
+static uint32_t adler32(const uint8_t *buf, size_t len)
+{
+	uint32_t a = 1, b = 0;
+	size_t amt;
+
+	while (len) {
+		/* The most we can do before the sums could overflow */
+		amt = min(len, (size_t)5552);
+		len -= amt;
+		while (amt--) {
+			a += *buf++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+/* Inflates a zlib stream into exactly out_len bytes of out. */
+static bool zlib_inflate(const uint8_t *in, size_t in_len, uint8_t *out,
+						 size_t out_len)
+{
+	struct inflate_state s;
+	int last, type;
+	uint32_t check;
+
+	if ((in_len < 6) || ((in[0] & 0xf) != 8) || (in[1] & 0x20) ||
+		(((in[0] << 8) | in[1]) % 31))
+		return FALSE;
+	memset(&s, 0, sizeof(s));
+	s.in = in + 2;
+	s.in_len = in_len - 6;
+	s.out = out;
+	s.out_len = out_len;
+	if (setjmp(s.bail))
+		return FALSE;
+	do {
+		last = get_bits(&s, 1);
+		type = get_bits(&s, 2);
+		if (type == 0)
+			stored(&s);
+		else if (type == 1)
+			fixed(&s);
+		else if (type == 2)
+			dynamic(&s);
+		else
+			return FALSE;
+	} while (!last);
+	if (s.out_off != out_len)
+		return FALSE;
+	in += in_len - 4;
+	check = (in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+	return check == adler32(out, out_len);
+}
+
+/* Returns FALSE at the end of the file. */
+static bool kpz_next_frame(struct kpz_file *kf)
+{
+	struct kpz_hdr hdr;
+	uint8_t *zbuf;
+	size_t ret;
+
+	ret = fread(&hdr, 1, sizeof(hdr), kf->raw);
+	if (!ret)
+		return FALSE;
+	if ((ret != sizeof(hdr)) || (hdr.magic != KPZ_MAGIC)) {
+		fprintf(stderr, "Bad kpz frame header, frame %lu\n", kf->frame_nr);
+		exit(1);
+	}
+	zbuf = xmalloc(hdr.z_len);
+	if (fread(zbuf, 1, hdr.z_len, kf->raw) != hdr.z_len) {
+		fprintf(stderr, "Truncated kpz frame %lu\n", kf->frame_nr);
+		exit(1);
+	}
+	free(kf->buf);
+	kf->buf = xmalloc(max(hdr.raw_len, 1U));
+	if (!zlib_inflate(zbuf, hdr.z_len, kf->buf, hdr.raw_len)) {
+		fprintf(stderr, "Corrupt kpz frame %lu\n", kf->frame_nr);
+		exit(1);
+	}
+	free(zbuf);
+	kf->len = hdr.raw_len;
+	kf->off = 0;
+	kf->frame_nr++;
+	return TRUE;
+}
+
+static ssize_t kpz_read(void *cookie, char *buf, size_t size)
+{
+	struct kpz_file *kf = cookie;
+	size_t amt;
+
+	while (kf->off == kf->len) {
+		if (!kpz_next_frame(kf))
+			return 0;
+	}
+	amt = min(size, kf->len - kf->off);
+	memcpy(buf, kf->buf + kf->off, amt);
+	kf->off += amt;
+	return amt;
+}
+
+static int kpz_close(void *cookie)
+{
+	struct kpz_file *kf = cookie;
+	int ret = fclose(kf->raw);
+
+	free(kf->buf);
+	free(kf);
+	return ret;
+}
+
+bool kpz_is_compressed(FILE *file)
+{
+	uint32_t magic;
+	bool ret;
+
+	ret = (fread(&magic, 1, sizeof(magic), file) == sizeof(magic)) &&
+		  (magic == KPZ_MAGIC);
+	xfseek(file, 0, SEEK_SET);
+	return ret;
+}
+
+FILE *kpz_fopen(FILE *raw)
+{
+	static const cookie_io_functions_t kpz_io = {
+		.read = kpz_read,
+		.close = kpz_close,
+	};
+	struct kpz_file *kf = xzmalloc(sizeof(*kf));
+	FILE *file;
+
+	kf->raw = raw;
+	file = fopencookie(kf, "rb", kpz_io);
+	if (!file) {
+		perror("fopencookie");
+		exit(1);
+	}
+	return file;
+}
@@ -0,0 +1,15 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Reading the kpz frames from #kprof/kpdata.z (see ros/kpz.h). */
+
+#pragma once
+
+#include <ros/common.h>
+#include <stdio.h>
+
+/* Whether a seekable file starts with a kpz frame.  Leaves it at the start. */
+bool kpz_is_compressed(FILE *file);
+/* Returns a FILE that reads the inflated contents of raw, which it takes over:
+ * closing it closes raw. */
+FILE *kpz_fopen(FILE *raw);
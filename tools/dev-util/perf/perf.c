@@ -22,7 +22,9 @@
 #include "xlib.h"
 #include "akaros.h"
 #include "perfconv.h"
+#include "perfreport.h"
 #include "perf_core.h"
+#include "kpz.h"
 
 /* Helpers */
 static void run_process_and_wait(int argc, char *argv[],
@@ -33,6 +35,7 @@ static struct perf_context_config perf_cfg = {
 	.perf_file = "#arch/perf",
 	.kpctl_file = "#kprof/kpctl",
 	.kpdata_file = "#kprof/kpdata",
+	.kpdataz_file = "#kprof/kpdata.z",
 };
 
 static struct perfconv_context *cctx;
@@ -41,6 +44,7 @@ extern char **environ;	/* POSIX envp */
 
 struct perf_opts {
 	FILE						*outfile;
+	FILE						*infile;
 	const char					*events;
 	char						**cmd_argv;
 	int							cmd_argc;
@@ -50,7 +54,10 @@ struct perf_opts {
 	bool						sampling;
 	bool						stat_bignum;
 	bool						record_quiet;
+	bool						record_raw;
+	bool						record_compressed;
 	unsigned long				record_period;
+	struct perfreport_opts		report;
 };
 static struct perf_opts opts;
 
@@ -66,6 +73,7 @@ static int perf_list(struct perf_cmd *cmd, int argc, char *argv[]);
 static int perf_record(struct perf_cmd *cmd, int argc, char *argv[]);
 static int perf_stat(struct perf_cmd *cmd, int argc, char *argv[]);
 static int perf_pmu_caps(struct perf_cmd *cmd, int argc, char *argv[]);
+static int perf_report(struct perf_cmd *cmd, int argc, char *argv[]);
 
 static struct perf_cmd perf_cmds[] = {
 	{ .name = "help",
@@ -93,6 +101,11 @@ static struct perf_cmd perf_cmds[] = {
 	  .opts = "",
 	  .func = perf_pmu_caps,
 	},
+	{ .name = "report",
+	  .desc = "Reports top symbols or folded stacks from a raw trace",
+	  .opts = 0,
+	  .func = perf_report,
+	},
 };
 
 /**************************** perf help ****************************/
@@ -217,26 +230,33 @@ static error_t parse_collect_opt(int key, char *arg, struct argp_state *state)
 	return 0;
 }
 
-/* Helper, parses args using the collect_opts and the child parser for a given
- * cmd. */
-static void collect_argp(struct perf_cmd *cmd, int argc, char *argv[],
-                         struct argp_child *children, struct perf_opts *opts)
+/* Helper, rewrites the command name from foo to perf foo for the --help
+ * output. */
+static void set_cmd_name(struct perf_cmd *cmd, char *argv[])
 {
-	struct argp collect_opt = {collect_opts, parse_collect_opt,
-	                           collect_args_doc, cmd->desc, children};
 	char *cmd_name;
 	const char *fmt = "perf %s";
 	size_t cmd_sz = strlen(cmd->name) + strlen(fmt) + 1;
 
-	/* Rewrite the command name from foo to perf foo for the --help output */
 	cmd_name = xmalloc(cmd_sz);
 	snprintf(cmd_name, cmd_sz, fmt, cmd->name);
 	cmd_name[cmd_sz - 1] = '\0';
 	argv[0] = cmd_name;
-	argp_parse(&collect_opt, argc, argv, ARGP_IN_ORDER, 0, opts);
 	/* It's possible that someone could still be using cmd_name */
 }
 
+/* Helper, parses args using the collect_opts and the child parser for a given
+ * cmd. */
+static void collect_argp(struct perf_cmd *cmd, int argc, char *argv[],
+                         struct argp_child *children, struct perf_opts *opts)
+{
+	struct argp collect_opt = {collect_opts, parse_collect_opt,
+	                           collect_args_doc, cmd->desc, children};
+
+	set_cmd_name(cmd, argv);
+	argp_parse(&collect_opt, argc, argv, ARGP_IN_ORDER, 0, opts);
+}
+
 /* Helper, submits the events in opts to the kernel for monitoring. */
 static void submit_events(struct perf_opts *opts)
 {
@@ -249,8 +269,11 @@ static void submit_events(struct perf_opts *opts)
 		 tok = strtok_r(NULL, ",", &tok_save)) {
 
 		sel = perf_parse_event(tok);
-		PMEV_SET_INTEN(sel->ev.event, opts->sampling);
-		sel->ev.trigger_count = opts->record_period;
+		/* Uncore events can't sample, and their trigger_count is a filter */
+		if (!perfmon_is_uncore_event(&sel->ev)) {
+			PMEV_SET_INTEN(sel->ev.event, opts->sampling);
+			sel->ev.trigger_count = opts->record_period;
+		}
 		perf_context_event_submit(pctx, &opts->cores, sel);
 	}
 	free(dup_evts);
@@ -264,6 +287,8 @@ static struct argp_option record_opts[] = {
 	{"freq", 'F', "FREQUENCY", 0, "Sampling frequency (assumes cycles)"},
 	{"call-graph", 'g', 0, 0, "Backtrace recording (always on!)"},
 	{"quiet", 'q', 0, 0, "No printing to stdio"},
+	{"raw", 'R', 0, 0, "Save the raw kprof trace, for perf report"},
+	{"compress", 'z', 0, 0, "Have the kernel compress the trace (kept with -R)"},
 	{ 0 }
 };
 
@@ -304,6 +329,12 @@ static error_t parse_record_opt(int key, char *arg, struct argp_state *state)
 	case 'q':
 		p_opts->record_quiet = TRUE;
 		break;
+	case 'R':
+		p_opts->record_raw = TRUE;
+		break;
+	case 'z':
+		p_opts->record_compressed = TRUE;
+		break;
 	case ARGP_KEY_END:
 		if (!p_opts->events)
 			p_opts->events = "cycles";
@@ -322,6 +353,7 @@ static int perf_record(struct perf_cmd *cmd, int argc, char *argv[])
 {
 	struct argp argp_record = {record_opts, parse_record_opt};
 	struct argp_child children[] = { {&argp_record, 0, 0, 0}, {0} };
+	const char *kpdata;
 
 	collect_argp(cmd, argc, argv, children, &opts);
 	opts.sampling = TRUE;
@@ -338,12 +370,85 @@ static int perf_record(struct perf_cmd *cmd, int argc, char *argv[])
 	 * them off to minimize our impact. */
 	perf_stop_events(pctx);
 	/* Generate the Linux perf file format with the traces which have been
-	 * created during this operation. */
-	perf_convert_trace_data(cctx, perf_cfg.kpdata_file, opts.outfile);
+	 * created during this operation, or just save them for perf report. */
+	kpdata = opts.record_compressed ? perf_cfg.kpdataz_file
+	                                : perf_cfg.kpdata_file;
+	if (opts.record_raw)
+		perf_copy_trace_data(kpdata, opts.outfile);
+	else
+		perf_convert_trace_data(cctx, kpdata, opts.record_compressed,
+		                        opts.outfile);
 	fclose(opts.outfile);
 	return 0;
 }
 
+/**************************** perf report ************************/
+
+static struct argp_option report_opts[] = {
+	{"input", 'i', "FILE", 0, "Trace from perf record -R (default perf.data)"},
+	{"output", 'o', "FILE", 0, "Print output to file (default stdout)"},
+	{"kernel", 'k', "FILE", 0, "Kernel ELF, for kernel symbols"},
+	{"folded", 'f', 0, 0, "Print folded stacks, for flamegraph.pl"},
+	{"top", 'n', "N", 0, "Print the top N symbols (default 20, 0 for all)"},
+	{"offcpu", 'O', 0, 0, "Report time blocked instead of on-CPU samples"},
+	{ 0 }
+};
+
+static error_t parse_report_opt(int key, char *arg, struct argp_state *state)
+{
+	struct perf_opts *p_opts = state->input;
+
+	switch (key) {
+	case 'i':
+		p_opts->infile = xfopen(arg, "rb");
+		break;
+	case 'o':
+		p_opts->outfile = xfopen(arg, "w");
+		break;
+	case 'k':
+		p_opts->report.kernel_path = arg;
+		break;
+	case 'f':
+		p_opts->report.folded = TRUE;
+		break;
+	case 'n':
+		p_opts->report.top_n = atoi(arg);
+		break;
+	case 'O':
+		p_opts->report.offcpu = TRUE;
+		break;
+	case ARGP_KEY_ARG:
+		argp_usage(state);
+		break;
+	case ARGP_KEY_END:
+		if (!p_opts->infile)
+			p_opts->infile = xfopen("perf.data", "rb");
+		if (!p_opts->outfile)
+			p_opts->outfile = stdout;
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static int perf_report(struct perf_cmd *cmd, int argc, char *argv[])
+{
+	struct argp argp_report = {report_opts, parse_report_opt, 0, cmd->desc};
+
+	opts.report.top_n = 20;
+	set_cmd_name(cmd, argv);
+	argp_parse(&argp_report, argc, argv, 0, 0, &opts);
+	/* perf record -R -z saves the kernel's compressed trace */
+	if (kpz_is_compressed(opts.infile))
+		opts.infile = kpz_fopen(opts.infile);
+	perfreport_process_input(&opts.report, opts.infile, opts.outfile);
+	fclose(opts.infile);
+	if (opts.outfile != stdout)
+		fclose(opts.outfile);
+	return 0;
+}
+
 /**************************** perf stat  ************************/
 
 static struct argp_option stat_opts[] = {
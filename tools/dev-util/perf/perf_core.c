@@ -27,6 +27,7 @@
 #include "akaros.h"
 #include "perf_core.h"
 #include "elf.h"
+#include "kpz.h"
 
 struct perf_generic_event {
 	char						*name;
@@ -152,11 +153,55 @@ static void x86_handle_pseudo_encoding(struct perf_eventsel *sel)
 		fprintf(stderr, "Unhandled pseudo encoding %d\n", lower_byte);
 }
 
+/* Helper: tells the kernel which uncore box an event from one of pfm4's SNB-EP
+ * or IVB-EP uncore PMUs is for.  The CBo filter, if any, is pfm4's second
+ * code, and on IVB-EP, the third code is the filter's upper half.  Returns
+ * FALSE if pmu isn't an uncore PMU the kernel knows. */
+static bool x86_handle_uncore_encoding(struct perf_eventsel *sel, pfm_pmu_t pmu,
+                                       const pfm_pmu_encode_arg_t *encode)
+{
+	static const struct {
+		pfm_pmu_t first;
+		pfm_pmu_t last;
+		int box;
+	} uncore_pmus[] = {
+		{PFM_PMU_INTEL_SNBEP_UNC_CB0, PFM_PMU_INTEL_SNBEP_UNC_CB7,
+		 PERFMON_UNC_BOX_CBO},
+		{PFM_PMU_INTEL_SNBEP_UNC_IMC0, PFM_PMU_INTEL_SNBEP_UNC_IMC3,
+		 PERFMON_UNC_BOX_IMC},
+		{PFM_PMU_INTEL_SNBEP_UNC_QPI0, PFM_PMU_INTEL_SNBEP_UNC_QPI1,
+		 PERFMON_UNC_BOX_QPI},
+		{PFM_PMU_INTEL_IVBEP_UNC_CB0, PFM_PMU_INTEL_IVBEP_UNC_CB14,
+		 PERFMON_UNC_BOX_CBO},
+		{PFM_PMU_INTEL_IVBEP_UNC_IMC0, PFM_PMU_INTEL_IVBEP_UNC_IMC7,
+		 PERFMON_UNC_BOX_IMC},
+		{PFM_PMU_INTEL_IVBEP_UNC_QPI0, PFM_PMU_INTEL_IVBEP_UNC_QPI2,
+		 PERFMON_UNC_BOX_QPI},
+	};
+
+	for (int i = 0; i < COUNT_OF(uncore_pmus); i++) {
+		if ((pmu < uncore_pmus[i].first) || (pmu > uncore_pmus[i].last))
+			continue;
+		sel->ev.flags |= PERFMON_UNCORE_EVENT;
+		PMFL_SET_UNC_BOX(sel->ev.flags, uncore_pmus[i].box);
+		PMFL_SET_UNC_BOX_IDX(sel->ev.flags, pmu - uncore_pmus[i].first);
+		if (uncore_pmus[i].box != PERFMON_UNC_BOX_CBO)
+			return TRUE;
+		if (encode->count > 1)
+			sel->ev.trigger_count = encode->codes[1];
+		if (encode->count > 2)
+			sel->ev.trigger_count |= encode->codes[2] << 32;
+		return TRUE;
+	}
+	return FALSE;
+}
+
 /* Parse the string using pfm's lookup functions.  Returns TRUE on success and
  * fills in parts of sel. */
 static bool parse_pfm_encoding(const char *str, struct perf_eventsel *sel)
 {
 	pfm_pmu_encode_arg_t encode;
+	pfm_event_info_t info;
 	int err;
 	char *ptr;
 
@@ -174,7 +219,11 @@ static bool parse_pfm_encoding(const char *str, struct perf_eventsel *sel)
 		return FALSE;
 	}
 	sel->ev.event = encode.codes[0];
-	x86_handle_pseudo_encoding(sel);
+	ZERO_DATA(info);
+	info.size = sizeof(info);
+	if (pfm_get_event_info(encode.idx, PFM_OS_NONE, &info) ||
+	    !x86_handle_uncore_encoding(sel, info.pmu, &encode))
+		x86_handle_pseudo_encoding(sel);
 	sel->type = PERF_TYPE_RAW;
 	sel->config = PMEV_GET_MASK(sel->ev.event) | PMEV_GET_EVENT(sel->ev.event);
 	return TRUE;
@@ -461,13 +510,16 @@ static int perf_open_event(int perf_fd, const struct core_set *cores,
 	return (int) ped;
 }
 
+/* Returns each core's count for the event.  If the kernel multiplexed the
+ * event, the counts are scaled up by how long it was open over how long it was
+ * actually counting. */
 static uint64_t *perf_get_event_values(int perf_fd, int ped, size_t *pnvalues)
 {
 	ssize_t rsize;
 	uint32_t i, n;
 	uint64_t *values;
-	uint64_t temp;
-	size_t bufsize = sizeof(uint32_t) + MAX_NUM_CORES * sizeof(uint64_t);
+	uint64_t enabled, running;
+	size_t bufsize = sizeof(uint32_t) + 3 * MAX_NUM_CORES * sizeof(uint64_t);
 	uint8_t *cmdbuf = xmalloc(bufsize);
 	uint8_t *wptr = cmdbuf;
 	const uint8_t *rptr = cmdbuf;
@@ -492,6 +544,15 @@ static uint64_t *perf_get_event_values(int perf_fd, int ped, size_t *pnvalues)
 	values = xmalloc(n * sizeof(uint64_t));
 	for (i = 0; i < n; i++)
 		rptr = get_le_u64(rptr, values + i);
+	/* Older kernels don't send the times */
+	if (((rptr - cmdbuf) + 2 * n * sizeof(uint64_t)) <= rsize) {
+		for (i = 0; i < n; i++) {
+			get_le_u64(rptr + i * sizeof(uint64_t), &enabled);
+			get_le_u64(rptr + (n + i) * sizeof(uint64_t), &running);
+			if (running && (running < enabled))
+				values[i] = (uint64_t)((double)values[i] * enabled / running);
+		}
+	}
 	free(cmdbuf);
 
 	*pnvalues = n;
@@ -760,16 +821,31 @@ void perf_show_events(const char *rx, FILE *file)
 }
 
 void perf_convert_trace_data(struct perfconv_context *cctx, const char *input,
-							 FILE *outfile)
+							 bool compressed, FILE *outfile)
 {
 	FILE *infile;
 	size_t ksize;
 
 	infile = xfopen(input, "rb");
 	if (xfsize(infile) > 0) {
+		if (compressed)
+			infile = kpz_fopen(infile);
 		perfconv_add_kernel_mmap(cctx);
 		perfconv_add_kernel_buildid(cctx);
 		perfconv_process_input(cctx, infile, outfile);
 	}
 	fclose(infile);
 }
+
+/* Saves the raw kprof trace, for perf report. */
+void perf_copy_trace_data(const char *input, FILE *outfile)
+{
+	FILE *infile;
+	char buf[4096];
+	size_t ret;
+
+	infile = xfopen(input, "rb");
+	while ((ret = fread(buf, 1, sizeof(buf), infile)) > 0)
+		xfwrite(buf, ret, outfile);
+	fclose(infile);
+}
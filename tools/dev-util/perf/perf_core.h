@@ -45,6 +45,7 @@ struct perf_context_config {
 	const char *perf_file;
 	const char *kpctl_file;
 	const char *kpdata_file;
+	const char *kpdataz_file;
 };
 
 struct perf_context {
@@ -70,8 +71,10 @@ void perf_stop_sampling(struct perf_context *pctx);
 uint64_t perf_get_event_count(struct perf_context *pctx, unsigned int idx);
 void perf_context_show_events(struct perf_context *pctx, FILE *file);
 void perf_show_events(const char *rx, FILE *file);
+/* compressed is for kpz frames, like #kprof/kpdata.z's */
 void perf_convert_trace_data(struct perfconv_context *cctx, const char *input,
-							 FILE *outfile);
+							 bool compressed, FILE *outfile);
+void perf_copy_trace_data(const char *input, FILE *outfile);
 
 static inline const struct perf_arch_info *perf_context_get_arch_info(
 	const struct perf_context *pctx)
@@ -32,7 +32,6 @@
 #include "elf.h"
 
 #define MAX_PERF_RECORD_SIZE (32 * 1024 * 1024)
-#define PERF_RECORD_BUFFER_SIZE 1024
 #define OFFSET_NORELOC ((uint64_t) -1)
 #define MEMFILE_BLOCK_SIZE (64 * 1024)
 
@@ -40,13 +39,6 @@
 
 char *cmd_line_save;
 
-struct perf_record {
-	uint64_t type;
-	uint64_t size;
-	char *data;
-	char buffer[PERF_RECORD_BUFFER_SIZE];
-};
-
 static void dbg_print(struct perfconv_context *cctx, int level, FILE *file,
 					  const char *fmt, ...)
 {
@@ -64,14 +56,14 @@ void perfconv_set_dbglevel(int level, struct perfconv_context *cctx)
 	cctx->debug_level = level;
 }
 
-static void free_record(struct perf_record *pr)
+void perfconv_free_record(struct perf_record *pr)
 {
 	if (pr->data != pr->buffer)
 		free(pr->data);
 	pr->data = NULL;
 }
 
-static int read_record(FILE *file, struct perf_record *pr)
+int perfconv_read_record(FILE *file, struct perf_record *pr)
 {
 	if (vb_fdecode_uint64(file, &pr->type) == EOF ||
 		vb_fdecode_uint64(file, &pr->size) == EOF)
@@ -685,6 +677,71 @@ static void emit_kernel_trace64(struct perf_record *pr,
 	free(xrec);
 }
 
+/* Off-CPU samples aren't from any of our eventsels, so they get their own
+ * stream.  Eventsel IDs are pointers, so they'll never be 1. */
+#define PERFCONV_OFFCPU_ID		1
+
+/* Each off-CPU sample is one block of a kthread, weighted by the nsec it was
+ * blocked.  We call it a context switch, which is close enough for perf. */
+static uint64_t perfconv_get_offcpu_id(struct perfconv_context *cctx)
+{
+	struct perf_event_attr attr;
+
+	if (cctx->offcpu_attr_emitted)
+		return PERFCONV_OFFCPU_ID;
+	ZERO_DATA(attr);
+	attr.size = sizeof(attr);
+	attr.mmap = 1;
+	attr.comm = 1;
+	attr.sample_period = 1;
+	/* Closely coupled with struct perf_record_period_sample */
+	attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+	                   PERF_SAMPLE_ADDR | PERF_SAMPLE_IDENTIFIER |
+	                   PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD |
+	                   PERF_SAMPLE_CALLCHAIN;
+	attr.exclude_guest = 1;
+	attr.exclude_hv = 1;
+	attr.exclude_user = 1;
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+	emit_attr(&cctx->attrs, &cctx->attr_ids, &attr, PERFCONV_OFFCPU_ID);
+	cctx->offcpu_attr_emitted = TRUE;
+	return PERFCONV_OFFCPU_ID;
+}
+
+static void emit_offcpu_trace64(struct perf_record *pr,
+								struct perfconv_context *cctx)
+{
+	struct proftype_offcpu_trace64 *rec = (struct proftype_offcpu_trace64 *)
+		pr->data;
+	size_t size = sizeof(struct perf_record_period_sample) +
+		(rec->num_traces - 1) * sizeof(uint64_t);
+	struct perf_record_period_sample *xrec = xzmalloc(size);
+
+	xrec->header.type = PERF_RECORD_SAMPLE;
+	xrec->header.misc = PERF_RECORD_MISC_KERNEL;
+	xrec->header.size = size;
+	xrec->ip = rec->trace[0];
+	if (rec->pid == -1) {
+		xrec->pid = -1;
+		xrec->tid = 0;
+	} else {
+		xrec->pid = rec->pid;
+		xrec->tid = rec->pid;
+	}
+	xrec->time = rec->tstamp;
+	xrec->addr = rec->trace[0];
+	xrec->identifier = perfconv_get_offcpu_id(cctx);
+	xrec->cpu = rec->cpu;
+	xrec->period = rec->duration;
+	xrec->nr = rec->num_traces - 1;
+	memcpy(xrec->ips, rec->trace + 1, (rec->num_traces - 1) * sizeof(uint64_t));
+
+	mem_file_write(&cctx->data, xrec, size, 0);
+
+	free(xrec);
+}
+
 static void emit_user_trace64(struct perf_record *pr,
 							  struct perfconv_context *cctx)
 {
@@ -760,7 +817,7 @@ void perfconv_process_input(struct perfconv_context *cctx, FILE *input,
 
 	emit_static_mmaps(cctx);
 
-	while (read_record(input, &pr) == 0) {
+	while (perfconv_read_record(input, &pr) == 0) {
 		dbg_print(cctx, 8, stderr, "Valid record: type=%lu size=%lu\n",
 				  pr.type, pr.size);
 
@@ -779,14 +836,23 @@ void perfconv_process_input(struct perfconv_context *cctx, FILE *input,
 		case PROFTYPE_NEW_PROCESS:
 			emit_new_process(&pr, cctx);
 			break;
+		case PROFTYPE_OFFCPU_TRACE64:
+			emit_offcpu_trace64(&pr, cctx);
+			break;
+		case PROFTYPE_DROPPED:
+			cctx->nr_dropped +=
+				((struct proftype_dropped *) pr.data)->nr_dropped;
+			break;
 		default:
 			fprintf(stderr, "Unknown record: type=%lu size=%lu\n", pr.type,
 					pr.size);
 			processed_records--;
 		}
 
-		free_record(&pr);
+		perfconv_free_record(&pr);
 	}
+	if (cctx->nr_dropped)
+		fprintf(stderr, "The kernel dropped %lu samples\n", cctx->nr_dropped);
 
 	/* Add all of the headers before outputting ph */
 	headers_build(&cctx->ph, &cctx->hdrs, &cctx->fhdrs);
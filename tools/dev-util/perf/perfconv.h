@@ -19,6 +19,8 @@
 #include "xlib.h"
 #include "perf_format.h"
 
+#define PERF_RECORD_BUFFER_SIZE 1024
+
 struct mem_file_reloc {
 	struct mem_file_reloc *next;
 	uint64_t *ptr;
@@ -58,6 +60,14 @@ struct perf_event_id {
 	uint64_t id;
 };
 
+/* One kprof record.  data points into buffer for small records. */
+struct perf_record {
+	uint64_t type;
+	uint64_t size;
+	char *data;
+	char buffer[PERF_RECORD_BUFFER_SIZE];
+};
+
 struct perfconv_context {
 	struct perf_context *pctx;
 	int debug_level;
@@ -65,6 +75,8 @@ struct perfconv_context {
 	struct perf_header ph;
 	struct perf_headers hdrs;
 	struct mem_file fhdrs, attr_ids, attrs, data, event_types;
+	uint64_t nr_dropped;	/* samples the kernel couldn't record */
+	bool offcpu_attr_emitted;
 };
 
 extern char *cmd_line_save;
@@ -76,3 +88,5 @@ void perfconv_add_kernel_mmap(struct perfconv_context *cctx);
 void perfconv_add_kernel_buildid(struct perfconv_context *cctx);
 void perfconv_process_input(struct perfconv_context *cctx, FILE *input,
 							FILE *output);
+int perfconv_read_record(FILE *file, struct perf_record *pr);
+void perfconv_free_record(struct perf_record *pr);
@@ -0,0 +1,403 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Reports on kprof profiler files without going through Linux perf.
+ *
+ * We stream the input one record at a time, so the profile never needs to fit
+ * in memory.  What we keep grows with the number of distinct stacks or symbols,
+ * not with the number of samples: a hash of stacks or symbols to their weights,
+ * the processes' mmaps, and the symbol tables of the objects they mapped.
+ *
+ * Symbols come from the ELF files themselves, via symbol-elf.c.  The mmap
+ * records tell us which object and offset a user IP is at.  Kernel IPs are
+ * resolved against the kernel ELF, if we were given one.
+ *
+ * Folded stacks are one line per distinct stack, root first, which is what
+ * FlameGraph's flamegraph.pl takes:
+ *
+ *		comm;outer_func;...;leaf_func weight
+ *
+ * Kernel frames get a _[k] suffix, which flamegraph.pl colors differently.
+ * On-CPU samples weigh 1 each.  In offcpu mode, we only look at the off-CPU
+ * samples, and each weighs the nsec it was blocked. */
+
+#include <ros/common.h>
+#include <ros/profiler_records.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "xlib.h"
+#include "elf.h"
+#include "perfconv.h"
+#include "perfreport.h"
+
+#define REPORT_HASH_SZ			(1 << 16)	/* power of two */
+#define REPORT_PID_HASH_SZ		256
+#define REPORT_MAX_SYM_KEY		512
+#define REPORT_NO_PID			((uint32_t) -1)
+
+struct report_dso {
+	struct report_dso			*next;
+	char						*path;
+	const char					*name;		/* basename of path */
+	struct elf_symtab			*symtab;	/* NULL if we couldn't load it */
+};
+
+struct report_mmap {
+	struct report_mmap			*next;
+	uint64_t					addr;
+	uint64_t					size;
+	uint64_t					offset;
+	struct report_dso			*dso;
+};
+
+struct report_proc {
+	struct report_proc			*next;
+	uint32_t					pid;
+	char						*comm;
+	struct report_mmap			*mmaps;		/* newest first */
+};
+
+/* A folded stack or a symbol, hashed by its string */
+struct report_entry {
+	struct report_entry			*next;
+	uint64_t					hash;
+	uint64_t					self;
+	uint64_t					total;
+	uint64_t					last_sample;	/* to count total once */
+	char						key[0];
+};
+
+struct report_ctx {
+	const struct perfreport_opts *ropts;
+	struct report_dso			*dsos;
+	struct report_dso			*kernel_dso;
+	struct report_proc			*procs[REPORT_PID_HASH_SZ];
+	struct report_entry			**table;
+	size_t						nr_entries;
+	uint64_t					nr_samples;
+	uint64_t					total_weight;
+	uint64_t					nr_dropped;
+	char						*buf;		/* folded stack being built */
+	size_t						buf_sz;
+	size_t						buf_len;
+};
+
+/* FNV-1a */
+static uint64_t report_hash(const char *s)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (; *s; s++) {
+		hash ^= (uint8_t) *s;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static struct report_entry *report_get_entry(struct report_ctx *rctx,
+                                             const char *key)
+{
+	uint64_t hash = report_hash(key);
+	struct report_entry **head = &rctx->table[hash & (REPORT_HASH_SZ - 1)];
+	struct report_entry *ent;
+
+	for (ent = *head; ent; ent = ent->next) {
+		if (ent->hash == hash && !strcmp(ent->key, key))
+			return ent;
+	}
+	ent = xzmalloc(sizeof(struct report_entry) + strlen(key) + 1);
+	ent->hash = hash;
+	strcpy(ent->key, key);
+	ent->next = *head;
+	*head = ent;
+	rctx->nr_entries++;
+	return ent;
+}
+
+/* There are only a handful of distinct objects, so a list is fine. */
+static struct report_dso *report_get_dso(struct report_ctx *rctx,
+                                         const char *path)
+{
+	struct report_dso *dso;
+	const char *slash;
+
+	for (dso = rctx->dsos; dso; dso = dso->next) {
+		if (!strcmp(dso->path, path))
+			return dso;
+	}
+	dso = xzmalloc(sizeof(struct report_dso));
+	dso->path = xstrdup(path);
+	slash = strrchr(dso->path, '/');
+	dso->name = slash ? slash + 1 : dso->path;
+	dso->symtab = filename__load_symtab(path);
+	if (!dso->symtab)
+		fprintf(stderr, "No symbols for %s\n", path);
+	dso->next = rctx->dsos;
+	rctx->dsos = dso;
+	return dso;
+}
+
+static struct report_proc *report_get_proc(struct report_ctx *rctx,
+                                           uint32_t pid)
+{
+	struct report_proc **head = &rctx->procs[pid % REPORT_PID_HASH_SZ];
+	struct report_proc *proc;
+
+	for (proc = *head; proc; proc = proc->next) {
+		if (proc->pid == pid)
+			return proc;
+	}
+	proc = xzmalloc(sizeof(struct report_proc));
+	proc->pid = pid;
+	proc->next = *head;
+	*head = proc;
+	return proc;
+}
+
+static void report_append(struct report_ctx *rctx, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (rctx->buf_len + len + 1 > rctx->buf_sz) {
+		rctx->buf_sz = max(rctx->buf_sz * 2, rctx->buf_len + len + 1);
+		rctx->buf = realloc(rctx->buf, rctx->buf_sz);
+		if (!rctx->buf) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(rctx->buf + rctx->buf_len, str, len + 1);
+	rctx->buf_len += len;
+}
+
+/* Returns the name of the function at ip, or NULL if we don't know it.  Either
+ * way, dso_name is the name of the object ip is in. */
+static const char *report_resolve(struct report_ctx *rctx,
+                                  struct report_proc *proc, uint64_t ip,
+                                  bool kernel, const char **dso_name)
+{
+	struct report_mmap *mm = NULL;
+	struct report_dso *dso = NULL;
+	const struct elf_symbol *sym;
+	uint64_t addr = ip;
+
+	if (kernel) {
+		dso = rctx->kernel_dso;
+	} else if (proc) {
+		for (mm = proc->mmaps; mm; mm = mm->next) {
+			if (ip >= mm->addr && ip < mm->addr + mm->size)
+				break;
+		}
+		if (mm)
+			dso = mm->dso;
+	}
+	if (!dso) {
+		*dso_name = kernel ? "kernel" : "unknown";
+		return NULL;
+	}
+	*dso_name = dso->name;
+	if (!dso->symtab)
+		return NULL;
+	/* Shared objects' symbols are relative to wherever they were mapped */
+	if (mm && dso->symtab->is_dyn)
+		addr = ip - mm->addr + mm->offset + dso->symtab->text_bias;
+	sym = elf_symtab__find(dso->symtab, addr);
+	return sym ? sym->name : NULL;
+}
+
+/* trace is an array of IPs, leaf first, straight out of a packed record. */
+static void report_sample(struct report_ctx *rctx, uint32_t pid,
+                          const void *trace, size_t nr_traces, bool kernel,
+                          uint64_t weight)
+{
+	struct report_proc *proc = NULL;
+	struct report_entry *ent;
+	const char *name, *dso_name;
+	char key[REPORT_MAX_SYM_KEY];
+	uint64_t ip;
+
+	if (!nr_traces)
+		return;
+	if (pid != REPORT_NO_PID)
+		proc = report_get_proc(rctx, pid);
+	rctx->nr_samples++;
+	rctx->total_weight += weight;
+	rctx->buf_len = 0;
+	if (proc && proc->comm)
+		report_append(rctx, proc->comm);
+	else
+		report_append(rctx, pid == REPORT_NO_PID ? "kernel" : "unknown");
+	for (size_t i = nr_traces; i-- > 0; ) {
+		memcpy(&ip, trace + i * sizeof(uint64_t), sizeof(uint64_t));
+		name = report_resolve(rctx, proc, ip, kernel, &dso_name);
+		if (rctx->ropts->folded) {
+			report_append(rctx, ";");
+			if (name) {
+				report_append(rctx, name);
+			} else {
+				report_append(rctx, "[");
+				report_append(rctx, dso_name);
+				report_append(rctx, "]");
+			}
+			if (kernel)
+				report_append(rctx, "_[k]");
+			continue;
+		}
+		if (name)
+			snprintf(key, sizeof(key), "%s [%s]", name, dso_name);
+		else
+			snprintf(key, sizeof(key), "%#lx [%s]", ip, dso_name);
+		ent = report_get_entry(rctx, key);
+		if (i == 0)
+			ent->self += weight;
+		/* Recursion puts a symbol in a stack more than once */
+		if (ent->last_sample != rctx->nr_samples) {
+			ent->last_sample = rctx->nr_samples;
+			ent->total += weight;
+		}
+	}
+	if (rctx->ropts->folded)
+		report_get_entry(rctx, rctx->buf)->self += weight;
+}
+
+static void report_pid_mmap64(struct report_ctx *rctx, struct perf_record *pr)
+{
+	struct proftype_pid_mmap64 *rec = (struct proftype_pid_mmap64 *) pr->data;
+	struct report_proc *proc = report_get_proc(rctx, rec->pid);
+	struct report_mmap *mm = xzmalloc(sizeof(struct report_mmap));
+
+	mm->addr = rec->addr;
+	mm->size = rec->size;
+	mm->offset = rec->offset;
+	mm->dso = report_get_dso(rctx, (char*) rec->path);
+	mm->next = proc->mmaps;
+	proc->mmaps = mm;
+}
+
+/* An exec gets a new process record after its mmaps, so we keep the mmaps we
+ * have.  The new ones shadow the old. */
+static void report_new_process(struct report_ctx *rctx, struct perf_record *pr)
+{
+	struct proftype_new_process *rec = (struct proftype_new_process *) pr->data;
+	struct report_proc *proc = report_get_proc(rctx, rec->pid);
+	const char *comm;
+
+	comm = strrchr((char*) rec->path, '/');
+	if (!comm)
+		comm = (char*) rec->path;
+	else
+		comm++;
+	free(proc->comm);
+	proc->comm = xstrdup(comm);
+}
+
+static void report_print_folded(struct report_ctx *rctx, FILE *output)
+{
+	struct report_entry *ent;
+
+	for (size_t i = 0; i < REPORT_HASH_SZ; i++) {
+		for (ent = rctx->table[i]; ent; ent = ent->next)
+			fprintf(output, "%s %lu\n", ent->key, ent->self);
+	}
+}
+
+static int report_cmp_entry(const void *a, const void *b)
+{
+	const struct report_entry *ea = *(const struct report_entry **) a;
+	const struct report_entry *eb = *(const struct report_entry **) b;
+
+	if (ea->self != eb->self)
+		return ea->self < eb->self ? 1 : -1;
+	if (ea->total != eb->total)
+		return ea->total < eb->total ? 1 : -1;
+	return strcmp(ea->key, eb->key);
+}
+
+static void report_print_top(struct report_ctx *rctx, FILE *output)
+{
+	struct report_entry **ents, *ent;
+	size_t nr = 0, nr_print;
+	double total = rctx->total_weight ? rctx->total_weight : 1;
+
+	ents = xmalloc(max(rctx->nr_entries, 1) * sizeof(struct report_entry *));
+	for (size_t i = 0; i < REPORT_HASH_SZ; i++) {
+		for (ent = rctx->table[i]; ent; ent = ent->next)
+			ents[nr++] = ent;
+	}
+	qsort(ents, nr, sizeof(struct report_entry *), report_cmp_entry);
+	nr_print = rctx->ropts->top_n ? min(rctx->ropts->top_n, nr) : nr;
+
+	fprintf(output, "# Samples: %lu", rctx->nr_samples);
+	if (rctx->nr_dropped)
+		fprintf(output, " (%lu dropped)", rctx->nr_dropped);
+	fprintf(output, "\n# Weight: %s\n#\n", rctx->ropts->offcpu ?
+	        "nsec blocked" : "samples");
+	fprintf(output, "#    Self    Total        Weight  Symbol\n");
+	for (size_t i = 0; i < nr_print; i++)
+		fprintf(output, "%7.2f%% %7.2f%% %13lu  %s\n",
+		        ents[i]->self * 100 / total, ents[i]->total * 100 / total,
+		        ents[i]->self, ents[i]->key);
+	free(ents);
+}
+
+/* Like perfconv, we don't bother freeing what we built; perf exits soon. */
+void perfreport_process_input(const struct perfreport_opts *ropts,
+                              FILE *input, FILE *output)
+{
+	struct report_ctx *rctx = xzmalloc(sizeof(struct report_ctx));
+	struct perf_record pr;
+	struct proftype_kern_trace64 *krec;
+	struct proftype_user_trace64 *urec;
+	struct proftype_offcpu_trace64 *orec;
+
+	rctx->ropts = ropts;
+	rctx->table = xzmalloc(REPORT_HASH_SZ * sizeof(struct report_entry *));
+	if (ropts->kernel_path)
+		rctx->kernel_dso = report_get_dso(rctx, ropts->kernel_path);
+
+	while (perfconv_read_record(input, &pr) == 0) {
+		switch (pr.type) {
+		case PROFTYPE_KERN_TRACE64:
+			krec = (struct proftype_kern_trace64 *) pr.data;
+			if (!ropts->offcpu)
+				report_sample(rctx, krec->pid, krec->trace, krec->num_traces,
+				              TRUE, 1);
+			break;
+		case PROFTYPE_USER_TRACE64:
+			urec = (struct proftype_user_trace64 *) pr.data;
+			if (!ropts->offcpu)
+				report_sample(rctx, urec->pid, urec->trace, urec->num_traces,
+				              FALSE, 1);
+			break;
+		case PROFTYPE_OFFCPU_TRACE64:
+			orec = (struct proftype_offcpu_trace64 *) pr.data;
+			if (ropts->offcpu)
+				report_sample(rctx, orec->pid, orec->trace, orec->num_traces,
+				              TRUE, orec->duration);
+			break;
+		case PROFTYPE_PID_MMAP64:
+			report_pid_mmap64(rctx, &pr);
+			break;
+		case PROFTYPE_NEW_PROCESS:
+			report_new_process(rctx, &pr);
+			break;
+		case PROFTYPE_DROPPED:
+			rctx->nr_dropped +=
+				((struct proftype_dropped *) pr.data)->nr_dropped;
+			break;
+		default:
+			fprintf(stderr, "Unknown record: type=%lu size=%lu\n", pr.type,
+					pr.size);
+		}
+		perfconv_free_record(&pr);
+	}
+	if (rctx->nr_dropped)
+		fprintf(stderr, "The kernel dropped %lu samples\n", rctx->nr_dropped);
+
+	if (ropts->folded)
+		report_print_folded(rctx, output);
+	else
+		report_print_top(rctx, output);
+}
@@ -0,0 +1,20 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Reports straight from kprof profiler files: folded stacks for flame graphs,
+ * or the top symbols by sample count.  See perfreport.c. */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+
+struct perfreport_opts {
+	const char					*kernel_path;	/* kernel ELF, or NULL */
+	bool						folded;
+	bool						offcpu;
+	unsigned int				top_n;			/* 0 for all */
+};
+
+void perfreport_process_input(const struct perfreport_opts *ropts,
+                              FILE *input, FILE *output);
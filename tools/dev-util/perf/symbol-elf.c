@@ -5,6 +5,7 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
@@ -295,6 +296,146 @@ out:
 	return err;
 }
 
+static int elf_symbol__cmp(const void *a, const void *b)
+{
+	const struct elf_symbol *sa = a, *sb = b;
+
+	if (sa->start < sb->start)
+		return -1;
+	return sa->start > sb->start;
+}
+
+/* The text segment's vaddr minus its file offset */
+static uint64_t elf_text_bias(Elf *elf)
+{
+	GElf_Phdr phdr;
+	size_t nr_phdrs;
+
+	if (elf_getphdrnum(elf, &nr_phdrs))
+		return 0;
+	for (size_t i = 0; i < nr_phdrs; i++) {
+		if (!gelf_getphdr(elf, i, &phdr))
+			continue;
+		if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X))
+			return phdr.p_vaddr - phdr.p_offset;
+	}
+	return 0;
+}
+
+static int elf_load_symtab(Elf *elf, struct elf_symtab *st)
+{
+	GElf_Ehdr ehdr;
+	GElf_Shdr shdr;
+	GElf_Sym sym;
+	Elf_Data *syms, *symstrs;
+	Elf_Scn *sec, *sec_strndx;
+	uint32_t nr_syms, idx;
+	size_t nr = 0;
+
+	if (gelf_getehdr(elf, &ehdr) == NULL)
+		return -1;
+
+	/* Prefer the full .symtab; stripped objects only have .dynsym. */
+	sec = elf_section_by_name(elf, &ehdr, &shdr, ".symtab", NULL);
+	if (sec == NULL)
+		sec = elf_section_by_name(elf, &ehdr, &shdr, ".dynsym", NULL);
+	if (sec == NULL || shdr.sh_entsize == 0)
+		return -1;
+
+	syms = elf_getdata(sec, NULL);
+	if (syms == NULL)
+		return -1;
+	sec_strndx = elf_getscn(elf, shdr.sh_link);
+	if (sec_strndx == NULL)
+		return -1;
+	symstrs = elf_getdata(sec_strndx, NULL);
+	if (symstrs == NULL)
+		return -1;
+
+	nr_syms = shdr.sh_size / shdr.sh_entsize;
+	st->syms = xmalloc(nr_syms * sizeof(struct elf_symbol));
+	elf_symtab__for_each_symbol(syms, nr_syms, idx, sym) {
+		if (!elf_sym__is_function(&sym))
+			continue;
+		st->syms[nr].start = sym.st_value;
+		st->syms[nr].end = sym.st_value + sym.st_size;
+		st->syms[nr].name = xstrdup(elf_sym__name(&sym, symstrs));
+		nr++;
+	}
+	qsort(st->syms, nr, sizeof(struct elf_symbol), elf_symbol__cmp);
+
+	/* Assembly functions often have no size; they run up to the next one. */
+	for (size_t i = 0; i < nr; i++) {
+		if (st->syms[i].end == st->syms[i].start && i + 1 < nr)
+			st->syms[i].end = st->syms[i + 1].start;
+	}
+	st->nr_syms = nr;
+	st->is_dyn = ehdr.e_type == ET_DYN;
+	st->text_bias = elf_text_bias(elf);
+	return 0;
+}
+
+/* Returns NULL if filename isn't an ELF file with a symbol table. */
+struct elf_symtab *filename__load_symtab(const char *filename)
+{
+	struct elf_symtab *st;
+	int fd, err;
+	Elf *elf;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	elf = elf_begin(fd, PERF_ELF_C_READ_MMAP, NULL);
+	if (elf == NULL) {
+		pr_debug2("%s: cannot read %s ELF file.\n", __func__, filename);
+		close(fd);
+		return NULL;
+	}
+
+	st = xzmalloc(sizeof(struct elf_symtab));
+	err = elf_load_symtab(elf, st);
+
+	elf_end(elf);
+	close(fd);
+	if (err) {
+		elf_symtab__delete(st);
+		return NULL;
+	}
+	return st;
+}
+
+void elf_symtab__delete(struct elf_symtab *st)
+{
+	if (st == NULL)
+		return;
+	for (size_t i = 0; i < st->nr_syms; i++)
+		free(st->syms[i].name);
+	free(st->syms);
+	free(st);
+}
+
+/* Finds the function containing addr, or NULL. */
+const struct elf_symbol *elf_symtab__find(const struct elf_symtab *st,
+					  uint64_t addr)
+{
+	size_t lo = 0, hi = st->nr_syms, mid;
+	const struct elf_symbol *sym;
+
+	/* Find the last symbol starting at or below addr */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (st->syms[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	sym = &st->syms[lo - 1];
+	return addr < sym->end ? sym : NULL;
+}
+
 void symbol__elf_init(void)
 {
 	elf_version(EV_CURRENT);
@@ -9,6 +9,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <packetizer.h>
+#include <stdlib.h>
+#include <getopt.h>
 #include <stdexcept>
 #include <fstream>
 
@@ -26,9 +28,22 @@ read_tsc(void)
     return tsc;
 }
 
+static uint64_t now_usec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
 packetizer::packetizer(const char *target_mac, const char *eth_device, 
-	                     const char *filename)
+	                     const char *filename, int payload_size, int window)
 {
+	if(payload_size <= 0 || payload_size > MAX_PAYLOAD_SIZE)
+	  throw std::runtime_error("bad payload size!");
+	if(window < 0 || window > MAX_WINDOW)
+	  throw std::runtime_error("bad window size!");
+	this->payload_size = payload_size;
+	this->window = window;
 	seqno = 0;
 	memcpy(this->target_mac, target_mac, 6);
 	strcpy(this->eth_device, eth_device);
@@ -64,14 +79,31 @@ packetizer::packetizer(const char *target_mac, const char *eth_device,
 	memcpy(&host_mac, &ifr.ifr_ifru.ifru_hwaddr.sa_data, 6);
 }
 
+void packetizer::send_packet(packet* p)
+{
+	int ret = ::sendto(sock, (char*)p, p->size(), 0,
+	                   (sockaddr*)&myaddr,sizeof(myaddr));
+	if (ret < 0)
+	  throw std::runtime_error("sending packet failed!");
+}
+
 int packetizer::start()
+{
+	printf("Starting to packetize the file: %s\n", filename);
+	if(window)
+	  return start_windowed();
+	return start_paced();
+}
+
+// Blasts the file out with a fixed delay between packets, and hopes the
+// target kept up.
+int packetizer::start_paced()
 {
 	std::ifstream file(filename, std::ios::in | std::ios::binary);
-	packet p(target_mac, host_mac, seqno, MAX_PAYLOAD_SIZE, NULL);
+	packet p(target_mac, host_mac, seqno, payload_size, NULL);
 
 	int ret;
-	printf("Starting to packetize the file: %s\n", filename);
-	file.read(p.payload, MAX_PAYLOAD_SIZE);
+	file.read(p.payload, payload_size);
 	while(file) {
 		//printf("Sending chunk %d\n", seqno);
 		ret = ::sendto(sock, (char*)&p, p.size(), 0,
@@ -82,7 +114,7 @@ int packetizer::start()
 		if (ret < 0)
 		  throw std::runtime_error("sending packet failed!");
 		p.header.seqno = htons(next_seqno());
-		file.read(p.payload, MAX_PAYLOAD_SIZE);
+		file.read(p.payload, payload_size);
 	}
 	if(file.gcount()) {
 		p.header.payload_size = ntohl(file.gcount());
@@ -95,6 +127,90 @@ int packetizer::start()
 		//printf("Sending chunk %d\n", seqno);
 	}
 	printf("Last chunk had %u bytes...\n", file.gcount());
+	return 0;
+}
+
+// Marks everything the ACK covers.  Seqnos are 16 bits on the wire, but base
+// and next count every packet we've sent, so we put the ACK's seqnos back in
+// terms of the window.  Stale ACKs end up past next and get ignored.
+void packetizer::handle_ack(const ack_packet* ack, window_slot* slots,
+                            uint32_t base, uint32_t next)
+{
+	uint32_t cum = base + (uint16_t)(ntohs(ack->cum_seqno) - (uint16_t)base);
+	uint32_t sack = ntohl(ack->sack);
+
+	if(cum > next)
+	  return;
+	for(uint32_t i = base; i < cum; i++)
+	  slots[i % window].acked = true;
+	for(int i = 0; i < 32; i++) {
+	  if((sack & (1U << i)) && (cum + 1 + i < next))
+	    slots[(cum + 1 + i) % window].acked = true;
+	}
+}
+
+// Keeps up to window packets in flight, and only resends the ones that the
+// target hasn't ACKed within RETRANSMIT_USEC.
+int packetizer::start_windowed()
+{
+	std::ifstream file(filename, std::ios::in | std::ios::binary);
+	window_slot* slots = new window_slot[window];
+	char buf[MAX_PACKET_SIZE];
+	uint32_t base = 0, next = 0, resent = 0;
+	bool done_reading = false;
+	window_slot* s;
+	uint64_t now;
+	int ret, flags;
+
+	struct timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = RETRANSMIT_USEC / 4;
+	if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO,&tv,sizeof(struct timeval)) < 0)
+	  throw std::runtime_error("setsockopt() failed!");
+
+	while(!done_reading || base != next) {
+		while(!done_reading && (next - base < (uint32_t)window)) {
+			s = &slots[next % window];
+			s->p = packet(target_mac, host_mac, next, payload_size, NULL);
+			file.read(s->p.payload, payload_size);
+			if(file.gcount() < payload_size) {
+				s->p.header.payload_size = htonl(file.gcount());
+				s->p.packet_size = sizeof(s->p.header)+file.gcount();
+				done_reading = true;
+			}
+			s->acked = false;
+			s->sent_usec = now_usec();
+			send_packet(&s->p);
+			next++;
+		}
+		// Wait a little for the first frame, then drain whatever else is there.
+		// The raw socket sees everything on the wire, including our own sends.
+		for(flags = 0; ; flags = MSG_DONTWAIT) {
+			ret = ::recv(sock, buf, sizeof(buf), flags);
+			if(ret < 0)
+			  break;
+			ack_packet* ack = (ack_packet*)buf;
+			if(ret >= (int)sizeof(ack_packet) &&
+			   ack->ethertype == htons(PACKETIZER_ACK_ETHERTYPE) &&
+			   !memcmp(ack->src_mac, target_mac, 6))
+			  handle_ack(ack, slots, base, next);
+		}
+		while(base != next && slots[base % window].acked)
+			base++;
+		now = now_usec();
+		for(uint32_t i = base; i < next; i++) {
+			s = &slots[i % window];
+			if(!s->acked && (now - s->sent_usec > RETRANSMIT_USEC)) {
+				debug(printf("Resending chunk %u\n", i));
+				send_packet(&s->p);
+				s->sent_usec = now;
+				resent++;
+			}
+		}
+	}
+	printf("Sent %u chunks, resent %u...\n", next, resent);
+	delete[] slots;
+	return 0;
 }
 
 int main(int argc, char** argv)
@@ -102,6 +218,28 @@ int main(int argc, char** argv)
 	char target_mac[6];
 	char eth_device[256];
 	char filename[256];
+	int payload_size = DEFAULT_PAYLOAD_SIZE;
+	int window = DEFAULT_WINDOW;
+	int opt;
+
+	// -s: bytes per packet, up to MAX_PAYLOAD_SIZE (needs jumbo frames past
+	// 1500).  -w: packets in flight; needs a target that sends ACKs.
+	while((opt = getopt(argc, argv, "s:w:")) != -1) {
+		switch(opt) {
+		case 's':
+			payload_size = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s payload] [-w window] "
+			        "[MAC dev file]\n", argv[0]);
+			return 1;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 	if(argc == 1) {
 		target_mac[0] = 0x00;
 		target_mac[1] = 0x24;
@@ -125,7 +263,7 @@ int main(int argc, char** argv)
 		strcpy(filename, argv[3]);
 		
 	}
-	packetizer p(target_mac, eth_device, filename);
+	packetizer p(target_mac, eth_device, filename, payload_size, window);
 	p.start();
 	return 0;
 }
@@ -7,8 +7,17 @@
 #include <netpacket/packet.h>
 
 #define PACKETIZER_ETHERTYPE 0xabcd
-#define MAX_PAYLOAD_SIZE 1024
+#define PACKETIZER_ACK_ETHERTYPE 0xabce
+#define DEFAULT_PAYLOAD_SIZE 1024
+// Fits in a 9000 byte jumbo frame with the header
+#define MAX_PAYLOAD_SIZE 8960
 #define MAX_PACKET_SIZE (MAX_PAYLOAD_SIZE+sizeof(packet_header))
+// Without ACKs, we just pace the packets out
+#define DEFAULT_WINDOW 0
+// Must be well under half the seqno space, so seqnos can't be ambiguous
+#define MAX_WINDOW 4096
+// Resend anything that's been out this long without an ACK
+#define RETRANSMIT_USEC 20000
 struct packet_header
 {
 	uint8_t dst_mac[6];
@@ -31,7 +40,7 @@ struct packet
 
 	packet() {}
 	packet(const char* dst_mac, const char* src_mac, 
-	       char seqno,int payload_size, const uint8_t* bytes)
+	       uint16_t seqno,int payload_size, const uint8_t* bytes)
 	{
 	  header.ethertype = htons(PACKETIZER_ETHERTYPE);
 	  memcpy(header.dst_mac,dst_mac,6);
@@ -44,12 +53,34 @@ struct packet
 	}
 };
 
+// In window mode, the target sends one of these whenever it gets a packet.
+// cum_seqno is the next seqno it needs, and bit i of sack is set if it already
+// has cum_seqno + 1 + i.  A transfer always ends with a packet that's shorter
+// than the payload size (maybe empty), so the target knows when it's done.
+struct ack_packet
+{
+	uint8_t dst_mac[6];
+	uint8_t src_mac[6];
+	uint16_t ethertype;
+	uint16_t cum_seqno;
+	uint32_t sack;
+} __attribute__((packed));
+
+// A packet in the send window
+struct window_slot
+{
+	packet p;
+	uint64_t sent_usec;
+	bool acked;
+};
+
 class packetizer
 {
 public:
 	
 	packetizer(const char *target_mac, const char *eth_device, 
-	           const char *filename);
+	           const char *filename, int payload_size = DEFAULT_PAYLOAD_SIZE,
+	           int window = DEFAULT_WINDOW);
 	int start(void); 
 
 protected:
@@ -61,7 +92,14 @@ protected:
 	char eth_device[64];
 	char filename[256];
 
+	int payload_size;
+	int window;
+
 	void send_packet(packet* packet);
+	int start_paced(void);
+	int start_windowed(void);
+	void handle_ack(const ack_packet* ack, window_slot* slots, uint32_t base,
+	                uint32_t next);
 
 	uint16_t seqno;
 	uint16_t next_seqno() { return seqno++; }
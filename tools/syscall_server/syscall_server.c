@@ -22,7 +22,6 @@ void run_server()
 {
 	// Struct for reading the syscall over the channel
 	syscall_req_t syscall_req;
-	syscall_rsp_t syscall_rsp;
 	
 	int fd_read, fd_write;
 	int ret = init_syscall_server(&fd_read, &fd_write);
@@ -32,29 +31,57 @@ void run_server()
 	printf("Server started....");
 	// Continuously read in data from the channel socket
 	while(1) {
-		syscall_req.payload_len = 0;
-		syscall_req.payload = NULL;
-		syscall_rsp.payload_len = 0;
-		syscall_rsp.payload = NULL;
-	
 		debug("\nWaiting for syscall...\n");
 		read_syscall_req(fd_read, &syscall_req);	
 
-		debug("Processing syscall: %d\n", syscall_req.header.id);
-		handle_syscall(&syscall_req, &syscall_rsp);
+		if (syscall_req.header.id == BATCH_ID)
+			serve_batch(fd_read, fd_write,
+			            syscall_req.header.subheader.batch.nr);
+		else
+			serve_syscall(fd_write, &syscall_req);
+	}
+}
+
+// Runs a request that's already been read in, and sends its response.
+void serve_syscall(int fd_write, syscall_req_t* req)
+{
+	syscall_rsp_t syscall_rsp;
+
+	syscall_rsp.payload_len = 0;
+	syscall_rsp.payload = NULL;
 
-		debug("Writing response: %d\n", syscall_req.header.id);
-		write_syscall_rsp(fd_write, &syscall_rsp);
+	debug("Processing syscall: %d\n", req->header.id);
+	handle_syscall(req, &syscall_rsp);
 
-		if(syscall_req.payload != NULL) 
-			free(syscall_req.payload);
-		if(syscall_rsp.payload != NULL)
-			free(syscall_rsp.payload);
+	debug("Writing response: %d\n", req->header.id);
+	write_syscall_rsp(fd_write, &syscall_rsp);
+
+	if(req->payload != NULL) 
+		free(req->payload);
+	if(syscall_rsp.payload != NULL)
+		free(syscall_rsp.payload);
+}
+
+// Each request's response goes out before we read the next request, so the
+// client's reads of the early responses overlap with our work on the later
+// ones.  Over UDP, the whole batch usually shows up in one datagram.
+void serve_batch(int fd_read, int fd_write, uint32_t nr)
+{
+	syscall_req_t syscall_req;
+
+	debug("Processing batch of %u\n", nr);
+	for (uint32_t i = 0; i < nr; i++) {
+		read_syscall_req(fd_read, &syscall_req);
+		if (syscall_req.header.id == BATCH_ID)
+			error(fd_read, "Batches can't be nested...");
+		serve_syscall(fd_write, &syscall_req);
 	}
 }
 
 void read_syscall_req(int fd, syscall_req_t* req) 
 {
+	req->payload_len = 0;
+	req->payload = NULL;
 	read_syscall_req_header(fd, req);
 	set_syscall_req_payload_len(req);
 	read_syscall_req_payload(fd, req);
@@ -91,9 +118,8 @@ void read_syscall_req_header(int fd, syscall_req_t* req)
 
    	// If no data, or the ID we got is bad, terminate process.
 	uint32_t id = req->header.id;
-   	if ((bytes_read < 0) || (id < 0) || (id > NUM_SYSCALLS)) {
-		perror("Problems reading the id from the channel...");
-	}
+   	if ((bytes_read < 0) || (id >= NUM_SYSCALLS))
+		error(fd, "Problems reading the id from the channel...");
 
    	// Otherwise, start grabbing the rest of the data
    	bytes_read = read_from_channel(fd, &req->header.subheader, 
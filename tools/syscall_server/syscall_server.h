@@ -17,7 +17,8 @@
 #define FSTAT_ID		7
 #define ISATTY_ID		8
 #define STAT_ID			9
-#define NUM_SYSCALLS	10
+#define BATCH_ID		10
+#define NUM_SYSCALLS	11
 
 typedef uint32_t syscall_id_t;
 
@@ -81,6 +82,16 @@ typedef struct stat_subheader {
 	uint32_t FILL2;
 } stat_subheader_t;
 
+/* A batch is a header with BATCH_ID, followed by nr ordinary requests, back to
+ * back.  The server runs them in order, and sends each one's response as soon
+ * as it's done, so the client gets nr responses and can start on the first
+ * while the rest are still running.  Batches don't nest. */
+typedef struct batch_subheader {
+	uint32_t nr;
+	uint32_t FILL1;
+	uint32_t FILL2;
+} batch_subheader_t;
+
 typedef struct syscall_req_header {
 	syscall_id_t id;
 	union {
@@ -94,6 +105,7 @@ typedef struct syscall_req_header {
 		unlink_subheader_t unlink;
 		fstat_subheader_t fstat;
 		stat_subheader_t stat;	
+		batch_subheader_t batch;
 	} subheader;
 } syscall_req_header_t;
 
@@ -115,6 +127,8 @@ typedef struct syscall_rsp {
 } syscall_rsp_t;
 
 void run_server();
+void serve_syscall(int fd_write, syscall_req_t* req);
+void serve_batch(int fd_read, int fd_write, uint32_t nr);
 int init_syscall_server(int* fd_read, int* fd_write);
 void translate_stat(struct stat* native, struct newlib_stat* newlib);
 int translate_flags(int native_flags);
@@ -7,7 +7,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 
-#define UDP_ARR_SIZE 4096
+// Big enough for any datagram, so batches and bulk writes can fill one
+#define UDP_ARR_SIZE 65536
 
 int port = 44444;
 char udp_arr[UDP_ARR_SIZE];
@@ -7,16 +7,19 @@
  * of the kernel alarms.  Under the hood, the user alarm uses the #alarm service
  * for the root of the alarm chain.
  *
- * There's only one timer chain, unlike in the kernel, for the entire process.
- * If you want one-off timers unrelated to the chain (and sent to other vcores),
- * use #alarm directly.
+ * Like the kernel, each vcore has its own timer chain, but we only make one
+ * when a uthread on that vcore first sets an alarm.  Chains are hierarchical
+ * timer wheels: setting and unsetting is O(1), and firing is O(1) per waiter
+ * plus the occasional cascade.  If you want one-off timers unrelated to the
+ * chains, use #alarm directly.
  *
  * Your handlers will run from vcore context.
  *
  * Code differences from the kernel (for future porting):
  * - init_alarm_service, run as a constructor
- * - set_alarm() and friends are __tc_set_alarm(), passing global_tchain.
- * - reset_tchain_interrupt() uses #alarm
+ * - set_alarm() and friends are __tc_set_alarm(), passing the vcore's tchain.
+ * - tchains are timer wheels instead of sorted lists
+ * - tc_arm() uses #alarm
  * - removed anything related to semaphores or kthreads
  * - spinlocks -> spin_pdr_locks
  * - ev_q wrappers for converting #alarm events to __triggers
@@ -40,6 +43,7 @@
 #include <parlib/timing.h>
 #include <sys/plan9_helpers.h>
 #include <sys/fork_cb.h>
+#include <string.h>
 
 /* Helper to get your own alarm.   If you don't care about a return value, pass
  * 0 and it'll be ignored.  The alarm is built, but has no evq or timer set. */
@@ -106,6 +110,34 @@ int devalarm_disable(int timerfd)
 	return write_hex_to_fd(timerfd, 0);
 }
 
+/* Has the kernel rearm the alarm every period TSC ticks.  0 turns it off. */
+int devalarm_set_period(int alarmid, uint64_t period)
+{
+	char path[32];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "#alarm/a%d/period", alarmid);
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = write_hex_to_fd(fd, period);
+	close(fd);
+	return ret;
+}
+
+/* Has the kernel post signo straight to vcoreid whenever the alarm fires,
+ * without an event.  Signo 0 turns it off. */
+int devalarm_set_signal(int ctlfd, uint32_t vcoreid, int signo)
+{
+	char buf[32];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "signal %u %d", vcoreid, signo);
+	if (write(ctlfd, buf, len) != len)
+		return -1;
+	return 0;
+}
+
 /* Helpers, basically renamed kernel interfaces, with the *tchain. */
 static void __tc_locked_set_alarm(struct timer_chain *tchain,
                                   struct alarm_waiter *waiter);
@@ -113,77 +145,148 @@ static void __tc_set_alarm(struct timer_chain *tchain,
                            struct alarm_waiter *waiter);
 static bool __tc_unset_alarm(struct timer_chain *tchain,
                              struct alarm_waiter *waiter);
-static void __tc_reset_alarm_abs(struct timer_chain *tchain,
-                                 struct alarm_waiter *waiter,
-                                 uint64_t abs_time);
 static void handle_user_alarm(struct event_msg *ev_msg, unsigned int ev_type,
                               void *data);
 
-/* One chain to rule them all. */
-struct timer_chain global_tchain;
-
-/* Helper, resets the earliest/latest times, based on the elements of the list.
- * If the list is empty, we set the times to be the 12345 poison time.  Since
- * the list is empty, the alarm shouldn't be going off. */
-static void reset_tchain_times(struct timer_chain *tchain)
-{
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = ALARM_POISON_TIME;
-		tchain->latest_time = ALARM_POISON_TIME;
-	} else {
-		tchain->earliest_time = TAILQ_FIRST(&tchain->waiters)->wake_up_time;
-		tchain->latest_time =
-		        TAILQ_LAST(&tchain->waiters, awaiters_tailq)->wake_up_time;
-	}
+/* One chain per vcore, made on demand.  Vcore 0's always exists. */
+static struct timer_chain **tchains;
+/* The chain whose handlers we're running, for __set_alarm() */
+static __thread struct timer_chain *__cur_tchain;
+
+static uint64_t tsc2tick(uint64_t tsc)
+{
+	return tsc >> TC_TICK_SHIFT;
 }
 
-static void devalarm_forked(void)
+static uint64_t tick2tsc(uint64_t tick)
 {
-	/* We need to poison the FDs too, in case the child attempts to use the
-	 * alarms.  It'd be chaos if they read/wrote to an arbitrary open FD. */
-	close(global_tchain.ctlfd);
-	global_tchain.ctlfd = -42;
-	close(global_tchain.timerfd);
-	global_tchain.timerfd = -42;
+	return tick << TC_TICK_SHIFT;
 }
 
-static void __attribute__((constructor)) init_alarm_service(void)
+static unsigned int tc_nr_waiters(struct timer_chain *tchain)
+{
+	unsigned int nr = 0;
+
+	for (int i = 0; i < TC_WHEEL_LEVELS; i++)
+		nr += tchain->nr_waiters[i];
+	return nr;
+}
+
+/* Sets up tchain's #alarm, sending its events to its vcore.  Returns 0 on
+ * success. */
+static int tc_open_alarm(struct timer_chain *tchain)
 {
 	int ctlfd, timerfd, alarmid;
 	struct event_queue *ev_q;
-	static struct fork_cb devalarm_fork_cb = {.func = devalarm_forked};
-
-	/* Sets up timer chain (only one chain per process) */
-	spin_pdr_init(&global_tchain.lock);
-	TAILQ_INIT(&global_tchain.waiters);
-	reset_tchain_times(&global_tchain);
 
 	if (devalarm_get_fds(&ctlfd, &timerfd, &alarmid)) {
 		perror("Useralarm: devalarm_get_fds");
-		return;
+		return -1;
 	}
 	/* Since we're doing SPAM_PUBLIC later, we actually don't need a big ev_q.
 	 * But someone might copy/paste this and change a flag. */
-	register_ev_handler(EV_ALARM, handle_user_alarm, 0);
 	if (!(ev_q = get_eventq(EV_MBOX_UCQ))) {
 		perror("Useralarm: Failed ev_q");
-		return;
+		goto out_fds;
 	}
-	ev_q->ev_vcore = 0;
+	ev_q->ev_vcore = tchain->vcoreid;
 	/* We could get multiple events for a single alarm.  It's okay, since
 	 * __trigger can handle spurious upcalls.  If it ever is not okay, then use
-	 * an INDIR (probably with SPAM_INDIR too) instead of SPAM_PUBLIC. */
+	 * an INDIR (probably with SPAM_INDIR too) instead of SPAM_PUBLIC.  If our
+	 * vcore is offline, SPAM_PUBLIC sends it elsewhere, which is fine too. */
 	ev_q->ev_flags = EVENT_IPI | EVENT_SPAM_PUBLIC | EVENT_WAKEUP;
 	if (devalarm_set_evq(timerfd, ev_q, alarmid)) {
 		perror("set_alarm_evq");
-		return;
+		/* TODO: can't put_eventq, the kernel might still have it */
+		goto out_fds;
 	}
 	/* now the alarm is all set, just need to write the timer whenever we want
 	 * it to go off. */
-	global_tchain.alarmid = alarmid;
-	global_tchain.ctlfd = ctlfd;
-	global_tchain.timerfd = timerfd;
-	global_tchain.ev_q = ev_q;	/* mostly for debugging */
+	tchain->alarmid = alarmid;
+	tchain->ctlfd = ctlfd;
+	tchain->timerfd = timerfd;
+	tchain->ev_q = ev_q;	/* mostly for debugging */
+	return 0;
+out_fds:
+	close(ctlfd);
+	close(timerfd);
+	return -1;
+}
+
+static struct timer_chain *tc_alloc(uint32_t vcoreid)
+{
+	struct timer_chain *tchain;
+
+	tchain = malloc(sizeof(struct timer_chain));
+	assert(tchain);
+	memset(tchain, 0, sizeof(struct timer_chain));
+	spin_pdr_init(&tchain->lock);
+	for (int i = 0; i < TC_WHEEL_LEVELS; i++)
+		for (int j = 0; j < TC_WHEEL_SIZE; j++)
+			TAILQ_INIT(&tchain->wheel[i][j]);
+	tchain->clk = tsc2tick(read_tsc());
+	tchain->vcoreid = vcoreid;
+	tchain->ctlfd = -1;
+	tchain->timerfd = -1;
+	tchain->alarmid = -1;
+	return tchain;
+}
+
+/* Returns the chain for our vcore, making it if we can.  Making one opens
+ * files, so vcore context makes do with vcore 0's chain. */
+static struct timer_chain *get_my_tchain(void)
+{
+	uint32_t vcoreid = vcore_id();
+	struct timer_chain *tchain = ACCESS_ONCE(tchains[vcoreid]);
+
+	if (tchain)
+		return tchain;
+	if (in_vcore_context())
+		return tchains[0];
+	tchain = tc_alloc(vcoreid);
+	if (tc_open_alarm(tchain)) {
+		free(tchain);
+		return tchains[0];
+	}
+	if (!atomic_cas_ptr((void**)&tchains[vcoreid], NULL, tchain)) {
+		/* Another uthread on our vcore beat us while we were opening files.
+		 * The ev_q leaks, just like in tc_open_alarm(). */
+		close(tchain->ctlfd);
+		close(tchain->timerfd);
+		free(tchain);
+	}
+	return tchains[vcoreid];
+}
+
+static void devalarm_forked(void)
+{
+	struct timer_chain *tchain;
+
+	/* We need to poison the FDs too, in case the child attempts to use the
+	 * alarms.  It'd be chaos if they read/wrote to an arbitrary open FD. */
+	for (int i = 0; i < max_vcores(); i++) {
+		tchain = tchains[i];
+		if (!tchain)
+			continue;
+		close(tchain->ctlfd);
+		tchain->ctlfd = -42;
+		close(tchain->timerfd);
+		tchain->timerfd = -42;
+	}
+}
+
+static void __attribute__((constructor)) init_alarm_service(void)
+{
+	static struct fork_cb devalarm_fork_cb = {.func = devalarm_forked};
+
+	tchains = calloc(max_vcores(), sizeof(struct timer_chain*));
+	assert(tchains);
+	/* Vcore 0's chain is the fallback, so it exists even if #alarm doesn't
+	 * work.  Its alarms just won't go off. */
+	tchains[0] = tc_alloc(0);
+	register_ev_handler(EV_ALARM, handle_user_alarm, 0);
+	if (tc_open_alarm(tchains[0]))
+		return;
 	register_fork_cb(&devalarm_fork_cb);
 }
 
@@ -196,6 +299,7 @@ void init_awaiter(struct alarm_waiter *waiter,
 	assert(func);
 	waiter->func = func;
 	waiter->on_tchain = FALSE;
+	waiter->tchain = NULL;
 }
 
 /* Give this the absolute time.  For now, abs_time is the TSC time that you want
@@ -234,47 +338,79 @@ void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 	waiter->wake_up_time += usec2tsc(usleep);
 }
 
-/* User interface to the global tchain */
+/* User interface to the tchains */
 void __set_alarm(struct alarm_waiter *waiter)
 {
-	__tc_locked_set_alarm(&global_tchain, waiter);
+	assert(__cur_tchain);
+	__tc_locked_set_alarm(__cur_tchain, waiter);
 }
 
 void set_alarm(struct alarm_waiter *waiter)
 {
-	__tc_set_alarm(&global_tchain, waiter);
+	__tc_set_alarm(get_my_tchain(), waiter);
 }
 
 bool unset_alarm(struct alarm_waiter *waiter)
 {
-	return __tc_unset_alarm(&global_tchain, waiter);
+	struct timer_chain *tchain = ACCESS_ONCE(waiter->tchain);
+
+	if (!tchain)
+		return FALSE;
+	return __tc_unset_alarm(tchain, waiter);
 }
 
+/* waiter may be on a tchain, or it might have fired already and be off it.
+ * Either way, this will put the waiter on our chain, set to go off at abs_time.
+ * If you know the alarm has fired, don't call this.  Just set the awaiter, and
+ * then set_alarm().  Unlike the kernel's, this isn't atomic: the alarm could
+ * fire between the unset and the set. */
 void reset_alarm_abs(struct alarm_waiter *waiter, uint64_t abs_time)
 {
-	__tc_reset_alarm_abs(&global_tchain, waiter, abs_time);
+	unset_alarm(waiter);
+	__set_awaiter_abs(waiter, abs_time);
+	set_alarm(waiter);
 }
 
-/* Helper, makes sure the kernel alarm is turned on at the right time. */
-static void reset_tchain_interrupt(struct timer_chain *tchain)
+/* Helper, points the kernel alarm at tsc_time.  We never turn it off: once it
+ * fires it's off anyway, and an early one just finds nothing to do. */
+static void tc_arm(struct timer_chain *tchain, uint64_t tsc_time)
 {
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		/* Turn it off */
-		printd("Turning alarm off\n");
-		if (devalarm_disable(tchain->timerfd)) {
-			printf("Useralarm: unable to disarm alarm!\n");
-			return;
-		}
-	} else {
-		/* Make sure it is on and set to the earliest time */
-		assert(tchain->earliest_time != ALARM_POISON_TIME);
-		/* TODO: check for times in the past or very close to now */
-		printd("Turning alarm on for %llu\n", tchain->earliest_time);
-		if (devalarm_set_time(tchain->timerfd, tchain->earliest_time)) {
-			perror("Useralarm: Failed to set timer");
-			return;
-		}
+	tchain->armed_time = tsc_time;
+	printd("Turning alarm on for %llu\n", tsc_time);
+	if (devalarm_set_time(tchain->timerfd, tsc_time))
+		perror("Useralarm: Failed to set timer");
+}
+
+/* Helper, puts the waiter in its wheel bucket.  Caller holds the lock. */
+static void __insert_awaiter(struct timer_chain *tchain,
+                             struct alarm_waiter *waiter)
+{
+	uint64_t expires = tsc2tick(waiter->wake_up_time);
+	uint64_t delta;
+	unsigned int level;
+
+	/* Anything already due goes in the current bucket */
+	expires = MAX(expires, tchain->clk);
+	delta = expires - tchain->clk;
+	for (level = 0; level < TC_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1ULL << (TC_WHEEL_BITS * (level + 1))))
+			break;
 	}
+	/* Past the end of the wheel: wait in the top level's last bucket, and get
+	 * put back when it comes around. */
+	if (delta >= (1ULL << (TC_WHEEL_BITS * TC_WHEEL_LEVELS)))
+		expires = tchain->clk + (1ULL << (TC_WHEEL_BITS * TC_WHEEL_LEVELS)) - 1;
+	waiter->level = level;
+	waiter->slot = (expires >> (TC_WHEEL_BITS * level)) & TC_WHEEL_MASK;
+	TAILQ_INSERT_TAIL(&tchain->wheel[level][waiter->slot], waiter, next);
+	tchain->nr_waiters[level]++;
+}
+
+static void __remove_awaiter(struct timer_chain *tchain,
+                             struct alarm_waiter *waiter)
+{
+	TAILQ_REMOVE(&tchain->wheel[waiter->level][waiter->slot], waiter, next);
+	tchain->nr_waiters[waiter->level]--;
 }
 
 /* When an awaiter's time has come, this gets called. */
@@ -285,98 +421,169 @@ static void wake_awaiter(struct alarm_waiter *waiter)
 	waiter->func(waiter);
 }
 
-/* This is called when the kernel alarm triggers a tchain, and needs to wake up
- * everyone whose time is up.  Called from vcore context. */
-static void __trigger_tchain(struct timer_chain *tchain)
+/* The wheel just turned over to tchain->clk: each level whose bucket starts
+ * here gets spread out into the levels below. */
+static void __cascade(struct timer_chain *tchain)
 {
+	struct awaiters_tailq moving = TAILQ_HEAD_INITIALIZER(moving);
 	struct alarm_waiter *i, *temp;
-	uint64_t now = read_tsc();
-	bool changed_list = FALSE;
-	spin_pdr_lock(&tchain->lock);
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
+	unsigned int slot;
+
+	for (int level = 1; level < TC_WHEEL_LEVELS; level++) {
+		slot = (tchain->clk >> (TC_WHEEL_BITS * level)) & TC_WHEEL_MASK;
+		TAILQ_CONCAT(&moving, &tchain->wheel[level][slot], next);
+		if (slot)
+			break;
+	}
+	TAILQ_FOREACH_SAFE(i, &moving, next, temp) {
+		tchain->nr_waiters[i->level]--;
+		__insert_awaiter(tchain, i);
+	}
+}
+
+/* Fires everything due in the current level 0 bucket. */
+static void __run_bucket(struct timer_chain *tchain, uint64_t now)
+{
+	struct awaiters_tailq *bucket =
+	        &tchain->wheel[0][tchain->clk & TC_WHEEL_MASK];
+	struct alarm_waiter *i, *temp;
+
+	TAILQ_FOREACH_SAFE(i, bucket, next, temp) {
 		printd("Trying to wake up %p who is due at %llu and now is %llu\n",
 		       i, i->wake_up_time, now);
-		/* TODO: Could also do something in cases where we're close to now */
-		if (i->wake_up_time <= now) {
-			changed_list = TRUE;
-			TAILQ_REMOVE(&tchain->waiters, i, next);
-			/* Don't touch the waiter after waking it, since it could be in use
-			 * on another core (and the waiter can be clobbered as the kthread
-			 * unwinds its stack).  Or it could be kfreed */
-			wake_awaiter(i);
-		} else {
+		if (i->wake_up_time > now)
+			continue;
+		__remove_awaiter(tchain, i);
+		/* Don't touch the waiter after waking it, since it could be in use
+		 * on another core (and the waiter can be clobbered as the kthread
+		 * unwinds its stack).  Or it could be kfreed */
+		wake_awaiter(i);
+	}
+}
+
+/* Runs the wheel up to now.  We step level 0 a bucket at a time, but when the
+ * lower levels are empty we jump straight to the next time the lowest busy
+ * level turns. */
+static void __advance_tchain(struct timer_chain *tchain, uint64_t now)
+{
+	uint64_t now_tick = tsc2tick(now);
+	uint64_t next;
+	int level;
+
+	while (1) {
+		__run_bucket(tchain, now);
+		if (tchain->clk >= now_tick)
+			break;
+		for (level = 0; level < TC_WHEEL_LEVELS; level++) {
+			if (tchain->nr_waiters[level])
+				break;
+		}
+		if (level == TC_WHEEL_LEVELS) {
+			tchain->clk = now_tick;
+			break;
+		}
+		next = (tchain->clk | ((1ULL << (TC_WHEEL_BITS * level)) - 1)) + 1;
+		if (next > now_tick) {
+			/* Nothing in level 0, and no bucket turns before now */
+			tchain->clk = now_tick;
 			break;
 		}
+		tchain->clk = next;
+		if (!(tchain->clk & TC_WHEEL_MASK))
+			__cascade(tchain);
 	}
-	if (changed_list) {
-		reset_tchain_times(tchain);
+}
+
+/* Returns the tsc time the kernel alarm should go off, or 0 if the chain is
+ * empty.  For level 0, that's the earliest waiter.  Higher levels just need to
+ * wake us when their next busy bucket turns, so we can spread it out. */
+static uint64_t __next_tchain_time(struct timer_chain *tchain)
+{
+	struct alarm_waiter *i;
+	struct awaiters_tailq *bucket;
+	uint64_t ret = 0, now_unit, unit;
+
+	for (int level = 0; level < TC_WHEEL_LEVELS; level++) {
+		if (!tchain->nr_waiters[level])
+			continue;
+		now_unit = tchain->clk >> (TC_WHEEL_BITS * level);
+		/* Level 0's current bucket might still have waiters; the others
+		 * already turned. */
+		for (int j = level ? 1 : 0; j <= TC_WHEEL_SIZE; j++) {
+			unit = now_unit + j;
+			bucket = &tchain->wheel[level][unit & TC_WHEEL_MASK];
+			if (TAILQ_EMPTY(bucket))
+				continue;
+			if (!level) {
+				ret = TAILQ_FIRST(bucket)->wake_up_time;
+				TAILQ_FOREACH(i, bucket, next)
+					ret = MIN(ret, i->wake_up_time);
+				break;
+			}
+			unit = tick2tsc(unit << (TC_WHEEL_BITS * level));
+			ret = ret ? MIN(ret, unit) : unit;
+			break;
+		}
 	}
-	/* Need to reset the interrupt no matter what */
-	reset_tchain_interrupt(tchain);
+	return ret;
+}
+
+/* This is called when the kernel alarm triggers a tchain, and needs to wake up
+ * everyone whose time is up.  Called from vcore context. */
+static void __trigger_tchain(struct timer_chain *tchain)
+{
+	uint64_t now = read_tsc();
+	uint64_t next;
+
+	spin_pdr_lock(&tchain->lock);
+	/* We might get spurious events; if the alarm hasn't gone off yet, it is
+	 * still armed. */
+	if (tchain->armed_time <= now)
+		tchain->armed_time = 0;
+	__cur_tchain = tchain;
+	__advance_tchain(tchain, now);
+	__cur_tchain = NULL;
+	next = __next_tchain_time(tchain);
+	if (next && (!tchain->armed_time || (next < tchain->armed_time)))
+		tc_arm(tchain, next);
 	spin_pdr_unlock(&tchain->lock);
 }
 
 static void handle_user_alarm(struct event_msg *ev_msg, unsigned int ev_type,
                               void *data)
 {
-	assert(ev_type == EV_ALARM);
-	if (devalarm_get_id(ev_msg) == global_tchain.alarmid)
-		__trigger_tchain(&global_tchain);
-}
+	struct timer_chain *tchain;
+	int alarmid = devalarm_get_id(ev_msg);
 
-/* Helper, inserts the waiter into the tchain, returning TRUE if we still need
- * to reset the tchain interrupt.  Caller holds the lock. */
-static bool __insert_awaiter(struct timer_chain *tchain,
-                             struct alarm_waiter *waiter)
-{
-	struct alarm_waiter *i, *temp;
-	/* This will fail if you don't set a time */
-	assert(waiter->wake_up_time != ALARM_POISON_TIME);
-	waiter->on_tchain = TRUE;
-	/* Either the list is empty, or not. */
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = waiter->wake_up_time;
-		tchain->latest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Need to turn on the timer interrupt later */
-		return TRUE;
-	}
-	/* If not, either we're first, last, or in the middle.  Reset the interrupt
-	 * and adjust the tchain's times accordingly. */
-	if (waiter->wake_up_time < tchain->earliest_time) {
-		tchain->earliest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Changed the first entry; we'll need to reset the interrupt later */
-		return TRUE;
-	}
-	/* If there is a tie for last, the newer one will really go last.  We need
-	 * to handle equality here since the loop later won't catch it. */
-	if (waiter->wake_up_time >= tchain->latest_time) {
-		tchain->latest_time = waiter->wake_up_time;
-		/* Proactively put it at the end if we know we're last */
-		TAILQ_INSERT_TAIL(&tchain->waiters, waiter, next);
-		return FALSE;
-	}
-	/* Insert before the first one you are earlier than.  This won't scale well
-	 * (TODO) if we have a lot of inserts.  The proactive insert_tail up above
-	 * will help a bit. */
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		if (waiter->wake_up_time < i->wake_up_time) {
-			TAILQ_INSERT_BEFORE(i, waiter, next);
-			return FALSE;
+	assert(ev_type == EV_ALARM);
+	for (int i = 0; i < max_vcores(); i++) {
+		tchain = ACCESS_ONCE(tchains[i]);
+		if (tchain && (tchain->alarmid == alarmid)) {
+			__trigger_tchain(tchain);
+			return;
 		}
 	}
-	printf("Could not find a spot for awaiter %p\n", waiter);
 }
 
-/* Sets the alarm.  If it is a kthread-style alarm (func == 0), sleep on it
- * later.  This version assumes you have the lock held.  That only makes sense
- * from alarm handlers, which are called with this lock held from IRQ context */
+/* Sets the alarm.  This version assumes you have the lock held.  That only
+ * makes sense from alarm handlers, which are called with this lock held from
+ * vcore context.
+ *
+ * The kernel alarm only needs to move if we're earlier than it.  If the chain
+ * was empty, its clock might be way behind; nothing's waiting on the skipped
+ * ticks, so we jump ahead. */
 static void __tc_locked_set_alarm(struct timer_chain *tchain,
                                   struct alarm_waiter *waiter)
-{	
-	if (__insert_awaiter(tchain, waiter))
-		reset_tchain_interrupt(tchain);
+{
+	/* This will fail if you don't set a time */
+	assert(waiter->wake_up_time != ALARM_POISON_TIME);
+	if (!tc_nr_waiters(tchain))
+		tchain->clk = MAX(tchain->clk, tsc2tick(read_tsc()));
+	waiter->tchain = tchain;
+	waiter->on_tchain = TRUE;
+	__insert_awaiter(tchain, waiter);
+	if (!tchain->armed_time || (waiter->wake_up_time < tchain->armed_time))
+		tc_arm(tchain, waiter->wake_up_time);
 }
 
 /* Sets the alarm.  Don't call this from an alarm handler, since you already
@@ -385,35 +592,13 @@ static void __tc_set_alarm(struct timer_chain *tchain,
                            struct alarm_waiter *waiter)
 {
 	spin_pdr_lock(&tchain->lock);
-	__set_alarm(waiter);
+	__tc_locked_set_alarm(tchain, waiter);
 	spin_pdr_unlock(&tchain->lock);
 }
 
-/* Helper, rips the waiter from the tchain, knowing that it is on the list.
- * Returns TRUE if the tchain interrupt needs to be reset.  Callers hold the
- * lock. */
-static bool __remove_awaiter(struct timer_chain *tchain,
-                             struct alarm_waiter *waiter)
-{
-	struct alarm_waiter *temp;
-	bool reset_int = FALSE;		/* whether or not to reset the interrupt */
-	/* Need to make sure earliest and latest are set, in case we're mucking with
-	 * the first and/or last element of the chain. */
-	if (TAILQ_FIRST(&tchain->waiters) == waiter) {
-		temp = TAILQ_NEXT(waiter, next);
-		tchain->earliest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
-		reset_int = TRUE;		/* we'll need to reset the timer later */
-	}
-	if (TAILQ_LAST(&tchain->waiters, awaiters_tailq) == waiter) {
-		temp = TAILQ_PREV(waiter, awaiters_tailq, next);
-		tchain->latest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
-	}
-	TAILQ_REMOVE(&tchain->waiters, waiter, next);
-	return reset_int;
-}
-
 /* Removes waiter from the tchain before it goes off.  Returns TRUE if we
- * disarmed before the alarm went off, FALSE if it already fired. */
+ * disarmed before the alarm went off, FALSE if it already fired.  We leave the
+ * kernel alarm alone; if it was for us, it'll go off and find nothing to do. */
 static bool __tc_unset_alarm(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
@@ -425,42 +610,22 @@ static bool __tc_unset_alarm(struct timer_chain *tchain,
 		spin_pdr_unlock(&tchain->lock);
 		return FALSE;
 	}
-	if (__remove_awaiter(tchain, waiter))
-		reset_tchain_interrupt(tchain);
+	__remove_awaiter(tchain, waiter);
+	waiter->on_tchain = FALSE;
 	spin_pdr_unlock(&tchain->lock);
 	return TRUE;
 }
 
-/* waiter may be on the tchain, or it might have fired already and be off the
- * tchain.  Either way, this will put the waiter on the list, set to go off at
- * abs_time.  If you know the alarm has fired, don't call this.  Just set the
- * awaiter, and then set_alarm() */
-static void __tc_reset_alarm_abs(struct timer_chain *tchain,
-                                 struct alarm_waiter *waiter, uint64_t abs_time)
-{
-	bool reset_int = FALSE;		/* whether or not to reset the interrupt */
-	spin_pdr_lock(&tchain->lock);
-	/* We only need to remove/unset when the alarm has not fired yet (is still
-	 * on the tchain).  If it has fired, it's like a fresh insert */
-	if (waiter->on_tchain)
-		reset_int = __remove_awaiter(tchain, waiter);
-	__set_awaiter_abs(waiter, abs_time);
-	/* regardless, we need to be reinserted */
-	if (__insert_awaiter(tchain, waiter) || reset_int)
-		reset_tchain_interrupt(tchain);
-	spin_pdr_unlock(&tchain->lock);
-}
-
 /* Debug helpers */
 
 void print_chain(struct timer_chain *tchain)
 {
-	struct alarm_waiter *i;
 	spin_pdr_lock(&tchain->lock);
-	printf("Chain %p is%s empty, early: %llu latest: %llu\n", tchain,
-	       TAILQ_EMPTY(&tchain->waiters) ? "" : " not",
-	       tchain->earliest_time,
-	       tchain->latest_time);
+	printf("Chain %p (vcore %u) has %u waiters, clk: %llu armed: %llu\n",
+	       tchain, tchain->vcoreid, tc_nr_waiters(tchain), tchain->clk,
+	       tchain->armed_time);
+	for (int i = 0; i < TC_WHEEL_LEVELS; i++)
+		printf("\tLevel %d: %u waiters\n", i, tchain->nr_waiters[i]);
 	spin_pdr_unlock(&tchain->lock);
 }
 
@@ -0,0 +1,161 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * HDR-style latency histograms.  See hdr_hist.h. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#ifdef __ros__
+#include <parlib/vcore.h>
+#include <parlib/uthread.h>
+#include <benchutil/hdr_hist.h>
+#endif /* __ros__ */
+
+void hdr_hist_init(struct hdr_hist *h)
+{
+	memset(h, 0, sizeof(struct hdr_hist));
+	h->min = UINT64_MAX;
+}
+
+struct hdr_hist *hdr_hist_alloc(unsigned int nr)
+{
+	struct hdr_hist *h;
+
+	if (posix_memalign((void**)&h, 64, nr * sizeof(struct hdr_hist)))
+		return 0;
+	for (int i = 0; i < nr; i++)
+		hdr_hist_init(&h[i]);
+	return h;
+}
+
+static void atomic_min_u64(uint64_t *dst, uint64_t val)
+{
+	uint64_t old = *dst;
+
+	while (val < old) {
+		if (__sync_bool_compare_and_swap(dst, old, val))
+			break;
+		old = *dst;
+	}
+}
+
+static void atomic_max_u64(uint64_t *dst, uint64_t val)
+{
+	uint64_t old = *dst;
+
+	while (val > old) {
+		if (__sync_bool_compare_and_swap(dst, old, val))
+			break;
+		old = *dst;
+	}
+}
+
+/* src's writer can keep recording.  We'll see some of its samples and not
+ * others, and the totals may be off from the buckets by the few in flight. */
+void hdr_hist_merge(struct hdr_hist *dst, struct hdr_hist *src)
+{
+	uint64_t count;
+
+	for (int i = 0; i < HDR_NR_BUCKETS; i++) {
+		count = ACCESS_ONCE(src->counts[i]);
+		if (count)
+			__sync_fetch_and_add(&dst->counts[i], count);
+	}
+	__sync_fetch_and_add(&dst->total, ACCESS_ONCE(src->total));
+	__sync_fetch_and_add(&dst->sum, ACCESS_ONCE(src->sum));
+	atomic_min_u64(&dst->min, ACCESS_ONCE(src->min));
+	atomic_max_u64(&dst->max, ACCESS_ONCE(src->max));
+}
+
+void hdr_hist_merge_all(struct hdr_hist *dst, struct hdr_hist *srcs,
+                        unsigned int nr)
+{
+	for (int i = 0; i < nr; i++)
+		hdr_hist_merge(dst, &srcs[i]);
+}
+
+/* Highest value that lands in bucket idx, capped at the max we saw */
+static uint64_t hdr_bucket_hi(struct hdr_hist *h, unsigned int idx)
+{
+	uint64_t hi = idx + 1 < HDR_NR_BUCKETS ? hdr_bucket_lo(idx + 1) - 1
+	                                       : UINT64_MAX;
+
+	return MIN(hi, h->max);
+}
+
+uint64_t hdr_hist_percentile(struct hdr_hist *h, double pct)
+{
+	uint64_t want, seen = 0;
+
+	if (!h->total)
+		return 0;
+	want = ceil(h->total * MIN(pct, 100.0) / 100.0);
+	want = MAX(want, 1);
+	for (int i = 0; i < HDR_NR_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= want)
+			return hdr_bucket_hi(h, i);
+	}
+	return h->max;
+}
+
+uint64_t hdr_hist_mean(struct hdr_hist *h)
+{
+	return h->total ? h->sum / h->total : 0;
+}
+
+/* From the bucket midpoints, so it carries the buckets' error */
+double hdr_hist_stddev(struct hdr_hist *h)
+{
+	double mean = hdr_hist_mean(h), var = 0, mid;
+
+	if (h->total < 2)
+		return 0;
+	for (int i = 0; i < HDR_NR_BUCKETS; i++) {
+		if (!h->counts[i])
+			continue;
+		mid = (hdr_bucket_lo(i) + (double)hdr_bucket_hi(h, i)) / 2;
+		var += h->counts[i] * (mid - mean) * (mid - mean);
+	}
+	return sqrt(var / (h->total - 1));
+}
+
+void hdr_hist_fprint(FILE *f, struct hdr_hist *h, const char *units)
+{
+	static const double pcts[] = {50, 75, 90, 99, 99.9, 99.99};
+
+	if (!h->total) {
+		fprintf(f, "No samples\n");
+		return;
+	}
+	fprintf(f, "Samples: %llu\n", h->total);
+	fprintf(f, "Min / Mean / Max (%s): %llu / %llu / %llu\n", units, h->min,
+	        hdr_hist_mean(h), h->max);
+	fprintf(f, "Stdev (%s): %.1f\n", units, hdr_hist_stddev(h));
+	for (int i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+		fprintf(f, "  p%-6g %llu\n", pcts[i], hdr_hist_percentile(h, pcts[i]));
+	fprintf(f, "(Percentiles are accurate to within %.1f%%)\n",
+	        100.0 / HDR_HALF_COUNT);
+}
+
+void hdr_hist_print(struct hdr_hist *h, const char *units)
+{
+	hdr_hist_fprint(stdout, h, units);
+}
+
+#ifdef __ros__
+/* Notifs off keeps us from migrating to another vcore mid-record */
+void hdr_hist_record_vcore(struct hdr_hist *hists, uint64_t val)
+{
+	if (in_vcore_context()) {
+		hdr_hist_record(&hists[vcore_id()], val);
+		return;
+	}
+	uth_disable_notifs();
+	hdr_hist_record(&hists[vcore_id()], val);
+	uth_enable_notifs();
+}
+#endif /* __ros__ */
@@ -10,9 +10,12 @@
  * This is (was) hanging out in benchutil so as to not create a dependency from
  * parlib on benchutil (usec2tsc and friends).
  *
- * There's only one timer chain, unlike in the kernel, for the entire process.
- * If you want one-off timers unrelated to the chain (and sent to other vcores),
- * use #A directly.
+ * Each vcore gets its own timer chain, with its own #A alarm, the first time a
+ * uthread on that vcore sets an alarm.  An alarm goes on the chain of the vcore
+ * that set it, and vcore context sets use vcore 0's chain if theirs doesn't
+ * exist yet.  Chains are hierarchical timer wheels, so setting and unsetting
+ * an alarm is O(1).  If you want one-off timers unrelated to the chains, use #A
+ * directly.
  *
  * Your handlers will run from vcore context.
  *
@@ -25,7 +28,8 @@
  * If you want the HANDLER to run again, do this at the end of it:
  * 	set_awaiter_rel(waiter, USEC);
  * 	__set_alarm(waiter);
- * Do not call set_alarm() from within an alarm handler; you'll deadlock.
+ * __set_alarm() puts the waiter on the chain whose handler is running.  Do not
+ * call set_alarm() from within an alarm handler; you'll deadlock.
  * Don't forget to manage your memory at some (safe) point:
  * 	free(waiter); */
 
@@ -45,9 +49,13 @@ int devalarm_set_evq(int timerfd, struct event_queue *ev_q, int alarmid);
 int devalarm_set_time(int timerfd, uint64_t tsc_time);
 int devalarm_get_id(struct event_msg *ev_msg);
 int devalarm_disable(int timerfd);
+int devalarm_set_period(int alarmid, uint64_t period);
+int devalarm_set_signal(int ctlfd, uint32_t vcoreid, int signo);
 
 /* Alarm service */
 
+struct timer_chain;
+
 /* Specifc waiter, per alarm */
 struct alarm_waiter {
 	uint64_t 					wake_up_time;	/* tsc time */
@@ -55,17 +63,32 @@ struct alarm_waiter {
 	void						*data;
 	TAILQ_ENTRY(alarm_waiter)	next;
 	bool						on_tchain;
+	struct timer_chain			*tchain;	/* last chain we were set on */
+	uint8_t						level;		/* wheel bucket, if on_tchain */
+	uint8_t						slot;
 };
-TAILQ_HEAD(awaiters_tailq, alarm_waiter);		/* ideally not a LL */
+TAILQ_HEAD(awaiters_tailq, alarm_waiter);
 
 typedef void (*alarm_handler)(struct alarm_waiter *waiter);
 
-/* Sorted collection of alarms. */
+/* Each wheel level has TC_WHEEL_SIZE buckets, and each bucket of a level spans
+ * a full turn of the level below it.  Level 0 buckets are one tick, or
+ * 2^TC_TICK_SHIFT TSC cycles (tens of usec).  Five levels cover hours; later
+ * alarms wait in the top level and get put back as it turns. */
+#define TC_WHEEL_BITS				6
+#define TC_WHEEL_SIZE				(1 << TC_WHEEL_BITS)
+#define TC_WHEEL_MASK				(TC_WHEEL_SIZE - 1)
+#define TC_WHEEL_LEVELS				5
+#define TC_TICK_SHIFT				16
+
+/* A hierarchical timer wheel of alarms. */
 struct timer_chain {
 	struct spin_pdr_lock		lock;
-	struct awaiters_tailq		waiters;
-	uint64_t					earliest_time;
-	uint64_t					latest_time;
+	uint64_t					clk;		/* tick we've run up to */
+	uint64_t					armed_time;	/* #alarm's tsc time, 0 if off */
+	unsigned int				nr_waiters[TC_WHEEL_LEVELS];
+	struct awaiters_tailq		wheel[TC_WHEEL_LEVELS][TC_WHEEL_SIZE];
+	uint32_t					vcoreid;
 	int							ctlfd;
 	int							timerfd;
 	int							alarmid;
@@ -0,0 +1,100 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * HDR-style latency histograms: constant memory, no matter how many samples,
+ * and percentiles out to p99.99 with a bounded relative error.
+ *
+ * Values below 2^HDR_SUB_BITS get a bucket each.  Above that, every power of
+ * two is split into 2^(HDR_SUB_BITS - 1) linear buckets, so a value is off by
+ * at most 1 / 2^(HDR_SUB_BITS - 1) (about 3%) of itself.  Any uint64_t fits.
+ *
+ * A histogram has one writer: hdr_hist_record() is not atomic.  Give each
+ * thread or vcore its own (hdr_hist_alloc(nr)), and merge them at the end, or
+ * while the writers run.  Merges use atomics on the destination, so several
+ * can merge into one histogram at once without a lock.
+ *
+ * 		struct hdr_hist *hists = hdr_hist_alloc(max_vcores());
+ *
+ * 		hdr_hist_record_vcore(hists, tsc2nsec(end - start));
+ * 		...
+ * 		struct hdr_hist *all = hdr_hist_alloc(1);
+ *
+ * 		hdr_hist_merge_all(all, hists, max_vcores());
+ * 		hdr_hist_print(all, "nsec");
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+__BEGIN_DECLS
+
+#define HDR_SUB_BITS			6
+#define HDR_SUB_COUNT			(1 << HDR_SUB_BITS)
+#define HDR_HALF_COUNT			(HDR_SUB_COUNT / 2)
+/* The first group is HDR_SUB_COUNT wide, the others half that */
+#define HDR_NR_BUCKETS			(HDR_SUB_COUNT + \
+                                 (64 - HDR_SUB_BITS) * HDR_HALF_COUNT)
+
+struct hdr_hist {
+	uint64_t					total;
+	uint64_t					min;
+	uint64_t					max;
+	uint64_t					sum;
+	uint64_t					counts[HDR_NR_BUCKETS];
+} __attribute__((aligned(64)));
+
+/* Returns nr zeroed histograms, or 0.  Free with free(). */
+struct hdr_hist *hdr_hist_alloc(unsigned int nr);
+void hdr_hist_init(struct hdr_hist *h);
+void hdr_hist_merge(struct hdr_hist *dst, struct hdr_hist *src);
+void hdr_hist_merge_all(struct hdr_hist *dst, struct hdr_hist *srcs,
+                        unsigned int nr);
+/* pct is from 0 to 100.  Returns the highest value in pct's bucket. */
+uint64_t hdr_hist_percentile(struct hdr_hist *h, double pct);
+uint64_t hdr_hist_mean(struct hdr_hist *h);
+double hdr_hist_stddev(struct hdr_hist *h);
+void hdr_hist_fprint(FILE *f, struct hdr_hist *h, const char *units);
+void hdr_hist_print(struct hdr_hist *h, const char *units);
+#ifdef __ros__
+/* Records into this vcore's entry of hists, which has one per vcore */
+void hdr_hist_record_vcore(struct hdr_hist *hists, uint64_t val);
+#endif /* __ros__ */
+
+/* Buckets are [hdr_bucket_lo(i), hdr_bucket_lo(i + 1)) */
+static inline unsigned int hdr_bucket_of(uint64_t val)
+{
+	unsigned int shift;
+
+	if (val < HDR_SUB_COUNT)
+		return val;
+	/* val has 64 - clz bits; keep the top HDR_SUB_BITS of them */
+	shift = 64 - __builtin_clzll(val) - HDR_SUB_BITS;
+	return HDR_SUB_COUNT + (shift - 1) * HDR_HALF_COUNT +
+	       (val >> shift) - HDR_HALF_COUNT;
+}
+
+static inline uint64_t hdr_bucket_lo(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < HDR_SUB_COUNT)
+		return idx;
+	shift = (idx - HDR_SUB_COUNT) / HDR_HALF_COUNT + 1;
+	return (uint64_t)((idx - HDR_SUB_COUNT) % HDR_HALF_COUNT +
+	                  HDR_HALF_COUNT) << shift;
+}
+
+static inline void hdr_hist_record(struct hdr_hist *h, uint64_t val)
+{
+	h->counts[hdr_bucket_of(val)]++;
+	h->total++;
+	h->sum += val;
+	if (val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+}
+
+__END_DECLS
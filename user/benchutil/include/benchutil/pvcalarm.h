@@ -25,6 +25,12 @@ enum {
  * active vcore according to that policy. */
 int enable_pvcalarms(int policy, uint64_t interval, void (*callback) (void));
 
+/* Enable the per-vcore alarms in signal mode: every interval usecs of a vcore
+ * running, the kernel posts signo to it directly, and it goes to the vcore's
+ * current uthread.  This skips the event round trip, so it has much less
+ * jitter than a callback that signals the uthread. */
+int enable_pvcalarm_signals(uint64_t interval, int signo);
+
 /* Disable the currently active per-vcore alarm service */
 int disable_pvcalarms();
 
@@ -34,6 +34,10 @@ struct pvcalarm_data {
 	int timerfd;
 	int alarmid;
 	uint64_t start_uptime;
+	/* For signal mode: an alarm with no evq, which posts a signal instead */
+	int sig_ctlfd;
+	int sig_timerfd;
+	int sig_alarmid;
 };
 
 /* The global state of the pvcalarm service itself */
@@ -44,6 +48,7 @@ struct pvcalarm {
 	atomic_t state;
 	int busy_count;
 	handle_event_t handler;
+	int signo;	/* non-zero in signal mode */
 	struct pvcalarm_data *data;
 };
 
@@ -53,6 +58,8 @@ static struct pvcalarm global_pvcalarm = { .state = (void*)S_DISABLED };
 
 /* Helper functions */
 static void init_pvcalarm(struct pvcalarm_data *pvcalarm_data, int vcoreid);
+static void init_sig_pvcalarm(struct pvcalarm_data *pvcalarm_data,
+                              int vcoreid);
 static void handle_pvcalarm(struct event_msg *ev_msg, unsigned int ev_type,
                             void *data);
 static void handle_alarm_real(struct event_msg *ev_msg, unsigned int ev_type,
@@ -123,6 +130,7 @@ int enable_pvcalarms(int method, uint64_t interval, void (*callback) (void))
 	global_pvcalarm.interval = usec2tsc(interval);
 	global_pvcalarm.callback = callback;
 	global_pvcalarm.busy_count = 0;
+	global_pvcalarm.signo = 0;
 	switch (method) {
 		case PVCALARM_REAL:
 			global_pvcalarm.handler = handle_alarm_real;
@@ -141,6 +149,50 @@ int enable_pvcalarms(int method, uint64_t interval, void (*callback) (void))
 	return 0;
 }
 
+static void init_sig_pvcalarms(void)
+{
+	for (int i = 0; i < max_vcores(); i++)
+		init_sig_pvcalarm(&global_pvcalarm.data[i], i);
+}
+
+/* Enable the per-vcore alarms in signal mode.  Every interval usecs, the kernel
+ * posts signo straight to each running vcore, which hands it to its current
+ * uthread, skipping the event round trip and our handlers.  The kernel rearms
+ * the alarms, and it drops ticks for vcores that aren't running, so this is
+ * like PVCALARM_PROF down to the granularity of a tick. */
+int enable_pvcalarm_signals(uint64_t interval, int signo)
+{
+	struct pvcalarm_data *pvcalarm_data;
+
+	assert(!in_vcore_context());
+	if (!signo)
+		return EINVAL;
+	if (atomic_cas(&global_pvcalarm.state, S_ENABLED, S_ENABLED))
+		return EALREADY;
+	if (!atomic_cas(&global_pvcalarm.state, S_DISABLED, S_ENABLING))
+		return EBUSY;
+
+	run_once_racy(init_global_pvcalarm());
+	run_once_racy(init_sig_pvcalarms());
+
+	global_pvcalarm.interval = usec2tsc(interval);
+	global_pvcalarm.callback = NULL;
+	global_pvcalarm.handler = NULL;
+	global_pvcalarm.signo = signo;
+	for (int i = 0; i < max_vcores(); i++) {
+		pvcalarm_data = &global_pvcalarm.data[i];
+		if (devalarm_set_signal(pvcalarm_data->sig_ctlfd, i, signo) ||
+		    devalarm_set_period(pvcalarm_data->sig_alarmid,
+		                        global_pvcalarm.interval) ||
+		    devalarm_set_time(pvcalarm_data->sig_timerfd,
+		                      read_tsc() + global_pvcalarm.interval))
+			perror("Pvcalarm: Failed to set signal alarm");
+	}
+
+	atomic_set(&global_pvcalarm.state, S_ENABLED);
+	return 0;
+}
+
 /* Disable the currently active per-vcore alarm service */
 int disable_pvcalarms()
 {
@@ -163,8 +215,13 @@ int disable_pvcalarms()
 	global_pvcalarm.handler = NULL;
 
 	/* Stop the timer on all vcores */
-	for (int i=0; i<max_vcores(); i++)
-		stop_pvcalarm(&global_pvcalarm.data[i]);
+	for (int i=0; i<max_vcores(); i++) {
+		if (global_pvcalarm.signo)
+			devalarm_disable(global_pvcalarm.data[i].sig_timerfd);
+		else
+			stop_pvcalarm(&global_pvcalarm.data[i]);
+	}
+	global_pvcalarm.signo = 0;
 
 	atomic_set(&global_pvcalarm.state, S_DISABLED);
 }
@@ -200,6 +257,19 @@ static void init_pvcalarm(struct pvcalarm_data *pvcalarm_data, int vcoreid)
 	pvcalarm_data->timerfd = timerfd;
 }
 
+/* The signal mode alarm for vcoreid.  It has no evq, so firing it doesn't send
+ * an event, just the signal. */
+static void init_sig_pvcalarm(struct pvcalarm_data *pvcalarm_data,
+                              int vcoreid)
+{
+	if (devalarm_get_fds(&pvcalarm_data->sig_ctlfd,
+	                     &pvcalarm_data->sig_timerfd,
+	                     &pvcalarm_data->sig_alarmid)) {
+		perror("Pvcalarm: signal alarm setup");
+		return;
+	}
+}
+
 /* TODO: implement a way to completely remove each per-vcore alarm and
  * deregister it from the #alarm device */
 
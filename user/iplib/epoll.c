@@ -4,11 +4,20 @@
  *
  * Epoll, built on FD taps, CEQs, and blocking uthreads on event queues.
  *
+ * Devices that track readiness fire a tap as soon as it is added, and again
+ * whenever it is re-armed with FDTAP_CMD_MOD, for any events that are already
+ * true.  Edge-triggered FDs just take whatever the taps send.  Level-triggered
+ * FDs get re-armed after every epoll_wait() that reported them, so if they are
+ * still ready, the kernel posts them to the CEQ again.  EPOLLONESHOT FDs get a
+ * MOD with an empty filter instead.  The re-arms from one epoll_wait() all go
+ * to the kernel in a single sys_tap_fds() call.
+ *
  * TODO: There are a few incompatibilities with Linux's epoll, some of which are
  * artifacts of the implementation, and other issues:
  * 	- you can't epoll on an epoll fd (or any user fd).  you can only epoll on a
  * 	kernel FD that accepts your FD taps.
- * 	- there's no EPOLLONESHOT or level-triggered support.
+ * 	- level-triggered and EPOLLONESHOT FDs need a device that supports
+ * 	FDTAP_CMD_MOD (#ip and #pipe).
  * 	- you can only tap one FD at a time, so you can't add the same FD to
  * 	multiple epoll sets.
  * 	- there is no support for growing the epoll set.
@@ -17,8 +26,8 @@
  * 	preempted, and are unlucky.
  * 	- epoll_create1 does not support CLOEXEC.  That'd need some work in glibc's
  * 	exec and flags in struct user_fd.
- * 	- EPOLL_CTL_MOD is just a DEL then an ADD.  There might be races associated
- * 	with that.
+ * 	- EPOLL_CTL_MOD falls back to a DEL then an ADD for devices without
+ * 	FDTAP_CMD_MOD.  There might be races associated with that.
  * 	- epoll_pwait is probably racy.
  * 	- You can't dup an epoll fd (same as other user FDs).
  * 	- If you add a BSD socket FD to an epoll set, you'll get taps on both the
@@ -52,6 +61,8 @@ struct epoll_ctlr {
 	struct event_queue			*alarm_evq;
 	struct ceq					*ceq;	/* convenience pointer */
 	unsigned int				size;
+	struct fd_tap_req			*rearm_reqs;	/* ep->size of them */
+	unsigned int				nr_rearm;
 	uth_mutex_t					mtx;
 	struct user_fd				ufd;
 };
@@ -70,6 +81,8 @@ struct ep_fd_data {
 	struct epoll_event			ep_event;
 	int							fd;
 	int							filter;
+	bool						rearm_pending;
+	bool						disarmed;	/* fired ONESHOT */
 };
 
 /* Converts epoll events to FD taps. */
@@ -130,6 +143,18 @@ static struct epoll_ctlr *fd_to_cltr(int fd)
 	return container_of(ufd, struct epoll_ctlr, ufd);
 }
 
+/* Sends all of tap_reqs to the kernel, skipping over any that fail, such as
+ * REMs for FDs that were already closed. */
+static void ep_tap_fds_all(struct fd_tap_req *tap_reqs, int nr_reqs)
+{
+	int nr_done = 0;
+
+	while (nr_done < nr_reqs) {
+		nr_done += sys_tap_fds(tap_reqs + nr_done, nr_reqs - nr_done);
+		nr_done += 1;	/* skip the failed one, if any */
+	}
+}
+
 /* Event queue helpers: */
 static struct event_queue *ep_get_ceq_evq(unsigned int ceq_size)
 {
@@ -178,7 +203,6 @@ static void epoll_close(struct user_fd *ufd)
 	struct ceq_event *ceq_ev_i;
 	struct ep_fd_data *ep_fd_i;
 	int nr_tap_req = 0;
-	int nr_done = 0;
 
 	tap_reqs = malloc(sizeof(struct fd_tap_req) * ep->size);
 	memset(tap_reqs, 0, sizeof(struct fd_tap_req) * ep->size);
@@ -195,13 +219,10 @@ static void epoll_close(struct user_fd *ufd)
 		tap_req_i->cmd = FDTAP_CMD_REM;
 		free(ep_fd_i);
 	}
-	/* Requests could fail if the tapped files are already closed.  We need to
-	 * skip the failed one (the +1) and untap the rest. */
-	do {
-		nr_done += sys_tap_fds(tap_reqs + nr_done, nr_tap_req - nr_done);
-		nr_done += 1;	/* nr_done could be more than nr_tap_req now */
-	} while (nr_done < nr_tap_req);
+	/* Requests could fail if the tapped files are already closed. */
+	ep_tap_fds_all(tap_reqs, nr_tap_req);
 	free(tap_reqs);
+	free(ep->rearm_reqs);
 	ep_put_ceq_evq(ep->ceq_evq);
 	ep_put_alarm_evq(ep->alarm_evq);
 	uth_mutex_lock(ctlrs_mtx);
@@ -224,6 +245,9 @@ static int init_ep_ctlr(struct epoll_ctlr *ep, int size)
 	ep->ufd.magic = EPOLL_UFD_MAGIC;
 	ep->ufd.close = epoll_close;
 	ep->ceq_evq = ep_get_ceq_evq(ceq_size);
+	ep->ceq = &ep->ceq_evq->ev_mbox->ceq;
+	ep->rearm_reqs = malloc(sizeof(struct fd_tap_req) * ceq_size);
+	memset(ep->rearm_reqs, 0, sizeof(struct fd_tap_req) * ceq_size);
 	ep->alarm_evq = ep_get_alarm_evq();
 	return 0;
 }
@@ -282,22 +306,87 @@ int epoll_create1(int flags)
 	return epoll_create(1);
 }
 
+/* Helper, returns fd's bookkeeping, or 0 if fd isn't in the epoll set. */
+static struct ep_fd_data *ep_get_fd_data(struct epoll_ctlr *ep, int fd)
+{
+	struct ceq_event *ceq_ev = ep_get_ceq_ev(ep, fd);
+
+	return ceq_ev ? (struct ep_fd_data*)ceq_ev->user_data : 0;
+}
+
+/* Level-triggered and ONESHOT FDs need a MOD after they are reported. */
+static bool ep_needs_rearm(uint32_t ep_ev)
+{
+	return !(ep_ev & EPOLLET) || (ep_ev & EPOLLONESHOT);
+}
+
+/* Fills in the tap requests to add fd: an ADD, then for FDs that need re-arming
+ * a MOD right behind it, so we find out now if the device can't do MODs.
+ * Returns the number of requests, or -1 on error. */
+static int ep_prep_add(struct epoll_ctlr *ep, int fd, struct epoll_event *event,
+                       struct fd_tap_req *tap_reqs)
+{
+	struct ceq_event *ceq_ev = ep_get_ceq_ev(ep, fd);
+
+	if (!ceq_ev) {
+		errno = ENOMEM;
+		werrstr("Epoll set cannot grow yet!");
+		return -1;
+	}
+	if (ceq_ev->user_data) {
+		errno = EEXIST;
+		return -1;
+	}
+	tap_reqs[0].fd = fd;
+	tap_reqs[0].cmd = FDTAP_CMD_ADD;
+	/* EPOLLHUP is implicitly set for all epolls. */
+	tap_reqs[0].filter = ep_events_to_taps(event->events | EPOLLHUP);
+	tap_reqs[0].ev_q = ep->ceq_evq;
+	tap_reqs[0].ev_id = fd;	/* using FD as the CEQ ID */
+	if (!ep_needs_rearm(event->events))
+		return 1;
+	tap_reqs[1] = tap_reqs[0];
+	tap_reqs[1].cmd = FDTAP_CMD_MOD;
+	return 2;
+}
+
+static void ep_install_fd(struct epoll_ctlr *ep, struct fd_tap_req *tap_req,
+                          struct epoll_event *event)
+{
+	struct ep_fd_data *ep_fd = malloc(sizeof(struct ep_fd_data));
+
+	memset(ep_fd, 0, sizeof(struct ep_fd_data));
+	ep_fd->fd = tap_req->fd;
+	ep_fd->filter = tap_req->filter;
+	ep_fd->ep_event = *event;
+	ep_fd->ep_event.events |= EPOLLHUP;
+	ep_get_ceq_ev(ep, tap_req->fd)->user_data = (uint64_t)ep_fd;
+}
+
+/* Removes the taps added by the first nr_done of tap_reqs, after the batch
+ * failed partway.  Keeps the errno of the original failure. */
+static void ep_undo_adds(struct fd_tap_req *tap_reqs, int nr_done)
+{
+	int saved_errno = errno;
+	int nr_rem = 0;
+
+	for (int i = 0; i < nr_done; i++) {
+		if (tap_reqs[i].cmd != FDTAP_CMD_ADD)
+			continue;
+		tap_reqs[nr_rem] = tap_reqs[i];
+		tap_reqs[nr_rem++].cmd = FDTAP_CMD_REM;
+	}
+	ep_tap_fds_all(tap_reqs, nr_rem);
+	errno = saved_errno;
+}
+
 static int __epoll_ctl_add(struct epoll_ctlr *ep, int fd,
                            struct epoll_event *event)
 {
-	struct ceq_event *ceq_ev;
-	struct ep_fd_data *ep_fd;
-	struct fd_tap_req tap_req = {0};
-	int ret, filter, sock_listen_fd;
+	struct fd_tap_req tap_reqs[4] = {{0}};
 	struct epoll_event listen_event;
+	int ret, nr_reqs, nr_listen = 0, sock_listen_fd;
 
-	/* Only support ET.  Also, we just ignore EPOLLONESHOT.  That might work,
-	 * logically, just with spurious events firing. */
-	if (!(event->events & EPOLLET)) {
-		errno = EPERM;
-		werrstr("Epoll level-triggered not supported");
-		return -1;
-	}
 	/* The sockets-to-plan9 networking shims are a bit inconvenient.  The user
 	 * asked us to epoll on an FD, but that FD is actually a Qdata FD.  We might
 	 * need to actually epoll on the listen_fd.  Further, we don't know yet
@@ -307,56 +396,65 @@ static int __epoll_ctl_add(struct epoll_ctlr *ep, int fd,
 	 * So in the case we have a socket FD, we'll actually open the listen FD
 	 * regardless (glibc handles this), and we'll epoll on both FDs.
 	 * Technically, either FD could fire and they'd get an epoll event for it,
-	 * but I think socket users will use only listen or data.
+	 * but I think socket users will use only listen or data.  Both FDs' taps
+	 * go to the kernel in one sys_tap_fds() call.
 	 *
 	 * As far as tracking the FD goes for epoll_wait() reporting, if the app
 	 * wants to track the FD they think we are using, then they already passed
 	 * that in event->data. */
 	sock_listen_fd = _sock_lookup_listen_fd(fd);
 	if (sock_listen_fd >= 0) {
-		listen_event.events = EPOLLET | EPOLLIN | EPOLLHUP;
+		listen_event.events = (event->events & (EPOLLET | EPOLLONESHOT)) |
+		                      EPOLLIN | EPOLLHUP;
 		listen_event.data = event->data;
-		ret = __epoll_ctl_add(ep, sock_listen_fd, &listen_event);
-		if (ret < 0)
-			return ret;
+		nr_listen = ep_prep_add(ep, sock_listen_fd, &listen_event, tap_reqs);
+		if (nr_listen < 0)
+			return -1;
 	}
-	ceq_ev = ep_get_ceq_ev(ep, fd);
-	if (!ceq_ev) {
-		errno = ENOMEM;
-		werrstr("Epoll set cannot grow yet!");
+	ret = ep_prep_add(ep, fd, event, tap_reqs + nr_listen);
+	if (ret < 0)
 		return -1;
-	}
-	ep_fd = (struct ep_fd_data*)ceq_ev->user_data;
-	if (ep_fd) {
-		errno = EEXIST;
+	nr_reqs = nr_listen + ret;
+	ret = sys_tap_fds(tap_reqs, nr_reqs);
+	if (ret != nr_reqs) {
+		if (tap_reqs[ret].cmd == FDTAP_CMD_MOD) {
+			errno = EPERM;
+			werrstr("Epoll level-triggered or ONESHOT not supported for FD %d",
+			        tap_reqs[ret].fd);
+		}
+		ep_undo_adds(tap_reqs, ret);
 		return -1;
 	}
-	tap_req.fd = fd;
-	tap_req.cmd = FDTAP_CMD_ADD;
-	/* EPOLLHUP is implicitly set for all epolls. */
-	filter = ep_events_to_taps(event->events | EPOLLHUP);
-	tap_req.filter = filter;
-	tap_req.ev_q = ep->ceq_evq;
-	tap_req.ev_id = fd;	/* using FD as the CEQ ID */
-	ret = sys_tap_fds(&tap_req, 1);
-	if (ret != 1)
+	if (nr_listen)
+		ep_install_fd(ep, &tap_reqs[0], &listen_event);
+	ep_install_fd(ep, &tap_reqs[nr_listen], event);
+	return 0;
+}
+
+/* Forgets fd and fills in the REM for its tap.  Returns -1 if fd wasn't in the
+ * epoll set. */
+static int ep_prep_del(struct epoll_ctlr *ep, int fd,
+                       struct fd_tap_req *tap_req)
+{
+	struct ep_fd_data *ep_fd = ep_get_fd_data(ep, fd);
+
+	if (!ep_fd) {
+		errno = ENOENT;
 		return -1;
-	ep_fd = malloc(sizeof(struct ep_fd_data));
-	ep_fd->fd = fd;
-	ep_fd->filter = filter;
-	ep_fd->ep_event = *event;
-	ep_fd->ep_event.events |= EPOLLHUP;
-	ceq_ev->user_data = (uint64_t)ep_fd;
+	}
+	assert(ep_fd->fd == fd);
+	tap_req->fd = fd;
+	tap_req->cmd = FDTAP_CMD_REM;
+	ep_get_ceq_ev(ep, fd)->user_data = 0;
+	free(ep_fd);
 	return 0;
 }
 
 static int __epoll_ctl_del(struct epoll_ctlr *ep, int fd,
                            struct epoll_event *event)
 {
-	struct ceq_event *ceq_ev;
-	struct ep_fd_data *ep_fd;
-	struct fd_tap_req tap_req = {0};
-	int ret, sock_listen_fd;
+	struct fd_tap_req tap_reqs[2] = {{0}};
+	int ret, nr_reqs = 0, sock_listen_fd;
 
 	/* If we were dealing with a socket shim FD, we tapped both the listen and
 	 * the data file and need to untap both of them. */
@@ -367,26 +465,79 @@ static int __epoll_ctl_del(struct epoll_ctlr *ep, int fd,
 		 * sock_listen_fd to be closed first, which would have triggered an
 		 * epoll_ctl_del.  When we get around to closing the Rock FD, the listen
 		 * FD was already closed. */
-		__epoll_ctl_del(ep, sock_listen_fd, event);
-	}
-	ceq_ev = ep_get_ceq_ev(ep, fd);
-	if (!ceq_ev) {
-		errno = ENOENT;
-		return -1;
+		if (!ep_prep_del(ep, sock_listen_fd, &tap_reqs[nr_reqs]))
+			nr_reqs++;
 	}
-	ep_fd = (struct ep_fd_data*)ceq_ev->user_data;
+	ret = ep_prep_del(ep, fd, &tap_reqs[nr_reqs]);
+	if (!ret)
+		nr_reqs++;
+	/* ignoring failures; we could have failed to remove a tap if the FD has
+	 * already closed and the kernel removed the tap. */
+	ep_tap_fds_all(tap_reqs, nr_reqs);
+	return ret;
+}
+
+/* Fills in the MOD to change fd's events.  Returns fd's ep_fd, or 0 if fd
+ * wasn't in the epoll set. */
+static struct ep_fd_data *ep_prep_mod(struct epoll_ctlr *ep, int fd,
+                                      struct epoll_event *event,
+                                      struct fd_tap_req *tap_req)
+{
+	struct ep_fd_data *ep_fd = ep_get_fd_data(ep, fd);
+
 	if (!ep_fd) {
 		errno = ENOENT;
+		return 0;
+	}
+	tap_req->fd = fd;
+	tap_req->cmd = FDTAP_CMD_MOD;
+	tap_req->filter = ep_events_to_taps(event->events | EPOLLHUP);
+	tap_req->ev_q = ep->ceq_evq;
+	tap_req->ev_id = fd;
+	return ep_fd;
+}
+
+/* Changes fd's events in place.  The MOD also re-arms the taps, so a fired
+ * ONESHOT FD will report again if it is already ready.  Devices that can't do
+ * MODs get a DEL and an ADD. */
+static int __epoll_ctl_mod(struct epoll_ctlr *ep, int fd,
+                           struct epoll_event *event)
+{
+	struct fd_tap_req tap_reqs[2] = {{0}};
+	struct ep_fd_data *ep_fds[2];
+	struct epoll_event events[2];
+	int ret, nr_reqs = 0, sock_listen_fd;
+
+	sock_listen_fd = _sock_lookup_listen_fd(fd);
+	if (sock_listen_fd >= 0) {
+		events[nr_reqs].events = (event->events & (EPOLLET | EPOLLONESHOT)) |
+		                         EPOLLIN | EPOLLHUP;
+		events[nr_reqs].data = event->data;
+		ep_fds[nr_reqs] = ep_prep_mod(ep, sock_listen_fd, &events[nr_reqs],
+		                              &tap_reqs[nr_reqs]);
+		if (ep_fds[nr_reqs])
+			nr_reqs++;
+	}
+	events[nr_reqs] = *event;
+	ep_fds[nr_reqs] = ep_prep_mod(ep, fd, event, &tap_reqs[nr_reqs]);
+	if (!ep_fds[nr_reqs])
 		return -1;
+	nr_reqs++;
+	ret = sys_tap_fds(tap_reqs, nr_reqs);
+	if (ret != nr_reqs) {
+		ret = __epoll_ctl_del(ep, fd, 0);
+		if (ret)
+			return ret;
+		return __epoll_ctl_add(ep, fd, event);
+	}
+	for (int i = 0; i < nr_reqs; i++) {
+		ep_fds[i]->filter = tap_reqs[i].filter;
+		ep_fds[i]->ep_event = events[i];
+		ep_fds[i]->ep_event.events |= EPOLLHUP;
+		ep_fds[i]->disarmed = FALSE;
+		/* Any re-arm from the last epoll_wait() is stale now */
+		ep_fds[i]->rearm_pending = FALSE;
 	}
-	assert(ep_fd->fd == fd);
-	tap_req.fd = fd;
-	tap_req.cmd = FDTAP_CMD_REM;
-	/* ignoring the return value; we could have failed to remove it if the FD
-	 * has already closed and the kernel removed the tap. */
-	sys_tap_fds(&tap_req, 1);
-	ceq_ev->user_data = 0;
-	free(ep_fd);
 	return 0;
 }
 
@@ -406,14 +557,7 @@ int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 	uth_mutex_lock(ep->mtx);
 	switch (op) {
 		case (EPOLL_CTL_MOD):
-			/* In lieu of a proper MOD, just remove and readd.  The errors might
-			 * not work out well, and there could be a missed event in the
-			 * middle.  Not sure what the guarantees are, but we can fake a
-			 * poke. (TODO). */
-			ret = __epoll_ctl_del(ep, fd, 0);
-			if (ret)
-				break;
-			ret = __epoll_ctl_add(ep, fd, event);
+			ret = __epoll_ctl_mod(ep, fd, event);
 			break;
 		case (EPOLL_CTL_ADD):
 			ret = __epoll_ctl_add(ep, fd, event);
@@ -429,6 +573,48 @@ int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 	return ret;
 }
 
+/* Queues up the MOD for a reported ep_fd, if it needs one.  Level-triggered FDs
+ * get their filter back, so the kernel reposts them if they are still ready.
+ * ONESHOT FDs get an empty filter, until the next EPOLL_CTL_MOD. */
+static void ep_queue_rearm(struct epoll_ctlr *ep, struct ep_fd_data *ep_fd)
+{
+	uint32_t ep_ev = ep_fd->ep_event.events;
+	struct fd_tap_req *tap_req;
+
+	if (!ep_needs_rearm(ep_ev) || ep_fd->rearm_pending)
+		return;
+	assert(ep->nr_rearm < ep->size);
+	tap_req = &ep->rearm_reqs[ep->nr_rearm++];
+	tap_req->fd = ep_fd->fd;
+	tap_req->cmd = FDTAP_CMD_MOD;
+	tap_req->filter = ep_ev & EPOLLONESHOT ? 0 : ep_fd->filter;
+	tap_req->ev_q = ep->ceq_evq;
+	tap_req->ev_id = ep_fd->fd;
+	ep_fd->rearm_pending = TRUE;
+	if (ep_ev & EPOLLONESHOT)
+		ep_fd->disarmed = TRUE;
+}
+
+/* Sends the re-arms queued by the last epoll_wait() in one batch.  We wait
+ * until the next epoll_wait(), so that the app has had a chance to drain its
+ * level-triggered FDs.  Entries for FDs that were deleted or modified since
+ * then are skipped. */
+static void ep_flush_rearms(struct epoll_ctlr *ep)
+{
+	struct ep_fd_data *ep_fd;
+	int nr_reqs = 0;
+
+	for (int i = 0; i < ep->nr_rearm; i++) {
+		ep_fd = ep_get_fd_data(ep, ep->rearm_reqs[i].fd);
+		if (!ep_fd || !ep_fd->rearm_pending)
+			continue;
+		ep_fd->rearm_pending = FALSE;
+		ep->rearm_reqs[nr_reqs++] = ep->rearm_reqs[i];
+	}
+	ep->nr_rearm = 0;
+	ep_tap_fds_all(ep->rearm_reqs, nr_reqs);
+}
+
 static bool get_ep_event_from_msg(struct epoll_ctlr *ep, struct event_msg *msg,
                                   struct epoll_event *ep_ev)
 {
@@ -444,32 +630,43 @@ static bool get_ep_event_from_msg(struct epoll_ctlr *ep, struct event_msg *msg,
 		 * event sent to this epoll set. */
 		return FALSE;
 	}
+	/* ONESHOTs could have been posted again before the disarm took effect */
+	if (ep_fd->disarmed)
+		return FALSE;
 	ep_ev->data = ep_fd->ep_event.data;
 	/* The events field was initialized to 0 in epoll_wait() */
 	ep_ev->events |= taps_to_ep_events(msg->ev_arg2);
+	ep_queue_rearm(ep, ep_fd);
 	return TRUE;
 }
 
-/* Helper: extracts as many epoll_events as possible from the ep. */
-static int __epoll_wait_poll(struct epoll_ctlr *ep, struct epoll_event *events,
-                             int maxevents)
+/* Helper: extracts as many epoll_events as possible from the ep, starting with
+ * msg, if we have one already.  We pull straight from the CEQ's ring, which
+ * only has the FDs that had activity. */
+static int __epoll_wait_poll(struct epoll_ctlr *ep, struct event_msg *msg,
+                             struct epoll_event *events, int maxevents)
 {
-	struct event_msg msg = {0};
+	struct event_msg local_msgs[CEQ_GET_BATCH];
+	unsigned int nr_msgs;
 	int nr_ret = 0;
 
-	if (maxevents <= 0)
-		return 0;
 	/* Locking to protect get_ep_event_from_msg, specifically that the ep_fd
 	 * stored at ceq_ev->user_data does not get concurrently removed and
 	 * freed. */
 	uth_mutex_lock(ep->mtx);
-	for (int i = 0; i < maxevents; i++) {
-retry:
-		if (!uth_check_evqs(&msg, NULL, 1, ep->ceq_evq))
-			break;
-		if (!get_ep_event_from_msg(ep, &msg, &events[i]))
-			goto retry;
+	/* Still-ready level-triggered FDs get reposted to the CEQ here */
+	ep_flush_rearms(ep);
+	if (msg && get_ep_event_from_msg(ep, msg, &events[nr_ret]))
 		nr_ret++;
+	while (nr_ret < maxevents) {
+		nr_msgs = get_ceq_msgs(ep->ceq, local_msgs,
+		                       MIN(maxevents - nr_ret, CEQ_GET_BATCH));
+		if (!nr_msgs)
+			break;
+		for (unsigned int i = 0; i < nr_msgs; i++) {
+			if (get_ep_event_from_msg(ep, &local_msgs[i], &events[nr_ret]))
+				nr_ret++;
+		}
 	}
 	uth_mutex_unlock(ep->mtx);
 	return nr_ret;
@@ -487,7 +684,7 @@ static int __epoll_wait(struct epoll_ctlr *ep, struct epoll_event *events,
 	int nr_ret;
 	struct syscall sysc;
 
-	nr_ret = __epoll_wait_poll(ep, events, maxevents);
+	nr_ret = __epoll_wait_poll(ep, 0, events, maxevents);
 	if (nr_ret)
 		return nr_ret;
 	if (timeout == 0)
@@ -507,13 +704,9 @@ static int __epoll_wait(struct epoll_ctlr *ep, struct epoll_event *events,
 	} else {
 		uth_blockon_evqs(&msg, &which_evq, 1, ep->ceq_evq);
 	}
-	uth_mutex_lock(ep->mtx);
-	if (get_ep_event_from_msg(ep, &msg, &events[0]))
-		nr_ret = 1;
-	uth_mutex_unlock(ep->mtx);
 	/* We had to extract one message already as part of the blocking process.
 	 * We might be able to get more. */
-	nr_ret += __epoll_wait_poll(ep, events + nr_ret, maxevents - nr_ret);
+	nr_ret = __epoll_wait_poll(ep, &msg, events, maxevents);
 	/* This is a little nasty and hopefully a rare race.  We still might not
 	 * have a ret, but we expected to block until we had something.  We didn't
 	 * time out yet, but we spuriously woke up.  We need to try again (ideally,
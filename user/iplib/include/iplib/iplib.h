@@ -181,6 +181,17 @@ struct udphdr
 	uint8_t	lport[2];		/* local port */
 };
 
+/*
+ *  with control message "batch", reads and writes carry many datagrams.
+ *  each is a 2 byte (big endian) length, then that many bytes of udphdr and
+ *  data.  reads return as many whole datagrams as fit in the buffer, which
+ *  should be big enough for the largest one.  writes should stay under 64K.
+ */
+enum
+{
+	Udpbatchhdrsize=	2,
+};
+
 uint8_t*	defmask(uint8_t*);
 void	maskip(uint8_t*, uint8_t*, uint8_t*);
 //int	eipfmt(Fmt*);
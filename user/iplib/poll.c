@@ -54,9 +54,9 @@ int ppoll(struct pollfd *fds, nfds_t nfds,
 		if (max_fd_plus_one < fds[i].fd + 1)
 			max_fd_plus_one = fds[i].fd + 1;
 		if (fds[i].events & (POLLIN | POLLPRI))
-			FD_SET(i, &rd_fds);
+			FD_SET(fds[i].fd, &rd_fds);
 		if (fds[i].events & POLLOUT)
-			FD_SET(i, &wr_fds);
+			FD_SET(fds[i].fd, &wr_fds);
 		/* TODO: We should be also asking for exceptions on all FDs.  But select
 		 * is spurious, so it will actually tell us we had errors on all of our
 		 * FDs, which will probably confuse programs. */
@@ -71,11 +71,11 @@ int ppoll(struct pollfd *fds, nfds_t nfds,
 			continue;
 		ret++;
 		fds[i].revents = 0;
-		if (FD_ISSET(i, &rd_fds))
+		if (FD_ISSET(fds[i].fd, &rd_fds))
 			fds[i].revents |= POLLIN | POLLPRI;
-		if (FD_ISSET(i, &wr_fds))
+		if (FD_ISSET(fds[i].fd, &wr_fds))
 			fds[i].revents |= POLLOUT;
-		if (FD_ISSET(i, &ex_fds))
+		if (FD_ISSET(fds[i].fd, &ex_fds))
 			fds[i].revents |= POLLERR | POLLHUP;
 	}
 	return ret;
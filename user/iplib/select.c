@@ -8,18 +8,25 @@
  * non-blocking I/O.
  *
  * Under the hood, our select() is implemented with epoll (and under that, FD
- * taps).  Those can only detect edges (e.g. a socket becomes readable).
+ * taps).  The epoll set persists across calls: an FD is added the first time
+ * anyone selects on it and stays until it is closed, so a select() loop over
+ * the same FDs costs one epoll_wait() per call, not a few syscalls per FD.
  *
- * The problem is that we want to detect a level status (e.g. socket is
- * readable) with an edge event (e.g. socket *becomes* readable).  To do this,
- * when someone initially selects, the FD gets tracked with epoll and we
- * immediately return saying the FD is ready for whatever they asked for.  This
- * is usually not true, and the application will need to poll all of its FDs
- * once after the initial select() call.  Subsequent selects() will still be
- * tracking the FD in the epoll set.  If any edge events that come after the
- * poll (which eventually returns EAGAIN) will be caught by epoll, and a
- * subsequent select will wake up (or never block in the first place) due to the
- * reception of that edge event.
+ * When the FD's device can re-arm its taps (#ip and #pipe), we track the FD
+ * level-triggered.  The kernel reports whether the FD is ready as soon as it
+ * is added and on every epoll_wait() after that, so those FDs need neither an
+ * fstat() nor a spurious return.
+ *
+ * Other FDs only get edges (e.g. a socket *becomes* readable).  When someone
+ * initially selects, the FD gets tracked with epoll and we immediately return
+ * saying the FD is ready for whatever they asked for.  This is usually not
+ * true, and the application will need to poll all of its FDs once after the
+ * initial select() call.  Subsequent selects() will still be tracking the FD
+ * in the epoll set.  If any edge events that come after the poll (which
+ * eventually returns EAGAIN) will be caught by epoll, and a subsequent select
+ * will wake up (or never block in the first place) due to the reception of
+ * that edge event.  We also fstat() these FDs on every call, since apps may
+ * select() on an FD they haven't drained.
  *
  * We maintain one FD set per program.  It tracks *any* FD being tracked by
  * *any* select call.  Regardless of whether the user asked for
@@ -27,11 +34,11 @@
  * will result in spurious wakeups.
  *
  * One issue with the global FD set is that one thread may consume the epoll
- * events intended for another thread (or even for itself at another call
+ * edge events intended for another thread (or even for itself at another call
  * site!).  To get around this, only one thread is the actual epoller, and the
- * others block on a mutex.  An alternative is to use a per-thread FD set, using
- * TLS, but not every 2LS uses TLS, and performance is not a concern for code
- * using select().
+ * others block on a mutex.  Level-triggered FDs don't have this problem, since
+ * the kernel reports them again until they are not ready.  An alternative is to
+ * use a per-thread FD set, using TLS, but not every 2LS uses TLS.
  *
  * Notes:
  * - pselect might be racy
@@ -63,6 +70,7 @@
 
 static int epoll_fd;
 static fd_set all_fds;
+static fd_set edge_fds;		/* subset of all_fds, tracked edge-triggered */
 static uth_mutex_t fdset_mtx;
 static uintptr_t unique_caller;
 static uth_mutex_t sleep_mtx;
@@ -86,6 +94,7 @@ static void select_fd_closed(int fd)
 	 * epoll set, since that will happen automatically on close(). */
 	uth_mutex_lock(fdset_mtx);
 	FD_CLR(fd, &all_fds);
+	FD_CLR(fd, &edge_fds);
 	uth_mutex_unlock(fdset_mtx);
 }
 
@@ -104,6 +113,7 @@ static void select_forked(void)
 			 * no epoll/tap so that a future CTL_ADD doesn't fail. */
 			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, i, &ep_ev);
 			FD_CLR(i, &all_fds);
+			FD_CLR(i, &edge_fds);
 		}
 	}
 	uth_mutex_unlock(fdset_mtx);
@@ -154,11 +164,45 @@ static bool fd_is_actionable(int fd, fd_set *readfds, fd_set *writefds)
 	       (fd_is_set(fd, writefds) && S_WRITABLE(stat_buf.st_mode));
 }
 
+/* Starts tracking fd with epoll.  We try level-triggered first, then fall back
+ * to edge-triggered for devices that can't re-arm taps.  We also might fail
+ * because we tried to set up too many FD tap types.  Listen FDs, for instance,
+ * can only be tapped for READABLE and HANGUP, so we try for just those too.
+ *
+ * FDs that we track for *any* reason with select will be tracked for *all*
+ * reasons with epoll.  Call with fdset_mtx held.  Returns 0 on success, -1 with
+ * errno set on failure. */
+static int select_track_fd(int fd)
+{
+	static const uint32_t try_events[] = {
+		EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR,
+		EPOLLIN | EPOLLHUP,
+		EPOLLET | EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR,
+		EPOLLET | EPOLLIN | EPOLLHUP,
+	};
+	struct epoll_event ep_ev;
+
+	for (int i = 0; i < COUNT_OF(try_events); i++) {
+		ep_ev.events = try_events[i];
+		ep_ev.data.fd = fd;
+		if (!epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ep_ev)) {
+			FD_SET(fd, &all_fds);
+			if (ep_ev.events & EPOLLET)
+				FD_SET(fd, &edge_fds);
+			return 0;
+		}
+		/* ENOSYS is an unsupported tap filter, EPERM is no tap re-arming */
+		if ((errno != ENOSYS) && (errno != EPERM))
+			return -1;
+	}
+	return -1;
+}
+
 int select(int nfds, fd_set *readfds, fd_set *writefds,
            fd_set *exceptfds, struct timeval *timeout)
 {
 	bool changed_set = FALSE;
-	struct epoll_event ep_ev;
+	bool has_edge_fds = FALSE;
 	struct epoll_event *ep_results;
 	uintptr_t my_call_id;
 	int ret;
@@ -171,46 +215,40 @@ int select(int nfds, fd_set *readfds, fd_set *writefds,
 		return -1;
 	}
 	/* It is legal to select on read even if you didn't consume all of the data
-	 * in an FD; similarly for writers on non-full FDs. */
+	 * in an FD; similarly for writers on non-full FDs.  Level-triggered FDs
+	 * don't need the check; epoll_wait() will tell us about them.  This races
+	 * with other selects changing the sets, but at worst we do an extra
+	 * fstat(). */
 	for (int i = 0; i < nfds; i++) {
+		if (fd_is_set(i, &all_fds) && !fd_is_set(i, &edge_fds))
+			continue;
 		if (fd_is_actionable(i, readfds, writefds))
 			return nfds;
 	}
 	uth_mutex_lock(fdset_mtx);
 	for (int i = 0; i < nfds; i++) {
-		if ((fd_is_set(i, readfds) || fd_is_set(i, writefds) ||
-		    fd_is_set(i, exceptfds)) && !fd_is_set(i, &all_fds)) {
-
-			changed_set = TRUE;
-			FD_SET(i, &all_fds);
-			/* FDs that we track for *any* reason with select will be
-			 * tracked for *all* reasons with epoll. */
-			ep_ev.events = EPOLLET | EPOLLIN | EPOLLOUT | EPOLLHUP |
-			               EPOLLERR;
-			ep_ev.data.fd = i;
-			if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, i, &ep_ev)) {
-				/* We might have failed because we tried to set up too many
-				 * FD tap types.  Listen FDs, for instance, can only be
-				 * tapped for READABLE and HANGUP.  Let's try for one of
-				 * those. */
-				if (errno == ENOSYS) {
-					ep_ev.events = EPOLLET | EPOLLIN | EPOLLHUP;
-					if (!epoll_ctl(epoll_fd, EPOLL_CTL_ADD, i, &ep_ev))
-						continue;
-				}
+		if (!(fd_is_set(i, readfds) || fd_is_set(i, writefds) ||
+		      fd_is_set(i, exceptfds)))
+			continue;
+		if (!fd_is_set(i, &all_fds)) {
+			if (select_track_fd(i)) {
 				/* Careful to unlock before calling perror.  perror calls
 				 * close, which calls our CB, which grabs the lock. */
 				uth_mutex_unlock(fdset_mtx);
 				perror("select epoll_ctl failed");
 				return -1;
 			}
+			if (fd_is_set(i, &edge_fds))
+				changed_set = TRUE;
 		}
+		if (fd_is_set(i, &edge_fds))
+			has_edge_fds = TRUE;
 	}
 	uth_mutex_unlock(fdset_mtx);
-	/* Since we just added some FD to our tracking set, we don't know if its
-	 * readable or not.  We'll only catch edge-triggered changes in the future.
-	 * We can spuriously tell the user all FDs are ready, and next time they
-	 * can block until there is edge activity. */
+	/* Since we just added some edge-triggered FD to our tracking set, we don't
+	 * know if its readable or not.  We'll only catch edge-triggered changes in
+	 * the future.  We can spuriously tell the user all FDs are ready, and next
+	 * time they can block until there is edge activity. */
 	if (changed_set)
 		return nfds;
 	/* Since there is a global epoll set, we could have multiple threads
@@ -225,10 +263,13 @@ int select(int nfds, fd_set *readfds, fd_set *writefds,
 	 * If the same {thread, callsite} selects again and no one else has since
 	 * selected, then we know no one consumed the events.  We'll use the stack
 	 * pointer to uniquely identify the {thread, callsite} combo that recently
-	 * selected.  We use a mutex so that the extra threads sleep. */
+	 * selected.  We use a mutex so that the extra threads sleep.
+	 *
+	 * Level-triggered FDs get reported again, so if we only have those, we
+	 * don't care who polled last. */
 	uth_mutex_lock(sleep_mtx);
 	my_call_id = get_stack_pointer();
-	if (my_call_id != unique_caller) {
+	if (has_edge_fds && (my_call_id != unique_caller)) {
 		/* Could thrash, if we fight with another uth for unique_caller */
 		unique_caller = my_call_id;
 		uth_mutex_unlock(sleep_mtx);
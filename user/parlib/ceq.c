@@ -16,7 +16,12 @@
  * small, then the ring may overflow, triggering an O(n) scan of the events
  * array.  You could make it the nearest power of 2 >= nr_events, for reasonable
  * behavior at the expense of memory.  It'll be very rare for the ring to have
- * more entries than the array has events. */
+ * more entries than the array has events.
+ *
+ * The events array and the ring are mmapped and populated when the CEQ is
+ * made, so the kernel never faults on them while posting.  Anonymous memory
+ * stays put once it's populated.  Arrays of PTSIZE or more are PTSIZE aligned,
+ * so the populate backs them with jumbo pages. */
 
 #include <parlib/ceq.h>
 #include <parlib/arch/atomic.h>
@@ -25,6 +30,38 @@
 #include <parlib/spinlock.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/mman.h>
+
+/* Returns size bytes (rounded up to pages) of zeroed, populated memory. */
+static void *ceq_alloc(size_t size)
+{
+	size_t len = ROUNDUP(size, PGSIZE);
+	uintptr_t va, aligned;
+	void *ret;
+
+	if (len < PTSIZE) {
+		ret = mmap(0, len, PROT_WRITE | PROT_READ,
+		           MAP_POPULATE | MAP_ANONYMOUS, -1, 0);
+		assert(ret != MAP_FAILED);
+		return ret;
+	}
+	/* Reserve enough to hold an aligned run, map over it, and trim the rest */
+	va = (uintptr_t)mmap(0, len + PTSIZE, PROT_NONE, MAP_ANONYMOUS, -1, 0);
+	assert((void*)va != MAP_FAILED);
+	aligned = ROUNDUP(va, PTSIZE);
+	ret = mmap((void*)aligned, len, PROT_WRITE | PROT_READ,
+	           MAP_FIXED | MAP_POPULATE | MAP_ANONYMOUS, -1, 0);
+	assert(ret == (void*)aligned);
+	if (aligned != va)
+		munmap((void*)va, aligned - va);
+	munmap((void*)(aligned + len), va + PTSIZE - aligned);
+	return ret;
+}
+
+static void ceq_free(void *addr, size_t size)
+{
+	munmap(addr, ROUNDUP(size, PGSIZE));
+}
 
 void ceq_init(struct ceq *ceq, uint8_t op, unsigned int nr_events,
               size_t ring_sz)
@@ -33,11 +70,10 @@ void ceq_init(struct ceq *ceq, uint8_t op, unsigned int nr_events,
 	 * so we don't leak memory.  They better not have asked for events before
 	 * doing this init call... */
 	ceq_cleanup(ceq);
-	ceq->events = malloc(sizeof(struct ceq_event) * nr_events);
-	memset(ceq->events, 0, sizeof(struct ceq_event) * nr_events);
+	ceq->events = ceq_alloc(sizeof(struct ceq_event) * nr_events);
 	ceq->nr_events = nr_events;
 	assert(IS_PWR2(ring_sz));
-	ceq->ring = malloc(sizeof(int32_t) * ring_sz);
+	ceq->ring = ceq_alloc(sizeof(int32_t) * ring_sz);
 	memset(ceq->ring, 0xff, sizeof(int32_t) * ring_sz);
 	ceq->ring_sz = ring_sz;
 	ceq->operation = op;
@@ -49,30 +85,39 @@ void ceq_init(struct ceq *ceq, uint8_t op, unsigned int nr_events,
 	spin_pdr_init((struct spin_pdr_lock*)&ceq->u_lock);
 }
 
-/* Helper, returns an index into the events array from the ceq ring.  -1 if the
- * ring was empty when we looked (could be filled right after we looked).  This
- * is the same algorithm used with BCQs, but with a magic value (-1) instead of
- * a bool to track whether or not the slot is ready for consumption. */
-static int32_t get_ring_idx(struct ceq *ceq)
+/* Helper, claims up to max indexes into the events array from the ceq ring,
+ * putting them in idxs.  Returns how many we got, 0 if the ring was empty when
+ * we looked (could be filled right after we looked).  This is the same
+ * algorithm used with BCQs, but with a magic value (-1) instead of a bool to
+ * track whether or not the slot is ready for consumption.  We grab all of our
+ * slots with one CAS, and advance cons_pub once for all of them. */
+static unsigned int get_ring_idxs(struct ceq *ceq, int32_t *idxs,
+                                  unsigned int max)
 {
 	long pvt_idx, prod_idx;
-	int32_t ret;
+	unsigned int nr;
+	int32_t *slot;
+
 	do {
 		prod_idx = atomic_read(&ceq->prod_idx);
 		pvt_idx = atomic_read(&ceq->cons_pvt_idx);
 		if (__ring_empty(prod_idx, pvt_idx))
-			return -1;
-	} while (!atomic_cas(&ceq->cons_pvt_idx, pvt_idx, pvt_idx + 1));
-	/* We claimed our slot, which is pvt_idx.  The new cons_pvt_idx is advanced
-	 * by 1 for the next consumer.  Now we need to wait on the kernel to fill
-	 * the value: */
-	while ((ret = ceq->ring[pvt_idx & (ceq->ring_sz - 1)]) == -1)
-		cpu_relax();
-	/* Set the value back to -1 for the next time the slot is used */
-	ceq->ring[pvt_idx & (ceq->ring_sz - 1)] = -1;
-	/* We now have our entry.  We need to make sure the pub_idx is updated.  All
-	 * consumers are doing this.  We can just wait on all of them to update the
-	 * cons_pub to our location, then we update it to the next.
+			return 0;
+		nr = MIN(__ring_nr_full(prod_idx, pvt_idx), max);
+	} while (!atomic_cas(&ceq->cons_pvt_idx, pvt_idx, pvt_idx + nr));
+	/* We claimed our slots, starting at pvt_idx.  The new cons_pvt_idx is
+	 * advanced by nr for the next consumer.  Now we need to wait on the kernel
+	 * to fill the values: */
+	for (unsigned int i = 0; i < nr; i++) {
+		slot = &ceq->ring[(pvt_idx + i) & (ceq->ring_sz - 1)];
+		while ((idxs[i] = ACCESS_ONCE(*slot)) == -1)
+			cpu_relax();
+		/* Set the value back to -1 for the next time the slot is used */
+		*slot = -1;
+	}
+	/* We now have our entries.  We need to make sure the pub_idx is updated.
+	 * All consumers are doing this.  We can just wait on all of them to update
+	 * the cons_pub to our location, then we update it to the next.
 	 *
 	 * We're waiting on other vcores, but we don't know which one(s). */
 	while (atomic_read(&ceq->cons_pub_idx) != pvt_idx)
@@ -82,7 +127,16 @@ static int32_t get_ring_idx(struct ceq *ceq)
 	 * no one gets to this point until pub == their pvt_idx, all of which are
 	 * unique. */
 	/* No rwmb needed, it's the same variable (con_pub) */
-	atomic_set(&ceq->cons_pub_idx, pvt_idx + 1);
+	atomic_set(&ceq->cons_pub_idx, pvt_idx + nr);
+	return nr;
+}
+
+static int32_t get_ring_idx(struct ceq *ceq)
+{
+	int32_t ret;
+
+	if (!get_ring_idxs(ceq, &ret, 1))
+		return -1;
 	return ret;
 }
 
@@ -174,6 +228,30 @@ bool get_ceq_msg(struct ceq *ceq, struct event_msg *msg)
 	return TRUE;
 }
 
+/* Consumer side, fills up to max msgs with ones that had activity, and returns
+ * how many it got.  This is get_ceq_msg() for a batch: the cost is in the
+ * number of ready events, not the total, unless the ring overflowed. */
+unsigned int get_ceq_msgs(struct ceq *ceq, struct event_msg *msgs,
+                          unsigned int max)
+{
+	int32_t idxs[CEQ_GET_BATCH];
+	unsigned int nr = 0, nr_idxs;
+
+	while (nr < max) {
+		nr_idxs = get_ring_idxs(ceq, idxs, MIN(max - nr, CEQ_GET_BATCH));
+		if (!nr_idxs)
+			break;
+		for (unsigned int i = 0; i < nr_idxs; i++) {
+			if (extract_ceq_msg(ceq, idxs[i], &msgs[nr]))
+				nr++;
+		}
+	}
+	/* Picks up anything left over from an overflow */
+	while ((nr < max) && get_ceq_msg(ceq, &msgs[nr]))
+		nr++;
+	return nr;
+}
+
 /* pvt_idx is the next slot that a new consumer will try to consume.  when
  * pvt_idx != pub_idx, pub_idx is lagging, and it represents consumptions in
  * progress. */
@@ -195,6 +273,10 @@ bool ceq_is_empty(struct ceq *ceq)
 
 void ceq_cleanup(struct ceq *ceq)
 {
-	free(ceq->events);
-	free(ceq->ring);
+	if (ceq->events)
+		ceq_free(ceq->events, sizeof(struct ceq_event) * ceq->nr_events);
+	if (ceq->ring)
+		ceq_free(ceq->ring, sizeof(int32_t) * ceq->ring_sz);
+	ceq->events = NULL;
+	ceq->ring = NULL;
 }
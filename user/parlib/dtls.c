@@ -9,9 +9,9 @@
 #include <parlib/spinlock.h>
 #include <stddef.h>
 
-/* The current dymamic tls implementation uses a locked linked list
- * to find the key for a given thread. We should probably find a better way to
- * do this based on a custom lock-free hash table or something. */
+/* Keys beyond the static ones live on a per-thread linked list, which we have
+ * to search.  We should probably find a better way to do this based on a
+ * custom lock-free hash table or something. */
 #include <parlib/spinlock.h>
 #include <sys/queue.h>
 
@@ -19,7 +19,15 @@
  * and the per-thread memory for the values associated with those keys is
  * allocated statically. This is adapted from glibc's notion of the
  * "specific_1stblock" field embedded directly into its pthread structure for
- * pthread_get/specific() calls. */
+ * pthread_get/specific() calls.
+ *
+ * A static key's id indexes each thread's early_values directly, so getting
+ * one is just a couple of loads.  An unset early value has a NULL dtls, so we
+ * don't even check its key.  That holds as long as a static id isn't reused
+ * until no thread has a value for it, which is what the key's ref count tells
+ * us: every value holds a ref, and freeing a value clears it.  Freed static ids
+ * go on free_static_ids, so churning keys doesn't push them all onto the
+ * lists. */
 #define NUM_STATIC_KEYS 32
 
 /* The dynamic tls key structure */
@@ -57,6 +65,9 @@ static __thread dtls_data_t __dtls_data;
 static __thread bool __dtls_initialized;
 static struct dtls_key static_dtls_keys[NUM_STATIC_KEYS];
 static int num_dtls_keys;
+static struct spin_pdr_lock free_static_ids_lock = SPINPDR_INITIALIZER;
+static int free_static_ids[NUM_STATIC_KEYS];
+static int nr_free_static_ids;
 
 /* Initialize the slab caches for allocating dtls keys and values. */
 int dtls_cache_init(void)
@@ -81,10 +92,35 @@ int dtls_cache_init(void)
 	return 0;
 }
 
+/* Returns a freed static id, or -1 if there aren't any. */
+static int __get_free_static_id(void)
+{
+	int keyid = -1;
+
+	if (!ACCESS_ONCE(nr_free_static_ids))
+		return -1;
+	spin_pdr_lock(&free_static_ids_lock);
+	if (nr_free_static_ids)
+		keyid = free_static_ids[--nr_free_static_ids];
+	spin_pdr_unlock(&free_static_ids_lock);
+	return keyid;
+}
+
+static void __put_free_static_id(int keyid)
+{
+	spin_pdr_lock(&free_static_ids_lock);
+	assert(nr_free_static_ids < NUM_STATIC_KEYS);
+	free_static_ids[nr_free_static_ids++] = keyid;
+	spin_pdr_unlock(&free_static_ids_lock);
+}
+
 static dtls_key_t __allocate_dtls_key(void)
 {
 	dtls_key_t key;
-	int keyid = __sync_fetch_and_add(&num_dtls_keys, 1);
+	int keyid = __get_free_static_id();
+
+	if (keyid < 0)
+		keyid = __sync_fetch_and_add(&num_dtls_keys, 1);
 
 	if (keyid < NUM_STATIC_KEYS) {
 		key = &static_dtls_keys[keyid];
@@ -102,7 +138,11 @@ static void __maybe_free_dtls_key(dtls_key_t key)
 {
 	int ref_count = __sync_add_and_fetch(&key->ref_count, -1);
 
-	if (ref_count == 0 && key->id >= NUM_STATIC_KEYS)
+	if (ref_count)
+		return;
+	if (key->id < NUM_STATIC_KEYS)
+		__put_free_static_id(key->id);
+	else
 		kmem_cache_free(__dtls_keys_cache, key);
 }
 
@@ -121,8 +161,12 @@ static struct dtls_value *__allocate_dtls_value(struct dtls_data *dtls_data,
 
 static void __free_dtls_value(struct dtls_value *v)
 {
-	if (v->key->id >= NUM_STATIC_KEYS)
+	if (v->key->id < NUM_STATIC_KEYS) {
+		v->key = NULL;
+		v->dtls = NULL;
+	} else {
 		kmem_cache_free(__dtls_values_cache, v);
+	}
 }
 
 dtls_key_t dtls_key_create(dtls_dtor_t dtor)
@@ -150,7 +194,7 @@ static inline struct dtls_value *__get_dtls(dtls_data_t *dtls_data,
 	assert(key);
 	if (key->id < NUM_STATIC_KEYS) {
 		v = &dtls_data->early_values[key->id];
-		if (v->key != NULL)
+		if (v->key == key)
 			return v;
 	} else {
 		TAILQ_FOREACH(v, &dtls_data->list, link)
@@ -223,11 +267,15 @@ void set_dtls(dtls_key_t key, void *dtls)
 	__set_dtls(dtls_data, key, dtls);
 }
 
+/* Static keys don't need __dtls_initialized: the TLS starts zeroed, and an
+ * early value's dtls is only ever non-NULL while it belongs to its key. */
 void *get_dtls(dtls_key_t key)
 {
 	dtls_data_t *dtls_data = NULL;
 	struct dtls_value *v;
 
+	if (key->id < NUM_STATIC_KEYS)
+		return __dtls_data.early_values[key->id].dtls;
 	if (!__dtls_initialized)
 		return NULL;
 	dtls_data = &__dtls_data;
@@ -3,10 +3,18 @@
  * See LICENSE for details.
  *
  * Event bitmaps.  These are a type of event mailbox where the message type is
- * translated to a bit, which is set in the bitmap. */
+ * translated to a bit, which is set in the bitmap.
+ *
+ * We scan the bitmap a word at a time and find set bits with ctz.  The bitmap
+ * is a byte array, and bit i lives in byte i / 8, so on a little-endian machine
+ * bit k of the word loaded from byte 'off' is event type off * 8 + k.  The
+ * kernel sets bits with atomic ORs on bytes, so we claim bits with atomic ANDs
+ * on the same bytes, clearing only the bits we saw. */
 
 #include <parlib/evbitmap.h>
 #include <parlib/bitmask.h>
+#include <parlib/arch/atomic.h>
+#include <sys/param.h>
 #include <string.h>
 
 void evbitmap_init(struct evbitmap *evbm)
@@ -23,26 +31,72 @@ bool evbitmap_is_empty(struct evbitmap *evbm)
 	return !evbm->check_bits;
 }
 
-bool get_evbitmap_msg(struct evbitmap *evbm, struct event_msg *ev_msg)
+/* Loads the word starting at byte off of the bitmap.  The last word may be
+ * short, and the bitmap needn't be aligned. */
+static unsigned long evbitmap_word(struct evbitmap *evbm, size_t off)
 {
-	if (evbitmap_is_empty(evbm))
-		return FALSE;
-	while (1) {
-		for (int i = 0; i < MAX_NR_EVENT; i++) {
-			if (GET_BITMASK_BIT(evbm->bitmap, i)) {
-				CLR_BITMASK_BIT_ATOMIC(evbm->bitmap, i);
+	unsigned long word = 0;
+
+	memcpy(&word, &evbm->bitmap[off],
+	       MIN(sizeof(word), sizeof(evbm->bitmap) - off));
+	return word;
+}
+
+/* One pass over the bitmap, claiming up to max set bits and putting their
+ * event types in msgs.  Returns how many we claimed. */
+static unsigned int evbitmap_scan(struct evbitmap *evbm,
+                                  struct event_msg *msgs, unsigned int max)
+{
+	unsigned long word;
+	unsigned int nr = 0;
+	size_t byte;
+	uint8_t bits, claim;
+
+	for (size_t off = 0; off < sizeof(evbm->bitmap); off += sizeof(word)) {
+		word = evbitmap_word(evbm, off);
+		while (word) {
+			byte = __builtin_ctzl(word) / 8;
+			bits = word >> (byte * 8);
+			word &= ~(0xffUL << (byte * 8));
+			claim = 0;
+			for (; bits && (nr < max); bits &= bits - 1) {
+				claim |= bits & -bits;
 				/* bit messages are empty except for the type. */
-				memset(ev_msg, 0, sizeof(struct event_msg));
-				ev_msg->ev_type = i;
-				return TRUE;
+				memset(&msgs[nr], 0, sizeof(struct event_msg));
+				msgs[nr++].ev_type = (off + byte) * 8 + __builtin_ctz(bits);
 			}
+			atomic_andb(&evbm->bitmap[off + byte], ~claim);
+			if (nr == max)
+				return nr;
 		}
+	}
+	return nr;
+}
+
+/* Claims up to max pending event types, one message per type, in a single
+ * pass.  Returns how many we got, 0 if the bitmap was empty. */
+unsigned int get_evbitmap_msgs(struct evbitmap *evbm, struct event_msg *msgs,
+                               unsigned int max)
+{
+	unsigned int nr;
+
+	if (!max || evbitmap_is_empty(evbm))
+		return 0;
+	while (1) {
+		nr = evbitmap_scan(evbm, msgs, max);
+		if (nr)
+			return nr;
 		/* If we made it here, then the bitmap might be empty. */
 		evbm->check_bits = FALSE;
 		wrmb();	/* check_bits written before we check for it being clear */
 		if (BITMASK_IS_CLEAR(evbm->bitmap, MAX_NR_EVENT))
-			return FALSE;
+			return 0;
 		cmb();
 		evbm->check_bits = TRUE;
 	}
 }
+
+bool get_evbitmap_msg(struct evbitmap *evbm, struct event_msg *ev_msg)
+{
+	return get_evbitmap_msgs(evbm, ev_msg, 1) == 1;
+}
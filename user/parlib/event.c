@@ -29,6 +29,13 @@
 __thread bool __vc_handle_an_mbox = FALSE;
 __thread uint32_t __vc_rem_vcoreid;
 
+/* UCQ or bitmap messages we claimed in a batch but haven't handled yet.  See
+ * handle_ucq_batch(). */
+#define EV_BATCH_SZ			32
+static __thread struct event_msg __vc_ev_batch[EV_BATCH_SZ];
+static __thread unsigned int __vc_ev_batch_next;
+static __thread unsigned int __vc_ev_batch_nr;
+
 /********* Event_q Setup / Registration  ***********/
 
 /* Get event_qs via these interfaces, since eventually we'll want to either
@@ -334,21 +341,87 @@ int handle_one_mbox_msg(struct event_mbox *ev_mbox)
 	return 1;
 }
 
-/* Handle an mbox.  This is the receive-side processing of an event_queue.  It
- * takes an ev_mbox, since the vcpd mbox isn't a regular ev_q.  Returns 1 if we
- * handled something, 0 o/w. */
-int handle_mbox(struct event_mbox *ev_mbox)
+/* Runs the handlers for this vcore's claimed messages.  We advance the
+ * index before each handler, since handlers might not return, and we copy the
+ * message out, since a nested handle_mbox() can refill the batch.  Returns 1 if
+ * we handled something, 0 o/w. */
+static int run_ev_batch(void)
+{
+	struct event_msg local_msg;
+	int retval = 0;
+
+	while (__vc_ev_batch_next < __vc_ev_batch_nr) {
+		local_msg = __vc_ev_batch[__vc_ev_batch_next++];
+		assert(local_msg.ev_type < MAX_NR_EVENT);
+		run_ev_handlers(local_msg.ev_type, &local_msg);
+		retval = 1;
+	}
+	return retval;
+}
+
+/* Handles a UCQ, claiming up to EV_BATCH_SZ messages at a time with
+ * get_ucq_msgs().  Claimed messages belong to this vcore, so if a handler
+ * doesn't return, the rest of its batch waits for this vcore's next
+ * handle_mbox(), not for whoever handles the UCQ next.  Vcore context only. */
+static int handle_ucq_batch(struct ucq *ucq)
+{
+	unsigned int nr;
+	int retval = run_ev_batch();
+
+	while ((nr = get_ucq_msgs(ucq, __vc_ev_batch, EV_BATCH_SZ))) {
+		printd("[event] UCQ %08p, batch of %d\n", ucq, nr);
+		__vc_ev_batch_next = 0;
+		__vc_ev_batch_nr = nr;
+		retval |= run_ev_batch();
+	}
+	return retval;
+}
+
+/* Handles an event bitmap, claiming every pending type in one pass with
+ * get_evbitmap_msgs().  Like handle_ucq_batch(), the claimed types wait in
+ * this vcore's batch.  Vcore context only. */
+static int handle_evbitmap_batch(struct evbitmap *evbm)
+{
+	unsigned int nr;
+	int retval = run_ev_batch();
+
+	while ((nr = get_evbitmap_msgs(evbm, __vc_ev_batch, EV_BATCH_SZ))) {
+		printd("[event] evbitmap %08p, batch of %d\n", evbm, nr);
+		__vc_ev_batch_next = 0;
+		__vc_ev_batch_nr = nr;
+		retval |= run_ev_batch();
+	}
+	return retval;
+}
+
+static int __handle_mbox(struct event_mbox *ev_mbox, bool batch)
 {
 	int retval = 0;
 	printd("[event] handling ev_mbox %08p on vcore %d\n", ev_mbox, vcore_id());
 	/* Some stack-smashing bugs cause this to fail */
 	assert(ev_mbox);
+	if (in_vcore_context()) {
+		/* Leftovers from a handler that didn't return go first */
+		retval = run_ev_batch();
+		if (batch && (ev_mbox->type == EV_MBOX_UCQ))
+			return handle_ucq_batch(&ev_mbox->ucq) | retval;
+		if (batch && (ev_mbox->type == EV_MBOX_BITMAP))
+			return handle_evbitmap_batch(&ev_mbox->evbm) | retval;
+	}
 	/* Handle all full messages, tracking if we do at least one. */
 	while (handle_one_mbox_msg(ev_mbox))
 		retval = 1;
 	return retval;
 }
 
+/* Handle an mbox.  This is the receive-side processing of an event_queue.  It
+ * takes an ev_mbox, since the vcpd mbox isn't a regular ev_q.  Returns 1 if we
+ * handled something, 0 o/w. */
+int handle_mbox(struct event_mbox *ev_mbox)
+{
+	return __handle_mbox(ev_mbox, TRUE);
+}
+
 /* Empty if the UCQ is empty and the bits don't need checked */
 bool mbox_is_empty(struct event_mbox *ev_mbox)
 {
@@ -401,7 +474,9 @@ int handle_events(uint32_t vcoreid)
 	vcpd->notif_pending = FALSE;
 	wrmb();	/* prevent future reads from happening before notif_p write */
 	retval += handle_mbox(&vcpd->ev_mbox_private);
-	retval += handle_mbox(&vcpd->ev_mbox_public);
+	/* Other vcores drain our public mbox if we're preempted, so we don't hide
+	 * its messages in our batch. */
+	retval += __handle_mbox(&vcpd->ev_mbox_public, FALSE);
 	return retval;
 }
 
@@ -489,7 +564,7 @@ void handle_vcpd_mbox(uint32_t rem_vcoreid)
 void try_handle_remote_mbox(void)
 {
 	if (__vc_handle_an_mbox) {
-		handle_mbox(&vcpd_of(__vc_rem_vcoreid)->ev_mbox_public);
+		__handle_mbox(&vcpd_of(__vc_rem_vcoreid)->ev_mbox_public, FALSE);
 		/* only clear the flag when we have returned from handling messages.  if
 		 * an event handler (like preempt_recover) doesn't return, we'll clear
 		 * this flag elsewhere. (it's actually not a big deal if we don't). */
@@ -30,10 +30,14 @@ __BEGIN_DECLS
  * for that yet, so just pick a size in advance.  If you're using a CEQ, you'll
  * probably want to do it yourself. */
 #define CEQ_DEFAULT_SZ 128
+/* Most ring slots get_ceq_msgs() claims at once */
+#define CEQ_GET_BATCH 32
 
 void ceq_init(struct ceq *ceq, uint8_t op, unsigned int nr_events,
               size_t ring_sz);
 bool get_ceq_msg(struct ceq *ceq, struct event_msg *msg);
+unsigned int get_ceq_msgs(struct ceq *ceq, struct event_msg *msgs,
+                          unsigned int max);
 bool ceq_is_empty(struct ceq *ceq);
 void ceq_cleanup(struct ceq *ceq);
 
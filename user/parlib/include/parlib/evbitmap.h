@@ -14,7 +14,8 @@ __BEGIN_DECLS
 void evbitmap_init(struct evbitmap *evbm);
 void evbitmap_cleanup(struct evbitmap *evbm);
 bool evbitmap_is_empty(struct evbitmap *evbm);
-void evbitmap_init(struct evbitmap *evbm);
 bool get_evbitmap_msg(struct evbitmap *evbm, struct event_msg *ev_msg);
+unsigned int get_evbitmap_msgs(struct evbitmap *evbm, struct event_msg *msgs,
+                               unsigned int max);
 
 __END_DECLS
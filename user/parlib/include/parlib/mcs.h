@@ -91,4 +91,47 @@ void mcs_pdr_fini(struct mcs_pdr_lock *lock);
 void mcs_pdr_lock(struct mcs_pdr_lock *lock);
 void mcs_pdr_unlock(struct mcs_pdr_lock *lock);
 
+/* Cohort MCS locks (C-MCS-MCS, from Dice et al.).
+ *
+ * Each socket has its own MCS lock, and the sockets take turns on a global MCS
+ * lock.  When the holder unlocks and someone on its socket is waiting, it hands
+ * over the local lock and keeps the global one, so the lock and the data it
+ * protects stay in that socket's caches.  We hand off locally at most
+ * max_passes times in a row before letting the other sockets in.
+ *
+ * Callers pass their own qnode, like the basic MCS lock.  These do not deal
+ * with preemption: use the notifsafe versions, or know that you can't be
+ * preempted while holding the lock. */
+#define MCS_COHORT_MAX_PASSES		64
+
+struct mcs_cohort_qnode {
+	struct mcs_lock_qnode		mcs;
+	uint32_t					socket;
+};
+
+struct mcs_cohort_node {
+	struct mcs_lock				local;
+	struct mcs_lock_qnode		global_qnode;
+	bool						global_held;	/* passed in with the lock */
+	unsigned int				nr_passes;
+}__attribute__((aligned(ARCH_CL_SIZE)));
+
+struct mcs_cohort_lock {
+	struct mcs_lock				global __attribute__((aligned(ARCH_CL_SIZE)));
+	struct mcs_cohort_node		*nodes __attribute__((aligned(ARCH_CL_SIZE)));
+	unsigned int				nr_nodes;
+	unsigned int				max_passes;
+};
+
+void mcs_cohort_init(struct mcs_cohort_lock *lock);
+void mcs_cohort_fini(struct mcs_cohort_lock *lock);
+void mcs_cohort_lock(struct mcs_cohort_lock *lock,
+                     struct mcs_cohort_qnode *qnode);
+void mcs_cohort_unlock(struct mcs_cohort_lock *lock,
+                       struct mcs_cohort_qnode *qnode);
+void mcs_cohort_lock_notifsafe(struct mcs_cohort_lock *lock,
+                               struct mcs_cohort_qnode *qnode);
+void mcs_cohort_unlock_notifsafe(struct mcs_cohort_lock *lock,
+                                 struct mcs_cohort_qnode *qnode);
+
 __END_DECLS
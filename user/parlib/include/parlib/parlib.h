@@ -32,6 +32,7 @@ int         sys_proc_destroy(int pid, int exitcode);
 void        sys_yield(bool being_nice);
 int         sys_proc_create(const char *path, size_t path_l, char *const argv[],
                             char *const envp[], int flags);
+int         sys_proc_spawn(int tmpl_pid, int flags);
 int         sys_proc_run(int pid);
 ssize_t     sys_shared_page_alloc(void **addr, pid_t p2, 
                                   int p1_flags, int p2_flags);
@@ -45,6 +46,10 @@ int         sys_self_notify(uint32_t vcoreid, unsigned int ev_type,
                             struct event_msg *u_msg, bool priv);
 int         sys_halt_core(unsigned long usec);
 void*		sys_init_arsc();
+void		*sys_sysring_setup(unsigned int nr_entries, struct event_queue *ev_q,
+                              int flags, int poll_core);
+int         sys_sysring_enter(void);
+long        sys_splice(int fd_in, int fd_out, size_t len, int flags);
 int         sys_block(unsigned long usec);
 int         sys_change_vcore(uint32_t vcoreid, bool enable_my_notif);
 int         sys_change_to_m(void);
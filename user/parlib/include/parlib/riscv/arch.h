@@ -44,6 +44,13 @@ read_tsc_serialized(void)
 	return read_tsc();
 }
 
+/* No cheap way to get it; ask the kernel */
+static __inline int
+arch_read_pcoreid(void)
+{
+	return -1;
+}
+
 static __inline void
 cpu_relax(void)
 {
@@ -55,3 +55,4 @@ void uthread_prep_pending_signals(struct uthread *uthread);
 void uthread_prep_signal_from_fault(struct uthread *uthread,
                                     int signo, int code, void *addr);
 int uthread_signal(struct uthread *uthread, int signo);
+void handle_vcore_signals(uint32_t vcoreid);
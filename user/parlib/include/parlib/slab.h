@@ -19,6 +19,15 @@
  * address of the next free item.  The slab structure is stored at the end of
  * the page.  There is only one page per slab.
  *
+ * In front of the slab lists sits a per-vcore magazine layer, like the
+ * kernel's.  Each vcore has a loaded and a previous magazine of constructed
+ * objects.  Allocs and frees only touch the current vcore's kmem_pcpu_cache,
+ * which has no lock: we disable notifs instead, so we can't migrate or be
+ * interrupted by vcore context while using it.  If we get preempted in the
+ * middle, the cache just waits for us to come back, since no other vcore ever
+ * touches it.  Only when both magazines are empty (alloc) or full (free) do we
+ * swap with the cache-wide depot, which has a lock.
+ *
  * TODO: Note, that this is a minor pain in the ass, and worth thinking about
  * before implementing.  To keep the constructor's state valid, we can't just
  * overwrite things, so we need to add an extra 4-8 bytes per object for the
@@ -34,6 +43,7 @@
 #include <sys/queue.h>
 #include <parlib/arch/atomic.h>
 #include <parlib/spinlock.h>
+#include <parlib/arch/arch.h>
 
 __BEGIN_DECLS
 
@@ -42,6 +52,14 @@ __BEGIN_DECLS
 #define NUM_BUF_PER_SLAB 8
 #define SLAB_LARGE_CUTOFF (PGSIZE / NUM_BUF_PER_SLAB)
 
+/* Magazines hold up to KMC_MAG_MAX_SZ rounds.  The depot's magsize determines
+ * how many of those are actually used. */
+#define KMC_MAG_MIN_SZ 8
+#define KMC_MAG_MAX_SZ 64
+
+/* Cache flags */
+#define KMC_NOMAG 0x0001	/* no per-vcore magazine layer */
+
 struct kmem_slab;
 
 /* Control block for buffers for large-object slabs */
@@ -68,6 +86,32 @@ struct kmem_slab {
 };
 TAILQ_HEAD(kmem_slab_list, kmem_slab);
 
+struct kmem_magazine {
+	SLIST_ENTRY(kmem_magazine) link;
+	unsigned int nr_rounds;
+	void *rounds[KMC_MAG_MAX_SZ];
+};
+SLIST_HEAD(kmem_mag_slist, kmem_magazine);
+
+/* Each vcore's view of a cache.  Only that vcore touches it, with notifs
+ * disabled. */
+struct kmem_pcpu_cache {
+	unsigned int magsize;
+	struct kmem_magazine *loaded;
+	struct kmem_magazine *prev;
+	unsigned long nr_allocs_ever;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+/* Cache-wide store of full and empty magazines */
+struct kmem_depot {
+	struct spin_pdr_lock lock;
+	struct kmem_mag_slist not_empty;
+	struct kmem_mag_slist empty;
+	unsigned int magsize;
+	unsigned int nr_not_empty;
+	unsigned int nr_empty;
+};
+
 /* Actual cache */
 struct kmem_cache {
 	SLIST_ENTRY(kmem_cache) link;
@@ -82,6 +126,8 @@ struct kmem_cache {
 	void (*ctor)(void *, size_t);
 	void (*dtor)(void *, size_t);
 	unsigned long nr_cur_alloc;
+	struct kmem_pcpu_cache *pcpu_caches;
+	struct kmem_depot depot;
 };
 
 /* List of all kmem_caches, sorted in order of size */
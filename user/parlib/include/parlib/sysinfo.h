@@ -6,8 +6,15 @@
 
 #pragma once
 
+#include <parlib/common.h>
+
 __BEGIN_DECLS
 
 int get_num_pcores(void);
 
+/* Load info from the kernel's shared page; see struct pcore_load.  These are
+ * only a snapshot: the pcore can change state right after we look. */
+bool pcore_is_idle(uint32_t pcoreid);
+void pcore_load_ticks(uint32_t pcoreid, uint64_t *busy, uint64_t *idle);
+
 __END_DECLS
@@ -0,0 +1,70 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Asynchronous I/O for uthreads, built on async syscalls.
+ *
+ * A uaio_group is a set of in-flight syscalls that share an event queue.  Each
+ * syscall lives in a uaio_future, which the caller owns and must keep around
+ * until the group hands it back.  Submit as many as you like from one uthread,
+ * then wait for any or all of them; waiting blocks only the calling uthread.
+ * When the kernel finishes a syscall, it sends an EV_SYSCALL to the group's
+ * evq, which tells us which future is done.
+ *
+ * A group belongs to one uthread at a time: only one should submit and wait on
+ * it at once.  Different groups are independent. */
+
+#pragma once
+
+#include <parlib/common.h>
+#include <ros/syscall.h>
+#include <ros/event.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+__BEGIN_DECLS
+
+struct uaio_group;
+
+struct uaio_future {
+	struct syscall				sysc;
+	struct iovec				iov;		/* for preadv/pwritev */
+	struct uaio_group			*grp;
+	TAILQ_ENTRY(uaio_future)	link;		/* on grp's done list */
+	bool						done;
+	void						*udata;		/* for the caller */
+};
+TAILQ_HEAD(uaio_future_tq, uaio_future);
+
+struct uaio_group {
+	struct event_queue			*evq;
+	unsigned int				nr_inflight;
+	struct uaio_future_tq		done;		/* finished, not yet reaped */
+};
+
+void uaio_group_init(struct uaio_group *grp);
+void uaio_group_destroy(struct uaio_group *grp);
+
+/* Submission.  These never block.  Results show up in the future's sysc. */
+void uaio_submit(struct uaio_group *grp, struct uaio_future *fut,
+                 unsigned long num, long a0, long a1, long a2, long a3,
+                 long a4, long a5);
+void uaio_read(struct uaio_group *grp, struct uaio_future *fut, int fd,
+               void *buf, size_t len);
+void uaio_write(struct uaio_group *grp, struct uaio_future *fut, int fd,
+                const void *buf, size_t len);
+void uaio_pread(struct uaio_group *grp, struct uaio_future *fut, int fd,
+                void *buf, size_t len, off_t off);
+void uaio_pwrite(struct uaio_group *grp, struct uaio_future *fut, int fd,
+                 const void *buf, size_t len, off_t off);
+
+/* Completion.  Reaping a future hands it back to the caller. */
+struct uaio_future *uaio_poll(struct uaio_group *grp);
+struct uaio_future *uaio_wait_any(struct uaio_group *grp);
+void uaio_wait(struct uaio_future *fut);
+unsigned int uaio_wait_all(struct uaio_group *grp);
+
+/* Returns the syscall's return value, setting errno on failure like the
+ * synchronous call would.  Only call this on a reaped future. */
+long uaio_result(struct uaio_future *fut);
+
+__END_DECLS
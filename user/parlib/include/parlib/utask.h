@@ -0,0 +1,46 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Stackless tasks for fine-grained parallelism.
+ *
+ * A utask is a small closure: a function and the group it belongs to.  Tasks
+ * have no stack or TLS of their own; they run to completion on the stack of
+ * whichever uthread picks them up.  Embed the struct utask in your own struct
+ * and use container_of() to get at your arguments.  The caller owns the
+ * memory, which must stay around until the task's group is synced.
+ *
+ * utask_spawn() puts the task on the current vcore's deque.  utask_sync()
+ * waits for every task in a group to finish, running tasks while it waits:
+ * first from its own vcore's deque, then by stealing from other vcores.  Any
+ * uthread can sync on any group, so to get more vcores working on a
+ * computation, start a few more uthreads (e.g. pthreads) that sync on its root
+ * group.  Tasks can spawn and sync on groups of their own.
+ *
+ * If a vcore is preempted, the tasks on its deque are still there for the
+ * taking: thieves look at preempted vcores first. */
+
+#pragma once
+
+#include <parlib/common.h>
+#include <ros/atomic.h>
+
+__BEGIN_DECLS
+
+struct utask_group {
+	atomic_t					nr_pending;
+};
+
+struct utask;
+typedef void (*utask_func_t)(struct utask *task);
+
+struct utask {
+	utask_func_t				func;
+	struct utask_group			*grp;
+};
+
+void utask_group_init(struct utask_group *grp);
+void utask_spawn(struct utask_group *grp, struct utask *task,
+                 utask_func_t func);
+void utask_sync(struct utask_group *grp);
+
+__END_DECLS
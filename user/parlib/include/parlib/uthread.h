@@ -29,6 +29,7 @@ struct uthread {
 	void *tls_desc;
 	int flags;
 	int state;
+	uint32_t vcoreid;	/* where it is or last was running */
 	struct sigstate sigstate;
 	int notif_disabled_depth;
 	struct syscall *sysc;	/* syscall we're blocking on, if any */
@@ -45,6 +46,7 @@ extern __thread struct uthread *current_uthread;
  * use another struct type for mtx and cvs. */
 typedef struct __uth_mtx_opaque * uth_mutex_t;
 typedef struct __uth_cv_opaque * uth_cond_var_t;
+typedef struct __uth_rwlock_opaque * uth_rwlock_t;
 
 /* 2L-Scheduler operations.  Examples in pthread.c. */
 struct schedule_ops {
@@ -67,8 +69,19 @@ struct schedule_ops {
 	void (*cond_var_wait)(uth_cond_var_t, uth_mutex_t);
 	void (*cond_var_signal)(uth_cond_var_t);
 	void (*cond_var_broadcast)(uth_cond_var_t);
+	uth_rwlock_t (*rwlock_alloc)(void);
+	void (*rwlock_free)(uth_rwlock_t);
+	void (*rwlock_rdlock)(uth_rwlock_t);
+	void (*rwlock_wrlock)(uth_rwlock_t);
+	bool (*rwlock_try_rdlock)(uth_rwlock_t);
+	bool (*rwlock_try_wrlock)(uth_rwlock_t);
+	void (*rwlock_unlock)(uth_rwlock_t);
 	/* Functions event handling wants */
 	void (*preempt_pending)(void);
+	/* Called in vcore context on a live vcore, once we know vcoreid was
+	 * preempted.  The 2LS should move whatever work vcoreid was holding to
+	 * vcores that are up.  Several vcores may call this for one preemption. */
+	void (*vcore_preempted)(uint32_t vcoreid);
 };
 extern struct schedule_ops *sched_ops;
 
@@ -86,7 +99,9 @@ void uthread_mcp_init(void);
 
 /* uthread_init() does the uthread initialization of a uthread that the caller
  * created.  Call this whenever you are "starting over" with a thread.  Pass in
- * attr, if you want to override any defaults. */
+ * attr, if you want to override any defaults.  A 2LS can also reuse a dead
+ * uthread without uthread_cleanup(): zero everything but tls_desc, and its TLS
+ * gets reinitialized instead of reallocated. */
 struct uth_thread_attr {
 	bool want_tls;		/* default, no */
 };
@@ -149,6 +164,46 @@ static inline struct user_context *get_cur_uth_ctx(void)
 	val;                                                                       \
 })
 
+/* Adaptive spinning for sleeping locks.  A waiter spins only while the lock's
+ * owner is running on a vcore that isn't preempted: otherwise the owner can't
+ * release the lock any time soon.  Each lock learns how long a wait usually
+ * takes, and waiters give up after spinning about twice that long.
+ *
+ * Owners' uthread structs could be freed while we look at them.  We only read
+ * them, and 2LSs don't unmap their thread structs, so at worst we guess wrong
+ * about whether to keep spinning. */
+#define UTH_SPIN_MIN				10
+#define UTH_SPIN_MAX				1000
+
+struct uth_spin_adapt {
+	unsigned int				avg;	/* of spins it took to get the lock */
+};
+
+static inline bool uth_owner_is_running(struct uthread *owner)
+{
+	uint32_t vcoreid;
+
+	if (!owner || ACCESS_ONCE(owner->state) != UT_RUNNING)
+		return FALSE;
+	vcoreid = ACCESS_ONCE(owner->vcoreid);
+	return !vcore_is_preempted(vcoreid) && !preempt_is_pending(vcoreid);
+}
+
+static inline unsigned int uth_spin_limit(struct uth_spin_adapt *sa)
+{
+	return MIN(ACCESS_ONCE(sa->avg) * 2 + UTH_SPIN_MIN, UTH_SPIN_MAX);
+}
+
+/* Call when done spinning, whether or not we got the lock. */
+static inline void uth_spin_update(struct uth_spin_adapt *sa,
+                                   unsigned int spun)
+{
+	int avg = ACCESS_ONCE(sa->avg);
+
+	/* Racy, but it's just a hint */
+	ACCESS_ONCE(sa->avg) = avg + ((int)spun - avg) / 8;
+}
+
 /* Generic Uthread Mutexes.  2LSs implement their own methods, but we need a
  * 2LS-independent interface and default implementation. */
 uth_mutex_t uth_mutex_alloc(void);
@@ -166,4 +221,16 @@ void uth_cond_var_wait(uth_cond_var_t cv, uth_mutex_t m);
 void uth_cond_var_signal(uth_cond_var_t cv);
 void uth_cond_var_broadcast(uth_cond_var_t cv);
 
+/* Generic Uthread Reader-Writer Locks.  2LSs can implement their own methods.
+ * Writers are preferred: once a writer is waiting, new readers block until
+ * there are no writers left.  Readers and writers both use uth_rwlock_unlock.
+ * The trylocks return TRUE if they got the lock. */
+uth_rwlock_t uth_rwlock_alloc(void);
+void uth_rwlock_free(uth_rwlock_t rwl);
+void uth_rwlock_rdlock(uth_rwlock_t rwl);
+void uth_rwlock_wrlock(uth_rwlock_t rwl);
+bool uth_rwlock_try_rdlock(uth_rwlock_t rwl);
+bool uth_rwlock_try_wrlock(uth_rwlock_t rwl);
+void uth_rwlock_unlock(uth_rwlock_t rwl);
+
 __END_DECLS
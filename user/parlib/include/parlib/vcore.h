@@ -44,6 +44,9 @@ static inline void __disable_notifs(uint32_t vcoreid);
 static inline bool notif_is_enabled(uint32_t vcoreid);
 static inline bool vcore_is_mapped(uint32_t vcoreid);
 static inline bool vcore_is_preempted(uint32_t vcoreid);
+static inline bool vcore_is_up(uint32_t vcoreid);
+static inline uint32_t vcore_pcoreid(uint32_t vcoreid);
+static inline uint32_t vcore_next_up(uint32_t vcoreid);
 static inline struct preempt_data *vcpd_of(uint32_t vcoreid);
 static inline bool preempt_is_pending(uint32_t vcoreid);
 static inline bool __preempt_is_pending(uint32_t vcoreid);
@@ -131,6 +134,34 @@ static inline bool vcore_is_preempted(uint32_t vcoreid)
 	return atomic_read(&vcpd->flags) & VC_PREEMPTED;
 }
 
+/* Whether vcoreid is a good place to send work: it's running and isn't about
+ * to stop. */
+static inline bool vcore_is_up(uint32_t vcoreid)
+{
+	return vcore_is_mapped(vcoreid) && !vcore_is_preempted(vcoreid) &&
+	       !__preempt_is_pending(vcoreid);
+}
+
+/* Returns the next vcore after vcoreid that is up, or our own vcore if there
+ * aren't any.  Calling this in a loop spreads work over the live vcores. */
+/* The pcore vcoreid is on (or was last on).  Only a hint, since the vcore can
+ * move at any time. */
+static inline uint32_t vcore_pcoreid(uint32_t vcoreid)
+{
+	return ACCESS_ONCE(__procinfo.vcoremap[vcoreid].pcoreid);
+}
+
+static inline uint32_t vcore_next_up(uint32_t vcoreid)
+{
+	uint32_t nr_vcores = max_vcores();
+
+	for (int i = 1; i < nr_vcores; i++) {
+		if (vcore_is_up((vcoreid + i) % nr_vcores))
+			return (vcoreid + i) % nr_vcores;
+	}
+	return vcore_id();
+}
+
 static inline struct preempt_data *vcpd_of(uint32_t vcoreid)
 {
 	return &__procdata.vcore_preempt_data[vcoreid];
@@ -4,26 +4,35 @@
  * See LICENSE for details.
  *
  * A wait-free unordered list data structure.
- * 
+ *
+ * Each entry gets its own cache line, so CASes on neighboring slots don't
+ * bounce a line between cores.  Inserts and removes start scanning at a
+ * per-vcore hint (the last slot that vcore used) and wrap around, instead of
+ * always starting from the head.  Entries are never freed while the list is in
+ * use; wfl_compact() reclaims empty ones when no one else is touching it.
  */
 
 #pragma once
 
 #include <string.h>
+#include <parlib/arch/arch.h>
 
 __BEGIN_DECLS
 
+#define WFL_NR_HINTS 8
+
 struct wfl_entry {
   struct wfl_entry *next;
   void *data;
-};
+} __attribute__((aligned(ARCH_CL_SIZE)));
 
 struct wfl {
   struct wfl_entry *head;
+  struct wfl_entry *hints[WFL_NR_HINTS];  /* indexed by vcore, racy */
   struct wfl_entry first;
 };
 
-#define WFL_INITIALIZER(list) {&(list).first, {0, 0}}
+#define WFL_INITIALIZER(list) {&(list).first, {0}, {0, 0}}
 
 void wfl_init(struct wfl *list);
 void wfl_destroy(struct wfl *list);
@@ -32,6 +41,7 @@ size_t wfl_size(struct wfl *list);
 void wfl_insert(struct wfl *list, void *data);
 void *wfl_remove(struct wfl *list);
 size_t wfl_remove_all(struct wfl *list, void *data);
+size_t wfl_compact(struct wfl *list);
 
 /* Iterate over list.  Safe w.r.t. inserts, but not w.r.t. removals. */
 #define wfl_foreach_unsafe(elm, list) \
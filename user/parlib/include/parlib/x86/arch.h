@@ -68,6 +68,18 @@ static inline uint64_t read_tsc_serialized(void)
 	return read_tsc();
 }
 
+/* The kernel puts the pcoreid in TSC_AUX.  Returns -1 if rdtscp can't be
+ * trusted, in which case you need to ask the kernel. */
+static inline int arch_read_pcoreid(void)
+{
+	uint32_t ecx;
+
+	if (!cpu_has_feat(CPU_FEAT_X86_RDTSCP))
+		return -1;
+	asm volatile("rdtscp" : "=c"(ecx) : : "eax", "edx");
+	return ecx;
+}
+
 static inline void cpu_relax(void)
 {
 	asm volatile("pause" : : : "memory");
@@ -448,3 +448,82 @@ void mcs_pdr_unlock(struct mcs_pdr_lock *lock)
 	__mcs_pdr_unlock(lock, &lock->qnodes[vcore_id()]);
 	uth_enable_notifs();
 }
+
+/* Cohort MCS locks */
+void mcs_cohort_init(struct mcs_cohort_lock *lock)
+{
+	int ret;
+
+	mcs_lock_init(&lock->global);
+	/* The kernel leaves nr_sockets at 0 if it doesn't know the topology */
+	lock->nr_nodes = MAX(__proc_global_info.nr_sockets, 1);
+	lock->max_passes = MCS_COHORT_MAX_PASSES;
+	ret = posix_memalign((void**)&lock->nodes,
+	                     __alignof__(struct mcs_cohort_node),
+	                     sizeof(struct mcs_cohort_node) * lock->nr_nodes);
+	assert(!ret);
+	memset(lock->nodes, 0, sizeof(struct mcs_cohort_node) * lock->nr_nodes);
+}
+
+void mcs_cohort_fini(struct mcs_cohort_lock *lock)
+{
+	free(lock->nodes);
+}
+
+/* Our socket may be stale by the time we use it if we're a uthread that
+ * migrates, but that only costs us locality.  Unlock uses the socket we
+ * saved in the qnode, not the one we're on. */
+static uint32_t mcs_cohort_socket(struct mcs_cohort_lock *lock)
+{
+	uint32_t pcoreid = vcore_pcoreid(vcore_id());
+
+	return __proc_global_info.core_socket[pcoreid] % lock->nr_nodes;
+}
+
+void mcs_cohort_lock(struct mcs_cohort_lock *lock,
+                     struct mcs_cohort_qnode *qnode)
+{
+	struct mcs_cohort_node *node;
+
+	qnode->socket = mcs_cohort_socket(lock);
+	node = &lock->nodes[qnode->socket];
+	mcs_lock_lock(&node->local, &qnode->mcs);
+	/* Whoever passed us the local lock set global_held before unlocking it */
+	if (node->global_held)
+		return;
+	mcs_lock_lock(&lock->global, &node->global_qnode);
+	node->nr_passes = 0;
+}
+
+void mcs_cohort_unlock(struct mcs_cohort_lock *lock,
+                       struct mcs_cohort_qnode *qnode)
+{
+	struct mcs_cohort_node *node = &lock->nodes[qnode->socket];
+
+	/* A waiter that hasn't linked in yet looks like no waiter, which just
+	 * means we let the other sockets in a little early. */
+	if (qnode->mcs.next && (node->nr_passes < lock->max_passes)) {
+		node->nr_passes++;
+		node->global_held = TRUE;
+		/* the local unlock orders our writes before the handoff */
+		mcs_lock_unlock(&node->local, &qnode->mcs);
+		return;
+	}
+	node->global_held = FALSE;
+	mcs_lock_unlock(&lock->global, &node->global_qnode);
+	mcs_lock_unlock(&node->local, &qnode->mcs);
+}
+
+void mcs_cohort_lock_notifsafe(struct mcs_cohort_lock *lock,
+                               struct mcs_cohort_qnode *qnode)
+{
+	uth_disable_notifs();
+	mcs_cohort_lock(lock, qnode);
+}
+
+void mcs_cohort_unlock_notifsafe(struct mcs_cohort_lock *lock,
+                                 struct mcs_cohort_qnode *qnode)
+{
+	mcs_cohort_unlock(lock, qnode);
+	uth_enable_notifs();
+}
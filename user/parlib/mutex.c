@@ -2,13 +2,16 @@
  * Barret Rhoden <brho@cs.berkeley.edu>
  * See LICENSE for details. */
 
-/* Generic Uthread Mutexes and CVs.  2LSs implement their own methods, but we
- * need a 2LS-independent interface and default implementation. */
+/* Generic Uthread Mutexes, CVs, and RWLocks.  2LSs implement their own
+ * methods, but we need a 2LS-independent interface and default
+ * implementation. */
 
 #include <parlib/uthread.h>
 #include <sys/queue.h>
 #include <parlib/spinlock.h>
+#include <parlib/arch/arch.h>
 #include <malloc.h>
+#include <string.h>
 
 /* The linkage structs are for the yield callbacks */
 struct uth_default_mtx;
@@ -23,6 +26,8 @@ struct uth_default_mtx {
 	struct spin_pdr_lock		lock;
 	struct mtx_link_tq			waiters;
 	bool						locked;
+	struct uthread				*owner;
+	struct uth_spin_adapt		spin;
 };
 
 struct uth_default_cv;
@@ -39,6 +44,31 @@ struct uth_default_cv {
 	struct cv_link_tq			waiters;
 };
 
+struct uth_default_rwlock;
+struct uth_rwlock_link {
+	TAILQ_ENTRY(uth_rwlock_link)	next;
+	struct uth_default_rwlock	*rwl;
+	struct uthread				*uth;
+};
+TAILQ_HEAD(rwlock_link_tq, uth_rwlock_link);
+
+/* Readers count themselves in their vcore's indicator, so they don't share a
+ * cacheline.  A reader might unlock on a different vcore than it locked on, so
+ * individual counts can go negative; only the sum means anything. */
+struct uth_rwlock_rind {
+	atomic_t					nr_readers;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct uth_default_rwlock {
+	struct spin_pdr_lock		lock;
+	bool						writer_intent;	/* held or wanted */
+	bool						writer_held;
+	struct uthread				*drainer;	/* writer waiting on readers */
+	struct rwlock_link_tq		readers;
+	struct rwlock_link_tq		writers;
+	struct uth_rwlock_rind		*rinds;
+};
+
 
 /************** Default Mutex Implementation **************/
 
@@ -52,6 +82,8 @@ static struct uth_default_mtx *uth_default_mtx_alloc(void)
 	spin_pdr_init(&mtx->lock);
 	TAILQ_INIT(&mtx->waiters);
 	mtx->locked = FALSE;
+	mtx->owner = NULL;
+	mtx->spin.avg = 0;
 	return mtx;
 }
 
@@ -76,16 +108,54 @@ static void __mutex_cb(struct uthread *uth, void *arg)
 	spin_pdr_unlock(&mtx->lock);
 }
 
-static void uth_default_mtx_lock(struct uth_default_mtx *mtx)
+/* Returns TRUE if we got the mutex.  Either way, we return with mtx->lock held
+ * iff the mutex was locked. */
+static bool __uth_default_mtx_trylock(struct uth_default_mtx *mtx)
 {
-	struct uth_mtx_link link;
-
 	spin_pdr_lock(&mtx->lock);
 	if (!mtx->locked) {
 		mtx->locked = TRUE;
+		mtx->owner = current_uthread;
 		spin_pdr_unlock(&mtx->lock);
-		return;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* Spins while the owner runs, for up to the mutex's spin limit.  Returns TRUE
+ * if we got the mutex along the way. */
+static bool uth_default_mtx_spin(struct uth_default_mtx *mtx)
+{
+	unsigned int limit = uth_spin_limit(&mtx->spin);
+	unsigned int spun;
+
+	for (spun = 0; spun < limit; spun++) {
+		if (!uth_owner_is_running(ACCESS_ONCE(mtx->owner)))
+			break;
+		cpu_relax();
+		if (!ACCESS_ONCE(mtx->locked)) {
+			if (__uth_default_mtx_trylock(mtx)) {
+				uth_spin_update(&mtx->spin, spun);
+				return TRUE;
+			}
+			spin_pdr_unlock(&mtx->lock);
+		}
 	}
+	uth_spin_update(&mtx->spin, spun);
+	return FALSE;
+}
+
+static void uth_default_mtx_lock(struct uth_default_mtx *mtx)
+{
+	struct uth_mtx_link link;
+
+	if (__uth_default_mtx_trylock(mtx))
+		return;
+	spin_pdr_unlock(&mtx->lock);
+	if (uth_default_mtx_spin(mtx))
+		return;
+	if (__uth_default_mtx_trylock(mtx))
+		return;
 	link.mtx = mtx;
 	link.uth = current_uthread;
 	TAILQ_INSERT_TAIL(&mtx->waiters, &link, next);
@@ -101,10 +171,13 @@ static void uth_default_mtx_unlock(struct uth_default_mtx *mtx)
 
 	spin_pdr_lock(&mtx->lock);
 	first = TAILQ_FIRST(&mtx->waiters);
-	if (first)
+	if (first) {
 		TAILQ_REMOVE(&mtx->waiters, first, next);
-	else
+		mtx->owner = first->uth;
+	} else {
 		mtx->locked = FALSE;
+		mtx->owner = NULL;
+	}
 	spin_pdr_unlock(&mtx->lock);
 	if (first)
 		uthread_runnable(first->uth);
@@ -325,3 +398,271 @@ void uth_cond_var_broadcast(uth_cond_var_t cv)
 	}
 	uth_default_cv_broadcast((struct uth_default_cv*)cv);
 }
+
+
+/************** Default RWLock Implementation **************/
+
+
+/* Readers never touch the spinlock unless a writer is around.  A reader bumps
+ * its vcore's indicator, then checks writer_intent; a writer sets
+ * writer_intent, then sums the indicators.  Both sides have a CPU mb() in
+ * between, so either the reader sees the writer and backs off, or the writer
+ * sees the reader and waits for it.
+ *
+ * A writer that has to wait for readers becomes the drainer.  Readers that
+ * leave while writer_intent is set grab the spinlock, and whichever one sees
+ * the sum hit zero hands the lock to the drainer.  Other writers queue behind
+ * the drainer and get the lock directly from the writer before them.  Readers
+ * that show up while any writer wants the lock block until the last writer
+ * unlocks, which counts them all in and wakes them. */
+static struct uth_default_rwlock *uth_default_rwlock_alloc(void)
+{
+	struct uth_default_rwlock *rwl;
+	size_t rinds_sz = sizeof(struct uth_rwlock_rind) * max_vcores();
+	int ret;
+
+	rwl = malloc(sizeof(struct uth_default_rwlock));
+	assert(rwl);
+	spin_pdr_init(&rwl->lock);
+	rwl->writer_intent = FALSE;
+	rwl->writer_held = FALSE;
+	rwl->drainer = NULL;
+	TAILQ_INIT(&rwl->readers);
+	TAILQ_INIT(&rwl->writers);
+	ret = posix_memalign((void**)&rwl->rinds,
+	                     __alignof__(struct uth_rwlock_rind), rinds_sz);
+	assert(!ret);
+	memset(rwl->rinds, 0, rinds_sz);
+	return rwl;
+}
+
+static void uth_default_rwlock_free(struct uth_default_rwlock *rwl)
+{
+	assert(TAILQ_EMPTY(&rwl->readers));
+	assert(TAILQ_EMPTY(&rwl->writers));
+	assert(!rwl->drainer);
+	free(rwl->rinds);
+	free(rwl);
+}
+
+static void __rwlock_cb(struct uthread *uth, void *arg)
+{
+	struct uth_rwlock_link *link = (struct uth_rwlock_link*)arg;
+
+	/* Same deal as the mutex: tell the 2LS before unlocking. */
+	uthread_has_blocked(uth, UTH_EXT_BLK_MUTEX);
+	spin_pdr_unlock(&link->rwl->lock);
+}
+
+static atomic_t *__rwlock_my_rind(struct uth_default_rwlock *rwl)
+{
+	return &rwl->rinds[vcore_id()].nr_readers;
+}
+
+static long __rwlock_nr_readers(struct uth_default_rwlock *rwl)
+{
+	long sum = 0;
+
+	for (int i = 0; i < max_vcores(); i++)
+		sum += atomic_read(&rwl->rinds[i].nr_readers);
+	return sum;
+}
+
+static void __rwlock_reader_leave(struct uth_default_rwlock *rwl)
+{
+	struct uthread *drainer = NULL;
+
+	atomic_dec(__rwlock_my_rind(rwl));
+	cmb();	/* the atomic provides a CPU mb() */
+	if (!ACCESS_ONCE(rwl->writer_intent))
+		return;
+	spin_pdr_lock(&rwl->lock);
+	if (rwl->drainer && !__rwlock_nr_readers(rwl)) {
+		drainer = rwl->drainer;
+		rwl->drainer = NULL;
+		rwl->writer_held = TRUE;
+	}
+	spin_pdr_unlock(&rwl->lock);
+	if (drainer)
+		uthread_runnable(drainer);
+}
+
+/* Returns TRUE if we're counted in as a reader. */
+static bool __rwlock_reader_enter(struct uth_default_rwlock *rwl)
+{
+	atomic_inc(__rwlock_my_rind(rwl));
+	cmb();	/* the atomic provides a CPU mb() */
+	if (!ACCESS_ONCE(rwl->writer_intent))
+		return TRUE;
+	/* A writer might be waiting on the count we just bumped */
+	__rwlock_reader_leave(rwl);
+	return FALSE;
+}
+
+static void uth_default_rwlock_rdlock(struct uth_default_rwlock *rwl)
+{
+	struct uth_rwlock_link link;
+
+	while (!__rwlock_reader_enter(rwl)) {
+		spin_pdr_lock(&rwl->lock);
+		if (!rwl->writer_intent) {
+			spin_pdr_unlock(&rwl->lock);
+			continue;
+		}
+		link.rwl = rwl;
+		link.uth = current_uthread;
+		TAILQ_INSERT_TAIL(&rwl->readers, &link, next);
+		uthread_yield(TRUE, __rwlock_cb, &link);
+		/* The last writer counted us in before waking us. */
+		return;
+	}
+}
+
+static bool uth_default_rwlock_try_rdlock(struct uth_default_rwlock *rwl)
+{
+	return __rwlock_reader_enter(rwl);
+}
+
+static void uth_default_rwlock_wrlock(struct uth_default_rwlock *rwl)
+{
+	struct uth_rwlock_link link;
+
+	link.rwl = rwl;
+	link.uth = current_uthread;
+	spin_pdr_lock(&rwl->lock);
+	if (rwl->writer_intent) {
+		TAILQ_INSERT_TAIL(&rwl->writers, &link, next);
+		uthread_yield(TRUE, __rwlock_cb, &link);
+		/* The writer before us handed us the lock. */
+		return;
+	}
+	rwl->writer_intent = TRUE;
+	wrmb();	/* order the intent before reading the indicators */
+	if (!__rwlock_nr_readers(rwl)) {
+		rwl->writer_held = TRUE;
+		spin_pdr_unlock(&rwl->lock);
+		return;
+	}
+	rwl->drainer = current_uthread;
+	uthread_yield(TRUE, __rwlock_cb, &link);
+	/* The last reader out set writer_held before waking us. */
+}
+
+static bool uth_default_rwlock_try_wrlock(struct uth_default_rwlock *rwl)
+{
+	spin_pdr_lock(&rwl->lock);
+	if (rwl->writer_intent) {
+		spin_pdr_unlock(&rwl->lock);
+		return FALSE;
+	}
+	rwl->writer_intent = TRUE;
+	wrmb();	/* order the intent before reading the indicators */
+	if (!__rwlock_nr_readers(rwl)) {
+		rwl->writer_held = TRUE;
+		spin_pdr_unlock(&rwl->lock);
+		return TRUE;
+	}
+	/* Back out.  Nothing queued while writer_intent was clear, and readers that
+	 * backed off because of us will retry once we unlock. */
+	rwl->writer_intent = FALSE;
+	spin_pdr_unlock(&rwl->lock);
+	return FALSE;
+}
+
+static void __rwlock_writer_unlock(struct uth_default_rwlock *rwl)
+{
+	struct rwlock_link_tq restartees = TAILQ_HEAD_INITIALIZER(restartees);
+	struct uth_rwlock_link *i, *safe;
+	long nr_readers = 0;
+
+	spin_pdr_lock(&rwl->lock);
+	i = TAILQ_FIRST(&rwl->writers);
+	if (i) {
+		TAILQ_REMOVE(&rwl->writers, i, next);
+		spin_pdr_unlock(&rwl->lock);
+		uthread_runnable(i->uth);
+		return;
+	}
+	TAILQ_SWAP(&rwl->readers, &restartees, uth_rwlock_link, next);
+	TAILQ_FOREACH(i, &restartees, next)
+		nr_readers++;
+	/* Count them in now, so a writer that comes after has to wait for them */
+	atomic_fetch_and_add(__rwlock_my_rind(rwl), nr_readers);
+	rwl->writer_held = FALSE;
+	rwl->writer_intent = FALSE;
+	spin_pdr_unlock(&rwl->lock);
+	/* Need the SAFE, since we can't touch the linkage once the uth could run */
+	TAILQ_FOREACH_SAFE(i, &restartees, next, safe)
+		uthread_runnable(i->uth);
+}
+
+/* Only the writer can see writer_held while it holds the lock: the flag isn't
+ * set until the readers are gone, and it's cleared before any come back. */
+static void uth_default_rwlock_unlock(struct uth_default_rwlock *rwl)
+{
+	if (ACCESS_ONCE(rwl->writer_held))
+		__rwlock_writer_unlock(rwl);
+	else
+		__rwlock_reader_leave(rwl);
+}
+
+
+/************** Wrappers for the uthread RWLock interface **************/
+
+
+uth_rwlock_t uth_rwlock_alloc(void)
+{
+	if (sched_ops->rwlock_alloc)
+		return sched_ops->rwlock_alloc();
+	return (uth_rwlock_t)uth_default_rwlock_alloc();
+}
+
+void uth_rwlock_free(uth_rwlock_t rwl)
+{
+	if (sched_ops->rwlock_free) {
+		sched_ops->rwlock_free(rwl);
+		return;
+	}
+	uth_default_rwlock_free((struct uth_default_rwlock*)rwl);
+}
+
+void uth_rwlock_rdlock(uth_rwlock_t rwl)
+{
+	if (sched_ops->rwlock_rdlock) {
+		sched_ops->rwlock_rdlock(rwl);
+		return;
+	}
+	uth_default_rwlock_rdlock((struct uth_default_rwlock*)rwl);
+}
+
+void uth_rwlock_wrlock(uth_rwlock_t rwl)
+{
+	if (sched_ops->rwlock_wrlock) {
+		sched_ops->rwlock_wrlock(rwl);
+		return;
+	}
+	uth_default_rwlock_wrlock((struct uth_default_rwlock*)rwl);
+}
+
+bool uth_rwlock_try_rdlock(uth_rwlock_t rwl)
+{
+	if (sched_ops->rwlock_try_rdlock)
+		return sched_ops->rwlock_try_rdlock(rwl);
+	return uth_default_rwlock_try_rdlock((struct uth_default_rwlock*)rwl);
+}
+
+bool uth_rwlock_try_wrlock(uth_rwlock_t rwl)
+{
+	if (sched_ops->rwlock_try_wrlock)
+		return sched_ops->rwlock_try_wrlock(rwl);
+	return uth_default_rwlock_try_wrlock((struct uth_default_rwlock*)rwl);
+}
+
+void uth_rwlock_unlock(uth_rwlock_t rwl)
+{
+	if (sched_ops->rwlock_unlock) {
+		sched_ops->rwlock_unlock(rwl);
+		return;
+	}
+	uth_default_rwlock_unlock((struct uth_default_rwlock*)rwl);
+}
@@ -238,6 +238,28 @@ int uthread_signal(struct uthread *uthread, int signo)
 	return sigaddset(&uthread->sigstate.pending, signo);
 }
 
+/* Takes the signals the kernel posted straight to our VCPD (see ros/event.h)
+ * and makes them pending on our current uthread.  The 2LS preps its handlers
+ * when it runs the uthread again, just like for pthread_kill().  These are
+ * per-vcore ticks, so with no current uthread, no one was there to get them
+ * and we drop them.  Vcore context only, once it's safe to touch
+ * current_uthread. */
+void handle_vcore_signals(uint32_t vcoreid)
+{
+	struct preempt_data *vcpd = vcpd_of(vcoreid);
+	unsigned long sigs;
+
+	if (!atomic_read(&vcpd->sig_pending))
+		return;
+	sigs = atomic_swap(&vcpd->sig_pending, 0);
+	if (!current_uthread)
+		return;
+	for (int i = 1; i < sizeof(sigs) * 8; i++) {
+		if (sigs & (1UL << i))
+			__sigaddset(&current_uthread->sigstate.pending, i);
+	}
+}
+
 /* If there are any pending signals, prep the uthread to run it's signal
  * handler. The next time the uthread is run, it will pop into it's signal
  * handler context instead of its original saved context. Once the signal
@@ -10,10 +10,16 @@
  * objects, so we use the same style for small objects: store the pointer to the
  * controlling bufctl at the top of the slab object.  Fix this with TODO (BUF).
  *
+ * KMC_NOMAG caches go straight to the slab layer.  Lock ordering is pcpu cache
+ * (notifs disabled) -> depot -> cache_lock.
+ *
  * Ported directly from the kernel's slab allocator. */
 
 #include <parlib/slab.h>
+#include <parlib/uthread.h>
+#include <parlib/vcore.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <parlib/assert.h>
 #include <sys/mman.h>
 #include <sys/param.h>
@@ -22,12 +28,35 @@ struct kmem_cache_list kmem_caches;
 struct spin_pdr_lock kmem_caches_lock;
 
 /* Backend/internal functions, defined later.  Grab the lock before calling
- * these. */
+ * kmem_cache_grow().  The slab layer's alloc and free grab it themselves. */
 static void kmem_cache_grow(struct kmem_cache *cp);
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags);
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf);
+static void kmem_cache_build_pcpu(struct kmem_cache *cp);
 
 /* Cache of the kmem_cache objects, needed for bootstrapping */
 struct kmem_cache kmem_cache_cache;
-struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache;
+struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache, *kmem_magazine_cache;
+
+/* Smaller objects get bigger magazines, roughly following the paper. */
+static unsigned int kmem_default_magsize(size_t obj_size)
+{
+	if (obj_size <= 64)
+		return KMC_MAG_MAX_SZ / 2;
+	if (obj_size <= SLAB_LARGE_CUTOFF)
+		return KMC_MAG_MIN_SZ * 2;
+	return KMC_MAG_MIN_SZ;
+}
+
+static void kmem_depot_init(struct kmem_depot *depot, size_t obj_size)
+{
+	spin_pdr_init(&depot->lock);
+	SLIST_INIT(&depot->not_empty);
+	SLIST_INIT(&depot->empty);
+	depot->magsize = kmem_default_magsize(obj_size);
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+}
 
 static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                                 size_t obj_size, int align, int flags,
@@ -47,7 +76,10 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->ctor = ctor;
 	kc->dtor = dtor;
 	kc->nr_cur_alloc = 0;
-	
+	kc->pcpu_caches = NULL;
+	kmem_depot_init(&kc->depot, obj_size);
+	kmem_cache_build_pcpu(kc);
+
 	/* put in cache list based on it's size */
 	struct kmem_cache *i, *prev = NULL;
 	spin_pdr_lock(&kmem_caches_lock);
@@ -73,15 +105,21 @@ void kmem_cache_init(void)
 	 * kmem_cache_cache. */
 	__kmem_cache_create(&kmem_cache_cache, "kmem_cache",
 	                    sizeof(struct kmem_cache),
-	                    __alignof__(struct kmem_cache), 0, NULL, NULL);
-	/* Build the slab and bufctl caches */
+	                    __alignof__(struct kmem_cache), KMC_NOMAG, NULL, NULL);
+	/* Build the slab and bufctl caches.  These, and the magazines themselves,
+	 * are used by the magazine layer, so they can't have one. */
 	kmem_slab_cache = kmem_cache_alloc(&kmem_cache_cache, 0);
 	__kmem_cache_create(kmem_slab_cache, "kmem_slab", sizeof(struct kmem_slab),
-	                    __alignof__(struct kmem_slab), 0, NULL, NULL); 
+	                    __alignof__(struct kmem_slab), KMC_NOMAG, NULL, NULL);
 	kmem_bufctl_cache = kmem_cache_alloc(&kmem_cache_cache, 0);
 	__kmem_cache_create(kmem_bufctl_cache, "kmem_bufctl",
 	                    sizeof(struct kmem_bufctl),
-	                    __alignof__(struct kmem_bufctl), 0, NULL, NULL); 
+	                    __alignof__(struct kmem_bufctl), KMC_NOMAG, NULL, NULL);
+	kmem_magazine_cache = kmem_cache_alloc(&kmem_cache_cache, 0);
+	__kmem_cache_create(kmem_magazine_cache, "kmem_magazine",
+	                    sizeof(struct kmem_magazine),
+	                    __alignof__(struct kmem_magazine), KMC_NOMAG, NULL,
+	                    NULL);
 }
 
 /* Cache management */
@@ -129,12 +167,119 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 	}
 }
 
+/* Magazine layer helpers.  Magazines come straight from the slab layer of
+ * kmem_magazine_cache, which has no magazines of its own. */
+
+static struct kmem_magazine *kmem_mag_alloc(void)
+{
+	struct kmem_magazine *mag;
+
+	mag = __kmem_alloc_from_slab(kmem_magazine_cache, 0);
+	mag->nr_rounds = 0;
+	return mag;
+}
+
+static void kmem_mag_free(struct kmem_magazine *mag)
+{
+	__kmem_free_to_slab(kmem_magazine_cache, mag);
+}
+
+/* Returns all of a magazine's rounds to the slab layer. */
+static void kmem_mag_drain(struct kmem_cache *cp, struct kmem_magazine *mag)
+{
+	for (int i = 0; i < mag->nr_rounds; i++)
+		__kmem_free_to_slab(cp, mag->rounds[i]);
+	mag->nr_rounds = 0;
+}
+
+static void kmem_pcc_swap_mags(struct kmem_pcpu_cache *pcc)
+{
+	struct kmem_magazine *temp = pcc->loaded;
+
+	pcc->loaded = pcc->prev;
+	pcc->prev = temp;
+}
+
+/* Disables notifs, which the caller must reenable, so that we stay on this
+ * vcore and vcore context can't run on it until we're done. */
+static struct kmem_pcpu_cache *get_my_pcpu_cache(struct kmem_cache *cp)
+{
+	uth_disable_notifs();
+	return &cp->pcpu_caches[vcore_id()];
+}
+
+/* Sets up the magazine layer for cp.  Magazines are small and come from the
+ * slab layer, which never fails (it asserts instead). */
+static void kmem_cache_build_pcpu(struct kmem_cache *cp)
+{
+	struct kmem_pcpu_cache *pcpu_caches, *pcc;
+	int ret;
+
+	if (cp->flags & KMC_NOMAG)
+		return;
+	ret = posix_memalign((void**)&pcpu_caches, __alignof__(*pcpu_caches),
+	                     sizeof(struct kmem_pcpu_cache) * max_vcores());
+	assert(!ret);
+	for (int i = 0; i < max_vcores(); i++) {
+		pcc = &pcpu_caches[i];
+		pcc->magsize = cp->depot.magsize;
+		pcc->nr_allocs_ever = 0;
+		pcc->loaded = kmem_mag_alloc();
+		pcc->prev = kmem_mag_alloc();
+	}
+	/* Other vcores can see the pcpu caches as soon as we publish the ptr */
+	wmb();
+	cp->pcpu_caches = pcpu_caches;
+}
+
+/* Returns the depot's rounds to the slab layer and frees its magazines. */
+static void kmem_depot_flush(struct kmem_cache *cp)
+{
+	struct kmem_depot *depot = &cp->depot;
+	struct kmem_mag_slist not_empty, empty;
+	struct kmem_magazine *mag;
+
+	/* Pull the lists out of the depot, so we don't drain with it locked */
+	spin_pdr_lock(&depot->lock);
+	not_empty = depot->not_empty;
+	empty = depot->empty;
+	SLIST_INIT(&depot->not_empty);
+	SLIST_INIT(&depot->empty);
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+	spin_pdr_unlock(&depot->lock);
+	while ((mag = SLIST_FIRST(&not_empty))) {
+		SLIST_REMOVE_HEAD(&not_empty, link);
+		kmem_mag_drain(cp, mag);
+		kmem_mag_free(mag);
+	}
+	while ((mag = SLIST_FIRST(&empty))) {
+		SLIST_REMOVE_HEAD(&empty, link);
+		kmem_mag_free(mag);
+	}
+}
+
 /* Once you call destroy, never use this cache again... o/w there may be weird
  * races, and other serious issues.  */
 void kmem_cache_destroy(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
+	struct kmem_pcpu_cache *pcc;
 
+	/* No one else is using the cache, so we can empty every vcore's magazines,
+	 * not just our own. */
+	if (cp->pcpu_caches) {
+		for (int i = 0; i < max_vcores(); i++) {
+			pcc = &cp->pcpu_caches[i];
+			kmem_mag_drain(cp, pcc->loaded);
+			kmem_mag_drain(cp, pcc->prev);
+			kmem_mag_free(pcc->loaded);
+			kmem_mag_free(pcc->prev);
+		}
+		free(cp->pcpu_caches);
+		cp->pcpu_caches = NULL;
+	}
+	kmem_depot_flush(cp);
 	spin_pdr_lock(&cp->cache_lock);
 	assert(TAILQ_EMPTY(&cp->full_slab_list));
 	assert(TAILQ_EMPTY(&cp->partial_slab_list));
@@ -154,8 +299,8 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
-/* Front end: clients of caches use these */
-void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+/* Slab layer: gets an object from the slab lists, growing if necessary. */
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags)
 {
 	void *retval = NULL;
 	spin_pdr_lock(&cp->cache_lock);
@@ -195,13 +340,55 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
 	return retval;
 }
 
+/* Front end: clients of caches use these */
+void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+{
+	struct kmem_depot *depot = &cp->depot;
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+	void *retval;
+
+	if (!cp->pcpu_caches)
+		return __kmem_alloc_from_slab(cp, flags);
+	pcc = get_my_pcpu_cache(cp);
+try_loaded:
+	if (pcc->loaded->nr_rounds) {
+		retval = pcc->loaded->rounds[--pcc->loaded->nr_rounds];
+		pcc->nr_allocs_ever++;
+		uth_enable_notifs();
+		return retval;
+	}
+	if (pcc->prev->nr_rounds) {
+		kmem_pcc_swap_mags(pcc);
+		goto try_loaded;
+	}
+	/* Both are empty: trade our prev for a full one from the depot */
+	spin_pdr_lock(&depot->lock);
+	mag = SLIST_FIRST(&depot->not_empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		depot->nr_not_empty--;
+		SLIST_INSERT_HEAD(&depot->empty, pcc->prev, link);
+		depot->nr_empty++;
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		pcc->magsize = depot->magsize;
+		spin_pdr_unlock(&depot->lock);
+		goto try_loaded;
+	}
+	spin_pdr_unlock(&depot->lock);
+	uth_enable_notifs();
+	return __kmem_alloc_from_slab(cp, flags);
+}
+
 static inline struct kmem_bufctl *buf2bufctl(void *buf, size_t offset)
 {
 	// TODO: hash table for back reference (BUF)
 	return *((struct kmem_bufctl**)(buf + offset));
 }
 
-void kmem_cache_free(struct kmem_cache *cp, void *buf)
+/* Slab layer: returns buf to its slab */
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 {
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
@@ -236,6 +423,51 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf)
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
+void kmem_cache_free(struct kmem_cache *cp, void *buf)
+{
+	struct kmem_depot *depot = &cp->depot;
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+
+	if (!cp->pcpu_caches) {
+		__kmem_free_to_slab(cp, buf);
+		return;
+	}
+	pcc = get_my_pcpu_cache(cp);
+try_free:
+	if (pcc->loaded->nr_rounds < pcc->magsize) {
+		pcc->loaded->rounds[pcc->loaded->nr_rounds++] = buf;
+		uth_enable_notifs();
+		return;
+	}
+	if (pcc->prev->nr_rounds < pcc->magsize) {
+		kmem_pcc_swap_mags(pcc);
+		goto try_free;
+	}
+	/* Both are full: trade our prev for an empty one from the depot */
+	spin_pdr_lock(&depot->lock);
+	mag = SLIST_FIRST(&depot->empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		depot->nr_empty--;
+		SLIST_INSERT_HEAD(&depot->not_empty, pcc->prev, link);
+		depot->nr_not_empty++;
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		pcc->magsize = depot->magsize;
+		spin_pdr_unlock(&depot->lock);
+		goto try_free;
+	}
+	spin_pdr_unlock(&depot->lock);
+	/* The depot is out of empty magazines, so we'll make one. */
+	mag = kmem_mag_alloc();
+	spin_pdr_lock(&depot->lock);
+	SLIST_INSERT_HEAD(&depot->empty, mag, link);
+	depot->nr_empty++;
+	spin_pdr_unlock(&depot->lock);
+	goto try_free;
+}
+
 /* Back end: internal functions */
 /* When this returns, the cache has at least one slab in the empty list.  If
  * page_alloc fails, there are some serious issues.  This only grows by one slab
@@ -310,11 +542,22 @@ static void kmem_cache_grow(struct kmem_cache *cp)
 
 /* This deallocs every slab from the empty list.  TODO: think a bit more about
  * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
+ * thrashing.  See 3.4 in the paper.
+ *
+ * Other vcores' magazines aren't locked, so we can only empty our own and the
+ * depot's.  Objects in other vcores' magazines keep their slabs around. */
 void kmem_cache_reap(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
-	
+	struct kmem_pcpu_cache *pcc;
+
+	if (cp->pcpu_caches) {
+		pcc = get_my_pcpu_cache(cp);
+		kmem_mag_drain(cp, pcc->loaded);
+		kmem_mag_drain(cp, pcc->prev);
+		uth_enable_notifs();
+		kmem_depot_flush(cp);
+	}
 	// Destroy all empty slabs.  Refer to the notes about the while loop
 	spin_pdr_lock(&cp->cache_lock);
 	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
@@ -340,6 +583,9 @@ void print_kmem_cache(struct kmem_cache *cp)
 	printf("Slab Partial: 0x%08x\n", cp->partial_slab_list);
 	printf("Slab Empty: 0x%08x\n", cp->empty_slab_list);
 	printf("Current Allocations: %d\n", cp->nr_cur_alloc);
+	printf("Magazine size: %d\n", cp->depot.magsize);
+	printf("Depot magazines: %d not empty, %d empty\n", cp->depot.nr_not_empty,
+	       cp->depot.nr_empty);
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
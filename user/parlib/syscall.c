@@ -3,15 +3,21 @@
 #include <parlib/parlib.h>
 #include <parlib/vcore.h>
 #include <parlib/serialize.h>
+#include <parlib/arch/arch.h>
 
 int sys_proc_destroy(int pid, int exitcode)
 {
 	return ros_syscall(SYS_proc_destroy, pid, exitcode, 0, 0, 0, 0);
 }
 
+/* Only traps if the hardware can't tell us. */
 size_t sys_getpcoreid(void)
 {
-	 return ros_syscall(SYS_getpcoreid, 0, 0, 0, 0, 0, 0);
+	int pcoreid = arch_read_pcoreid();
+
+	if (pcoreid >= 0)
+		return pcoreid;
+	return ros_syscall(SYS_getpcoreid, 0, 0, 0, 0, 0, 0);
 }
 
 int sys_null(void)
@@ -56,6 +62,11 @@ int sys_proc_create(const char *path, size_t path_l, char *const argv[],
 	return ret;
 }
 
+int sys_proc_spawn(int tmpl_pid, int flags)
+{
+	return ros_syscall(SYS_proc_spawn, tmpl_pid, flags, 0, 0, 0, 0);
+}
+
 int sys_proc_run(int pid)
 {
 	return ros_syscall(SYS_proc_run, pid, 0, 0, 0, 0, 0);
@@ -93,6 +104,23 @@ void* sys_init_arsc()
 	return (void*)ros_syscall(SYS_init_arsc, 0, 0, 0, 0, 0, 0);
 }
 
+void *sys_sysring_setup(unsigned int nr_entries, struct event_queue *ev_q,
+                        int flags, int poll_core)
+{
+	return (void*)ros_syscall(SYS_sysring_setup, nr_entries, ev_q, flags,
+	                          poll_core, 0, 0);
+}
+
+int sys_sysring_enter(void)
+{
+	return ros_syscall(SYS_sysring_enter, 0, 0, 0, 0, 0, 0);
+}
+
+long sys_splice(int fd_in, int fd_out, size_t len, int flags)
+{
+	return ros_syscall(SYS_splice, fd_in, fd_out, len, flags, 0, 0);
+}
+
 int sys_block(unsigned long usec)
 {
 	return ros_syscall(SYS_block, usec, 0, 0, 0, 0, 0);
@@ -14,7 +14,9 @@
 #include <unistd.h>
 
 #include <parlib/sysinfo.h>
+#include <parlib/tsc-compat.h>
 #include <ros/arch/arch.h>
+#include <ros/procinfo.h>
 
 int get_num_pcores(void)
 {
@@ -34,3 +36,30 @@ int get_num_pcores(void)
 	close(fd);
 	return ret;
 }
+
+bool pcore_is_idle(uint32_t pcoreid)
+{
+	return ACCESS_ONCE(__proc_global_info.pcore_load[pcoreid].idle);
+}
+
+/* Cumulative busy and idle ticks for pcoreid, as of now.  Diff two of these to
+ * get the utilization over an interval. */
+void pcore_load_ticks(uint32_t pcoreid, uint64_t *busy, uint64_t *idle)
+{
+	struct pcore_load *pl = &__proc_global_info.pcore_load[pcoreid];
+	seq_ctr_t seq;
+	uint64_t since;
+	bool is_idle;
+
+	do {
+		seq = ACCESS_ONCE(pl->seq);
+		is_idle = pl->idle;
+		since = pl->since;
+		*busy = pl->busy_ticks;
+		*idle = pl->idle_ticks;
+	} while (seqctr_retry(seq, ACCESS_ONCE(pl->seq)));
+	if (is_idle)
+		*idle += read_tsc() - since;
+	else
+		*busy += read_tsc() - since;
+}
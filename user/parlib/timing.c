@@ -71,12 +71,17 @@ uint64_t tsc2usec(uint64_t tsc_time)
 		return (tsc_time * 1000000) / get_tsc_freq();
 }
 
+/* The kernel publishes its scaled multipliers, which avoid the divide and
+ * don't lose precision for large tsc values. */
+static inline uint64_t mult_shift_64(uint64_t a, uint64_t b, uint8_t shift)
+{
+	return ((unsigned __int128)a * b) >> shift;
+}
+
 uint64_t tsc2nsec(uint64_t tsc_time)
 {
-	if (mult_will_overflow_u64(tsc_time, 1000000000))
-		return tsc2usec(tsc_time) * 1000;
-	else
-		return (tsc_time * 1000000000) / get_tsc_freq();
+	return mult_shift_64(tsc_time, __proc_global_info.tsc2nsec_mult,
+	                     GINFO_TSC_SHIFT);
 }
 
 uint64_t sec2tsc(uint64_t sec)
@@ -105,10 +110,8 @@ uint64_t usec2tsc(uint64_t usec)
 
 uint64_t nsec2tsc(uint64_t nsec)
 {
-	if (mult_will_overflow_u64(nsec, get_tsc_freq()))
-		return usec2tsc(nsec / 1000);
-	else
-		return (nsec * get_tsc_freq()) / 1000000000;
+	return mult_shift_64(nsec, __proc_global_info.nsec2tsc_mult,
+	                     GINFO_TSC_SHIFT);
 }
 
 uint64_t nsec(void)
@@ -0,0 +1,198 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Asynchronous I/O for uthreads.  See parlib/uaio.h.
+ *
+ * Each group has its own UCQ event queue with a wakeup controller, the same
+ * setup uthreads use to block on other event queues.  We don't use a CEQ: it
+ * coalesces events by type, and every completion is an EV_SYSCALL, so we'd
+ * lose which syscall finished.  The UCQ keeps each message, and ev_arg3 points
+ * at the syscall, so reaping a completion is O(1).
+ *
+ * The kernel sends the event from inside its SC_K_LOCK, so we wait for it to
+ * let go of the syscall before handing the future back. */
+
+#include <parlib/uaio.h>
+#include <parlib/parlib.h>
+#include <parlib/event.h>
+#include <parlib/uthread.h>
+#include <parlib/arch/atomic.h>
+#include <parlib/arch/arch.h>
+#include <parlib/assert.h>
+#include <string.h>
+#include <errno.h>
+
+void uaio_group_init(struct uaio_group *grp)
+{
+	grp->evq = get_eventq(EV_MBOX_UCQ);
+	grp->evq->ev_flags = EVENT_INDIR | EVENT_SPAM_INDIR | EVENT_WAKEUP;
+	evq_attach_wakeup_ctlr(grp->evq);
+	grp->nr_inflight = 0;
+	TAILQ_INIT(&grp->done);
+}
+
+/* There could be INDIRs floating around for the evq still, so we can't free
+ * it.  Like epoll, we need some sort of user deferred destruction (TODO). */
+void uaio_group_destroy(struct uaio_group *grp)
+{
+	assert(!grp->nr_inflight);
+#if 0 /* TODO: EVQ/INDIR Cleanup */
+	evq_remove_wakeup_ctlr(grp->evq);
+	put_eventq(grp->evq);
+#endif
+	grp->evq = NULL;
+}
+
+void uaio_submit(struct uaio_group *grp, struct uaio_future *fut,
+                 unsigned long num, long a0, long a1, long a2, long a3,
+                 long a4, long a5)
+{
+	struct syscall *sysc = &fut->sysc;
+
+	fut->grp = grp;
+	fut->done = FALSE;
+	memset(sysc, 0, sizeof(struct syscall));
+	sysc->num = num;
+	sysc->ev_q = grp->evq;
+	atomic_set(&sysc->flags, SC_UEVENT);
+	sysc->arg0 = a0;
+	sysc->arg1 = a1;
+	sysc->arg2 = a2;
+	sysc->arg3 = a3;
+	sysc->arg4 = a4;
+	sysc->arg5 = a5;
+	grp->nr_inflight++;
+	__ros_arch_syscall((long)sysc, 1);
+}
+
+void uaio_read(struct uaio_group *grp, struct uaio_future *fut, int fd,
+               void *buf, size_t len)
+{
+	uaio_submit(grp, fut, SYS_read, fd, (long)buf, len, 0, 0, 0);
+}
+
+void uaio_write(struct uaio_group *grp, struct uaio_future *fut, int fd,
+                const void *buf, size_t len)
+{
+	uaio_submit(grp, fut, SYS_write, fd, (long)buf, len, 0, 0, 0);
+}
+
+/* The kernel reads the iovec whenever the syscall runs, so it lives in the
+ * future. */
+void uaio_pread(struct uaio_group *grp, struct uaio_future *fut, int fd,
+                void *buf, size_t len, off_t off)
+{
+	fut->iov.iov_base = buf;
+	fut->iov.iov_len = len;
+	uaio_submit(grp, fut, SYS_preadv, fd, (long)&fut->iov, 1, off, 0, 0);
+}
+
+void uaio_pwrite(struct uaio_group *grp, struct uaio_future *fut, int fd,
+                 const void *buf, size_t len, off_t off)
+{
+	fut->iov.iov_base = (void*)buf;
+	fut->iov.iov_len = len;
+	uaio_submit(grp, fut, SYS_pwritev, fd, (long)&fut->iov, 1, off, 0, 0);
+}
+
+/* Moves the syscall's future to its group's done list. */
+static void uaio_complete(struct event_msg *ev_msg)
+{
+	struct syscall *sysc = ev_msg->ev_arg3;
+	struct uaio_future *fut;
+	struct uaio_group *grp;
+
+	assert(ev_msg->ev_type == EV_SYSCALL && sysc);
+	fut = container_of(sysc, struct uaio_future, sysc);
+	grp = fut->grp;
+	while (atomic_read(&sysc->flags) & SC_K_LOCK)
+		cpu_relax();
+	fut->done = TRUE;
+	TAILQ_INSERT_TAIL(&grp->done, fut, link);
+	grp->nr_inflight--;
+}
+
+/* Reaps every completion that has arrived, without blocking. */
+static void uaio_reap(struct uaio_group *grp)
+{
+	struct event_msg ev_msg;
+
+	while (grp->nr_inflight && uth_check_evqs(&ev_msg, NULL, 1, grp->evq))
+		uaio_complete(&ev_msg);
+}
+
+/* Blocks until at least one more completion arrives, then reaps them all. */
+static void uaio_block(struct uaio_group *grp)
+{
+	struct event_msg ev_msg;
+
+	assert(grp->nr_inflight);
+	uth_blockon_evqs(&ev_msg, NULL, 1, grp->evq);
+	uaio_complete(&ev_msg);
+	uaio_reap(grp);
+}
+
+static struct uaio_future *uaio_pop_done(struct uaio_group *grp)
+{
+	struct uaio_future *fut = TAILQ_FIRST(&grp->done);
+
+	if (fut)
+		TAILQ_REMOVE(&grp->done, fut, link);
+	return fut;
+}
+
+/* Returns a finished future, or 0 if none have finished yet. */
+struct uaio_future *uaio_poll(struct uaio_group *grp)
+{
+	if (TAILQ_EMPTY(&grp->done))
+		uaio_reap(grp);
+	return uaio_pop_done(grp);
+}
+
+/* Returns the next future to finish, blocking if needed, or 0 if nothing is in
+ * flight. */
+struct uaio_future *uaio_wait_any(struct uaio_group *grp)
+{
+	if (TAILQ_EMPTY(&grp->done)) {
+		if (!grp->nr_inflight)
+			return NULL;
+		uaio_block(grp);
+	}
+	return uaio_pop_done(grp);
+}
+
+/* Blocks until fut finishes and reaps it.  Other futures that finish in the
+ * meantime stay on the done list for uaio_wait_any() or uaio_poll(). */
+void uaio_wait(struct uaio_future *fut)
+{
+	struct uaio_group *grp = fut->grp;
+
+	while (!fut->done)
+		uaio_block(grp);
+	TAILQ_REMOVE(&grp->done, fut, link);
+}
+
+/* Blocks until everything in flight finishes, then reaps every finished
+ * future.  Returns how many it reaped; the caller knows which ones they are. */
+unsigned int uaio_wait_all(struct uaio_group *grp)
+{
+	unsigned int nr = 0;
+
+	while (grp->nr_inflight)
+		uaio_block(grp);
+	while (uaio_pop_done(grp))
+		nr++;
+	return nr;
+}
+
+long uaio_result(struct uaio_future *fut)
+{
+	struct syscall *sysc = &fut->sysc;
+
+	assert(fut->done);
+	if (sysc->err) {
+		errno = sysc->err;
+		memcpy(errstr(), sysc->errstr, MAX_ERRSTR_LEN);
+	}
+	return sysc->retval;
+}
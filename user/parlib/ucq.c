@@ -60,16 +60,36 @@ void ucq_free_pgs(struct ucq *ucq)
 	munmap((void*)pg2, PGSIZE);
 }
 
-/* Consumer side, returns TRUE on success and fills *msg with the ev_msg.  If
- * the ucq appears empty, it will return FALSE.  Messages may have arrived after
- * we started getting that we do not receive. */
-bool get_ucq_msg(struct ucq *ucq, struct event_msg *msg)
+/* Helper: how many slots, up to max, we can claim starting at the good slot
+ * my_idx.  A claim can't cross into the next page, and only goes up to prod_idx
+ * if the producer is still on our page.  Returns 0 if the ucq looks empty. */
+static unsigned int nr_claimable(struct ucq *ucq, uintptr_t my_idx,
+                                 unsigned int max)
+{
+	uintptr_t prod_idx = atomic_read(&ucq->prod_idx);
+	uintptr_t nr = NR_MSG_PER_PAGE - PGOFF(my_idx);
+
+	if (PTE_ADDR(prod_idx) == PTE_ADDR(my_idx))
+		nr = MIN(nr, prod_idx - my_idx);
+	return MIN(nr, max);
+}
+
+/* Consumer side, copies up to max messages into msgs, and returns how many it
+ * got.  The messages all come from one page, claimed with a single CAS on the
+ * consumer index.  Returns 0 if the ucq appears empty.  Messages may have
+ * arrived after we started getting that we do not receive. */
+unsigned int get_ucq_msgs(struct ucq *ucq, struct event_msg *msgs,
+                          unsigned int max)
 {
 	uintptr_t my_idx;
+	unsigned int nr;
 	struct ucq_page *old_page, *other_page;
 	struct msg_container *my_msg;
 	struct spin_pdr_lock *ucq_lock = (struct spin_pdr_lock*)(&ucq->u_lock);
 
+	if (!max)
+		return 0;
+
 	do {
 loop_top:
 		cmb();
@@ -77,7 +97,7 @@ loop_top:
 		/* The ucq is empty if the consumer and producer are on the same 'next'
 		 * slot. */
 		if (my_idx == atomic_read(&ucq->prod_idx))
-			return FALSE;
+			return 0;
 		/* Is the slot we want good?  If not, we're going to need to try and
 		 * move on to the next page.  If it is, we bypass all of this and try to
 		 * CAS on us getting my_idx. */
@@ -93,7 +113,7 @@ loop_top:
 			spin_pdr_unlock(ucq_lock);
 			/* Make sure this new slot has a producer (ucq isn't empty) */
 			if (my_idx == atomic_read(&ucq->prod_idx))
-				return FALSE;
+				return 0;
 			goto claim_slot;
 		}
 		/* At this point, the slot is bad, and all other possible consumers are
@@ -137,27 +157,44 @@ loop_top:
 		goto loop_top;
 claim_slot:
 		cmb();	/* so we can goto claim_slot */
-		/* If we're still here, my_idx is good, and we'll try to claim it.  If
-		 * we fail, we need to repeat the whole process. */
-	} while (!atomic_cas(&ucq->cons_idx, my_idx, my_idx + 1));
+		/* If we're still here, my_idx is good, and we'll try to claim it and
+		 * the slots after it.  If we fail, we need to repeat the whole
+		 * process. */
+		nr = nr_claimable(ucq, my_idx, max);
+		if (!nr)
+			return 0;
+	} while (!atomic_cas(&ucq->cons_idx, my_idx, my_idx + nr));
 	assert(slot_is_good(my_idx));
-	/* Now we have a good slot that we can consume */
-	my_msg = slot2msg(my_idx);
-	/* linux would put an rmb_depends() here */
-	/* Wait til the msg is ready (kernel sets this flag) */
-	while (!my_msg->ready)
-		cpu_relax();
-	rmb();	/* order the ready read before the contents */
-	/* Copy out */
-	*msg = my_msg->ev_msg;
-	/* Unset this for the next usage of the container */
-	my_msg->ready = FALSE;
-	wmb();	/* post the ready write before incrementing */
-	/* Increment nr_cons, showing we're done */
-	atomic_inc(&((struct ucq_page*)PTE_ADDR(my_idx))->header.nr_cons);
-	return TRUE;
+	assert(slot_is_good(my_idx + nr - 1));
+	/* Now we have good slots that we can consume */
+	for (unsigned int i = 0; i < nr; i++) {
+		my_msg = slot2msg(my_idx + i);
+		/* linux would put an rmb_depends() here */
+		/* Wait til the msg is ready (kernel sets this flag) */
+		while (!my_msg->ready)
+			cpu_relax();
+		rmb();	/* order the ready read before the contents */
+		/* Copy out */
+		msgs[i] = my_msg->ev_msg;
+		/* Unset this for the next usage of the container */
+		my_msg->ready = FALSE;
+	}
+	wmb();	/* post the ready writes before adding */
+	/* Add to nr_cons, showing we're done */
+	atomic_fetch_and_add(&((struct ucq_page*)PTE_ADDR(my_idx))->header.nr_cons,
+	                     nr);
+	return nr;
 }
 
+/* Consumer side, returns TRUE on success and fills *msg with the ev_msg.  If
+ * the ucq appears empty, it will return FALSE.  Messages may have arrived after
+ * we started getting that we do not receive. */
+bool get_ucq_msg(struct ucq *ucq, struct event_msg *msg)
+{
+	return get_ucq_msgs(ucq, msg, 1) == 1;
+}
+
+
 bool ucq_is_empty(struct ucq *ucq)
 {
 	/* The ucq is empty if the consumer and producer are on the same 'next'
@@ -0,0 +1,201 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Stackless tasks.  See parlib/utask.h.
+ *
+ * Each vcore has a Chase-Lev work-stealing deque.  The owner pushes and pops at
+ * the bottom, without atomics except when racing for the last task, and
+ * thieves CAS the top.  The owner of vcore X's deque is whoever is running on
+ * vcore X with notifs disabled, so a uthread can't be switched out or migrated
+ * in the middle of an owner op.  Thieves don't need that: a steal is just a CAS
+ * on someone else's deque, so a preempted owner never holds up a thief.
+ *
+ * The deques are a fixed size.  If ours is full, utask_spawn() runs the task
+ * right away, which is what the task's spawner would have gotten with no
+ * parallelism at all. */
+
+#include <parlib/utask.h>
+#include <parlib/vcore.h>
+#include <parlib/uthread.h>
+#include <parlib/arch/atomic.h>
+#include <parlib/arch/arch.h>
+#include <parlib/assert.h>
+#include <stdlib.h>
+
+#define UTASK_DEQUE_SZ				512		/* power of two */
+#define UTASK_SPINS					1000	/* before we yield in sync */
+
+struct utask_deque {
+	atomic_t					top;		/* thieves take from here */
+	long						bottom;		/* owner works here */
+	struct utask				*tasks[UTASK_DEQUE_SZ];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct utask_deque *utask_deques;
+
+/* The first spawner allocates every vcore's deque, so that later spawns, which
+ * might be in vcore context, never need to allocate. */
+static struct utask_deque *get_deques(void)
+{
+	struct utask_deque *deques = ACCESS_ONCE(utask_deques);
+
+	if (deques)
+		return deques;
+	assert(!in_vcore_context());
+	if (posix_memalign((void**)&deques, ARCH_CL_SIZE,
+	                   max_vcores() * sizeof(struct utask_deque)))
+		panic("Unable to allocate utask deques!");
+	for (int i = 0; i < max_vcores(); i++) {
+		atomic_init(&deques[i].top, 0);
+		deques[i].bottom = 0;
+	}
+	if (!atomic_cas_ptr((void**)&utask_deques, NULL, deques)) {
+		free(deques);
+		deques = utask_deques;
+	}
+	return deques;
+}
+
+/* Owner only.  Returns FALSE if the deque is full. */
+static bool utask_push(struct utask_deque *d, struct utask *task)
+{
+	long b = d->bottom;
+
+	if (b - atomic_read(&d->top) >= UTASK_DEQUE_SZ)
+		return FALSE;
+	d->tasks[b & (UTASK_DEQUE_SZ - 1)] = task;
+	wmb();	/* the task must be there before thieves can see it */
+	ACCESS_ONCE(d->bottom) = b + 1;
+	return TRUE;
+}
+
+/* Owner only.  We claim the bottom slot before looking at top, so a thief
+ * either sees our claim or we see its steal.  That needs a real mb. */
+static struct utask *utask_pop(struct utask_deque *d)
+{
+	long b = d->bottom - 1;
+	long t;
+	struct utask *task;
+
+	ACCESS_ONCE(d->bottom) = b;
+	wrmb();
+	t = atomic_read(&d->top);
+	if (t > b) {
+		ACCESS_ONCE(d->bottom) = b + 1;
+		return NULL;
+	}
+	task = d->tasks[b & (UTASK_DEQUE_SZ - 1)];
+	if (t == b) {
+		/* Last one: race the thieves for it */
+		if (!atomic_cas(&d->top, t, t + 1))
+			task = NULL;
+		ACCESS_ONCE(d->bottom) = b + 1;
+	}
+	return task;
+}
+
+/* Anyone.  If we lose a race with another thief or the owner, we just give
+ * up; the caller will try somewhere else. */
+static struct utask *utask_steal(struct utask_deque *d)
+{
+	long t = atomic_read(&d->top);
+	struct utask *task;
+
+	rmb();	/* read top before bottom */
+	if (t >= ACCESS_ONCE(d->bottom))
+		return NULL;
+	/* If the owner wrapped around and overwrote this slot, top moved past t
+	 * first, and our CAS fails. */
+	task = ACCESS_ONCE(d->tasks[t & (UTASK_DEQUE_SZ - 1)]);
+	if (!atomic_cas(&d->top, t, t + 1))
+		return NULL;
+	return task;
+}
+
+/* Tries our own deque, then the preempted vcores' (no one else will run those
+ * tasks until the vcore comes back), then everyone else's. */
+static struct utask *utask_grab(void)
+{
+	struct utask_deque *deques = get_deques();
+	struct utask *task;
+	uint32_t vcoreid, victim;
+
+	uth_disable_notifs();
+	vcoreid = vcore_id();
+	task = utask_pop(&deques[vcoreid]);
+	uth_enable_notifs();
+	if (task)
+		return task;
+	for (int i = 1; i < max_vcores(); i++) {
+		victim = (vcoreid + i) % max_vcores();
+		if (vcore_is_preempted(victim) &&
+		    (task = utask_steal(&deques[victim])))
+			return task;
+	}
+	for (int i = 1; i < max_vcores(); i++) {
+		victim = (vcoreid + i) % max_vcores();
+		if ((task = utask_steal(&deques[victim])))
+			return task;
+	}
+	return NULL;
+}
+
+/* The task might free itself, so we're done with it once func runs. */
+static void utask_run(struct utask *task)
+{
+	struct utask_group *grp = task->grp;
+
+	task->func(task);
+	atomic_dec(&grp->nr_pending);
+}
+
+void utask_group_init(struct utask_group *grp)
+{
+	atomic_init(&grp->nr_pending, 0);
+}
+
+void utask_spawn(struct utask_group *grp, struct utask *task,
+                 utask_func_t func)
+{
+	struct utask_deque *deques = get_deques();
+	bool pushed;
+
+	task->func = func;
+	task->grp = grp;
+	atomic_inc(&grp->nr_pending);
+	uth_disable_notifs();
+	pushed = utask_push(&deques[vcore_id()], task);
+	uth_enable_notifs();
+	if (!pushed)
+		utask_run(task);
+}
+
+static void __utask_yield_cb(struct uthread *uth, void *arg)
+{
+	uthread_paused(uth);
+}
+
+/* Runs tasks until grp's are all done.  Once there's nothing left to grab, the
+ * stragglers are running somewhere else.  We spin for a while, then yield, in
+ * case one of them is a uthread that needs our vcore.  We can't yield from
+ * vcore context, so there we just spin. */
+void utask_sync(struct utask_group *grp)
+{
+	struct utask *task;
+	unsigned int spins = 0;
+
+	while (atomic_read(&grp->nr_pending)) {
+		task = utask_grab();
+		if (task) {
+			utask_run(task);
+			spins = 0;
+			continue;
+		}
+		if (in_vcore_context() || (++spins < UTASK_SPINS)) {
+			cpu_relax();
+			continue;
+		}
+		spins = 0;
+		uthread_yield(TRUE, __utask_yield_cb, NULL);
+	}
+}
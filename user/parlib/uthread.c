@@ -46,6 +46,7 @@ static void uthread_init_thread0(struct uthread *uthread)
 	current_uthread = uthread;
 	/* Thread is currently running (it is 'us') */
 	uthread->state = UT_RUNNING;
+	uthread->vcoreid = 0;
 	/* Reset the signal state */
 	uthread->sigstate.mask = 0;
 	__sigemptyset(&uthread->sigstate.pending);
@@ -265,6 +266,8 @@ void __attribute__((noreturn)) uthread_vcore_entry(void)
 	/* Check and see if we wanted ourselves to handle a remote VCPD mbox.  Want
 	 * to do this after we've handled STEALING and DONT_MIGRATE. */
 	try_handle_remote_mbox();
+	/* Signals the kernel posted to us directly; this is their fast path. */
+	handle_vcore_signals(vcoreid);
 	/* Otherwise, go about our usual vcore business (messages, etc). */
 	handle_events(vcoreid);
 	__check_preempt_pending(vcoreid);
@@ -291,6 +294,10 @@ void uthread_init(struct uthread *new_thread, struct uth_thread_attr *attr)
 	 * were interrupted off a core. */
 	new_thread->flags |= UTHREAD_SAVED;
 	new_thread->notif_disabled_depth = 0;
+	/* 2LSs can recycle a uthread without uthread_cleanup(), keeping its TLS,
+	 * if any, so tls_desc can be 0, a TLS, or UTH_TLSDESC_NOTLS. */
+	if (new_thread->tls_desc == UTH_TLSDESC_NOTLS)
+		new_thread->tls_desc = NULL;
 	if (attr && attr->want_tls) {
 		/* Get a TLS.  If we already have one, reallocate/refresh it */
 		if (new_thread->tls_desc)
@@ -307,6 +314,8 @@ void uthread_init(struct uthread *new_thread, struct uth_thread_attr *attr)
 		__ctype_init();
 		end_access_tls_vars();
 	} else {
+		if (new_thread->tls_desc)
+			__uthread_free_tls(new_thread);
 		new_thread->tls_desc = UTH_TLSDESC_NOTLS;
 	}
 }
@@ -568,6 +577,7 @@ void highjack_current_uthread(struct uthread *uthread)
 	uint32_t vcoreid = vcore_id();
 	assert(uthread != current_uthread);
 	current_uthread->state = UT_NOT_RUNNING;
+	uthread->vcoreid = vcoreid;
 	uthread->state = UT_RUNNING;
 	/* Make sure the vcore is tracking the new uthread struct */
 	if (__uthread_has_tls(current_uthread))
@@ -700,6 +710,7 @@ void __attribute__((noreturn)) run_uthread(struct uthread *uthread)
 		set_stack_pointer((void*)vcpd->vcore_stack);
 		vcore_entry();
 	}
+	uthread->vcoreid = vcoreid;
 	uthread->state = UT_RUNNING;
 	/* Save a ptr to the uthread we'll run in the transition context's TLS */
 	current_uthread = uthread;
@@ -1034,6 +1045,10 @@ static void handle_vc_preempt(struct event_msg *ev_msg, unsigned int ev_type,
 	/* If they aren't preempted anymore, just return (optimization). */
 	if (!(atomic_read(&rem_vcpd->flags) & VC_PREEMPTED))
 		return;
+	/* Get their queued work moving before we deal with their uthread, which
+	 * might mean changing to them and never coming back. */
+	if (sched_ops->vcore_preempted)
+		sched_ops->vcore_preempted(rem_vcoreid);
 	/* At this point, we need to try to recover */
 	/* This case handles when the remote core was in vcore context */
 	if (rem_vcpd->notif_disabled) {
@@ -8,12 +8,14 @@
 #include <stdlib.h>
 #include <parlib/arch/atomic.h>
 #include <parlib/waitfreelist.h>
+#include <parlib/vcore.h>
 
 void wfl_init(struct wfl *list)
 {
   list->first.next = NULL;
   list->first.data = NULL;
   list->head = &list->first;
+  memset(list->hints, 0, sizeof(list->hints));
 }
 
 void wfl_destroy(struct wfl *list)
@@ -80,44 +82,90 @@ retry:
 }
 #endif
 
+/* A slot near the one this vcore used last.  Hints are just guesses: any
+ * entry is a fine place to start, since entries stay put until wfl_compact().
+ * NULL means start from the head. */
+static struct wfl_entry **wfl_hint(struct wfl *list)
+{
+  return &list->hints[vcore_id() % WFL_NR_HINTS];
+}
+
+static struct wfl_entry *wfl_alloc_entry(void *data)
+{
+  struct wfl_entry *new_entry;
+
+  if (posix_memalign((void**)&new_entry, ARCH_CL_SIZE,
+                     sizeof(struct wfl_entry)))
+    abort();
+  new_entry->data = data;
+  new_entry->next = NULL;
+  return new_entry;
+}
+
+static bool wfl_try_fill(struct wfl_entry *p, void *data)
+{
+  return p->data == NULL && __sync_bool_compare_and_swap(&p->data, NULL, data);
+}
+
+static void *wfl_try_take(struct wfl_entry *p)
+{
+  return p->data == NULL ? NULL : atomic_swap_ptr(&p->data, 0);
+}
+
+/* Scans from our hint to the tail, then wraps from the head back to the hint.
+ * The hint is always reachable from the head, so the wrap ends. */
 void wfl_insert(struct wfl *list, void *data)
 {
-  struct wfl_entry *p = list->head; // list head is never null
-  while (1) {
-    if (p->data == NULL) {
-      if (__sync_bool_compare_and_swap(&p->data, NULL, data))
-        return;
-    }
+  struct wfl_entry **hint = wfl_hint(list);
+  struct wfl_entry *start = ACCESS_ONCE(*hint) ?: list->head;
+  struct wfl_entry *p = start;
+  struct wfl_entry *tail, *new_entry, *next;
 
+  while (1) {
+    if (wfl_try_fill(p, data))
+      goto found;
     if (p->next == NULL)
       break;
-
     p = p->next;
   }
+  tail = p;
+  for (p = list->head; p != start; p = p->next) {
+    if (wfl_try_fill(p, data))
+      goto found;
+  }
 
-  struct wfl_entry *new_entry = malloc(sizeof(struct wfl_entry));
-  if (new_entry == NULL)
-    abort();
-  new_entry->data = data;
-  new_entry->next = NULL;
+  new_entry = wfl_alloc_entry(data);
 
   wmb();
 
-  struct wfl_entry *next;
+  p = tail;
   while ((next = __sync_val_compare_and_swap(&p->next, NULL, new_entry)))
     p = next;
+  p = new_entry;
+found:
+  *hint = p;
 }
 
 void *wfl_remove(struct wfl *list)
 {
-  for (struct wfl_entry *p = list->head; p != NULL; p = p->next) {
-    if (p->data != NULL) {
-      void *data = atomic_swap_ptr(&p->data, 0);
-      if (data != NULL)
-        return data;
-    }
+  struct wfl_entry **hint = wfl_hint(list);
+  struct wfl_entry *start = ACCESS_ONCE(*hint) ?: list->head;
+  struct wfl_entry *p;
+  void *data;
+
+  for (p = start; p != NULL; p = p->next) {
+    if ((data = wfl_try_take(p)))
+      goto found;
+  }
+  for (p = list->head; p != start; p = p->next) {
+    if ((data = wfl_try_take(p)))
+      goto found;
   }
   return NULL;
+found:
+  /* The slot we just emptied is a good place for our next insert. */
+  *hint = p;
+  return data;
 }
 
 size_t wfl_remove_all(struct wfl *list, void *data)
@@ -129,3 +177,39 @@ size_t wfl_remove_all(struct wfl *list, void *data)
   }
   return n;
 }
+
+/* Packs the data into the front of the list and frees the empty entries after
+ * it.  Returns the number of entries freed.  Like wfl_destroy(), the caller
+ * must make sure no one else is using the list, since other scanners and the
+ * hints may be pointing at the entries we free. */
+size_t wfl_compact(struct wfl *list)
+{
+  struct wfl_entry *dst = list->head;
+  struct wfl_entry *p, *tmp;
+  size_t n = 0;
+
+  for (p = list->head; p != NULL; p = p->next) {
+    if (p->data == NULL)
+      continue;
+    while (dst->data != NULL && dst != p)
+      dst = dst->next;
+    if (dst != p) {
+      dst->data = p->data;
+      p->data = NULL;
+    }
+  }
+  /* Every entry after the last full one is now empty.  The first one holds
+   * data if anything does, and it's embedded, so we never free it. */
+  for (dst = list->head; dst->next != NULL && dst->next->data != NULL; )
+    dst = dst->next;
+  p = dst->next;
+  dst->next = NULL;
+  while (p != NULL) {
+    tmp = p;
+    p = p->next;
+    free(tmp);
+    n++;
+  }
+  memset(list->hints, 0, sizeof(list->hints));
+  return n;
+}
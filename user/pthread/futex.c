@@ -7,51 +7,75 @@
 #include <stdio.h>
 #include <errno.h>
 #include <parlib/slab.h>
-#include <parlib/mcs.h>
+#include <parlib/spinlock.h>
+#include <parlib/arch/arch.h>
 #include <benchutil/alarm.h>
 
 static inline int futex_wake(int *uaddr, int count);
 static inline int futex_wait(int *uaddr, int val, uint64_t ms_timeout);
 static void *timer_thread(void *arg);
 
+// Waiters hash by futex address into buckets, each with its own lock, so
+// wakes and timeouts only look at (and contend with) waiters on the same
+// bucket.
+#define FUTEX_HASH_BITS 8
+#define NR_FUTEX_BUCKETS (1 << FUTEX_HASH_BITS)
+
+struct futex_bucket;
+
 struct futex_element {
   TAILQ_ENTRY(futex_element) link;
   pthread_t pthread;
   int *uaddr;
+  struct futex_bucket *bucket;
   uint64_t us_timeout;
   struct alarm_waiter awaiter;
   bool timedout;
+  bool queued;    // on bucket->queue, protected by bucket->lock
 };
 TAILQ_HEAD(futex_queue, futex_element);
 
-struct futex_data {
-  struct mcs_pdr_lock lock;
+struct futex_bucket {
+  struct spin_pdr_lock lock;
   struct futex_queue queue;
-};
-static struct futex_data __futex;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct futex_bucket __futex[NR_FUTEX_BUCKETS];
 
 static inline void futex_init()
 {
-  mcs_pdr_init(&__futex.lock);
-  TAILQ_INIT(&__futex.queue);
+  for (int i = 0; i < NR_FUTEX_BUCKETS; i++) {
+    spin_pdr_init(&__futex[i].lock);
+    TAILQ_INIT(&__futex[i].queue);
+  }
+}
+
+static inline struct futex_bucket *futex_bucket(int *uaddr)
+{
+  // Fibonacci hashing; the low bits of an int's address are always 0.
+  uint32_t hash = ((uintptr_t)uaddr >> 2) * 0x9e3779b9;
+
+  return &__futex[hash >> (32 - FUTEX_HASH_BITS)];
 }
 
 static void __futex_timeout(struct alarm_waiter *awaiter) {
-  struct futex_element *__e = NULL;
   struct futex_element *e = (struct futex_element*)awaiter->data;
+  struct futex_bucket *b = e->bucket;
+  bool removed = false;
   //printf("timeout fired: %p\n", e->uaddr);
 
-  // Atomically remove the timed-out element from the futex queue if we won the
+  // Atomically remove the timed-out element from its bucket if we won the
   // race against actually completing.
-  mcs_pdr_lock(&__futex.lock);
-  TAILQ_FOREACH(__e, &__futex.queue, link)
-    if (__e == e) break;
-  if (__e != NULL)
-    TAILQ_REMOVE(&__futex.queue, e, link);
-  mcs_pdr_unlock(&__futex.lock);
+  spin_pdr_lock(&b->lock);
+  if (e->queued) {
+    TAILQ_REMOVE(&b->queue, e, link);
+    e->queued = false;
+    removed = true;
+  }
+  spin_pdr_unlock(&b->lock);
 
   // If we removed it, restart it outside the lock
-  if (__e != NULL) {
+  if (removed) {
     e->timedout = true;
     //printf("timeout: %p\n", e->uaddr);
     uthread_runnable((struct uthread*)e->pthread);
@@ -72,8 +96,9 @@ static void __futex_block(struct uthread *uthread, void *arg) {
   e->pthread = pthread;
   e->timedout = false;
 
-  // Insert the futex element into the queue
-  TAILQ_INSERT_TAIL(&__futex.queue, e, link);
+  // Insert the futex element into its bucket
+  TAILQ_INSERT_TAIL(&e->bucket->queue, e, link);
+  e->queued = true;
 
   // Set an alarm for the futex timeout if applicable
   if(e->us_timeout != (uint64_t)-1) {
@@ -88,20 +113,23 @@ static void __futex_block(struct uthread *uthread, void *arg) {
   __pthread_generic_yield(pthread);
   pthread->state = PTH_BLK_MUTEX;
 
-  // Unlock the pdr_lock 
-  mcs_pdr_unlock(&__futex.lock);
+  // Unlock the pdr_lock
+  spin_pdr_unlock(&e->bucket->lock);
 }
 
 static inline int futex_wait(int *uaddr, int val, uint64_t us_timeout)
 {
+  struct futex_bucket *b = futex_bucket(uaddr);
+
   // Atomically do the following...
-  mcs_pdr_lock(&__futex.lock);
+  spin_pdr_lock(&b->lock);
   // If the value of *uaddr matches val
   if(*uaddr == val) {
     //printf("wait: %p, %d\n", uaddr, us_timeout);
     // Create a new futex element and initialize it.
     struct futex_element e;
     e.uaddr = uaddr;
+    e.bucket = b;
     e.us_timeout = us_timeout;
     // Yield the uthread...
     // We set the remaining properties of the futex element, set the timeout
@@ -128,7 +156,7 @@ static inline int futex_wait(int *uaddr, int val, uint64_t us_timeout)
       return -1;
     }
   } else {
-      mcs_pdr_unlock(&__futex.lock);
+      spin_pdr_unlock(&b->lock);
   }
   return 0;
 }
@@ -136,18 +164,20 @@ static inline int futex_wait(int *uaddr, int val, uint64_t us_timeout)
 static inline int futex_wake(int *uaddr, int count)
 {
   int max = count;
+  struct futex_bucket *b = futex_bucket(uaddr);
   struct futex_element *e,*n = NULL;
   struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
 
   // Atomically grab all relevant futex blockers
-  // from the global futex queue
-  mcs_pdr_lock(&__futex.lock);
-  e = TAILQ_FIRST(&__futex.queue);
+  // from the futex's bucket
+  spin_pdr_lock(&b->lock);
+  e = TAILQ_FIRST(&b->queue);
   while(e != NULL) {
     if(count > 0) {
       n = TAILQ_NEXT(e, link);
       if(e->uaddr == uaddr) {
-        TAILQ_REMOVE(&__futex.queue, e, link);
+        TAILQ_REMOVE(&b->queue, e, link);
+        e->queued = false;
         TAILQ_INSERT_TAIL(&q, e, link);
         count--;
       }
@@ -155,7 +185,7 @@ static inline int futex_wake(int *uaddr, int count)
     }
     else break;
   }
-  mcs_pdr_unlock(&__futex.lock);
+  spin_pdr_unlock(&b->lock);
 
   // Unblock them outside the lock
   e = TAILQ_FIRST(&q);
@@ -5,15 +5,11 @@
 #include <pthread.h>
 #include <benchutil/pvcalarm.h>
 
-void pvcalarm_callback(void)
-{
-	if (current_uthread)
-		pthread_kill((pthread_t)current_uthread, SIGPROF);
-}
-
+/* The kernel posts SIGPROF straight to each vcore's current uthread.  See
+ * enable_pvcalarm_signals(). */
 void enable_profalarm(uint64_t usecs)
 {
-	enable_pvcalarms(PVCALARM_PROF, usecs, pvcalarm_callback);
+	enable_pvcalarm_signals(usecs, SIGPROF);
 }
 
 void disable_profalarm(void)
@@ -18,21 +18,45 @@
 #include <parlib/signal.h>
 #include <parlib/arch/trap.h>
 
-struct pthread_queue ready_queue = TAILQ_HEAD_INITIALIZER(ready_queue);
-struct pthread_queue active_queue = TAILQ_HEAD_INITIALIZER(active_queue);
-struct mcs_pdr_lock queue_lock;
-int threads_ready = 0;
-int threads_active = 0;
+/* Per-vcore run queues.  A vcore runs threads from the head of its own queue.
+ * When that is empty, it steals half of a random victim's queue from the tail,
+ * and before giving up, it checks every queue.  Runnable threads go back to the
+ * vcore they last ran on, if that vcore is still up, so they find their cache
+ * warm.  Each queue has its own lock; no one holds two at once.
+ *
+ * When a vcore is about to be preempted, it hands its queue to the others.  If
+ * it gets preempted anyway, whoever recovers its uthread takes its queue too.
+ * nr_ready is read without the lock, as a hint. */
+struct pth_runq {
+	struct spin_pdr_lock		lock;
+	struct pthread_queue		ready;
+	unsigned int				nr_ready;
+	uint32_t					rand;		/* only touched by the owner */
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+#define PTH_STEAL_TRIES			4
+
+static struct pth_runq *runqs;
+atomic_t threads_ready;
+atomic_t threads_active;
 atomic_t threads_total;
 bool need_tls = TRUE;
 
+/* Pool of dead pthreads, still holding their stacks and TLS.  Exiting (for
+ * detached threads) or joining puts them here, and pthread_create() takes them
+ * back, saving an mmap/munmap and a TLS allocation per thread.  Protected by
+ * pool_lock, which we grab from both uthread and vcore context. */
+static struct pthread_queue thread_pool = TAILQ_HEAD_INITIALIZER(thread_pool);
+static struct spin_pdr_lock pool_lock = SPINPDR_INITIALIZER;
+static unsigned int nr_pooled;
+static size_t pool_max = PTHREAD_POOL_SIZE;
+
 /* Array of per-vcore structs to manage waiting on syscalls and handling
  * overflow.  Init'd in pth_init(). */
 struct sysc_mgmt *sysc_mgmt = 0;
 
 /* Helper / local functions */
 static int get_next_pid(void);
-static inline void spin_to_sleep(unsigned int spins, unsigned int *spun);
 static inline void pthread_exit_no_cleanup(void *ret);
 
 /* Pthread 2LS operations */
@@ -43,6 +67,8 @@ static void pth_thread_blockon_sysc(struct uthread *uthread, void *sysc);
 static void pth_thread_has_blocked(struct uthread *uthread, int flags);
 static void pth_thread_refl_fault(struct uthread *uth,
                                   struct user_context *ctx);
+static void pth_preempt_pending(void);
+static void pth_vcore_preempted(uint32_t vcoreid);
 
 /* Event Handlers */
 static void pth_handle_syscall(struct event_msg *ev_msg, unsigned int ev_type,
@@ -55,13 +81,168 @@ struct schedule_ops pthread_sched_ops = {
 	.thread_blockon_sysc = pth_thread_blockon_sysc,
 	.thread_has_blocked = pth_thread_has_blocked,
 	.thread_refl_fault = pth_thread_refl_fault,
+	.preempt_pending = pth_preempt_pending,
+	.vcore_preempted = pth_vcore_preempted,
 };
 
 /* Static helpers */
 static void __pthread_free_stack(struct pthread_tcb *pt);
 static int __pthread_allocate_stack(struct pthread_tcb *pt);
+static void __pthread_release(struct pthread_tcb *pt);
 static void __pth_yield_cb(struct uthread *uthread, void *junk);
 
+static void runq_push(uint32_t vcoreid, struct pthread_tcb *pthread)
+{
+	struct pth_runq *rq = &runqs[vcoreid];
+
+	spin_pdr_lock(&rq->lock);
+	TAILQ_INSERT_TAIL(&rq->ready, pthread, tq_next);
+	rq->nr_ready++;
+	spin_pdr_unlock(&rq->lock);
+}
+
+/* Moves everything on src to the tail of vcoreid's queue. */
+static void runq_push_all(uint32_t vcoreid, struct pthread_queue *src,
+                          unsigned int nr)
+{
+	struct pth_runq *rq = &runqs[vcoreid];
+
+	if (!nr)
+		return;
+	spin_pdr_lock(&rq->lock);
+	TAILQ_CONCAT(&rq->ready, src, tq_next);
+	rq->nr_ready += nr;
+	spin_pdr_unlock(&rq->lock);
+}
+
+/* Empties vcoreid's queue into dst.  Returns how many threads it took. */
+static unsigned int runq_take_all(uint32_t vcoreid, struct pthread_queue *dst)
+{
+	struct pth_runq *rq = &runqs[vcoreid];
+	unsigned int nr;
+
+	if (!ACCESS_ONCE(rq->nr_ready))
+		return 0;
+	spin_pdr_lock(&rq->lock);
+	TAILQ_CONCAT(dst, &rq->ready, tq_next);
+	nr = rq->nr_ready;
+	rq->nr_ready = 0;
+	spin_pdr_unlock(&rq->lock);
+	return nr;
+}
+
+static struct pthread_tcb *runq_pop(uint32_t vcoreid)
+{
+	struct pth_runq *rq = &runqs[vcoreid];
+	struct pthread_tcb *pthread;
+
+	if (!ACCESS_ONCE(rq->nr_ready))
+		return NULL;
+	spin_pdr_lock(&rq->lock);
+	pthread = TAILQ_FIRST(&rq->ready);
+	if (pthread) {
+		TAILQ_REMOVE(&rq->ready, pthread, tq_next);
+		rq->nr_ready--;
+	}
+	spin_pdr_unlock(&rq->lock);
+	return pthread;
+}
+
+/* Takes half of victim's threads, from the tail, returning one and putting the
+ * rest on our queue.  With try, we give up if victim's lock is busy. */
+static struct pthread_tcb *runq_steal(uint32_t vcoreid, uint32_t victim,
+                                      bool try)
+{
+	struct pth_runq *rq = &runqs[victim];
+	struct pthread_queue stolen = TAILQ_HEAD_INITIALIZER(stolen);
+	struct pthread_tcb *pthread, *ret = NULL;
+	unsigned int nr;
+
+	if (!ACCESS_ONCE(rq->nr_ready))
+		return NULL;
+	if (try) {
+		if (!spin_pdr_trylock(&rq->lock))
+			return NULL;
+	} else {
+		spin_pdr_lock(&rq->lock);
+	}
+	nr = (rq->nr_ready + 1) / 2;
+	for (int i = 0; i < nr; i++) {
+		pthread = TAILQ_LAST(&rq->ready, pthread_queue);
+		TAILQ_REMOVE(&rq->ready, pthread, tq_next);
+		TAILQ_INSERT_HEAD(&stolen, pthread, tq_next);
+	}
+	rq->nr_ready -= nr;
+	spin_pdr_unlock(&rq->lock);
+	if (nr) {
+		ret = TAILQ_FIRST(&stolen);
+		TAILQ_REMOVE(&stolen, ret, tq_next);
+		runq_push_all(vcoreid, &stolen, nr - 1);
+	}
+	return ret;
+}
+
+/* Tries a few random victims, then all of them in order. */
+static struct pthread_tcb *pth_steal(uint32_t vcoreid)
+{
+	struct pth_runq *rq = &runqs[vcoreid];
+	struct pthread_tcb *pthread;
+	uint32_t nr_vcores = max_vcores();
+	uint32_t victim;
+
+	if (nr_vcores == 1)
+		return NULL;
+	for (int i = 0; i < PTH_STEAL_TRIES; i++) {
+		/* xorshift; good enough to spread the thieves out */
+		rq->rand ^= rq->rand << 13;
+		rq->rand ^= rq->rand >> 17;
+		rq->rand ^= rq->rand << 5;
+		victim = rq->rand % nr_vcores;
+		if (victim == vcoreid)
+			continue;
+		pthread = runq_steal(vcoreid, victim, TRUE);
+		if (pthread)
+			return pthread;
+	}
+	for (victim = 0; victim < nr_vcores; victim++) {
+		if (victim == vcoreid)
+			continue;
+		pthread = runq_steal(vcoreid, victim, FALSE);
+		if (pthread)
+			return pthread;
+	}
+	return NULL;
+}
+
+/* Empties vcoreid's queue and splits it evenly over the vcores that are up,
+ * one chunk and one lock grab per target. */
+static void runq_spread(uint32_t vcoreid)
+{
+	struct pthread_queue orphans = TAILQ_HEAD_INITIALIZER(orphans);
+	struct pthread_queue chunk = TAILQ_HEAD_INITIALIZER(chunk);
+	struct pthread_tcb *pthread;
+	unsigned int nr, nr_up = 0, per_target, nr_chunk;
+	uint32_t target = vcoreid;
+
+	nr = runq_take_all(vcoreid, &orphans);
+	if (!nr)
+		return;
+	for (int i = 0; i < max_vcores(); i++)
+		nr_up += (i != vcoreid) && vcore_is_up(i);
+	per_target = DIV_ROUND_UP(nr, MAX(nr_up, 1));
+	while (nr) {
+		nr_chunk = MIN(nr, per_target);
+		for (int i = 0; i < nr_chunk; i++) {
+			pthread = TAILQ_FIRST(&orphans);
+			TAILQ_REMOVE(&orphans, pthread, tq_next);
+			TAILQ_INSERT_TAIL(&chunk, pthread, tq_next);
+		}
+		target = vcore_next_up(target);
+		runq_push_all(target, &chunk, nr_chunk);
+		nr -= nr_chunk;
+	}
+}
+
 /* Called from vcore entry.  Options usually include restarting whoever was
  * running there before or running a new thread.  Events are handled out of
  * event.c (table of function pointers, stuff like that). */
@@ -84,16 +265,15 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 	do {
 		handle_events(vcoreid);
 		__check_preempt_pending(vcoreid);
-		mcs_pdr_lock(&queue_lock);
-		new_thread = TAILQ_FIRST(&ready_queue);
+		new_thread = runq_pop(vcoreid);
+		if (!new_thread)
+			new_thread = pth_steal(vcoreid);
 		if (new_thread) {
-			TAILQ_REMOVE(&ready_queue, new_thread, tq_next);
 			assert(new_thread->state == PTH_RUNNABLE);
 			new_thread->state = PTH_RUNNING;
-			TAILQ_INSERT_TAIL(&active_queue, new_thread, tq_next);
-			threads_active++;
-			threads_ready--;
-			mcs_pdr_unlock(&queue_lock);
+			new_thread->last_vcoreid = vcoreid;
+			atomic_inc(&threads_active);
+			atomic_dec(&threads_ready);
 			/* If you see what looks like the same uthread running in multiple
 			 * places, your list might be jacked up.  Turn this on. */
 			printd("[P] got uthread %08p on vc %d state %08p flags %08p\n",
@@ -102,7 +282,6 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 			       ((struct uthread*)new_thread)->flags);
 			break;
 		}
-		mcs_pdr_unlock(&queue_lock);
 		/* no new thread, try to yield */
 		printd("[P] No threads, vcore %d is yielding\n", vcore_id());
 		/* TODO: you can imagine having something smarter here, like spin for a
@@ -133,30 +312,38 @@ static void pth_thread_runnable(struct uthread *uthread)
 	 * the first place (coupling these things together).  On the yield path, the
 	 * 2LS was involved and was able to set the state.  Now when we get the
 	 * thread back, we can take a look. */
+	uint32_t vcoreid;
+
 	printd("pthread %08p runnable, state was %d\n", pthread, pthread->state);
 	switch (pthread->state) {
 		case (PTH_CREATED):
+			vcoreid = vcore_id();
+			break;
+		case (PTH_BLK_PAUSED):
+			/* Its old vcore is going away */
+			vcoreid = vcore_next_up(pthread->last_vcoreid);
+			break;
 		case (PTH_BLK_YIELDING):
 		case (PTH_BLK_JOINING):
 		case (PTH_BLK_SYSC):
-		case (PTH_BLK_PAUSED):
 		case (PTH_BLK_MUTEX):
-			/* can do whatever for each of these cases */
+			/* Back to where it last ran, if that vcore is still around */
+			vcoreid = pthread->last_vcoreid;
+			if (!vcore_is_up(vcoreid))
+				vcoreid = vcore_id();
 			break;
 		default:
 			panic("Odd state %d for pthread %08p\n", pthread->state, pthread);
 	}
 	pthread->state = PTH_RUNNABLE;
-	/* Insert the newly created thread into the ready queue of threads.
-	 * It will be removed from this queue later when vcore_entry() comes up */
-	mcs_pdr_lock(&queue_lock);
+	/* Insert the thread into a ready queue.  It will be removed from this queue
+	 * later when vcore_entry() comes up */
 	/* Again, GIANT WARNING: if you change this, change batch wakeup code */
-	TAILQ_INSERT_TAIL(&ready_queue, pthread, tq_next);
-	threads_ready++;
-	mcs_pdr_unlock(&queue_lock);
+	runq_push(vcoreid, pthread);
+	atomic_inc(&threads_ready);
 	/* Smarter schedulers should look at the num_vcores() and how much work is
 	 * going on to make a decision about how many vcores to request. */
-	vcore_request_more(threads_ready);
+	vcore_request_more(atomic_read(&threads_ready));
 }
 
 /* For some reason not under its control, the uthread stopped running (compared
@@ -172,7 +359,15 @@ static void pth_thread_runnable(struct uthread *uthread)
 static void pth_thread_paused(struct uthread *uthread)
 {
 	struct pthread_tcb *pthread = (struct pthread_tcb*)uthread;
-
+	struct pthread_queue orphans = TAILQ_HEAD_INITIALIZER(orphans);
+	unsigned int nr;
+
+	/* If we're recovering another vcore's uthread, that vcore was preempted.
+	 * Its queue would sit there until someone stole it, so take it now. */
+	if (pthread->last_vcoreid != vcore_id()) {
+		nr = runq_take_all(pthread->last_vcoreid, &orphans);
+		runq_push_all(vcore_id(), &orphans, nr);
+	}
 	__pthread_generic_yield(pthread);
 	/* communicate to pth_thread_runnable */
 	pthread->state = PTH_BLK_PAUSED;
@@ -182,6 +377,21 @@ static void pth_thread_paused(struct uthread *uthread)
 	pth_thread_runnable(uthread);
 }
 
+/* Our vcore is about to be preempted.  Spread our queue over the vcores that
+ * are still up, so those threads don't wait for us to come back. */
+static void pth_preempt_pending(void)
+{
+	runq_spread(vcore_id());
+}
+
+/* vcoreid was preempted, maybe without warning, or while it had no uthread for
+ * anyone to steal.  Either way, no one would run its queue until a thief
+ * happened by, so send it to the vcores that are up. */
+static void pth_vcore_preempted(uint32_t vcoreid)
+{
+	runq_spread(vcoreid);
+}
+
 /* Restarts a uthread hanging off a syscall.  For the simple pthread case, we
  * just make it runnable and let the main scheduler code handle it. */
 static void restart_thread(struct syscall *sysc)
@@ -350,6 +560,7 @@ int pthread_attr_init(pthread_attr_t *a)
 	a->sched_priority = 0;
 	a->sched_policy = 0;
 	a->sched_inherit = PTHREAD_INHERIT_SCHED;
+	a->poolsize = 0;
   	return 0;
 }
 
@@ -380,6 +591,91 @@ static int __pthread_allocate_stack(struct pthread_tcb *pt)
 	return 0;
 }
 
+/* Takes a dead pthread with a stack of stacksize from the pool, if there is
+ * one.  Only the stack and TLS survive; everything else is zeroed. */
+static struct pthread_tcb *__pthread_pool_get(size_t stacksize)
+{
+	struct pthread_tcb *pt;
+	void *stacktop, *tls_desc;
+
+	if (!ACCESS_ONCE(nr_pooled))
+		return NULL;
+	spin_pdr_lock(&pool_lock);
+	TAILQ_FOREACH(pt, &thread_pool, tq_next) {
+		if (pt->stacksize == stacksize)
+			break;
+	}
+	if (pt) {
+		TAILQ_REMOVE(&thread_pool, pt, tq_next);
+		nr_pooled--;
+	}
+	spin_pdr_unlock(&pool_lock);
+	if (!pt)
+		return NULL;
+	stacktop = pt->stacktop;
+	tls_desc = pt->uthread.tls_desc;
+	memset(pt, 0, sizeof(struct pthread_tcb));
+	pt->stacksize = stacksize;
+	pt->stacktop = stacktop;
+	pt->uthread.tls_desc = tls_desc;
+	return pt;
+}
+
+/* We're done with pt, which has exited and won't be joined.  Pool it, or free
+ * it, its stack, and its TLS if the pool is full.  Thread0's stack and TLS
+ * aren't ours to reuse. */
+static void __pthread_release(struct pthread_tcb *pt)
+{
+	if (!(pt->uthread.flags & UTHREAD_IS_THREAD0)) {
+		spin_pdr_lock(&pool_lock);
+		if (nr_pooled < pool_max) {
+			TAILQ_INSERT_HEAD(&thread_pool, pt, tq_next);
+			nr_pooled++;
+			spin_pdr_unlock(&pool_lock);
+			return;
+		}
+		spin_pdr_unlock(&pool_lock);
+	}
+	uthread_cleanup((struct uthread*)pt);
+	__pthread_free_stack(pt);
+	free(pt);
+}
+
+/* Shrinks the pool, if needed, to the new max. */
+static void __pthread_pool_resize(size_t max)
+{
+	struct pthread_queue evicted = TAILQ_HEAD_INITIALIZER(evicted);
+	struct pthread_tcb *pt;
+
+	spin_pdr_lock(&pool_lock);
+	pool_max = max;
+	while (nr_pooled > pool_max) {
+		pt = TAILQ_LAST(&thread_pool, pthread_queue);
+		TAILQ_REMOVE(&thread_pool, pt, tq_next);
+		TAILQ_INSERT_HEAD(&evicted, pt, tq_next);
+		nr_pooled--;
+	}
+	spin_pdr_unlock(&pool_lock);
+	while ((pt = TAILQ_FIRST(&evicted))) {
+		TAILQ_REMOVE(&evicted, pt, tq_next);
+		uthread_cleanup((struct uthread*)pt);
+		__pthread_free_stack(pt);
+		free(pt);
+	}
+}
+
+int pthread_attr_setpoolsize_np(pthread_attr_t *attr, size_t poolsize)
+{
+	attr->poolsize = poolsize;
+	return 0;
+}
+
+int pthread_attr_getpoolsize_np(const pthread_attr_t *attr, size_t *poolsize)
+{
+	*poolsize = attr->poolsize;
+	return 0;
+}
+
 // Warning, this will reuse numbers eventually
 static int get_next_pid(void)
 {
@@ -442,7 +738,17 @@ void __attribute__((constructor)) pthread_lib_init(void)
 	init_once_racy(return);
 	uthread_lib_init();
 
-	mcs_pdr_init(&queue_lock);
+	ret = posix_memalign((void**)&runqs, __alignof__(struct pth_runq),
+	                     sizeof(struct pth_runq) * max_vcores());
+	assert(!ret);
+	for (int i = 0; i < max_vcores(); i++) {
+		spin_pdr_init(&runqs[i].lock);
+		TAILQ_INIT(&runqs[i].ready);
+		runqs[i].nr_ready = 0;
+		runqs[i].rand = i + 1;	/* xorshift needs a non-zero seed */
+	}
+	atomic_init(&threads_ready, 0);
+	atomic_init(&threads_active, 0);
 	/* Create a pthread_tcb for the main thread */
 	ret = posix_memalign((void**)&t, __alignof__(struct pthread_tcb),
 	                     sizeof(struct pthread_tcb));
@@ -459,11 +765,8 @@ void __attribute__((constructor)) pthread_lib_init(void)
 	t->sched_policy = SCHED_FIFO;
 	t->sched_priority = 0;
 	SLIST_INIT(&t->cr_stack);
-	/* Put the new pthread (thread0) on the active queue */
-	mcs_pdr_lock(&queue_lock);
-	threads_active++;
-	TAILQ_INSERT_TAIL(&active_queue, t, tq_next);
-	mcs_pdr_unlock(&queue_lock);
+	/* thread0 is running */
+	atomic_inc(&threads_active);
 	/* Tell the kernel where and how we want to receive events.  This is just an
 	 * example of what to do to have a notification turned on.  We're turning on
 	 * USER_IPIs, posting events to vcore 0's vcpd, and telling the kernel to
@@ -540,6 +843,7 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	struct uth_thread_attr uth_attr = {0};
 	struct pthread_tcb *parent;
 	struct pthread_tcb *pthread;
+	size_t stacksize;
 	int ret;
 
 	/* For now, unconditionally become an mcp when creating a pthread (if not
@@ -548,11 +852,21 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	pthread_mcp_init();
 
 	parent = (struct pthread_tcb*)current_uthread;
-	ret = posix_memalign((void**)&pthread, __alignof__(struct pthread_tcb),
-	                     sizeof(struct pthread_tcb));
-	assert(!ret);
-	memset(pthread, 0, sizeof(struct pthread_tcb));	/* aggressively 0 for bugs*/
-	pthread->stacksize = PTHREAD_STACK_SIZE;	/* default */
+	if (attr && attr->poolsize)
+		__pthread_pool_resize(attr->poolsize);
+	/* don't set a 0 stacksize */
+	stacksize = attr && attr->stacksize ? attr->stacksize : PTHREAD_STACK_SIZE;
+	pthread = __pthread_pool_get(stacksize);
+	if (!pthread) {
+		ret = posix_memalign((void**)&pthread, __alignof__(struct pthread_tcb),
+		                     sizeof(struct pthread_tcb));
+		assert(!ret);
+		memset(pthread, 0, sizeof(struct pthread_tcb));	/* aggressively 0 */
+		pthread->stacksize = stacksize;
+		/* allocate a stack */
+		if (__pthread_allocate_stack(pthread))
+			printf("We're fucked\n");
+	}
 	pthread->state = PTH_CREATED;
 	pthread->id = get_next_pid();
 	pthread->detached = FALSE;				/* default */
@@ -563,8 +877,6 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	SLIST_INIT(&pthread->cr_stack);
 	/* Respect the attributes */
 	if (attr) {
-		if (attr->stacksize)					/* don't set a 0 stacksize */
-			pthread->stacksize = attr->stacksize;
 		if (attr->detachstate == PTHREAD_CREATE_DETACHED)
 			pthread->detached = TRUE;
 		if (attr->sched_inherit == PTHREAD_EXPLICIT_SCHED) {
@@ -572,9 +884,6 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 			pthread->sched_priority = attr->sched_priority;
 		}
 	}
-	/* allocate a stack */
-	if (__pthread_allocate_stack(pthread))
-		printf("We're fucked\n");
 	/* Set the u_tf to start up in __pthread_run, which will call the real
 	 * start_routine and pass it the arg.  Note those aren't set until later in
 	 * pthread_create(). */
@@ -600,14 +909,11 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 }
 
 /* Helper that all pthread-controlled yield paths call.  Just does some
- * accounting.  This is another example of how the much-loathed (and loved)
- * active queue is keeping us honest.  Need to export for sem and friends. */
+ * accounting.  We used to keep a global active queue here, but every vcore
+ * fought over its lock.  Need to export for sem and friends. */
 void __pthread_generic_yield(struct pthread_tcb *pthread)
 {
-	mcs_pdr_lock(&queue_lock);
-	threads_active--;
-	TAILQ_REMOVE(&active_queue, pthread, tq_next);
-	mcs_pdr_unlock(&queue_lock);
+	atomic_dec(&threads_active);
 }
 
 /* Callback/bottom half of join, called from __uthread_yield (vcore context).
@@ -653,7 +959,7 @@ int pthread_join(struct pthread_tcb *join_target, void **retval)
 	}
 	if (retval)
 		*retval = join_target->retval;
-	free(join_target);
+	__pthread_release(join_target);
 	return 0;
 }
 
@@ -671,13 +977,11 @@ static void __pth_exit_cb(struct uthread *uthread, void *junk)
 	__pthread_generic_yield(pthread);
 	/* Catch some bugs */
 	pthread->state = PTH_EXITING;
-	/* Destroy the pthread */
-	uthread_cleanup(uthread);
-	/* Cleanup, mirroring pthread_create() */
-	__pthread_free_stack(pthread);
+	/* The stack and TLS stay with the pthread until we release it, which pools
+	 * it or frees everything, mirroring pthread_create(). */
 	/* TODO: race on detach state (see join) */
 	if (pthread->detached) {
-		free(pthread);
+		__pthread_release(pthread);
 	} else {
 		/* See if someone is joining on us.  If not, we're done (and the
 		 * joiner will wake itself when it saw us there instead of 0). */
@@ -796,6 +1100,8 @@ int pthread_mutex_init(pthread_mutex_t* m, const pthread_mutexattr_t* attr)
 {
   m->attr = attr;
   atomic_init(&m->lock, 0);
+  m->owner = NULL;
+  m->spin.avg = 0;
   return 0;
 }
 
@@ -814,27 +1120,30 @@ int pthread_mutex_init(pthread_mutex_t* m, const pthread_mutexattr_t* attr)
 /* TODO: consider making this a 2LS op */
 static inline bool safe_to_spin(unsigned int *state)
 {
-	return !threads_ready;
-}
-
-/* Set *spun to 0 when calling this the first time.  It will yield after 'spins'
- * calls.  Use this for adaptive mutexes and such. */
-static inline void spin_to_sleep(unsigned int spins, unsigned int *spun)
-{
-	if ((*spun)++ == spins) {
-		pthread_yield();
-		*spun = 0;
-	}
+	return !atomic_read(&threads_ready);
 }
 
+/* Spins while the owner is running, up to the mutex's learned limit, then
+ * yields so the owner (or anyone else) can run. */
 int pthread_mutex_lock(pthread_mutex_t* m)
 {
-	unsigned int spinner = 0;
-	while(pthread_mutex_trylock(m))
-		while(*(volatile size_t*)&m->lock) {
+	unsigned int limit, spun;
+
+	while(pthread_mutex_trylock(m)) {
+		limit = uth_spin_limit(&m->spin);
+		for (spun = 0; *(volatile size_t*)&m->lock; spun++) {
+			if ((spun == limit) ||
+			    !uth_owner_is_running(ACCESS_ONCE(m->owner))) {
+				uth_spin_update(&m->spin, spun);
+				pthread_yield();
+				limit = uth_spin_limit(&m->spin);
+				spun = 0;
+				continue;
+			}
 			cpu_relax();
-			spin_to_sleep(PTHREAD_MUTEX_SPINS, &spinner);
 		}
+		uth_spin_update(&m->spin, spun);
+	}
 	/* normally we'd need a wmb() and a wrmb() after locking, but the
 	 * atomic_swap handles the CPU mb(), so just a cmb() is necessary. */
 	cmb();
@@ -843,7 +1152,12 @@ int pthread_mutex_lock(pthread_mutex_t* m)
 
 int pthread_mutex_trylock(pthread_mutex_t* m)
 {
-  return atomic_swap(&m->lock, 1) == 0 ? 0 : EBUSY;
+  if (atomic_swap(&m->lock, 1))
+    return EBUSY;
+  /* Spinners might see the old owner for a moment.  Unlock leaves it alone:
+   * clearing it would make them give up just before the lock frees up. */
+  m->owner = current_uthread;
+  return 0;
 }
 
 int pthread_mutex_unlock(pthread_mutex_t* m)
@@ -891,19 +1205,20 @@ static void wake_slist(struct pthread_list *to_wake)
 {
 	unsigned int nr_woken = 0;	/* assuming less than 4 bil threads */
 	struct pthread_tcb *pthread_i, *pth_temp;
-	/* Amortize the lock grabbing over all restartees */
-	mcs_pdr_lock(&queue_lock);
+	struct pthread_queue woken = TAILQ_HEAD_INITIALIZER(woken);
+
 	/* Do the work of pth_thread_runnable().  We're in uth context here, but I
 	 * think it's okay.  When we need to (when locking) we drop into VC ctx, as
-	 * far as the kernel and other cores are concerned. */
+	 * far as the kernel and other cores are concerned.  They all go on our
+	 * queue, amortizing the lock grabbing; idle vcores will steal them. */
 	SLIST_FOREACH_SAFE(pthread_i, to_wake, sl_next, pth_temp) {
 		pthread_i->state = PTH_RUNNABLE;
 		nr_woken++;
-		TAILQ_INSERT_TAIL(&ready_queue, pthread_i, tq_next);
+		TAILQ_INSERT_TAIL(&woken, pthread_i, tq_next);
 	}
-	threads_ready += nr_woken;
-	mcs_pdr_unlock(&queue_lock);
-	vcore_request_more(threads_ready);
+	runq_push_all(vcore_id(), &woken, nr_woken);
+	atomic_fetch_and_add(&threads_ready, nr_woken);
+	vcore_request_more(atomic_read(&threads_ready));
 }
 
 int pthread_cond_broadcast(pthread_cond_t *c)
@@ -1023,12 +1338,60 @@ int pthread_once(pthread_once_t* once_control, void (*init_routine)(void))
   return 0;
 }
 
+/* Arrivals count up in a combining tree instead of on one shared counter.
+ * Each node expects quota arrivals: a leaf gets its share of the threads, and
+ * an inner node gets one arrival per child.  Whoever fills a node moves up and
+ * arrives at its parent, and whoever fills the root is the last thread in.
+ * Threads don't have a fixed spot in the tree, so if a thread's leaf is full,
+ * it tries the next one.  There are exactly as many arrivals as leaf slots, so
+ * everyone finds one.  Departure is still the single sense flag, which the
+ * waiters only read. */
+struct pth_barrier_node {
+	atomic_t					count;
+	int							quota;
+	int							parent;	/* -1 for the root */
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 int pthread_barrier_init(pthread_barrier_t *b,
                          const pthread_barrierattr_t *a, int count)
 {
+	struct pth_barrier_node *node;
+	int lvl_start, lvl_sz, nr_nodes;
+
+	if (count <= 0)
+		return EINVAL;
+	b->nr_leaves = DIV_ROUND_UP(count, PTHREAD_BARRIER_FANIN);
+	nr_nodes = 0;
+	for (lvl_sz = b->nr_leaves; lvl_sz > 1;
+	     lvl_sz = DIV_ROUND_UP(lvl_sz, PTHREAD_BARRIER_FANIN))
+		nr_nodes += lvl_sz;
+	nr_nodes++;
+	if (posix_memalign((void**)&b->nodes, ARCH_CL_SIZE,
+	                   nr_nodes * sizeof(struct pth_barrier_node)))
+		return ENOMEM;
+	b->nr_nodes = nr_nodes;
+	for (int i = 0; i < b->nr_leaves; i++)
+		b->nodes[i].quota = count / b->nr_leaves +
+		                    (i < count % b->nr_leaves);
+	/* Each level follows the one below it.  Node i of a level has children
+	 * FANIN * i through FANIN * i + FANIN - 1 of the level below. */
+	lvl_start = 0;
+	lvl_sz = b->nr_leaves;
+	while (lvl_sz > 1) {
+		for (int i = 0; i < lvl_sz; i++) {
+			node = &b->nodes[lvl_start + lvl_sz + i / PTHREAD_BARRIER_FANIN];
+			b->nodes[lvl_start + i].parent = node - b->nodes;
+			if (i % PTHREAD_BARRIER_FANIN == 0)
+				node->quota = MIN(lvl_sz - i, PTHREAD_BARRIER_FANIN);
+		}
+		lvl_start += lvl_sz;
+		lvl_sz = DIV_ROUND_UP(lvl_sz, PTHREAD_BARRIER_FANIN);
+	}
+	b->nodes[nr_nodes - 1].parent = -1;
+	for (int i = 0; i < nr_nodes; i++)
+		atomic_init(&b->nodes[i].count, 0);
 	b->total_threads = count;
 	b->sense = 0;
-	atomic_set(&b->count, count);
 	spin_pdr_init(&b->lock);
 	SLIST_INIT(&b->waiters);
 	b->nr_waiters = 0;
@@ -1065,9 +1428,54 @@ static void __pth_barrier_cb(struct uthread *uthread, void *junk)
 	spin_pdr_unlock(&b->lock);
 }
 
+/* Picks the leaf a thread tries first.  Leaves are split among the sockets,
+ * so threads on the same socket mostly share the lower levels of the tree, and
+ * the pthread id spreads threads on the same vcore across that socket's
+ * leaves.  Stale vcore info only costs us locality. */
+static int __barrier_first_leaf(pthread_barrier_t *b)
+{
+	uint32_t nr_sockets = MAX(__proc_global_info.nr_sockets, 1);
+	uint32_t pcoreid = vcore_pcoreid(vcore_id());
+	uint32_t socket = __proc_global_info.core_socket[pcoreid] % nr_sockets;
+	int lo = socket * b->nr_leaves / nr_sockets;
+	int hi = (socket + 1) * b->nr_leaves / nr_sockets;
+
+	if (lo == hi) {
+		lo = 0;
+		hi = b->nr_leaves;
+	}
+	return lo + pthread_self()->id % (hi - lo);
+}
+
+/* Arrives at the barrier's tree.  Returns TRUE if we were the last thread in.
+ * Increments on a full leaf are harmless: the barrier can't finish until the
+ * thread that made them gets a slot, and the last thread clears every count
+ * after that. */
+static bool __barrier_arrive(pthread_barrier_t *b)
+{
+	struct pth_barrier_node *node;
+	int idx = __barrier_first_leaf(b);
+	long old_count;
+
+	while (1) {
+		node = &b->nodes[idx];
+		old_count = atomic_fetch_and_add(&node->count, 1);
+		if (old_count < node->quota)
+			break;
+		idx = (idx + 1) % b->nr_leaves;
+	}
+	while (old_count + 1 == node->quota) {
+		if (node->parent < 0)
+			return TRUE;
+		node = &b->nodes[node->parent];
+		old_count = atomic_fetch_and_add(&node->count, 1);
+	}
+	return FALSE;
+}
+
 /* We assume that the same threads participating in the barrier this time will
- * also participate next time.  Imagine a thread stopped right after its fetch
- * and add - we know it is coming through eventually.  We finish and change the
+ * also participate next time.  Imagine a thread stopped right after it
+ * arrives - we know it is coming through eventually.  We finish and change the
  * sense, which should allow the delayed thread to eventually break through.
  * But if another n threads come in first, we'll set the sense back to the old
  * value, thereby catching the delayed thread til the next barrier. 
@@ -1086,15 +1494,14 @@ int pthread_barrier_wait(pthread_barrier_t *b)
 	struct pthread_list restartees = SLIST_HEAD_INITIALIZER(restartees);
 	struct pthread_tcb *pthread_i;
 	struct barrier_junk local_junk;
-	
-	long old_count = atomic_fetch_and_add(&b->count, -1);
 
-	if (old_count == 1) {
+	if (__barrier_arrive(b)) {
 		printd("Thread %d is last to hit the barrier, resetting...\n",
 		       pthread_self()->id);
 		/* TODO: we might want to grab the lock right away, so a few short
 		 * circuit faster? */
-		atomic_set(&b->count, b->total_threads);
+		for (int i = 0; i < b->nr_nodes; i++)
+			atomic_set(&b->nodes[i].count, 0);
 		/* we still need to maintain ordering btw count and sense, in case
 		 * another thread doesn't sleep (if we wrote sense first, they could
 		 * break out, race around, and muck with count before it is time) */
@@ -1133,6 +1540,8 @@ int pthread_barrier_destroy(pthread_barrier_t *b)
 {
 	assert(SLIST_EMPTY(&b->waiters));
 	assert(!b->nr_waiters);
+	free(b->nodes);
+	b->nodes = NULL;
 	/* Free any locks (if we end up using an MCS) */
 	return 0;
 }
@@ -47,6 +47,7 @@ struct pthread_tcb {
 	bool detached;
 	struct pthread_tcb *joiner;			/* raced on by exit and join */
 	uint32_t id;
+	uint32_t last_vcoreid;				/* for run queue affinity */
 	uint32_t stacksize;
 	void *stacktop;
 	void *(*start_routine)(void*);
@@ -74,8 +75,8 @@ struct sysc_mgmt {
 #define PTHREAD_MUTEX_NORMAL 0
 #define PTHREAD_MUTEX_RECURSIVE 1
 #define PTHREAD_MUTEX_DEFAULT PTHREAD_MUTEX_NORMAL
-#define PTHREAD_MUTEX_SPINS 100 // totally arbitrary
 #define PTHREAD_BARRIER_SPINS 100 // totally arbitrary
+#define PTHREAD_BARRIER_FANIN 8	/* arrivals per combining tree node */
 #define PTHREAD_COND_INITIALIZER {/* SLIST_HEAD_INITIALIZER */ {NULL},         \
                                   SPINPDR_INITIALIZER, 0, 0}
 #define PTHREAD_PROCESS_PRIVATE 0
@@ -90,13 +91,19 @@ typedef struct
 {
   const pthread_mutexattr_t* attr;
   atomic_t lock;
+  struct uthread *owner;
+  struct uth_spin_adapt spin;
 } pthread_mutex_t;
 
+struct pth_barrier_node;
+
 typedef struct
 {
 	int							total_threads;
 	volatile int				sense;	/* state of barrier, flips btw runs */
-	atomic_t					count;
+	struct pth_barrier_node		*nodes;	/* combining tree, leaves first */
+	int							nr_nodes;
+	int							nr_leaves;
 	struct spin_pdr_lock		lock;
 	struct pthread_list			waiters;
 	int							nr_waiters;
@@ -119,6 +126,7 @@ enum
 #define PTHREAD_STACK_PAGES 1024
 #define PTHREAD_STACK_SIZE (PTHREAD_STACK_PAGES*PGSIZE)
 #define PTHREAD_STACK_MIN PTHREAD_STACK_SIZE
+#define PTHREAD_POOL_SIZE 32	/* default number of dead threads kept */
 
 typedef int clockid_t;
 typedef struct
@@ -147,6 +155,7 @@ typedef struct
 	int sched_priority;
 	int sched_policy;
 	int sched_inherit;
+	size_t poolsize;
 } pthread_attr_t;
 typedef int pthread_barrierattr_t;
 typedef int pthread_once_t;
@@ -157,6 +166,10 @@ void pthread_need_tls(bool need);			/* default is TRUE */
 void pthread_lib_init(void);
 void pthread_mcp_init(void);
 void __pthread_generic_yield(struct pthread_tcb *pthread);
+/* Creating a thread with a nonzero poolsize sets how many dead threads we keep,
+ * with their stacks and TLS, for reuse by pthread_create(). */
+int pthread_attr_setpoolsize_np(pthread_attr_t *attr, size_t poolsize);
+int pthread_attr_getpoolsize_np(const pthread_attr_t *attr, size_t *poolsize);
 
 /* Profiling alarms for pthreads.  (profalarm.c) */
 void enable_profalarm(uint64_t usecs);
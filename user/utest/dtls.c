@@ -88,6 +88,28 @@ bool test_set_from_dtor(void)
 	return TRUE;
 }
 
+/* Deleted keys' ids get reused.  The new key must not see the old value, and
+ * its own value must stick. */
+bool test_reuse_deleted_key(void)
+{
+	dtls_key_t key;
+	void *set_val = (void*)0x15;
+	void *got_val;
+
+	for (int i = 0; i < 100; i++) {
+		key = dtls_key_create(0);
+		got_val = get_dtls(key);
+		UT_ASSERT_FMT("Expected 0, got %p", got_val == 0, 0, got_val);
+		set_dtls(key, set_val + i);
+		got_val = get_dtls(key);
+		UT_ASSERT_FMT("Expected %p, got %p", got_val == set_val + i,
+		              set_val + i, got_val);
+		destroy_dtls();
+		dtls_key_delete(key);
+	}
+	return TRUE;
+}
+
 /* <--- End definition of test cases ---> */
 
 struct utest utests[] = {
@@ -96,6 +118,7 @@ struct utest utests[] = {
 	UTEST_REG(set_and_get),
 	UTEST_REG(set_twice),
 	UTEST_REG(set_from_dtor),
+	UTEST_REG(reuse_deleted_key),
 };
 int num_utests = sizeof(utests) / sizeof(struct utest);
 
@@ -45,6 +45,33 @@ int debug_decode = 0;
 
 static char *modrmreg[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi"};
 
+/* The same handful of instructions in the guest's drivers do nearly all of the
+ * MMIO, so we remember how we decoded them, keyed by RIP and CR3.  We don't see
+ * the guest change its page tables, so a hit doesn't trust the translation
+ * blindly: we compare the instruction bytes at the cached rip_gpa with what we
+ * decoded.  That costs a memcmp instead of a page walk and a decode.  If the
+ * bytes changed, we miss and decode again.  Each cache belongs to one guest
+ * thread, and only its ctlr uses it, so there's no locking. */
+#define DECODE_CACHE_SZ			16		/* power of two */
+#define DECODE_MAX_INSN			16
+
+struct decode_cache_entry {
+	uint64_t					rip;
+	uint64_t					cr3;
+	uint8_t						*rip_gpa;
+	uint8_t						insn[DECODE_MAX_INSN];
+	uint8_t						destreg;
+	int							store;
+	int							size;
+	int							advance;
+};
+
+struct decode_cache {
+	struct decode_cache_entry	entries[DECODE_CACHE_SZ];
+	uint64_t					nr_hits;
+	uint64_t					nr_misses;
+};
+
 // Since we at most have to decode less than half of each instruction, I'm trying to be dumb here.
 // Fortunately, for me, that's not hard.
 // I'm trying to avoid the whole Big Fun of full instruction decode, and in most of these
@@ -214,11 +241,49 @@ static int insize(void *rip)
 // int is the reg index which we can use for printing info.
 // regp points to the register in hw_trapframe from which
 // to load or store a result.
+static struct decode_cache_entry *decode_cache_lookup(struct guest_thread *gth,
+                                                     bool *hit)
+{
+	struct vm_trapframe *vm_tf = gth_to_vmtf(gth);
+	struct decode_cache *dc = gth->decode_cache;
+	struct decode_cache_entry *dce;
+	uint64_t rip = vm_tf->tf_rip;
+
+	*hit = FALSE;
+	if (!dc) {
+		dc = calloc(1, sizeof(struct decode_cache));
+		if (!dc)
+			return NULL;
+		gth->decode_cache = dc;
+	}
+	dce = &dc->entries[(rip ^ (rip >> 4)) & (DECODE_CACHE_SZ - 1)];
+	if (dce->rip_gpa && dce->rip == rip && dce->cr3 == vm_tf->tf_cr3 &&
+	    !memcmp(dce->rip_gpa, dce->insn, dce->advance)) {
+		*hit = TRUE;
+		dc->nr_hits++;
+	} else {
+		dc->nr_misses++;
+	}
+	return dce;
+}
+
+void decode_print_stats(FILE *f, struct guest_thread *gth)
+{
+	struct decode_cache *dc = gth->decode_cache;
+
+	if (!dc)
+		return;
+	fprintf(f, "MMIO decode cache: %llu hits, %llu misses\n", dc->nr_hits,
+	        dc->nr_misses);
+}
+
 int decode(struct guest_thread *vm_thread, uint64_t *gpa, uint8_t *destreg,
            uint64_t **regp, int *store, int *size, int *advance)
 {
 	struct vm_trapframe *vm_tf = &(vm_thread->uthread.u_ctx.tf.vm_tf);
 	uint8_t *rip_gpa = NULL;
+	struct decode_cache_entry *dce;
+	bool hit;
 
 	DPRINTF("v is %p\n", vm_tf);
 
@@ -234,6 +299,15 @@ int decode(struct guest_thread *vm_thread, uint64_t *gpa, uint8_t *destreg,
 
 	DPRINTF("rip is %p\n", vm_tf->tf_rip);
 
+	dce = decode_cache_lookup(vm_thread, &hit);
+	if (hit) {
+		*destreg = dce->destreg;
+		*store = dce->store;
+		*size = dce->size;
+		*advance = dce->advance;
+		goto found_reg;
+	}
+
 	if (rippa(vm_thread, (uint64_t *)&rip_gpa))
 		return VM_PAGE_FAULT;
 	DPRINTF("rip_gpa is %p\n", rip_gpa);
@@ -253,6 +327,18 @@ int decode(struct guest_thread *vm_thread, uint64_t *gpa, uint8_t *destreg,
 
 	*destreg = (ins>>11) & 7;
 	*destreg += 8 * (rip_gpa[0] == 0x44);
+
+	if (dce && *advance <= DECODE_MAX_INSN) {
+		dce->rip = vm_tf->tf_rip;
+		dce->cr3 = vm_tf->tf_cr3;
+		dce->rip_gpa = rip_gpa;
+		memcpy(dce->insn, rip_gpa, *advance);
+		dce->destreg = *destreg;
+		dce->store = *store;
+		dce->size = *size;
+		dce->advance = *advance;
+	}
+found_reg:
 	// Our primitive approach wins big here.
 	// We don't have to decode the register or the offset used
 	// in the computation; that was done by the CPU and is the gpa.
@@ -31,8 +31,11 @@ struct guest_thread {
 	struct ctlr_thread			*buddy;
 	unsigned int				gpc_id;
 	bool						halt_exit;
+	bool						halted;		/* protected by halt_mtx */
 	uth_mutex_t					halt_mtx;
 	uth_cond_var_t				halt_cv;
+	struct vmm_exit_stat		*exit_stats;	/* VMM_EXIT_NR_REASONS */
+	struct decode_cache			*decode_cache;	/* decode.c, lazily */
 };
 
 struct ctlr_thread {
@@ -65,6 +68,12 @@ struct vmm_thread {
 TAILQ_HEAD(vmm_thread_tq, vmm_thread);
 
 extern int vmm_sched_period_usec;
+/* Gives each guest core a vcore of its own, which it never shares with other
+ * guest cores or with tasks, and which never yields its pcore, even when the
+ * guest halts.  Tasks get vcore 0 and any extra vcores.  Set this before
+ * vmm_init(), and provision enough pcores (nr_gpcs + 1) so those vcores stay
+ * put.  If we lose vcores, we fall back to sharing until they return. */
+extern bool vmm_sched_dedicated;
 
 /* Initialize a VMM for a virtual machine, which the caller fills out, except
  * for gths.  This will set **gths in the struct virtual machine.  Do not free()
@@ -68,6 +68,9 @@ struct virtio_vq {
 	// processing the queue
 	uint16_t last_avail;
 
+	// The vq.vring.used->idx as of the last virtio_vq_needs_irq()
+	uint16_t last_irq_used;
+
 	// The service function that processes buffers for this queue
 	void (*srv_fn)(void *arg);
 
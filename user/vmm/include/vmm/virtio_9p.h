@@ -39,3 +39,11 @@ struct virtio_9p_config {
 	/* non-NULL terminated tag name */
 	uint8_t tag[0];
 } __attribute__((packed));
+
+struct virtual_machine;
+
+/* Serves our directory root to the guest, which mounts it with
+ * "mount -t 9p -o trans=virtio,version=9p2000.L <tag> /mnt". */
+void p9_init_fn(struct virtual_machine *vm, struct virtio_vq_dev *vqdev,
+                const char *root, const char *tag);
+void p9_request(void *_vq);
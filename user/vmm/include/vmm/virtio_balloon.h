@@ -32,6 +32,9 @@
 #define VIRTIO_BALLOON_F_MUST_TELL_HOST	0 /* Tell before reclaiming pages */
 #define VIRTIO_BALLOON_F_STATS_VQ	1 /* Memory Stats virtqueue */
 #define VIRTIO_BALLOON_F_DEFLATE_ON_OOM	2 /* Deflate balloon on OOM */
+#define VIRTIO_BALLOON_F_FREE_PAGE_HINT	3 /* VQ to report free pages */
+#define VIRTIO_BALLOON_F_PAGE_POISON	4 /* Guest is using page poisoning */
+#define VIRTIO_BALLOON_F_REPORTING	5 /* Page reporting virtqueue */
 
 /* Size of a PFN in the balloon interface. */
 #define VIRTIO_BALLOON_PFN_SHIFT 12
@@ -78,3 +81,13 @@ struct virtio_balloon_stat {
 	uint16_t tag;
 	uint64_t val;
 } __attribute__((packed));
+
+/* Inflate, deflate, and the page reporting queue.  Linux numbers the queues
+ * it uses in order, so since we don't offer the stats or free page hint
+ * queues, reporting is always the third. */
+#define VIRTIO_BALLOON_NR_VQS	3
+
+void balloon_inflateq_fn(void *_vq);
+void balloon_deflateq_fn(void *_vq);
+void balloon_reportq_fn(void *_vq);
+void balloon_set_target(struct virtio_vq_dev *vqdev, uint32_t nr_pages);
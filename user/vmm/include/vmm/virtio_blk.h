@@ -145,5 +145,9 @@ struct virtio_scsi_inhdr {
 #define VIRTIO_BLK_S_IOERR	1
 #define VIRTIO_BLK_S_UNSUPP	2
 
+/* blk_init_fn() gives the device up to this many request queues. */
+#define VIRTIO_BLK_MAX_QUEUES	8
+
 void blk_request(void *_vq);
-void blk_init_fn(struct virtio_vq_dev *vqdev, const char *filename);
+void blk_init_fn(struct virtio_vq_dev *vqdev, const char *filename,
+                 int nr_queues);
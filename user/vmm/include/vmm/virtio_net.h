@@ -243,6 +243,14 @@ struct virtio_net_ctrl_mq {
 #define VIRTIO_NET_CTRL_GUEST_OFFLOADS   5
 #define VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET        0
 
+/* The most queue pairs we'll offer.  A vqdev needs room for
+ * VIRTIO_NET_MAX_VQS queues: two per pair and the controlq. */
+#define VIRTIO_NET_MAX_QPAIRS	8
+#define VIRTIO_NET_MAX_VQS	(2 * VIRTIO_NET_MAX_QPAIRS + 1)
+
 void net_receiveq_fn(void *_vq);
 void net_transmitq_fn(void *_vq);
-void net_init_fn(struct virtio_vq_dev *vqdev, int nic);
+void net_controlq_fn(void *_vq);
+void net_init_fn(struct virtio_vq_dev *vqdev, int nic, int nr_qpairs);
+void net_use_vhost(struct virtio_vq_dev *vqdev);
+void net_vhost_fn(void *_vq);
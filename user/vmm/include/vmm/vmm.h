@@ -17,6 +17,8 @@ enum {
 	VIRTIO_MMIO_CONSOLE_DEV,
 	VIRTIO_MMIO_NETWORK_DEV,
 	VIRTIO_MMIO_BLOCK_DEV,
+	VIRTIO_MMIO_BALLOON_DEV,
+	VIRTIO_MMIO_9P_DEV,
 
 	/* This should always be the last entry. */
 	VIRTIO_MMIO_MAX_NUM_DEV,
@@ -48,6 +50,7 @@ struct virtual_machine {
 char *regname(uint8_t reg);
 int decode(struct guest_thread *vm_thread, uint64_t *gpa, uint8_t *destreg,
            uint64_t **regp, int *store, int *size, int *advance);
+void decode_print_stats(FILE *f, struct guest_thread *gth);
 int io(struct guest_thread *vm_thread);
 void showstatus(FILE *f, struct guest_thread *vm_thread);
 int gvatogpa(struct guest_thread *vm_thread, uint64_t va, uint64_t *pa);
@@ -57,6 +60,7 @@ int msrio(struct guest_thread *vm_thread, struct vmm_gpcore_init *gpci,
 int do_ioapic(struct guest_thread *vm_thread, uint64_t gpa,
               int destreg, uint64_t *regp, int store);
 bool handle_vmexit(struct guest_thread *gth);
+void vmm_print_exit_stats(FILE *f, struct virtual_machine *vm);
 int __apic_access(struct guest_thread *vm_thread, uint64_t gpa, int destreg,
                   uint64_t *regp, int store);
 int vmm_interrupt_guest(struct virtual_machine *vm, unsigned int gpcoreid,
@@ -17,6 +17,7 @@
 #include <benchutil/vcore_tick.h>
 
 int vmm_sched_period_usec = 1000;
+bool vmm_sched_dedicated = FALSE;
 
 /* For now, we only have one VM managed by the 2LS.  If we ever expand that,
  * we'll need something analogous to current_uthread, so the 2LS knows which VM
@@ -33,6 +34,21 @@ static atomic_t nr_unblk_guests;
 /* Global evq for all syscalls.  Could make this per vcore or whatever. */
 static struct event_queue *sysc_evq;
 
+/* Dedicated mode: guest core i (and its ctlr) runs on vcore i + 1, and only
+ * there, while tasks run on vcore 0 and any vcores past the guests'.  If we
+ * don't have all of those vcores, we're degraded and fall back to running
+ * anything anywhere.  We also note when a guest's vcore moves to a new pcore.
+ * Both are rare, so we just print them. */
+#define TASK_VCORE				0
+
+enum {
+	DED_STARTING,
+	DED_WHOLE,
+	DED_DEGRADED,
+};
+static int ded_state = DED_STARTING;
+static uint32_t *ded_last_pcoreid;	/* per guest vcore, for migrations */
+
 static void vmm_sched_entry(void);
 static void vmm_thread_runnable(struct uthread *uth);
 static void vmm_thread_paused(struct uthread *uth);
@@ -128,11 +144,21 @@ static void __attribute__((constructor)) vmm_lib_init(void)
 /* The scheduling policy is encapsulated in the next few functions (from here
  * down to sched_entry()). */
 
+static bool sched_is_dedicated(void)
+{
+	/* current_vm is set before we ever become an MCP */
+	return vmm_sched_dedicated && current_vm;
+}
+
 static int desired_nr_vcores(void)
 {
 	/* Sanity checks on our accounting. */
 	assert(atomic_read(&nr_unblk_guests) >= 0);
 	assert(atomic_read(&nr_unblk_tasks) >= 0);
+	/* Every guest core's vcore, even if it is halted, and at least the task
+	 * vcore. */
+	if (sched_is_dedicated())
+		return current_vm->nr_gpcs + MAX(1, atomic_read(&nr_unblk_tasks));
 	/* Lockless peak.  This is always an estimate.  Some of our tasks busy-wait,
 	 * so it's not enough to just give us one vcore for all tasks, yet. */
 	return atomic_read(&nr_unblk_guests) + atomic_read(&nr_unblk_tasks);
@@ -188,6 +214,92 @@ static struct vmm_thread *pick_a_thread_plenty(void)
 	return vth;
 }
 
+static int vth_gpcoreid(struct vmm_thread *vth)
+{
+	switch (vth->type) {
+	case VMM_THREAD_GUEST:
+		return vth->guest.gpc_id;
+	case VMM_THREAD_CTLR:
+		return vth->ctlr.buddy->gpc_id;
+	}
+	return -1;
+}
+
+static bool ded_runs_here(struct vmm_thread *vth, uint32_t vcoreid)
+{
+	int gpcoreid = vth_gpcoreid(vth);
+
+	if (gpcoreid >= 0)
+		return vcoreid == gpcoreid + 1;
+	return vcoreid == TASK_VCORE || vcoreid > current_vm->nr_gpcs;
+}
+
+/* We have all of our vcores: only run our own guest core, or only tasks. */
+static struct vmm_thread *pick_a_thread_dedicated(uint32_t vcoreid)
+{
+	struct vmm_thread *vth;
+	int gpcoreid = (int)vcoreid - 1;
+
+	spin_pdr_lock(&queue_lock);
+	if (vcoreid != TASK_VCORE && gpcoreid < current_vm->nr_gpcs) {
+		/* There are never more than a couple runnable per guest core */
+		TAILQ_FOREACH(vth, &rnbl_guests, tq_next) {
+			if (vth_gpcoreid(vth) == gpcoreid)
+				break;
+		}
+		if (vth)
+			TAILQ_REMOVE(&rnbl_guests, vth, tq_next);
+	} else {
+		vth = __pop_first(&rnbl_tasks);
+	}
+	spin_pdr_unlock(&queue_lock);
+	return vth;
+}
+
+static void ded_set_state(int new_state)
+{
+	int old_state = ACCESS_ONCE(ded_state);
+
+	if (old_state == new_state)
+		return;
+	/* Whoever changes the state reports it.  Starting up doesn't count as
+	 * degrading. */
+	if (!__sync_bool_compare_and_swap(&ded_state, old_state, new_state))
+		return;
+	if (new_state == DED_DEGRADED && old_state == DED_WHOLE)
+		debug_printf("vmm: dedicated cores degraded, have %d of %d vcores\n",
+		             num_vcores(), desired_nr_vcores());
+	if (new_state == DED_WHOLE && old_state == DED_DEGRADED)
+		debug_printf("vmm: dedicated cores restored\n");
+}
+
+static void ded_check_pcore(uint32_t vcoreid)
+{
+	uint32_t pcoreid = vcore_pcoreid(vcoreid);
+	uint32_t last;
+
+	if (vcoreid == TASK_VCORE || vcoreid > current_vm->nr_gpcs)
+		return;
+	last = ded_last_pcoreid[vcoreid - 1];
+	if (last == pcoreid)
+		return;
+	ded_last_pcoreid[vcoreid - 1] = pcoreid;
+	if (last != (uint32_t)-1)
+		debug_printf("vmm: guest core %d moved from pcore %d to %d\n",
+		             vcoreid - 1, last, pcoreid);
+}
+
+/* A guest's vcore keeps its pcore, even with nothing to do, so the guest never
+ * waits on the ksched.  The overflow task vcores can yield. */
+static void __attribute__((noreturn)) ded_idle(uint32_t vcoreid)
+{
+	if (vcoreid > current_vm->nr_gpcs)
+		vcore_yield_or_restart();
+	cpu_relax();
+	handle_events(vcoreid);
+	vcore_reenter(vmm_sched_entry);
+}
+
 static void yield_current_uth(void)
 {
 	struct vmm_thread *vth;
@@ -209,6 +321,17 @@ static bool try_to_get_vcores(void)
 	int nr_vcores_wanted = desired_nr_vcores();
 	bool have_enough = nr_vcores_wanted <= num_vcores();
 
+	/* The count isn't enough; we need the specific vcores.  We can't ask for
+	 * a vcore by id, so ask for one more for each that is missing. */
+	if (sched_is_dedicated()) {
+		for (int i = 0; i <= current_vm->nr_gpcs; i++) {
+			if (!vcore_is_mapped(i)) {
+				nr_vcores_wanted++;
+				have_enough = FALSE;
+			}
+		}
+	}
+
 	if (have_enough) {
 		vcore_tick_disable();
 		return TRUE;
@@ -228,8 +351,22 @@ static void __attribute__((noreturn)) vmm_sched_entry(void)
 		/* slightly less than ideal: we grab the queue lock twice */
 		yield_current_uth();
 	}
+	if (sched_is_dedicated()) {
+		ded_set_state(have_enough ? DED_WHOLE : DED_DEGRADED);
+		ded_check_pcore(vcore_id());
+		/* Leftovers from when we were degraded go back where they belong */
+		if (have_enough && current_uthread &&
+		    !ded_runs_here((struct vmm_thread*)current_uthread, vcore_id()))
+			yield_current_uth();
+	}
 	if (current_uthread)
 		run_current_uthread();
+	if (sched_is_dedicated() && have_enough) {
+		vth = pick_a_thread_dedicated(vcore_id());
+		if (!vth)
+			ded_idle(vcore_id());
+		run_uthread((struct uthread*)vth);
+	}
 	if (have_enough)
 		vth = pick_a_thread_plenty();
 	else
@@ -432,6 +569,9 @@ static struct guest_thread *create_guest_thread(struct virtual_machine *vm,
 	gth->uthread.flags |= UTHREAD_FPSAVED;
 	gth->halt_mtx = uth_mutex_alloc();
 	gth->halt_cv = uth_cond_var_alloc();
+	gth->exit_stats = calloc(VMM_EXIT_NR_REASONS,
+	                         sizeof(struct vmm_exit_stat));
+	assert(gth->exit_stats);
 	return gth;
 }
 
@@ -444,6 +584,12 @@ int vmm_init(struct virtual_machine *vm, int flags)
 	current_vm = vm;
 	if (syscall(SYS_vmm_setup, vm->nr_gpcs, vm->gpcis, flags) != vm->nr_gpcs)
 		return -1;
+	if (vmm_sched_dedicated) {
+		ded_last_pcoreid = malloc(vm->nr_gpcs * sizeof(uint32_t));
+		if (!ded_last_pcoreid)
+			return -1;
+		memset(ded_last_pcoreid, 0xff, vm->nr_gpcs * sizeof(uint32_t));
+	}
 	gths = malloc(vm->nr_gpcs * sizeof(struct guest_thread *));
 	if (!gths)
 		return -1;
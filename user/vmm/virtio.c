@@ -15,6 +15,7 @@
 #include <vmm/virtio.h>
 #include <vmm/virtio_ids.h>
 #include <vmm/virtio_config.h>
+#include <vmm/virtio_balloon.h>
 
 // Returns NULL if the features are valid, otherwise returns
 // an error string describing what part of validation failed
@@ -39,6 +40,16 @@ const char *virtio_validate_feat(struct virtio_vq_dev *vqdev, uint64_t feat)
 			break;
 		case VIRTIO_ID_BLOCK:
 			break;
+		case VIRTIO_ID_BALLOON:
+			// The reporting queue is the third one only because we never
+			// offer the stats or free page hint queues.
+			if (feat & ((1ULL << VIRTIO_BALLOON_F_STATS_VQ) |
+			            (1ULL << VIRTIO_BALLOON_F_FREE_PAGE_HINT)))
+				return "The balloon does not support the stats or free page hint queues.";
+			break;
+		case VIRTIO_ID_9P:
+			// The mount tag is the only feature, and it's optional.
+			break;
 		case 0:
 			return "Invalid device id (0x0)! On the MMIO transport, this value indicates that the device is a system memory map with placeholder devices at static, well known addresses. In any case, this is not something you validate features for.";
 		default:
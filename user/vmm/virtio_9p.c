@@ -0,0 +1,1349 @@
+/*
+ * Copyright (c) 2016 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Virtio 9P: a 9P2000.L server for the guest's v9fs, backed by a directory in
+ * our namespace.
+ *
+ * Each request is a T-message in the driver's buffers and room for the
+ * R-message in ours.  We never gather a message into a buffer of our own: we
+ * parse and build messages in place, through an iterator over the iovecs.  In
+ * particular, Tread and Twrite data go straight between the guest's buffers
+ * and the host chan with preadv and pwritev.  For large I/O, Linux puts the
+ * data in its own descriptors, pointing at the pages of the guest process's
+ * buffer, so those reads and writes are zero copy all the way through.
+ *
+ * The service thread pulls requests off the ring and hands them to a pool of
+ * worker threads, so a slow request (a read from a pipe, a big write) doesn't
+ * hold up the rest.  Workers put their replies on the used ring in whatever
+ * order they finish.
+ *
+ * Fids are refcounted: the table holds a ref, and so does every request
+ * using the fid, so a racing Tclunk can't pull a fid out from under a Tread.
+ *
+ * The guest sees our uids, modes and errnos as-is.  Our errnos are Linux's.
+ * We don't do xattrs, locks or auth; the guest gets EOPNOTSUPP for those. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <parlib/common.h>
+#include <parlib/assert.h>
+#include <parlib/uthread.h>
+#include <parlib/arch/atomic.h>
+#include <vmm/vmm.h>
+#include <vmm/sched.h>
+#include <vmm/virtio.h>
+#include <vmm/virtio_mmio.h>
+#include <vmm/virtio_9p.h>
+
+int debug_virtio_9p;
+
+#define DPRINTF(fmt, ...)                                                      \
+	do {                                                                       \
+	if (debug_virtio_9p) {                                                     \
+		fprintf(stderr, "virtio_9p: " fmt, ##__VA_ARGS__);                     \
+	}                                                                          \
+	} while (0)
+
+#define P9_NR_WORKERS			8
+#define P9_MAX_MSIZE			(512 * 1024)
+#define P9_HDR_SZ				7		/* size[4] type[1] tag[2] */
+#define P9_QID_SZ				13
+#define P9_NOFID				((uint32_t)~0)
+#define P9_NOTAG				((uint16_t)~0)
+#define P9_MAXWELEM				16
+#define P9_MAX_NAME				255
+
+/* Message types.  Each R-message is its T-message + 1. */
+enum {
+	P9_TLERROR = 6,
+	P9_TSTATFS = 8,
+	P9_TLOPEN = 12,
+	P9_TLCREATE = 14,
+	P9_TSYMLINK = 16,
+	P9_TMKNOD = 18,
+	P9_TRENAME = 20,
+	P9_TREADLINK = 22,
+	P9_TGETATTR = 24,
+	P9_TSETATTR = 26,
+	P9_TXATTRWALK = 30,
+	P9_TXATTRCREATE = 32,
+	P9_TREADDIR = 40,
+	P9_TFSYNC = 50,
+	P9_TLOCK = 52,
+	P9_TGETLOCK = 54,
+	P9_TLINK = 70,
+	P9_TMKDIR = 72,
+	P9_TRENAMEAT = 74,
+	P9_TUNLINKAT = 76,
+	P9_TVERSION = 100,
+	P9_TAUTH = 102,
+	P9_TATTACH = 104,
+	P9_TFLUSH = 108,
+	P9_TWALK = 110,
+	P9_TREAD = 116,
+	P9_TWRITE = 118,
+	P9_TCLUNK = 120,
+	P9_TREMOVE = 122,
+};
+
+#define P9_QTDIR				0x80
+#define P9_QTSYMLINK			0x02
+#define P9_QTFILE				0x00
+
+/* Open flags, as Linux on x86 has them.  Ours are different. */
+#define P9_DOTL_ACCMODE			00000003
+#define P9_DOTL_WRONLY			00000001
+#define P9_DOTL_RDWR			00000002
+#define P9_DOTL_CREATE			00000100
+#define P9_DOTL_EXCL			00000200
+#define P9_DOTL_TRUNC			00001000
+#define P9_DOTL_APPEND			00002000
+#define P9_DOTL_NONBLOCK		00004000
+#define P9_DOTL_DIRECTORY		00200000
+
+#define P9_GETATTR_BASIC		0x000007ffULL
+
+#define P9_SETATTR_MODE			0x00000001
+#define P9_SETATTR_SIZE			0x00000008
+
+#define P9_AT_REMOVEDIR			0x200
+#define P9_FS_MAGIC				0x01021997
+
+struct p9_qid {
+	uint8_t						type;
+	uint32_t					version;
+	uint64_t					path;
+};
+
+struct p9_fid {
+	uint32_t					fid;
+	atomic_t					refcnt;
+	struct p9_fid				*next;		/* hash chain */
+	char						*path;		/* in our namespace */
+	uth_mutex_t					mtx;		/* protects the rest */
+	int							fd;
+	DIR							*dir;
+	long						dir_pos;	/* readdir offset of next ent */
+	struct dirent				*dir_pending;	/* didn't fit last time */
+};
+
+#define P9_FID_HASH_SZ			64
+
+/* Walks a chain of iovecs, for parsing a T-message in the driver's buffers or
+ * building an R-message in ours.  Running off the end sets err, and later
+ * gets and puts do nothing. */
+struct p9_iter {
+	struct iovec				*iov;
+	int							iovcnt;
+	int							idx;
+	size_t						off;		/* in iov[idx] */
+	size_t						pos;		/* from the start */
+	bool						err;
+};
+
+struct p9_req {
+	uint32_t					head;
+	struct iovec				*iov;
+	uint32_t					olen;
+	uint32_t					ilen;
+	uint16_t					tag;
+	struct p9_req				*next;
+};
+
+struct p9_server {
+	struct virtual_machine		*vm;
+	struct virtio_vq			*vq;
+	char						*root;
+	uint32_t					msize;
+	uth_mutex_t					fid_mtx;
+	struct p9_fid				*fids[P9_FID_HASH_SZ];
+	/* Requests waiting for a worker, and the free ones.  Also protects the
+	 * list of tags in flight, for Tflush. */
+	uth_mutex_t					req_mtx;
+	uth_cond_var_t				req_cv;		/* work to do */
+	uth_cond_var_t				done_cv;	/* a request finished */
+	struct p9_req				*work;
+	struct p9_req				**work_tail;
+	struct p9_req				*free_reqs;
+	struct p9_req				*busy;		/* handed to a worker */
+	/* Serializes the used ring and IRQs */
+	uth_mutex_t					used_mtx;
+};
+
+static struct p9_server p9srv;
+
+static void p9_iter_init(struct p9_iter *it, struct iovec *iov, int iovcnt)
+{
+	it->iov = iov;
+	it->iovcnt = iovcnt;
+	it->idx = 0;
+	it->off = 0;
+	it->pos = 0;
+	it->err = FALSE;
+}
+
+/* Copies between buf and the iovecs at the iterator, in either direction. */
+static void p9_iter_copy(struct p9_iter *it, void *buf, size_t len,
+                         bool to_iov)
+{
+	size_t amt;
+
+	if (it->err)
+		return;
+	while (len) {
+		if (it->idx >= it->iovcnt) {
+			it->err = TRUE;
+			return;
+		}
+		amt = MIN(len, it->iov[it->idx].iov_len - it->off);
+		if (to_iov)
+			memcpy(it->iov[it->idx].iov_base + it->off, buf, amt);
+		else
+			memcpy(buf, it->iov[it->idx].iov_base + it->off, amt);
+		buf += amt;
+		len -= amt;
+		it->off += amt;
+		it->pos += amt;
+		if (it->off == it->iov[it->idx].iov_len) {
+			it->idx++;
+			it->off = 0;
+		}
+	}
+}
+
+/* Fills iov with up to len bytes of the iterator's iovecs, without copying.
+ * Returns the number of iovecs; the iterator moves past them. */
+static int p9_iter_slice(struct p9_iter *it, struct iovec *iov, int max_iov,
+                         size_t len)
+{
+	int nr = 0;
+	size_t amt;
+
+	while (len && it->idx < it->iovcnt && nr < max_iov) {
+		amt = MIN(len, it->iov[it->idx].iov_len - it->off);
+		iov[nr].iov_base = it->iov[it->idx].iov_base + it->off;
+		iov[nr].iov_len = amt;
+		nr++;
+		len -= amt;
+		it->off += amt;
+		it->pos += amt;
+		if (it->off == it->iov[it->idx].iov_len) {
+			it->idx++;
+			it->off = 0;
+		}
+	}
+	return nr;
+}
+
+/* 9P is little endian, like us. */
+#define P9_GET(it, type)                                                       \
+({                                                                             \
+	type __v = 0;                                                              \
+	p9_iter_copy((it), &__v, sizeof(type), FALSE);                             \
+	__v;                                                                       \
+})
+
+#define P9_PUT(it, type, val)                                                  \
+({                                                                             \
+	type __v = (val);                                                          \
+	p9_iter_copy((it), &__v, sizeof(type), TRUE);                              \
+})
+
+/* Gets a string into buf, which has room for P9_MAX_NAME and a \0. */
+static void p9_get_str(struct p9_iter *it, char *buf)
+{
+	uint16_t len = P9_GET(it, uint16_t);
+
+	if (len > P9_MAX_NAME)
+		it->err = TRUE;
+	p9_iter_copy(it, buf, len, FALSE);
+	buf[it->err ? 0 : len] = '\0';
+}
+
+static void p9_put_str(struct p9_iter *it, const char *str)
+{
+	size_t len = strlen(str);
+
+	P9_PUT(it, uint16_t, len);
+	p9_iter_copy(it, (void*)str, len, TRUE);
+}
+
+static void p9_put_qid(struct p9_iter *it, struct p9_qid *qid)
+{
+	P9_PUT(it, uint8_t, qid->type);
+	P9_PUT(it, uint32_t, qid->version);
+	P9_PUT(it, uint64_t, qid->path);
+}
+
+static void p9_stat_to_qid(struct stat *st, struct p9_qid *qid)
+{
+	if (S_ISDIR(st->st_mode))
+		qid->type = P9_QTDIR;
+	else if (S_ISLNK(st->st_mode))
+		qid->type = P9_QTSYMLINK;
+	else
+		qid->type = P9_QTFILE;
+	qid->version = st->st_mtime;
+	qid->path = st->st_ino;
+}
+
+static int p9_path_qid(const char *path, struct p9_qid *qid)
+{
+	struct stat st;
+
+	if (lstat(path, &st))
+		return -1;
+	p9_stat_to_qid(&st, qid);
+	return 0;
+}
+
+/* Names come from the guest; they must be one path element. */
+static bool p9_name_ok(const char *name)
+{
+	return name[0] && !strchr(name, '/') && strcmp(name, ".") &&
+	       strcmp(name, "..");
+}
+
+static char *p9_path_join(const char *dir, const char *name)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s", strcmp(dir, "/") ? dir : "", name) < 0)
+		return NULL;
+	return path;
+}
+
+/* Walks one element, staying at or below the root. */
+static char *p9_path_walk(const char *dir, const char *name)
+{
+	char *slash;
+
+	if (!strcmp(name, "..")) {
+		if (!strcmp(dir, p9srv.root))
+			return strdup(dir);
+		slash = strrchr(dir, '/');
+		if (slash == dir)
+			return strdup("/");
+		return strndup(dir, slash - dir);
+	}
+	if (!p9_name_ok(name)) {
+		errno = ENOENT;
+		return NULL;
+	}
+	return p9_path_join(dir, name);
+}
+
+static struct p9_fid **p9_fid_slot(uint32_t fid)
+{
+	struct p9_fid **pp = &p9srv.fids[fid % P9_FID_HASH_SZ];
+
+	while (*pp && (*pp)->fid != fid)
+		pp = &(*pp)->next;
+	return pp;
+}
+
+static struct p9_fid *p9_fid_get(uint32_t fid)
+{
+	struct p9_fid *f;
+
+	uth_mutex_lock(p9srv.fid_mtx);
+	f = *p9_fid_slot(fid);
+	if (f)
+		atomic_inc(&f->refcnt);
+	uth_mutex_unlock(p9srv.fid_mtx);
+	return f;
+}
+
+/* Doesn't touch errno, so callers can put before returning an error. */
+static void p9_fid_put(struct p9_fid *f)
+{
+	int saved_errno = errno;
+
+	if (atomic_fetch_and_add(&f->refcnt, -1) != 1)
+		return;
+	if (f->dir)
+		closedir(f->dir);
+	if (f->fd >= 0)
+		close(f->fd);
+	free(f->dir_pending);
+	uth_mutex_free(f->mtx);
+	free(f->path);
+	free(f);
+	errno = saved_errno;
+}
+
+/* Lcreate and rename change a fid's path, so everyone else gets a copy. */
+static char *p9_fid_path(struct p9_fid *f)
+{
+	char *path;
+
+	uth_mutex_lock(f->mtx);
+	path = strdup(f->path);
+	uth_mutex_unlock(f->mtx);
+	return path;
+}
+
+/* Adds a fid for path, which it takes ownership of.  Returns a ref. */
+static struct p9_fid *p9_fid_new(uint32_t fid, char *path)
+{
+	struct p9_fid *f, **pp;
+
+	f = calloc(1, sizeof(struct p9_fid));
+	if (!f) {
+		free(path);
+		errno = ENOMEM;
+		return NULL;
+	}
+	f->fid = fid;
+	f->path = path;
+	f->fd = -1;
+	f->mtx = uth_mutex_alloc();
+	atomic_init(&f->refcnt, 2);	/* table's, and ours */
+	uth_mutex_lock(p9srv.fid_mtx);
+	pp = p9_fid_slot(fid);
+	if (*pp) {
+		uth_mutex_unlock(p9srv.fid_mtx);
+		uth_mutex_free(f->mtx);
+		free(path);
+		free(f);
+		errno = EBADF;
+		return NULL;
+	}
+	*pp = f;
+	uth_mutex_unlock(p9srv.fid_mtx);
+	return f;
+}
+
+/* Takes the fid out of the table and drops the table's ref. */
+static int p9_fid_clunk(uint32_t fid)
+{
+	struct p9_fid *f, **pp;
+
+	uth_mutex_lock(p9srv.fid_mtx);
+	pp = p9_fid_slot(fid);
+	f = *pp;
+	if (f)
+		*pp = f->next;
+	uth_mutex_unlock(p9srv.fid_mtx);
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	p9_fid_put(f);
+	return 0;
+}
+
+static int p9_open_flags(uint32_t flags)
+{
+	int ret;
+
+	switch (flags & P9_DOTL_ACCMODE) {
+	case P9_DOTL_WRONLY:
+		ret = O_WRONLY;
+		break;
+	case P9_DOTL_RDWR:
+		ret = O_RDWR;
+		break;
+	default:
+		ret = O_RDONLY;
+	}
+	if (flags & P9_DOTL_CREATE)
+		ret |= O_CREAT;
+	if (flags & P9_DOTL_EXCL)
+		ret |= O_EXCL;
+	if (flags & P9_DOTL_TRUNC)
+		ret |= O_TRUNC;
+	if (flags & P9_DOTL_APPEND)
+		ret |= O_APPEND;
+	if (flags & P9_DOTL_NONBLOCK)
+		ret |= O_NONBLOCK;
+	return ret;
+}
+
+/* Each handler parses the rest of its T-message from in and writes the body
+ * of its R-message to out.  Returns -1 with errno set to send an Rlerror. */
+
+static int p9_version(struct p9_iter *in, struct p9_iter *out)
+{
+	uint32_t msize = P9_GET(in, uint32_t);
+	char version[P9_MAX_NAME + 1];
+
+	p9_get_str(in, version);
+	/* A Tversion starts a new session; Linux only sends one, at mount. */
+	p9srv.msize = MIN(msize, P9_MAX_MSIZE);
+	P9_PUT(out, uint32_t, p9srv.msize);
+	p9_put_str(out, strcmp(version, "9P2000.L") ? "unknown" : "9P2000.L");
+	return 0;
+}
+
+static int p9_attach(struct p9_iter *in, struct p9_iter *out)
+{
+	uint32_t fid = P9_GET(in, uint32_t);
+	char name[P9_MAX_NAME + 1];
+	struct p9_fid *f;
+	struct p9_qid qid;
+
+	P9_GET(in, uint32_t);	/* afid: no auth */
+	p9_get_str(in, name);	/* uname */
+	p9_get_str(in, name);	/* aname: there's only one tree */
+	if (p9_path_qid(p9srv.root, &qid))
+		return -1;
+	f = p9_fid_new(fid, strdup(p9srv.root));
+	if (!f)
+		return -1;
+	p9_fid_put(f);
+	p9_put_qid(out, &qid);
+	return 0;
+}
+
+static int p9_walk(struct p9_iter *in, struct p9_iter *out)
+{
+	uint32_t fid = P9_GET(in, uint32_t);
+	uint32_t newfid = P9_GET(in, uint32_t);
+	uint16_t nwname = P9_GET(in, uint16_t);
+	char name[P9_MAX_NAME + 1];
+	struct p9_qid qids[P9_MAXWELEM];
+	struct p9_fid *f, *nf;
+	char *path, *next;
+	int i;
+
+	if (nwname > P9_MAXWELEM) {
+		errno = EINVAL;
+		return -1;
+	}
+	f = p9_fid_get(fid);
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	path = p9_fid_path(f);
+	p9_fid_put(f);
+	/* Only an error on the first element is an error; o/w we return the qids
+	 * we got, and the guest sees it came up short. */
+	for (i = 0; path && i < nwname; i++) {
+		p9_get_str(in, name);
+		next = p9_path_walk(path, name);
+		if (!next || p9_path_qid(next, &qids[i])) {
+			free(next);
+			break;
+		}
+		free(path);
+		path = next;
+	}
+	if (!path || (nwname && !i)) {
+		free(path);
+		return -1;
+	}
+	if (i == nwname) {
+		if (newfid == fid) {
+			/* Walking a fid in place: swap in the new path */
+			p9_fid_clunk(fid);
+		}
+		nf = p9_fid_new(newfid, path);
+		if (!nf)
+			return -1;
+		p9_fid_put(nf);
+	} else {
+		free(path);
+	}
+	P9_PUT(out, uint16_t, i);
+	for (int j = 0; j < i; j++)
+		p9_put_qid(out, &qids[j]);
+	return 0;
+}
+
+static int p9_clunk(struct p9_iter *in, struct p9_iter *out)
+{
+	return p9_fid_clunk(P9_GET(in, uint32_t));
+}
+
+static int p9_remove(struct p9_iter *in, struct p9_iter *out)
+{
+	uint32_t fid = P9_GET(in, uint32_t);
+	struct p9_fid *f = p9_fid_get(fid);
+	struct stat st;
+	char *path;
+	int ret = -1;
+
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	path = p9_fid_path(f);
+	p9_fid_put(f);
+	if (path && !lstat(path, &st))
+		ret = S_ISDIR(st.st_mode) ? rmdir(path) : unlink(path);
+	free(path);
+	/* Tremove clunks the fid, even if it fails */
+	if (ret) {
+		int saved_errno = errno;
+
+		p9_fid_clunk(fid);
+		errno = saved_errno;
+		return -1;
+	}
+	p9_fid_clunk(fid);
+	return 0;
+}
+
+static int p9_lopen(struct p9_iter *in, struct p9_iter *out)
+{
+	struct p9_fid *f = p9_fid_get(P9_GET(in, uint32_t));
+	uint32_t flags = P9_GET(in, uint32_t);
+	struct p9_qid qid;
+	int ret = -1;
+
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	uth_mutex_lock(f->mtx);
+	if (f->fd >= 0 || f->dir) {
+		errno = EBADF;
+		goto out;
+	}
+	if (p9_path_qid(f->path, &qid))
+		goto out;
+	if (qid.type == P9_QTDIR) {
+		f->dir = opendir(f->path);
+		if (!f->dir)
+			goto out;
+	} else {
+		f->fd = open(f->path, p9_open_flags(flags & ~P9_DOTL_CREATE));
+		if (f->fd < 0)
+			goto out;
+	}
+	p9_put_qid(out, &qid);
+	P9_PUT(out, uint32_t, 0);	/* iounit: let the guest use msize */
+	ret = 0;
+out:
+	uth_mutex_unlock(f->mtx);
+	p9_fid_put(f);
+	return ret;
+}
+
+/* The fid, which was the directory, becomes the new open file. */
+static int p9_lcreate(struct p9_iter *in, struct p9_iter *out)
+{
+	struct p9_fid *f = p9_fid_get(P9_GET(in, uint32_t));
+	char name[P9_MAX_NAME + 1];
+	uint32_t flags, mode;
+	struct p9_qid qid;
+	char *path = NULL;
+	int fd, ret = -1;
+
+	p9_get_str(in, name);
+	flags = P9_GET(in, uint32_t);
+	mode = P9_GET(in, uint32_t);
+	P9_GET(in, uint32_t);	/* gid */
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	uth_mutex_lock(f->mtx);
+	if (f->fd >= 0 || f->dir || !p9_name_ok(name)) {
+		errno = f->fd >= 0 || f->dir ? EBADF : EINVAL;
+		goto out;
+	}
+	path = p9_path_join(f->path, name);
+	if (!path)
+		goto out;
+	fd = open(path, p9_open_flags(flags) | O_CREAT, mode);
+	if (fd < 0)
+		goto out;
+	if (p9_path_qid(path, &qid)) {
+		close(fd);
+		goto out;
+	}
+	free(f->path);
+	f->path = path;
+	path = NULL;
+	f->fd = fd;
+	p9_put_qid(out, &qid);
+	P9_PUT(out, uint32_t, 0);
+	ret = 0;
+out:
+	free(path);
+	uth_mutex_unlock(f->mtx);
+	p9_fid_put(f);
+	return ret;
+}
+
+/* Tread and Twrite go straight between the guest's buffers and the fd. */
+static int p9_read(struct p9_iter *in, struct p9_iter *out, struct p9_req *req)
+{
+	struct p9_fid *f = p9_fid_get(P9_GET(in, uint32_t));
+	uint64_t offset = P9_GET(in, uint64_t);
+	uint32_t count = P9_GET(in, uint32_t);
+	struct p9_iter cnt_it = *out;
+	struct iovec *iov = req->iov + req->olen + req->ilen;
+	size_t data_pos;
+	int iovcnt;
+	ssize_t ret;
+
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	if (f->fd < 0) {
+		p9_fid_put(f);
+		errno = EBADF;
+		return -1;
+	}
+	count = MIN(count, p9srv.msize - P9_HDR_SZ - sizeof(uint32_t));
+	/* Fill in the count once we know it */
+	P9_PUT(out, uint32_t, 0);
+	data_pos = out->pos;
+	iovcnt = p9_iter_slice(out, iov, req->ilen, count);
+	ret = preadv(f->fd, iov, iovcnt, offset);
+	p9_fid_put(f);
+	if (ret < 0)
+		return -1;
+	P9_PUT(&cnt_it, uint32_t, ret);
+	/* Our reply ends at what we read, not at what we made room for */
+	out->pos = data_pos + ret;
+	return 0;
+}
+
+static int p9_write(struct p9_iter *in, struct p9_iter *out, struct p9_req *req)
+{
+	struct p9_fid *f = p9_fid_get(P9_GET(in, uint32_t));
+	uint64_t offset = P9_GET(in, uint64_t);
+	uint32_t count = P9_GET(in, uint32_t);
+	struct iovec *iov = req->iov + req->olen + req->ilen;
+	int iovcnt;
+	ssize_t ret;
+
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	if (f->fd < 0) {
+		p9_fid_put(f);
+		errno = EBADF;
+		return -1;
+	}
+	iovcnt = p9_iter_slice(in, iov, req->olen, count);
+	ret = pwritev(f->fd, iov, iovcnt, offset);
+	p9_fid_put(f);
+	if (ret < 0)
+		return -1;
+	P9_PUT(out, uint32_t, ret);
+	return 0;
+}
+
+static int p9_getattr(struct p9_iter *in, struct p9_iter *out)
+{
+	struct p9_fid *f = p9_fid_get(P9_GET(in, uint32_t));
+	struct p9_qid qid;
+	struct stat st;
+	char *path;
+	int ret = -1;
+
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	if (f->fd >= 0) {
+		ret = fstat(f->fd, &st);
+	} else {
+		path = p9_fid_path(f);
+		if (path)
+			ret = lstat(path, &st);
+		free(path);
+	}
+	p9_fid_put(f);
+	if (ret)
+		return -1;
+	p9_stat_to_qid(&st, &qid);
+	P9_PUT(out, uint64_t, P9_GETATTR_BASIC);
+	p9_put_qid(out, &qid);
+	P9_PUT(out, uint32_t, st.st_mode);
+	P9_PUT(out, uint32_t, st.st_uid);
+	P9_PUT(out, uint32_t, st.st_gid);
+	P9_PUT(out, uint64_t, st.st_nlink);
+	P9_PUT(out, uint64_t, st.st_rdev);
+	P9_PUT(out, uint64_t, st.st_size);
+	P9_PUT(out, uint64_t, st.st_blksize);
+	P9_PUT(out, uint64_t, st.st_blocks);
+	P9_PUT(out, uint64_t, st.st_atime);
+	P9_PUT(out, uint64_t, 0);
+	P9_PUT(out, uint64_t, st.st_mtime);
+	P9_PUT(out, uint64_t, 0);
+	P9_PUT(out, uint64_t, st.st_ctime);
+	P9_PUT(out, uint64_t, 0);
+	/* btime, gen and data_version aren't in BASIC */
+	for (int i = 0; i < 4; i++)
+		P9_PUT(out, uint64_t, 0);
+	return 0;
+}
+
+/* We only do mode and size.  Times and owners are quietly left alone. */
+static int p9_setattr(struct p9_iter *in, struct p9_iter *out)
+{
+	struct p9_fid *f = p9_fid_get(P9_GET(in, uint32_t));
+	uint32_t valid = P9_GET(in, uint32_t);
+	uint32_t mode = P9_GET(in, uint32_t);
+	uint64_t size;
+	char *path;
+	int ret = 0;
+
+	P9_GET(in, uint32_t);	/* uid */
+	P9_GET(in, uint32_t);	/* gid */
+	size = P9_GET(in, uint64_t);
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	path = p9_fid_path(f);
+	if (!path)
+		ret = -1;
+	if (!ret && (valid & P9_SETATTR_MODE))
+		ret = chmod(path, mode & 07777);
+	if (!ret && (valid & P9_SETATTR_SIZE))
+		ret = f->fd >= 0 ? ftruncate(f->fd, size) : truncate(path, size);
+	free(path);
+	p9_fid_put(f);
+	return ret;
+}
+
+/* We don't have statfs; make up something df won't choke on. */
+static int p9_statfs(struct p9_iter *in, struct p9_iter *out)
+{
+	P9_GET(in, uint32_t);
+	P9_PUT(out, uint32_t, P9_FS_MAGIC);
+	P9_PUT(out, uint32_t, 4096);	/* bsize */
+	for (int i = 0; i < 6; i++)		/* blocks, bfree, ..., fsid */
+		P9_PUT(out, uint64_t, 0);
+	P9_PUT(out, uint32_t, P9_MAX_NAME);
+	return 0;
+}
+
+static struct dirent *p9_dirent_dup(struct dirent *d)
+{
+	struct dirent *copy = malloc(sizeof(struct dirent));
+
+	if (copy)
+		memcpy(copy, d, sizeof(struct dirent));
+	return copy;
+}
+
+/* Offsets are just entry indexes.  If the guest asks for one other than where
+ * we are, we start over and skip ahead. */
+static int p9_readdir(struct p9_iter *in, struct p9_iter *out)
+{
+	struct p9_fid *f = p9_fid_get(P9_GET(in, uint32_t));
+	uint64_t offset = P9_GET(in, uint64_t);
+	uint32_t count = P9_GET(in, uint32_t);
+	struct p9_iter cnt_it = *out;
+	struct dirent *d;
+	struct p9_qid qid;
+	uint32_t used = 0;
+	size_t ent_sz;
+	char *path;
+
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	uth_mutex_lock(f->mtx);
+	if (!f->dir) {
+		uth_mutex_unlock(f->mtx);
+		p9_fid_put(f);
+		errno = EBADF;
+		return -1;
+	}
+	if (offset != f->dir_pos) {
+		rewinddir(f->dir);
+		free(f->dir_pending);
+		f->dir_pending = NULL;
+		for (f->dir_pos = 0; f->dir_pos < offset; f->dir_pos++) {
+			if (!readdir(f->dir))
+				break;
+		}
+	}
+	count = MIN(count, p9srv.msize - P9_HDR_SZ - sizeof(uint32_t));
+	P9_PUT(out, uint32_t, 0);
+	for (;;) {
+		d = f->dir_pending;
+		f->dir_pending = NULL;
+		if (!d) {
+			d = readdir(f->dir);
+			if (!d)
+				break;
+			d = p9_dirent_dup(d);
+			if (!d)
+				break;
+		}
+		ent_sz = P9_QID_SZ + sizeof(uint64_t) + 1 + 2 + strlen(d->d_name);
+		if (used + ent_sz > count) {
+			f->dir_pending = d;
+			break;
+		}
+		path = p9_path_join(f->path, d->d_name);
+		if (!path || p9_path_qid(path, &qid)) {
+			/* Raced with a remove, most likely */
+			qid.type = P9_QTFILE;
+			qid.version = 0;
+			qid.path = d->d_ino;
+		}
+		free(path);
+		f->dir_pos++;
+		p9_put_qid(out, &qid);
+		P9_PUT(out, uint64_t, f->dir_pos);
+		P9_PUT(out, uint8_t, d->d_type);
+		p9_put_str(out, d->d_name);
+		used += ent_sz;
+		free(d);
+	}
+	uth_mutex_unlock(f->mtx);
+	p9_fid_put(f);
+	P9_PUT(&cnt_it, uint32_t, used);
+	return 0;
+}
+
+static int p9_fsync(struct p9_iter *in, struct p9_iter *out)
+{
+	struct p9_fid *f = p9_fid_get(P9_GET(in, uint32_t));
+	int ret = 0;
+
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	if (f->fd >= 0)
+		ret = fsync(f->fd);
+	p9_fid_put(f);
+	return ret;
+}
+
+/* Helper for messages that operate on a name in a directory fid.  Returns the
+ * malloced path, or NULL with errno set. */
+static char *p9_get_dir_name(struct p9_iter *in, uint32_t dfid)
+{
+	struct p9_fid *f = p9_fid_get(dfid);
+	char name[P9_MAX_NAME + 1];
+	char *path;
+
+	p9_get_str(in, name);
+	if (!f) {
+		errno = EBADF;
+		return NULL;
+	}
+	if (!p9_name_ok(name)) {
+		p9_fid_put(f);
+		errno = EINVAL;
+		return NULL;
+	}
+	uth_mutex_lock(f->mtx);
+	path = p9_path_join(f->path, name);
+	uth_mutex_unlock(f->mtx);
+	p9_fid_put(f);
+	return path;
+}
+
+static int p9_mkdir(struct p9_iter *in, struct p9_iter *out)
+{
+	char *path = p9_get_dir_name(in, P9_GET(in, uint32_t));
+	uint32_t mode = P9_GET(in, uint32_t);
+	struct p9_qid qid;
+	int ret;
+
+	P9_GET(in, uint32_t);	/* gid */
+	if (!path)
+		return -1;
+	ret = mkdir(path, mode);
+	if (!ret)
+		ret = p9_path_qid(path, &qid);
+	free(path);
+	if (ret)
+		return -1;
+	p9_put_qid(out, &qid);
+	return 0;
+}
+
+static int p9_symlink(struct p9_iter *in, struct p9_iter *out)
+{
+	char *path = p9_get_dir_name(in, P9_GET(in, uint32_t));
+	char target[P9_MAX_NAME + 1];
+	struct p9_qid qid;
+	int ret;
+
+	p9_get_str(in, target);
+	P9_GET(in, uint32_t);	/* gid */
+	if (!path)
+		return -1;
+	ret = symlink(target, path);
+	if (!ret)
+		ret = p9_path_qid(path, &qid);
+	free(path);
+	if (ret)
+		return -1;
+	p9_put_qid(out, &qid);
+	return 0;
+}
+
+static int p9_readlink(struct p9_iter *in, struct p9_iter *out)
+{
+	struct p9_fid *f = p9_fid_get(P9_GET(in, uint32_t));
+	char target[P9_MAX_NAME + 1];
+	char *path;
+	ssize_t ret = -1;
+
+	if (!f) {
+		errno = EBADF;
+		return -1;
+	}
+	path = p9_fid_path(f);
+	if (path)
+		ret = readlink(path, target, P9_MAX_NAME);
+	free(path);
+	p9_fid_put(f);
+	if (ret < 0)
+		return -1;
+	target[ret] = '\0';
+	p9_put_str(out, target);
+	return 0;
+}
+
+static int p9_link(struct p9_iter *in, struct p9_iter *out)
+{
+	uint32_t dfid = P9_GET(in, uint32_t);
+	struct p9_fid *f = p9_fid_get(P9_GET(in, uint32_t));
+	char *path = p9_get_dir_name(in, dfid);
+	char *old = f ? p9_fid_path(f) : NULL;
+	int ret = -1;
+
+	if (!f)
+		errno = EBADF;
+	else if (old && path)
+		ret = link(old, path);
+	if (f)
+		p9_fid_put(f);
+	free(old);
+	free(path);
+	return ret;
+}
+
+static int p9_rename(struct p9_iter *in, struct p9_iter *out)
+{
+	struct p9_fid *f = p9_fid_get(P9_GET(in, uint32_t));
+	char *path = p9_get_dir_name(in, P9_GET(in, uint32_t));
+	int ret = -1;
+
+	if (!f) {
+		errno = EBADF;
+	} else if (path) {
+		/* Hold the fid's lock so its path is the one we rename */
+		uth_mutex_lock(f->mtx);
+		ret = rename(f->path, path);
+		if (!ret) {
+			free(f->path);
+			f->path = path;
+			path = NULL;
+		}
+		uth_mutex_unlock(f->mtx);
+	}
+	if (f)
+		p9_fid_put(f);
+	free(path);
+	return ret;
+}
+
+static int p9_renameat(struct p9_iter *in, struct p9_iter *out)
+{
+	char *old = p9_get_dir_name(in, P9_GET(in, uint32_t));
+	char *new = p9_get_dir_name(in, P9_GET(in, uint32_t));
+	int ret = -1;
+
+	if (old && new)
+		ret = rename(old, new);
+	free(old);
+	free(new);
+	return ret;
+}
+
+static int p9_unlinkat(struct p9_iter *in, struct p9_iter *out)
+{
+	char *path = p9_get_dir_name(in, P9_GET(in, uint32_t));
+	uint32_t flags = P9_GET(in, uint32_t);
+	int ret;
+
+	if (!path)
+		return -1;
+	ret = flags & P9_AT_REMOVEDIR ? rmdir(path) : unlink(path);
+	free(path);
+	return ret;
+}
+
+static bool p9_tag_busy(uint16_t tag)
+{
+	for (struct p9_req *r = p9srv.busy; r; r = r->next) {
+		if (r->tag == tag)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* We can't abort a request once a worker has it, but 9P lets us answer it
+ * before the Rflush instead.  So we wait for it to finish.  Workers take
+ * requests in order, so by the time we have the Tflush, the old request is
+ * either busy or done. */
+static int p9_flush(struct p9_iter *in, struct p9_iter *out)
+{
+	uint16_t oldtag = P9_GET(in, uint16_t);
+
+	uth_mutex_lock(p9srv.req_mtx);
+	while (p9_tag_busy(oldtag))
+		uth_cond_var_wait(p9srv.done_cv, p9srv.req_mtx);
+	uth_mutex_unlock(p9srv.req_mtx);
+	return 0;
+}
+
+static int p9_dispatch(uint8_t type, struct p9_iter *in, struct p9_iter *out,
+                       struct p9_req *req)
+{
+	switch (type) {
+	case P9_TVERSION:
+		return p9_version(in, out);
+	case P9_TATTACH:
+		return p9_attach(in, out);
+	case P9_TWALK:
+		return p9_walk(in, out);
+	case P9_TCLUNK:
+		return p9_clunk(in, out);
+	case P9_TREMOVE:
+		return p9_remove(in, out);
+	case P9_TLOPEN:
+		return p9_lopen(in, out);
+	case P9_TLCREATE:
+		return p9_lcreate(in, out);
+	case P9_TREAD:
+		return p9_read(in, out, req);
+	case P9_TWRITE:
+		return p9_write(in, out, req);
+	case P9_TGETATTR:
+		return p9_getattr(in, out);
+	case P9_TSETATTR:
+		return p9_setattr(in, out);
+	case P9_TSTATFS:
+		return p9_statfs(in, out);
+	case P9_TREADDIR:
+		return p9_readdir(in, out);
+	case P9_TFSYNC:
+		return p9_fsync(in, out);
+	case P9_TMKDIR:
+		return p9_mkdir(in, out);
+	case P9_TSYMLINK:
+		return p9_symlink(in, out);
+	case P9_TREADLINK:
+		return p9_readlink(in, out);
+	case P9_TLINK:
+		return p9_link(in, out);
+	case P9_TRENAME:
+		return p9_rename(in, out);
+	case P9_TRENAMEAT:
+		return p9_renameat(in, out);
+	case P9_TUNLINKAT:
+		return p9_unlinkat(in, out);
+	case P9_TFLUSH:
+		return p9_flush(in, out);
+	default:
+		/* Tauth, Txattr*, Tlock, Tgetlock, Tmknod and the 9P2000 ones */
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+}
+
+/* Handles one request and returns how much of the reply we wrote. */
+static uint32_t p9_handle(struct p9_req *req)
+{
+	struct p9_iter in, out, hdr;
+	uint8_t type;
+	int ret;
+
+	p9_iter_init(&in, req->iov, req->olen);
+	p9_iter_init(&out, req->iov + req->olen, req->ilen);
+	P9_GET(&in, uint32_t);	/* size: we go by the descriptors */
+	type = P9_GET(&in, uint8_t);
+	P9_GET(&in, uint16_t);	/* tag, which we already have */
+	if (in.err)
+		VIRTIO_DRI_ERRX(p9srv.vq->vqdev, "Short 9P request");
+	DPRINTF("T-message %d tag %d\n", type, req->tag);
+
+	/* Leave room for the header, which we write once we know the size */
+	p9_iter_copy(&out, (uint8_t[P9_HDR_SZ]){0}, P9_HDR_SZ, TRUE);
+	errno = 0;
+	ret = p9_dispatch(type, &in, &out, req);
+	if (in.err && !ret) {
+		errno = EINVAL;
+		ret = -1;
+	}
+	if (ret || out.err) {
+		p9_iter_init(&out, req->iov + req->olen, req->ilen);
+		p9_iter_copy(&out, (uint8_t[P9_HDR_SZ]){0}, P9_HDR_SZ, TRUE);
+		P9_PUT(&out, uint32_t, errno ? errno : EIO);
+		type = P9_TLERROR;
+	}
+	if (out.err)
+		VIRTIO_DRI_ERRX(p9srv.vq->vqdev, "No room for a 9P reply");
+	p9_iter_init(&hdr, req->iov + req->olen, req->ilen);
+	P9_PUT(&hdr, uint32_t, out.pos);
+	P9_PUT(&hdr, uint8_t, type + 1);
+	P9_PUT(&hdr, uint16_t, req->tag);
+	return out.pos;
+}
+
+static void p9_complete(struct p9_req *req, uint32_t len)
+{
+	struct virtio_vq *vq = p9srv.vq;
+	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
+	struct p9_req **pp;
+
+	uth_mutex_lock(p9srv.used_mtx);
+	virtio_add_used_desc(vq, req->head, len);
+	if (virtio_vq_needs_irq(vq)) {
+		virtio_mmio_set_vring_irq(dev);
+		dev->poke_guest(dev->vec);
+	}
+	uth_mutex_unlock(p9srv.used_mtx);
+
+	uth_mutex_lock(p9srv.req_mtx);
+	for (pp = &p9srv.busy; *pp != req; pp = &(*pp)->next)
+		;
+	*pp = req->next;
+	req->next = p9srv.free_reqs;
+	p9srv.free_reqs = req;
+	uth_cond_var_broadcast(p9srv.done_cv);
+	uth_mutex_unlock(p9srv.req_mtx);
+}
+
+static void p9_worker(void *arg)
+{
+	struct p9_req *req;
+
+	for (;;) {
+		uth_mutex_lock(p9srv.req_mtx);
+		while (!p9srv.work)
+			uth_cond_var_wait(p9srv.req_cv, p9srv.req_mtx);
+		req = p9srv.work;
+		p9srv.work = req->next;
+		if (!p9srv.work)
+			p9srv.work_tail = &p9srv.work;
+		req->next = p9srv.busy;
+		p9srv.busy = req;
+		uth_mutex_unlock(p9srv.req_mtx);
+		p9_complete(req, p9_handle(req));
+	}
+}
+
+void p9_init_fn(struct virtual_machine *vm, struct virtio_vq_dev *vqdev,
+                const char *root, const char *tag)
+{
+	size_t tag_len = strlen(tag);
+	size_t cfg_sz = sizeof(struct virtio_9p_config) + tag_len;
+	struct virtio_9p_config *cfg = malloc(cfg_sz);
+	struct virtio_9p_config *cfg_d = malloc(cfg_sz);
+
+	if (!cfg || !cfg_d)
+		VIRTIO_DEV_ERRX(vqdev, "malloc returned null trying to allocate cfg");
+	cfg->tag_len = tag_len;
+	memcpy(cfg->tag, tag, tag_len);
+	memcpy(cfg_d, cfg, cfg_sz);
+	vqdev->cfg = cfg;
+	vqdev->cfg_d = cfg_d;
+	vqdev->cfg_sz = cfg_sz;
+
+	p9srv.vm = vm;
+	p9srv.root = realpath(root, NULL);
+	if (!p9srv.root)
+		VIRTIO_DEV_ERRX(vqdev, "Could not find 9p root %s", root);
+	p9srv.msize = P9_MAX_MSIZE;
+	p9srv.fid_mtx = uth_mutex_alloc();
+	p9srv.req_mtx = uth_mutex_alloc();
+	p9srv.req_cv = uth_cond_var_alloc();
+	p9srv.done_cv = uth_cond_var_alloc();
+	p9srv.used_mtx = uth_mutex_alloc();
+	p9srv.work_tail = &p9srv.work;
+}
+
+void p9_request(void *_vq)
+{
+	struct virtio_vq *vq = _vq;
+	struct virtio_mmio_dev *dev;
+	struct p9_req *req;
+	struct p9_iter it;
+	int nr = vq->qnum_max;
+
+	assert(vq != NULL);
+	dev = vq->vqdev->transport_dev;
+	if (vq->qready != 0x1)
+		VIRTIO_DEV_ERRX(vq->vqdev,
+		                "The service function for queue '%s' was launched before the driver set QueueReady to 0x1.",
+		                 vq->name);
+	if (!dev->poke_guest)
+		VIRTIO_DEV_ERRX(vq->vqdev,
+		                "The 'poke_guest' function pointer was not set.");
+
+	p9srv.vq = vq;
+	/* There can't be more requests than descriptors.  Each one's iov has room
+	 * for the descriptors, then scratch for a preadv or pwritev. */
+	for (int i = 0; i < nr; i++) {
+		req = malloc(sizeof(struct p9_req));
+		if (req)
+			req->iov = malloc(2 * nr * sizeof(struct iovec));
+		if (!req || !req->iov)
+			VIRTIO_DEV_ERRX(vq->vqdev,
+			                "malloc returned null trying to allocate 9p reqs.\n");
+		req->next = p9srv.free_reqs;
+		p9srv.free_reqs = req;
+	}
+	for (int i = 0; i < P9_NR_WORKERS; i++) {
+		if (!vmm_run_task(p9srv.vm, p9_worker, NULL))
+			VIRTIO_DEV_ERRX(vq->vqdev, "Could not start a 9p worker");
+	}
+
+	for (;;) {
+		uth_mutex_lock(p9srv.req_mtx);
+		req = p9srv.free_reqs;
+		assert(req);
+		p9srv.free_reqs = req->next;
+		uth_mutex_unlock(p9srv.req_mtx);
+
+		req->head = virtio_next_avail_vq_desc(vq, req->iov, &req->olen,
+		                                      &req->ilen);
+		/* The tag is the only thing we need before a worker gets it, so
+		 * that a Tflush can find the request. */
+		p9_iter_init(&it, req->iov, req->olen);
+		P9_GET(&it, uint32_t);
+		P9_GET(&it, uint8_t);
+		req->tag = P9_GET(&it, uint16_t);
+		if (it.err || !req->ilen)
+			VIRTIO_DRI_ERRX(vq->vqdev, "Short 9P request or no reply buffer");
+
+		uth_mutex_lock(p9srv.req_mtx);
+		req->next = NULL;
+		*p9srv.work_tail = req;
+		p9srv.work_tail = &req->next;
+		uth_cond_var_signal(p9srv.req_cv);
+		uth_mutex_unlock(p9srv.req_mtx);
+	}
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2016 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Virtio balloon.  Guest physical addresses are our virtual addresses, so
+ * giving a guest page back to the host is an madvise(MADV_DONTNEED) on it: the
+ * kernel frees the page, and if the guest touches it again, it faults in a
+ * fresh zeroed page.
+ *
+ * The host sets a target with balloon_set_target().  The guest inflates by
+ * handing us PFNs of pages it gave up, which we drop.  On deflate, it is about
+ * to reuse pages, so we populate them again to spare the guest the EPT faults.
+ * We don't offer VIRTIO_BALLOON_F_MUST_TELL_HOST: the guest may reuse a page
+ * before telling us, and all that costs is a fault.
+ *
+ * With VIRTIO_BALLOON_F_REPORTING, the guest also reports free pages, in
+ * large chunks, that it hasn't ballooned.  We drop those too.  The guest
+ * doesn't tell us when it reuses them; they fault back in. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <parlib/common.h>
+#include <parlib/assert.h>
+#include <ros/syscall.h>
+#include <vmm/virtio.h>
+#include <vmm/virtio_mmio.h>
+#include <vmm/virtio_balloon.h>
+
+#define BALLOON_PGSIZE			(1UL << VIRTIO_BALLOON_PFN_SHIFT)
+
+static void balloon_check_vq(struct virtio_vq *vq)
+{
+	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
+
+	if (vq->qready != 0x1)
+		VIRTIO_DEV_ERRX(vq->vqdev,
+		                "The service function for queue '%s' was launched before the driver set QueueReady to 0x1.",
+		                 vq->name);
+	if (!dev->poke_guest)
+		VIRTIO_DEV_ERRX(vq->vqdev,
+		                "The 'poke_guest' function pointer was not set.");
+}
+
+static void balloon_discard(struct virtio_vq *vq, uintptr_t gpa, size_t len)
+{
+	virtio_check_pointer(vq, gpa, len, __FILE__, __LINE__);
+	if (madvise((void*)gpa, len, MADV_DONTNEED))
+		VIRTIO_DRI_WARNX(vq->vqdev,
+		                 "Could not discard guest memory at 0x%lx+0x%lx: %r",
+		                 gpa, len);
+}
+
+static void balloon_populate(struct virtio_vq *vq, uintptr_t gpa, size_t len)
+{
+	virtio_check_pointer(vq, gpa, len, __FILE__, __LINE__);
+	/* Only a hint; anything we don't populate faults in later. */
+	ros_syscall(SYS_populate_va, gpa, len >> VIRTIO_BALLOON_PFN_SHIFT, 0, 0,
+	            0, 0);
+}
+
+/* The guest gives us arrays of 4K PFNs.  It gets them one at a time from its
+ * allocator, so runs of contiguous PFNs are common; we do each run at once. */
+static void balloon_do_pfns(struct virtio_vq *vq, struct iovec *iov,
+                            void (*fn)(struct virtio_vq *, uintptr_t, size_t))
+{
+	uint32_t *pfns = iov->iov_base;
+	size_t nr = iov->iov_len / sizeof(uint32_t);
+	uintptr_t start = 0, gpa;
+	size_t len = 0;
+
+	for (size_t i = 0; i < nr; i++) {
+		gpa = (uintptr_t)pfns[i] << VIRTIO_BALLOON_PFN_SHIFT;
+		if (len && (gpa == start + len)) {
+			len += BALLOON_PGSIZE;
+			continue;
+		}
+		if (len)
+			fn(vq, start, len);
+		start = gpa;
+		len = BALLOON_PGSIZE;
+	}
+	if (len)
+		fn(vq, start, len);
+}
+
+static void balloon_pfn_queue(struct virtio_vq *vq,
+                              void (*fn)(struct virtio_vq *, uintptr_t, size_t))
+{
+	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
+	struct iovec *iov;
+	uint32_t head, olen, ilen;
+
+	balloon_check_vq(vq);
+	iov = malloc(vq->qnum_max * sizeof(struct iovec));
+	assert(iov);
+	for (;;) {
+		head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
+		if (ilen)
+			VIRTIO_DRI_ERRX(vq->vqdev,
+			                "The driver gave us a device-writable buffer on '%s'.",
+			                vq->name);
+		for (int i = 0; i < olen; i++)
+			balloon_do_pfns(vq, &iov[i], fn);
+		virtio_add_used_desc(vq, head, 0);
+		if (virtio_vq_needs_irq(vq)) {
+			virtio_mmio_set_vring_irq(dev);
+			dev->poke_guest(dev->vec);
+		}
+	}
+}
+
+void balloon_inflateq_fn(void *_vq)
+{
+	balloon_pfn_queue(_vq, balloon_discard);
+}
+
+void balloon_deflateq_fn(void *_vq)
+{
+	balloon_pfn_queue(_vq, balloon_populate);
+}
+
+/* Each buffer is a scatterlist of free ranges, page aligned and usually a few
+ * MB each.  The driver hands them to us as device-writable, though we don't
+ * write anything. */
+void balloon_reportq_fn(void *_vq)
+{
+	struct virtio_vq *vq = _vq;
+	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
+	struct iovec *iov;
+	uint32_t head, olen, ilen;
+
+	balloon_check_vq(vq);
+	iov = malloc(vq->qnum_max * sizeof(struct iovec));
+	assert(iov);
+	for (;;) {
+		head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
+		for (int i = olen; i < olen + ilen; i++)
+			balloon_discard(vq, (uintptr_t)iov[i].iov_base, iov[i].iov_len);
+		virtio_add_used_desc(vq, head, 0);
+		if (virtio_vq_needs_irq(vq)) {
+			virtio_mmio_set_vring_irq(dev);
+			dev->poke_guest(dev->vec);
+		}
+	}
+}
+
+/* Asks the guest to have nr_pages 4K pages in the balloon.  The guest reports
+ * how many it has in the config's 'actual'. */
+void balloon_set_target(struct virtio_vq_dev *vqdev, uint32_t nr_pages)
+{
+	struct virtio_balloon_config *cfg = vqdev->cfg;
+	struct virtio_balloon_config *cfg_d = vqdev->cfg_d;
+	struct virtio_mmio_dev *dev = vqdev->transport_dev;
+
+	cfg->num_pages = nr_pages;
+	/* A device reset puts cfg back to cfg_d; keep the target. */
+	cfg_d->num_pages = nr_pages;
+	if (!vqdev->dri_feat)
+		return;
+	dev->cfg_gen++;
+	virtio_mmio_set_cfg_irq(dev);
+	dev->poke_guest(dev->vec);
+}
@@ -4,7 +4,11 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <parlib/common.h>
+#include <parlib/uaio.h>
 #include <vmm/virtio.h>
 #include <vmm/virtio_blk.h>
 #include <vmm/virtio_mmio.h>
@@ -21,7 +25,45 @@ int debug_virtio_blk;
 /* TODO(ganshun): multiple disks */
 static int diskfd;
 
-void blk_init_fn(struct virtio_vq_dev *vqdev, const char *filename)
+/* Each queue is served by its own thread, which keeps up to a queue's worth of
+ * requests in flight with async syscalls.  Every pass, it takes what the driver
+ * has made available, merging requests for adjacent sectors into one preadv or
+ * pwritev, then waits for something to finish.  Whatever has finished by then
+ * goes into the used ring, and the guest gets one interrupt for the lot.  We
+ * only wait on the eventfd when nothing is in flight; otherwise, we look for
+ * new requests after each round of completions, so the driver doesn't need to
+ * kick us. */
+struct blk_req {
+	uint32_t					head;
+	uint8_t						*status;
+	size_t						len;
+	struct blk_req				*next;
+};
+
+struct blk_op {
+	struct uaio_future			fut;
+	uint32_t					type;
+	uint64_t					sector;
+	size_t						len;
+	int							iovcnt;
+	struct iovec				*iov;
+	struct blk_req				*reqs;
+	struct blk_req				**tail;
+	struct blk_op				*next_free;
+};
+
+struct blk_queue {
+	struct virtio_vq			*vq;
+	struct uaio_group			grp;
+	struct iovec				*iov;		/* scratch, for one chain */
+	struct blk_req				*reqs;		/* indexed by head */
+	struct blk_op				*ops;
+	struct blk_op				*free_ops;
+	struct blk_op				*cur;		/* still taking merges */
+};
+
+void blk_init_fn(struct virtio_vq_dev *vqdev, const char *filename,
+                 int nr_queues)
 {
 	struct virtio_blk_config *cfg = vqdev->cfg;
 	struct virtio_blk_config *cfg_d = vqdev->cfg_d;
@@ -38,6 +80,145 @@ void blk_init_fn(struct virtio_vq_dev *vqdev, const char *filename)
 
 	cfg->capacity = len;
 	cfg_d->capacity = len;
+
+	nr_queues = MAX(1, MIN(nr_queues, VIRTIO_BLK_MAX_QUEUES));
+	for (int i = 0; i < nr_queues; i++) {
+		vqdev->vqs[i].name = "blk_request";
+		vqdev->vqs[i].srv_fn = blk_request;
+	}
+	vqdev->num_vqs = nr_queues;
+	cfg->num_queues = nr_queues;
+	cfg_d->num_queues = nr_queues;
+}
+
+static struct blk_queue *blk_queue_init(struct virtio_vq *vq)
+{
+	struct blk_queue *bq = calloc(1, sizeof(struct blk_queue));
+	int nr = vq->qnum_max;
+
+	assert(bq);
+	bq->vq = vq;
+	uaio_group_init(&bq->grp);
+	bq->iov = malloc(nr * sizeof(struct iovec));
+	bq->reqs = malloc(nr * sizeof(struct blk_req));
+	bq->ops = malloc(nr * sizeof(struct blk_op));
+	if (!bq->iov || !bq->reqs || !bq->ops)
+		VIRTIO_DEV_ERRX(vq->vqdev,
+		                "malloc returned null trying to allocate blk queue.\n");
+	/* Every descriptor in flight is in at most one op, so an op never needs
+	 * more iovecs than the queue has descriptors. */
+	for (int i = 0; i < nr; i++) {
+		bq->ops[i].iov = malloc(nr * sizeof(struct iovec));
+		if (!bq->ops[i].iov)
+			VIRTIO_DEV_ERRX(vq->vqdev,
+			                "malloc returned null trying to allocate iov.\n");
+		bq->ops[i].next_free = bq->free_ops;
+		bq->free_ops = &bq->ops[i];
+	}
+	return bq;
+}
+
+static void blk_submit(struct blk_queue *bq)
+{
+	struct blk_op *op = bq->cur;
+
+	if (!op)
+		return;
+	bq->cur = NULL;
+	uaio_submit(&bq->grp, &op->fut,
+	            op->type == VIRTIO_BLK_T_OUT ? SYS_pwritev : SYS_preadv,
+	            diskfd, (long)op->iov, op->iovcnt, op->sector * 512, 0, 0);
+}
+
+/* Pulls one chain off the vq and adds it to bq->cur, or to a new op.  Requests
+ * we can't do finish right away; returns TRUE if so. */
+static bool blk_take_req(struct blk_queue *bq)
+{
+	struct virtio_vq *vq = bq->vq;
+	struct virtio_blk_config *cfg = vq->vqdev->cfg;
+	struct iovec *iov = bq->iov;
+	struct virtio_blk_outhdr *out;
+	struct blk_req *req;
+	struct blk_op *op;
+	uint32_t head, olen, ilen;
+	int iovcnt;
+	size_t len = 0;
+
+	head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
+	/* The header comes first, and the status byte is the last byte of the
+	 * chain.  The data is everything in between. */
+	if (olen < 1 || ilen < 1 || head >= vq->qnum_max)
+		VIRTIO_DRI_ERRX(vq->vqdev, "Bad blk request layout\n");
+	req = &bq->reqs[head];
+	req->head = head;
+	req->next = NULL;
+	req->status = iov[olen + ilen - 1].iov_base +
+	              iov[olen + ilen - 1].iov_len - 1;
+	iov[olen + ilen - 1].iov_len--;
+	iovcnt = olen + ilen - 1;
+	out = iov[0].iov_base;
+	if (out->type & VIRTIO_BLK_T_FLUSH)
+		VIRTIO_DEV_ERRX(vq->vqdev, "Flush not supported.\n");
+	for (int i = 1; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	req->len = len;
+
+	if (out->type != VIRTIO_BLK_T_IN && out->type != VIRTIO_BLK_T_OUT) {
+		*req->status = VIRTIO_BLK_S_UNSUPP;
+		virtio_add_used_desc(vq, head, sizeof(uint8_t));
+		return TRUE;
+	}
+	if (out->sector * 512 + len > cfg->capacity * 512) {
+		*req->status = VIRTIO_BLK_S_IOERR;
+		virtio_add_used_desc(vq, head, sizeof(uint8_t));
+		return TRUE;
+	}
+	op = bq->cur;
+	if (!(op && op->type == out->type && !(op->len % 512) &&
+	      op->sector + op->len / 512 == out->sector &&
+	      op->iovcnt + iovcnt - 1 <= vq->qnum_max)) {
+		blk_submit(bq);
+		op = bq->free_ops;
+		assert(op);
+		bq->free_ops = op->next_free;
+		op->type = out->type;
+		op->sector = out->sector;
+		op->len = 0;
+		op->iovcnt = 0;
+		op->reqs = NULL;
+		op->tail = &op->reqs;
+		bq->cur = op;
+	}
+	memcpy(&op->iov[op->iovcnt], &iov[1], (iovcnt - 1) * sizeof(struct iovec));
+	op->iovcnt += iovcnt - 1;
+	op->len += len;
+	*op->tail = req;
+	op->tail = &req->next;
+	return FALSE;
+}
+
+/* Fills in the used ring for everything in op, then recycles op. */
+static void blk_complete(struct blk_queue *bq, struct blk_op *op)
+{
+	long ret = uaio_result(&op->fut);
+	bool ok = ret == op->len;
+
+	DPRINTF("%s %lu bytes at sector %llu: %ld\n",
+	        op->type == VIRTIO_BLK_T_IN ? "read" : "write", op->len,
+	        op->sector, ret);
+	for (struct blk_req *req = op->reqs; req; req = req->next) {
+		*req->status = ok ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+		virtio_add_used_desc(bq->vq, req->head, sizeof(uint8_t) +
+		                     (ok && op->type == VIRTIO_BLK_T_IN ? req->len
+		                                                        : 0));
+	}
+	op->next_free = bq->free_ops;
+	bq->free_ops = op;
+}
+
+static bool blk_has_avail(struct virtio_vq *vq)
+{
+	return vq->last_avail != ACCESS_ONCE(vq->vring.avail->idx);
 }
 
 void blk_request(void *_vq)
@@ -47,15 +228,9 @@ void blk_request(void *_vq)
 	assert(vq != NULL);
 
 	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
-	struct iovec *iov;
-	uint32_t head;
-	uint32_t olen, ilen;
-	struct virtio_blk_outhdr *out;
-	uint64_t offset;
-	int64_t ret;
-	size_t wlen;
-	uint8_t *status;
-	struct virtio_blk_config *cfg = vq->vqdev->cfg;
+	struct blk_queue *bq;
+	struct uaio_future *fut;
+	bool used;
 
 	if (vq->qready != 0x1)
 		VIRTIO_DEV_ERRX(vq->vqdev,
@@ -66,71 +241,25 @@ void blk_request(void *_vq)
 		VIRTIO_DEV_ERRX(vq->vqdev,
 		                "The 'poke_guest' function pointer was not set.");
 
-	iov = malloc(vq->qnum_max * sizeof(struct iovec));
-	if (iov == NULL)
-		VIRTIO_DEV_ERRX(vq->vqdev,
-		                "malloc returned null trying to allocate iov.\n");
-
+	bq = blk_queue_init(vq);
 	for (;;) {
-		head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
-		/* There are always three iovecs.
-		 * The first is the header.
-		 * The second is the actual data.
-		 * The third contains just the status byte.
-		 */
-
-		status = iov[2].iov_base;
-		if (!status)
-			VIRTIO_DEV_ERRX(vq->vqdev, "no room for status\n");
-
-		out = iov[0].iov_base;
-		if (out->type & VIRTIO_BLK_T_FLUSH)
-			VIRTIO_DEV_ERRX(vq->vqdev, "Flush not supported.\n");
-
-		offset = out->sector * 512;
-		if (lseek64(diskfd, offset, SEEK_SET) != offset)
-			VIRTIO_DEV_ERRX(vq->vqdev, "Bad seek at sector %llu\n",
-			                out->sector);
-
-		if (out->type & VIRTIO_BLK_T_OUT) {
-
-			if ((offset + iov[1].iov_len) > (cfg->capacity * 512))
-				VIRTIO_DEV_ERRX(vq->vqdev, "write past end of file!\n");
-
-			ret = writev(diskfd, &iov[1], 1);
-
-			if (ret >= 0 && ret == iov[1].iov_len)
-				*status = VIRTIO_BLK_S_OK;
-			else
-				*status = VIRTIO_BLK_S_IOERR;
-			wlen = sizeof(*status);
-		} else {
-			ret = readv(diskfd, &iov[1], 1);
-			if (ret >= 0) {
-				wlen = sizeof(*status) + ret;
-				*status = VIRTIO_BLK_S_OK;
-			} else {
-				wlen = sizeof(*status);
-				*status = VIRTIO_BLK_S_IOERR;
-			}
-
-			// Hexdump for debugging.
-			if (debug_virtio_blk && ret >= 0) {
-				char *pf = "";
-
-				for (int i = 0; i < iov[olen].iov_len; i += 2) {
-					uint8_t *p = (uint8_t *)iov[olen].iov_base + i;
-
-					fprintf(stderr, "%s%02x", pf, *(p + 1));
-					fprintf(stderr, "%02x", *p);
-					fprintf(stderr, " ");
-					pf = ((i + 2) % 16) ? " " : "\n";
-				}
-			}
+		used = FALSE;
+		/* With nothing in flight, it's OK to block for the next request */
+		if (!bq->grp.nr_inflight)
+			used |= blk_take_req(bq);
+		while (blk_has_avail(vq))
+			used |= blk_take_req(bq);
+		blk_submit(bq);
+		if (bq->grp.nr_inflight) {
+			fut = uaio_wait_any(&bq->grp);
+			do {
+				blk_complete(bq, container_of(fut, struct blk_op, fut));
+				used = TRUE;
+			} while ((fut = uaio_poll(&bq->grp)));
+		}
+		if (used && virtio_vq_needs_irq(vq)) {
+			virtio_mmio_set_vring_irq(dev);
+			dev->poke_guest(dev->vec);
 		}
-
-		virtio_add_used_desc(vq, head, wlen);
-		virtio_mmio_set_vring_irq(dev);
-		dev->poke_guest(dev->vec);
 	}
 }
@@ -85,8 +85,10 @@ void cons_receiveq_fn(void *_vq) // host -> guest
 		// You pass the number of bytes written to virtio_add_used_desc
 		virtio_add_used_desc(vq, head, num_read);
 
-		// Poke the guest however the mmio transport prefers
+		// Poke the guest however the mmio transport prefers, if it wants
 		// NOTE: assuming that the mmio transport was used for now.
+		if (!virtio_vq_needs_irq(vq))
+			continue;
 		virtio_mmio_set_vring_irq(dev);
 		if (dev->poke_guest)
 			dev->poke_guest(dev->vec);
@@ -146,8 +148,10 @@ void cons_transmitq_fn(void *_vq) // guest -> host
 		// Pass 0 because we wrote nothing.
 		virtio_add_used_desc(vq, head, 0);
 
-		// Poke the guest however the mmio transport prefers
+		// Poke the guest however the mmio transport prefers, if it wants
 		// NOTE: assuming that the mmio transport was used for now
+		if (!virtio_vq_needs_irq(vq))
+			continue;
 		virtio_mmio_set_vring_irq(dev);
 		if (dev->poke_guest)
 			dev->poke_guest(dev->vec);
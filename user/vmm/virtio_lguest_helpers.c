@@ -130,6 +130,26 @@ void virtio_add_used_desc(struct virtio_vq *vq, uint32_t head, uint32_t len)
 	vq->vring.used->idx++;
 }
 
+// Not from lguest.  The driver tells us which used entries it wants to hear
+// about: with VIRTIO_RING_F_EVENT_IDX, it's the used_event idx, otherwise it
+// can set NO_INTERRUPT, e.g. while it polls the used ring.  Call this once
+// you've added a batch of used descriptors, and interrupt the guest only if it
+// says so.
+// virtio-v1.0-cs04 s2.4.7.2 Used Buffer Notification Suppression
+bool virtio_vq_needs_irq(struct virtio_vq *vq)
+{
+	uint16_t old = vq->last_irq_used;
+	uint16_t new = vq->vring.used->idx;
+
+	// The driver writes used_event and then rereads used->idx, so we need to
+	// have published idx before we read used_event.
+	wrmb();
+	vq->last_irq_used = new;
+	if (vq->vqdev->dri_feat & (1ULL << VIRTIO_RING_F_EVENT_IDX))
+		return vring_need_event(vring_used_event(&vq->vring), new, old);
+	return !(vq->vring.avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+}
+
 // Based on wait_for_vq_desc in Linux's'lguest.c, which came with
 // the following comment:
 /*
@@ -162,6 +182,12 @@ uint32_t virtio_next_avail_vq_desc(struct virtio_vq *vq, struct iovec iov[],
 		// that we want a notification when it adds new buffers for
 		// us to process.
 		vq->vring.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+		// With VIRTIO_RING_F_EVENT_IDX, the driver ignores the flag and
+		// kicks when avail->idx moves past avail_event, so we ask for a kick
+		// for the next buffer.  While we're busy, we leave avail_event
+		// behind, so the driver doesn't kick us for buffers we'd find anyway.
+		if (vq->vqdev->dri_feat & (1ULL << VIRTIO_RING_F_EVENT_IDX))
+			vring_avail_event(&vq->vring) = vq->last_avail;
 
 		// If the guest added an available buffer while we were unsetting
 		// the VRING_USED_F_NO_NOTIFY flag, we'll break out here and process
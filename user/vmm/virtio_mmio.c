@@ -127,6 +127,7 @@ static void virtio_mmio_reset(struct virtio_mmio_dev *mmio_dev)
 
 		mmio_dev->vqdev->vqs[i].qready = 0;
 		mmio_dev->vqdev->vqs[i].last_avail = 0;
+		mmio_dev->vqdev->vqs[i].last_irq_used = 0;
 	}
 
 	virtio_mmio_reset_cfg(mmio_dev);
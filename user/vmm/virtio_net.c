@@ -29,20 +29,82 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <string.h>
+#include <parlib/common.h>
+#include <parlib/uthread.h>
+#include <parlib/event.h>
+#include <parlib/arch/atomic.h>
+#include <sys/syscall.h>
+#include <ros/vmm.h>
 #include <vmm/virtio.h>
 #include <vmm/virtio_mmio.h>
 #include <vmm/virtio_net.h>
 
 #define VIRTIO_HEADER_SIZE	12
 
+/* The #ether conversation is in batch mode (see netif.c): each read or write
+ * on the data file carries many frames, each prefixed by a 2 byte big-endian
+ * length.  Each queue's worker moves up to NET_BATCH_SZ per syscall.
+ *
+ * It's also in vnethdr mode, so each frame comes after a virtio_net_hdr_v1,
+ * the same one the guest's buffers start with.  That's how the guest's
+ * checksum offload and TSO requests get to #ether, which hands them to the NIC
+ * or does them in software, and how the guest hears which checksums the NIC
+ * checked.  A record, header and all, is at most NET_MAX_REC. */
+#define NET_BATCH_HDR		2
+#define NET_BATCH_SZ		(256 * 1024)
+#define NET_MAX_REC			0xffff
+
+#define NET_OFFLOAD_FEAT	(1ULL << VIRTIO_NET_F_CSUM | \
+                             1ULL << VIRTIO_NET_F_GUEST_CSUM | \
+                             1ULL << VIRTIO_NET_F_HOST_TSO4 | \
+                             1ULL << VIRTIO_NET_F_HOST_TSO6 | \
+                             1ULL << VIRTIO_NET_F_MRG_RXBUF)
+
 static int ctlfd;
 static int etherfd;
 static char data_path[128];
 static char clone_path[64];
 
-void net_init_fn(struct virtio_vq_dev *vqdev, int nic)
+/* Every queue pair shares the one conversation, so each incoming frame goes to
+ * whichever receiveq worker reads it first.  Only the first nr_active_pairs
+ * pairs get used; the driver changes that with VIRTIO_NET_CTRL_MQ. */
+static unsigned int nr_active_pairs = 1;
+static uth_mutex_t active_mtx;
+static uth_cond_var_t active_cv;
+
+/* #ether cuts up TCP/IPv4 for TSO if the NIC can't, but only a NIC with TSO
+ * can take TCP/IPv6. */
+static bool nic_has_tso(int nic)
+{
+	char path[32];
+	char buf[512];
+	char *feat, *eol;
+	int fd, n;
+
+	snprintf(path, sizeof(path), "/net/ether%d/stats", nic);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return FALSE;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return FALSE;
+	buf[n] = 0;
+	feat = strstr(buf, "feat: ");
+	if (!feat)
+		return FALSE;
+	eol = strchr(feat, '\n');
+	if (eol)
+		*eol = 0;
+	return strstr(feat, "tso") != NULL;
+}
+
+void net_init_fn(struct virtio_vq_dev *vqdev, int nic, int nr_qpairs)
 {
 	char type[] = "connect -1";
+	char batch[] = "batch";
+	char vnethdr[] = "vnethdr";
 	char buf[8];
 	char addr_path[32];
 	char addr_buf[3];
@@ -51,6 +113,25 @@ void net_init_fn(struct virtio_vq_dev *vqdev, int nic)
 	int num_read;
 	int total_read = 0;
 
+	/* Queues 2N and 2N + 1 are pair N's receiveq and transmitq.  The
+	 * controlq comes after all of the pairs. */
+	nr_qpairs = MAX(1, MIN(nr_qpairs, VIRTIO_NET_MAX_QPAIRS));
+	for (int i = 0; i < nr_qpairs; i++) {
+		vqdev->vqs[2 * i].name = "net_receiveq";
+		vqdev->vqs[2 * i].srv_fn = net_receiveq_fn;
+		vqdev->vqs[2 * i + 1].name = "net_transmitq";
+		vqdev->vqs[2 * i + 1].srv_fn = net_transmitq_fn;
+	}
+	vqdev->vqs[2 * nr_qpairs].name = "net_controlq";
+	vqdev->vqs[2 * nr_qpairs].srv_fn = net_controlq_fn;
+	vqdev->num_vqs = 2 * nr_qpairs + 1;
+	((struct virtio_net_config *)(vqdev->cfg))->max_virtqueue_pairs =
+		nr_qpairs;
+	((struct virtio_net_config *)(vqdev->cfg_d))->max_virtqueue_pairs =
+		nr_qpairs;
+	active_mtx = uth_mutex_alloc();
+	active_cv = uth_cond_var_alloc();
+
 	snprintf(addr_path, sizeof(addr_path), "/net/ether%d/addr", nic);
 	addr_fd = open(addr_path, O_RDONLY);
 	if (addr_fd < 0)
@@ -83,84 +164,324 @@ void net_init_fn(struct virtio_vq_dev *vqdev, int nic)
 
 	if (write(ctlfd, type, sizeof(type)) != sizeof(type))
 		VIRTIO_DEV_ERRX(vqdev, "write to ctlfd failed");
+	if (write(ctlfd, batch, sizeof(batch)) != sizeof(batch))
+		VIRTIO_DEV_ERRX(vqdev, "could not put the conversation in batch mode");
+	if (write(ctlfd, vnethdr, sizeof(vnethdr)) != sizeof(vnethdr))
+		VIRTIO_DEV_ERRX(vqdev, "could not turn on the conversation's vnethdr");
+	vqdev->dev_feat |= NET_OFFLOAD_FEAT;
+	if (!nic_has_tso(nic))
+		vqdev->dev_feat &= ~(1ULL << VIRTIO_NET_F_HOST_TSO6);
 }
 
-/* net_receiveq_fn receives packets for the guest through the virtio networking
- * device and the _vq virtio queue.
- */
-void net_receiveq_fn(void *_vq)
+/* With vhost, the kernel runs the receiveq and transmitq; see vhost_net.c in
+ * the kernel.  It does one pair, no controlq and no offloads.  Call this after
+ * net_init_fn(). */
+void net_use_vhost(struct virtio_vq_dev *vqdev)
 {
-	struct virtio_vq *vq = _vq;
-	uint32_t head;
-	uint32_t olen, ilen;
-	int num_read;
-	struct iovec *iov;
-	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
-	int fd;
-	struct virtio_net_hdr_v1 *net_header;
+	char vnethdr_off[] = "vnethdr off";
 
-	fd = open(data_path, O_RDWR);
-	if (fd == -1)
-		VIRTIO_DEV_ERRX(vq->vqdev, "Could not open data file for ether1.");
+	if (write(ctlfd, vnethdr_off, sizeof(vnethdr_off)) != sizeof(vnethdr_off))
+		VIRTIO_DEV_ERRX(vqdev, "could not turn off the conversation's vnethdr");
+	/* vhost_net doesn't do EVENT_IDX; it polls while it has work anyway. */
+	vqdev->dev_feat &= ~(1ULL << VIRTIO_NET_F_CTRL_VQ |
+	                     1ULL << VIRTIO_NET_F_MQ |
+	                     1ULL << VIRTIO_RING_F_EVENT_IDX |
+	                     NET_OFFLOAD_FEAT);
+	vqdev->vqs[0].srv_fn = net_vhost_fn;
+	vqdev->vqs[1].srv_fn = net_vhost_fn;
+	vqdev->num_vqs = 2;
+	((struct virtio_net_config *)(vqdev->cfg))->max_virtqueue_pairs = 1;
+	((struct virtio_net_config *)(vqdev->cfg_d))->max_virtqueue_pairs = 1;
+}
 
-	if (!vq)
-		VIRTIO_DEV_ERRX(vq->vqdev,
-			"\n  %s:%d\n"
-			"  Virtio device: (not sure which one): Error, device behavior.\n"
-			"  The device must provide a valid virtio_vq as an argument to %s."
-			, __FILE__, __LINE__, __func__);
+static unsigned int net_vq_idx(struct virtio_vq *vq)
+{
+	return vq - vq->vqdev->vqs;
+}
+
+/* The controlq is queue 2 if the driver didn't take VIRTIO_NET_F_MQ. */
+static bool net_vq_is_ctrl(struct virtio_vq *vq)
+{
+	struct virtio_vq_dev *vqdev = vq->vqdev;
+
+	if (!(vqdev->dri_feat & (1ULL << VIRTIO_NET_F_CTRL_VQ)))
+		return FALSE;
+	if (vqdev->dri_feat & (1ULL << VIRTIO_NET_F_MQ))
+		return net_vq_idx(vq) == vqdev->num_vqs - 1;
+	return net_vq_idx(vq) == 2;
+}
+
+static bool net_vq_has_avail(struct virtio_vq *vq)
+{
+	return vq->last_avail != ACCESS_ONCE(vq->vring.avail->idx);
+}
+
+/* Blocks until vq's pair is one the driver is using. */
+static void net_wait_active(struct virtio_vq *vq)
+{
+	unsigned int pair = net_vq_idx(vq) / 2;
+
+	if (pair < ACCESS_ONCE(nr_active_pairs))
+		return;
+	uth_mutex_lock(active_mtx);
+	while (pair >= nr_active_pairs)
+		uth_cond_var_wait(active_cv, active_mtx);
+	uth_mutex_unlock(active_mtx);
+}
+
+/* Copies up to len bytes out of iov, skipping the first skip bytes. */
+static size_t iov_to_buf(struct iovec *iov, int iovcnt, size_t skip,
+                         uint8_t *buf, size_t len)
+{
+	size_t done = 0, amt;
+
+	for (int i = 0; i < iovcnt && done < len; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		amt = MIN(iov[i].iov_len - skip, len - done);
+		memcpy(buf + done, iov[i].iov_base + skip, amt);
+		done += amt;
+		skip = 0;
+	}
+	return done;
+}
+
+static size_t iov_len(struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+static size_t buf_to_iov(uint8_t *buf, size_t len, struct iovec *iov,
+                         int iovcnt)
+{
+	size_t done = 0, amt;
+
+	for (int i = 0; i < iovcnt && done < len; i++) {
+		amt = MIN(iov[i].iov_len, len - done);
+		memcpy(iov[i].iov_base, buf + done, amt);
+		done += amt;
+	}
+	return done;
+}
+
+static struct iovec *net_srv_init(struct virtio_vq *vq)
+{
+	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
+	struct iovec *iov;
 
 	if (vq->qready == 0x0)
 		VIRTIO_DEV_ERRX(vq->vqdev,
 			"The service function for queue '%s' was launched before the driver set QueueReady to 0x1.",
 			vq->name);
-
+	if (!dev->poke_guest)
+		VIRTIO_DEV_ERRX(vq->vqdev,
+		                "The 'poke_guest' function pointer was not set.");
 	iov = malloc(vq->qnum_max * sizeof(struct iovec));
 	assert(iov != NULL);
+	return iov;
+}
 
-	if (!dev->poke_guest) {
-		free(iov);
-		VIRTIO_DEV_ERRX(vq->vqdev,
-		                "The 'poke_guest' function pointer was not set.");
+/* Both vhost queues run this once the driver sets QueueReady.  The second one
+ * hands the pair to the kernel, then sticks around to inject the IRQs the
+ * kernel can't: those for guest pcores that aren't running, maybe halted.
+ *
+ * Once the kernel has the queues, it sees every kick first.  The ones it can't
+ * finish for us still get to the queues' eventfds, which no one reads. */
+void net_vhost_fn(void *_vq)
+{
+	static atomic_t nr_ready;
+	struct virtio_vq *vq = _vq;
+	struct virtio_vq_dev *vqdev = vq->vqdev;
+	struct virtio_mmio_dev *dev = vqdev->transport_dev;
+	struct vmm_vhost_net_init init = {0};
+	struct event_queue *evq;
+	struct event_msg msg;
+	struct vring *vr;
+
+	if (atomic_fetch_and_add(&nr_ready, 1) != 1)
+		return;
+	evq = get_eventq(EV_MBOX_UCQ);
+	evq->ev_flags = EVENT_INDIR | EVENT_SPAM_INDIR | EVENT_WAKEUP;
+	evq_attach_wakeup_ctlr(evq);
+
+	init.mmio_addr = dev->addr;
+	init.isr = &dev->isr;
+	init.data_fd = open(data_path, O_RDWR);
+	if (init.data_fd == -1)
+		VIRTIO_DEV_ERRX(vqdev, "Could not open data file for ether1.");
+	init.gpcoreid = 0;
+	init.vector = dev->vec;
+	init.ev_q = evq;
+	for (int i = 0; i < 2; i++) {
+		vr = &vqdev->vqs[i].vring;
+		init.vrings[i].desc = (uint64_t)vr->desc;
+		init.vrings[i].avail = (uint64_t)vr->avail;
+		init.vrings[i].used = (uint64_t)vr->used;
+		init.vrings[i].num = vr->num;
+	}
+	if (ros_syscall(SYS_vmm_vhost_net, &init, 0, 0, 0, 0, 0))
+		VIRTIO_DEV_ERRX(vqdev, "SYS_vmm_vhost_net failed: %r");
+
+	for (;;) {
+		uth_blockon_evqs(&msg, NULL, 1, evq);
+		dev->poke_guest(msg.ev_arg2);
 	}
+}
+
+/* net_controlq_fn handles the driver's commands on the control queue.  The
+ * only one we support is setting the number of queue pairs. */
+void net_controlq_fn(void *_vq)
+{
+	struct virtio_vq *vq = _vq;
+	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
+	struct virtio_net_config *cfg = vq->vqdev->cfg;
+	uint32_t head;
+	uint32_t olen, ilen;
+	struct iovec *iov = net_srv_init(vq);
+	struct {
+		struct virtio_net_ctrl_hdr hdr;
+		struct virtio_net_ctrl_mq mq;
+	} __attribute__((packed)) cmd;
+	size_t len;
+	virtio_net_ctrl_ack ack;
 
 	for (;;) {
 		head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
+		if (!olen || !ilen)
+			VIRTIO_DRI_ERRX(vq->vqdev,
+				"Control commands need a header and an ack.\n"
+				"  See virtio-v1.0-cs04 s5.1.6.5 Control Virtqueue");
+		len = iov_to_buf(iov, olen, 0, (uint8_t*)&cmd, sizeof(cmd));
+		ack = VIRTIO_NET_ERR;
+		if (len == sizeof(cmd) && cmd.hdr.class == VIRTIO_NET_CTRL_MQ &&
+		    cmd.hdr.cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET &&
+		    cmd.mq.virtqueue_pairs >= VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN &&
+		    cmd.mq.virtqueue_pairs <= cfg->max_virtqueue_pairs) {
+			uth_mutex_lock(active_mtx);
+			nr_active_pairs = cmd.mq.virtqueue_pairs;
+			uth_cond_var_broadcast(active_cv);
+			uth_mutex_unlock(active_mtx);
+			ack = VIRTIO_NET_OK;
+		}
+		/* The ack goes in the last device-writable byte */
+		*(virtio_net_ctrl_ack*)(iov[olen + ilen - 1].iov_base +
+		                        iov[olen + ilen - 1].iov_len -
+		                        sizeof(ack)) = ack;
+		virtio_add_used_desc(vq, head, sizeof(ack));
+
+		if (virtio_vq_needs_irq(vq)) {
+			virtio_mmio_set_vring_irq(dev);
+			dev->poke_guest(dev->vec);
+		}
+	}
+}
+
+/* Gives the guest one record from #ether: the header, then the frame, laid
+ * over the guest's buffers in order.  With VIRTIO_NET_F_MRG_RXBUF, a frame
+ * that doesn't fit in one buffer goes on into more of them, up to one per
+ * descriptor, and num_buffers says how many.  Otherwise we cut it short.  The
+ * driver can't see the first buffer until the header is done, so heads and
+ * lens hold the used entries until then.
+ *
+ * See virtio-v1.0-cs04 s5.1.6.3.2 and s5.1.6.4 for the device requirements.
+ */
+static void net_rx_rec(struct virtio_vq *vq, struct iovec *iov, uint8_t *rec,
+                       size_t len, uint32_t *heads, uint32_t *lens)
+{
+	uint64_t feat = vq->vqdev->dri_feat;
+	bool mrg = feat & (1ULL << VIRTIO_NET_F_MRG_RXBUF);
+	struct virtio_net_hdr_v1 *net_header = NULL;
+	uint32_t olen, ilen;
+	size_t done = 0;
+	int nr = 0;
+
+	do {
+		heads[nr] = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
 		if (olen) {
 			free(iov);
 			VIRTIO_DRI_ERRX(vq->vqdev,
 				"The driver placed a device-readable buffer in the net device's receiveq.\n"
 				"  See virtio-v1.0-cs04 s5.3.6.1 Device Operation");
 		}
+		if (!nr) {
+			if (!ilen || iov[0].iov_len < VIRTIO_HEADER_SIZE)
+				VIRTIO_DRI_ERRX(vq->vqdev,
+					"The net device's header must fit in the first receive buffer.");
+			net_header = iov[0].iov_base;
+		}
+		lens[nr] = buf_to_iov(rec + done, len - done, iov, ilen);
+		done += lens[nr++];
+	} while (mrg && done < len && nr < vq->qnum_max);
+
+	net_header->num_buffers = nr;
+	if (!(feat & (1ULL << VIRTIO_NET_F_GUEST_CSUM)))
+		net_header->flags = 0;
+	for (int i = 0; i < nr; i++)
+		virtio_add_used_desc(vq, heads[i], lens[i]);
+}
 
-		/* For receive the virtio header is in iov[0], so we only want
-		 * the packet to be read into iov[1] and above.
-		 */
-		num_read = readv(fd, iov + 1, ilen - 1);
+/* net_receiveq_fn receives packets for the guest through the virtio networking
+ * device and the _vq virtio queue.  Each read gets a batch of frames, which we
+ * hand to the guest before we interrupt it once.
+ */
+void net_receiveq_fn(void *_vq)
+{
+	struct virtio_vq *vq = _vq;
+	int num_read, len;
+	struct iovec *iov;
+	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
+	int fd;
+	uint8_t *batch;
+	uint32_t *heads, *lens;
+
+	if (net_vq_is_ctrl(vq)) {
+		net_controlq_fn(vq);
+		return;
+	}
+	iov = net_srv_init(vq);
+	batch = malloc(NET_BATCH_SZ);
+	heads = malloc(vq->qnum_max * sizeof(uint32_t));
+	lens = malloc(vq->qnum_max * sizeof(uint32_t));
+	assert(batch && heads && lens);
+	fd = open(data_path, O_RDWR);
+	if (fd == -1)
+		VIRTIO_DEV_ERRX(vq->vqdev, "Could not open data file for ether1.");
+
+	for (;;) {
+		net_wait_active(vq);
+		num_read = read(fd, batch, NET_BATCH_SZ);
 		if (num_read < 0) {
 			free(iov);
 			VIRTIO_DEV_ERRX(vq->vqdev,
 				"Encountered an error trying to read input from the ethernet device.");
 		}
+		for (int off = 0; num_read - off >= NET_BATCH_HDR;
+		     off += NET_BATCH_HDR + len) {
+			len = batch[off] << 8 | batch[off + 1];
+			if (len > num_read - off - NET_BATCH_HDR)
+				break;
+			if (len < VIRTIO_HEADER_SIZE)
+				continue;
+			net_rx_rec(vq, iov, batch + off + NET_BATCH_HDR, len, heads,
+			           lens);
+		}
 
-		/* See virtio spec virtio-v1.0-cs04 s5.1.6.3.2 Device Requirements:
-		 * Setting Up Receive Buffers
-		 *
-		 * VIRTIO_NET_F_MRG_RXBUF is not currently negotiated.
-		 * num_buffers will always be 1 if VIRTIO_NET_F_MRG_RXBUF is not
-		 * negotiated.
-		 */
-		net_header = iov[0].iov_base;
-		net_header->num_buffers = 1;
-		virtio_add_used_desc(vq, head, num_read + VIRTIO_HEADER_SIZE);
-
-		virtio_mmio_set_vring_irq(dev);
-		dev->poke_guest(dev->vec);
+		if (virtio_vq_needs_irq(vq)) {
+			virtio_mmio_set_vring_irq(dev);
+			dev->poke_guest(dev->vec);
+		}
 	}
 }
 
 /* net_transmitq_fn transmits packets from the guest through the virtio
- * networking device through the _vq virtio queue.
+ * networking device through the _vq virtio queue.  We gather whatever the
+ * guest has queued into one batch, so it costs one write and one interrupt.
  */
 void net_transmitq_fn(void *_vq)
 {
@@ -169,44 +490,51 @@ void net_transmitq_fn(void *_vq)
 	uint32_t olen, ilen;
 	struct iovec *iov;
 	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
-	void *stripped;
+	uint8_t *batch;
+	size_t off, len;
 	int ret;
-	int fd = open(data_path, O_RDWR);
+	int fd;
 
+	iov = net_srv_init(vq);
+	batch = malloc(NET_BATCH_SZ);
+	assert(batch);
+	fd = open(data_path, O_RDWR);
 	if (fd == -1)
 		VIRTIO_DEV_ERRX(vq->vqdev, "Could not open data file for ether1.");
 
-	iov = malloc(vq->qnum_max * sizeof(struct iovec));
-	assert(iov != NULL);
-
-	if (!dev->poke_guest) {
-		free(iov);
-		VIRTIO_DEV_ERRX(vq->vqdev,
-		                "The 'poke_guest' function pointer was not set.");
-	}
-
 	for (;;) {
-		head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
+		net_wait_active(vq);
+		off = 0;
+		do {
+			head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
+			if (ilen) {
+				free(iov);
+				VIRTIO_DRI_ERRX(vq->vqdev,
+				                "The driver placed a device-writeable buffer in the network device's transmitq.\n"
+				                "  See virtio-v1.0-cs04 s5.3.6.1 Device Operation");
+			}
+			/* The virtio header and the frame are the record.
+			 * Guests keep their TSO frames under 64K, so we just
+			 * drop anything too big for one.
+			 */
+			if (iov_len(iov, olen) <= NET_MAX_REC) {
+				len = iov_to_buf(iov, olen, 0,
+				                 batch + off + NET_BATCH_HDR, NET_MAX_REC);
+				batch[off] = len >> 8;
+				batch[off + 1] = len & 0xff;
+				off += NET_BATCH_HDR + len;
+			}
+			/* We copied the frame, so the guest can have it back */
+			virtio_add_used_desc(vq, head, 0);
+		} while (net_vq_has_avail(vq) &&
+		         NET_BATCH_SZ - off >= NET_BATCH_HDR + NET_MAX_REC);
 
-		if (ilen) {
-			free(iov);
-			VIRTIO_DRI_ERRX(vq->vqdev,
-			                "The driver placed a device-writeable buffer in the network device's transmitq.\n"
-		                    "  See virtio-v1.0-cs04 s5.3.6.1 Device Operation");
+		if (virtio_vq_needs_irq(vq)) {
+			virtio_mmio_set_vring_irq(dev);
+			dev->poke_guest(dev->vec);
 		}
 
-		/* Strip off the virtio header (the first 12 bytes), as it is
-		 * not a part of the actual ethernet frame.
-		 */
-		for (int i = 0; i < olen; i++) {
-			stripped = iov[i].iov_base + VIRTIO_HEADER_SIZE;
-			ret = write(fd, stripped, iov[i].iov_len - VIRTIO_HEADER_SIZE);
-			assert(ret == iov[i].iov_len - VIRTIO_HEADER_SIZE);
-		}
-
-		virtio_add_used_desc(vq, head, 0);
-
-		virtio_mmio_set_vring_irq(dev);
-		dev->poke_guest(dev->vec);
+		ret = write(fd, batch, off);
+		assert(ret == off);
 	}
 }
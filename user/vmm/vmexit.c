@@ -8,7 +8,9 @@
 #include <vmm/virtio_config.h>
 #include <vmm/vmm.h>
 #include <parlib/arch/trap.h>
+#include <parlib/arch/arch.h>
 #include <parlib/bitmask.h>
+#include <ros/syscall.h>
 #include <stdio.h>
 
 static bool pir_notif_is_set(struct vmm_gpcore_init *gpci)
@@ -59,11 +61,34 @@ static void sleep_til_irq(struct guest_thread *gth)
 	 * the post; that's why we sync with the mutex to make sure there is an
 	 * ordering between the actual halt (this function) and the posting. */
 	uth_mutex_lock(gth->halt_mtx);
+	gth->halted = TRUE;
 	while (!(pir_notif_is_set(gpci) || rvi_is_set(gth)))
 		uth_cond_var_wait(gth->halt_cv, gth->halt_mtx);
+	gth->halted = FALSE;
 	uth_mutex_unlock(gth->halt_mtx);
 }
 
+/* Is gpa on a page we emulate below? */
+static bool gpa_is_emulated(struct virtual_machine *vm, uint64_t gpa)
+{
+	for (int i = 0; i < VIRTIO_MMIO_MAX_NUM_DEV; i++) {
+		if (vm->virtio_mmio_devices[i] &&
+		    PG_ADDR(gpa) == vm->virtio_mmio_devices[i]->addr)
+			return TRUE;
+	}
+	return PG_ADDR(gpa) == 0xfec00000 || PG_ADDR(gpa) == 0;
+}
+
+/* The kernel can't block in a vmexit to read in a page of a file we mapped as
+ * guest memory, like the guest image, so those EPT faults come to us.  We page
+ * it in here, since we can block, and the guest tries again. */
+static bool populate_guest_page(struct virtual_machine *vm, uint64_t gpa)
+{
+	if (gpa_is_emulated(vm, gpa))
+		return FALSE;
+	return ros_syscall(SYS_populate_va, PG_ADDR(gpa), 1, 0, 0, 0, 0) == 1;
+}
+
 static bool handle_ept_fault(struct guest_thread *gth)
 {
 	struct vm_trapframe *vm_tf = gth_to_vmtf(gth);
@@ -72,8 +97,11 @@ static bool handle_ept_fault(struct guest_thread *gth)
 	uint8_t regx;
 	int store, size;
 	int advance;
+	int ret;
 
-	int ret = decode(gth, &gpa, &regx, &regp, &store, &size, &advance);
+	if (populate_guest_page(vm, vm_tf->tf_guest_pa))
+		return TRUE;
+	ret = decode(gth, &gpa, &regx, &regp, &store, &size, &advance);
 
 	if (ret < 0)
 		return FALSE;
@@ -214,7 +242,7 @@ static bool handle_mwait(struct guest_thread *gth)
 /* Is this a vmm specific thing?  or generic?
  *
  * what do we do when we want to kill the vm?  what are our other options? */
-bool handle_vmexit(struct guest_thread *gth)
+static bool __handle_vmexit(struct guest_thread *gth)
 {
 	struct vm_trapframe *vm_tf = gth_to_vmtf(gth);
 
@@ -246,3 +274,42 @@ bool handle_vmexit(struct guest_thread *gth)
 		return FALSE;
 	}
 }
+
+/* Handles a reflected exit, charging the time we took to gth's exit_stats.
+ * For halts, that includes the time the guest slept. */
+bool handle_vmexit(struct guest_thread *gth)
+{
+	unsigned int reason = gth_to_vmtf(gth)->tf_exit_reason;
+	uint64_t start = read_tsc();
+	bool ret;
+
+	ret = __handle_vmexit(gth);
+	if (reason < VMM_EXIT_NR_REASONS)
+		vmm_exit_stat_add(&gth->exit_stats[reason], read_tsc() - start);
+	return ret;
+}
+
+/* Prints each guest thread's reflected exits, in the format of the kernel's
+ * #kprof/kpvmexit.  Reading the stats races with the guests; that's OK. */
+void vmm_print_exit_stats(FILE *f, struct virtual_machine *vm)
+{
+	struct vmm_exit_stat *st;
+
+	for (int i = 0; i < vm->nr_gpcs; i++) {
+		fprintf(f, "Guest pcore %d:\n%-20s %10s %8s  %s%d\n", i, "Reason",
+		        "Count", "AvgCyc", "Histogram, log2 cycles from ",
+		        VMM_EXIT_HIST_SHIFT + 1);
+		for (int j = 0; j < VMM_EXIT_NR_REASONS; j++) {
+			st = &vm->gths[i]->exit_stats[j];
+			if (!st->count)
+				continue;
+			fprintf(f, "%-20s %10llu %8llu ",
+			        VMX_EXIT_REASON_NAMES[j] ?: "?", st->count,
+			        st->cycles / st->count);
+			for (int k = 0; k < VMM_EXIT_HIST_NR_BUCKETS; k++)
+				fprintf(f, " %llu", st->hist[k]);
+			fprintf(f, "\n");
+		}
+		decode_print_stats(f, vm->gths[i]);
+	}
+}
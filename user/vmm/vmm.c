@@ -37,14 +37,22 @@ int vmm_interrupt_guest(struct virtual_machine *vm, unsigned int gpcoreid,
 	uth_mutex_lock(gth->halt_mtx);
 	SET_BITMASK_BIT_ATOMIC(gpci->posted_irq_desc, vector);
 	/* Atomic op provides the mb() btw writing the vector and mucking with
-	 * OUTSTANDING_NOTIF.  If the notif was already set, then a previous thread
-	 * poked the guest and signaled the CV. */
+	 * OUTSTANDING_NOTIF.  If the notif was already set, then a previous poster
+	 * poked the guest.  We still signal: the kernel's vhost_net posts IRQs too,
+	 * and it can't signal the CV, so it asks us to.
+	 *
+	 * The poke is only for a guest that is running: its core gets the posted
+	 * IRQ notification vector and delivers the IRQ without a vmexit.  A halted
+	 * guest isn't in VMX non-root anywhere, so the poke would be a wasted
+	 * syscall.  It'll see the NOTIF when it wakes up, and the kernel self-pokes
+	 * when it resumes the guest with NOTIF set. */
 	if (!GET_BITMASK_BIT(gpci->posted_irq_desc, VMX_POSTED_OUTSTANDING_NOTIF)) {
 		SET_BITMASK_BIT_ATOMIC(gpci->posted_irq_desc,
 		                       VMX_POSTED_OUTSTANDING_NOTIF);
-		ros_syscall(SYS_vmm_poke_guest, gpcoreid, 0, 0, 0, 0, 0);
-		uth_cond_var_signal(gth->halt_cv);
+		if (!gth->halted)
+			ros_syscall(SYS_vmm_poke_guest, gpcoreid, 0, 0, 0, 0, 0);
 	}
+	uth_cond_var_signal(gth->halt_cv);
 	uth_mutex_unlock(gth->halt_mtx);
 	return 0;
 }